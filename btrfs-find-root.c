@@ -22,6 +22,9 @@
 #include <getopt.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/ctree.h"
@@ -36,6 +39,12 @@
 #include "common/string-utils.h"
 #include "cmds/commands.h"
 
+/* Part of a block group searched at once by a thread */
+#define FIND_ROOT_SHARD_SIZE		(SZ_64M)
+/* Size of one read of the search */
+#define FIND_ROOT_READ_SIZE		(SZ_4M)
+#define FIND_ROOT_MAX_THREADS		(64)
+
 /*
  * Find-root will restore the search result in a 2-level trees.
  * Search result is a cache_tree consisted of generation_cache.
@@ -79,7 +88,8 @@ struct btrfs_find_root_filter {
 int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
 			   struct btrfs_find_root_filter *filter,
 			   struct cache_tree *result,
-			   struct cache_extent **match);
+			   struct cache_extent **match,
+			   int nr_threads);
 
 static void btrfs_find_root_free(struct cache_tree *result)
 {
@@ -98,24 +108,16 @@ static void btrfs_find_root_free(struct cache_tree *result)
 }
 
 /* Return value is the same as btrfs_find_root_search(). */
-static int add_eb_to_result(struct extent_buffer *eb,
-			    struct cache_tree *result,
-			    u32 nodesize,
-			    struct btrfs_find_root_filter *filter,
-			    struct cache_extent **match)
+static int add_block_to_result(u64 start, u64 generation, u8 level,
+			       struct cache_tree *result,
+			       u32 nodesize,
+			       struct btrfs_find_root_filter *filter,
+			       struct cache_extent **match)
 {
-	u64 generation = btrfs_header_generation(eb);
-	u64 level = btrfs_header_level(eb);
-	u64 owner = btrfs_header_owner(eb);
-	u64 start = eb->start;
 	struct cache_extent *cache;
 	struct btrfs_find_root_gen_cache *gen_cache = NULL;
 	int ret = 0;
 
-	if (owner != filter->objectid || level < filter->level ||
-	    generation < filter->generation)
-		return ret;
-
 	/*
 	 * Get the generation cache or create one
 	 *
@@ -166,27 +168,291 @@ static int add_eb_to_result(struct extent_buffer *eb,
 	return ret;
 }
 
+/* A tree block passing the filter, found by a search thread */
+struct btrfs_find_root_hit {
+	u64 start;
+	u64 generation;
+	u8 level;
+};
+
+/* Part of a metadata block group searched by one thread */
+struct btrfs_find_root_shard {
+	u64 start;
+	u64 len;
+	int num_copies;
+	/* Hits in ascending order, up to the first match of the filter */
+	struct btrfs_find_root_hit *hits;
+	int nr_hits;
+	int alloc_hits;
+};
+
+struct btrfs_find_root_ctx {
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_find_root_filter *filter;
+	struct btrfs_find_root_shard *shards;
+	int nr_shards;
+	pthread_mutex_t lock;
+	/* Next shard to search, and the first one with a match */
+	int next_shard;
+	int match_shard;
+	int ret;
+};
+
+/* State of one node of the read window of a search thread */
+enum {
+	FIND_ROOT_BLOCK_PENDING,	/* no valid copy read yet */
+	FIND_ROOT_BLOCK_SKIP,		/* valid or filtered out */
+	FIND_ROOT_BLOCK_HIT,
+};
+
+struct btrfs_find_root_slot {
+	u8 state;
+	u8 level;
+	u64 generation;
+};
+
+static bool find_root_fsid_match(struct btrfs_fs_info *fs_info, const u8 *fsid)
+{
+	struct btrfs_fs_devices *fs_devices = fs_info->fs_devices;
+
+	if (fs_info->ignore_fsid_mismatch)
+		return true;
+	/* The same as check_tree_block() */
+	while (fs_devices) {
+		const u8 *expected = fs_devices->fsid;
+
+		if (fs_devices == fs_info->fs_devices &&
+		    btrfs_fs_incompat(fs_info, METADATA_UUID))
+			expected = fs_devices->metadata_uuid;
+		if (!memcmp(fsid, expected, BTRFS_FSID_SIZE))
+			return true;
+		fs_devices = fs_devices->seed;
+	}
+	return false;
+}
+
 /*
- * Return 0 if iterating all the metadata extents.
- * Return 1 if found root with given gen/level and set *match to it.
- * Return <0 if error happens
+ * Check a node read at @bytenr.  The header is checked first, including the
+ * filter on owner, level and generation, only the blocks passing it are
+ * checksummed and verified by the tree-checker.
  */
-int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
-			   struct btrfs_find_root_filter *filter,
-			   struct cache_tree *result,
-			   struct cache_extent **match)
+static void find_root_check_block(struct btrfs_find_root_ctx *ctx,
+				  struct extent_buffer *eb, const char *data,
+				  u64 bytenr, struct btrfs_find_root_slot *slot)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	struct btrfs_find_root_filter *filter = ctx->filter;
+	struct btrfs_header *header = (struct btrfs_header *)data;
+	u64 generation = btrfs_stack_header_generation(header);
+	enum btrfs_tree_block_status status;
+	u8 level = header->level;
+
+	if (btrfs_stack_header_bytenr(header) != bytenr ||
+	    !find_root_fsid_match(fs_info, header->fsid) ||
+	    level >= BTRFS_MAX_LEVEL)
+		return;
+
+	if (btrfs_stack_header_owner(header) != filter->objectid ||
+	    level < filter->level || generation < filter->generation) {
+		slot->state = FIND_ROOT_BLOCK_SKIP;
+		return;
+	}
+
+	eb->start = bytenr;
+	memcpy(eb->data, data, fs_info->nodesize);
+	if (verify_tree_block_csum_silent(eb, fs_info->csum_size,
+					  fs_info->csum_type))
+		return;
+	if (btrfs_header_nritems(eb) == 0 && level != 0)
+		return;
+
+	/* The tree-checker prints the corrupted blocks */
+	pthread_mutex_lock(&ctx->lock);
+	if (level)
+		status = __btrfs_check_node(eb);
+	else
+		status = __btrfs_check_leaf(eb);
+	pthread_mutex_unlock(&ctx->lock);
+	if (status != BTRFS_TREE_BLOCK_CLEAN)
+		return;
+
+	slot->state = FIND_ROOT_BLOCK_HIT;
+	slot->level = level;
+	slot->generation = generation;
+}
+
+static int find_root_add_hit(struct btrfs_find_root_shard *shard, u64 start,
+			     const struct btrfs_find_root_slot *slot)
+{
+	struct btrfs_find_root_hit *hit;
+
+	if (shard->nr_hits == shard->alloc_hits) {
+		int alloc = max(16, shard->alloc_hits * 2);
+
+		hit = realloc(shard->hits, alloc * sizeof(*hit));
+		if (!hit)
+			return -ENOMEM;
+		shard->hits = hit;
+		shard->alloc_hits = alloc;
+	}
+	hit = &shard->hits[shard->nr_hits++];
+	hit->start = start;
+	hit->generation = slot->generation;
+	hit->level = slot->level;
+	return 0;
+}
+
+/*
+ * Search a shard with reads of FIND_ROOT_READ_SIZE.  Like read_tree_block(),
+ * a node is read from the next mirror only if no valid copy was found yet.
+ *
+ * Return 1 if a block matching the filter was found, the hits stop there.
+ */
+static int find_root_search_shard(struct btrfs_find_root_ctx *ctx,
+				  struct btrfs_find_root_shard *shard,
+				  struct extent_buffer *eb, char *buf,
+				  struct btrfs_find_root_slot *slots)
 {
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	struct btrfs_find_root_filter *filter = ctx->filter;
+	const u32 nodesize = fs_info->nodesize;
+	const u64 end = shard->start + shard->len;
+	u64 pos;
+	int ret;
+
+	for (pos = shard->start; pos < end; pos += FIND_ROOT_READ_SIZE) {
+		const u64 len = min_t(u64, FIND_ROOT_READ_SIZE, end - pos);
+		const int nr = len / nodesize;
+		int nr_pending = nr;
+		int mirror;
+		int i;
+
+		memset(slots, 0, nr * sizeof(*slots));
+		for (mirror = 1; mirror <= shard->num_copies && nr_pending;
+		     mirror++) {
+			u64 done = 0;
+			bool window = true;
+
+			while (done < len) {
+				u64 cur = len - done;
+
+				ret = read_data_from_disk(fs_info, buf + done,
+							  pos + done, &cur,
+							  mirror);
+				if (ret < 0) {
+					window = false;
+					break;
+				}
+				done += cur;
+			}
+
+			for (i = 0; i < nr; i++) {
+				u64 bytenr = pos + (u64)i * nodesize;
+				char *data = buf + (u64)i * nodesize;
+
+				if (slots[i].state != FIND_ROOT_BLOCK_PENDING)
+					continue;
+				/* Fall back to the nodes of a failed read */
+				if (!window) {
+					u64 cur = nodesize;
+
+					ret = read_data_from_disk(fs_info, data,
+							bytenr, &cur, mirror);
+					if (ret < 0 || cur < nodesize)
+						continue;
+				}
+				find_root_check_block(ctx, eb, data, bytenr,
+						      &slots[i]);
+				if (slots[i].state != FIND_ROOT_BLOCK_PENDING)
+					nr_pending--;
+			}
+		}
+
+		for (i = 0; i < nr; i++) {
+			if (slots[i].state != FIND_ROOT_BLOCK_HIT)
+				continue;
+			ret = find_root_add_hit(shard, pos + (u64)i * nodesize,
+						&slots[i]);
+			if (ret < 0)
+				return ret;
+			if (slots[i].generation == filter->match_gen &&
+			    slots[i].level == filter->match_level &&
+			    !filter->search_all)
+				return 1;
+		}
+	}
+	return 0;
+}
+
+static void *find_root_search_thread(void *arg)
+{
+	struct btrfs_find_root_ctx *ctx = arg;
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	struct btrfs_find_root_slot *slots;
 	struct extent_buffer *eb;
+	char *buf;
+	int ret = 0;
+
+	eb = alloc_dummy_extent_buffer(fs_info, 0, fs_info->nodesize);
+	buf = malloc(FIND_ROOT_READ_SIZE);
+	slots = calloc(FIND_ROOT_READ_SIZE / fs_info->nodesize,
+		       sizeof(*slots));
+	if (!eb || !buf || !slots) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (1) {
+		int index;
+
+		pthread_mutex_lock(&ctx->lock);
+		index = ctx->next_shard++;
+		/* Shards after a match are not needed */
+		if (ctx->ret || index >= ctx->nr_shards ||
+		    index > ctx->match_shard) {
+			pthread_mutex_unlock(&ctx->lock);
+			break;
+		}
+		pthread_mutex_unlock(&ctx->lock);
+
+		ret = find_root_search_shard(ctx, &ctx->shards[index], eb, buf,
+					     slots);
+		if (ret < 0)
+			break;
+		if (ret > 0) {
+			pthread_mutex_lock(&ctx->lock);
+			ctx->match_shard = min(ctx->match_shard, index);
+			pthread_mutex_unlock(&ctx->lock);
+			ret = 0;
+		}
+	}
+out:
+	if (ret < 0) {
+		pthread_mutex_lock(&ctx->lock);
+		if (!ctx->ret)
+			ctx->ret = ret;
+		pthread_mutex_unlock(&ctx->lock);
+	}
+	free(slots);
+	free(buf);
+	free(eb);
+	return NULL;
+}
+
+/* Split the metadata (or system) block groups to shards */
+static int find_root_prepare_shards(struct btrfs_fs_info *fs_info,
+				    struct btrfs_find_root_filter *filter,
+				    struct btrfs_find_root_ctx *ctx)
+{
 	u64 chunk_offset = 0;
 	u64 chunk_size = 0;
-	u64 offset = 0;
-	u32 nodesize = btrfs_super_nodesize(fs_info->super_copy);
-	int suppress_errors = 0;
-	int ret = 0;
+	int alloc = 0;
+	int ret;
 
-	suppress_errors = fs_info->suppress_check_block_errors;
-	fs_info->suppress_check_block_errors = 1;
 	while (1) {
+		u64 offset;
+		int num_copies;
+
 		if (filter->objectid != BTRFS_CHUNK_TREE_OBJECTID)
 			ret = btrfs_next_bg_metadata(fs_info,
 						  &chunk_offset,
@@ -200,23 +466,110 @@ int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
 				ret = 0;
 			break;
 		}
+		num_copies = btrfs_num_copies(fs_info, chunk_offset, chunk_size);
 		for (offset = chunk_offset;
 		     offset < chunk_offset + chunk_size;
-		     offset += nodesize) {
-			struct btrfs_tree_parent_check check = { 0 };
+		     offset += FIND_ROOT_SHARD_SIZE) {
+			struct btrfs_find_root_shard *shard;
 
-			eb = read_tree_block(fs_info, offset, &check);
-			if (!eb || IS_ERR(eb))
-				continue;
-			ret = add_eb_to_result(eb, result, nodesize, filter,
-					       match);
-			free_extent_buffer(eb);
+			if (ctx->nr_shards == alloc) {
+				alloc = max(64, alloc * 2);
+				shard = realloc(ctx->shards,
+						alloc * sizeof(*shard));
+				if (!shard)
+					return -ENOMEM;
+				ctx->shards = shard;
+			}
+			shard = &ctx->shards[ctx->nr_shards++];
+			memset(shard, 0, sizeof(*shard));
+			shard->start = offset;
+			shard->len = min_t(u64, FIND_ROOT_SHARD_SIZE,
+					   chunk_offset + chunk_size - offset);
+			shard->num_copies = num_copies;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Return 0 if iterating all the metadata extents.
+ * Return 1 if found root with given gen/level and set *match to it.
+ * Return <0 if error happens
+ *
+ * The block groups are split to shards of FIND_ROOT_SHARD_SIZE searched by
+ * @nr_threads threads, the hits are added to @result in the logical order at
+ * the end, so the result is the same as a sequential search.
+ */
+int btrfs_find_root_search(struct btrfs_fs_info *fs_info,
+			   struct btrfs_find_root_filter *filter,
+			   struct cache_tree *result,
+			   struct cache_extent **match,
+			   int nr_threads)
+{
+	struct btrfs_find_root_ctx ctx = {
+		.fs_info = fs_info,
+		.filter = filter,
+		.match_shard = INT_MAX,
+	};
+	pthread_t *threads;
+	u32 nodesize = btrfs_super_nodesize(fs_info->super_copy);
+	int started = 0;
+	int ret;
+	int i;
+	int j;
+
+	ret = find_root_prepare_shards(fs_info, filter, &ctx);
+	if (ret < 0)
+		goto out;
+	if (!ctx.nr_shards)
+		return 0;
+
+	nr_threads = min(nr_threads, ctx.nr_shards);
+	nr_threads = max(nr_threads, 1);
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	pthread_mutex_init(&ctx.lock, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&threads[i], NULL, find_root_search_thread,
+				     &ctx);
+		if (ret) {
+			ret = -ret;
+			break;
+		}
+		started++;
+	}
+	/* Run the search with the threads started, at least one */
+	if (started)
+		ret = 0;
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&ctx.lock);
+	free(threads);
+	if (ret < 0 || ctx.ret < 0) {
+		ret = (ret < 0 ? ret : ctx.ret);
+		goto out;
+	}
+
+	for (i = 0; i < ctx.nr_shards && i <= ctx.match_shard; i++) {
+		struct btrfs_find_root_shard *shard = &ctx.shards[i];
+
+		for (j = 0; j < shard->nr_hits; j++) {
+			struct btrfs_find_root_hit *hit = &shard->hits[j];
+
+			ret = add_block_to_result(hit->start, hit->generation,
+						  hit->level, result, nodesize,
+						  filter, match);
 			if (ret)
 				goto out;
 		}
 	}
 out:
-	fs_info->suppress_check_block_errors = suppress_errors;
+	for (i = 0; i < ctx.nr_shards; i++)
+		free(ctx.shards[i].hits);
+	free(ctx.shards);
 	return ret;
 }
 
@@ -328,6 +681,8 @@ static const char * const btrfs_find_root_usage[] = {
 	OPTLINE("-o OBJECTID", "filter by the tree's object id"),
 	OPTLINE("-l LEVEL", "filter by tree level, (default: 0)"),
 	OPTLINE("-g GENERATION", "filter by tree generation"),
+	OPTLINE("--threads <num>", "number of threads searching the metadata, "
+		"default is the number of CPUs"),
 	NULL
 };
 
@@ -342,6 +697,7 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 	struct cache_tree result;
 	struct cache_extent *found;
 	struct open_ctree_args oca = { 0 };
+	int nr_threads = 0;
 	int ret;
 
 	/* Default to search root tree */
@@ -350,8 +706,10 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 	filter.match_level = (u8)-1;
 	opterr = 0;
 	while (1) {
+		enum { GETOPT_VAL_THREADS = GETOPT_VAL_FIRST };
 		static const struct option long_options[] = {
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP},
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "al:o:g:", long_options, NULL);
@@ -372,6 +730,18 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 		case 'l':
 			filter.level = arg_strtou64(optarg);
 			break;
+		case GETOPT_VAL_THREADS:
+		{
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp < 1 || tmp > FIND_ROOT_MAX_THREADS) {
+				error("number of threads out of range: %llu, must be 1 to %u",
+				      tmp, FIND_ROOT_MAX_THREADS);
+				return 1;
+			}
+			nr_threads = tmp;
+			break;
+		}
 		case GETOPT_VAL_HELP:
 			usage(&btrfs_find_root_cmd, 0);
 			return 0;
@@ -384,6 +754,14 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (!nr_threads) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (nr_cpus < 1)
+			nr_cpus = 1;
+		nr_threads = min_t(long, nr_cpus, FIND_ROOT_MAX_THREADS);
+	}
+
 	oca.filename = argv[optind];
 	oca.flags = OPEN_CTREE_CHUNK_ROOT_ONLY | OPEN_CTREE_IGNORE_CHUNK_TREE_ERROR;
 	fs_info = open_ctree_fs_info(&oca);
@@ -395,7 +773,8 @@ int BOX_MAIN(find_root)(int argc, char **argv)
 
 	get_root_gen_and_level(filter.objectid, fs_info,
 			       &filter.match_gen, &filter.match_level);
-	ret = btrfs_find_root_search(fs_info, &filter, &result, &found);
+	ret = btrfs_find_root_search(fs_info, &filter, &result, &found,
+				     nr_threads);
 	if (ret < 0) {
 		errno = -ret;
 		error("fail to search the tree root: %m");
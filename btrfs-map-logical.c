@@ -24,6 +24,8 @@
 #include <getopt.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
@@ -37,6 +39,8 @@
 #include "common/extent-cache.h"
 #include "common/extent-tree-utils.h"
 #include "common/string-utils.h"
+#include "common/parse-utils.h"
+#include "common/device-utils.h"
 #include "cmds/commands.h"
 
 #define BUFFER_SIZE SZ_64K
@@ -207,6 +211,624 @@ static int write_extent_content(struct btrfs_fs_info *fs_info, int out_fd,
 	return ret;
 }
 
+/*
+ * Batch mode, read the ranges listed in a file.
+ *
+ * The requests are sorted by the device and physical offset of their first
+ * stripe and read in windows of BATCH_WINDOW bytes.  The stripes of all the
+ * requests in a window are sorted again and the stripes close to each other
+ * on one device are read by one pread of up to BATCH_READ bytes, so the
+ * devices are read mostly sequentially whatever the order of the list.
+ */
+#define BATCH_WINDOW		SZ_32M
+#define BATCH_READ		SZ_4M
+/* Stripes of one device are read together if the hole is not larger */
+#define BATCH_GAP		SZ_64K
+#define TAR_BLOCK		512
+
+struct batch_request {
+	u64 logical;
+	u64 len;
+	int mirror;
+	/* Line in the list, for the messages */
+	unsigned int line;
+	/* Sort key, the first stripe of the range */
+	u64 devid;
+	u64 physical;
+};
+
+/* Part of a request read in the current window */
+struct batch_chunk {
+	struct batch_request *req;
+	u64 offset;
+	u64 len;
+	char *buf;
+};
+
+/* Stripe of a chunk, no device means it's rebuilt from the RAID56 parity */
+struct batch_stripe {
+	struct btrfs_device *dev;
+	u64 physical;
+	u64 logical;
+	u64 len;
+	int mirror;
+	char *buf;
+};
+
+struct batch_ctx {
+	struct btrfs_fs_info *fs_info;
+	struct batch_request *reqs;
+	unsigned int nr_reqs;
+	/* Directory of the files, or -1 for a tar stream on stdout */
+	int dir_fd;
+	/* File of the request being written to @dir_fd */
+	int out_fd;
+	char *window;
+	char *bounce;
+	struct batch_chunk *chunks;
+	unsigned int nr_chunks;
+	struct batch_stripe *stripes;
+	unsigned int nr_stripes;
+	unsigned int max_stripes;
+	/* Ranges that could not be mapped or read */
+	u64 errors;
+};
+
+/* The ustar header, padded to TAR_BLOCK */
+struct tar_header {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char pad[12];
+};
+static_assert(sizeof(struct tar_header) == TAR_BLOCK);
+
+/*
+ * Parse the list of requests, one per line as "LOGICAL LENGTH [COPY]", the
+ * empty lines and anything after '#' are ignored.
+ */
+static int batch_parse(const char *file, int mirror,
+		       struct batch_request **reqs_ret, unsigned int *nr_ret)
+{
+	struct batch_request *reqs = NULL;
+	unsigned int nr = 0;
+	unsigned int alloced = 0;
+	unsigned int lineno = 0;
+	char *line = NULL;
+	size_t size = 0;
+	FILE *fp;
+	int ret = 0;
+
+	if (strcmp(file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen(file, "r");
+		if (!fp) {
+			ret = -errno;
+			error("cannot open %s: %m", file);
+			return ret;
+		}
+	}
+	while (getline(&line, &size, fp) >= 0) {
+		struct batch_request *req;
+		char *saveptr = NULL;
+		char *tokens[4];
+		int nr_tokens = 0;
+		u64 copy = mirror;
+		char *tmp;
+
+		lineno++;
+		tmp = strchr(line, '#');
+		if (tmp)
+			*tmp = 0;
+		for (tmp = strtok_r(line, " \t\n", &saveptr); tmp && nr_tokens < 4;
+		     tmp = strtok_r(NULL, " \t\n", &saveptr))
+			tokens[nr_tokens++] = tmp;
+		if (nr_tokens == 0)
+			continue;
+
+		if (nr == alloced) {
+			alloced = max(alloced * 2, 64U);
+			req = realloc(reqs, alloced * sizeof(*reqs));
+			if (!req) {
+				ret = -ENOMEM;
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				goto out;
+			}
+			reqs = req;
+		}
+		req = &reqs[nr];
+		if (nr_tokens < 2 || nr_tokens > 3 ||
+		    parse_u64(tokens[0], &req->logical) ||
+		    parse_u64_with_suffix(tokens[1], &req->len) ||
+		    req->len == 0 ||
+		    (nr_tokens == 3 && (parse_u64(tokens[2], &copy) ||
+					copy > INT_MAX))) {
+			ret = -EINVAL;
+			error("invalid request at %s:%u, expected LOGICAL LENGTH [COPY]",
+			      file, lineno);
+			goto out;
+		}
+		req->mirror = copy;
+		req->line = lineno;
+		nr++;
+	}
+	if (ferror(fp)) {
+		ret = -EIO;
+		error("failed to read %s", file);
+	}
+out:
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	if (ret < 0) {
+		free(reqs);
+		return ret;
+	}
+	*reqs_ret = reqs;
+	*nr_ret = nr;
+	return 0;
+}
+
+static int batch_map_stripe(struct btrfs_fs_info *fs_info, u64 logical,
+			    u64 *len, u64 *type, int mirror,
+			    struct btrfs_bio_stripe *stripe)
+{
+	/* The mapping does not check the copy */
+	if (mirror > btrfs_num_copies(fs_info, logical, *len))
+		return -EINVAL;
+	return btrfs_map_block_stripe(fs_info, logical, len, type, mirror,
+				      stripe);
+}
+
+/* Look up the sort keys and drop the requests that can't be mapped */
+static void batch_map_requests(struct batch_ctx *ctx)
+{
+	unsigned int nr = 0;
+
+	for (unsigned int i = 0; i < ctx->nr_reqs; i++) {
+		struct batch_request *req = &ctx->reqs[i];
+		struct btrfs_bio_stripe stripe;
+		u64 len = req->len;
+		u64 type;
+		int ret;
+
+		ret = batch_map_stripe(ctx->fs_info, req->logical, &len, &type,
+				       req->mirror, &stripe);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to map logical %llu copy %d at line %u: %m",
+			      req->logical, req->mirror, req->line);
+			ctx->errors++;
+			continue;
+		}
+		req->devid = stripe.dev->devid;
+		req->physical = stripe.physical;
+		ctx->reqs[nr++] = *req;
+	}
+	ctx->nr_reqs = nr;
+}
+
+static int cmp_batch_request(const void *a, const void *b)
+{
+	const struct batch_request *ra = a;
+	const struct batch_request *rb = b;
+
+	if (ra->devid != rb->devid)
+		return ra->devid < rb->devid ? -1 : 1;
+	if (ra->physical != rb->physical)
+		return ra->physical < rb->physical ? -1 : 1;
+	/* Keep the order of the list otherwise */
+	return ra->line < rb->line ? -1 : ra->line > rb->line;
+}
+
+static u64 batch_stripe_devid(const struct batch_stripe *stripe)
+{
+	return stripe->dev ? stripe->dev->devid : 0;
+}
+
+static int cmp_batch_stripe(const void *a, const void *b)
+{
+	const struct batch_stripe *sa = a;
+	const struct batch_stripe *sb = b;
+	const u64 devid_a = batch_stripe_devid(sa);
+	const u64 devid_b = batch_stripe_devid(sb);
+
+	if (devid_a != devid_b)
+		return devid_a < devid_b ? -1 : 1;
+	if (sa->physical != sb->physical)
+		return sa->physical < sb->physical ? -1 : 1;
+	return sa->logical < sb->logical ? -1 : sa->logical > sb->logical;
+}
+
+/* Take the next BATCH_WINDOW bytes of the sorted requests */
+static void batch_fill_window(struct batch_ctx *ctx, unsigned int *index,
+			      u64 *offset)
+{
+	u64 used = 0;
+
+	ctx->nr_chunks = 0;
+	while (*index < ctx->nr_reqs && used < BATCH_WINDOW) {
+		struct batch_request *req = &ctx->reqs[*index];
+		struct batch_chunk *chunk = &ctx->chunks[ctx->nr_chunks++];
+
+		chunk->req = req;
+		chunk->offset = *offset;
+		chunk->len = min(req->len - *offset, BATCH_WINDOW - used);
+		chunk->buf = ctx->window + used;
+		used += chunk->len;
+		*offset += chunk->len;
+		if (*offset == req->len) {
+			(*index)++;
+			*offset = 0;
+		}
+	}
+}
+
+/* Split a chunk to the stripes of the requested copy */
+static int batch_add_stripes(struct batch_ctx *ctx, struct batch_chunk *chunk)
+{
+	const int mirror = chunk->req->mirror;
+	u64 cur = 0;
+
+	while (cur < chunk->len) {
+		const u64 logical = chunk->req->logical + chunk->offset + cur;
+		struct btrfs_bio_stripe map;
+		struct batch_stripe *stripe;
+		u64 len = chunk->len - cur;
+		u64 type;
+		int ret;
+
+		ret = batch_map_stripe(ctx->fs_info, logical, &len, &type,
+				       mirror, &map);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to map logical %llu copy %d at line %u: %m",
+			      logical, mirror, chunk->req->line);
+			memset(chunk->buf + cur, 0, chunk->len - cur);
+			ctx->errors++;
+			return 0;
+		}
+		len = min(len, chunk->len - cur);
+
+		if (ctx->nr_stripes == ctx->max_stripes) {
+			unsigned int max = max(ctx->max_stripes * 2, 256U);
+
+			stripe = realloc(ctx->stripes, max * sizeof(*stripe));
+			if (!stripe) {
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				return -ENOMEM;
+			}
+			ctx->stripes = stripe;
+			ctx->max_stripes = max;
+		}
+		stripe = &ctx->stripes[ctx->nr_stripes++];
+		if (mirror > 1 && type & BTRFS_BLOCK_GROUP_RAID56_MASK)
+			stripe->dev = NULL;
+		else
+			stripe->dev = map.dev;
+		stripe->physical = map.physical;
+		stripe->logical = logical;
+		stripe->len = len;
+		stripe->mirror = mirror;
+		stripe->buf = chunk->buf + cur;
+		cur += len;
+	}
+	return 0;
+}
+
+static int batch_pread(struct btrfs_fs_info *fs_info,
+		       struct btrfs_device *device, void *buf, u64 len,
+		       u64 physical)
+{
+	ssize_t ret;
+	u64 start;
+
+	if (device->fd <= 0)
+		return -EIO;
+	start = btrfs_device_read_start(device);
+	ret = btrfs_pread(device->fd, buf, len, physical, fs_info->zoned);
+	btrfs_device_read_end(device, start);
+	if (ret > 0)
+		btrfs_device_account_read(device, ret);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+	return 0;
+}
+
+/* Read one stripe to its buffer, or zero it if that fails */
+static void batch_read_stripe(struct batch_ctx *ctx,
+			      struct batch_stripe *stripe)
+{
+	u64 cur = 0;
+	int ret = 0;
+
+	if (stripe->dev) {
+		ret = batch_pread(ctx->fs_info, stripe->dev, stripe->buf,
+				  stripe->len, stripe->physical);
+	} else {
+		while (cur < stripe->len) {
+			u64 len = stripe->len - cur;
+
+			ret = read_data_from_disk(ctx->fs_info, stripe->buf + cur,
+						  stripe->logical + cur, &len,
+						  stripe->mirror);
+			if (ret < 0)
+				break;
+			cur += len;
+		}
+	}
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to read logical %llu length %llu copy %d: %m",
+		      stripe->logical, stripe->len, stripe->mirror);
+		memset(stripe->buf, 0, stripe->len);
+		ctx->errors++;
+	}
+}
+
+static void batch_read_window(struct batch_ctx *ctx)
+{
+	unsigned int next;
+
+	qsort(ctx->stripes, ctx->nr_stripes, sizeof(struct batch_stripe),
+	      cmp_batch_stripe);
+	for (unsigned int i = 0; i < ctx->nr_stripes; i = next) {
+		struct batch_stripe *first = &ctx->stripes[i];
+		const u64 start = first->physical;
+		u64 end = start + first->len;
+		int ret;
+
+		for (next = i + 1; first->dev && next < ctx->nr_stripes; next++) {
+			struct batch_stripe *stripe = &ctx->stripes[next];
+			const u64 stripe_end = stripe->physical + stripe->len;
+
+			if (stripe->dev != first->dev ||
+			    stripe->physical > end + BATCH_GAP ||
+			    max(end, stripe_end) - start > BATCH_READ)
+				break;
+			end = max(end, stripe_end);
+		}
+		if (next == i + 1) {
+			batch_read_stripe(ctx, first);
+			continue;
+		}
+
+		ret = batch_pread(ctx->fs_info, first->dev, ctx->bounce,
+				  end - start, start);
+		for (unsigned int k = i; k < next; k++) {
+			struct batch_stripe *stripe = &ctx->stripes[k];
+
+			/* Find out which of the stripes can't be read */
+			if (ret < 0)
+				batch_read_stripe(ctx, stripe);
+			else
+				memcpy(stripe->buf,
+				       ctx->bounce + stripe->physical - start,
+				       stripe->len);
+		}
+	}
+	ctx->nr_stripes = 0;
+}
+
+static int batch_write(int fd, const void *buf, u64 len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			error("output write failed: %m");
+			return ret;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int batch_tar_header(const char *name, u64 size)
+{
+	struct tar_header header = { 0 };
+	const unsigned char *bytes = (const unsigned char *)&header;
+	unsigned int sum = 0;
+
+	strncpy_null(header.name, name, sizeof(header.name));
+	strcpy(header.mode, "0000600");
+	strcpy(header.uid, "0000000");
+	strcpy(header.gid, "0000000");
+	/* Sizes not fitting 11 octal digits are stored in base-256 as GNU tar does */
+	if (size < (1ULL << 33)) {
+		snprintf(header.size, sizeof(header.size), "%011llo", size);
+	} else {
+		header.size[0] = 0x80;
+		for (int i = sizeof(header.size) - 1; i > 0 && size; i--) {
+			header.size[i] = size & 0xff;
+			size >>= 8;
+		}
+	}
+	strcpy(header.mtime, "00000000000");
+	header.typeflag = '0';
+	memcpy(header.magic, "ustar", sizeof(header.magic));
+	memcpy(header.version, "00", sizeof(header.version));
+
+	memset(header.chksum, ' ', sizeof(header.chksum));
+	for (int i = 0; i < sizeof(header); i++)
+		sum += bytes[i];
+	snprintf(header.chksum, sizeof(header.chksum), "%06o", sum);
+	header.chksum[7] = ' ';
+
+	return batch_write(STDOUT_FILENO, &header, sizeof(header));
+}
+
+/*
+ * Write a chunk to the output, the chunks of a request come in order so the
+ * first one starts the tar member or file and the last one ends it.
+ */
+static int batch_output_chunk(struct batch_ctx *ctx, struct batch_chunk *chunk)
+{
+	static const char zeros[TAR_BLOCK];
+	const struct batch_request *req = chunk->req;
+	char name[64];
+	int fd = STDOUT_FILENO;
+	int ret;
+
+	snprintf(name, sizeof(name), "%llu-%llu-%d", req->logical, req->len,
+		 req->mirror);
+	if (chunk->offset == 0) {
+		if (ctx->dir_fd < 0) {
+			ret = batch_tar_header(name, req->len);
+			if (ret < 0)
+				return ret;
+		} else {
+			ctx->out_fd = openat(ctx->dir_fd, name,
+					     O_WRONLY | O_CREAT | O_TRUNC, 0600);
+			if (ctx->out_fd < 0) {
+				ret = -errno;
+				error("cannot create %s: %m", name);
+				return ret;
+			}
+		}
+	}
+	if (ctx->dir_fd >= 0)
+		fd = ctx->out_fd;
+
+	ret = batch_write(fd, chunk->buf, chunk->len);
+	if (ret < 0)
+		return ret;
+	if (chunk->offset + chunk->len < req->len)
+		return 0;
+
+	if (ctx->dir_fd < 0)
+		return batch_write(fd, zeros, -req->len & (TAR_BLOCK - 1));
+	ret = close(ctx->out_fd);
+	ctx->out_fd = -1;
+	if (ret < 0) {
+		ret = -errno;
+		error("cannot write %s: %m", name);
+	}
+	return ret;
+}
+
+/*
+ * Read the ranges listed in @file to a tar stream on stdout if @output is
+ * "-", or to a file per range in the directory @output, named
+ * LOGICAL-LENGTH-COPY.  Without @output only print the mapping.
+ *
+ * Ranges that can't be mapped are skipped and the parts that can't be read
+ * are zeroed, the return value is 1 if there were any.
+ */
+static int map_logical_batch(struct btrfs_fs_info *fs_info, const char *file,
+			     const char *output, int mirror)
+{
+	struct batch_ctx ctx = {
+		.fs_info = fs_info,
+		.dir_fd = -1,
+		.out_fd = -1,
+	};
+	unsigned int index = 0;
+	u64 offset = 0;
+	int ret;
+
+	ret = batch_parse(file, mirror, &ctx.reqs, &ctx.nr_reqs);
+	if (ret < 0)
+		return ret;
+
+	if (!output) {
+		for (unsigned int i = 0; i < ctx.nr_reqs; i++) {
+			struct batch_request *req = &ctx.reqs[i];
+
+			if (req->mirror)
+				ret = __print_mapping_info(fs_info, req->logical,
+							   req->len, req->mirror);
+			else
+				ret = print_mapping_info(fs_info, req->logical,
+							 req->len);
+			if (ret < 0)
+				ctx.errors++;
+		}
+		ret = 0;
+		goto out;
+	}
+
+	if (strcmp(output, "-") != 0) {
+		if (mkdir(output, 0700) < 0 && errno != EEXIST) {
+			ret = -errno;
+			error("cannot create directory %s: %m", output);
+			goto out;
+		}
+		ctx.dir_fd = open(output, O_RDONLY | O_DIRECTORY);
+		if (ctx.dir_fd < 0) {
+			ret = -errno;
+			error("cannot open directory %s: %m", output);
+			goto out;
+		}
+	}
+
+	batch_map_requests(&ctx);
+	qsort(ctx.reqs, ctx.nr_reqs, sizeof(struct batch_request),
+	      cmp_batch_request);
+
+	ctx.window = malloc(BATCH_WINDOW);
+	ctx.bounce = malloc(BATCH_READ);
+	ctx.chunks = calloc(ctx.nr_reqs + 1, sizeof(struct batch_chunk));
+	if (!ctx.window || !ctx.bounce || !ctx.chunks) {
+		ret = -ENOMEM;
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		goto out;
+	}
+
+	while (index < ctx.nr_reqs) {
+		batch_fill_window(&ctx, &index, &offset);
+		for (unsigned int i = 0; i < ctx.nr_chunks; i++) {
+			ret = batch_add_stripes(&ctx, &ctx.chunks[i]);
+			if (ret < 0)
+				goto out;
+		}
+		batch_read_window(&ctx);
+		for (unsigned int i = 0; i < ctx.nr_chunks; i++) {
+			ret = batch_output_chunk(&ctx, &ctx.chunks[i]);
+			if (ret < 0)
+				goto out;
+		}
+	}
+	/* End of archive */
+	if (ctx.dir_fd < 0) {
+		memset(ctx.window, 0, 2 * TAR_BLOCK);
+		ret = batch_write(STDOUT_FILENO, ctx.window, 2 * TAR_BLOCK);
+	}
+out:
+	if (ctx.out_fd >= 0)
+		close(ctx.out_fd);
+	if (ctx.dir_fd >= 0)
+		close(ctx.dir_fd);
+	free(ctx.reqs);
+	free(ctx.window);
+	free(ctx.bounce);
+	free(ctx.chunks);
+	free(ctx.stripes);
+	if (ret == 0 && ctx.errors)
+		ret = 1;
+	return ret;
+}
+
 static const char * const map_logical_usage[] = {
 	"btrfs-map-logical [options] device",
 	"Map logical address on a device",
@@ -215,6 +837,10 @@ static const char * const map_logical_usage[] = {
 	OPTLINE("-c COPY", "copy of the extent to read (usually 1 or 2)"),
 	OPTLINE("-o FILE", "output file to hold the extent"),
 	OPTLINE("-b BYTES", "number of bytes to read"),
+	OPTLINE("-f FILE", "read the ranges listed in FILE ('-' for stdin), one "
+		"per line as 'LOGICAL LENGTH [COPY]', with -o - write them as "
+		"a tar stream to stdout, with -o DIR to files named "
+		"LOGICAL-LENGTH-COPY in DIR, otherwise print the mapping"),
 	NULL
 };
 
@@ -228,6 +854,7 @@ int main(int argc, char **argv)
 	struct btrfs_root *root;
 	char *dev;
 	char *output_file = NULL;
+	const char *batch_file = NULL;
 	u64 copy = 0;
 	u64 logical = 0;
 	u64 bytes = 0;
@@ -245,10 +872,11 @@ int main(int argc, char **argv)
 			{ "copy", required_argument, NULL, 'c' },
 			{ "output", required_argument, NULL, 'o' },
 			{ "bytes", required_argument, NULL, 'b' },
+			{ "from-file", required_argument, NULL, 'f' },
 			{ NULL, 0, NULL, 0}
 		};
 
-		c = getopt_long(argc, argv, "l:c:o:b:", long_options, NULL);
+		c = getopt_long(argc, argv, "l:c:o:b:f:", long_options, NULL);
 		if (c < 0)
 			break;
 		switch(c) {
@@ -264,6 +892,9 @@ int main(int argc, char **argv)
 			case 'o':
 				output_file = strdup(optarg);
 				break;
+			case 'f':
+				batch_file = optarg;
+				break;
 			default:
 				usage(&map_logical_cmd, 1);
 		}
@@ -271,14 +902,20 @@ int main(int argc, char **argv)
 	set_argv0(argv);
 	if (check_argc_min(argc - optind, 1))
 		return 1;
-	if (logical == 0)
+	if (batch_file) {
+		if (logical || bytes) {
+			error("-l and -b can't be used with -f");
+			return 1;
+		}
+	} else if (logical == 0) {
 		usage(&map_logical_cmd, 1);
+	}
 
 	dev = argv[optind];
 
 	cache_tree_init(&root_cache);
 
-	root = open_ctree(dev, 0, 0);
+	root = open_ctree(dev, 0, OPEN_CTREE_LAZY_BLOCK_GROUPS);
 	if (!root) {
 		error("open ctree failed");
 		free(output_file);
@@ -286,6 +923,13 @@ int main(int argc, char **argv)
 	}
 
 	info_file = stdout;
+	if (batch_file) {
+		if (output_file && strcmp(output_file, "-") == 0)
+			info_file = stderr;
+		ret = map_logical_batch(root->fs_info, batch_file, output_file,
+					copy);
+		goto close;
+	}
 	if (output_file) {
 		if (strcmp(output_file, "-") == 0) {
 			out_fd = 1;
@@ -22,6 +22,7 @@
 #include <getopt.h>
 #include <stdbool.h>
 #include <strings.h>
+#include "kernel-lib/raid56.h"
 #include "kernel-shared/volumes.h"
 #include "crypto/hash.h"
 #include "common/cpu-utils.h"
@@ -30,6 +31,7 @@
 #include "common/help.h"
 #include "common/box.h"
 #include "common/messages.h"
+#include "common/stats.h"
 #include "cmds/commands.h"
 
 static const char * const btrfs_cmd_group_usage[] = {
@@ -45,6 +47,10 @@ static const char * const btrfs_cmd_group_usage[] = {
 	"  -q|--quiet        print only errors\n"
 	"  --log <level>     set log level (default, info, verbose, debug, quiet)\n"
 	"  --dry-run         if supported, do not do any active/changing actions\n"
+	"  --stats[=json]    print I/O, cache and memory statistics to stderr on exit\n"
+	"  --read-policy <policy>\n"
+	"                    mirror to read first from unmounted filesystems (first,\n"
+	"                    round-robin, queue, latency)\n"
 	"\n"
 	"Options for the main command only:\n"
 	"  --help            print condensed help for all subcommands\n"
@@ -291,7 +297,8 @@ static void handle_log_level(const char *level) {
  */
 static int handle_global_options(int argc, char **argv)
 {
-	enum { OPT_HELP = 256, OPT_VERSION, OPT_FULL, OPT_FORMAT, OPT_LOG };
+	enum { OPT_HELP = 256, OPT_VERSION, OPT_FULL, OPT_FORMAT, OPT_LOG,
+	       OPT_READ_POLICY };
 	static const struct option long_options[] = {
 		{ "help", no_argument, NULL, OPT_HELP },
 		{ "version", no_argument, NULL, OPT_VERSION },
@@ -302,6 +309,8 @@ static int handle_global_options(int argc, char **argv)
 		{ "log", required_argument, NULL, OPT_LOG },
 		{ "param", required_argument, NULL, GETOPT_VAL_PARAM },
 		{ "dry-run", no_argument, NULL, GETOPT_VAL_DRY_RUN },
+		{ "stats", optional_argument, NULL, GETOPT_VAL_STATS },
+		{ "read-policy", required_argument, NULL, OPT_READ_POLICY },
 		{ NULL, 0, NULL, 0}
 	};
 	int shift;
@@ -333,6 +342,18 @@ static int handle_global_options(int argc, char **argv)
 		case GETOPT_VAL_DRY_RUN:
 			bconf_set_dry_run();
 			break;
+		case GETOPT_VAL_STATS:
+			if (stats_enable(optarg)) {
+				error("invalid stats format: %s", optarg);
+				exit(1);
+			}
+			break;
+		case OPT_READ_POLICY:
+			if (btrfs_set_read_policy(optarg)) {
+				error("invalid read policy: %s", optarg);
+				exit(1);
+			}
+			break;
 		case 'v':
 			bconf_be_verbose();
 			break;
@@ -464,6 +485,7 @@ int main(int argc, char **argv)
 	handle_help_options_next_level(cmd, argc, argv);
 	cpu_detect_flags();
 	hash_init_accel();
+	raid6_init_accel();
 	fixup_argv0(argv, cmd->token);
 
 	ret = cmd_execute(cmd, argc, argv);
@@ -0,0 +1,273 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <errno.h>
+#include "kernel-lib/list.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "common/extent-cache.h"
+#include "check/backref-cache.h"
+
+struct backref_cache_entry {
+	struct cache_extent cache;
+	struct list_head lru;
+	/* Allocated size, accounted to the budget */
+	u32 size;
+	/* There's no extent item for the bytenr, the leaf is empty */
+	bool missing;
+	/* The leaf holds one reference for the cache and one for each user */
+	struct extent_buffer leaf;
+	/* Data of the leaf follows */
+};
+
+struct backref_cache {
+	struct btrfs_fs_info *fs_info;
+	/* Results of lookup_entry(), by bytenr */
+	struct cache_tree entries;
+	/* Most recently used first */
+	struct list_head lru;
+	u64 size;
+	u64 budget;
+};
+
+struct backref_cache *backref_cache_alloc(struct btrfs_fs_info *fs_info,
+					  u64 budget)
+{
+	struct backref_cache *cache;
+
+	cache = calloc(1, sizeof(*cache));
+	if (!cache)
+		return NULL;
+	cache->fs_info = fs_info;
+	cache->budget = budget;
+	cache_tree_init(&cache->entries);
+	INIT_LIST_HEAD(&cache->lru);
+	return cache;
+}
+
+static void put_entry(struct backref_cache_entry *entry)
+{
+	if (--entry->leaf.refs == 0)
+		free(entry);
+}
+
+void backref_cache_put(struct extent_buffer *leaf)
+{
+	if (leaf)
+		put_entry(container_of(leaf, struct backref_cache_entry, leaf));
+}
+
+static void evict_entry(struct backref_cache *cache,
+			struct backref_cache_entry *entry)
+{
+	remove_cache_extent(&cache->entries, &entry->cache);
+	list_del(&entry->lru);
+	cache->size -= entry->size;
+	put_entry(entry);
+}
+
+void backref_cache_free(struct backref_cache *cache)
+{
+	if (!cache)
+		return;
+	while (!list_empty(&cache->lru))
+		evict_entry(cache, list_last_entry(&cache->lru,
+				struct backref_cache_entry, lru));
+	free(cache);
+}
+
+/*
+ * Search the extent tree for @key, exactly or with btrfs_previous_extent_item()
+ * after it, and copy the item found to a new entry.
+ *
+ * Return 0 and the entry with one reference, also if nothing was found, or
+ * negative errno.
+ */
+static int read_entry(struct backref_cache *cache, const struct btrfs_key *key,
+		      bool exact, struct backref_cache_entry **entry_ret)
+{
+	struct btrfs_fs_info *fs_info = cache->fs_info;
+	struct btrfs_root *extent_root = btrfs_extent_root(fs_info, key->objectid);
+	struct backref_cache_entry *entry;
+	struct btrfs_path path = { 0 };
+	struct btrfs_disk_key disk_key;
+	struct extent_buffer *src;
+	struct extent_buffer *leaf;
+	u32 item_size = 0;
+	u32 leaf_size = 0;
+	int slot;
+	int ret;
+
+	ret = btrfs_search_slot(NULL, extent_root, key, &path, 0, 0);
+	if (ret >= 0 && !exact)
+		ret = btrfs_previous_extent_item(extent_root, &path,
+						 key->objectid);
+	if (ret < 0)
+		goto out;
+
+	if (ret == 0) {
+		item_size = btrfs_item_size(path.nodes[0], path.slots[0]);
+		leaf_size = btrfs_item_nr_offset(path.nodes[0], 1) + item_size;
+	}
+	entry = calloc(1, sizeof(*entry) + leaf_size);
+	if (!entry) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	entry->cache.start = key->objectid;
+	entry->cache.size = 1;
+	entry->size = sizeof(*entry) + leaf_size;
+	INIT_LIST_HEAD(&entry->lru);
+	leaf = &entry->leaf;
+	leaf->fs_info = fs_info;
+	leaf->refs = 1;
+	leaf->flags = EXTENT_BUFFER_UPTODATE | EXTENT_BUFFER_DUMMY;
+	leaf->data = (char *)(entry + 1);
+	leaf->len = leaf_size;
+	if (ret > 0) {
+		entry->missing = true;
+		ret = 0;
+		goto done;
+	}
+
+	src = path.nodes[0];
+	slot = path.slots[0];
+	leaf->start = src->start;
+	copy_extent_buffer(leaf, src, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_nritems(leaf, 1);
+	btrfs_item_key(src, &disk_key, slot);
+	btrfs_set_item_key(leaf, &disk_key, 0);
+	btrfs_set_item_offset(leaf, 0, sizeof(struct btrfs_item));
+	btrfs_set_item_size(leaf, 0, item_size);
+	copy_extent_buffer(leaf, src, btrfs_item_ptr_offset(leaf, 0),
+			   btrfs_item_ptr_offset(src, slot), item_size);
+done:
+	*entry_ret = entry;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/*
+ * Find the entry of @bytenr for the key (@bytenr, METADATA_ITEM, -1), which
+ * covers all the extent items of the bytenr, in the cache or the extent tree.
+ */
+static int lookup_entry(struct backref_cache *cache, u64 bytenr,
+			struct backref_cache_entry **entry_ret)
+{
+	struct backref_cache_entry *entry;
+	struct cache_extent *ce;
+	struct btrfs_key key;
+	int ret;
+
+	ce = lookup_cache_extent(&cache->entries, bytenr, 1);
+	if (ce) {
+		entry = container_of(ce, struct backref_cache_entry, cache);
+		list_move(&entry->lru, &cache->lru);
+		entry->leaf.refs++;
+		*entry_ret = entry;
+		return 0;
+	}
+
+	key.objectid = bytenr;
+	key.type = BTRFS_METADATA_ITEM_KEY;
+	key.offset = (u64)-1;
+	ret = read_entry(cache, &key, false, &entry);
+	if (ret < 0)
+		return ret;
+
+	if (cache->budget && entry->size <= cache->budget) {
+		ret = insert_cache_extent(&cache->entries, &entry->cache);
+		if (ret == 0) {
+			entry->leaf.refs++;
+			list_add(&entry->lru, &cache->lru);
+			cache->size += entry->size;
+			while (cache->size > cache->budget)
+				evict_entry(cache, list_last_entry(&cache->lru,
+						struct backref_cache_entry, lru));
+		}
+	}
+	*entry_ret = entry;
+	return 0;
+}
+
+static int return_entry(struct backref_cache_entry *entry,
+			struct extent_buffer **leaf_ret)
+{
+	if (entry->missing) {
+		put_entry(entry);
+		return 1;
+	}
+	*leaf_ret = &entry->leaf;
+	return 0;
+}
+
+int backref_cache_lookup(struct backref_cache *cache, u64 bytenr, u8 type,
+			 struct extent_buffer **leaf_ret)
+{
+	struct backref_cache_entry *entry;
+	struct btrfs_key key;
+	int ret;
+
+	ret = lookup_entry(cache, bytenr, &entry);
+	if (ret < 0)
+		return ret;
+	if (type == BTRFS_METADATA_ITEM_KEY || entry->missing)
+		return return_entry(entry, leaf_ret);
+	btrfs_item_key_to_cpu(&entry->leaf, &key, 0);
+	if (key.type == BTRFS_EXTENT_ITEM_KEY)
+		return return_entry(entry, leaf_ret);
+
+	/* There's a metadata item, the extent items are below it if any */
+	put_entry(entry);
+	key.objectid = bytenr;
+	key.type = type;
+	key.offset = (u64)-1;
+	ret = read_entry(cache, &key, false, &entry);
+	if (ret < 0)
+		return ret;
+	return return_entry(entry, leaf_ret);
+}
+
+int backref_cache_lookup_exact(struct backref_cache *cache, u64 bytenr,
+			       u64 num_bytes, struct extent_buffer **leaf_ret)
+{
+	struct backref_cache_entry *entry;
+	struct btrfs_key key;
+	int ret;
+
+	ret = lookup_entry(cache, bytenr, &entry);
+	if (ret < 0)
+		return ret;
+	if (entry->missing)
+		return return_entry(entry, leaf_ret);
+	btrfs_item_key_to_cpu(&entry->leaf, &key, 0);
+	if (key.type == BTRFS_EXTENT_ITEM_KEY && key.offset == num_bytes)
+		return return_entry(entry, leaf_ret);
+
+	/* Some other item of the bytenr, the wanted one may still be there */
+	put_entry(entry);
+	key.objectid = bytenr;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = num_bytes;
+	ret = read_entry(cache, &key, true, &entry);
+	if (ret < 0)
+		return ret;
+	return return_entry(entry, leaf_ret);
+}
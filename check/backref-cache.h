@@ -0,0 +1,57 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_BACKREF_CACHE_H__
+#define __BTRFS_CHECK_BACKREF_CACHE_H__
+
+#include "kerncompat.h"
+
+/*
+ * Cache of the extent and metadata items of the extent tree for the lowmem
+ * mode, which looks up the same items for every referencer.
+ *
+ * An item is returned as a copy, in a fake leaf with the item at slot 0 and
+ * ->start of the leaf it was found in, so the usual accessors and messages
+ * work the same as with a path.  The least recently used items are dropped
+ * once the copies take more than the budget.  The extent tree must not change
+ * while the cache is used, a zero budget caches nothing.
+ */
+
+struct btrfs_fs_info;
+struct extent_buffer;
+struct backref_cache;
+
+struct backref_cache *backref_cache_alloc(struct btrfs_fs_info *fs_info,
+					  u64 budget);
+void backref_cache_free(struct backref_cache *cache);
+
+/*
+ * Find the extent item of @bytenr like btrfs_search_slot() of
+ * (@bytenr, @type, -1) followed by btrfs_previous_extent_item(), @type is
+ * BTRFS_EXTENT_ITEM_KEY or BTRFS_METADATA_ITEM_KEY.
+ *
+ * Return 0 and the leaf in @leaf_ret, 1 if there's no such item or negative
+ * errno.
+ */
+int backref_cache_lookup(struct backref_cache *cache, u64 bytenr, u8 type,
+			 struct extent_buffer **leaf_ret);
+/* Same for the exact key (@bytenr, BTRFS_EXTENT_ITEM_KEY, @num_bytes) */
+int backref_cache_lookup_exact(struct backref_cache *cache, u64 bytenr,
+			       u64 num_bytes, struct extent_buffer **leaf_ret);
+/* Release the leaf returned by a lookup */
+void backref_cache_put(struct extent_buffer *leaf);
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <uuid/uuid.h>
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "common/messages.h"
+#include "check/mode-common.h"
+#include "check/checkpoint.h"
+
+#define CHECKPOINT_VERSION		(1)
+
+/* The counters printed at the end of the check */
+static const struct {
+	const char *name;
+	u64 *value;
+} counters[] = {
+	{ "bytes-used", &bytes_used },
+	{ "total-csum-bytes", &total_csum_bytes },
+	{ "total-btree-bytes", &total_btree_bytes },
+	{ "total-fs-tree-bytes", &total_fs_tree_bytes },
+	{ "total-extent-tree-bytes", &total_extent_tree_bytes },
+	{ "btree-space-waste", &btree_space_waste },
+	{ "data-bytes-allocated", &data_bytes_allocated },
+	{ "data-bytes-referenced", &data_bytes_referenced },
+};
+
+void checkpoint_init(struct check_checkpoint *ckpt, const char *path,
+		     struct btrfs_fs_info *fs_info, u64 since_generation)
+{
+	memset(ckpt, 0, sizeof(*ckpt));
+	ckpt->path = path;
+	memcpy(ckpt->fsid, fs_info->super_copy->fsid, BTRFS_FSID_SIZE);
+	ckpt->generation = btrfs_super_generation(fs_info->super_copy);
+	ckpt->since_generation = since_generation;
+	ckpt->phase_start = time(NULL);
+}
+
+static int write_file(struct check_checkpoint *ckpt, FILE *file)
+{
+	char uuidbuf[BTRFS_UUID_UNPARSED_SIZE];
+	time_t now = time(NULL);
+	int i;
+
+	uuid_unparse(ckpt->fsid, uuidbuf);
+	fprintf(file, "version %d\n", CHECKPOINT_VERSION);
+	fprintf(file, "fsid %s\n", uuidbuf);
+	fprintf(file, "generation %llu\n", ckpt->generation);
+	fprintf(file, "since-generation %llu\n", ckpt->since_generation);
+	fprintf(file, "phase %d\n", ckpt->phase);
+	fprintf(file, "errors %d\n", ckpt->errors);
+	fprintf(file, "pass-errors %d\n", ckpt->pass_errors);
+	fprintf(file, "root-errors %d\n", ckpt->root_errors);
+	fprintf(file, "root %llu %u %llu\n", ckpt->root_key.objectid,
+		ckpt->root_key.type, ckpt->root_key.offset);
+	if (ckpt->has_key)
+		fprintf(file, "key %llu %u %llu\n", ckpt->key.objectid,
+			ckpt->key.type, ckpt->key.offset);
+	fprintf(file, "total-used %llu\n", ckpt->total_used);
+	for (i = 0; i < ARRAY_SIZE(counters); i++)
+		fprintf(file, "%s %llu\n", counters[i].name, *counters[i].value);
+	for (i = 1; i <= CHECKPOINT_PHASES; i++) {
+		u64 seconds = ckpt->phase_time[i];
+
+		if (i == ckpt->phase)
+			seconds += now - ckpt->phase_start;
+		fprintf(file, "phase-time %d %llu\n", i, seconds);
+	}
+	return ferror(file) ? -EIO : 0;
+}
+
+int checkpoint_write(struct check_checkpoint *ckpt)
+{
+	char *tmp_path;
+	FILE *file;
+	int ret;
+
+	ckpt->last_write = time(NULL);
+	tmp_path = malloc(strlen(ckpt->path) + sizeof(".tmp"));
+	if (!tmp_path)
+		return -ENOMEM;
+	sprintf(tmp_path, "%s.tmp", ckpt->path);
+
+	file = fopen(tmp_path, "w");
+	if (!file) {
+		ret = -errno;
+		error("cannot create checkpoint %s: %m", tmp_path);
+		goto out;
+	}
+	ret = write_file(ckpt, file);
+	if (!ret && (fflush(file) || fsync(fileno(file))))
+		ret = -errno;
+	if (fclose(file) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp_path, ckpt->path))
+		ret = -errno;
+	if (ret) {
+		errno = -ret;
+		error("cannot write checkpoint %s: %m", ckpt->path);
+		unlink(tmp_path);
+	}
+out:
+	free(tmp_path);
+	return ret;
+}
+
+static int parse_line(struct check_checkpoint *ckpt, const char *name,
+		      const char *value, uuid_t fsid, int *version)
+{
+	unsigned int type;
+	char uuidbuf[BTRFS_UUID_UNPARSED_SIZE];
+	int phase;
+	u64 num;
+	int i;
+
+	if (!strcmp(name, "version"))
+		return sscanf(value, "%d", version) == 1 ? 0 : -EINVAL;
+	if (!strcmp(name, "fsid")) {
+		if (sscanf(value, "%36s", uuidbuf) != 1 ||
+		    uuid_parse(uuidbuf, fsid))
+			return -EINVAL;
+		return 0;
+	}
+	if (!strcmp(name, "generation")) {
+		if (sscanf(value, "%llu", &num) != 1)
+			return -EINVAL;
+		if (num != ckpt->generation) {
+			error(
+	"filesystem changed since the checkpoint, generation %llu, checkpoint of %llu",
+			      ckpt->generation, num);
+			return -ESTALE;
+		}
+		return 0;
+	}
+	if (!strcmp(name, "since-generation")) {
+		if (sscanf(value, "%llu", &num) != 1)
+			return -EINVAL;
+		if (num != ckpt->since_generation) {
+			error("checkpoint was made with --since-generation %llu",
+			      num);
+			return -ESTALE;
+		}
+		return 0;
+	}
+	if (!strcmp(name, "phase"))
+		return sscanf(value, "%d", &ckpt->phase) == 1 ? 0 : -EINVAL;
+	if (!strcmp(name, "errors"))
+		return sscanf(value, "%d", &ckpt->errors) == 1 ? 0 : -EINVAL;
+	if (!strcmp(name, "pass-errors"))
+		return sscanf(value, "%d", &ckpt->pass_errors) == 1 ? 0 : -EINVAL;
+	if (!strcmp(name, "root-errors"))
+		return sscanf(value, "%d", &ckpt->root_errors) == 1 ? 0 : -EINVAL;
+	if (!strcmp(name, "root")) {
+		if (sscanf(value, "%llu %u %llu", &ckpt->root_key.objectid,
+			   &type, &ckpt->root_key.offset) != 3 || type > (u8)-1)
+			return -EINVAL;
+		ckpt->root_key.type = type;
+		return 0;
+	}
+	if (!strcmp(name, "key")) {
+		if (sscanf(value, "%llu %u %llu", &ckpt->key.objectid,
+			   &type, &ckpt->key.offset) != 3 || type > (u8)-1)
+			return -EINVAL;
+		ckpt->key.type = type;
+		ckpt->has_key = true;
+		return 0;
+	}
+	if (!strcmp(name, "total-used"))
+		return sscanf(value, "%llu", &ckpt->total_used) == 1 ? 0 : -EINVAL;
+	if (!strcmp(name, "phase-time")) {
+		if (sscanf(value, "%d %llu", &phase, &num) != 2 ||
+		    phase < 1 || phase > CHECKPOINT_PHASES)
+			return -EINVAL;
+		ckpt->phase_time[phase] = num;
+		return 0;
+	}
+	for (i = 0; i < ARRAY_SIZE(counters); i++) {
+		if (!strcmp(name, counters[i].name))
+			return sscanf(value, "%llu", counters[i].value) == 1 ?
+			       0 : -EINVAL;
+	}
+	/* Unknown names are ignored, the version tells if they matter */
+	return 0;
+}
+
+int checkpoint_load(struct check_checkpoint *ckpt)
+{
+	char line[256];
+	char name[64];
+	uuid_t fsid;
+	int version = 0;
+	int offset;
+	FILE *file;
+	int ret = 0;
+
+	uuid_clear(fsid);
+	ckpt->phase = 0;
+	file = fopen(ckpt->path, "r");
+	if (!file) {
+		ret = -errno;
+		error("cannot open checkpoint %s: %m", ckpt->path);
+		return ret;
+	}
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line, "%63s %n", name, &offset) != 1)
+			continue;
+		ret = parse_line(ckpt, name, line + offset, fsid, &version);
+		if (ret)
+			break;
+	}
+	fclose(file);
+	/* Not for this check, already reported */
+	if (ret == -ESTALE)
+		return ret;
+	if (!ret && version != CHECKPOINT_VERSION) {
+		error("unsupported checkpoint version %d", version);
+		return -EINVAL;
+	}
+	if (ret || ckpt->phase < 1 || ckpt->phase > CHECKPOINT_PHASE_DONE) {
+		error("invalid checkpoint %s", ckpt->path);
+		return -EINVAL;
+	}
+	if (memcmp(fsid, ckpt->fsid, BTRFS_FSID_SIZE)) {
+		error("checkpoint %s is of another filesystem", ckpt->path);
+		return -EINVAL;
+	}
+	if (ckpt->phase == CHECKPOINT_PHASE_DONE) {
+		error("checkpoint %s is of a finished check", ckpt->path);
+		return -EINVAL;
+	}
+	ckpt->resuming = true;
+	ckpt->phase_start = time(NULL);
+	return 0;
+}
+
+static void end_phase(struct check_checkpoint *ckpt)
+{
+	time_t now = time(NULL);
+
+	if (ckpt->phase >= 1 && ckpt->phase <= CHECKPOINT_PHASES)
+		ckpt->phase_time[ckpt->phase] += now - ckpt->phase_start;
+	ckpt->phase_start = now;
+}
+
+bool checkpoint_phase_start(struct check_checkpoint *ckpt, int phase,
+			    int errors)
+{
+	if (ckpt->resuming && phase < ckpt->phase)
+		return true;
+	end_phase(ckpt);
+	if (!checkpoint_resume_phase(ckpt, phase)) {
+		ckpt->resuming = false;
+		ckpt->pass_errors = 0;
+		ckpt->root_errors = 0;
+		memset(&ckpt->root_key, 0, sizeof(ckpt->root_key));
+		ckpt->has_key = false;
+		ckpt->total_used = 0;
+	}
+	ckpt->phase = phase;
+	ckpt->errors = errors;
+	checkpoint_write(ckpt);
+	return false;
+}
+
+bool checkpoint_resume_phase(struct check_checkpoint *ckpt, int phase)
+{
+	return ckpt->resuming && ckpt->phase == phase;
+}
+
+int checkpoint_update(struct check_checkpoint *ckpt)
+{
+	if (time(NULL) - ckpt->last_write < CHECKPOINT_INTERVAL)
+		return 0;
+	return checkpoint_write(ckpt);
+}
+
+int checkpoint_done(struct check_checkpoint *ckpt, int errors)
+{
+	end_phase(ckpt);
+	ckpt->phase = CHECKPOINT_PHASE_DONE;
+	ckpt->errors = errors;
+	ckpt->resuming = false;
+	ckpt->has_key = false;
+	return checkpoint_write(ckpt);
+}
@@ -0,0 +1,98 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_CHECKPOINT_H__
+#define __BTRFS_CHECK_CHECKPOINT_H__
+
+#include "kerncompat.h"
+#include <time.h>
+#include "kernel-shared/ctree.h"
+
+/*
+ * Progress of a lowmem mode check, saved to a file so an interrupted check
+ * can continue where it stopped.
+ *
+ * The phases are numbered as printed by the check, [1/8] to [8/8].  In the
+ * extent and fs tree passes the position is the tree being walked and the
+ * key of the next subtree to walk in it, everything before was checked.  The
+ * errors and the counters printed at the end are saved with the position, as
+ * well as the time spent in each phase, accumulated over the resumed runs.
+ *
+ * The file is a text of "name value" lines, replaced atomically.
+ */
+
+#define CHECKPOINT_PHASES		(8)
+/* All phases are done, the file keeps only the times */
+#define CHECKPOINT_PHASE_DONE		(CHECKPOINT_PHASES + 1)
+
+/* Seconds between two writes during a phase */
+#define CHECKPOINT_INTERVAL		(60)
+
+struct check_checkpoint {
+	const char *path;
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 generation;
+	u64 since_generation;
+
+	/* Phase in progress, 1 based */
+	int phase;
+	/* Errors of the finished phases, of the pass and of the tree so far */
+	int errors;
+	int pass_errors;
+	int root_errors;
+	/*
+	 * Tree being walked by the pass: the root item key in the tree root,
+	 * the objectid alone for the trees without root item.  The walk of
+	 * that tree resumes at @key if @has_key.
+	 */
+	struct btrfs_key root_key;
+	struct btrfs_key key;
+	bool has_key;
+	/* Sum of the block group used bytes of the lowmem extent pass */
+	u64 total_used;
+
+	/* Seconds spent in each phase, index 0 unused */
+	u64 phase_time[CHECKPOINT_PHASES + 1];
+	time_t phase_start;
+	time_t last_write;
+	/* Loaded by --resume, the position is valid until the phase starts */
+	bool resuming;
+};
+
+void checkpoint_init(struct check_checkpoint *ckpt, const char *path,
+		     struct btrfs_fs_info *fs_info, u64 since_generation);
+/*
+ * Load the file of @ckpt->path and verify it's for the same filesystem as
+ * passed to checkpoint_init(), restore the counters
+ */
+int checkpoint_load(struct check_checkpoint *ckpt);
+int checkpoint_write(struct check_checkpoint *ckpt);
+
+/*
+ * End the previous phase and start @phase with @errors found before it.
+ * Return true if the phase was already done by the resumed check and is to be
+ * skipped.
+ */
+bool checkpoint_phase_start(struct check_checkpoint *ckpt, int phase,
+			    int errors);
+/* Return true if the phase resumes at the position loaded */
+bool checkpoint_resume_phase(struct check_checkpoint *ckpt, int phase);
+/* Write the file if the last write is older than CHECKPOINT_INTERVAL */
+int checkpoint_update(struct check_checkpoint *ckpt);
+/* All phases finished with @errors */
+int checkpoint_done(struct check_checkpoint *ckpt, int errors);
+
+#endif
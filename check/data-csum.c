@@ -0,0 +1,372 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "kernel-lib/list.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/volumes.h"
+#include "common/messages.h"
+#include "common/utils.h"
+#include "crypto/hash.h"
+#include "check/data-csum.h"
+
+int data_csum_verify(struct btrfs_fs_info *fs_info, u64 bytenr, u64 num_bytes,
+		     const u8 *csums, FILE *out)
+{
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	const u16 csum_type = fs_info->csum_type;
+	u64 offset = 0;
+	u8 *data;
+	u8 *results;
+	u64 read_len;
+	u64 data_checked;
+	int ret = 0;
+	int mirror;
+	int num_copies;
+	bool csum_mismatch = false;
+
+	if (num_bytes % sectorsize)
+		return -EINVAL;
+
+	data = malloc(num_bytes);
+	results = malloc(num_bytes / sectorsize * csum_size);
+	if (!data || !results) {
+		free(data);
+		free(results);
+		return -ENOMEM;
+	}
+
+	num_copies = btrfs_num_copies(fs_info, bytenr, num_bytes);
+	while (offset < num_bytes) {
+		/*
+		 * Mirror 0 means 'read from any valid copy', so it's skipped.
+		 * The indexes 1-N represent the n-th copy for levels with
+		 * redundancy.
+		 */
+		for (mirror = 1; mirror <= num_copies; mirror++) {
+			read_len = num_bytes - offset;
+			/* read as much space once a time */
+			ret = read_data_from_disk(fs_info, (char *)data + offset,
+					bytenr + offset, &read_len, mirror);
+			if (ret)
+				goto out;
+
+			btrfs_csum_data_batch(csum_type, data + offset, results,
+					sectorsize,
+					DIV_ROUND_UP(read_len, sectorsize));
+			data_checked = 0;
+			/* verify every 4k data's checksum */
+			while (data_checked < read_len) {
+				const u8 *result = results + data_checked /
+						   sectorsize * csum_size;
+				const u64 tmp = offset + data_checked;
+				const u8 *expected = csums + tmp / sectorsize *
+						     csum_size;
+
+				if (memcmp(result, expected, csum_size) != 0) {
+					char found[BTRFS_CSUM_STRING_LEN];
+					char want[BTRFS_CSUM_STRING_LEN];
+
+					csum_mismatch = true;
+					btrfs_format_csum(csum_type, result, found);
+					btrfs_format_csum(csum_type, expected, want);
+					fprintf(out,
+				"mirror %d bytenr %llu csum %s expected csum %s\n",
+						mirror, bytenr + tmp, found, want);
+				}
+				data_checked += sectorsize;
+			}
+		}
+		offset += read_len;
+	}
+out:
+	free(data);
+	free(results);
+	if (!ret && csum_mismatch)
+		ret = 1;
+	return ret;
+}
+
+struct data_csum_pool {
+	struct btrfs_fs_info *fs_info;
+	pthread_mutex_t lock;
+	pthread_cond_t queued_cond;
+	pthread_cond_t done_cond;
+	/* All jobs not reaped yet, in submission order */
+	struct list_head inflight;
+	unsigned int nr_queued;
+	unsigned int nr_inflight;
+	unsigned int max_inflight;
+	/*
+	 * Devices for the per-device limit, the last slot is for ranges that
+	 * don't map to any of them
+	 */
+	struct btrfs_device **devices;
+	unsigned int *dev_busy;
+	unsigned int nr_devices;
+	unsigned int per_device;
+	unsigned int nr_threads;
+	bool stop;
+	pthread_t *threads;
+};
+
+static unsigned int job_dev_index(struct data_csum_pool *pool, u64 bytenr,
+				  u64 num_bytes)
+{
+	struct btrfs_bio_stripe stripe;
+	u64 length = num_bytes;
+
+	if (btrfs_map_block_stripe(pool->fs_info, bytenr, &length, NULL, 1,
+				   &stripe) == 0) {
+		for (unsigned int i = 0; i < pool->nr_devices; i++)
+			if (pool->devices[i] == stripe.dev)
+				return i;
+	}
+	return pool->nr_devices;
+}
+
+/* First job not started yet whose device is below the limit */
+static struct data_csum_job *dequeue_job(struct data_csum_pool *pool)
+{
+	struct data_csum_job *job;
+
+	if (!pool->nr_queued)
+		return NULL;
+	list_for_each_entry(job, &pool->inflight, list) {
+		if (!job->started &&
+		    pool->dev_busy[job->dev_index] < pool->per_device) {
+			job->started = true;
+			pool->nr_queued--;
+			pool->dev_busy[job->dev_index]++;
+			return job;
+		}
+	}
+	return NULL;
+}
+
+static void *data_csum_worker(void *arg)
+{
+	struct data_csum_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		struct data_csum_job *job;
+		FILE *out;
+
+		while (!(job = dequeue_job(pool)) && !pool->stop)
+			pthread_cond_wait(&pool->queued_cond, &pool->lock);
+		if (!job)
+			break;
+		pthread_mutex_unlock(&pool->lock);
+
+		out = open_memstream(&job->report, &job->report_len);
+		if (out) {
+			job->ret = data_csum_verify(pool->fs_info, job->bytenr,
+						    job->num_bytes, job->csums,
+						    out);
+			fclose(out);
+		} else {
+			job->ret = -ENOMEM;
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		pool->dev_busy[job->dev_index]--;
+		/* Another job of the device may be waiting for the slot */
+		pthread_cond_broadcast(&pool->queued_cond);
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct data_csum_pool *data_csum_pool_alloc(struct btrfs_fs_info *fs_info,
+					    unsigned int per_device)
+{
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_device *device;
+	struct data_csum_pool *pool;
+	unsigned int nr_threads;
+	int ret = 0;
+
+	if (!per_device)
+		return NULL;
+	/* Same as for the tree block checksums of the prefetch workers */
+	if (!CRYPTO_HASH_THREAD_SAFE &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_CRC32 &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_XXHASH)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->fs_info = fs_info;
+	pool->per_device = per_device;
+	INIT_LIST_HEAD(&pool->inflight);
+
+	for (fs_devices = fs_info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed)
+		list_for_each_entry(device, &fs_devices->devices, dev_list)
+			pool->nr_devices++;
+	pool->devices = calloc(pool->nr_devices, sizeof(*pool->devices));
+	pool->dev_busy = calloc(pool->nr_devices + 1, sizeof(*pool->dev_busy));
+	if (!pool->devices || !pool->dev_busy)
+		goto out_free;
+	pool->nr_devices = 0;
+	for (fs_devices = fs_info->fs_devices; fs_devices;
+	     fs_devices = fs_devices->seed)
+		list_for_each_entry(device, &fs_devices->devices, dev_list)
+			pool->devices[pool->nr_devices++] = device;
+
+	nr_threads = max(pool->nr_devices, 1U);
+	nr_threads = min_t(u64, (u64)per_device * nr_threads,
+			   DATA_CSUM_MAX_THREADS);
+	pool->max_inflight = nr_threads * DATA_CSUM_INFLIGHT_PER_THREAD;
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pool->threads)
+		goto out_free;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->queued_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (pool->nr_threads = 0; pool->nr_threads < nr_threads;
+	     pool->nr_threads++) {
+		ret = pthread_create(&pool->threads[pool->nr_threads], NULL,
+				     data_csum_worker, pool);
+		if (ret)
+			break;
+	}
+	if (pool->nr_threads == 0) {
+		errno = ret;
+		warning("cannot start data checksum threads: %m");
+		data_csum_pool_free(pool);
+		return NULL;
+	}
+	return pool;
+
+out_free:
+	free(pool->threads);
+	free(pool->dev_busy);
+	free(pool->devices);
+	free(pool);
+	return NULL;
+}
+
+void data_csum_job_free(struct data_csum_job *job)
+{
+	if (!job)
+		return;
+	free(job->csums);
+	free(job->report);
+	free(job);
+}
+
+void data_csum_pool_free(struct data_csum_pool *pool)
+{
+	struct data_csum_job *job;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	/* Nobody is going to look at the results of the queued jobs */
+	list_for_each_entry(job, &pool->inflight, list) {
+		if (!job->started) {
+			job->started = true;
+			job->done = true;
+		}
+	}
+	pool->nr_queued = 0;
+	pthread_cond_broadcast(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned int i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	while ((job = data_csum_pool_reap(pool, true)))
+		data_csum_job_free(job);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->queued_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->dev_busy);
+	free(pool->devices);
+	free(pool);
+}
+
+int data_csum_pool_submit(struct data_csum_pool *pool, u64 bytenr,
+			  u64 num_bytes, const u8 *csums)
+{
+	const size_t csums_len = num_bytes / pool->fs_info->sectorsize *
+				 pool->fs_info->csum_size;
+	struct data_csum_job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (!job)
+		return -ENOMEM;
+	job->csums = malloc(csums_len);
+	if (!job->csums) {
+		free(job);
+		return -ENOMEM;
+	}
+	memcpy(job->csums, csums, csums_len);
+	job->bytenr = bytenr;
+	job->num_bytes = num_bytes;
+	job->dev_index = job_dev_index(pool, bytenr, num_bytes);
+
+	pthread_mutex_lock(&pool->lock);
+	list_add_tail(&job->list, &pool->inflight);
+	pool->nr_inflight++;
+	pool->nr_queued++;
+	pthread_cond_signal(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+struct data_csum_job *data_csum_pool_reap(struct data_csum_pool *pool, bool wait)
+{
+	struct data_csum_job *job = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!list_empty(&pool->inflight)) {
+		job = list_first_entry(&pool->inflight, struct data_csum_job, list);
+		if (job->done || !wait)
+			break;
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	}
+	if (job && job->done) {
+		list_del_init(&job->list);
+		pool->nr_inflight--;
+	} else {
+		job = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+bool data_csum_pool_full(const struct data_csum_pool *pool)
+{
+	return pool->nr_inflight >= pool->max_inflight;
+}
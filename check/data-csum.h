@@ -0,0 +1,83 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_DATA_CSUM_H__
+#define __BTRFS_CHECK_DATA_CSUM_H__
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdbool.h>
+#include "kernel-lib/list.h"
+
+struct btrfs_fs_info;
+struct data_csum_pool;
+
+#define DATA_CSUM_DEFAULT_READERS	(4)
+#define DATA_CSUM_MAX_THREADS		(256)
+/* Ranges queued or verified but not reaped yet, per thread */
+#define DATA_CSUM_INFLIGHT_PER_THREAD	(4)
+
+/*
+ * Verify the data checksums of [@bytenr, @bytenr + @num_bytes) for all copies
+ * against @csums, one per sector.  Mismatches are printed to @out.
+ *
+ * Return <0 for fatal error (fails to read data or allocate memory).
+ * Return >0 for csum mismatch for any copy.
+ * Return 0 if everything is OK.
+ */
+int data_csum_verify(struct btrfs_fs_info *fs_info, u64 bytenr, u64 num_bytes,
+		     const u8 *csums, FILE *out);
+
+struct data_csum_job {
+	struct list_head list;
+	u64 bytenr;
+	u64 num_bytes;
+	u8 *csums;
+	/* Device of the first copy, for the per-device limit */
+	unsigned int dev_index;
+	bool started;
+	bool done;
+	/* Result of data_csum_verify() and what it printed */
+	int ret;
+	char *report;
+	size_t report_len;
+};
+
+/*
+ * Pool of threads reading and verifying data ranges, up to @per_device of
+ * them in flight for each device.  The ranges are reaped in the order they
+ * were submitted, so the reports come out in the same order as with
+ * data_csum_verify() called in a loop.
+ *
+ * Return NULL if the checksum implementation can't be used from several
+ * threads or the threads can't be started, the caller should verify the
+ * ranges synchronously then.
+ */
+struct data_csum_pool *data_csum_pool_alloc(struct btrfs_fs_info *fs_info,
+					    unsigned int per_device);
+void data_csum_pool_free(struct data_csum_pool *pool);
+/* Queue the range, @csums are copied */
+int data_csum_pool_submit(struct data_csum_pool *pool, u64 bytenr,
+			  u64 num_bytes, const u8 *csums);
+bool data_csum_pool_full(const struct data_csum_pool *pool);
+/*
+ * Return the oldest submitted job if it's done, or wait for it with @wait.
+ * Return NULL if there's nothing in flight or it's not done yet.
+ */
+struct data_csum_job *data_csum_pool_reap(struct data_csum_pool *pool, bool wait);
+void data_csum_job_free(struct data_csum_job *job);
+
+#endif
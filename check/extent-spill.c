@@ -0,0 +1,381 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "kernel-lib/sizes.h"
+#include "common/internal.h"
+#include "common/messages.h"
+#include "common/sort-utils.h"
+#include "common/thread-pool.h"
+#include "check/extent-spill.h"
+
+/* Don't bother with buffers smaller than this, whatever the limit is */
+#define EXTENT_SPILL_MIN_BUFFER		(SZ_1M)
+/* Threads sorting a full buffer before it's written */
+#define EXTENT_SPILL_SORT_THREADS	8
+
+struct spill_run {
+	/* Position and length in the scratch file, in events */
+	u64 start;
+	u64 nr;
+	/* Events of the run read so far */
+	u64 done;
+	/* Part of the read buffer owned by the run */
+	struct extent_spill_event *buf;
+	size_t buf_max;
+	size_t buf_nr;
+	size_t buf_pos;
+};
+
+struct extent_spill {
+	int fd;
+	/* Events added and not yet written, or being returned if no runs */
+	struct extent_spill_event *buf;
+	size_t buf_max;
+	size_t buf_nr;
+	size_t buf_pos;
+	u64 seq;
+	/* Events written to the scratch file */
+	u64 file_nr;
+
+	struct spill_run *runs;
+	unsigned int nr_runs;
+	unsigned int max_runs;
+
+	/* Runs with events left, min-heap of their current events */
+	unsigned int *heap;
+	unsigned int heap_nr;
+	/* First error of writing the runs, returned again when reading */
+	int error;
+	bool finished;
+};
+
+static int compare_event(const struct extent_spill_event *a,
+			 const struct extent_spill_event *b)
+{
+	if (a->bytenr != b->bytenr)
+		return a->bytenr < b->bytenr ? -1 : 1;
+	if (a->seq != b->seq)
+		return a->seq < b->seq ? -1 : 1;
+	return 0;
+}
+
+/*
+ * The buffer is filled in the order of seq, so a stable sort by bytenr orders
+ * it like compare_event().
+ */
+static void sort_events(struct extent_spill *spill)
+{
+	radix_sort_u64_parallel(spill->buf, spill->buf_nr, sizeof(*spill->buf),
+				offsetof(struct extent_spill_event, bytenr),
+				thread_pool_default_threads(EXTENT_SPILL_SORT_THREADS));
+}
+
+struct extent_spill *extent_spill_alloc(const char *tmpdir, u64 mem_limit)
+{
+	struct extent_spill *spill;
+	char *path;
+	int ret;
+
+	spill = calloc(1, sizeof(*spill));
+	if (!spill)
+		return ERR_PTR(-ENOMEM);
+	spill->buf_max = max_t(u64, mem_limit, EXTENT_SPILL_MIN_BUFFER) /
+			 sizeof(struct extent_spill_event);
+	spill->buf = malloc(spill->buf_max * sizeof(struct extent_spill_event));
+	if (!spill->buf) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	ret = asprintf(&path, "%s/btrfs-check-XXXXXX", tmpdir);
+	if (ret < 0) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+	spill->fd = mkstemp(path);
+	if (spill->fd < 0) {
+		ret = -errno;
+		free(path);
+		goto out_free;
+	}
+	/* Nobody else needs the file, let it go away with the descriptor */
+	unlink(path);
+	free(path);
+	return spill;
+
+out_free:
+	free(spill->buf);
+	free(spill);
+	return ERR_PTR(ret);
+}
+
+void extent_spill_free(struct extent_spill *spill)
+{
+	if (!spill)
+		return;
+	close(spill->fd);
+	free(spill->heap);
+	free(spill->runs);
+	free(spill->buf);
+	free(spill);
+}
+
+static int write_events(int fd, const struct extent_spill_event *events,
+			size_t nr, u64 pos)
+{
+	const char *p = (const char *)events;
+	size_t count = nr * sizeof(*events);
+	off_t offset = pos * sizeof(*events);
+
+	while (count) {
+		ssize_t ret = pwrite(fd, p, count, offset);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		p += ret;
+		offset += ret;
+		count -= ret;
+	}
+	return 0;
+}
+
+static int read_events(int fd, struct extent_spill_event *events, size_t nr,
+		       u64 pos)
+{
+	char *p = (char *)events;
+	size_t count = nr * sizeof(*events);
+	off_t offset = pos * sizeof(*events);
+
+	while (count) {
+		ssize_t ret = pread(fd, p, count, offset);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		/* The file is private, a short file means it got truncated */
+		if (ret == 0)
+			return -EIO;
+		p += ret;
+		offset += ret;
+		count -= ret;
+	}
+	return 0;
+}
+
+/* Sort the buffered events and write them as a new run */
+static int flush_run(struct extent_spill *spill)
+{
+	struct spill_run *run;
+	int ret;
+
+	if (!spill->buf_nr)
+		return 0;
+	if (spill->nr_runs == spill->max_runs) {
+		unsigned int max_runs = max(spill->max_runs * 2, 16U);
+		struct spill_run *runs;
+
+		runs = realloc(spill->runs, max_runs * sizeof(*runs));
+		if (!runs)
+			return -ENOMEM;
+		spill->runs = runs;
+		spill->max_runs = max_runs;
+	}
+
+	sort_events(spill);
+	ret = write_events(spill->fd, spill->buf, spill->buf_nr, spill->file_nr);
+	if (ret < 0)
+		return ret;
+
+	run = &spill->runs[spill->nr_runs++];
+	memset(run, 0, sizeof(*run));
+	run->start = spill->file_nr;
+	run->nr = spill->buf_nr;
+	spill->file_nr += spill->buf_nr;
+	spill->buf_nr = 0;
+	return 0;
+}
+
+int extent_spill_add(struct extent_spill *spill,
+		     const struct extent_spill_event *event)
+{
+	struct extent_spill_event *ev;
+
+	UASSERT(!spill->finished);
+	if (spill->error)
+		return spill->error;
+	if (spill->buf_nr == spill->buf_max) {
+		int ret = flush_run(spill);
+
+		if (ret < 0) {
+			spill->error = ret;
+			return ret;
+		}
+	}
+	ev = &spill->buf[spill->buf_nr++];
+	*ev = *event;
+	ev->seq = spill->seq++;
+	return 0;
+}
+
+unsigned int extent_spill_nr_runs(const struct extent_spill *spill)
+{
+	return spill->nr_runs;
+}
+
+/* Make sure the run has a current event, return 1 if it's exhausted */
+static int fill_run(struct extent_spill *spill, struct spill_run *run)
+{
+	size_t nr;
+	int ret;
+
+	if (run->buf_pos < run->buf_nr)
+		return 0;
+	if (run->done == run->nr)
+		return 1;
+	nr = min_t(u64, run->nr - run->done, run->buf_max);
+	ret = read_events(spill->fd, run->buf, nr, run->start + run->done);
+	if (ret < 0)
+		return ret;
+	run->done += nr;
+	run->buf_nr = nr;
+	run->buf_pos = 0;
+	return 0;
+}
+
+static inline const struct extent_spill_event *run_event(
+		const struct extent_spill *spill, unsigned int index)
+{
+	const struct spill_run *run = &spill->runs[index];
+
+	return &run->buf[run->buf_pos];
+}
+
+static void heap_down(struct extent_spill *spill, unsigned int i)
+{
+	unsigned int *heap = spill->heap;
+
+	while (true) {
+		unsigned int left = 2 * i + 1;
+		unsigned int right = left + 1;
+		unsigned int min = i;
+		unsigned int tmp;
+
+		if (left < spill->heap_nr &&
+		    compare_event(run_event(spill, heap[left]),
+				  run_event(spill, heap[min])) < 0)
+			min = left;
+		if (right < spill->heap_nr &&
+		    compare_event(run_event(spill, heap[right]),
+				  run_event(spill, heap[min])) < 0)
+			min = right;
+		if (min == i)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+int extent_spill_finish(struct extent_spill *spill)
+{
+	size_t per_run;
+	int ret;
+
+	UASSERT(!spill->finished);
+	spill->finished = true;
+	if (spill->error)
+		return spill->error;
+
+	/* Everything fit in the buffer, no need to touch the file at all */
+	if (!spill->nr_runs) {
+		sort_events(spill);
+		spill->buf_pos = 0;
+		return 0;
+	}
+
+	ret = flush_run(spill);
+	if (ret < 0)
+		return ret;
+
+	spill->heap = calloc(spill->nr_runs, sizeof(*spill->heap));
+	if (!spill->heap)
+		return -ENOMEM;
+
+	/* Split the now unused buffer among the runs for reading them back */
+	per_run = spill->buf_max / spill->nr_runs;
+	if (!per_run) {
+		struct extent_spill_event *buf;
+
+		per_run = 1;
+		buf = realloc(spill->buf, spill->nr_runs * sizeof(*buf));
+		if (!buf)
+			return -ENOMEM;
+		spill->buf = buf;
+	}
+	for (unsigned int i = 0; i < spill->nr_runs; i++) {
+		struct spill_run *run = &spill->runs[i];
+
+		run->buf = spill->buf + i * per_run;
+		run->buf_max = per_run;
+		ret = fill_run(spill, run);
+		if (ret < 0)
+			return ret;
+		spill->heap[spill->heap_nr++] = i;
+	}
+	for (unsigned int i = spill->heap_nr / 2; i > 0; i--)
+		heap_down(spill, i - 1);
+	return 0;
+}
+
+int extent_spill_next(struct extent_spill *spill,
+		      struct extent_spill_event *event)
+{
+	struct spill_run *run;
+	int ret;
+
+	UASSERT(spill->finished);
+	if (!spill->nr_runs) {
+		if (spill->buf_pos == spill->buf_nr)
+			return 1;
+		*event = spill->buf[spill->buf_pos++];
+		return 0;
+	}
+
+	if (!spill->heap_nr)
+		return 1;
+	run = &spill->runs[spill->heap[0]];
+	*event = run->buf[run->buf_pos++];
+	ret = fill_run(spill, run);
+	if (ret < 0)
+		return ret;
+	if (ret > 0)
+		spill->heap[0] = spill->heap[--spill->heap_nr];
+	if (spill->heap_nr)
+		heap_down(spill, 0);
+	return 0;
+}
@@ -0,0 +1,80 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_EXTENT_SPILL_H__
+#define __BTRFS_CHECK_EXTENT_SPILL_H__
+
+#include "kerncompat.h"
+
+/*
+ * External memory store of the data extent records of the original mode.
+ *
+ * Instead of building the records during the tree walk, the data extent items
+ * and data backrefs found are appended as events to a buffer of bounded size.
+ * A full buffer is sorted by bytenr and written as a run to an unlinked file
+ * in the scratch directory.  Once the walk is done the runs are merged and the
+ * events come back in bytenr order, so that the records can be built, verified
+ * and freed range by range.
+ *
+ * Events of the same bytenr are returned in the order they were added, the
+ * records end up the same as if they were built during the walk.
+ */
+
+enum extent_spill_type {
+	/* Data extent item, like process_extent_item() */
+	EXTENT_SPILL_EXTENT_ITEM,
+	/* Data backref, from the extent tree or a file extent */
+	EXTENT_SPILL_DATA_BACKREF,
+};
+
+struct extent_spill_event {
+	u64 bytenr;
+	/* Order of adding, keeps the events of the same bytenr stable */
+	u64 seq;
+	u64 parent;
+	u64 root;
+	u64 owner;
+	u64 offset;
+	/* Length of the extent item or the max_size of the backref */
+	u64 num_bytes;
+	u64 generation;
+	/* Refs of the extent item or the num_refs of the backref */
+	u64 refs;
+	u8 type;
+	u8 found_ref;
+};
+
+struct extent_spill;
+
+struct extent_spill *extent_spill_alloc(const char *tmpdir, u64 mem_limit);
+void extent_spill_free(struct extent_spill *spill);
+
+/*
+ * Errors of writing the runs are sticky, the callers can ignore them here
+ * and get them again from extent_spill_finish()
+ */
+int extent_spill_add(struct extent_spill *spill,
+		     const struct extent_spill_event *event);
+/* Stop adding events and start returning them in bytenr order */
+int extent_spill_finish(struct extent_spill *spill);
+/* Return 0 and the next event, 1 if there are no more or negative errno */
+int extent_spill_next(struct extent_spill *spill,
+		      struct extent_spill_event *event);
+
+/* Number of runs written to the scratch file so far */
+unsigned int extent_spill_nr_runs(const struct extent_spill *spill);
+
+#endif
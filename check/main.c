@@ -47,19 +47,24 @@
 #include "kernel-shared/ulist.h"
 #include "kernel-shared/file-item.h"
 #include "kernel-shared/tree-checker.h"
+#include "kernel-shared/free-space-tree.h"
 #include "common/defs.h"
 #include "common/extent-cache.h"
 #include "common/internal.h"
+#include "common/slab.h"
 #include "common/messages.h"
 #include "common/task-utils.h"
+#include "common/tree-prefetch.h"
 #include "common/device-utils.h"
 #include "common/utils.h"
 #include "common/rbtree-utils.h"
 #include "common/help.h"
 #include "common/open-utils.h"
 #include "common/string-utils.h"
+#include "common/units.h"
 #include "common/clear-cache.h"
 #include "common/root-tree-utils.h"
+#include "common/stats.h"
 #include "cmds/commands.h"
 #include "mkfs/common.h"
 #include "check/common.h"
@@ -68,6 +73,11 @@
 #include "check/mode-original.h"
 #include "check/mode-lowmem.h"
 #include "check/qgroup-verify.h"
+#include "check/extent-spill.h"
+#include "check/data-csum.h"
+#include "check/checkpoint.h"
+#include "check/metrics.h"
+#include "check/quick.h"
 
 /* Global context variables */
 struct btrfs_fs_info *gfs_info;
@@ -86,7 +96,41 @@ bool no_holes = false;
 bool is_free_space_tree = false;
 bool init_extent_tree = false;
 bool check_data_csum = false;
+/*
+ * Only the tree blocks written after this generation are checked, 0 checks
+ * everything, lowmem mode only
+ */
+u64 check_since_generation = 0;
+/* Progress saved by --checkpoint or --resume, NULL if not saved */
+struct check_checkpoint *check_checkpoint = NULL;
 static bool found_free_ino_cache = false;
+/*
+ * Asynchronous reads of the tree blocks queued in the extent tree pass and
+ * the fs tree walk, with this many threads, 0 for synchronous reads only
+ */
+struct tree_prefetch *tree_prefetch = NULL;
+static unsigned int check_threads = TREE_PREFETCH_DEFAULT_THREADS;
+/*
+ * Extent records and their backrefs, the bulk of the memory of the extent
+ * tree pass, all released at once at the end of the pass
+ */
+static struct object_slab extent_rec_slab;
+static struct object_slab tree_backref_slab;
+static struct object_slab data_backref_slab;
+/* Extent, backref and inode records allocated so far, for the metrics */
+static u64 records_allocated = 0;
+/* Metrics written by --metrics or --progress-fd, NULL if not written */
+static struct check_metrics *check_metrics = NULL;
+/*
+ * With a memory limit the data extent records are not kept during the extent
+ * tree pass but spilled to a scratch file in check_tmpdir, and verified in
+ * bytenr order after the walk
+ */
+static struct extent_spill *extent_spill = NULL;
+static u64 check_mem_limit = 0;
+static const char *check_tmpdir = NULL;
+/* Ranges of --check-data-csum verified in parallel, per device */
+static unsigned int csum_readers = DATA_CSUM_DEFAULT_READERS;
 struct cache_tree *roots_info_cache = NULL;
 
 enum btrfs_check_mode {
@@ -219,11 +263,13 @@ static void print_status_check_line(void *p)
 		"[7/7] checking quota groups                   ",
 	};
 	time_t elapsed;
+	time_t total;
 	int hours;
 	int minutes;
 	int seconds;
 
 	elapsed = time(NULL) - priv->start_time;
+	total = elapsed;
 	hours   = elapsed  / 3600;
 	elapsed -= hours   * 3600;
 	minutes = elapsed  / 60;
@@ -233,9 +279,20 @@ static void print_status_check_line(void *p)
 	printf("%s (%d:%02d:%02d elapsed", task_position_string[priv->tp],
 			hours, minutes, seconds);
 	if (priv->item_count > 0)
-		printf(", %llu items checked)\r", priv->item_count);
-	else
-		printf(")\r");
+		printf(", %llu items checked", priv->item_count);
+	if (priv->tp == TASK_CSUMS && priv->csum_bytes_total && total > 0) {
+		const u64 rate = priv->csum_bytes_done / total;
+
+		printf(", %s/s", pretty_size(rate));
+		if (rate && priv->csum_bytes_done < priv->csum_bytes_total) {
+			u64 eta = (priv->csum_bytes_total -
+				   priv->csum_bytes_done) / rate;
+
+			printf(", ETA %llu:%02llu:%02llu", eta / 3600,
+			       eta / 60 % 60, eta % 60);
+		}
+	}
+	printf(")\r");
 	fflush(stdout);
 }
 
@@ -759,6 +816,7 @@ static struct inode_record *get_inode_rec(struct cache_tree *inode_cache,
 		rec = calloc(1, sizeof(*rec));
 		if (!rec)
 			return ERR_PTR(-ENOMEM);
+		records_allocated++;
 		rec->ino = ino;
 		rec->extent_start = (u64)-1;
 		rec->refs = 1;
@@ -1436,7 +1494,8 @@ static int add_mismatch_dir_hash(struct inode_record *dir_rec,
 
 static int process_dir_item(struct extent_buffer *eb,
 			    int slot, struct btrfs_key *key,
-			    struct shared_node *active_node)
+			    struct shared_node *active_node,
+			    struct btrfs_leaf_name_hashes *names)
 {
 	u32 total;
 	u32 cur = 0;
@@ -1464,6 +1523,7 @@ static int process_dir_item(struct extent_buffer *eb,
 	di = btrfs_item_ptr(eb, slot, struct btrfs_dir_item);
 	total = btrfs_item_size(eb, slot);
 	while (cur < total) {
+		u32 name_hash;
 		int ret;
 
 		nritems++;
@@ -1488,8 +1548,12 @@ static int process_dir_item(struct extent_buffer *eb,
 
 		read_extent_buffer(eb, namebuf, (unsigned long)(di + 1), len);
 
+		/* The first name of the item is hashed with the rest of the leaf */
 		if (key->type == BTRFS_DIR_ITEM_KEY &&
-		    key->offset != btrfs_name_hash(namebuf, len)) {
+		    (cur > 0 || error ||
+		     !btrfs_leaf_name_hash(eb, names, slot, &name_hash)))
+			name_hash = btrfs_name_hash(namebuf, len);
+		if (key->type == BTRFS_DIR_ITEM_KEY && key->offset != name_hash) {
 			rec->errors |= I_ERR_MISMATCH_DIR_HASH;
 			ret = add_mismatch_dir_hash(rec, key, namebuf, len);
 			/* Fatal error, ENOMEM */
@@ -1801,8 +1865,9 @@ static int process_file_extent(struct btrfs_root *root,
 static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 			    struct walk_control *wc)
 {
+	struct btrfs_leaf_items *items = &wc->items;
+	struct btrfs_leaf_name_hashes names = { 0 };
 	struct btrfs_key key;
-	u32 nritems;
 	int i;
 	int ret = 0;
 	struct cache_tree *inode_cache;
@@ -1814,9 +1879,11 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 
 	active_node = wc->nodes[wc->active_node];
 	inode_cache = &active_node->inode_cache;
-	nritems = btrfs_header_nritems(eb);
-	for (i = 0; i < nritems; i++) {
-		btrfs_item_key_to_cpu(eb, &key, i);
+	ret = btrfs_leaf_items_decode(eb, items);
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < items->nr; i++) {
+		key = items->keys[i];
 
 		if (key.objectid == BTRFS_FREE_SPACE_OBJECTID)
 			continue;
@@ -1837,7 +1904,8 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 		switch (key.type) {
 		case BTRFS_DIR_ITEM_KEY:
 		case BTRFS_DIR_INDEX_KEY:
-			ret = process_dir_item(eb, i, &key, active_node);
+			ret = process_dir_item(eb, i, &key, active_node,
+					       &names);
 			break;
 		case BTRFS_INODE_REF_KEY:
 			ret = process_inode_ref(eb, i, &key, active_node);
@@ -1862,6 +1930,23 @@ static int process_one_leaf(struct btrfs_root *root, struct extent_buffer *eb,
 	return ret;
 }
 
+/*
+ * Queue the children of @node after @slot for reading into the page cache,
+ * once per node.  The child at @slot is read right away by the caller.
+ */
+static void prefetch_walk_down(struct walk_control *wc,
+			       struct extent_buffer *node, int slot, int level)
+{
+	u32 nritems = btrfs_header_nritems(node);
+
+	if (wc->prefetched[level] == node->start)
+		return;
+	wc->prefetched[level] = node->start;
+	for (int i = slot + 1; i < nritems; i++)
+		tree_prefetch_readahead(tree_prefetch,
+					btrfs_node_blockptr(node, i));
+}
+
 static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			  struct walk_control *wc, int *level,
 			  struct node_refs *nrefs)
@@ -1959,7 +2044,11 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			};
 
 			free_extent_buffer(next);
-			reada_walk_down(root, cur, path->slots[*level]);
+			if (tree_prefetch)
+				prefetch_walk_down(wc, cur, path->slots[*level],
+						   *level);
+			else
+				reada_walk_down(root, cur, path->slots[*level]);
 			next = read_tree_block(gfs_info, bytenr, &check);
 			if (!extent_buffer_uptodate(next)) {
 				struct btrfs_key node_key;
@@ -2181,7 +2270,7 @@ static int add_missing_dir_index(struct btrfs_root *root,
 	u32 data_size = sizeof(*dir_item) + backref->namelen;
 	int ret;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -2212,7 +2301,7 @@ static int add_missing_dir_index(struct btrfs_root *root,
 	write_extent_buffer(leaf, backref->name, name_ptr, backref->namelen);
 	btrfs_mark_buffer_dirty(leaf);
 	btrfs_release_path(&path);
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 
 	backref->found_dir_index = 1;
 	dir_rec = get_inode_rec(inode_cache, backref->dir, 0);
@@ -2237,7 +2326,7 @@ static int delete_dir_index(struct btrfs_root *root,
 	struct btrfs_path path = { 0 };
 	int ret = 0;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -2254,7 +2343,7 @@ static int delete_dir_index(struct btrfs_root *root,
 	if (IS_ERR(di)) {
 		ret = PTR_ERR(di);
 		btrfs_release_path(&path);
-		btrfs_commit_transaction(trans, root);
+		repair_trans_commit(trans, root);
 		if (ret == -ENOENT)
 			return 0;
 		return ret;
@@ -2266,7 +2355,7 @@ static int delete_dir_index(struct btrfs_root *root,
 		ret = btrfs_delete_one_dir_name(trans, root, &path, di);
 	BUG_ON(ret);
 	btrfs_release_path(&path);
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 	return ret;
 }
 
@@ -2279,7 +2368,7 @@ static int create_inode_item(struct btrfs_root *root,
 	u64 size = 0;
 	int ret;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -2303,7 +2392,7 @@ static int create_inode_item(struct btrfs_root *root,
 
 	ret = insert_inode_item(trans, root, rec->ino, size, rec->nbytes,
 				  nlink, mode);
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 	return 0;
 }
 
@@ -2384,7 +2473,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 			location.type = BTRFS_INODE_ITEM_KEY;
 			location.offset = 0;
 
-			trans = btrfs_start_transaction(root, 1);
+			trans = repair_trans_start(root, 1);
 			if (IS_ERR(trans)) {
 				ret = PTR_ERR(trans);
 				errno = -ret;
@@ -2399,7 +2488,7 @@ static int repair_inode_backrefs(struct btrfs_root *root,
 						    imode_to_type(rec->imode),
 						    backref->index);
 			BUG_ON(ret);
-			btrfs_commit_transaction(trans, root);
+			repair_trans_commit(trans, root);
 			repaired++;
 		}
 
@@ -3052,7 +3141,7 @@ static int try_repair_inode(struct btrfs_root *root, struct inode_record *rec)
 	 * 1 for the new inode_ref of the file
 	 * 2 for lost+found dir's dir_index and dir_item for the file
 	 */
-	trans = btrfs_start_transaction(root, 7);
+	trans = repair_trans_start(root, 7);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -3082,7 +3171,7 @@ static int try_repair_inode(struct btrfs_root *root, struct inode_record *rec)
 		ret = repair_unaligned_extent_recs(trans, root, &path, rec);
 	if (!ret && rec->errors & I_ERR_INVALID_GEN)
 		ret = repair_inode_gen_original(trans, root, &path, rec);
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 	btrfs_release_path(&path);
 	return ret;
 }
@@ -3174,7 +3263,7 @@ static int check_inode_recs(struct btrfs_root *root,
 		if (opt_check_repair) {
 			struct btrfs_trans_handle *trans;
 
-			trans = btrfs_start_transaction(root, 1);
+			trans = repair_trans_start(root, 1);
 			if (IS_ERR(trans)) {
 				ret = PTR_ERR(trans);
 				errno = -ret;
@@ -3188,11 +3277,11 @@ static int check_inode_recs(struct btrfs_root *root,
 			ret = btrfs_make_root_dir(trans, root, root_dirid);
 			if (ret < 0) {
 				btrfs_abort_transaction(trans, ret);
-				btrfs_commit_transaction(trans, root);
+				repair_trans_commit(trans, root);
 				return ret;
 			}
 
-			btrfs_commit_transaction(trans, root);
+			repair_trans_commit(trans, root);
 			return -EAGAIN;
 		}
 
@@ -3616,7 +3705,7 @@ static int repair_btree(struct btrfs_root *root,
 	if (cache_tree_empty(corrupt_blocks))
 		return 0;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -3674,7 +3763,7 @@ static int repair_btree(struct btrfs_root *root,
 		cache = next_cache_extent(cache);
 	}
 out:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 	btrfs_release_path(&path);
 	return ret;
 }
@@ -3873,8 +3962,10 @@ static int check_fs_roots(struct cache_tree *root_cache)
 	struct extent_buffer *leaf, *tree_node;
 	struct btrfs_root *tmp_root;
 	struct btrfs_root *tree_root = gfs_info->tree_root;
+	struct extent_buffer *reada_leaf = NULL;
 	u64 skip_root = 0;
 	int ret;
+	int ret2;
 	int err = 0;
 
 	/*
@@ -3886,6 +3977,13 @@ static int check_fs_roots(struct cache_tree *root_cache)
 	memset(&wc, 0, sizeof(wc));
 	cache_tree_init(&wc.shared);
 
+	/*
+	 * Only warm the page cache, the blocks are still read and verified by
+	 * the walk in the same order, so the reports don't change.
+	 */
+	if (!opt_check_repair && check_threads)
+		tree_prefetch = tree_prefetch_alloc(gfs_info, check_threads);
+
 again:
 	if (skip_root)
 		key.objectid = skip_root + 1;
@@ -3916,6 +4014,11 @@ again:
 			}
 			leaf = path.nodes[0];
 		}
+		/* The subvolumes of the leaf are read next, one by one */
+		if (leaf != reada_leaf) {
+			btrfs_readahead_root_nodes(leaf, path.slots[0], 0);
+			reada_leaf = leaf;
+		}
 		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
 		if (key.type == BTRFS_ROOT_ITEM_KEY &&
 		    fs_root_objectid(key.objectid)) {
@@ -3931,7 +4034,11 @@ again:
 				err = 1;
 				goto next;
 			}
+			repair_batch_begin();
 			ret = check_fs_root(tmp_root, root_cache, &wc);
+			ret2 = repair_batch_end();
+			if (ret2 < 0)
+				ret = ret2;
 			if (ret == -EAGAIN) {
 				free_root_recs_tree(root_cache);
 				btrfs_release_path(&path);
@@ -3972,6 +4079,9 @@ next:
 	}
 out:
 	btrfs_release_path(&path);
+	btrfs_leaf_items_release(&wc.items);
+	tree_prefetch_free(tree_prefetch);
+	tree_prefetch = NULL;
 	if (err)
 		free_extent_cache_tree(&wc.shared);
 	if (!cache_tree_empty(&wc.shared))
@@ -4044,10 +4154,15 @@ static int do_check_fs_roots(struct cache_tree *root_cache)
 {
 	int ret;
 
-	if (check_mode == CHECK_MODE_LOWMEM)
+	if (check_mode == CHECK_MODE_LOWMEM) {
+		if (!opt_check_repair && check_threads)
+			tree_prefetch = tree_prefetch_alloc(gfs_info, check_threads);
 		ret = check_fs_roots_lowmem();
-	else
+		tree_prefetch_free(tree_prefetch);
+		tree_prefetch = NULL;
+	} else {
 		ret = check_fs_roots(root_cache);
+	}
 
 	return ret;
 }
@@ -4217,11 +4332,28 @@ out:
 	return err;
 }
 
-static void __free_one_backref(struct rb_node *node)
+static struct extent_record *alloc_extent_record(void)
+{
+	records_allocated++;
+	return object_slab_zalloc(&extent_rec_slab);
+}
+
+static void free_extent_record(struct extent_record *rec)
 {
-	struct extent_backref *back = rb_node_to_extent_backref(node);
+	object_slab_free(&extent_rec_slab, rec);
+}
+
+static void free_extent_backref(struct extent_backref *back)
+{
+	if (back->is_data)
+		object_slab_free(&data_backref_slab, to_data_backref(back));
+	else
+		object_slab_free(&tree_backref_slab, to_tree_backref(back));
+}
 
-	free(back);
+static void __free_one_backref(struct rb_node *node)
+{
+	free_extent_backref(rb_node_to_extent_backref(node));
 }
 
 static void free_all_extent_backrefs(struct extent_record *rec)
@@ -4229,20 +4361,24 @@ static void free_all_extent_backrefs(struct extent_record *rec)
 	rb_free_nodes(&rec->backref_tree, __free_one_backref);
 }
 
-static void free_extent_record_cache(struct cache_tree *extent_cache)
+static void init_extent_record_slabs(void)
 {
-	struct cache_extent *cache;
-	struct extent_record *rec;
+	object_slab_init(&extent_rec_slab, sizeof(struct extent_record), SZ_16K);
+	object_slab_init(&tree_backref_slab, sizeof(struct tree_backref), SZ_16K);
+	object_slab_init(&data_backref_slab, sizeof(struct data_backref), SZ_16K);
+}
 
-	while (1) {
-		cache = first_cache_extent(extent_cache);
-		if (!cache)
-			break;
-		rec = container_of(cache, struct extent_record, cache);
-		remove_cache_extent(extent_cache, cache);
-		free_all_extent_backrefs(rec);
-		free(rec);
-	}
+/*
+ * Drop all the extent records and backrefs at once, including the duplicates
+ * still linked to the records.
+ */
+static void free_extent_record_cache(struct cache_tree *extent_cache)
+{
+	cache_tree_init(extent_cache);
+	INIT_LIST_HEAD(&duplicate_extents);
+	object_slab_release(&extent_rec_slab);
+	object_slab_release(&tree_backref_slab);
+	object_slab_release(&data_backref_slab);
 }
 
 static int maybe_free_extent_rec(struct cache_tree *extent_cache,
@@ -4260,7 +4396,7 @@ static int maybe_free_extent_rec(struct cache_tree *extent_cache,
 		remove_cache_extent(extent_cache, &rec->cache);
 		free_all_extent_backrefs(rec);
 		list_del_init(&rec->list);
-		free(rec);
+		free_extent_record(rec);
 	}
 	return 0;
 }
@@ -4698,11 +4834,11 @@ static int check_block(struct btrfs_root *root,
 static struct tree_backref *alloc_tree_backref(struct extent_record *rec,
 						u64 parent, u64 root)
 {
-	struct tree_backref *ref = malloc(sizeof(*ref));
+	struct tree_backref *ref = object_slab_zalloc(&tree_backref_slab);
 
 	if (!ref)
 		return NULL;
-	memset(&ref->node, 0, sizeof(ref->node));
+	records_allocated++;
 	if (parent > 0) {
 		ref->parent = parent;
 		ref->node.full_backref = 1;
@@ -4719,11 +4855,11 @@ static struct data_backref *alloc_data_backref(struct extent_record *rec,
 						u64 owner, u64 offset,
 						u64 max_size)
 {
-	struct data_backref *ref = malloc(sizeof(*ref));
+	struct data_backref *ref = object_slab_zalloc(&data_backref_slab);
 
 	if (!ref)
 		return NULL;
-	memset(ref, 0, sizeof(*ref));
+	records_allocated++;
 	ref->node.is_data = 1;
 
 	if (parent > 0) {
@@ -4806,7 +4942,7 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	int ret = 0;
 
 	BUG_ON(tmpl->max_size == 0);
-	rec = malloc(sizeof(*rec));
+	rec = alloc_extent_record();
 	if (!rec)
 		return -ENOMEM;
 	rec->start = tmpl->start;
@@ -4827,7 +4963,6 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	rec->parent_generation = tmpl->parent_generation;
 	rec->generation = tmpl->generation;
 	rec->level = tmpl->level;
-	INIT_LIST_HEAD(&rec->backrefs);
 	INIT_LIST_HEAD(&rec->dups);
 	INIT_LIST_HEAD(&rec->list);
 	rec->backref_tree = RB_ROOT;
@@ -4836,7 +4971,7 @@ static int add_extent_rec_nolookup(struct cache_tree *extent_cache,
 	rec->cache.size = tmpl->nr;
 	ret = insert_cache_extent(extent_cache, &rec->cache);
 	if (ret) {
-		free(rec);
+		free_extent_record(rec);
 		return ret;
 	}
 	bytes_used += rec->nr;
@@ -4894,7 +5029,7 @@ static int add_extent_rec(struct cache_tree *extent_cache,
 				 * our current extent record but does not have
 				 * the same objectid.
 				 */
-				tmp = malloc(sizeof(*tmp));
+				tmp = alloc_extent_record();
 				if (!tmp)
 					return -ENOMEM;
 				tmp->start = tmpl->start;
@@ -5023,9 +5158,9 @@ static int add_tree_backref(struct cache_tree *extent_cache, u64 bytenr,
 	return 0;
 }
 
-static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
-			    u64 parent, u64 root, u64 owner, u64 offset,
-			    u32 num_refs, u64 gen, int found_ref, u64 max_size)
+static int __add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
+			      u64 parent, u64 root, u64 owner, u64 offset,
+			      u32 num_refs, u64 gen, int found_ref, u64 max_size)
 {
 	struct extent_record *rec;
 	struct data_backref *back;
@@ -5113,6 +5248,49 @@ static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
 	return 0;
 }
 
+/*
+ * Whether the data extent record of [@bytenr, @bytenr + @len) goes to the
+ * spill file.  Anything that could end up in the same record as a tree block,
+ * which is a corruption, stays in memory so it's reported the same way.
+ */
+static bool spill_data_extent(struct cache_tree *extent_cache, u64 bytenr,
+			      u64 len)
+{
+	struct btrfs_block_group *bg;
+
+	if (!extent_spill)
+		return false;
+	bg = btrfs_lookup_block_group(gfs_info, bytenr);
+	if (!bg || (bg->flags & BTRFS_BLOCK_GROUP_TYPE_MASK) !=
+		   BTRFS_BLOCK_GROUP_DATA)
+		return false;
+	return !lookup_cache_extent(extent_cache, bytenr, len);
+}
+
+static int add_data_backref(struct cache_tree *extent_cache, u64 bytenr,
+			    u64 parent, u64 root, u64 owner, u64 offset,
+			    u32 num_refs, u64 gen, int found_ref, u64 max_size)
+{
+	struct extent_spill_event event = {
+		.type = EXTENT_SPILL_DATA_BACKREF,
+		.bytenr = bytenr,
+		.parent = parent,
+		.root = root,
+		.owner = owner,
+		.offset = offset,
+		.num_bytes = max_size,
+		.generation = gen,
+		.refs = num_refs,
+		.found_ref = found_ref,
+	};
+
+	if (!spill_data_extent(extent_cache, bytenr, 1))
+		return __add_data_backref(extent_cache, bytenr, parent, root,
+					  owner, offset, num_refs, gen,
+					  found_ref, max_size);
+	return extent_spill_add(extent_spill, &event);
+}
+
 static int add_pending(struct cache_tree *pending,
 		       struct cache_tree *seen, u64 bytenr, u32 size)
 {
@@ -5676,7 +5854,20 @@ static int process_extent_item(struct btrfs_root *root,
 	tmpl.found_rec = 1;
 	tmpl.max_size = num_bytes;
 	tmpl.generation = gen;
-	add_extent_rec(extent_cache, &tmpl);
+	if (!metadata && spill_data_extent(extent_cache, key.objectid, num_bytes)) {
+		struct extent_spill_event event = {
+			.type = EXTENT_SPILL_EXTENT_ITEM,
+			.bytenr = key.objectid,
+			.num_bytes = num_bytes,
+			.generation = gen,
+			.refs = refs,
+		};
+
+		/* Write errors are reported when reading the events back */
+		extent_spill_add(extent_spill, &event);
+	} else {
+		add_extent_rec(extent_cache, &tmpl);
+	}
 
 	ptr = (unsigned long)(ei + 1);
 	if (btrfs_extent_flags(eb, ei) & BTRFS_EXTENT_FLAG_TREE_BLOCK &&
@@ -5778,90 +5969,6 @@ out:
 	return 0;
 }
 
-/*
- * Check data checksum for [@bytenr, @bytenr + @num_bytes).
- *
- * Return <0 for fatal error (fails to read checksum/data or allocate memory).
- * Return >0 for csum mismatch for any copy.
- * Return 0 if everything is OK.
- */
-static int check_extent_csums(struct btrfs_root *root, u64 bytenr,
-			u64 num_bytes, unsigned long leaf_offset,
-			struct extent_buffer *eb)
-{
-	u64 offset = 0;
-	u16 csum_size = gfs_info->csum_size;
-	u16 csum_type = gfs_info->csum_type;
-	u8 *data;
-	unsigned long csum_offset;
-	u8 result[BTRFS_CSUM_SIZE];
-	u8 csum_expected[BTRFS_CSUM_SIZE];
-	u64 read_len;
-	u64 data_checked = 0;
-	u64 tmp;
-	int ret = 0;
-	int mirror;
-	int num_copies;
-	bool csum_mismatch = false;
-
-	if (num_bytes % gfs_info->sectorsize)
-		return -EINVAL;
-
-	data = malloc(num_bytes);
-	if (!data)
-		return -ENOMEM;
-
-	num_copies = btrfs_num_copies(gfs_info, bytenr, num_bytes);
-	while (offset < num_bytes) {
-		/*
-		 * Mirror 0 means 'read from any valid copy', so it's skipped.
-		 * The indexes 1-N represent the n-th copy for levels with
-		 * redundancy.
-		 */
-		for (mirror = 1; mirror <= num_copies; mirror++) {
-			read_len = num_bytes - offset;
-			/* read as much space once a time */
-			ret = read_data_from_disk(gfs_info, (char *)data + offset,
-					bytenr + offset, &read_len, mirror);
-			if (ret)
-				goto out;
-
-			data_checked = 0;
-			/* verify every 4k data's checksum */
-			while (data_checked < read_len) {
-				tmp = offset + data_checked;
-
-				btrfs_csum_data(csum_type, data + tmp,
-						result, gfs_info->sectorsize);
-
-				csum_offset = leaf_offset +
-					 tmp / gfs_info->sectorsize * csum_size;
-				read_extent_buffer(eb, (char *)&csum_expected,
-						   csum_offset, csum_size);
-				if (memcmp(result, csum_expected, csum_size) != 0) {
-					char found[BTRFS_CSUM_STRING_LEN];
-					char want[BTRFS_CSUM_STRING_LEN];
-
-					csum_mismatch = true;
-					btrfs_format_csum(csum_type, result, found);
-					btrfs_format_csum(csum_type,
-							  csum_expected, want);
-					fprintf(stderr,
-				"mirror %d bytenr %llu csum %s expected csum %s\n",
-						mirror, bytenr + tmp, found, want);
-				}
-				data_checked += gfs_info->sectorsize;
-			}
-		}
-		offset += read_len;
-	}
-out:
-	free(data);
-	if (!ret && csum_mismatch)
-		ret = 1;
-	return ret;
-}
-
 static int check_extent_exists(struct btrfs_root *root, u64 bytenr,
 			       u64 num_bytes)
 {
@@ -6004,6 +6111,165 @@ out:
 	return ret;
 }
 
+/*
+ * Cursor in the extent tree following the csum tree, the ranges of the csum
+ * items are checked in ascending order so the extent items covering them are
+ * found by walking forward instead of searching from the root each time.
+ */
+struct csum_extent_cursor {
+	struct btrfs_path path;
+	/* The extent items before the cursor all end at or before this bytenr */
+	u64 pos;
+};
+
+/*
+ * Position the cursor at the last extent item starting before @bytenr, or at
+ * the first item after it if there's none.
+ */
+static int csum_extent_cursor_seek(struct csum_extent_cursor *cursor,
+				   u64 bytenr)
+{
+	struct btrfs_root *extent_root = btrfs_extent_root(gfs_info, bytenr);
+	struct btrfs_path *path = &cursor->path;
+	struct btrfs_key key;
+	int ret;
+
+	btrfs_release_path(path);
+	key.objectid = bytenr;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
+	if (ret < 0) {
+		fprintf(stderr, "Error looking up extent record %d\n", ret);
+		return ret;
+	}
+	/*
+	 * An extent covering @bytenr can only start at or before it, go back to
+	 * the last extent or tree block item before it.  The block group and
+	 * keyed ref items before @bytenr come after the item of their extent.
+	 */
+	while (1) {
+		if (path->slots[0] > 0) {
+			path->slots[0]--;
+		} else {
+			ret = btrfs_prev_leaf(extent_root, path);
+			if (ret < 0)
+				return ret;
+			if (ret > 0) {
+				/* Nothing before, stay at the first item */
+				btrfs_release_path(path);
+				key.objectid = 0;
+				key.type = 0;
+				key.offset = 0;
+				ret = btrfs_search_slot(NULL, extent_root, &key,
+							path, 0, 0);
+				return ret < 0 ? ret : 0;
+			}
+		}
+		btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+		if (key.objectid < bytenr &&
+		    (key.type == BTRFS_EXTENT_ITEM_KEY ||
+		     key.type == BTRFS_METADATA_ITEM_KEY))
+			break;
+	}
+	cursor->pos = max(cursor->pos, key.objectid);
+	return 0;
+}
+
+/*
+ * Check that the csum range @bytenr, @num_bytes is covered by extent items,
+ * the ranges must be passed in ascending order, otherwise they're looked up
+ * by check_extent_exists().
+ */
+static int csum_extent_cursor_check(struct csum_extent_cursor *cursor,
+				    u64 bytenr, u64 num_bytes)
+{
+	struct btrfs_root *extent_root = btrfs_extent_root(gfs_info, bytenr);
+	struct btrfs_path *path = &cursor->path;
+	struct extent_buffer *leaf = path->nodes[0];
+	const u64 end = bytenr + num_bytes;
+	struct btrfs_key key;
+	int missing = 0;
+	int ret;
+
+	if (btrfs_fs_incompat(gfs_info, EXTENT_TREE_V2) || bytenr < cursor->pos)
+		return check_extent_exists(extent_root, bytenr, num_bytes);
+
+	/* Search instead of walking the leaves between the ranges */
+	if (leaf && btrfs_header_nritems(leaf)) {
+		btrfs_item_key_to_cpu(leaf, &key, btrfs_header_nritems(leaf) - 1);
+		if (key.objectid < bytenr)
+			leaf = NULL;
+	}
+	if (!leaf || !btrfs_header_nritems(leaf)) {
+		ret = csum_extent_cursor_seek(cursor, bytenr);
+		if (ret < 0)
+			return ret;
+	}
+
+	while (bytenr < end) {
+		if (path->slots[0] >= btrfs_header_nritems(path->nodes[0])) {
+			ret = btrfs_next_leaf(extent_root, path);
+			if (ret < 0) {
+				fprintf(stderr, "Error going to next leaf %d\n",
+					ret);
+				return ret;
+			}
+			if (ret)
+				break;
+		}
+		btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+		if (key.type != BTRFS_EXTENT_ITEM_KEY) {
+			path->slots[0]++;
+			continue;
+		}
+		if (key.objectid + key.offset <= bytenr) {
+			cursor->pos = max(cursor->pos, key.objectid + key.offset);
+			path->slots[0]++;
+			continue;
+		}
+		if (key.objectid >= end)
+			break;
+		if (key.objectid > bytenr) {
+			fprintf(stderr,
+				"there are no extents for csum range %llu-%llu\n",
+				bytenr, key.objectid);
+			missing = 1;
+		}
+		bytenr = key.objectid + key.offset;
+		/* Stay at an extent reaching into the next range */
+		if (bytenr > end)
+			break;
+		cursor->pos = bytenr;
+		path->slots[0]++;
+	}
+
+	if (bytenr < end) {
+		fprintf(stderr,
+			"there are no extents for csum range %llu-%llu\n",
+			bytenr, end);
+		missing = 1;
+	}
+	return missing;
+}
+
+/*
+ * Report the result of a range verified by the pool, in the order the ranges
+ * were submitted
+ */
+static int retire_csum_job(struct data_csum_job *job, int *errors)
+{
+	int ret = job->ret;
+
+	if (job->report_len)
+		fwrite(job->report, 1, job->report_len, stderr);
+	if (ret > 0)
+		(*errors)++;
+	g_task_ctx.csum_bytes_done += job->num_bytes;
+	data_csum_job_free(job);
+	return ret;
+}
+
 static int check_csum_root(struct btrfs_root *root)
 {
 	struct btrfs_path path = { 0 };
@@ -6018,6 +6284,11 @@ static int check_csum_root(struct btrfs_root *root)
 	unsigned long leaf_offset;
 	bool verify_csum = check_data_csum;
 	u16 num_entries, max_entries;
+	struct data_csum_pool *pool = NULL;
+	struct data_csum_job *job;
+	struct csum_extent_cursor extent_cursor = { 0 };
+	u8 *csums = NULL;
+	bool csum_fatal = false;
 
 	max_entries = ((BTRFS_LEAF_DATA_SIZE(gfs_info) -
 			(sizeof(struct btrfs_item) * 2)) / csum_size) - 1;
@@ -6050,6 +6321,14 @@ static int check_csum_root(struct btrfs_root *root)
 		printf("skip data csum verification for metadata dump\n");
 		verify_csum = false;
 	}
+	if (verify_csum) {
+		csums = malloc(BTRFS_LEAF_DATA_SIZE(gfs_info));
+		if (!csums) {
+			btrfs_release_path(&path);
+			return -ENOMEM;
+		}
+		pool = data_csum_pool_alloc(gfs_info, csum_readers);
+	}
 
 	while (1) {
 		g_task_ctx.item_count++;
@@ -6092,8 +6371,32 @@ static int check_csum_root(struct btrfs_root *root)
 		if (!verify_csum)
 			goto skip_csum_check;
 		leaf_offset = btrfs_item_ptr_offset(leaf, path.slots[0]);
-		ret = check_extent_csums(root, key.offset, data_len,
-					 leaf_offset, leaf);
+		read_extent_buffer(leaf, csums, leaf_offset,
+				   num_entries * csum_size);
+		if (pool) {
+			/*
+			 * Keep the amount of ranges in flight bounded, and print
+			 * the reports of the finished ones as soon as possible.
+			 */
+			ret = 0;
+			while (ret >= 0 && data_csum_pool_full(pool))
+				ret = retire_csum_job(data_csum_pool_reap(pool, true),
+						      &errors);
+			while (ret >= 0 && (job = data_csum_pool_reap(pool, false)))
+				ret = retire_csum_job(job, &errors);
+			if (ret < 0) {
+				csum_fatal = true;
+				break;
+			}
+			ret = data_csum_pool_submit(pool, key.offset, data_len,
+						    csums);
+			if (ret < 0)
+				break;
+			goto skip_csum_check;
+		}
+		ret = data_csum_verify(gfs_info, key.offset, data_len, csums,
+				       stderr);
+		g_task_ctx.csum_bytes_done += data_len;
 		/*
 		 * Only break for fatal errors, if mismatch is found, continue
 		 * checking until all extents are checked.
@@ -6106,7 +6409,8 @@ skip_csum_check:
 		if (!num_bytes) {
 			offset = key.offset;
 		} else if (key.offset != offset + num_bytes) {
-			ret = check_extent_exists(root, offset, num_bytes);
+			ret = csum_extent_cursor_check(&extent_cursor, offset,
+						       num_bytes);
 			if (ret) {
 				fprintf(stderr,
 		"csum exists for %llu-%llu but there is no extent record\n",
@@ -6121,6 +6425,16 @@ skip_csum_check:
 		path.slots[0]++;
 	}
 
+	/* Like with the synchronous reads, nothing is reported after a fatal error */
+	if (pool && !csum_fatal) {
+		while ((job = data_csum_pool_reap(pool, true))) {
+			if (retire_csum_job(job, &errors) < 0)
+				break;
+		}
+	}
+	data_csum_pool_free(pool);
+	free(csums);
+	btrfs_release_path(&extent_cursor.path);
 	btrfs_release_path(&path);
 	return errors;
 }
@@ -6131,6 +6445,10 @@ static int check_csums(void)
 	struct btrfs_root *root;
 	int ret;
 
+	/* Data bytes covered by the checksums, for the progress */
+	g_task_ctx.csum_bytes_done = 0;
+	g_task_ctx.csum_bytes_total = total_csum_bytes / gfs_info->csum_size *
+				      gfs_info->sectorsize;
 	root = btrfs_csum_root(gfs_info, 0);
 	while (1) {
 		ret = check_csum_root(root);
@@ -6339,7 +6657,11 @@ static int run_next_block(struct btrfs_root *root,
 				continue;
 
 			/* fixme, get the parent transid */
-			readahead_tree_block(gfs_info, bits[i].start, 0);
+			if (tree_prefetch)
+				tree_prefetch_submit(tree_prefetch,
+						     bits[i].start, 0);
+			else
+				readahead_tree_block(gfs_info, bits[i].start, 0);
 		}
 	}
 	*last = bits[0].start;
@@ -6369,6 +6691,8 @@ static int run_next_block(struct btrfs_root *root,
 
 	/* fixme, get the real parent transid */
 	check.transid = gen;
+	if (tree_prefetch)
+		tree_prefetch_wait(tree_prefetch, bytenr);
 	buf = read_tree_block(gfs_info, bytenr, &check);
 	if (!extent_buffer_uptodate(buf)) {
 		record_bad_block_io(extent_cache, bytenr, size);
@@ -6759,7 +7083,7 @@ static int free_extent_hook(u64 bytenr, u64 num_bytes, u64 parent,
 
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	} else {
 		struct tree_backref *back;
@@ -6779,7 +7103,7 @@ static int free_extent_hook(u64 bytenr, u64 num_bytes, u64 parent,
 		}
 		if (!back->node.found_extent_tree && back->node.found_ref) {
 			rb_erase(&back->node.node, &rec->backref_tree);
-			free(back);
+			free_extent_backref(&back->node);
 		}
 	}
 	maybe_free_extent_rec(extent_cache, rec);
@@ -6787,9 +7111,13 @@ out:
 	return 0;
 }
 
+/*
+ * Delete the extent item and the backrefs of the extent at @bytenr, the bytes
+ * of the deleted extent item are added to @freed.
+ */
 static int delete_extent_records(struct btrfs_trans_handle *trans,
 				 struct btrfs_path *path,
-				 u64 bytenr)
+				 u64 bytenr, u64 *freed)
 {
 	struct btrfs_root *extent_root = btrfs_extent_root(gfs_info, bytenr);
 	struct btrfs_key key;
@@ -6861,6 +7189,7 @@ static int delete_extent_records(struct btrfs_trans_handle *trans,
 						       0, 0);
 			if (ret)
 				break;
+			*freed += bytes;
 		}
 	}
 
@@ -7423,7 +7752,7 @@ static int process_duplicates(struct cache_tree *extent_cache,
 
 	good = to_extent_record(rec->dups.next);
 	list_del_init(&good->list);
-	INIT_LIST_HEAD(&good->backrefs);
+	good->backref_tree = RB_ROOT;
 	INIT_LIST_HEAD(&good->dups);
 	good->cache.start = good->start;
 	good->cache.size = good->nr;
@@ -7431,7 +7760,6 @@ static int process_duplicates(struct cache_tree *extent_cache,
 	good->owner_ref_checked = 0;
 	good->num_duplicates = 0;
 	good->refs = rec->refs;
-	list_splice_init(&rec->backrefs, &good->backrefs);
 	while (1) {
 		cache = lookup_cache_extent(extent_cache, good->start,
 					    good->nr);
@@ -7461,13 +7789,12 @@ static int process_duplicates(struct cache_tree *extent_cache,
 		 * just add it to this extent and carry on like we did above.
 		 */
 		good->refs += tmp->refs;
-		list_splice_init(&tmp->backrefs, &good->backrefs);
 		remove_cache_extent(extent_cache, &tmp->cache);
-		free(tmp);
+		free_extent_record(tmp);
 	}
 	ret = insert_cache_extent(extent_cache, &good->cache);
 	BUG_ON(ret);
-	free(rec);
+	free_extent_record(rec);
 	return good->num_duplicates ? 0 : 1;
 }
 
@@ -7553,13 +7880,13 @@ out:
 		list_del_init(&tmp->list);
 		if (tmp == rec)
 			continue;
-		free(tmp);
+		free_extent_record(tmp);
 	}
 
 	while (!list_empty(&rec->dups)) {
 		tmp = to_extent_record(rec->dups.next);
 		list_del_init(&tmp->list);
-		free(tmp);
+		free_extent_record(tmp);
 	}
 
 	btrfs_release_path(&path);
@@ -7745,6 +8072,7 @@ static int fixup_extent_refs(struct cache_tree *extent_cache,
 	struct extent_backref *back, *tmp;
 	int allocated = 0;
 	u64 flags = 0;
+	u64 freed = 0;
 
 	if (rec->flag_block_full_backref)
 		flags |= BTRFS_BLOCK_FLAG_FULL_BACKREF;
@@ -7776,7 +8104,7 @@ static int fixup_extent_refs(struct cache_tree *extent_cache,
 	}
 
 	/* step two, delete all the existing records */
-	ret = delete_extent_records(trans, &path, rec->start);
+	ret = delete_extent_records(trans, &path, rec->start, &freed);
 
 	if (ret < 0)
 		goto out;
@@ -7806,6 +8134,14 @@ static int fixup_extent_refs(struct cache_tree *extent_cache,
 		if (ret)
 			goto out;
 	}
+
+	/*
+	 * No reference was found, the extent is now free and its space must be
+	 * given back to the free space tree, or allocating it again fails.
+	 */
+	if (!allocated && freed &&
+	    btrfs_fs_compat_ro(gfs_info, FREE_SPACE_TREE))
+		ret = add_to_free_space_tree(trans, rec->start, freed);
 out:
 	if (!ret && !IS_ERR(trans)) {
 		int err = btrfs_commit_transaction(trans, gfs_info->tree_root);
@@ -7821,25 +8157,344 @@ out:
 	return ret;
 }
 
-static int fixup_extent_flags(struct extent_record *rec)
+/*
+ * An inline backref of an extent item rebuilt by bulk_rebuild_extent_items(),
+ * sorted like the kernel keeps them: by type, then by descending hash of the
+ * data refs or descending offset of the other types.
+ */
+struct rebuilt_ref {
+	u8 type;
+	u64 order;
+	struct extent_backref *back;
+};
+
+static int compare_rebuilt_ref(const void *a, const void *b)
 {
-	struct btrfs_trans_handle *trans;
-	struct btrfs_root *root = btrfs_extent_root(gfs_info, rec->start);
-	struct btrfs_path path = { 0 };
-	struct btrfs_extent_item *ei;
-	struct btrfs_key key;
-	u64 flags;
-	int ret = 0;
-	bool metadata_item = rec->metadata;
+	const struct rebuilt_ref *ref1 = a;
+	const struct rebuilt_ref *ref2 = b;
 
-	if (!btrfs_fs_incompat(gfs_info, SKINNY_METADATA))
-		metadata_item = false;
-retry:
-	key.objectid = rec->start;
-	if (metadata_item) {
-		key.type = BTRFS_METADATA_ITEM_KEY;
-		key.offset = rec->info_level;
-	} else {
+	if (ref1->type != ref2->type)
+		return ref1->type < ref2->type ? -1 : 1;
+	if (ref1->order != ref2->order)
+		return ref1->order > ref2->order ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Collect the refs of @rec into @refs if its extent item can be built at once
+ * with all of them inline, exactly as fixup_extent_refs() would build it ref
+ * by ref.  Records with any other problem than the missing extent item are
+ * left to fixup_extent_refs().
+ *
+ * Return the number of refs, 0 if the record can't be rebuilt this way.
+ */
+static int collect_rebuilt_refs(struct btrfs_root *extent_root,
+				struct extent_record *rec,
+				struct rebuilt_ref *refs, u32 *item_size_ret)
+{
+	const u64 super_gen = btrfs_super_generation(gfs_info->super_copy);
+	const u32 max_item_size = BTRFS_MAX_EXTENT_ITEM_SIZE(extent_root);
+	struct extent_backref *back, *tmp;
+	u32 item_size = sizeof(struct btrfs_extent_item);
+	int nr = 0;
+	int i;
+
+	if (rec->found_rec || rec->extent_item_refs || rec->num_duplicates ||
+	    rec->generation > super_gen + 1 ||
+	    (rec->metadata && rec->level != rec->info_level) ||
+	    rec->crossing_stripes || rec->wrong_chunk_type ||
+	    !IS_ALIGNED(rec->start, gfs_info->sectorsize))
+		return 0;
+	if (!rec->metadata && rec->nr != rec->max_size)
+		return 0;
+	if (lookup_cache_extent(gfs_info->corrupt_blocks, rec->start,
+				rec->max_size))
+		return 0;
+
+	if (rec->metadata)
+		item_size += sizeof(struct btrfs_tree_block_info);
+
+	rbtree_postorder_for_each_entry_safe(back, tmp,
+					     &rec->backref_tree, node) {
+		struct rebuilt_ref *ref = &refs[nr];
+
+		if (!back->found_ref || back->found_extent_tree ||
+		    back->broken || back->is_data == rec->metadata)
+			return 0;
+
+		if (back->is_data) {
+			struct data_backref *dback = to_data_backref(back);
+
+			if (!dback->found_ref)
+				return 0;
+			if (back->full_backref) {
+				if (!dback->parent)
+					return 0;
+				ref->type = BTRFS_SHARED_DATA_REF_KEY;
+				ref->order = dback->parent;
+			} else {
+				if (dback->disk_bytenr != rec->start ||
+				    dback->bytes != rec->nr ||
+				    dback->owner < BTRFS_FIRST_FREE_OBJECTID)
+					return 0;
+				ref->type = BTRFS_EXTENT_DATA_REF_KEY;
+				ref->order = hash_extent_data_ref(dback->root,
+						dback->owner, dback->offset);
+			}
+		} else {
+			struct tree_backref *tback = to_tree_backref(back);
+
+			if (back->full_backref) {
+				if (!tback->parent)
+					return 0;
+				ref->type = BTRFS_SHARED_BLOCK_REF_KEY;
+			} else {
+				ref->type = BTRFS_TREE_BLOCK_REF_KEY;
+			}
+			/* parent and root are a union */
+			ref->order = tback->parent;
+		}
+		ref->back = back;
+
+		/* The refs that don't fit inline would go to separate items */
+		item_size += btrfs_extent_inline_ref_size(ref->type);
+		if (item_size >= max_item_size)
+			return 0;
+		nr++;
+	}
+	if (!nr)
+		return 0;
+
+	/* Equal hashes of data refs depend on the order the refs were added */
+	qsort(refs, nr, sizeof(*refs), compare_rebuilt_ref);
+	for (i = 1; i < nr; i++) {
+		if (compare_rebuilt_ref(&refs[i - 1], &refs[i]) == 0)
+			return 0;
+	}
+	*item_size_ret = item_size;
+	return nr;
+}
+
+static int bulk_add_extent_item(struct btrfs_bulk_loader *loader,
+				struct extent_record *rec,
+				const struct rebuilt_ref *refs, int nr,
+				u32 item_size, const void *zeros)
+{
+	struct extent_buffer *leaf;
+	struct btrfs_extent_item *ei;
+	struct btrfs_key key;
+	unsigned long ptr;
+	u64 total_refs = 0;
+	int ret;
+	int i;
+
+	if (rec->metadata)
+		rec->max_size = max_t(u64, rec->max_size, gfs_info->nodesize);
+
+	key.objectid = rec->start;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = rec->max_size;
+	ret = btrfs_bulk_loader_add(loader, &key, zeros, item_size);
+	if (ret < 0)
+		return ret;
+
+	leaf = loader->path.nodes[0];
+	ei = btrfs_item_ptr(leaf, loader->path.slots[0], struct btrfs_extent_item);
+	if (rec->generation)
+		btrfs_set_extent_generation(leaf, ei, rec->generation);
+	else
+		btrfs_set_extent_generation(leaf, ei, loader->trans->transid);
+
+	ptr = (unsigned long)(ei + 1);
+	if (rec->metadata) {
+		struct btrfs_tree_block_info *bi;
+		struct btrfs_disk_key copy_key;
+		u64 flags = BTRFS_EXTENT_FLAG_TREE_BLOCK;
+
+		if (rec->flag_block_full_backref)
+			flags |= BTRFS_BLOCK_FLAG_FULL_BACKREF;
+
+		bi = (struct btrfs_tree_block_info *)ptr;
+		btrfs_set_disk_key_objectid(&copy_key, rec->info_objectid);
+		btrfs_set_disk_key_type(&copy_key, 0);
+		btrfs_set_disk_key_offset(&copy_key, 0);
+		btrfs_set_tree_block_level(leaf, bi, rec->info_level);
+		btrfs_set_tree_block_key(leaf, bi, &copy_key);
+		btrfs_set_extent_flags(leaf, ei, flags);
+		ptr += sizeof(*bi);
+	} else {
+		btrfs_set_extent_flags(leaf, ei, BTRFS_EXTENT_FLAG_DATA);
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct btrfs_extent_inline_ref *iref;
+
+		iref = (struct btrfs_extent_inline_ref *)ptr;
+		btrfs_set_extent_inline_ref_type(leaf, iref, refs[i].type);
+		if (refs[i].type == BTRFS_EXTENT_DATA_REF_KEY) {
+			struct data_backref *dback = to_data_backref(refs[i].back);
+			struct btrfs_extent_data_ref *dref;
+
+			dref = (struct btrfs_extent_data_ref *)(&iref->offset);
+			btrfs_set_extent_data_ref_root(leaf, dref, dback->root);
+			btrfs_set_extent_data_ref_objectid(leaf, dref, dback->owner);
+			btrfs_set_extent_data_ref_offset(leaf, dref, dback->offset);
+			btrfs_set_extent_data_ref_count(leaf, dref, dback->found_ref);
+			total_refs += dback->found_ref;
+		} else if (refs[i].type == BTRFS_SHARED_DATA_REF_KEY) {
+			struct data_backref *dback = to_data_backref(refs[i].back);
+			struct btrfs_shared_data_ref *sref;
+
+			sref = (struct btrfs_shared_data_ref *)(iref + 1);
+			btrfs_set_shared_data_ref_count(leaf, sref, dback->found_ref);
+			btrfs_set_extent_inline_ref_offset(leaf, iref, dback->parent);
+			total_refs += dback->found_ref;
+		} else {
+			btrfs_set_extent_inline_ref_offset(leaf, iref, refs[i].order);
+			total_refs++;
+		}
+		ptr += btrfs_extent_inline_ref_size(refs[i].type);
+	}
+	btrfs_set_extent_refs(leaf, ei, total_refs);
+	btrfs_mark_buffer_dirty(leaf);
+
+	return btrfs_update_block_group(loader->trans, rec->start,
+					rec->max_size, 1, 0);
+}
+
+/*
+ * Rebuild the extent items of --init-extent-tree before the records are
+ * checked one by one.
+ *
+ * The new extent tree is empty, besides the block group items, and each
+ * record would go through fixup_extent_refs(), one transaction and a search
+ * for each of its refs.  Instead the items of the records whose refs agree
+ * are built at once and appended in bytenr order by the bulk loader, in
+ * transactions of up to repair_batch_bytes of new tree blocks.  The rebuilt
+ * records are dropped, the others are repaired by check_extent_refs().
+ */
+static int bulk_rebuild_extent_items(struct cache_tree *extent_cache)
+{
+	const u32 max_item_size =
+		BTRFS_MAX_EXTENT_ITEM_SIZE(btrfs_extent_root(gfs_info, 0));
+	struct btrfs_bulk_loader loader = { 0 };
+	struct btrfs_root *loader_root = NULL;
+	struct btrfs_trans_handle *trans;
+	struct rebuilt_ref *refs;
+	struct cache_extent *cache;
+	struct cache_extent *next;
+	void *zeros;
+	u64 rebuilt = 0;
+	int ret = 0;
+
+	refs = calloc(max_item_size / sizeof(struct btrfs_extent_inline_ref),
+		      sizeof(*refs));
+	zeros = calloc(1, max_item_size);
+	if (!refs || !zeros) {
+		free(refs);
+		free(zeros);
+		return -ENOMEM;
+	}
+
+	trans = btrfs_start_transaction(gfs_info->tree_root, 1);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		errno = -ret;
+		error_msg(ERROR_MSG_START_TRANS, "%m");
+		goto out;
+	}
+
+	for (cache = search_cache_extent(extent_cache, 0); cache; cache = next) {
+		struct extent_record *rec;
+		struct btrfs_root *root;
+		u32 item_size;
+		int nr;
+
+		next = next_cache_extent(cache);
+		rec = container_of(cache, struct extent_record, cache);
+		root = btrfs_extent_root(gfs_info, rec->start);
+		nr = collect_rebuilt_refs(root, rec, refs, &item_size);
+		if (!nr)
+			continue;
+
+		if (root != loader_root) {
+			btrfs_bulk_loader_release(&loader);
+			btrfs_bulk_loader_init(&loader, trans, root, 100);
+			loader_root = root;
+		}
+		ret = bulk_add_extent_item(&loader, rec, refs, nr, item_size,
+					   zeros);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to rebuild extent item for %llu: %m",
+			      rec->start);
+			break;
+		}
+		rebuilt++;
+		remove_cache_extent(extent_cache, cache);
+		free_all_extent_backrefs(rec);
+		free_extent_record(rec);
+
+		if ((u64)trans->blocks_used * gfs_info->nodesize <
+		    repair_batch_bytes)
+			continue;
+
+		btrfs_bulk_loader_release(&loader);
+		loader_root = NULL;
+		ret = btrfs_commit_transaction(trans, gfs_info->tree_root);
+		if (ret < 0) {
+			errno = -ret;
+			error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+			goto out;
+		}
+		trans = btrfs_start_transaction(gfs_info->tree_root, 1);
+		if (IS_ERR(trans)) {
+			ret = PTR_ERR(trans);
+			errno = -ret;
+			error_msg(ERROR_MSG_START_TRANS, "%m");
+			goto out;
+		}
+	}
+	btrfs_bulk_loader_release(&loader);
+	if (ret < 0) {
+		btrfs_abort_transaction(trans, ret);
+		btrfs_commit_transaction(trans, gfs_info->tree_root);
+		goto out;
+	}
+	ret = btrfs_commit_transaction(trans, gfs_info->tree_root);
+	if (ret < 0) {
+		errno = -ret;
+		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+		goto out;
+	}
+	if (rebuilt)
+		fprintf(stderr, "Rebuilt %llu extent items with their references\n",
+			rebuilt);
+out:
+	free(refs);
+	free(zeros);
+	return ret;
+}
+
+static int fixup_extent_flags(struct extent_record *rec)
+{
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root = btrfs_extent_root(gfs_info, rec->start);
+	struct btrfs_path path = { 0 };
+	struct btrfs_extent_item *ei;
+	struct btrfs_key key;
+	u64 flags;
+	int ret = 0;
+	bool metadata_item = rec->metadata;
+
+	if (!btrfs_fs_incompat(gfs_info, SKINNY_METADATA))
+		metadata_item = false;
+retry:
+	key.objectid = rec->start;
+	if (metadata_item) {
+		key.type = BTRFS_METADATA_ITEM_KEY;
+		key.offset = rec->info_level;
+	} else {
 		key.type = BTRFS_EXTENT_ITEM_KEY;
 		key.offset = rec->max_size;
 	}
@@ -8214,6 +8869,12 @@ static int check_extent_refs(struct btrfs_root *root,
 	if (had_dups)
 		return -EAGAIN;
 
+	if (opt_check_repair && init_extent_tree) {
+		ret = bulk_rebuild_extent_items(extent_cache);
+		if (ret < 0)
+			goto repair_abort;
+	}
+
 	super_gen = btrfs_super_generation(gfs_info->super_copy);
 	while (1) {
 		int cur_err = 0;
@@ -8330,7 +8991,7 @@ next:
 					   rec->start,
 					   rec->start + rec->max_size - 1,
 					   NULL);
-		free(rec);
+		free_extent_record(rec);
 	}
 repair_abort:
 	if (opt_check_repair) {
@@ -8367,20 +9028,222 @@ repair_abort:
 }
 
 /*
- * Check the chunk with its block group/dev list ref:
+ * Complete spilled records verified at once, each check_extent_refs() call
+ * goes through all the block groups
+ */
+#define EXTENT_SPILL_CHECK_BATCH	(8192)
+
+static void drop_extent_records(struct cache_tree *extent_cache)
+{
+	struct cache_extent *cache;
+
+	while ((cache = search_cache_extent(extent_cache, 0))) {
+		struct extent_record *rec;
+
+		rec = container_of(cache, struct extent_record, cache);
+		remove_cache_extent(extent_cache, cache);
+		free_all_extent_backrefs(rec);
+		list_del_init(&rec->list);
+		free_extent_record(rec);
+	}
+}
+
+static void replay_spilled_event(struct cache_tree *extent_cache,
+				 const struct extent_spill_event *event)
+{
+	struct extent_record tmpl;
+
+	switch (event->type) {
+	case EXTENT_SPILL_EXTENT_ITEM:
+		memset(&tmpl, 0, sizeof(tmpl));
+		tmpl.start = event->bytenr;
+		tmpl.nr = event->num_bytes;
+		tmpl.extent_item_refs = event->refs;
+		tmpl.found_rec = 1;
+		tmpl.max_size = event->num_bytes;
+		tmpl.generation = event->generation;
+		add_extent_rec(extent_cache, &tmpl);
+		break;
+	case EXTENT_SPILL_DATA_BACKREF:
+		__add_data_backref(extent_cache, event->bytenr, event->parent,
+				   event->root, event->owner, event->offset,
+				   event->refs, event->generation,
+				   event->found_ref, event->num_bytes);
+		break;
+	default:
+		BUG();
+	}
+}
+
+/*
+ * Build the data extent records from the events spilled during the tree walk
+ * and check them like check_extent_refs() does for the records in memory.
+ *
+ * The events come in bytenr order, a record that ends before the next event
+ * can't get any more backrefs, so only the records around the current bytenr
+ * are kept and the complete ones are verified in batches.
+ *
+ * Without @verify the records are only built and dropped, for the accounting
+ * when the tree walk did not finish.
+ */
+static int check_spilled_extent_refs(struct btrfs_root *root, bool verify)
+{
+	struct extent_spill_event event;
+	struct cache_tree live;
+	struct cache_tree ready;
+	unsigned int nr_ready = 0;
+	int err = 0;
+	int ret;
+
+	ret = extent_spill_finish(extent_spill);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot read back the spilled extent records: %m");
+		return ret;
+	}
+	cache_tree_init(&live);
+	cache_tree_init(&ready);
+	while (1) {
+		struct cache_extent *cache;
+		u64 bytenr;
+
+		ret = extent_spill_next(extent_spill, &event);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot read back the spilled extent records: %m");
+			break;
+		}
+		bytenr = ret ? (u64)-1 : event.bytenr;
+		while ((cache = search_cache_extent(&live, 0)) &&
+		       cache->start + cache->size <= bytenr) {
+			remove_cache_extent(&live, cache);
+			insert_cache_extent(&ready, cache);
+			nr_ready++;
+		}
+		if (!verify) {
+			drop_extent_records(&ready);
+			nr_ready = 0;
+		} else if (nr_ready >= EXTENT_SPILL_CHECK_BATCH ||
+			   (ret && nr_ready)) {
+			int check_ret = check_extent_refs(root, &ready);
+
+			if (check_ret && !err)
+				err = check_ret;
+			nr_ready = 0;
+		}
+		if (ret)
+			break;
+		replay_spilled_event(&live, &event);
+	}
+	/* Leftovers after an error, the records are still in use otherwise */
+	drop_extent_records(&live);
+	drop_extent_records(&ready);
+	if (ret < 0)
+		return ret;
+	return err;
+}
+
+/* A chunk stripe and the dev extent found for it by the merge pass */
+struct chunk_stripe_ref {
+	u64 devid;
+	u64 offset;
+	u64 length;
+	struct device_extent_record *dext;
+};
+
+static int cmp_chunk_stripe_ref(const void *a, const void *b)
+{
+	const struct chunk_stripe_ref *ra = *(const struct chunk_stripe_ref **)a;
+	const struct chunk_stripe_ref *rb = *(const struct chunk_stripe_ref **)b;
+
+	if (ra->devid != rb->devid)
+		return ra->devid < rb->devid ? -1 : 1;
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Find the dev extents of all the chunk stripes.
+ *
+ * The stripes are sorted by (devid, physical offset) and matched in one pass
+ * with the dev extents, which the cache keeps in the same order, instead of
+ * a lookup for each stripe.  A stripe gets the dev extent overlapping it, as
+ * lookup_cache_extent2() would return.
+ */
+static int find_chunk_stripe_dextents(struct cache_tree *chunk_cache,
+				      struct device_extent_tree *dev_extent_cache,
+				      struct chunk_stripe_ref **refs_ret)
+{
+	struct chunk_stripe_ref *refs;
+	struct chunk_stripe_ref **sorted;
+	struct cache_extent *cache;
+	size_t nr = 0;
+	size_t i;
+
+	for (cache = first_cache_extent(chunk_cache); cache;
+	     cache = next_cache_extent(cache))
+		nr += container_of(cache, struct chunk_record, cache)->num_stripes;
+
+	refs = calloc(max_t(size_t, nr, 1), sizeof(*refs));
+	sorted = malloc(max_t(size_t, nr, 1) * sizeof(*sorted));
+	if (!refs || !sorted) {
+		free(refs);
+		free(sorted);
+		return -ENOMEM;
+	}
+
+	i = 0;
+	for (cache = first_cache_extent(chunk_cache); cache;
+	     cache = next_cache_extent(cache)) {
+		struct chunk_record *chunk_rec;
+		u64 length;
+
+		chunk_rec = container_of(cache, struct chunk_record, cache);
+		length = calc_stripe_length(chunk_rec->type_flags,
+					    chunk_rec->length,
+					    chunk_rec->num_stripes);
+		for (int s = 0; s < chunk_rec->num_stripes; s++, i++) {
+			refs[i].devid = chunk_rec->stripes[s].devid;
+			refs[i].offset = chunk_rec->stripes[s].offset;
+			refs[i].length = length;
+			sorted[i] = &refs[i];
+		}
+	}
+	qsort(sorted, nr, sizeof(*sorted), cmp_chunk_stripe_ref);
+
+	cache = first_cache_extent(&dev_extent_cache->tree);
+	for (i = 0; i < nr; i++) {
+		struct chunk_stripe_ref *ref = sorted[i];
+
+		/* Skip the dev extents ending before the stripe */
+		while (cache && (cache->objectid < ref->devid ||
+				 (cache->objectid == ref->devid &&
+				  cache->start + cache->size <= ref->offset)))
+			cache = next_cache_extent(cache);
+		if (cache && cache->objectid == ref->devid &&
+		    cache->start < ref->offset + ref->length)
+			ref->dext = container_of(cache,
+						 struct device_extent_record,
+						 cache);
+	}
+	free(sorted);
+	*refs_ret = refs;
+	return 0;
+}
+
+/*
+ * Check the chunk with its block group/dev list ref, found by the merge passes
+ * of check_chunks():
  * Return 0 if all refs seems valid.
  * Return 1 if part of refs seems valid, need later check for rebuild ref
  * like missing block group and needs to search extent tree to rebuild them.
  * Return -1 if essential refs are missing and unable to rebuild.
  */
 static int check_chunk_refs(struct chunk_record *chunk_rec,
-			    struct block_group_tree *block_group_cache,
-			    struct device_extent_tree *dev_extent_cache,
-			    int silent)
+			    struct block_group_record *block_group_rec,
+			    struct chunk_stripe_ref *refs, int silent)
 {
-	struct cache_extent *block_group_item;
-	struct block_group_record *block_group_rec;
-	struct cache_extent *dev_extent_item;
 	struct device_extent_record *dev_extent_rec;
 	u64 devid;
 	u64 offset;
@@ -8389,13 +9252,7 @@ static int check_chunk_refs(struct chunk_record *chunk_rec,
 	int i;
 	int ret = 0;
 
-	block_group_item = lookup_cache_extent(&block_group_cache->tree,
-					       chunk_rec->offset,
-					       chunk_rec->length);
-	if (block_group_item) {
-		block_group_rec = container_of(block_group_item,
-					       struct block_group_record,
-					       cache);
+	if (block_group_rec) {
 		if (chunk_rec->length != block_group_rec->offset ||
 		    chunk_rec->offset != block_group_rec->objectid ||
 		    (!metadump_v2 &&
@@ -8441,12 +9298,8 @@ static int check_chunk_refs(struct chunk_record *chunk_rec,
 	for (i = 0; i < chunk_rec->num_stripes; ++i) {
 		devid = chunk_rec->stripes[i].devid;
 		offset = chunk_rec->stripes[i].offset;
-		dev_extent_item = lookup_cache_extent2(&dev_extent_cache->tree,
-						       devid, offset, length);
-		if (dev_extent_item) {
-			dev_extent_rec = container_of(dev_extent_item,
-						struct device_extent_record,
-						cache);
+		dev_extent_rec = refs[i].dext;
+		if (dev_extent_rec) {
 			if (dev_extent_rec->objectid != devid ||
 			    dev_extent_rec->offset != offset ||
 			    dev_extent_rec->chunk_offset != chunk_rec->offset ||
@@ -8494,13 +9347,37 @@ int check_chunks(struct cache_tree *chunk_cache,
 	struct block_group_record *bg_rec;
 	struct device_extent_record *dext_rec;
 	bool strict_alignment = get_env_bool("BTRFS_DEBUG_STRICT_CHUNK_ALIGNMENT");
+	struct cache_extent *bg_item;
+	struct chunk_stripe_ref *refs;
+	size_t ref = 0;
 	int err;
 	int ret = 0;
 
+	err = find_chunk_stripe_dextents(chunk_cache, dev_extent_cache, &refs);
+	if (err < 0) {
+		error_msg(ERROR_MSG_MEMORY, "chunk stripes");
+		return err;
+	}
+
+	/*
+	 * The chunks and block groups are both ordered by the logical address,
+	 * each chunk gets the block group overlapping it in one pass.
+	 */
+	bg_item = first_cache_extent(&block_group_cache->tree);
 	chunk_item = first_cache_extent(chunk_cache);
 	while (chunk_item) {
+		struct block_group_record *chunk_bg = NULL;
+
 		chunk_rec = container_of(chunk_item, struct chunk_record,
 					 cache);
+		while (bg_item &&
+		       bg_item->start + bg_item->size <= chunk_rec->offset)
+			bg_item = next_cache_extent(bg_item);
+		if (bg_item &&
+		    bg_item->start < chunk_rec->offset + chunk_rec->length)
+			chunk_bg = container_of(bg_item,
+						struct block_group_record,
+						cache);
 		if (chunk_rec->unaligned && !silent) {
 			if (strict_alignment) {
 				error(
@@ -8517,8 +9394,8 @@ int check_chunks(struct cache_tree *chunk_cache,
 				      BTRFS_STRIPE_LEN);
 			}
 		}
-		err = check_chunk_refs(chunk_rec, block_group_cache,
-				       dev_extent_cache, silent);
+		err = check_chunk_refs(chunk_rec, chunk_bg, refs + ref, silent);
+		ref += chunk_rec->num_stripes;
 		if (err < 0)
 			ret = err;
 		if (err == 0 && good)
@@ -8529,6 +9406,7 @@ int check_chunks(struct cache_tree *chunk_cache,
 			list_add_tail(&chunk_rec->list, bad);
 		chunk_item = next_cache_extent(chunk_item);
 	}
+	free(refs);
 
 	list_for_each_entry(bg_rec, &block_group_cache->block_groups, list) {
 		if (!silent)
@@ -8791,7 +9669,8 @@ static int deal_root_from_list(struct list_head *list,
 	return ret;
 }
 
-static int check_block_groups(struct block_group_tree *bg_cache)
+static int check_block_groups(struct block_group_tree *bg_cache,
+			      u64 super_bytes_used)
 {
 	struct btrfs_trans_handle *trans;
 	struct cache_extent *item;
@@ -8818,11 +9697,14 @@ static int check_block_groups(struct block_group_tree *bg_cache)
 	 * groups used, and the repair actually happens in
 	 * btrfs_fix_block_accounting, so we can kill both birds with the same
 	 * stone here.
+	 *
+	 * The value is the one from when the trees were read, the repair of the
+	 * extent refs commits in between and the new tree blocks may change it.
 	 */
-	if (used != btrfs_super_bytes_used(gfs_info->super_copy)) {
+	if (used != super_bytes_used) {
 		fprintf(stderr,
 			"super bytes used %llu mismatches actual used %llu\n",
-			btrfs_super_bytes_used(gfs_info->super_copy), used);
+			super_bytes_used, used);
 		ret = -1;
 	}
 
@@ -8932,6 +9814,7 @@ static int check_dev_extents(void)
 	struct btrfs_path path = { 0 };
 	struct btrfs_key key;
 	struct btrfs_root *dev_root = gfs_info->dev_root;
+	struct btrfs_device *dev = NULL;
 	int ret;
 	u64 prev_devid = 0;
 	u64 prev_dev_ext_end = 0;
@@ -8961,7 +9844,6 @@ static int check_dev_extents(void)
 
 	while (1) {
 		struct btrfs_dev_extent *dev_ext;
-		struct btrfs_device *dev;
 		u64 devid;
 		u64 physical_offset;
 		u64 physical_len;
@@ -8975,7 +9857,9 @@ static int check_dev_extents(void)
 		physical_offset = key.offset;
 		physical_len = btrfs_dev_extent_length(path.nodes[0], dev_ext);
 
-		dev = btrfs_find_device(gfs_info, devid, NULL, NULL);
+		/* The dev extents are sorted by devid, look up each device once */
+		if (!dev || dev->devid != devid)
+			dev = btrfs_find_device(gfs_info, devid, NULL, NULL);
 		if (!dev) {
 			error("failed to find device with devid %llu", devid);
 			ret = -EUCLEAN;
@@ -9046,6 +9930,7 @@ static int check_chunks_and_extents(void)
 	struct list_head dropping_trees;
 	struct list_head normal_trees;
 	struct btrfs_root *root;
+	u64 super_bytes_used;
 
 	root = gfs_info->fs_root;
 	dev_cache = RB_ROOT;
@@ -9054,6 +9939,7 @@ static int check_chunks_and_extents(void)
 	device_extent_tree_init(&dev_extent_cache);
 
 	cache_tree_init(&extent_cache);
+	init_extent_record_slabs();
 	cache_tree_init(&seen);
 	cache_tree_init(&pending);
 	cache_tree_init(&nodes);
@@ -9077,6 +9963,24 @@ static int check_chunks_and_extents(void)
 		exit(1);
 	}
 
+	/*
+	 * Repair modifies the trees while blocks are queued, stay with the
+	 * synchronous reads there.
+	 */
+	if (!opt_check_repair && check_threads)
+		tree_prefetch = tree_prefetch_alloc(gfs_info, check_threads);
+
+	if (check_mem_limit) {
+		extent_spill = extent_spill_alloc(check_tmpdir, check_mem_limit);
+		if (IS_ERR(extent_spill)) {
+			ret = PTR_ERR(extent_spill);
+			extent_spill = NULL;
+			errno = -ret;
+			error("cannot create scratch file in %s: %m", check_tmpdir);
+			goto out;
+		}
+	}
+
 again:
 	ret = load_super_root(&normal_trees, gfs_info->tree_root);
 	if (ret < 0)
@@ -9111,6 +10015,7 @@ again:
 			goto loop;
 		goto out;
 	}
+	super_bytes_used = btrfs_super_bytes_used(gfs_info->super_copy);
 
 	ret = check_dev_extents();
 	if (ret < 0) {
@@ -9127,13 +10032,21 @@ again:
 	}
 
 	ret = check_extent_refs(root, &extent_cache);
+	if (extent_spill) {
+		int spill_ret = check_spilled_extent_refs(root, true);
+
+		if (!ret)
+			ret = spill_ret;
+		extent_spill_free(extent_spill);
+		extent_spill = NULL;
+	}
 	if (ret < 0) {
 		if (ret == -EAGAIN)
 			goto loop;
 		goto out;
 	}
 
-	ret = check_block_groups(&block_group_cache);
+	ret = check_block_groups(&block_group_cache, super_bytes_used);
 	if (ret) {
 		if (ret == -EAGAIN)
 			goto loop;
@@ -9153,6 +10066,14 @@ out:
 		gfs_info->corrupt_blocks = NULL;
 		gfs_info->excluded_extents = NULL;
 	}
+	tree_prefetch_free(tree_prefetch);
+	tree_prefetch = NULL;
+	if (extent_spill) {
+		/* The records would have been created, count their bytes */
+		check_spilled_extent_refs(root, false);
+		extent_spill_free(extent_spill);
+		extent_spill = NULL;
+	}
 	free(bits);
 	free_chunk_cache_tree(&chunk_cache);
 	free_device_cache_tree(&dev_cache);
@@ -9162,6 +10083,7 @@ out:
 	free_extent_cache_tree(&pending);
 	free_extent_cache_tree(&reada);
 	free_extent_cache_tree(&nodes);
+	free_extent_record_cache(&extent_cache);
 	free_root_item_list(&normal_trees);
 	free_root_item_list(&dropping_trees);
 	return ret;
@@ -9186,10 +10108,15 @@ static int do_check_chunks_and_extents(void)
 {
 	int ret;
 
-	if (check_mode == CHECK_MODE_LOWMEM)
+	if (check_mode == CHECK_MODE_LOWMEM) {
+		if (!opt_check_repair && check_threads)
+			tree_prefetch = tree_prefetch_alloc(gfs_info, check_threads);
 		ret = check_chunks_and_extents_lowmem();
-	else
+		tree_prefetch_free(tree_prefetch);
+		tree_prefetch = NULL;
+	} else {
 		ret = check_chunks_and_extents();
+	}
 
 	/* Also repair device size related problems */
 	if (opt_check_repair && !ret) {
@@ -10367,6 +11294,49 @@ static bool check_early_critical_roots(void)
 	return ret;
 }
 
+/*
+ * Start the phase in the metrics and the checkpoint if any, return false if the
+ * resumed check already did it
+ */
+static bool start_phase(int phase, int err, const char *name)
+{
+	stats_phase(name);
+	if (check_metrics)
+		check_metrics_phase(check_metrics, phase, name, records_allocated);
+	if (!check_checkpoint ||
+	    !checkpoint_phase_start(check_checkpoint, phase, err))
+		return true;
+	fprintf(stderr, "[%d/8] %s skipped (done before the checkpoint)\n",
+		phase, name);
+	return false;
+}
+
+/*
+ * Write the generation of the checked filesystem to @path, to be passed to
+ * --since-generation by the next check
+ */
+static int record_checked_generation(const char *path)
+{
+	u64 generation = btrfs_super_generation(gfs_info->super_copy);
+	FILE *file;
+	int ret = 0;
+
+	file = fopen(path, "w");
+	if (!file) {
+		ret = -errno;
+		error("cannot open %s: %m", path);
+		return ret;
+	}
+	fprintf(file, "%llu\n", generation);
+	if (fclose(file)) {
+		ret = -errno;
+		error("cannot write %s: %m", path);
+		return ret;
+	}
+	printf("recorded generation %llu to %s\n", generation, path);
+	return 0;
+}
+
 static const char * const cmd_check_usage[] = {
 	"btrfs check [options] <device>",
 	"Check structural integrity of a filesystem (unmounted).",
@@ -10392,16 +11362,52 @@ static const char * const cmd_check_usage[] = {
 	OPTLINE("--mode <MODE>", "allows choice of memory/IO trade-offs where MODE is one of:"),
 	OPTLINE("", "original - read inodes and extents to memory (requires more memory, does less IO)"),
 	OPTLINE("", "lowmem   - try to use less memory but read blocks again when needed"),
+	OPTLINE("--threads <N>", "number of threads reading tree blocks ahead in read-only mode, "
+			"0 for synchronous reads only (default: 16)"),
+	OPTLINE("--mem-limit <SIZE>", "in the original mode, buffer at most SIZE of data "
+			"extent records and spill the rest to a scratch file"),
+	OPTLINE("--tmpdir <DIR>", "directory of the --mem-limit scratch file "
+			"(default: $TMPDIR or /tmp)"),
+	OPTLINE("--mmap", "in read-only mode, map the image files instead of reading "
+			"the tree blocks; the check is killed by SIGBUS if an image is "
+			"truncated or fails to read"),
 	"",
 	"Repair options:",
 	OPTLINE("--init-csum-tree", "create a new CRC tree"),
 	OPTLINE("--init-extent-tree", "create a new extent tree"),
+	OPTLINE("--repair-batch <N>", "number of fixes of a subvolume committed in one "
+			"transaction, 0 or 1 to commit each fix (default: 256)"),
+	OPTLINE("--repair-batch-size <SIZE>", "commit the batched fixes when they have "
+			"written SIZE of new metadata (default: 16M)"),
 	"",
 	"Check and reporting options:",
 	OPTLINE("--check-data-csum", "verify checksums of data blocks"),
+	OPTLINE("--csum-readers <N>", "number of data ranges verified in parallel per device "
+			"with --check-data-csum or checksummed with --init-csum-tree, "
+			"0 for synchronous reads only (default: 4)"),
 	OPTLINE("-Q|--qgroup-report", "print a report on qgroup consistency"),
+	OPTLINE("--qgroup-workers <N>", "number of threads accounting the extents to the "
+			"qgroups, 0 to account them in one thread (default: 4)"),
 	OPTLINE("-E|--subvol-extents <subvolid>", "print subvolume extents and sharing state"),
 	OPTLINE("-p|--progress", "indicate progress"),
+	OPTLINE("--progress-fd <FD>", "write the progress and the time and resources used "
+			"by each phase as JSON lines to the file descriptor FD"),
+	OPTLINE("--metrics <FILE>", "write the time and resources used by each phase "
+			"as JSON to FILE at the end"),
+	OPTLINE("--since-generation <GEN>", "in the lowmem mode, check only the tree blocks "
+			"written after generation GEN"),
+	OPTLINE("--record-generation <FILE>", "write the generation of the filesystem to FILE "
+			"if no error was found"),
+	OPTLINE("--checkpoint <FILE>", "in the lowmem mode, save the progress to FILE "
+			"periodically"),
+	OPTLINE("--resume <FILE>", "continue the check saved to FILE by --checkpoint, "
+			"and keep saving to it"),
+	OPTLINE("--quick", "only verify the superblocks, the backup roots and the top "
+			"levels of the trees needed to mount, and print a verdict"),
+	OPTLINE("--quick-levels <N>", "number of levels of each tree read by --quick "
+			"(default: 2)"),
+	OPTLINE("--quick-budget <MSEC>", "stop --quick after MSEC milliseconds, the "
+			"verdict is then incomplete (default: 1000)"),
 	"",
 	"Deprecated or moved options:",
 	OPTLINE("--clear-space-cache v1|v2", "clear space cache for v1 or v2 (moved to 'rescue' group)"),
@@ -10421,10 +11427,23 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	int ret = 0;
 	int err = 0;
 	u64 num;
+	const char *record_generation_file = NULL;
+	const char *checkpoint_file = NULL;
+	struct check_checkpoint checkpoint;
+	bool resume = false;
+	const char *metrics_file = NULL;
+	int progress_fd = -1;
+	bool quick = false;
+	struct check_quick_args quick_args = {
+		.levels = CHECK_QUICK_DEFAULT_LEVELS,
+		.budget_ms = CHECK_QUICK_DEFAULT_BUDGET_MS,
+	};
+	struct check_metrics metrics;
 	bool init_csum_tree = false;
 	bool readonly = false;
 	bool qgroup_report = false;
 	bool force = false;
+	bool use_mmap = false;
 	int clear_space_cache = 0;
 	int qgroups_repaired = 0;
 	int qgroup_verify_ret;
@@ -10438,7 +11457,15 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			GETOPT_VAL_INIT_EXTENT, GETOPT_VAL_CHECK_CSUM,
 			GETOPT_VAL_READONLY, GETOPT_VAL_CHUNK_TREE,
 			GETOPT_VAL_MODE, GETOPT_VAL_CLEAR_SPACE_CACHE,
-			GETOPT_VAL_FORCE };
+			GETOPT_VAL_FORCE, GETOPT_VAL_THREADS,
+			GETOPT_VAL_MEM_LIMIT, GETOPT_VAL_TMPDIR,
+			GETOPT_VAL_CSUM_READERS, GETOPT_VAL_SINCE_GENERATION,
+			GETOPT_VAL_RECORD_GENERATION, GETOPT_VAL_CHECKPOINT,
+			GETOPT_VAL_RESUME, GETOPT_VAL_PROGRESS_FD,
+			GETOPT_VAL_METRICS, GETOPT_VAL_QGROUP_WORKERS,
+			GETOPT_VAL_REPAIR_BATCH, GETOPT_VAL_REPAIR_BATCH_SIZE,
+			GETOPT_VAL_QUICK, GETOPT_VAL_QUICK_LEVELS,
+			GETOPT_VAL_QUICK_BUDGET, GETOPT_VAL_MMAP };
 		static const struct option long_options[] = {
 			{ "super", required_argument, NULL, 's' },
 			{ "repair", no_argument, NULL, GETOPT_VAL_REPAIR },
@@ -10461,6 +11488,38 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "clear-space-cache", required_argument, NULL,
 				GETOPT_VAL_CLEAR_SPACE_CACHE},
 			{ "force", no_argument, NULL, GETOPT_VAL_FORCE },
+			{ "threads", required_argument, NULL,
+				GETOPT_VAL_THREADS },
+			{ "mem-limit", required_argument, NULL,
+				GETOPT_VAL_MEM_LIMIT },
+			{ "tmpdir", required_argument, NULL,
+				GETOPT_VAL_TMPDIR },
+			{ "csum-readers", required_argument, NULL,
+				GETOPT_VAL_CSUM_READERS },
+			{ "since-generation", required_argument, NULL,
+				GETOPT_VAL_SINCE_GENERATION },
+			{ "record-generation", required_argument, NULL,
+				GETOPT_VAL_RECORD_GENERATION },
+			{ "checkpoint", required_argument, NULL,
+				GETOPT_VAL_CHECKPOINT },
+			{ "resume", required_argument, NULL,
+				GETOPT_VAL_RESUME },
+			{ "progress-fd", required_argument, NULL,
+				GETOPT_VAL_PROGRESS_FD },
+			{ "metrics", required_argument, NULL,
+				GETOPT_VAL_METRICS },
+			{ "qgroup-workers", required_argument, NULL,
+				GETOPT_VAL_QGROUP_WORKERS },
+			{ "repair-batch", required_argument, NULL,
+				GETOPT_VAL_REPAIR_BATCH },
+			{ "repair-batch-size", required_argument, NULL,
+				GETOPT_VAL_REPAIR_BATCH_SIZE },
+			{ "quick", no_argument, NULL, GETOPT_VAL_QUICK },
+			{ "quick-levels", required_argument, NULL,
+				GETOPT_VAL_QUICK_LEVELS },
+			{ "quick-budget", required_argument, NULL,
+				GETOPT_VAL_QUICK_BUDGET },
+			{ "mmap", no_argument, NULL, GETOPT_VAL_MMAP },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -10544,6 +11603,109 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			case GETOPT_VAL_FORCE:
 				force = true;
 				break;
+			case GETOPT_VAL_THREADS:
+				num = arg_strtou64(optarg);
+				if (num > TREE_PREFETCH_MAX_THREADS) {
+					error("number of threads out of range: %llu > %d",
+					      num, TREE_PREFETCH_MAX_THREADS);
+					exit(1);
+				}
+				check_threads = num;
+				break;
+			case GETOPT_VAL_MEM_LIMIT:
+				check_mem_limit = arg_strtou64_with_suffix(optarg);
+				if (!check_mem_limit) {
+					error("invalid memory limit: %s", optarg);
+					exit(1);
+				}
+				break;
+			case GETOPT_VAL_TMPDIR:
+				check_tmpdir = optarg;
+				break;
+			case GETOPT_VAL_MMAP:
+				use_mmap = true;
+				break;
+			case GETOPT_VAL_CSUM_READERS:
+				num = arg_strtou64(optarg);
+				if (num > DATA_CSUM_MAX_THREADS) {
+					error("number of csum readers out of range: %llu > %d",
+					      num, DATA_CSUM_MAX_THREADS);
+					exit(1);
+				}
+				csum_readers = num;
+				break;
+			case GETOPT_VAL_SINCE_GENERATION:
+				check_since_generation = arg_strtou64(optarg);
+				break;
+			case GETOPT_VAL_RECORD_GENERATION:
+				record_generation_file = optarg;
+				break;
+			case GETOPT_VAL_CHECKPOINT:
+			case GETOPT_VAL_RESUME:
+				if (checkpoint_file) {
+					error("only one of --checkpoint and --resume can be used");
+					exit(1);
+				}
+				checkpoint_file = optarg;
+				resume = (c == GETOPT_VAL_RESUME);
+				break;
+			case GETOPT_VAL_PROGRESS_FD:
+				num = arg_strtou64(optarg);
+				if (num > INT_MAX || fcntl(num, F_GETFL) < 0) {
+					error("invalid file descriptor for --progress-fd: %s",
+					      optarg);
+					exit(1);
+				}
+				progress_fd = num;
+				break;
+			case GETOPT_VAL_METRICS:
+				metrics_file = optarg;
+				break;
+			case GETOPT_VAL_QGROUP_WORKERS:
+				num = arg_strtou64(optarg);
+				if (num > QGROUP_VERIFY_MAX_WORKERS) {
+					error("number of qgroup workers out of range: %llu > %d",
+					      num, QGROUP_VERIFY_MAX_WORKERS);
+					exit(1);
+				}
+				qgroup_set_workers(num);
+				break;
+			case GETOPT_VAL_REPAIR_BATCH:
+				num = arg_strtou64(optarg);
+				if (num > UINT_MAX) {
+					error("number of batched fixes out of range: %llu > %u",
+					      num, UINT_MAX);
+					exit(1);
+				}
+				repair_batch_fixes = num;
+				break;
+			case GETOPT_VAL_REPAIR_BATCH_SIZE:
+				repair_batch_bytes = arg_strtou64_with_suffix(optarg);
+				if (!repair_batch_bytes) {
+					error("invalid repair batch size: %s", optarg);
+					exit(1);
+				}
+				break;
+			case GETOPT_VAL_QUICK:
+				quick = true;
+				break;
+			case GETOPT_VAL_QUICK_LEVELS:
+				num = arg_strtou64(optarg);
+				if (num < 1 || num > BTRFS_MAX_LEVEL) {
+					error("number of levels out of range: %llu, must be 1 to %d",
+					      num, BTRFS_MAX_LEVEL);
+					exit(1);
+				}
+				quick_args.levels = num;
+				break;
+			case GETOPT_VAL_QUICK_BUDGET:
+				num = arg_strtou64(optarg);
+				if (num < 1 || num > UINT_MAX) {
+					error("time budget out of range: %llu", num);
+					exit(1);
+				}
+				quick_args.budget_ms = num;
+				break;
 			case '?':
 			case 'h':
 				usage_unknown_option(cmd, argv);
@@ -10564,6 +11726,59 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		exit(1);
 	}
 
+	if (check_tmpdir && !check_mem_limit) {
+		error("--tmpdir is only used with --mem-limit");
+		exit(1);
+	}
+	if (check_mem_limit) {
+		if (opt_check_repair) {
+			error("repair options are not compatible with --mem-limit");
+			exit(1);
+		}
+		if (check_mode != CHECK_MODE_ORIGINAL) {
+			error("--mem-limit is only supported by the original mode");
+			exit(1);
+		}
+		if (!check_tmpdir)
+			check_tmpdir = getenv("TMPDIR") ?: "/tmp";
+	}
+	if (check_since_generation) {
+		if (opt_check_repair) {
+			error("repair options are not compatible with --since-generation");
+			exit(1);
+		}
+		if (check_mode != CHECK_MODE_LOWMEM) {
+			error("--since-generation is only supported by the lowmem mode");
+			exit(1);
+		}
+	}
+	if (checkpoint_file) {
+		if (opt_check_repair) {
+			error("repair options are not compatible with --checkpoint and --resume");
+			exit(1);
+		}
+		if (check_mode != CHECK_MODE_LOWMEM) {
+			error("--checkpoint and --resume are only supported by the lowmem mode");
+			exit(1);
+		}
+	}
+
+	if (quick) {
+		if (opt_check_repair || clear_space_cache) {
+			error("repair options are not compatible with --quick");
+			exit(1);
+		}
+		if (check_data_csum || qgroup_report || subvolid ||
+		    checkpoint_file || metrics_file || progress_fd >= 0 ||
+		    record_generation_file) {
+			error("--quick only reads the tree roots, no other check can be done");
+			exit(1);
+		}
+	} else if (bconf.output_format == CMD_FORMAT_JSON) {
+		error("the json output format is only supported by --quick");
+		exit(1);
+	}
+
 	if (opt_check_repair && !force) {
 		int delay = 10;
 
@@ -10582,7 +11797,9 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		printf("\nStarting repair.\n");
 	}
 
-	printf("Opening filesystem to check...\n");
+	if (!quick)
+		printf("Opening filesystem to check...\n");
+	stats_phase("opening filesystem");
 
 	cache_tree_init(&root_cache);
 	qgroup_set_item_count_ptr(&g_task_ctx.item_count);
@@ -10615,9 +11832,20 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		ctree_flags &= ~OPEN_CTREE_EXCLUSIVE;
 	}
 
+	if (quick) {
+		quick_args.path = argv[optind];
+		quick_args.sb_bytenr = bytenr;
+		quick_args.nr_threads = check_threads;
+		quick_args.force = force;
+		err = check_quick(&quick_args);
+		goto err_out;
+	}
+
 	/* only allow partial opening under repair mode */
 	if (opt_check_repair)
 		ctree_flags |= OPEN_CTREE_PARTIAL;
+	if (use_mmap && !(ctree_flags & OPEN_CTREE_WRITES))
+		ctree_flags |= OPEN_CTREE_MMAP;
 
 	oca.filename = argv[optind];
 	oca.sb_bytenr = bytenr;
@@ -10636,6 +11864,44 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	uuid_unparse(gfs_info->super_copy->fsid, uuidbuf);
 
 	printf("Checking filesystem on %s\nUUID: %s\n", argv[optind], uuidbuf);
+	if (check_since_generation) {
+		u64 generation = btrfs_super_generation(gfs_info->super_copy);
+
+		if (check_since_generation > generation) {
+			error("--since-generation %llu is newer than the filesystem generation %llu",
+			      check_since_generation, generation);
+			ret = -EINVAL;
+			err |= !!ret;
+			goto close_out;
+		}
+		printf("Checking tree blocks written after generation %llu\n",
+		       check_since_generation);
+	}
+	if (checkpoint_file) {
+		checkpoint_init(&checkpoint, checkpoint_file, gfs_info,
+				check_since_generation);
+		if (resume) {
+			ret = checkpoint_load(&checkpoint);
+			if (ret) {
+				err |= !!ret;
+				goto close_out;
+			}
+			err |= !!checkpoint.errors;
+			printf("Resuming from phase %d saved in %s\n",
+			       checkpoint.phase, checkpoint_file);
+		}
+		check_checkpoint = &checkpoint;
+	}
+	if (metrics_file || progress_fd >= 0) {
+		ret = check_metrics_init(&metrics, gfs_info,
+				check_mode == CHECK_MODE_LOWMEM ? "lowmem" : "original",
+				metrics_file, progress_fd);
+		if (ret) {
+			err |= !!ret;
+			goto close_out;
+		}
+		check_metrics = &metrics;
+	}
 
 	if (check_early_critical_roots()) {
 		err |= 1;
@@ -10728,7 +11994,11 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 			}
 
 			pr_verbose(LOG_DEFAULT, "Fill checksum tree\n");
-			ret = fill_csum_tree(trans, init_extent_tree);
+			/* Same number of readers per device as --check-data-csum */
+			ret = fill_csum_tree(trans, init_extent_tree,
+				min_t(u64, (u64)csum_readers *
+				      gfs_info->fs_devices->num_devices,
+				      DATA_CSUM_MAX_THREADS));
 			err |= !!ret;
 			if (ret) {
 				error("checksum tree refilling failed: %d", ret);
@@ -10754,6 +12024,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		goto close_out;
 	}
 
+	if (!start_phase(1, err, "checking log"))
+		goto root_items;
 	if (gfs_info->log_root_tree) {
 		fprintf(stderr, "[1/8] checking log\n");
 		ret = check_log(&root_cache);
@@ -10766,6 +12038,9 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		"[1/8] checking log skipped (none written)\n");
 	}
 
+root_items:
+	if (!start_phase(2, err, "checking root items"))
+		goto extents;
 	if (!init_extent_tree) {
 		if (!g_task_ctx.progress_enabled) {
 			fprintf(stderr, "[2/8] checking root items\n");
@@ -10806,6 +12081,9 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		fprintf(stderr, "[2/8] checking root items... skipped\n");
 	}
 
+extents:
+	if (!start_phase(3, err, "checking extents"))
+		goto free_space;
 	if (!g_task_ctx.progress_enabled) {
 		fprintf(stderr, "[3/8] checking extents\n");
 	} else {
@@ -10821,8 +12099,16 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	/* Only re-check super size after we checked and repaired the fs */
 	err |= !is_super_size_valid();
 
+free_space:
 	is_free_space_tree = btrfs_fs_compat_ro(gfs_info, FREE_SPACE_TREE);
 
+	if (!start_phase(4, err, "checking free space"))
+		goto fs_roots;
+	if (check_since_generation) {
+		fprintf(stderr, "[4/8] checking free space %s skipped (--since-generation)\n",
+			is_free_space_tree ? "tree" : "cache");
+		goto fs_roots;
+	}
 	if (!g_task_ctx.progress_enabled) {
 		if (is_free_space_tree)
 			fprintf(stderr, "[4/8] checking free space tree\n");
@@ -10837,6 +12123,7 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	task_stop(g_task_ctx.info);
 	err |= !!ret;
 
+fs_roots:
 	/*
 	 * We used to have to have these hole extents in between our real
 	 * extents so if we don't have this flag set we need to make sure there
@@ -10844,6 +12131,8 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 	 * ignore it when this happens.
 	 */
 	no_holes = btrfs_fs_incompat(gfs_info, NO_HOLES);
+	if (!start_phase(5, err, "checking fs roots"))
+		goto csums;
 	if (!g_task_ctx.progress_enabled) {
 		fprintf(stderr, "[5/8] checking fs roots\n");
 	} else {
@@ -10862,6 +12151,13 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		goto out;
 	}
 
+csums:
+	if (!start_phase(6, err, "checking csums"))
+		goto root_refs;
+	if (check_since_generation) {
+		fprintf(stderr, "[6/8] checking csums skipped (--since-generation)\n");
+		goto root_refs;
+	}
 	if (!g_task_ctx.progress_enabled) {
 		if (check_data_csum)
 			fprintf(stderr, "[6/8] checking csums against data\n");
@@ -10883,6 +12179,9 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		error("errors found in csum tree");
 	err |= !!ret;
 
+root_refs:
+	if (!start_phase(7, err, "checking root refs"))
+		goto qgroups;
 	/* For low memory mode, check_fs_roots_v2 handles root refs */
         if (check_mode != CHECK_MODE_LOWMEM) {
 		if (!g_task_ctx.progress_enabled) {
@@ -10931,7 +12230,13 @@ static int cmd_check(const struct cmd_struct *cmd, int argc, char **argv)
 		free(bad);
 	}
 
-	if (gfs_info->quota_enabled) {
+qgroups:
+	/* The last phase can't be done before a checkpoint */
+	start_phase(8, err, "checking quota groups");
+	if (gfs_info->quota_enabled && check_since_generation) {
+		fprintf(stderr,
+		"[8/8] checking quota groups skipped (--since-generation)\n");
+	} else if (gfs_info->quota_enabled) {
 		if (!g_task_ctx.progress_enabled) {
 			fprintf(stderr, "[8/8] checking quota groups\n");
 		} else {
@@ -10978,9 +12283,28 @@ out:
 	printf("file data blocks allocated: %llu\n referenced %llu\n",
 		data_bytes_allocated, data_bytes_referenced);
 
+	if (check_checkpoint) {
+		ret = checkpoint_done(check_checkpoint, err);
+		err |= !!ret;
+	}
+	if (record_generation_file) {
+		if (err) {
+			warning("generation not recorded to %s, errors found",
+				record_generation_file);
+		} else {
+			ret = record_checked_generation(record_generation_file);
+			err |= !!ret;
+		}
+	}
+
 	free_qgroup_counts();
 	free_root_recs_tree(&root_cache);
 close_out:
+	if (check_metrics) {
+		ret = check_metrics_finish(check_metrics, err, records_allocated);
+		err |= !!ret;
+	}
+	free_backref_cache_lowmem();
 	close_ctree(root);
 err_out:
 	if (g_task_ctx.progress_enabled)
@@ -10988,4 +12312,4 @@ err_out:
 
 	return err;
 }
-DEFINE_SIMPLE_COMMAND(check, "check");
+DEFINE_COMMAND_WITH_FLAGS(check, "check", CMD_FORMAT_JSON);
@@ -0,0 +1,418 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/volumes.h"
+#include "common/messages.h"
+#include "common/task-utils.h"
+#include "check/mode-common.h"
+#include "check/metrics.h"
+
+static double timespec_diff(const struct timespec *end,
+			    const struct timespec *start)
+{
+	return (end->tv_sec - start->tv_sec) +
+	       (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* CPU time of all the threads of the check, in seconds */
+static double cpu_time(long *peak_rss_kib)
+{
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage))
+		return 0.0;
+	if (peak_rss_kib)
+		*peak_rss_kib = usage.ru_maxrss;
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+	       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void read_devices(const struct check_metrics *metrics,
+			 struct check_device_reads *reads)
+{
+	for (int i = 0; i < metrics->nr_devices; i++) {
+		const struct btrfs_device *device = metrics->devices[i];
+
+		reads[i].ios = __atomic_load_n(&device->read_ios,
+					       __ATOMIC_RELAXED);
+		reads[i].bytes = __atomic_load_n(&device->read_bytes,
+						 __ATOMIC_RELAXED);
+	}
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	while (len) {
+		ssize_t ret = write(fd, buf, len);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static void print_string(FILE *out, const char *str)
+{
+	fputc('"', out);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(out, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(out, "\\u%04x", *str);
+		else
+			fputc(*str, out);
+	}
+	fputc('"', out);
+}
+
+static u64 throughput(u64 bytes, double seconds)
+{
+	return seconds > 0.0 ? bytes / seconds : 0;
+}
+
+static void print_hit_rate(FILE *out, u64 hits, u64 misses)
+{
+	if (hits + misses)
+		fprintf(out, "%.3f", (double)hits / (hits + misses));
+	else
+		fprintf(out, "null");
+}
+
+static void print_phase(FILE *out, const struct check_metrics *metrics,
+			int phase)
+{
+	const struct check_phase_metrics *pm = &metrics->phases[phase];
+	u64 ios = 0;
+	u64 bytes = 0;
+
+	for (int i = 0; i < metrics->nr_devices; i++) {
+		ios += pm->reads[i].ios;
+		bytes += pm->reads[i].bytes;
+	}
+	fprintf(out, "{\"type\":\"phase\",\"phase\":%d,\"name\":", phase);
+	print_string(out, pm->name);
+	fprintf(out, ",\"wall_time\":%.3f,\"cpu_time\":%.3f,\"items\":%llu",
+		pm->wall_time, pm->cpu_time, pm->items);
+	fprintf(out, ",\"read_ios\":%llu,\"read_bytes\":%llu,\"read_throughput\":%llu",
+		ios, bytes, throughput(bytes, pm->wall_time));
+	fprintf(out, ",\"eb_cache_hits\":%llu,\"eb_cache_misses\":%llu,\"eb_cache_hit_rate\":",
+		pm->eb_cache_hits, pm->eb_cache_misses);
+	print_hit_rate(out, pm->eb_cache_hits, pm->eb_cache_misses);
+	fprintf(out, ",\"records_allocated\":%llu,\"peak_rss_kib\":%ld,\"devices\":[",
+		pm->records, pm->peak_rss_kib);
+	for (int i = 0; i < metrics->nr_devices; i++)
+		fprintf(out, "%s{\"devid\":%llu,\"read_ios\":%llu,\"read_bytes\":%llu}",
+			i ? "," : "", metrics->devices[i]->devid,
+			pm->reads[i].ios, pm->reads[i].bytes);
+	fprintf(out, "]}");
+}
+
+static void print_summary(FILE *out, const struct check_metrics *metrics,
+			  int errors)
+{
+	const struct check_phase_metrics *pm;
+	double wall_time = 0.0;
+	double cpu = 0.0;
+	u64 items = 0;
+	u64 hits = 0;
+	u64 misses = 0;
+	u64 records = 0;
+	u64 ios = 0;
+	u64 bytes = 0;
+	long peak_rss_kib = 0;
+	bool first = true;
+
+	for (int phase = 1; phase <= CHECK_METRICS_PHASES; phase++) {
+		pm = &metrics->phases[phase];
+		if (!pm->started)
+			continue;
+		wall_time += pm->wall_time;
+		cpu += pm->cpu_time;
+		items += pm->items;
+		hits += pm->eb_cache_hits;
+		misses += pm->eb_cache_misses;
+		records += pm->records;
+		for (int i = 0; i < metrics->nr_devices; i++) {
+			ios += pm->reads[i].ios;
+			bytes += pm->reads[i].bytes;
+		}
+	}
+	cpu_time(&peak_rss_kib);
+
+	fprintf(out, "{\"type\":\"summary\",\"mode\":\"%s\",\"errors\":%s",
+		metrics->mode, errors ? "true" : "false");
+	fprintf(out, ",\"wall_time\":%.3f,\"cpu_time\":%.3f,\"items\":%llu",
+		wall_time, cpu, items);
+	fprintf(out, ",\"read_ios\":%llu,\"read_bytes\":%llu,\"read_throughput\":%llu",
+		ios, bytes, throughput(bytes, wall_time));
+	fprintf(out, ",\"eb_cache_hits\":%llu,\"eb_cache_misses\":%llu,\"eb_cache_hit_rate\":",
+		hits, misses);
+	print_hit_rate(out, hits, misses);
+	fprintf(out, ",\"records_allocated\":%llu,\"peak_rss_kib\":%ld,\"devices\":[",
+		records, peak_rss_kib);
+	for (int i = 0; i < metrics->nr_devices; i++) {
+		u64 dev_ios = 0;
+		u64 dev_bytes = 0;
+
+		for (int phase = 1; phase <= CHECK_METRICS_PHASES; phase++) {
+			pm = &metrics->phases[phase];
+			if (!pm->started)
+				continue;
+			dev_ios += pm->reads[i].ios;
+			dev_bytes += pm->reads[i].bytes;
+		}
+		fprintf(out, "%s{\"devid\":%llu,\"path\":", i ? "," : "",
+			metrics->devices[i]->devid);
+		print_string(out, metrics->devices[i]->name ?: "");
+		fprintf(out, ",\"read_ios\":%llu,\"read_bytes\":%llu}",
+			dev_ios, dev_bytes);
+	}
+	fprintf(out, "],\"phases\":[");
+	for (int phase = 1; phase <= CHECK_METRICS_PHASES; phase++) {
+		if (!metrics->phases[phase].started)
+			continue;
+		if (!first)
+			fputc(',', out);
+		print_phase(out, metrics, phase);
+		first = false;
+	}
+	fprintf(out, "]}");
+}
+
+/* Write the record printed by @print as a line to @fd */
+static int write_record(int fd, const struct check_metrics *metrics,
+			void (*print)(FILE *, const struct check_metrics *, int),
+			int arg)
+{
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out;
+	int ret;
+
+	out = open_memstream(&buf, &len);
+	if (!out)
+		return -errno;
+	print(out, metrics, arg);
+	fputc('\n', out);
+	if (fclose(out)) {
+		free(buf);
+		return -ENOMEM;
+	}
+	ret = write_all(fd, buf, len);
+	free(buf);
+	return ret;
+}
+
+static void write_progress(struct check_metrics *metrics)
+{
+	const struct check_phase_metrics *pm = &metrics->phases[metrics->phase];
+	struct timespec now;
+	u64 ios = 0;
+	u64 bytes = 0;
+	double elapsed;
+	char buf[512];
+	int len;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = timespec_diff(&now, &metrics->phase_start);
+	for (int i = 0; i < metrics->nr_devices; i++) {
+		const struct btrfs_device *device = metrics->devices[i];
+
+		ios += __atomic_load_n(&device->read_ios, __ATOMIC_RELAXED) -
+		       metrics->phase_reads[i].ios;
+		bytes += __atomic_load_n(&device->read_bytes, __ATOMIC_RELAXED) -
+			 metrics->phase_reads[i].bytes;
+	}
+	len = snprintf(buf, sizeof(buf),
+"{\"type\":\"progress\",\"phase\":%d,\"name\":\"%s\",\"elapsed\":%.3f,\"items\":%llu,"
+"\"read_ios\":%llu,\"read_bytes\":%llu,\"read_throughput\":%llu,"
+"\"eb_cache_hits\":%llu,\"eb_cache_misses\":%llu}\n",
+		       metrics->phase, pm->name, elapsed, g_task_ctx.item_count,
+		       ios, bytes, throughput(bytes, elapsed),
+		       metrics->fs_info->eb_cache_hits - metrics->phase_eb_hits,
+		       metrics->fs_info->eb_cache_misses - metrics->phase_eb_misses);
+	if (len > 0 && len < sizeof(buf))
+		write_all(metrics->progress_fd, buf, len);
+}
+
+static void *progress_thread(void *p)
+{
+	struct check_metrics *metrics = p;
+
+	task_period_start(metrics->task, 1000);
+	while (1) {
+		task_period_wait(metrics->task);
+		/* Don't leave a partial line when the phase ends */
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		write_progress(metrics);
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+	}
+	return NULL;
+}
+
+int check_metrics_init(struct check_metrics *metrics,
+		       struct btrfs_fs_info *fs_info, const char *mode,
+		       const char *metrics_path, int progress_fd)
+{
+	struct btrfs_device *device;
+	struct check_device_reads *reads;
+	int nr = 0;
+	int ret;
+
+	memset(metrics, 0, sizeof(*metrics));
+	metrics->fs_info = fs_info;
+	metrics->mode = mode;
+	metrics->metrics_fd = -1;
+	metrics->progress_fd = progress_fd;
+
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		nr++;
+	metrics->devices = calloc(nr, sizeof(*metrics->devices));
+	/* One set of reads for each phase and one for the phase start */
+	reads = calloc((CHECK_METRICS_PHASES + 2) * nr, sizeof(*reads));
+	if (!metrics->devices || !reads) {
+		free(metrics->devices);
+		free(reads);
+		return -ENOMEM;
+	}
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		metrics->devices[metrics->nr_devices++] = device;
+	for (int phase = 0; phase <= CHECK_METRICS_PHASES; phase++)
+		metrics->phases[phase].reads = reads + phase * nr;
+	metrics->phase_reads = reads + (CHECK_METRICS_PHASES + 1) * nr;
+
+	if (progress_fd >= 0) {
+		metrics->task = task_init(progress_thread, NULL, metrics);
+		if (!metrics->task) {
+			ret = -ENOMEM;
+			goto error;
+		}
+	}
+	if (metrics_path) {
+		metrics->metrics_fd = open(metrics_path,
+					   O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+					   0644);
+		if (metrics->metrics_fd < 0) {
+			ret = -errno;
+			error("cannot create metrics file %s: %m", metrics_path);
+			goto error;
+		}
+	}
+	return 0;
+
+error:
+	task_deinit(metrics->task);
+	free(metrics->devices);
+	free(metrics->phases[0].reads);
+	return ret;
+}
+
+static void end_phase(struct check_metrics *metrics, u64 records)
+{
+	struct check_phase_metrics *pm;
+	struct timespec now;
+
+	if (!metrics->phase)
+		return;
+	if (metrics->task)
+		task_stop(metrics->task);
+
+	pm = &metrics->phases[metrics->phase];
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	pm->wall_time = timespec_diff(&now, &metrics->phase_start);
+	pm->cpu_time = cpu_time(&pm->peak_rss_kib) - metrics->phase_cpu_start;
+	pm->items = g_task_ctx.item_count;
+	pm->eb_cache_hits = metrics->fs_info->eb_cache_hits - metrics->phase_eb_hits;
+	pm->eb_cache_misses = metrics->fs_info->eb_cache_misses -
+			      metrics->phase_eb_misses;
+	pm->records = records - metrics->phase_records;
+	read_devices(metrics, pm->reads);
+	for (int i = 0; i < metrics->nr_devices; i++) {
+		pm->reads[i].ios -= metrics->phase_reads[i].ios;
+		pm->reads[i].bytes -= metrics->phase_reads[i].bytes;
+	}
+
+	if (metrics->progress_fd >= 0)
+		write_record(metrics->progress_fd, metrics, print_phase,
+			     metrics->phase);
+	metrics->phase = 0;
+}
+
+void check_metrics_phase(struct check_metrics *metrics, int phase,
+			 const char *name, u64 records)
+{
+	struct check_phase_metrics *pm = &metrics->phases[phase];
+
+	end_phase(metrics, records);
+
+	pm->name = name;
+	pm->started = true;
+	metrics->phase = phase;
+	g_task_ctx.item_count = 0;
+	clock_gettime(CLOCK_MONOTONIC, &metrics->phase_start);
+	metrics->phase_cpu_start = cpu_time(NULL);
+	metrics->phase_eb_hits = metrics->fs_info->eb_cache_hits;
+	metrics->phase_eb_misses = metrics->fs_info->eb_cache_misses;
+	metrics->phase_records = records;
+	read_devices(metrics, metrics->phase_reads);
+
+	if (metrics->task)
+		task_start(metrics->task, NULL, NULL);
+}
+
+int check_metrics_finish(struct check_metrics *metrics, int errors,
+			 u64 records)
+{
+	int ret = 0;
+
+	end_phase(metrics, records);
+	if (metrics->progress_fd >= 0)
+		ret = write_record(metrics->progress_fd, metrics,
+				   print_summary, errors);
+	if (metrics->metrics_fd >= 0) {
+		int ret2;
+
+		ret2 = write_record(metrics->metrics_fd, metrics,
+				    print_summary, errors);
+		if (close(metrics->metrics_fd) && !ret2)
+			ret2 = -errno;
+		if (ret2) {
+			errno = -ret2;
+			error("cannot write metrics: %m");
+			ret = ret2;
+		}
+	}
+
+	task_deinit(metrics->task);
+	free(metrics->devices);
+	free(metrics->phases[0].reads);
+	return ret;
+}
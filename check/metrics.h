@@ -0,0 +1,100 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_METRICS_H__
+#define __BTRFS_CHECK_METRICS_H__
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <time.h>
+
+struct btrfs_fs_info;
+struct btrfs_device;
+struct task_info;
+
+/*
+ * Time and resources used by each phase of the check, written as JSON.
+ *
+ * With --progress-fd every record is a line of its own: a "progress" record
+ * each second while a phase runs, a "phase" record when it ends and the
+ * "summary" with all the phases at the end.  The --metrics file gets only the
+ * summary.
+ */
+
+#define CHECK_METRICS_PHASES		(8)
+
+struct check_device_reads {
+	u64 ios;
+	u64 bytes;
+};
+
+struct check_phase_metrics {
+	const char *name;
+	bool started;
+	double wall_time;
+	double cpu_time;
+	u64 items;
+	u64 eb_cache_hits;
+	u64 eb_cache_misses;
+	u64 records;
+	/* Peak resident set size at the end of the phase */
+	long peak_rss_kib;
+	/* Reads of the phase, by device */
+	struct check_device_reads *reads;
+};
+
+struct check_metrics {
+	struct btrfs_fs_info *fs_info;
+	const char *mode;
+	/* Summary file, -1 if not written */
+	int metrics_fd;
+	/* Stream of the records, -1 if not written */
+	int progress_fd;
+
+	int nr_devices;
+	struct btrfs_device **devices;
+
+	struct timespec start;
+	/* Phase in progress, 0 if none */
+	int phase;
+	struct check_phase_metrics phases[CHECK_METRICS_PHASES + 1];
+
+	/* Counters at the start of the phase in progress */
+	struct timespec phase_start;
+	double phase_cpu_start;
+	u64 phase_eb_hits;
+	u64 phase_eb_misses;
+	u64 phase_records;
+	struct check_device_reads *phase_reads;
+
+	/* Writer of the progress records */
+	struct task_info *task;
+};
+
+int check_metrics_init(struct check_metrics *metrics,
+		       struct btrfs_fs_info *fs_info, const char *mode,
+		       const char *metrics_path, int progress_fd);
+/*
+ * End the phase in progress and start @phase, @records is the number of
+ * records allocated by the check so far
+ */
+void check_metrics_phase(struct check_metrics *metrics, int phase,
+			 const char *name, u64 records);
+/* End the last phase and write the summary, free the metrics */
+int check_metrics_finish(struct check_metrics *metrics, int errors,
+			 u64 records);
+
+#endif
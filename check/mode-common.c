@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/extent-io-tree.h"
@@ -32,9 +33,11 @@
 #include "kernel-shared/compression.h"
 #include "kernel-shared/file-item.h"
 #include "kernel-shared/tree-checker.h"
+#include "crypto/hash.h"
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/utils.h"
+#include "common/thread-pool.h"
 #include "check/mode-common.h"
 #include "check/repair.h"
 
@@ -996,7 +999,7 @@ int repair_imode_common(struct btrfs_root *root, struct btrfs_path *path)
 			return ret;
 	}
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -1008,7 +1011,7 @@ int repair_imode_common(struct btrfs_root *root, struct btrfs_path *path)
 	ret = reset_imode(trans, root, path, key.objectid, imode);
 	if (ret < 0)
 		goto abort;
-	ret = btrfs_commit_transaction(trans, root);
+	ret = repair_trans_commit(trans, root);
 	if (!ret)
 		printf("reset mode for inode %llu root %llu\n",
 			key.objectid, root->root_key.objectid);
@@ -1069,7 +1072,7 @@ int recow_extent_buffer(struct btrfs_root *root, struct extent_buffer *eb)
 		return PTR_ERR(root);
 	}
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -1084,7 +1087,7 @@ int recow_extent_buffer(struct btrfs_root *root, struct extent_buffer *eb)
 		btrfs_item_key_to_cpu(eb, &key, 0);
 
 	ret = btrfs_search_slot(trans, root, &key, &path, 0, 1);
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 	btrfs_release_path(&path);
 	return ret;
 }
@@ -1170,7 +1173,7 @@ int repair_dev_item_bytes_used(struct btrfs_fs_info *fs_info,
 	 * device->bytes_used.
 	 */
 	device->bytes_used = bytes_used_expected;
-	trans = btrfs_start_transaction(fs_info->chunk_root, 1);
+	trans = repair_trans_start(fs_info->chunk_root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -1190,7 +1193,7 @@ int repair_dev_item_bytes_used(struct btrfs_fs_info *fs_info,
 	 * Commit transaction not only to save the above change but also update
 	 * the device item in super block.
 	 */
-	ret = btrfs_commit_transaction(trans, fs_info->chunk_root);
+	ret = repair_trans_commit(trans, fs_info->chunk_root);
 	if (ret < 0) {
 		errno = -ret;
 		error_msg(ERROR_MSG_START_TRANS, "%m");
@@ -1204,49 +1207,346 @@ error:
 	return ret;
 }
 
-static int populate_csum(struct btrfs_trans_handle *trans,
-			 struct btrfs_root *csum_root, char *buf, u64 start,
-			 u64 len)
+/* Data read and checksummed at once by a job of the csum tree refill */
+#define CSUM_FILL_JOB_BYTES	(SZ_4M)
+
+struct csum_fill_job {
+	u64 logical;
+	u64 len;
+	/* Range whose csums are deleted after the job is inserted, if any */
+	u64 del_start;
+	u64 del_len;
+	int ret;
+	u8 *csums;
+};
+
+/*
+ * Workers reading the data and calculating the csums of the csum tree refill.
+ * The ranges are queued by the main thread, merged into large reads when they
+ * are contiguous, and the csums are inserted in the order they were queued.
+ */
+struct csum_fill {
+	struct btrfs_trans_handle *trans;
+
+	/*
+	 * Held for read by the workers mapping the data, for write by the
+	 * main thread modifying the trees, which can allocate new chunks.
+	 */
+	pthread_rwlock_t map_lock;
+
+	struct thread_pool pool;
+	/* Ring of the jobs, indexed by the sequence number of the pool */
+	struct csum_fill_job *jobs;
+	unsigned int nr_jobs;
+	/* The job being merged into, not pushed yet */
+	struct csum_fill_job *pending;
+
+	/*
+	 * The ranges are queued in the logical order, the csum items are
+	 * built here and appended by the bulk loader.  Otherwise each job is
+	 * inserted by btrfs_insert_data_csums().
+	 */
+	bool sorted;
+	struct btrfs_bulk_loader loader;
+	u8 *item;
+	u64 item_start;
+	u32 item_nr;
+};
+
+static void csum_fill_process(void *arg, void *data, void *thread_data)
 {
-	struct btrfs_fs_info *fs_info = trans->fs_info;
-	u64 offset = 0;
-	u64 sectorsize = fs_info->sectorsize;
+	struct csum_fill *fill = arg;
+	struct csum_fill_job *job = data;
+	struct btrfs_fs_info *fs_info = fill->trans->fs_info;
+	u8 *buf = thread_data;
+	u64 read_len;
 	int ret = 0;
 
-	while (offset < len) {
-		ret = read_data_from_disk(fs_info, buf, start + offset,
-					  &sectorsize, 0);
-		if (ret)
-			break;
-		ret = btrfs_csum_file_block(trans, start + offset,
-					    BTRFS_EXTENT_CSUM_OBJECTID,
-					    fs_info->csum_type, buf);
-		if (ret)
+	if (!buf) {
+		job->ret = -ENOMEM;
+		return;
+	}
+	pthread_rwlock_rdlock(&fill->map_lock);
+	for (u64 offset = 0; offset < job->len; offset += read_len) {
+		read_len = job->len - offset;
+		ret = read_data_from_disk(fs_info, buf + offset,
+					  job->logical + offset, &read_len, 0);
+		if (ret < 0)
 			break;
-		offset += sectorsize;
 	}
+	pthread_rwlock_unlock(&fill->map_lock);
+	if (ret == 0)
+		btrfs_csum_data_batch(fs_info->csum_type, buf, job->csums,
+				      fs_info->sectorsize,
+				      job->len / fs_info->sectorsize);
+	job->ret = ret;
+}
+
+static void *csum_fill_thread_init(void *arg)
+{
+	return malloc(CSUM_FILL_JOB_BYTES);
+}
+
+static void csum_fill_thread_exit(void *arg, void *thread_data)
+{
+	free(thread_data);
+}
+
+static const struct thread_pool_ops csum_fill_pool_ops = {
+	.process = csum_fill_process,
+	.thread_init = csum_fill_thread_init,
+	.thread_exit = csum_fill_thread_exit,
+};
+
+static void csum_fill_free(struct csum_fill *fill)
+{
+	if (!fill)
+		return;
+	thread_pool_release(&fill->pool);
+	for (unsigned int i = 0; fill->jobs && i < fill->nr_jobs; i++)
+		free(fill->jobs[i].csums);
+	free(fill->jobs);
+	btrfs_bulk_loader_release(&fill->loader);
+	free(fill->item);
+	pthread_rwlock_destroy(&fill->map_lock);
+	free(fill);
+}
+
+/*
+ * Start @nr_threads reading and checksumming the data, none if the csum
+ * implementation can't be used from several threads, the jobs are then
+ * processed by the main thread.  @sorted must be set only if the ranges are
+ * queued in the logical order.
+ */
+static struct csum_fill *csum_fill_start(struct btrfs_trans_handle *trans,
+					 unsigned int nr_threads, bool sorted)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, 0);
+	const u32 job_sectors = CSUM_FILL_JOB_BYTES / fs_info->sectorsize;
+	struct csum_fill *fill;
+
+	/* Same as for --check-data-csum */
+	if (!CRYPTO_HASH_THREAD_SAFE &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_CRC32 &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_XXHASH)
+		nr_threads = 0;
+
+	fill = calloc(1, sizeof(*fill));
+	if (!fill)
+		return NULL;
+	fill->trans = trans;
+	fill->sorted = sorted;
+	pthread_rwlock_init(&fill->map_lock, NULL);
+
+	fill->item = malloc(MAX_CSUM_ITEMS(csum_root, fs_info->csum_size) *
+			    fs_info->csum_size);
+	fill->nr_jobs = max(nr_threads * 2, 1U);
+	fill->jobs = calloc(fill->nr_jobs, sizeof(*fill->jobs));
+	if (!fill->item || !fill->jobs)
+		goto fail;
+	for (unsigned int i = 0; i < fill->nr_jobs; i++) {
+		fill->jobs[i].csums = malloc(job_sectors * fs_info->csum_size);
+		if (!fill->jobs[i].csums)
+			goto fail;
+	}
+	if (thread_pool_init(&fill->pool, &csum_fill_pool_ops, fill,
+			     nr_threads, fill->nr_jobs) < 0)
+		goto fail;
+	return fill;
+fail:
+	csum_fill_free(fill);
+	return NULL;
+}
+
+/* Append the csum item being built, if any */
+static int csum_fill_flush_item(struct csum_fill *fill)
+{
+	struct btrfs_fs_info *fs_info = fill->trans->fs_info;
+	struct btrfs_root *csum_root;
+	struct btrfs_key key;
+	int ret;
+
+	if (!fill->item_nr)
+		return 0;
+	csum_root = btrfs_csum_root(fs_info, fill->item_start);
+	if (fill->loader.root != csum_root) {
+		btrfs_bulk_loader_release(&fill->loader);
+		btrfs_bulk_loader_init(&fill->loader, fill->trans, csum_root, 100);
+	}
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = fill->item_start;
+	ret = btrfs_bulk_loader_add(&fill->loader, &key, fill->item,
+				    fill->item_nr * fs_info->csum_size);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to insert csum for data at logical %llu: %m",
+		      fill->item_start);
+		return ret;
+	}
+	fill->item_nr = 0;
+	return 0;
+}
+
+/* Add the csums of @job to the csum items, which are full unless there's a gap */
+static int csum_fill_add_item(struct csum_fill *fill, struct csum_fill_job *job)
+{
+	struct btrfs_fs_info *fs_info = fill->trans->fs_info;
+	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, job->logical);
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	const u32 max_csums = MAX_CSUM_ITEMS(csum_root, csum_size);
+	const u32 nr_sectors = job->len / sectorsize;
+	u32 added = 0;
+	int ret;
+
+	if (fill->item_nr &&
+	    fill->item_start + (u64)fill->item_nr * sectorsize != job->logical) {
+		ret = csum_fill_flush_item(fill);
+		if (ret < 0)
+			return ret;
+	}
+	while (added < nr_sectors) {
+		const u32 nr = min(nr_sectors - added, max_csums - fill->item_nr);
+
+		if (fill->item_nr == 0)
+			fill->item_start = job->logical + (u64)added * sectorsize;
+		memcpy(fill->item + fill->item_nr * csum_size,
+		       job->csums + added * csum_size, nr * csum_size);
+		fill->item_nr += nr;
+		added += nr;
+		if (fill->item_nr < max_csums)
+			continue;
+		ret = csum_fill_flush_item(fill);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int csum_fill_insert_job(struct csum_fill *fill, struct csum_fill_job *job)
+{
+	struct btrfs_trans_handle *trans = fill->trans;
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	int ret;
+
+	if (fill->sorted)
+		return csum_fill_add_item(fill, job);
+
+	ret = btrfs_insert_data_csums(trans, job->logical, job->len,
+				      BTRFS_EXTENT_CSUM_OBJECTID,
+				      fs_info->csum_type, job->csums);
+	if (ret == -EEXIST)
+		ret = 0;
+	if (ret < 0)
+		return ret;
+	if (job->del_len)
+		ret = btrfs_del_csums(trans,
+				      btrfs_csum_root(fs_info, job->del_start),
+				      job->del_start, job->del_len);
+	return ret;
+}
+
+/* Insert the csums of the oldest queued job, return 1 if there's none */
+static int csum_fill_next_job(struct csum_fill *fill)
+{
+	struct csum_fill_job *job;
+	int ret;
+
+	job = thread_pool_pop(&fill->pool);
+	if (!job)
+		return 1;
+	if (job->ret < 0) {
+		errno = -job->ret;
+		error("failed to read data at logical %llu length %llu: %m",
+		      job->logical, job->len);
+		return job->ret;
+	}
+	pthread_rwlock_wrlock(&fill->map_lock);
+	ret = csum_fill_insert_job(fill, job);
+	pthread_rwlock_unlock(&fill->map_lock);
 	return ret;
 }
 
-static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
+/*
+ * Queue the csums of the sector aligned range [@logical, @logical + @len),
+ * then delete those of [@del_start, @del_start + @del_len) if @del_len is set.
+ */
+static int csum_fill_queue(struct csum_fill *fill, u64 logical, u64 len,
+			   u64 del_start, u64 del_len)
+{
+	struct csum_fill_job *job = fill->pending;
+	int ret;
+
+	while (len) {
+		u64 cur_len;
+
+		if (job && (job->logical + job->len != logical || job->del_len ||
+			    job->len == CSUM_FILL_JOB_BYTES)) {
+			thread_pool_push(&fill->pool, job);
+			job = NULL;
+		}
+		if (!job) {
+			while (thread_pool_full(&fill->pool)) {
+				ret = csum_fill_next_job(fill);
+				if (ret < 0) {
+					fill->pending = NULL;
+					return ret;
+				}
+			}
+			job = &fill->jobs[fill->pool.head_seq % fill->nr_jobs];
+			job->logical = logical;
+			job->len = 0;
+			job->del_start = 0;
+			job->del_len = 0;
+			job->ret = 0;
+		}
+		cur_len = min_t(u64, len, CSUM_FILL_JOB_BYTES - job->len);
+		job->len += cur_len;
+		logical += cur_len;
+		len -= cur_len;
+	}
+	if (job && del_len) {
+		job->del_start = del_start;
+		job->del_len = del_len;
+	}
+	fill->pending = job;
+	return 0;
+}
+
+/* Insert the csums of all queued ranges */
+static int csum_fill_finish(struct csum_fill *fill)
+{
+	int ret;
+
+	if (fill->pending) {
+		thread_pool_push(&fill->pool, fill->pending);
+		fill->pending = NULL;
+	}
+	do {
+		ret = csum_fill_next_job(fill);
+	} while (ret == 0);
+	if (ret < 0)
+		return ret;
+	return csum_fill_flush_item(fill);
+}
+
+static int fill_csum_tree_from_one_fs_root(struct csum_fill *fill,
 					   struct btrfs_root *cur_root)
 {
-	struct btrfs_root *csum_root;
 	struct btrfs_path path = { 0 };
 	struct btrfs_key key;
 	struct extent_buffer *node;
 	struct btrfs_file_extent_item *fi;
-	char *buf = NULL;
 	u64 skip_ino = 0;
 	u64 start = 0;
 	u64 len = 0;
+	u64 del_start;
+	u64 del_len;
 	int slot = 0;
 	int ret = 0;
 
-	buf = malloc(gfs_info->sectorsize);
-	if (!buf)
-		return -ENOMEM;
-
 	key.objectid = 0;
 	key.type = 0;
 	key.offset = 0;
@@ -1300,22 +1600,17 @@ static int fill_csum_tree_from_one_fs_root(struct btrfs_trans_handle *trans,
 		 * This behavior will cost extra IO/CPU time, but there is
 		 * not other way to ensure the correctness.
 		 */
-		csum_root = btrfs_csum_root(gfs_info, start);
 		len = btrfs_file_extent_disk_num_bytes(node, fi);
-		ret = populate_csum(trans, csum_root, buf, start, len);
-		if (ret == -EEXIST)
-			ret = 0;
-		if (ret < 0)
-			goto out;
-
+		del_start = 0;
+		del_len = 0;
 		/* Delete the csum for the preallocated range */
 		if (type == BTRFS_FILE_EXTENT_PREALLOC) {
-			start += btrfs_file_extent_offset(node, fi);
-			len = btrfs_file_extent_num_bytes(node, fi);
-			ret = btrfs_del_csums(trans, csum_root, start, len);
-			if (ret < 0)
-				goto out;
+			del_start = start + btrfs_file_extent_offset(node, fi);
+			del_len = btrfs_file_extent_num_bytes(node, fi);
 		}
+		ret = csum_fill_queue(fill, start, len, del_start, del_len);
+		if (ret < 0)
+			goto out;
 next:
 		/*
 		 * TODO: if next leaf is corrupted, jump to nearest next valid
@@ -1332,20 +1627,26 @@ next:
 
 out:
 	btrfs_release_path(&path);
-	free(buf);
 	return ret;
 }
 
-static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans)
+static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans,
+				  unsigned int nr_threads)
 {
 	struct btrfs_path path = { 0 };
 	struct btrfs_root *tree_root = gfs_info->tree_root;
 	struct btrfs_root *cur_root;
 	struct extent_buffer *node;
+	struct csum_fill *fill;
 	struct btrfs_key key;
 	int slot = 0;
 	int ret = 0;
 
+	/* The file extents are not in the logical order */
+	fill = csum_fill_start(trans, nr_threads, false);
+	if (!fill)
+		return -ENOMEM;
+
 	key.objectid = BTRFS_FS_TREE_OBJECTID;
 	key.type = BTRFS_ROOT_ITEM_KEY;
 	key.offset = 0;
@@ -1362,7 +1663,7 @@ static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans)
 		slot = path.slots[0];
 		btrfs_item_key_to_cpu(node, &key, slot);
 		if (key.objectid > BTRFS_LAST_FREE_OBJECTID)
-			goto out;
+			break;
 		if (key.type != BTRFS_ROOT_ITEM_KEY)
 			goto next;
 		if (!is_fstree(key.objectid))
@@ -1373,30 +1674,35 @@ static int fill_csum_tree_from_fs(struct btrfs_trans_handle *trans)
 		if (IS_ERR(cur_root) || !cur_root) {
 			fprintf(stderr, "Fail to read fs/subvol tree: %lld\n",
 				key.objectid);
-			goto out;
+			break;
 		}
-		ret = fill_csum_tree_from_one_fs_root(trans, cur_root);
+		ret = fill_csum_tree_from_one_fs_root(fill, cur_root);
 		if (ret < 0)
 			goto out;
 next:
 		ret = btrfs_next_item(tree_root, &path);
 		if (ret > 0) {
 			ret = 0;
-			goto out;
+			break;
 		}
 		if (ret < 0)
 			goto out;
 	}
+	ret = csum_fill_finish(fill);
 
 out:
 	btrfs_release_path(&path);
+	csum_fill_free(fill);
 	return ret;
 }
 
-static int remove_csum_for_file_extent(u64 ino, u64 offset, u64 rootid, void *ctx)
+/*
+ * Clear the range of a file extent from the csummed ranges of the data extent
+ * if it's preallocated or of a NODATASUM inode.
+ */
+static int exclude_csum_for_file_extent(u64 ino, u64 offset, u64 rootid, void *ctx)
 {
-	struct btrfs_trans_handle *trans = (struct btrfs_trans_handle *)ctx;
-	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct extent_io_tree *csum_ranges = ctx;
 	struct btrfs_file_extent_item *fi;
 	struct btrfs_inode_item *ii;
 	struct btrfs_path path = {};
@@ -1411,7 +1717,7 @@ static int remove_csum_for_file_extent(u64 ino, u64 offset, u64 rootid, void *ct
 	key.objectid = rootid;
 	key.type = BTRFS_ROOT_ITEM_KEY;
 	key.offset = (u64)-1;
-	root = btrfs_read_fs_root(fs_info, &key);
+	root = btrfs_read_fs_root(gfs_info, &key);
 	if (IS_ERR(root)) {
 		ret = PTR_ERR(root);
 		goto out;
@@ -1434,7 +1740,7 @@ static int remove_csum_for_file_extent(u64 ino, u64 offset, u64 rootid, void *ct
 
 	btrfs_release_path(&path);
 
-	/* Check the file extent item and delete csum if needed */
+	/* Check the file extent item and exclude its range if needed */
 	key.objectid = ino;
 	key.type = BTRFS_EXTENT_DATA_KEY;
 	key.offset = offset;
@@ -1455,13 +1761,13 @@ static int remove_csum_for_file_extent(u64 ino, u64 offset, u64 rootid, void *ct
 	    BTRFS_COMPRESS_NONE)
 		goto out;
 	/*
-	 * We only want to delete the csum range if the inode has NODATASUM
+	 * We only want to exclude the csum range if the inode has NODATASUM
 	 * flag or it's a preallocated extent.
 	 */
 	if (!(nocsum || type == BTRFS_FILE_EXTENT_PREALLOC))
 		goto out;
 
-	/* If NODATASUM, we need to remove all csum for the extent */
+	/* If NODATASUM, we need to exclude all csum for the extent */
 	if (nocsum) {
 		disk_bytenr = btrfs_file_extent_disk_bytenr(path.nodes[0], fi);
 		disk_len = btrfs_file_extent_disk_num_bytes(path.nodes[0], fi);
@@ -1470,27 +1776,25 @@ static int remove_csum_for_file_extent(u64 ino, u64 offset, u64 rootid, void *ct
 			      btrfs_file_extent_offset(path.nodes[0], fi);
 		disk_len = btrfs_file_extent_num_bytes(path.nodes[0], fi);
 	}
-	btrfs_release_path(&path);
-
-	/* Now delete the csum for the preallocated or nodatasum range */
-	root = btrfs_csum_root(fs_info, disk_bytenr);
-	ret = btrfs_del_csums(trans, root, disk_bytenr, disk_len);
+	if (disk_len)
+		clear_extent_dirty(csum_ranges, disk_bytenr,
+				   disk_bytenr + disk_len - 1, NULL);
 out:
 	btrfs_release_path(&path);
 	return ret;
 }
 
-static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
+static int fill_csum_tree_from_extent(struct csum_fill *fill,
 				      struct btrfs_root *extent_root)
 {
-	struct btrfs_root *csum_root;
 	struct btrfs_path path = { 0 };
 	struct btrfs_extent_item *ei;
 	struct extent_buffer *leaf;
-	char *buf;
+	struct extent_io_tree csum_ranges;
 	struct btrfs_key key;
 	int ret;
 
+	extent_io_tree_init(gfs_info, &csum_ranges, 0);
 	key.objectid = 0;
 	key.type = BTRFS_EXTENT_ITEM_KEY;
 	key.offset = 0;
@@ -1500,13 +1804,10 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
 		return ret;
 	}
 
-	buf = malloc(gfs_info->sectorsize);
-	if (!buf) {
-		btrfs_release_path(&path);
-		return -ENOMEM;
-	}
-
 	while (1) {
+		u64 start;
+		u64 end;
+
 		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
 			ret = btrfs_next_leaf(extent_root, &path);
 			if (ret < 0)
@@ -1532,10 +1833,9 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
 			continue;
 		}
 		/*
-		 * Generate the datasum unconditionally first.
-		 *
-		 * This will generate csum for preallocated extents, but that
-		 * will be later deleted.
+		 * Generate the datasum for the whole extent except the ranges
+		 * of preallocated extents and NODATASUM inodes, the same as
+		 * generating all the csums and deleting those.
 		 *
 		 * This is to address cases like this:
 		 *  fallocate 0 8K
@@ -1545,20 +1845,27 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
 		 *
 		 * Above case we will have csum for [0, 4K) and that's valid.
 		 */
-		csum_root = btrfs_csum_root(gfs_info, key.objectid);
-		ret = populate_csum(trans, csum_root, buf, key.objectid,
-				    key.offset);
-		if (ret < 0)
-			break;
-		ret = iterate_extent_inodes(trans->fs_info, key.objectid, 0, 0,
-					    remove_csum_for_file_extent, trans);
+		set_extent_dirty(&csum_ranges, key.objectid,
+				 key.objectid + key.offset - 1, GFP_NOFS);
+		ret = iterate_extent_inodes(gfs_info, key.objectid, 0, 0,
+					    exclude_csum_for_file_extent,
+					    &csum_ranges);
 		if (ret)
 			break;
+		while (!find_first_extent_bit(&csum_ranges, key.objectid,
+					      &start, &end, EXTENT_DIRTY, NULL)) {
+			clear_extent_dirty(&csum_ranges, start, end, NULL);
+			ret = csum_fill_queue(fill, start, end + 1 - start, 0, 0);
+			if (ret < 0)
+				break;
+		}
+		if (ret < 0)
+			break;
 		path.slots[0]++;
 	}
 
 	btrfs_release_path(&path);
-	free(buf);
+	extent_io_tree_release(&csum_ranges);
 	return ret;
 }
 
@@ -1569,19 +1876,27 @@ static int fill_csum_tree_from_extent(struct btrfs_trans_handle *trans,
  *			If true, iterate all fs roots to get all
  *			extent data (which can be slow).
  *			Otherwise, search extent tree for extent data.
+ * @nr_threads:		Threads reading and checksumming the data, 0 to do it
+ *			in the calling thread.
  */
-int fill_csum_tree(struct btrfs_trans_handle *trans, bool search_fs_tree)
+int fill_csum_tree(struct btrfs_trans_handle *trans, bool search_fs_tree,
+		   unsigned int nr_threads)
 {
 	struct btrfs_root *root;
+	struct csum_fill *fill;
 	struct rb_node *n;
 	int ret;
 
 	if (search_fs_tree)
-		return fill_csum_tree_from_fs(trans);
+		return fill_csum_tree_from_fs(trans, nr_threads);
 
+	/* The data extents of each extent tree are in the logical order */
+	fill = csum_fill_start(trans, nr_threads, true);
+	if (!fill)
+		return -ENOMEM;
 	root = btrfs_extent_root(gfs_info, 0);
 	while (1) {
-		ret = fill_csum_tree_from_extent(trans, root);
+		ret = fill_csum_tree_from_extent(fill, root);
 		if (ret)
 			break;
 		n = rb_next(&root->rb_node);
@@ -1591,6 +1906,9 @@ int fill_csum_tree(struct btrfs_trans_handle *trans, bool search_fs_tree)
 		if (root->root_key.objectid != BTRFS_EXTENT_TREE_OBJECTID)
 			break;
 	}
+	if (ret == 0)
+		ret = csum_fill_finish(fill);
+	csum_fill_free(fill);
 	return ret;
 }
 
@@ -32,6 +32,8 @@
 struct btrfs_trans_handle;
 struct extent_buffer;
 struct task_ctx;
+struct check_checkpoint;
+struct tree_prefetch;
 
 extern struct task_ctx g_task_ctx;
 
@@ -48,6 +50,8 @@ struct node_refs {
 	int checked[BTRFS_MAX_LEVEL];
 	/* the corresponding extent should be marked as full backref or not */
 	int full_backref[BTRFS_MAX_LEVEL];
+	/* the node whose children were queued for prefetch, lowmem mode only */
+	u64 prefetched[BTRFS_MAX_LEVEL];
 };
 
 enum task_position {
@@ -66,6 +70,9 @@ struct task_ctx {
 	enum task_position tp;
 	time_t start_time;
 	u64 item_count;
+	/* Data verified and to be verified by --check-data-csum */
+	u64 csum_bytes_done;
+	u64 csum_bytes_total;
 
 	struct task_info *info;
 };
@@ -83,8 +90,11 @@ extern struct list_head delete_items;
 extern bool no_holes;
 extern bool init_extent_tree;
 extern bool check_data_csum;
+extern u64 check_since_generation;
+extern struct check_checkpoint *check_checkpoint;
 extern struct btrfs_fs_info *gfs_info;
 extern struct cache_tree *roots_info_cache;
+extern struct tree_prefetch *tree_prefetch;
 
 static inline u8 imode_to_type(u32 imode)
 {
@@ -194,7 +204,8 @@ static inline void btrfs_check_subpage_eb_alignment(struct btrfs_fs_info *info,
 int repair_dev_item_bytes_used(struct btrfs_fs_info *fs_info,
 			       u64 devid, u64 bytes_used_expected);
 
-int fill_csum_tree(struct btrfs_trans_handle *trans, bool search_fs_tree);
+int fill_csum_tree(struct btrfs_trans_handle *trans, bool search_fs_tree,
+		   unsigned int nr_threads);
 
 int check_and_repair_super_num_devs(struct btrfs_fs_info *fs_info);
 
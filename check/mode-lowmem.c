@@ -38,23 +38,65 @@
 #include "common/internal.h"
 #include "common/utils.h"
 #include "common/device-utils.h"
+#include "common/tree-prefetch.h"
 #include "check/repair.h"
 #include "check/mode-common.h"
 #include "check/mode-lowmem.h"
+#include "check/backref-cache.h"
+#include "check/checkpoint.h"
 
 static u64 last_allocated_chunk;
 static u64 total_used = 0;
 static bool found_free_ino_cache = false;
+/*
+ * Extent items looked up for the referencers, shared by the fs tree and the
+ * extent tree checks, not used when repairing as that changes the extent tree
+ */
+static struct backref_cache *backref_cache = NULL;
+
+static struct backref_cache *get_backref_cache(void)
+{
+	if (!backref_cache)
+		backref_cache = backref_cache_alloc(gfs_info,
+				opt_check_repair ? 0 : LOWMEM_BACKREF_CACHE_SIZE);
+	return backref_cache;
+}
+
+/* See backref_cache_lookup() */
+static int lookup_extent_item(u64 bytenr, u8 type, struct extent_buffer **leaf)
+{
+	struct backref_cache *cache = get_backref_cache();
+
+	if (!cache)
+		return -ENOMEM;
+	return backref_cache_lookup(cache, bytenr, type, leaf);
+}
+
+/* See backref_cache_lookup_exact() */
+static int lookup_extent_item_exact(u64 bytenr, u64 num_bytes,
+				    struct extent_buffer **leaf)
+{
+	struct backref_cache *cache = get_backref_cache();
+
+	if (!cache)
+		return -ENOMEM;
+	return backref_cache_lookup_exact(cache, bytenr, num_bytes, leaf);
+}
+
+void free_backref_cache_lowmem(void)
+{
+	backref_cache_free(backref_cache);
+	backref_cache = NULL;
+}
 
 static int calc_extent_flag(struct btrfs_root *root, struct extent_buffer *eb,
 			    u64 *flags_ret)
 {
-	struct btrfs_root *extent_root;
 	struct btrfs_root_item *ri = &root->root_item;
 	struct btrfs_extent_inline_ref *iref;
 	struct btrfs_extent_item *ei;
 	struct btrfs_key key;
-	struct btrfs_path *path = NULL;
+	struct extent_buffer *leaf = NULL;
 	unsigned long ptr;
 	unsigned long end;
 	u64 flags;
@@ -81,32 +123,18 @@ static int calc_extent_flag(struct btrfs_root *root, struct extent_buffer *eb,
 	if (owner == root->objectid)
 		goto normal;
 
-	path = btrfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-
-	key.objectid = btrfs_header_bytenr(eb);
-	key.type = (u8)-1;
-	key.offset = (u64)-1;
-
-	extent_root = btrfs_extent_root(gfs_info, key.objectid);
-	ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
-	if (ret <= 0) {
-		ret = -EIO;
+	ret = lookup_extent_item(btrfs_header_bytenr(eb),
+				 BTRFS_METADATA_ITEM_KEY, &leaf);
+	if (ret < 0)
 		goto out;
+	if (ret) {
+		ret = 0;
+		goto full_backref;
 	}
+	btrfs_item_key_to_cpu(leaf, &key, 0);
 
-	if (ret > 0) {
-		ret = btrfs_previous_extent_item(extent_root, path,
-						 key.objectid);
-		if (ret)
-			goto full_backref;
-
-	}
-	btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
-
-	eb = path->nodes[0];
-	slot = path->slots[0];
+	eb = leaf;
+	slot = 0;
 	ei = btrfs_item_ptr(eb, slot, struct btrfs_extent_item);
 
 	flags = btrfs_extent_flags(eb, ei);
@@ -147,7 +175,7 @@ normal:
 full_backref:
 	*flags_ret |= BTRFS_BLOCK_FLAG_FULL_BACKREF;
 out:
-	btrfs_free_path(path);
+	backref_cache_put(leaf);
 	return ret;
 }
 
@@ -158,8 +186,9 @@ out:
  */
 static bool need_check(struct btrfs_root *root, struct ulist *roots)
 {
-	struct rb_node *node;
+	struct ulist_iterator iter;
 	struct ulist_node *u;
+	u64 min_root = (u64)-1;
 
 	/*
 	 * @roots can be empty if it belongs to tree reloc tree
@@ -169,13 +198,14 @@ static bool need_check(struct btrfs_root *root, struct ulist *roots)
 	if (roots->nnodes == 1 || roots->nnodes == 0)
 		return true;
 
-	node = rb_first(&roots->root);
-	u = rb_entry(node, struct ulist_node, rb_node);
+	ULIST_ITER_INIT(&iter);
+	while ((u = ulist_next(roots, &iter)))
+		min_root = min(min_root, u->val);
 	/*
 	 * current root id is not smallest, we skip it and let it be checked
 	 * in the fs or file tree who hash the smallest root id.
 	 */
-	if (root->objectid != u->val)
+	if (root->objectid != min_root)
 		return false;
 
 	return true;
@@ -352,7 +382,7 @@ static int create_chunk_and_block_group(u64 flags, u64 *start, u64 *nbytes)
 	if ((flags & BTRFS_BLOCK_GROUP_TYPE_MASK) == 0)
 		return -EINVAL;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -374,7 +404,7 @@ static int create_chunk_and_block_group(u64 flags, u64 *start, u64 *nbytes)
 		goto out;
 	}
 out:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 	return ret;
 }
 
@@ -567,7 +597,7 @@ static int delete_item(struct btrfs_root *root, struct btrfs_path *path)
 	ret = avoid_extents_overwrite();
 	if (ret)
 		return ret;
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -591,7 +621,7 @@ static int delete_item(struct btrfs_root *root, struct btrfs_path *path)
 	else
 		path->slots[0]--;
 out:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 	if (ret)
 		error("failed to delete root %llu item[%llu, %u, %llu]",
 		      root->objectid, key.objectid, key.type, key.offset);
@@ -612,7 +642,7 @@ static int repair_block_accounting(void)
 	struct btrfs_trans_handle *trans = NULL;
 	int ret;
 
-	trans = btrfs_start_transaction(gfs_info->tree_root, 1);
+	trans = repair_trans_start(gfs_info->tree_root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -621,7 +651,7 @@ static int repair_block_accounting(void)
 	}
 
 	ret = btrfs_fix_block_accounting(trans);
-	btrfs_commit_transaction(trans, gfs_info->tree_root);
+	repair_trans_commit(trans, gfs_info->tree_root);
 	return ret;
 }
 
@@ -688,7 +718,7 @@ static int repair_tree_block_ref(struct btrfs_root *root,
 	ret = avoid_extents_overwrite();
 	if (ret)
 		goto out;
-	trans = btrfs_start_transaction(extent_root, 1);
+	trans = repair_trans_start(extent_root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -762,7 +792,7 @@ static int repair_tree_block_ref(struct btrfs_root *root,
 	nrefs->refs[level]++;
 out:
 	if (trans)
-		btrfs_commit_transaction(trans, extent_root);
+		repair_trans_commit(trans, extent_root);
 	btrfs_release_path(&path);
 	if (ret) {
 		errno = -ret;
@@ -1031,7 +1061,7 @@ static int repair_ternary_lowmem(struct btrfs_root *root, u64 dir_ino, u64 ino,
 	/* stage must be smllarer than 3 */
 	UASSERT(stage < 3);
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (stage == 2) {
 		ret = btrfs_unlink(trans, root, ino, dir_ino, index, name,
 				   name_len, 0);
@@ -1047,7 +1077,7 @@ static int repair_ternary_lowmem(struct btrfs_root *root, u64 dir_ino, u64 ino,
 		goto out;
 	}
 out:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 
 	if (ret)
 		error("fail to repair inode %llu name %s filetype %u",
@@ -1501,7 +1531,7 @@ static int repair_inode_item_missing(struct btrfs_root *root, u64 ino,
 	key.type = BTRFS_INODE_ITEM_KEY;
 	key.offset = 0;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = -EIO;
 		goto out;
@@ -1515,7 +1545,7 @@ static int repair_inode_item_missing(struct btrfs_root *root, u64 ino,
 	create_inode_item_lowmem(trans, root, ino, filetype);
 	ret = 0;
 fail:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 out:
 	if (ret)
 		error("failed to repair root %llu INODE ITEM[%llu] missing",
@@ -1535,7 +1565,7 @@ static int lowmem_delete_corrupted_dir_item(struct btrfs_root *root,
 	struct btrfs_trans_handle *trans;
 	int ret;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -1547,7 +1577,7 @@ static int lowmem_delete_corrupted_dir_item(struct btrfs_root *root,
 	if (ret < 0) {
 		btrfs_abort_transaction(trans, ret);
 	} else {
-		ret = btrfs_commit_transaction(trans, root);
+		ret = repair_trans_commit(trans, root);
 		if (ret < 0) {
 			errno = -ret;
 			error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
@@ -1861,7 +1891,7 @@ static int punch_extent_hole(struct btrfs_root *root, struct btrfs_path *path,
 	int ret;
 
 	btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans))
 		return PTR_ERR(trans);
 
@@ -1873,7 +1903,7 @@ static int punch_extent_hole(struct btrfs_root *root, struct btrfs_path *path,
 		return ret;
 	}
 	printf("Add a hole [%llu, %llu] in inode [%llu]\n", start, len, ino);
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 
 	btrfs_release_path(path);
 	ret = btrfs_search_slot(NULL, root, &key, path, 0, 0);
@@ -1892,7 +1922,7 @@ static int repair_inline_ram_bytes(struct btrfs_root *root,
 	int ret;
 	int recover_ret;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		return ret;
@@ -1922,7 +1952,7 @@ static int repair_inline_ram_bytes(struct btrfs_root *root,
 	btrfs_set_file_extent_ram_bytes(path->nodes[0], fi, on_disk_data_len);
 	btrfs_mark_buffer_dirty(path->nodes[0]);
 
-	ret = btrfs_commit_transaction(trans, root);
+	ret = repair_trans_commit(trans, root);
 	if (!ret) {
 		printf(
 	"Successfully repaired inline ram_bytes for root %llu ino %llu\n",
@@ -2283,7 +2313,7 @@ static int repair_inode_nbytes_lowmem(struct btrfs_root *root,
 	key.type = BTRFS_INODE_ITEM_KEY;
 	key.offset = 0;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		err |= ret;
@@ -2304,7 +2334,7 @@ static int repair_inode_nbytes_lowmem(struct btrfs_root *root,
 	btrfs_set_inode_nbytes(path->nodes[0], ii, nbytes);
 	btrfs_mark_buffer_dirty(path->nodes[0]);
 fail:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 out:
 	if (ret)
 		error("failed to set nbytes in inode %llu root %llu",
@@ -2344,7 +2374,7 @@ static int repair_dir_isize_lowmem(struct btrfs_root *root,
 	key.type = BTRFS_INODE_ITEM_KEY;
 	key.offset = 0;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		err |= ret;
@@ -2365,7 +2395,7 @@ static int repair_dir_isize_lowmem(struct btrfs_root *root,
 	btrfs_set_inode_size(path->nodes[0], ii, isize);
 	btrfs_mark_buffer_dirty(path->nodes[0]);
 fail:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 out:
 	if (ret)
 		error("failed to set isize in inode %llu root %llu",
@@ -2397,7 +2427,7 @@ static int repair_inode_orphan_item_lowmem(struct btrfs_root *root,
 
 	btrfs_item_key_to_cpu(path->nodes[0], &research_key, path->slots[0]);
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		err |= ret;
@@ -2407,7 +2437,7 @@ static int repair_inode_orphan_item_lowmem(struct btrfs_root *root,
 	btrfs_release_path(path);
 	ret = btrfs_add_orphan_item(trans, root, path, ino);
 	err |= ret;
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 out:
 	if (ret)
 		error("failed to add inode %llu as orphan item root %llu",
@@ -2456,7 +2486,7 @@ static int repair_inode_nlinks_lowmem(struct btrfs_root *root,
 		       ino, namebuf);
 	}
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		goto out;
@@ -2491,7 +2521,7 @@ static int repair_inode_nlinks_lowmem(struct btrfs_root *root,
 	if (nlink)
 		*nlink = ref_count;
 fail:
-	btrfs_commit_transaction(trans, root);
+	repair_trans_commit(trans, root);
 out:
 	if (ret)
 		error(
@@ -2535,7 +2565,7 @@ static int repair_inode_gen_lowmem(struct btrfs_root *root,
 	u64 transid;
 	int ret;
 
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -2564,7 +2594,7 @@ static int repair_inode_gen_lowmem(struct btrfs_root *root,
 	btrfs_set_inode_generation(path->nodes[0], ii, trans->transid);
 	btrfs_set_inode_transid(path->nodes[0], ii, trans->transid);
 	btrfs_mark_buffer_dirty(path->nodes[0]);
-	ret = btrfs_commit_transaction(trans, root);
+	ret = repair_trans_commit(trans, root);
 	if (ret < 0) {
 		errno = -ret;
 		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
@@ -2662,6 +2692,9 @@ static int check_inode_item(struct btrfs_root *root, struct btrfs_path *path)
 	if (btrfs_super_log_root(super) != 0 &&
 	    root->objectid == BTRFS_TREE_LOG_OBJECTID)
 		gen_uplimit = btrfs_super_generation(super) + 1;
+	else if (gfs_info->running_transaction)
+		/* Written by the batched repairs not committed yet */
+		gen_uplimit = gfs_info->running_transaction->transid;
 	else
 		gen_uplimit = btrfs_super_generation(super);
 
@@ -3020,7 +3053,7 @@ static int check_tree_block_ref(struct btrfs_root *root,
 	struct btrfs_path path = { 0 };
 	struct btrfs_extent_item *ei;
 	struct btrfs_extent_inline_ref *iref;
-	struct extent_buffer *leaf;
+	struct extent_buffer *leaf = NULL;
 	unsigned long end;
 	unsigned long ptr;
 	int slot;
@@ -3036,28 +3069,17 @@ static int check_tree_block_ref(struct btrfs_root *root,
 	int strict = 1;
 	int parent = 0;
 
-	key.objectid = bytenr;
-	if (btrfs_fs_incompat(gfs_info, SKINNY_METADATA))
-		key.type = BTRFS_METADATA_ITEM_KEY;
-	else
-		key.type = BTRFS_EXTENT_ITEM_KEY;
-	key.offset = (u64)-1;
-
 	/* Search for the backref in extent tree */
 	extent_root = btrfs_extent_root(gfs_info, bytenr);
-	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
-	if (ret < 0) {
-		err |= BACKREF_MISSING;
-		goto out;
-	}
-	ret = btrfs_previous_extent_item(extent_root, &path, bytenr);
+	ret = lookup_extent_item(bytenr,
+			btrfs_fs_incompat(gfs_info, SKINNY_METADATA) ?
+			BTRFS_METADATA_ITEM_KEY : BTRFS_EXTENT_ITEM_KEY, &leaf);
 	if (ret) {
 		err |= BACKREF_MISSING;
 		goto out;
 	}
 
-	leaf = path.nodes[0];
-	slot = path.slots[0];
+	slot = 0;
 	btrfs_item_key_to_cpu(leaf, &key, slot);
 
 	ei = btrfs_item_ptr(leaf, slot, struct btrfs_extent_item);
@@ -3164,6 +3186,8 @@ static int check_tree_block_ref(struct btrfs_root *root,
 			break;
 		ptr += btrfs_extent_inline_ref_size(type);
 	}
+	backref_cache_put(leaf);
+	leaf = NULL;
 
 	/*
 	 * Inlined extent item doesn't have what we need, check
@@ -3206,6 +3230,7 @@ static int check_tree_block_ref(struct btrfs_root *root,
 	if (!found_ref)
 		err |= BACKREF_MISSING;
 out:
+	backref_cache_put(leaf);
 	btrfs_release_path(&path);
 	if (nrefs && strict &&
 	    level < root_level && nrefs->full_backref[level + 1])
@@ -3299,7 +3324,7 @@ static int repair_extent_data_item(struct btrfs_root *root,
 	ret = avoid_extents_overwrite();
 	if (ret)
 		goto out;
-	trans = btrfs_start_transaction(root, 1);
+	trans = repair_trans_start(root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -3349,7 +3374,7 @@ static int repair_extent_data_item(struct btrfs_root *root,
 	err &= ~BACKREF_MISSING;
 out:
 	if (trans)
-		btrfs_commit_transaction(trans, root);
+		repair_trans_commit(trans, root);
 	btrfs_release_path(&path);
 out_no_release:
 	if (ret)
@@ -3399,7 +3424,7 @@ static int check_extent_data_item(struct btrfs_root *root,
 	struct btrfs_root *extent_root;
 	struct btrfs_key fi_key;
 	struct btrfs_key dbref_key;
-	struct extent_buffer *leaf;
+	struct extent_buffer *leaf = NULL;
 	struct btrfs_extent_item *ei;
 	struct btrfs_extent_inline_ref *iref;
 	struct btrfs_extent_data_ref *dref;
@@ -3484,13 +3509,12 @@ static int check_extent_data_item(struct btrfs_root *root,
 	dbref_key.type = BTRFS_EXTENT_ITEM_KEY;
 	dbref_key.offset = btrfs_file_extent_disk_num_bytes(eb, fi);
 
-	extent_root = btrfs_extent_root(gfs_info, dbref_key.objectid);
-	ret = btrfs_search_slot(NULL, extent_root, &dbref_key, &path, 0, 0);
+	ret = lookup_extent_item_exact(dbref_key.objectid, dbref_key.offset,
+				       &leaf);
 	if (ret)
 		goto out;
 
-	leaf = path.nodes[0];
-	slot = path.slots[0];
+	slot = 0;
 	ei = btrfs_item_ptr(leaf, slot, struct btrfs_extent_item);
 
 	extent_flags = btrfs_extent_flags(leaf, ei);
@@ -3504,7 +3528,7 @@ static int check_extent_data_item(struct btrfs_root *root,
 	}
 
 	/* Check data backref inside that extent item */
-	item_size = btrfs_item_size(leaf, path.slots[0]);
+	item_size = btrfs_item_size(leaf, slot);
 	iref = (struct btrfs_extent_inline_ref *)(ei + 1);
 	ptr = (unsigned long)iref;
 	end = (unsigned long)ei + item_size;
@@ -3549,9 +3573,10 @@ static int check_extent_data_item(struct btrfs_root *root,
 		ptr += btrfs_extent_inline_ref_size(type);
 	}
 
-	if (!found_dbackref) {
-		btrfs_release_path(&path);
+	backref_cache_put(leaf);
+	leaf = NULL;
 
+	if (!found_dbackref) {
 		/* Didn't find inlined data backref, try EXTENT_DATA_REF_KEY */
 		dbref_key.objectid = btrfs_file_extent_disk_bytenr(eb, fi);
 		dbref_key.type = BTRFS_EXTENT_DATA_REF_KEY;
@@ -3587,6 +3612,7 @@ static int check_extent_data_item(struct btrfs_root *root,
 out:
 	if (!found_dbackref)
 		err |= BACKREF_MISSING;
+	backref_cache_put(leaf);
 	btrfs_release_path(&path);
 	if (err & BACKREF_MISSING) {
 		error(
@@ -3732,9 +3758,8 @@ out:
  */
 static int query_tree_block_level(u64 bytenr)
 {
-	struct btrfs_root *extent_root;
 	struct extent_buffer *eb;
-	struct btrfs_path path = { 0 };
+	struct extent_buffer *leaf;
 	struct btrfs_key key;
 	struct btrfs_extent_item *ei;
 	struct btrfs_tree_parent_check check = { 0 };
@@ -3745,33 +3770,22 @@ static int query_tree_block_level(u64 bytenr)
 	int ret;
 
 	/* Search extent tree for extent generation and level */
-	key.objectid = bytenr;
-	key.type = BTRFS_METADATA_ITEM_KEY;
-	key.offset = (u64)-1;
-
-	extent_root = btrfs_extent_root(gfs_info, bytenr);
-	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	ret = lookup_extent_item(bytenr, BTRFS_METADATA_ITEM_KEY, &leaf);
 	if (ret < 0)
-		goto release_out;
-	ret = btrfs_previous_extent_item(extent_root, &path, bytenr);
-	if (ret < 0)
-		goto release_out;
-	if (ret > 0) {
-		ret = -ENOENT;
-		goto release_out;
-	}
+		return ret;
+	if (ret > 0)
+		return -ENOENT;
 
-	btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
-	ei = btrfs_item_ptr(path.nodes[0], path.slots[0],
-			    struct btrfs_extent_item);
-	flags = btrfs_extent_flags(path.nodes[0], ei);
+	btrfs_item_key_to_cpu(leaf, &key, 0);
+	ei = btrfs_item_ptr(leaf, 0, struct btrfs_extent_item);
+	flags = btrfs_extent_flags(leaf, ei);
 	if (!(flags & BTRFS_EXTENT_FLAG_TREE_BLOCK)) {
 		ret = -ENOENT;
 		goto release_out;
 	}
 
 	/* Get transid for later read_tree_block() check */
-	transid = btrfs_extent_generation(path.nodes[0], ei);
+	transid = btrfs_extent_generation(leaf, ei);
 
 	/* Get backref level as one source */
 	if (key.type == BTRFS_METADATA_ITEM_KEY) {
@@ -3780,9 +3794,9 @@ static int query_tree_block_level(u64 bytenr)
 		struct btrfs_tree_block_info *info;
 
 		info = (struct btrfs_tree_block_info *)(ei + 1);
-		backref_level = btrfs_tree_block_level(path.nodes[0], info);
+		backref_level = btrfs_tree_block_level(leaf, info);
 	}
-	btrfs_release_path(&path);
+	backref_cache_put(leaf);
 
 	/* Get level from tree block as an alternative source */
 	check.transid = transid;
@@ -3799,7 +3813,7 @@ static int query_tree_block_level(u64 bytenr)
 	return header_level;
 
 release_out:
-	btrfs_release_path(&path);
+	backref_cache_put(leaf);
 	return ret;
 }
 
@@ -3983,12 +3997,9 @@ out:
  */
 static int has_inline_shared_backref(u64 data_bytenr, u64 data_len, u64 parent)
 {
-	struct btrfs_root *extent_root = btrfs_extent_root(gfs_info, data_bytenr);
 	struct btrfs_extent_inline_ref *iref;
 	struct btrfs_extent_item *ei;
-	struct btrfs_path path = { 0 };
-	struct extent_buffer *leaf;
-	struct btrfs_key key;
+	struct extent_buffer *leaf = NULL;
 	unsigned long ptr;
 	unsigned long end;
 	bool found = false;
@@ -3996,25 +4007,20 @@ static int has_inline_shared_backref(u64 data_bytenr, u64 data_len, u64 parent)
 	u64 flags;
 	int ret;
 
-	key.objectid = data_bytenr;
-	key.type = BTRFS_EXTENT_ITEM_KEY;
-	key.offset = data_len;
-
-	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	ret = lookup_extent_item_exact(data_bytenr, data_len, &leaf);
 	if (ret > 0)
 		ret = -ENOENT;
 	if (ret < 0)
 		goto out;
 
-	leaf = path.nodes[0];
-	item_size = btrfs_item_size(leaf, path.slots[0]);
+	item_size = btrfs_item_size(leaf, 0);
 	if (item_size < sizeof(*ei)) {
 		error("extent item size %u < %zu, leaf %llu slot %u",
-		      item_size, sizeof(*ei), leaf->start, path.slots[0]);
+		      item_size, sizeof(*ei), leaf->start, 0);
 		ret = -EUCLEAN;
 		goto out;
 	}
-	ei = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_extent_item);
+	ei = btrfs_item_ptr(leaf, 0, struct btrfs_extent_item);
 	flags = btrfs_extent_flags(leaf, ei);
 
 	if (!(flags & BTRFS_EXTENT_FLAG_DATA)) {
@@ -4054,7 +4060,7 @@ next:
 	}
 
 out:
-	btrfs_release_path(&path);
+	backref_cache_put(leaf);
 	if (ret < 0)
 		return ret;
 	return found;
@@ -4119,33 +4125,26 @@ static int check_extent_data_backref(u64 root_id, u64 objectid, u64 offset,
 				     u64 bytenr, u64 len, u32 count)
 {
 	struct btrfs_root *root;
-	struct btrfs_root *extent_root;
 	struct btrfs_key key;
 	struct btrfs_path path = { 0 };
 	struct extent_buffer *leaf;
 	struct btrfs_file_extent_item *fi;
+	/* Last leaf found not to be shared, all its items are checked */
+	u64 unshared_leaf = (u64)-1;
 	u32 found_count = 0;
 	int slot;
 	int ret = 0;
 
 	if (!len) {
-		key.objectid = bytenr;
-		key.type = BTRFS_EXTENT_ITEM_KEY;
-		key.offset = (u64)-1;
-
-		extent_root = btrfs_extent_root(gfs_info, bytenr);
-		ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
-		if (ret < 0)
-			goto out;
-		ret = btrfs_previous_extent_item(extent_root, &path, bytenr);
+		ret = lookup_extent_item(bytenr, BTRFS_EXTENT_ITEM_KEY, &leaf);
 		if (ret)
 			goto out;
-		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		btrfs_item_key_to_cpu(leaf, &key, 0);
+		backref_cache_put(leaf);
 		if (key.objectid != bytenr ||
 		    key.type != BTRFS_EXTENT_ITEM_KEY)
 			goto out;
 		len = key.offset;
-		btrfs_release_path(&path);
 	}
 	key.objectid = root_id;
 	key.type = BTRFS_ROOT_ITEM_KEY;
@@ -4186,12 +4185,15 @@ static int check_extent_data_backref(u64 root_id, u64 objectid, u64 offset,
 		 * If the node belongs to a shared backref item, we should not
 		 * account the number.
 		 */
-		ret = is_leaf_shared(leaf, bytenr, len);
-		if (ret < 0)
-			break;
-		if (ret > 0) {
-			slot = btrfs_header_nritems(leaf);
-			goto next;
+		if (leaf->start != unshared_leaf) {
+			ret = is_leaf_shared(leaf, bytenr, len);
+			if (ret < 0)
+				break;
+			if (ret > 0) {
+				slot = btrfs_header_nritems(leaf);
+				goto next;
+			}
+			unshared_leaf = leaf->start;
 		}
 
 		btrfs_item_key_to_cpu(leaf, &key, slot);
@@ -4298,7 +4300,7 @@ static int repair_extent_item(struct btrfs_path *path, u64 bytenr, u64
 	if (ret)
 		return ret;
 
-	trans = btrfs_start_transaction(extent_root, 1);
+	trans = repair_trans_start(extent_root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -4317,7 +4319,7 @@ static int repair_extent_item(struct btrfs_path *path, u64 bytenr, u64
 		btrfs_abort_transaction(trans, ret);
 		goto out;
 	}
-	btrfs_commit_transaction(trans, extent_root);
+	repair_trans_commit(trans, extent_root);
 
 	btrfs_release_path(path);
 	ret = btrfs_search_slot(NULL, extent_root, &old_key, path, 0, 0);
@@ -4372,7 +4374,7 @@ static int repair_extent_item_generation(struct btrfs_path *path)
 		return ret;
 	btrfs_release_path(path);
 	extent_root = btrfs_extent_root(gfs_info, key.objectid);
-	trans = btrfs_start_transaction(extent_root, 1);
+	trans = repair_trans_start(extent_root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -4392,7 +4394,7 @@ static int repair_extent_item_generation(struct btrfs_path *path)
 		new_gen = trans->transid;
 	ei = btrfs_item_ptr(path->nodes[0], path->slots[0], struct btrfs_extent_item);
 	btrfs_set_extent_generation(path->nodes[0], ei, new_gen);
-	ret = btrfs_commit_transaction(trans, extent_root);
+	ret = repair_trans_commit(trans, extent_root);
 	if (ret < 0) {
 		errno = -ret;
 		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
@@ -4998,7 +5000,7 @@ static int repair_chunk_item(struct btrfs_root *chunk_root,
 	if (ret)
 		return ret;
 
-	trans = btrfs_start_transaction(extent_root, 1);
+	trans = repair_trans_start(extent_root, 1);
 	if (IS_ERR(trans)) {
 		ret = PTR_ERR(trans);
 		errno = -ret;
@@ -5017,7 +5019,7 @@ static int repair_chunk_item(struct btrfs_root *chunk_root,
 		       length);
 	}
 
-	btrfs_commit_transaction(trans, extent_root);
+	repair_trans_commit(trans, extent_root);
 	if (ret)
 		error("fail to repair item(s) related to chunk item [%llu %llu]",
 		      chunk_key.objectid, chunk_key.offset);
@@ -5142,6 +5144,27 @@ out:
 	return err;
 }
 
+/*
+ * Queue the children of @node after @slot for reading into the page cache by
+ * the prefetch threads, once per node, the child at @slot is read right away.
+ * The children not written since --since-generation are skipped by the walk.
+ */
+static void prefetch_walk_down(struct node_refs *nrefs,
+			       struct extent_buffer *node, int slot, int level)
+{
+	u32 nritems = btrfs_header_nritems(node);
+
+	if (nrefs->prefetched[level] == node->start)
+		return;
+	nrefs->prefetched[level] = node->start;
+	for (int i = slot + 1; i < nritems; i++) {
+		if (btrfs_node_ptr_generation(node, i) <= check_since_generation)
+			continue;
+		tree_prefetch_readahead(tree_prefetch,
+					btrfs_node_blockptr(node, i));
+	}
+}
+
 /*
  * @trans      just for lowmem repair mode
  * @check all  if not 0 then check all tree block backrefs and items
@@ -5239,6 +5262,12 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 		bytenr = btrfs_node_blockptr(cur, path->slots[*level]);
 		ptr_gen = btrfs_node_ptr_generation(cur, path->slots[*level]);
 
+		/* Nothing below was written since the last check */
+		if (ptr_gen <= check_since_generation) {
+			path->slots[*level]++;
+			continue;
+		}
+
 		ret = update_nodes_refs(root, bytenr, NULL, nrefs, *level - 1,
 					check_all);
 		if (ret < 0)
@@ -5261,7 +5290,11 @@ static int walk_down_tree(struct btrfs_root *root, struct btrfs_path *path,
 			};
 
 			free_extent_buffer(next);
-			reada_walk_down(root, cur, path->slots[*level]);
+			if (tree_prefetch)
+				prefetch_walk_down(nrefs, cur, path->slots[*level],
+						   *level);
+			else
+				reada_walk_down(root, cur, path->slots[*level]);
 			next = read_tree_block(gfs_info, bytenr, &tree_check);
 			if (!extent_buffer_uptodate(next)) {
 				struct btrfs_key node_key;
@@ -5341,7 +5374,7 @@ static int repair_fs_first_inode(struct btrfs_root *root, int err)
 		key.type = BTRFS_INODE_REF_KEY;
 		key.offset = BTRFS_FIRST_FREE_OBJECTID;
 
-		trans = btrfs_start_transaction(root, 1);
+		trans = repair_trans_start(root, 1);
 		if (IS_ERR(trans)) {
 			ret = PTR_ERR(trans);
 			goto out;
@@ -5365,7 +5398,7 @@ static int repair_fs_first_inode(struct btrfs_root *root, int err)
 trans_fail:
 		if (ret)
 			error("fail to insert first inode's ref");
-		btrfs_commit_transaction(trans, root);
+		repair_trans_commit(trans, root);
 	}
 
 	if (err & INODE_ITEM_MISSING) {
@@ -5449,6 +5482,49 @@ out:
 	return ret < 0 ? ret : err;
 }
 
+/*
+ * Start the walk of the tree of @root_key, the root item key or the objectid
+ * alone for the trees without root item, in the checkpoint if any.
+ *
+ * Return the key to resume the walk at if the resumed check stopped in this
+ * tree, NULL otherwise.
+ */
+static const struct btrfs_key *checkpoint_tree(const struct btrfs_key *root_key,
+					       int pass_err)
+{
+	struct check_checkpoint *ckpt = check_checkpoint;
+
+	if (!ckpt)
+		return NULL;
+	if (ckpt->resuming) {
+		/* The pass started at the tree saved */
+		ckpt->resuming = false;
+		return ckpt->has_key ? &ckpt->key : NULL;
+	}
+	ckpt->root_key = *root_key;
+	ckpt->has_key = false;
+	ckpt->pass_errors = pass_err;
+	ckpt->root_errors = 0;
+	ckpt->total_used = total_used;
+	checkpoint_update(ckpt);
+	return NULL;
+}
+
+/* Save the position of the walk, the subtrees before the slot at @level */
+static void checkpoint_walk(struct btrfs_path *path, int level, int err)
+{
+	struct check_checkpoint *ckpt = check_checkpoint;
+
+	if (!ckpt || level == 0)
+		return;
+	btrfs_node_key_to_cpu(path->nodes[level], &ckpt->key,
+			      path->slots[level]);
+	ckpt->has_key = true;
+	ckpt->root_errors = err;
+	ckpt->total_used = total_used;
+	checkpoint_update(ckpt);
+}
+
 /*
  * This function calls walk_down_tree and walk_up_tree to check tree
  * blocks and integrity of fs tree items.
@@ -5457,10 +5533,12 @@ out:
  * @account       if NOT 0 means check the tree (including tree)'s treeblocks.
  *                otherwise means check fs tree(s) items relationship and
  *		  @root MUST be a fs tree root.
+ * @resume:       if not NULL, the key where a resumed check continues the walk
  * Returns 0      represents OK.
  * Returns >0     represents error bits.
  */
-static int check_btrfs_root(struct btrfs_root *root, int check_all)
+static int check_btrfs_root(struct btrfs_root *root, int check_all,
+			    const struct btrfs_key *resume)
 {
 	struct btrfs_path path = { 0 };
 	struct node_refs nrefs;
@@ -5469,6 +5547,7 @@ static int check_btrfs_root(struct btrfs_root *root, int check_all)
 	int ret;
 	int level;
 	int err = 0;
+	int i;
 
 	memset(&nrefs, 0, sizeof(nrefs));
 	if (!check_all) {
@@ -5502,7 +5581,29 @@ static int check_btrfs_root(struct btrfs_root *root, int check_all)
 			}
 		}
 	}
-	if (btrfs_root_refs(root_item) > 0 ||
+	if (btrfs_header_generation(root->node) <= check_since_generation)
+		return err;
+
+	if (resume) {
+		/*
+		 * The blocks on the path above the leaf were checked before
+		 * the checkpoint, only their refs are needed for the walk
+		 */
+		err |= check_checkpoint->root_errors;
+		level = 0;
+		ret = btrfs_search_slot(NULL, root, resume, &path, 0, 0);
+		if (ret < 0)
+			goto out;
+		for (i = btrfs_header_level(root->node); i > 0; i--) {
+			ret = update_nodes_refs(root, path.nodes[i]->start,
+						path.nodes[i], &nrefs, i,
+						check_all);
+			if (ret < 0)
+				goto out;
+			nrefs.checked[i] = 1;
+		}
+		ret = 0;
+	} else if (btrfs_root_refs(root_item) > 0 ||
 	    btrfs_disk_key_objectid(&root_item->drop_progress) == 0) {
 		path.nodes[level] = root->node;
 		path.slots[level] = 0;
@@ -5537,6 +5638,7 @@ static int check_btrfs_root(struct btrfs_root *root, int check_all)
 			ret = err;
 			break;
 		}
+		checkpoint_walk(&path, level, err);
 	}
 
 out:
@@ -5548,14 +5650,16 @@ out:
  * Iterate all items in the tree and call check_inode_item() to check.
  *
  * @root:	the root of the tree to be checked.
+ * @resume:	see check_btrfs_root()
  *
  * Return 0 if no error found.
  * Return <0 for error.
  */
-static int check_fs_root(struct btrfs_root *root)
+static int check_fs_root(struct btrfs_root *root,
+			 const struct btrfs_key *resume)
 {
 	reset_cached_block_groups();
-	return check_btrfs_root(root, 0);
+	return check_btrfs_root(root, 0, resume);
 }
 
 /*
@@ -5661,8 +5765,10 @@ int check_fs_roots_lowmem(void)
 	struct btrfs_root *tree_root = gfs_info->tree_root;
 	struct btrfs_root *cur_root = NULL;
 	struct btrfs_path path = { 0 };
+	const struct btrfs_key *resume;
 	struct btrfs_key key;
 	struct extent_buffer *node;
+	struct extent_buffer *reada_leaf = NULL;
 	int slot;
 	int ret;
 	int err = 0;
@@ -5670,6 +5776,15 @@ int check_fs_roots_lowmem(void)
 	key.objectid = BTRFS_FS_TREE_OBJECTID;
 	key.type = BTRFS_ROOT_ITEM_KEY;
 	key.offset = 0;
+	if (check_checkpoint && checkpoint_resume_phase(check_checkpoint, 5)) {
+		/*
+		 * Start at the item being checked when the checkpoint was saved,
+		 * none if saved right at the start of the pass
+		 */
+		if (check_checkpoint->root_key.objectid)
+			key = check_checkpoint->root_key;
+		err = check_checkpoint->pass_errors;
+	}
 
 	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
 	if (ret < 0) {
@@ -5683,9 +5798,15 @@ int check_fs_roots_lowmem(void)
 	while (1) {
 		node = path.nodes[0];
 		slot = path.slots[0];
+		/* The subvolumes of the leaf are read next, one by one */
+		if (node != reada_leaf) {
+			btrfs_readahead_root_nodes(node, slot, 0);
+			reada_leaf = node;
+		}
 		btrfs_item_key_to_cpu(node, &key, slot);
 		if (key.objectid > BTRFS_LAST_FREE_OBJECTID)
 			goto out;
+		resume = checkpoint_tree(&key, err);
 		if (key.type == BTRFS_INODE_ITEM_KEY &&
 		    is_fstree(key.objectid)) {
 			ret = check_repair_free_space_inode(&path);
@@ -5714,8 +5835,12 @@ int check_fs_roots_lowmem(void)
 				goto next;
 			}
 
-			ret = check_fs_root(cur_root);
+			repair_batch_begin();
+			ret = check_fs_root(cur_root, resume);
 			err |= ret;
+			ret = repair_batch_end();
+			if (ret < 0)
+				err |= FATAL_ERROR;
 
 			if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
 				btrfs_free_fs_root(cur_root);
@@ -5769,24 +5894,50 @@ out:
 int check_chunks_and_extents_lowmem(void)
 {
 	struct btrfs_path path = { 0 };
+	struct btrfs_key root_key = { 0 };
 	struct btrfs_key old_key;
 	struct btrfs_key key;
 	struct btrfs_root *root;
 	struct btrfs_root *cur_root;
+	const struct btrfs_key *resume;
 	int err = 0;
 	int ret;
 
-	root = gfs_info->chunk_root;
-	ret = check_btrfs_root(root, 1);
-	err |= ret;
+	if (check_checkpoint && checkpoint_resume_phase(check_checkpoint, 3)) {
+		root_key = check_checkpoint->root_key;
+		err = check_checkpoint->pass_errors;
+		total_used = check_checkpoint->total_used;
+	}
+
+	/* The trees without root item first, unless resuming after them */
+	if (root_key.type != BTRFS_ROOT_ITEM_KEY &&
+	    root_key.objectid != BTRFS_ROOT_TREE_OBJECTID) {
+		root = gfs_info->chunk_root;
+		key.objectid = BTRFS_CHUNK_TREE_OBJECTID;
+		key.type = 0;
+		key.offset = 0;
+		resume = checkpoint_tree(&key, err);
+		ret = check_btrfs_root(root, 1, resume);
+		err |= ret;
+	}
 
-	root = gfs_info->tree_root;
-	ret = check_btrfs_root(root, 1);
-	err |= ret;
+	if (root_key.type != BTRFS_ROOT_ITEM_KEY) {
+		root = gfs_info->tree_root;
+		key.objectid = BTRFS_ROOT_TREE_OBJECTID;
+		key.type = 0;
+		key.offset = 0;
+		resume = checkpoint_tree(&key, err);
+		ret = check_btrfs_root(root, 1, resume);
+		err |= ret;
+	}
 
-	key.objectid = BTRFS_EXTENT_TREE_OBJECTID;
-	key.type = BTRFS_ROOT_ITEM_KEY;
-	key.offset = 0;
+	if (root_key.type == BTRFS_ROOT_ITEM_KEY) {
+		key = root_key;
+	} else {
+		key.objectid = BTRFS_EXTENT_TREE_OBJECTID;
+		key.type = BTRFS_ROOT_ITEM_KEY;
+		key.offset = 0;
+	}
 
 	ret = btrfs_search_slot(NULL, gfs_info->tree_root, &key, &path, 0, 0);
 	if (ret) {
@@ -5799,6 +5950,7 @@ int check_chunks_and_extents_lowmem(void)
 		if (key.type != BTRFS_ROOT_ITEM_KEY)
 			goto next;
 		old_key = key;
+		resume = checkpoint_tree(&old_key, err);
 		key.offset = (u64)-1;
 
 		if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
@@ -5811,7 +5963,7 @@ int check_chunks_and_extents_lowmem(void)
 			goto next;
 		}
 
-		ret = check_btrfs_root(cur_root, 1);
+		ret = check_btrfs_root(cur_root, 1, resume);
 		err |= ret;
 
 		if (key.objectid == BTRFS_TREE_RELOC_OBJECTID)
@@ -5829,7 +5981,9 @@ next:
 	}
 out:
 
-	if (total_used != btrfs_super_bytes_used(gfs_info->super_copy)) {
+	/* Only the blocks of the changed subtrees were accounted */
+	if (!check_since_generation &&
+	    total_used != btrfs_super_bytes_used(gfs_info->super_copy)) {
 		fprintf(stderr,
 			"super bytes_used %llu mismatches actual used %llu\n",
 			btrfs_super_bytes_used(gfs_info->super_copy),
@@ -66,7 +66,11 @@
 #define CHUNK_TYPE_MISMATCH	(1U << 8)	/* Extent type and chunk type don't match */
 #define BACKREF_OUT_OF_ORDER	(1U << 9)	/* Inline backrefs out of order */
 
+/* Memory for the extent items cached for the backref checks */
+#define LOWMEM_BACKREF_CACHE_SIZE	(SZ_16M)
+
 int check_fs_roots_lowmem(void);
 int check_chunks_and_extents_lowmem(void);
+void free_backref_cache_lowmem(void);
 
 #endif
@@ -52,7 +52,6 @@ struct data_backref {
 	u64 offset;
 	u64 disk_bytenr;
 	u64 bytes;
-	u64 ram_bytes;
 	u32 num_refs;
 	u32 found_ref;
 };
@@ -78,13 +77,15 @@ static inline struct tree_backref* to_tree_backref(struct extent_backref *back)
 /* Explicit initialization for extent_record::flag_block_full_backref */
 enum { FLAG_UNSET = 2 };
 
+/*
+ * One per extent found in the extent tree or referenced from a tree, keep the
+ * layout free of padding, there can be hundreds of millions of them.
+ */
 struct extent_record {
-	struct list_head backrefs;
 	struct list_head dups;
 	struct rb_root backref_tree;
 	struct list_head list;
 	struct cache_extent cache;
-	struct btrfs_key parent_key;
 	u64 start;
 	u64 max_size;
 	u64 nr;
@@ -94,6 +95,8 @@ struct extent_record {
 	u64 parent_generation;
 	u64 info_objectid;
 	u32 num_duplicates;
+	/* Packed, 17 bytes */
+	struct btrfs_key parent_key;
 	u8 info_level;
 	u8 level;
 	unsigned int flag_block_full_backref:2;
@@ -289,6 +292,10 @@ struct walk_control {
 	struct shared_node *nodes[BTRFS_MAX_LEVEL];
 	int active_node;
 	int root_level;
+	/* Decoded items of the leaf in process_one_leaf() */
+	struct btrfs_leaf_items items;
+	/* Last node per level with its children queued for prefetch */
+	u64 prefetched[BTRFS_MAX_LEVEL];
 };
 
 struct bad_item {
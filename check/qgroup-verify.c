@@ -22,9 +22,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <pthread.h>
 #include "kernel-lib/list.h"
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/ctree.h"
@@ -35,16 +37,23 @@
 #include "kernel-shared/tree-checker.h"
 #include "common/messages.h"
 #include "common/rbtree-utils.h"
+#include "common/extent-cache.h"
 #include "check/repair.h"
 #include "check/qgroup-verify.h"
 
 static u64 *qgroup_item_count;
+static unsigned int qgroup_workers = QGROUP_VERIFY_DEFAULT_WORKERS;
 
 void qgroup_set_item_count_ptr(u64 *item_count_ptr)
 {
 	qgroup_item_count = item_count_ptr;
 }
 
+void qgroup_set_workers(unsigned int workers)
+{
+	qgroup_workers = workers;
+}
+
 /*#define QGROUP_VERIFY_DEBUG*/
 static unsigned long tot_extents_scanned = 0;
 
@@ -77,7 +86,8 @@ struct qgroup_count {
 	 */
 	struct list_head members;
 
-	u64 cur_refcnt;
+	/* Index of the group in the counters of struct qgroup_accounting */
+	unsigned int index;
 
 	struct list_head bad_list;
 };
@@ -107,28 +117,69 @@ struct btrfs_qgroup_list {
 	struct qgroup_count *member;
 };
 
-/* Allow us to reset ref counts during accounting without zeroing each group. */
-static u64 qgroup_seq = 1ULL;
+/* Memory for the memoized roots of shared tree blocks, split by the workers */
+#define QGROUP_ROOTS_MEMO_SIZE		(SZ_64M)
+
+/*
+ * The fs roots a shared tree block resolves to, memoized as all the extents
+ * referenced from the same block resolve to the same roots
+ */
+struct roots_memo {
+	struct cache_extent cache;
+	u64 nr_roots;
+	u64 roots[];
+};
+
+/*
+ * Accounting of the refs of bytenr range [first, end) by one worker of
+ * account_all_refs().  The counts are indexed by qgroup_count::index and
+ * added to the qgroups once all the workers are done.
+ */
+struct qgroup_accounting {
+	/* Allow us to reset ref counts during accounting without zeroing each group. */
+	u64 seq;
+	u64 *refcnt;
+	struct qgroup_info *info;
+
+	struct cache_tree memo;
+	u64 memo_size;
+	u64 memo_limit;
+
+	struct rb_node *first;
+	u64 end;
+	int do_qgroups;
+	u64 search_subvol;
+	int ret;
+};
 
-static inline void update_cur_refcnt(struct qgroup_count *c)
+static inline void update_cur_refcnt(struct qgroup_accounting *acct,
+				     struct qgroup_count *c)
 {
-	if (c->cur_refcnt < qgroup_seq)
-		c->cur_refcnt = qgroup_seq;
-	c->cur_refcnt++;
+	u64 *refcnt = &acct->refcnt[c->index];
+
+	if (*refcnt < acct->seq)
+		*refcnt = acct->seq;
+	(*refcnt)++;
 }
 
-static inline u64 group_get_cur_refcnt(struct qgroup_count *c)
+static inline u64 group_get_cur_refcnt(struct qgroup_accounting *acct,
+				       struct qgroup_count *c)
 {
-	if (c->cur_refcnt < qgroup_seq)
+	u64 refcnt = acct->refcnt[c->index];
+
+	if (refcnt < acct->seq)
 		return 0;
-	return c->cur_refcnt - qgroup_seq;
+	return refcnt - acct->seq;
 }
 
-static void inc_qgroup_seq(int root_count)
+static void inc_qgroup_seq(struct qgroup_accounting *acct, int root_count)
 {
-	qgroup_seq += root_count + 1;
+	acct->seq += root_count + 1;
 }
 
+/* Accounting of the simple quota extents while scanning the extent tree */
+static struct qgroup_accounting *simple_acct = NULL;
+
 /*
  * List of interior tree blocks. We walk this list after loading the
  * extent tree to resolve implied refs. For each interior node we'll
@@ -328,10 +379,14 @@ static void free_ref_node(struct rb_node *node)
 
 FREE_RB_BASED_TREE(ref, free_ref_node);
 
+static int find_parent_roots(struct qgroup_accounting *acct,
+			     struct ulist *roots, u64 parent);
+
 /*
  * Resolves all the possible roots for the ref at parent.
  */
-static int find_parent_roots(struct ulist *roots, u64 parent)
+static int __find_parent_roots(struct qgroup_accounting *acct,
+			       struct ulist *roots, u64 parent)
 {
 	struct ref *ref;
 	struct rb_node *node;
@@ -379,13 +434,12 @@ static int find_parent_roots(struct ulist *roots, u64 parent)
 				if (ret < 0)
 					goto out;
 			}
-		} else if (ref->parent == ref->bytenr) {
+		} else if (ref->parent != ref->bytenr) {
 			/*
-			 * Special loop case for tree reloc tree
+			 * A block referencing itself is the special loop case
+			 * of the tree reloc tree, which has no fs root
 			 */
-			ref->root = BTRFS_TREE_RELOC_OBJECTID;
-		} else {
-			ret = find_parent_roots(roots, ref->parent);
+			ret = find_parent_roots(acct, roots, ref->parent);
 			if (ret < 0)
 				goto out;
 		}
@@ -400,7 +454,92 @@ out:
 	return ret;
 }
 
-static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
+static void free_roots_memo(struct cache_extent *ce)
+{
+	free(container_of(ce, struct roots_memo, cache));
+}
+
+FREE_EXTENT_CACHE_BASED_TREE(roots_memo, free_roots_memo);
+
+static void memoize_roots(struct qgroup_accounting *acct, u64 bytenr,
+			  struct ulist *roots)
+{
+	const size_t size = sizeof(struct roots_memo) + roots->nnodes * sizeof(u64);
+	struct ulist_iterator uiter;
+	struct ulist_node *unode;
+	struct roots_memo *memo;
+
+	if (size > acct->memo_limit)
+		return;
+	if (acct->memo_size + size > acct->memo_limit) {
+		/* The refs are accounted by bytenr, start over at a new range */
+		free_roots_memo_tree(&acct->memo);
+		acct->memo_size = 0;
+	}
+	memo = malloc(size);
+	if (!memo)
+		return;
+	memo->cache.start = bytenr;
+	memo->cache.size = 1;
+	memo->nr_roots = 0;
+	ULIST_ITER_INIT(&uiter);
+	while ((unode = ulist_next(roots, &uiter)))
+		memo->roots[memo->nr_roots++] = unode->val;
+	if (insert_cache_extent(&acct->memo, &memo->cache)) {
+		free(memo);
+		return;
+	}
+	acct->memo_size += size;
+}
+
+/*
+ * Add the roots for the ref at parent to @roots, from the memo if the block
+ * was resolved before.
+ */
+static int find_parent_roots(struct qgroup_accounting *acct,
+			     struct ulist *roots, u64 parent)
+{
+	struct cache_extent *ce;
+	struct ulist *found;
+	struct ulist_iterator uiter;
+	struct ulist_node *unode;
+	int ret;
+
+	ce = lookup_cache_extent(&acct->memo, parent, 1);
+	if (ce) {
+		struct roots_memo *memo = container_of(ce, struct roots_memo,
+						       cache);
+
+		for (u64 i = 0; i < memo->nr_roots; i++) {
+			ret = ulist_add(roots, memo->roots[i], 0, 0);
+			if (ret < 0)
+				return ret;
+		}
+		return 0;
+	}
+
+	found = ulist_alloc(0);
+	if (!found)
+		return -ENOMEM;
+	ret = __find_parent_roots(acct, found, parent);
+	if (ret < 0)
+		goto out;
+	memoize_roots(acct, parent, found);
+
+	ULIST_ITER_INIT(&uiter);
+	while ((unode = ulist_next(found, &uiter))) {
+		ret = ulist_add(roots, unode->val, 0, 0);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	ulist_free(found);
+	return ret;
+}
+
+static int account_one_extent(struct qgroup_accounting *acct,
+			      struct ulist *roots, u64 bytenr, u64 num_bytes)
 {
 	int ret;
 	u64 id, nr_roots, nr_refs;
@@ -450,7 +589,7 @@ static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
 		while ((tmp_unode = ulist_next(tmp, &tmp_uiter))) {
 			/* Bump the refcount on a node every time we see it. */
 			count = u64_to_ptr(tmp_unode->aux);
-			update_cur_refcnt(count);
+			update_cur_refcnt(acct, count);
 
 			list_for_each_entry(glist, &count->groups, next_group) {
 				struct qgroup_count *parent;
@@ -478,16 +617,19 @@ static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
 	nr_roots = roots->nnodes;
 	ULIST_ITER_INIT(&uiter);
 	while ((unode = ulist_next(local_counts, &uiter))) {
+		struct qgroup_info *info;
+
 		count = u64_to_ptr(unode->aux);
+		info = &acct->info[count->index];
 
-		nr_refs = group_get_cur_refcnt(count);
+		nr_refs = group_get_cur_refcnt(acct, count);
 		if (nr_refs) {
-			count->info.referenced += num_bytes;
-			count->info.referenced_compressed += num_bytes;
+			info->referenced += num_bytes;
+			info->referenced_compressed += num_bytes;
 
 			if (nr_refs == nr_roots) {
-				count->info.exclusive += num_bytes;
-				count->info.exclusive_compressed += num_bytes;
+				info->exclusive += num_bytes;
+				info->exclusive_compressed += num_bytes;
 			}
 		}
 #ifdef QGROUP_VERIFY_DEBUG
@@ -495,12 +637,12 @@ static int account_one_extent(struct ulist *roots, u64 bytenr, u64 num_bytes)
 		       " excl %llu, refs %llu, roots %llu\n", bytenr, num_bytes,
 		       btrfs_qgroup_level(count->qgroupid),
 		       btrfs_qgroup_subvolid(count->qgroupid),
-		       count->info.referenced, count->info.exclusive, nr_refs,
+		       info->referenced, info->exclusive, nr_refs,
 		       nr_roots);
 #endif
 	}
 
-	inc_qgroup_seq(roots->nnodes);
+	inc_qgroup_seq(acct, roots->nnodes);
 	ret = 0;
 out:
 	ulist_free(local_counts);
@@ -511,8 +653,8 @@ out:
 static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
 			      struct ulist *roots);
 /*
- * Account each ref. Walk the refs, for each set of refs in a
- * given bytenr:
+ * Account each ref of the range of @acct. Walk the refs, for each set of
+ * refs in a given bytenr:
  *
  * - add the roots for direct refs to the ref roots ulist
  *
@@ -522,19 +664,23 @@ static void print_subvol_info(u64 subvolid, u64 bytenr, u64 num_bytes,
  * - With all roots resolved we can account the ref - this is done in
  *   account_one_extent().
  */
-static int account_all_refs(int do_qgroups, u64 search_subvol)
+static int account_refs_range(struct qgroup_accounting *acct)
 {
 	struct ref *ref;
-	struct rb_node *node;
+	struct rb_node *node = acct->first;
 	u64 bytenr, num_bytes;
 	struct ulist *roots = ulist_alloc(0);
 	int ret;
 
-	node = rb_first(&by_bytenr);
+	if (!roots)
+		goto enomem;
+
 	while (node) {
+		ref = rb_entry(node, struct ref, bytenr_node);
+		if (ref->bytenr >= acct->end)
+			break;
 		ulist_reinit(roots);
 
-		ref = rb_entry(node, struct ref, bytenr_node);
 		/*
 		 * Walk forward through the list of refs for this
 		 * bytenr, adding roots to our ulist. If it's a full
@@ -552,7 +698,7 @@ static int account_all_refs(int do_qgroups, u64 search_subvol)
 						goto enomem;
 				}
 			} else {
-				ret = find_parent_roots(roots, ref->parent);
+				ret = find_parent_roots(acct, roots, ref->parent);
 				if (ret < 0)
 					goto enomem;
 			}
@@ -567,24 +713,181 @@ static int account_all_refs(int do_qgroups, u64 search_subvol)
 				ref = rb_entry(node, struct ref, bytenr_node);
 		} while (node && ref->bytenr == bytenr);
 
-		if (search_subvol)
-			print_subvol_info(search_subvol, bytenr, num_bytes,
+		if (acct->search_subvol)
+			print_subvol_info(acct->search_subvol, bytenr, num_bytes,
 					  roots);
 
-		if (!do_qgroups)
+		if (!acct->do_qgroups)
 			continue;
 
-		if (account_one_extent(roots, bytenr, num_bytes))
+		if (account_one_extent(acct, roots, bytenr, num_bytes))
 			goto enomem;
 	}
 
 	ulist_free(roots);
 	return 0;
 enomem:
+	ulist_free(roots);
 	error_msg(ERROR_MSG_MEMORY, "accounting for refs for qgroups");
 	return -ENOMEM;
 }
 
+static void *account_refs_worker(void *arg)
+{
+	struct qgroup_accounting *acct = arg;
+
+	acct->ret = account_refs_range(acct);
+	return NULL;
+}
+
+static int init_accounting(struct qgroup_accounting *acct, int do_qgroups,
+			   u64 search_subvol, u64 memo_limit)
+{
+	const unsigned int nr = max(counts.num_groups, 1U);
+
+	acct->seq = 1ULL;
+	acct->refcnt = calloc(nr, sizeof(*acct->refcnt));
+	acct->info = calloc(nr, sizeof(*acct->info));
+	if (!acct->refcnt || !acct->info)
+		return -ENOMEM;
+	cache_tree_init(&acct->memo);
+	acct->memo_limit = memo_limit;
+	acct->end = (u64)-1;
+	acct->do_qgroups = do_qgroups;
+	acct->search_subvol = search_subvol;
+	return 0;
+}
+
+/* Add the counts of @acct to the qgroups */
+static void add_accounting(const struct qgroup_accounting *acct)
+{
+	struct rb_node *node;
+
+	for (node = rb_first(&counts.root); node; node = rb_next(node)) {
+		struct qgroup_count *c = rb_entry(node, struct qgroup_count,
+						  rb_node);
+		const struct qgroup_info *info = &acct->info[c->index];
+
+		c->info.referenced += info->referenced;
+		c->info.referenced_compressed += info->referenced_compressed;
+		c->info.exclusive += info->exclusive;
+		c->info.exclusive_compressed += info->exclusive_compressed;
+	}
+}
+
+static void release_accounting(struct qgroup_accounting *acct)
+{
+	free(acct->refcnt);
+	free(acct->info);
+	free_roots_memo_tree(&acct->memo);
+}
+
+/*
+ * Split the refs in ranges of about the same number of refs for @nr_workers,
+ * the refs of one bytenr are accounted together
+ */
+static void split_refs(struct qgroup_accounting *accts, unsigned int nr_workers)
+{
+	struct rb_node *node;
+	struct ref *ref;
+	u64 nr_refs = 0;
+	u64 per_worker;
+	u64 prev_bytenr = 0;
+	u64 n = 0;
+	unsigned int i = 0;
+
+	for (node = rb_first(&by_bytenr); node; node = rb_next(node))
+		nr_refs++;
+	per_worker = max_t(u64, DIV_ROUND_UP(nr_refs, nr_workers), 1);
+
+	accts[0].first = rb_first(&by_bytenr);
+	for (node = accts[0].first; node; node = rb_next(node), n++) {
+		ref = rb_entry(node, struct ref, bytenr_node);
+		if (n >= per_worker * (i + 1) && i + 1 < nr_workers &&
+		    ref->bytenr != prev_bytenr) {
+			accts[i].end = ref->bytenr;
+			accts[++i].first = node;
+		}
+		prev_bytenr = ref->bytenr;
+	}
+}
+
+/*
+ * Account all the refs, sharded by bytenr ranges across qgroup_workers
+ * threads when verifying the qgroups.  Each worker counts the references of
+ * its extents to the groups on its own and the counts are summed at the end,
+ * the result does not depend on the number of workers.
+ */
+static int account_all_refs(int do_qgroups, u64 search_subvol)
+{
+	struct qgroup_accounting *accts;
+	pthread_t *threads;
+	bool *started;
+	unsigned int nr_workers = 1;
+	unsigned int i;
+	int ret = 0;
+
+	/* The extents of a subvolume are printed in order */
+	if (do_qgroups && !search_subvol && qgroup_workers > 1)
+		nr_workers = qgroup_workers;
+
+	accts = calloc(nr_workers, sizeof(*accts));
+	threads = calloc(nr_workers, sizeof(*threads));
+	started = calloc(nr_workers, sizeof(*started));
+	if (!accts || !threads || !started)
+		goto enomem;
+	for (i = 0; i < nr_workers; i++) {
+		if (init_accounting(&accts[i], do_qgroups, search_subvol,
+				    QGROUP_ROOTS_MEMO_SIZE / nr_workers))
+			goto enomem;
+	}
+	if (nr_workers > 1)
+		split_refs(accts, nr_workers);
+	else
+		accts[0].first = rb_first(&by_bytenr);
+
+	for (i = 1; i < nr_workers; i++) {
+		if (!accts[i].first)
+			break;
+		/* Do it here if the thread can't be started */
+		if (pthread_create(&threads[i], NULL, account_refs_worker,
+				   &accts[i]))
+			account_refs_worker(&accts[i]);
+		else
+			started[i] = true;
+	}
+	account_refs_worker(&accts[0]);
+	for (i = 1; i < nr_workers; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		if (accts[i].ret) {
+			ret = accts[i].ret;
+			goto out;
+		}
+	}
+	if (!do_qgroups)
+		goto out;
+
+	for (i = 0; i < nr_workers; i++)
+		add_accounting(&accts[i]);
+
+out:
+	for (i = 0; accts && i < nr_workers; i++)
+		release_accounting(&accts[i]);
+	free(accts);
+	free(threads);
+	free(started);
+	return ret;
+
+enomem:
+	error_msg(ERROR_MSG_MEMORY, "accounting for refs for qgroups");
+	ret = -ENOMEM;
+	goto out;
+}
+
 static u64 resolve_one_root(u64 bytenr)
 {
 	struct ref *ref = find_ref_bytenr(bytenr);
@@ -672,24 +975,25 @@ static void print_all_tree_blocks(void)
 }
 #endif
 
+/* Decoded items of the leaf being scanned by add_refs_for_leaf_items() */
+static struct btrfs_leaf_items leaf_items;
+
 static int add_refs_for_leaf_items(struct extent_buffer *eb, u64 ref_parent)
 {
-	int nr, i;
+	int ret, i;
 	int extent_type;
 	u64 bytenr, num_bytes;
-	struct btrfs_key key;
-	struct btrfs_disk_key disk_key;
 	struct btrfs_file_extent_item *fi;
 
-	nr = btrfs_header_nritems(eb);
-	for (i = 0; i < nr; i++) {
-		btrfs_item_key(eb, &disk_key, i);
-		btrfs_disk_key_to_cpu(&key, &disk_key);
-
-		if (key.type != BTRFS_EXTENT_DATA_KEY)
+	ret = btrfs_leaf_items_decode(eb, &leaf_items);
+	if (ret < 0)
+		return -ret;
+	for (i = 0; i < leaf_items.nr; i++) {
+		if (leaf_items.types[i] != BTRFS_EXTENT_DATA_KEY)
 			continue;
 
-		fi = btrfs_item_ptr(eb, i, struct btrfs_file_extent_item);
+		fi = (struct btrfs_file_extent_item *)
+			(btrfs_item_nr_offset(eb, 0) + leaf_items.offsets[i]);
 		/* filter out: inline, disk_bytenr == 0, compressed?
 		 * not if we can avoid it */
 		extent_type = btrfs_file_extent_type(eb, fi);
@@ -812,6 +1116,7 @@ static int map_implied_refs(struct btrfs_fs_info *info)
 			goto out;
 	}
 out:
+	btrfs_leaf_items_release(&leaf_items);
 	return ret;
 }
 
@@ -837,7 +1142,7 @@ static int insert_count(struct qgroup_count *qc)
 		else
 			return EEXIST;
 	}
-	counts.num_groups++;
+	qc->index = counts.num_groups++;
 	rb_link_node(&qc->rb_node, parent, p);
 	rb_insert_color(&qc->rb_node, &counts.root);
 	return 0;
@@ -1084,9 +1389,13 @@ static int simple_quota_account_extent(struct btrfs_fs_info *info,
 	if (!is_fstree(root))
 		return 0;
 
+	/* Not counted when only printing the extents */
+	if (!simple_acct)
+		return 0;
+
 	ulist_init(&roots);
 	ulist_add(&roots, root, 0, 0);
-	ret = account_one_extent(&roots, bytenr, num_bytes);
+	ret = account_one_extent(simple_acct, &roots, bytenr, num_bytes);
 	ulist_release(&roots);
 	return ret;
 }
@@ -1466,6 +1775,7 @@ static bool is_bad_qgroup(struct qgroup_count *count)
  */
 int qgroup_verify_all(struct btrfs_fs_info *info)
 {
+	struct qgroup_accounting simple = { 0 };
 	struct rb_node *n;
 	int ret;
 	bool found_err = false;
@@ -1493,6 +1803,15 @@ int qgroup_verify_all(struct btrfs_fs_info *info)
 	    counts.rescan_running == 0)
 		skip_err = true;
 
+	if (counts.simple) {
+		ret = init_accounting(&simple, 1, 0, 0);
+		if (ret) {
+			error_msg(ERROR_MSG_MEMORY, "accounting for simple qgroups");
+			goto out;
+		}
+		simple_acct = &simple;
+	}
+
 	/*
 	 * Put all extent refs into our rbtree
 	 */
@@ -1512,8 +1831,10 @@ int qgroup_verify_all(struct btrfs_fs_info *info)
 	 * so we don't need to resolve backrefs to find which subvol an extent
 	 * is accounted to.
 	 */
-	if (counts.simple)
+	if (counts.simple) {
+		add_accounting(simple_acct);
 		goto check;
+	}
 
 	ret = map_implied_refs(info);
 	if (ret) {
@@ -1545,6 +1866,8 @@ out:
 	 * Don't free the qgroup count records as they will be walked
 	 * later via the print function.
 	 */
+	release_accounting(&simple);
+	simple_acct = NULL;
 	free_tree_blocks();
 	free_ref_tree(&by_bytenr);
 	if (!ret && !skip_err && found_err)
@@ -1626,6 +1949,140 @@ out:
 	return ret;
 }
 
+/* Add a level 0 group for each subvolume of the root tree */
+static int add_subvol_counts(struct btrfs_fs_info *info)
+{
+	struct btrfs_root *tree_root = info->tree_root;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = BTRFS_FS_TREE_OBJECTID;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		struct extent_buffer *leaf;
+		struct btrfs_root_item *ri;
+		struct qgroup_count *count;
+
+		if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret)
+				break;
+			continue;
+		}
+		leaf = path.nodes[0];
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		path.slots[0]++;
+		if (key.objectid > BTRFS_LAST_FREE_OBJECTID)
+			break;
+		if (key.type != BTRFS_ROOT_ITEM_KEY || !is_fstree(key.objectid))
+			continue;
+		/* Not reported, a deleted subvolume shares its extents until cleaned */
+		ri = btrfs_item_ptr(leaf, path.slots[0] - 1, struct btrfs_root_item);
+		if (btrfs_disk_root_refs(leaf, ri) == 0)
+			continue;
+
+		count = calloc(1, sizeof(*count));
+		if (!count) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		count->qgroupid = key.objectid;
+		count->subvol_exists = 1;
+		INIT_LIST_HEAD(&count->groups);
+		INIT_LIST_HEAD(&count->members);
+		INIT_LIST_HEAD(&count->bad_list);
+		if (insert_count(count))
+			free(count);
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/*
+ * Account the referenced and exclusive bytes of each subvolume like a qgroup
+ * of level 0, without the quota tree.  The extent tree is scanned once, the
+ * shared tree blocks are resolved to their roots with the memo of each
+ * worker and the extents are accounted by qgroup_workers threads.
+ *
+ * Return the subvolumes sorted by id in @space, to be freed by the caller.
+ */
+int account_subvol_space(struct btrfs_fs_info *info,
+			 struct subvol_space **space, unsigned int *nr_space)
+{
+	struct rb_node *n;
+	unsigned int nr = 0;
+	int ret;
+
+	*space = NULL;
+	*nr_space = 0;
+	tree_blocks = ulist_alloc(0);
+	if (!tree_blocks) {
+		error_msg(ERROR_MSG_MEMORY, "allocate ulist");
+		return -ENOMEM;
+	}
+
+	ret = add_subvol_counts(info);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to read the subvolumes: %m");
+		goto out;
+	}
+
+	for (n = rb_first(&info->block_group_cache_tree); n; n = rb_next(n)) {
+		struct btrfs_block_group *bg;
+
+		bg = rb_entry(n, struct btrfs_block_group, cache_node);
+		ret = scan_extents(info, bg->start,
+				   bg->start + bg->length - 1);
+		if (ret) {
+			error("while scanning extent tree: %d", ret);
+			goto out;
+		}
+	}
+
+	ret = map_implied_refs(info);
+	if (ret) {
+		error("while mapping refs: %d", ret);
+		goto out;
+	}
+
+	ret = account_all_refs(1, 0);
+	if (ret)
+		goto out;
+
+	*space = calloc(max(counts.num_groups, 1U), sizeof(**space));
+	if (!*space) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (n = rb_first(&counts.root); n; n = rb_next(n)) {
+		struct qgroup_count *c = rb_entry(n, struct qgroup_count, rb_node);
+		struct subvol_space *entry = &(*space)[nr++];
+
+		entry->subvolid = c->qgroupid;
+		entry->referenced = c->info.referenced;
+		entry->exclusive = c->info.exclusive;
+	}
+	*nr_space = nr;
+
+out:
+	free_tree_blocks();
+	free_ref_tree(&by_bytenr);
+	free_qgroup_counts();
+	counts.num_groups = 0;
+	return ret;
+}
+
 static int repair_qgroup_info(struct btrfs_fs_info *info,
 			      struct qgroup_count *count, bool silent)
 {
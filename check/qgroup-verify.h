@@ -24,14 +24,30 @@
 
 struct btrfs_fs_info;
 
+/* Default number of threads accounting the extents to the qgroups */
+#define QGROUP_VERIFY_DEFAULT_WORKERS	(4)
+#define QGROUP_VERIFY_MAX_WORKERS	(256)
+
 int qgroup_verify_all(struct btrfs_fs_info *info);
 void report_qgroups(int all);
 int repair_qgroups(struct btrfs_fs_info *info, int *repaired, bool silent);
 
 int print_extent_state(struct btrfs_fs_info *info, u64 subvol);
 
+/* Bytes referenced by a subvolume, the exclusive ones by no other subvolume */
+struct subvol_space {
+	u64 subvolid;
+	u64 referenced;
+	u64 exclusive;
+};
+
+int account_subvol_space(struct btrfs_fs_info *info,
+			 struct subvol_space **space, unsigned int *nr_space);
+
 void free_qgroup_counts(void);
 
 void qgroup_set_item_count_ptr(u64 *item_count_ptr);
+/* Number of threads accounting the extents, 0 or 1 to account in the caller */
+void qgroup_set_workers(unsigned int workers);
 
 #endif
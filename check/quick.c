@@ -0,0 +1,615 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/volumes.h"
+#include "kernel-shared/tree-checker.h"
+#include "common/messages.h"
+#include "common/format-output.h"
+#include "common/tree-prefetch.h"
+#include "common/utils.h"
+#include "cmds/commands.h"
+#include "check/quick.h"
+
+static const struct rowspec quick_rowspec[] = {
+	{ .key = "device", .fmt = "str", .out_text = "device", .out_json = "device" },
+	{ .key = "devid", .fmt = "%llu", .out_text = "devid", .out_json = "devid" },
+	{ .key = "copy", .fmt = "%llu", .out_text = "copy", .out_json = "copy" },
+	{ .key = "slot", .fmt = "%llu", .out_text = "slot", .out_json = "slot" },
+	{ .key = "best", .fmt = "bool", .out_text = "best", .out_json = "best" },
+	{ .key = "tree", .fmt = "str", .out_text = "tree", .out_json = "tree" },
+	{ .key = "objectid", .fmt = "%llu", .out_text = "objectid", .out_json = "objectid" },
+	{ .key = "bytenr", .fmt = "%llu", .out_text = "bytenr", .out_json = "bytenr" },
+	{ .key = "generation", .fmt = "%llu", .out_text = "generation", .out_json = "generation" },
+	{ .key = "level", .fmt = "%llu", .out_text = "level", .out_json = "level" },
+	{ .key = "blocks", .fmt = "%llu", .out_text = "blocks", .out_json = "blocks" },
+	{ .key = "bad-blocks", .fmt = "%llu", .out_text = "bad blocks", .out_json = "bad-blocks" },
+	{ .key = "status", .fmt = "str", .out_text = "status", .out_json = "status" },
+	{ .key = "fsid", .fmt = "uuid", .out_text = "fsid", .out_json = "fsid" },
+	{ .key = "errors", .fmt = "%llu", .out_text = "errors", .out_json = "errors" },
+	{ .key = "warnings", .fmt = "%llu", .out_text = "warnings", .out_json = "warnings" },
+	{ .key = "elapsed-ms", .fmt = "%llu", .out_text = "elapsed ms", .out_json = "elapsed-ms" },
+	{ .key = "verdict", .fmt = "str", .out_text = "verdict", .out_json = "verdict" },
+	ROWSPEC_END
+};
+
+/* A tree whose top levels are verified */
+struct quick_tree {
+	const char *name;
+	u64 objectid;
+	u64 bytenr;
+	u64 generation;
+	u8 level;
+	u32 blocks;
+	u32 bad_blocks;
+};
+
+/* A block of the level being read */
+struct quick_block {
+	u64 bytenr;
+	u64 transid;
+	u64 owner;
+	u8 level;
+	u32 tree;
+};
+
+struct quick_probe {
+	/* Only the JSON output goes through the context, the text is a table */
+	bool json;
+	struct format_ctx fctx;
+	struct timespec start;
+	u64 deadline_ms;
+	bool timed_out;
+	/* Problems preventing the mount, and the ones that don't */
+	unsigned int errors;
+	unsigned int warnings;
+
+	struct quick_tree *trees;
+	u32 nr_trees;
+	u32 max_trees;
+};
+
+static u64 quick_elapsed_ms(const struct quick_probe *qp)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - qp->start.tv_sec) * 1000 +
+	       (now.tv_nsec - qp->start.tv_nsec) / 1000000;
+}
+
+static bool quick_over_budget(struct quick_probe *qp)
+{
+	if (!qp->timed_out && quick_elapsed_ms(qp) >= qp->deadline_ms)
+		qp->timed_out = true;
+	return qp->timed_out;
+}
+
+static const char *quick_tree_name(u64 objectid)
+{
+	switch (objectid) {
+	case BTRFS_ROOT_TREE_OBJECTID:		return "root";
+	case BTRFS_EXTENT_TREE_OBJECTID:	return "extent";
+	case BTRFS_CHUNK_TREE_OBJECTID:		return "chunk";
+	case BTRFS_DEV_TREE_OBJECTID:		return "dev";
+	case BTRFS_FS_TREE_OBJECTID:		return "fs";
+	case BTRFS_CSUM_TREE_OBJECTID:		return "csum";
+	case BTRFS_QUOTA_TREE_OBJECTID:		return "quota";
+	case BTRFS_UUID_TREE_OBJECTID:		return "uuid";
+	case BTRFS_FREE_SPACE_TREE_OBJECTID:	return "free-space";
+	case BTRFS_BLOCK_GROUP_TREE_OBJECTID:	return "block-group";
+	case BTRFS_RAID_STRIPE_TREE_OBJECTID:	return "raid-stripe";
+	case BTRFS_TREE_LOG_OBJECTID:		return "log";
+	case BTRFS_DATA_RELOC_TREE_OBJECTID:	return "data-reloc";
+	}
+	return "other";
+}
+
+static int quick_add_tree(struct quick_probe *qp, u64 objectid, u64 bytenr,
+			  u64 generation, u8 level)
+{
+	struct quick_tree *tree;
+
+	if (qp->nr_trees == qp->max_trees) {
+		u32 max = max(16U, qp->max_trees * 2);
+
+		tree = realloc(qp->trees, max * sizeof(*tree));
+		if (!tree)
+			return -ENOMEM;
+		qp->trees = tree;
+		qp->max_trees = max;
+	}
+	tree = &qp->trees[qp->nr_trees++];
+	memset(tree, 0, sizeof(*tree));
+	tree->name = quick_tree_name(objectid);
+	tree->objectid = objectid;
+	tree->bytenr = bytenr;
+	tree->generation = generation;
+	tree->level = level;
+	return 0;
+}
+
+/*
+ * Verify the superblock copies of one device, the primary one must be valid,
+ * the others are only used by rescue tools.
+ */
+static void quick_check_supers(struct quick_probe *qp, int fd,
+			       const char *name, u64 devid)
+{
+	struct btrfs_super_block primary;
+	struct btrfs_super_block sb;
+	u64 device_size = 0;
+
+	for (int i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		const u64 bytenr = btrfs_sb_offset(i);
+		const char *status = "ok";
+		int ret;
+
+		/* The copies past the end of the device are not written */
+		if (i && device_size && bytenr + BTRFS_SUPER_INFO_SIZE > device_size)
+			break;
+		ret = btrfs_read_dev_super(fd, i ? &sb : &primary, bytenr,
+					   SBREAD_DEFAULT);
+		if (i && ret == -ENOENT)
+			break;
+		if (ret < 0) {
+			status = "bad";
+		} else if (i == 0) {
+			device_size = btrfs_stack_device_total_bytes(&primary.dev_item);
+		} else if (memcmp(sb.fsid, primary.fsid, BTRFS_FSID_SIZE)) {
+			status = "bad";
+		} else if (btrfs_super_generation(&sb) !=
+			   btrfs_super_generation(&primary)) {
+			status = "stale";
+		}
+		if (strcmp(status, "ok")) {
+			if (i == 0)
+				qp->errors++;
+			else
+				qp->warnings++;
+		}
+
+		if (qp->json) {
+			fmt_print_start_group(&qp->fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(&qp->fctx, "device", name);
+			if (devid)
+				fmt_print(&qp->fctx, "devid", devid);
+			fmt_print(&qp->fctx, "copy", (u64)i);
+			fmt_print(&qp->fctx, "bytenr", bytenr);
+			if (ret == 0)
+				fmt_print(&qp->fctx, "generation",
+					  btrfs_super_generation(i ? &sb : &primary));
+			fmt_print(&qp->fctx, "status", status);
+			fmt_print_end_group(&qp->fctx, NULL);
+		} else {
+			printf("superblock %-6s %s copy %d bytenr %llu",
+			       status, name, i, bytenr);
+			if (ret == 0)
+				printf(" generation %llu",
+				       btrfs_super_generation(i ? &sb : &primary));
+			putchar('\n');
+		}
+		/* Without the primary copy the size of the device is unknown */
+		if (i == 0 && ret < 0)
+			break;
+	}
+}
+
+/*
+ * Read the tree roots of the backup slots, they're used for a mount with
+ * -o usebackuproot if the current one is damaged.  The blocks of the older
+ * slots may have been reused since, so they're only warnings.
+ */
+static void quick_check_backup_roots(struct quick_probe *qp,
+				     struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_super_block *sb = fs_info->super_copy;
+	const int best = find_best_backup_root(sb);
+
+	for (int i = 0; i < BTRFS_NUM_BACKUP_ROOTS; i++) {
+		struct btrfs_root_backup *backup = sb->super_roots + i;
+		struct btrfs_tree_parent_check check = {
+			.owner_root = BTRFS_ROOT_TREE_OBJECTID,
+			.transid = btrfs_backup_tree_root_gen(backup),
+			.level = btrfs_backup_tree_root_level(backup),
+		};
+		const char *status = "unused";
+
+		if (check.transid && !quick_over_budget(qp)) {
+			struct extent_buffer *eb;
+
+			eb = read_tree_block(fs_info,
+					     btrfs_backup_tree_root(backup),
+					     &check);
+			if (extent_buffer_uptodate(eb)) {
+				status = "ok";
+			} else {
+				status = "bad";
+				qp->warnings++;
+			}
+			free_extent_buffer(eb);
+		} else if (check.transid) {
+			status = "skipped";
+		}
+
+		if (qp->json) {
+			fmt_print_start_group(&qp->fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(&qp->fctx, "slot", (u64)i);
+			fmt_print(&qp->fctx, "best", i == best && check.transid);
+			fmt_print(&qp->fctx, "bytenr", btrfs_backup_tree_root(backup));
+			fmt_print(&qp->fctx, "generation", check.transid);
+			fmt_print(&qp->fctx, "status", status);
+			fmt_print_end_group(&qp->fctx, NULL);
+		} else if (check.transid) {
+			printf("backup     %-6s slot %d bytenr %llu generation %llu%s\n",
+			       status, i, btrfs_backup_tree_root(backup),
+			       check.transid, i == best ? " (best)" : "");
+		}
+	}
+}
+
+/* The trees read at mount time, from the superblock and the tree root */
+static int quick_find_trees(struct quick_probe *qp,
+			    struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_super_block *sb = fs_info->super_copy;
+	struct btrfs_root *tree_root = fs_info->tree_root;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	ret = quick_add_tree(qp, BTRFS_ROOT_TREE_OBJECTID,
+			     btrfs_super_root(sb), btrfs_super_generation(sb),
+			     btrfs_super_root_level(sb));
+	if (ret < 0)
+		return ret;
+	ret = quick_add_tree(qp, BTRFS_CHUNK_TREE_OBJECTID,
+			     btrfs_super_chunk_root(sb),
+			     btrfs_super_chunk_root_generation(sb),
+			     btrfs_super_chunk_root_level(sb));
+	if (ret < 0)
+		return ret;
+	if (btrfs_super_log_root(sb)) {
+		ret = quick_add_tree(qp, BTRFS_TREE_LOG_OBJECTID,
+				     btrfs_super_log_root(sb),
+				     btrfs_super_generation(sb) + 1,
+				     btrfs_super_log_root_level(sb));
+		if (ret < 0)
+			return ret;
+	}
+
+	/* The global trees and the fs tree, then the data reloc tree at the end */
+	key.objectid = 0;
+	key.type = BTRFS_ROOT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		struct extent_buffer *leaf = path.nodes[0];
+		struct btrfs_root_item *ri;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid >= BTRFS_FIRST_FREE_OBJECTID &&
+		    key.objectid < BTRFS_DATA_RELOC_TREE_OBJECTID) {
+			key.objectid = BTRFS_DATA_RELOC_TREE_OBJECTID;
+			key.type = BTRFS_ROOT_ITEM_KEY;
+			key.offset = 0;
+			btrfs_release_path(&path);
+			ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+			if (ret < 0)
+				goto out;
+			continue;
+		}
+		if (key.objectid > BTRFS_DATA_RELOC_TREE_OBJECTID)
+			break;
+		if (key.type == BTRFS_ROOT_ITEM_KEY) {
+			ri = btrfs_item_ptr(leaf, path.slots[0],
+					    struct btrfs_root_item);
+			ret = quick_add_tree(qp, key.objectid,
+					     btrfs_disk_root_bytenr(leaf, ri),
+					     btrfs_disk_root_generation(leaf, ri),
+					     btrfs_disk_root_level(leaf, ri));
+			if (ret < 0)
+				goto out;
+		}
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+static int quick_add_block(struct quick_block **blocks, u32 *nr, u32 *max,
+			   const struct quick_block *block)
+{
+	if (*nr == *max) {
+		u32 new_max = max(64U, *max * 2);
+		struct quick_block *tmp;
+
+		tmp = realloc(*blocks, new_max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		*blocks = tmp;
+		*max = new_max;
+	}
+	(*blocks)[(*nr)++] = *block;
+	return 0;
+}
+
+/*
+ * Verify the top @levels of all the trees, level by level.  The blocks of a
+ * level are read by the prefetch threads first, read_tree_block() then finds
+ * them cached and verifies them in order, or reads them again to report the
+ * error.
+ */
+static int quick_check_trees(struct quick_probe *qp,
+			     struct btrfs_fs_info *fs_info,
+			     unsigned int levels, unsigned int nr_threads)
+{
+	struct tree_prefetch *tp = NULL;
+	struct quick_block *cur = NULL;
+	struct quick_block *next = NULL;
+	u32 nr_cur = 0, max_cur = 0;
+	u32 nr_next = 0, max_next = 0;
+	int ret = 0;
+
+	for (u32 i = 0; i < qp->nr_trees; i++) {
+		const struct quick_tree *tree = &qp->trees[i];
+		const struct quick_block block = {
+			.bytenr = tree->bytenr,
+			.transid = tree->generation,
+			.owner = tree->objectid,
+			.level = tree->level,
+			.tree = i,
+		};
+
+		ret = quick_add_block(&cur, &nr_cur, &max_cur, &block);
+		if (ret < 0)
+			goto out;
+	}
+	if (nr_threads)
+		tp = tree_prefetch_alloc(fs_info, nr_threads);
+
+	for (unsigned int depth = 0; depth < levels && nr_cur; depth++) {
+		if (tp) {
+			struct extent_buffer *eb;
+
+			for (u32 i = 0; i < nr_cur; i++)
+				tree_prefetch_submit(tp, cur[i].bytenr,
+						     cur[i].transid);
+			while ((eb = tree_prefetch_reap(tp))) {
+				free_extent_buffer(eb);
+				if (quick_over_budget(qp))
+					goto out;
+			}
+		}
+
+		nr_next = 0;
+		for (u32 i = 0; i < nr_cur; i++) {
+			struct quick_tree *tree = &qp->trees[cur[i].tree];
+			struct btrfs_tree_parent_check check = {
+				.owner_root = cur[i].owner,
+				.transid = cur[i].transid,
+				.level = cur[i].level,
+			};
+			struct extent_buffer *eb;
+
+			if (quick_over_budget(qp))
+				goto out;
+			eb = read_tree_block(fs_info, cur[i].bytenr, &check);
+			if (!extent_buffer_uptodate(eb) ||
+			    btrfs_header_generation(eb) != cur[i].transid ||
+			    btrfs_header_level(eb) != cur[i].level) {
+				tree->bad_blocks++;
+				qp->errors++;
+				free_extent_buffer(eb);
+				continue;
+			}
+			tree->blocks++;
+			if (depth + 1 < levels && btrfs_header_level(eb) > 0) {
+				for (u32 slot = 0; slot < btrfs_header_nritems(eb); slot++) {
+					const struct quick_block block = {
+						.bytenr = btrfs_node_blockptr(eb, slot),
+						.transid = btrfs_node_ptr_generation(eb, slot),
+						.owner = btrfs_header_owner(eb),
+						.level = btrfs_header_level(eb) - 1,
+						.tree = cur[i].tree,
+					};
+
+					ret = quick_add_block(&next, &nr_next,
+							      &max_next, &block);
+					if (ret < 0)
+						break;
+				}
+			}
+			free_extent_buffer(eb);
+			if (ret < 0)
+				goto out;
+		}
+		/* The next level reuses the array of the current one */
+		{
+			struct quick_block *tmp = cur;
+			u32 tmp_max = max_cur;
+
+			cur = next;
+			nr_cur = nr_next;
+			max_cur = max_next;
+			next = tmp;
+			max_next = tmp_max;
+		}
+	}
+out:
+	tree_prefetch_free(tp);
+	free(cur);
+	free(next);
+	return ret;
+}
+
+static void quick_print_trees(struct quick_probe *qp)
+{
+	for (u32 i = 0; i < qp->nr_trees; i++) {
+		const struct quick_tree *tree = &qp->trees[i];
+		const char *status = "ok";
+
+		if (tree->bad_blocks)
+			status = "bad";
+		else if (!tree->blocks)
+			status = "skipped";
+
+		if (qp->json) {
+			fmt_print_start_group(&qp->fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(&qp->fctx, "tree", tree->name);
+			fmt_print(&qp->fctx, "objectid", tree->objectid);
+			fmt_print(&qp->fctx, "bytenr", tree->bytenr);
+			fmt_print(&qp->fctx, "generation", tree->generation);
+			fmt_print(&qp->fctx, "level", (u64)tree->level);
+			fmt_print(&qp->fctx, "blocks", (u64)tree->blocks);
+			fmt_print(&qp->fctx, "bad-blocks", (u64)tree->bad_blocks);
+			fmt_print(&qp->fctx, "status", status);
+			fmt_print_end_group(&qp->fctx, NULL);
+		} else {
+			printf("tree       %-6s %s (%llu) bytenr %llu level %u blocks %u bad %u\n",
+			       status, tree->name, tree->objectid, tree->bytenr,
+			       tree->level, tree->blocks, tree->bad_blocks);
+		}
+	}
+}
+
+int check_quick(const struct check_quick_args *args)
+{
+	struct quick_probe qp = { 0 };
+	struct open_ctree_args oca = { 0 };
+	struct btrfs_fs_info *fs_info;
+	const char *verdict;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &qp.start);
+	qp.deadline_ms = args->budget_ms;
+	qp.json = (bconf.output_format == CMD_FORMAT_JSON);
+	if (qp.json)
+		fmt_start(&qp.fctx, quick_rowspec, 14, 0);
+
+	/*
+	 * The block groups aren't needed by the probe and are the bulk of the
+	 * reads at open time without the block group tree.  The items aren't
+	 * verified, only the checksums, generations and the structure of the
+	 * blocks, the damaged ones are then reported instead of failing the open,
+	 * and in the table rather than by each read.
+	 */
+	oca.filename = args->path;
+	oca.sb_bytenr = args->sb_bytenr;
+	oca.flags = OPEN_CTREE_PARTIAL | OPEN_CTREE_NO_BLOCK_GROUPS |
+		    OPEN_CTREE_ALLOW_TRANSID_MISMATCH |
+		    OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS |
+		    OPEN_CTREE_SUPPRESS_CHECK_BLOCK_ERRORS;
+	if (!args->force)
+		oca.flags |= OPEN_CTREE_EXCLUSIVE;
+	fs_info = open_ctree_fs_info(&oca);
+
+	if (qp.json)
+		fmt_print_start_group(&qp.fctx, "superblocks", JSON_TYPE_ARRAY);
+	if (fs_info) {
+		struct btrfs_device *device;
+
+		list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list) {
+			if (device->fd < 0) {
+				qp.errors++;
+				continue;
+			}
+			quick_check_supers(&qp, device->fd, device->name,
+					   device->devid);
+		}
+	} else {
+		int fd = open(args->path, O_RDONLY);
+
+		if (fd >= 0) {
+			quick_check_supers(&qp, fd, args->path, 0);
+			close(fd);
+		}
+	}
+	if (qp.json)
+		fmt_print_end_group(&qp.fctx, "superblocks");
+
+	if (fs_info) {
+		if (qp.json)
+			fmt_print_start_group(&qp.fctx, "backup-roots", JSON_TYPE_ARRAY);
+		quick_check_backup_roots(&qp, fs_info);
+		if (qp.json)
+			fmt_print_end_group(&qp.fctx, "backup-roots");
+
+		ret = quick_find_trees(&qp, fs_info);
+		if (ret == 0)
+			ret = quick_check_trees(&qp, fs_info, args->levels,
+						args->nr_threads);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot read the trees: %m");
+			qp.errors++;
+		}
+		if (qp.json) {
+			fmt_print_start_group(&qp.fctx, "trees", JSON_TYPE_ARRAY);
+			quick_print_trees(&qp);
+			fmt_print_end_group(&qp.fctx, "trees");
+			fmt_print(&qp.fctx, "fsid", fs_info->super_copy->fsid);
+		} else {
+			quick_print_trees(&qp);
+		}
+		close_ctree_fs_info(fs_info);
+	} else {
+		error("cannot open file system");
+		qp.errors++;
+	}
+
+	if (qp.errors)
+		verdict = "damaged";
+	else if (qp.timed_out)
+		verdict = "incomplete";
+	else
+		verdict = "ok";
+	if (qp.json) {
+		fmt_print(&qp.fctx, "errors", (u64)qp.errors);
+		fmt_print(&qp.fctx, "warnings", (u64)qp.warnings);
+		fmt_print(&qp.fctx, "elapsed-ms", quick_elapsed_ms(&qp));
+		fmt_print(&qp.fctx, "verdict", verdict);
+		fmt_end(&qp.fctx);
+	} else {
+		printf("quick check: %s, %u errors, %u warnings, %llu ms\n",
+		       verdict, qp.errors, qp.warnings, quick_elapsed_ms(&qp));
+	}
+	free(qp.trees);
+
+	return strcmp(verdict, "ok") ? 1 : 0;
+}
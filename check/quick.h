@@ -0,0 +1,52 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_CHECK_QUICK_H__
+#define __BTRFS_CHECK_QUICK_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+/*
+ * Quick probe of a filesystem before it's mounted, the blocks needed to mount
+ * it are verified within a time budget and a verdict is printed.
+ *
+ * The superblock copies of all devices, the chunk tree, the tree roots of the
+ * backup slots and the top levels of the trees read at mount time are read,
+ * each level of all the trees at once by the prefetch threads.  The checksums,
+ * generations and the structure of the blocks are verified, not the items.
+ */
+
+#define CHECK_QUICK_DEFAULT_LEVELS		(2)
+#define CHECK_QUICK_DEFAULT_BUDGET_MS		(1000)
+
+struct check_quick_args {
+	const char *path;
+	u64 sb_bytenr;
+	/* Levels of each tree read from its root, at least 1 */
+	unsigned int levels;
+	/* The probe stops when it's over, the verdict is then incomplete */
+	unsigned int budget_ms;
+	/* Threads reading the blocks, 0 reads them one by one */
+	unsigned int nr_threads;
+	/* The filesystem may be mounted, don't open the devices exclusively */
+	bool force;
+};
+
+/* Return 0 if the filesystem is fine, 1 if not or the probe didn't finish */
+int check_quick(const struct check_quick_args *args);
+
+#endif
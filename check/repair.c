@@ -32,9 +32,24 @@
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/tree-checker.h"
 #include "common/extent-cache.h"
+#include "common/messages.h"
 #include "check/repair.h"
 
 int opt_check_repair = 0;
+unsigned int repair_batch_fixes = REPAIR_BATCH_FIXES;
+u64 repair_batch_bytes = REPAIR_BATCH_BYTES;
+
+/*
+ * The transaction shared by the fixes of a batch, see repair_batch_begin().
+ * A transaction commits only one subvolume root, so the batch is bound to the
+ * root it was started for.
+ */
+static struct {
+	bool open;
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root;
+	unsigned int fixes;
+} repair_batch;
 
 /*
  * Adjust the pointers going up the tree, starting at level making sure the
@@ -381,3 +396,95 @@ enum btrfs_tree_block_status btrfs_check_block_for_repair(struct extent_buffer *
 	}
 	return status;
 }
+
+/*
+ * Start batching the fixes, the transactions of repair_trans_start() are
+ * committed by repair_trans_commit() only when the limits are reached, when
+ * another root is repaired or by repair_batch_end().
+ *
+ * The caller must not start transactions other than by repair_trans_start()
+ * until repair_batch_end().
+ */
+void repair_batch_begin(void)
+{
+	if (repair_batch_fixes > 1)
+		repair_batch.open = true;
+}
+
+static int repair_batch_commit(void)
+{
+	struct btrfs_trans_handle *trans = repair_batch.trans;
+	int ret;
+
+	if (!trans)
+		return 0;
+	repair_batch.trans = NULL;
+	ret = btrfs_commit_transaction(trans, repair_batch.root);
+	if (ret < 0) {
+		errno = -ret;
+		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+	}
+	return ret;
+}
+
+/* Commit the fixes of the batch and stop batching */
+int repair_batch_end(void)
+{
+	repair_batch.open = false;
+	return repair_batch_commit();
+}
+
+/*
+ * Start a transaction for a fix of @root, or join the one of the batch if it's
+ * for the same root.  Return the transaction or an error pointer.
+ */
+struct btrfs_trans_handle *repair_trans_start(struct btrfs_root *root,
+					      unsigned int num_items)
+{
+	struct btrfs_trans_handle *trans;
+	int ret;
+
+	if (repair_batch.trans) {
+		if (root->fs_info->transaction_aborted)
+			return ERR_PTR(-EROFS);
+		if (repair_batch.root == root)
+			return repair_batch.trans;
+		ret = repair_batch_commit();
+		if (ret < 0)
+			return ERR_PTR(ret);
+	}
+
+	trans = btrfs_start_transaction(root, num_items);
+	if (IS_ERR(trans) || !repair_batch.open)
+		return trans;
+	repair_batch.trans = trans;
+	repair_batch.root = root;
+	repair_batch.fixes = 0;
+	return trans;
+}
+
+/*
+ * End the fix done in @trans, commit it if it's not batched or the batch has
+ * reached the number of fixes or the size of the new metadata.
+ */
+int repair_trans_commit(struct btrfs_trans_handle *trans,
+			struct btrfs_root *root)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+
+	if (trans != repair_batch.trans)
+		return btrfs_commit_transaction(trans, root);
+
+	repair_batch.fixes++;
+	if (!fs_info->transaction_aborted &&
+	    repair_batch.fixes < repair_batch_fixes &&
+	    (u64)trans->blocks_used * fs_info->nodesize < repair_batch_bytes) {
+		/*
+		 * The checks following read the extent tree, let it reflect
+		 * the fixes already done as if they were committed.
+		 */
+		if (btrfs_run_delayed_refs(trans, -1) == 0)
+			return 0;
+	}
+	return repair_batch_commit();
+}
@@ -20,6 +20,7 @@
 #define __BTRFS_REPAIR_H__
 
 #include "kerncompat.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/tree-checker.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "common/extent-cache.h"
@@ -34,6 +35,15 @@ struct extent_buffer;
 /* Repair mode */
 extern int opt_check_repair;
 
+/* Limits of the fixes committed together, see repair_batch_begin() */
+#define REPAIR_BATCH_FIXES		(256)
+#define REPAIR_BATCH_BYTES		(SZ_16M)
+
+/* Number of fixes in one transaction, 0 or 1 to commit each of them */
+extern unsigned int repair_batch_fixes;
+/* Size of the tree blocks allocated by the batch that makes it commit */
+extern u64 repair_batch_bytes;
+
 struct btrfs_corrupt_block {
 	struct cache_extent cache;
 	struct btrfs_key key;
@@ -55,4 +65,11 @@ void btrfs_set_item_key_unsafe(struct btrfs_root *root, struct btrfs_path *path,
 void btrfs_fixup_low_keys(struct btrfs_path *path, struct btrfs_disk_key *key,
 			  int level);
 
+void repair_batch_begin(void);
+int repair_batch_end(void);
+struct btrfs_trans_handle *repair_trans_start(struct btrfs_root *root,
+					      unsigned int num_items);
+int repair_trans_commit(struct btrfs_trans_handle *trans,
+			struct btrfs_root *root);
+
 #endif
@@ -0,0 +1,497 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Simulation of the relocation of block groups for balance plan.
+ *
+ * Relocating a block group writes its used bytes to the free space of the
+ * other block groups of the same type and profile and returns the chunk to
+ * the unallocated space of the devices.  The simulation picks the block group
+ * moving the least data for the device space it frees, fills the free space
+ * of the remaining block groups in the order of the logical address like the
+ * allocator does, and repeats until the target is reached or the data would
+ * not fit without allocating a new chunk.
+ */
+
+#include "kerncompat.h"
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/uapi/btrfs_tree.h"
+#include "kernel-shared/uapi/btrfs.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/volumes.h"
+#include "common/messages.h"
+#include "common/device-utils.h"
+#include "common/tree-search.h"
+#include "cmds/balance-plan.h"
+
+/* Type and profile, relocated data stays within the same class */
+#define PLAN_CLASS_MASK		(BTRFS_BLOCK_GROUP_TYPE_MASK |		\
+				 BTRFS_BLOCK_GROUP_PROFILE_MASK)
+
+/*
+ * Call @fn for each item of the search key of @args until it returns non-zero,
+ * a negative errno is returned, a positive value stops the search.
+ */
+static int search_items(int fd, struct btrfs_tree_search_args *args,
+			int (*fn)(struct btrfs_ioctl_search_header *sh,
+				  void *item, void *priv),
+			void *priv)
+{
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(args);
+	struct btrfs_ioctl_search_header sh = { 0 };
+	int ret;
+
+	while (1) {
+		unsigned long off = 0;
+
+		sk->nr_items = 4096;
+		ret = btrfs_tree_search_ioctl(fd, args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		for (int i = 0; i < sk->nr_items; i++) {
+			void *item;
+
+			memcpy(&sh, btrfs_tree_search_data(args, off), sizeof(sh));
+			off += sizeof(sh);
+			item = btrfs_tree_search_data(args, off);
+			off += sh.len;
+
+			ret = fn(&sh, item, priv);
+			if (ret)
+				return ret < 0 ? ret : 0;
+		}
+
+		/* Continue after the last key */
+		sk->min_objectid = sh.objectid;
+		sk->min_type = sh.type;
+		sk->min_offset = sh.offset + 1;
+		if (sk->min_offset == 0) {
+			if (sk->min_type == (u8)-1) {
+				if (sk->min_objectid == sk->max_objectid)
+					break;
+				sk->min_objectid++;
+			}
+			sk->min_type++;
+		}
+	}
+
+	return 0;
+}
+
+static void init_search(struct btrfs_tree_search_args *args, u64 tree_id,
+			u64 min_objectid, u8 min_type, u64 max_objectid,
+			u8 max_type)
+{
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(args);
+
+	memset(args, 0, sizeof(*args));
+	sk->tree_id = tree_id;
+	sk->min_objectid = min_objectid;
+	sk->min_type = min_type;
+	sk->max_objectid = max_objectid;
+	sk->max_type = max_type;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+}
+
+struct load_ctx {
+	struct balance_plan *plan;
+	int size;
+	/* Device space of all chunks, including the types not planned */
+	u64 allocated;
+	u64 types;
+};
+
+/* Space of the chunk on the devices, see also calc_chunk_size() */
+static u64 chunk_raw_size(u64 flags, u64 length, u16 num_stripes)
+{
+	u64 data_stripes = 1;
+
+	if (!(flags & (BTRFS_BLOCK_GROUP_RAID1_MASK | BTRFS_BLOCK_GROUP_DUP)))
+		data_stripes = (num_stripes - btrfs_bg_type_to_nparity(flags)) /
+			       btrfs_bg_type_to_sub_stripes(flags);
+	if (!data_stripes)
+		data_stripes = 1;
+
+	return length / data_stripes * num_stripes;
+}
+
+static int add_chunk(struct btrfs_ioctl_search_header *sh, void *item,
+		     void *priv)
+{
+	struct load_ctx *ctx = priv;
+	struct balance_plan *plan = ctx->plan;
+	struct balance_plan_bg *bg;
+	u64 flags;
+	u64 raw;
+
+	if (sh->type != BTRFS_CHUNK_ITEM_KEY)
+		return 0;
+
+	flags = btrfs_stack_chunk_type(item);
+	raw = chunk_raw_size(flags, btrfs_stack_chunk_length(item),
+			     btrfs_stack_chunk_num_stripes(item));
+	ctx->allocated += raw;
+	if (!(flags & ctx->types))
+		return 0;
+
+	if (plan->nr_bgs == ctx->size) {
+		struct balance_plan_bg *bgs;
+
+		ctx->size = ctx->size ? ctx->size * 2 : 256;
+		bgs = realloc(plan->bgs, ctx->size * sizeof(*bgs));
+		if (!bgs)
+			return -ENOMEM;
+		plan->bgs = bgs;
+	}
+	bg = &plan->bgs[plan->nr_bgs++];
+	bg->start = sh->offset;
+	bg->length = btrfs_stack_chunk_length(item);
+	bg->flags = flags;
+	bg->used = 0;
+	bg->raw = raw;
+	bg->relocated = false;
+	return 0;
+}
+
+static int cmp_bg_start(const void *a, const void *b)
+{
+	const u64 *start = a;
+	const struct balance_plan_bg *bg = b;
+
+	if (*start < bg->start)
+		return -1;
+	return *start > bg->start;
+}
+
+static int read_block_group_used(struct btrfs_ioctl_search_header *sh,
+				 void *item, void *priv)
+{
+	struct balance_plan *plan = priv;
+	struct balance_plan_bg *bg;
+
+	if (sh->type != BTRFS_BLOCK_GROUP_ITEM_KEY)
+		return 0;
+	bg = bsearch(&sh->objectid, plan->bgs, plan->nr_bgs, sizeof(*bg),
+		     cmp_bg_start);
+	if (bg)
+		bg->used = btrfs_stack_block_group_used(item);
+	return 0;
+}
+
+/*
+ * Read the used bytes of the block groups in one pass of the block group tree
+ * if the filesystem has it, otherwise look up each of them in the extent tree
+ * where the items are spread among the extents.
+ */
+static int load_block_group_used(int fd, struct balance_plan *plan)
+{
+	struct btrfs_tree_search_args args;
+	int ret;
+
+	init_search(&args, BTRFS_BLOCK_GROUP_TREE_OBJECTID, 0,
+		    BTRFS_BLOCK_GROUP_ITEM_KEY, (u64)-1,
+		    BTRFS_BLOCK_GROUP_ITEM_KEY);
+	ret = search_items(fd, &args, read_block_group_used, plan);
+	if (ret != -ENOENT)
+		return ret;
+
+	for (int i = 0; i < plan->nr_bgs; i++) {
+		u64 start = plan->bgs[i].start;
+
+		init_search(&args, BTRFS_EXTENT_TREE_OBJECTID, start,
+			    BTRFS_BLOCK_GROUP_ITEM_KEY, start,
+			    BTRFS_BLOCK_GROUP_ITEM_KEY);
+		ret = search_items(fd, &args, read_block_group_used, plan);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static int load_device_size(int fd, u64 *total)
+{
+	struct btrfs_ioctl_fs_info_args fi_args;
+	int ret;
+
+	ret = ioctl(fd, BTRFS_IOC_FS_INFO, &fi_args);
+	if (ret < 0)
+		return -errno;
+
+	*total = 0;
+	for (u64 devid = 1; devid <= fi_args.max_id; devid++) {
+		struct btrfs_ioctl_dev_info_args dev_info;
+
+		memset(&dev_info, 0, sizeof(dev_info));
+		ret = device_get_info(fd, devid, &dev_info);
+		if (ret == -ENODEV)
+			continue;
+		if (ret < 0)
+			return ret;
+		*total += dev_info.total_bytes;
+	}
+	return 0;
+}
+
+/*
+ * Read the block groups of the @types (BTRFS_BLOCK_GROUP_DATA etc.) of the
+ * filesystem of @fd, with their usage, and the unallocated space of the
+ * devices.  Return 0 or a negative errno.
+ */
+int balance_plan_load(int fd, u64 types, struct balance_plan *plan)
+{
+	struct btrfs_tree_search_args args;
+	struct load_ctx ctx = { .plan = plan, .types = types };
+	u64 total = 0;
+	int ret;
+
+	memset(plan, 0, sizeof(*plan));
+
+	init_search(&args, BTRFS_CHUNK_TREE_OBJECTID,
+		    BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY,
+		    BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY);
+	ret = search_items(fd, &args, add_chunk, &ctx);
+	if (ret < 0)
+		goto out;
+
+	ret = load_block_group_used(fd, plan);
+	if (ret < 0)
+		goto out;
+
+	ret = load_device_size(fd, &total);
+	if (ret < 0)
+		goto out;
+	plan->unallocated = total > ctx.allocated ? total - ctx.allocated : 0;
+	ret = 0;
+out:
+	if (ret < 0)
+		balance_plan_free(plan);
+	return ret;
+}
+
+void balance_plan_free(struct balance_plan *plan)
+{
+	free(plan->bgs);
+	free(plan->steps);
+	plan->bgs = NULL;
+	plan->steps = NULL;
+	plan->nr_bgs = 0;
+	plan->nr_steps = 0;
+}
+
+/* Free space of the block groups of one type and profile */
+struct plan_class {
+	u64 flags;
+	u64 free;
+	/* First block group that may still have free space */
+	int next;
+};
+
+/* Candidate for relocation, by the data moved for each reclaimed byte */
+struct plan_candidate {
+	double cost;
+	/* The used bytes the cost was computed from */
+	u64 used;
+	int index;
+};
+
+struct plan_heap {
+	struct plan_candidate *items;
+	int nr;
+};
+
+static void heap_push(struct plan_heap *heap, struct plan_candidate cand)
+{
+	int i = heap->nr++;
+
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+
+		if (heap->items[parent].cost <= cand.cost)
+			break;
+		heap->items[i] = heap->items[parent];
+		i = parent;
+	}
+	heap->items[i] = cand;
+}
+
+static struct plan_candidate heap_pop(struct plan_heap *heap)
+{
+	struct plan_candidate top = heap->items[0];
+	struct plan_candidate last = heap->items[--heap->nr];
+	int i = 0;
+
+	while (1) {
+		int child = 2 * i + 1;
+
+		if (child >= heap->nr)
+			break;
+		if (child + 1 < heap->nr &&
+		    heap->items[child + 1].cost < heap->items[child].cost)
+			child++;
+		if (last.cost <= heap->items[child].cost)
+			break;
+		heap->items[i] = heap->items[child];
+		i = child;
+	}
+	heap->items[i] = last;
+	return top;
+}
+
+static struct plan_candidate make_candidate(const struct balance_plan_bg *bg,
+					    int index)
+{
+	struct plan_candidate cand = {
+		.cost = (double)bg->used / bg->raw,
+		.used = bg->used,
+		.index = index,
+	};
+
+	return cand;
+}
+
+static struct plan_class *find_class(struct plan_class *classes, int nr,
+				     u64 flags)
+{
+	for (int i = 0; i < nr; i++) {
+		if (classes[i].flags == (flags & PLAN_CLASS_MASK))
+			return &classes[i];
+	}
+	return NULL;
+}
+
+/*
+ * Move @bytes to the free space of the block groups of @class in the order of
+ * their logical address.
+ */
+static void fill_class(struct balance_plan *plan, struct plan_class *class,
+		       u64 bytes)
+{
+	int i;
+
+	for (i = class->next; i < plan->nr_bgs && bytes; i++) {
+		struct balance_plan_bg *bg = &plan->bgs[i];
+		u64 take;
+
+		if ((bg->flags & PLAN_CLASS_MASK) != class->flags || bg->relocated)
+			continue;
+		take = min(bg->length - bg->used, bytes);
+		bg->used += take;
+		bytes -= take;
+		if (bg->used < bg->length)
+			break;
+	}
+	/* Everything before is full, relocated or of another class */
+	class->next = i;
+}
+
+/*
+ * Plan the relocation of the block groups of @types until @target bytes of
+ * device space are unallocated, or all of it if @target is 0, in at most
+ * @max_steps steps if not 0.  The steps are stored in @plan and the usage of
+ * its block groups is updated as the data would move.  Return 0 or a negative
+ * errno.
+ */
+int balance_plan_simulate(struct balance_plan *plan, u64 types, u64 target,
+			  int max_steps)
+{
+	struct plan_class classes[32];
+	struct plan_heap heap = { 0 };
+	int nr_classes = 0;
+	u64 reclaimed = 0;
+	int ret = 0;
+
+	/* A stale candidate is pushed only after it's popped, one per bg */
+	heap.items = malloc((plan->nr_bgs + 1) * sizeof(*heap.items));
+	plan->steps = malloc((plan->nr_bgs + 1) * sizeof(*plan->steps));
+	if (!heap.items || !plan->steps) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	plan->nr_steps = 0;
+
+	for (int i = 0; i < plan->nr_bgs; i++) {
+		const struct balance_plan_bg *bg = &plan->bgs[i];
+		struct plan_class *class;
+
+		class = find_class(classes, nr_classes, bg->flags);
+		if (!class) {
+			if (nr_classes == ARRAY_SIZE(classes)) {
+				ret = -E2BIG;
+				goto out;
+			}
+			class = &classes[nr_classes++];
+			class->flags = bg->flags & PLAN_CLASS_MASK;
+			class->free = 0;
+			class->next = i;
+		}
+		class->free += bg->length - bg->used;
+		/* Relocation of the system chunks needs a forced balance */
+		if ((bg->flags & types) && !(bg->flags & BTRFS_BLOCK_GROUP_SYSTEM))
+			heap_push(&heap, make_candidate(bg, i));
+	}
+
+	while (heap.nr > 0) {
+		struct plan_candidate cand = heap_pop(&heap);
+		struct balance_plan_bg *bg = &plan->bgs[cand.index];
+		struct balance_plan_step *step;
+		struct plan_class *class;
+
+		if (target && reclaimed >= target)
+			break;
+		if (max_steps && plan->nr_steps >= max_steps)
+			break;
+
+		/* Data moved in by a previous step, queue with the new cost */
+		if (cand.used != bg->used) {
+			heap_push(&heap, make_candidate(bg, cand.index));
+			continue;
+		}
+
+		/*
+		 * The data must fit the free space of the other block groups,
+		 * otherwise the kernel allocates a new chunk and nothing is
+		 * gained.  The free space only shrinks so the block group is
+		 * not tried again.
+		 */
+		class = find_class(classes, nr_classes, bg->flags);
+		if (class->free - (bg->length - bg->used) < bg->used)
+			continue;
+
+		step = &plan->steps[plan->nr_steps++];
+		step->start = bg->start;
+		step->length = bg->length;
+		step->flags = bg->flags;
+		step->moved = bg->used;
+		step->reclaimed = bg->raw;
+		reclaimed += bg->raw;
+
+		bg->relocated = true;
+		class->free -= bg->length;
+		fill_class(plan, class, bg->used);
+	}
+
+out:
+	free(heap.items);
+	return ret;
+}
@@ -0,0 +1,61 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_BALANCE_PLAN_H__
+#define __BTRFS_BALANCE_PLAN_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+/* A block group as seen by the planner */
+struct balance_plan_bg {
+	u64 start;
+	u64 length;
+	u64 flags;
+	/* Used bytes, grows in the simulation as relocated data moves in */
+	u64 used;
+	/* Space of the chunk on all its devices */
+	u64 raw;
+	bool relocated;
+};
+
+/* One relocated block group, in the order of the plan */
+struct balance_plan_step {
+	u64 start;
+	u64 length;
+	u64 flags;
+	/* Used bytes of the block group when it's relocated */
+	u64 moved;
+	/* Unallocated device space gained by the relocation */
+	u64 reclaimed;
+};
+
+struct balance_plan {
+	/* Sorted by the logical address */
+	struct balance_plan_bg *bgs;
+	int nr_bgs;
+	/* Sum of the device sizes not allocated to chunks, before the plan */
+	u64 unallocated;
+	struct balance_plan_step *steps;
+	int nr_steps;
+};
+
+int balance_plan_load(int fd, u64 types, struct balance_plan *plan);
+int balance_plan_simulate(struct balance_plan *plan, u64 types, u64 target,
+			  int max_steps);
+void balance_plan_free(struct balance_plan *plan);
+
+#endif
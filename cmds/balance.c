@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <limits.h>
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/volumes.h"
 #include "common/open-utils.h"
@@ -32,7 +33,13 @@
 #include "common/parse-utils.h"
 #include "common/messages.h"
 #include "common/help.h"
+#include "common/progress.h"
+#include "common/task-utils.h"
+#include "common/units.h"
+#include "common/string-table.h"
+#include "common/string-utils.h"
 #include "cmds/commands.h"
+#include "cmds/balance-plan.h"
 
 static const char * const balance_cmd_group_usage[] = {
 	"btrfs balance <command> [options] <path>",
@@ -736,15 +743,67 @@ static int cmd_balance_resume(const struct cmd_struct *cmd,
 static DEFINE_SIMPLE_COMMAND(balance_resume, "resume");
 
 static const char * const cmd_balance_status_usage[] = {
-	"btrfs balance status [-v] <path>",
+	"btrfs balance status [-v] [--watch] <path>",
 	"Show status of running or paused balance",
 	"",
 	OPTLINE("-v|--verbose", "deprecated, alias for global -v option"),
+	OPTLINE("--watch", "print the status every second with the rate and the estimated "
+		"time left, until the balance is finished or paused"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
+	HELPINFO_INSERT_FORMAT,
 	NULL
 };
 
+static void print_balance_status_json(const struct btrfs_ioctl_balance_args *args,
+				      const struct progress_estimator *est)
+{
+	printf("{\"state\":\"%s\",\"pause_requested\":%s,\"cancel_requested\":%s",
+	       (args->state & BTRFS_BALANCE_STATE_RUNNING) ? "running" : "paused",
+	       (args->state & BTRFS_BALANCE_STATE_PAUSE_REQ) ? "true" : "false",
+	       (args->state & BTRFS_BALANCE_STATE_CANCEL_REQ) ? "true" : "false");
+	printf(",\"expected\":%llu,\"considered\":%llu,\"completed\":%llu",
+	       args->stat.expected, args->stat.considered, args->stat.completed);
+	printf(",\"rate\":%.4f,\"avg_rate\":%.4f", est->rate, est->avg_rate);
+	if (est->eta >= 0)
+		printf(",\"eta\":%.0f}\n", est->eta);
+	else
+		printf(",\"eta\":null}\n");
+}
+
+static void print_balance_status(const char *path,
+				 const struct btrfs_ioctl_balance_args *args,
+				 const struct progress_estimator *est)
+{
+	char eta[64];
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		print_balance_status_json(args, est);
+		return;
+	}
+
+	if (args->state & BTRFS_BALANCE_STATE_RUNNING) {
+		printf("Balance on '%s' is running", path);
+		if (args->state & BTRFS_BALANCE_STATE_CANCEL_REQ)
+			printf(", cancel requested\n");
+		else if (args->state & BTRFS_BALANCE_STATE_PAUSE_REQ)
+			printf(", pause requested\n");
+		else
+			printf("\n");
+	} else {
+		printf("Balance on '%s' is paused\n", path);
+	}
+
+	printf("%llu out of about %llu chunks balanced (%llu considered), "
+	       "%3.f%% left\n", args->stat.completed,
+	       args->stat.expected, args->stat.considered,
+	       100 * (1 - (float)args->stat.completed/args->stat.expected));
+	if (est->nr_samples > 1)
+		printf("%.1f chunks/min (avg %.1f chunks/min), ETA %s\n",
+		       est->rate * 60, est->avg_rate * 60,
+		       progress_eta_string(est, eta, sizeof(eta)));
+}
+
 /* Checks the status of the balance if any
  * return codes:
  *   2 : Error failed to know if there is any pending balance
@@ -755,15 +814,21 @@ static int cmd_balance_status(const struct cmd_struct *cmd,
 			      int argc, char **argv)
 {
 	struct btrfs_ioctl_balance_args args;
+	struct progress_estimator est;
+	struct task_info *info = NULL;
 	const char *path;
+	bool watch = false;
+	bool first = true;
 	int fd;
 	int ret;
 
 	optind = 0;
 	while (1) {
 		int opt;
+		enum { GETOPT_VAL_WATCH = GETOPT_VAL_FIRST };
 		static const struct option longopts[] = {
 			{ "verbose", no_argument, NULL, 'v' },
+			{ "watch", no_argument, NULL, GETOPT_VAL_WATCH },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -775,6 +840,9 @@ static int cmd_balance_status(const struct cmd_struct *cmd,
 		case 'v':
 			bconf_be_verbose();
 			break;
+		case GETOPT_VAL_WATCH:
+			watch = true;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -789,44 +857,259 @@ static int cmd_balance_status(const struct cmd_struct *cmd,
 	if (fd < 0)
 		return 2;
 
-	ret = ioctl(fd, BTRFS_IOC_BALANCE_PROGRESS, &args);
-	if (ret < 0) {
-		if (errno == ENOTCONN) {
-			printf("No balance found on '%s'\n", path);
-			ret = 0;
+	if (watch) {
+		info = task_init(NULL, NULL, NULL);
+		if (!info || task_period_start(info, 1000) < 0) {
+			error("cannot start the status timer: %m");
+			ret = 2;
 			goto out;
 		}
-		error("balance status on '%s' failed: %m", path);
-		ret = 2;
-		goto out;
 	}
 
-	if (args.state & BTRFS_BALANCE_STATE_RUNNING) {
-		printf("Balance on '%s' is running", path);
-		if (args.state & BTRFS_BALANCE_STATE_CANCEL_REQ)
-			printf(", cancel requested\n");
-		else if (args.state & BTRFS_BALANCE_STATE_PAUSE_REQ)
-			printf(", pause requested\n");
-		else
-			printf("\n");
-	} else {
-		printf("Balance on '%s' is paused\n", path);
-	}
+	progress_init(&est, 0);
+	while (1) {
+		ret = ioctl(fd, BTRFS_IOC_BALANCE_PROGRESS, &args);
+		if (ret < 0) {
+			if (errno == ENOTCONN) {
+				if (bconf.output_format == CMD_FORMAT_JSON)
+					printf("{\"state\":\"%s\"}\n",
+					       first ? "none" : "finished");
+				else if (first)
+					printf("No balance found on '%s'\n", path);
+				else
+					printf("Balance on '%s' finished\n", path);
+				ret = 0;
+				goto out;
+			}
+			error("balance status on '%s' failed: %m", path);
+			ret = 2;
+			goto out;
+		}
 
-	printf("%llu out of about %llu chunks balanced (%llu considered), "
-	       "%3.f%% left\n", args.stat.completed,
-	       args.stat.expected, args.stat.considered,
-	       100 * (1 - (float)args.stat.completed/args.stat.expected));
+		est.total = args.stat.expected;
+		progress_update(&est, args.stat.completed);
+		print_balance_status(path, &args, &est);
 
-	if (bconf.verbose > BTRFS_BCONF_QUIET)
-		dump_ioctl_balance_args(&args);
+		if (first && bconf.verbose > BTRFS_BCONF_QUIET)
+			dump_ioctl_balance_args(&args);
+		first = false;
 
-	ret = 1;
+		ret = 1;
+		if (!watch || !(args.state & BTRFS_BALANCE_STATE_RUNNING))
+			break;
+		fflush(stdout);
+		task_period_wait(info);
+		if (bconf.output_format != CMD_FORMAT_JSON)
+			putchar('\n');
+	}
 out:
+	if (info) {
+		task_period_stop(info);
+		task_deinit(info);
+	}
+	close(fd);
+	return ret;
+}
+static DEFINE_COMMAND_WITH_FLAGS(balance_status, "status", CMD_FORMAT_JSON);
+
+static const char * const cmd_balance_plan_usage[] = {
+	"btrfs balance plan [options] <path>",
+	"Plan the relocation of block groups to gain unallocated space",
+	"Simulate the relocation of the block groups in the order that moves the",
+	"least data for the unallocated space it gains, and print the steps and the",
+	"balance commands relocating the block groups one by one. The plan is an",
+	"estimate, the kernel may allocate new chunks if the free space is too",
+	"fragmented for the relocated extents.",
+	"",
+	OPTLINE("-d", "plan the data block groups"),
+	OPTLINE("-m", "plan the metadata block groups (default: data and metadata)"),
+	OPTLINE("--target SIZE", "stop after gaining SIZE of unallocated device space"),
+	OPTLINE("--max-steps NUM", "relocate at most NUM block groups"),
+	HELPINFO_UNITS_LONG,
+	NULL
+};
+
+static void print_plan_filter(char *buf, size_t size, char opt,
+			      const struct balance_plan_step *step)
+{
+	u64 usage;
+
+	/* The block group is skipped if it got more data since the plan */
+	usage = min_t(u64, step->moved * 100 / step->length + 1, 100);
+	snprintf(buf, size, " -%cvrange=%llu..%llu,usage=%llu", opt,
+		 step->start, step->start + step->length, usage);
+}
+
+static int cmd_balance_plan(const struct cmd_struct *cmd, int argc, char **argv)
+{
+	struct balance_plan plan;
+	struct string_table *table;
+	unsigned int unit_mode;
+	u64 types = 0;
+	u64 target = 0;
+	u64 max_steps = 0;
+	u64 moved = 0;
+	u64 reclaimed = 0;
+	u64 unallocated;
+	const char *path;
+	int fd;
+	int ret;
+
+	unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
+
+	optind = 0;
+	while (1) {
+		enum { GETOPT_VAL_TARGET = GETOPT_VAL_FIRST,
+			GETOPT_VAL_MAX_STEPS };
+		static const struct option long_options[] = {
+			{ "target", required_argument, NULL, GETOPT_VAL_TARGET },
+			{ "max-steps", required_argument, NULL, GETOPT_VAL_MAX_STEPS },
+			{ NULL, 0, NULL, 0 }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "dm", long_options, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'd':
+			types |= BTRFS_BLOCK_GROUP_DATA;
+			break;
+		case 'm':
+			types |= BTRFS_BLOCK_GROUP_METADATA;
+			break;
+		case GETOPT_VAL_TARGET:
+			target = arg_strtou64_with_suffix(optarg);
+			break;
+		case GETOPT_VAL_MAX_STEPS:
+			max_steps = arg_strtou64(optarg);
+			if (max_steps > INT_MAX) {
+				error("too many steps: %llu", max_steps);
+				return 1;
+			}
+			break;
+		default:
+			usage_unknown_option(cmd, argv);
+		}
+	}
+
+	if (check_argc_exact(argc - optind, 1))
+		return 1;
+
+	if (!types)
+		types = BTRFS_BLOCK_GROUP_DATA | BTRFS_BLOCK_GROUP_METADATA;
+	path = argv[optind];
+
+	fd = btrfs_open_dir(path);
+	if (fd < 0)
+		return 1;
+
+	ret = balance_plan_load(fd, types, &plan);
 	close(fd);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot read the block groups of '%s': %m", path);
+		return 1;
+	}
+
+	ret = balance_plan_simulate(&plan, types, target, max_steps);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot simulate the relocation: %m");
+		ret = 1;
+		goto out;
+	}
+
+	for (int i = 0; i < plan.nr_steps; i++) {
+		moved += plan.steps[i].moved;
+		reclaimed += plan.steps[i].reclaimed;
+	}
+
+	pr_verbose(LOG_DEFAULT, "Unallocated:       %s\n",
+		   pretty_size_mode(plan.unallocated, unit_mode));
+	pr_verbose(LOG_DEFAULT, "Block groups:      %d of %d\n",
+		   plan.nr_steps, plan.nr_bgs);
+	pr_verbose(LOG_DEFAULT, "Data moved:        %s\n",
+		   pretty_size_mode(moved, unit_mode));
+	pr_verbose(LOG_DEFAULT, "Reclaimed:         %s\n",
+		   pretty_size_mode(reclaimed, unit_mode));
+	pr_verbose(LOG_DEFAULT, "Unallocated after: %s\n",
+		   pretty_size_mode(plan.unallocated + reclaimed, unit_mode));
+	if (target && reclaimed < target)
+		warning("the target %s is not reachable without allocating new chunks",
+			pretty_size_mode(target, unit_mode));
+
+	if (plan.nr_steps == 0) {
+		ret = 0;
+		goto out;
+	}
+
+	/* Header, separator and the steps */
+	table = table_create(8, plan.nr_steps + 2);
+	if (!table) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = 1;
+		goto out;
+	}
+	table_printf(table, 0, 0, ">Step");
+	table_printf(table, 1, 0, ">Type/profile");
+	table_printf(table, 2, 0, ">LStart");
+	table_printf(table, 3, 0, ">Length");
+	table_printf(table, 4, 0, ">Usage%%");
+	table_printf(table, 5, 0, ">Moved");
+	table_printf(table, 6, 0, ">Reclaimed");
+	table_printf(table, 7, 0, ">Unallocated");
+	for (int j = 0; j < 8; j++)
+		table_printf(table, j, 1, "*-");
+
+	unallocated = plan.unallocated;
+	for (int i = 0; i < plan.nr_steps; i++) {
+		const struct balance_plan_step *step = &plan.steps[i];
+		const int row = i + 2;
+
+		unallocated += step->reclaimed;
+		table_printf(table, 0, row, ">%d", i + 1);
+		table_printf(table, 1, row, ">%10s/%-6s",
+			     btrfs_group_type_str(step->flags),
+			     btrfs_group_profile_str(step->flags));
+		table_printf(table, 2, row, ">%s",
+			     pretty_size_mode(step->start, unit_mode));
+		table_printf(table, 3, row, ">%s",
+			     pretty_size_mode(step->length, unit_mode));
+		table_printf(table, 4, row, ">%6.2f",
+			     (float)step->moved / step->length * 100);
+		table_printf(table, 5, row, ">%s",
+			     pretty_size_mode(step->moved, unit_mode));
+		table_printf(table, 6, row, ">%s",
+			     pretty_size_mode(step->reclaimed, unit_mode));
+		table_printf(table, 7, row, ">%s",
+			     pretty_size_mode(unallocated, unit_mode));
+	}
+	pr_verbose(LOG_DEFAULT, "\n");
+	table_dump(table);
+	table_free(table);
+
+	pr_verbose(LOG_DEFAULT, "\nBalance commands:\n");
+	for (int i = 0; i < plan.nr_steps; i++) {
+		const struct balance_plan_step *step = &plan.steps[i];
+		char data[128] = "";
+		char meta[128] = "";
+
+		/* Mixed block groups need the same filters for both */
+		if (step->flags & BTRFS_BLOCK_GROUP_DATA)
+			print_plan_filter(data, sizeof(data), 'd', step);
+		if (step->flags & BTRFS_BLOCK_GROUP_METADATA)
+			print_plan_filter(meta, sizeof(meta), 'm', step);
+		pr_verbose(LOG_DEFAULT, "btrfs balance start%s%s %s\n", data, meta,
+			   path);
+	}
+	ret = 0;
+out:
+	balance_plan_free(&plan);
 	return ret;
 }
-static DEFINE_SIMPLE_COMMAND(balance_status, "status");
+static DEFINE_SIMPLE_COMMAND(balance_plan, "plan");
 
 static int cmd_balance_full(const struct cmd_struct *cmd, int argc, char **argv)
 {
@@ -851,6 +1134,7 @@ static const struct cmd_group balance_cmd_group = {
 		&cmd_struct_balance_cancel,
 		&cmd_struct_balance_resume,
 		&cmd_struct_balance_status,
+		&cmd_struct_balance_plan,
 		&cmd_struct_balance_full,
 		NULL
 	}
@@ -143,6 +143,8 @@ DECLARE_COMMAND(inspect);
 DECLARE_COMMAND(inspect_dump_super);
 DECLARE_COMMAND(inspect_dump_tree);
 DECLARE_COMMAND(inspect_tree_stats);
+DECLARE_COMMAND(inspect_layout_report);
+DECLARE_COMMAND(inspect_space_report);
 DECLARE_COMMAND(property);
 DECLARE_COMMAND(send);
 DECLARE_COMMAND(receive);
@@ -25,6 +25,7 @@
 #include <getopt.h>
 #include <dirent.h>
 #include <stdbool.h>
+#include <time.h>
 #include "kernel-shared/zoned.h"
 #include "common/string-table.h"
 #include "common/utils.h"
@@ -37,6 +38,7 @@
 #include "common/units.h"
 #include "common/string-utils.h"
 #include "common/messages.h"
+#include "common/sysfs-utils.h"
 #include "cmds/commands.h"
 #include "cmds/filesystem-usage.h"
 #include "mkfs/common.h"
@@ -591,6 +593,9 @@ static const char * const cmd_device_stats_usage[] = {
 	OPTLINE("-c|--check", "return non-zero if any stat counter is not zero"),
 	OPTLINE("-z|--reset", "show current stats and reset values to zero"),
 	OPTLINE("-T", "show current stats in tabular format"),
+	OPTLINE("--watch SECONDS", "print the changes of the error counters and the I/O rates of the "
+		"devices every SECONDS, one object per line and device with --format json"),
+	OPTLINE("--count NUM", "with --watch, stop after NUM reports"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_FORMAT,
 	NULL
@@ -702,6 +707,249 @@ static int print_device_stat_tabular(struct string_table *table, int row,
 	return err;
 }
 
+/* One device of device stats --watch, the counters of the previous report */
+struct stats_watch_dev {
+	u64 devid;
+	char path[BTRFS_DEVICE_PATH_NAME_MAX + 1];
+	/* The block layer stat file, or -1 if the device has none */
+	int io_fd;
+	bool gone;
+	u64 errs[BTRFS_DEV_STAT_VALUES_MAX];
+	struct sysfs_blockdev_stat io;
+};
+
+static const char * const stats_watch_names[BTRFS_DEV_STAT_VALUES_MAX] = {
+	[BTRFS_DEV_STAT_WRITE_ERRS] = "write_io_errs",
+	[BTRFS_DEV_STAT_READ_ERRS] = "read_io_errs",
+	[BTRFS_DEV_STAT_FLUSH_ERRS] = "flush_io_errs",
+	[BTRFS_DEV_STAT_CORRUPTION_ERRS] = "corruption_errs",
+	[BTRFS_DEV_STAT_GENERATION_ERRS] = "generation_errs",
+};
+
+/* Counters can go back after a reset by device stats -z */
+static u64 stats_delta(u64 now, u64 prev)
+{
+	return now >= prev ? now - prev : now;
+}
+
+static void print_stats_watch_json(const struct stats_watch_dev *dev,
+				   const u64 *errs,
+				   const struct sysfs_blockdev_stat *io,
+				   time_t now, double elapsed)
+{
+	char path[sizeof(dev->path) * FMT_JSON_ESCAPE_MAX];
+	size_t len;
+
+	len = fmt_escape_json(path, dev->path, strlen(dev->path));
+	printf("{\"time\":%llu,\"interval\":%.3f,\"devid\":%llu,\"device\":\"%.*s\"",
+	       (unsigned long long)now, elapsed, dev->devid, (int)len, path);
+	for (int i = 0; i < BTRFS_DEV_STAT_VALUES_MAX; i++) {
+		const u64 delta = stats_delta(errs[i], dev->errs[i]);
+
+		printf(",\"%s\":%llu,\"%s_delta\":%llu,\"%s_rate\":%.3f",
+		       stats_watch_names[i], errs[i], stats_watch_names[i], delta,
+		       stats_watch_names[i], delta / elapsed);
+	}
+	if (dev->io_fd >= 0) {
+		const u64 read_bytes = io->read_sectors * 512;
+		const u64 write_bytes = io->write_sectors * 512;
+
+		printf(",\"read_ios\":%llu,\"read_ios_rate\":%.3f",
+		       io->read_ios,
+		       stats_delta(io->read_ios, dev->io.read_ios) / elapsed);
+		printf(",\"read_bytes\":%llu,\"read_bytes_rate\":%.3f",
+		       read_bytes,
+		       stats_delta(read_bytes, dev->io.read_sectors * 512) / elapsed);
+		printf(",\"write_ios\":%llu,\"write_ios_rate\":%.3f",
+		       io->write_ios,
+		       stats_delta(io->write_ios, dev->io.write_ios) / elapsed);
+		printf(",\"write_bytes\":%llu,\"write_bytes_rate\":%.3f",
+		       write_bytes,
+		       stats_delta(write_bytes, dev->io.write_sectors * 512) / elapsed);
+	}
+	fputs("}\n", stdout);
+}
+
+static void print_stats_watch_row(struct string_table *table, int row,
+				  const struct stats_watch_dev *dev,
+				  const u64 *errs,
+				  const struct sysfs_blockdev_stat *io,
+				  double elapsed)
+{
+	int col = 0;
+
+	table_printf(table, col++, row, ">%llu", dev->devid);
+	table_printf(table, col++, row, "<%s", dev->path);
+	for (int i = 0; i < BTRFS_DEV_STAT_VALUES_MAX; i++)
+		table_printf(table, col++, row, ">%llu",
+			     stats_delta(errs[i], dev->errs[i]));
+	if (dev->io_fd < 0) {
+		for (int i = 0; i < 4; i++)
+			table_printf(table, col++, row, ">-");
+		return;
+	}
+	table_printf(table, col++, row, ">%.1f",
+		     stats_delta(io->read_ios, dev->io.read_ios) / elapsed);
+	table_printf(table, col++, row, ">%s",
+		     pretty_size(stats_delta(io->read_sectors,
+					     dev->io.read_sectors) * 512 / elapsed));
+	table_printf(table, col++, row, ">%.1f",
+		     stats_delta(io->write_ios, dev->io.write_ios) / elapsed);
+	table_printf(table, col++, row, ">%s",
+		     pretty_size(stats_delta(io->write_sectors,
+					     dev->io.write_sectors) * 512 / elapsed));
+}
+
+/*
+ * Read the error counters and the block layer counters of all devices, and
+ * print the changes since the previous sample unless this is the first one.
+ */
+static int stats_watch_sample(int fdmnt, struct stats_watch_dev *devs, int nr,
+			      bool print, double elapsed)
+{
+	const bool json = (bconf.output_format == CMD_FORMAT_JSON);
+	struct string_table *table = NULL;
+	const int ncols = 2 + BTRFS_DEV_STAT_VALUES_MAX + 4;
+	time_t now = time(NULL);
+	int row = 2;
+	int ret = 0;
+
+	if (print && !json) {
+		static const char * const header[] = {
+			"<Id", "<Path", ">Write errs", ">Read errs", ">Flush errs",
+			">Corruption errs", ">Generation errs", ">Reads/s",
+			">Read/s", ">Writes/s", ">Write/s"
+		};
+		char date[64];
+
+		table = table_create(ncols, nr + 2);
+		if (!table) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+		for (int i = 0; i < ncols; i++) {
+			table_printf(table, i, 0, "%s", header[i]);
+			table_printf(table, i, 1, "*-");
+		}
+		strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&now));
+		pr_verbose(LOG_DEFAULT, "%s\n", date);
+	}
+
+	for (int i = 0; i < nr; i++) {
+		struct stats_watch_dev *dev = &devs[i];
+		struct btrfs_ioctl_get_dev_stats args = { 0 };
+		struct sysfs_blockdev_stat io = { 0 };
+
+		if (dev->gone)
+			continue;
+
+		args.devid = dev->devid;
+		args.nr_items = BTRFS_DEV_STAT_VALUES_MAX;
+		if (ioctl(fdmnt, BTRFS_IOC_GET_DEV_STATS, &args) < 0) {
+			if (errno == ENODEV) {
+				warning("device %llu removed, not watched anymore",
+					dev->devid);
+				dev->gone = true;
+				continue;
+			}
+			error("device stats ioctl failed on %s: %m", dev->path);
+			ret = -errno;
+			break;
+		}
+		/* Older kernels may return fewer items */
+		for (int j = args.nr_items; j < BTRFS_DEV_STAT_VALUES_MAX; j++)
+			args.values[j] = 0;
+		if (dev->io_fd >= 0 && sysfs_read_blockdev_stat(dev->io_fd, &io) < 0) {
+			close(dev->io_fd);
+			dev->io_fd = -1;
+		}
+
+		if (print && json)
+			print_stats_watch_json(dev, args.values, &io, now, elapsed);
+		else if (print)
+			print_stats_watch_row(table, row, dev, args.values, &io,
+					      elapsed);
+		row++;
+		memcpy(dev->errs, args.values, sizeof(dev->errs));
+		dev->io = io;
+	}
+
+	if (table) {
+		if (!ret) {
+			table->nrows = row;
+			table_dump(table);
+			pr_verbose(LOG_DEFAULT, "\n");
+		}
+		table_free(table);
+	}
+	fflush(stdout);
+	return ret;
+}
+
+static double timespec_diff(const struct timespec *a, const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/*
+ * Poll the devices of the mounted filesystem every @interval seconds on the
+ * same file descriptor, until @count reports are printed if not 0.
+ */
+static int device_stats_watch(int fdmnt, struct btrfs_ioctl_dev_info_args *di_args,
+			      int nr, u64 interval, u64 count)
+{
+	struct stats_watch_dev *devs;
+	struct timespec prev;
+	struct timespec next;
+	int ret;
+
+	devs = calloc(nr, sizeof(*devs));
+	if (!devs) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return 1;
+	}
+	for (int i = 0; i < nr; i++) {
+		char *canonical_path;
+
+		devs[i].devid = di_args[i].devid;
+		devs[i].io_fd = -1;
+		canonical_path = path_canonicalize((char *)di_args[i].path);
+		if (canonical_path) {
+			strncpy_null(devs[i].path, canonical_path, sizeof(devs[i].path));
+			devs[i].io_fd = sysfs_open_blockdev_stat(canonical_path);
+			free(canonical_path);
+		} else {
+			/* No path when device is missing. */
+			snprintf(devs[i].path, sizeof(devs[i].path), "devid:%llu",
+				 devs[i].devid);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &prev);
+	ret = stats_watch_sample(fdmnt, devs, nr, false, 0);
+	next = prev;
+	for (u64 reports = 0; !ret && (!count || reports < count); reports++) {
+		struct timespec now;
+
+		/* Absolute deadlines so the reports don't drift */
+		next.tv_sec += interval;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next,
+				       NULL) == EINTR)
+			;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ret = stats_watch_sample(fdmnt, devs, nr, true,
+					 timespec_diff(&now, &prev));
+		prev = now;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		if (devs[i].io_fd >= 0)
+			close(devs[i].io_fd);
+	}
+	free(devs);
+	return ret ? 1 : 0;
+}
+
 static int cmd_device_stats(const struct cmd_struct *cmd, int argc, char **argv)
 {
 	char *dev_path;
@@ -716,14 +964,19 @@ static int cmd_device_stats(const struct cmd_struct *cmd, int argc, char **argv)
 	bool free_table = false;
 	bool tabular = false;
 	__u64 flags = 0;
+	u64 watch = 0;
+	u64 count = 0;
 	struct format_ctx fctx;
 
 	optind = 0;
 	while (1) {
 		int c;
+		enum { GETOPT_VAL_WATCH = GETOPT_VAL_FIRST, GETOPT_VAL_COUNT };
 		static const struct option long_options[] = {
 			{"check", no_argument, NULL, 'c'},
 			{"reset", no_argument, NULL, 'z'},
+			{"watch", required_argument, NULL, GETOPT_VAL_WATCH},
+			{"count", required_argument, NULL, GETOPT_VAL_COUNT},
 			{NULL, 0, NULL, 0}
 		};
 
@@ -741,6 +994,16 @@ static int cmd_device_stats(const struct cmd_struct *cmd, int argc, char **argv)
 		case 'T':
 			tabular = true;
 			break;
+		case GETOPT_VAL_WATCH:
+			watch = arg_strtou64(optarg);
+			if (!watch) {
+				error("watch interval must be at least 1 second");
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_COUNT:
+			count = arg_strtou64(optarg);
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -748,6 +1011,14 @@ static int cmd_device_stats(const struct cmd_struct *cmd, int argc, char **argv)
 
 	if (check_argc_exact(argc - optind, 1))
 		return 1;
+	if (watch && (check || flags || tabular)) {
+		error("--watch cannot be combined with -c, -z or -T");
+		return 1;
+	}
+	if (count && !watch) {
+		error("--count requires --watch");
+		return 1;
+	}
 
 	dev_path = argv[optind];
 
@@ -768,6 +1039,12 @@ static int cmd_device_stats(const struct cmd_struct *cmd, int argc, char **argv)
 		goto out;
 	}
 
+	if (watch) {
+		err = device_stats_watch(fdmnt, di_args, fi_args.num_devices,
+					 watch, count);
+		goto out;
+	}
+
 	if (tabular) {
 		/*
 		 * cols = Id/Path/write/read/flush/corruption/generation
@@ -30,13 +30,14 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <unistd.h>
-#include "kernel-lib/rbtree.h"
-#include "kernel-lib/rbtree_types.h"
-#include "kernel-lib/interval_tree_generic.h"
+#include <pthread.h>
+#include "kernel-lib/sizes.h"
+#include "kernel-lib/bitops.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "common/utils.h"
 #include "common/open-utils.h"
 #include "common/units.h"
+#include "common/string-utils.h"
 #include "common/help.h"
 #include "common/messages.h"
 #include "common/fsfeatures.h"
@@ -48,115 +49,112 @@
 
 static bool summarize = false;
 static unsigned unit_mode = UNITS_RAW;
-static char path[PATH_MAX] = { 0, };
-static char *pathp = path;
-static char *path_max = &path[PATH_MAX - 1];
 
+#define DU_MAX_THREADS			(64)
+/* Initial and largest size of the fiemap buffer of a thread */
+#define DU_FIEMAP_MIN_SIZE		(SZ_4K)
+#define DU_FIEMAP_MAX_SIZE		(SZ_1M)
+
+/* Shared extent, the physical range [start, end) */
 struct shared_extent {
-	struct rb_node	rb;
-	u64	start;	/* Start of interval */
-	u64	last;	/* Last location _in_ interval */
-	u64	__subtree_last;
+	u64 start;
+	u64 end;
 };
 
 /*
- * extent_tree_* functions are defined in the massive interval tree
- * macro below. This serves to illustrate the api in human-readable
- * terms.
+ * Shared extents collected by one thread.  The array is sorted and the
+ * overlapping extents merged each time it's full, so the extents shared many
+ * times inside the set take the space only once.
  */
-static void
-extent_tree_insert(struct shared_extent *node, struct rb_root *root);
-
-static void
-extent_tree_remove(struct shared_extent *node, struct rb_root *root);
-
-static struct shared_extent *
-extent_tree_iter_first(struct rb_root *root,
-		       u64 start, u64 last);
-
-static struct shared_extent *
-extent_tree_iter_next(struct shared_extent *node,
-			u64 start, u64 last);
-
-#define START(node) ((node)->start)
-#define LAST(node)  ((node)->last)
-
-INTERVAL_TREE_DEFINE(struct shared_extent, rb,
-		     u64, __subtree_last,
-		     START, LAST, static, extent_tree)
+struct shared_extents {
+	struct shared_extent *extents;
+	size_t nr;
+	size_t alloc;
+};
 
-static int add_shared_extent(u64 start, u64 len, struct rb_root *root)
+static int cmp_shared_extent(const void *a, const void *b)
 {
-	struct shared_extent *sh;
-
-	UASSERT(len != 0);
+	const struct shared_extent *ea = a;
+	const struct shared_extent *eb = b;
 
-	sh = calloc(1, sizeof(*sh));
-	if (!sh)
-		return -ENOMEM;
-
-	sh->start = start;
-	sh->last = (start + len - 1);
-
-	extent_tree_insert(sh, root);
-
-	return 0;
+	return (ea->start < eb->start ? -1 : ea->start > eb->start ? 1 : 0);
 }
 
-static void cleanup_shared_extents(struct rb_root *root)
+static void merge_shared_extents(struct shared_extents *se)
 {
-	struct shared_extent *s;
-	struct shared_extent *tmp;
+	size_t i, j;
 
-	if (!root)
+	if (se->nr < 2)
 		return;
 
-	s = extent_tree_iter_first(root, 0, -1ULL);
-	while (s) {
-		tmp = extent_tree_iter_next(s, 0, -1ULL);
-		extent_tree_remove(s, root);
+	qsort(se->extents, se->nr, sizeof(*se->extents), cmp_shared_extent);
+	for (i = 1, j = 0; i < se->nr; i++) {
+		struct shared_extent *cur = &se->extents[j];
 
-		free(s);
-		s = tmp;
+		if (se->extents[i].start <= cur->end) {
+			cur->end = max(cur->end, se->extents[i].end);
+		} else {
+			j++;
+			se->extents[j] = se->extents[i];
+		}
 	}
+	se->nr = j + 1;
 }
 
-/*
- * Find all extents which overlap 'n', calculate the space
- * covered by them and remove those nodes from the tree.
- */
-static u64 count_unique_bytes(struct rb_root *root, struct shared_extent *n)
+static int reserve_shared_extents(struct shared_extents *se, size_t nr)
 {
 	struct shared_extent *tmp;
-	u64 wstart = n->start;
-	u64 wlast = n->last;
+	size_t alloc = max_t(size_t, se->alloc, 1024);
 
-	pr_verbose(LOG_DEBUG, "Count overlaps:");
-
-	do {
-		/*
-		 * Expand our search window based on the latest
-		 * overlapping extent. Doing this will allow us to
-		 * find all possible overlaps
-		 */
-		if (wstart > n->start)
-			wstart = n->start;
-		if (wlast < n->last)
-			wlast = n->last;
+	while (alloc < nr)
+		alloc *= 2;
+	if (alloc == se->alloc)
+		return 0;
+	tmp = realloc(se->extents, alloc * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	se->extents = tmp;
+	se->alloc = alloc;
+	return 0;
+}
 
-		pr_verbose(LOG_DEBUG, " (%llu, %llu)", n->start, n->last);
+static int add_shared_extent(u64 start, u64 len, struct shared_extents *se)
+{
+	UASSERT(len != 0);
 
-		tmp = n;
-		n = extent_tree_iter_next(n, wstart, wlast);
+	if (se->nr == se->alloc) {
+		merge_shared_extents(se);
+		/* Grow only if merging did not free enough */
+		if (se->nr >= se->alloc / 2 &&
+		    reserve_shared_extents(se, se->nr + 1) < 0)
+			return -ENOMEM;
+	}
+	se->extents[se->nr].start = start;
+	se->extents[se->nr].end = start + len;
+	se->nr++;
 
-		extent_tree_remove(tmp, root);
-		free(tmp);
-	} while (n);
+	return 0;
+}
 
-	pr_verbose(LOG_DEBUG, "; wstart: %llu wlast: %llu total: %llu\n", wstart,
-		wlast, wlast - wstart + 1);
+/* Move the extents of @src to @dst */
+static int splice_shared_extents(struct shared_extents *dst,
+				 struct shared_extents *src)
+{
+	if (reserve_shared_extents(dst, dst->nr + src->nr) < 0)
+		return -ENOMEM;
+	memcpy(&dst->extents[dst->nr], src->extents,
+	       src->nr * sizeof(*src->extents));
+	dst->nr += src->nr;
+	src->nr = 0;
+	return 0;
+}
 
-	return wlast - wstart + 1;
+static void cleanup_shared_extents(struct shared_extents *se)
+{
+	free(se->extents);
+	se->extents = NULL;
+	se->nr = 0;
+	se->alloc = 0;
 }
 
 /*
@@ -165,126 +163,145 @@ static u64 count_unique_bytes(struct rb_root *root, struct shared_extent *n)
  * count any byte more than once, so just adding them up doesn't
  * work.
  *
- * For each set of overlapping extents we find the lowest start and
- * highest end. From there we have the actual number of bytes which is
- * shared across all of the extents in our set. A sum of each sets
- * extent length is returned.
+ * The extents are sorted by the start and the overlapping ones merged, the
+ * sum of the lengths of the merged extents is returned.
  */
-static void count_shared_bytes(struct rb_root *root, u64 *ret_cnt)
+static u64 count_shared_bytes(struct shared_extents *se)
 {
 	u64 count = 0;
-	struct shared_extent *s = extent_tree_iter_first(root,
-							 0, -1ULL);
-
-	if (!s)
-		goto out;
 
-	while (s) {
-		/*
-		 * Find all extents which overlap 's', calculate the space
-		 * covered by them and remove those nodes from the tree.
-		 */
-		count += count_unique_bytes(root, s);
-
-		/*
-		 * Since count_unique_bytes will be emptying the tree,
-		 * we can grab the first node here
-		 */
-		s = extent_tree_iter_first(root, 0, -1ULL);
+	merge_shared_extents(se);
+	for (size_t i = 0; i < se->nr; i++) {
+		pr_verbose(LOG_DEBUG, "Shared extent (%llu, %llu)\n",
+			   se->extents[i].start, se->extents[i].end - 1);
+		count += se->extents[i].end - se->extents[i].start;
 	}
-
-	BUG_ON(!RB_EMPTY_ROOT(root));
-out:
-	*ret_cnt = count;
+	return count;
 }
 
-/* Track which inodes we've seen for the purposes of hardlink detection. */
-struct seen_inode {
-	struct rb_node	i_node;
-	u64		i_ino;
-	u64		i_subvol;
+/*
+ * Track which inodes we've seen for the purposes of hardlink detection.  The
+ * inode numbers of a subvolume are dense, so they're kept in bitmaps of
+ * SEEN_CHUNK_INODES consecutive inodes, found in an open addressing hash table
+ * by the subvolume and the index of the chunk.
+ */
+#define SEEN_CHUNK_INODES		(4096)
+
+struct seen_chunk {
+	u64 subvol;
+	u64 index;
+	unsigned long bits[BITS_TO_LONGS(SEEN_CHUNK_INODES)];
+};
+
+struct seen_inodes {
+	struct seen_chunk **chunks;
+	/* Number of slots, a power of two */
+	size_t size;
+	size_t nr;
 };
-static struct rb_root seen_inodes = RB_ROOT;
+static struct seen_inodes seen_inodes;
+static pthread_mutex_t seen_inodes_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int cmp_si(struct seen_inode *si, u64 ino, u64 subvol)
+static size_t seen_chunk_slot(const struct seen_inodes *seen, u64 subvol,
+			      u64 index)
 {
-	if (ino < si->i_ino)
-		return -1;
-	else if (ino > si->i_ino)
-		return 1;
-	if (subvol < si->i_subvol)
-		return -1;
-	else if (subvol > si->i_subvol)
-		return 1;
-	return 0;
+	u64 hash = (subvol * 0x9E3779B97F4A7C15ULL) ^ (index * 0xC2B2AE3D27D4EB4FULL);
+	size_t slot = (hash ^ (hash >> 29)) & (seen->size - 1);
+
+	while (seen->chunks[slot] && (seen->chunks[slot]->subvol != subvol ||
+				      seen->chunks[slot]->index != index))
+		slot = (slot + 1) & (seen->size - 1);
+	return slot;
 }
 
-static int mark_inode_seen(u64 ino, u64 subvol)
+static int grow_seen_inodes(struct seen_inodes *seen)
 {
-	int cmp;
-	struct rb_node **p = &seen_inodes.rb_node;
-	struct rb_node *parent = NULL;
-	struct seen_inode *si;
-
-	while (*p) {
-		parent = *p;
-
-		si = rb_entry(parent, struct seen_inode, i_node);
-		cmp = cmp_si(si, ino, subvol);
-		if (cmp < 0)
-			p = &(*p)->rb_left;
-		else if (cmp > 0)
-			p = &(*p)->rb_right;
-		else
-			return -EEXIST;
-	}
+	struct seen_inodes new = { .size = max_t(size_t, seen->size * 2, 1024) };
 
-	si = calloc(1, sizeof(*si));
-	if (!si)
+	new.chunks = calloc(new.size, sizeof(*new.chunks));
+	if (!new.chunks)
 		return -ENOMEM;
+	for (size_t i = 0; i < seen->size; i++) {
+		struct seen_chunk *chunk = seen->chunks[i];
 
-	si->i_ino = ino;
-	si->i_subvol = subvol;
-
-	rb_link_node(&si->i_node, parent, p);
-	rb_insert_color(&si->i_node, &seen_inodes);
-
+		if (chunk)
+			new.chunks[seen_chunk_slot(&new, chunk->subvol,
+						   chunk->index)] = chunk;
+	}
+	new.nr = seen->nr;
+	free(seen->chunks);
+	*seen = new;
 	return 0;
 }
 
-static int inode_seen(u64 ino, u64 subvol)
+static int __mark_inode_seen(u64 ino, u64 subvol)
 {
-	int cmp;
-	struct rb_node *n = seen_inodes.rb_node;
-	struct seen_inode *si;
-
-	while (n) {
-		si = rb_entry(n, struct seen_inode, i_node);
-
-		cmp = cmp_si(si, ino, subvol);
-		if (cmp < 0)
-			n = n->rb_left;
-		else if (cmp > 0)
-			n = n->rb_right;
-		else
-			return -EEXIST;
+	struct seen_chunk *chunk;
+	u64 index = ino / SEEN_CHUNK_INODES;
+	size_t slot;
+
+	if ((seen_inodes.nr + 1) * 2 > seen_inodes.size &&
+	    grow_seen_inodes(&seen_inodes) < 0)
+		return -ENOMEM;
+
+	slot = seen_chunk_slot(&seen_inodes, subvol, index);
+	chunk = seen_inodes.chunks[slot];
+	if (!chunk) {
+		chunk = calloc(1, sizeof(*chunk));
+		if (!chunk)
+			return -ENOMEM;
+		chunk->subvol = subvol;
+		chunk->index = index;
+		seen_inodes.chunks[slot] = chunk;
+		seen_inodes.nr++;
 	}
+
+	if (test_and_set_bit(ino % SEEN_CHUNK_INODES, chunk->bits))
+		return -EEXIST;
 	return 0;
 }
 
+/* Return -EEXIST if the inode has been seen already */
+static int mark_inode_seen(u64 ino, u64 subvol)
+{
+	int ret;
+
+	pthread_mutex_lock(&seen_inodes_lock);
+	ret = __mark_inode_seen(ino, subvol);
+	pthread_mutex_unlock(&seen_inodes_lock);
+	return ret;
+}
+
 static void clear_seen_inodes(void)
 {
-	struct rb_node *n = rb_first(&seen_inodes);
-	struct seen_inode *si;
+	for (size_t i = 0; i < seen_inodes.size; i++)
+		free(seen_inodes.chunks[i]);
+	free(seen_inodes.chunks);
+	seen_inodes.chunks = NULL;
+	seen_inodes.size = 0;
+	seen_inodes.nr = 0;
+}
 
-	while (n) {
-		si = rb_entry(n, struct seen_inode, i_node);
+/*
+ * Fiemap buffer of a thread, starts small as most files have a few extents
+ * and grows each time a file needs more than one call.
+ */
+struct du_fiemap {
+	struct fiemap *fiemap;
+	size_t size;
+};
 
-		rb_erase(&si->i_node, &seen_inodes);
-		free(si);
+static int grow_du_fiemap(struct du_fiemap *fm)
+{
+	size_t size = fm->size ? fm->size * 2 : DU_FIEMAP_MIN_SIZE;
+	struct fiemap *tmp;
 
-		n = rb_first(&seen_inodes);
-	}
+	tmp = realloc(fm->fiemap, size);
+	if (!tmp)
+		return -ENOMEM;
+	fm->fiemap = tmp;
+	fm->size = size;
+	return 0;
 }
 
 /*
@@ -293,27 +310,35 @@ static void clear_seen_inodes(void)
  * space they will use yet.
  */
 #define	SKIP_FLAGS	(FIEMAP_EXTENT_UNKNOWN|FIEMAP_EXTENT_DELALLOC|FIEMAP_EXTENT_DATA_INLINE)
-static int du_calc_file_space(int fd, struct rb_root *shared_extents,
+static int du_calc_file_space(int fd, struct du_fiemap *fm,
+			      struct shared_extents *shared_extents,
 			      u64 *ret_total, u64 *ret_shared)
 {
-	char buf[16384];
-	struct fiemap *fiemap = (struct fiemap *)buf;
-	struct fiemap_extent *fm_ext = &fiemap->fm_extents[0];
-	int count = (sizeof(buf) - sizeof(*fiemap)) /
-			sizeof(struct fiemap_extent);
+	struct fiemap *fiemap;
+	struct fiemap_extent *fm_ext;
 	unsigned int i, ret;
 	bool last = false;
 	int rc;
 	u64 ext_len;
 	u64 file_total = 0;
 	u64 file_shared = 0;
+	u64 start = 0;
 	u32 flags;
 
-	memset(fiemap, 0, sizeof(struct fiemap));
+	if (!fm->fiemap) {
+		ret = grow_du_fiemap(fm);
+		if (ret)
+			goto out;
+	}
 
 	do {
+		fiemap = fm->fiemap;
+		fm_ext = &fiemap->fm_extents[0];
+		memset(fiemap, 0, sizeof(struct fiemap));
+		fiemap->fm_start = start;
 		fiemap->fm_length = ~0ULL;
-		fiemap->fm_extent_count = count;
+		fiemap->fm_extent_count = (fm->size - sizeof(*fiemap)) /
+					  sizeof(struct fiemap_extent);
 		rc = ioctl(fd, FS_IOC_FIEMAP, (unsigned long) fiemap);
 		if (rc < 0) {
 			ret = -errno;
@@ -354,8 +379,13 @@ static int du_calc_file_space(int fd, struct rb_root *shared_extents,
 			}
 		}
 
-		fiemap->fm_start = (fm_ext[i - 1].fe_logical +
-				    fm_ext[i - 1].fe_length);
+		start = (fm_ext[i - 1].fe_logical + fm_ext[i - 1].fe_length);
+		/* The file did not fit, use a bigger buffer from now on */
+		if (!last && fm->size < DU_FIEMAP_MAX_SIZE) {
+			ret = grow_du_fiemap(fm);
+			if (ret)
+				goto out;
+		}
 	} while (!last);
 
 	*ret_total = file_total;
@@ -366,186 +396,371 @@ out:
 	return ret;
 }
 
-struct du_dir_ctxt {
-	u64		bytes_total;
-	u64		bytes_shared;
-	DIR		*dirstream;
-	struct rb_root	shared_extents;
+/*
+ * The directories of an argument are walked by several threads, each thread
+ * takes a directory from the stack, reads it, calculates the space of the
+ * files and pushes the subdirectories.  A directory is finished when it and
+ * all its subdirectories are read, then its totals are added to the parent.
+ *
+ * Without --summarize the lines of a directory are kept in the order of
+ * readdir, with a placeholder for each subdirectory, and printed as soon as
+ * all lines before them are printed, so the output is the same as with a
+ * recursive walk.
+ */
+struct du_line {
+	struct du_line *next;
+	/* Line of a file or of the directory itself */
+	char *line;
+	/* Or the subdirectory whose lines are printed here */
+	struct du_dir *dir;
+};
+
+struct du_dir {
+	struct du_dir *parent;
+	/* Next directory in the stack of the walk */
+	struct du_dir *next;
+	char *path;
+	/* From the parent directory, to detect crossing to a subvolume */
+	dev_t dev;
+	u64 ino;
+	u64 subvol;
+	u64 bytes_total;
+	u64 bytes_shared;
+	/* Subdirectories not finished yet, plus one until read */
+	unsigned int pending;
+	bool finished;
+	/* Not accessible or seen already, nothing is accounted */
+	bool skip;
+	struct du_line *lines;
+	struct du_line **lines_tail;
+};
+
+struct du_walk {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct du_dir *stack;
+	/* Directories being read */
+	unsigned int active;
+	/* The first error, stops the walk */
+	int ret;
+	/* Directory whose lines are being printed */
+	struct du_dir *print_dir;
 };
-#define INIT_DU_DIR_CTXT	(struct du_dir_ctxt) { 0ULL, 0ULL, NULL, RB_ROOT }
 
-static int du_add_file(const char *filename, int dirfd,
-		       struct rb_root *shared_extents, u64 *ret_total,
-		       u64 *ret_shared, int top_level);
+struct du_worker {
+	pthread_t thread;
+	struct du_walk *walk;
+	struct du_fiemap fiemap;
+	struct shared_extents shared_extents;
+};
 
-static int du_walk_dir(struct du_dir_ctxt *ctxt, struct rb_root *shared_extents)
+static char *du_format_line(u64 total, u64 shared, const char *set_shared,
+			    const char *path)
 {
-	int ret, type;
-	struct dirent *entry;
-	DIR *dirstream = ctxt->dirstream;
+	char *line;
+
+	if (asprintf(&line, "%10s  %10s  %10s  %s\n",
+		     pretty_size_mode(total, unit_mode),
+		     pretty_size_mode(total - shared, unit_mode),
+		     set_shared, path) < 0)
+		return NULL;
+	return line;
+}
 
-	ret = 0;
-	do {
-		u64 tot, shr;
+static struct du_dir *alloc_du_dir(struct du_dir *parent, const char *name,
+				   dev_t dev, u64 ino)
+{
+	struct du_dir *dir;
+
+	dir = calloc(1, sizeof(*dir));
+	if (!dir)
+		return NULL;
+	if (!parent)
+		dir->path = strdup(name);
+	else if (asprintf(&dir->path, "%s%s%s", parent->path,
+			  parent->path[strlen(parent->path) - 1] == '/' ? "" : "/",
+			  name) < 0)
+		dir->path = NULL;
+	if (!dir->path) {
+		free(dir);
+		return NULL;
+	}
+	dir->parent = parent;
+	dir->dev = dev;
+	dir->ino = ino;
+	dir->pending = 1;
+	dir->lines_tail = &dir->lines;
+	return dir;
+}
 
-		errno = 0;
-		entry = readdir(dirstream);
-		if (entry) {
-			if (strcmp(entry->d_name, ".") == 0
-			    || strcmp(entry->d_name, "..") == 0)
-				continue;
+static void free_du_dir(struct du_dir *dir)
+{
+	free(dir->path);
+	free(dir);
+}
 
-			type = entry->d_type;
-			if (type == DT_REG || type == DT_DIR) {
-				tot = shr = 0;
-
-				ret = du_add_file(entry->d_name,
-						  dirfd(dirstream),
-						  shared_extents, &tot, &shr,
-						  0);
-				if (ret) {
-					errno = -ret;
-					warning("cannot access '%s': %m\n", entry->d_name);
-					if (ret == -ENOTTY || ret == -EACCES) {
-						ret = 0;
-						continue;
-					}
-					break;
-				}
+/* Print the lines that are ready, called with the walk lock held */
+static void du_print_lines(struct du_walk *walk)
+{
+	struct du_dir *dir = walk->print_dir;
 
-				ctxt->bytes_total += tot;
-				ctxt->bytes_shared += shr;
-			}
+	while (dir) {
+		struct du_line *line = dir->lines;
+
+		if (!line) {
+			struct du_dir *parent = dir->parent;
+
+			if (!dir->finished)
+				break;
+			/* The top directory is printed by the caller */
+			if (parent)
+				free_du_dir(dir);
+			dir = parent;
+			continue;
+		}
+
+		dir->lines = line->next;
+		if (!dir->lines)
+			dir->lines_tail = &dir->lines;
+		if (line->dir) {
+			dir = line->dir;
+		} else {
+			if (!walk->ret)
+				pr_verbose(LOG_DEFAULT, "%s", line->line);
+			free(line->line);
 		}
-	} while (entry != NULL);
+		free(line);
+	}
+	walk->print_dir = dir;
+}
 
+/*
+ * The directory and all subdirectories have been read, add the totals to the
+ * parents up to the first that's not finished yet.  Called with the walk lock
+ * held.
+ */
+static int du_finish_dir(struct du_walk *walk, struct du_dir *dir)
+{
+	int ret = 0;
+
+	while (dir) {
+		struct du_dir *parent = dir->parent;
+
+		if (parent && !dir->skip) {
+			if (!summarize) {
+				struct du_line *line = calloc(1, sizeof(*line));
+
+				if (line)
+					line->line = du_format_line(dir->bytes_total,
+								    dir->bytes_shared,
+								    "-", dir->path);
+				if (!line || !line->line) {
+					free(line);
+					ret = -ENOMEM;
+				} else {
+					*dir->lines_tail = line;
+					dir->lines_tail = &line->next;
+				}
+			}
+			parent->bytes_total += dir->bytes_total;
+			parent->bytes_shared += dir->bytes_shared;
+		}
+		dir->finished = true;
+		if (!parent)
+			break;
+		/* Without lines the directory is not referenced anymore */
+		if (summarize)
+			free_du_dir(dir);
+		if (--parent->pending)
+			break;
+		dir = parent;
+	}
 	return ret;
 }
 
-static int du_add_file(const char *filename, int dirfd,
-		       struct rb_root *shared_extents, u64 *ret_total,
-		       u64 *ret_shared, int top_level)
+/*
+ * Account one entry of @dir, a file is calculated right away and a
+ * subdirectory is pushed to the stack.  Lines of the files and the
+ * placeholders of the subdirectories are added to @lines_tail.
+ */
+static int du_add_entry(struct du_worker *w, struct du_dir *dir, int dirfd,
+			const char *name, struct du_line ***lines_tail,
+			u64 *ret_total, u64 *ret_shared)
 {
-	int ret, len = strlen(filename);
-	char *pathtmp;
+	struct du_walk *walk = w->walk;
+	struct du_line *line = NULL;
 	struct stat st;
-	struct du_dir_ctxt dir = INIT_DU_DIR_CTXT;
-	int is_dir = 0;
+	u64 subvol = dir->subvol;
 	u64 file_total = 0;
 	u64 file_shared = 0;
-	u64 dir_set_shared = 0;
 	int fd;
-	DIR *dirstream = NULL;
+	int ret;
 
-	ret = fstatat(dirfd, filename, &st, 0);
+	ret = fstatat(dirfd, name, &st, 0);
 	if (ret)
 		return -errno;
 
 	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
 		return 0;
 
-	if (len > (path_max - pathp)) {
-		error("path too long: %s %s", path, filename);
+	if (strlen(dir->path) + 1 + strlen(name) > PATH_MAX - 1) {
+		error("path too long: %s %s", dir->path, name);
 		return -ENAMETOOLONG;
 	}
 
-	pathtmp = pathp;
-	if (pathp == path || *(pathp - 1) == '/')
-		ret = sprintf(pathp, "%s", filename);
-	else
-		ret = sprintf(pathp, "/%s", filename);
-	pathp += ret;
+	if (!summarize) {
+		line = calloc(1, sizeof(*line));
+		if (!line)
+			return -ENOMEM;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		struct du_dir *subdir;
+
+		subdir = alloc_du_dir(dir, name, st.st_dev, st.st_ino);
+		if (!subdir) {
+			free(line);
+			return -ENOMEM;
+		}
+		if (line) {
+			line->dir = subdir;
+			**lines_tail = line;
+			*lines_tail = &line->next;
+		}
+		pthread_mutex_lock(&walk->lock);
+		dir->pending++;
+		subdir->next = walk->stack;
+		walk->stack = subdir;
+		pthread_cond_signal(&walk->cond);
+		pthread_mutex_unlock(&walk->lock);
+		return 0;
+	}
 
-	fd = btrfs_open_path(path, false, false);
+	fd = openat(dirfd, name, O_RDONLY);
 	if (fd < 0) {
-		ret = fd;
+		ret = -errno;
 		goto out;
 	}
 
 	/*
-	 * If st.st_ino == BTRFS_EMPTY_SUBVOL_DIR_OBJECTID ==2, there is no any
-	 * related tree
+	 * Only the files with more links can be found again, the subvolume
+	 * is the one of the directory unless the file is on another device.
 	 */
-	if (st.st_ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
-		u64 subvol;
-
+	if (st.st_dev != dir->dev) {
 		ret = lookup_path_rootid(fd, &subvol);
 		if (ret)
 			goto out_close;
-
-		if (inode_seen(st.st_ino, subvol))
-			goto out_close;
-
+	}
+	if (st.st_nlink > 1) {
 		ret = mark_inode_seen(st.st_ino, subvol);
-		if (ret)
+		if (ret) {
+			if (ret == -EEXIST)
+				ret = 0;
 			goto out_close;
+		}
 	}
 
-	if (S_ISREG(st.st_mode)) {
-		ret = du_calc_file_space(fd, shared_extents, &file_total,
-					 &file_shared);
-		if (ret)
-			goto out_close;
-	} else if (S_ISDIR(st.st_mode)) {
-		struct rb_root *root = shared_extents;
+	ret = du_calc_file_space(fd, &w->fiemap, &w->shared_extents,
+				 &file_total, &file_shared);
+	if (ret)
+		goto out_close;
 
-		dirstream = fdopendir(fd);
-		if (!dirstream) {
-			ret = -errno;
+	if (line) {
+		char path[PATH_MAX];
+
+		snprintf(path, sizeof(path), "%s%s%s", dir->path,
+			 dir->path[strlen(dir->path) - 1] == '/' ? "" : "/", name);
+		line->line = du_format_line(file_total, file_shared, "-", path);
+		if (!line->line) {
+			ret = -ENOMEM;
 			goto out_close;
 		}
+		**lines_tail = line;
+		*lines_tail = &line->next;
+		line = NULL;
+	}
+	*ret_total += file_total;
+	*ret_shared += file_shared;
 
-		/*
-		 * We collect shared extents in an rb_root, the top
-		 * level caller will not pass a root down, so use the
-		 * one on our dir context.
-		 */
-		if (top_level)
-			root = &dir.shared_extents;
+out_close:
+	close(fd);
+out:
+	free(line);
+	return ret;
+}
 
-		is_dir = 1;
+static int du_walk_dir(struct du_worker *w, struct du_dir *dir)
+{
+	struct du_walk *walk = w->walk;
+	struct du_line *lines = NULL;
+	struct du_line **lines_tail = &lines;
+	struct dirent *entry;
+	DIR *dirstream = NULL;
+	u64 total = 0;
+	u64 shared = 0;
+	int fd;
+	int ret;
 
-		dir.dirstream = dirstream;
-		ret = du_walk_dir(&dir, root);
-		*pathp = '\0';
-		if (ret) {
-			if (top_level)
-				cleanup_shared_extents(root);
-			goto out_close;
+	fd = btrfs_open_path(dir->path, false, false);
+	if (fd < 0) {
+		ret = fd;
+		goto out;
+	}
+
+	/*
+	 * If st.st_ino == BTRFS_EMPTY_SUBVOL_DIR_OBJECTID ==2, there is no any
+	 * related tree
+	 */
+	if (dir->ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
+		if (dir->parent && dir->dev == dir->parent->dev) {
+			dir->subvol = dir->parent->subvol;
+		} else {
+			ret = lookup_path_rootid(fd, &dir->subvol);
+			if (ret)
+				goto out_close;
 		}
 
-		file_total = dir.bytes_total;
-		file_shared = dir.bytes_shared;
-		if (top_level)
-			count_shared_bytes(root, &dir_set_shared);
+		ret = mark_inode_seen(dir->ino, dir->subvol);
+		if (ret == -EEXIST) {
+			dir->skip = true;
+			ret = 0;
+		}
+		if (ret || dir->skip)
+			goto out_close;
 	}
 
-	if (!summarize || top_level) {
-		u64 excl = file_total - file_shared;
+	dirstream = fdopendir(fd);
+	if (!dirstream) {
+		ret = -errno;
+		goto out_close;
+	}
 
-		if (top_level) {
-			u64 set_shared = file_shared;
+	ret = 0;
+	do {
+		errno = 0;
+		entry = readdir(dirstream);
+		if (entry) {
+			if (strcmp(entry->d_name, ".") == 0
+			    || strcmp(entry->d_name, "..") == 0)
+				continue;
 
-			if (is_dir)
-				set_shared = dir_set_shared;
+			if (entry->d_type != DT_REG && entry->d_type != DT_DIR)
+				continue;
 
-			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
-			       pretty_size_mode(file_total, unit_mode),
-			       pretty_size_mode(excl, unit_mode),
-			       pretty_size_mode(set_shared, unit_mode),
-			       path);
-		} else {
-			pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
-			       pretty_size_mode(file_total, unit_mode),
-			       pretty_size_mode(excl, unit_mode),
-			       "-", path);
+			ret = du_add_entry(w, dir, dirfd(dirstream),
+					   entry->d_name, &lines_tail,
+					   &total, &shared);
+			if (ret) {
+				errno = -ret;
+				warning("cannot access '%s': %m\n", entry->d_name);
+				if (ret == -ENOTTY || ret == -EACCES) {
+					ret = 0;
+					continue;
+				}
+				break;
+			}
 		}
-	}
-
-	if (ret_total)
-		*ret_total = file_total;
-	if (ret_shared)
-		*ret_shared = file_shared;
+	} while (entry != NULL && !READ_ONCE(walk->ret));
 
 out_close:
 	/*
@@ -556,11 +771,200 @@ out_close:
 		closedir(dirstream);
 	else
 		close(fd);
-
 out:
-	/* reset path to just before this element */
-	pathp = pathtmp;
+	pthread_mutex_lock(&walk->lock);
+	dir->bytes_total += total;
+	dir->bytes_shared += shared;
+	*dir->lines_tail = lines;
+	if (lines)
+		dir->lines_tail = lines_tail;
+	if (ret) {
+		/* The subdirectory is skipped like a file that can't be read */
+		if (dir->parent && (ret == -ENOTTY || ret == -EACCES)) {
+			errno = -ret;
+			warning("cannot access '%s': %m\n", dir->path);
+			ret = 0;
+		}
+		dir->skip = true;
+		if (ret && !walk->ret)
+			walk->ret = ret;
+	}
+	if (--dir->pending == 0) {
+		ret = du_finish_dir(walk, dir);
+		if (ret && !walk->ret)
+			walk->ret = ret;
+	}
+	if (!summarize)
+		du_print_lines(walk);
+	pthread_mutex_unlock(&walk->lock);
+
+	return ret;
+}
+
+static void *du_worker_fn(void *arg)
+{
+	struct du_worker *w = arg;
+	struct du_walk *walk = w->walk;
+
+	pthread_mutex_lock(&walk->lock);
+	while (1) {
+		struct du_dir *dir;
+
+		while (!walk->stack && walk->active)
+			pthread_cond_wait(&walk->cond, &walk->lock);
+		dir = walk->stack;
+		if (!dir)
+			break;
+		walk->stack = dir->next;
+		walk->active++;
+		pthread_mutex_unlock(&walk->lock);
+
+		/* After an error the remaining directories are only finished */
+		if (READ_ONCE(walk->ret)) {
+			pthread_mutex_lock(&walk->lock);
+			dir->skip = true;
+			if (--dir->pending == 0)
+				du_finish_dir(walk, dir);
+			if (!summarize)
+				du_print_lines(walk);
+			pthread_mutex_unlock(&walk->lock);
+		} else {
+			du_walk_dir(w, dir);
+		}
+
+		pthread_mutex_lock(&walk->lock);
+		walk->active--;
+	}
+	/* Nothing to do and nobody to push more, wake up the others */
+	pthread_cond_broadcast(&walk->cond);
+	pthread_mutex_unlock(&walk->lock);
+	return NULL;
+}
+
+/*
+ * Walk the directory @top by @nr_threads threads including the current one,
+ * return the totals and the set shared bytes in @top.
+ */
+static int du_walk(struct du_dir *top, unsigned int nr_threads,
+		   u64 *ret_set_shared)
+{
+	struct du_walk walk = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.stack = top,
+		.print_dir = top,
+	};
+	struct du_worker *workers;
+	unsigned int started;
+	int ret;
+
+	workers = calloc(max(nr_threads, 1U), sizeof(*workers));
+	if (!workers)
+		return -ENOMEM;
+	for (unsigned int i = 0; i < max(nr_threads, 1U); i++)
+		workers[i].walk = &walk;
+
+	for (started = 1; started < nr_threads; started++) {
+		if (pthread_create(&workers[started].thread, NULL, du_worker_fn,
+				   &workers[started]))
+			break;
+	}
+	du_worker_fn(&workers[0]);
+	for (unsigned int i = 1; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	ret = walk.ret;
+	for (unsigned int i = 1; i < started && !ret; i++)
+		ret = splice_shared_extents(&workers[0].shared_extents,
+					    &workers[i].shared_extents);
+	if (!ret)
+		*ret_set_shared = count_shared_bytes(&workers[0].shared_extents);
+
+	for (unsigned int i = 0; i < started; i++) {
+		cleanup_shared_extents(&workers[i].shared_extents);
+		free(workers[i].fiemap.fiemap);
+	}
+	free(workers);
+	return ret;
+}
+
+static int du_add_file(const char *filename, unsigned int nr_threads)
+{
+	struct du_fiemap fm = { 0 };
+	struct du_dir *top;
+	struct stat st;
+	u64 file_total = 0;
+	u64 file_shared = 0;
+	u64 set_shared = 0;
+	int fd;
+	int ret;
+
+	ret = fstatat(AT_FDCWD, filename, &st, 0);
+	if (ret)
+		return -errno;
+
+	if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+		return 0;
+
+	if (strlen(filename) > PATH_MAX - 1) {
+		error("path too long: %s", filename);
+		return -ENAMETOOLONG;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		top = alloc_du_dir(NULL, filename, st.st_dev, st.st_ino);
+		if (!top)
+			return -ENOMEM;
+		ret = du_walk(top, nr_threads, &set_shared);
+		file_total = top->bytes_total;
+		file_shared = top->bytes_shared;
+		if (!ret && top->skip)
+			ret = -EEXIST;
+		free_du_dir(top);
+		if (ret == -EEXIST)
+			return 0;
+		if (ret)
+			return ret;
+		goto print;
+	}
+
+	fd = btrfs_open_path(filename, false, false);
+	if (fd < 0)
+		return fd;
+
+	if (st.st_ino != BTRFS_EMPTY_SUBVOL_DIR_OBJECTID) {
+		u64 subvol;
+
+		ret = lookup_path_rootid(fd, &subvol);
+		if (ret)
+			goto out_close;
+
+		ret = mark_inode_seen(st.st_ino, subvol);
+		if (ret) {
+			if (ret == -EEXIST)
+				ret = 0;
+			goto out_close;
+		}
+	}
+
+	ret = du_calc_file_space(fd, &fm, NULL, &file_total, &file_shared);
+	if (ret)
+		goto out_close;
+	set_shared = file_shared;
+	close(fd);
+	free(fm.fiemap);
+
+print:
+	pr_verbose(LOG_DEFAULT, "%10s  %10s  %10s  %s\n",
+		   pretty_size_mode(file_total, unit_mode),
+		   pretty_size_mode(file_total - file_shared, unit_mode),
+		   pretty_size_mode(set_shared, unit_mode),
+		   filename);
+	return 0;
 
+out_close:
+	close(fd);
+	free(fm.fiemap);
 	return ret;
 }
 
@@ -569,6 +973,7 @@ static const char * const cmd_filesystem_du_usage[] = {
 	"Summarize disk usage of each file.",
 	"",
 	OPTLINE("-s|--summarize", "display only a total for each argument"),
+	OPTLINE("--threads <num>", "number of threads walking the directories, default: number of CPUs"),
 	HELPINFO_UNITS_LONG,
 	NULL
 };
@@ -579,13 +984,16 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 	int ret = 0, err = 0;
 	int i;
 	u32 kernel_version;
+	unsigned int nr_threads = 0;
 
 	unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
 
 	optind = 0;
 	while (1) {
+		enum { GETOPT_VAL_THREADS = GETOPT_VAL_FIRST };
 		static const struct option long_options[] = {
 			{ "summarize", no_argument, NULL, 's'},
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "s", long_options, NULL);
@@ -596,6 +1004,17 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 		case 's':
 			summarize = true;
 			break;
+		case GETOPT_VAL_THREADS: {
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp == 0 || tmp > DU_MAX_THREADS) {
+				error("number of threads out of range: %llu, allowed 1..%u",
+				      tmp, DU_MAX_THREADS);
+				return 1;
+			}
+			nr_threads = tmp;
+			break;
+		}
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -604,6 +1023,14 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (nr_threads == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		if (nr_cpus < 1)
+			nr_cpus = 1;
+		nr_threads = min_t(long, nr_cpus, DU_MAX_THREADS);
+	}
+
 	kernel_version = get_running_kernel_version();
 
 	if (kernel_version < KERNEL_VERSION(2,6,33)) {
@@ -616,7 +1043,7 @@ static int cmd_filesystem_du(const struct cmd_struct *cmd,
 			"Filename");
 
 	for (i = optind; i < argc; i++) {
-		ret = du_add_file(argv[i], AT_FDCWD, NULL, NULL, NULL, 1);
+		ret = du_add_file(argv[i], nr_threads);
 		if (ret) {
 			errno = -ret;
 			error("cannot check space of '%s': %m", argv[i]);
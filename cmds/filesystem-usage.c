@@ -44,14 +44,53 @@
 #include "common/sysfs-utils.h"
 #include "common/messages.h"
 #include "common/path-utils.h"
-#include "common/tree-search.h"
+#include "common/rbtree-utils.h"
+#include "common/format-output.h"
 #include "cmds/filesystem-usage.h"
 #include "cmds/commands.h"
 
+/* Buffer of one search of the chunk tree, about 7000 chunks of 2 stripes */
+#define CHUNK_SEARCH_BUF_SIZE		(SZ_1M)
+
+struct chunk_info_key {
+	u64 type;
+	u64 devid;
+	u64 num_stripes;
+};
+
+static int cmp_chunk_info_key(const struct rb_node *node, const void *data)
+{
+	const struct chunk_info *cinfo = rb_entry(node, struct chunk_info, node);
+	const struct chunk_info_key *key = data;
+
+	if (key->type != cinfo->type)
+		return key->type < cinfo->type ? -1 : 1;
+	if (key->devid != cinfo->devid)
+		return key->devid < cinfo->devid ? -1 : 1;
+	if (key->num_stripes != cinfo->num_stripes)
+		return key->num_stripes < cinfo->num_stripes ? -1 : 1;
+	return 0;
+}
+
+static int cmp_chunk_info_nodes(const struct rb_node *node1,
+				const struct rb_node *node2)
+{
+	const struct chunk_info *cinfo = rb_entry(node2, struct chunk_info, node);
+	const struct chunk_info_key key = {
+		.type = cinfo->type,
+		.devid = cinfo->devid,
+		.num_stripes = cinfo->num_stripes,
+	};
+
+	return cmp_chunk_info_key(node1, &key);
+}
+
 /*
- * Add the chunk info to the chunk_info list
+ * Add the chunk info to the chunk_info list, the groups are looked up in
+ * @lookup so a filesystem with many chunks and devices is not quadratic
  */
-static int add_info_to_list(struct array *chunkinfos, struct btrfs_chunk *chunk)
+static int add_info_to_list(struct array *chunkinfos, struct rb_root *lookup,
+			    struct btrfs_chunk *chunk)
 {
 
 	u64 type = btrfs_stack_chunk_type(chunk);
@@ -60,24 +99,19 @@ static int add_info_to_list(struct array *chunkinfos, struct btrfs_chunk *chunk)
 	int j;
 
 	for (j = 0 ; j < num_stripes ; j++) {
-		int i;
 		struct chunk_info *p = NULL;
 		struct btrfs_stripe *stripe;
-		u64    devid;
+		struct rb_node *node;
+		struct chunk_info_key key;
 
 		stripe = btrfs_stripe_nr(chunk, j);
-		devid = btrfs_stack_stripe_devid(stripe);
+		key.type = type;
+		key.devid = btrfs_stack_stripe_devid(stripe);
+		key.num_stripes = num_stripes;
 
-		for (i = 0; i < chunkinfos->length; i++) {
-			struct chunk_info *cinfo = chunkinfos->data[i];
-
-			if (cinfo->type == type &&
-			    cinfo->devid == devid &&
-			    cinfo->num_stripes == num_stripes ) {
-				p = cinfo;
-				break;
-			}
-		}
+		node = rb_search(lookup, &key, cmp_chunk_info_key, NULL);
+		if (node)
+			p = rb_entry(node, struct chunk_info, node);
 
 		if (!p) {
 			int ret;
@@ -87,16 +121,18 @@ static int add_info_to_list(struct array *chunkinfos, struct btrfs_chunk *chunk)
 				error_msg(ERROR_MSG_MEMORY, NULL);
 				return -ENOMEM;
 			}
-			p->devid = devid;
+			p->devid = key.devid;
 			p->type = type;
 			p->size = 0;
 			p->num_stripes = num_stripes;
 
 			ret = array_append(chunkinfos, p);
 			if (ret < 0) {
+				free(p);
 				error_msg(ERROR_MSG_MEMORY, NULL);
 				return -ENOMEM;
 			}
+			rb_insert(lookup, &p->node, cmp_chunk_info_nodes);
 		}
 
 		p->size += size;
@@ -142,41 +178,79 @@ static int cmp_chunk_info(const void *a, const void *b)
 	return cmp_chunk_block_group((*pa)->type, (*pb)->type);
 }
 
+/*
+ * Search the chunk tree with a buffer large enough for thousands of chunks,
+ * falling back to the v1 ioctl and its 4KiB buffer on kernels without v2.
+ */
+static int chunk_search_ioctl(int fd, struct btrfs_ioctl_search_args_v2 *args2,
+			      bool *use_v1)
+{
+	struct btrfs_ioctl_search_args args1;
+	int ret;
+
+	if (!*use_v1) {
+		args2->key.nr_items = (u32)-1;
+		args2->buf_size = CHUNK_SEARCH_BUF_SIZE;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args2);
+		if (ret == 0 || errno != ENOTTY)
+			return ret;
+		*use_v1 = true;
+	}
+
+	memcpy(&args1.key, &args2->key, sizeof(args1.key));
+	args1.key.nr_items = 4096;
+	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args1);
+	if (ret < 0)
+		return ret;
+	memcpy(&args2->key, &args1.key, sizeof(args2->key));
+	memcpy(args2->buf, args1.buf, sizeof(args1.buf));
+	return 0;
+}
+
 static int load_chunk_info(int fd, struct array *chunkinfos)
 {
 	int ret;
-	struct btrfs_tree_search_args args;
+	struct btrfs_ioctl_search_args_v2 *args;
 	struct btrfs_ioctl_search_key *sk;
+	struct rb_root lookup = RB_ROOT;
+	bool use_v1 = false;
+	char *buf;
 	unsigned long off = 0;
 	int i;
 
-	memset(&args, 0, sizeof(args));
-	sk = btrfs_tree_search_sk(&args);
+	args = calloc(1, sizeof(*args) + CHUNK_SEARCH_BUF_SIZE);
+	if (!args) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return 1;
+	}
+	sk = &args->key;
+	buf = (char *)args->buf;
 
 	/*
-	 * there may be more than one ROOT_ITEM key if there are
-	 * snapshots pending deletion, we have to loop through
-	 * them.
+	 * Only the chunk items, the device items at the beginning of the chunk
+	 * tree are not needed.
 	 */
 	sk->tree_id = BTRFS_CHUNK_TREE_OBJECTID;
 
-	sk->min_objectid = 0;
-	sk->min_type = (u8)-1;
+	sk->min_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+	sk->min_type = BTRFS_CHUNK_ITEM_KEY;
 	sk->min_offset = 0;
-	sk->max_objectid = (u64)-1;
-	sk->max_type = 0;
+	sk->max_objectid = BTRFS_FIRST_CHUNK_TREE_OBJECTID;
+	sk->max_type = BTRFS_CHUNK_ITEM_KEY;
 	sk->max_offset = (u64)-1;
 	sk->min_transid = 0;
 	sk->max_transid = (u64)-1;
-	sk->nr_items = 4096;
 
 	while (1) {
-		ret = btrfs_tree_search_ioctl(fd, &args);
+		ret = chunk_search_ioctl(fd, args, &use_v1);
 		if (ret < 0) {
-			if (errno == EPERM)
-				return -errno;
+			if (errno == EPERM) {
+				ret = -errno;
+				goto out;
+			}
 			error("cannot look up chunk tree info: %m");
-			return 1;
+			ret = 1;
+			goto out;
 		}
 		/* the ioctl returns the number of item it found in nr_items */
 
@@ -188,39 +262,32 @@ static int load_chunk_info(int fd, struct array *chunkinfos)
 			struct btrfs_chunk *item;
 			struct btrfs_ioctl_search_header sh;
 
-			memcpy(&sh, btrfs_tree_search_data(&args, off), sizeof(sh));
+			memcpy(&sh, buf + off, sizeof(sh));
 			off += sizeof(sh);
-			item = btrfs_tree_search_data(&args, off);
+			item = (struct btrfs_chunk *)(buf + off);
 
-			ret = add_info_to_list(chunkinfos, item);
-			if (ret)
-				return 1;
+			ret = add_info_to_list(chunkinfos, &lookup, item);
+			if (ret) {
+				ret = 1;
+				goto out;
+			}
 
 			off += sh.len;
 
-			sk->min_objectid = sh.objectid;
-			sk->min_type = sh.type;
 			sk->min_offset = sh.offset + 1;
-
 		}
-		if (!sk->min_offset)	/* overflow */
-			sk->min_type++;
-		else
-			continue;
-
-		if (!sk->min_type)
-			sk->min_objectid++;
-		 else
-			continue;
-
-		if (!sk->min_objectid)
+		/* Last chunk at the end of the address space */
+		if (!sk->min_offset)
 			break;
 	}
 
 	qsort(chunkinfos->data, chunkinfos->length, sizeof(struct chunk_info *),
 	      cmp_chunk_info);
+	ret = 0;
 
-	return 0;
+out:
+	free(args);
+	return ret;
 }
 
 /*
@@ -439,11 +506,13 @@ static u64 calc_slack_size(const struct device_info *devinfo)
 }
 
 #define	MIN_UNALOCATED_THRESH	SZ_16M
-static int print_filesystem_usage_overall(int fd, const struct array *chunkinfos,
-		const struct array *devinfos, const char *path, unsigned unit_mode)
+static int print_filesystem_usage_overall(int fd, struct format_ctx *fctx,
+		struct btrfs_ioctl_space_args *sargs,
+		const struct array *chunkinfos, const struct array *devinfos,
+		const char *path, unsigned unit_mode)
 {
-	struct btrfs_ioctl_space_args *sargs = NULL;
-	char *tmp;
+	const bool json = (bconf.output_format == CMD_FORMAT_JSON);
+	char *tmp = NULL;
 	int i;
 	int ret = 0;
 	int width = 10;		/* default 10 for human units */
@@ -481,12 +550,8 @@ static int print_filesystem_usage_overall(int fd, const struct array *chunkinfos
 	struct btrfs_ioctl_feature_flags feature_flags;
 	bool raid56 = false;
 	bool unreliable_allocated = false;
-
-	sargs = load_space_info(fd, path);
-	if (!sargs) {
-		ret = 1;
-		goto exit;
-	}
+	bool zoned;
+	u64 zone_size = 0;
 
 	r_total_size = 0;
 	for (i = 0; i < devinfos->length; i++) {
@@ -627,6 +692,37 @@ static int print_filesystem_usage_overall(int fd, const struct array *chunkinfos
 		goto exit;
 	}
 
+	zoned = (ioctl(fd, BTRFS_IOC_GET_FEATURES, &feature_flags) == 0 &&
+		 (feature_flags.incompat_flags & BTRFS_FEATURE_INCOMPAT_ZONED));
+	if (zoned)
+		zone_size = get_first_device_zone_size(fd);
+	tmp = btrfs_test_for_multiple_profiles(fd);
+
+	if (json) {
+		fmt_print_start_group(fctx, "overall", JSON_TYPE_MAP);
+		fmt_print(fctx, "device-size", r_total_size);
+		fmt_print(fctx, "device-allocated", r_total_chunks);
+		fmt_print(fctx, "device-unallocated", r_total_unused);
+		fmt_print(fctx, "device-missing", r_total_missing);
+		fmt_print(fctx, "device-slack", r_total_slack);
+		if (zoned) {
+			fmt_print(fctx, "device-zone-unusable", zone_unusable);
+			fmt_print(fctx, "device-zone-size", zone_size);
+		}
+		fmt_print(fctx, "used", r_total_used);
+		fmt_print(fctx, "free-estimated", free_estimated);
+		fmt_print(fctx, "free-estimated-min", free_min);
+		fmt_print(fctx, "free-statfs-df",
+			  (u64)(statvfs_buf.f_bavail * statvfs_buf.f_bsize));
+		fmt_print(fctx, "data-ratio", data_ratio);
+		fmt_print(fctx, "metadata-ratio", metadata_ratio);
+		fmt_print(fctx, "global-reserve", l_global_reserve);
+		fmt_print(fctx, "global-reserve-used", l_global_reserve_used);
+		fmt_print(fctx, "multiple-profiles", tmp);
+		fmt_print_end_group(fctx, "overall");
+		goto exit;
+	}
+
 	pr_verbose(LOG_DEFAULT, "Overall:\n");
 
 	pr_verbose(LOG_DEFAULT, "    Device size:\t\t%*s\n", width,
@@ -639,13 +735,9 @@ static int print_filesystem_usage_overall(int fd, const struct array *chunkinfos
 		pretty_size_mode(r_total_missing, unit_mode));
 	pr_verbose(LOG_DEFAULT, "    Device slack:\t\t%*s\n", width,
 		pretty_size_mode(r_total_slack, unit_mode));
-	ret = ioctl(fd, BTRFS_IOC_GET_FEATURES, &feature_flags);
-	if (ret == 0 && (feature_flags.incompat_flags & BTRFS_FEATURE_INCOMPAT_ZONED)) {
-		u64 zone_size;
-
+	if (zoned) {
 		pr_verbose(LOG_DEFAULT, "    Device zone unusable:\t%*s\n", width,
 			pretty_size_mode(zone_unusable, unit_mode));
-		zone_size = get_first_device_zone_size(fd);
 		pr_verbose(LOG_DEFAULT, "    Device zone size:\t\t%*s\n", width,
 			pretty_size_mode(zone_size, unit_mode));
 	}
@@ -664,17 +756,13 @@ static int print_filesystem_usage_overall(int fd, const struct array *chunkinfos
 	pr_verbose(LOG_DEFAULT, "    Global reserve:\t\t%*s\t(used: %s)\n", width,
 		pretty_size_mode(l_global_reserve, unit_mode),
 		pretty_size_mode(l_global_reserve_used, unit_mode));
-	tmp = btrfs_test_for_multiple_profiles(fd);
 	if (tmp[0])
 		pr_verbose(LOG_DEFAULT, "    Multiple profiles:\t\t%*s\t(%s)\n", width, "yes", tmp);
 	else
 		pr_verbose(LOG_DEFAULT, "    Multiple profiles:\t\t%*s\n", width, "no");
-	free(tmp);
 
 exit:
-
-	if (sargs)
-		free(sargs);
+	free(tmp);
 
 	return ret;
 }
@@ -883,13 +971,93 @@ static u64 calc_chunk_size(const struct chunk_info *ci)
 	return ci->size / div;
 }
 
+/*
+ * Allocated space of each space info on each device, summed in one pass over
+ * the chunk infos instead of a scan of all of them for each printed value
+ */
+struct usage_matrix {
+	int nr_spaces;
+	int nr_devs;
+	/* Indexed by [space * nr_devs + device] */
+	u64 *allocated;
+	/* Chunks of all types on each device */
+	u64 *dev_allocated;
+};
+
+static int cmp_device_info_devid(const void *a, const void *b)
+{
+	const u64 *devid = a;
+	const struct device_info * const *devinfo = b;
+
+	if (*devid < (*devinfo)->devid)
+		return -1;
+	if (*devid > (*devinfo)->devid)
+		return 1;
+	return 0;
+}
+
+static int load_usage_matrix(struct usage_matrix *um,
+			     const struct btrfs_ioctl_space_args *sargs,
+			     const struct array *chunkinfos,
+			     const struct array *devinfos)
+{
+	um->nr_spaces = sargs->total_spaces;
+	um->nr_devs = devinfos->length;
+	um->allocated = calloc((size_t)um->nr_spaces * um->nr_devs + 1,
+			       sizeof(u64));
+	um->dev_allocated = calloc(um->nr_devs + 1, sizeof(u64));
+	if (!um->allocated || !um->dev_allocated) {
+		free(um->allocated);
+		free(um->dev_allocated);
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+
+	for (int i = 0; i < chunkinfos->length; i++) {
+		const struct chunk_info *chunk = chunkinfos->data[i];
+		struct device_info **devinfo;
+		u64 size;
+		int dev;
+
+		/* The devices are sorted by devid */
+		devinfo = bsearch(&chunk->devid, devinfos->data, devinfos->length,
+				  sizeof(struct device_info *),
+				  cmp_device_info_devid);
+		if (!devinfo)
+			continue;
+		dev = devinfo - (struct device_info **)devinfos->data;
+		size = calc_chunk_size(chunk);
+		um->dev_allocated[dev] += size;
+
+		for (int k = 0; k < um->nr_spaces; k++) {
+			if (sargs->spaces[k].flags != chunk->type)
+				continue;
+			um->allocated[k * um->nr_devs + dev] += size;
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static void free_usage_matrix(struct usage_matrix *um)
+{
+	free(um->allocated);
+	free(um->dev_allocated);
+}
+
+static u64 usage_matrix_get(const struct usage_matrix *um, int space, int dev)
+{
+	return um->allocated[space * um->nr_devs + dev];
+}
+
 /*
  *  This function print the results of the command "btrfs fi usage"
  *  in tabular format
  */
 static void _cmd_filesystem_usage_tabular(unsigned unit_mode,
 					struct btrfs_ioctl_space_args *sargs,
-					const struct array *chunkinfos,
+					const struct usage_matrix *um,
 					const struct array *devinfos)
 {
 	int i;
@@ -973,22 +1141,12 @@ static void _cmd_filesystem_usage_tabular(unsigned unit_mode,
 
 		for (col = spaceinfos_col, k = 0; k < sargs->total_spaces; k++) {
 			u64	flags = sargs->spaces[k].flags;
-			u64 devid = devinfo->devid;
-			u64 size = 0;
+			u64 size;
 
 			if (flags & BTRFS_SPACE_INFO_GLOBAL_RSV)
 				continue;
 
-			for (int j = 0; j < chunkinfos->length; j++) {
-				const struct chunk_info *chunk = chunkinfos->data[j];
-
-				if (chunk->type != flags)
-					continue;
-				if (chunk->devid != devid)
-					continue;
-
-				size += calc_chunk_size(chunk);
-			}
+			size = usage_matrix_get(um, k, i);
 
 			if (size)
 				table_printf(matrix, col, vhdr_skip+ i,
@@ -1000,7 +1158,6 @@ static void _cmd_filesystem_usage_tabular(unsigned unit_mode,
 			col++;
 		}
 
-		unused = device_get_partition_size(devinfo->path) - total_allocated;
 		unused = devinfo->size - total_allocated;
 
 		table_printf(matrix, unallocated_col, vhdr_skip + i, ">%s",
@@ -1079,46 +1236,28 @@ static void _cmd_filesystem_usage_tabular(unsigned unit_mode,
 /*
  *  This function prints the unused space per every disk
  */
-static void print_unused(const struct array *chunkinfos, const struct array *devinfos,
+static void print_unused(const struct usage_matrix *um, const struct array *devinfos,
 			 unsigned unit_mode)
 {
 	for (int i = 0; i < devinfos->length; i++) {
-		u64	total = 0;
 		const struct device_info *devinfo = devinfos->data[i];
 
-		for (int j = 0; j < chunkinfos->length; j++) {
-			const struct chunk_info *chunk = chunkinfos->data[j];
-
-			if (chunk->devid == devinfo->devid)
-				total += calc_chunk_size(chunk);
-		}
-
 		pr_verbose(LOG_DEFAULT, "   %s\t%10s\n",
 			devinfo->path,
-			pretty_size_mode(devinfo->size - total, unit_mode));
+			pretty_size_mode(devinfo->size - um->dev_allocated[i],
+					 unit_mode));
 	}
 }
 
 /*
  *  This function prints the allocated chunk per every disk
  */
-static void print_chunk_device(u64 chunk_type, const struct array *chunkinfos,
+static void print_chunk_device(int space, const struct usage_matrix *um,
 			       const struct array *devinfos, unsigned unit_mode)
 {
 	for (int i = 0; i < devinfos->length; i++) {
 		const struct device_info *devinfo = devinfos->data[i];
-		u64	total = 0;
-
-		for (int j = 0; j < chunkinfos->length; j++) {
-			const struct chunk_info *chunk = chunkinfos->data[j];
-
-			if (chunk->type != chunk_type)
-				continue;
-			if (chunk->devid != devinfo->devid)
-				continue;
-
-			total += calc_chunk_size(chunk);
-		}
+		u64	total = usage_matrix_get(um, space, i);
 
 		if (total > 0)
 			pr_verbose(LOG_DEFAULT, "   %s\t%10s\n", devinfo->path,
@@ -1132,6 +1271,7 @@ static void print_chunk_device(u64 chunk_type, const struct array *chunkinfos,
  */
 static void _cmd_filesystem_usage_linear(unsigned unit_mode,
 					struct btrfs_ioctl_space_args *sargs,
+					const struct usage_matrix *um,
 					const struct array *chunkinfos,
 					const struct array *devinfos)
 {
@@ -1157,46 +1297,138 @@ static void _cmd_filesystem_usage_linear(unsigned unit_mode,
 			pretty_size_mode(sargs->spaces[i].used_bytes, unit_mode),
 			100.0f * sargs->spaces[i].used_bytes /
 			(sargs->spaces[i].total_bytes + 1));
-		print_chunk_device(flags, chunkinfos, devinfos, unit_mode);
+		print_chunk_device(i, um, devinfos, unit_mode);
 		pr_verbose(LOG_DEFAULT, "\n");
 	}
 
 	if (chunkinfos->length > 0) {
 		pr_verbose(LOG_DEFAULT, "Unallocated:\n");
-		print_unused(chunkinfos, devinfos, unit_mode | UNITS_NEGATIVE);
+		print_unused(um, devinfos, unit_mode | UNITS_NEGATIVE);
+	}
+}
+
+/*
+ * The same as the linear format with raw numbers, the per-device values are
+ * left out if the chunks could not be read
+ */
+static void _cmd_filesystem_usage_json(struct format_ctx *fctx,
+				       struct btrfs_ioctl_space_args *sargs,
+				       const struct usage_matrix *um,
+				       const struct array *chunkinfos,
+				       const struct array *devinfos)
+{
+	const bool have_chunks = (chunkinfos->length > 0);
+
+	fmt_print_start_group(fctx, "profiles", JSON_TYPE_ARRAY);
+	for (int i = 0; i < sargs->total_spaces; i++) {
+		u64 flags = sargs->spaces[i].flags;
+
+		if (flags & BTRFS_SPACE_INFO_GLOBAL_RSV)
+			continue;
+
+		fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(fctx, "bg-type", btrfs_group_type_str(flags));
+		fmt_print(fctx, "bg-profile", btrfs_group_profile_str(flags));
+		fmt_print(fctx, "size", sargs->spaces[i].total_bytes);
+		fmt_print(fctx, "used", sargs->spaces[i].used_bytes);
+		if (have_chunks) {
+			fmt_print_start_group(fctx, "devices", JSON_TYPE_ARRAY);
+			for (int k = 0; k < devinfos->length; k++) {
+				const struct device_info *devinfo = devinfos->data[k];
+				u64 allocated = usage_matrix_get(um, i, k);
+
+				if (!allocated)
+					continue;
+				fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+				fmt_print(fctx, "devid", devinfo->devid);
+				fmt_print(fctx, "path", devinfo->path);
+				fmt_print(fctx, "allocated", allocated);
+				fmt_print_end_group(fctx, NULL);
+			}
+			fmt_print_end_group(fctx, "devices");
+		}
+		fmt_print_end_group(fctx, NULL);
+	}
+	fmt_print_end_group(fctx, "profiles");
+
+	fmt_print_start_group(fctx, "devices", JSON_TYPE_ARRAY);
+	for (int i = 0; i < devinfos->length; i++) {
+		const struct device_info *devinfo = devinfos->data[i];
+
+		fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(fctx, "devid", devinfo->devid);
+		fmt_print(fctx, "path", devinfo->path);
+		fmt_print(fctx, "size", devinfo->size);
+		fmt_print(fctx, "device-size", devinfo->device_size);
+		fmt_print(fctx, "slack", calc_slack_size(devinfo));
+		if (have_chunks)
+			fmt_print(fctx, "unallocated",
+				  devinfo->size - um->dev_allocated[i]);
+		fmt_print_end_group(fctx, NULL);
 	}
+	fmt_print_end_group(fctx, "devices");
 }
 
-static int print_filesystem_usage_by_chunk(int fd,
+static int print_filesystem_usage_by_chunk(struct format_ctx *fctx,
+		struct btrfs_ioctl_space_args *sargs,
 		const struct array *chunkinfos,
 		const struct array *devinfos,
-		const char *path, unsigned unit_mode, int tabular)
+		unsigned unit_mode, int tabular)
 {
-	struct btrfs_ioctl_space_args *sargs;
-	int ret = 0;
+	struct usage_matrix um;
+	int ret;
 
-	sargs = load_space_info(fd, path);
-	if (!sargs) {
-		ret = 1;
-		goto out;
-	}
+	ret = load_usage_matrix(&um, sargs, chunkinfos, devinfos);
+	if (ret < 0)
+		return 1;
 
-	if (tabular)
-		_cmd_filesystem_usage_tabular(unit_mode, sargs, chunkinfos, devinfos);
+	if (bconf.output_format == CMD_FORMAT_JSON)
+		_cmd_filesystem_usage_json(fctx, sargs, &um, chunkinfos, devinfos);
+	else if (tabular)
+		_cmd_filesystem_usage_tabular(unit_mode, sargs, &um, devinfos);
 	else
-		_cmd_filesystem_usage_linear(unit_mode, sargs, chunkinfos, devinfos);
+		_cmd_filesystem_usage_linear(unit_mode, sargs, &um, chunkinfos, devinfos);
 
-	free(sargs);
-out:
-	return ret;
+	free_usage_matrix(&um);
+	return 0;
 }
 
+static const struct rowspec filesystem_usage_rowspec[] = {
+	{ .key = "path", .fmt = "str", .out_json = "path" },
+	{ .key = "device-size", .fmt = "%llu", .out_json = "device-size" },
+	{ .key = "device-allocated", .fmt = "%llu", .out_json = "device-allocated" },
+	{ .key = "device-unallocated", .fmt = "%llu", .out_json = "device-unallocated" },
+	{ .key = "device-missing", .fmt = "%llu", .out_json = "device-missing" },
+	{ .key = "device-slack", .fmt = "%llu", .out_json = "device-slack" },
+	{ .key = "device-zone-unusable", .fmt = "%llu", .out_json = "device-zone-unusable" },
+	{ .key = "device-zone-size", .fmt = "%llu", .out_json = "device-zone-size" },
+	{ .key = "used", .fmt = "%llu", .out_json = "used" },
+	{ .key = "free-estimated", .fmt = "%llu", .out_json = "free-estimated" },
+	{ .key = "free-estimated-min", .fmt = "%llu", .out_json = "free-estimated-min" },
+	{ .key = "free-statfs-df", .fmt = "%llu", .out_json = "free-statfs-df" },
+	{ .key = "data-ratio", .fmt = "%.2f", .out_json = "data-ratio" },
+	{ .key = "metadata-ratio", .fmt = "%.2f", .out_json = "metadata-ratio" },
+	{ .key = "global-reserve", .fmt = "%llu", .out_json = "global-reserve" },
+	{ .key = "global-reserve-used", .fmt = "%llu", .out_json = "global-reserve-used" },
+	{ .key = "multiple-profiles", .fmt = "str", .out_json = "multiple-profiles" },
+	{ .key = "bg-type", .fmt = "%s", .out_json = "bg-type" },
+	{ .key = "bg-profile", .fmt = "%s", .out_json = "bg-profile" },
+	{ .key = "size", .fmt = "%llu", .out_json = "size" },
+	{ .key = "devid", .fmt = "%llu", .out_json = "devid" },
+	{ .key = "allocated", .fmt = "%llu", .out_json = "allocated" },
+	{ .key = "slack", .fmt = "%llu", .out_json = "slack" },
+	{ .key = "unallocated", .fmt = "%llu", .out_json = "unallocated" },
+	ROWSPEC_END
+};
+
 static const char * const cmd_filesystem_usage_usage[] = {
 	"btrfs filesystem usage [options] <path> [<path>..]",
 	"Show detailed information about internal filesystem usage .",
 	"",
 	HELPINFO_UNITS_SHORT_LONG,
 	OPTLINE("-T", "show data in tabular format"),
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_FORMAT,
 	NULL
 };
 
@@ -1208,6 +1440,8 @@ static int cmd_filesystem_usage(const struct cmd_struct *cmd,
 	int i;
 	int more_than_one = 0;
 	int tabular = 0;
+	const bool json = (bconf.output_format == CMD_FORMAT_JSON);
+	struct format_ctx fctx;
 
 	unit_mode = get_unit_mode_from_arg(&argc, argv, 1);
 
@@ -1231,32 +1465,52 @@ static int cmd_filesystem_usage(const struct cmd_struct *cmd,
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (json) {
+		fmt_start(&fctx, filesystem_usage_rowspec, 1, 0);
+		fmt_print_start_group(&fctx, "filesystem-usage", JSON_TYPE_ARRAY);
+	}
+
 	for (i = optind; i < argc; i++) {
 		int fd;
 		struct array chunkinfos = { 0 };
 		struct array devinfos = { 0 };
+		struct btrfs_ioctl_space_args *sargs = NULL;
 
 		fd = btrfs_open_dir(argv[i]);
 		if (fd < 0) {
 			ret = 1;
 			goto out;
 		}
-		if (more_than_one)
+		if (more_than_one && !json)
 			pr_verbose(LOG_DEFAULT, "\n");
 
 		ret = load_chunk_and_device_info(fd, &chunkinfos, &devinfos);
 		if (ret)
 			goto cleanup;
 
-		ret = print_filesystem_usage_overall(fd, &chunkinfos,
+		sargs = load_space_info(fd, argv[i]);
+		if (!sargs) {
+			ret = 1;
+			goto cleanup;
+		}
+
+		if (json) {
+			fmt_print_start_group(&fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(&fctx, "path", argv[i]);
+		}
+		ret = print_filesystem_usage_overall(fd, &fctx, sargs, &chunkinfos,
 				&devinfos, argv[i], unit_mode);
 		if (ret)
 			goto cleanup;
-		pr_verbose(LOG_DEFAULT, "\n");
-		ret = print_filesystem_usage_by_chunk(fd, &chunkinfos,
-				&devinfos, argv[i], unit_mode, tabular);
+		if (!json)
+			pr_verbose(LOG_DEFAULT, "\n");
+		ret = print_filesystem_usage_by_chunk(&fctx, sargs, &chunkinfos,
+				&devinfos, unit_mode, tabular);
+		if (json)
+			fmt_print_end_group(&fctx, NULL);
 cleanup:
 		close(fd);
+		free(sargs);
 		array_free_elements(&chunkinfos);
 		array_free(&chunkinfos);
 		array_free_elements(&devinfos);
@@ -1267,10 +1521,15 @@ cleanup:
 		more_than_one = 1;
 	}
 
+	if (json) {
+		fmt_print_end_group(&fctx, "filesystem-usage");
+		fmt_end(&fctx);
+	}
+
 out:
 	return !!ret;
 }
-DEFINE_SIMPLE_COMMAND(filesystem_usage, "usage");
+DEFINE_COMMAND_WITH_FLAGS(filesystem_usage, "usage", CMD_FORMAT_JSON);
 
 void print_device_chunks(const struct device_info *devinfo,
 			 const struct array *chunkinfos, unsigned unit_mode)
@@ -20,6 +20,7 @@
 #define __CMDS_FI_USAGE_H__
 
 #include "kerncompat.h"
+#include "kernel-lib/rbtree_types.h"
 #include "kernel-shared/uapi/btrfs.h"
 #include "common/array.h"
 
@@ -43,6 +44,8 @@ struct chunk_info {
 	u64	size;
 	u64	devid;
 	u64	num_stripes;
+	/* Lookup by (type, devid, num_stripes) while loading the chunks */
+	struct rb_node node;
 };
 
 int load_chunk_and_device_info(int fd, struct array *chunkinfos, struct array *devinfos);
@@ -19,10 +19,12 @@
 #include <sys/stat.h>
 #include <linux/version.h>
 #include <linux/fs.h>
+#include <linux/fiemap.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <ftw.h>
@@ -380,6 +382,7 @@ static u64 calc_used_bytes(struct btrfs_ioctl_space_args *si)
 
 static int print_one_fs(struct btrfs_ioctl_fs_info_args *fs_info,
 		struct btrfs_ioctl_dev_info_args *dev_info,
+		const bool *missing,
 		struct btrfs_ioctl_space_args *space_info,
 		char *label, unsigned unit_mode)
 {
@@ -408,18 +411,28 @@ static int print_one_fs(struct btrfs_ioctl_fs_info_args *fs_info,
 
 	for (i = 0; i < fs_info->num_devices; i++) {
 		char *canonical_path;
+		bool is_missing;
 
 		tmp_dev_info = (struct btrfs_ioctl_dev_info_args *)&dev_info[i];
 
-		/* Add check for missing devices even mounted */
-		fd = open((char *)tmp_dev_info->path, O_RDONLY);
-		if (fd < 0) {
+		/*
+		 * Add check for missing devices even mounted, the state from
+		 * sysfs if available, otherwise try to open the device.
+		 */
+		if (missing) {
+			is_missing = missing[i] || !tmp_dev_info->path[0];
+		} else {
+			fd = open((char *)tmp_dev_info->path, O_RDONLY);
+			is_missing = (fd < 0);
+			if (fd >= 0)
+				close(fd);
+		}
+		if (is_missing) {
 			pr_verbose(LOG_DEFAULT, "\tdevid %4llu size 0 used 0 path %s MISSING\n",
 					tmp_dev_info->devid, tmp_dev_info->path);
 			continue;
 
 		}
-		close(fd);
 		canonical_path = path_canonicalize((char *)tmp_dev_info->path);
 		pr_verbose(LOG_DEFAULT, "\tdevid %4llu size %s used %s path %s\n",
 			tmp_dev_info->devid,
@@ -433,15 +446,175 @@ static int print_one_fs(struct btrfs_ioctl_fs_info_args *fs_info,
 	return 0;
 }
 
+static int cmp_u64(const void *a, const void *b)
+{
+	const u64 *ua = a;
+	const u64 *ub = b;
+
+	return *ua < *ub ? -1 : *ua > *ub ? 1 : 0;
+}
+
+/*
+ * Read a sysfs attribute of a device in /sys/fs/btrfs/FSID/devinfo/DEVID, the
+ * value is stripped of the trailing newline. Return the length or -errno.
+ */
+static int read_devinfo_attr(int dirfd, u64 devid, const char *name,
+			     char *buf, size_t size)
+{
+	char path[64];
+	int fd;
+	int ret;
+
+	snprintf(path, sizeof(path), "%llu/%s", devid, name);
+	fd = openat(dirfd, path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = sysfs_read_file(fd, buf, size - 1);
+	close(fd);
+	if (ret > 0 && buf[ret - 1] == '\n')
+		buf[--ret] = 0;
+	return ret;
+}
+
+/*
+ * Read the devices of a mounted filesystem using the list of devices in
+ * /sys/fs/btrfs/FSID/devinfo, only the existing devices are queried by the
+ * DEV_INFO ioctl, the chunk tree is not searched for the seed devices and the
+ * device nodes are not opened to find the missing ones.
+ *
+ * The seed devices are listed since kernel 5.11, the per-device 'fsid'
+ * attribute was added at the same time.  Return -ENOENT if sysfs does not
+ * provide all the information, the caller should use get_fs_info() then.
+ */
+static int get_fs_info_sysfs(int fd, struct btrfs_ioctl_fs_info_args *fi_args,
+			     struct btrfs_ioctl_dev_info_args **di_ret,
+			     bool **missing_ret)
+{
+	char fsid_str[BTRFS_UUID_UNPARSED_SIZE];
+	char path[PATH_MAX];
+	struct btrfs_ioctl_dev_info_args *di_args = NULL;
+	bool *missing = NULL;
+	u64 *devids = NULL;
+	int nr_devids = 0;
+	int ndevs = 0;
+	struct dirent *de;
+	DIR *dir;
+	int ret;
+
+	uuid_unparse(fi_args->fsid, fsid_str);
+	ret = path_cat3_out(path, "/sys/fs/btrfs", fsid_str, "devinfo");
+	if (ret < 0)
+		return ret;
+	dir = opendir(path);
+	if (!dir)
+		return -ENOENT;
+
+	while ((de = readdir(dir)) != NULL) {
+		char *end;
+		u64 devid;
+		u64 *tmp;
+
+		if (!isdigit(de->d_name[0]))
+			continue;
+		devid = strtoull(de->d_name, &end, 10);
+		if (*end)
+			continue;
+		tmp = realloc(devids, (nr_devids + 1) * sizeof(*devids));
+		if (!tmp) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		devids = tmp;
+		devids[nr_devids++] = devid;
+	}
+	if (!nr_devids) {
+		ret = -ENOENT;
+		goto out;
+	}
+	qsort(devids, nr_devids, sizeof(*devids), cmp_u64);
+
+	di_args = calloc(nr_devids, sizeof(*di_args));
+	missing = calloc(nr_devids, sizeof(*missing));
+	if (!di_args || !missing) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (int i = 0; i < nr_devids; i++) {
+		char buf[BTRFS_UUID_UNPARSED_SIZE + 1];
+
+		ret = read_devinfo_attr(dirfd(dir), devids[i], "fsid", buf,
+					sizeof(buf));
+		if (ret < 0) {
+			ret = -ENOENT;
+			goto out;
+		}
+		ret = device_get_info(fd, devids[i], &di_args[ndevs]);
+		/* Removed in the meantime */
+		if (ret == -ENODEV)
+			continue;
+		if (ret)
+			goto out;
+		ret = read_devinfo_attr(dirfd(dir), devids[i], "missing", buf,
+					sizeof(buf));
+		missing[ndevs] = (ret > 0 && buf[0] == '1');
+		ndevs++;
+	}
+	ret = 0;
+	fi_args->num_devices = ndevs;
+	*di_ret = di_args;
+	*missing_ret = missing;
+	di_args = NULL;
+	missing = NULL;
+out:
+	closedir(dir);
+	free(devids);
+	free(di_args);
+	free(missing);
+	return ret;
+}
+
+/* Read the label from /sys/fs/btrfs/FSID/label, return 0 or -errno */
+static int get_label_sysfs(const u8 *fsid, char *label)
+{
+	char fsid_str[BTRFS_UUID_UNPARSED_SIZE];
+	char path[PATH_MAX];
+	char buf[BTRFS_LABEL_SIZE + 1];
+	int fd;
+	int ret;
+
+	uuid_unparse(fsid, fsid_str);
+	ret = path_cat3_out(path, "/sys/fs/btrfs", fsid_str, "label");
+	if (ret < 0)
+		return ret;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -errno;
+	ret = sysfs_read_file(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (ret < 0)
+		return ret;
+	if (ret > 0 && buf[ret - 1] == '\n')
+		buf[--ret] = 0;
+	strncpy_null(label, buf, BTRFS_LABEL_SIZE);
+	return 0;
+}
+
+/*
+ * Print the mounted filesystems, each filesystem is opened once and its
+ * devices and label are read from sysfs where possible.  The output is
+ * flushed after each filesystem so it's shown before the next one is read.
+ */
 static int btrfs_scan_kernel(void *search, unsigned unit_mode)
 {
-	int ret = 0, fd;
+	int ret = 0, fd = -1;
 	int found = 0;
 	FILE *f;
 	struct mntent *mnt;
 	struct btrfs_ioctl_fs_info_args fs_info_arg;
 	struct btrfs_ioctl_dev_info_args *dev_info_arg = NULL;
 	struct btrfs_ioctl_space_args *space_info_arg = NULL;
+	bool *missing = NULL;
 	char label[BTRFS_LABEL_SIZE];
 
 	f = setmntent("/proc/self/mounts", "r");
@@ -452,18 +625,41 @@ static int btrfs_scan_kernel(void *search, unsigned unit_mode)
 	while ((mnt = getmntent(f)) != NULL) {
 		free(dev_info_arg);
 		dev_info_arg = NULL;
+		free(missing);
+		missing = NULL;
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
 		if (strcmp(mnt->mnt_type, "btrfs"))
 			continue;
-		ret = get_fs_info(mnt->mnt_dir, &fs_info_arg,
-				&dev_info_arg);
-		if (ret)
+
+		fd = btrfs_open_file_or_dir(mnt->mnt_dir);
+		if (fd < 0) {
+			ret = fd;
 			goto out;
+		}
+		memset(&fs_info_arg, 0, sizeof(fs_info_arg));
+		ret = ioctl(fd, BTRFS_IOC_FS_INFO, &fs_info_arg);
+		if (ret < 0) {
+			ret = -errno;
+			goto out;
+		}
 
 		/* skip all fs already shown as mounted fs */
 		if (is_seen_fsid(fs_info_arg.fsid, seen_fsid_hash))
 			continue;
 
-		ret = get_label_mounted(mnt->mnt_dir, label);
+		ret = get_fs_info_sysfs(fd, &fs_info_arg, &dev_info_arg,
+					&missing);
+		if (ret == -ENOENT)
+			ret = get_fs_info(mnt->mnt_dir, &fs_info_arg,
+					  &dev_info_arg);
+		if (ret)
+			goto out;
+
+		ret = get_label_sysfs(fs_info_arg.fsid, label);
+		if (ret < 0)
+			ret = get_label_mounted(mnt->mnt_dir, label);
 		/* provide backward kernel compatibility */
 		if (ret == -ENOTTY)
 			ret = get_label_unmounted(
@@ -477,24 +673,25 @@ static int btrfs_scan_kernel(void *search, unsigned unit_mode)
 			continue;
 		}
 
-		fd = open(mnt->mnt_dir, O_RDONLY);
-		if ((fd != -1) && !get_df(fd, &space_info_arg)) {
+		if (!get_df(fd, &space_info_arg)) {
 			/* Put space between filesystem entries for readability. */
 			if (found != 0)
 				pr_verbose(LOG_DEFAULT, "\n");
 
-			print_one_fs(&fs_info_arg, dev_info_arg,
+			print_one_fs(&fs_info_arg, dev_info_arg, missing,
 				     space_info_arg, label, unit_mode);
+			fflush(stdout);
 			free(space_info_arg);
 			memset(label, 0, sizeof(label));
 			found = 1;
 		}
-		if (fd != -1)
-			close(fd);
 	}
 
 out:
+	if (fd >= 0)
+		close(fd);
 	free(dev_info_arg);
+	free(missing);
 	endmntent(f);
 	return !found;
 }
@@ -690,7 +887,7 @@ static int map_seed_devices(struct list_head *all_uuids)
 		 * open_ctree_* detects seed/sprout mapping
 		 */
 		oca.filename = device->name;
-		oca.flags = OPEN_CTREE_PARTIAL;
+		oca.flags = OPEN_CTREE_PARTIAL | OPEN_CTREE_LAZY_BLOCK_GROUPS;
 		fs_info = open_ctree_fs_info(&oca);
 		if (!fs_info)
 			continue;
@@ -860,7 +1057,8 @@ static int cmd_filesystem_show(const struct cmd_struct *cmd,
 
 devs_only:
 	if (type == BTRFS_ARG_REG) {
-		root = open_ctree(search, btrfs_sb_offset(0), 0);
+		root = open_ctree(search, btrfs_sb_offset(0),
+				  OPEN_CTREE_LAZY_BLOCK_GROUPS);
 		if (root)
 			ret = 0;
 		else
@@ -897,6 +1095,7 @@ devs_only:
 			pr_verbose(LOG_DEFAULT, "\n");
 
 		print_one_uuid(fs_devices, unit_mode);
+		fflush(stdout);
 		needs_newline = true;
 	}
 
@@ -968,6 +1167,9 @@ static const char * const cmd_filesystem_defrag_usage[] = {
 	OPTLINE("-l len", "defragment only up to len bytes"),
 	OPTLINE("-t size", "target extent size hint (default: 32M)"),
 	OPTLINE("--step SIZE", "process the range in given steps, flush after each one"),
+	OPTLINE("--min-fragments <num>", "measure the files first, skip files with fewer fragments and start with the most fragmented"),
+	OPTLINE("--io-budget <size>", "measure the files first and stop after defragmenting data of the given size, most fragmented first"),
+	OPTLINE("--threads <num>", "number of files defragmented at the same time (default: 1)"),
 	OPTLINE("-v", "deprecated, alias for global -v option"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
@@ -1055,6 +1257,263 @@ error:
 	return 0;
 }
 
+/*
+ * Ranked and parallel defragmentation, used with --min-fragments, --io-budget
+ * or --threads.  All files are collected first, measured by fiemap, the files
+ * with too few fragments are skipped and the rest is ordered worst first, then
+ * defragmented by the threads.
+ */
+#define DEFRAG_MAX_THREADS		(64)
+
+struct defrag_file {
+	char *path;
+	u64 size;
+	/* Bytes of the data extents in the range */
+	u64 bytes;
+	/* Extents in the range smaller than the target size, except the last */
+	u64 fragments;
+};
+
+static struct defrag_file *defrag_files;
+static size_t defrag_nr_files;
+static size_t defrag_alloc_files;
+static bool defrag_measure;
+static u64 defrag_min_fragments;
+static u64 defrag_io_budget = (u64)-1;
+static u64 defrag_io_used;
+static size_t defrag_next_file;
+static bool defrag_stop;
+static bool defrag_budget_hit;
+
+static int defrag_add_file(const char *fpath, const struct stat *st)
+{
+	struct defrag_file *df;
+
+	if (defrag_nr_files == defrag_alloc_files) {
+		size_t alloc = max_t(size_t, 1024, defrag_alloc_files * 2);
+
+		df = realloc(defrag_files, alloc * sizeof(*df));
+		if (!df)
+			return -ENOMEM;
+		defrag_files = df;
+		defrag_alloc_files = alloc;
+	}
+	df = &defrag_files[defrag_nr_files];
+	memset(df, 0, sizeof(*df));
+	df->path = strdup(fpath);
+	if (!df->path)
+		return -ENOMEM;
+	df->size = st->st_size;
+	defrag_nr_files++;
+	return 0;
+}
+
+static int defrag_collect_callback(const char *fpath, const struct stat *sb,
+				   int typeflag, struct FTW *ftwbuf)
+{
+	if ((typeflag == FTW_F) && S_ISREG(sb->st_mode)) {
+		if (defrag_add_file(fpath, sb) < 0) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+static void free_defrag_files(void)
+{
+	for (size_t i = 0; i < defrag_nr_files; i++)
+		free(defrag_files[i].path);
+	free(defrag_files);
+	defrag_files = NULL;
+	defrag_nr_files = 0;
+	defrag_alloc_files = 0;
+}
+
+/*
+ * Count the data extents in the defrag range of the file that are smaller
+ * than the target extent size, not counting the last one, as the kernel
+ * would try to merge them.
+ */
+static int defrag_measure_file(int fd, struct defrag_file *df)
+{
+	char buf[16384];
+	struct fiemap *fiemap = (struct fiemap *)buf;
+	struct fiemap_extent *fm_ext = &fiemap->fm_extents[0];
+	const u32 skip_flags = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC |
+			       FIEMAP_EXTENT_DATA_INLINE;
+	u64 thresh = defrag_global_range.extent_thresh ?: SZ_256K;
+	u64 end;
+	bool last = false;
+
+	if (check_add_overflow(defrag_global_range.start, defrag_global_range.len, &end))
+		end = (u64)-1;
+
+	memset(fiemap, 0, sizeof(*fiemap));
+	fiemap->fm_start = defrag_global_range.start;
+	do {
+		unsigned int i;
+
+		fiemap->fm_length = end - fiemap->fm_start;
+		fiemap->fm_extent_count = (sizeof(buf) - sizeof(*fiemap)) /
+					  sizeof(struct fiemap_extent);
+		if (ioctl(fd, FS_IOC_FIEMAP, fiemap) < 0)
+			return -errno;
+		if (fiemap->fm_mapped_extents == 0)
+			break;
+
+		for (i = 0; i < fiemap->fm_mapped_extents; i++) {
+			if (fm_ext[i].fe_flags & FIEMAP_EXTENT_LAST)
+				last = true;
+			if (fm_ext[i].fe_flags & skip_flags)
+				continue;
+			df->bytes += fm_ext[i].fe_length;
+			if (fm_ext[i].fe_length < thresh &&
+			    !(fm_ext[i].fe_flags & FIEMAP_EXTENT_LAST))
+				df->fragments++;
+		}
+		fiemap->fm_start = fm_ext[i - 1].fe_logical + fm_ext[i - 1].fe_length;
+	} while (!last && fiemap->fm_start < end);
+
+	return 0;
+}
+
+static int cmp_defrag_file(const void *a, const void *b)
+{
+	const struct defrag_file *fa = a;
+	const struct defrag_file *fb = b;
+
+	if (fa->fragments != fb->fragments)
+		return (fa->fragments > fb->fragments ? -1 : 1);
+	if (fa->bytes != fb->bytes)
+		return (fa->bytes > fb->bytes ? -1 : 1);
+	return 0;
+}
+
+static void defrag_one_file(struct defrag_file *df)
+{
+	struct stat st = { .st_size = df->size };
+	int defrag_err;
+	int fd;
+	int ret;
+
+	if (defrag_measure) {
+		u64 used = __atomic_fetch_add(&defrag_io_used, df->bytes,
+					      __ATOMIC_RELAXED);
+
+		if (used >= defrag_io_budget) {
+			pr_verbose(LOG_VERBOSE, "%s: skipped, budget exhausted\n",
+				   df->path);
+			__atomic_store_n(&defrag_budget_hit, true, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+
+	pr_verbose(LOG_INFO, "%s\n", df->path);
+	fd = open(df->path, defrag_open_mode);
+	if (fd < 0) {
+		error("defrag failed on %s: %m", df->path);
+		__atomic_add_fetch(&defrag_global_errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	ret = defrag_range_in_steps(fd, &st);
+	defrag_err = errno;
+	close(fd);
+	if (ret && defrag_err == ENOTTY) {
+		if (!__atomic_exchange_n(&defrag_stop, true, __ATOMIC_RELAXED))
+			error(
+"defrag range ioctl not supported in this kernel version, 2.6.33 and newer is required");
+		__atomic_add_fetch(&defrag_global_errors, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	if (ret) {
+		errno = defrag_err;
+		error("defrag failed on %s: %m", df->path);
+		__atomic_add_fetch(&defrag_global_errors, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void defrag_measure_one_file(struct defrag_file *df)
+{
+	int fd;
+	int ret;
+
+	fd = open(df->path, O_RDONLY);
+	if (fd < 0) {
+		ret = -errno;
+	} else {
+		ret = defrag_measure_file(fd, df);
+		close(fd);
+	}
+	/* Leave it to the defrag to report the errors */
+	if (ret < 0) {
+		errno = -ret;
+		pr_verbose(LOG_VERBOSE, "cannot measure %s: %m\n", df->path);
+		df->fragments = (u64)-1;
+		return;
+	}
+	pr_verbose(LOG_VERBOSE, "%s: %llu fragments in %llu bytes\n", df->path,
+		   df->fragments, df->bytes);
+}
+
+static void *defrag_worker_fn(void *arg)
+{
+	void (*fn)(struct defrag_file *) = arg;
+
+	while (!__atomic_load_n(&defrag_stop, __ATOMIC_RELAXED)) {
+		size_t i = __atomic_fetch_add(&defrag_next_file, 1, __ATOMIC_RELAXED);
+
+		if (i >= defrag_nr_files)
+			break;
+		fn(&defrag_files[i]);
+	}
+	return NULL;
+}
+
+/* Call @fn for all collected files by @nr_threads threads */
+static void defrag_run_threads(void (*fn)(struct defrag_file *),
+			       unsigned int nr_threads)
+{
+	pthread_t threads[DEFRAG_MAX_THREADS];
+	unsigned int started;
+
+	defrag_next_file = 0;
+	for (started = 1; started < nr_threads; started++) {
+		if (pthread_create(&threads[started], NULL, defrag_worker_fn, fn))
+			break;
+	}
+	defrag_worker_fn(fn);
+	for (unsigned int i = 1; i < started; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static void defrag_collected_files(unsigned int nr_threads)
+{
+	if (defrag_measure) {
+		size_t skipped = 0;
+		size_t i, j;
+
+		defrag_run_threads(defrag_measure_one_file, nr_threads);
+		for (i = 0, j = 0; i < defrag_nr_files; i++) {
+			if (defrag_files[i].fragments < defrag_min_fragments) {
+				free(defrag_files[i].path);
+				skipped++;
+				continue;
+			}
+			defrag_files[j++] = defrag_files[i];
+		}
+		defrag_nr_files = j;
+		qsort(defrag_files, defrag_nr_files, sizeof(*defrag_files),
+		      cmp_defrag_file);
+		pr_verbose(LOG_INFO,
+			   "%zu files to defragment, %zu skipped with less than %llu fragments\n",
+			   defrag_nr_files, skipped, defrag_min_fragments);
+	}
+	defrag_run_threads(defrag_one_file, nr_threads);
+	if (defrag_budget_hit)
+		pr_verbose(LOG_INFO, "defragmentation stopped by the io budget\n");
+}
+
 static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 				 int argc, char **argv)
 {
@@ -1068,6 +1527,8 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 	int ret = 0;
 	int compress_type = BTRFS_COMPRESS_NONE;
 	int compress_level = 0;
+	unsigned int nr_threads = 1;
+	bool collect;
 
 	/*
 	 * Kernel 4.19+ supports defragmention of files open read-only,
@@ -1100,10 +1561,15 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 	defrag_global_errors = 0;
 	optind = 0;
 	while(1) {
-		enum { GETOPT_VAL_STEP = GETOPT_VAL_FIRST };
+		enum { GETOPT_VAL_STEP = GETOPT_VAL_FIRST,
+		       GETOPT_VAL_MIN_FRAGMENTS, GETOPT_VAL_IO_BUDGET,
+		       GETOPT_VAL_THREADS };
 		static const struct option long_options[] = {
 			{ "level", required_argument, NULL, 'L' },
 			{ "step", required_argument, NULL, GETOPT_VAL_STEP },
+			{ "min-fragments", required_argument, NULL, GETOPT_VAL_MIN_FRAGMENTS },
+			{ "io-budget", required_argument, NULL, GETOPT_VAL_IO_BUDGET },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c;
@@ -1165,6 +1631,25 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 				defrag_global_step = SZ_256K;
 			}
 			break;
+		case GETOPT_VAL_MIN_FRAGMENTS:
+			defrag_min_fragments = arg_strtou64(optarg);
+			defrag_measure = true;
+			break;
+		case GETOPT_VAL_IO_BUDGET:
+			defrag_io_budget = arg_strtou64_with_suffix(optarg);
+			defrag_measure = true;
+			break;
+		case GETOPT_VAL_THREADS: {
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp == 0 || tmp > DEFRAG_MAX_THREADS) {
+				error("number of threads out of range: %llu, allowed 1..%u",
+				      tmp, DEFRAG_MAX_THREADS);
+				return 1;
+			}
+			nr_threads = tmp;
+			break;
+		}
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -1172,6 +1657,7 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 
 	if (check_argc_min(argc - optind, 1))
 		return 1;
+	collect = defrag_measure || nr_threads > 1;
 
 	memset(&defrag_global_range, 0, sizeof(defrag_global_range));
 	defrag_global_range.start = start;
@@ -1240,13 +1726,31 @@ static int cmd_filesystem_defrag(const struct cmd_struct *cmd,
 			ret = -EINVAL;
 			goto next;
 		}
-		if (recursive && S_ISDIR(st.st_mode)) {
+		if (recursive && S_ISDIR(st.st_mode) && collect) {
+			ret = nftw(argv[i], defrag_collect_callback, 10,
+						FTW_MOUNT | FTW_PHYS);
+			if (ret == ENOMEM) {
+				close(fd);
+				defrag_global_errors++;
+				break;
+			}
+			/* errors are handled in the callback */
+			ret = 0;
+		} else if (recursive && S_ISDIR(st.st_mode)) {
 			ret = nftw(argv[i], defrag_callback, 10,
 						FTW_MOUNT | FTW_PHYS);
 			if (ret == ENOTTY)
 				exit(1);
 			/* errors are handled in the callback */
 			ret = 0;
+		} else if (S_ISREG(st.st_mode) && collect) {
+			ret = defrag_add_file(argv[i], &st);
+			if (ret < 0) {
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				close(fd);
+				defrag_global_errors++;
+				break;
+			}
 		} else {
 			pr_verbose(LOG_INFO, "%s\n", argv[i]);
 			ret = defrag_range_in_steps(fd, &st);
@@ -1270,6 +1774,12 @@ next:
 		close(fd);
 	}
 
+	if (collect) {
+		if (i == argc)
+			defrag_collected_files(nr_threads);
+		free_defrag_files();
+	}
+
 	if (defrag_global_errors)
 		pr_stderr(LOG_DEFAULT, "total %d failures\n", defrag_global_errors);
 
@@ -18,6 +18,8 @@
 
 #include "kerncompat.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdio_ext.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <errno.h>
@@ -38,6 +40,8 @@
 #include "common/messages.h"
 #include "common/help.h"
 #include "common/device-scan.h"
+#include "common/tree-prefetch.h"
+#include "common/utils.h"
 #include "common/string-utils.h"
 #include "cmds/commands.h"
 
@@ -234,6 +238,8 @@ static const char * const cmd_inspect_dump_tree_usage[] = {
 	OPTLINE("--hide-names", "hide filenames/subvolume/xattrs and other name references"),
 	OPTLINE("--csum-headers", "print node checksums stored in headers (metadata)"),
 	OPTLINE("--csum-items", "print checksums stored in checksum items (data)"),
+	OPTLINE("--jsonl", "print one json object per line for each node pointer and item, with the raw item data in hex"),
+	OPTLINE("--mmap", "map the image files instead of reading the tree blocks, the tool is killed by SIGBUS if an image is truncated or fails to read"),
 	NULL
 };
 
@@ -345,7 +351,10 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 	u64 tree_id = 0;
 	unsigned int follow = 0;
 	unsigned int csum_mode = 0;
+	unsigned int jsonl = 0;
 	unsigned int print_mode;
+	struct tree_prefetch *tp = NULL;
+	static char stdout_buf[SZ_1M];
 
 	/*
 	 * For debug-tree, we care nothing about extent tree (it's just backref
@@ -367,6 +376,7 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 			GETOPT_VAL_BFS,
 		       GETOPT_VAL_NOSCAN, GETOPT_VAL_HIDE_NAMES,
 		       GETOPT_VAL_CSUM_HEADERS, GETOPT_VAL_CSUM_ITEMS,
+		       GETOPT_VAL_JSONL, GETOPT_VAL_MMAP,
 		};
 		static const struct option long_options[] = {
 			{ "extents", no_argument, NULL, 'e'},
@@ -383,6 +393,8 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 			{ "hide-names", no_argument, NULL, GETOPT_VAL_HIDE_NAMES },
 			{ "csum-headers", no_argument, NULL, GETOPT_VAL_CSUM_HEADERS },
 			{ "csum-items", no_argument, NULL, GETOPT_VAL_CSUM_ITEMS },
+			{ "jsonl", no_argument, NULL, GETOPT_VAL_JSONL },
+			{ "mmap", no_argument, NULL, GETOPT_VAL_MMAP },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -459,6 +471,12 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 		case GETOPT_VAL_CSUM_ITEMS:
 			csum_mode |= BTRFS_PRINT_TREE_CSUM_ITEMS;
 			break;
+		case GETOPT_VAL_JSONL:
+			jsonl = BTRFS_PRINT_TREE_JSONL;
+			break;
+		case GETOPT_VAL_MMAP:
+			oca.flags |= OPEN_CTREE_MMAP;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -467,10 +485,27 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (jsonl && (extent_only || roots_only)) {
+		error("--jsonl cannot be used with --extents, --roots or --backups");
+		return 1;
+	}
+
 	ret = btrfs_scan_argv_devices(optind, argc, argv);
 	if (ret)
 		return ret;
 
+	/*
+	 * The dump is printed only by this thread, don't lock the stream for
+	 * each call and write it in big chunks unless it goes to a terminal.
+	 */
+	if (!isatty(STDOUT_FILENO)) {
+		setvbuf(stdout, stdout_buf, _IOFBF, sizeof(stdout_buf));
+		__fsetlocking(stdout, FSETLOCKING_BYCALLER);
+	}
+	/* Only the json lines go to the output */
+	if (jsonl)
+		bconf_be_quiet();
+
 	pr_verbose(LOG_DEFAULT, "%s\n", PACKAGE_STRING);
 
 	oca.filename = argv[optind];
@@ -480,7 +515,11 @@ static int cmd_inspect_dump_tree(const struct cmd_struct *cmd,
 		goto out;
 	}
 
-	print_mode = follow | traverse | csum_mode;
+	print_mode = follow | traverse | csum_mode | jsonl;
+
+	/* The children are read while the previous blocks are printed */
+	tp = tree_prefetch_alloc(info, 0);
+	btrfs_print_tree_set_prefetch(tp);
 
 	if (!cache_tree_empty(&block_root)) {
 		root = info->chunk_root;
@@ -712,7 +751,7 @@ again:
 				break;
 			case BTRFS_RAID_STRIPE_TREE_OBJECTID:
 				if (!skip)
-					printf("raid stripe");
+					pr_verbose(LOG_DEFAULT, "raid stripe");
 				break;
 			default:
 				if (!skip) {
@@ -726,7 +765,8 @@ again:
 				print_extents(buf);
 			} else if (!skip) {
 				pr_verbose(LOG_DEFAULT, " tree ");
-				btrfs_print_key(&disk_key);
+				if (!jsonl)
+					btrfs_print_key(&disk_key);
 				if (roots_only) {
 					pr_verbose(LOG_DEFAULT, " %llu level %d\n",
 					       buf->start, btrfs_header_level(buf));
@@ -763,8 +803,13 @@ no_node:
 	uuid_unparse(info->super_copy->fsid, uuidbuf);
 	pr_verbose(LOG_DEFAULT, "uuid %s\n", uuidbuf);
 close_root:
+	btrfs_print_tree_set_prefetch(NULL);
+	tree_prefetch_free(tp);
+	tp = NULL;
 	ret = close_ctree(root);
 out:
+	btrfs_print_tree_set_prefetch(NULL);
+	tree_prefetch_free(tp);
 	return !!ret;
 }
 DEFINE_SIMPLE_COMMAND(inspect_dump_tree, "dump-tree");
@@ -0,0 +1,155 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <getopt.h>
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "common/help.h"
+#include "common/messages.h"
+#include "common/open-utils.h"
+#include "common/string-utils.h"
+#include "common/units.h"
+#include "common/utils.h"
+#include "common/format-output.h"
+#include "check/qgroup-verify.h"
+#include "cmds/commands.h"
+
+static const struct rowspec space_report_rowspec[] = {
+	{ .key = "subvolid", .fmt = "%llu", .out_json = "subvolid" },
+	{ .key = "referenced", .fmt = "%llu", .out_json = "referenced" },
+	{ .key = "exclusive", .fmt = "%llu", .out_json = "exclusive" },
+	{ .key = "shared", .fmt = "%llu", .out_json = "shared" },
+	ROWSPEC_END
+};
+
+static const char * const cmd_inspect_space_report_usage[] = {
+	"btrfs inspect-internal space-report [options] <device>",
+	"Print the referenced, exclusive and shared bytes of each subvolume",
+	"The numbers are those of the level 0 qgroups, computed offline from one",
+	"pass over the extent tree, quotas don't need to be enabled.",
+	"",
+	OPTLINE("-b", "raw numbers in bytes"),
+	HELPINFO_UNITS_LONG,
+	OPTLINE("--workers <num>", "number of threads accounting the extents, "
+		"0 to account them in the main thread, default: 4"),
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_FORMAT,
+	NULL
+};
+
+static int cmd_inspect_space_report(const struct cmd_struct *cmd,
+				    int argc, char **argv)
+{
+	struct btrfs_root *root;
+	struct subvol_space *space = NULL;
+	struct format_ctx fctx;
+	unsigned int unit_mode;
+	unsigned int nr_space = 0;
+	int ret;
+
+	unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
+
+	optind = 0;
+	while (1) {
+		enum { GETOPT_VAL_WORKERS = GETOPT_VAL_FIRST };
+		static const struct option long_options[] = {
+			{ "workers", required_argument, NULL, GETOPT_VAL_WORKERS },
+			{ NULL, 0, NULL, 0 }
+		};
+		int opt = getopt_long(argc, argv, "b", long_options, NULL);
+		u64 num;
+
+		if (opt < 0)
+			break;
+		switch (opt) {
+		case 'b':
+			unit_mode = UNITS_RAW;
+			break;
+		case GETOPT_VAL_WORKERS:
+			num = arg_strtou64(optarg);
+			if (num > QGROUP_VERIFY_MAX_WORKERS) {
+				error("number of workers out of range: %llu > %d",
+				      num, QGROUP_VERIFY_MAX_WORKERS);
+				return 1;
+			}
+			qgroup_set_workers(num);
+			break;
+		default:
+			usage_unknown_option(cmd, argv);
+		}
+	}
+
+	if (check_argc_exact(argc - optind, 1))
+		return 1;
+
+	ret = check_mounted(argv[optind]);
+	if (ret < 0) {
+		errno = -ret;
+		warning("unable to check mount status of: %m");
+	} else if (ret) {
+		warning("%s already mounted, space-report accesses the block devices directly, this may\n"
+			"\tresult in inaccurate numbers, various errors or it may crash if the filesystem\n"
+			"\tchanges unexpectedly, restart if needed or remount read-only", argv[optind]);
+	}
+
+	root = open_ctree(argv[optind], 0, OPEN_CTREE_MMAP);
+	if (!root) {
+		error("cannot open ctree");
+		return 1;
+	}
+
+	ret = account_subvol_space(root->fs_info, &space, &nr_space);
+	if (ret)
+		goto out;
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_start(&fctx, space_report_rowspec, 24, 0);
+		fmt_print_start_group(&fctx, "space-report", JSON_TYPE_ARRAY);
+		for (unsigned int i = 0; i < nr_space; i++) {
+			fmt_print_start_group(&fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(&fctx, "subvolid", space[i].subvolid);
+			fmt_print(&fctx, "referenced", space[i].referenced);
+			fmt_print(&fctx, "exclusive", space[i].exclusive);
+			fmt_print(&fctx, "shared",
+				  space[i].referenced - space[i].exclusive);
+			fmt_print_end_group(&fctx, NULL);
+		}
+		fmt_print_end_group(&fctx, "space-report");
+		fmt_end(&fctx);
+		goto out;
+	}
+
+	pr_verbose(LOG_DEFAULT, "%-20s %12s %12s %12s\n", "Subvolid", "Referenced",
+		   "Exclusive", "Shared");
+	for (unsigned int i = 0; i < nr_space; i++) {
+		pr_verbose(LOG_DEFAULT, "%-20llu ", space[i].subvolid);
+		pr_verbose(LOG_DEFAULT, "%12s ",
+			   pretty_size_mode(space[i].referenced, unit_mode));
+		pr_verbose(LOG_DEFAULT, "%12s ",
+			   pretty_size_mode(space[i].exclusive, unit_mode));
+		pr_verbose(LOG_DEFAULT, "%12s\n",
+			   pretty_size_mode(space[i].referenced - space[i].exclusive,
+					    unit_mode));
+	}
+out:
+	free(space);
+	close_ctree(root);
+	return !!ret;
+}
+DEFINE_COMMAND_WITH_FLAGS(inspect_space_report, "space-report", CMD_FORMAT_JSON);
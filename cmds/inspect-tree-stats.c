@@ -17,12 +17,15 @@
  */
 
 #include "kerncompat.h"
-#include <sys/time.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
 #include "kernel-shared/accessors.h"
@@ -32,13 +35,44 @@
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/file-item.h"
 #include "kernel-shared/tree-checker.h"
+#include "kernel-shared/volumes.h"
+#include "crypto/hash.h"
 #include "common/help.h"
 #include "common/messages.h"
 #include "common/open-utils.h"
+#include "common/sort-utils.h"
 #include "common/string-utils.h"
 #include "common/units.h"
+#include "common/utils.h"
+#include "common/format-output.h"
+#include "common/work-queue.h"
 #include "cmds/commands.h"
 
+/*
+ * The trees are split into subtrees walked in parallel by the workers.  The
+ * top levels are read by the main thread until there are enough subtrees,
+ * these are sorted by physical address and queued in runs to the workers.
+ * Each worker walks its subtrees breadth first, reads every level in
+ * physical order with readahead of the next blocks, and merges the stats to
+ * the tree at the end.  The workers read the blocks into their own buffers
+ * and don't use the extent buffer cache, which is not thread safe.
+ *
+ * None of the stats depends on the order the blocks are visited.
+ *
+ * The layout-report command walks the subvolume trees the same way and also
+ * accounts their file extents, see walk_file_extents().
+ */
+
+/* Subtrees queued per worker, more than one to balance the load */
+#define TREE_STATS_JOBS_PER_WORKER	(8)
+/* Blocks read ahead of the current one by each worker */
+#define TREE_STATS_READAHEAD		(32)
+#define TREE_STATS_MAX_THREADS		(64)
+/* Buckets of the histogram of extents per file, by power of two */
+#define LAYOUT_FILE_BUCKETS		(32)
+/* Buckets of the block group fill, by 10% */
+#define LAYOUT_FILL_BUCKETS		(10)
+
 static int verbose = 0;
 
 struct seek {
@@ -47,6 +81,12 @@ struct seek {
 	struct rb_node n;
 };
 
+/* Number of extents of a file in a leaf */
+struct file_extents {
+	u64 ino;
+	u64 nr;
+};
+
 struct root_stats {
 	u64 total_nodes;
 	u64 total_bytes;
@@ -62,12 +102,103 @@ struct root_stats {
 	u64 max_cluster_size;
 	u64 lowest_bytenr;
 	u64 highest_bytenr;
+	/* Child pointers of all nodes, the seeks are counted between them */
+	u64 total_ptrs;
 	u64 node_counts[BTRFS_MAX_LEVEL];
+	/*
+	 * Pointers of the nodes or bytes used by the leaves, and the capacity
+	 * of the blocks read on each level, for the fill factor
+	 */
+	u64 level_used[BTRFS_MAX_LEVEL];
+	u64 level_capacity[BTRFS_MAX_LEVEL];
+	/* Time spent reading the tree, summed over the workers */
+	u64 read_ns;
 	struct rb_root seek_root;
-	int total_levels;
+
+	/* File extents, only accounted by layout-report */
+	u64 files;
+	u64 file_extents;
+	u64 inline_extents;
+	u64 prealloc_extents;
+	u64 extent_bytes;
+	u64 file_hist[LAYOUT_FILE_BUCKETS];
+	u64 data_seeks;
+	u64 data_seek_len;
+	u64 max_data_seek_len;
+	struct rb_root data_seek_root;
+	/*
+	 * The first and last file of a leaf may continue in the neighbouring
+	 * leaves, possibly read by another worker, and are counted at the end
+	 */
+	struct file_extents *edges;
+	u64 nr_edges;
+	u64 max_edges;
 };
 
-static int add_seek(struct rb_root *root, u64 dist)
+/* A tree to walk */
+struct tree_stats_tree {
+	u64 objectid;
+	u64 bytenr;
+	u64 generation;
+	int level;
+	int find_inline;
+	int find_data;
+	/* Protects @stat, the workers merge their results to it */
+	pthread_mutex_t lock;
+	struct root_stats stat;
+};
+
+struct tree_stats_block {
+	u64 bytenr;
+	u64 transid;
+	u64 devid;
+	u64 physical;
+	int fd;
+};
+
+/* Blocks of one level of a tree, the roots of the subtrees of a job */
+struct tree_stats_job {
+	struct tree_stats_tree *tree;
+	int level;
+	u32 nr;
+	struct tree_stats_block blocks[];
+};
+
+struct tree_stats_level {
+	struct tree_stats_block *blocks;
+	size_t nr;
+	size_t capacity;
+};
+
+struct tree_stats_walk {
+	struct btrfs_fs_info *fs_info;
+	struct root_stats *stat;
+	int find_inline;
+	int find_data;
+	/* Decoded items of the current leaf, reused across leaves */
+	struct btrfs_leaf_items items;
+};
+
+struct tree_stats_worker {
+	struct btrfs_fs_info *fs_info;
+	struct work_queue *queue;
+	pthread_t thread;
+	/* Private buffer for the blocks read */
+	struct extent_buffer *eb;
+	struct tree_stats_walk walk;
+	struct tree_stats_level cur;
+	struct tree_stats_level next;
+	int ret;
+};
+
+static u64 timespec_diff_ns(const struct timespec *start,
+			    const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000000000ULL +
+		end->tv_nsec - start->tv_nsec;
+}
+
+static int add_seek(struct rb_root *root, u64 dist, u64 count)
 {
 	struct rb_node **p = &root->rb_node;
 	struct rb_node *parent = NULL;
@@ -82,7 +213,7 @@ static int add_seek(struct rb_root *root, u64 dist)
 		} else if (dist > seek->distance) {
 			p = &(*p)->rb_right;
 		} else {
-			seek->count++;
+			seek->count += count;
 			return 0;
 		}
 	}
@@ -91,41 +222,150 @@ static int add_seek(struct rb_root *root, u64 dist)
 	if (!seek)
 		return -ENOMEM;
 	seek->distance = dist;
-	seek->count = 1;
+	seek->count = count;
 	rb_link_node(&seek->n, parent, p);
 	rb_insert_color(&seek->n, root);
 	return 0;
 }
 
-static int walk_leaf(struct btrfs_root *root, struct btrfs_path *path,
-		     struct root_stats *stat, int find_inline)
+static void init_root_stats(struct root_stats *stat, u32 nodesize)
 {
-	struct extent_buffer *b = path->nodes[0];
-	struct btrfs_file_extent_item *fi;
-	struct btrfs_key found_key;
-	int i;
+	memset(stat, 0, sizeof(*stat));
+	stat->lowest_bytenr = (u64)-1;
+	stat->min_cluster_size = (u64)-1;
+	stat->max_cluster_size = nodesize;
+	stat->seek_root = RB_ROOT;
+	stat->data_seek_root = RB_ROOT;
+}
 
-	stat->total_bytes += root->fs_info->nodesize;
-	stat->total_nodes++;
-	stat->node_counts[0]++;
+static void release_seeks(struct rb_root *root)
+{
+	struct rb_node *n;
 
-	if (!find_inline)
-		return 0;
+	while ((n = rb_first(root)) != NULL) {
+		struct seek *seek = rb_entry(n, struct seek, n);
 
-	for (i = 0; i < btrfs_header_nritems(b); i++) {
-		btrfs_item_key_to_cpu(b, &found_key, i);
-		if (found_key.type != BTRFS_EXTENT_DATA_KEY)
-			continue;
+		rb_erase(n, root);
+		free(seek);
+	}
+}
 
-		fi = btrfs_item_ptr(b, i, struct btrfs_file_extent_item);
-		if (btrfs_file_extent_type(b, fi) == BTRFS_FILE_EXTENT_INLINE)
-			stat->total_inline +=
-				btrfs_file_extent_inline_item_len(b, i);
+static void release_root_stats(struct root_stats *stat)
+{
+	release_seeks(&stat->seek_root);
+	release_seeks(&stat->data_seek_root);
+	free(stat->edges);
+	stat->edges = NULL;
+	stat->nr_edges = 0;
+	stat->max_edges = 0;
+}
+
+static int merge_seeks(struct rb_root *dst, struct rb_root *src)
+{
+	struct rb_node *n;
+	int ret = 0;
+
+	for (n = rb_first(src); n && !ret; n = rb_next(n)) {
+		struct seek *seek = rb_entry(n, struct seek, n);
+
+		ret = add_seek(dst, seek->distance, seek->count);
 	}
+	return ret;
+}
+
+static int add_file_edge(struct root_stats *stat, u64 ino, u64 nr)
+{
+	if (stat->nr_edges == stat->max_edges) {
+		u64 max_edges = max_t(u64, 64, stat->max_edges * 2);
+		struct file_extents *edges;
 
+		edges = realloc(stat->edges, max_edges * sizeof(*edges));
+		if (!edges)
+			return -ENOMEM;
+		stat->edges = edges;
+		stat->max_edges = max_edges;
+	}
+	stat->edges[stat->nr_edges].ino = ino;
+	stat->edges[stat->nr_edges].nr = nr;
+	stat->nr_edges++;
 	return 0;
 }
 
+static void add_file(struct root_stats *stat, u64 nr)
+{
+	stat->files++;
+	stat->file_hist[min(ilog2(nr), LAYOUT_FILE_BUCKETS - 1)]++;
+}
+
+/* Count the files split over several leaves, once all the leaves are read */
+static void merge_file_edges(struct root_stats *stat)
+{
+	u64 nr = 0;
+
+	radix_sort_u64(stat->edges, stat->nr_edges, sizeof(struct file_extents),
+		       offsetof(struct file_extents, ino));
+	for (u64 i = 0; i < stat->nr_edges; i++) {
+		nr += stat->edges[i].nr;
+		if (i + 1 == stat->nr_edges ||
+		    stat->edges[i + 1].ino != stat->edges[i].ino) {
+			add_file(stat, nr);
+			nr = 0;
+		}
+	}
+	free(stat->edges);
+	stat->edges = NULL;
+	stat->nr_edges = 0;
+	stat->max_edges = 0;
+}
+
+/* Add the stats of @src to @dst and release @src */
+static int merge_root_stats(struct root_stats *dst, struct root_stats *src)
+{
+	int ret;
+
+	dst->total_nodes += src->total_nodes;
+	dst->total_bytes += src->total_bytes;
+	dst->total_inline += src->total_inline;
+	dst->total_seeks += src->total_seeks;
+	dst->forward_seeks += src->forward_seeks;
+	dst->backward_seeks += src->backward_seeks;
+	dst->total_seek_len += src->total_seek_len;
+	dst->max_seek_len = max(dst->max_seek_len, src->max_seek_len);
+	dst->total_clusters += src->total_clusters;
+	dst->total_cluster_size += src->total_cluster_size;
+	dst->min_cluster_size = min(dst->min_cluster_size, src->min_cluster_size);
+	dst->max_cluster_size = max(dst->max_cluster_size, src->max_cluster_size);
+	dst->lowest_bytenr = min(dst->lowest_bytenr, src->lowest_bytenr);
+	dst->highest_bytenr = max(dst->highest_bytenr, src->highest_bytenr);
+	dst->total_ptrs += src->total_ptrs;
+	for (int i = 0; i < BTRFS_MAX_LEVEL; i++) {
+		dst->node_counts[i] += src->node_counts[i];
+		dst->level_used[i] += src->level_used[i];
+		dst->level_capacity[i] += src->level_capacity[i];
+	}
+	dst->read_ns += src->read_ns;
+	dst->files += src->files;
+	dst->file_extents += src->file_extents;
+	dst->inline_extents += src->inline_extents;
+	dst->prealloc_extents += src->prealloc_extents;
+	dst->extent_bytes += src->extent_bytes;
+	for (int i = 0; i < LAYOUT_FILE_BUCKETS; i++)
+		dst->file_hist[i] += src->file_hist[i];
+	dst->data_seeks += src->data_seeks;
+	dst->data_seek_len += src->data_seek_len;
+	dst->max_data_seek_len = max(dst->max_data_seek_len,
+				     src->max_data_seek_len);
+	ret = merge_seeks(&dst->seek_root, &src->seek_root);
+	if (!ret)
+		ret = merge_seeks(&dst->data_seek_root, &src->data_seek_root);
+	for (u64 i = 0; i < src->nr_edges && !ret; i++)
+		ret = add_file_edge(dst, src->edges[i].ino, src->edges[i].nr);
+	release_root_stats(src);
+	if (ret < 0)
+		error_msg(ERROR_MSG_MEMORY, "seek histogram");
+	return ret;
+}
+
 static u64 calc_distance(u64 block1, u64 block2)
 {
 	if (block1 < block2)
@@ -133,11 +373,133 @@ static u64 calc_distance(u64 block1, u64 block2)
 	return block1 - block2;
 }
 
-static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
-		      struct root_stats *stat, int level, int find_inline)
+/*
+ * Account the file extents of a leaf: the extents of each file, their size
+ * and the distance between the consecutive extents of a file in the logical
+ * address space.  The distance from the last extent of a file in the
+ * previous leaf is not known and not counted.
+ */
+static int walk_file_extents(struct tree_stats_walk *tsw, struct extent_buffer *b)
+{
+	struct root_stats *stat = tsw->stat;
+	struct btrfs_leaf_items *items = &tsw->items;
+	bool first = true;
+	u64 ino = 0;
+	u64 nr = 0;
+	u64 last_end = 0;
+	int ret = 0;
+
+	for (u32 i = 0; i <= items->nr; i++) {
+		struct btrfs_file_extent_item *fi;
+		u64 start;
+		u8 type;
+
+		if (i < items->nr && items->types[i] != BTRFS_EXTENT_DATA_KEY)
+			continue;
+		if (i == items->nr || items->keys[i].objectid != ino) {
+			if (nr) {
+				/* The last file is known only at the end */
+				if (first || i == items->nr)
+					ret = add_file_edge(stat, ino, nr);
+				else
+					add_file(stat, nr);
+				if (ret < 0)
+					return ret;
+				first = false;
+			}
+			if (i == items->nr)
+				break;
+			ino = items->keys[i].objectid;
+			nr = 0;
+			last_end = 0;
+		}
+
+		fi = (struct btrfs_file_extent_item *)
+			(btrfs_item_nr_offset(b, 0) + items->offsets[i]);
+		type = btrfs_file_extent_type(b, fi);
+		if (type == BTRFS_FILE_EXTENT_INLINE) {
+			stat->inline_extents++;
+			nr++;
+			continue;
+		}
+		/* Holes */
+		if (btrfs_file_extent_disk_bytenr(b, fi) == 0)
+			continue;
+		nr++;
+		stat->file_extents++;
+		stat->extent_bytes += btrfs_file_extent_num_bytes(b, fi);
+		if (type == BTRFS_FILE_EXTENT_PREALLOC)
+			stat->prealloc_extents++;
+
+		start = btrfs_file_extent_disk_bytenr(b, fi) +
+			btrfs_file_extent_offset(b, fi);
+		if (last_end && start != last_end) {
+			u64 distance = calc_distance(last_end, start);
+
+			stat->data_seeks++;
+			stat->data_seek_len += distance;
+			stat->max_data_seek_len = max(stat->max_data_seek_len,
+						      distance);
+			ret = add_seek(&stat->data_seek_root, distance, 1);
+			if (ret < 0)
+				return ret;
+		}
+		last_end = start + btrfs_file_extent_num_bytes(b, fi);
+	}
+	return 0;
+}
+
+/* Leaves are only read if @find_inline is set, @b is NULL otherwise */
+static int walk_leaf(struct tree_stats_walk *tsw, struct extent_buffer *b)
+{
+	struct btrfs_fs_info *fs_info = tsw->fs_info;
+	struct root_stats *stat = tsw->stat;
+	struct btrfs_leaf_items *items = &tsw->items;
+	struct btrfs_file_extent_item *fi;
+	int ret;
+	int i;
+
+	stat->total_bytes += fs_info->nodesize;
+	stat->total_nodes++;
+	stat->node_counts[0]++;
+
+	if (!tsw->find_inline)
+		return 0;
+
+	stat->level_used[0] += BTRFS_LEAF_DATA_SIZE(fs_info) -
+			       btrfs_leaf_free_space(b);
+	stat->level_capacity[0] += BTRFS_LEAF_DATA_SIZE(fs_info);
+	ret = btrfs_leaf_items_decode(b, items);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to decode leaf %llu: %m", b->start);
+		return ret;
+	}
+	for (i = 0; i < items->nr; i++) {
+		if (items->types[i] != BTRFS_EXTENT_DATA_KEY)
+			continue;
+
+		fi = (struct btrfs_file_extent_item *)
+			(btrfs_item_nr_offset(b, 0) + items->offsets[i]);
+		if (btrfs_file_extent_type(b, fi) == BTRFS_FILE_EXTENT_INLINE)
+			stat->total_inline += items->sizes[i] -
+				BTRFS_FILE_EXTENT_INLINE_DATA_START;
+	}
+	if (tsw->find_data)
+		return walk_file_extents(tsw, b);
+
+	return 0;
+}
+
+/*
+ * Account a node and the layout of its children, the children themselves are
+ * visited separately by the tree walk.
+ */
+static int walk_node(struct tree_stats_walk *tsw, struct extent_buffer *b)
 {
-	struct extent_buffer *b = path->nodes[level];
-	u32 nodesize = root->fs_info->nodesize;
+	struct root_stats *stat = tsw->stat;
+	u32 nodesize = tsw->fs_info->nodesize;
+	int level = btrfs_header_level(b);
 	u64 last_block;
 	u64 cluster_size = nodesize;
 	int i;
@@ -146,32 +508,20 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 	stat->total_bytes += nodesize;
 	stat->total_nodes++;
 	stat->node_counts[level]++;
+	stat->total_ptrs += btrfs_header_nritems(b);
+	stat->level_used[level] += btrfs_header_nritems(b);
+	stat->level_capacity[level] += BTRFS_NODEPTRS_PER_BLOCK(tsw->fs_info);
 
 	last_block = btrfs_header_bytenr(b);
 	for (i = 0; i < btrfs_header_nritems(b); i++) {
-		struct extent_buffer *tmp = NULL;
 		u64 cur_blocknr = btrfs_node_blockptr(b, i);
 
-		path->slots[level] = i;
-		if ((level - 1) > 0 || find_inline) {
-			struct btrfs_tree_parent_check check = {
-				.owner_root = btrfs_header_owner(b),
-				.transid = btrfs_node_ptr_generation(b, i),
-				.level = level - 1,
-			};
-			tmp = read_tree_block(root->fs_info, cur_blocknr, &check);
-			if (!extent_buffer_uptodate(tmp)) {
-				error("failed to read blocknr %llu",
-					btrfs_node_blockptr(b, i));
-				continue;
-			}
-			path->nodes[level - 1] = tmp;
+		/* The leaves are not read without find_inline */
+		if (level == 1 && !tsw->find_inline) {
+			ret = walk_leaf(tsw, NULL);
+			if (ret)
+				break;
 		}
-		if (level - 1)
-			ret = walk_nodes(root, path, stat, level - 1,
-					 find_inline);
-		else
-			ret = walk_leaf(root, path, stat, find_inline);
 		if (last_block + nodesize != cur_blocknr) {
 			u64 distance = calc_distance(last_block +
 						     nodesize,
@@ -180,7 +530,7 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 			stat->total_seek_len += distance;
 			if (stat->max_seek_len < distance)
 				stat->max_seek_len = distance;
-			if (add_seek(&stat->seek_root, distance)) {
+			if (add_seek(&stat->seek_root, distance, 1)) {
 				error("cannot add new seek at distance %llu", distance);
 				ret = -ENOMEM;
 				break;
@@ -207,36 +557,431 @@ static int walk_nodes(struct btrfs_root *root, struct btrfs_path *path,
 			stat->lowest_bytenr = cur_blocknr;
 		if (cur_blocknr > stat->highest_bytenr)
 			stat->highest_bytenr = cur_blocknr;
-		free_extent_buffer(tmp);
-		if (ret) {
-			error("walking down path failed: %d",  ret);
+	}
+
+	return ret;
+}
+
+static int walk_tree_block(struct tree_stats_walk *tsw, struct extent_buffer *eb)
+{
+	if (btrfs_header_level(eb) == 0)
+		return walk_leaf(tsw, eb);
+	return walk_node(tsw, eb);
+}
+
+/* Lowest level read, the leaves are counted from their parents otherwise */
+static int lowest_level(const struct tree_stats_tree *tree)
+{
+	return tree->find_inline ? 0 : 1;
+}
+
+static int queue_children(struct tree_stats_level *tsl, struct extent_buffer *node)
+{
+	const u32 nritems = btrfs_header_nritems(node);
+
+	if (tsl->nr + nritems > tsl->capacity) {
+		size_t capacity = max_t(size_t, tsl->capacity * 2, tsl->nr + nritems);
+		struct tree_stats_block *blocks;
+
+		blocks = realloc(tsl->blocks, capacity * sizeof(*blocks));
+		if (!blocks)
+			return -ENOMEM;
+		tsl->blocks = blocks;
+		tsl->capacity = capacity;
+	}
+	for (u32 i = 0; i < nritems; i++) {
+		struct tree_stats_block *blk = &tsl->blocks[tsl->nr++];
+
+		blk->bytenr = btrfs_node_blockptr(node, i);
+		blk->transid = btrfs_node_ptr_generation(node, i);
+	}
+	return 0;
+}
+
+static void sort_physical(struct btrfs_fs_info *fs_info,
+			  struct tree_stats_block *blocks, size_t nr)
+{
+	for (size_t i = 0; i < nr; i++) {
+		struct tree_stats_block *blk = &blocks[i];
+		struct btrfs_bio_stripe stripe;
+		u64 length = fs_info->nodesize;
+		int ret;
+
+		ret = btrfs_map_block_stripe(fs_info, blk->bytenr, &length,
+					     NULL, 1, &stripe);
+		if (ret < 0 || !stripe.dev || stripe.dev->fd < 0) {
+			/* Unmapped blocks go last, reading them reports it */
+			blk->devid = (u64)-1;
+			blk->physical = blk->bytenr;
+			blk->fd = -1;
+		} else {
+			blk->devid = stripe.dev->devid;
+			blk->physical = stripe.physical;
+			blk->fd = stripe.dev->fd;
+		}
+	}
+	radix_sort_u64_pair(blocks, nr, sizeof(struct tree_stats_block),
+			    offsetof(struct tree_stats_block, devid),
+			    offsetof(struct tree_stats_block, physical));
+}
+
+static bool tree_block_valid(struct btrfs_fs_info *fs_info,
+			     struct extent_buffer *eb,
+			     const struct tree_stats_block *blk, int level)
+{
+	u8 result[BTRFS_CSUM_SIZE];
+
+	if (btrfs_header_bytenr(eb) != blk->bytenr ||
+	    btrfs_header_generation(eb) != blk->transid ||
+	    btrfs_header_level(eb) != level)
+		return false;
+	if (!fs_info->skip_csum_check) {
+		if (btrfs_csum_data(fs_info->csum_type,
+				    (u8 *)eb->data + BTRFS_CSUM_SIZE, result,
+				    fs_info->nodesize - BTRFS_CSUM_SIZE))
+			return false;
+		if (memcmp(result, eb->data, fs_info->csum_size))
+			return false;
+	}
+	if (level)
+		return __btrfs_check_node(eb) == BTRFS_TREE_BLOCK_CLEAN;
+	return __btrfs_check_leaf(eb) == BTRFS_TREE_BLOCK_CLEAN;
+}
+
+/*
+ * Read @blk into the private buffer of the worker, from the first copy and
+ * then the other ones if it's not valid.
+ */
+static int read_tree_stats_block(struct tree_stats_worker *w,
+				 const struct tree_stats_block *blk, int level)
+{
+	struct btrfs_fs_info *fs_info = w->fs_info;
+	struct extent_buffer *eb = w->eb;
+	const u32 nodesize = fs_info->nodesize;
+	int num_copies;
+
+	eb->start = blk->bytenr;
+	num_copies = btrfs_num_copies(fs_info, blk->bytenr, nodesize);
+	for (int mirror = 1; mirror <= num_copies; mirror++) {
+		u64 len = nodesize;
+		int ret;
+
+		if (mirror == 1 && blk->fd >= 0)
+			ret = pread(blk->fd, eb->data, nodesize,
+				    blk->physical) == nodesize ? 0 : -EIO;
+		else
+			ret = read_data_from_disk(fs_info, eb->data, blk->bytenr,
+						  &len, mirror);
+		if (ret == 0 && len == nodesize &&
+		    tree_block_valid(fs_info, eb, blk, level))
+			return 0;
+	}
+	error("failed to read tree block %llu", blk->bytenr);
+	return -EIO;
+}
+
+/*
+ * Walk the subtrees of @job level by level.  The unreadable blocks are
+ * reported and skipped, like in the tree walk of the main thread.
+ */
+static int walk_tree_stats_job(struct tree_stats_worker *w,
+			       struct tree_stats_job *job)
+{
+	struct btrfs_fs_info *fs_info = w->fs_info;
+	struct tree_stats_tree *tree = job->tree;
+	struct root_stats stat;
+	struct timespec start, end;
+	int level = job->level;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	init_root_stats(&stat, fs_info->nodesize);
+	w->walk.stat = &stat;
+	w->walk.find_inline = tree->find_inline;
+	w->walk.find_data = tree->find_data;
+
+	w->cur.nr = 0;
+	if (job->nr > w->cur.capacity) {
+		struct tree_stats_block *blocks;
+
+		blocks = realloc(w->cur.blocks, job->nr * sizeof(*blocks));
+		if (!blocks) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		w->cur.blocks = blocks;
+		w->cur.capacity = job->nr;
+	}
+	memcpy(w->cur.blocks, job->blocks, job->nr * sizeof(*job->blocks));
+	w->cur.nr = job->nr;
+
+	while (w->cur.nr) {
+		struct tree_stats_level tmp;
+		size_t ra = 0;
+
+		/* The blocks of the job are already sorted */
+		if (level != job->level)
+			sort_physical(fs_info, w->cur.blocks, w->cur.nr);
+		w->next.nr = 0;
+		for (size_t i = 0; i < w->cur.nr; i++) {
+			struct tree_stats_block *blk = &w->cur.blocks[i];
+
+			for (; ra < w->cur.nr && ra < i + TREE_STATS_READAHEAD; ra++)
+				if (w->cur.blocks[ra].fd >= 0)
+					readahead(w->cur.blocks[ra].fd,
+						  w->cur.blocks[ra].physical,
+						  fs_info->nodesize);
+
+			if (read_tree_stats_block(w, blk, level))
+				continue;
+			ret = walk_tree_block(&w->walk, w->eb);
+			if (ret == 0 && level > lowest_level(tree))
+				ret = queue_children(&w->next, w->eb);
+			if (ret < 0)
+				goto out;
+		}
+		tmp = w->cur;
+		w->cur = w->next;
+		w->next = tmp;
+		level--;
+	}
+out:
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stat.read_ns = timespec_diff_ns(&start, &end);
+	pthread_mutex_lock(&tree->lock);
+	if (merge_root_stats(&tree->stat, &stat) < 0 && !ret)
+		ret = -ENOMEM;
+	pthread_mutex_unlock(&tree->lock);
+	return ret;
+}
+
+static void *tree_stats_worker_fn(void *arg)
+{
+	struct tree_stats_worker *w = arg;
+	struct tree_stats_job *job;
+
+	while ((job = work_queue_pop(w->queue))) {
+		int ret = walk_tree_stats_job(w, job);
+
+		if (ret < 0 && !w->ret)
+			w->ret = ret;
+		free(job);
+	}
+	return NULL;
+}
+
+static int init_tree_stats_worker(struct tree_stats_worker *w,
+				  struct btrfs_fs_info *fs_info,
+				  struct work_queue *queue)
+{
+	memset(w, 0, sizeof(*w));
+	w->fs_info = fs_info;
+	w->queue = queue;
+	w->walk.fs_info = fs_info;
+	w->eb = alloc_extent_buffer_inline(fs_info->nodesize);
+	if (!w->eb)
+		return -ENOMEM;
+	w->eb->len = fs_info->nodesize;
+	w->eb->fs_info = fs_info;
+	return 0;
+}
+
+static void release_tree_stats_worker(struct tree_stats_worker *w)
+{
+	btrfs_leaf_items_release(&w->walk.items);
+	free(w->cur.blocks);
+	free(w->next.blocks);
+	free(w->eb);
+}
+
+/*
+ * Read the top levels of @tree in the main thread until there are at least
+ * @min_jobs subtrees, and queue them in jobs of consecutive physical blocks.
+ * The jobs are run directly without the workers if @queue is NULL.
+ */
+static int split_tree(struct btrfs_fs_info *fs_info, struct tree_stats_tree *tree,
+		      struct tree_stats_worker *main_worker,
+		      struct work_queue *queue, unsigned int min_jobs)
+{
+	struct tree_stats_level cur = { 0 };
+	struct tree_stats_level next = { 0 };
+	struct tree_stats_walk tsw = {
+		.fs_info = fs_info,
+		.find_inline = tree->find_inline,
+		.find_data = tree->find_data,
+	};
+	struct root_stats stat;
+	struct timespec start, end;
+	int level = tree->level;
+	size_t per_job;
+	int ret = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	init_root_stats(&stat, fs_info->nodesize);
+	tsw.stat = &stat;
+	cur.blocks = malloc(sizeof(*cur.blocks));
+	if (!cur.blocks) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	cur.blocks[0].bytenr = tree->bytenr;
+	cur.blocks[0].transid = tree->generation;
+	cur.nr = 1;
+
+	while (cur.nr < min_jobs && level > lowest_level(tree)) {
+		struct tree_stats_level tmp;
+
+		next.nr = 0;
+		for (size_t i = 0; i < cur.nr; i++) {
+			struct btrfs_tree_parent_check check = {
+				.transid = cur.blocks[i].transid,
+				.level = level,
+			};
+			struct extent_buffer *eb;
+
+			eb = read_tree_block(fs_info, cur.blocks[i].bytenr, &check);
+			if (!extent_buffer_uptodate(eb)) {
+				error("failed to read tree block %llu",
+				      cur.blocks[i].bytenr);
+				if (!IS_ERR(eb))
+					free_extent_buffer(eb);
+				continue;
+			}
+			ret = walk_tree_block(&tsw, eb);
+			if (ret == 0)
+				ret = queue_children(&next, eb);
+			free_extent_buffer(eb);
+			if (ret < 0)
+				goto out;
+		}
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		level--;
+	}
+
+	sort_physical(fs_info, cur.blocks, cur.nr);
+	per_job = max_t(size_t, 1, DIV_ROUND_UP(cur.nr, min_jobs));
+	for (size_t i = 0; i < cur.nr; i += per_job) {
+		const u32 nr = min_t(size_t, per_job, cur.nr - i);
+		struct tree_stats_job *job;
+
+		job = malloc(sizeof(*job) + nr * sizeof(job->blocks[0]));
+		if (!job) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		job->tree = tree;
+		job->level = level;
+		job->nr = nr;
+		memcpy(job->blocks, &cur.blocks[i], nr * sizeof(job->blocks[0]));
+		if (queue) {
+			work_queue_push(queue, job);
+			continue;
+		}
+		ret = walk_tree_stats_job(main_worker, job);
+		free(job);
+		if (ret < 0)
+			goto out;
+	}
+out:
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	stat.read_ns = timespec_diff_ns(&start, &end);
+	pthread_mutex_lock(&tree->lock);
+	if (merge_root_stats(&tree->stat, &stat) < 0 && !ret)
+		ret = -ENOMEM;
+	pthread_mutex_unlock(&tree->lock);
+	free(cur.blocks);
+	free(next.blocks);
+	btrfs_leaf_items_release(&tsw.items);
+	if (ret == -ENOMEM)
+		error_msg(ERROR_MSG_MEMORY, "tree stats");
+	return ret;
+}
+
+/*
+ * Walk all @trees by @nr_threads workers, or only by the main thread if it's
+ * 0 or the threads can't be started.
+ */
+static int walk_trees(struct btrfs_fs_info *fs_info, struct tree_stats_tree *trees,
+		      int nr_trees, unsigned int nr_threads)
+{
+	struct tree_stats_worker main_worker;
+	struct tree_stats_worker *workers = NULL;
+	struct work_queue queue;
+	unsigned int started = 0;
+	int ret;
+
+	/* The checksums are verified by the workers */
+	if (!CRYPTO_HASH_THREAD_SAFE &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_CRC32 &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_XXHASH)
+		nr_threads = 0;
+
+	ret = init_tree_stats_worker(&main_worker, fs_info, NULL);
+	if (ret < 0)
+		goto out;
+	if (nr_threads) {
+		workers = calloc(nr_threads, sizeof(*workers));
+		if (workers && work_queue_init(&queue, nr_threads *
+					       TREE_STATS_JOBS_PER_WORKER) < 0) {
+			free(workers);
+			workers = NULL;
+		}
+	}
+	for (; workers && started < nr_threads; started++) {
+		struct tree_stats_worker *w = &workers[started];
+
+		if (init_tree_stats_worker(w, fs_info, &queue) < 0)
+			break;
+		if (pthread_create(&w->thread, NULL, tree_stats_worker_fn, w)) {
+			release_tree_stats_worker(w);
 			break;
 		}
 	}
 
+	for (int i = 0; i < nr_trees && ret == 0; i++)
+		ret = split_tree(fs_info, &trees[i], &main_worker,
+				 started ? &queue : NULL,
+				 max(started, 1U) * TREE_STATS_JOBS_PER_WORKER);
+
+	for (unsigned int i = 0; i < started; i++)
+		work_queue_push(&queue, NULL);
+	for (unsigned int i = 0; i < started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		if (workers[i].ret < 0 && !ret)
+			ret = workers[i].ret;
+		release_tree_stats_worker(&workers[i]);
+	}
+	if (workers) {
+		work_queue_release(&queue);
+		free(workers);
+	}
+out:
+	release_tree_stats_worker(&main_worker);
 	return ret;
 }
 
-static void print_seek_histogram(struct root_stats *stat)
+static void print_seek_histogram(struct rb_root *seek_root, u64 total_seeks,
+				 u64 max_seek)
 {
-	struct rb_node *n = rb_first(&stat->seek_root);
+	struct rb_node *n = rb_first(seek_root);
 	struct seek *seek;
 	u64 tick_interval;
 	u64 group_start = 0;
 	u64 group_count = 0;
 	u64 group_end = 0;
 	u64 i;
-	u64 max_seek = stat->max_seek_len;
 	int digits = 1;
 
-	if (stat->total_seeks < 20)
+	if (total_seeks < 20)
 		return;
 
 	while ((max_seek /= 10))
 		digits++;
 
 	/* Make a tick count as 5% of the total seeks */
-	tick_interval = stat->total_seeks / 20;
+	tick_interval = total_seeks / 20;
 	pr_verbose(LOG_DEFAULT, "\tSeek histogram\n");
 	for (; n; n = rb_next(n)) {
 		u64 ticks, gticks = 0;
@@ -295,143 +1040,313 @@ static void print_seek_histogram(struct root_stats *stat)
 	}
 }
 
-static void timeval_subtract(struct timeval *result, struct timeval *x,
-			     struct timeval *y)
+static void print_tree_stats(struct tree_stats_tree *tree, unsigned int unit_mode)
 {
-	if (x->tv_usec < y->tv_usec) {
-		int nsec = (y->tv_usec - x->tv_usec) / 1000000 + 1;
-		y->tv_usec -= 1000000 * nsec;
-		y->tv_sec += nsec;
-	}
-
-	if (x->tv_usec - y->tv_usec > 1000000) {
-		int nsec = (x->tv_usec - y->tv_usec) / 1000000;
-		y->tv_usec += 1000000 * nsec;
-		y->tv_sec -= nsec;
-	}
-
-	result->tv_sec = x->tv_sec - y->tv_sec;
-	result->tv_usec = x->tv_usec - y->tv_usec;
-}
-
-static int calc_root_size(struct btrfs_root *tree_root, struct btrfs_key *key,
-			  int find_inline, unsigned int unit_mode)
-{
-	struct btrfs_root *root;
-	struct btrfs_path path = { 0 };
-	struct rb_node *n;
-	struct timeval start, end, diff = {0};
-	struct root_stats stat;
-	int level;
-	int ret = 0;
-	int size_fail = 0;
+	struct root_stats *stat = &tree->stat;
+	u64 read_us = stat->read_ns / 1000;
+	int level = tree->level;
 	int i;
 
-	root = btrfs_read_fs_root(tree_root->fs_info, key);
-	if (IS_ERR(root)) {
-		error("failed to read root %llu", key->objectid);
-		return 1;
-	}
-
-	memset(&stat, 0, sizeof(stat));
-	level = btrfs_header_level(root->node);
-	stat.lowest_bytenr = btrfs_header_bytenr(root->node);
-	stat.highest_bytenr = stat.lowest_bytenr;
-	stat.min_cluster_size = (u64)-1;
-	stat.max_cluster_size = root->fs_info->nodesize;
-	path.nodes[level] = root->node;
-	if (gettimeofday(&start, NULL)) {
-		error("cannot get time: %m");
-		goto out;
-	}
-	if (!level) {
-		ret = walk_leaf(root, &path, &stat, find_inline);
-		if (ret)
-			goto out;
-		goto out_print;
+	if (stat->min_cluster_size == (u64)-1) {
+		stat->min_cluster_size = 0;
+		stat->total_clusters = 1;
 	}
 
-	ret = walk_nodes(root, &path, &stat, level, find_inline);
-	if (ret)
-		goto out;
-	if (gettimeofday(&end, NULL)) {
-		error("cannot get time: %m");
-		goto out;
-	}
-	timeval_subtract(&diff, &end, &start);
-out_print:
-	if (stat.min_cluster_size == (u64)-1) {
-		stat.min_cluster_size = 0;
-		stat.total_clusters = 1;
-	}
-
-	if (unit_mode == UNITS_RAW || size_fail) {
-		pr_verbose(LOG_DEFAULT, "\tTotal size: %llu\n", stat.total_bytes);
-		pr_verbose(LOG_DEFAULT, "\t\tInline data: %llu\n", stat.total_inline);
-		pr_verbose(LOG_DEFAULT, "\tTotal seeks: %llu\n", stat.total_seeks);
-		pr_verbose(LOG_DEFAULT, "\t\tForward seeks: %llu\n", stat.forward_seeks);
-		pr_verbose(LOG_DEFAULT, "\t\tBackward seeks: %llu\n", stat.backward_seeks);
-		pr_verbose(LOG_DEFAULT, "\t\tAvg seek len: %llu\n", stat.total_seeks ?
-			stat.total_seek_len / stat.total_seeks : 0);
-		print_seek_histogram(&stat);
-		pr_verbose(LOG_DEFAULT, "\tTotal clusters: %llu\n", stat.total_clusters);
-		pr_verbose(LOG_DEFAULT, "\t\tAvg cluster size: %llu\n", stat.total_cluster_size /
-		       stat.total_clusters);
-		pr_verbose(LOG_DEFAULT, "\t\tMin cluster size: %llu\n", stat.min_cluster_size);
-		pr_verbose(LOG_DEFAULT, "\t\tMax cluster size: %llu\n", stat.max_cluster_size);
-		pr_verbose(LOG_DEFAULT, "\tTotal disk spread: %llu\n", stat.highest_bytenr -
-		       stat.lowest_bytenr);
-		pr_verbose(LOG_DEFAULT, "\tTotal read time: %d s %d us\n", (int)diff.tv_sec,
-		       (int)diff.tv_usec);
+	if (unit_mode == UNITS_RAW) {
+		pr_verbose(LOG_DEFAULT, "\tTotal size: %llu\n", stat->total_bytes);
+		pr_verbose(LOG_DEFAULT, "\t\tInline data: %llu\n", stat->total_inline);
+		pr_verbose(LOG_DEFAULT, "\tTotal seeks: %llu\n", stat->total_seeks);
+		pr_verbose(LOG_DEFAULT, "\t\tForward seeks: %llu\n", stat->forward_seeks);
+		pr_verbose(LOG_DEFAULT, "\t\tBackward seeks: %llu\n", stat->backward_seeks);
+		pr_verbose(LOG_DEFAULT, "\t\tAvg seek len: %llu\n", stat->total_seeks ?
+			stat->total_seek_len / stat->total_seeks : 0);
+		print_seek_histogram(&stat->seek_root, stat->total_seeks,
+				     stat->max_seek_len);
+		pr_verbose(LOG_DEFAULT, "\tTotal clusters: %llu\n", stat->total_clusters);
+		pr_verbose(LOG_DEFAULT, "\t\tAvg cluster size: %llu\n", stat->total_cluster_size /
+		       stat->total_clusters);
+		pr_verbose(LOG_DEFAULT, "\t\tMin cluster size: %llu\n", stat->min_cluster_size);
+		pr_verbose(LOG_DEFAULT, "\t\tMax cluster size: %llu\n", stat->max_cluster_size);
+		pr_verbose(LOG_DEFAULT, "\tTotal disk spread: %llu\n", stat->highest_bytenr -
+		       stat->lowest_bytenr);
 	} else {
-		pr_verbose(LOG_DEFAULT, "\tTotal size: %s\n", pretty_size_mode(stat.total_bytes, unit_mode));
-		pr_verbose(LOG_DEFAULT, "\t\tInline data: %s\n", pretty_size_mode(stat.total_inline, unit_mode));
-		pr_verbose(LOG_DEFAULT, "\tTotal seeks: %llu\n", stat.total_seeks);
-		pr_verbose(LOG_DEFAULT, "\t\tForward seeks: %llu\n", stat.forward_seeks);
-		pr_verbose(LOG_DEFAULT, "\t\tBackward seeks: %llu\n", stat.backward_seeks);
-		pr_verbose(LOG_DEFAULT, "\t\tAvg seek len: %s\n", stat.total_seeks ?
-			pretty_size_mode(stat.total_seek_len / stat.total_seeks, unit_mode) :
+		pr_verbose(LOG_DEFAULT, "\tTotal size: %s\n", pretty_size_mode(stat->total_bytes, unit_mode));
+		pr_verbose(LOG_DEFAULT, "\t\tInline data: %s\n", pretty_size_mode(stat->total_inline, unit_mode));
+		pr_verbose(LOG_DEFAULT, "\tTotal seeks: %llu\n", stat->total_seeks);
+		pr_verbose(LOG_DEFAULT, "\t\tForward seeks: %llu\n", stat->forward_seeks);
+		pr_verbose(LOG_DEFAULT, "\t\tBackward seeks: %llu\n", stat->backward_seeks);
+		pr_verbose(LOG_DEFAULT, "\t\tAvg seek len: %s\n", stat->total_seeks ?
+			pretty_size_mode(stat->total_seek_len / stat->total_seeks, unit_mode) :
 			pretty_size_mode(0, unit_mode));
-		print_seek_histogram(&stat);
-		pr_verbose(LOG_DEFAULT, "\tTotal clusters: %llu\n", stat.total_clusters);
+		print_seek_histogram(&stat->seek_root, stat->total_seeks,
+				     stat->max_seek_len);
+		pr_verbose(LOG_DEFAULT, "\tTotal clusters: %llu\n", stat->total_clusters);
 		pr_verbose(LOG_DEFAULT, "\t\tAvg cluster size: %s\n",
-				pretty_size_mode((stat.total_cluster_size /
-						  stat.total_clusters), unit_mode));
+				pretty_size_mode((stat->total_cluster_size /
+						  stat->total_clusters), unit_mode));
 		pr_verbose(LOG_DEFAULT, "\t\tMin cluster size: %s\n",
-				pretty_size_mode(stat.min_cluster_size, unit_mode));
+				pretty_size_mode(stat->min_cluster_size, unit_mode));
 		pr_verbose(LOG_DEFAULT, "\t\tMax cluster size: %s\n",
-				pretty_size_mode(stat.max_cluster_size, unit_mode));
+				pretty_size_mode(stat->max_cluster_size, unit_mode));
 		pr_verbose(LOG_DEFAULT, "\tTotal disk spread: %s\n",
-				pretty_size_mode(stat.highest_bytenr - stat.lowest_bytenr, unit_mode));
-		pr_verbose(LOG_DEFAULT, "\tTotal read time: %d s %d us\n", (int)diff.tv_sec,
-		       (int)diff.tv_usec);
+				pretty_size_mode(stat->highest_bytenr - stat->lowest_bytenr, unit_mode));
 	}
+	pr_verbose(LOG_DEFAULT, "\tFragmentation: %llu%%\n", stat->total_ptrs ?
+		   stat->total_seeks * 100 / stat->total_ptrs : 0);
+	pr_verbose(LOG_DEFAULT, "\tTotal read time: %d s %d us\n",
+		   (int)(read_us / 1000000), (int)(read_us % 1000000));
 	pr_verbose(LOG_DEFAULT, "\tLevels: %d\n", level + 1);
-	pr_verbose(LOG_DEFAULT, "\tTotal nodes: %llu\n", stat.total_nodes);
+	pr_verbose(LOG_DEFAULT, "\tTotal nodes: %llu\n", stat->total_nodes);
 	for (i = 0; i < level + 1; i++) {
-		pr_verbose(LOG_DEFAULT, "\t\tOn level %d: %8llu", i, stat.node_counts[i]);
-		if (i > 0) {
+		pr_verbose(LOG_DEFAULT, "\t\tOn level %d: %8llu", i, stat->node_counts[i]);
+		if (i > 0 && stat->node_counts[i]) {
 			u64 fanout;
 
-			fanout = stat.node_counts[i - 1];
-			fanout /= stat.node_counts[i];
+			fanout = stat->node_counts[i - 1];
+			fanout /= stat->node_counts[i];
 			pr_verbose(LOG_DEFAULT, "  (avg fanout %llu)", fanout);
 		}
+		if (stat->level_capacity[i])
+			pr_verbose(LOG_DEFAULT, "  (fill %llu%%)", stat->level_used[i] *
+				   100 / stat->level_capacity[i]);
 		pr_verbose(LOG_DEFAULT, "\n");
 	}
-out:
-	while ((n = rb_first(&stat.seek_root)) != NULL) {
-		struct seek *seek = rb_entry(n, struct seek, n);
-		rb_erase(n, &stat.seek_root);
-		free(seek);
+}
+
+static const struct rowspec tree_stats_rowspec[] = {
+	{ .key = "tree", .fmt = "%llu", .out_json = "tree" },
+	{ .key = "name", .fmt = "str", .out_json = "name" },
+	{ .key = "total_bytes", .fmt = "%llu", .out_json = "total_bytes" },
+	{ .key = "inline_bytes", .fmt = "%llu", .out_json = "inline_bytes" },
+	{ .key = "total_seeks", .fmt = "%llu", .out_json = "total_seeks" },
+	{ .key = "forward_seeks", .fmt = "%llu", .out_json = "forward_seeks" },
+	{ .key = "backward_seeks", .fmt = "%llu", .out_json = "backward_seeks" },
+	{ .key = "avg_seek_len", .fmt = "%llu", .out_json = "avg_seek_len" },
+	{ .key = "max_seek_len", .fmt = "%llu", .out_json = "max_seek_len" },
+	{ .key = "fragmentation", .fmt = "%llu", .out_json = "fragmentation" },
+	{ .key = "total_clusters", .fmt = "%llu", .out_json = "total_clusters" },
+	{ .key = "avg_cluster_size", .fmt = "%llu", .out_json = "avg_cluster_size" },
+	{ .key = "min_cluster_size", .fmt = "%llu", .out_json = "min_cluster_size" },
+	{ .key = "max_cluster_size", .fmt = "%llu", .out_json = "max_cluster_size" },
+	{ .key = "disk_spread", .fmt = "%llu", .out_json = "disk_spread" },
+	{ .key = "read_time_us", .fmt = "%llu", .out_json = "read_time_us" },
+	{ .key = "total_nodes", .fmt = "%llu", .out_json = "total_nodes" },
+	{ .key = "level", .fmt = "%llu", .out_json = "level" },
+	{ .key = "nodes", .fmt = "%llu", .out_json = "nodes" },
+	{ .key = "fanout", .fmt = "%llu", .out_json = "fanout" },
+	{ .key = "fill", .fmt = "%llu", .out_json = "fill" },
+	{ .key = "seek_min", .fmt = "%llu", .out_json = "min" },
+	{ .key = "seek_max", .fmt = "%llu", .out_json = "max" },
+	{ .key = "seek_count", .fmt = "%llu", .out_json = "count" },
+	ROWSPEC_END
+};
+
+/* The seeks are grouped by powers of two of the distance */
+static void print_seek_histogram_json(struct format_ctx *fctx,
+				      struct rb_root *seek_root)
+{
+	struct rb_node *n;
+	u64 count = 0;
+	int bucket = -1;
+
+	fmt_print_start_group(fctx, "seek-histogram", JSON_TYPE_ARRAY);
+	for (n = rb_first(seek_root); ; n = rb_next(n)) {
+		struct seek *seek = n ? rb_entry(n, struct seek, n) : NULL;
+
+		if (count && (!seek || ilog2(seek->distance) != bucket)) {
+			fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(fctx, "seek_min", 1ULL << bucket);
+			fmt_print(fctx, "seek_max", (2ULL << bucket) - 1);
+			fmt_print(fctx, "seek_count", count);
+			fmt_print_end_group(fctx, NULL);
+			count = 0;
+		}
+		if (!seek)
+			break;
+		bucket = ilog2(seek->distance);
+		count += seek->count;
 	}
+	fmt_print_end_group(fctx, "seek-histogram");
+}
 
-	/*
-	 * We only use path to save node data in iterating, without holding
-	 * eb's ref_cnt in path.  Don't use btrfs_release_path() here, it will
-	 * free these eb again, and cause many problems, as negative ref_cnt or
-	 * invalid memory access.
-	 */
+static void print_tree_stats_json(struct format_ctx *fctx,
+				  struct tree_stats_tree *tree, const char *name)
+{
+	struct root_stats *stat = &tree->stat;
+
+	if (stat->min_cluster_size == (u64)-1) {
+		stat->min_cluster_size = 0;
+		stat->total_clusters = 1;
+	}
+	fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+	fmt_print(fctx, "tree", tree->objectid);
+	if (name)
+		fmt_print(fctx, "name", name);
+	fmt_print(fctx, "total_bytes", stat->total_bytes);
+	fmt_print(fctx, "inline_bytes", stat->total_inline);
+	fmt_print(fctx, "total_seeks", stat->total_seeks);
+	fmt_print(fctx, "forward_seeks", stat->forward_seeks);
+	fmt_print(fctx, "backward_seeks", stat->backward_seeks);
+	fmt_print(fctx, "avg_seek_len", stat->total_seeks ?
+		  stat->total_seek_len / stat->total_seeks : 0);
+	fmt_print(fctx, "max_seek_len", stat->max_seek_len);
+	fmt_print(fctx, "fragmentation", stat->total_ptrs ?
+		  stat->total_seeks * 100 / stat->total_ptrs : 0);
+	fmt_print(fctx, "total_clusters", stat->total_clusters);
+	fmt_print(fctx, "avg_cluster_size",
+		  stat->total_cluster_size / stat->total_clusters);
+	fmt_print(fctx, "min_cluster_size", stat->min_cluster_size);
+	fmt_print(fctx, "max_cluster_size", stat->max_cluster_size);
+	fmt_print(fctx, "disk_spread", stat->highest_bytenr - stat->lowest_bytenr);
+	fmt_print(fctx, "read_time_us", stat->read_ns / 1000);
+	fmt_print(fctx, "total_nodes", stat->total_nodes);
+	fmt_print_start_group(fctx, "levels", JSON_TYPE_ARRAY);
+	for (int i = 0; i <= tree->level; i++) {
+		fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(fctx, "level", (u64)i);
+		fmt_print(fctx, "nodes", stat->node_counts[i]);
+		if (i > 0 && stat->node_counts[i])
+			fmt_print(fctx, "fanout",
+				  stat->node_counts[i - 1] / stat->node_counts[i]);
+		if (stat->level_capacity[i])
+			fmt_print(fctx, "fill", stat->level_used[i] * 100 /
+				  stat->level_capacity[i]);
+		fmt_print_end_group(fctx, NULL);
+	}
+	fmt_print_end_group(fctx, "levels");
+	print_seek_histogram_json(fctx, &stat->seek_root);
+	fmt_print_end_group(fctx, NULL);
+}
+
+static const char *tree_name(u64 objectid)
+{
+	switch (objectid) {
+	case BTRFS_ROOT_TREE_OBJECTID:		return "root";
+	case BTRFS_EXTENT_TREE_OBJECTID:	return "extent";
+	case BTRFS_CHUNK_TREE_OBJECTID:		return "chunk";
+	case BTRFS_DEV_TREE_OBJECTID:		return "device";
+	case BTRFS_FS_TREE_OBJECTID:		return "fs";
+	case BTRFS_CSUM_TREE_OBJECTID:		return "csum";
+	case BTRFS_QUOTA_TREE_OBJECTID:		return "quota";
+	case BTRFS_UUID_TREE_OBJECTID:		return "uuid";
+	case BTRFS_FREE_SPACE_TREE_OBJECTID:	return "free space";
+	case BTRFS_BLOCK_GROUP_TREE_OBJECTID:	return "block group";
+	case BTRFS_RAID_STRIPE_TREE_OBJECTID:	return "raid stripe";
+	case BTRFS_DATA_RELOC_TREE_OBJECTID:	return "data reloc";
+	case BTRFS_TREE_RELOC_OBJECTID:		return "reloc";
+	}
+	return NULL;
+}
+
+static int add_tree(struct tree_stats_tree **trees, int *nr_trees, u64 objectid,
+		    u64 bytenr, u64 generation, int level, int find_inline)
+{
+	struct tree_stats_tree *tmp;
+	struct tree_stats_tree *tree;
+
+	tmp = realloc(*trees, (*nr_trees + 1) * sizeof(*tmp));
+	if (!tmp) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	*trees = tmp;
+	tree = &tmp[(*nr_trees)++];
+	memset(tree, 0, sizeof(*tree));
+	tree->objectid = objectid;
+	tree->bytenr = bytenr;
+	tree->generation = generation;
+	tree->level = level;
+	tree->find_inline = find_inline;
+	return 0;
+}
+
+static int add_root(struct btrfs_fs_info *fs_info, struct tree_stats_tree **trees,
+		    int *nr_trees, struct btrfs_key *key, int find_inline)
+{
+	struct btrfs_root *root;
+
+	root = btrfs_read_fs_root(fs_info, key);
+	if (IS_ERR(root)) {
+		error("failed to read root %llu", key->objectid);
+		return -EIO;
+	}
+	return add_tree(trees, nr_trees, key->objectid,
+			btrfs_header_bytenr(root->node),
+			btrfs_header_generation(root->node),
+			btrfs_header_level(root->node), find_inline);
+}
+
+/*
+ * The root and chunk trees and all trees with a root item, the leaves are
+ * read only for the subvolume trees.  Only the subvolume trees are added if
+ * @subvols_only is set.
+ */
+static int add_all_trees(struct btrfs_fs_info *fs_info,
+			 struct tree_stats_tree **trees, int *nr_trees,
+			 bool subvols_only)
+{
+	struct btrfs_root *tree_root = fs_info->tree_root;
+	struct extent_buffer *node;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key = { 0 };
+	int ret;
+
+	if (!subvols_only) {
+		node = tree_root->node;
+		ret = add_tree(trees, nr_trees, BTRFS_ROOT_TREE_OBJECTID,
+			       btrfs_header_bytenr(node),
+			       btrfs_header_generation(node),
+			       btrfs_header_level(node), 0);
+		if (ret < 0)
+			return ret;
+		node = fs_info->chunk_root->node;
+		ret = add_tree(trees, nr_trees, BTRFS_CHUNK_TREE_OBJECTID,
+			       btrfs_header_bytenr(node),
+			       btrfs_header_generation(node),
+			       btrfs_header_level(node), 0);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to search the root tree: %m");
+		return ret;
+	}
+	while (true) {
+		struct extent_buffer *leaf = path.nodes[0];
+		struct btrfs_root_item *ri;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret < 0) {
+				errno = -ret;
+				error("failed to search the root tree: %m");
+				break;
+			}
+			if (ret > 0) {
+				ret = 0;
+				break;
+			}
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		path.slots[0]++;
+		if (key.type != BTRFS_ROOT_ITEM_KEY)
+			continue;
+		if (subvols_only && !is_fstree(key.objectid))
+			continue;
+		ri = btrfs_item_ptr(leaf, path.slots[0] - 1, struct btrfs_root_item);
+		ret = add_tree(trees, nr_trees, key.objectid,
+			       btrfs_disk_root_bytenr(leaf, ri),
+			       btrfs_disk_root_generation(leaf, ri),
+			       btrfs_disk_root_level(leaf, ri),
+			       is_fstree(key.objectid));
+		if (ret < 0)
+			break;
+	}
+	btrfs_release_path(&path);
 	return ret;
 }
 
@@ -441,7 +1356,11 @@ static const char * const cmd_inspect_tree_stats_usage[] = {
 	"",
 	OPTLINE("-b", "raw numbers in bytes"),
 	HELPINFO_UNITS_LONG,
-	OPTLINE("-t <rootid>", "print only tree with the given rootid"),
+	OPTLINE("-t <rootid>|all", "print only tree with the given rootid, or all trees"),
+	OPTLINE("--threads <num>", "number of threads walking the trees, 0 to walk them in the main thread, default: number of CPUs"),
+	OPTLINE("--mmap", "map the image files instead of reading the tree blocks, the tool is killed by SIGBUS if an image is truncated or fails to read"),
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_FORMAT,
 	NULL
 };
 
@@ -449,16 +1368,32 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 				  int argc, char **argv)
 {
 	struct btrfs_key key = { .type = BTRFS_ROOT_ITEM_KEY };
+	struct btrfs_fs_info *fs_info;
 	struct btrfs_root *root;
+	struct tree_stats_tree *trees = NULL;
+	struct format_ctx fctx;
 	unsigned int unit_mode = UNITS_DEFAULT;
-	int opt;
+	unsigned int nr_threads = (unsigned int)-1;
+	unsigned int ctree_flags = 0;
+	int nr_trees = 0;
 	int ret = 0;
 	u64 tree_id = 0;
+	bool all_trees = false;
 
 	unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
 
 	optind = 0;
-	while ((opt = getopt(argc, argv, "vbt:")) != -1) {
+	while (1) {
+		enum { GETOPT_VAL_THREADS = GETOPT_VAL_FIRST, GETOPT_VAL_MMAP };
+		static const struct option long_options[] = {
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "mmap", no_argument, NULL, GETOPT_VAL_MMAP },
+			{ NULL, 0, NULL, 0 }
+		};
+		int opt = getopt_long(argc, argv, "vbt:", long_options, NULL);
+
+		if (opt < 0)
+			break;
 		switch (opt) {
 		case 'v':
 			verbose++;
@@ -467,12 +1402,31 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 			unit_mode = UNITS_RAW;
 			break;
 		case 't':
+			if (strcmp(optarg, "all") == 0) {
+				all_trees = true;
+				break;
+			}
 			tree_id = arg_strtou64(optarg);
 			if (!tree_id) {
 				error("unrecognized tree id: %s", optarg);
 				exit(1);
 			}
 			break;
+		case GETOPT_VAL_THREADS:
+		{
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp > TREE_STATS_MAX_THREADS) {
+				error("number of threads out of range: %llu > %u",
+				      tmp, TREE_STATS_MAX_THREADS);
+				return 1;
+			}
+			nr_threads = tmp;
+			break;
+		}
+		case GETOPT_VAL_MMAP:
+			ctree_flags |= OPEN_CTREE_MMAP;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -481,6 +1435,13 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 	if (check_argc_exact(argc - optind, 1))
 		return 1;
 
+	if (nr_threads == (unsigned int)-1) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nr_threads = nr_cpus > 1 ? min_t(long, nr_cpus,
+						 TREE_STATS_MAX_THREADS) : 0;
+	}
+
 	ret = check_mounted(argv[optind]);
 	if (ret < 0) {
 		errno = -ret;
@@ -491,46 +1452,391 @@ static int cmd_inspect_tree_stats(const struct cmd_struct *cmd,
 			"\tchanges unexpectedly, restart if needed or remount read-only", argv[optind]);
 	}
 
-	root = open_ctree(argv[optind], 0, 0);
+	root = open_ctree(argv[optind], 0,
+			  ctree_flags | OPEN_CTREE_LAZY_BLOCK_GROUPS);
 	if (!root) {
 		error("cannot open ctree");
 		exit(1);
 	}
+	fs_info = root->fs_info;
 
-	if (tree_id) {
-		pr_verbose(LOG_DEFAULT, "Calculating size of tree (%llu)\n", tree_id);
+	if (all_trees) {
+		ret = add_all_trees(fs_info, &trees, &nr_trees, false);
+	} else if (tree_id) {
 		key.objectid = tree_id;
 		key.offset = (u64)-1;
-		ret = calc_root_size(root, &key, 1, unit_mode);
-		goto out;
+		ret = add_root(fs_info, &trees, &nr_trees, &key, 1);
+	} else {
+		key.objectid = BTRFS_ROOT_TREE_OBJECTID;
+		ret = add_root(fs_info, &trees, &nr_trees, &key, 0);
+		key.objectid = BTRFS_EXTENT_TREE_OBJECTID;
+		if (!ret)
+			ret = add_root(fs_info, &trees, &nr_trees, &key, 0);
+		key.objectid = BTRFS_CSUM_TREE_OBJECTID;
+		if (!ret)
+			ret = add_root(fs_info, &trees, &nr_trees, &key, 0);
+		key.objectid = BTRFS_FS_TREE_OBJECTID;
+		key.offset = (u64)-1;
+		if (!ret)
+			ret = add_root(fs_info, &trees, &nr_trees, &key, 1);
 	}
-
-	pr_verbose(LOG_DEFAULT, "Calculating size of root tree\n");
-	key.objectid = BTRFS_ROOT_TREE_OBJECTID;
-	ret = calc_root_size(root, &key, 0, unit_mode);
-	if (ret)
+	if (ret < 0)
 		goto out;
 
-	pr_verbose(LOG_DEFAULT, "Calculating size of extent tree\n");
-	key.objectid = BTRFS_EXTENT_TREE_OBJECTID;
-	ret = calc_root_size(root, &key, 0, unit_mode);
-	if (ret)
+	for (int i = 0; i < nr_trees; i++) {
+		init_root_stats(&trees[i].stat, fs_info->nodesize);
+		trees[i].stat.lowest_bytenr = trees[i].bytenr;
+		trees[i].stat.highest_bytenr = trees[i].bytenr;
+		pthread_mutex_init(&trees[i].lock, NULL);
+	}
+	ret = walk_trees(fs_info, trees, nr_trees, nr_threads);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to walk the trees: %m");
 		goto out;
+	}
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_start(&fctx, tree_stats_rowspec, 24, 0);
+		fmt_print_start_group(&fctx, "tree-stats", JSON_TYPE_ARRAY);
+	}
+	for (int i = 0; i < nr_trees; i++) {
+		const char *name = tree_name(trees[i].objectid);
+
+		if (bconf.output_format == CMD_FORMAT_JSON) {
+			print_tree_stats_json(&fctx, &trees[i], name);
+			continue;
+		}
+		if (name && !tree_id)
+			pr_verbose(LOG_DEFAULT, "Calculating size of %s tree\n", name);
+		else
+			pr_verbose(LOG_DEFAULT, "Calculating size of tree (%llu)\n",
+				   trees[i].objectid);
+		print_tree_stats(&trees[i], unit_mode);
+	}
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_print_end_group(&fctx, "tree-stats");
+		fmt_end(&fctx);
+	}
+out:
+	for (int i = 0; i < nr_trees; i++) {
+		release_root_stats(&trees[i].stat);
+		pthread_mutex_destroy(&trees[i].lock);
+	}
+	free(trees);
+	close_ctree(root);
+	return !!ret;
+}
+DEFINE_COMMAND_WITH_FLAGS(inspect_tree_stats, "tree-stats", CMD_FORMAT_JSON);
+
+static const struct rowspec layout_report_rowspec[] = {
+	{ .key = "subvolid", .fmt = "%llu", .out_json = "subvolid" },
+	{ .key = "files", .fmt = "%llu", .out_json = "files" },
+	{ .key = "extents", .fmt = "%llu", .out_json = "extents" },
+	{ .key = "inline_extents", .fmt = "%llu", .out_json = "inline_extents" },
+	{ .key = "prealloc_extents", .fmt = "%llu", .out_json = "prealloc_extents" },
+	{ .key = "extent_bytes", .fmt = "%llu", .out_json = "extent_bytes" },
+	{ .key = "avg_extent_size", .fmt = "%llu", .out_json = "avg_extent_size" },
+	{ .key = "data_seeks", .fmt = "%llu", .out_json = "data_seeks" },
+	{ .key = "avg_seek_len", .fmt = "%llu", .out_json = "avg_seek_len" },
+	{ .key = "max_seek_len", .fmt = "%llu", .out_json = "max_seek_len" },
+	{ .key = "type", .fmt = "str", .out_json = "type" },
+	{ .key = "min", .fmt = "%llu", .out_json = "min" },
+	{ .key = "max", .fmt = "%llu", .out_json = "max" },
+	{ .key = "count", .fmt = "%llu", .out_json = "count" },
+	{ .key = "seek_min", .fmt = "%llu", .out_json = "min" },
+	{ .key = "seek_max", .fmt = "%llu", .out_json = "max" },
+	{ .key = "seek_count", .fmt = "%llu", .out_json = "count" },
+	ROWSPEC_END
+};
+
+/* Block groups of each type by the used part, in LAYOUT_FILL_BUCKETS */
+struct block_group_fill {
+	u64 type;
+	u64 count[LAYOUT_FILL_BUCKETS];
+};
+
+static void account_block_group_fill(struct btrfs_fs_info *fs_info,
+				     struct block_group_fill fill[3])
+{
+	const u64 types[3] = {
+		BTRFS_BLOCK_GROUP_DATA,
+		BTRFS_BLOCK_GROUP_METADATA,
+		BTRFS_BLOCK_GROUP_SYSTEM,
+	};
+	struct rb_node *n;
+
+	memset(fill, 0, 3 * sizeof(*fill));
+	for (int i = 0; i < 3; i++)
+		fill[i].type = types[i];
+	for (n = rb_first(&fs_info->block_group_cache_tree); n; n = rb_next(n)) {
+		struct btrfs_block_group *bg;
+		u64 bucket;
+
+		bg = rb_entry(n, struct btrfs_block_group, cache_node);
+		if (!bg->length)
+			continue;
+		bucket = min_t(u64, bg->used * LAYOUT_FILL_BUCKETS / bg->length,
+			       LAYOUT_FILL_BUCKETS - 1);
+		/* Mixed block groups are counted as data */
+		for (int i = 0; i < 3; i++) {
+			if (bg->flags & fill[i].type) {
+				fill[i].count[bucket]++;
+				break;
+			}
+		}
+	}
+}
+
+static void print_layout_report(struct tree_stats_tree *tree,
+				unsigned int unit_mode)
+{
+	struct root_stats *stat = &tree->stat;
+
+	pr_verbose(LOG_DEFAULT, "Subvolume %llu\n", tree->objectid);
+	pr_verbose(LOG_DEFAULT, "\tFiles with extents: %llu\n", stat->files);
+	pr_verbose(LOG_DEFAULT, "\tExtents: %llu\n", stat->file_extents);
+	pr_verbose(LOG_DEFAULT, "\t\tInline: %llu\n", stat->inline_extents);
+	pr_verbose(LOG_DEFAULT, "\t\tPreallocated: %llu\n", stat->prealloc_extents);
+	pr_verbose(LOG_DEFAULT, "\tExtent bytes: %s\n",
+		   pretty_size_mode(stat->extent_bytes, unit_mode));
+	pr_verbose(LOG_DEFAULT, "\t\tAvg extent size: %s\n",
+		   pretty_size_mode(stat->file_extents ?
+				    stat->extent_bytes / stat->file_extents : 0,
+				    unit_mode));
+	pr_verbose(LOG_DEFAULT, "\tExtents per file\n");
+	for (int i = 0; i < LAYOUT_FILE_BUCKETS; i++) {
+		if (!stat->file_hist[i])
+			continue;
+		pr_verbose(LOG_DEFAULT, "\t\t%llu - %llu: %llu\n", 1ULL << i,
+			   (2ULL << i) - 1, stat->file_hist[i]);
+	}
+	pr_verbose(LOG_DEFAULT, "\tData seeks: %llu\n", stat->data_seeks);
+	pr_verbose(LOG_DEFAULT, "\t\tAvg seek len: %s\n",
+		   pretty_size_mode(stat->data_seeks ?
+				    stat->data_seek_len / stat->data_seeks : 0,
+				    unit_mode));
+	print_seek_histogram(&stat->data_seek_root, stat->data_seeks,
+			     stat->max_data_seek_len);
+}
+
+static void print_layout_report_json(struct format_ctx *fctx,
+				     struct tree_stats_tree *tree)
+{
+	struct root_stats *stat = &tree->stat;
+
+	fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+	fmt_print(fctx, "subvolid", tree->objectid);
+	fmt_print(fctx, "files", stat->files);
+	fmt_print(fctx, "extents", stat->file_extents);
+	fmt_print(fctx, "inline_extents", stat->inline_extents);
+	fmt_print(fctx, "prealloc_extents", stat->prealloc_extents);
+	fmt_print(fctx, "extent_bytes", stat->extent_bytes);
+	fmt_print(fctx, "avg_extent_size", stat->file_extents ?
+		  stat->extent_bytes / stat->file_extents : 0);
+	fmt_print_start_group(fctx, "extents-per-file", JSON_TYPE_ARRAY);
+	for (int i = 0; i < LAYOUT_FILE_BUCKETS; i++) {
+		if (!stat->file_hist[i])
+			continue;
+		fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(fctx, "min", 1ULL << i);
+		fmt_print(fctx, "max", (2ULL << i) - 1);
+		fmt_print(fctx, "count", stat->file_hist[i]);
+		fmt_print_end_group(fctx, NULL);
+	}
+	fmt_print_end_group(fctx, "extents-per-file");
+	fmt_print(fctx, "data_seeks", stat->data_seeks);
+	fmt_print(fctx, "avg_seek_len", stat->data_seeks ?
+		  stat->data_seek_len / stat->data_seeks : 0);
+	fmt_print(fctx, "max_seek_len", stat->max_data_seek_len);
+	print_seek_histogram_json(fctx, &stat->data_seek_root);
+	fmt_print_end_group(fctx, NULL);
+}
+
+static void print_block_group_fill(struct format_ctx *fctx,
+				   const struct block_group_fill fill[3])
+{
+	const bool json = (bconf.output_format == CMD_FORMAT_JSON);
 
-	pr_verbose(LOG_DEFAULT, "Calculating size of csum tree\n");
-	key.objectid = BTRFS_CSUM_TREE_OBJECTID;
-	ret = calc_root_size(root, &key, 0, unit_mode);
-	if (ret)
+	if (json)
+		fmt_print_start_group(fctx, "block-group-fill", JSON_TYPE_ARRAY);
+	else
+		pr_verbose(LOG_DEFAULT, "Block group fill\n");
+	for (int i = 0; i < 3; i++) {
+		const char *type = btrfs_group_type_str(fill[i].type);
+
+		if (!json)
+			pr_verbose(LOG_DEFAULT, "\t%s\n", type);
+		for (int b = 0; b < LAYOUT_FILL_BUCKETS; b++) {
+			const u64 min = b * 100 / LAYOUT_FILL_BUCKETS;
+			const u64 max = (b + 1) * 100 / LAYOUT_FILL_BUCKETS;
+
+			if (!fill[i].count[b])
+				continue;
+			if (!json) {
+				pr_verbose(LOG_DEFAULT, "\t\t%3llu%% - %3llu%%: %llu\n",
+					   min, max, fill[i].count[b]);
+				continue;
+			}
+			fmt_print_start_group(fctx, NULL, JSON_TYPE_MAP);
+			fmt_print(fctx, "type", type);
+			fmt_print(fctx, "min", min);
+			fmt_print(fctx, "max", max);
+			fmt_print(fctx, "count", fill[i].count[b]);
+			fmt_print_end_group(fctx, NULL);
+		}
+	}
+	if (json)
+		fmt_print_end_group(fctx, "block-group-fill");
+}
+
+static const char * const cmd_inspect_layout_report_usage[] = {
+	"btrfs inspect-internal layout-report [options] <device>",
+	"Print the fragmentation of the files of each subvolume and the block group fill",
+	"The file extents are read from the subvolume trees, the files are not",
+	"opened and no FIEMAP is used.",
+	"",
+	OPTLINE("-b", "raw numbers in bytes"),
+	HELPINFO_UNITS_LONG,
+	OPTLINE("-t <subvolid>", "report only the given subvolume"),
+	OPTLINE("--threads <num>", "number of threads walking the trees, 0 to walk them in the main thread, default: number of CPUs"),
+	OPTLINE("--mmap", "map the image files instead of reading the tree blocks, the tool is killed by SIGBUS if an image is truncated or fails to read"),
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_FORMAT,
+	NULL
+};
+
+static int cmd_inspect_layout_report(const struct cmd_struct *cmd,
+				     int argc, char **argv)
+{
+	struct btrfs_key key = { .type = BTRFS_ROOT_ITEM_KEY, .offset = (u64)-1 };
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_root *root;
+	struct tree_stats_tree *trees = NULL;
+	struct block_group_fill fill[3];
+	struct format_ctx fctx;
+	unsigned int unit_mode;
+	unsigned int nr_threads = (unsigned int)-1;
+	unsigned int ctree_flags = 0;
+	int nr_trees = 0;
+	int ret = 0;
+	u64 subvolid = 0;
+
+	unit_mode = get_unit_mode_from_arg(&argc, argv, 0);
+
+	optind = 0;
+	while (1) {
+		enum { GETOPT_VAL_THREADS = GETOPT_VAL_FIRST, GETOPT_VAL_MMAP };
+		static const struct option long_options[] = {
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "mmap", no_argument, NULL, GETOPT_VAL_MMAP },
+			{ NULL, 0, NULL, 0 }
+		};
+		int opt = getopt_long(argc, argv, "bt:", long_options, NULL);
+		u64 tmp;
+
+		if (opt < 0)
+			break;
+		switch (opt) {
+		case 'b':
+			unit_mode = UNITS_RAW;
+			break;
+		case 't':
+			subvolid = arg_strtou64(optarg);
+			if (!is_fstree(subvolid)) {
+				error("not a subvolume id: %s", optarg);
+				exit(1);
+			}
+			break;
+		case GETOPT_VAL_THREADS:
+			tmp = arg_strtou64(optarg);
+			if (tmp > TREE_STATS_MAX_THREADS) {
+				error("number of threads out of range: %llu > %u",
+				      tmp, TREE_STATS_MAX_THREADS);
+				return 1;
+			}
+			nr_threads = tmp;
+			break;
+		case GETOPT_VAL_MMAP:
+			ctree_flags |= OPEN_CTREE_MMAP;
+			break;
+		default:
+			usage_unknown_option(cmd, argv);
+		}
+	}
+
+	if (check_argc_exact(argc - optind, 1))
+		return 1;
+
+	if (nr_threads == (unsigned int)-1) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nr_threads = nr_cpus > 1 ? min_t(long, nr_cpus,
+						 TREE_STATS_MAX_THREADS) : 0;
+	}
+
+	ret = check_mounted(argv[optind]);
+	if (ret < 0) {
+		errno = -ret;
+		warning("unable to check mount status of: %m");
+	} else if (ret) {
+		warning("%s already mounted, layout-report accesses the block devices directly, this may\n"
+			"\tresult in inaccurate numbers, various errors or it may crash if the filesystem\n"
+			"\tchanges unexpectedly, restart if needed or remount read-only", argv[optind]);
+	}
+
+	/* The block groups are read for their fill */
+	root = open_ctree(argv[optind], 0, ctree_flags);
+	if (!root) {
+		error("cannot open ctree");
+		exit(1);
+	}
+	fs_info = root->fs_info;
+
+	if (subvolid) {
+		key.objectid = subvolid;
+		ret = add_root(fs_info, &trees, &nr_trees, &key, 1);
+	} else {
+		ret = add_all_trees(fs_info, &trees, &nr_trees, true);
+	}
+	if (ret < 0)
 		goto out;
 
-	key.objectid = BTRFS_FS_TREE_OBJECTID;
-	key.offset = (u64)-1;
-	pr_verbose(LOG_DEFAULT, "Calculating size of fs tree\n");
-	ret = calc_root_size(root, &key, 1, unit_mode);
-	if (ret)
+	for (int i = 0; i < nr_trees; i++) {
+		init_root_stats(&trees[i].stat, fs_info->nodesize);
+		trees[i].find_data = 1;
+		pthread_mutex_init(&trees[i].lock, NULL);
+	}
+	ret = walk_trees(fs_info, trees, nr_trees, nr_threads);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to walk the trees: %m");
 		goto out;
+	}
+	for (int i = 0; i < nr_trees; i++)
+		merge_file_edges(&trees[i].stat);
+	account_block_group_fill(fs_info, fill);
+
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		fmt_start(&fctx, layout_report_rowspec, 24, 0);
+		fmt_print_start_group(&fctx, "subvolumes", JSON_TYPE_ARRAY);
+		for (int i = 0; i < nr_trees; i++)
+			print_layout_report_json(&fctx, &trees[i]);
+		fmt_print_end_group(&fctx, "subvolumes");
+		print_block_group_fill(&fctx, fill);
+		fmt_end(&fctx);
+	} else {
+		for (int i = 0; i < nr_trees; i++)
+			print_layout_report(&trees[i], unit_mode);
+		print_block_group_fill(NULL, fill);
+	}
 out:
+	for (int i = 0; i < nr_trees; i++) {
+		release_root_stats(&trees[i].stat);
+		pthread_mutex_destroy(&trees[i].lock);
+	}
+	free(trees);
 	close_ctree(root);
-	return ret;
+	return !!ret;
 }
-DEFINE_SIMPLE_COMMAND(inspect_tree_stats, "tree-stats");
+DEFINE_COMMAND_WITH_FLAGS(inspect_layout_report, "layout-report", CMD_FORMAT_JSON);
@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <ctype.h>
 #include <dirent.h>
 #include <string.h>
 #include <unistd.h>
@@ -48,6 +49,8 @@
 #include "common/string-table.h"
 #include "common/sort-utils.h"
 #include "common/tree-search.h"
+#include "common/rbtree-utils.h"
+#include "common/format-output.h"
 #include "cmds/commands.h"
 
 static const char * const inspect_cmd_group_usage[] = {
@@ -55,37 +58,59 @@ static const char * const inspect_cmd_group_usage[] = {
 	NULL
 };
 
-static int __ino_to_path_fd(u64 inum, int fd, const char *prepend)
+/*
+ * Read the paths of inode @inum in the subvolume of @fd to @fspath of @size
+ * bytes.  Return 0 or a negative errno.
+ */
+static int ino_to_paths(u64 inum, int fd, struct btrfs_data_container *fspath,
+			u64 size)
 {
 	int ret;
-	int i;
 	struct btrfs_ioctl_ino_path_args ipa;
-	char pathbuf[PATH_MAX];
-	struct btrfs_data_container *fspath = (struct btrfs_data_container *)pathbuf;
 
 	memset(fspath, 0, sizeof(*fspath));
 	ipa.inum = inum;
-	ipa.size = PATH_MAX;
+	ipa.size = size;
 	ipa.fspath = ptr_to_u64(fspath);
 
 	ret = ioctl(fd, BTRFS_IOC_INO_PATHS, &ipa);
-	if (ret < 0) {
-		error("ino paths ioctl: %m");
-		goto out;
-	}
+	if (ret < 0)
+		return -errno;
 
 	pr_verbose(LOG_DEBUG,
 	"ioctl ret=%d, bytes_left=%lu, bytes_missing=%lu cnt=%d, missed=%d\n",
 		   ret, (unsigned long)fspath->bytes_left,
 		   (unsigned long)fspath->bytes_missing, fspath->elem_cnt,
 		   fspath->elem_missed);
+	return 0;
+}
+
+static const char *fspath_elem(const struct btrfs_data_container *fspath, int i)
+{
+	u64 ptr;
+
+	ptr = (u64)(unsigned long)fspath->val;
+	ptr += fspath->val[i];
+	return (const char *)(unsigned long)ptr;
+}
+
+static int __ino_to_path_fd(u64 inum, int fd, const char *prepend)
+{
+	int ret;
+	int i;
+	char pathbuf[PATH_MAX];
+	struct btrfs_data_container *fspath = (struct btrfs_data_container *)pathbuf;
+
+	ret = ino_to_paths(inum, fd, fspath, PATH_MAX);
+	if (ret < 0) {
+		errno = -ret;
+		error("ino paths ioctl: %m");
+		goto out;
+	}
 
 	for (i = 0; i < fspath->elem_cnt; ++i) {
-		u64 ptr;
-		char *str;
-		ptr = (u64)(unsigned long)fspath->val;
-		ptr += fspath->val[i];
-		str = (char *)(unsigned long)ptr;
+		const char *str = fspath_elem(fspath, i);
+
 		if (prepend)
 			pr_verbose(LOG_DEFAULT, "%s/%s\n", prepend, str);
 		else
@@ -96,10 +121,484 @@ out:
 	return !!ret;
 }
 
+/*
+ * Batch mode of logical-resolve and inode-resolve (--stdin).  The numbers are
+ * read from standard input, sorted and deduplicated, and the results are
+ * printed as JSON lines.  The subvolumes and the paths of the inodes are
+ * resolved once and cached for all the queries.
+ */
+
+/* Subvolume of a logical-resolve batch */
+struct resolve_subvol {
+	struct rb_node node;
+	u64 root;
+	/* Open directory of the subvolume, or -1 */
+	int fd;
+	/* Path of the subvolume in the mounted filesystem */
+	char *path;
+	/* Reason why the subvolume cannot be accessed */
+	const char *error;
+};
+
+/* Paths of an inode of a logical-resolve batch */
+struct resolve_inode {
+	struct rb_node node;
+	u64 root;
+	u64 inum;
+	/* Negative errno of the path lookup */
+	int error;
+	int nr_paths;
+	/* Paths relative to the subvolume, each NUL terminated */
+	char *paths;
+};
+
+struct resolve_batch {
+	int fd;
+	const char *path;
+	struct rb_root subvols;
+	struct rb_root inodes;
+	struct btrfs_data_container *fspath;
+};
+
+/*
+ * Parse the number of one line of the batch input.  A line that does not
+ * start with a number is searched for @keyword followed by a number, so the
+ * kernel messages of scrub can be used as the input directly.
+ */
+static bool parse_batch_line(const char *line, const char *keyword, u64 *value)
+{
+	const char *p = line;
+	char *end;
+
+	while (isspace((unsigned char)*p))
+		p++;
+	if (!isdigit((unsigned char)*p)) {
+		p = strstr(line, keyword);
+		if (!p)
+			return false;
+		p += strlen(keyword);
+		if (!isdigit((unsigned char)*p))
+			return false;
+	}
+	errno = 0;
+	if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X'))
+		*value = strtoull(p, &end, 16);
+	else
+		*value = strtoull(p, &end, 10);
+	if (errno)
+		return false;
+	return (*end == 0 || isspace((unsigned char)*end) ||
+		ispunct((unsigned char)*end));
+}
+
+static int read_batch_input(const char *keyword, u64 **values_ret,
+			    size_t *nr_ret)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	u64 *values = NULL;
+	size_t nr = 0;
+	size_t alloc = 0;
+	size_t lineno = 0;
+	size_t i, j;
+
+	while (getline(&line, &line_size, stdin) >= 0) {
+		u64 value;
+
+		lineno++;
+		if (!parse_batch_line(line, keyword, &value)) {
+			pr_verbose(LOG_INFO, "skipping line %zu without a number\n",
+				   lineno);
+			continue;
+		}
+		if (nr == alloc) {
+			u64 *tmp;
+
+			alloc = max_t(size_t, 1024, alloc * 2);
+			tmp = realloc(values, alloc * sizeof(*values));
+			if (!tmp) {
+				free(values);
+				free(line);
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				return -ENOMEM;
+			}
+			values = tmp;
+		}
+		values[nr++] = value;
+	}
+	free(line);
+
+	radix_sort_u64(values, nr, sizeof(*values), 0);
+	for (i = 0, j = 0; i < nr; i++) {
+		if (j == 0 || values[j - 1] != values[i])
+			values[j++] = values[i];
+	}
+	pr_verbose(LOG_INFO, "%zu unique numbers read from %zu lines\n", j, lineno);
+
+	*values_ret = values;
+	*nr_ret = j;
+	return 0;
+}
+
+static void print_jsonl_escaped(const char *str)
+{
+	char buf[256 * FMT_JSON_ESCAPE_MAX];
+	size_t len = strlen(str);
+
+	while (len) {
+		size_t chunk = min_t(size_t, len, 256);
+
+		fwrite(buf, 1, fmt_escape_json(buf, str, chunk), stdout);
+		str += chunk;
+		len -= chunk;
+	}
+}
+
+static void print_jsonl_path(const char *prepend, const char *str)
+{
+	fputs(",\"path\":\"", stdout);
+	print_jsonl_escaped(prepend);
+	putchar('/');
+	print_jsonl_escaped(str);
+	putchar('"');
+}
+
+static void print_jsonl_error(const char *msg)
+{
+	fputs(",\"error\":\"", stdout);
+	print_jsonl_escaped(msg);
+	putchar('"');
+}
+
+static int cmp_resolve_subvol(const struct rb_node *node, const void *key)
+{
+	const struct resolve_subvol *subvol;
+	u64 root = *(const u64 *)key;
+
+	subvol = rb_entry(node, struct resolve_subvol, node);
+	return (subvol->root < root ? -1 : subvol->root > root ? 1 : 0);
+}
+
+static int cmp_resolve_subvol_nodes(const struct rb_node *node1,
+				    const struct rb_node *node2)
+{
+	const struct resolve_subvol *subvol;
+
+	subvol = rb_entry(node2, struct resolve_subvol, node);
+	return cmp_resolve_subvol(node1, &subvol->root);
+}
+
+static void free_resolve_subvol(struct rb_node *node)
+{
+	struct resolve_subvol *subvol;
+
+	subvol = rb_entry(node, struct resolve_subvol, node);
+	if (subvol->fd >= 0)
+		close(subvol->fd);
+	free(subvol->path);
+	free(subvol);
+}
+FREE_RB_BASED_TREE(resolve_subvol, free_resolve_subvol);
+
+struct resolve_inode_key {
+	u64 root;
+	u64 inum;
+};
+
+static int cmp_resolve_inode(const struct rb_node *node, const void *key)
+{
+	const struct resolve_inode *inode;
+	const struct resolve_inode_key *ikey = key;
+
+	inode = rb_entry(node, struct resolve_inode, node);
+	if (inode->root != ikey->root)
+		return (inode->root < ikey->root ? -1 : 1);
+	return (inode->inum < ikey->inum ? -1 : inode->inum > ikey->inum ? 1 : 0);
+}
+
+static int cmp_resolve_inode_nodes(const struct rb_node *node1,
+				   const struct rb_node *node2)
+{
+	const struct resolve_inode *inode;
+	struct resolve_inode_key key;
+
+	inode = rb_entry(node2, struct resolve_inode, node);
+	key.root = inode->root;
+	key.inum = inode->inum;
+	return cmp_resolve_inode(node1, &key);
+}
+
+static void free_resolve_inode(struct rb_node *node)
+{
+	struct resolve_inode *inode;
+
+	inode = rb_entry(node, struct resolve_inode, node);
+	free(inode->paths);
+	free(inode);
+}
+FREE_RB_BASED_TREE(resolve_inode, free_resolve_inode);
+
+/*
+ * Find the mount path of subvolume @root and open it, the same way as the
+ * single logical-resolve.  Failures are recorded in the subvolume and
+ * reported for each of its inodes.
+ */
+static struct resolve_subvol *resolve_batch_subvol(struct resolve_batch *batch,
+						   u64 root)
+{
+	struct resolve_subvol *subvol;
+	struct rb_node *node;
+	char name[PATH_MAX];
+	int ret;
+
+	node = rb_search(&batch->subvols, &root, cmp_resolve_subvol, NULL);
+	if (node)
+		return rb_entry(node, struct resolve_subvol, node);
+
+	subvol = calloc(1, sizeof(*subvol));
+	if (!subvol) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	subvol->root = root;
+	subvol->fd = -1;
+
+	ret = btrfs_subvolid_resolve(batch->fd, name, sizeof(name), root);
+	if (ret < 0) {
+		subvol->error = "cannot resolve subvolume";
+	} else if (name[0] == 0) {
+		subvol->fd = dup(batch->fd);
+		subvol->path = strdup(batch->path);
+		if (subvol->fd < 0)
+			subvol->error = "cannot open subvolume";
+	} else {
+		char *mounted = NULL;
+		char subvol_path[PATH_MAX];
+		char subvolid[PATH_MAX];
+
+		/* See cmd_inspect_logical_resolve() */
+		snprintf(subvol_path, PATH_MAX, "/%s", name);
+		snprintf(subvolid, PATH_MAX, "%llu", root);
+
+		ret = find_mount_fsroot(subvol_path, subvolid, &mounted);
+		if (ret) {
+			subvol->error = "failed to parse mountinfo";
+		} else if (!mounted) {
+			subvol->error = "not mounted";
+		} else {
+			subvol->path = mounted;
+			subvol->fd = btrfs_open_dir(mounted);
+			if (subvol->fd < 0)
+				subvol->error = "cannot open subvolume";
+		}
+	}
+	if (!subvol->error && !subvol->path) {
+		free_resolve_subvol(&subvol->node);
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	rb_insert(&batch->subvols, &subvol->node, cmp_resolve_subvol_nodes);
+	return subvol;
+}
+
+static struct resolve_inode *resolve_batch_inode(struct resolve_batch *batch,
+						 struct resolve_subvol *subvol,
+						 u64 inum)
+{
+	struct resolve_inode_key key = { .root = subvol->root, .inum = inum };
+	struct resolve_inode *inode;
+	struct rb_node *node;
+	size_t len = 0;
+	int i;
+
+	node = rb_search(&batch->inodes, &key, cmp_resolve_inode, NULL);
+	if (node)
+		return rb_entry(node, struct resolve_inode, node);
+
+	inode = calloc(1, sizeof(*inode));
+	if (!inode) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	inode->root = subvol->root;
+	inode->inum = inum;
+	inode->error = ino_to_paths(inum, subvol->fd, batch->fspath, PATH_MAX);
+	if (!inode->error) {
+		for (i = 0; i < batch->fspath->elem_cnt; i++)
+			len += strlen(fspath_elem(batch->fspath, i)) + 1;
+		inode->paths = malloc(len + 1);
+		if (!inode->paths) {
+			free(inode);
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return NULL;
+		}
+		len = 0;
+		for (i = 0; i < batch->fspath->elem_cnt; i++) {
+			const char *str = fspath_elem(batch->fspath, i);
+
+			strcpy(inode->paths + len, str);
+			len += strlen(str) + 1;
+		}
+		inode->nr_paths = batch->fspath->elem_cnt;
+	}
+	rb_insert(&batch->inodes, &inode->node, cmp_resolve_inode_nodes);
+	return inode;
+}
+
+/*
+ * Print the results of one reference of a logical address, return 1 if it
+ * could not be resolved, or a negative errno.
+ */
+static int print_logical_ref_jsonl(struct resolve_batch *batch, u64 logical,
+				   u64 inum, u64 offset, u64 root, bool getpath)
+{
+	struct resolve_subvol *subvol;
+	struct resolve_inode *inode;
+	const char *str;
+	int i;
+
+	if (!getpath) {
+		printf("{\"logical\":%llu,\"inode\":%llu,\"offset\":%llu,\"root\":%llu}\n",
+		       logical, inum, offset, root);
+		return 0;
+	}
+
+	subvol = resolve_batch_subvol(batch, root);
+	if (!subvol)
+		return -ENOMEM;
+	if (subvol->error) {
+		printf("{\"logical\":%llu,\"inode\":%llu,\"offset\":%llu,\"root\":%llu",
+		       logical, inum, offset, root);
+		print_jsonl_error(subvol->error);
+		fputs("}\n", stdout);
+		return 1;
+	}
+	inode = resolve_batch_inode(batch, subvol, inum);
+	if (!inode)
+		return -ENOMEM;
+	if (inode->error) {
+		printf("{\"logical\":%llu,\"inode\":%llu,\"offset\":%llu,\"root\":%llu",
+		       logical, inum, offset, root);
+		print_jsonl_error(strerror(-inode->error));
+		fputs("}\n", stdout);
+		return 1;
+	}
+	for (i = 0, str = inode->paths; i < inode->nr_paths;
+	     i++, str += strlen(str) + 1) {
+		printf("{\"logical\":%llu,\"inode\":%llu,\"offset\":%llu,\"root\":%llu",
+		       logical, inum, offset, root);
+		print_jsonl_path(subvol->path, str);
+		fputs("}\n", stdout);
+	}
+	return 0;
+}
+
+static int logical_resolve_batch(int fd, const char *path, bool getpath,
+				 struct btrfs_data_container *inodes, u64 size,
+				 u64 flags, unsigned long request)
+{
+	struct resolve_batch batch = {
+		.fd = fd,
+		.path = path,
+		.subvols = RB_ROOT,
+		.inodes = RB_ROOT,
+	};
+	char pathbuf[PATH_MAX];
+	u64 *logicals;
+	size_t nr;
+	size_t i;
+	int failed = 0;
+	int ret;
+
+	ret = read_batch_input("logical ", &logicals, &nr);
+	if (ret < 0)
+		return ret;
+	batch.fspath = (struct btrfs_data_container *)pathbuf;
+
+	for (i = 0; i < nr; i++) {
+		struct btrfs_ioctl_logical_ino_args loi = { 0 };
+		int j;
+
+		memset(inodes, 0, sizeof(*inodes));
+		loi.logical = logicals[i];
+		loi.size = size;
+		loi.flags = flags;
+		loi.inodes = ptr_to_u64(inodes);
+
+		ret = ioctl(fd, request, &loi);
+		if (ret < 0) {
+			printf("{\"logical\":%llu", logicals[i]);
+			print_jsonl_error(strerror(errno));
+			fputs("}\n", stdout);
+			failed++;
+			continue;
+		}
+		if (inodes->elem_missed)
+			warning("logical %llu: %u references did not fit the buffer",
+				logicals[i], inodes->elem_missed / 3);
+
+		for (j = 0; j < inodes->elem_cnt; j += 3) {
+			ret = print_logical_ref_jsonl(&batch, logicals[i],
+						      inodes->val[j],
+						      inodes->val[j + 1],
+						      inodes->val[j + 2], getpath);
+			if (ret < 0)
+				goto out;
+			failed += ret;
+		}
+	}
+	ret = 0;
+out:
+	free_resolve_subvol_tree(&batch.subvols);
+	free_resolve_inode_tree(&batch.inodes);
+	free(logicals);
+	if (ret < 0)
+		return ret;
+	return !!failed;
+}
+
+static int inode_resolve_batch(int fd, const char *path)
+{
+	char pathbuf[PATH_MAX];
+	struct btrfs_data_container *fspath = (struct btrfs_data_container *)pathbuf;
+	u64 *inums;
+	size_t nr;
+	size_t i;
+	int failed = 0;
+	int ret;
+
+	ret = read_batch_input("inode ", &inums, &nr);
+	if (ret < 0)
+		return ret;
+
+	for (i = 0; i < nr; i++) {
+		int j;
+
+		ret = ino_to_paths(inums[i], fd, fspath, PATH_MAX);
+		if (ret < 0) {
+			printf("{\"inode\":%llu", inums[i]);
+			print_jsonl_error(strerror(-ret));
+			fputs("}\n", stdout);
+			failed++;
+			continue;
+		}
+		for (j = 0; j < fspath->elem_cnt; j++) {
+			printf("{\"inode\":%llu", inums[i]);
+			print_jsonl_path(path, fspath_elem(fspath, j));
+			fputs("}\n", stdout);
+		}
+	}
+	free(inums);
+	return !!failed;
+}
+
 static const char * const cmd_inspect_inode_resolve_usage[] = {
-	"btrfs inspect-internal inode-resolve [-v] <inode> <path>",
+	"btrfs inspect-internal inode-resolve [-v] <inode> <path>\n"
+	"btrfs inspect-internal inode-resolve --stdin <path>",
 	"Get file system paths for the given inode",
 	"",
+	OPTLINE("--stdin", "read the inode numbers from standard input, one per line, "
+		"and print the paths as JSON lines"),
 	OPTLINE("-v", "deprecated, alias for global -v option"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
@@ -111,10 +610,18 @@ static int cmd_inspect_inode_resolve(const struct cmd_struct *cmd,
 {
 	int fd;
 	int ret;
+	bool batch = false;
 
 	optind = 0;
 	while (1) {
-		int c = getopt(argc, argv, "v");
+		int c;
+		enum { GETOPT_VAL_STDIN = GETOPT_VAL_FIRST };
+		static const struct option long_options[] = {
+			{ "stdin", no_argument, NULL, GETOPT_VAL_STDIN },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "v", long_options, NULL);
 		if (c < 0)
 			break;
 
@@ -122,14 +629,26 @@ static int cmd_inspect_inode_resolve(const struct cmd_struct *cmd,
 		case 'v':
 			bconf_be_verbose();
 			break;
+		case GETOPT_VAL_STDIN:
+			batch = true;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
 	}
 
-	if (check_argc_exact(argc - optind, 2))
+	if (check_argc_exact(argc - optind, batch ? 1 : 2))
 		return 1;
 
+	if (batch) {
+		fd = btrfs_open_dir(argv[optind]);
+		if (fd < 0)
+			return 1;
+		ret = inode_resolve_batch(fd, argv[optind]);
+		close(fd);
+		return !!ret;
+	}
+
 	fd = btrfs_open_dir(argv[optind + 1]);
 	if (fd < 0)
 		return 1;
@@ -142,9 +661,12 @@ static int cmd_inspect_inode_resolve(const struct cmd_struct *cmd,
 static DEFINE_SIMPLE_COMMAND(inspect_inode_resolve, "inode-resolve");
 
 static const char * const cmd_inspect_logical_resolve_usage[] = {
-	"btrfs inspect-internal logical-resolve [-Pvo] [-s bufsize] <logical> <path>",
+	"btrfs inspect-internal logical-resolve [-Pvo] [-s bufsize] <logical> <path>\n"
+	"btrfs inspect-internal logical-resolve [-Po] [-s bufsize] --stdin <path>",
 	"Get file system paths for the given logical address",
 	"",
+	OPTLINE("--stdin", "read the logical addresses from standard input, one per line, "
+		"and print the results as JSON lines"),
 	OPTLINE("-P", "skip the path resolving and print the inodes instead"),
 	OPTLINE("-o", "ignore offsets when matching references (requires v2 ioctl support in the kernel 4.15+)"),
 	OPTLINE("-s bufsize", "set inode container's size. This is used to increase inode "
@@ -172,14 +694,26 @@ static int cmd_inspect_logical_resolve(const struct cmd_struct *cmd,
 	char *path_ptr;
 	u64 flags = 0;
 	unsigned long request = BTRFS_IOC_LOGICAL_INO;
+	bool batch = false;
+	const char *path;
 
 	optind = 0;
 	while (1) {
-		int c = getopt(argc, argv, "Pvos:");
+		int c;
+		enum { GETOPT_VAL_STDIN = GETOPT_VAL_FIRST };
+		static const struct option long_options[] = {
+			{ "stdin", no_argument, NULL, GETOPT_VAL_STDIN },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "Pvos:", long_options, NULL);
 		if (c < 0)
 			break;
 
 		switch (c) {
+		case GETOPT_VAL_STDIN:
+			batch = true;
+			break;
 		case 'P':
 			getpath = false;
 			break;
@@ -197,8 +731,9 @@ static int cmd_inspect_logical_resolve(const struct cmd_struct *cmd,
 		}
 	}
 
-	if (check_argc_exact(argc - optind, 2))
+	if (check_argc_exact(argc - optind, batch ? 1 : 2))
 		return 1;
+	path = argv[optind + (batch ? 0 : 1)];
 
 	size = min(size, (u64)SZ_16M);
 	inodes = malloc(size);
@@ -208,18 +743,24 @@ static int cmd_inspect_logical_resolve(const struct cmd_struct *cmd,
 	if (size > SZ_64K || flags != 0)
 		request = BTRFS_IOC_LOGICAL_INO_V2;
 
+	fd = btrfs_open_dir(path);
+	if (fd < 0) {
+		ret = 12;
+		goto out;
+	}
+
+	if (batch) {
+		ret = logical_resolve_batch(fd, path, getpath, inodes, size,
+					    flags, request);
+		goto out;
+	}
+
 	memset(inodes, 0, sizeof(*inodes));
 	loi.logical = arg_strtou64(argv[optind]);
 	loi.size = size;
 	loi.flags = flags;
 	loi.inodes = ptr_to_u64(inodes);
 
-	fd = btrfs_open_dir(argv[optind + 1]);
-	if (fd < 0) {
-		ret = 12;
-		goto out;
-	}
-
 	ret = ioctl(fd, request, &loi);
 	if (ret < 0) {
 		error("logical ino ioctl: %m");
@@ -233,7 +774,7 @@ static int cmd_inspect_logical_resolve(const struct cmd_struct *cmd,
 		   inodes->elem_missed);
 
 	bytes_left = sizeof(full_path);
-	ret = snprintf(full_path, bytes_left, "%s/", argv[optind+1]);
+	ret = snprintf(full_path, bytes_left, "%s/", path);
 	path_ptr = full_path + ret;
 	bytes_left -= ret + 1;
 	if (bytes_left < 0) {
@@ -716,6 +1257,8 @@ struct list_chunks_entry {
 	u64 lnumber;
 	u64 used;
 	u64 pnumber;
+	/* Used part of the length scaled to 2^53, the sort key of usage */
+	u64 usage;
 };
 
 struct list_chunks_ctx {
@@ -724,87 +1267,6 @@ struct list_chunks_ctx {
 	struct list_chunks_entry *stats;
 };
 
-static int cmp_cse_devid(const void *va, const void *vb)
-{
-	const struct list_chunks_entry *a = va;
-	const struct list_chunks_entry *b = vb;
-
-	if (a->devid < b->devid)
-		return -1;
-	if (a->devid > b->devid)
-		return 1;
-	return 0;
-}
-
-static int cmp_cse_devid_pstart(const void *va, const void *vb)
-{
-	const struct list_chunks_entry *a = va;
-	const struct list_chunks_entry *b = vb;
-
-	if (a->devid < b->devid)
-		return -1;
-	if (a->devid > b->devid)
-		return 1;
-
-	if (a->start < b->start)
-		return -1;
-	if (a->start == b->start)
-		return 0;
-	return 1;
-}
-
-static int cmp_cse_pstart(const void *va, const void *vb)
-{
-	const struct list_chunks_entry *a = va;
-	const struct list_chunks_entry *b = vb;
-
-	if (a->start < b->start)
-		return -1;
-	if (a->start == b->start)
-		return 0;
-	return 1;
-}
-
-static int cmp_cse_lstart(const void *va, const void *vb)
-{
-	const struct list_chunks_entry *a = va;
-	const struct list_chunks_entry *b = vb;
-
-	if (a->lstart < b->lstart)
-		return -1;
-	if (a->lstart == b->lstart)
-		return 0;
-	return 1;
-}
-
-/* Compare entries by usage percent, descending. */
-static int cmp_cse_usage(const void *va, const void *vb)
-{
-	const struct list_chunks_entry *a = va;
-	const struct list_chunks_entry *b = vb;
-	const float usage_a = (float)a->used / a->length * 100;
-	const float usage_b = (float)b->used / b->length * 100;
-	const float epsilon = 1e-8;
-
-	if (usage_b - usage_a < epsilon)
-		return 1;
-	if (usage_a - usage_b < epsilon)
-		return -1;
-	return 0;
-}
-
-static int cmp_cse_length(const void *va, const void *vb)
-{
-	const struct list_chunks_entry *a = va;
-	const struct list_chunks_entry *b = vb;
-
-	if (a->length < b->length)
-		return -1;
-	if (a->length > b->length)
-		return 1;
-	return 0;
-}
-
 static int print_list_chunks(struct list_chunks_ctx *ctx, const char *sortmode,
 			     unsigned unit_mode)
 {
@@ -822,31 +1284,40 @@ static int print_list_chunks(struct list_chunks_ctx *ctx, const char *sortmode,
 		CHUNK_SORT_LENGTH,
 		CHUNK_SORT_DEFAULT = CHUNK_SORT_PSTART
 	};
+	/* The keys are found by their id, the comparators are not used */
 	static const struct sortdef sortit[] = {
-		{ .name = "devid", .comp = (sort_cmp_t)cmp_cse_devid,
+		{ .name = "devid",
 		  .desc = "sort by device id (default, with pstart)",
 		  .id = CHUNK_SORT_PSTART
 		},
-		{ .name = "pstart", .comp = (sort_cmp_t)cmp_cse_pstart,
+		{ .name = "pstart",
 		  .desc = "sort by physical start offset",
 		  .id = CHUNK_SORT_PSTART
 		},
-		{ .name = "lstart", .comp = (sort_cmp_t)cmp_cse_lstart,
+		{ .name = "lstart",
 		  .desc = "sort by logical offset",
 		  .id = CHUNK_SORT_LSTART
 		},
-		{ .name = "usage", .comp = (sort_cmp_t)cmp_cse_usage,
+		{ .name = "usage",
 		  .desc = "sort by chunk usage",
 		  .id = CHUNK_SORT_USAGE
 		},
-		{ .name = "length", .comp = (sort_cmp_t)cmp_cse_length,
+		{ .name = "length",
 		  .desc = "sort by length",
 		  .id = CHUNK_SORT_LENGTH
 		},
 		SORTDEF_END
 	};
+	static const size_t sort_offsets[] = {
+		[CHUNK_SORT_PSTART] = offsetof(struct list_chunks_entry, devid),
+		[CHUNK_SORT_LSTART] = offsetof(struct list_chunks_entry, lstart),
+		[CHUNK_SORT_USAGE] = offsetof(struct list_chunks_entry, usage),
+		[CHUNK_SORT_LENGTH] = offsetof(struct list_chunks_entry, length),
+	};
 	const char *tmp;
 	struct compare comp;
+	int ids[SORT_MAX_KEYS];
+	int nr_ids = 0;
 	int id;
 
 	compare_init(&comp, sortit);
@@ -858,14 +1329,22 @@ static int print_list_chunks(struct list_chunks_ctx *ctx, const char *sortmode,
 			error("unknown sort key: %s", tmp);
 			return 1;
 		}
-		compare_add_sort_id(&comp, id);
+		if (id >= 0) {
+			if (nr_ids == SORT_MAX_KEYS) {
+				error("too many sort keys, at most %d", SORT_MAX_KEYS);
+				return 1;
+			}
+			ids[nr_ids++] = id;
+		}
 	} while (id >= 0);
 
 	/*
 	 * Chunks are sorted logically as found by the ioctl, we need to sort
 	 * them once to find the physical ordering. This is the default mode.
 	 */
-	qsort(ctx->stats, ctx->length, sizeof(ctx->stats[0]), cmp_cse_devid_pstart);
+	radix_sort_u64_pair(ctx->stats, ctx->length, sizeof(ctx->stats[0]),
+			    offsetof(struct list_chunks_entry, devid),
+			    offsetof(struct list_chunks_entry, start));
 	devid = 0;
 	number = 0;
 	for (i = 0; i < ctx->length; i++) {
@@ -875,16 +1354,25 @@ static int print_list_chunks(struct list_chunks_ctx *ctx, const char *sortmode,
 			number = 0;
 		}
 		ctx->stats[i].pnumber = number++;
+		ctx->stats[i].usage = e.length ?
+			(u64)((double)e.used / e.length * (1ULL << 53)) : 0;
 	}
 
-	/* Skip additional sort if nothing defined by user. */
-	if (comp.count > 0)
-		qsort_r(ctx->stats, ctx->length, sizeof(ctx->stats[0]),
-			(sort_r_cmp_t)compare_cmp_multi, &comp);
+	/*
+	 * The sort is stable, sorting by the keys from the last one gives the
+	 * order of the first key with ties broken by the next ones and finally
+	 * by the physical order.
+	 */
+	for (i = nr_ids - 1; i >= 0; i--)
+		radix_sort_u64(ctx->stats, ctx->length, sizeof(ctx->stats[0]),
+			       sort_offsets[ids[i]]);
 
 	col_count = 9;
-	/* Two rows for header and separator. */
-	table = table_create(col_count, 2 + ctx->length);
+	/*
+	 * Two rows for header and separator. The rows are printed in batches,
+	 * the column widths are found from the first batch.
+	 */
+	table = table_create_stream(col_count, 2, 16384);
 	if (!table) {
 		error_msg(ERROR_MSG_MEMORY, NULL);
 		return 1;
@@ -930,41 +1418,126 @@ static int print_list_chunks(struct list_chunks_ctx *ctx, const char *sortmode,
 	return 0;
 }
 
-static u64 fill_usage(int fd, u64 lstart)
+/*
+ * Set the used bytes of the chunks from @pos on from the block group items
+ * found by @args, both are in the logical order.  Return the position after
+ * the last chunk set or a negative errno.
+ */
+static int join_block_group_usage(int fd, struct btrfs_tree_search_args *args,
+				  struct list_chunks_ctx *ctx, int pos)
 {
-	struct btrfs_tree_search_args args;
-	struct btrfs_ioctl_search_key *sk;
-	struct btrfs_block_group_item *item;
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(args);
+	struct btrfs_ioctl_search_header sh = { 0 };
 	int ret;
 
-	memset(&args, 0, sizeof(args));
-	sk = btrfs_tree_search_sk(&args);
-	sk->tree_id = BTRFS_EXTENT_TREE_OBJECTID;
-	sk->min_objectid = lstart;
+	while (1) {
+		unsigned long off = 0;
+
+		sk->nr_items = 4096;
+		ret = btrfs_tree_search_ioctl(fd, args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		for (int i = 0; i < sk->nr_items; i++) {
+			struct btrfs_block_group_item *item;
+			u64 used;
+
+			memcpy(&sh, btrfs_tree_search_data(args, off), sizeof(sh));
+			off += sizeof(sh);
+			item = btrfs_tree_search_data(args, off);
+			off += sh.len;
+
+			if (sh.type != BTRFS_BLOCK_GROUP_ITEM_KEY)
+				continue;
+			used = btrfs_stack_block_group_used(item);
+			while (pos < ctx->length && ctx->stats[pos].lstart < sh.objectid)
+				pos++;
+			for (; pos < ctx->length && ctx->stats[pos].lstart == sh.objectid; pos++)
+				ctx->stats[pos].used = used;
+		}
+
+		/* Continue after the last key unless it's the end of the range */
+		if (sh.objectid == sk->max_objectid && sh.type == sk->max_type &&
+		    sh.offset == sk->max_offset)
+			break;
+		sk->min_objectid = sh.objectid;
+		sk->min_type = sh.type;
+		sk->min_offset = sh.offset + 1;
+		if (sk->min_offset == 0) {
+			if (sk->min_type == (u8)-1) {
+				if (sk->min_objectid == sk->max_objectid)
+					break;
+				sk->min_objectid++;
+			}
+			sk->min_type++;
+		}
+	}
+
+	return pos;
+}
+
+static void init_block_group_search(struct btrfs_tree_search_args *args,
+				    u64 tree_id, u64 min_objectid,
+				    u64 max_objectid, u64 min_offset,
+				    u64 max_offset)
+{
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(args);
+
+	memset(args, 0, sizeof(*args));
+	sk->tree_id = tree_id;
+	sk->min_objectid = min_objectid;
 	sk->min_type = BTRFS_BLOCK_GROUP_ITEM_KEY;
-	sk->min_offset = 0;
-	sk->max_objectid = lstart;
+	sk->min_offset = min_offset;
+	sk->max_objectid = max_objectid;
 	sk->max_type = BTRFS_BLOCK_GROUP_ITEM_KEY;
-	sk->max_offset = (u64)-1;
+	sk->max_offset = max_offset;
 	sk->max_transid = (u64)-1;
-	sk->nr_items = 1;
+}
 
-	ret = btrfs_tree_search_ioctl(fd, &args);
+/*
+ * Read the used bytes of the block groups of the chunks, sorted by the logical
+ * offset, in one pass of the block group tree if the filesystem has it.
+ * Otherwise look up each of them in the extent tree where the items are spread
+ * among the extents, by the exact key so it's one search each.
+ */
+static int fill_usage(int fd, struct list_chunks_ctx *ctx)
+{
+	struct btrfs_tree_search_args args;
+	int ret;
+
+	init_block_group_search(&args, BTRFS_BLOCK_GROUP_TREE_OBJECTID, 0,
+				(u64)-1, 0, (u64)-1);
+	ret = join_block_group_usage(fd, &args, ctx, 0);
+	if (ret == -ENOENT) {
+		for (int i = 0; i < ctx->length; i = max(ret, i + 1)) {
+			const struct list_chunks_entry *e = &ctx->stats[i];
+
+			init_block_group_search(&args, BTRFS_EXTENT_TREE_OBJECTID,
+						e->lstart, e->lstart, e->length,
+						e->length);
+			ret = join_block_group_usage(fd, &args, ctx, i);
+			if (ret < 0)
+				break;
+		}
+	}
 	if (ret < 0) {
+		errno = -ret;
 		error("cannot perform the search: %m");
-		return 1;
+		return ret;
 	}
-	if (sk->nr_items == 0) {
-		warning("blockgroup %llu not found", lstart);
-		return 0;
-	}
-	if (sk->nr_items > 1)
-		warning("found more than one blockgroup %llu", lstart);
 
-	/* Only one item, we don't need search header. */
-	item = btrfs_tree_search_data(&args, sizeof(struct btrfs_ioctl_search_header));
+	for (int i = 0; i < ctx->length; i++) {
+		struct list_chunks_entry *e = &ctx->stats[i];
 
-	return item->used;
+		if (e->used != (u64)-1)
+			continue;
+		if (i == 0 || ctx->stats[i - 1].lstart != e->lstart)
+			warning("blockgroup %llu not found", e->lstart);
+		e->used = 0;
+	}
+	return 0;
 }
 
 static int cmd_inspect_list_chunks(const struct cmd_struct *cmd,
@@ -1048,7 +1621,7 @@ static int cmd_inspect_list_chunks(const struct cmd_struct *cmd,
 	}
 
 	while (1) {
-		sk->nr_items = 1;
+		sk->nr_items = 4096;
 		ret = btrfs_tree_search_ioctl(fd, &args);
 		if (ret < 0) {
 			error("cannot perform the search: %m");
@@ -1063,7 +1636,6 @@ static int cmd_inspect_list_chunks(const struct cmd_struct *cmd,
 			struct btrfs_stripe *stripes;
 			struct btrfs_ioctl_search_header sh;
 			int sidx;
-			u64 used = (u64)-1;
 
 			memcpy(&sh, btrfs_tree_search_data(&args, off), sizeof(sh));
 			off += sizeof(sh);
@@ -1098,9 +1670,8 @@ static int cmd_inspect_list_chunks(const struct cmd_struct *cmd,
 					lnumber = tmp;
 				}
 				e->lnumber = lnumber[devid]++;
-				if (used == (u64)-1)
-					used = fill_usage(fd, sh.offset);
-				e->used = used;
+				/* Set by fill_usage() */
+				e->used = (u64)-1;
 
 				ctx.length++;
 
@@ -1126,7 +1697,9 @@ static int cmd_inspect_list_chunks(const struct cmd_struct *cmd,
 			break;
 	}
 
-	ret = print_list_chunks(&ctx, sortmode, unit_mode);
+	ret = fill_usage(fd, &ctx);
+	if (!ret)
+		ret = print_list_chunks(&ctx, sortmode, unit_mode);
 	close(fd);
 
 out:
@@ -1562,6 +2135,8 @@ static const struct cmd_group inspect_cmd_group = {
 		&cmd_struct_inspect_dump_tree,
 		&cmd_struct_inspect_dump_super,
 		&cmd_struct_inspect_tree_stats,
+		&cmd_struct_inspect_layout_report,
+		&cmd_struct_inspect_space_report,
 		&cmd_struct_inspect_list_chunks,
 		NULL
 	}
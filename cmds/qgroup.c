@@ -75,12 +75,6 @@ struct btrfs_qgroup {
 	struct qgroup_lookup *lookup;
 
 	struct rb_node rb_node;
-	struct rb_node sort_node;
-	/*
-	 *all_parent_node is used to
-	 *filter a qgroup's all parent
-	 */
-	struct rb_node all_parent_node;
 	u64 qgroupid;
 
 	/*
@@ -101,6 +95,12 @@ struct btrfs_qgroup {
 	 */
 	bool stale;
 
+	/*
+	 * Set on the qgroup of the all parent filter and all of its parents,
+	 * see pre_process_filter_set().
+	 */
+	bool all_parent;
+
 	/*
 	 * info_item
 	 */
@@ -807,11 +807,14 @@ static struct btrfs_qgroup *qgroup_tree_search(struct qgroup_lookup *root_tree,
  * initialize a btrfs_qgroup with the given qgroupid and insert it to the
  * @qgroup_lookup.
  *
+ * The path and the stale status of level 0 qgroups are filled later by
+ * qgroups_resolve_subvolumes() for all of them at once.
+ *
  * Return the pointer to the btrfs_qgroup if found or if inserted successfully.
  * Return ERR_PTR if any error occurred.
  */
-static struct btrfs_qgroup *get_or_add_qgroup(int fd,
-		struct qgroup_lookup *qgroup_lookup, u64 qgroupid)
+static struct btrfs_qgroup *get_or_add_qgroup(struct qgroup_lookup *qgroup_lookup,
+					      u64 qgroupid)
 {
 	struct btrfs_qgroup *bq;
 	int ret;
@@ -831,40 +834,6 @@ static struct btrfs_qgroup *get_or_add_qgroup(int fd,
 	INIT_LIST_HEAD(&bq->qgroups);
 	INIT_LIST_HEAD(&bq->members);
 
-	if (btrfs_qgroup_level(qgroupid) == 0) {
-		enum btrfs_util_error uret;
-		char *path;
-
-		uret = btrfs_util_subvolume_get_path_fd(fd, qgroupid, &path);
-		if (uret == BTRFS_UTIL_OK)
-			bq->path = path;
-		else if (uret != BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND) {
-			error("%s", btrfs_util_strerror(uret));
-			if (uret == BTRFS_UTIL_ERROR_NO_MEMORY)
-				return ERR_PTR(-ENOMEM);
-			else
-				return ERR_PTR(-EIO);
-		}
-		/*
-		 * Do a correct stale detection by searching for the ROOT_ITEM of
-		 * the subvolume.
-		 *
-		 * Passing @subvol as NULL will force the search to only search
-		 * for the ROOT_ITEM.
-		 */
-		uret = btrfs_util_subvolume_get_info_fd(fd, qgroupid, NULL);
-		if (uret == BTRFS_UTIL_OK) {
-			bq->stale = false;
-		} else if (uret == BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND) {
-			bq->stale = true;
-		} else {
-			warning("failed to search root item for qgroup %u/%llu, assuming it not stale",
-				btrfs_qgroup_level(qgroupid),
-				btrfs_qgroup_subvolid(qgroupid));
-			bq->stale = false;
-		}
-	}
-
 	ret = qgroup_tree_insert(qgroup_lookup, bq);
 	if (ret) {
 		errno = -ret;
@@ -876,12 +845,12 @@ static struct btrfs_qgroup *get_or_add_qgroup(int fd,
 	return bq;
 }
 
-static int update_qgroup_info(int fd, struct qgroup_lookup *qgroup_lookup, u64 qgroupid,
+static int update_qgroup_info(struct qgroup_lookup *qgroup_lookup, u64 qgroupid,
 			      struct btrfs_qgroup_info_item *info)
 {
 	struct btrfs_qgroup *bq;
 
-	bq = get_or_add_qgroup(fd, qgroup_lookup, qgroupid);
+	bq = get_or_add_qgroup(qgroup_lookup, qgroupid);
 	if (IS_ERR_OR_NULL(bq))
 		return PTR_ERR(bq);
 
@@ -895,13 +864,13 @@ static int update_qgroup_info(int fd, struct qgroup_lookup *qgroup_lookup, u64 q
 	return 0;
 }
 
-static int update_qgroup_limit(int fd, struct qgroup_lookup *qgroup_lookup,
+static int update_qgroup_limit(struct qgroup_lookup *qgroup_lookup,
 			       u64 qgroupid,
 			       struct btrfs_qgroup_limit_item *limit)
 {
 	struct btrfs_qgroup *bq;
 
-	bq = get_or_add_qgroup(fd, qgroup_lookup, qgroupid);
+	bq = get_or_add_qgroup(qgroup_lookup, qgroupid);
 	if (IS_ERR_OR_NULL(bq))
 		return PTR_ERR(bq);
 
@@ -914,11 +883,16 @@ static int update_qgroup_limit(int fd, struct qgroup_lookup *qgroup_lookup,
 	return 0;
 }
 
+/*
+ * The relation items come sorted by the parent, @last_parent keeps the parent
+ * of the previous relation so it's looked up only once for all its members.
+ */
 static int update_qgroup_relation(struct qgroup_lookup *qgroup_lookup,
-				  u64 child_id, u64 parent_id)
+				  u64 child_id, u64 parent_id,
+				  struct btrfs_qgroup **last_parent)
 {
 	struct btrfs_qgroup *child;
-	struct btrfs_qgroup *parent;
+	struct btrfs_qgroup *parent = *last_parent;
 	struct btrfs_qgroup_list *list;
 
 	child = qgroup_tree_search(qgroup_lookup, child_id);
@@ -929,12 +903,15 @@ static int update_qgroup_relation(struct qgroup_lookup *qgroup_lookup,
 		return -ENOENT;
 	}
 
-	parent = qgroup_tree_search(qgroup_lookup, parent_id);
-	if (!parent) {
-		error("cannot find the qgroup %u/%llu",
-		      btrfs_qgroup_level(parent_id),
-		      btrfs_qgroup_subvolid(parent_id));
-		return -ENOENT;
+	if (!parent || parent->qgroupid != parent_id) {
+		parent = qgroup_tree_search(qgroup_lookup, parent_id);
+		if (!parent) {
+			error("cannot find the qgroup %u/%llu",
+			      btrfs_qgroup_level(parent_id),
+			      btrfs_qgroup_subvolid(parent_id));
+			return -ENOENT;
+		}
+		*last_parent = parent;
 	}
 
 	list = malloc(sizeof(*list));
@@ -990,31 +967,6 @@ static void __free_all_qgroups(struct qgroup_lookup *root_tree)
 	}
 }
 
-static int filter_all_parent_insert(struct qgroup_lookup *sort_tree,
-				    struct btrfs_qgroup *bq)
-{
-	struct rb_node **p = &sort_tree->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct btrfs_qgroup *curr;
-	int ret;
-
-	while (*p) {
-		parent = *p;
-		curr = rb_entry(parent, struct btrfs_qgroup, all_parent_node);
-
-		ret = comp_entry_with_qgroupid(bq, curr, 0);
-		if (ret < 0)
-			p = &(*p)->rb_left;
-		else if (ret > 0)
-			p = &(*p)->rb_right;
-		else
-			return -EEXIST;
-	}
-	rb_link_node(&bq->all_parent_node, parent, p);
-	rb_insert_color(&bq->all_parent_node, &sort_tree->root);
-	return 0;
-}
-
 static int filter_by_parent(struct btrfs_qgroup *bq, u64 data)
 {
 	struct btrfs_qgroup *qgroup =
@@ -1029,35 +981,9 @@ static int filter_by_parent(struct btrfs_qgroup *bq, u64 data)
 
 static int filter_by_all_parent(struct btrfs_qgroup *bq, u64 data)
 {
-	struct qgroup_lookup lookup;
-	struct qgroup_lookup *ql = &lookup;
-	struct btrfs_qgroup_list *list;
-	struct rb_node *n;
-	struct btrfs_qgroup *qgroup =
-			 (struct btrfs_qgroup *)(unsigned long)data;
-
 	if (data == 0)
 		return 0;
-	if (bq->qgroupid == qgroup->qgroupid)
-		return 1;
-
-	qgroup_lookup_init(ql);
-	filter_all_parent_insert(ql, qgroup);
-	n = rb_first(&ql->root);
-	while (n) {
-		qgroup = rb_entry(n, struct btrfs_qgroup, all_parent_node);
-		if (!list_empty(&qgroup->qgroups)) {
-			list_for_each_entry(list, &qgroup->qgroups,
-					    next_qgroup) {
-				if ((list->qgroup)->qgroupid == bq->qgroupid)
-					return 1;
-				filter_all_parent_insert(ql, list->qgroup);
-			}
-		}
-		rb_erase(n, &ql->root);
-		n = rb_first(&ql->root);
-	}
-	return 0;
+	return bq->all_parent;
 }
 
 static btrfs_qgroup_filter_func all_filter_funcs[] = {
@@ -1137,6 +1063,18 @@ static int filter_qgroup(struct btrfs_qgroup *bq,
 	return 1;
 }
 
+/* Mark @qgroup and all the qgroups it is a member of, directly or not */
+static void mark_all_parents(struct btrfs_qgroup *qgroup)
+{
+	struct btrfs_qgroup_list *list;
+
+	if (qgroup->all_parent)
+		return;
+	qgroup->all_parent = true;
+	list_for_each_entry(list, &qgroup->qgroups, next_qgroup)
+		mark_all_parents(list->qgroup);
+}
+
 static void pre_process_filter_set(struct qgroup_lookup *lookup,
 				   struct btrfs_qgroup_filter_set *set)
 {
@@ -1151,34 +1089,23 @@ static void pre_process_filter_set(struct qgroup_lookup *lookup,
 					    set->filters[i].data);
 			set->filters[i].data =
 				 (u64)(unsigned long)qgroup_for_filter;
+			/*
+			 * The parents are marked once here instead of walking
+			 * them again for each qgroup in filter_by_all_parent().
+			 */
+			if (qgroup_for_filter &&
+			    set->filters[i].filter_func == filter_by_all_parent)
+				mark_all_parents(qgroup_for_filter);
 		}
 	}
 }
 
-static int sort_tree_insert(struct qgroup_lookup *sort_tree,
-			    struct btrfs_qgroup *bq,
-			    struct btrfs_qgroup_comparer_set *comp_set)
+static int qsort_qgroup_comp(const void *p1, const void *p2, void *priv)
 {
-	struct rb_node **p = &sort_tree->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct btrfs_qgroup *curr;
-	int ret;
+	struct btrfs_qgroup *entry1 = *(struct btrfs_qgroup **)p1;
+	struct btrfs_qgroup *entry2 = *(struct btrfs_qgroup **)p2;
 
-	while (*p) {
-		parent = *p;
-		curr = rb_entry(parent, struct btrfs_qgroup, sort_node);
-
-		ret = sort_comp(bq, curr, comp_set);
-		if (ret < 0)
-			p = &(*p)->rb_left;
-		else if (ret > 0)
-			p = &(*p)->rb_right;
-		else
-			return -EEXIST;
-	}
-	rb_link_node(&bq->sort_node, parent, p);
-	rb_insert_color(&bq->sort_node, &sort_tree->root);
-	return 0;
+	return sort_comp(entry1, entry2, priv);
 }
 
 static void __update_columns_max_len(struct btrfs_qgroup *bq,
@@ -1264,30 +1191,41 @@ static void update_columns_max_len(struct btrfs_qgroup *bq)
 	}
 }
 
-static void __filter_and_sort_qgroups(struct qgroup_lookup *all_qgroups,
-				 struct qgroup_lookup *sort_tree,
+/*
+ * Return the qgroups passing the filters in an array sorted by @comp_set, to
+ * be freed by the caller, or NULL if out of memory.
+ */
+static struct btrfs_qgroup **__filter_and_sort_qgroups(struct qgroup_lookup *all_qgroups,
 				 struct btrfs_qgroup_filter_set *filter_set,
-				 struct btrfs_qgroup_comparer_set *comp_set)
+				 struct btrfs_qgroup_comparer_set *comp_set,
+				 size_t *nr_ret)
 {
+	struct btrfs_qgroup **sorted;
 	struct rb_node *n;
 	struct btrfs_qgroup *entry;
-	int ret;
+	size_t nr = 0;
+
+	for (n = rb_first(&all_qgroups->root); n; n = rb_next(n))
+		nr++;
+	sorted = malloc((nr ? nr : 1) * sizeof(*sorted));
+	if (!sorted)
+		return NULL;
 
-	qgroup_lookup_init(sort_tree);
 	pre_process_filter_set(all_qgroups, filter_set);
 
-	n = rb_last(&all_qgroups->root);
-	while (n) {
+	nr = 0;
+	for (n = rb_first(&all_qgroups->root); n; n = rb_next(n)) {
 		entry = rb_entry(n, struct btrfs_qgroup, rb_node);
 
-		ret = filter_qgroup(entry, filter_set);
-		if (ret) {
-			sort_tree_insert(sort_tree, entry, comp_set);
-
+		if (filter_qgroup(entry, filter_set)) {
+			sorted[nr++] = entry;
 			update_columns_max_len(entry);
 		}
-		n = rb_prev(n);
 	}
+	qsort_r(sorted, nr, sizeof(*sorted), qsort_qgroup_comp, comp_set);
+
+	*nr_ret = nr;
+	return sorted;
 }
 
 static inline void print_status_flag_warning(u64 flags)
@@ -1352,6 +1290,7 @@ static int __qgroups_search(int fd, struct btrfs_tree_search_args *args,
 	u64 flags;
 	u64 qgroupid;
 	u64 child, parent;
+	struct btrfs_qgroup *last_parent = NULL;
 
 	sk = btrfs_tree_search_sk(args);
 	filter_key = *sk;
@@ -1403,14 +1342,14 @@ static int __qgroups_search(int fd, struct btrfs_tree_search_args *args,
 				qgroupid = key.offset;
 				info = btrfs_tree_search_data(args, off);
 
-				ret = update_qgroup_info(fd, qgroup_lookup,
+				ret = update_qgroup_info(qgroup_lookup,
 							 qgroupid, info);
 				break;
 			case BTRFS_QGROUP_LIMIT_KEY:
 				qgroupid = key.offset;
 				limit = btrfs_tree_search_data(args, off);
 
-				ret = update_qgroup_limit(fd, qgroup_lookup,
+				ret = update_qgroup_limit(qgroup_lookup,
 							  qgroupid, limit);
 				break;
 			case BTRFS_QGROUP_RELATION_KEY:
@@ -1421,7 +1360,8 @@ static int __qgroups_search(int fd, struct btrfs_tree_search_args *args,
 					break;
 
 				ret = update_qgroup_relation(qgroup_lookup,
-							     child, parent);
+							     child, parent,
+							     &last_parent);
 				break;
 			default:
 				return ret;
@@ -1455,6 +1395,96 @@ next:
 	return ret;
 }
 
+/*
+ * Fill the subvolume paths of the level 0 qgroups and find the stale ones.
+ * All subvolumes are listed by one iterator and their root items are read
+ * together, instead of resolving the path and searching the root item of each
+ * qgroup.
+ */
+static int qgroups_resolve_subvolumes(int fd, struct qgroup_lookup *qgroup_lookup)
+{
+	struct btrfs_util_subvolume_iterator *iter;
+	struct btrfs_util_subvolume_info *infos = NULL;
+	struct btrfs_qgroup *bq;
+	enum btrfs_util_error uret;
+	struct rb_node *n;
+	uint64_t *ids = NULL;
+	size_t nr = 0;
+	size_t i;
+	char *path;
+	uint64_t id;
+	int ret = 0;
+
+	/* Level 0 qgroups sort first */
+	for (n = rb_first(&qgroup_lookup->root); n; n = rb_next(n)) {
+		bq = rb_entry(n, struct btrfs_qgroup, rb_node);
+		if (btrfs_qgroup_level(bq->qgroupid) > 0)
+			break;
+		nr++;
+	}
+	if (!nr)
+		return 0;
+
+	ids = malloc(nr * sizeof(*ids));
+	infos = malloc(nr * sizeof(*infos));
+	if (!ids || !infos) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+	n = rb_first(&qgroup_lookup->root);
+	for (i = 0; i < nr; i++, n = rb_next(n))
+		ids[i] = rb_entry(n, struct btrfs_qgroup, rb_node)->qgroupid;
+
+	/*
+	 * Do a correct stale detection by searching for the ROOT_ITEM of
+	 * the subvolumes, a missing one has a zero id.
+	 */
+	uret = btrfs_util_subvolume_get_info_many_fd(fd, ids, nr, infos);
+	if (uret)
+		warning("failed to search root items for qgroups, assuming them not stale");
+	n = rb_first(&qgroup_lookup->root);
+	for (i = 0; i < nr; i++, n = rb_next(n)) {
+		bq = rb_entry(n, struct btrfs_qgroup, rb_node);
+		bq->stale = !uret && !infos[i].id;
+	}
+
+	/* The toplevel subvolume is not listed by the iterator */
+	bq = qgroup_tree_search(qgroup_lookup, BTRFS_FS_TREE_OBJECTID);
+	if (bq) {
+		bq->path = strdup("");
+		if (!bq->path) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	uret = btrfs_util_subvolume_iter_create_fd(fd, BTRFS_FS_TREE_OBJECTID,
+						   0, &iter);
+	if (uret == BTRFS_UTIL_OK) {
+		while (!(uret = btrfs_util_subvolume_iter_next(iter, &path, &id))) {
+			bq = qgroup_tree_search(qgroup_lookup, id);
+			if (bq && !bq->path)
+				bq->path = path;
+			else
+				free(path);
+		}
+		btrfs_util_subvolume_iter_destroy(iter);
+		if (uret == BTRFS_UTIL_ERROR_STOP_ITERATION)
+			uret = BTRFS_UTIL_OK;
+	}
+	if (uret) {
+		error("%s", btrfs_util_strerror(uret));
+		ret = (uret == BTRFS_UTIL_ERROR_NO_MEMORY ? -ENOMEM : -EIO);
+	}
+
+out:
+	free(infos);
+	free(ids);
+	return ret;
+}
+
 static int qgroups_search_all(int fd, struct qgroup_lookup *qgroup_lookup)
 {
 	struct btrfs_tree_search_args args;
@@ -1472,6 +1502,8 @@ static int qgroups_search_all(int fd, struct qgroup_lookup *qgroup_lookup)
 	sk->nr_items = 4096;
 
 	ret = __qgroups_search(fd, &args, qgroup_lookup);
+	if (!ret)
+		ret = qgroups_resolve_subvolumes(fd, qgroup_lookup);
 	if (ret == -ENOTTY) {
 		error("can't list qgroups: quotas not enabled");
 	} else if (ret < 0) {
@@ -1521,20 +1553,14 @@ int btrfs_qgroup_query(int fd, u64 qgroupid, struct btrfs_qgroup_stats *stats)
 	return ret;
 }
 
-static void print_all_qgroups(struct qgroup_lookup *qgroup_lookup)
+static void print_all_qgroups(struct btrfs_qgroup **qgroups, size_t nr)
 {
-
-	struct rb_node *n;
-	struct btrfs_qgroup *entry;
+	size_t i;
 
 	print_table_head();
 
-	n = rb_first(&qgroup_lookup->root);
-	while (n) {
-		entry = rb_entry(n, struct btrfs_qgroup, sort_node);
-		print_single_qgroup_table(entry);
-		n = rb_next(n);
-	}
+	for (i = 0; i < nr; i++)
+		print_single_qgroup_table(qgroups[i]);
 }
 
 static const struct rowspec qgroup_show_rowspec[] = {
@@ -1555,20 +1581,19 @@ static const struct rowspec qgroup_show_rowspec[] = {
 	ROWSPEC_END
 };
 
-static void print_all_qgroups_json(struct qgroup_lookup *qgroup_lookup)
+static void print_all_qgroups_json(struct btrfs_qgroup **qgroups, size_t nr)
 {
-	struct rb_node *n;
 	struct btrfs_qgroup *qgroup;
 	struct format_ctx fctx;
+	size_t i;
 
 	fmt_start(&fctx, qgroup_show_rowspec, 24, 0);
 	fmt_print_start_group(&fctx, "qgroup-show", JSON_TYPE_ARRAY);
 
-	n = rb_first(&qgroup_lookup->root);
-	while (n) {
+	for (i = 0; i < nr; i++) {
 		struct btrfs_qgroup_list *list = NULL;
 
-		qgroup = rb_entry(n, struct btrfs_qgroup, sort_node);
+		qgroup = qgroups[i];
 
 		fmt_print_start_group(&fctx, NULL, JSON_TYPE_MAP);
 
@@ -1604,8 +1629,6 @@ static void print_all_qgroups_json(struct qgroup_lookup *qgroup_lookup)
 		fmt_print_end_group(&fctx, "children");
 
 		fmt_print_end_group(&fctx, NULL);
-
-		n = rb_next(n);
 	}
 	fmt_print_end_group(&fctx, "qgroup-show");
 	fmt_end(&fctx);
@@ -1642,7 +1665,8 @@ static int show_qgroups(int fd,
 {
 
 	struct qgroup_lookup qgroup_lookup;
-	struct qgroup_lookup sort_tree;
+	struct btrfs_qgroup **sorted;
+	size_t nr;
 	int ret;
 
 	ret = qgroups_search_all(fd, &qgroup_lookup);
@@ -1650,13 +1674,19 @@ static int show_qgroups(int fd,
 		return ret;
 
 	check_qgroup_sysfs_inconsistent(fd, &qgroup_lookup);
-	__filter_and_sort_qgroups(&qgroup_lookup, &sort_tree,
-				  filter_set, comp_set);
+	sorted = __filter_and_sort_qgroups(&qgroup_lookup, filter_set, comp_set,
+					   &nr);
+	if (!sorted) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		__free_all_qgroups(&qgroup_lookup);
+		return -ENOMEM;
+	}
 	if (bconf.output_format == CMD_FORMAT_JSON)
-		print_all_qgroups_json(&sort_tree);
+		print_all_qgroups_json(sorted, nr);
 	else
-		print_all_qgroups(&sort_tree);
+		print_all_qgroups(sorted, nr);
 
+	free(sorted);
 	__free_all_qgroups(&qgroup_lookup);
 	return ret;
 }
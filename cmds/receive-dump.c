@@ -20,15 +20,18 @@
 #include <limits.h>
 #include <time.h>
 #include <errno.h>
-#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
 #include <uuid/uuid.h>
+#include "kernel-lib/sizes.h"
 #include "common/defs.h"
 #include "common/messages.h"
 #include "common/send-stream.h"
 #include "common/path-utils.h"
 #include "common/string-utils.h"
+#include "common/format-output.h"
 #include "cmds/receive-dump.h"
 
 #define PATH_CAT_OR_RET(function_name, outpath, path1, path2, ret)	\
@@ -40,127 +43,309 @@
 	}								\
 })
 
-enum print_mode {
-	PRINT_DUMP_NORMAL,
-	PRINT_DUMP_SUBVOLUME,
-	PRINT_DUMP_NONEWLINE
-};
-
 /*
- * Underlying PRINT_DUMP, the only difference is how we handle
- * the full path.
+ * The lines are formatted to a buffer written to stdout when full, the paths
+ * and the values are escaped and converted without the printf machinery.
  */
-__attribute__ ((format (printf, 5, 6)))
-static int __print_dump(enum print_mode mode, void *user, const char *path,
-			const char *title, const char *fmt, ...)
+#define DUMP_BUF_SIZE		(SZ_1M)
+
+/* Path column of the text format, the values start after it */
+#define DUMP_PATH_WIDTH		32
+
+static int dump_flush(struct btrfs_dump_send_args *r)
 {
-	struct btrfs_dump_send_args *r = user;
-	char full_path[PATH_MAX] = {0};
-	char *out_path;
-	va_list args;
-	int ret;
+	size_t written = 0;
+
+	while (written < r->buf_len) {
+		ssize_t ret;
+
+		ret = write(fileno(stdout), r->buf + written, r->buf_len - written);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			error("failed to write the dump: %m");
+			return ret;
+		}
+		written += ret;
+	}
+	r->buf_len = 0;
+	return 0;
+}
 
-	if (mode == PRINT_DUMP_SUBVOLUME) {
-		PATH_CAT_OR_RET(title, r->full_subvol_path, r->root_path, path, ret);
-		out_path = r->full_subvol_path;
-	} else {
-		PATH_CAT_OR_RET(title, full_path, r->full_subvol_path, path, ret);
-		out_path = full_path;
+/* Make room for @size bytes in the buffer, return where to write them */
+static char *dump_reserve(struct btrfs_dump_send_args *r, size_t size)
+{
+	if (r->ret < 0)
+		return NULL;
+	if (size > DUMP_BUF_SIZE) {
+		error("dump line too long: %zu", size);
+		r->ret = -EOVERFLOW;
+		return NULL;
+	}
+	if (r->buf_len + size > DUMP_BUF_SIZE) {
+		r->ret = dump_flush(r);
+		if (r->ret < 0)
+			return NULL;
 	}
+	return r->buf + r->buf_len;
+}
+
+static void dump_mem(struct btrfs_dump_send_args *r, const char *data, size_t len)
+{
+	char *p = dump_reserve(r, len);
 
-	/* Unified header */
-	printf("%-16s", title);
-	ret = string_print_escape_special(out_path);
-	if (!fmt) {
-		putchar('\n');
+	if (!p)
+		return;
+	memcpy(p, data, len);
+	r->buf_len += len;
+}
+
+static void dump_str(struct btrfs_dump_send_args *r, const char *str)
+{
+	dump_mem(r, str, strlen(str));
+}
+
+static void dump_char(struct btrfs_dump_send_args *r, char c)
+{
+	dump_mem(r, &c, 1);
+}
+
+static void dump_number(struct btrfs_dump_send_args *r, u64 value,
+			unsigned int base)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[24];
+	int i = sizeof(tmp);
+
+	do {
+		tmp[--i] = digits[value % base];
+		value /= base;
+	} while (value);
+	dump_mem(r, tmp + i, sizeof(tmp) - i);
+}
+
+/*
+ * Escape the string in C way for the text format, as JSON string for the json
+ * format. Return the length of the text.
+ */
+static int dump_escaped(struct btrfs_dump_send_args *r, const char *str,
+			size_t len)
+{
+	size_t out;
+	char *p;
+
+	if (r->json) {
+		p = dump_reserve(r, len * FMT_JSON_ESCAPE_MAX + 2);
+		if (!p)
+			return 0;
+		p[0] = '"';
+		out = fmt_escape_json(p + 1, str, len);
+		p[out + 1] = '"';
+		r->buf_len += out + 2;
+		return out;
+	}
+	p = dump_reserve(r, len * STRING_ESCAPE_MAX);
+	if (!p)
 		return 0;
+	out = string_escape_special(p, str, len);
+	r->buf_len += out;
+	return out;
+}
+
+/*
+ * Start the line of a command, the text format has the title and the path
+ * aligned, the json format an object with "op" and "path".
+ */
+static void dump_start(struct btrfs_dump_send_args *r, const char *title,
+		       const char *path)
+{
+	if (r->json) {
+		dump_str(r, "{\"op\":\"");
+		dump_str(r, title);
+		dump_str(r, "\",\"path\":");
+		dump_escaped(r, path, strlen(path));
+		return;
+	}
+	dump_str(r, title);
+	for (int i = strlen(title); i < 16; i++)
+		dump_char(r, ' ');
+	r->column = dump_escaped(r, path, strlen(path));
+}
+
+/* Start a value, the first one is aligned after the path in the text format */
+static void dump_key(struct btrfs_dump_send_args *r, const char *key)
+{
+	if (r->json) {
+		dump_str(r, ",\"");
+		dump_str(r, key);
+		dump_str(r, "\":");
+		return;
 	}
 	/* Short paths are aligned to 32 chars; longer paths get a single space */
 	do {
-		putchar(' ');
-	} while (++ret < 32);
-	va_start(args, fmt);
-	/* Operation specified ones */
-	vprintf(fmt, args);
-	va_end(args);
-	if (mode != PRINT_DUMP_NONEWLINE)
-		putchar('\n');
-	return 0;
+		dump_char(r, ' ');
+	} while (++r->column < DUMP_PATH_WIDTH);
+	dump_str(r, key);
+	dump_char(r, '=');
+}
+
+static void dump_u64(struct btrfs_dump_send_args *r, const char *key, u64 value)
+{
+	dump_key(r, key);
+	dump_number(r, value, 10);
 }
 
-/* For subvolume/snapshot operation only */
-#define PRINT_DUMP_SUBVOL(user, path, title, fmt, ...) \
-	__print_dump(PRINT_DUMP_SUBVOLUME, user, path, title, fmt, ##__VA_ARGS__)
+static void dump_s64(struct btrfs_dump_send_args *r, const char *key, s64 value)
+{
+	dump_key(r, key);
+	if (value < 0) {
+		dump_char(r, '-');
+		value = -value;
+	}
+	dump_number(r, value, 10);
+}
 
-/* For other operations */
-#define PRINT_DUMP(user, path, title, fmt, ...) \
-	__print_dump(PRINT_DUMP_NORMAL, user, path, title, fmt, ##__VA_ARGS__)
+/* Octal in the text format, JSON has only decimal numbers */
+static void dump_oct(struct btrfs_dump_send_args *r, const char *key, u64 value)
+{
+	dump_key(r, key);
+	dump_number(r, value, r->json ? 10 : 8);
+}
 
-/* For commands that may want to format parts of the line by themselves */
-#define PRINT_DUMP_NO_NEWLINE(user, path, title, fmt, ...) \
-	__print_dump(PRINT_DUMP_NONEWLINE, user, path, title, fmt, ##__VA_ARGS__)
+/* Hexadecimal with 0x in the text format, decimal in json */
+static void dump_hex(struct btrfs_dump_send_args *r, const char *key, u64 value)
+{
+	dump_key(r, key);
+	if (r->json) {
+		dump_number(r, value, 10);
+		return;
+	}
+	dump_str(r, "0x");
+	dump_number(r, value, 16);
+}
+
+/* A string that needs no escaping, quoted in json */
+static void dump_plain(struct btrfs_dump_send_args *r, const char *key,
+		       const char *value)
+{
+	dump_key(r, key);
+	if (r->json)
+		dump_char(r, '"');
+	dump_str(r, value);
+	if (r->json)
+		dump_char(r, '"');
+}
+
+static void dump_path(struct btrfs_dump_send_args *r, const char *key,
+		      const char *path)
+{
+	dump_key(r, key);
+	dump_escaped(r, path, strlen(path));
+}
+
+static int dump_end(struct btrfs_dump_send_args *r)
+{
+	if (r->json)
+		dump_char(r, '}');
+	dump_char(r, '\n');
+	return r->ret;
+}
 
 static int print_subvol(const char *path, const u8 *uuid, u64 ctransid,
 			void *user)
 {
+	struct btrfs_dump_send_args *r = user;
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
+	int ret;
 
+	PATH_CAT_OR_RET("subvol", r->full_subvol_path, r->root_path, path, ret);
 	uuid_unparse(uuid, uuid_str);
 
-	return PRINT_DUMP_SUBVOL(user, path, "subvol", "uuid=%s transid=%llu",
-				 uuid_str, ctransid);
+	dump_start(r, "subvol", r->full_subvol_path);
+	dump_plain(r, "uuid", uuid_str);
+	dump_u64(r, "transid", ctransid);
+	return dump_end(r);
 }
 
 static int print_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 			  const u8 *parent_uuid, u64 parent_ctransid,
 			  void *user)
 {
+	struct btrfs_dump_send_args *r = user;
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 	char parent_uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 	int ret;
 
+	PATH_CAT_OR_RET("snapshot", r->full_subvol_path, r->root_path, path, ret);
 	uuid_unparse(uuid, uuid_str);
 	uuid_unparse(parent_uuid, parent_uuid_str);
 
-	ret = PRINT_DUMP_SUBVOL(user, path, "snapshot",
-		"uuid=%s transid=%llu parent_uuid=%s parent_transid=%llu",
-				uuid_str, ctransid, parent_uuid_str,
-				parent_ctransid);
-	return ret;
+	dump_start(r, "snapshot", r->full_subvol_path);
+	dump_plain(r, "uuid", uuid_str);
+	dump_u64(r, "transid", ctransid);
+	dump_plain(r, "parent_uuid", parent_uuid_str);
+	dump_u64(r, "parent_transid", parent_ctransid);
+	return dump_end(r);
+}
+
+/* Start the line of a command on a path in the subvolume */
+#define DUMP_START_OR_RET(r, title, path, ret)				\
+({									\
+	char __full_path[PATH_MAX];					\
+									\
+	PATH_CAT_OR_RET(title, __full_path, (r)->full_subvol_path, path, ret); \
+	dump_start(r, title, __full_path);				\
+})
+
+static int print_path_only(const char *title, const char *path, void *user)
+{
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, title, path, ret);
+	return dump_end(r);
 }
 
 static int print_mkfile(const char *path, void *user)
 {
-	return PRINT_DUMP(user, path, "mkfile", NULL);
+	return print_path_only("mkfile", path, user);
 }
 
 static int print_mkdir(const char *path, void *user)
 {
-	return PRINT_DUMP(user, path, "mkdir", NULL);
+	return print_path_only("mkdir", path, user);
 }
 
 static int print_mknod(const char *path, u64 mode, u64 dev, void *user)
 {
-	return PRINT_DUMP(user, path, "mknod", "mode=%llo dev=0x%llx", mode,
-			  dev);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "mknod", path, ret);
+	dump_oct(r, "mode", mode);
+	dump_hex(r, "dev", dev);
+	return dump_end(r);
 }
 
 static int print_mkfifo(const char *path, void *user)
 {
-	return PRINT_DUMP(user, path, "mkfifo", NULL);
+	return print_path_only("mkfifo", path, user);
 }
 
 static int print_mksock(const char *path, void *user)
 {
-	return PRINT_DUMP(user, path, "mksock", NULL);
+	return print_path_only("mksock", path, user);
 }
 
 static int print_symlink(const char *path, const char *lnk, void *user)
 {
-	PRINT_DUMP_NO_NEWLINE(user, path, "symlink", "dest=");
-	string_print_escape_special(lnk);
-	putchar('\n');
-	return 0;
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "symlink", path, ret);
+	dump_path(r, "dest", lnk);
+	return dump_end(r);
 }
 
 static int print_rename(const char *from, const char *to, void *user)
@@ -170,35 +355,41 @@ static int print_rename(const char *from, const char *to, void *user)
 	int ret;
 
 	PATH_CAT_OR_RET("rename", full_to, r->full_subvol_path, to, ret);
-	PRINT_DUMP_NO_NEWLINE(user, from, "rename", "dest=");
-	string_print_escape_special(full_to);
-	putchar('\n');
-	return 0;
+	DUMP_START_OR_RET(r, "rename", from, ret);
+	dump_path(r, "dest", full_to);
+	return dump_end(r);
 }
 
 static int print_link(const char *path, const char *lnk, void *user)
 {
-	PRINT_DUMP_NO_NEWLINE(user, path, "link", "dest=");
-	string_print_escape_special(lnk);
-	putchar('\n');
-	return 0;
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "link", path, ret);
+	dump_path(r, "dest", lnk);
+	return dump_end(r);
 }
 
 static int print_unlink(const char *path, void *user)
 {
-	return PRINT_DUMP(user, path, "unlink", NULL);
+	return print_path_only("unlink", path, user);
 }
 
 static int print_rmdir(const char *path, void *user)
 {
-	return PRINT_DUMP(user, path, "rmdir", NULL);
+	return print_path_only("rmdir", path, user);
 }
 
 static int print_write(const char *path, const void *data, u64 offset,
 		       u64 len, void *user)
 {
-	return PRINT_DUMP(user, path, "write", "offset=%llu len=%llu",
-			  offset, len);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "write", path, ret);
+	dump_u64(r, "offset", offset);
+	dump_u64(r, "len", len);
+	return dump_end(r);
 }
 
 static int print_clone(const char *path, u64 offset, u64 len,
@@ -211,11 +402,12 @@ static int print_clone(const char *path, u64 offset, u64 len,
 	int ret;
 
 	PATH_CAT_OR_RET("clone", full_path, r->full_subvol_path, clone_path, ret);
-	PRINT_DUMP_NO_NEWLINE(user, path, "clone", "offset=%llu len=%llu from=", offset, len);
-	string_print_escape_special(full_path);
-	putchar(' ');
-	printf("clone_offset=%llu\n", clone_offset);
-	return 0;
+	DUMP_START_OR_RET(r, "clone", path, ret);
+	dump_u64(r, "offset", offset);
+	dump_u64(r, "len", len);
+	dump_path(r, "from", full_path);
+	dump_u64(r, "clone_offset", clone_offset);
+	return dump_end(r);
 }
 
 /*
@@ -225,81 +417,122 @@ static int print_clone(const char *path, u64 offset, u64 len,
 static int print_set_xattr(const char *path, const char *name,
 			   const void *data, int len, void *user)
 {
-	PRINT_DUMP_NO_NEWLINE(user, path, "set_xattr", "name=");
-	string_print_escape_special(name);
-	putchar(' ');
-	string_print_escape_special_len((const char *)data, len);
-	putchar(' ');
-	printf("len=%d\n", len);
-	return 0;
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "set_xattr", path, ret);
+	dump_path(r, "name", name);
+	/* The value has no key in the text format */
+	if (r->json)
+		dump_key(r, "data");
+	else
+		dump_char(r, ' ');
+	dump_escaped(r, data, len);
+	dump_s64(r, "len", len);
+	return dump_end(r);
 }
 
 static int print_remove_xattr(const char *path, const char *name, void *user)
 {
+	struct btrfs_dump_send_args *r = user;
+	int ret;
 
-	PRINT_DUMP_NO_NEWLINE(user, path, "remove_xattr", "name=");
-	string_print_escape_special(name);
-	putchar('\n');
-	return 0;
+	DUMP_START_OR_RET(r, "remove_xattr", path, ret);
+	dump_path(r, "name", name);
+	return dump_end(r);
 }
 
 static int print_truncate(const char *path, u64 size, void *user)
 {
-	return PRINT_DUMP(user, path, "truncate", "size=%llu", size);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "truncate", path, ret);
+	dump_u64(r, "size", size);
+	return dump_end(r);
 }
 
 static int print_chmod(const char *path, u64 mode, void *user)
 {
-	return PRINT_DUMP(user, path, "chmod", "mode=%llo", mode);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "chmod", path, ret);
+	dump_oct(r, "mode", mode);
+	return dump_end(r);
 }
 
 static int print_chown(const char *path, u64 uid, u64 gid, void *user)
 {
-	return PRINT_DUMP(user, path, "chown", "gid=%llu uid=%llu", gid, uid);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "chown", path, ret);
+	dump_u64(r, "gid", gid);
+	dump_u64(r, "uid", uid);
+	return dump_end(r);
 }
 
-static int sprintf_timespec(struct timespec *ts, char *dest, int max_size)
+/*
+ * Format the time in the local timezone. The times of one inode and of the
+ * inodes of a stream tend to be the same, the last one is remembered.
+ */
+static const char *dump_timespec(struct btrfs_dump_send_args *r,
+				 struct timespec *ts, int slot)
 {
+	char *dest = r->time_str[slot];
 	struct tm tm;
-	int ret;
 
+	if (r->time_valid[slot] && r->time_sec[slot] == ts->tv_sec)
+		return dest;
 	if (!localtime_r(&ts->tv_sec, &tm)) {
 		error("failed to convert time %lld.%.9ld to local time",
 		      (long long)ts->tv_sec, ts->tv_nsec);
-		return -EINVAL;
+		return NULL;
 	}
-	ret = strftime(dest, max_size, "%FT%T%z", &tm);
-	if (ret == 0) {
+	if (strftime(dest, DUMP_TIME_STRING_MAX - 1, "%FT%T%z", &tm) == 0) {
 		error(
 		"time %lld.%ld is too long to convert into readable string",
 		      (long long)ts->tv_sec, ts->tv_nsec);
-		return -EINVAL;
+		return NULL;
 	}
-	return 0;
+	r->time_sec[slot] = ts->tv_sec;
+	r->time_valid[slot] = true;
+	return dest;
 }
 
-#define TIME_STRING_MAX	64
 static int print_utimes(const char *path, struct timespec *at,
 			struct timespec *mt, struct timespec *ct,
 			void *user)
 {
-	char at_str[TIME_STRING_MAX];
-	char mt_str[TIME_STRING_MAX];
-	char ct_str[TIME_STRING_MAX];
+	struct btrfs_dump_send_args *r = user;
+	const char *at_str;
+	const char *mt_str;
+	const char *ct_str;
+	int ret;
 
-	if (sprintf_timespec(at, at_str, TIME_STRING_MAX - 1) < 0 ||
-	    sprintf_timespec(mt, mt_str, TIME_STRING_MAX - 1) < 0 ||
-	    sprintf_timespec(ct, ct_str, TIME_STRING_MAX - 1) < 0)
+	at_str = dump_timespec(r, at, 0);
+	mt_str = dump_timespec(r, mt, 1);
+	ct_str = dump_timespec(r, ct, 2);
+	if (!at_str || !mt_str || !ct_str)
 		return -EINVAL;
-	return PRINT_DUMP(user, path, "utimes", "atime=%s mtime=%s ctime=%s",
-			  at_str, mt_str, ct_str);
+	DUMP_START_OR_RET(r, "utimes", path, ret);
+	dump_plain(r, "atime", at_str);
+	dump_plain(r, "mtime", mt_str);
+	dump_plain(r, "ctime", ct_str);
+	return dump_end(r);
 }
 
 static int print_update_extent(const char *path, u64 offset, u64 len,
 			       void *user)
 {
-	return PRINT_DUMP(user, path, "update_extent", "offset=%llu len=%llu",
-			  offset, len);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "update_extent", path, ret);
+	dump_u64(r, "offset", offset);
+	dump_u64(r, "len", len);
+	return dump_end(r);
 }
 
 static int print_encoded_write(const char *path, const void *data, u64 offset,
@@ -307,32 +540,86 @@ static int print_encoded_write(const char *path, const void *data, u64 offset,
 			       u64 unencoded_len, u64 unencoded_offset,
 			       u32 compression, u32 encryption, void *user)
 {
-	return PRINT_DUMP(user, path, "encoded_write",
-"offset=%llu len=%llu unencoded_file_len=%llu unencoded_len=%llu unencoded_offset=%llu compression=%u encryption=%u",
-			  offset, len, unencoded_file_len, unencoded_len,
-			  unencoded_offset, compression, encryption);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "encoded_write", path, ret);
+	dump_u64(r, "offset", offset);
+	dump_u64(r, "len", len);
+	dump_u64(r, "unencoded_file_len", unencoded_file_len);
+	dump_u64(r, "unencoded_len", unencoded_len);
+	dump_u64(r, "unencoded_offset", unencoded_offset);
+	dump_u64(r, "compression", compression);
+	dump_u64(r, "encryption", encryption);
+	return dump_end(r);
 }
 
 static int print_fallocate(const char *path, int mode, u64 offset, u64 len,
 			   void *user)
 {
-	return PRINT_DUMP(user, path, "fallocate",
-			  "mode=%d offset=%llu len=%llu",
-			  mode, offset, len);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "fallocate", path, ret);
+	dump_s64(r, "mode", mode);
+	dump_u64(r, "offset", offset);
+	dump_u64(r, "len", len);
+	return dump_end(r);
 }
 
 static int print_fileattr(const char *path, u64 attr, void *user)
 {
-	return PRINT_DUMP(user, path, "fileattr", "fileattr=0x%llu", attr);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "fileattr", path, ret);
+	dump_key(r, "fileattr");
+	/* The text format always printed the value in decimal after 0x */
+	if (!r->json)
+		dump_str(r, "0x");
+	dump_number(r, attr, 10);
+	return dump_end(r);
 }
 
 static int print_enable_verity (const char *path, u8 algorithm, u32 block_size,
 				int salt_len, char *salt,
 				int sig_len, char *sig, void *user)
 {
-	return PRINT_DUMP(user, path, "enable_verity",
-			  "algorithm=%u block_size=%u salt_len=%d sig_len=%d",
-			  algorithm, block_size, salt_len, sig_len);
+	struct btrfs_dump_send_args *r = user;
+	int ret;
+
+	DUMP_START_OR_RET(r, "enable_verity", path, ret);
+	dump_u64(r, "algorithm", algorithm);
+	dump_u64(r, "block_size", block_size);
+	dump_s64(r, "salt_len", salt_len);
+	dump_s64(r, "sig_len", sig_len);
+	return dump_end(r);
+}
+
+int btrfs_dump_send_init(struct btrfs_dump_send_args *r, bool json)
+{
+	memset(r, 0, sizeof(*r));
+	r->root_path[0] = '.';
+	r->full_subvol_path[0] = '.';
+	r->json = json;
+	r->buf = malloc(DUMP_BUF_SIZE);
+	if (!r->buf)
+		return -ENOMEM;
+	return 0;
+}
+
+/* Write out the rest of the dump, return the first error of the writes */
+int btrfs_dump_send_finish(struct btrfs_dump_send_args *r)
+{
+	int ret = r->ret;
+
+	if (!ret) {
+		fflush(stdout);
+		ret = dump_flush(r);
+	}
+	free(r->buf);
+	r->buf = NULL;
+	return ret;
 }
 
 struct btrfs_send_ops btrfs_print_send_ops = {
@@ -21,13 +21,35 @@
 
 #include <linux/limits.h>
 #include <limits.h>
+#include <stdbool.h>
+#include <time.h>
 #include "common/send-stream.h"
 
+#define DUMP_TIME_STRING_MAX	64
+
 struct btrfs_dump_send_args {
 	char full_subvol_path[PATH_MAX];
 	char root_path[PATH_MAX];
+
+	/* Print JSON objects, one per line */
+	bool json;
+	/* Output buffer, see btrfs_dump_send_finish() */
+	char *buf;
+	size_t buf_len;
+	/* First error of writing the output */
+	int ret;
+	/* Length of the path printed on the current line */
+	int column;
+
+	/* The last formatted atime, mtime and ctime */
+	time_t time_sec[3];
+	bool time_valid[3];
+	char time_str[3][DUMP_TIME_STRING_MAX];
 };
 
 extern struct btrfs_send_ops btrfs_print_send_ops;
 
+int btrfs_dump_send_init(struct btrfs_dump_send_args *r, bool json);
+int btrfs_dump_send_finish(struct btrfs_dump_send_args *r);
+
 #endif
@@ -20,6 +20,8 @@
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include <sys/xattr.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <linux/fs.h>
 #if HAVE_LINUX_FSVERITY_H
 #include <linux/fsverity.h>
@@ -35,6 +37,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <uuid/uuid.h>
 #include <zlib.h>
 #if COMPRESSION_LZO
@@ -44,32 +50,107 @@
 #if COMPRESSION_ZSTD
 #include <zstd.h>
 #endif
+#include "kernel-lib/list.h"
+#include "kernel-lib/rbtree.h"
 #include "kernel-shared/uapi/btrfs.h"
+#include "crypto/crc32c.h"
 #include "common/defs.h"
 #include "common/messages.h"
 #include "common/utils.h"
 #include "common/send-stream.h"
 #include "common/send-utils.h"
 #include "common/help.h"
+#include "common/io-ring.h"
 #include "common/path-utils.h"
+#include "common/stats.h"
 #include "common/string-utils.h"
+#include "common/units.h"
 #include "cmds/commands.h"
 #include "cmds/receive-dump.h"
 
+/* Threads applying the commands of the stream, see struct receive_pool */
+#define RECEIVE_MAX_THREADS	(64)
+/* Commands queued to each thread and not applied yet */
+#define RECEIVE_WORKER_JOBS	(64)
+/* Files kept open for the writes and as clone sources, by each thread */
+#define RECEIVE_FD_CACHE_SIZE	(16)
+/* Paths with attributes not applied yet, see struct receive_attrs */
+#define RECEIVE_MAX_ATTRS	(4096)
+/* Writes in flight with --io-uring, see struct receive_uring */
+#define RECEIVE_URING_DEPTH	(64)
+/* Writes queued before they're submitted */
+#define RECEIVE_URING_BATCH	(8)
+/* Streams received at once by the daemon, see struct receive_daemon */
+#define RECEIVE_MAX_STREAMS	(256)
+
+struct receive_pool;
+
+/* The files open last, closed when their path is renamed or removed */
+struct receive_fd_cache {
+	struct {
+		/* Absolute path of a file written, mount relative for sources */
+		char *path;
+		int fd;
+		bool source;
+		u64 last_used;
+		/* Writes queued to io_uring and not completed */
+		unsigned int writes;
+	} entries[RECEIVE_FD_CACHE_SIZE];
+	u64 clock;
+};
+
+/*
+ * Writes queued to io_uring with --io-uring, the thread reading the stream
+ * goes on while they're in flight.
+ *
+ * The data are copied to the buffer of a slot, which refers to the cached
+ * file written. The writes of a file are waited for before it's closed,
+ * i.e. before it's renamed or removed and at the end of the subvolume, and
+ * before the commands whose result depends on the data or that change the
+ * times, like truncate, fallocate, encoded writes, utimes and the clones.
+ * A write overlapping one in flight to the same file waits for the file, so
+ * the result is the same as in the order of the stream.
+ *
+ * The errors of the writes are returned for the next write or at the end of
+ * the subvolume.
+ */
+struct receive_uring {
+	struct io_ring ring;
+	struct {
+		void *buf;
+		size_t buf_size;
+		/* Index of the file in fd_cache, -1 if the slot is free */
+		int entry;
+		u64 offset;
+		u64 len;
+	} slots[RECEIVE_URING_DEPTH];
+	unsigned int in_flight;
+	/* The first error not returned yet */
+	int err;
+};
+
 struct btrfs_receive
 {
 	int mnt_fd;
 	int dest_dir_fd;
 
+	/* The file opened by open_inode_for_write(), owned by fd_cache */
 	int write_fd;
-	char write_path[PATH_MAX];
+	struct receive_fd_cache fd_cache;
 
 	char *root_path;
+	char *dest_dir_full_path;
 	char *dest_dir_path; /* relative to root_path */
 	char full_subvol_path[PATH_MAX];
 	char *full_root_path;
 
 	struct subvol_info cur_subvol;
+	/*
+	 * The sources of the clones and the snapshots, reset on changes.  Shared
+	 * by the streams of the daemon, which take the lock, NULL otherwise.
+	 */
+	struct subvol_uuid_cache *uuid_cache;
+	pthread_mutex_t *uuid_cache_lock;
 	/*
 	 * Substitute for cur_subvol::path which is a pointer and we cannot
 	 * change it to an array as it's a public API.
@@ -81,14 +162,52 @@ struct btrfs_receive
 	bool honor_end_cmd;
 
 	bool force_decompress;
+	/* The encoded write ioctl is not supported, decompress without trying */
+	bool no_encoded_write;
 
 #if COMPRESSION_ZSTD
 	/* Reuse stream objects for encoded_write decompression fallback */
 	ZSTD_DStream *zstd_dstream;
 #endif
 	z_stream *zlib_stream;
+
+	unsigned int nr_threads;
+	struct receive_pool *pool;
+	/* Queue the writes to io_uring, see struct receive_uring */
+	bool use_io_uring;
+	struct receive_uring *uring;
+
+	/* Pending attributes by path, and from the least recently changed */
+	struct rb_root attrs_root;
+	struct list_head attrs_lru;
+	unsigned int nr_attrs;
+
+	/* Clone not applied yet, extended by the contiguous ones following */
+	struct {
+		char *path;
+		char *clone_path;
+		u8 clone_uuid[BTRFS_UUID_SIZE];
+		u64 clone_ctransid;
+		u64 offset;
+		u64 len;
+		u64 clone_offset;
+	} clone;
 };
 
+static int flush_attrs(struct btrfs_receive *rctx, const char *path);
+static void receive_uring_wait(struct btrfs_receive *rctx, int entry);
+static int receive_uring_result(struct btrfs_receive *rctx, int ret);
+
+/* The subvolumes changed, the uuids and paths are searched again */
+static void uuid_cache_invalidate(struct btrfs_receive *rctx)
+{
+	if (rctx->uuid_cache_lock)
+		pthread_mutex_lock(rctx->uuid_cache_lock);
+	subvol_uuid_cache_invalidate(rctx->uuid_cache);
+	if (rctx->uuid_cache_lock)
+		pthread_mutex_unlock(rctx->uuid_cache_lock);
+}
+
 static int finish_subvol(struct btrfs_receive *rctx)
 {
 	int ret;
@@ -96,9 +215,19 @@ static int finish_subvol(struct btrfs_receive *rctx)
 	struct btrfs_ioctl_received_subvol_args rs_args;
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 	u64 flags;
+	u64 start;
 
+	/* The writes are done before the subvolume is set read-only */
+	receive_uring_wait(rctx, -1);
+	ret = receive_uring_result(rctx, 0);
 	if (rctx->cur_subvol_path[0] == 0)
-		return 0;
+		return ret;
+	if (ret < 0)
+		goto out;
+
+	ret = flush_attrs(rctx, NULL);
+	if (ret < 0)
+		goto out;
 
 	subvol_fd = openat(rctx->mnt_fd, rctx->cur_subvol_path,
 			   O_RDONLY | O_NOATIME);
@@ -118,7 +247,10 @@ static int finish_subvol(struct btrfs_receive *rctx)
 				"stransid=%llu\n", uuid_str, rs_args.stransid);
 	}
 
+	start = stats_io_start();
 	ret = ioctl(subvol_fd, BTRFS_IOC_SET_RECEIVED_SUBVOL, &rs_args);
+	stats_op("receive set_received ioctl", 0, start);
+	uuid_cache_invalidate(rctx);
 	if (ret < 0) {
 		ret = -errno;
 		error("ioctl BTRFS_IOC_SET_RECEIVED_SUBVOL failed: %m");
@@ -160,6 +292,7 @@ static int process_subvol(const char *path, const u8 *uuid, u64 ctransid,
 	struct btrfs_receive *rctx = user;
 	struct btrfs_ioctl_vol_args args_v1;
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
+	u64 start;
 
 	ret = finish_subvol(rctx);
 	if (ret < 0)
@@ -210,7 +343,10 @@ static int process_subvol(const char *path, const u8 *uuid, u64 ctransid,
 
 	memset(&args_v1, 0, sizeof(args_v1));
 	strncpy_null(args_v1.name, path, sizeof(args_v1.name));
+	start = stats_io_start();
 	ret = ioctl(rctx->dest_dir_fd, BTRFS_IOC_SUBVOL_CREATE, &args_v1);
+	stats_op("receive subvol ioctl", 0, start);
+	uuid_cache_invalidate(rctx);
 	if (ret < 0) {
 		ret = -errno;
 		error("creating subvolume %s failed: %m", path);
@@ -225,17 +361,23 @@ out:
  * Search for the @subvol_uuid, try received_uuid and subvolume as a fallback
  * if it's not found.
  */
-static struct subvol_info *search_source_subvol(int mnt_fd, const u8 *subvol_uuid,
+static struct subvol_info *search_source_subvol(struct btrfs_receive *rctx,
+						const u8 *subvol_uuid,
 						u64 transid)
 {
+	struct subvol_uuid_cache *cache = rctx->uuid_cache;
 	struct subvol_info *found;
 
-	found = subvol_uuid_search(mnt_fd, 0, subvol_uuid, transid, NULL,
-				   subvol_search_by_received_uuid);
+	if (rctx->uuid_cache_lock)
+		pthread_mutex_lock(rctx->uuid_cache_lock);
+	found = subvol_uuid_cache_search(cache, 0, subvol_uuid, transid, NULL,
+					 subvol_search_by_received_uuid);
 	if (IS_ERR_OR_NULL(found)) {
-		found = subvol_uuid_search(mnt_fd, 0, subvol_uuid, transid,
-					   NULL, subvol_search_by_uuid);
+		found = subvol_uuid_cache_search(cache, 0, subvol_uuid, transid,
+						 NULL, subvol_search_by_uuid);
 	}
+	if (rctx->uuid_cache_lock)
+		pthread_mutex_unlock(rctx->uuid_cache_lock);
 
 	return found;
 }
@@ -249,6 +391,7 @@ static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 	char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
 	struct btrfs_ioctl_vol_args_v2 args_v2;
 	struct subvol_info *parent_subvol = NULL;
+	u64 start;
 
 	ret = finish_subvol(rctx);
 	if (ret < 0)
@@ -302,7 +445,7 @@ static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 	memset(&args_v2, 0, sizeof(args_v2));
 	strncpy_null(args_v2.name, path, sizeof(args_v2.name));
 
-	parent_subvol = search_source_subvol(rctx->mnt_fd, parent_uuid,
+	parent_subvol = search_source_subvol(rctx, parent_uuid,
 					     parent_ctransid);
 	if (IS_ERR_OR_NULL(parent_subvol)) {
 		if (!parent_subvol)
@@ -373,7 +516,10 @@ static int process_snapshot(const char *path, const u8 *uuid, u64 ctransid,
 		goto out;
 	}
 
+	start = stats_io_start();
 	ret = ioctl(rctx->dest_dir_fd, BTRFS_IOC_SNAP_CREATE_V2, &args_v2);
+	stats_op("receive snapshot ioctl", 0, start);
+	uuid_cache_invalidate(rctx);
 	close(args_v2.fd);
 	if (ret < 0) {
 		ret = -errno;
@@ -544,9 +690,260 @@ out:
 	return ret;
 }
 
+static void receive_uring_set_error(struct receive_uring *uring, int ret)
+{
+	if (!uring->err)
+		uring->err = ret;
+}
+
+/* Account the completion of the write in @slot, finish it if it was short */
+static void receive_uring_complete(struct btrfs_receive *rctx, unsigned int slot,
+				   int res)
+{
+	struct receive_uring *uring = rctx->uring;
+	const int entry = uring->slots[slot].entry;
+	const char *path = rctx->fd_cache.entries[entry].path;
+	const u64 len = uring->slots[slot].len;
+	u64 pos = max(res, 0);
+
+	if (res < 0) {
+		errno = -res;
+		error("writing to %s failed: %m", path);
+		receive_uring_set_error(uring, res);
+	}
+	while (res >= 0 && pos < len) {
+		ssize_t w;
+
+		w = pwrite(rctx->fd_cache.entries[entry].fd,
+			   (char *)uring->slots[slot].buf + pos, len - pos,
+			   uring->slots[slot].offset + pos);
+		if (w < 0) {
+			error("writing to %s failed: %m", path);
+			receive_uring_set_error(uring, -errno);
+			break;
+		}
+		pos += w;
+	}
+	rctx->fd_cache.entries[entry].writes--;
+	uring->slots[slot].entry = -1;
+	uring->in_flight--;
+}
+
+/* Submit the queued writes and reap the completions, waiting for one */
+static void receive_uring_reap(struct btrfs_receive *rctx)
+{
+	struct receive_uring *uring = rctx->uring;
+	u64 start = stats_io_start();
+	u64 slot;
+	int res;
+	int ret;
+
+	ret = io_ring_submit(&uring->ring, 1);
+	stats_op("receive uring wait", 0, start);
+	if (ret < 0) {
+		/* Nothing would complete, fail the writes in flight */
+		errno = -ret;
+		error("io_uring submission failed: %m");
+		for (int i = 0; i < RECEIVE_URING_DEPTH; i++) {
+			if (uring->slots[i].entry >= 0)
+				receive_uring_complete(rctx, i, ret);
+		}
+		uring->ring.to_submit = 0;
+		return;
+	}
+	while (io_ring_reap(&uring->ring, &slot, &res))
+		receive_uring_complete(rctx, slot, res);
+}
+
+/* Wait for the writes of the cached file @entry, or all writes if it's -1 */
+static void receive_uring_wait(struct btrfs_receive *rctx, int entry)
+{
+	struct receive_uring *uring = rctx->uring;
+
+	if (!uring)
+		return;
+	while (entry < 0 ? uring->in_flight :
+			   rctx->fd_cache.entries[entry].writes)
+		receive_uring_reap(rctx);
+}
+
+/* Wait for the writes of the file @full_path, if it's cached */
+static void receive_uring_wait_path(struct btrfs_receive *rctx,
+				    const char *full_path)
+{
+	struct receive_fd_cache *cache = &rctx->fd_cache;
+
+	if (!rctx->uring)
+		return;
+	for (int i = 0; i < RECEIVE_FD_CACHE_SIZE; i++) {
+		if (cache->entries[i].writes &&
+		    strcmp(cache->entries[i].path, full_path) == 0)
+			receive_uring_wait(rctx, i);
+	}
+}
+
+/* Return the error of a write not returned yet if @ret is 0 */
+static int receive_uring_result(struct btrfs_receive *rctx, int ret)
+{
+	if (!rctx->uring || ret)
+		return ret;
+	ret = rctx->uring->err;
+	rctx->uring->err = 0;
+	return ret;
+}
+
+static void receive_uring_free(struct receive_uring *uring)
+{
+	if (!uring)
+		return;
+	io_ring_release(&uring->ring);
+	for (int i = 0; i < RECEIVE_URING_DEPTH; i++)
+		free(uring->slots[i].buf);
+	free(uring);
+}
+
+/* Return NULL if io_uring is not supported, the writes are synchronous then */
+static struct receive_uring *receive_uring_start(void)
+{
+	struct receive_uring *uring;
+	int ret;
+
+	uring = calloc(1, sizeof(*uring));
+	if (!uring)
+		return NULL;
+	ret = io_ring_init(&uring->ring, RECEIVE_URING_DEPTH);
+	if (ret < 0) {
+		errno = -ret;
+		warning("cannot use io_uring, writing synchronously: %m");
+		free(uring);
+		return NULL;
+	}
+	for (int i = 0; i < RECEIVE_URING_DEPTH; i++)
+		uring->slots[i].entry = -1;
+	return uring;
+}
+
+static void fd_cache_close_entry(struct btrfs_receive *rctx, int i)
+{
+	struct receive_fd_cache *cache = &rctx->fd_cache;
+
+	if (cache->entries[i].writes)
+		receive_uring_wait(rctx, i);
+	close(cache->entries[i].fd);
+	free(cache->entries[i].path);
+	cache->entries[i].path = NULL;
+}
+
+/*
+ * Return the cached fd of @path, or open it read-write (or read-only for
+ * clone @source) in place of the least recently used one.
+ */
+static int fd_cache_open(struct btrfs_receive *rctx, const char *path,
+			 bool source)
+{
+	struct receive_fd_cache *cache = &rctx->fd_cache;
+	int victim = 0;
+	int fd;
+
+	for (int i = 0; i < RECEIVE_FD_CACHE_SIZE; i++) {
+		if (!cache->entries[i].path) {
+			victim = i;
+			continue;
+		}
+		if (cache->entries[i].source == source &&
+		    strcmp(cache->entries[i].path, path) == 0) {
+			cache->entries[i].last_used = ++cache->clock;
+			return cache->entries[i].fd;
+		}
+		if (cache->entries[victim].path &&
+		    cache->entries[i].last_used < cache->entries[victim].last_used)
+			victim = i;
+	}
+	if (cache->entries[victim].path)
+		fd_cache_close_entry(rctx, victim);
+
+	if (source)
+		fd = openat(rctx->mnt_fd, path, O_RDONLY | O_NOATIME);
+	else
+		fd = open(path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+	cache->entries[victim].path = strdup(path);
+	if (!cache->entries[victim].path) {
+		close(fd);
+		return -ENOMEM;
+	}
+	cache->entries[victim].fd = fd;
+	cache->entries[victim].source = source;
+	cache->entries[victim].last_used = ++cache->clock;
+	return fd;
+}
+
+static bool fd_cache_path_under(const char *entry, const char *path)
+{
+	const size_t len = strlen(path);
+
+	return strncmp(entry, path, len) == 0 &&
+	       (entry[len] == 0 || entry[len] == '/');
+}
+
+/*
+ * Close the cached files of the stream @path and the paths below it, which
+ * are going to be renamed or removed.
+ */
+static void close_cached_path(struct btrfs_receive *rctx, const char *path)
+{
+	struct receive_fd_cache *cache = &rctx->fd_cache;
+	char full_path[PATH_MAX];
+	char source_path[PATH_MAX];
+
+	if (path_cat_out(full_path, rctx->full_subvol_path, path) < 0 ||
+	    path_cat_out(source_path, rctx->cur_subvol_path, path) < 0)
+		full_path[0] = source_path[0] = 0;
+
+	for (int i = 0; i < RECEIVE_FD_CACHE_SIZE; i++) {
+		const char *entry = cache->entries[i].path;
+
+		if (!entry)
+			continue;
+		if (!fd_cache_path_under(entry, cache->entries[i].source ?
+					 source_path : full_path))
+			continue;
+		if (cache->entries[i].fd == rctx->write_fd)
+			rctx->write_fd = -1;
+		fd_cache_close_entry(rctx, i);
+	}
+}
+
+static int open_inode_for_write(struct btrfs_receive *rctx, const char *path)
+{
+	int fd;
+
+	fd = fd_cache_open(rctx, path, false);
+	if (fd < 0) {
+		errno = -fd;
+		error("cannot open %s: %m", path);
+		rctx->write_fd = -1;
+		return fd;
+	}
+	rctx->write_fd = fd;
+	return 0;
+}
+
+/* Close all the cached files */
+static void close_inode_for_write(struct btrfs_receive *rctx)
+{
+	for (int i = 0; i < RECEIVE_FD_CACHE_SIZE; i++) {
+		if (rctx->fd_cache.entries[i].path)
+			fd_cache_close_entry(rctx, i);
+	}
+	rctx->write_fd = -1;
+}
+
 static int process_rename(const char *from, const char *to, void *user)
 {
 	int ret;
+	int err;
 	struct btrfs_receive *rctx = user;
 	char full_from[PATH_MAX];
 	char full_to[PATH_MAX];
@@ -566,8 +963,15 @@ static int process_rename(const char *from, const char *to, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rename %s -> %s\n", from, to);
 
-	ret = rename(full_from, full_to);
-	if (ret < 0) {
+	/* The pending attributes are applied while the names are valid */
+	ret = flush_attrs(rctx, from);
+	err = flush_attrs(rctx, to);
+	if (err < 0 && ret == 0)
+		ret = err;
+
+	close_cached_path(rctx, from);
+	close_cached_path(rctx, to);
+	if (rename(full_from, full_to) < 0) {
 		ret = -errno;
 		error("rename %s -> %s failed: %m", from, to);
 	}
@@ -624,8 +1028,9 @@ static int process_unlink(const char *path, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "unlink %s\n", path);
 
-	ret = unlink(full_path);
-	if (ret < 0) {
+	ret = flush_attrs(rctx, path);
+	close_cached_path(rctx, path);
+	if (unlink(full_path) < 0) {
 		ret = -errno;
 		error("unlink %s failed: %m", path);
 	}
@@ -649,8 +1054,9 @@ static int process_rmdir(const char *path, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "rmdir %s\n", path);
 
-	ret = rmdir(full_path);
-	if (ret < 0) {
+	ret = flush_attrs(rctx, path);
+	close_cached_path(rctx, path);
+	if (rmdir(full_path) < 0) {
 		ret = -errno;
 		error("rmdir %s failed: %m", path);
 	}
@@ -659,37 +1065,67 @@ out:
 	return ret;
 }
 
-static int open_inode_for_write(struct btrfs_receive *rctx, const char *path)
+/* Queue a write of @data to rctx->write_fd, the file open by the write */
+static int receive_uring_write(struct btrfs_receive *rctx, const void *data,
+			       u64 offset, u64 len)
 {
-	int ret = 0;
+	struct receive_uring *uring = rctx->uring;
+	struct receive_fd_cache *cache = &rctx->fd_cache;
+	int entry = -1;
+	int slot = -1;
+	int ret;
 
-	if (rctx->write_fd != -1) {
-		if (strcmp(rctx->write_path, path) == 0)
-			goto out;
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
+	for (int i = 0; i < RECEIVE_FD_CACHE_SIZE; i++) {
+		if (cache->entries[i].path && !cache->entries[i].source &&
+		    cache->entries[i].fd == rctx->write_fd) {
+			entry = i;
+			break;
+		}
 	}
+	UASSERT(entry >= 0);
 
-	rctx->write_fd = open(path, O_RDWR);
-	if (rctx->write_fd < 0) {
-		ret = -errno;
-		error("cannot open %s: %m", path);
-		goto out;
+	for (int i = 0; i < RECEIVE_URING_DEPTH; i++) {
+		if (uring->slots[i].entry == entry &&
+		    offset < uring->slots[i].offset + uring->slots[i].len &&
+		    uring->slots[i].offset < offset + len) {
+			receive_uring_wait(rctx, entry);
+			break;
+		}
+	}
+	while (uring->in_flight == RECEIVE_URING_DEPTH)
+		receive_uring_reap(rctx);
+	for (int i = 0; i < RECEIVE_URING_DEPTH; i++) {
+		if (uring->slots[i].entry < 0) {
+			slot = i;
+			break;
+		}
 	}
-	strncpy_null(rctx->write_path, path, sizeof(rctx->write_path));
-
-out:
-	return ret;
-}
 
-static void close_inode_for_write(struct btrfs_receive *rctx)
-{
-	if(rctx->write_fd == -1)
-		return;
+	if (uring->slots[slot].buf_size < len) {
+		void *buf = realloc(uring->slots[slot].buf, len);
 
-	close(rctx->write_fd);
-	rctx->write_fd = -1;
-	rctx->write_path[0] = 0;
+		if (!buf) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+		uring->slots[slot].buf = buf;
+		uring->slots[slot].buf_size = len;
+	}
+	memcpy(uring->slots[slot].buf, data, len);
+	uring->slots[slot].entry = entry;
+	uring->slots[slot].offset = offset;
+	uring->slots[slot].len = len;
+	cache->entries[entry].writes++;
+	uring->in_flight++;
+	io_ring_write(&uring->ring, rctx->write_fd, uring->slots[slot].buf, len,
+		      offset, slot);
+
+	if (uring->ring.to_submit >= RECEIVE_URING_BATCH) {
+		ret = io_ring_submit(&uring->ring, 0);
+		if (ret < 0)
+			receive_uring_reap(rctx);
+	}
+	return receive_uring_result(rctx, 0);
 }
 
 static int process_write(const char *path, const void *data, u64 offset,
@@ -715,9 +1151,15 @@ static int process_write(const char *path, const void *data, u64 offset,
 		fprintf(stderr, "write %s - offset=%llu length=%llu\n",
 			path, offset, len);
 
+	if (rctx->uring)
+		return receive_uring_write(rctx, data, offset, len);
+
 	while (pos < len) {
+		u64 start = stats_io_start();
+
 		w = pwrite(rctx->write_fd, (char*)data + pos, len - pos,
 				offset + pos);
+		stats_op("receive pwrite", max(w, 0), start);
 		if (w < 0) {
 			ret = -errno;
 			error("writing to %s failed: %m", path);
@@ -742,7 +1184,8 @@ static int process_clone(const char *path, u64 offset, u64 len,
 	char full_path[PATH_MAX];
 	const char *subvol_path;
 	char full_clone_path[PATH_MAX];
-	int clone_fd = -1;
+	int clone_fd;
+	u64 start;
 
 	ret = path_cat_out(full_path, rctx->full_subvol_path, path);
 	if (ret < 0) {
@@ -758,7 +1201,7 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		   BTRFS_UUID_SIZE) == 0) {
 		subvol_path = rctx->cur_subvol_path;
 	} else {
-		si = search_source_subvol(rctx->mnt_fd, clone_uuid,
+		si = search_source_subvol(rctx, clone_uuid,
 					  clone_ctransid);
 		if (IS_ERR_OR_NULL(si)) {
 			char uuid_str[BTRFS_UUID_UNPARSED_SIZE];
@@ -796,9 +1239,10 @@ static int process_clone(const char *path, u64 offset, u64 len,
 		goto out;
 	}
 
-	clone_fd = openat(rctx->mnt_fd, full_clone_path, O_RDONLY | O_NOATIME);
+	clone_fd = fd_cache_open(rctx, full_clone_path, true);
 	if (clone_fd < 0) {
-		ret = -errno;
+		ret = clone_fd;
+		errno = -ret;
 		error("cannot open %s: %m", full_clone_path);
 		goto out;
 	}
@@ -808,11 +1252,15 @@ static int process_clone(const char *path, u64 offset, u64 len,
 			"clone %s - source=%s source offset=%llu offset=%llu length=%llu\n",
 			path, clone_path, clone_offset, offset, len);
 
+	/* The source may be any of the files written */
+	receive_uring_wait(rctx, -1);
 	clone_args.src_fd = clone_fd;
 	clone_args.src_offset = clone_offset;
 	clone_args.src_length = len;
 	clone_args.dest_offset = offset;
+	start = stats_io_start();
 	ret = ioctl(rctx->write_fd, BTRFS_IOC_CLONE_RANGE, &clone_args);
+	stats_op("receive clone ioctl", len, start);
 	if (ret < 0) {
 		ret = -errno;
 		error("failed to clone extents to %s: %m", path);
@@ -824,8 +1272,6 @@ out:
 		free(si->path);
 		free(si);
 	}
-	if (clone_fd != -1)
-		close(clone_fd);
 	return ret;
 }
 
@@ -849,6 +1295,11 @@ static int process_set_xattr(const char *path, const char *name,
 				len, (char*)data);
 	}
 
+	/* Changing the owner would drop the file capabilities set here */
+	ret = flush_attrs(rctx, path);
+	if (ret < 0)
+		goto out;
+
 	ret = lsetxattr(full_path, name, data, len, 0);
 	if (ret < 0) {
 		ret = -errno;
@@ -904,6 +1355,7 @@ static int process_truncate(const char *path, u64 size, void *user)
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "truncate %s size=%llu\n", path, size);
 
+	receive_uring_wait_path(rctx, full_path);
 	ret = truncate(full_path, size);
 	if (ret < 0) {
 		ret = -errno;
@@ -985,6 +1437,8 @@ static int process_utimes(const char *path, struct timespec *at,
 	if (bconf.verbose >= 3)
 		fprintf(stderr, "utimes %s\n", path);
 
+	/* The writes change the times as they complete */
+	receive_uring_wait_path(rctx, full_path);
 	tv[0] = *at;
 	tv[1] = *mt;
 	ret = utimensat(AT_FDCWD, full_path, tv, AT_SYMLINK_NOFOLLOW);
@@ -1182,6 +1636,7 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 	char *unencoded_data;
 	int sector_shift = 0;
 	u64 written = 0;
+	u64 start;
 
 	unencoded_data = calloc(unencoded_len, 1);
 	if (!unencoded_data) {
@@ -1189,6 +1644,7 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 		return -errno;
 	}
 
+	start = stats_io_start();
 	switch (compression) {
 	case BTRFS_ENCODED_IO_COMPRESSION_ZLIB:
 		ret = decompress_zlib(rctx, encoded_data, encoded_len,
@@ -1231,12 +1687,15 @@ static int decompress_and_write(struct btrfs_receive *rctx,
 		ret = -EOPNOTSUPP;
 		goto out;
 	}
+	stats_op("receive decompress", unencoded_len, start);
 
 	while (written < unencoded_file_len) {
 		ssize_t w;
 
+		start = stats_io_start();
 		w = pwrite(rctx->write_fd, unencoded_data + unencoded_offset,
 			   unencoded_file_len - written, offset);
+		stats_op("receive pwrite", max_t(ssize_t, w, 0), start);
 		if (w < 0) {
 			ret = -errno;
 			error("writing unencoded data failed: %m");
@@ -1291,9 +1750,13 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		return ret;
+	receive_uring_wait_path(rctx, full_path);
+
+	if (!rctx->force_decompress && !rctx->no_encoded_write) {
+		u64 start = stats_io_start();
 
-	if (!rctx->force_decompress) {
 		ret = ioctl(rctx->write_fd, BTRFS_IOC_ENCODED_WRITE, &encoded);
+		stats_op("receive encoded_write ioctl", len, start);
 		if (ret >= 0)
 			return 0;
 		/* Fall back for these errors, fail hard for anything else. */
@@ -1302,6 +1765,9 @@ static int process_encoded_write(const char *path, const void *data, u64 offset,
 			error("encoded_write: writing to %s failed: %m", path);
 			return ret;
 		}
+		/* The others depend on the extent, retry with the next one */
+		if (errno == ENOTTY)
+			rctx->no_encoded_write = true;
 		if (bconf.verbose >= 3)
 			fprintf(stderr,
 "encoded_write %s - falling back to decompress and write due to errno %d (\"%m\")\n",
@@ -1333,6 +1799,7 @@ static int process_fallocate(const char *path, int mode, u64 offset, u64 len,
 	ret = open_inode_for_write(rctx, full_path);
 	if (ret < 0)
 		return ret;
+	receive_uring_wait_path(rctx, full_path);
 	ret = fallocate(rctx->write_fd, mode, offset, len);
 	if (ret < 0) {
 		ret = -errno;
@@ -1440,82 +1907,1484 @@ static int process_enable_verity(const char *path, u8 algorithm, u32 block_size,
 
 #endif
 
-static struct btrfs_send_ops send_ops = {
-	.subvol = process_subvol,
-	.snapshot = process_snapshot,
-	.mkfile = process_mkfile,
-	.mkdir = process_mkdir,
-	.mknod = process_mknod,
-	.mkfifo = process_mkfifo,
-	.mksock = process_mksock,
-	.symlink = process_symlink,
-	.rename = process_rename,
-	.link = process_link,
-	.unlink = process_unlink,
-	.rmdir = process_rmdir,
-	.write = process_write,
-	.clone = process_clone,
-	.set_xattr = process_set_xattr,
-	.remove_xattr = process_remove_xattr,
-	.truncate = process_truncate,
-	.chmod = process_chmod,
-	.chown = process_chown,
-	.utimes = process_utimes,
-	.update_extent = process_update_extent,
-	.encoded_write = process_encoded_write,
-	.fallocate = process_fallocate,
-	.fileattr = process_fileattr,
-	.enable_verity = process_enable_verity,
+
+/*
+ * Receive with threads applying the commands.
+ *
+ * The stream is parsed by the main thread. The commands changing the names
+ * (creating, renaming, linking and removing the inodes, subvolumes and
+ * snapshots) and the clones are applied there in the stream order. The
+ * commands changing the content or the attributes of one inode (writes,
+ * xattrs, truncate, chmod, chown, utimes, fallocate, verity) are queued to
+ * one of the threads by the hash of the path, so the commands for one path
+ * are applied in order by the same thread.
+ *
+ * The writes of a file with encoded writes, which may need to be
+ * decompressed, are spread to all the threads instead. They write disjoint
+ * ranges and the other commands for the file wait until they're done.
+ *
+ * Before a name is created, moved or removed, the main thread waits for the
+ * queued commands for the same path, the paths below it and its parent
+ * directory, whose times would change. A clone waits for all queued commands
+ * as the source can be any file. Once a name is moved or removed, the files
+ * kept open by the threads for the writes are reopened by the path.
+ *
+ * The errors of the threads are returned for the next command parsed, the
+ * last ones at the end of the stream.
+ */
+enum receive_job_type {
+	RECEIVE_JOB_WRITE,
+	RECEIVE_JOB_ENCODED_WRITE,
+	RECEIVE_JOB_SET_XATTR,
+	RECEIVE_JOB_REMOVE_XATTR,
+	RECEIVE_JOB_TRUNCATE,
+	RECEIVE_JOB_CHMOD,
+	RECEIVE_JOB_CHOWN,
+	RECEIVE_JOB_UTIMES,
+	RECEIVE_JOB_FALLOCATE,
+	RECEIVE_JOB_ENABLE_VERITY,
 };
 
-static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
-		      char *realmnt, int r_fd, u64 max_errors)
+struct receive_job {
+	enum receive_job_type type;
+	/* Names generation the path was queued in, see receive_pool::name_gen */
+	u64 name_gen;
+	char *path;
+	/* The xattr name */
+	char *name;
+	/* Data of writes and xattrs, verity salt */
+	void *data;
+	void *sig;
+	union {
+		struct {
+			u64 offset;
+			u64 len;
+		} write;
+		struct {
+			u64 offset;
+			u64 len;
+			u64 unencoded_file_len;
+			u64 unencoded_len;
+			u64 unencoded_offset;
+			u32 compression;
+			u32 encryption;
+		} encoded;
+		int xattr_len;
+		u64 size;
+		u64 mode;
+		struct {
+			u64 uid;
+			u64 gid;
+		} chown;
+		struct timespec times[3];
+		struct {
+			int mode;
+			u64 offset;
+			u64 len;
+		} fallocate;
+		struct {
+			u8 algorithm;
+			u32 block_size;
+			int salt_len;
+			int sig_len;
+		} verity;
+	};
+};
+
+struct receive_worker {
+	struct receive_pool *pool;
+	pthread_t thread;
+	/* Own copy of the context, with the file open for writes */
+	struct btrfs_receive rctx;
+	u64 name_gen;
+
+	/* Ring of jobs, queued by the main thread and applied in order */
+	struct receive_job jobs[RECEIVE_WORKER_JOBS];
+	u64 queued_seq;
+	u64 done_seq;
+	/* The jobs up to this one write to receive_pool::spread_path */
+	u64 spread_seq;
+};
+
+struct receive_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t queued_cond;
+	pthread_cond_t done_cond;
+	bool stop;
+
+	unsigned int nr_workers;
+	struct receive_worker *workers;
+
+	/* Increased when a name is moved or removed */
+	u64 name_gen;
+
+	/*
+	 * The file whose writes are spread to all workers after an encoded
+	 * write, and the worker for the next one.
+	 */
+	char *spread_path;
+	u64 spread_name_gen;
+	unsigned int spread_next;
+
+	/* Errors of the workers, and how many were returned to the stream */
+	u64 errors;
+	u64 errors_returned;
+	int last_err;
+};
+
+static void free_decompress_streams(struct btrfs_receive *rctx)
 {
-	u64 subvol_id;
-	int ret;
-	char *dest_dir_full_path;
-	char root_subvol_path[PATH_MAX];
-	bool end = false;
-	int iterations = 0;
+#if COMPRESSION_ZSTD
+	if (rctx->zstd_dstream)
+		ZSTD_freeDStream(rctx->zstd_dstream);
+	rctx->zstd_dstream = NULL;
+#endif
+	if (rctx->zlib_stream) {
+		inflateEnd(rctx->zlib_stream);
+		free(rctx->zlib_stream);
+	}
+	rctx->zlib_stream = NULL;
+}
 
-	dest_dir_full_path = realpath(tomnt, NULL);
-	if (!dest_dir_full_path) {
-		ret = -errno;
-		error("realpath(%s) failed: %m", tomnt);
-		goto out;
+static void receive_job_release(struct receive_job *job)
+{
+	free(job->path);
+	free(job->name);
+	free(job->data);
+	free(job->sig);
+	memset(job, 0, sizeof(*job));
+}
+
+static int receive_job_apply(struct receive_worker *worker,
+			     struct receive_job *job)
+{
+	struct btrfs_receive *rctx = &worker->rctx;
+
+	/* The path may lead to another inode than the file kept open */
+	if (job->name_gen != worker->name_gen) {
+		close_inode_for_write(rctx);
+		worker->name_gen = job->name_gen;
 	}
-	rctx->dest_dir_fd = open(dest_dir_full_path, O_RDONLY | O_NOATIME);
-	if (rctx->dest_dir_fd < 0) {
-		ret = -errno;
-		error("cannot open destination directory %s: %m",
-			dest_dir_full_path);
-		goto out;
+
+	switch (job->type) {
+	case RECEIVE_JOB_WRITE:
+		return process_write(job->path, job->data, job->write.offset,
+				     job->write.len, rctx);
+	case RECEIVE_JOB_ENCODED_WRITE:
+		return process_encoded_write(job->path, job->data,
+					     job->encoded.offset,
+					     job->encoded.len,
+					     job->encoded.unencoded_file_len,
+					     job->encoded.unencoded_len,
+					     job->encoded.unencoded_offset,
+					     job->encoded.compression,
+					     job->encoded.encryption, rctx);
+	case RECEIVE_JOB_SET_XATTR:
+		return process_set_xattr(job->path, job->name, job->data,
+					 job->xattr_len, rctx);
+	case RECEIVE_JOB_REMOVE_XATTR:
+		return process_remove_xattr(job->path, job->name, rctx);
+	case RECEIVE_JOB_TRUNCATE:
+		return process_truncate(job->path, job->size, rctx);
+	case RECEIVE_JOB_CHMOD:
+		return process_chmod(job->path, job->mode, rctx);
+	case RECEIVE_JOB_CHOWN:
+		return process_chown(job->path, job->chown.uid, job->chown.gid,
+				     rctx);
+	case RECEIVE_JOB_UTIMES:
+		return process_utimes(job->path, &job->times[0],
+				      &job->times[1], &job->times[2], rctx);
+	case RECEIVE_JOB_FALLOCATE:
+		return process_fallocate(job->path, job->fallocate.mode,
+					 job->fallocate.offset,
+					 job->fallocate.len, rctx);
+	case RECEIVE_JOB_ENABLE_VERITY:
+		return process_enable_verity(job->path, job->verity.algorithm,
+					     job->verity.block_size,
+					     job->verity.salt_len, job->data,
+					     job->verity.sig_len, job->sig,
+					     rctx);
 	}
+	return -EINVAL;
+}
 
-	if (realmnt[0]) {
-		rctx->root_path = realmnt;
-	} else {
-		ret = find_mount_root(dest_dir_full_path, &rctx->root_path);
+static void *receive_worker_fn(void *arg)
+{
+	struct receive_worker *worker = arg;
+	struct receive_pool *pool = worker->pool;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		struct receive_job *job;
+		int ret;
+
+		while (worker->done_seq == worker->queued_seq && !pool->stop)
+			pthread_cond_wait(&pool->queued_cond, &pool->mutex);
+		/* The queued jobs are applied before stopping */
+		if (worker->done_seq == worker->queued_seq)
+			break;
+		job = &worker->jobs[worker->done_seq % RECEIVE_WORKER_JOBS];
+		pthread_mutex_unlock(&pool->mutex);
+
+		ret = receive_job_apply(worker, job);
+
+		pthread_mutex_lock(&pool->mutex);
 		if (ret < 0) {
-			errno = -ret;
-			error("failed to determine mount point for %s: %m",
-				dest_dir_full_path);
-			ret = -EINVAL;
-			goto out;
-		}
-		if (ret > 0) {
-			error("%s doesn't belong to btrfs mount point",
-				dest_dir_full_path);
-			ret = -EINVAL;
-			goto out;
+			pool->errors++;
+			pool->last_err = ret;
 		}
+		worker->done_seq++;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
+
+/* Wait for all the queued jobs */
+static void receive_pool_drain(struct receive_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->nr_workers; i++) {
+		struct receive_worker *worker = &pool->workers[i];
+
+		while (worker->done_seq != worker->queued_seq)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Update the contexts of the workers after the subvolume changed, all jobs
+ * must be done.
+ */
+static void receive_pool_sync(struct receive_pool *pool,
+			      const struct btrfs_receive *rctx)
+{
+	for (unsigned int i = 0; i < pool->nr_workers; i++) {
+		struct btrfs_receive *wctx = &pool->workers[i].rctx;
+		z_stream *zlib_stream = wctx->zlib_stream;
+		bool no_encoded_write = wctx->no_encoded_write;
+#if COMPRESSION_ZSTD
+		ZSTD_DStream *zstd_dstream = wctx->zstd_dstream;
+#endif
+
+		close_inode_for_write(wctx);
+		*wctx = *rctx;
+		wctx->write_fd = -1;
+		memset(&wctx->fd_cache, 0, sizeof(wctx->fd_cache));
+		wctx->attrs_root = RB_ROOT;
+		INIT_LIST_HEAD(&wctx->attrs_lru);
+		wctx->nr_attrs = 0;
+		memset(&wctx->clone, 0, sizeof(wctx->clone));
+		wctx->zlib_stream = zlib_stream;
+#if COMPRESSION_ZSTD
+		wctx->zstd_dstream = zstd_dstream;
+#endif
+		wctx->no_encoded_write |= no_encoded_write;
+		wctx->pool = NULL;
+		wctx->uring = NULL;
+	}
+}
+
+/* Close the files kept open by the workers, all jobs must be done */
+static void receive_pool_close_files(struct receive_pool *pool)
+{
+	for (unsigned int i = 0; i < pool->nr_workers; i++)
+		close_inode_for_write(&pool->workers[i].rctx);
+}
+
+static void receive_pool_free(struct receive_pool *pool)
+{
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->nr_workers; i++) {
+		struct receive_worker *worker = &pool->workers[i];
+
+		pthread_join(worker->thread, NULL);
+		close_inode_for_write(&worker->rctx);
+		free_decompress_streams(&worker->rctx);
+		for (int j = 0; j < RECEIVE_WORKER_JOBS; j++)
+			receive_job_release(&worker->jobs[j]);
+	}
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->queued_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->spread_path);
+	free(pool->workers);
+	free(pool);
+}
+
+static struct receive_pool *receive_pool_start(struct btrfs_receive *rctx)
+{
+	struct receive_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->workers = calloc(rctx->nr_threads, sizeof(*pool->workers));
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->queued_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	pool->nr_workers = rctx->nr_threads;
+	for (unsigned int i = 0; i < pool->nr_workers; i++) {
+		pool->workers[i].pool = pool;
+		pool->workers[i].rctx.write_fd = -1;
+	}
+	receive_pool_sync(pool, rctx);
+	for (unsigned int i = 0; i < rctx->nr_threads; i++) {
+		struct receive_worker *worker = &pool->workers[i];
+
+		if (pthread_create(&worker->thread, NULL, receive_worker_fn,
+				   worker)) {
+			pool->nr_workers = i;
+			break;
+		}
+	}
+	if (pool->nr_workers)
+		return pool;
+	receive_pool_free(pool);
+	return NULL;
+}
+
+/*
+ * Return the error of a worker not returned yet if @ret is 0, so the errors
+ * are accounted by the stream processing like the errors of the commands
+ * applied by the main thread.
+ */
+static int receive_pool_result(struct receive_pool *pool, int ret)
+{
+	if (ret)
+		return ret;
+	pthread_mutex_lock(&pool->mutex);
+	if (pool->errors > pool->errors_returned) {
+		pool->errors_returned++;
+		ret = pool->last_err;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return ret;
+}
+
+/*
+ * Return true if the job for @job_path must be done before changing the name
+ * @path, i.e. it's the same path, a path below it or the parent directory.
+ */
+static bool receive_path_conflicts(const char *job_path, const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	const size_t len = strlen(path);
+	const size_t parent_len = slash ? slash - path : 0;
+
+	if (strncmp(job_path, path, len) == 0 &&
+	    (job_path[len] == 0 || job_path[len] == '/'))
+		return true;
+	return strlen(job_path) == parent_len &&
+	       strncmp(job_path, path, parent_len) == 0;
+}
+
+/* Wait for the queued jobs conflicting with the names @path1 and @path2 */
+static void receive_pool_wait_paths(struct receive_pool *pool,
+				    const char *path1, const char *path2)
+{
+	pthread_mutex_lock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->nr_workers; i++) {
+		struct receive_worker *worker = &pool->workers[i];
+		u64 wait_seq = 0;
+
+		for (u64 seq = worker->done_seq; seq < worker->queued_seq; seq++) {
+			const char *job_path;
+
+			job_path = worker->jobs[seq % RECEIVE_WORKER_JOBS].path;
+			if (receive_path_conflicts(job_path, path1) ||
+			    (path2 && receive_path_conflicts(job_path, path2)))
+				wait_seq = seq + 1;
+		}
+		while (worker->done_seq < wait_seq)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Wait for the spread writes and stop spreading them */
+static void receive_pool_wait_spread(struct receive_pool *pool)
+{
+	pthread_mutex_lock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->nr_workers; i++) {
+		struct receive_worker *worker = &pool->workers[i];
+
+		while (worker->done_seq < worker->spread_seq)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	free(pool->spread_path);
+	pool->spread_path = NULL;
+}
+
+/*
+ * Return the worker for a write to @path if it's spread, the writes start to
+ * be spread from an encoded write of the file on. Return NULL for the worker
+ * by the hash of the path.
+ */
+static struct receive_worker *receive_pool_spread_worker(struct receive_pool *pool,
+							 const char *path,
+							 enum receive_job_type type)
+{
+	if (!pool->spread_path || pool->spread_name_gen != pool->name_gen ||
+	    strcmp(path, pool->spread_path) != 0) {
+		if (type != RECEIVE_JOB_ENCODED_WRITE || pool->nr_workers == 1)
+			return NULL;
+		if (pool->spread_path)
+			receive_pool_wait_spread(pool);
+		/* The commands queued before for the file go first */
+		receive_pool_wait_paths(pool, path, NULL);
+		pool->spread_path = strdup(path);
+		if (!pool->spread_path)
+			return NULL;
+		pool->spread_name_gen = pool->name_gen;
+	}
+	return &pool->workers[pool->spread_next++ % pool->nr_workers];
+}
+
+/*
+ * Get a free job of the worker for @path, waiting for the worker if all its
+ * jobs are queued. The job is queued by receive_pool_queue().
+ */
+static struct receive_job *receive_pool_get_job(struct receive_pool *pool,
+						const char *path,
+						enum receive_job_type type,
+						struct receive_worker **ret_worker)
+{
+	struct receive_worker *worker;
+	struct receive_job *job;
+	u32 hash;
+
+	if (type == RECEIVE_JOB_ENCODED_WRITE || type == RECEIVE_JOB_WRITE)
+		worker = receive_pool_spread_worker(pool, path, type);
+	else
+		worker = NULL;
+	if (!worker) {
+		if (pool->spread_path && strcmp(path, pool->spread_path) == 0)
+			receive_pool_wait_spread(pool);
+		hash = crc32c(~0U, path, strlen(path));
+		worker = &pool->workers[hash % pool->nr_workers];
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	while (worker->queued_seq - worker->done_seq == RECEIVE_WORKER_JOBS)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	pthread_mutex_unlock(&pool->mutex);
+
+	job = &worker->jobs[worker->queued_seq % RECEIVE_WORKER_JOBS];
+	if (pool->spread_path && strcmp(path, pool->spread_path) == 0)
+		worker->spread_seq = worker->queued_seq + 1;
+	receive_job_release(job);
+	job->type = type;
+	job->name_gen = pool->name_gen;
+	job->path = strdup(path);
+	if (!job->path) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	*ret_worker = worker;
+	return job;
+}
+
+static int receive_pool_queue(struct receive_pool *pool,
+			      struct receive_worker *worker)
+{
+	pthread_mutex_lock(&pool->mutex);
+	worker->queued_seq++;
+	pthread_cond_broadcast(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	return receive_pool_result(pool, 0);
+}
+
+static void *receive_job_dup(const void *data, size_t len)
+{
+	void *copy;
+
+	copy = malloc(len ? len : 1);
+	if (!copy) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return NULL;
+	}
+	memcpy(copy, data, len);
+	return copy;
+}
+
+static int thread_subvol(const char *path, const u8 *uuid, u64 ctransid,
+			 void *user)
+{
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	receive_pool_drain(rctx->pool);
+	ret = process_subvol(path, uuid, ctransid, user);
+	receive_pool_sync(rctx->pool, rctx);
+	return receive_pool_result(rctx->pool, ret);
+}
+
+static int thread_snapshot(const char *path, const u8 *uuid, u64 ctransid,
+			   const u8 *parent_uuid, u64 parent_ctransid,
+			   void *user)
+{
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	receive_pool_drain(rctx->pool);
+	ret = process_snapshot(path, uuid, ctransid, parent_uuid,
+			       parent_ctransid, user);
+	receive_pool_sync(rctx->pool, rctx);
+	return receive_pool_result(rctx->pool, ret);
+}
+
+static int thread_mkfile(const char *path, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	return receive_pool_result(rctx->pool, process_mkfile(path, user));
+}
+
+static int thread_mkdir(const char *path, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	return receive_pool_result(rctx->pool, process_mkdir(path, user));
+}
+
+static int thread_mknod(const char *path, u64 mode, u64 dev, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	return receive_pool_result(rctx->pool,
+				   process_mknod(path, mode, dev, user));
+}
+
+static int thread_mkfifo(const char *path, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	return receive_pool_result(rctx->pool, process_mkfifo(path, user));
+}
+
+static int thread_mksock(const char *path, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	return receive_pool_result(rctx->pool, process_mksock(path, user));
+}
+
+static int thread_symlink(const char *path, const char *lnk, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	return receive_pool_result(rctx->pool,
+				   process_symlink(path, lnk, user));
+}
+
+static int thread_rename(const char *from, const char *to, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	receive_pool_wait_paths(rctx->pool, from, to);
+	ret = process_rename(from, to, user);
+	rctx->pool->name_gen++;
+	return receive_pool_result(rctx->pool, ret);
+}
+
+static int thread_link(const char *path, const char *lnk, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	receive_pool_wait_paths(rctx->pool, path, lnk);
+	return receive_pool_result(rctx->pool, process_link(path, lnk, user));
+}
+
+static int thread_unlink(const char *path, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	ret = process_unlink(path, user);
+	rctx->pool->name_gen++;
+	return receive_pool_result(rctx->pool, ret);
+}
+
+static int thread_rmdir(const char *path, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	receive_pool_wait_paths(rctx->pool, path, NULL);
+	ret = process_rmdir(path, user);
+	rctx->pool->name_gen++;
+	return receive_pool_result(rctx->pool, ret);
+}
+
+static int thread_write(const char *path, const void *data, u64 offset,
+			u64 len, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_WRITE, &worker);
+	if (!job)
+		return -ENOMEM;
+	job->data = receive_job_dup(data, len);
+	if (!job->data)
+		return -ENOMEM;
+	job->write.offset = offset;
+	job->write.len = len;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_set_xattr(const char *path, const char *name,
+			    const void *data, int len, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+	int ret;
+
+	ret = flush_attrs(rctx, path);
+	if (ret < 0)
+		return ret;
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_SET_XATTR,
+				   &worker);
+	if (!job)
+		return -ENOMEM;
+	job->name = strdup(name);
+	job->data = receive_job_dup(data, len);
+	if (!job->name || !job->data)
+		return -ENOMEM;
+	job->xattr_len = len;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_remove_xattr(const char *path, const char *name, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_REMOVE_XATTR,
+				   &worker);
+	if (!job)
+		return -ENOMEM;
+	job->name = strdup(name);
+	if (!job->name)
+		return -ENOMEM;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_truncate(const char *path, u64 size, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_TRUNCATE,
+				   &worker);
+	if (!job)
+		return -ENOMEM;
+	job->size = size;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_chmod(const char *path, u64 mode, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_CHMOD, &worker);
+	if (!job)
+		return -ENOMEM;
+	job->mode = mode;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_CHOWN, &worker);
+	if (!job)
+		return -ENOMEM;
+	job->chown.uid = uid;
+	job->chown.gid = gid;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_utimes(const char *path, struct timespec *at,
+			 struct timespec *mt, struct timespec *ct,
+			 void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_UTIMES,
+				   &worker);
+	if (!job)
+		return -ENOMEM;
+	job->times[0] = *at;
+	job->times[1] = *mt;
+	job->times[2] = *ct;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_update_extent(const char *path, u64 offset, u64 len,
+				void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	return receive_pool_result(rctx->pool,
+			process_update_extent(path, offset, len, user));
+}
+
+static int thread_encoded_write(const char *path, const void *data,
+				u64 offset, u64 len, u64 unencoded_file_len,
+				u64 unencoded_len, u64 unencoded_offset,
+				u32 compression, u32 encryption, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_ENCODED_WRITE,
+				   &worker);
+	if (!job)
+		return -ENOMEM;
+	job->data = receive_job_dup(data, len);
+	if (!job->data)
+		return -ENOMEM;
+	job->encoded.offset = offset;
+	job->encoded.len = len;
+	job->encoded.unencoded_file_len = unencoded_file_len;
+	job->encoded.unencoded_len = unencoded_len;
+	job->encoded.unencoded_offset = unencoded_offset;
+	job->encoded.compression = compression;
+	job->encoded.encryption = encryption;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_fallocate(const char *path, int mode, u64 offset, u64 len,
+			    void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_FALLOCATE,
+				   &worker);
+	if (!job)
+		return -ENOMEM;
+	job->fallocate.mode = mode;
+	job->fallocate.offset = offset;
+	job->fallocate.len = len;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+static int thread_fileattr(const char *path, u64 attr, void *user)
+{
+	struct btrfs_receive *rctx = user;
+
+	return receive_pool_result(rctx->pool,
+				   process_fileattr(path, attr, user));
+}
+
+static int thread_enable_verity(const char *path, u8 algorithm,
+				u32 block_size, int salt_len, char *salt,
+				int sig_len, char *sig, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_worker *worker;
+	struct receive_job *job;
+
+	job = receive_pool_get_job(rctx->pool, path, RECEIVE_JOB_ENABLE_VERITY,
+				   &worker);
+	if (!job)
+		return -ENOMEM;
+	if (salt_len) {
+		job->data = receive_job_dup(salt, salt_len);
+		if (!job->data)
+			return -ENOMEM;
+	}
+	if (sig_len) {
+		job->sig = receive_job_dup(sig, sig_len);
+		if (!job->sig)
+			return -ENOMEM;
+	}
+	job->verity.algorithm = algorithm;
+	job->verity.block_size = block_size;
+	job->verity.salt_len = salt_len;
+	job->verity.sig_len = sig_len;
+	return receive_pool_queue(rctx->pool, worker);
+}
+
+/*
+ * The chown, chmod and utimes of a path not applied yet.
+ *
+ * The stream sends the times of a directory after each change of its entries
+ * and may repeat the attributes of an inode, only the last ones are applied.
+ * They're applied before the path is renamed or removed, before its xattrs
+ * are set, when there are too many pending paths and at the end of the
+ * subvolume. The owner is changed first as it clears the setuid bits, the
+ * times are set last.
+ */
+struct receive_attrs {
+	struct rb_node node;
+	struct list_head list;
+	char *path;
+
+	bool chown;
+	bool chmod;
+	bool utimes;
+	u64 uid;
+	u64 gid;
+	u64 mode;
+	struct timespec times[3];
+};
+
+static int attrs_cmp(const void *key, const struct rb_node *node)
+{
+	return strcmp(key, rb_entry(node, struct receive_attrs, node)->path);
+}
+
+/* Match the paths starting with the key, the ones below it are among them */
+static int attrs_prefix_cmp(const void *key, const struct rb_node *node)
+{
+	const struct receive_attrs *attrs;
+
+	attrs = rb_entry(node, struct receive_attrs, node);
+	return strncmp(key, attrs->path, strlen(key));
+}
+
+static bool attrs_less(struct rb_node *node1, const struct rb_node *node2)
+{
+	return attrs_cmp(rb_entry(node1, struct receive_attrs, node)->path,
+			 node2) < 0;
+}
+
+/* Apply and free @attrs, by the threads if there are some */
+static int apply_attrs(struct btrfs_receive *rctx, struct receive_attrs *attrs)
+{
+	int ret = 0;
+	int err;
+
+	if (attrs->chown) {
+		if (rctx->pool)
+			ret = thread_chown(attrs->path, attrs->uid, attrs->gid, rctx);
+		else
+			ret = process_chown(attrs->path, attrs->uid, attrs->gid, rctx);
+	}
+	if (attrs->chmod) {
+		if (rctx->pool)
+			err = thread_chmod(attrs->path, attrs->mode, rctx);
+		else
+			err = process_chmod(attrs->path, attrs->mode, rctx);
+		if (err < 0 && ret == 0)
+			ret = err;
+	}
+	if (attrs->utimes) {
+		if (rctx->pool)
+			err = thread_utimes(attrs->path, &attrs->times[0],
+					    &attrs->times[1], &attrs->times[2],
+					    rctx);
+		else
+			err = process_utimes(attrs->path, &attrs->times[0],
+					     &attrs->times[1], &attrs->times[2],
+					     rctx);
+		if (err < 0 && ret == 0)
+			ret = err;
+	}
+
+	rb_erase(&attrs->node, &rctx->attrs_root);
+	list_del(&attrs->list);
+	rctx->nr_attrs--;
+	free(attrs->path);
+	free(attrs);
+	return ret;
+}
+
+/*
+ * Apply the pending attributes of @path and the paths below it, or all of
+ * them if @path is NULL. The threads are waited for, so the attributes are
+ * set when this returns.
+ */
+static int flush_attrs(struct btrfs_receive *rctx, const char *path)
+{
+	struct receive_attrs *attrs;
+	struct receive_attrs *tmp;
+	struct rb_node *node;
+	bool applied = false;
+	size_t len;
+	int ret = 0;
+	int err;
+
+	if (!path) {
+		list_for_each_entry_safe(attrs, tmp, &rctx->attrs_lru, list) {
+			err = apply_attrs(rctx, attrs);
+			if (err < 0 && ret == 0)
+				ret = err;
+		}
+		if (rctx->pool) {
+			receive_pool_drain(rctx->pool);
+			ret = receive_pool_result(rctx->pool, ret);
+		}
+		return ret;
+	}
+
+	len = strlen(path);
+	node = rb_find_first(path, &rctx->attrs_root, attrs_prefix_cmp);
+	while (node) {
+		attrs = rb_entry(node, struct receive_attrs, node);
+		node = rb_next(node);
+		if (strncmp(attrs->path, path, len) != 0)
+			break;
+		if (attrs->path[len] != 0 && attrs->path[len] != '/')
+			continue;
+		err = apply_attrs(rctx, attrs);
+		if (err < 0 && ret == 0)
+			ret = err;
+		applied = true;
+	}
+	if (rctx->pool && applied)
+		receive_pool_wait_paths(rctx->pool, path, NULL);
+	return ret;
+}
+
+/* Free the attributes not applied after an error */
+static void free_attrs(struct btrfs_receive *rctx)
+{
+	struct receive_attrs *attrs;
+	struct receive_attrs *tmp;
+
+	list_for_each_entry_safe(attrs, tmp, &rctx->attrs_lru, list) {
+		list_del(&attrs->list);
+		free(attrs->path);
+		free(attrs);
+	}
+	rctx->attrs_root = RB_ROOT;
+	rctx->nr_attrs = 0;
+}
+
+/*
+ * Return the pending attributes of @path, added as the most recently changed
+ * ones. The least recently changed are applied if there are too many.
+ */
+static struct receive_attrs *get_attrs(struct btrfs_receive *rctx,
+				       const char *path, int *ret)
+{
+	struct receive_attrs *attrs;
+	struct rb_node *node;
+
+	*ret = 0;
+	node = rb_find(path, &rctx->attrs_root, attrs_cmp);
+	if (node) {
+		attrs = rb_entry(node, struct receive_attrs, node);
+		list_move_tail(&attrs->list, &rctx->attrs_lru);
+		return attrs;
+	}
+
+	if (rctx->nr_attrs >= RECEIVE_MAX_ATTRS) {
+		attrs = list_first_entry(&rctx->attrs_lru, struct receive_attrs,
+					 list);
+		*ret = apply_attrs(rctx, attrs);
+	}
+
+	attrs = calloc(1, sizeof(*attrs));
+	if (attrs)
+		attrs->path = strdup(path);
+	if (!attrs || !attrs->path) {
+		free(attrs);
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		*ret = -ENOMEM;
+		return NULL;
+	}
+	rb_add(&attrs->node, &rctx->attrs_root, attrs_less);
+	list_add_tail(&attrs->list, &rctx->attrs_lru);
+	rctx->nr_attrs++;
+	return attrs;
+}
+
+static int defer_chmod(const char *path, u64 mode, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_attrs *attrs;
+	int ret;
+
+	attrs = get_attrs(rctx, path, &ret);
+	if (!attrs)
+		return ret;
+	attrs->chmod = true;
+	attrs->mode = mode;
+	return ret;
+}
+
+static int defer_chown(const char *path, u64 uid, u64 gid, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_attrs *attrs;
+	int ret;
+
+	attrs = get_attrs(rctx, path, &ret);
+	if (!attrs)
+		return ret;
+	/* A chown after the chmod clears the setuid bits, keep the order */
+	if (attrs->chmod && !attrs->chown) {
+		ret = apply_attrs(rctx, attrs);
+		if (ret < 0)
+			return ret;
+		return defer_chown(path, uid, gid, user);
+	}
+	attrs->chown = true;
+	attrs->uid = uid;
+	attrs->gid = gid;
+	return ret;
+}
+
+static int defer_utimes(const char *path, struct timespec *at,
+			struct timespec *mt, struct timespec *ct, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	struct receive_attrs *attrs;
+	int ret;
+
+	attrs = get_attrs(rctx, path, &ret);
+	if (!attrs)
+		return ret;
+	attrs->utimes = true;
+	attrs->times[0] = *at;
+	attrs->times[1] = *mt;
+	attrs->times[2] = *ct;
+	return ret;
+}
+
+/*
+ * Clones of a file deduplicated or reflinked on the sending side come as runs
+ * of commands with contiguous ranges of the same source, merged here into one
+ * ioctl applied when the run ends.
+ */
+static bool clone_extends(const struct btrfs_receive *rctx, const char *path,
+			  u64 offset, u64 len, const u8 *clone_uuid,
+			  u64 clone_ctransid, const char *clone_path,
+			  u64 clone_offset)
+{
+	const u64 start = rctx->clone.offset;
+	const u64 clone_start = rctx->clone.clone_offset;
+	const u64 total = rctx->clone.len + len;
+
+	if (!rctx->clone.path ||
+	    offset != start + rctx->clone.len ||
+	    clone_offset != clone_start + rctx->clone.len ||
+	    total < len || clone_ctransid != rctx->clone.clone_ctransid ||
+	    memcmp(clone_uuid, rctx->clone.clone_uuid, BTRFS_UUID_SIZE) ||
+	    strcmp(path, rctx->clone.path) ||
+	    strcmp(clone_path, rctx->clone.clone_path))
+		return false;
+
+	/* The merged ranges of the same file must not overlap */
+	if (strcmp(path, clone_path) == 0 &&
+	    memcmp(clone_uuid, rctx->cur_subvol.received_uuid,
+		   BTRFS_UUID_SIZE) == 0 &&
+	    start < clone_start + total && clone_start < start + total)
+		return false;
+	return true;
+}
+
+static int flush_clone(void *user)
+{
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	if (!rctx->clone.path)
+		return 0;
+	/* The source can be written by any worker */
+	if (rctx->pool)
+		receive_pool_drain(rctx->pool);
+	ret = process_clone(rctx->clone.path, rctx->clone.offset,
+			    rctx->clone.len, rctx->clone.clone_uuid,
+			    rctx->clone.clone_ctransid, rctx->clone.clone_path,
+			    rctx->clone.clone_offset, rctx);
+	free(rctx->clone.path);
+	free(rctx->clone.clone_path);
+	rctx->clone.path = NULL;
+	rctx->clone.clone_path = NULL;
+	if (rctx->pool)
+		ret = receive_pool_result(rctx->pool, ret);
+	return ret;
+}
+
+static int queue_clone(const char *path, u64 offset, u64 len,
+		       const u8 *clone_uuid, u64 clone_ctransid,
+		       const char *clone_path, u64 clone_offset, void *user)
+{
+	struct btrfs_receive *rctx = user;
+	int ret;
+
+	if (clone_extends(rctx, path, offset, len, clone_uuid, clone_ctransid,
+			  clone_path, clone_offset)) {
+		rctx->clone.len += len;
+		return 0;
+	}
+	ret = flush_clone(rctx);
+	rctx->clone.path = strdup(path);
+	rctx->clone.clone_path = strdup(clone_path);
+	if (!rctx->clone.path || !rctx->clone.clone_path) {
+		free(rctx->clone.path);
+		free(rctx->clone.clone_path);
+		rctx->clone.path = NULL;
+		rctx->clone.clone_path = NULL;
+		return -ENOMEM;
+	}
+	memcpy(rctx->clone.clone_uuid, clone_uuid, BTRFS_UUID_SIZE);
+	rctx->clone.clone_ctransid = clone_ctransid;
+	rctx->clone.offset = offset;
+	rctx->clone.len = len;
+	rctx->clone.clone_offset = clone_offset;
+	return ret;
+}
+
+static struct btrfs_send_ops send_ops = {
+	.subvol = process_subvol,
+	.snapshot = process_snapshot,
+	.mkfile = process_mkfile,
+	.mkdir = process_mkdir,
+	.mknod = process_mknod,
+	.mkfifo = process_mkfifo,
+	.mksock = process_mksock,
+	.symlink = process_symlink,
+	.rename = process_rename,
+	.link = process_link,
+	.unlink = process_unlink,
+	.rmdir = process_rmdir,
+	.write = process_write,
+	.clone = queue_clone,
+	.set_xattr = process_set_xattr,
+	.remove_xattr = process_remove_xattr,
+	.truncate = process_truncate,
+	.chmod = defer_chmod,
+	.chown = defer_chown,
+	.utimes = defer_utimes,
+	.update_extent = process_update_extent,
+	.encoded_write = process_encoded_write,
+	.fallocate = process_fallocate,
+	.fileattr = process_fileattr,
+	.enable_verity = process_enable_verity,
+	.clone_end = flush_clone,
+};
+
+static struct btrfs_send_ops send_ops_threads = {
+	.subvol = thread_subvol,
+	.snapshot = thread_snapshot,
+	.mkfile = thread_mkfile,
+	.mkdir = thread_mkdir,
+	.mknod = thread_mknod,
+	.mkfifo = thread_mkfifo,
+	.mksock = thread_mksock,
+	.symlink = thread_symlink,
+	.rename = thread_rename,
+	.link = thread_link,
+	.unlink = thread_unlink,
+	.rmdir = thread_rmdir,
+	.write = thread_write,
+	.clone = queue_clone,
+	.set_xattr = thread_set_xattr,
+	.remove_xattr = thread_remove_xattr,
+	.truncate = thread_truncate,
+	.chmod = defer_chmod,
+	.chown = defer_chown,
+	.utimes = defer_utimes,
+	.update_extent = thread_update_extent,
+	.encoded_write = thread_encoded_write,
+	.fallocate = thread_fallocate,
+	.fileattr = thread_fileattr,
+	.enable_verity = thread_enable_verity,
+	.clone_end = flush_clone,
+};
+
+/*
+ * Throughput limit of reading the streams, of one stream or all the streams of
+ * the daemon.  The reads are delayed so the bytes read are due at the rate, the
+ * time the streams were idle isn't credited.
+ */
+struct receive_limit {
+	pthread_mutex_t mutex;
+	/* Bytes per second, 0 for unlimited */
+	u64 rate;
+	/* CLOCK_MONOTONIC time in nanoseconds when the bytes read are due */
+	u64 due;
+};
+
+/* Delays shorter than this are accumulated, in nanoseconds */
+#define RECEIVE_LIMIT_SLACK	(10ULL * 1000 * 1000)
+
+/*
+ * The stream read by receive_stream_read(), decompressed if it starts with a
+ * zstd frame, e.g. sent by send --compress-stream.  Each thread reads its own
+ * stream, see receive_stream_reset().
+ */
+static __thread struct {
+	int fd;
+	/* Bytes read from the fd, and their limits if set */
+	u64 bytes;
+	struct receive_limit *limit;
+	struct receive_limit *total_limit;
+	bool compressed;
+	/* The bytes read to detect the compression and not returned yet */
+	char peek[4];
+	size_t peek_start;
+	size_t peek_end;
+#if COMPRESSION_ZSTD
+	ZSTD_DStream *dstream;
+	ZSTD_inBuffer in;
+	void *in_buf;
+	size_t in_buf_size;
+	/* Zero when the last frame was decompressed completely */
+	size_t frame_left;
+#endif
+} stream_reader = { .fd = -1 };
+
+static void receive_limit_charge(struct receive_limit *limit, size_t bytes)
+{
+	const u64 nsec_per_sec = 1000ULL * 1000 * 1000;
+	struct timespec ts;
+	u64 now;
+	u64 due = 0;
+
+	if (!limit || !limit->rate)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * nsec_per_sec + ts.tv_nsec;
+	pthread_mutex_lock(&limit->mutex);
+	limit->due = max(limit->due, now) + bytes * nsec_per_sec / limit->rate;
+	if (limit->due > now + RECEIVE_LIMIT_SLACK)
+		due = limit->due;
+	pthread_mutex_unlock(&limit->mutex);
+	if (!due)
+		return;
+
+	ts.tv_sec = due / nsec_per_sec;
+	ts.tv_nsec = due % nsec_per_sec;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* Read the stream fd, within the throughput limits */
+static ssize_t receive_read_fd(int fd, void *buf, size_t count)
+{
+	ssize_t ret;
+
+	ret = read(fd, buf, count);
+	if (ret > 0) {
+		stream_reader.bytes += ret;
+		receive_limit_charge(stream_reader.limit, ret);
+		receive_limit_charge(stream_reader.total_limit, ret);
+	}
+	return ret;
+}
+
+/*
+ * Forget the stream read by this thread and its limits, before its fd is closed
+ * and the number reused for another stream
+ */
+static void receive_stream_reset(void)
+{
+#if COMPRESSION_ZSTD
+	if (stream_reader.dstream)
+		ZSTD_freeDStream(stream_reader.dstream);
+	free(stream_reader.in_buf);
+#endif
+	btrfs_send_stream_forget(stream_reader.fd);
+	memset(&stream_reader, 0, sizeof(stream_reader));
+	stream_reader.fd = -1;
+}
+
+static ssize_t read_full(int fd, void *buf, size_t count)
+{
+	size_t done = 0;
+
+	while (done < count) {
+		ssize_t ret;
+
+		ret = receive_read_fd(fd, buf + done, count - done);
+		if (ret < 0)
+			return ret;
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int receive_stream_detect(int fd)
+{
+	ssize_t ret;
+
+	stream_reader.fd = fd;
+	ret = read_full(fd, stream_reader.peek, sizeof(stream_reader.peek));
+	if (ret < 0)
+		return -1;
+	stream_reader.peek_start = 0;
+	stream_reader.peek_end = ret;
+	/* The magic number of zstd frames, ZSTD_MAGICNUMBER */
+	if (ret < sizeof(stream_reader.peek) ||
+	    get_unaligned_le32(stream_reader.peek) != 0xFD2FB528)
+		return 0;
+
+#if COMPRESSION_ZSTD
+	stream_reader.dstream = ZSTD_createDStream();
+	stream_reader.in_buf_size = ZSTD_DStreamInSize();
+	stream_reader.in_buf = malloc(stream_reader.in_buf_size);
+	if (!stream_reader.dstream || !stream_reader.in_buf) {
+		error_msg(ERROR_MSG_MEMORY, "stream decompression");
+		errno = ENOMEM;
+		return -1;
+	}
+	ZSTD_initDStream(stream_reader.dstream);
+	memcpy(stream_reader.in_buf, stream_reader.peek, ret);
+	stream_reader.in.src = stream_reader.in_buf;
+	stream_reader.in.size = ret;
+	stream_reader.in.pos = 0;
+	stream_reader.peek_end = 0;
+	stream_reader.compressed = true;
+	return 0;
+#else
+	error("the stream is compressed by zstd, support not compiled in");
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+/* Read the stream, decompress it if it's compressed */
+static ssize_t receive_stream_read(int fd, void *buf, size_t count)
+{
+	if (stream_reader.fd != fd && receive_stream_detect(fd) < 0)
+		return -1;
+
+	if (stream_reader.peek_start < stream_reader.peek_end) {
+		size_t len = min_t(size_t, count, stream_reader.peek_end -
+					   stream_reader.peek_start);
+
+		memcpy(buf, stream_reader.peek + stream_reader.peek_start, len);
+		stream_reader.peek_start += len;
+		return len;
+	}
+	if (!stream_reader.compressed)
+		return receive_read_fd(fd, buf, count);
+
+#if COMPRESSION_ZSTD
+	{
+		ZSTD_outBuffer out = { .dst = buf, .size = count, .pos = 0 };
+
+		while (out.pos == 0) {
+			size_t zret;
+
+			if (stream_reader.in.pos == stream_reader.in.size) {
+				ssize_t rbytes;
+
+				rbytes = receive_read_fd(fd, stream_reader.in_buf,
+							 stream_reader.in_buf_size);
+				if (rbytes < 0)
+					return rbytes;
+				if (rbytes == 0) {
+					if (stream_reader.frame_left == 0)
+						return 0;
+					error("compressed stream is truncated");
+					errno = EIO;
+					return -1;
+				}
+				stream_reader.in.size = rbytes;
+				stream_reader.in.pos = 0;
+			}
+			zret = ZSTD_decompressStream(stream_reader.dstream, &out,
+						     &stream_reader.in);
+			if (ZSTD_isError(zret)) {
+				error("stream decompression failed: %s",
+				      ZSTD_getErrorName(zret));
+				errno = EIO;
+				return -1;
+			}
+			stream_reader.frame_left = zret;
+		}
+		return out.pos;
+	}
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Open the destination directory @tomnt and the mount point, and resolve the
+ * paths the subvolumes are received to.  Done once for all the streams of the
+ * daemon.
+ */
+static int receive_open_dest(struct btrfs_receive *rctx, const char *tomnt,
+			     char *realmnt)
+{
+	u64 subvol_id;
+	int ret;
+	char root_subvol_path[PATH_MAX];
+
+	rctx->dest_dir_full_path = realpath(tomnt, NULL);
+	if (!rctx->dest_dir_full_path) {
+		ret = -errno;
+		error("realpath(%s) failed: %m", tomnt);
+		return ret;
+	}
+	rctx->dest_dir_fd = open(rctx->dest_dir_full_path, O_RDONLY | O_NOATIME);
+	if (rctx->dest_dir_fd < 0) {
+		ret = -errno;
+		error("cannot open destination directory %s: %m",
+			rctx->dest_dir_full_path);
+		return ret;
+	}
+
+	if (realmnt[0]) {
+		rctx->root_path = realmnt;
+	} else {
+		ret = find_mount_root(rctx->dest_dir_full_path, &rctx->root_path);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to determine mount point for %s: %m",
+				rctx->dest_dir_full_path);
+			return -EINVAL;
+		}
+		if (ret > 0) {
+			error("%s doesn't belong to btrfs mount point",
+				rctx->dest_dir_full_path);
+			return -EINVAL;
+		}
+	}
+	rctx->mnt_fd = open(rctx->root_path, O_RDONLY | O_NOATIME);
+	if (rctx->mnt_fd < 0) {
+		ret = -errno;
+		error("cannot open %s: %m", rctx->root_path);
+		return ret;
 	}
-	rctx->mnt_fd = open(rctx->root_path, O_RDONLY | O_NOATIME);
-	if (rctx->mnt_fd < 0) {
-		ret = -errno;
-		error("cannot open %s: %m", rctx->root_path);
-		goto out;
-	}
 
 	/*
 	 * If we use -m or a default subvol we want to resolve the path to the
@@ -1526,7 +3395,7 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	if (ret) {
 		errno = -ret;
 		error("cannot resolve rootid for path: %m");
-		goto out;
+		return ret;
 	}
 
 	root_subvol_path[0] = 0;
@@ -1534,29 +3403,36 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 				     PATH_MAX, subvol_id);
 	if (ret) {
 		error("cannot resolve our subvol path");
-		goto out;
+		return ret;
 	}
 
 	/*
 	 * Ok we're inside of a subvol off of the root subvol, we need to
 	 * actually set full_root_path.
 	 */
-	if (*root_subvol_path)
-		rctx->full_root_path = root_subvol_path;
+	if (*root_subvol_path) {
+		rctx->full_root_path = strdup(root_subvol_path);
+		if (!rctx->full_root_path) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+	}
 
 	if (rctx->dest_dir_chroot) {
-		if (chroot(dest_dir_full_path)) {
+		if (chroot(rctx->dest_dir_full_path)) {
 			ret = -errno;
-			error("failed to chroot to %s: %m", dest_dir_full_path);
-			goto out;
+			error("failed to chroot to %s: %m", rctx->dest_dir_full_path);
+			return ret;
 		}
 		if (chdir("/")) {
 			ret = -errno;
 			error("failed to chdir to / after chroot: %m");
-			goto out;
+			return ret;
 		}
 		if (bconf.verbose > BTRFS_BCONF_QUIET)
-			fprintf(stderr, "Chroot to %s\n", dest_dir_full_path);
+			fprintf(stderr, "Chroot to %s\n", rctx->dest_dir_full_path);
+		if (rctx->root_path != realmnt)
+			free(rctx->root_path);
 		rctx->root_path = strdup("/");
 		rctx->dest_dir_path = rctx->root_path;
 	} else {
@@ -1565,16 +3441,70 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 		 * dest_dir_full_path. Now get the other part of root_path,
 		 * which is the destination dir relative to root_path.
 		 */
-		rctx->dest_dir_path = dest_dir_full_path + strlen(rctx->root_path);
+		rctx->dest_dir_path = rctx->dest_dir_full_path +
+				      strlen(rctx->root_path);
 		while (rctx->dest_dir_path[0] == '/')
 			rctx->dest_dir_path++;
 	}
 
+	return 0;
+}
+
+static void receive_close_dest(struct btrfs_receive *rctx, char *realmnt)
+{
+	if (rctx->root_path != realmnt)
+		free(rctx->root_path);
+	rctx->root_path = NULL;
+	rctx->dest_dir_path = NULL;
+	free(rctx->dest_dir_full_path);
+	rctx->dest_dir_full_path = NULL;
+	free(rctx->full_root_path);
+	rctx->full_root_path = NULL;
+	if (rctx->mnt_fd != -1) {
+		close(rctx->mnt_fd);
+		rctx->mnt_fd = -1;
+	}
+	if (rctx->dest_dir_fd != -1) {
+		close(rctx->dest_dir_fd);
+		rctx->dest_dir_fd = -1;
+	}
+}
+
+/* Receive the streams read from @r_fd to the destination opened before */
+static int receive_streams(struct btrfs_receive *rctx, int r_fd, u64 max_errors)
+{
+	bool end = false;
+	int iterations = 0;
+	int ret;
+
+	if (rctx->nr_threads) {
+		rctx->pool = receive_pool_start(rctx);
+		if (!rctx->pool) {
+			ret = -ENOMEM;
+			error("failed to start the receive threads");
+			goto out;
+		}
+	}
+
+	if (rctx->use_io_uring)
+		rctx->uring = receive_uring_start();
+
 	while (!end) {
-		ret = btrfs_read_and_process_send_stream(r_fd, &send_ops,
-							 rctx,
-							 rctx->honor_end_cmd,
-							 max_errors);
+		ret = btrfs_read_and_process_send_stream(r_fd,
+				rctx->pool ? &send_ops_threads : &send_ops,
+				rctx, rctx->honor_end_cmd, max_errors);
+		if (rctx->pool) {
+			receive_pool_drain(rctx->pool);
+			receive_pool_close_files(rctx->pool);
+			if (ret >= 0 || ret == -ENODATA) {
+				int err = receive_pool_result(rctx->pool, 0);
+
+				if (err < 0) {
+					ret = err;
+					goto out;
+				}
+			}
+		}
 		if (ret < 0) {
 			if (ret != -ENODATA)
 				goto out;
@@ -1601,38 +3531,371 @@ static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
 	ret = 0;
 
 out:
-	if (rctx->write_fd != -1) {
-		close(rctx->write_fd);
-		rctx->write_fd = -1;
+	receive_pool_free(rctx->pool);
+	rctx->pool = NULL;
+	close_inode_for_write(rctx);
+	receive_uring_free(rctx->uring);
+	rctx->uring = NULL;
+	free_attrs(rctx);
+	free(rctx->clone.path);
+	free(rctx->clone.clone_path);
+	rctx->clone.path = NULL;
+	rctx->clone.clone_path = NULL;
+	free_decompress_streams(rctx);
+
+	return ret;
+}
+
+static int do_receive(struct btrfs_receive *rctx, const char *tomnt,
+		      char *realmnt, int r_fd, u64 max_errors)
+{
+	struct subvol_uuid_cache uuid_cache = { 0 };
+	int ret;
+
+	ret = receive_open_dest(rctx, tomnt, realmnt);
+	if (ret < 0)
+		goto out;
+
+	subvol_uuid_cache_init(&uuid_cache, rctx->mnt_fd);
+	rctx->uuid_cache = &uuid_cache;
+	ret = receive_streams(rctx, r_fd, max_errors);
+	rctx->uuid_cache = NULL;
+	subvol_uuid_cache_release(&uuid_cache);
+
+out:
+	receive_close_dest(rctx, realmnt);
+	return ret;
+}
+
+/* A connection accepted by the daemon, waiting for a stream thread */
+struct receive_conn {
+	struct list_head list;
+	int fd;
+	u64 id;
+};
+
+struct receive_daemon_stream {
+	struct receive_daemon *daemon;
+	pthread_t thread;
+	struct receive_limit limit;
+};
+
+/*
+ * Receive the streams of the connections to a socket, each by one of the
+ * stream threads with its own context.  The destination, its mount point and
+ * the uuid cache are set up once and shared.  The connections are received in
+ * the order they were accepted when a thread is free.
+ */
+struct receive_daemon {
+	/* The context with the destination opened, copied for each stream */
+	const struct btrfs_receive *rctx;
+	u64 max_errors;
+	struct subvol_uuid_cache uuid_cache;
+	pthread_mutex_t uuid_cache_lock;
+	/* Of all the streams, and the rate of each stream */
+	struct receive_limit limit;
+	u64 stream_limit;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	struct list_head conns;
+	bool stop;
+	u64 received;
+	u64 failed;
+
+	unsigned int nr_streams;
+	struct receive_daemon_stream *streams;
+};
+
+static volatile sig_atomic_t receive_daemon_stop;
+
+static void receive_daemon_signal(int signal)
+{
+	receive_daemon_stop = signal;
+}
+
+/* Return 1 if a stream was received, 0 if the connection had no data */
+static int receive_daemon_conn(struct receive_daemon_stream *stream,
+			       struct receive_conn *conn)
+{
+	struct receive_daemon *daemon = stream->daemon;
+	struct btrfs_receive rctx = *daemon->rctx;
+	u64 bytes;
+	char c;
+	int ret;
+
+	/* Closed without data, e.g. to check that the daemon is listening */
+	if (recv(conn->fd, &c, 1, MSG_PEEK) == 0) {
+		close(conn->fd);
+		return 0;
 	}
 
-	if (rctx->root_path != realmnt)
-		free(rctx->root_path);
-	rctx->root_path = NULL;
-	rctx->dest_dir_path = NULL;
-	free(dest_dir_full_path);
-	if (rctx->mnt_fd != -1) {
-		close(rctx->mnt_fd);
-		rctx->mnt_fd = -1;
+	rctx.write_fd = -1;
+	rctx.attrs_root = RB_ROOT;
+	INIT_LIST_HEAD(&rctx.attrs_lru);
+	rctx.uuid_cache = &daemon->uuid_cache;
+	rctx.uuid_cache_lock = &daemon->uuid_cache_lock;
+
+	receive_stream_reset();
+	stream->limit.due = 0;
+	stream_reader.limit = &stream->limit;
+	stream_reader.total_limit = &daemon->limit;
+
+	if (bconf.verbose > BTRFS_BCONF_QUIET)
+		fprintf(stderr, "Stream %llu started\n", conn->id);
+	ret = receive_streams(&rctx, conn->fd, daemon->max_errors);
+	bytes = stream_reader.bytes;
+	receive_stream_reset();
+	close(conn->fd);
+
+	if (ret < 0) {
+		error("stream %llu failed after %s", conn->id, pretty_size(bytes));
+		return ret;
 	}
-	if (rctx->dest_dir_fd != -1) {
-		close(rctx->dest_dir_fd);
-		rctx->dest_dir_fd = -1;
+	if (bconf.verbose > BTRFS_BCONF_QUIET)
+		fprintf(stderr, "Stream %llu received %s\n", conn->id,
+			pretty_size(bytes));
+	return 1;
+}
+
+static void *receive_daemon_thread(void *arg)
+{
+	struct receive_daemon_stream *stream = arg;
+	struct receive_daemon *daemon = stream->daemon;
+
+	pthread_mutex_lock(&daemon->mutex);
+	while (true) {
+		struct receive_conn *conn;
+		int ret;
+
+		while (list_empty(&daemon->conns) && !daemon->stop)
+			pthread_cond_wait(&daemon->cond, &daemon->mutex);
+		/* The connections not started yet are closed */
+		if (daemon->stop)
+			break;
+		conn = list_first_entry(&daemon->conns, struct receive_conn, list);
+		list_del(&conn->list);
+		pthread_mutex_unlock(&daemon->mutex);
+
+		ret = receive_daemon_conn(stream, conn);
+		free(conn);
+
+		pthread_mutex_lock(&daemon->mutex);
+		if (ret < 0)
+			daemon->failed++;
+		else if (ret > 0)
+			daemon->received++;
 	}
-#if COMPRESSION_ZSTD
-	if (rctx->zstd_dstream)
-		ZSTD_freeDStream(rctx->zstd_dstream);
-#endif
-	if (rctx->zlib_stream) {
-		inflateEnd(rctx->zlib_stream);
-		free(rctx->zlib_stream);
+	pthread_mutex_unlock(&daemon->mutex);
+	return NULL;
+}
+
+/*
+ * Create the listening socket at @path.  A socket left there is replaced if
+ * nothing is listening on it anymore.
+ */
+static int receive_daemon_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		error("socket path too long: %s", path);
+		return -ENAMETOOLONG;
+	}
+	strcpy(addr.sun_path, path);
+
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0) {
+			error("cannot create socket: %m");
+			return -errno;
+		}
+		if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+			close(fd);
+			error("another receive is listening on %s", path);
+			return -EADDRINUSE;
+		}
+		close(fd);
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		error("cannot create socket: %m");
+		return -errno;
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		error("cannot bind socket to %s: %m", path);
+		close(fd);
+		return -errno;
+	}
+	if (listen(fd, SOMAXCONN) < 0) {
+		error("cannot listen on %s: %m", path);
+		close(fd);
+		unlink(path);
+		return -errno;
+	}
+	return fd;
+}
+
+/* Accept the connections until SIGINT or SIGTERM, @sigmask unblocks them */
+static void receive_daemon_accept(struct receive_daemon *daemon, int listen_fd,
+				  const sigset_t *sigmask)
+{
+	struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+	u64 id = 0;
+
+	while (!receive_daemon_stop) {
+		struct receive_conn *conn;
+		int fd;
+
+		if (ppoll(&pfd, 1, NULL, sigmask) < 0) {
+			if (errno != EINTR) {
+				error("cannot wait for connections: %m");
+				break;
+			}
+			continue;
+		}
+		fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EAGAIN || errno == EINTR ||
+			    errno == ECONNABORTED)
+				continue;
+			/* Out of files or memory until some streams end */
+			warning("cannot accept connection: %m");
+			sleep(1);
+			continue;
+		}
+		conn = malloc(sizeof(*conn));
+		if (!conn) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			close(fd);
+			continue;
+		}
+		conn->fd = fd;
+		conn->id = ++id;
+
+		pthread_mutex_lock(&daemon->mutex);
+		list_add_tail(&conn->list, &daemon->conns);
+		pthread_cond_signal(&daemon->cond);
+		pthread_mutex_unlock(&daemon->mutex);
+	}
+}
+
+static int receive_daemon(struct receive_daemon *daemon,
+			  struct btrfs_receive *rctx, const char *tomnt,
+			  char *realmnt, const char *listen_path)
+{
+	struct sigaction sa = {
+		.sa_handler = receive_daemon_signal,
+		/* A second signal terminates without waiting for the streams */
+		.sa_flags = SA_RESETHAND,
+	};
+	sigset_t stop_signals;
+	sigset_t sigmask;
+	int listen_fd;
+	int ret;
+
+	listen_fd = receive_daemon_listen(listen_path);
+	if (listen_fd < 0)
+		return listen_fd;
+
+	ret = receive_open_dest(rctx, tomnt, realmnt);
+	if (ret < 0)
+		goto out;
+
+	daemon->rctx = rctx;
+	subvol_uuid_cache_init(&daemon->uuid_cache, rctx->mnt_fd);
+	pthread_mutex_init(&daemon->uuid_cache_lock, NULL);
+	pthread_mutex_init(&daemon->limit.mutex, NULL);
+	pthread_mutex_init(&daemon->mutex, NULL);
+	pthread_cond_init(&daemon->cond, NULL);
+	INIT_LIST_HEAD(&daemon->conns);
+	daemon->streams = calloc(daemon->nr_streams, sizeof(*daemon->streams));
+	if (!daemon->streams) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out_destroy;
+	}
+
+	/* Only the accepting thread handles the signals */
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, &sigmask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for (unsigned int i = 0; i < daemon->nr_streams; i++) {
+		struct receive_daemon_stream *stream = &daemon->streams[i];
+
+		stream->daemon = daemon;
+		pthread_mutex_init(&stream->limit.mutex, NULL);
+		stream->limit.rate = daemon->stream_limit;
+		if (pthread_create(&stream->thread, NULL, receive_daemon_thread,
+				   stream)) {
+			daemon->nr_streams = i;
+			break;
+		}
+	}
+
+	if (!daemon->nr_streams) {
+		error("cannot start the stream threads");
+		ret = -ENOMEM;
+	} else {
+		if (bconf.verbose > BTRFS_BCONF_QUIET)
+			fprintf(stderr, "Receiving up to %u streams from %s\n",
+				daemon->nr_streams, listen_path);
+		receive_daemon_accept(daemon, listen_fd, &sigmask);
+		if (bconf.verbose > BTRFS_BCONF_QUIET)
+			fprintf(stderr, "Stopping, waiting for the running streams\n");
+	}
+	pthread_sigmask(SIG_SETMASK, &sigmask, NULL);
+	close(listen_fd);
+	listen_fd = -1;
+	unlink(listen_path);
+
+	pthread_mutex_lock(&daemon->mutex);
+	daemon->stop = true;
+	pthread_cond_broadcast(&daemon->cond);
+	pthread_mutex_unlock(&daemon->mutex);
+	for (unsigned int i = 0; i < daemon->nr_streams; i++) {
+		pthread_join(daemon->streams[i].thread, NULL);
+		pthread_mutex_destroy(&daemon->streams[i].limit.mutex);
 	}
+	while (!list_empty(&daemon->conns)) {
+		struct receive_conn *conn;
 
+		conn = list_first_entry(&daemon->conns, struct receive_conn, list);
+		list_del(&conn->list);
+		close(conn->fd);
+		free(conn);
+	}
+	if (bconf.verbose > BTRFS_BCONF_QUIET)
+		fprintf(stderr, "Received %llu streams, %llu failed\n",
+			daemon->received, daemon->failed);
+	free(daemon->streams);
+
+out_destroy:
+	pthread_cond_destroy(&daemon->cond);
+	pthread_mutex_destroy(&daemon->mutex);
+	pthread_mutex_destroy(&daemon->limit.mutex);
+	pthread_mutex_destroy(&daemon->uuid_cache_lock);
+	subvol_uuid_cache_release(&daemon->uuid_cache);
+out:
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		unlink(listen_path);
+	}
+	receive_close_dest(rctx, realmnt);
 	return ret;
 }
 
 static const char * const cmd_receive_usage[] = {
 	"btrfs receive [options] <mount>\n"
+	"btrfs receive --listen <socket> [options] <mount>\n"
 	"btrfs receive --dump [options]",
 	"Receive subvolumes from a stream",
 	"Receives one or more subvolumes that were previously",
@@ -1658,12 +3921,32 @@ static const char * const cmd_receive_usage[] = {
 		"this file system is mounted."),
 	OPTLINE("--force-decompress", "if the stream contains compressed data, always "
 		"decompress it instead of writing it with encoded I/O"),
+	OPTLINE("--threads N", "number of threads applying the writes and "
+		"attribute changes of the inodes (0 ~ 64), default is 0, "
+		"the commands are applied by the thread reading the stream"),
+	OPTLINE("--io-uring", "queue the writes to io_uring and keep several "
+		"of them in flight, the writes are synchronous if it's not "
+		"supported, not with --threads"),
+	OPTLINE("--listen SOCKET", "keep running and receive the stream of each "
+		"connection to the unix socket SOCKET, several at once, "
+		"until SIGINT or SIGTERM"),
+	OPTLINE("--max-streams N", "number of streams received at once with "
+		"--listen (1 ~ 256), default is 16"),
+	OPTLINE("--limit RATE", "throughput limit of reading all the streams "
+		"together with --listen, bytes per second"),
+	OPTLINE("--stream-limit RATE", "throughput limit of reading each "
+		"stream with --listen, bytes per second"),
+	OPTLINE("--stats[=json]", "print the count, bytes and time of each "
+		"stream command and of the reads, writes and ioctls to stderr "
+		"at the end, same as the global option --stats"),
 	OPTLINE("--dump", "dump stream metadata, one line per operation, "
-		"does not require the MOUNT parameter"),
+		"does not require the MOUNT parameter, one JSON object per "
+		"line with the global option --format json"),
 	OPTLINE("-v", "deprecated, alias for global -v option"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_VERBOSE,
 	HELPINFO_INSERT_QUIET,
+	HELPINFO_INSERT_FORMAT,
 	"",
 	"Compression support: zlib"
 #if COMPRESSION_LZO
@@ -1687,14 +3970,19 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 	char fromfile[PATH_MAX];
 	char realmnt[PATH_MAX];
 	struct btrfs_receive rctx;
+	struct receive_daemon daemon = { 0 };
+	char *listen_path = NULL;
 	int receive_fd = fileno(stdin);
 	u64 max_errors = 1;
+	u64 nr_threads = 0;
+	u64 nr_streams = 16;
 	bool dump = false;
 	int ret = 0;
 
 	memset(&rctx, 0, sizeof(rctx));
 	rctx.mnt_fd = -1;
 	rctx.write_fd = -1;
+	INIT_LIST_HEAD(&rctx.attrs_lru);
 	rctx.dest_dir_fd = -1;
 	rctx.dest_dir_chroot = false;
 	realmnt[0] = 0;
@@ -1718,6 +4006,12 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		enum {
 			GETOPT_VAL_DUMP = GETOPT_VAL_FIRST,
 			GETOPT_VAL_FORCE_DECOMPRESS,
+			GETOPT_VAL_THREADS,
+			GETOPT_VAL_IO_URING,
+			GETOPT_VAL_LISTEN,
+			GETOPT_VAL_MAX_STREAMS,
+			GETOPT_VAL_LIMIT,
+			GETOPT_VAL_STREAM_LIMIT,
 		};
 		static const struct option long_opts[] = {
 			{ "max-errors", required_argument, NULL, 'E' },
@@ -1725,6 +4019,13 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "dump", no_argument, NULL, GETOPT_VAL_DUMP },
 			{ "quiet", no_argument, NULL, 'q' },
 			{ "force-decompress", no_argument, NULL, GETOPT_VAL_FORCE_DECOMPRESS },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "io-uring", no_argument, NULL, GETOPT_VAL_IO_URING },
+			{ "listen", required_argument, NULL, GETOPT_VAL_LISTEN },
+			{ "max-streams", required_argument, NULL, GETOPT_VAL_MAX_STREAMS },
+			{ "limit", required_argument, NULL, GETOPT_VAL_LIMIT },
+			{ "stream-limit", required_argument, NULL, GETOPT_VAL_STREAM_LIMIT },
+			{ "stats", optional_argument, NULL, GETOPT_VAL_STATS },
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -1770,15 +4071,76 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		case GETOPT_VAL_FORCE_DECOMPRESS:
 			rctx.force_decompress = true;
 			break;
+		case GETOPT_VAL_THREADS:
+			nr_threads = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_IO_URING:
+			rctx.use_io_uring = true;
+			break;
+		case GETOPT_VAL_LISTEN:
+			listen_path = optarg;
+			break;
+		case GETOPT_VAL_MAX_STREAMS:
+			nr_streams = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_LIMIT:
+			daemon.limit.rate = arg_strtou64_with_suffix(optarg);
+			break;
+		case GETOPT_VAL_STREAM_LIMIT:
+			daemon.stream_limit = arg_strtou64_with_suffix(optarg);
+			break;
+		case GETOPT_VAL_STATS:
+			if (stats_enable(optarg)) {
+				error("invalid stats format: %s", optarg);
+				ret = 1;
+				goto out;
+			}
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
 	}
 
+	if (nr_threads > RECEIVE_MAX_THREADS) {
+		error("number of threads out of range: %llu > %d", nr_threads,
+		      RECEIVE_MAX_THREADS);
+		ret = 1;
+		goto out;
+	}
+	rctx.nr_threads = nr_threads;
+	if (nr_threads && rctx.use_io_uring) {
+		error("--io-uring and --threads are mutually exclusive");
+		ret = 1;
+		goto out;
+	}
+
+	if (nr_streams < 1 || nr_streams > RECEIVE_MAX_STREAMS) {
+		error("number of streams out of range: %llu, 1 ~ %d", nr_streams,
+		      RECEIVE_MAX_STREAMS);
+		ret = 1;
+		goto out;
+	}
+	daemon.nr_streams = nr_streams;
+	daemon.max_errors = max_errors;
+	if (listen_path && (dump || fromfile[0])) {
+		error("--listen is not compatible with --dump and -f");
+		ret = 1;
+		goto out;
+	}
+	if (!listen_path && (daemon.limit.rate || daemon.stream_limit)) {
+		error("--limit and --stream-limit need --listen");
+		ret = 1;
+		goto out;
+	}
+
 	if (dump && check_argc_exact(argc - optind, 0))
 		usage(cmd, 1);
 	if (!dump && check_argc_exact(argc - optind, 1))
 		usage(cmd, 1);
+	if (!dump && bconf.output_format == CMD_FORMAT_JSON) {
+		error("the json format is only supported by --dump");
+		return 1;
+	}
 
 	tomnt = argv[optind];
 
@@ -1790,19 +4152,28 @@ static int cmd_receive(const struct cmd_struct *cmd, int argc, char **argv)
 		}
 	}
 
+	btrfs_send_stream_set_read(receive_stream_read);
 	if (dump) {
 		struct btrfs_dump_send_args dump_args;
+		int ret2;
 
-		dump_args.root_path[0] = '.';
-		dump_args.root_path[1] = '\0';
-		dump_args.full_subvol_path[0] = '.';
-		dump_args.full_subvol_path[1] = '\0';
+		ret = btrfs_dump_send_init(&dump_args,
+				bconf.output_format == CMD_FORMAT_JSON);
+		if (ret < 0) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			goto out;
+		}
 		ret = btrfs_read_and_process_send_stream(receive_fd,
 			&btrfs_print_send_ops, &dump_args, 0, max_errors);
+		ret2 = btrfs_dump_send_finish(&dump_args);
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to dump the send stream: %m");
+		} else if (ret2 < 0) {
+			ret = ret2;
 		}
+	} else if (listen_path) {
+		ret = receive_daemon(&daemon, &rctx, tomnt, realmnt, listen_path);
 	} else {
 		ret = do_receive(&rctx, tomnt, realmnt, receive_fd, max_errors);
 	}
@@ -1813,4 +4184,4 @@ out:
 
 	return !!ret;
 }
-DEFINE_SIMPLE_COMMAND(receive, "receive");
+DEFINE_COMMAND_WITH_FLAGS(receive, "receive", CMD_FORMAT_JSON);
@@ -30,6 +30,7 @@
 #include <signal.h>
 #include <stdbool.h>
 #include "kernel-shared/uapi/btrfs.h"
+#include "kernel-shared/accessors.h"
 #include "common/utils.h"
 #include "common/open-utils.h"
 #include "common/help.h"
@@ -37,6 +38,11 @@
 #include "common/device-utils.h"
 #include "common/string-utils.h"
 #include "common/messages.h"
+#include "common/progress.h"
+#include "common/sysfs-utils.h"
+#include "common/task-utils.h"
+#include "common/tree-search.h"
+#include "common/units.h"
 #include "cmds/commands.h"
 #include "mkfs/common.h"
 
@@ -364,6 +370,8 @@ static const char *const cmd_replace_status_usage[] = {
 	"Print status and progress information of a running device replace operation",
 	"",
 	OPTLINE("-1", "print once instead of print continuously until the replace operation finishes (or is canceled)"),
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_FORMAT,
 	NULL
 };
 
@@ -399,20 +407,142 @@ static int cmd_replace_status(const struct cmd_struct *cmd,
 	close(fd);
 	return !!ret;
 }
-static DEFINE_SIMPLE_COMMAND(replace_status, "status");
+static DEFINE_COMMAND_WITH_FLAGS(replace_status, "status", CMD_FORMAT_JSON);
+
+/*
+ * Find the source device of the replace from the persistent replace item and
+ * its size, the progress reported by the ioctl is relative to it.
+ */
+static int replace_source_device(int fd, u64 *devid, u64 *size)
+{
+	struct btrfs_tree_search_args args = { 0 };
+	struct btrfs_ioctl_search_key *sk;
+	struct btrfs_ioctl_search_header sh;
+	struct btrfs_dev_replace_item *item;
+	struct btrfs_ioctl_dev_info_args di_args = { 0 };
+	int ret;
+
+	sk = btrfs_tree_search_sk(&args);
+	sk->tree_id = BTRFS_DEV_TREE_OBJECTID;
+	sk->min_objectid = 0;
+	sk->max_objectid = 0;
+	sk->min_type = BTRFS_DEV_REPLACE_KEY;
+	sk->max_type = BTRFS_DEV_REPLACE_KEY;
+	sk->min_offset = 0;
+	sk->max_offset = 0;
+	sk->max_transid = (u64)-1;
+	sk->nr_items = 1;
+
+	ret = btrfs_tree_search_ioctl(fd, &args);
+	if (ret < 0)
+		return -errno;
+	if (sk->nr_items == 0)
+		return -ENOENT;
+	memcpy(&sh, btrfs_tree_search_data(&args, 0), sizeof(sh));
+	item = btrfs_tree_search_data(&args, sizeof(sh));
+
+	di_args.devid = btrfs_stack_dev_replace_src_devid(item);
+	ret = ioctl(fd, BTRFS_IOC_DEV_INFO, &di_args);
+	if (ret < 0)
+		return -errno;
+	*devid = di_args.devid;
+	*size = di_args.total_bytes;
+	return 0;
+}
+
+static const char *replace_state2string(u64 state)
+{
+	switch (state) {
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_STARTED:
+		return "started";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_FINISHED:
+		return "finished";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_CANCELED:
+		return "canceled";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_SUSPENDED:
+		return "suspended";
+	case BTRFS_IOCTL_DEV_REPLACE_STATE_NEVER_STARTED:
+		return "never-started";
+	default:
+		return "unknown";
+	}
+}
+
+/*
+ * The replace is throttled by the scrub limit of the source device, consider
+ * it throttled when the average rate is close to the limit.
+ */
+static bool replace_throttled(const struct progress_estimator *est, u64 limit)
+{
+	return limit && est->avg_rate >= limit * 0.9;
+}
+
+static void print_replace_status_json(const struct btrfs_ioctl_dev_replace_status_params *status,
+				      const struct progress_estimator *est,
+				      u64 source_size, u64 limit)
+{
+	printf("{\"state\":\"%s\",\"progress\":%d.%01d",
+	       replace_state2string(status->replace_state),
+	       (int)status->progress_1000 / 10, (int)status->progress_1000 % 10);
+	printf(",\"time_started\":%llu", status->time_started);
+	if (status->replace_state != BTRFS_IOCTL_DEV_REPLACE_STATE_STARTED)
+		printf(",\"time_stopped\":%llu", status->time_stopped);
+	printf(",\"write_errors\":%llu,\"uncorrectable_read_errors\":%llu",
+	       status->num_write_errors, status->num_uncorrectable_read_errors);
+	if (status->replace_state != BTRFS_IOCTL_DEV_REPLACE_STATE_STARTED) {
+		printf("}\n");
+		return;
+	}
+	if (source_size)
+		printf(",\"bytes_done\":%llu,\"bytes_total\":%llu,\"rate\":%.0f,\"avg_rate\":%.0f",
+		       est->done, est->total, est->rate, est->avg_rate);
+	if (est->eta >= 0)
+		printf(",\"eta\":%.0f", est->eta);
+	else
+		printf(",\"eta\":null");
+	printf(",\"limit\":%llu,\"throttled\":%s}\n", limit,
+	       replace_throttled(est, limit) ? "true" : "false");
+}
 
 static int print_replace_status(int fd, const char *path, int once)
 {
 	struct btrfs_ioctl_dev_replace_args args = {0};
 	struct btrfs_ioctl_dev_replace_status_params *status;
+	struct progress_estimator est;
+	struct task_info *info = NULL;
+	const bool json = (bconf.output_format == CMD_FORMAT_JSON);
 	int ret;
 	int prevent_loop = 0;
 	int skip_stats;
 	int num_chars;
+	int prev_chars = 0;
+	u64 source_devid = 0;
+	u64 source_size = 0;
+	u64 limit = 0;
 	char string1[80];
 	char string2[80];
 	char string3[80];
 
+	/* Without the source device the progress is tracked in per mille */
+	if (replace_source_device(fd, &source_devid, &source_size) == 0) {
+		char name[64];
+
+		snprintf(name, sizeof(name), "devinfo/%llu/scrub_speed_max",
+			 source_devid);
+		if (sysfs_read_fsid_file_u64(fd, name, &limit) < 0)
+			limit = 0;
+	}
+	progress_init(&est, source_size ?: 1000);
+
+	if (!once) {
+		info = task_init(NULL, NULL, NULL);
+		if (!info || task_period_start(info, 1000) < 0) {
+			error("cannot start the status timer: %m");
+			task_deinit(info);
+			return -1;
+		}
+	}
+
 	for (;;) {
 		args.cmd = BTRFS_IOCTL_DEV_REPLACE_CMD_STATUS;
 		args.result = BTRFS_IOCTL_DEV_REPLACE_RESULT_NO_RESULT;
@@ -424,17 +554,36 @@ static int print_replace_status(int fd, const char *path, int once)
 					replace_dev_result2string(args.result));
 			else
 				pr_stderr(LOG_DEFAULT, "\n");
-			return ret;
+			goto out;
 		}
 
 		if (args.result != BTRFS_IOCTL_DEV_REPLACE_RESULT_NO_ERROR) {
 			error("ioctl(DEV_REPLACE_STATUS) on '%s' returns error: %s",
 				path,
 				replace_dev_result2string(args.result));
-			return -1;
+			ret = -1;
+			goto out;
 		}
 
 		status = &args.status;
+		progress_update(&est, source_size ?
+				source_size / 1000 * status->progress_1000 :
+				status->progress_1000);
+
+		if (json) {
+			if (status->replace_state > BTRFS_IOCTL_DEV_REPLACE_STATE_SUSPENDED) {
+				error("unknown status from ioctl DEV_REPLACE_STATUS on '%s': %llu",
+				      path, status->replace_state);
+				ret = -EINVAL;
+				goto out;
+			}
+			print_replace_status_json(status, &est, source_size, limit);
+			if (once || status->replace_state != BTRFS_IOCTL_DEV_REPLACE_STATE_STARTED)
+				break;
+			fflush(stdout);
+			task_period_wait(info);
+			continue;
+		}
 
 		skip_stats = 0;
 		num_chars = 0;
@@ -445,6 +594,17 @@ static int print_replace_status(int fd, const char *path, int once)
 				       progress2string(string3,
 						       sizeof(string3),
 						       status->progress_1000));
+			if (source_size && est.nr_samples > 1)
+				num_chars += printf(", %s/s (avg %s/s)",
+					pretty_size(est.rate),
+					pretty_size(est.avg_rate));
+			if (est.eta >= 0)
+				num_chars += printf(", ETA %s",
+					progress_eta_string(&est, string1,
+							    sizeof(string1)));
+			if (replace_throttled(&est, limit))
+				num_chars += printf(", throttled to %s/s",
+						    pretty_size(limit));
 			break;
 		case BTRFS_IOCTL_DEV_REPLACE_STATE_FINISHED:
 			prevent_loop = 1;
@@ -482,7 +642,8 @@ static int print_replace_status(int fd, const char *path, int once)
 		default:
 			error("unknown status from ioctl DEV_REPLACE_STATUS on '%s': %llu",
 					path, status->replace_state);
-			return -EINVAL;
+			ret = -EINVAL;
+			goto out;
 		}
 
 		if (!skip_stats)
@@ -490,20 +651,30 @@ static int print_replace_status(int fd, const char *path, int once)
 				", %llu write errs, %llu uncorr. read errs",
 				status->num_write_errors,
 				status->num_uncorrectable_read_errors);
+		/* Blank the rest of a longer previous line */
+		if (num_chars < prev_chars)
+			num_chars += printf("%*s", prev_chars - num_chars, "");
 		if (once || prevent_loop) {
 			printf("\n");
 			break;
 		}
 
 		fflush(stdout);
-		sleep(1);
+		task_period_wait(info);
+		prev_chars = num_chars;
 		while (num_chars > 0) {
 			putchar('\b');
 			num_chars--;
 		}
 	}
+	ret = 0;
 
-	return 0;
+out:
+	if (info) {
+		task_period_stop(info);
+		task_deinit(info);
+	}
+	return ret;
 }
 
 static char *
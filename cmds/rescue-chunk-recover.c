@@ -26,7 +26,10 @@
 #include <errno.h>
 #include <stddef.h>
 #include <string.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "kernel-lib/list.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/extent-io-tree.h"
 #include "kernel-shared/locking.h"
@@ -40,12 +43,16 @@
 #include "common/messages.h"
 #include "common/extent-cache.h"
 #include "common/utils.h"
+#include "common/device-utils.h"
 #include "cmds/rescue.h"
 #include "check/common.h"
 
 struct recover_control {
 	int verbose;
 	int yes;
+	/* Readers of each device, 0 to decide by the device type */
+	int readers;
+	bool direct_io;
 
 	u16 csum_size;
 	u16 csum_type;
@@ -77,10 +84,26 @@ struct extent_record {
 	int nmirrors;
 };
 
+/* Size of one read of the device scan */
+#define SCAN_READ_SIZE			(SZ_4M)
+/* Alignment of the read buffer, for O_DIRECT */
+#define SCAN_READ_ALIGN			(SZ_64K)
+/* Smallest part of a device given to one reader */
+#define SCAN_MIN_RANGE			(SZ_256M)
+/* Readers of a non-rotational device by default */
+#define SCAN_READERS_DEFAULT		(4)
+
 struct device_scan {
 	struct recover_control *rc;
 	struct btrfs_device *dev;
 	int fd;
+	/* Index of the device and its size, for the progress */
+	int devidx;
+	u64 dev_size;
+	/* Blocks starting in [start, end) are scanned, end is -1 for the last */
+	u64 start;
+	u64 end;
+	/* Current position, -1 when the reader is not running */
 	u64 bytenr;
 };
 
@@ -745,87 +768,194 @@ static inline int is_super_block_address(u64 offset)
 	return 0;
 }
 
+/* Process a tree block of the filesystem found by the device scan */
+static int scan_process_block(struct recover_control *rc,
+			      struct extent_buffer *buf,
+			      struct btrfs_device *device, u64 bytenr)
+{
+	int ret;
+
+	pthread_mutex_lock(&rc->rc_lock);
+	ret = process_extent_buffer(&rc->eb_cache, buf, device, bytenr);
+	pthread_mutex_unlock(&rc->rc_lock);
+	if (ret)
+		return ret;
+
+	if (btrfs_header_level(buf) != 0)
+		return 0;
+
+	switch (btrfs_header_owner(buf)) {
+	case BTRFS_EXTENT_TREE_OBJECTID:
+	case BTRFS_DEV_TREE_OBJECTID:
+		/* different tree use different generation */
+		if (btrfs_header_generation(buf) > rc->generation)
+			break;
+		ret = extract_metadata_record(rc, buf);
+		break;
+	case BTRFS_CHUNK_TREE_OBJECTID:
+		if (btrfs_header_generation(buf) > rc->chunk_root_generation)
+			break;
+		ret = extract_metadata_record(rc, buf);
+		break;
+	}
+	return ret;
+}
+
+/*
+ * Scan the range of a device for tree blocks, reading SCAN_READ_SIZE at once.
+ * Each read overlaps the next one by a node so that every sector aligned
+ * candidate block is whole in one buffer.  The fsid is compared in the read
+ * buffer, only the blocks with a matching fsid are copied and checksummed.
+ */
 static int scan_one_device(void *dev_scan_struct)
 {
 	struct extent_buffer *buf;
-	u64 bytenr;
-	int ret = 0;
 	struct device_scan *dev_scan = (struct device_scan *)dev_scan_struct;
 	struct recover_control *rc = dev_scan->rc;
 	struct btrfs_device *device = dev_scan->dev;
+	const size_t fsid_offset = offsetof(struct btrfs_header, fsid);
+	const size_t len = SCAN_READ_SIZE + rc->nodesize - rc->sectorsize;
+	char *data;
+	u64 pos;
+	u64 next;
 	int fd = dev_scan->fd;
 	int oldtype;
+	int ret = 0;
 
 	ret = pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, &oldtype);
 	if (ret)
 		return 1;
 
-	buf = malloc(sizeof(*buf) + rc->nodesize);
+	buf = alloc_extent_buffer_inline(rc->nodesize);
 	if (!buf)
 		return -ENOMEM;
 	buf->len = rc->nodesize;
 
-	bytenr = 0;
-	while (1) {
-		dev_scan->bytenr = bytenr;
-
-		if (is_super_block_address(bytenr))
-			bytenr += rc->sectorsize;
+	/* Aligned for O_DIRECT */
+	ret = posix_memalign((void **)&data, SCAN_READ_ALIGN, len);
+	if (ret) {
+		free(buf);
+		return -ENOMEM;
+	}
 
-		if (pread(fd, buf->data, rc->nodesize, bytenr) <
-		    rc->nodesize)
-			break;
+	next = dev_scan->start;
+	for (pos = dev_scan->start; pos < dev_scan->end; pos += SCAN_READ_SIZE) {
+		ssize_t nread;
+		u64 off;
 
-		if (memcmp_extent_buffer(buf, rc->fs_devices->metadata_uuid,
-					 btrfs_header_fsid(),
-					 BTRFS_FSID_SIZE)) {
-			bytenr += rc->sectorsize;
+		dev_scan->bytenr = pos;
+		nread = pread(fd, data, len, pos);
+		if (nread < 0) {
+			warning("failed to read %s at %llu, skipping %u bytes: %m",
+				device->name, pos, SCAN_READ_SIZE);
 			continue;
 		}
+		if (nread < rc->nodesize)
+			break;
 
-		if (verify_tree_block_csum_silent(buf, rc->csum_size,
-						  rc->csum_type)) {
-			bytenr += rc->sectorsize;
-			continue;
-		}
+		off = (next > pos ? next - pos : 0);
+		for (; off < SCAN_READ_SIZE && off + rc->nodesize <= nread;
+		     off += rc->sectorsize) {
+			u64 bytenr = pos + off;
 
-		pthread_mutex_lock(&rc->rc_lock);
-		ret = process_extent_buffer(&rc->eb_cache, buf, device, bytenr);
-		pthread_mutex_unlock(&rc->rc_lock);
-		if (ret)
-			goto out;
+			if (is_super_block_address(bytenr))
+				continue;
 
-		if (btrfs_header_level(buf) != 0)
-			goto next_node;
+			if (memcmp(data + off + fsid_offset,
+				   rc->fs_devices->metadata_uuid,
+				   BTRFS_FSID_SIZE))
+				continue;
 
-		switch (btrfs_header_owner(buf)) {
-		case BTRFS_EXTENT_TREE_OBJECTID:
-		case BTRFS_DEV_TREE_OBJECTID:
-			/* different tree use different generation */
-			if (btrfs_header_generation(buf) > rc->generation)
-				break;
-			ret = extract_metadata_record(rc, buf);
-			if (ret)
-				goto out;
-			break;
-		case BTRFS_CHUNK_TREE_OBJECTID:
-			if (btrfs_header_generation(buf) >
-			    rc->chunk_root_generation)
-				break;
-			ret = extract_metadata_record(rc, buf);
+			memcpy(buf->data, data + off, rc->nodesize);
+			if (verify_tree_block_csum_silent(buf, rc->csum_size,
+							  rc->csum_type))
+				continue;
+
+			ret = scan_process_block(rc, buf, device, bytenr);
 			if (ret)
 				goto out;
-			break;
+
+			next = bytenr + rc->nodesize;
+			off = next - pos - rc->sectorsize;
 		}
-next_node:
-		bytenr += rc->nodesize;
+		if (nread < len)
+			break;
 	}
 out:
 	close(fd);
+	free(data);
 	free(buf);
 	return ret;
 }
 
+/* Open a device for the scan, O_DIRECT is dropped if not supported */
+static int scan_open_device(struct recover_control *rc, const char *name)
+{
+	int fd;
+
+	if (rc->direct_io) {
+		fd = open(name, O_RDONLY | O_DIRECT);
+		if (fd >= 0 || errno != EINVAL)
+			return fd;
+		warning("direct io not supported by %s, using buffered reads",
+			name);
+	}
+	return open(name, O_RDONLY);
+}
+
+/* Bytes scanned by the readers of each device, and the ETA of the scan */
+static void print_scan_progress(struct device_scan *dev_scans, int nr_scans,
+				int devnr, time_t start_time)
+{
+	u64 total_done = 0;
+	u64 total_size = 0;
+	time_t elapsed = time(NULL) - start_time;
+	int i;
+	int j;
+
+	printf("\rScanning: ");
+	for (i = 0; i < devnr; i++) {
+		u64 done = 0;
+		u64 size = 0;
+		bool all_done = true;
+
+		for (j = 0; j < nr_scans; j++) {
+			struct device_scan *scan = &dev_scans[j];
+
+			if (scan->devidx != i)
+				continue;
+			size = scan->dev_size;
+			if (scan->bytenr == -1) {
+				done += min(scan->end, scan->dev_size) -
+					scan->start;
+			} else {
+				all_done = false;
+				done += scan->bytenr - scan->start;
+			}
+		}
+		total_done += done;
+		total_size += size;
+
+		if (all_done)
+			printf("%sDONE in dev%d", i ? ", " : "", i);
+		else if (size)
+			printf("%s%llu%% in dev%d", i ? ", " : "",
+			       done * 100 / size, i);
+		else
+			printf("%s%llu in dev%d", i ? ", " : "", done, i);
+	}
+	if (elapsed > 0 && total_done && total_done < total_size) {
+		u64 eta = (total_size - total_done) * elapsed / total_done;
+
+		printf(", ETA %llu:%02llu:%02llu", eta / 3600, eta / 60 % 60,
+		       eta % 60);
+	}
+	/* clear chars if exist in tail */
+	printf("                ");
+	printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
+	fflush(stdout);
+}
+
 static int scan_devices(struct recover_control *rc)
 {
 	int ret = 0;
@@ -834,57 +964,107 @@ static int scan_devices(struct recover_control *rc)
 	struct device_scan *dev_scans;
 	pthread_t *t_scans;
 	long *t_rets;
+	time_t start_time;
 	int devnr = 0;
 	int devidx = 0;
+	int nr_scans = 0;
+	int nr_started = 0;
+	int max_readers;
 	int i;
 	bool all_done;
 
 	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list)
 		devnr++;
+	max_readers = rc->readers ? rc->readers : SCAN_READERS_DEFAULT;
 	dev_scans = (struct device_scan *)malloc(sizeof(struct device_scan)
-						 * devnr);
+						 * devnr * max_readers);
 	if (!dev_scans)
 		return -ENOMEM;
-	t_scans = (pthread_t *)malloc(sizeof(pthread_t) * devnr);
+	t_scans = (pthread_t *)malloc(sizeof(pthread_t) * devnr * max_readers);
 	if (!t_scans) {
 		free(dev_scans);
 		return -ENOMEM;
 	}
-	t_rets = (long *)malloc(sizeof(long) * devnr);
+	t_rets = (long *)malloc(sizeof(long) * devnr * max_readers);
 	if (!t_rets) {
 		free(dev_scans);
 		free(t_scans);
 		return -ENOMEM;
 	}
 
+	/*
+	 * Split each device to contiguous ranges of whole reads, one for each
+	 * reader.  Several readers only help non-rotational devices, a single
+	 * reader is used for the others unless asked.
+	 */
 	list_for_each_entry(dev, &rc->fs_devices->devices, dev_list) {
-		fd = open(dev->name, O_RDONLY);
-		if (fd < 0) {
+		struct stat st;
+		u64 size;
+		u64 range;
+		int readers;
+		int j;
+
+		fd = scan_open_device(rc, dev->name);
+		if (fd < 0 || fstat(fd, &st) < 0) {
 			fprintf(stderr, "Failed to open device %s\n",
 				dev->name);
+			if (fd >= 0)
+				close(fd);
 			ret = 1;
 			goto out2;
 		}
-		dev_scans[devidx].rc = rc;
-		dev_scans[devidx].dev = dev;
-		dev_scans[devidx].fd = fd;
-		dev_scans[devidx].bytenr = -1;
+		size = device_get_partition_size_fd_stat(fd, &st);
+
+		readers = rc->readers;
+		if (!readers)
+			readers = device_get_rotational(dev->name) ?
+				  SCAN_READERS_DEFAULT : 1;
+		readers = min_t(u64, readers, size / SCAN_MIN_RANGE);
+		readers = max(readers, 1);
+		range = round_up(size / readers, SCAN_READ_SIZE);
+
+		for (j = 0; j < readers; j++) {
+			struct device_scan *scan = &dev_scans[nr_scans];
+
+			if (j) {
+				fd = scan_open_device(rc, dev->name);
+				if (fd < 0) {
+					fprintf(stderr,
+						"Failed to open device %s\n",
+						dev->name);
+					ret = 1;
+					goto out2;
+				}
+			}
+			scan->rc = rc;
+			scan->dev = dev;
+			scan->fd = fd;
+			scan->devidx = devidx;
+			scan->dev_size = size;
+			scan->start = j * range;
+			scan->end = (j == readers - 1 ? (u64)-1 : scan->start + range);
+			scan->bytenr = -1;
+			nr_scans++;
+		}
 		devidx++;
 	}
 
-	for (i = 0; i < devidx; i++) {
+	start_time = time(NULL);
+	for (i = 0; i < nr_scans; i++) {
+		dev_scans[i].bytenr = dev_scans[i].start;
 		ret = pthread_create(&t_scans[i], NULL,
 				     (void *)scan_one_device,
 				     (void *)&dev_scans[i]);
-		if (ret)
+		if (ret) {
+			dev_scans[i].bytenr = -1;
 			goto out1;
-
-		dev_scans[i].bytenr = 0;
+		}
+		nr_started++;
 	}
 
 	while (1) {
 		all_done = true;
-		for (i = 0; i < devidx; i++) {
+		for (i = 0; i < nr_scans; i++) {
 			if (dev_scans[i].bytenr == -1)
 				continue;
 			ret = pthread_tryjoin_np(t_scans[i],
@@ -900,19 +1080,7 @@ static int scan_devices(struct recover_control *rc)
 			dev_scans[i].bytenr = -1;
 		}
 
-		printf("\rScanning: ");
-		for (i = 0; i < devidx; i++) {
-			if (dev_scans[i].bytenr == -1)
-				printf("%sDONE in dev%d",
-				       i ? ", " : "", i);
-			else
-				printf("%s%llu in dev%d",
-				       i ? ", " : "", dev_scans[i].bytenr, i);
-		}
-		/* clear chars if exist in tail */
-		printf("                ");
-		printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b");
-		fflush(stdout);
+		print_scan_progress(dev_scans, nr_scans, devidx, start_time);
 
 		if (all_done) {
 			printf("\n");
@@ -922,12 +1090,14 @@ static int scan_devices(struct recover_control *rc)
 		sleep(1);
 	}
 out1:
-	for (i = 0; i < devidx; i++) {
+	for (i = 0; i < nr_started; i++) {
 		if (dev_scans[i].bytenr == -1)
 			continue;
 		pthread_cancel(t_scans[i]);
 	}
 out2:
+	for (i = nr_started; i < nr_scans; i++)
+		close(dev_scans[i].fd);
 	free(dev_scans);
 	free(t_scans);
 	free(t_rets);
@@ -2301,7 +2471,8 @@ static void validate_rebuild_chunks(struct recover_control *rc)
 /*
  * Return 0 when successful, < 0 on error and > 0 if aborted by user
  */
-int btrfs_recover_chunk_tree(const char *path, int yes)
+int btrfs_recover_chunk_tree(const char *path, int yes, int readers,
+			     bool direct_io)
 {
 	int ret = 0;
 	struct btrfs_root *root = NULL;
@@ -2309,6 +2480,8 @@ int btrfs_recover_chunk_tree(const char *path, int yes)
 	struct recover_control rc;
 
 	init_recover_control(&rc, yes);
+	rc.readers = readers;
+	rc.direct_io = direct_io;
 
 	ret = recover_prepare(&rc, path);
 	if (ret) {
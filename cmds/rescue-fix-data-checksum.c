@@ -16,6 +16,10 @@
 
 #include "kerncompat.h"
 #include <ctype.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/volumes.h"
@@ -83,14 +87,15 @@ static int add_corrupted_block(struct btrfs_fs_info *fs_info, u64 logical,
 	/* The last entry is the same, just set update the error mirror bitmap. */
 	if (last->logical == logical) {
 		UASSERT(last->error_mirror_bitmap);
-		set_bit(mirror, last->error_mirror_bitmap);
+		set_bit(mirror - 1, last->error_mirror_bitmap);
 		return 0;
 	}
 add:
 	last = calloc(1, sizeof(*last));
 	if (!last)
 		return -ENOMEM;
-	last->error_mirror_bitmap = calloc(1, BITS_TO_LONGS(num_mirrors));
+	last->error_mirror_bitmap = calloc(BITS_TO_LONGS(num_mirrors),
+					   sizeof(unsigned long));
 	if (!last->error_mirror_bitmap) {
 		free(last);
 		return -ENOMEM;
@@ -103,84 +108,281 @@ add:
 	return 0;
 }
 
+/* Data bytes verified at once by a worker, read with one request per mirror */
+#define CSUM_BATCH_SIZE		(SZ_4M)
+/* Batches queued to the workers or waiting to be collected */
+#define CSUM_BATCH_QUEUE	(64)
+#define CSUM_VERIFY_MAX_THREADS	(16)
+
+/* A sector of a batch with a mismatch or read error on @mirror */
+struct csum_batch_error {
+	u32 index;
+	unsigned int mirror;
+};
+
+/* Contiguous data sectors with the same number of mirrors */
+struct csum_batch {
+	u64 logical;
+	u32 nr_sectors;
+	unsigned int num_mirrors;
+	/* Expected checksums of the sectors */
+	u8 *csums;
+	struct csum_batch_error *errors;
+	int nr_errors;
+	int alloc_errors;
+	int ret;
+	bool done;
+};
+
+/*
+ * The csum tree is walked by the main thread, which fills the batches in
+ * logical order and queues them to the workers.  The batches are collected
+ * in the same order, so the corrupted blocks are recorded as if verified one
+ * by one.
+ */
+struct csum_verify_ctx {
+	struct btrfs_fs_info *fs_info;
+	struct csum_batch batches[CSUM_BATCH_QUEUE];
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	/* Sequence numbers of the batches, the slot is seq % CSUM_BATCH_QUEUE */
+	u64 next_fill;
+	u64 next_work;
+	u64 next_collect;
+	bool finished;
+};
+
+static int csum_batch_add_error(struct csum_batch *batch, u32 index,
+				unsigned int mirror)
+{
+	if (batch->nr_errors == batch->alloc_errors) {
+		int alloc = max(16, batch->alloc_errors * 2);
+		struct csum_batch_error *tmp;
+
+		tmp = realloc(batch->errors, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		batch->errors = tmp;
+		batch->alloc_errors = alloc;
+	}
+	batch->errors[batch->nr_errors].index = index;
+	batch->errors[batch->nr_errors].mirror = mirror;
+	batch->nr_errors++;
+	return 0;
+}
+
 /*
- * Verify all mirrors for @logical.
+ * Verify all mirrors of the sectors of @batch, reading each mirror of the
+ * whole batch at once, or sector by sector if the large read failed.
  *
- * If something critical happened, return <0 and should end the run immediately.
- * Otherwise return 0, including data checksum mismatch or read failure.
+ * The mismatches and read errors are recorded in the batch, return <0 only
+ * if something critical happened and the run should end.
  */
-static int verify_one_data_block(struct btrfs_fs_info *fs_info,
-				 struct extent_buffer *leaf,
-				 unsigned long leaf_offset, u64 logical,
-				 unsigned int num_mirrors)
+static int verify_csum_batch(struct btrfs_fs_info *fs_info,
+			     struct csum_batch *batch, u8 *buf)
 {
 	const u32 blocksize = fs_info->sectorsize;
 	const u32 csum_size = fs_info->csum_size;
-	u8 *buf;
+	const u64 len = (u64)batch->nr_sectors * blocksize;
 	u8 csum[BTRFS_CSUM_SIZE];
-	u8 csum_expected[BTRFS_CSUM_SIZE];
-	int ret = 0;
+	int ret;
 
-	buf = malloc(blocksize);
-	if (!buf)
-		return -ENOMEM;
+	for (int mirror = 1; mirror <= batch->num_mirrors; mirror++) {
+		bool whole = true;
+		u64 done = 0;
 
-	for (int mirror = 1; mirror <= num_mirrors; mirror++) {
-		u64 read_len = blocksize;
+		while (done < len) {
+			u64 read_len = len - done;
 
-		ret = read_data_from_disk(fs_info, buf, logical, &read_len, mirror);
-		if (ret < 0) {
-			/* IO error, add one record. */
-			ret = add_corrupted_block(fs_info, logical, mirror, num_mirrors);
-			if (ret < 0)
+			ret = read_data_from_disk(fs_info, buf + done,
+						  batch->logical + done,
+						  &read_len, mirror);
+			if (ret < 0) {
+				whole = false;
 				break;
+			}
+			done += read_len;
 		}
-		/* Verify the data checksum. */
-		btrfs_csum_data(fs_info->csum_type, buf, csum, blocksize);
-		read_extent_buffer(leaf, csum_expected, leaf_offset, csum_size);
-		if (memcmp(csum_expected, csum, csum_size) != 0) {
-			ret = add_corrupted_block(fs_info, logical, mirror, num_mirrors);
-			if (ret < 0)
-				break;
+
+		for (u32 i = 0; i < batch->nr_sectors; i++) {
+			u8 *data = buf + (u64)i * blocksize;
+
+			if (!whole) {
+				u64 read_len = blocksize;
+
+				ret = read_data_from_disk(fs_info, data,
+						batch->logical + (u64)i * blocksize,
+						&read_len, mirror);
+				if (ret < 0) {
+					/* IO error, add one record. */
+					ret = csum_batch_add_error(batch, i, mirror);
+					if (ret < 0)
+						return ret;
+					continue;
+				}
+			}
+			btrfs_csum_data(fs_info->csum_type, data, csum, blocksize);
+			if (memcmp(batch->csums + i * csum_size, csum,
+				   csum_size) != 0) {
+				ret = csum_batch_add_error(batch, i, mirror);
+				if (ret < 0)
+					return ret;
+			}
 		}
 	}
+	return 0;
+}
 
+static void *csum_verify_worker(void *arg)
+{
+	struct csum_verify_ctx *ctx = arg;
+	u8 *buf;
+
+	buf = malloc(CSUM_BATCH_SIZE);
+
+	pthread_mutex_lock(&ctx->lock);
+	while (1) {
+		struct csum_batch *batch;
+
+		while (ctx->next_work == ctx->next_fill && !ctx->finished)
+			pthread_cond_wait(&ctx->work_cond, &ctx->lock);
+		if (ctx->next_work == ctx->next_fill)
+			break;
+		batch = &ctx->batches[ctx->next_work % CSUM_BATCH_QUEUE];
+		ctx->next_work++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		if (buf)
+			batch->ret = verify_csum_batch(ctx->fs_info, batch, buf);
+		else
+			batch->ret = -ENOMEM;
+
+		pthread_mutex_lock(&ctx->lock);
+		batch->done = true;
+		pthread_cond_broadcast(&ctx->done_cond);
+	}
+	pthread_mutex_unlock(&ctx->lock);
 	free(buf);
-	return ret;
+	return NULL;
 }
 
-static int iterate_one_csum_item(struct btrfs_fs_info *fs_info, struct btrfs_path *path)
+static int compare_batch_error(const void *a, const void *b)
 {
-	struct btrfs_key key;
-	const unsigned long item_ptr_off = btrfs_item_ptr_offset(path->nodes[0],
-								 path->slots[0]);
-	const u32 blocksize = fs_info->sectorsize;
-	int num_mirrors;
-	u64 data_size;
-	u64 cur;
-	char *buf;
-	int ret = 0;
+	const struct csum_batch_error *ea = a;
+	const struct csum_batch_error *eb = b;
 
-	buf = malloc(blocksize);
-	if (!buf)
-		return -ENOMEM;
+	if (ea->index != eb->index)
+		return ea->index < eb->index ? -1 : 1;
+	if (ea->mirror != eb->mirror)
+		return ea->mirror < eb->mirror ? -1 : 1;
+	return 0;
+}
 
-	btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
-	data_size = btrfs_item_size(path->nodes[0], path->slots[0]) /
-		    fs_info->csum_size * blocksize;
-	num_mirrors = btrfs_num_copies(fs_info, key.offset, data_size);
+/* Wait for the oldest queued batch and record its corrupted blocks */
+static int collect_csum_batch(struct csum_verify_ctx *ctx)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	struct csum_batch *batch;
+	int ret;
 
-	for (cur = 0; cur < data_size; cur += blocksize) {
-		const unsigned long leaf_offset = item_ptr_off +
-			cur / blocksize * fs_info->csum_size;
+	batch = &ctx->batches[ctx->next_collect % CSUM_BATCH_QUEUE];
+	pthread_mutex_lock(&ctx->lock);
+	while (!batch->done)
+		pthread_cond_wait(&ctx->done_cond, &ctx->lock);
+	pthread_mutex_unlock(&ctx->lock);
+	ctx->next_collect++;
 
-		ret = verify_one_data_block(fs_info, path->nodes[0], leaf_offset,
-					    key.offset + cur, num_mirrors);
+	ret = batch->ret;
+	if (ret < 0)
+		return ret;
+	qsort(batch->errors, batch->nr_errors, sizeof(struct csum_batch_error),
+	      compare_batch_error);
+	for (int i = 0; i < batch->nr_errors; i++) {
+		ret = add_corrupted_block(fs_info, batch->logical +
+				(u64)batch->errors[i].index * fs_info->sectorsize,
+				batch->errors[i].mirror, batch->num_mirrors);
 		if (ret < 0)
-			break;
+			return ret;
 	}
-	free(buf);
-	return ret;
+	return 0;
+}
+
+/* Queue the batch being filled, if any, and get the next slot ready */
+static int queue_csum_batch(struct csum_verify_ctx *ctx)
+{
+	struct csum_batch *batch;
+	int ret;
+
+	batch = &ctx->batches[ctx->next_fill % CSUM_BATCH_QUEUE];
+	if (!batch->nr_sectors)
+		return 0;
+
+	pthread_mutex_lock(&ctx->lock);
+	batch->done = false;
+	ctx->next_fill++;
+	pthread_cond_signal(&ctx->work_cond);
+	pthread_mutex_unlock(&ctx->lock);
+
+	/* The next slot is reused once its previous batch is collected */
+	if (ctx->next_fill - ctx->next_collect == CSUM_BATCH_QUEUE) {
+		ret = collect_csum_batch(ctx);
+		if (ret < 0)
+			return ret;
+	}
+	batch = &ctx->batches[ctx->next_fill % CSUM_BATCH_QUEUE];
+	batch->nr_sectors = 0;
+	batch->nr_errors = 0;
+	batch->ret = 0;
+	return 0;
+}
+
+static int iterate_one_csum_item(struct csum_verify_ctx *ctx, struct btrfs_path *path)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	struct extent_buffer *leaf = path->nodes[0];
+	struct btrfs_key key;
+	const unsigned long item_ptr_off = btrfs_item_ptr_offset(leaf,
+								 path->slots[0]);
+	const u32 blocksize = fs_info->sectorsize;
+	const u32 csum_size = fs_info->csum_size;
+	unsigned int num_mirrors;
+	u32 nr_sectors;
+	u32 cur = 0;
+	int ret;
+
+	btrfs_item_key_to_cpu(leaf, &key, path->slots[0]);
+	nr_sectors = btrfs_item_size(leaf, path->slots[0]) / csum_size;
+	num_mirrors = btrfs_num_copies(fs_info, key.offset,
+				       (u64)nr_sectors * blocksize);
+
+	while (cur < nr_sectors) {
+		struct csum_batch *batch;
+		u64 logical = key.offset + (u64)cur * blocksize;
+		u32 nr;
+
+		batch = &ctx->batches[ctx->next_fill % CSUM_BATCH_QUEUE];
+		if (batch->nr_sectors &&
+		    (batch->logical + (u64)batch->nr_sectors * blocksize != logical ||
+		     batch->num_mirrors != num_mirrors ||
+		     batch->nr_sectors == CSUM_BATCH_SIZE / blocksize)) {
+			ret = queue_csum_batch(ctx);
+			if (ret < 0)
+				return ret;
+			batch = &ctx->batches[ctx->next_fill % CSUM_BATCH_QUEUE];
+		}
+		if (!batch->nr_sectors) {
+			batch->logical = logical;
+			batch->num_mirrors = num_mirrors;
+		}
+		nr = min(nr_sectors - cur,
+			 CSUM_BATCH_SIZE / blocksize - batch->nr_sectors);
+		read_extent_buffer(leaf, batch->csums + batch->nr_sectors * csum_size,
+				   item_ptr_off + cur * csum_size, nr * csum_size);
+		batch->nr_sectors += nr;
+		cur += nr;
+	}
+	return 0;
 }
 
 static int print_filenames(u64 ino, u64 offset, u64 rootid, void *ctx)
@@ -227,7 +429,7 @@ out:
 	return ret;
 }
 
-static int iterate_csum_root(struct btrfs_fs_info *fs_info, struct btrfs_root *csum_root)
+static int walk_csum_root(struct csum_verify_ctx *ctx, struct btrfs_root *csum_root)
 {
 	struct btrfs_path path = { 0 };
 	struct btrfs_key key;
@@ -237,6 +439,7 @@ static int iterate_csum_root(struct btrfs_fs_info *fs_info, struct btrfs_root *c
 	key.type = 0;
 	key.offset = 0;
 
+	path.reada = READA_FORWARD;
 	ret = btrfs_search_slot(NULL, csum_root, &key, &path, 0, 0);
 	if (ret < 0) {
 		errno = -ret;
@@ -248,24 +451,89 @@ static int iterate_csum_root(struct btrfs_fs_info *fs_info, struct btrfs_root *c
 		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
 		if (key.type != BTRFS_EXTENT_CSUM_KEY)
 			goto next;
-		ret = iterate_one_csum_item(fs_info, &path);
+		ret = iterate_one_csum_item(ctx, &path);
 		if (ret < 0)
 			break;
 next:
 		ret = btrfs_next_item(csum_root, &path);
 		if (ret > 0) {
-			ret = 0;
+			ret = queue_csum_batch(ctx);
 			break;
 		}
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to get next csum item: %m");
+			break;
 		}
 	}
 	btrfs_release_path(&path);
 	return ret;
 }
 
+/*
+ * Verify the data of all the csum items by batches of up to CSUM_BATCH_SIZE,
+ * in logical order, which is also the physical order inside a chunk.
+ */
+static int iterate_csum_root(struct btrfs_fs_info *fs_info, struct btrfs_root *csum_root)
+{
+	struct csum_verify_ctx ctx = { .fs_info = fs_info };
+	pthread_t threads[CSUM_VERIFY_MAX_THREADS];
+	long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int nr_threads;
+	int started = 0;
+	int ret = 0;
+	int ret2;
+
+	if (nr_cpus < 1)
+		nr_cpus = 1;
+	nr_threads = min_t(long, nr_cpus, CSUM_VERIFY_MAX_THREADS);
+	for (int i = 0; i < CSUM_BATCH_QUEUE; i++) {
+		ctx.batches[i].csums = malloc(CSUM_BATCH_SIZE / fs_info->sectorsize *
+					      fs_info->csum_size);
+		if (!ctx.batches[i].csums) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	pthread_mutex_init(&ctx.lock, NULL);
+	pthread_cond_init(&ctx.work_cond, NULL);
+	pthread_cond_init(&ctx.done_cond, NULL);
+	for (int i = 0; i < nr_threads; i++) {
+		if (pthread_create(&threads[i], NULL, csum_verify_worker, &ctx))
+			break;
+		started++;
+	}
+	if (!started) {
+		ret = -EAGAIN;
+		goto out_destroy;
+	}
+
+	ret = walk_csum_root(&ctx, csum_root);
+
+	pthread_mutex_lock(&ctx.lock);
+	ctx.finished = true;
+	pthread_cond_broadcast(&ctx.work_cond);
+	pthread_mutex_unlock(&ctx.lock);
+	/* Collect what was queued even after an error */
+	while (ctx.next_collect < ctx.next_fill) {
+		ret2 = collect_csum_batch(&ctx);
+		if (ret2 < 0 && !ret)
+			ret = ret2;
+	}
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+out_destroy:
+	pthread_cond_destroy(&ctx.done_cond);
+	pthread_cond_destroy(&ctx.work_cond);
+	pthread_mutex_destroy(&ctx.lock);
+out:
+	for (int i = 0; i < CSUM_BATCH_QUEUE; i++) {
+		free(ctx.batches[i].csums);
+		free(ctx.batches[i].errors);
+	}
+	return ret;
+}
+
 #define ASK_ACTION_BUFSIZE	(32)
 static enum fix_data_checksum_action_value ask_action(unsigned int num_mirrors,
 						      unsigned int *mirror_ret)
@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include "kernel-lib/list.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
@@ -106,30 +107,76 @@ static int add_superblock_record(struct btrfs_super_block *sb, char *fname,
 	return 0;
 }
 
-static int
-read_dev_supers(char *filename, struct btrfs_recover_superblock *recover)
+/* Threads reading the super blocks of the devices */
+#define SUPER_READ_THREADS	(16)
+
+/* All the super block copies of one device, read by a worker */
+struct dev_supers {
+	char *filename;
+	struct btrfs_super_block sb[BTRFS_SUPER_MIRROR_MAX];
+	int ret[BTRFS_SUPER_MIRROR_MAX];
+	/* Error of the open */
+	int err;
+};
+
+struct dev_supers_ctx {
+	struct dev_supers *devs;
+	int nr;
+	int next;
+	pthread_mutex_t mutex;
+};
+
+static void read_dev_supers(struct dev_supers *ds)
 {
-	int i, ret, fd;
-	u64 max_gen, bytenr;
-	struct btrfs_super_block sb;
+	int i, fd;
 
-	/* just ignore errno that were set in btrfs_scan_fs_devices() */
-	errno = 0;
+	fd = open(ds->filename, O_RDONLY);
+	if (fd < 0) {
+		ds->err = -errno;
+		return;
+	}
+
+	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++)
+		ds->ret[i] = btrfs_read_dev_super(fd, &ds->sb[i],
+						  btrfs_sb_offset(i),
+						  SBREAD_DEFAULT);
+	close(fd);
+}
+
+static void *read_dev_supers_worker(void *arg)
+{
+	struct dev_supers_ctx *ctx = arg;
 
-	fd = open(filename, O_RDONLY);
-	if (fd < 0)
-		return -errno;
+	pthread_mutex_lock(&ctx->mutex);
+	while (ctx->next < ctx->nr) {
+		struct dev_supers *ds = &ctx->devs[ctx->next++];
+
+		pthread_mutex_unlock(&ctx->mutex);
+		read_dev_supers(ds);
+		pthread_mutex_lock(&ctx->mutex);
+	}
+	pthread_mutex_unlock(&ctx->mutex);
+	return NULL;
+}
+
+static int add_dev_supers(struct dev_supers *ds,
+			  struct btrfs_recover_superblock *recover)
+{
+	int i, ret;
+	u64 max_gen, bytenr;
+
+	if (ds->err)
+		return ds->err;
 
 	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
 		bytenr = btrfs_sb_offset(i);
-
-		ret = btrfs_read_dev_super(fd, &sb, bytenr, SBREAD_DEFAULT);
+		ret = ds->ret[i];
 		if (!ret) {
-			ret = add_superblock_record(&sb, filename, bytenr,
-							&recover->good_supers);
+			ret = add_superblock_record(&ds->sb[i], ds->filename,
+					bytenr, &recover->good_supers);
 			if (ret)
-				goto out;
-			max_gen = btrfs_super_generation(&sb);
+				return ret;
+			max_gen = btrfs_super_generation(&ds->sb[i]);
 			if (max_gen > recover->max_generation)
 				recover->max_generation = max_gen;
 		} else if (ret != -ENOENT){
@@ -137,31 +184,60 @@ read_dev_supers(char *filename, struct btrfs_recover_superblock *recover)
 			 * Skip superblock which doesn't exist, only adds
 			 * really corrupted superblock
 			 */
-			ret = add_superblock_record(&sb, filename, bytenr,
-						&recover->bad_supers);
+			ret = add_superblock_record(&ds->sb[i], ds->filename,
+					bytenr, &recover->bad_supers);
 			if (ret)
-				goto out;
+				return ret;
 		}
 	}
-	ret = 0;
-out:
-	close(fd);
-	return ret;
+	return 0;
 }
 
+/*
+ * Read the super blocks of all devices in parallel, the records are added in
+ * the order of the devices.
+ */
 static int read_fs_supers(struct btrfs_recover_superblock *recover)
 {
+	struct dev_supers_ctx ctx = { 0 };
 	struct super_block_record *record;
 	struct super_block_record *next_record;
 	struct btrfs_device *dev;
-	int ret;
+	pthread_t threads[SUPER_READ_THREADS];
+	int nr_threads;
+	int ret = 0;
+	int i;
 	u64 gen;
 
-	list_for_each_entry(dev, &recover->fs_devices->devices,
-				dev_list) {
-		ret = read_dev_supers(dev->name, recover);
+	list_for_each_entry(dev, &recover->fs_devices->devices, dev_list)
+		ctx.nr++;
+	ctx.devs = calloc(ctx.nr, sizeof(*ctx.devs));
+	if (!ctx.devs)
+		return -ENOMEM;
+	i = 0;
+	list_for_each_entry(dev, &recover->fs_devices->devices, dev_list)
+		ctx.devs[i++].filename = dev->name;
+
+	/* just ignore errno that were set in btrfs_scan_fs_devices() */
+	errno = 0;
+
+	pthread_mutex_init(&ctx.mutex, NULL);
+	nr_threads = min(ctx.nr, SUPER_READ_THREADS);
+	for (i = 0; i < nr_threads && nr_threads > 1; i++) {
+		if (pthread_create(&threads[i], NULL, read_dev_supers_worker,
+				   &ctx))
+			break;
+	}
+	nr_threads = i;
+	read_dev_supers_worker(&ctx);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&ctx.mutex);
+
+	for (i = 0; i < ctx.nr; i++) {
+		ret = add_dev_supers(&ctx.devs[i], recover);
 		if (ret)
-			return ret;
+			goto out;
 	}
 	list_for_each_entry_safe(record, next_record,
 			&recover->good_supers, list) {
@@ -169,8 +245,9 @@ static int read_fs_supers(struct btrfs_recover_superblock *recover)
 		if (gen < recover->max_generation)
 			list_move_tail(&record->list, &recover->bad_supers);
 	}
-
-	return 0;
+out:
+	free(ctx.devs);
+	return ret;
 }
 
 static void print_super_info(struct super_block_record *record)
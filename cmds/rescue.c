@@ -37,6 +37,7 @@
 #include "common/help.h"
 #include "common/open-utils.h"
 #include "common/clear-cache.h"
+#include "common/root-tree-utils.h"
 #include "cmds/commands.h"
 #include "cmds/rescue.h"
 
@@ -50,6 +51,9 @@ static const char * const cmd_rescue_chunk_recover_usage[] = {
 	"Recover the chunk tree by scanning the devices one by one.",
 	"",
 	OPTLINE("-y", "assume an answer of `yes' to all questions"),
+	OPTLINE("--readers <num>", "number of parallel readers of each device, "
+		"default is 4 for non-rotational devices and 1 otherwise"),
+	OPTLINE("--direct-io", "read the devices with direct io, bypassing the page cache"),
 	OPTLINE("-h", "help"),
 	OPTLINE("-v", "deprecated, alias for global -v option"),
 	HELPINFO_INSERT_GLOBALS,
@@ -63,6 +67,8 @@ static int cmd_rescue_chunk_recover(const struct cmd_struct *cmd,
 	int ret = 0;
 	char *file;
 	bool yes = false;
+	bool direct_io = false;
+	int readers = 0;
 
 	/* If verbose is unset, set it to 0 */
 	if (bconf.verbose == BTRFS_BCONF_UNSET)
@@ -70,7 +76,16 @@ static int cmd_rescue_chunk_recover(const struct cmd_struct *cmd,
 
 	optind = 0;
 	while (1) {
-		int c = getopt(argc, argv, "yvh");
+		int c;
+		enum { GETOPT_VAL_READERS = GETOPT_VAL_FIRST,
+		       GETOPT_VAL_DIRECT_IO };
+		static const struct option long_options[] = {
+			{ "readers", required_argument, NULL, GETOPT_VAL_READERS },
+			{ "direct-io", no_argument, NULL, GETOPT_VAL_DIRECT_IO },
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "yvh", long_options, NULL);
 		if (c < 0)
 			break;
 		switch (c) {
@@ -80,6 +95,20 @@ static int cmd_rescue_chunk_recover(const struct cmd_struct *cmd,
 		case 'v':
 			bconf.verbose++;
 			break;
+		case GETOPT_VAL_READERS: {
+			u64 num = arg_strtou64(optarg);
+
+			if (num < 1 || num > 64) {
+				error("invalid number of readers %s, must be 1 to 64",
+				      optarg);
+				return 1;
+			}
+			readers = num;
+			break;
+		}
+		case GETOPT_VAL_DIRECT_IO:
+			direct_io = true;
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -100,7 +129,7 @@ static int cmd_rescue_chunk_recover(const struct cmd_struct *cmd,
 		return 1;
 	}
 
-	ret = btrfs_recover_chunk_tree(file, yes);
+	ret = btrfs_recover_chunk_tree(file, yes, readers, direct_io);
 	if (!ret) {
 		pr_verbose(LOG_DEFAULT, "Chunk tree recovered successfully\n");
 	} else if (ret > 0) {
@@ -473,6 +502,56 @@ out:
 }
 static DEFINE_SIMPLE_COMMAND(rescue_clear_uuid_tree, "clear-uuid-tree");
 
+static const char * const cmd_rescue_rebuild_uuid_tree_usage[] = {
+	"btrfs rescue rebuild-uuid-tree <device>",
+	"Rebuild the uuid tree from the subvolumes in one transaction",
+	"The uuids of all subvolumes and received subvolumes are read in one pass",
+	"and the tree is rewritten in the key order, instead of the rescan at the",
+	"next read-write mount.",
+	NULL,
+};
+
+static int cmd_rescue_rebuild_uuid_tree(const struct cmd_struct *cmd,
+					int argc, char **argv)
+{
+	struct btrfs_fs_info *fs_info;
+	struct open_ctree_args oca = { 0 };
+	char *devname;
+	int ret;
+
+	clean_args_no_options(cmd, argc, argv);
+	if (check_argc_exact(argc, 2))
+		return 1;
+
+	devname = argv[optind];
+	ret = check_mounted(devname);
+	if (ret < 0) {
+		errno = -ret;
+		error("could not check mount status: %m");
+		goto out;
+	} else if (ret) {
+		error("%s is currently mounted", devname);
+		ret = -EBUSY;
+		goto out;
+	}
+	oca.filename = devname;
+	oca.flags = OPEN_CTREE_WRITES | OPEN_CTREE_EXCLUSIVE;
+	fs_info = open_ctree_fs_info(&oca);
+	if (!fs_info) {
+		error("could not open btrfs");
+		ret = -EIO;
+		goto out;
+	}
+
+	ret = btrfs_rebuild_uuid_tree(fs_info);
+	if (ret == 0)
+		pr_verbose(LOG_DEFAULT, "Successfully rebuilt uuid tree\n");
+	close_ctree(fs_info->tree_root);
+out:
+	return !!ret;
+}
+static DEFINE_SIMPLE_COMMAND(rescue_rebuild_uuid_tree, "rebuild-uuid-tree");
+
 static const char * const cmd_rescue_clear_ino_cache_usage[] = {
 	"btrfs rescue clear-ino-cache <device>",
 	"remove leftover items pertaining to the deprecated inode cache feature",
@@ -599,6 +678,7 @@ static const struct cmd_group rescue_cmd_group = {
 		&cmd_struct_rescue_clear_ino_cache,
 		&cmd_struct_rescue_clear_space_cache,
 		&cmd_struct_rescue_clear_uuid_tree,
+		&cmd_struct_rescue_rebuild_uuid_tree,
 		NULL
 	}
 };
@@ -20,6 +20,8 @@
 #ifndef __BTRFS_RESCUE_H__
 #define __BTRFS_RESCUE_H__
 
+#include <stdbool.h>
+
 enum btrfs_fix_data_checksum_mode {
 	BTRFS_FIX_DATA_CSUMS_READONLY,
 	BTRFS_FIX_DATA_CSUMS_INTERACTIVE,
@@ -28,7 +30,8 @@ enum btrfs_fix_data_checksum_mode {
 };
 
 int btrfs_recover_superblocks(const char *path, int yes);
-int btrfs_recover_chunk_tree(const char *path, int yes);
+int btrfs_recover_chunk_tree(const char *path, int yes, int readers,
+			     bool direct_io);
 int btrfs_recover_fix_data_checksum(const char *path, enum btrfs_fix_data_checksum_mode mode,
 				    unsigned int mirror);
 
@@ -31,6 +31,7 @@
 #include <limits.h>
 #include <stddef.h>
 #include <string.h>
+#include <pthread.h>
 #if COMPRESSION_LZO
 #include <lzo/lzoconf.h>
 #include <lzo/lzo1x.h>
@@ -39,6 +40,8 @@
 #if COMPRESSION_ZSTD
 #include <zstd.h>
 #endif
+#include "kernel-lib/list.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/ctree.h"
@@ -66,6 +69,72 @@ static int ignore_errors = 0;
 static int overwrite = 0;
 static int get_xattrs = 0;
 static int dry_run = 0;
+static bool preallocate = false;
+static bool resume = false;
+/* Cleared by the threads when the devices or the target can't do it */
+static bool reflink = false;
+
+/* The file data is read and written by the threads of --threads */
+#define RESTORE_MAX_THREADS	(64)
+/* Extent items of a file passed to a thread at once */
+#define RESTORE_WORK_EXTENTS	(64)
+#define RESTORE_WORK_BYTES	(SZ_16M)
+
+static struct restore_pool *restore_pool;
+
+/* Largest read of the file data, see --read-size */
+#define RESTORE_READ_SIZE	(SZ_4M)
+#define RESTORE_MIN_READ_SIZE	(SZ_64K)
+#define RESTORE_MAX_READ_SIZE	(SZ_1G)
+static u64 read_size = RESTORE_READ_SIZE;
+
+/*
+ * Decompression contexts and buffers of the thread, kept for all the extents
+ * it restores and freed by restore_buffers_free() when it's done.
+ */
+struct restore_buffers {
+	char *inbuf;
+	size_t inbuf_size;
+	char *outbuf;
+	size_t outbuf_size;
+	z_stream zlib;
+	bool zlib_ready;
+#if COMPRESSION_ZSTD
+	ZSTD_DStream *zstd;
+#endif
+};
+
+static __thread struct restore_buffers restore_buffers;
+
+/* Return a buffer of at least @size bytes, the content is not kept */
+static char *restore_buffer(char **buf, size_t *buf_size, size_t size)
+{
+	if (size > *buf_size) {
+		free(*buf);
+		*buf = malloc(size);
+		if (!*buf) {
+			*buf_size = 0;
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return NULL;
+		}
+		*buf_size = size;
+	}
+	return *buf;
+}
+
+static void restore_buffers_free(void)
+{
+	struct restore_buffers *bufs = &restore_buffers;
+
+	free(bufs->inbuf);
+	free(bufs->outbuf);
+	if (bufs->zlib_ready)
+		(void)inflateEnd(&bufs->zlib);
+#if COMPRESSION_ZSTD
+	ZSTD_freeDStream(bufs->zstd);
+#endif
+	memset(bufs, 0, sizeof(*bufs));
+}
 
 #define LZO_LEN 4
 #define lzo1x_worst_compress(x) ((x) + ((x) / 16) + 64 + 3)
@@ -73,28 +142,31 @@ static int dry_run = 0;
 static int decompress_zlib(char *inbuf, char *outbuf, u64 compress_len,
 			   u64 decompress_len)
 {
-	z_stream strm;
+	z_stream *strm = &restore_buffers.zlib;
 	int ret;
 
-	memset(&strm, 0, sizeof(strm));
-	ret = inflateInit(&strm);
+	if (restore_buffers.zlib_ready) {
+		ret = inflateReset(strm);
+	} else {
+		memset(strm, 0, sizeof(*strm));
+		ret = inflateInit(strm);
+		restore_buffers.zlib_ready = (ret == Z_OK);
+	}
 	if (ret != Z_OK) {
 		error("zlib init returned %d", ret);
 		return -1;
 	}
 
-	strm.avail_in = compress_len;
-	strm.next_in = (unsigned char *)inbuf;
-	strm.avail_out = decompress_len;
-	strm.next_out = (unsigned char *)outbuf;
-	ret = inflate(&strm, Z_NO_FLUSH);
+	strm->avail_in = compress_len;
+	strm->next_in = (unsigned char *)inbuf;
+	strm->avail_out = decompress_len;
+	strm->next_out = (unsigned char *)outbuf;
+	ret = inflate(strm, Z_NO_FLUSH);
 	if (ret != Z_STREAM_END) {
-		(void)inflateEnd(&strm);
 		error("zlib inflate failed: %d", ret);
 		return -1;
 	}
 
-	(void)inflateEnd(&strm);
 	return 0;
 }
 static inline size_t read_compress_length(unsigned char *buf)
@@ -177,40 +249,37 @@ static int decompress_zstd(const char *inbuf, char *outbuf, u64 compress_len,
 	error("btrfs not compiled with zstd support");
 	return -1;
 #else
-	ZSTD_DStream *strm;
+	ZSTD_DStream *strm = restore_buffers.zstd;
 	size_t zret;
-	int ret = 0;
 	ZSTD_inBuffer in = {inbuf, compress_len, 0};
 	ZSTD_outBuffer out = {outbuf, decompress_len, 0};
 
-	strm = ZSTD_createDStream();
 	if (!strm) {
-		error("zstd create failed");
-		return -1;
+		strm = ZSTD_createDStream();
+		if (!strm) {
+			error("zstd create failed");
+			return -1;
+		}
+		restore_buffers.zstd = strm;
 	}
 
 	zret = ZSTD_initDStream(strm);
 	if (ZSTD_isError(zret)) {
 		error("zstd init failed: %s", ZSTD_getErrorName(zret));
-		ret = -1;
-		goto out;
+		return -1;
 	}
 
 	zret = ZSTD_decompressStream(strm, &out, &in);
 	if (ZSTD_isError(zret)) {
 		error("zstd decompress failed %s\n", ZSTD_getErrorName(zret));
-		ret = -1;
-		goto out;
+		return -1;
 	}
 	if (zret != 0) {
 		error("zstd frame incomplete");
-		ret = -1;
-		goto out;
+		return -1;
 	}
 
-out:
-	ZSTD_freeDStream(strm);
-	return ret;
+	return 0;
 #endif
 }
 
@@ -235,6 +304,113 @@ static int decompress(struct btrfs_root *root, char *inbuf, char *outbuf,
 	return -1;
 }
 
+/* Leaves read ahead of the one walked by next_leaf() */
+#define RESTORE_READA_LEAVES	(16)
+
+/*
+ * Read ahead the leaves following the current one in its parent node, also
+ * when they're far apart on the disk.  The blocks read ahead before are found
+ * in the page cache, and the cached ones are skipped.
+ */
+static void readahead_leaf_window(struct btrfs_fs_info *fs_info,
+				  struct btrfs_path *path)
+{
+	struct extent_buffer *node = path->nodes[1];
+	int slot;
+	int nritems;
+	int i;
+
+	if (!node)
+		return;
+	slot = path->slots[1];
+	nritems = btrfs_header_nritems(node);
+	for (i = slot + 1; i <= slot + RESTORE_READA_LEAVES && i < nritems; i++)
+		readahead_tree_block(fs_info, btrfs_node_blockptr(node, i),
+				     btrfs_node_ptr_generation(node, i));
+	/* The next node, entered after the last leaf */
+	if (slot == 0 && path->nodes[2] &&
+	    path->slots[2] + 1 < btrfs_header_nritems(path->nodes[2]))
+		readahead_tree_block(fs_info,
+			btrfs_node_blockptr(path->nodes[2], path->slots[2] + 1),
+			btrfs_node_ptr_generation(path->nodes[2],
+						  path->slots[2] + 1));
+}
+
+/*
+ * Read ahead the leaf with @key, the nodes on the way are read.  Return the
+ * leaf address, it's not read again if it's @last.
+ */
+static u64 readahead_key_leaf(struct btrfs_root *root,
+			      const struct btrfs_key *key, u64 last)
+{
+	struct extent_buffer *eb = root->node;
+	struct extent_buffer *next;
+	u64 bytenr;
+	int slot;
+	int ret;
+
+	if (btrfs_header_level(eb) == 0)
+		return last;
+	extent_buffer_get(eb);
+	while (true) {
+		ret = btrfs_bin_search(eb, 0, key, &slot);
+		if (ret && slot > 0)
+			slot--;
+		if (btrfs_header_level(eb) == 1)
+			break;
+		next = btrfs_read_node_slot(eb, slot);
+		free_extent_buffer(eb);
+		if (!extent_buffer_uptodate(next)) {
+			free_extent_buffer(next);
+			return last;
+		}
+		eb = next;
+	}
+	bytenr = btrfs_node_blockptr(eb, slot);
+	if (bytenr != last)
+		readahead_tree_block(root->fs_info, bytenr,
+				     btrfs_node_ptr_generation(eb, slot));
+	free_extent_buffer(eb);
+	return bytenr;
+}
+
+/*
+ * Read ahead the leaves with the inode and extent items of the files, and the
+ * entries of the directories, listed in @leaf from @slot on.
+ */
+static void readahead_dir_entries(struct btrfs_root *root,
+				  struct extent_buffer *leaf, int slot,
+				  u64 dir_ino)
+{
+	struct btrfs_dir_item *dir_item;
+	struct btrfs_key found_key;
+	struct btrfs_key location;
+	u64 last = 0;
+	int nritems = btrfs_header_nritems(leaf);
+
+	for (; slot < nritems; slot++) {
+		btrfs_item_key_to_cpu(leaf, &found_key, slot);
+		if (found_key.objectid != dir_ino ||
+		    found_key.type != BTRFS_DIR_INDEX_KEY)
+			break;
+		dir_item = btrfs_item_ptr(leaf, slot, struct btrfs_dir_item);
+		btrfs_dir_item_key_to_cpu(leaf, dir_item, &location);
+		if (location.type != BTRFS_INODE_ITEM_KEY)
+			continue;
+		switch (btrfs_dir_ftype(leaf, dir_item)) {
+		case BTRFS_FT_REG_FILE:
+			last = readahead_key_leaf(root, &location, last);
+			location.type = BTRFS_EXTENT_DATA_KEY;
+			last = readahead_key_leaf(root, &location, last);
+			break;
+		case BTRFS_FT_DIR:
+			location.type = BTRFS_DIR_INDEX_KEY;
+			last = readahead_key_leaf(root, &location, last);
+			break;
+		}
+	}
+}
+
 static int next_leaf(struct btrfs_root *root, struct btrfs_path *path)
 {
 	int slot;
@@ -286,58 +462,42 @@ again:
 		if (!extent_buffer_uptodate(next))
 			goto again;
 	}
+	if (path->reada)
+		readahead_leaf_window(root->fs_info, path);
 	return 0;
 }
 
-static int copy_one_inline(struct btrfs_root *root, int fd,
-				struct btrfs_path *path, u64 pos)
+/* Write the data of an inline extent, @buf is the content of the item */
+static int copy_inline_data(struct btrfs_root *root, int fd, char *buf,
+			    int inline_item_len, u64 ram_size, int compress,
+			    u64 pos)
 {
-	struct extent_buffer *leaf = path->nodes[0];
-	struct btrfs_file_extent_item *fi;
-	char buf[4096];
 	char *outbuf;
-	u64 ram_size;
 	ssize_t done;
-	unsigned long ptr;
 	int ret;
-	int len;
-	int inline_item_len;
-	int compress;
-
-	fi = btrfs_item_ptr(leaf, path->slots[0],
-			    struct btrfs_file_extent_item);
-	ptr = btrfs_file_extent_inline_start(fi);
-	len = btrfs_file_extent_ram_bytes(leaf, fi);
-	inline_item_len = btrfs_file_extent_inline_item_len(leaf, path->slots[0]);
-	read_extent_buffer(leaf, buf, ptr, inline_item_len);
 
-	compress = btrfs_file_extent_compression(leaf, fi);
 	if (compress == BTRFS_COMPRESS_NONE) {
-		done = pwrite(fd, buf, len, pos);
-		if (done < len) {
-			error("short inline write, wanted %d, did %zd: %m",
-					len, done);
+		done = pwrite(fd, buf, ram_size, pos);
+		if (done < (ssize_t)ram_size) {
+			error("short inline write, wanted %llu, did %zd: %m",
+					ram_size, done);
 			return -1;
 		}
 		return 0;
 	}
 
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
-	outbuf = calloc(1, ram_size);
-	if (!outbuf) {
-		error_msg(ERROR_MSG_MEMORY, NULL);
+	outbuf = restore_buffer(&restore_buffers.outbuf,
+				&restore_buffers.outbuf_size, ram_size);
+	if (!outbuf)
 		return -ENOMEM;
-	}
+	memset(outbuf, 0, ram_size);
 
 	ret = decompress(root, buf, outbuf, inline_item_len, &ram_size,
 			 compress);
-	if (ret) {
-		free(outbuf);
+	if (ret)
 		return ret;
-	}
 
 	done = pwrite(fd, outbuf, ram_size, pos);
-	free(outbuf);
 	if (done < ram_size) {
 		error("short compressed inline write, wanted %llu, did %zd: %m",
 				ram_size, done);
@@ -347,31 +507,199 @@ static int copy_one_inline(struct btrfs_root *root, int fd,
 	return 0;
 }
 
-static int copy_one_extent(struct btrfs_root *root, int fd,
-			   struct extent_buffer *leaf,
-			   struct btrfs_file_extent_item *fi, u64 pos)
+static int copy_one_inline(struct btrfs_root *root, int fd,
+				struct btrfs_path *path, u64 pos)
 {
-	char *inbuf, *outbuf = NULL;
-	ssize_t done, total = 0;
+	struct extent_buffer *leaf = path->nodes[0];
+	struct btrfs_file_extent_item *fi;
+	char buf[4096];
+	unsigned long ptr;
+	int inline_item_len;
+
+	fi = btrfs_item_ptr(leaf, path->slots[0],
+			    struct btrfs_file_extent_item);
+	ptr = btrfs_file_extent_inline_start(fi);
+	inline_item_len = btrfs_file_extent_inline_item_len(leaf, path->slots[0]);
+	read_extent_buffer(leaf, buf, ptr, inline_item_len);
+
+	return copy_inline_data(root, fd, buf, inline_item_len,
+				btrfs_file_extent_ram_bytes(leaf, fi),
+				btrfs_file_extent_compression(leaf, fi), pos);
+}
+
+/* A file extent item, the data is read from the disk by copy_extent_data() */
+struct restore_extent {
+	u64 pos;
 	u64 bytenr;
-	u64 ram_size;
 	u64 disk_size;
-	u64 num_bytes;
-	u64 length;
-	u64 size_left;
+	u64 ram_size;
 	u64 offset;
-	u64 cur;
+	u64 num_bytes;
 	int compress;
+	/* Content of the inline extent item, NULL for a regular extent */
+	char *inline_data;
+	int inline_len;
+};
+
+static void restore_extent_from_item(struct extent_buffer *leaf,
+				     struct btrfs_file_extent_item *fi,
+				     u64 pos, struct restore_extent *ext)
+{
+	memset(ext, 0, sizeof(*ext));
+	ext->pos = pos;
+	ext->compress = btrfs_file_extent_compression(leaf, fi);
+	ext->ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
+	/* The inline data starts where the disk location of a regular one is */
+	if (btrfs_file_extent_type(leaf, fi) == BTRFS_FILE_EXTENT_INLINE)
+		return;
+	ext->bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+	ext->disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
+	ext->offset = btrfs_file_extent_offset(leaf, fi);
+	ext->num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
+}
+
+/*
+ * Merge @next to @ext if both are uncompressed and adjacent in the file and on
+ * the disk, up to the read size, so they're read and written at once.
+ */
+static bool restore_extent_merge(struct restore_extent *ext,
+				 const struct restore_extent *next)
+{
+	if (ext->inline_data || next->inline_data)
+		return false;
+	if (ext->compress != BTRFS_COMPRESS_NONE ||
+	    next->compress != BTRFS_COMPRESS_NONE)
+		return false;
+	/* Holes and invalid extents are left to copy_extent_data() */
+	if (!ext->disk_size || ext->offset >= ext->disk_size ||
+	    ext->num_bytes > ext->disk_size - ext->offset)
+		return false;
+	if (!next->disk_size || next->offset >= next->disk_size ||
+	    next->num_bytes > next->disk_size - next->offset)
+		return false;
+	if (ext->pos + ext->num_bytes != next->pos ||
+	    ext->bytenr + ext->offset + ext->num_bytes != next->bytenr + next->offset)
+		return false;
+	if (ext->num_bytes + next->num_bytes > read_size)
+		return false;
+
+	/* The merged extent is exactly the referenced range */
+	ext->bytenr += ext->offset;
+	ext->offset = 0;
+	ext->num_bytes += next->num_bytes;
+	ext->disk_size = ext->num_bytes;
+	ext->ram_size = ext->num_bytes;
+	return true;
+}
+
+/*
+ * The mirror to read at @logical for the attempt @mirror_num, counted from the
+ * mirror picked by the read policy
+ */
+static int attempt_mirror(struct btrfs_fs_info *fs_info, u64 logical,
+			  int mirror_num, int num_copies)
+{
+	return (btrfs_read_mirror(fs_info, logical) + mirror_num - 2) %
+		num_copies + 1;
+}
+
+/* Read the range, switch to the next mirror in @mirror_num on errors */
+static int read_extent_range(struct btrfs_fs_info *fs_info, char *buf,
+			     u64 bytenr, u64 len, int *mirror_num,
+			     int num_copies)
+{
+	u64 cur = bytenr;
+
+	while (cur < bytenr + len) {
+		u64 length = bytenr + len - cur;
+		int ret;
+
+		ret = read_data_from_disk(fs_info, buf + cur - bytenr, cur,
+					  &length, attempt_mirror(fs_info, cur,
+						*mirror_num, num_copies));
+		if (ret < 0) {
+			(*mirror_num)++;
+			if (*mirror_num > num_copies) {
+				error("exhausted mirrors trying to read (%d > %d)",
+					*mirror_num, num_copies);
+				return -1;
+			}
+			pr_stderr(LOG_DEFAULT, "trying another mirror\n");
+			continue;
+		}
+		cur += length;
+	}
+	return 0;
+}
+
+/*
+ * Copy the range from the device to @fd by copy_file_range(), the blocks are
+ * cloned if the device is an image file on the same filesystem as the target.
+ * Return -EOPNOTSUPP if it's not possible for the devices or the target, then
+ * the data are read and written.
+ */
+static int reflink_extent_range(struct btrfs_fs_info *fs_info, int fd,
+				u64 bytenr, u64 len, u64 pos, int mirror_num,
+				int num_copies)
+{
+	u64 cur = 0;
+
+	if (fs_info->zoned)
+		return -EOPNOTSUPP;
+	while (cur < len) {
+		struct btrfs_bio_stripe stripe;
+		u64 length = len - cur;
+		u64 type;
+		loff_t in_off;
+		loff_t out_off = pos + cur;
+		ssize_t done;
+		int ret;
+
+		ret = btrfs_map_block_stripe(fs_info, bytenr + cur, &length,
+					     &type, attempt_mirror(fs_info,
+						bytenr + cur, mirror_num,
+						num_copies), &stripe);
+		if (ret)
+			return -EIO;
+		if (type & BTRFS_BLOCK_GROUP_RAID56_MASK || stripe.dev->fd <= 0)
+			return -EOPNOTSUPP;
+		length = min(length, len - cur);
+		in_off = stripe.physical;
+		done = copy_file_range(stripe.dev->fd, &in_off, fd, &out_off,
+				       length, 0);
+		if (done < 0) {
+			if (errno == EXDEV || errno == EINVAL ||
+			    errno == EOPNOTSUPP || errno == ENOSYS)
+				return -EOPNOTSUPP;
+			return -errno;
+		}
+		if (done == 0)
+			return -EIO;
+		btrfs_device_account_read(stripe.dev, done);
+		cur += done;
+	}
+	return 0;
+}
+
+static int copy_extent_data(struct btrfs_root *root, int fd,
+			    const struct restore_extent *ext)
+{
+	struct restore_buffers *bufs = &restore_buffers;
+	char *inbuf, *outbuf;
+	ssize_t done;
+	u64 total = 0;
+	const u64 pos = ext->pos;
+	const u64 disk_size = ext->disk_size;
+	const u64 num_bytes = ext->num_bytes;
+	const u64 offset = ext->offset;
+	const int compress = ext->compress;
+	u64 bytenr = ext->bytenr;
+	u64 ram_size;
+	u64 size_left;
 	int ret;
 	int mirror_num = 1;
 	int num_copies;
 
-	compress = btrfs_file_extent_compression(leaf, fi);
-	bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
-	disk_size = btrfs_file_extent_disk_num_bytes(leaf, fi);
-	ram_size = btrfs_file_extent_ram_bytes(leaf, fi);
-	offset = btrfs_file_extent_offset(leaf, fi);
-	num_bytes = btrfs_file_extent_num_bytes(leaf, fi);
 	size_left = disk_size;
 	/* Hole, early exit */
 	if (disk_size == 0)
@@ -379,10 +707,10 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 
 	/* Invalid file extent */
 	if ((compress == BTRFS_COMPRESS_NONE && offset >= disk_size) ||
-	    offset > ram_size) {
+	    offset > ext->ram_size) {
 		error(
 	"invalid data extent offset, offset %llu disk_size %llu ram_size %llu",
-		      offset, disk_size, ram_size);
+		      offset, disk_size, ext->ram_size);
 		return -EUCLEAN;
 	}
 
@@ -393,64 +721,69 @@ static int copy_one_extent(struct btrfs_root *root, int fd,
 
 	pr_verbose(offset ? 1 : 0, "offset is %llu\n", offset);
 
-	inbuf = malloc(size_left);
-	if (!inbuf) {
-		error_msg(ERROR_MSG_MEMORY, NULL);
-		return -ENOMEM;
-	}
-
-	if (compress != BTRFS_COMPRESS_NONE) {
-		outbuf = calloc(1, ram_size);
-		if (!outbuf) {
-			error_msg(ERROR_MSG_MEMORY, NULL);
-			free(inbuf);
-			return -ENOMEM;
-		}
-	}
-
 	num_copies = btrfs_num_copies(root->fs_info, bytenr, disk_size - offset);
-again:
-	cur = bytenr;
-	while (cur < bytenr + size_left) {
-		length = bytenr + size_left - cur;
-		ret = read_data_from_disk(root->fs_info, inbuf + cur - bytenr, cur,
-					  &length, mirror_num);
-		if (ret < 0) {
-			mirror_num++;
-			if (mirror_num > num_copies) {
-				ret = -1;
-				error("exhausted mirrors trying to read (%d > %d)",
-					mirror_num, num_copies);
-				goto out;
-			}
-			pr_stderr(LOG_DEFAULT, "trying another mirror\n");
-			continue;
-		}
-		cur += length;
-	}
 
+	/* Only the referenced part, in pieces of the read size */
 	if (compress == BTRFS_COMPRESS_NONE) {
 		while (total < num_bytes) {
-			done = pwrite(fd, inbuf+total, num_bytes-total,
-				      pos+total);
-			if (done < 0) {
-				ret = -1;
-				error("cannot write data: %d %m", errno);
-				goto out;
+			u64 len = min(num_bytes - total, read_size);
+			u64 written = 0;
+
+			if (__atomic_load_n(&reflink, __ATOMIC_RELAXED)) {
+				ret = reflink_extent_range(root->fs_info, fd,
+						bytenr + total, len, pos + total,
+						mirror_num, num_copies);
+				if (ret == 0) {
+					total += len;
+					continue;
+				}
+				/* Read the piece again, also other mirrors */
+				if (ret == -EOPNOTSUPP)
+					__atomic_store_n(&reflink, false,
+							 __ATOMIC_RELAXED);
 			}
-			total += done;
+			inbuf = restore_buffer(&bufs->inbuf, &bufs->inbuf_size, len);
+			if (!inbuf)
+				return -ENOMEM;
+			ret = read_extent_range(root->fs_info, inbuf,
+						bytenr + total, len,
+						&mirror_num, num_copies);
+			if (ret)
+				return ret;
+			while (written < len) {
+				done = pwrite(fd, inbuf + written, len - written,
+					      pos + total + written);
+				if (done < 0) {
+					error("cannot write data: %d %m", errno);
+					return -1;
+				}
+				written += done;
+			}
+			total += len;
 		}
-		ret = 0;
-		goto out;
+		return 0;
 	}
 
+	inbuf = restore_buffer(&bufs->inbuf, &bufs->inbuf_size, size_left);
+	if (!inbuf)
+		return -ENOMEM;
+	outbuf = restore_buffer(&bufs->outbuf, &bufs->outbuf_size, ext->ram_size);
+	if (!outbuf)
+		return -ENOMEM;
+
+again:
+	ret = read_extent_range(root->fs_info, inbuf, bytenr, size_left,
+				&mirror_num, num_copies);
+	if (ret)
+		return ret;
+
+	ram_size = ext->ram_size;
+	memset(outbuf, 0, ram_size);
 	ret = decompress(root, inbuf, outbuf, disk_size, &ram_size, compress);
 	if (ret) {
 		mirror_num++;
-		if (mirror_num > num_copies) {
-			ret = -1;
-			goto out;
-		}
+		if (mirror_num > num_copies)
+			return -1;
 		pr_stderr(LOG_DEFAULT,
 			"trying another mirror due to decompression error\n");
 		goto again;
@@ -460,20 +793,81 @@ again:
 		done = pwrite(fd, outbuf + offset + total,
 			      num_bytes - total,
 			      pos + total);
-		if (done < 0) {
-			ret = -1;
-			goto out;
-		}
+		if (done < 0)
+			return -1;
 		total += done;
 	}
-out:
-	free(inbuf);
-	free(outbuf);
+	return 0;
+}
+
+/*
+ * Add the extent to @pending if it can be merged, otherwise copy the pending
+ * extent and keep this one.  The caller copies the last one, the pending
+ * extent is empty if num_bytes is 0.
+ */
+static int copy_one_extent(struct btrfs_root *root, int fd,
+			   struct extent_buffer *leaf,
+			   struct btrfs_file_extent_item *fi, u64 pos,
+			   struct restore_extent *pending)
+{
+	struct restore_extent ext;
+	int ret = 0;
+
+	restore_extent_from_item(leaf, fi, pos, &ext);
+	if (pending->num_bytes && restore_extent_merge(pending, &ext))
+		return 0;
+	if (pending->num_bytes)
+		ret = copy_extent_data(root, fd, pending);
+	*pending = ext;
+	if (ret)
+		pending->num_bytes = 0;
 	return ret;
 }
 
+static int copy_pending_extent(struct btrfs_root *root, int fd,
+			       struct restore_extent *pending)
+{
+	int ret = 0;
+
+	if (pending->num_bytes)
+		ret = copy_extent_data(root, fd, pending);
+	pending->num_bytes = 0;
+	return ret;
+}
+
+struct restore_xattr {
+	struct list_head list;
+	char *name;
+	char *data;
+	u32 len;
+};
+
+/* Remember the xattr to be set by the thread finishing the file */
+static int queue_xattr(struct list_head *xattrs, const char *name,
+		       const char *data, u32 len)
+{
+	struct restore_xattr *xattr;
+	size_t name_len = strlen(name);
+
+	xattr = malloc(sizeof(*xattr) + name_len + 1 + len);
+	if (!xattr)
+		return -ENOMEM;
+	xattr->name = (char *)(xattr + 1);
+	xattr->data = xattr->name + name_len + 1;
+	xattr->len = len;
+	memcpy(xattr->name, name, name_len + 1);
+	memcpy(xattr->data, data, len);
+	list_add_tail(&xattr->list, xattrs);
+	return 0;
+}
+
+/*
+ * Set the xattrs of @inode on @fd, or add them to the list @queue to be set
+ * later if it's not NULL.
+ */
 static int set_file_xattrs(struct btrfs_root *root, u64 inode,
-			   int fd, const char *file_name)
+			   int fd, const char *file_name,
+			   struct list_head *queue)
 {
 	struct btrfs_key key;
 	struct btrfs_path path = { 0 };
@@ -490,6 +884,7 @@ static int set_file_xattrs(struct btrfs_root *root, u64 inode,
 	key.objectid = inode;
 	key.type = BTRFS_XATTR_ITEM_KEY;
 	key.offset = 0;
+	path.reada = READA_FORWARD;
 	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
 	if (ret < 0)
 		goto out;
@@ -550,9 +945,14 @@ static int set_file_xattrs(struct btrfs_root *root, u64 inode,
 					   len);
 			data_len = len;
 
-			if (fsetxattr(fd, name, data, data_len, 0))
+			if (queue) {
+				ret = queue_xattr(queue, name, data, data_len);
+				if (ret < 0)
+					goto out;
+			} else if (fsetxattr(fd, name, data, data_len, 0)) {
 				error("setting extended attribute %s on file %s: %m",
 					name, file_name);
+			}
 
 			len = sizeof(*di) + name_len + data_len;
 			cur += len;
@@ -616,8 +1016,365 @@ out:
 	return ret;
 }
 
+/* A file restored by the threads, finished by the last one done with it */
+struct restore_file {
+	struct btrfs_root *root;
+	int fd;
+	char *path;
+	u64 size;
+	bool times_ok;
+	struct timespec times[2];
+	struct list_head xattrs;
+	/* The work being filled by copy_file() */
+	struct restore_work *work;
+	/* The queued works, and one for copy_file() */
+	int refs;
+	/* Failed in copy_file(), reported by search_dir() */
+	bool walk_failed;
+	/* First error of the works */
+	int ret;
+};
+
+struct restore_work {
+	struct list_head list;
+	struct restore_file *file;
+	u32 nr;
+	u64 bytes;
+	struct restore_extent extents[RESTORE_WORK_EXTENTS];
+};
+
+/*
+ * The directories are walked and the files created and queued by the main
+ * thread, the threads read the extents, decompress and write them. The last
+ * thread done with a file sets its size, xattrs and times and closes it.
+ */
+struct restore_pool {
+	pthread_mutex_t mutex;
+	/* Signaled when a work is queued or the threads stop */
+	pthread_cond_t queued_cond;
+	/* Signaled when a work is done */
+	pthread_cond_t done_cond;
+	struct list_head works;
+	unsigned int nr_queued;
+	unsigned int nr_running;
+	unsigned int max_queued;
+	bool stop;
+	/* First error not ignored by -i */
+	int ret;
+
+	pthread_t *threads;
+	unsigned int nr_threads;
+};
+
+static struct restore_file *restore_file_alloc(struct btrfs_root *root, int fd,
+					       const char *path)
+{
+	struct restore_file *file;
+
+	file = calloc(1, sizeof(*file));
+	if (!file)
+		return NULL;
+	file->path = strdup(path);
+	if (!file->path) {
+		free(file);
+		return NULL;
+	}
+	file->root = root;
+	file->fd = fd;
+	file->refs = 1;
+	INIT_LIST_HEAD(&file->xattrs);
+	return file;
+}
+
+static void restore_file_finish(struct restore_pool *pool,
+				struct restore_file *file)
+{
+	int ret = file->ret;
+
+	if (!ret && !file->walk_failed) {
+		struct restore_xattr *xattr;
+
+		if (file->size && ftruncate(file->fd, (loff_t)file->size))
+			ret = -errno;
+		list_for_each_entry(xattr, &file->xattrs, list) {
+			if (fsetxattr(file->fd, xattr->name, xattr->data,
+				      xattr->len, 0))
+				error("setting extended attribute %s on file %s: %m",
+				      xattr->name, file->path);
+		}
+		if (!ret && file->times_ok && futimens(file->fd, file->times))
+			ret = -errno;
+	}
+	if (ret) {
+		error("copying data for %s failed", file->path);
+		if (!ignore_errors) {
+			pthread_mutex_lock(&pool->mutex);
+			if (!pool->ret)
+				pool->ret = ret;
+			pthread_mutex_unlock(&pool->mutex);
+		}
+	}
+	close(file->fd);
+	while (!list_empty(&file->xattrs)) {
+		struct restore_xattr *xattr;
+
+		xattr = list_first_entry(&file->xattrs, struct restore_xattr, list);
+		list_del(&xattr->list);
+		free(xattr);
+	}
+	free(file->path);
+	free(file);
+}
+
+static void restore_file_put(struct restore_pool *pool,
+			     struct restore_file *file)
+{
+	bool last;
+
+	pthread_mutex_lock(&pool->mutex);
+	last = (--file->refs == 0);
+	pthread_mutex_unlock(&pool->mutex);
+	if (last)
+		restore_file_finish(pool, file);
+}
+
+static void restore_work_process(struct restore_work *work)
+{
+	struct restore_file *file = work->file;
+
+	for (u32 i = 0; i < work->nr; i++) {
+		struct restore_extent *ext = &work->extents[i];
+		int ret;
+
+		/* A failed file is left as it is, like without the threads */
+		if (__atomic_load_n(&file->ret, __ATOMIC_RELAXED))
+			ret = 0;
+		else if (ext->inline_data)
+			ret = copy_inline_data(file->root, file->fd,
+					       ext->inline_data, ext->inline_len,
+					       ext->ram_size, ext->compress,
+					       ext->pos);
+		else
+			ret = copy_extent_data(file->root, file->fd, ext);
+		if (ret)
+			__atomic_store_n(&file->ret, ret, __ATOMIC_RELAXED);
+		free(ext->inline_data);
+	}
+}
+
+static void *restore_worker(void *arg)
+{
+	struct restore_pool *pool = arg;
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		struct restore_work *work;
+
+		while (list_empty(&pool->works) && !pool->stop)
+			pthread_cond_wait(&pool->queued_cond, &pool->mutex);
+		if (list_empty(&pool->works))
+			break;
+		work = list_first_entry(&pool->works, struct restore_work, list);
+		list_del(&work->list);
+		pool->nr_queued--;
+		pool->nr_running++;
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->mutex);
+
+		restore_work_process(work);
+		restore_file_put(pool, work->file);
+		free(work);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->nr_running--;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	restore_buffers_free();
+	return NULL;
+}
+
+/* Pass the work being filled to the threads, wait while too many are queued */
+static void restore_queue_work(struct restore_pool *pool,
+			       struct restore_file *file)
+{
+	struct restore_work *work = file->work;
+
+	if (!work)
+		return;
+	file->work = NULL;
+	pthread_mutex_lock(&pool->mutex);
+	while (pool->nr_queued >= pool->max_queued)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+	file->refs++;
+	list_add_tail(&work->list, &pool->works);
+	pool->nr_queued++;
+	pthread_cond_signal(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Add the extent item at @path to the work of @file */
+static int restore_queue_extent(struct restore_pool *pool,
+				struct restore_file *file,
+				struct btrfs_path *path, u64 pos, bool is_inline)
+{
+	struct extent_buffer *leaf = path->nodes[0];
+	struct btrfs_file_extent_item *fi;
+	struct restore_extent *ext;
+	struct restore_work *work = file->work;
+
+	if (!work) {
+		work = malloc(sizeof(*work));
+		if (!work) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+		work->file = file;
+		work->nr = 0;
+		work->bytes = 0;
+		file->work = work;
+	}
+	fi = btrfs_item_ptr(leaf, path->slots[0], struct btrfs_file_extent_item);
+	ext = &work->extents[work->nr];
+	restore_extent_from_item(leaf, fi, pos, ext);
+	if (!is_inline && work->nr > 0) {
+		struct restore_extent *prev = &work->extents[work->nr - 1];
+		u64 prev_size = prev->disk_size;
+
+		if (restore_extent_merge(prev, ext)) {
+			work->bytes += prev->disk_size - prev_size;
+			goto check_full;
+		}
+	}
+	if (is_inline) {
+		ext->inline_len = btrfs_file_extent_inline_item_len(leaf,
+								    path->slots[0]);
+		ext->inline_data = malloc(ext->inline_len);
+		if (!ext->inline_data) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return -ENOMEM;
+		}
+		read_extent_buffer(leaf, ext->inline_data,
+				   btrfs_file_extent_inline_start(fi),
+				   ext->inline_len);
+	} else {
+		work->bytes += ext->disk_size;
+	}
+	work->nr++;
+check_full:
+	if (work->nr == RESTORE_WORK_EXTENTS || work->bytes >= RESTORE_WORK_BYTES)
+		restore_queue_work(pool, file);
+	return 0;
+}
+
+/* Return the first error of the threads, search_dir() stops on it */
+static int restore_pool_error(struct restore_pool *pool)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->mutex);
+	ret = pool->ret;
+	pthread_mutex_unlock(&pool->mutex);
+	return ret;
+}
+
+static struct restore_pool *restore_pool_start(unsigned int nr_threads)
+{
+	struct restore_pool *pool;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->queued_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	INIT_LIST_HEAD(&pool->works);
+	pool->max_queued = nr_threads * 4;
+	for (; pool->nr_threads < nr_threads; pool->nr_threads++) {
+		int ret;
+
+		ret = pthread_create(&pool->threads[pool->nr_threads], NULL,
+				     restore_worker, pool);
+		if (ret) {
+			errno = ret;
+			error("failed to start thread: %m");
+			break;
+		}
+	}
+	if (!pool->nr_threads) {
+		free(pool->threads);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+/* Finish all the queued works, return the first error */
+static int restore_pool_stop(struct restore_pool *pool)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	ret = pool->ret;
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->queued_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+	return ret;
+}
+
+/*
+ * Copy the data of the inode @key to @fd, or queue it to the threads of
+ * restore_pool in @rfile if it's not NULL.
+ */
+/* Ignore the filesystems of the target not supporting the mode */
+static int restore_fallocate(int fd, int mode, u64 start, u64 len)
+{
+	int ret;
+
+	if (!len)
+		return 0;
+	ret = fallocate(fd, mode, start, len);
+	if (ret < 0 && (errno == EOPNOTSUPP || errno == ENOSYS))
+		return 0;
+	if (ret < 0) {
+		ret = -errno;
+		error("fallocate of %llu bytes at %llu failed: %m", len, start);
+	}
+	return ret;
+}
+
+/*
+ * Whether the range of the target file was written by an interrupted restore.
+ * A partially written extent ends with a hole, it's copied again.  Without
+ * SEEK_HOLE support only the size of the file tells.
+ */
+static bool restore_range_present(int fd, u64 start, u64 end, u64 size)
+{
+	off_t hole;
+
+	/* The last extent may end past the size, up to the sector */
+	if (size)
+		end = min(end, size);
+	if (start >= end)
+		return true;
+	hole = lseek(fd, start, SEEK_HOLE);
+	return hole >= 0 && hole >= end;
+}
+
 static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
-		     const char *file)
+		     const char *file, struct restore_file *rfile)
 {
 	struct extent_buffer *leaf;
 	struct btrfs_path path = { 0 };
@@ -625,10 +1382,16 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 	struct btrfs_inode_item *inode_item;
 	struct btrfs_timespec *bts;
 	struct btrfs_key found_key;
+	struct restore_extent pending = { 0 };
+	struct stat st;
 	int ret;
 	int extent_type;
 	int compression;
 	u64 found_size = 0;
+	/* End of the data written so far, the gaps before the extents are holes */
+	u64 data_end = 0;
+	u64 extent_end;
+	bool punch_holes;
 	struct timespec times[2];
 	bool times_ok = false;
 
@@ -665,9 +1428,26 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 	}
 	btrfs_release_path(&path);
 
+	/*
+	 * The holes of a new file are left unwritten, an overwritten one or
+	 * the preallocated space needs them punched.
+	 */
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		error("cannot stat '%s': %m", file);
+		return ret;
+	}
+	punch_holes = preallocate || st.st_size > 0;
+	if (preallocate) {
+		ret = restore_fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, found_size);
+		if (ret)
+			return ret;
+	}
+
 	key->offset = 0;
 	key->type = BTRFS_EXTENT_DATA_KEY;
 
+	path.reada = READA_FORWARD;
 	ret = btrfs_search_slot(NULL, root, key, &path, 0, 0);
 	if (ret < 0) {
 		error("searching extent data returned %d", ret);
@@ -720,15 +1500,63 @@ static int copy_file(struct btrfs_root *root, int fd, struct btrfs_key *key,
 			goto out;
 		}
 
-		if (extent_type == BTRFS_FILE_EXTENT_PREALLOC)
-			goto next;
 		if (extent_type == BTRFS_FILE_EXTENT_INLINE) {
+			extent_end = found_key.offset +
+				     btrfs_file_extent_ram_bytes(leaf, fi);
+		} else {
+			extent_end = found_key.offset +
+				     btrfs_file_extent_num_bytes(leaf, fi);
+			/* Explicit holes are punched with the implicit ones */
+			if (btrfs_file_extent_disk_bytenr(leaf, fi) == 0)
+				goto next;
+		}
+		if (punch_holes && found_key.offset > data_end) {
+			ret = restore_fallocate(fd,
+					FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					data_end, found_key.offset - data_end);
+			if (ret)
+				goto out;
+		}
+		data_end = max(data_end, extent_end);
+
+		/* Allocated but unwritten, reads as zeros */
+		if (extent_type == BTRFS_FILE_EXTENT_PREALLOC) {
+			if (punch_holes) {
+				ret = restore_fallocate(fd,
+					FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					found_key.offset,
+					extent_end - found_key.offset);
+				if (ret)
+					goto out;
+			}
+			ret = restore_fallocate(fd, FALLOC_FL_KEEP_SIZE,
+						found_key.offset,
+						extent_end - found_key.offset);
+			if (ret)
+				goto out;
+			goto next;
+		}
+		if (resume && extent_type == BTRFS_FILE_EXTENT_REG &&
+		    restore_range_present(fd, found_key.offset, extent_end,
+					  found_size))
+			goto next;
+		if (rfile && (extent_type == BTRFS_FILE_EXTENT_INLINE ||
+			      extent_type == BTRFS_FILE_EXTENT_REG)) {
+			ret = restore_queue_extent(restore_pool, rfile, &path,
+					found_key.offset,
+					extent_type == BTRFS_FILE_EXTENT_INLINE);
+			if (ret)
+				goto out;
+		} else if (extent_type == BTRFS_FILE_EXTENT_INLINE) {
+			ret = copy_pending_extent(root, fd, &pending);
+			if (ret)
+				goto out;
 			ret = copy_one_inline(root, fd, &path, found_key.offset);
 			if (ret)
 				goto out;
 		} else if (extent_type == BTRFS_FILE_EXTENT_REG) {
 			ret = copy_one_extent(root, fd, leaf, fi,
-					      found_key.offset);
+					      found_key.offset, &pending);
 			if (ret)
 				goto out;
 		} else {
@@ -740,13 +1568,37 @@ next:
 
 	btrfs_release_path(&path);
 set_size:
+	ret = copy_pending_extent(root, fd, &pending);
+	if (ret)
+		return ret;
+	if (punch_holes && found_size > data_end) {
+		ret = restore_fallocate(fd,
+				FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				data_end, found_size - data_end);
+		if (ret)
+			return ret;
+	}
+	if (rfile) {
+		/* The rest is done by the thread finishing the file */
+		restore_queue_work(restore_pool, rfile);
+		rfile->size = found_size;
+		if (times_ok) {
+			rfile->times_ok = true;
+			rfile->times[0] = times[0];
+			rfile->times[1] = times[1];
+		}
+		if (get_xattrs)
+			return set_file_xattrs(root, key->objectid, fd, file,
+					       &rfile->xattrs);
+		return 0;
+	}
 	if (found_size) {
 		ret = ftruncate(fd, (loff_t)found_size);
 		if (ret)
 			return ret;
 	}
 	if (get_xattrs) {
-		ret = set_file_xattrs(root, key->objectid, fd, file);
+		ret = set_file_xattrs(root, key->objectid, fd, file, NULL);
 		if (ret)
 			return ret;
 	}
@@ -759,6 +1611,11 @@ set_size:
 
 out:
 	btrfs_release_path(&path);
+	/* The extents before the failure are written like without the threads */
+	if (rfile)
+		restore_queue_work(restore_pool, rfile);
+	else
+		copy_pending_extent(root, fd, &pending);
 	return ret;
 }
 
@@ -780,6 +1637,9 @@ static int overwrite_ok(const char * path)
 	if (!ret) {
 		if (overwrite)
 			return 2;
+		/* Continue the files, the symlinks are complete */
+		if (resume && S_ISREG(st.st_mode))
+			return 2;
 
 		if (!warn) {
 			pr_verbose(LOG_DEFAULT, "Skipping existing file %s\n", path);
@@ -918,17 +1778,21 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 	char filename[BTRFS_NAME_LEN + 1];
 	unsigned long name_ptr;
 	int name_len;
+	/* The leaf whose entries were read ahead */
+	struct extent_buffer *reada_leaf = NULL;
 	int ret = 0;
 	int fd;
 	u8 type;
 
 	key->offset = 0;
 	key->type = BTRFS_DIR_INDEX_KEY;
+	path.reada = READA_FORWARD;
 	ret = btrfs_search_slot(NULL, root, key, &path, 0, 0);
 	if (ret < 0) {
 		error("search for next directory entry failed: %d", ret);
 		goto out;
 	}
+	readahead_leaf_window(root->fs_info, &path);
 
 	ret = 0;
 
@@ -968,6 +1832,11 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 			} while (!leaf);
 			continue;
 		}
+		if (leaf != reada_leaf) {
+			readahead_dir_entries(root, leaf, path.slots[0],
+					      key->objectid);
+			reada_leaf = leaf;
+		}
 		btrfs_item_key_to_cpu(leaf, &found_key, path.slots[0]);
 		if (found_key.objectid != key->objectid) {
 			pr_verbose(LOG_VERBOSE, "Found objectid=%llu, key=%llu\n",
@@ -1001,6 +1870,10 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 		 * Restore directories, files, symlinks and metadata.
 		 */
 		if (type == BTRFS_FT_REG_FILE) {
+			if (restore_pool && restore_pool_error(restore_pool)) {
+				ret = -1;
+				goto out;
+			}
 			if (!overwrite_ok(path_name))
 				goto next;
 
@@ -1015,8 +1888,26 @@ static int search_dir(struct btrfs_root *root, struct btrfs_key *key,
 				ret = -1;
 				goto out;
 			}
-			ret = copy_file(root, fd, &location, path_name);
-			close(fd);
+			if (restore_pool) {
+				struct restore_file *rfile;
+
+				rfile = restore_file_alloc(root, fd, path_name);
+				if (!rfile) {
+					close(fd);
+					error_msg(ERROR_MSG_MEMORY, NULL);
+					ret = -ENOMEM;
+					goto out;
+				}
+				ret = copy_file(root, fd, &location, path_name,
+						rfile);
+				if (ret)
+					rfile->walk_failed = true;
+				restore_file_put(restore_pool, rfile);
+			} else {
+				ret = copy_file(root, fd, &location, path_name,
+						NULL);
+				close(fd);
+			}
 			if (ret) {
 				error("copying data for %s failed", path_name);
 				if (ignore_errors)
@@ -1134,7 +2025,8 @@ next:
 
 			/* Also set xattrs on the directory. */
 			if (get_xattrs) {
-				ret = set_file_xattrs(root, key->objectid, fd, path_name);
+				ret = set_file_xattrs(root, key->objectid, fd, path_name,
+						      NULL);
 				if (ret) {
 					error("failed to set xattrs on %s: %m", path_name);
 				}
@@ -1168,6 +2060,7 @@ static int do_list_roots(struct btrfs_root *root)
 	key.objectid = 0;
 	key.type = BTRFS_ROOT_ITEM_KEY;
 	key.offset = 0;
+	path.reada = READA_FORWARD;
 	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
 	if (ret < 0) {
 		error("failed search next root item: %d", ret);
@@ -1294,6 +2187,7 @@ static int find_first_dir(struct btrfs_root *root, u64 *objectid)
 	key.objectid = 0;
 	key.type = BTRFS_DIR_INDEX_KEY;
 	key.offset = 0;
+	path.reada = READA_FORWARD;
 	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
 	if (ret < 0) {
 		error("searching next directory entry failed: %d", ret);
@@ -1344,6 +2238,18 @@ static const char * const cmd_restore_usage[] = {
 	OPTLINE("-D|--dry-run", "dry run (only list files that would be recovered)"),
 	OPTLINE("-i|--ignore-errors", "ignore errors"),
 	OPTLINE("-o|--overwrite", "overwrite"),
+	OPTLINE("--threads <N>", "number of threads reading and writing the "
+		"file data (0 ~ 64), default is 0, the data is copied by the "
+		"thread walking the directories"),
+	OPTLINE("--read-size <size>", "read at most size of the file data at "
+		"once, adjacent extents are read together up to it (64K ~ 1G), "
+		"default is 4M"),
+	OPTLINE("--preallocate", "allocate the whole size of the files before "
+		"writing the data, the holes are punched"),
+	OPTLINE("--reflink", "copy the uncompressed data by copy_file_range(), "
+		"cloned if the image file is on the target filesystem"),
+	OPTLINE("--resume", "continue an interrupted restore, the extents "
+		"already written to the existing files are not read again"),
 	"",
 	"Restoration:",
 	OPTLINE("-m|--metadata", "restore owner, mode and times"),
@@ -1400,11 +2306,19 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 	int match_cflags = REG_EXTENDED | REG_NOSUB | REG_NEWLINE;
 	regex_t match_reg, *mreg = NULL;
 	char reg_err[256];
+	u64 nr_threads = 0;
 
 	optind = 0;
 	while (1) {
 		int opt;
-		enum { GETOPT_VAL_PATH_REGEX = GETOPT_VAL_FIRST };
+		enum {
+			GETOPT_VAL_PATH_REGEX = GETOPT_VAL_FIRST,
+			GETOPT_VAL_THREADS,
+			GETOPT_VAL_READ_SIZE,
+			GETOPT_VAL_PREALLOCATE,
+			GETOPT_VAL_REFLINK,
+			GETOPT_VAL_RESUME,
+		};
 		static const struct option long_options[] = {
 			{ "path-regex", required_argument, NULL,
 				GETOPT_VAL_PATH_REGEX },
@@ -1419,6 +2333,13 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "super", required_argument, NULL, 'u'},
 			{ "root", required_argument, NULL, 'r'},
 			{ "list-roots", no_argument, NULL, 'l'},
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "read-size", required_argument, NULL,
+				GETOPT_VAL_READ_SIZE },
+			{ "preallocate", no_argument, NULL,
+				GETOPT_VAL_PREALLOCATE },
+			{ "reflink", no_argument, NULL, GETOPT_VAL_REFLINK },
+			{ "resume", no_argument, NULL, GETOPT_VAL_RESUME },
 			{ NULL, 0, NULL, 0}
 		};
 
@@ -1486,6 +2407,21 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 			case 'x':
 				get_xattrs = 1;
 				break;
+			case GETOPT_VAL_THREADS:
+				nr_threads = arg_strtou64(optarg);
+				break;
+			case GETOPT_VAL_READ_SIZE:
+				read_size = arg_strtou64_with_suffix(optarg);
+				break;
+			case GETOPT_VAL_PREALLOCATE:
+				preallocate = true;
+				break;
+			case GETOPT_VAL_REFLINK:
+				reflink = true;
+				break;
+			case GETOPT_VAL_RESUME:
+				resume = true;
+				break;
 			default:
 				usage_unknown_option(cmd, argv);
 		}
@@ -1501,6 +2437,17 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 		return 1;
 	}
 
+	if (nr_threads > RESTORE_MAX_THREADS) {
+		error("number of threads out of range: %llu > %d",
+		      nr_threads, RESTORE_MAX_THREADS);
+		return 1;
+	}
+	if (read_size < RESTORE_MIN_READ_SIZE || read_size > RESTORE_MAX_READ_SIZE) {
+		error("read size out of range: %llu, must be between %u and %u",
+		      read_size, RESTORE_MIN_READ_SIZE, RESTORE_MAX_READ_SIZE);
+		return 1;
+	}
+
 	if ((ret = check_mounted(argv[optind])) < 0) {
 		errno = -ret;
 		error("could not check mount status: %m");
@@ -1582,11 +2529,30 @@ static int cmd_restore(const struct cmd_struct *cmd, int argc, char **argv)
 	if (dry_run)
 		printf("This is a dry-run, no files are going to be restored\n");
 
+	if (nr_threads && !dry_run) {
+		restore_pool = restore_pool_start(nr_threads);
+		if (!restore_pool) {
+			error("failed to start the restore threads");
+			ret = 1;
+			goto out;
+		}
+	}
+
 	ret = search_dir(root, &key, dir_name, "", mreg);
 
+	if (restore_pool) {
+		int ret2;
+
+		ret2 = restore_pool_stop(restore_pool);
+		restore_pool = NULL;
+		if (!ret)
+			ret = ret2;
+	}
+
 out:
 	if (mreg)
 		regfree(mreg);
+	restore_buffers_free();
 	close_ctree(root);
 	return !!ret;
 }
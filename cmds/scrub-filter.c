@@ -0,0 +1,587 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Selection of the block groups scrubbed first or only by scrub start
+ * --filter.
+ *
+ * The scrub ioctl takes a physical range of a device and scrubs the device
+ * extents overlapping it, so the selected block groups are turned into the
+ * ranges of their device extents, scrubbed one after another.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/uapi/btrfs_tree.h"
+#include "kernel-shared/uapi/btrfs.h"
+#include "kernel-shared/ctree.h"
+#include "common/messages.h"
+#include "common/parse-utils.h"
+#include "common/tree-search.h"
+#include "cmds/scrub-filter.h"
+
+static int parse_profiles(char *profiles, u64 *flags)
+{
+	char *this_char;
+	char *save_ptr = NULL; /* Satisfy static checkers */
+
+	for (this_char = strtok_r(profiles, "|", &save_ptr);
+	     this_char != NULL;
+	     this_char = strtok_r(NULL, "|", &save_ptr)) {
+		u64 tmp = 0;
+
+		if (parse_bg_profile(this_char, &tmp)) {
+			error("unknown profile: %s", this_char);
+			return 1;
+		}
+		if (tmp == 0)
+			tmp = BTRFS_AVAIL_ALLOC_BIT_SINGLE;
+		*flags |= tmp;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the filters of one --filter, comma separated, with the syntax of the
+ * balance filters.
+ */
+int scrub_parse_filter(char *str, struct scrub_filter *filter)
+{
+	char *this_char;
+	char *value;
+	char *save_ptr = NULL; /* Satisfy static checkers */
+
+	memset(filter, 0, sizeof(*filter));
+	for (this_char = strtok_r(str, ",", &save_ptr);
+	     this_char != NULL;
+	     this_char = strtok_r(NULL, ",", &save_ptr)) {
+		if ((value = strchr(this_char, '=')) != NULL)
+			*value++ = 0;
+		if (!value || !*value) {
+			error("the %s filter requires an argument", this_char);
+			return 1;
+		}
+		if (!strcmp(this_char, "profiles")) {
+			if (parse_profiles(value, &filter->profiles)) {
+				error("invalid profiles argument");
+				return 1;
+			}
+			filter->flags |= SCRUB_FILTER_PROFILES;
+		} else if (!strcmp(this_char, "usage")) {
+			u64 usage;
+
+			if (parse_u64(value, &usage) == 0) {
+				filter->usage_min = 0;
+				filter->usage_max = usage;
+			} else if (parse_range_u32(value, &filter->usage_min,
+						   &filter->usage_max)) {
+				error("invalid usage argument: %s", value);
+				return 1;
+			}
+			if (filter->usage_min > filter->usage_max ||
+			    (filter->usage_max > 100 &&
+			     filter->usage_max != (u32)-1)) {
+				error("invalid usage argument: %s", value);
+				return 1;
+			}
+			filter->flags |= SCRUB_FILTER_USAGE;
+		} else if (!strcmp(this_char, "generation")) {
+			if (parse_u64(value, &filter->generation)) {
+				error("invalid generation argument: %s", value);
+				return 1;
+			}
+			filter->flags |= SCRUB_FILTER_GENERATION;
+		} else if (!strcmp(this_char, "vrange")) {
+			if (parse_range_strict(value, &filter->vstart,
+					       &filter->vend)) {
+				error("invalid vrange argument");
+				return 1;
+			}
+			filter->flags |= SCRUB_FILTER_VRANGE;
+		} else {
+			error("unrecognized scrub filter: %s", this_char);
+			return 1;
+		}
+	}
+	if (!filter->flags) {
+		error("empty scrub filter");
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Call @fn for each item of the search key of @args until it returns non-zero,
+ * a negative errno is returned, a positive value stops the search.
+ */
+static int search_items(int fd, struct btrfs_tree_search_args *args,
+			int (*fn)(struct btrfs_ioctl_search_header *sh,
+				  void *item, void *priv),
+			void *priv)
+{
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(args);
+	struct btrfs_ioctl_search_header sh = { 0 };
+	int ret;
+
+	while (1) {
+		unsigned long off = 0;
+
+		sk->nr_items = 4096;
+		ret = btrfs_tree_search_ioctl(fd, args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		for (int i = 0; i < sk->nr_items; i++) {
+			void *item;
+
+			memcpy(&sh, btrfs_tree_search_data(args, off), sizeof(sh));
+			off += sizeof(sh);
+			item = btrfs_tree_search_data(args, off);
+			off += sh.len;
+
+			ret = fn(&sh, item, priv);
+			if (ret)
+				return ret < 0 ? ret : 0;
+		}
+
+		/* Continue after the last key */
+		sk->min_objectid = sh.objectid;
+		sk->min_type = sh.type;
+		sk->min_offset = sh.offset + 1;
+		if (sk->min_offset == 0) {
+			if (sk->min_type == (u8)-1) {
+				if (sk->min_objectid == sk->max_objectid)
+					break;
+				sk->min_objectid++;
+			}
+			sk->min_type++;
+		}
+	}
+
+	return 0;
+}
+
+static void init_search(struct btrfs_tree_search_args *args, u64 tree_id,
+			u64 min_objectid, u8 min_type, u64 max_objectid,
+			u8 max_type)
+{
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(args);
+
+	memset(args, 0, sizeof(*args));
+	sk->tree_id = tree_id;
+	sk->min_objectid = min_objectid;
+	sk->min_type = min_type;
+	sk->max_objectid = max_objectid;
+	sk->max_type = max_type;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+}
+
+struct chunks_ctx {
+	struct scrub_filter_bg *bgs;
+	u64 *types;
+	int nr;
+	int size;
+};
+
+static int add_chunk(struct btrfs_ioctl_search_header *sh, void *item,
+		     void *priv)
+{
+	struct chunks_ctx *ctx = priv;
+
+	if (sh->type != BTRFS_CHUNK_ITEM_KEY)
+		return 0;
+	if (ctx->nr == ctx->size) {
+		struct scrub_filter_bg *bgs;
+		u64 *types;
+
+		ctx->size = ctx->size ? ctx->size * 2 : 256;
+		bgs = realloc(ctx->bgs, ctx->size * sizeof(*bgs));
+		if (!bgs)
+			return -ENOMEM;
+		ctx->bgs = bgs;
+		types = realloc(ctx->types, ctx->size * sizeof(*types));
+		if (!types)
+			return -ENOMEM;
+		ctx->types = types;
+	}
+	ctx->bgs[ctx->nr].start = sh->offset;
+	ctx->bgs[ctx->nr].length = btrfs_stack_chunk_length(item);
+	ctx->bgs[ctx->nr].generation = 0;
+	ctx->types[ctx->nr] = btrfs_stack_chunk_type(item);
+	ctx->nr++;
+	return 0;
+}
+
+static int read_block_group_used(struct btrfs_ioctl_search_header *sh,
+				 void *item, void *priv)
+{
+	u64 *used = priv;
+
+	if (sh->type != BTRFS_BLOCK_GROUP_ITEM_KEY)
+		return 0;
+	*used = btrfs_stack_block_group_used(item);
+	return 1;
+}
+
+/*
+ * Read the used bytes of the block group at @start, from the block group tree
+ * if the filesystem has it, otherwise from the extent tree.
+ */
+static int block_group_used(int fd, u64 start, u64 *used)
+{
+	struct btrfs_tree_search_args args;
+	int ret;
+
+	*used = (u64)-1;
+	init_search(&args, BTRFS_BLOCK_GROUP_TREE_OBJECTID, start,
+		    BTRFS_BLOCK_GROUP_ITEM_KEY, start, BTRFS_BLOCK_GROUP_ITEM_KEY);
+	ret = search_items(fd, &args, read_block_group_used, used);
+	if (ret == -ENOENT) {
+		init_search(&args, BTRFS_EXTENT_TREE_OBJECTID, start,
+			    BTRFS_BLOCK_GROUP_ITEM_KEY, start,
+			    BTRFS_BLOCK_GROUP_ITEM_KEY);
+		ret = search_items(fd, &args, read_block_group_used, used);
+	}
+	if (ret < 0)
+		return ret;
+	if (*used == (u64)-1)
+		return -ENOENT;
+	return 0;
+}
+
+static int newest_extent(struct btrfs_ioctl_search_header *sh, void *item,
+			 void *priv)
+{
+	struct btrfs_extent_item *ei = item;
+	u64 *generation = priv;
+
+	if (sh->type != BTRFS_EXTENT_ITEM_KEY &&
+	    sh->type != BTRFS_METADATA_ITEM_KEY)
+		return 0;
+	*generation = max_t(u64, *generation,
+			    get_unaligned_le64(&ei->generation));
+	return 0;
+}
+
+/*
+ * Find the newest extent of the block group @bg newer than @min_generation.
+ * The search skips the tree blocks older than it so only the recently changed
+ * parts of the extent tree are read.
+ */
+static int block_group_generation(int fd, struct scrub_filter_bg *bg,
+				  u64 min_generation)
+{
+	struct btrfs_tree_search_args args;
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(&args);
+
+	init_search(&args, BTRFS_EXTENT_TREE_OBJECTID, bg->start, 0,
+		    bg->start + bg->length - 1, (u8)-1);
+	sk->min_transid = min_generation;
+	bg->generation = 0;
+	return search_items(fd, &args, newest_extent, &bg->generation);
+}
+
+static bool match_filter(const struct scrub_filter *filter,
+			 const struct scrub_filter_bg *bg, u64 type, u64 used)
+{
+	if (filter->flags & SCRUB_FILTER_PROFILES) {
+		u64 profile = type & BTRFS_BLOCK_GROUP_PROFILE_MASK;
+
+		if (!profile)
+			profile = BTRFS_AVAIL_ALLOC_BIT_SINGLE;
+		if (!(profile & filter->profiles))
+			return false;
+	}
+	if (filter->flags & SCRUB_FILTER_USAGE) {
+		u64 percent = used * 100 / bg->length;
+
+		if (percent < filter->usage_min || percent > filter->usage_max)
+			return false;
+	}
+	if (filter->flags & SCRUB_FILTER_GENERATION) {
+		if (bg->generation <= filter->generation)
+			return false;
+	}
+	if (filter->flags & SCRUB_FILTER_VRANGE) {
+		if (bg->start >= filter->vend ||
+		    bg->start + bg->length <= filter->vstart)
+			return false;
+	}
+	return true;
+}
+
+static int cmp_bg_generation(const void *a, const void *b)
+{
+	const struct scrub_filter_bg *bg1 = a;
+	const struct scrub_filter_bg *bg2 = b;
+
+	if (bg1->generation > bg2->generation)
+		return -1;
+	if (bg1->generation < bg2->generation)
+		return 1;
+	if (bg1->start < bg2->start)
+		return -1;
+	return bg1->start > bg2->start;
+}
+
+/*
+ * Select the block groups of the filesystem of @fd matching any of the
+ * @nr_filters @filters, in the order of their newest extent if there's a
+ * generation filter or of their logical address otherwise.  The number of all
+ * block groups is returned in @nr_total_ret.
+ */
+int scrub_filter_block_groups(int fd, const struct scrub_filter *filters,
+			      int nr_filters, struct scrub_filter_bg **bgs_ret,
+			      int *nr_bgs_ret, int *nr_total_ret)
+{
+	struct btrfs_tree_search_args args;
+	struct chunks_ctx ctx = { 0 };
+	u64 min_generation = (u64)-1;
+	bool need_usage = false;
+	int nr = 0;
+	int ret;
+
+	for (int i = 0; i < nr_filters; i++) {
+		if (filters[i].flags & SCRUB_FILTER_USAGE)
+			need_usage = true;
+		if (filters[i].flags & SCRUB_FILTER_GENERATION)
+			min_generation = min(min_generation,
+					     filters[i].generation + 1);
+	}
+
+	init_search(&args, BTRFS_CHUNK_TREE_OBJECTID,
+		    BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY,
+		    BTRFS_FIRST_CHUNK_TREE_OBJECTID, BTRFS_CHUNK_ITEM_KEY);
+	ret = search_items(fd, &args, add_chunk, &ctx);
+	if (ret < 0)
+		goto out;
+
+	for (int i = 0; i < ctx.nr; i++) {
+		struct scrub_filter_bg *bg = &ctx.bgs[i];
+		u64 used = 0;
+
+		if (need_usage) {
+			ret = block_group_used(fd, bg->start, &used);
+			if (ret < 0)
+				goto out;
+		}
+		if (min_generation != (u64)-1) {
+			ret = block_group_generation(fd, bg, min_generation);
+			if (ret < 0)
+				goto out;
+		}
+		for (int j = 0; j < nr_filters; j++) {
+			if (match_filter(&filters[j], bg, ctx.types[i], used)) {
+				ctx.bgs[nr++] = *bg;
+				break;
+			}
+		}
+	}
+	if (min_generation != (u64)-1)
+		qsort(ctx.bgs, nr, sizeof(*ctx.bgs), cmp_bg_generation);
+
+	*bgs_ret = ctx.bgs;
+	*nr_bgs_ret = nr;
+	*nr_total_ret = ctx.nr;
+	ctx.bgs = NULL;
+	ret = 0;
+out:
+	free(ctx.bgs);
+	free(ctx.types);
+	return ret;
+}
+
+/* A device extent of a selected block group, at its index in the order */
+struct dev_extent {
+	int order;
+	u64 start;
+	u64 length;
+};
+
+struct dev_extents_ctx {
+	u64 devid;
+	/* The selected block groups sorted by logical address */
+	struct scrub_filter_bg *bgs;
+	int *order;
+	int nr_bgs;
+	struct dev_extent *extents;
+	int nr;
+	int size;
+};
+
+static int cmp_bg_start(const void *a, const void *b)
+{
+	const struct scrub_filter_bg *bg1 = a;
+	const struct scrub_filter_bg *bg2 = b;
+
+	if (bg1->start < bg2->start)
+		return -1;
+	return bg1->start > bg2->start;
+}
+
+static int cmp_dev_extent_order(const void *a, const void *b)
+{
+	const struct dev_extent *de1 = a;
+	const struct dev_extent *de2 = b;
+
+	if (de1->order != de2->order)
+		return de1->order < de2->order ? -1 : 1;
+	if (de1->start < de2->start)
+		return -1;
+	return de1->start > de2->start;
+}
+
+static int cmp_dev_extent_start(const void *a, const void *b)
+{
+	const struct dev_extent *de1 = a;
+	const struct dev_extent *de2 = b;
+
+	if (de1->start < de2->start)
+		return -1;
+	return de1->start > de2->start;
+}
+
+static int add_dev_extent(struct btrfs_ioctl_search_header *sh, void *item,
+			  void *priv)
+{
+	struct dev_extents_ctx *ctx = priv;
+	struct scrub_filter_bg key;
+	struct scrub_filter_bg *bg;
+
+	if (sh->objectid != ctx->devid || sh->type != BTRFS_DEV_EXTENT_KEY)
+		return 0;
+	key.start = btrfs_stack_dev_extent_chunk_offset(item);
+	bg = bsearch(&key, ctx->bgs, ctx->nr_bgs, sizeof(*bg), cmp_bg_start);
+	if (!bg)
+		return 0;
+	if (ctx->nr == ctx->size) {
+		struct dev_extent *extents;
+
+		ctx->size = ctx->size ? ctx->size * 2 : 256;
+		extents = realloc(ctx->extents, ctx->size * sizeof(*extents));
+		if (!extents)
+			return -ENOMEM;
+		ctx->extents = extents;
+	}
+	ctx->extents[ctx->nr].order = ctx->order[bg - ctx->bgs];
+	ctx->extents[ctx->nr].start = sh->offset;
+	ctx->extents[ctx->nr].length = btrfs_stack_dev_extent_length(item);
+	ctx->nr++;
+	return 0;
+}
+
+static int add_range(struct scrub_range **ranges, int *nr, u64 start, u64 end)
+{
+	struct scrub_range *tmp;
+
+	/* Merge with the previous range if contiguous */
+	if (*nr && (*ranges)[*nr - 1].end == start) {
+		(*ranges)[*nr - 1].end = end;
+		return 0;
+	}
+	tmp = realloc(*ranges, (*nr + 1) * sizeof(*tmp));
+	if (!tmp)
+		return -ENOMEM;
+	tmp[*nr].start = start;
+	tmp[*nr].end = end;
+	*ranges = tmp;
+	(*nr)++;
+	return 0;
+}
+
+/*
+ * Return the physical ranges of device @devid to scrub one after another, the
+ * device extents of the @nr_bgs block groups @bgs in their order.  With
+ * @prioritize the ranges between them follow, to scrub the whole device.
+ */
+int scrub_filter_device_ranges(int fd, u64 devid,
+			       const struct scrub_filter_bg *bgs, int nr_bgs,
+			       bool prioritize, struct scrub_range **ranges_ret,
+			       int *nr_ranges_ret)
+{
+	struct btrfs_tree_search_args args;
+	struct dev_extents_ctx ctx = { .devid = devid, .nr_bgs = nr_bgs };
+	struct scrub_range *ranges = NULL;
+	int nr_ranges = 0;
+	u64 last = 0;
+	int ret;
+
+	ctx.bgs = malloc(nr_bgs * sizeof(*ctx.bgs) + 1);
+	ctx.order = malloc(nr_bgs * sizeof(*ctx.order) + 1);
+	if (!ctx.bgs || !ctx.order) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	/* The order is kept in the generation field of the sorted copy */
+	for (int i = 0; i < nr_bgs; i++) {
+		ctx.bgs[i] = bgs[i];
+		ctx.bgs[i].generation = i;
+	}
+	qsort(ctx.bgs, nr_bgs, sizeof(*ctx.bgs), cmp_bg_start);
+	for (int i = 0; i < nr_bgs; i++)
+		ctx.order[i] = ctx.bgs[i].generation;
+
+	init_search(&args, BTRFS_DEV_TREE_OBJECTID, devid, BTRFS_DEV_EXTENT_KEY,
+		    devid, BTRFS_DEV_EXTENT_KEY);
+	ret = search_items(fd, &args, add_dev_extent, &ctx);
+	if (ret < 0)
+		goto out;
+
+	qsort(ctx.extents, ctx.nr, sizeof(*ctx.extents), cmp_dev_extent_order);
+	for (int i = 0; i < ctx.nr; i++) {
+		ret = add_range(&ranges, &nr_ranges, ctx.extents[i].start,
+				ctx.extents[i].start + ctx.extents[i].length);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (prioritize) {
+		/* Fill the gaps, the ioctl skips the extents not overlapping */
+		qsort(ctx.extents, ctx.nr, sizeof(*ctx.extents),
+		      cmp_dev_extent_start);
+		for (int i = 0; i < ctx.nr; i++) {
+			if (ctx.extents[i].start > last) {
+				ret = add_range(&ranges, &nr_ranges, last,
+						ctx.extents[i].start);
+				if (ret < 0)
+					goto out;
+			}
+			last = ctx.extents[i].start + ctx.extents[i].length;
+		}
+		ret = add_range(&ranges, &nr_ranges, last, (u64)-1);
+		if (ret < 0)
+			goto out;
+	}
+
+	*ranges_ret = ranges;
+	*nr_ranges_ret = nr_ranges;
+	ranges = NULL;
+	ret = 0;
+out:
+	free(ranges);
+	free(ctx.bgs);
+	free(ctx.order);
+	free(ctx.extents);
+	return ret;
+}
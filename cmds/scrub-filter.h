@@ -0,0 +1,66 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_SCRUB_FILTER_H__
+#define __BTRFS_SCRUB_FILTER_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+#define SCRUB_FILTER_PROFILES		(1ULL << 0)
+#define SCRUB_FILTER_USAGE		(1ULL << 1)
+#define SCRUB_FILTER_GENERATION		(1ULL << 2)
+#define SCRUB_FILTER_VRANGE		(1ULL << 3)
+
+/* Filters of one --filter of scrub start, all must match a block group */
+struct scrub_filter {
+	u64 flags;
+	/* Extended profile bits, see parse_bg_profile() */
+	u64 profiles;
+	/* Percents of the block group used, inclusive */
+	u32 usage_min;
+	u32 usage_max;
+	/* An extent newer than the generation */
+	u64 generation;
+	/* Logical range, [vstart, vend) */
+	u64 vstart;
+	u64 vend;
+};
+
+/* A block group selected by the filters */
+struct scrub_filter_bg {
+	u64 start;
+	u64 length;
+	/* Newest extent generation, only with a generation filter */
+	u64 generation;
+};
+
+/* Physical range of a device scrubbed by one pass of the scrub ioctl */
+struct scrub_range {
+	u64 start;
+	u64 end;
+};
+
+int scrub_parse_filter(char *str, struct scrub_filter *filter);
+int scrub_filter_block_groups(int fd, const struct scrub_filter *filters,
+			      int nr_filters, struct scrub_filter_bg **bgs_ret,
+			      int *nr_bgs_ret, int *nr_total_ret);
+int scrub_filter_device_ranges(int fd, u64 devid,
+			       const struct scrub_filter_bg *bgs, int nr_bgs,
+			       bool prioritize, struct scrub_range **ranges_ret,
+			       int *nr_ranges_ret);
+
+#endif
@@ -0,0 +1,987 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Scrub of an unmounted filesystem, see scrub_offline().
+ *
+ * The main thread walks the extent tree in the order of the logical address
+ * and maps each extent to the copies on the devices.  The ranges are queued
+ * to a reader thread per device, with the checksums of the data looked up in
+ * the checksum tree, so only the main thread reads the trees.  The readers
+ * read their ranges sequentially by chunks and verify them, the other copies
+ * are read only to tell if an error can be corrected.
+ */
+
+#include "kerncompat.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "kernel-lib/raid56.h"
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/volumes.h"
+#include "kernel-shared/extent_io.h"
+#include "common/device-utils.h"
+#include "common/messages.h"
+#include "common/string-utils.h"
+#include "common/work-queue.h"
+#include "cmds/scrub-offline.h"
+
+/* Copies of RAID1C4 */
+#define SCRUB_OFFLINE_MAX_COPIES	(4)
+
+enum scrub_offline_job_type {
+	SCRUB_OFFLINE_DATA,
+	SCRUB_OFFLINE_TREE,
+	SCRUB_OFFLINE_PARITY,
+};
+
+/* Location of a copy of a range, or of a stripe of a RAID5/6 full stripe */
+struct scrub_offline_copy {
+	struct btrfs_device *dev;
+	u64 physical;
+};
+
+/* A range read by one device, merged from adjacent extents */
+struct scrub_offline_job {
+	enum scrub_offline_job_type type;
+	u64 logical;
+	u64 len;
+	/* Extents starting in the range, for the counters */
+	u32 nr_extents;
+	/* Index of the copy on the device of the job */
+	int mirror;
+	/*
+	 * The copies of the range, each contiguous on its device.  For the
+	 * parity the data stripes of the full stripe in the logical order,
+	 * followed by P and Q, each of stripe_len.
+	 */
+	int nr_copies;
+	struct scrub_offline_copy *copies;
+	/* Parity: data stripes of the full stripe */
+	int nr_data;
+	u64 stripe_len;
+	/* Data: checksum of each sector, present if has_csum is set */
+	u8 *csums;
+	u8 *has_csum;
+	/* Tree: expected generation of each block */
+	u64 *generations;
+};
+
+struct scrub_offline_dev {
+	struct scrub_offline *sctx;
+	struct btrfs_device *dev;
+	struct work_queue queue;
+	pthread_t thread;
+	bool started;
+	/* Filled by the main thread, merged with the following ranges */
+	struct scrub_offline_job *open;
+	/* Reader buffers */
+	u8 *buf;
+	u8 *cmp_buf;
+	u8 *csum_buf;
+	u8 *bad;
+	void **stripes;
+	int nr_stripes;
+	struct btrfs_scrub_progress progress;
+};
+
+struct scrub_offline {
+	struct btrfs_fs_info *fs_info;
+	int nr_devs;
+	struct scrub_offline_dev *devs;
+	/* Checksums of the extent being queued */
+	u8 *csums;
+	u8 *has_csum;
+	u64 csums_nr;
+	/* The full stripe last queued for the parity check */
+	u64 last_full_stripe;
+	bool skip_data;
+};
+
+static struct scrub_offline_dev *scrub_offline_find_dev(struct scrub_offline *sctx,
+							 struct btrfs_device *dev)
+{
+	for (int i = 0; i < sctx->nr_devs; i++)
+		if (sctx->devs[i].dev == dev)
+			return &sctx->devs[i];
+	return NULL;
+}
+
+static int scrub_offline_read(struct scrub_offline *sctx,
+			      const struct scrub_offline_copy *copy, void *buf,
+			      u64 len, u64 offset)
+{
+	ssize_t ret;
+
+	if (!copy->dev || copy->dev->fd < 0)
+		return -ENODEV;
+	ret = btrfs_pread(copy->dev->fd, buf, len, copy->physical + offset,
+			  sctx->fs_info->zoned);
+	if (ret > 0)
+		btrfs_device_account_read(copy->dev, ret);
+	if (ret < 0)
+		return -errno;
+	if (ret != len)
+		return -EIO;
+	return 0;
+}
+
+/* Return 0 if the tree block is valid, 1 on checksum mismatch, 2 on bad header */
+static int scrub_offline_verify_tree_block(struct scrub_offline *sctx,
+					   const u8 *buf, u64 logical, u64 generation)
+{
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	const struct btrfs_header *header = (const struct btrfs_header *)buf;
+	u8 result[BTRFS_CSUM_SIZE];
+
+	btrfs_csum_data(fs_info->csum_type, buf + BTRFS_CSUM_SIZE, result,
+			fs_info->nodesize - BTRFS_CSUM_SIZE);
+	if (memcmp(result, header->csum, fs_info->csum_size))
+		return 1;
+	if (btrfs_stack_header_bytenr(header) != logical ||
+	    btrfs_stack_header_generation(header) != generation ||
+	    memcmp(header->fsid, fs_info->fs_devices->metadata_uuid,
+		   BTRFS_FSID_SIZE) ||
+	    memcmp(header->chunk_tree_uuid, fs_info->chunk_tree_uuid,
+		   BTRFS_UUID_SIZE))
+		return 2;
+	return 0;
+}
+
+/*
+ * Check if another copy of the block at @offset of the job is good, the block
+ * is a sector of data or a tree block.
+ */
+static bool scrub_offline_good_copy(struct scrub_offline_dev *sdev,
+				    struct scrub_offline_job *job, u64 offset,
+				    u32 blocksize)
+{
+	struct scrub_offline *sctx = sdev->sctx;
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	u8 csum[BTRFS_CSUM_SIZE];
+	u32 index;
+
+	for (int i = 0; i < job->nr_copies; i++) {
+		if (i == job->mirror)
+			continue;
+		if (scrub_offline_read(sctx, &job->copies[i], sdev->cmp_buf,
+				       blocksize, offset))
+			continue;
+		if (job->type == SCRUB_OFFLINE_TREE) {
+			index = offset / fs_info->nodesize;
+			if (!scrub_offline_verify_tree_block(sctx, sdev->cmp_buf,
+					job->logical + offset,
+					job->generations[index]))
+				return true;
+			continue;
+		}
+		index = offset / fs_info->sectorsize;
+		if (!job->has_csum[index])
+			return true;
+		btrfs_csum_data(fs_info->csum_type, sdev->cmp_buf, csum,
+				fs_info->sectorsize);
+		if (!memcmp(csum, job->csums + index * fs_info->csum_size,
+			    fs_info->csum_size))
+			return true;
+	}
+	return false;
+}
+
+/* Compare the data without checksums with the other copies */
+static void scrub_offline_compare_copies(struct scrub_offline_dev *sdev,
+					 struct scrub_offline_job *job, u32 nr)
+{
+	struct scrub_offline *sctx = sdev->sctx;
+	const u32 sectorsize = sctx->fs_info->sectorsize;
+
+	for (int i = 0; i < job->nr_copies; i++) {
+		if (i == job->mirror)
+			continue;
+		if (scrub_offline_read(sctx, &job->copies[i], sdev->cmp_buf,
+				       job->len, 0))
+			continue;
+		for (u32 s = 0; s < nr; s++) {
+			if (job->has_csum[s] || sdev->bad[s])
+				continue;
+			if (!memcmp(sdev->buf + s * sectorsize,
+				    sdev->cmp_buf + s * sectorsize, sectorsize))
+				continue;
+			error(
+	"copies differ at logical %llu on dev %s physical %llu and dev %s physical %llu",
+			      job->logical + s * sectorsize, sdev->dev->name,
+			      job->copies[job->mirror].physical + s * sectorsize,
+			      job->copies[i].dev->name,
+			      job->copies[i].physical + s * sectorsize);
+			sdev->progress.verify_errors++;
+			/* Reported once for all the copies */
+			sdev->bad[s] = 1;
+		}
+	}
+}
+
+static void scrub_offline_data(struct scrub_offline_dev *sdev,
+			       struct scrub_offline_job *job)
+{
+	struct scrub_offline *sctx = sdev->sctx;
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct btrfs_scrub_progress *p = &sdev->progress;
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	const u32 nr = job->len / sectorsize;
+	const u64 physical = job->copies[job->mirror].physical;
+	bool need_compare = false;
+
+	memset(sdev->bad, 0, nr);
+	if (scrub_offline_read(sctx, &job->copies[job->mirror], sdev->buf,
+			       job->len, 0)) {
+		/* Find the sectors that can't be read */
+		for (u32 s = 0; s < nr; s++) {
+			if (!scrub_offline_read(sctx, &job->copies[job->mirror],
+					sdev->buf + s * sectorsize, sectorsize,
+					s * sectorsize))
+				continue;
+			error("read error at logical %llu on dev %s physical %llu",
+			      job->logical + s * sectorsize, sdev->dev->name,
+			      physical + s * sectorsize);
+			p->read_errors++;
+			sdev->bad[s] = 1;
+		}
+	}
+
+	btrfs_csum_data_batch(fs_info->csum_type, sdev->buf, sdev->csum_buf,
+			      sectorsize, nr);
+	for (u32 s = 0; s < nr; s++) {
+		if (sdev->bad[s])
+			continue;
+		if (!job->has_csum[s]) {
+			p->no_csum++;
+			need_compare = true;
+			continue;
+		}
+		if (!memcmp(sdev->csum_buf + s * csum_size,
+			    job->csums + s * csum_size, csum_size))
+			continue;
+		error("checksum error at logical %llu on dev %s physical %llu",
+		      job->logical + s * sectorsize, sdev->dev->name,
+		      physical + s * sectorsize);
+		p->csum_errors++;
+		sdev->bad[s] = 1;
+	}
+
+	for (u32 s = 0; s < nr; s++) {
+		if (sdev->bad[s] &&
+		    !scrub_offline_good_copy(sdev, job, s * sectorsize, sectorsize))
+			p->uncorrectable_errors++;
+	}
+
+	/* The first copy is compared with the others, once for all of them */
+	if (need_compare && job->mirror == 0 && job->nr_copies > 1)
+		scrub_offline_compare_copies(sdev, job, nr);
+
+	p->data_extents_scrubbed += job->nr_extents;
+	p->data_bytes_scrubbed += job->len;
+}
+
+static void scrub_offline_tree(struct scrub_offline_dev *sdev,
+			       struct scrub_offline_job *job)
+{
+	struct scrub_offline *sctx = sdev->sctx;
+	struct btrfs_scrub_progress *p = &sdev->progress;
+	const u32 nodesize = sctx->fs_info->nodesize;
+	const u32 nr = job->len / nodesize;
+	const u64 physical = job->copies[job->mirror].physical;
+	bool read_failed;
+
+	read_failed = scrub_offline_read(sctx, &job->copies[job->mirror],
+					 sdev->buf, job->len, 0);
+	for (u32 i = 0; i < nr; i++) {
+		u8 *block = sdev->buf + i * nodesize;
+		u64 logical = job->logical + i * nodesize;
+		int ret;
+
+		if (read_failed &&
+		    scrub_offline_read(sctx, &job->copies[job->mirror], block,
+				       nodesize, i * nodesize)) {
+			error("read error at logical %llu on dev %s physical %llu",
+			      logical, sdev->dev->name, physical + i * nodesize);
+			p->read_errors++;
+		} else {
+			ret = scrub_offline_verify_tree_block(sctx, block, logical,
+							job->generations[i]);
+			if (!ret)
+				continue;
+			if (ret == 1) {
+				error(
+			"checksum error at logical %llu on dev %s physical %llu, tree block",
+				      logical, sdev->dev->name,
+				      physical + i * nodesize);
+				p->csum_errors++;
+			} else {
+				error(
+		"header error at logical %llu on dev %s physical %llu, tree block",
+				      logical, sdev->dev->name,
+				      physical + i * nodesize);
+				p->verify_errors++;
+			}
+		}
+		if (!scrub_offline_good_copy(sdev, job, i * nodesize, nodesize))
+			p->uncorrectable_errors++;
+	}
+	p->tree_extents_scrubbed += job->nr_extents;
+	p->tree_bytes_scrubbed += job->len;
+}
+
+/* Verify P and Q of a full stripe, read by the device with P */
+static void scrub_offline_parity(struct scrub_offline_dev *sdev,
+				 struct scrub_offline_job *job)
+{
+	struct scrub_offline *sctx = sdev->sctx;
+	const int nr_stripes = job->nr_copies;
+	const int nr_parity = nr_stripes - job->nr_data;
+	const u64 stripe_len = job->stripe_len;
+	void **ptrs;
+	int ret;
+
+	/* The stripes read, then the P and Q calculated */
+	if (sdev->nr_stripes < nr_stripes + nr_parity) {
+		void **stripes;
+
+		stripes = realloc(sdev->stripes, sizeof(void *) *
+				  (nr_stripes + nr_parity));
+		if (!stripes) {
+			sdev->progress.malloc_errors++;
+			return;
+		}
+		sdev->stripes = stripes;
+		for (int i = sdev->nr_stripes; i < nr_stripes + nr_parity; i++) {
+			sdev->stripes[i] = malloc(stripe_len);
+			if (!sdev->stripes[i]) {
+				sdev->nr_stripes = i;
+				sdev->progress.malloc_errors++;
+				return;
+			}
+		}
+		sdev->nr_stripes = nr_stripes + nr_parity;
+	}
+	ptrs = sdev->stripes;
+
+	for (int i = 0; i < nr_stripes; i++) {
+		ret = scrub_offline_read(sctx, &job->copies[i], ptrs[i],
+					 stripe_len, 0);
+		if (ret == -ENODEV)
+			return;
+		if (ret) {
+			error(
+		"read error in full stripe at logical %llu on dev %s physical %llu",
+			      job->logical, job->copies[i].dev->name,
+			      job->copies[i].physical);
+			sdev->progress.read_errors++;
+			return;
+		}
+	}
+
+	/* Calculate the parity into the buffers after the stripes read */
+	if (nr_parity == 1) {
+		void *tmp = ptrs[job->nr_data];
+
+		ptrs[job->nr_data] = ptrs[nr_stripes];
+		ret = raid5_gen_result(nr_stripes, stripe_len, job->nr_data, ptrs);
+		ptrs[job->nr_data] = tmp;
+		if (ret < 0) {
+			sdev->progress.malloc_errors++;
+			return;
+		}
+	} else {
+		void *p = ptrs[job->nr_data];
+		void *q = ptrs[job->nr_data + 1];
+
+		ptrs[job->nr_data] = ptrs[nr_stripes];
+		ptrs[job->nr_data + 1] = ptrs[nr_stripes + 1];
+		raid6_gen_syndrome(nr_stripes, stripe_len, ptrs);
+		ptrs[job->nr_data] = p;
+		ptrs[job->nr_data + 1] = q;
+	}
+	for (int i = 0; i < nr_parity; i++) {
+		if (!memcmp(ptrs[job->nr_data + i], ptrs[nr_stripes + i],
+			    stripe_len))
+			continue;
+		error(
+	"parity %c mismatch in full stripe at logical %llu on dev %s physical %llu",
+		      i ? 'Q' : 'P', job->logical,
+		      job->copies[job->nr_data + i].dev->name,
+		      job->copies[job->nr_data + i].physical);
+		sdev->progress.verify_errors++;
+	}
+}
+
+/* Verify the super block copies that fit on the device */
+static void scrub_offline_supers(struct scrub_offline_dev *sdev)
+{
+	struct scrub_offline *sctx = sdev->sctx;
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct btrfs_super_block *sb = (struct btrfs_super_block *)sdev->buf;
+	u8 result[BTRFS_CSUM_SIZE];
+
+	/* The zoned devices keep them in log zones */
+	if (fs_info->zoned)
+		return;
+	for (int i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		struct scrub_offline_copy copy = {
+			.dev = sdev->dev,
+			.physical = btrfs_sb_offset(i),
+		};
+
+		if (copy.physical + BTRFS_SUPER_INFO_SIZE > sdev->dev->total_bytes)
+			break;
+		if (scrub_offline_read(sctx, &copy, sb, BTRFS_SUPER_INFO_SIZE, 0)) {
+			error("super block %d read error on dev %s", i,
+			      sdev->dev->name);
+			sdev->progress.super_errors++;
+			continue;
+		}
+		btrfs_csum_data(btrfs_super_csum_type(sb),
+				(u8 *)sb + BTRFS_CSUM_SIZE, result,
+				BTRFS_SUPER_INFO_SIZE - BTRFS_CSUM_SIZE);
+		if (btrfs_super_magic(sb) != BTRFS_MAGIC ||
+		    btrfs_super_csum_type(sb) != fs_info->csum_type ||
+		    memcmp(result, sb->csum, fs_info->csum_size) ||
+		    btrfs_super_bytenr(sb) != copy.physical ||
+		    memcmp(sb->fsid, fs_info->super_copy->fsid, BTRFS_FSID_SIZE) ||
+		    btrfs_stack_device_id(&sb->dev_item) != sdev->dev->devid) {
+			error("super block %d error on dev %s", i, sdev->dev->name);
+			sdev->progress.super_errors++;
+		}
+	}
+}
+
+static void scrub_offline_job_free(struct scrub_offline_job *job)
+{
+	if (!job)
+		return;
+	free(job->copies);
+	free(job->csums);
+	free(job->has_csum);
+	free(job->generations);
+	free(job);
+}
+
+static void *scrub_offline_reader(void *arg)
+{
+	struct scrub_offline_dev *sdev = arg;
+	struct scrub_offline_job *job;
+
+	scrub_offline_supers(sdev);
+	while ((job = work_queue_pop(&sdev->queue))) {
+		switch (job->type) {
+		case SCRUB_OFFLINE_DATA:
+			scrub_offline_data(sdev, job);
+			break;
+		case SCRUB_OFFLINE_TREE:
+			scrub_offline_tree(sdev, job);
+			break;
+		case SCRUB_OFFLINE_PARITY:
+			scrub_offline_parity(sdev, job);
+			break;
+		}
+		sdev->progress.last_physical = job->copies[job->mirror].physical +
+			(job->type == SCRUB_OFFLINE_PARITY ? job->stripe_len : job->len);
+		scrub_offline_job_free(job);
+	}
+	return NULL;
+}
+
+static void scrub_offline_flush(struct scrub_offline_dev *sdev)
+{
+	if (!sdev->open)
+		return;
+	work_queue_push(&sdev->queue, sdev->open);
+	sdev->open = NULL;
+}
+
+static bool scrub_offline_can_merge(const struct scrub_offline_job *job,
+				    enum scrub_offline_job_type type,
+				    u64 logical, u64 len,
+				    const struct scrub_offline_copy *copies,
+				    int nr_copies, int mirror)
+{
+	if (job->type != type || job->mirror != mirror ||
+	    job->nr_copies != nr_copies)
+		return false;
+	if (job->logical + job->len != logical ||
+	    job->len + len > SCRUB_OFFLINE_JOB_SIZE)
+		return false;
+	for (int i = 0; i < nr_copies; i++) {
+		if (job->copies[i].dev != copies[i].dev ||
+		    job->copies[i].physical + job->len != copies[i].physical)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Add the range at @logical to the job of the device with the copy @mirror,
+ * the checksums or generations are at @index of the extent being queued.
+ */
+static int scrub_offline_queue(struct scrub_offline *sctx,
+			       enum scrub_offline_job_type type, u64 logical,
+			       u64 len, const struct scrub_offline_copy *copies,
+			       int nr_copies, int mirror, u64 index,
+			       u64 generation, bool extent_start)
+{
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct scrub_offline_dev *sdev;
+	struct scrub_offline_job *job;
+	u64 offset;
+
+	sdev = scrub_offline_find_dev(sctx, copies[mirror].dev);
+	/* Missing devices and devices of the seed filesystems */
+	if (!sdev || sdev->dev->fd < 0)
+		return 0;
+
+	job = sdev->open;
+	if (job && !scrub_offline_can_merge(job, type, logical, len, copies,
+					    nr_copies, mirror)) {
+		scrub_offline_flush(sdev);
+		job = NULL;
+	}
+	if (!job) {
+		job = calloc(1, sizeof(*job));
+		if (!job)
+			return -ENOMEM;
+		job->type = type;
+		job->logical = logical;
+		job->mirror = mirror;
+		job->nr_copies = nr_copies;
+		job->copies = malloc(sizeof(*copies) * nr_copies);
+		if (type == SCRUB_OFFLINE_DATA) {
+			u32 nr = SCRUB_OFFLINE_JOB_SIZE / fs_info->sectorsize;
+
+			job->csums = malloc(nr * fs_info->csum_size);
+			job->has_csum = malloc(nr);
+		} else {
+			job->generations = malloc(sizeof(u64) *
+					SCRUB_OFFLINE_JOB_SIZE / fs_info->nodesize);
+		}
+		if (!job->copies || (type == SCRUB_OFFLINE_DATA ?
+				     !job->csums || !job->has_csum :
+				     !job->generations)) {
+			scrub_offline_job_free(job);
+			return -ENOMEM;
+		}
+		memcpy(job->copies, copies, sizeof(*copies) * nr_copies);
+		sdev->open = job;
+	}
+
+	offset = job->len;
+	job->len += len;
+	if (extent_start)
+		job->nr_extents++;
+	if (type == SCRUB_OFFLINE_DATA) {
+		u32 sectorsize = fs_info->sectorsize;
+		u16 csum_size = fs_info->csum_size;
+
+		memcpy(job->csums + offset / sectorsize * csum_size,
+		       sctx->csums + index * csum_size,
+		       len / sectorsize * csum_size);
+		memcpy(job->has_csum + offset / sectorsize,
+		       sctx->has_csum + index, len / sectorsize);
+	} else {
+		job->generations[offset / fs_info->nodesize] = generation;
+	}
+	if (job->len == SCRUB_OFFLINE_JOB_SIZE)
+		scrub_offline_flush(sdev);
+	return 0;
+}
+
+/* Queue the check of the parity of the full stripe with @logical */
+static int scrub_offline_queue_parity(struct scrub_offline *sctx, u64 logical)
+{
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct btrfs_multi_bio *multi = NULL;
+	struct scrub_offline_job *job;
+	struct scrub_offline_dev *sdev;
+	u64 *raid_map = NULL;
+	u64 length = fs_info->sectorsize;
+	int nr_parity;
+	int ret;
+
+	ret = btrfs_map_block(fs_info, READ, logical, &length, &multi, 2,
+			      &raid_map);
+	if (ret)
+		return ret;
+	if (raid_map[0] == sctx->last_full_stripe)
+		goto out;
+	sctx->last_full_stripe = raid_map[0];
+	nr_parity = btrfs_bg_type_to_nparity(multi->type);
+
+	sdev = scrub_offline_find_dev(sctx,
+			multi->stripes[multi->num_stripes - nr_parity].dev);
+	if (!sdev || sdev->dev->fd < 0)
+		goto out;
+	scrub_offline_flush(sdev);
+	job = calloc(1, sizeof(*job));
+	if (!job) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	job->type = SCRUB_OFFLINE_PARITY;
+	job->logical = raid_map[0];
+	job->nr_copies = multi->num_stripes;
+	job->nr_data = multi->num_stripes - nr_parity;
+	job->mirror = job->nr_data;
+	job->stripe_len = length;
+	job->copies = calloc(multi->num_stripes, sizeof(*job->copies));
+	if (!job->copies) {
+		scrub_offline_job_free(job);
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (int i = 0; i < multi->num_stripes; i++) {
+		job->copies[i].dev = multi->stripes[i].dev;
+		job->copies[i].physical = multi->stripes[i].physical;
+	}
+	work_queue_push(&sdev->queue, job);
+out:
+	kfree(multi);
+	kfree(raid_map);
+	return ret;
+}
+
+/* Look up the checksums of the data extent at @start */
+static int scrub_offline_lookup_csums(struct scrub_offline *sctx, u64 start,
+				      u64 len)
+{
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, start);
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	const u64 nr = len / sectorsize;
+	int ret;
+
+	if (nr > sctx->csums_nr) {
+		u8 *csums = realloc(sctx->csums, nr * csum_size);
+		u8 *has_csum;
+
+		if (!csums)
+			return -ENOMEM;
+		sctx->csums = csums;
+		has_csum = realloc(sctx->has_csum, nr);
+		if (!has_csum)
+			return -ENOMEM;
+		sctx->has_csum = has_csum;
+		sctx->csums_nr = nr;
+	}
+	memset(sctx->has_csum, 0, nr);
+	if (sctx->skip_data)
+		return 0;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = start;
+	path.reada = READA_FORWARD;
+	ret = btrfs_search_slot(NULL, csum_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	if (ret > 0 && path.slots[0] > 0)
+		path.slots[0]--;
+
+	while (true) {
+		struct extent_buffer *leaf = path.nodes[0];
+		u64 item_start, item_end;
+		u64 cur, end;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(csum_root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != BTRFS_EXTENT_CSUM_OBJECTID ||
+		    key.type != BTRFS_EXTENT_CSUM_KEY) {
+			if (key.objectid > BTRFS_EXTENT_CSUM_OBJECTID)
+				break;
+			path.slots[0]++;
+			continue;
+		}
+		if (key.offset >= start + len)
+			break;
+		item_start = key.offset;
+		item_end = item_start + btrfs_item_size(leaf, path.slots[0]) /
+				       csum_size * sectorsize;
+		cur = max(item_start, start);
+		end = min(item_end, start + len);
+		if (cur < end) {
+			unsigned long ptr = btrfs_item_ptr_offset(leaf, path.slots[0]);
+
+			read_extent_buffer(leaf,
+				sctx->csums + (cur - start) / sectorsize * csum_size,
+				ptr + (cur - item_start) / sectorsize * csum_size,
+				(end - cur) / sectorsize * csum_size);
+			memset(sctx->has_csum + (cur - start) / sectorsize, 1,
+			       (end - cur) / sectorsize);
+		}
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/* Queue the ranges of the extent to the devices of its copies */
+static int scrub_offline_queue_extent(struct scrub_offline *sctx, u64 start,
+				      u64 len, bool is_tree, u64 generation)
+{
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct scrub_offline_copy copies[SCRUB_OFFLINE_MAX_COPIES];
+	const enum scrub_offline_job_type type = is_tree ?
+		SCRUB_OFFLINE_TREE : SCRUB_OFFLINE_DATA;
+	u64 cur = start;
+	int ret;
+
+	if (!is_tree) {
+		ret = scrub_offline_lookup_csums(sctx, start, len);
+		if (ret < 0)
+			return ret;
+	}
+
+	while (cur < start + len) {
+		struct btrfs_bio_stripe stripe;
+		u64 piece = start + len - cur;
+		u64 type_flags = 0;
+		int nr_copies;
+
+		nr_copies = btrfs_num_copies(fs_info, cur, piece);
+		for (int m = 0; m < nr_copies; m++) {
+			u64 length = start + len - cur;
+
+			ret = btrfs_map_block_stripe(fs_info, cur, &length,
+						     &type_flags, m + 1, &stripe);
+			if (ret < 0)
+				return ret;
+			/* The other copies of RAID5/6 are the rebuilt data */
+			if (type_flags & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+				nr_copies = 1;
+				piece = min(piece, length);
+				copies[0].dev = stripe.dev;
+				copies[0].physical = stripe.physical;
+				break;
+			}
+			if (m >= SCRUB_OFFLINE_MAX_COPIES)
+				return -EUCLEAN;
+			piece = min(piece, length);
+			copies[m].dev = stripe.dev;
+			copies[m].physical = stripe.physical;
+		}
+		piece = min_t(u64, piece, SCRUB_OFFLINE_JOB_SIZE);
+
+		for (int m = 0; m < nr_copies; m++) {
+			ret = scrub_offline_queue(sctx, type, cur, piece, copies,
+					nr_copies, m,
+					(cur - start) / fs_info->sectorsize,
+					generation, cur == start);
+			if (ret < 0)
+				return ret;
+		}
+		if (type_flags & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+			ret = scrub_offline_queue_parity(sctx, cur);
+			if (ret < 0)
+				return ret;
+		}
+		cur += piece;
+	}
+	return 0;
+}
+
+/* Walk the extent tree and queue all the extents */
+static int scrub_offline_walk(struct scrub_offline *sctx)
+{
+	struct btrfs_fs_info *fs_info = sctx->fs_info;
+	struct btrfs_root *extent_root = btrfs_extent_root(fs_info, 0);
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = 0;
+	key.type = 0;
+	key.offset = 0;
+	path.reada = READA_FORWARD;
+	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	if (ret < 0)
+		return ret;
+
+	while (true) {
+		struct extent_buffer *leaf = path.nodes[0];
+		struct btrfs_extent_item *ei;
+		u64 flags;
+		u64 len;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(extent_root, &path);
+			if (ret < 0)
+				break;
+			if (ret > 0) {
+				ret = 0;
+				break;
+			}
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		path.slots[0]++;
+		if (key.type != BTRFS_EXTENT_ITEM_KEY &&
+		    key.type != BTRFS_METADATA_ITEM_KEY)
+			continue;
+		if (btrfs_item_size(leaf, path.slots[0] - 1) < sizeof(*ei))
+			continue;
+		ei = btrfs_item_ptr(leaf, path.slots[0] - 1,
+				    struct btrfs_extent_item);
+		flags = btrfs_extent_flags(leaf, ei);
+		len = key.type == BTRFS_METADATA_ITEM_KEY ? fs_info->nodesize :
+							    key.offset;
+		if (!(flags & BTRFS_EXTENT_FLAG_TREE_BLOCK) && sctx->skip_data)
+			continue;
+		ret = scrub_offline_queue_extent(sctx, key.objectid, len,
+				flags & BTRFS_EXTENT_FLAG_TREE_BLOCK,
+				btrfs_extent_generation(leaf, ei));
+		if (ret < 0)
+			break;
+	}
+	btrfs_release_path(&path);
+	return ret;
+}
+
+int scrub_offline(const char *path, u8 *fsid,
+		  struct scrub_offline_device **devs_ret, int *nr_devs_ret)
+{
+	struct open_ctree_args oca = { 0 };
+	struct btrfs_fs_info *fs_info;
+	struct scrub_offline sctx = { 0 };
+	struct scrub_offline_device *result = NULL;
+	struct btrfs_device *device;
+	u32 nr;
+	int ret = 0;
+	int i;
+
+	oca.filename = path;
+	oca.flags = OPEN_CTREE_LAZY_BLOCK_GROUPS;
+	fs_info = open_ctree_fs_info(&oca);
+	if (!fs_info) {
+		error("cannot open the filesystem on %s", path);
+		return -EIO;
+	}
+	sctx.fs_info = fs_info;
+	sctx.last_full_stripe = (u64)-1;
+	memcpy(fsid, fs_info->super_copy->fsid, BTRFS_FSID_SIZE);
+	if (btrfs_super_flags(fs_info->super_copy) &
+	    (BTRFS_SUPER_FLAG_METADUMP | BTRFS_SUPER_FLAG_METADUMP_V2)) {
+		warning("skipping the data of a metadata dump");
+		sctx.skip_data = true;
+	}
+
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list)
+		sctx.nr_devs++;
+	sctx.devs = calloc(sctx.nr_devs, sizeof(*sctx.devs));
+	result = calloc(sctx.nr_devs, sizeof(*result));
+	if (!sctx.devs || !result) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	i = 0;
+	nr = SCRUB_OFFLINE_JOB_SIZE / fs_info->sectorsize;
+	list_for_each_entry(device, &fs_info->fs_devices->devices, dev_list) {
+		struct scrub_offline_dev *sdev = &sctx.devs[i++];
+
+		sdev->sctx = &sctx;
+		sdev->dev = device;
+		if (device->fd < 0)
+			continue;
+		sdev->buf = malloc(SCRUB_OFFLINE_JOB_SIZE);
+		sdev->cmp_buf = malloc(SCRUB_OFFLINE_JOB_SIZE);
+		sdev->csum_buf = malloc(nr * fs_info->csum_size);
+		sdev->bad = malloc(nr);
+		if (!sdev->buf || !sdev->cmp_buf || !sdev->csum_buf || !sdev->bad) {
+			ret = -ENOMEM;
+			break;
+		}
+		ret = work_queue_init(&sdev->queue, SCRUB_OFFLINE_QUEUE);
+		if (ret < 0)
+			break;
+		ret = pthread_create(&sdev->thread, NULL, scrub_offline_reader,
+				     sdev);
+		if (ret) {
+			ret = -ret;
+			work_queue_release(&sdev->queue);
+			break;
+		}
+		sdev->started = true;
+	}
+
+	if (!ret) {
+		ret = scrub_offline_walk(&sctx);
+		if (ret < 0) {
+			errno = -ret;
+			error("walking the extent tree failed: %m");
+		}
+	}
+
+	for (i = 0; i < sctx.nr_devs; i++) {
+		struct scrub_offline_dev *sdev = &sctx.devs[i];
+
+		if (sdev->started) {
+			scrub_offline_flush(sdev);
+			work_queue_push(&sdev->queue, NULL);
+			pthread_join(sdev->thread, NULL);
+			work_queue_release(&sdev->queue);
+		}
+		scrub_offline_job_free(sdev->open);
+		for (int j = 0; j < sdev->nr_stripes; j++)
+			free(sdev->stripes[j]);
+		free(sdev->stripes);
+		free(sdev->buf);
+		free(sdev->cmp_buf);
+		free(sdev->csum_buf);
+		free(sdev->bad);
+
+		result[i].devid = sdev->dev->devid;
+		strncpy_null(result[i].path, sdev->dev->name ?: "<missing>",
+			     sizeof(result[i].path));
+		result[i].bytes_used = sdev->dev->bytes_used;
+		result[i].missing = sdev->dev->fd < 0;
+		result[i].progress = sdev->progress;
+	}
+
+out:
+	free(sctx.devs);
+	free(sctx.csums);
+	free(sctx.has_csum);
+	close_ctree_fs_info(fs_info);
+	if (ret < 0) {
+		free(result);
+		return ret;
+	}
+	*devs_ret = result;
+	*nr_devs_ret = sctx.nr_devs;
+	return 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_SCRUB_OFFLINE_H__
+#define __BTRFS_SCRUB_OFFLINE_H__
+
+#include "kerncompat.h"
+#include <limits.h>
+#include <stdbool.h>
+#include "kernel-lib/sizes.h"
+#include "kernel-shared/uapi/btrfs.h"
+#include "kernel-shared/uapi/btrfs_tree.h"
+
+/* Largest range read at once from a device */
+#define SCRUB_OFFLINE_JOB_SIZE		(SZ_1M)
+/* Ranges queued to each device reader */
+#define SCRUB_OFFLINE_QUEUE		(64)
+
+/* Result of the scrub of one device, the same counters as the ioctl */
+struct scrub_offline_device {
+	u64 devid;
+	char path[PATH_MAX];
+	u64 bytes_used;
+	bool missing;
+	struct btrfs_scrub_progress progress;
+};
+
+/*
+ * Scrub the unmounted filesystem on @path without the kernel.  One thread per
+ * device reads the metadata and data extents of the device sequentially by
+ * chunks, and verifies the checksums, the tree block headers, the super
+ * blocks, the copies of data without checksums and the RAID5/6 parity.
+ *
+ * The devices are returned in @devs_ret, to be freed by the caller.  Return 0
+ * if the scrub finished, even with errors found, or a negative errno.
+ */
+int scrub_offline(const char *path, u8 *fsid,
+		  struct scrub_offline_device **devs_ret, int *nr_devs_ret);
+
+#endif
@@ -24,10 +24,13 @@
 #include <sys/un.h>
 #include <sys/file.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
 #include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <ctype.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -54,7 +57,10 @@
 #include "common/string-table.h"
 #include "common/string-utils.h"
 #include "common/help.h"
+#include "common/format-output.h"
 #include "cmds/commands.h"
+#include "cmds/scrub-offline.h"
+#include "cmds/scrub-filter.h"
 
 static unsigned unit_mode = UNITS_DEFAULT;
 
@@ -67,6 +73,15 @@ static const char * const scrub_cmd_group_usage[] = {
 #define SCRUB_PROGRESS_SOCKET_PATH "/var/lib/btrfs/scrub.progress"
 #define SCRUB_FILE_VERSION_PREFIX "scrub status"
 #define SCRUB_FILE_VERSION "1"
+#define SCRUB_STATE_FILE "/var/lib/btrfs/scrub.state"
+/* "SCRSTATE" */
+#define SCRUB_STATE_MAGIC 0x4554415453524353ULL
+#define SCRUB_STATE_VERSION 1
+#define SCRUB_SCHEDULE_FILE "/var/lib/btrfs/scrub.schedule"
+#define SCRUB_SCHEDULE_VERSION_PREFIX "scrub schedule"
+#define SCRUB_SCHEDULE_VERSION "1"
+/* Attempts to read a consistent record while it's being updated */
+#define SCRUB_STATE_READ_RETRIES 1000
 
 struct scrub_stats {
 	time_t t_start;
@@ -99,8 +114,58 @@ struct scrub_progress {
 	int ioprio_classdata;
 	u64 old_limit;
 	u64 limit;
+	/* Physical ranges scrubbed one after another with --filter */
+	bool use_ranges;
+	struct scrub_range *ranges;
+	int nr_ranges;
+	/* Sum of the progress of the finished ranges */
+	struct btrfs_scrub_progress passes;
 };
 
+/*
+ * Binary scrub state, the header and a record per device with the same values
+ * as the status file, little-endian.  The records are updated in place through
+ * a shared mapping by the scrub and can be read the same way without parsing.
+ */
+struct scrub_state_header {
+	__le64 magic;
+	__le32 version;
+	__le32 record_size;
+	__le32 nr_records;
+	__le32 reserved;
+	/* Time of the last update of the records */
+	__le64 t_update;
+	u8 fsid[BTRFS_FSID_SIZE];
+	__le64 reserved2[2];
+} __attribute__ ((__packed__));
+
+struct scrub_state_record {
+	/* Odd while the record is being updated */
+	__le64 seq;
+	__le64 devid;
+	__le64 data_extents_scrubbed;
+	__le64 tree_extents_scrubbed;
+	__le64 data_bytes_scrubbed;
+	__le64 tree_bytes_scrubbed;
+	__le64 read_errors;
+	__le64 csum_errors;
+	__le64 verify_errors;
+	__le64 no_csum;
+	__le64 csum_discards;
+	__le64 super_errors;
+	__le64 malloc_errors;
+	__le64 uncorrectable_errors;
+	__le64 corrected_errors;
+	__le64 last_physical;
+	__le64 unverified_errors;
+	__le64 t_start;
+	__le64 t_resumed;
+	__le64 duration;
+	__le64 canceled;
+	__le64 finished;
+	__le64 reserved[2];
+} __attribute__ ((__packed__));
+
 struct scrub_file_record {
 	u8 fsid[BTRFS_FSID_SIZE];
 	u64 devid;
@@ -108,6 +173,23 @@ struct scrub_file_record {
 	struct btrfs_scrub_progress p;
 };
 
+/* Default floor of the scrub limit set by --target-latency */
+#define SCRUB_THROTTLE_LIMIT_MIN	(SZ_1M)
+/* Reads in a cycle needed to trust their average latency */
+#define SCRUB_THROTTLE_MIN_IOS		(16)
+
+/* Latency samples and scrub limit of one device for --target-latency */
+struct scrub_throttle {
+	/* /sys/dev/block/MAJ:MIN/stat of the device */
+	int stat_fd;
+	u64 read_ios;
+	u64 read_ticks;
+	u64 bytes_scrubbed;
+	struct timeval tv;
+	/* Current scrub limit, 0 for unlimited */
+	u64 limit;
+};
+
 struct scrub_progress_cycle {
 	int fdmnt;
 	int prg_fd;
@@ -116,6 +198,13 @@ struct scrub_progress_cycle {
 	struct scrub_progress *progress;
 	struct scrub_progress *shared_progress;
 	pthread_mutex_t *write_mutex;
+	/* Latency-targeted throttling, target in microseconds or 0 if off */
+	u64 target_latency;
+	u64 limit_min;
+	u64 limit_max;
+	struct scrub_throttle *throttle;
+	/* Mapping of the binary state, NULL to write the status file */
+	struct scrub_state_header *state;
 };
 
 struct scrub_fs_stat {
@@ -945,6 +1034,446 @@ out3:
 	return err;
 }
 
+static struct scrub_state_record *scrub_state_record(
+		struct scrub_state_header *state, int i)
+{
+	return (struct scrub_state_record *)(state + 1) + i;
+}
+
+static size_t scrub_state_size(int n)
+{
+	return sizeof(struct scrub_state_header) +
+	       n * sizeof(struct scrub_state_record);
+}
+
+#define _SCRUB_STATE_SET(rec, name, use)				\
+	rec->name = cpu_to_le64(use->scrub_args.progress.name)
+#define _SCRUB_STATE_SET_STATS(rec, name, use)				\
+	rec->name = cpu_to_le64(use->stats.name)
+
+/*
+ * Update the records of the binary state in place, a reader sees the sequence
+ * number odd or changed while a record is updated.  Called only by one thread
+ * at a time.
+ */
+static void scrub_state_update(struct scrub_state_header *state,
+			       struct scrub_progress *data, int n)
+{
+	struct scrub_progress local;
+	struct scrub_progress *use;
+	int old;
+
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	for (int i = 0; i < n; i++) {
+		struct scrub_state_record *rec = scrub_state_record(state, i);
+		u64 seq = le64_to_cpu(rec->seq);
+
+		__atomic_store_n(&rec->seq, cpu_to_le64(seq + 1),
+				 __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		use = scrub_resumed_stats(&data[i], &local);
+		rec->devid = cpu_to_le64(use->scrub_args.devid);
+		_SCRUB_STATE_SET(rec, data_extents_scrubbed, use);
+		_SCRUB_STATE_SET(rec, tree_extents_scrubbed, use);
+		_SCRUB_STATE_SET(rec, data_bytes_scrubbed, use);
+		_SCRUB_STATE_SET(rec, tree_bytes_scrubbed, use);
+		_SCRUB_STATE_SET(rec, read_errors, use);
+		_SCRUB_STATE_SET(rec, csum_errors, use);
+		_SCRUB_STATE_SET(rec, verify_errors, use);
+		_SCRUB_STATE_SET(rec, no_csum, use);
+		_SCRUB_STATE_SET(rec, csum_discards, use);
+		_SCRUB_STATE_SET(rec, super_errors, use);
+		_SCRUB_STATE_SET(rec, malloc_errors, use);
+		_SCRUB_STATE_SET(rec, uncorrectable_errors, use);
+		_SCRUB_STATE_SET(rec, corrected_errors, use);
+		_SCRUB_STATE_SET(rec, last_physical, use);
+		/* Not kept by the status file and the resumed stats */
+		rec->unverified_errors = cpu_to_le64(
+			data[i].scrub_args.progress.unverified_errors);
+		_SCRUB_STATE_SET_STATS(rec, t_start, use);
+		_SCRUB_STATE_SET_STATS(rec, t_resumed, use);
+		_SCRUB_STATE_SET_STATS(rec, duration, use);
+		_SCRUB_STATE_SET_STATS(rec, canceled, use);
+		_SCRUB_STATE_SET_STATS(rec, finished, use);
+		__atomic_store_n(&rec->seq, cpu_to_le64(seq + 2),
+				 __ATOMIC_RELEASE);
+	}
+	state->t_update = cpu_to_le64(time(NULL));
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+}
+
+/*
+ * Create the binary state of the @n devices of the filesystem @fsid and return
+ * its shared mapping.  It's created under a temporary name and renamed when
+ * complete, so a reader never sees a partial header.
+ */
+static struct scrub_state_header *scrub_state_create(const char *fsid,
+						     const u8 *fsid_bin,
+						     struct scrub_progress *data,
+						     int n)
+{
+	char path[PATH_MAX];
+	struct scrub_state_header *state;
+	size_t size = scrub_state_size(n);
+	int fd;
+	int ret;
+
+	ret = scrub_datafile(SCRUB_STATE_FILE, fsid, "tmp", path, sizeof(path));
+	if (ret < 0)
+		return ERR_PTR(ret);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return ERR_PTR(-errno);
+	if (ftruncate(fd, size) < 0) {
+		ret = -errno;
+		close(fd);
+		return ERR_PTR(ret);
+	}
+	state = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	ret = -errno;
+	close(fd);
+	if (state == MAP_FAILED)
+		return ERR_PTR(ret);
+
+	state->magic = cpu_to_le64(SCRUB_STATE_MAGIC);
+	state->version = cpu_to_le32(SCRUB_STATE_VERSION);
+	state->record_size = cpu_to_le32(sizeof(struct scrub_state_record));
+	state->nr_records = cpu_to_le32(n);
+	memcpy(state->fsid, fsid_bin, BTRFS_FSID_SIZE);
+	scrub_state_update(state, data, n);
+
+	ret = scrub_rename_file(SCRUB_STATE_FILE, fsid, "tmp");
+	if (ret < 0) {
+		munmap(state, size);
+		return ERR_PTR(ret);
+	}
+	return state;
+}
+
+#define _SCRUB_STATE_GET(rec, name, dest)				\
+	dest->p.name = le64_to_cpu(rec->name)
+#define _SCRUB_STATE_GET_STATS(rec, name, dest)			\
+	dest->stats.name = le64_to_cpu(rec->name)
+
+static void scrub_state_read_record(const struct scrub_state_record *rec,
+				    struct scrub_file_record *dest)
+{
+	struct scrub_state_record copy;
+	u64 seq;
+
+	for (int retry = 0; retry < SCRUB_STATE_READ_RETRIES; retry++) {
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		memcpy(&copy, rec, sizeof(copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (!(le64_to_cpu(seq) & 1) &&
+		    __atomic_load_n(&rec->seq, __ATOMIC_RELAXED) == seq)
+			break;
+		sched_yield();
+	}
+
+	dest->devid = le64_to_cpu(copy.devid);
+	_SCRUB_STATE_GET((&copy), data_extents_scrubbed, dest);
+	_SCRUB_STATE_GET((&copy), tree_extents_scrubbed, dest);
+	_SCRUB_STATE_GET((&copy), data_bytes_scrubbed, dest);
+	_SCRUB_STATE_GET((&copy), tree_bytes_scrubbed, dest);
+	_SCRUB_STATE_GET((&copy), read_errors, dest);
+	_SCRUB_STATE_GET((&copy), csum_errors, dest);
+	_SCRUB_STATE_GET((&copy), verify_errors, dest);
+	_SCRUB_STATE_GET((&copy), no_csum, dest);
+	_SCRUB_STATE_GET((&copy), csum_discards, dest);
+	_SCRUB_STATE_GET((&copy), super_errors, dest);
+	_SCRUB_STATE_GET((&copy), malloc_errors, dest);
+	_SCRUB_STATE_GET((&copy), uncorrectable_errors, dest);
+	_SCRUB_STATE_GET((&copy), corrected_errors, dest);
+	_SCRUB_STATE_GET((&copy), last_physical, dest);
+	_SCRUB_STATE_GET((&copy), unverified_errors, dest);
+	_SCRUB_STATE_GET_STATS((&copy), t_start, dest);
+	_SCRUB_STATE_GET_STATS((&copy), t_resumed, dest);
+	_SCRUB_STATE_GET_STATS((&copy), duration, dest);
+	_SCRUB_STATE_GET_STATS((&copy), canceled, dest);
+	_SCRUB_STATE_GET_STATS((&copy), finished, dest);
+}
+
+/*
+ * Read the last scrub of the filesystem @fsid from the binary state if it's
+ * valid and not older than the status file, which could have been written by
+ * a version without the binary state.  Return NULL if it can't be used.
+ */
+static struct scrub_file_record **scrub_read_state(const char *fsid)
+{
+	char path[PATH_MAX];
+	struct scrub_file_record **p = NULL;
+	struct scrub_state_header *state;
+	struct stat st;
+	size_t size;
+	int nr;
+	int fd;
+
+	if (scrub_datafile(SCRUB_STATE_FILE, fsid, NULL, path, sizeof(path)))
+		return NULL;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(*state)) {
+		close(fd);
+		return NULL;
+	}
+	size = st.st_size;
+	state = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (state == MAP_FAILED)
+		return NULL;
+
+	nr = le32_to_cpu(state->nr_records);
+	if (le64_to_cpu(state->magic) != SCRUB_STATE_MAGIC ||
+	    le32_to_cpu(state->version) != SCRUB_STATE_VERSION ||
+	    le32_to_cpu(state->record_size) != sizeof(struct scrub_state_record) ||
+	    size < scrub_state_size(nr))
+		goto out;
+
+	if (scrub_datafile(SCRUB_DATA_FILE, fsid, NULL, path, sizeof(path)) == 0 &&
+	    stat(path, &st) == 0 && st.st_mtime > le64_to_cpu(state->t_update))
+		goto out;
+
+	p = calloc(nr + 1, sizeof(*p));
+	if (!p)
+		goto out;
+	for (int i = 0; i < nr; i++) {
+		p[i] = calloc(1, sizeof(**p));
+		if (!p[i]) {
+			free_history(p);
+			p = NULL;
+			goto out;
+		}
+		memcpy(p[i]->fsid, state->fsid, BTRFS_FSID_SIZE);
+		scrub_state_read_record(scrub_state_record(state, i), p[i]);
+	}
+out:
+	munmap(state, size);
+	return p;
+}
+
+static u64 read_scrub_device_limit(int fd, u64 devid)
+{
+	char path[PATH_MAX] = { 0 };
+	u64 limit;
+	int ret;
+
+	/* /sys/fs/btrfs/FSID/devinfo/1/scrub_speed_max */
+	snprintf(path, sizeof(path), "devinfo/%llu/scrub_speed_max", devid);
+	ret = sysfs_read_fsid_file_u64(fd, path, &limit);
+	if (ret < 0)
+		limit = 0;
+	return limit;
+}
+
+static u64 write_scrub_device_limit(int fd, u64 devid, u64 limit)
+{
+	char path[PATH_MAX] = { 0 };
+	int ret;
+
+	/* /sys/fs/btrfs/FSID/devinfo/1/scrub_speed_max */
+	snprintf(path, sizeof(path), "devinfo/%llu/scrub_speed_max", devid);
+	ret = sysfs_write_fsid_file_u64(fd, path, limit);
+	return ret;
+}
+
+static void scrub_reset_device_limit(int fd, u64 devid, u64 old_limit)
+{
+	int ret;
+
+	ret = write_scrub_device_limit(fd, devid, old_limit);
+	if (ret < 0) {
+		errno = -ret;
+		warning("failed to reset scrub throughput limit on devid %llu: %m",
+			devid);
+	}
+}
+
+/*
+ * Open the statistics of the block device of @path, the file descriptor or -1
+ * if it's not a block device.
+ */
+static int scrub_throttle_open(const char *path)
+{
+	char stat_path[PATH_MAX];
+	struct stat st;
+
+	if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+		return -1;
+	/* /sys/dev/block/MAJ:MIN/stat, also for partitions */
+	snprintf(stat_path, sizeof(stat_path), "/sys/dev/block/%u:%u/stat",
+		 major(st.st_rdev), minor(st.st_rdev));
+	return open(stat_path, O_RDONLY);
+}
+
+static int scrub_throttle_sample(struct scrub_throttle *st, u64 *read_ios,
+				 u64 *read_ticks)
+{
+	char buf[256];
+	int ret;
+
+	ret = sysfs_read_file(st->stat_fd, buf, sizeof(buf) - 1);
+	if (ret < 0)
+		return ret;
+	/* Read I/Os, read merges, read sectors, read ticks in milliseconds */
+	if (sscanf(buf, "%llu %*u %*u %llu", read_ios, read_ticks) != 2)
+		return -EINVAL;
+	return 0;
+}
+
+static int scrub_throttle_init(struct scrub_throttle *st, const char *path,
+			       u64 limit)
+{
+	memset(st, 0, sizeof(*st));
+	st->limit = limit;
+	st->stat_fd = scrub_throttle_open(path);
+	if (st->stat_fd < 0)
+		return -ENODEV;
+	gettimeofday(&st->tv, NULL);
+	return scrub_throttle_sample(st, &st->read_ios, &st->read_ticks);
+}
+
+/*
+ * Adjust the scrub limit of the device of @sp to the average latency of the
+ * reads of its block device since the last cycle, the scrub reads included.
+ *
+ * Above the target latency the limit is halved, down to the minimum, starting
+ * from the current rate of the scrub if it's unlimited.  Below 3/4 of the
+ * target it's raised by a quarter, up to the --limit if set, otherwise it's
+ * removed once the scrub doesn't use half of it.  In between it's kept.
+ */
+static void scrub_throttle_device(struct scrub_progress_cycle *spc,
+				  struct scrub_progress *sp,
+				  struct scrub_throttle *st)
+{
+	struct btrfs_scrub_progress *p = &sp->scrub_args.progress;
+	struct timeval tv;
+	u64 read_ios;
+	u64 read_ticks;
+	u64 bytes;
+	u64 elapsed;
+	u64 rate = 0;
+	u64 latency = 0;
+	u64 limit = st->limit;
+	int ret;
+
+	ret = scrub_throttle_sample(st, &read_ios, &read_ticks);
+	if (ret < 0)
+		return;
+	gettimeofday(&tv, NULL);
+	elapsed = (tv.tv_sec - st->tv.tv_sec) * 1000000 +
+		  tv.tv_usec - st->tv.tv_usec;
+	bytes = p->data_bytes_scrubbed + p->tree_bytes_scrubbed;
+	if (elapsed && bytes > st->bytes_scrubbed)
+		rate = (bytes - st->bytes_scrubbed) * 1000000 / elapsed;
+	/* Too few reads to tell, the device is idle */
+	if (read_ios - st->read_ios >= SCRUB_THROTTLE_MIN_IOS)
+		latency = (read_ticks - st->read_ticks) * 1000 /
+			  (read_ios - st->read_ios);
+
+	st->read_ios = read_ios;
+	st->read_ticks = read_ticks;
+	st->bytes_scrubbed = bytes;
+	st->tv = tv;
+
+	if (latency > spc->target_latency) {
+		if (!limit)
+			limit = rate;
+		limit = max(limit / 2, spc->limit_min);
+	} else if (latency < spc->target_latency * 3 / 4 && limit) {
+		limit += max(limit / 4, spc->limit_min);
+		if (spc->limit_max)
+			limit = min(limit, spc->limit_max);
+		else if (limit > rate * 2)
+			limit = 0;
+	}
+	if (limit == st->limit)
+		return;
+
+	pr_verbose(LOG_VERBOSE,
+		   "devid %llu: read latency %lluus, scrub limit %s%s\n",
+		   sp->scrub_args.devid, latency,
+		   limit ? pretty_size(limit) : "unlimited", limit ? "/s" : "");
+	ret = write_scrub_device_limit(spc->fdmnt, sp->scrub_args.devid, limit);
+	if (ret < 0)
+		return;
+	st->limit = limit;
+}
+
+static void scrub_progress_add(struct btrfs_scrub_progress *dest,
+			       const struct btrfs_scrub_progress *src)
+{
+	dest->data_extents_scrubbed += src->data_extents_scrubbed;
+	dest->tree_extents_scrubbed += src->tree_extents_scrubbed;
+	dest->data_bytes_scrubbed += src->data_bytes_scrubbed;
+	dest->tree_bytes_scrubbed += src->tree_bytes_scrubbed;
+	dest->read_errors += src->read_errors;
+	dest->csum_errors += src->csum_errors;
+	dest->verify_errors += src->verify_errors;
+	dest->no_csum += src->no_csum;
+	dest->csum_discards += src->csum_discards;
+	dest->super_errors += src->super_errors;
+	dest->malloc_errors += src->malloc_errors;
+	dest->uncorrectable_errors += src->uncorrectable_errors;
+	dest->corrected_errors += src->corrected_errors;
+	dest->last_physical = src->last_physical;
+}
+
+/*
+ * Scrub the ranges of the device one after another, the progress is the sum of
+ * all of them.
+ */
+static int scrub_one_dev_ranges(struct scrub_progress *sp)
+{
+	int ret = 0;
+
+	for (int i = 0; i < sp->nr_ranges; i++) {
+		int err;
+
+		sp->scrub_args.start = sp->ranges[i].start;
+		sp->scrub_args.end = sp->ranges[i].end;
+		memset(&sp->scrub_args.progress, 0,
+		       sizeof(sp->scrub_args.progress));
+		ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
+		err = errno;
+		pthread_mutex_lock(&sp->progress_mutex);
+		scrub_progress_add(&sp->passes, &sp->scrub_args.progress);
+		pthread_mutex_unlock(&sp->progress_mutex);
+		if (ret) {
+			errno = err;
+			break;
+		}
+	}
+	sp->scrub_args.progress = sp->passes;
+	return ret;
+}
+
+/*
+ * Add the progress of the finished ranges to the progress @sp of the range
+ * being scrubbed.
+ */
+static int scrub_add_passes(struct scrub_progress *sp,
+			    struct scrub_progress *sp_shared)
+{
+	u64 last_physical = sp->scrub_args.progress.last_physical;
+	int old;
+	int ret;
+
+	ret = pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old);
+	if (ret)
+		return ret;
+	ret = pthread_mutex_lock(&sp_shared->progress_mutex);
+	if (ret)
+		return ret;
+	scrub_progress_add(&sp->scrub_args.progress, &sp_shared->passes);
+	sp->scrub_args.progress.last_physical = last_physical;
+	ret = pthread_mutex_unlock(&sp_shared->progress_mutex);
+	if (ret)
+		return ret;
+	return pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old);
+}
+
 static void *scrub_one_dev(void *ctx)
 {
 	struct scrub_progress *sp = ctx;
@@ -961,7 +1490,10 @@ static void *scrub_one_dev(void *ctx)
 	if (ret)
 		warning("setting ioprio failed: %m (ignored)");
 
-	ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
+	if (sp->use_ranges)
+		ret = scrub_one_dev_ranges(sp);
+	else
+		ret = ioctl(sp->fd, BTRFS_IOC_SCRUB, &sp->scrub_args);
 	gettimeofday(&tv, NULL);
 	sp->ret = ret;
 	sp->stats.duration = tv.tv_sec - sp->stats.t_start;
@@ -1058,6 +1590,11 @@ static void *scrub_progress_cycle(void *ctx)
 				continue;
 			progress_one_dev(sp);
 			sp->stats.duration = tv.tv_sec - sp->stats.t_start;
+			if (!sp->ret && sp_shared->use_ranges) {
+				perr = scrub_add_passes(sp, sp_shared);
+				if (perr)
+					goto out;
+			}
 			if (!sp->ret)
 				continue;
 			if (sp->ioctl_errno != ENOTCONN &&
@@ -1100,6 +1637,13 @@ static void *scrub_progress_cycle(void *ctx)
 			memcpy(sp, sp_shared, sizeof(*sp));
 			memcpy(sp_last, sp_shared, sizeof(*sp));
 		}
+		for (i = 0; spc->throttle && i < ndev; ++i) {
+			sp = &spc->progress[this * ndev + i];
+			if (sp->skip || sp->stats.finished ||
+			    spc->throttle[i].stat_fd < 0)
+				continue;
+			scrub_throttle_device(spc, sp, &spc->throttle[i]);
+		}
 		if (peer_fd != -1) {
 			write_poll_fd.fd = peer_fd;
 			ret = poll(&write_poll_fd, 1, 0);
@@ -1119,6 +1663,11 @@ static void *scrub_progress_cycle(void *ctx)
 		}
 		if (!spc->do_record)
 			continue;
+		if (spc->state) {
+			scrub_state_update(spc->state,
+					   &spc->progress[this * ndev], ndev);
+			continue;
+		}
 		ret = scrub_write_progress(spc->write_mutex, fsid,
 					   &spc->progress[this * ndev], ndev);
 		if (ret)
@@ -1147,6 +1696,36 @@ static struct scrub_file_record *last_dev_scrub(
 	return NULL;
 }
 
+/*
+ * Read the last scrub of each device of @fsid, from the binary state or the
+ * status file
+ */
+static struct scrub_file_record **scrub_read_history(const char *fsid)
+{
+	struct scrub_file_record **past_scrubs;
+	int fdres;
+
+	past_scrubs = scrub_read_state(fsid);
+	if (past_scrubs)
+		return past_scrubs;
+
+	fdres = scrub_open_file_r(SCRUB_DATA_FILE, fsid);
+	if (fdres < 0) {
+		if (fdres != -ENOENT) {
+			errno = -fdres;
+			warning("failed to open status file: %m");
+		}
+		return NULL;
+	}
+	past_scrubs = scrub_read_file(fdres, 1);
+	if (IS_ERR(past_scrubs)) {
+		errno = -PTR_ERR(past_scrubs);
+		warning("failed to read status file: %m");
+	}
+	close(fdres);
+	return past_scrubs;
+}
+
 static int mkdir_p(char *path)
 {
 	int i;
@@ -1204,29 +1783,114 @@ static int is_scrub_running_in_kernel(int fd,
 	return 0;
 }
 
-static u64 read_scrub_device_limit(int fd, u64 devid)
+/*
+ * Scrub the unmounted filesystem on @path by scrub_offline() and print the
+ * result like a scrub started with -B.
+ */
+static int scrub_start_offline(const char *path, bool do_stats_per_dev,
+			       bool print_raw)
 {
-	char path[PATH_MAX] = { 0 };
-	u64 limit;
+	struct scrub_offline_device *devs = NULL;
+	struct scrub_fs_stat fs_stat;
+	struct scrub_stats ss = { 0 };
+	u8 fsid[BTRFS_FSID_SIZE];
+	char fsid_str[BTRFS_UUID_UNPARSED_SIZE];
+	u64 total_bytes_scrubbed = 0;
+	int e_uncorrectable = 0;
+	int e_errors = 0;
+	int nr_devs;
 	int ret;
 
-	/* /sys/fs/btrfs/FSID/devinfo/1/scrub_speed_max */
-	snprintf(path, sizeof(path), "devinfo/%llu/scrub_speed_max", devid);
-	ret = sysfs_read_fsid_file_u64(fd, path, &limit);
+	ret = check_mounted(path);
+	if (ret < 0) {
+		errno = -ret;
+		error("could not check mount status of %s: %m", path);
+		return 1;
+	}
+	if (ret) {
+		error("%s is mounted, the offline scrub needs an unmounted filesystem",
+		      path);
+		return 1;
+	}
+
+	ss.t_start = time(NULL);
+	ret = scrub_offline(path, fsid, &devs, &nr_devs);
 	if (ret < 0)
-		limit = 0;
-	return limit;
+		return 1;
+	ss.duration = time(NULL) - ss.t_start;
+	ss.finished = 1;
+	uuid_unparse(fsid, fsid_str);
+
+	if (!do_stats_per_dev)
+		init_fs_stat(&fs_stat);
+	for (int i = 0; i < nr_devs; i++) {
+		struct btrfs_scrub_progress *p = &devs[i].progress;
+
+		if (devs[i].missing) {
+			warning("device %llu not present", devs[i].devid);
+			continue;
+		}
+		if (p->uncorrectable_errors)
+			e_uncorrectable++;
+		if (p->read_errors || p->csum_errors || p->verify_errors ||
+		    p->super_errors)
+			e_errors++;
+		if (do_stats_per_dev) {
+			struct btrfs_ioctl_dev_info_args di = { 0 };
+
+			di.devid = devs[i].devid;
+			di.bytes_used = devs[i].bytes_used;
+			strncpy_null((char *)di.path, devs[i].path, sizeof(di.path));
+			print_scrub_dev(&di, p, print_raw, "done", &ss, 0);
+		} else {
+			add_to_fs_stat(p, &ss, &fs_stat);
+		}
+		total_bytes_scrubbed += p->data_bytes_scrubbed +
+					p->tree_bytes_scrubbed;
+	}
+	if (!do_stats_per_dev) {
+		pr_verbose(LOG_DEFAULT, "scrub done for %s\n", fsid_str);
+		print_fs_stat(&fs_stat, print_raw, total_bytes_scrubbed, nr_devs, 0);
+	}
+	free(devs);
+
+	if (e_uncorrectable) {
+		error("there are %d uncorrectable errors", e_uncorrectable);
+		return 3;
+	}
+	if (e_errors)
+		warning("errors detected during scrubbing, not corrected by the offline scrub");
+	return 0;
 }
 
-static u64 write_scrub_device_limit(int fd, u64 devid, u64 limit)
+/*
+ * Parse the latency of --target-latency to microseconds, a number followed by
+ * "us", "ms" (the default) or "s".
+ */
+static u64 parse_scrub_latency(const char *str)
 {
-	char path[PATH_MAX] = { 0 };
-	int ret;
-
-	/* /sys/fs/btrfs/FSID/devinfo/1/scrub_speed_max */
-	snprintf(path, sizeof(path), "devinfo/%llu/scrub_speed_max", devid);
-	ret = sysfs_write_fsid_file_u64(fd, path, limit);
-	return ret;
+	char *end;
+	u64 value;
+
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno || end == str || str[0] == '-')
+		goto invalid;
+	if (strcmp(end, "us") == 0)
+		;
+	else if (*end == 0 || strcmp(end, "ms") == 0)
+		value *= 1000;
+	else if (strcmp(end, "s") == 0)
+		value *= 1000000;
+	else
+		goto invalid;
+	if (!value)
+		goto invalid;
+	return value;
+
+invalid:
+	error("invalid latency: %s", str);
+	exit(1);
 }
 
 static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
@@ -1234,7 +1898,6 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 {
 	int fdmnt;
 	int prg_fd = -1;
-	int fdres = -1;
 	int ret;
 	pid_t pid;
 	int i;
@@ -1272,15 +1935,34 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 	pthread_mutex_t spc_write_mutex = PTHREAD_MUTEX_INITIALIZER;
 	void *terr;
 	u64 throughput_limit = 0;
+	u64 target_latency = 0;
+	u64 limit_min = SCRUB_THROTTLE_LIMIT_MIN;
 	u64 devid;
 	bool force = false;
 	bool nothing_to_resume = false;
+	bool offline = false;
+	struct scrub_filter *filters = NULL;
+	int nr_filters = 0;
+	bool prioritize = false;
 
 	while (1) {
 		int c;
-		enum { GETOPT_VAL_LIMIT = GETOPT_VAL_FIRST };
+		enum {
+			GETOPT_VAL_LIMIT = GETOPT_VAL_FIRST,
+			GETOPT_VAL_OFFLINE,
+			GETOPT_VAL_TARGET_LATENCY,
+			GETOPT_VAL_LIMIT_MIN,
+			GETOPT_VAL_FILTER,
+			GETOPT_VAL_PRIORITIZE,
+		};
 		static const struct option long_options[] = {
 			{"limit", required_argument, NULL, GETOPT_VAL_LIMIT},
+			{"offline", no_argument, NULL, GETOPT_VAL_OFFLINE},
+			{"target-latency", required_argument, NULL,
+				GETOPT_VAL_TARGET_LATENCY},
+			{"limit-min", required_argument, NULL, GETOPT_VAL_LIMIT_MIN},
+			{"filter", required_argument, NULL, GETOPT_VAL_FILTER},
+			{"prioritize", no_argument, NULL, GETOPT_VAL_PRIORITIZE},
 			{ NULL, 0, NULL, 0 }
 		};
 
@@ -1317,17 +1999,75 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 		case GETOPT_VAL_LIMIT:
 			throughput_limit = arg_strtou64_with_suffix(optarg);
 			break;
-		default:
-			usage_unknown_option(cmd, argv);
-		}
-	}
+		case GETOPT_VAL_OFFLINE:
+			if (resume) {
+				error("resume does not support --offline");
+				goto out_filters;
+			}
+			offline = true;
+			break;
+		case GETOPT_VAL_TARGET_LATENCY:
+			target_latency = parse_scrub_latency(optarg);
+			break;
+		case GETOPT_VAL_LIMIT_MIN:
+			limit_min = arg_strtou64_with_suffix(optarg);
+			if (!limit_min) {
+				error("--limit-min must be greater than 0");
+				goto out_filters;
+			}
+			break;
+		case GETOPT_VAL_FILTER: {
+			struct scrub_filter *tmp;
+
+			if (resume) {
+				error("resume does not support --filter");
+				goto out_filters;
+			}
+			tmp = realloc(filters, (nr_filters + 1) * sizeof(*tmp));
+			if (!tmp) {
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				goto out_filters;
+			}
+			filters = tmp;
+			if (scrub_parse_filter(optarg, &filters[nr_filters]))
+				goto out_filters;
+			nr_filters++;
+			break;
+		}
+		case GETOPT_VAL_PRIORITIZE:
+			prioritize = true;
+			break;
+		default:
+			usage_unknown_option(cmd, argv);
+		}
+	}
 
 	/* try to catch most error cases before forking */
 
 	if (check_argc_exact(argc - optind, 1))
-		return 1;
+		goto out_filters;
+
+	if (offline) {
+		if (throughput_limit || target_latency || nr_filters) {
+			error("--limit, --target-latency and --filter are not supported by --offline");
+			goto out_filters;
+		}
+		return scrub_start_offline(argv[optind], do_stats_per_dev,
+					   print_raw);
+	}
+
+	if (target_latency && throughput_limit && throughput_limit < limit_min) {
+		error("--limit must not be lower than --limit-min");
+		goto out_filters;
+	}
+	if (prioritize && !nr_filters) {
+		error("--prioritize needs --filter");
+		goto out_filters;
+	}
 
 	spc.progress = NULL;
+	spc.throttle = NULL;
+	spc.state = NULL;
 	if (bconf.verbose == BTRFS_BCONF_QUIET && do_print)
 		do_print = false;
 
@@ -1341,7 +2081,7 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 
 	fdmnt = btrfs_open_mnt(path);
 	if (fdmnt < 0)
-		return 1;
+		goto out_filters;
 
 	ret = get_fs_info(path, &fi_args, &di_args);
 	if (ret) {
@@ -1357,18 +2097,7 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 	}
 
 	uuid_unparse(fi_args.fsid, fsid);
-	fdres = scrub_open_file_r(SCRUB_DATA_FILE, fsid);
-	if (fdres < 0 && fdres != -ENOENT) {
-		errno = -fdres;
-		warning("failed to open status file: %m");
-	} else if (fdres >= 0) {
-		past_scrubs = scrub_read_file(fdres, 1);
-		if (IS_ERR(past_scrubs)) {
-			errno = -PTR_ERR(past_scrubs);
-			warning("failed to read status file: %m");
-		}
-		close(fdres);
-	}
+	past_scrubs = scrub_read_history(fsid);
 
 	/*
 	 * Check for stale information in the status file, ie. if it's
@@ -1401,12 +2130,64 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 	sp = calloc(fi_args.num_devices, sizeof(*sp));
 	spc.progress = calloc(fi_args.num_devices * 2, sizeof(*spc.progress));
 
-	if (!t_devs || !sp || !spc.progress) {
+	if (target_latency)
+		spc.throttle = calloc(fi_args.num_devices, sizeof(*spc.throttle));
+
+	if (!t_devs || !sp || !spc.progress ||
+	    (target_latency && !spc.throttle)) {
 		error("scrub failed: %m");
 		err = 1;
 		goto out;
 	}
 
+	for (i = 0; spc.throttle && i < fi_args.num_devices; ++i) {
+		ret = scrub_throttle_init(&spc.throttle[i],
+					  (const char *)di_args[i].path,
+					  throughput_limit);
+		if (ret < 0) {
+			errno = -ret;
+			warning("cannot read the latency of devid %llu, not throttled: %m",
+				di_args[i].devid);
+			if (spc.throttle[i].stat_fd >= 0)
+				close(spc.throttle[i].stat_fd);
+			spc.throttle[i].stat_fd = -1;
+		}
+	}
+
+	if (nr_filters) {
+		struct scrub_filter_bg *bgs = NULL;
+		int nr_bgs;
+		int nr_total;
+
+		ret = scrub_filter_block_groups(fdmnt, filters, nr_filters,
+						&bgs, &nr_bgs, &nr_total);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot select the block groups to scrub: %m");
+			err = 1;
+			goto out;
+		}
+		pr_verbose(LOG_DEFAULT,
+			   "scrub: %d of %d block groups selected%s\n",
+			   nr_bgs, nr_total, prioritize ? ", scrubbed first" : "");
+		for (i = 0; i < fi_args.num_devices; ++i) {
+			sp[i].use_ranges = true;
+			ret = scrub_filter_device_ranges(fdmnt, di_args[i].devid,
+							 bgs, nr_bgs, prioritize,
+							 &sp[i].ranges,
+							 &sp[i].nr_ranges);
+			if (ret < 0)
+				break;
+		}
+		free(bgs);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot read the device extents to scrub: %m");
+			err = 1;
+			goto out;
+		}
+	}
+
 	for (i = 0; i < fi_args.num_devices; ++i) {
 		devid = di_args[i].devid;
 		sp[i].old_limit = read_scrub_device_limit(fdmnt, devid);
@@ -1509,6 +2290,20 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 		}
 	}
 
+	if (do_record) {
+		/*
+		 * The progress is updated in the binary state, the status
+		 * file is written only at the start and the end.
+		 */
+		spc.state = scrub_state_create(fsid, fi_args.fsid, sp,
+					       fi_args.num_devices);
+		if (IS_ERR(spc.state)) {
+			errno = -PTR_ERR(spc.state);
+			warning("failed to create the binary scrub state: %m, updating the status file");
+			spc.state = NULL;
+		}
+	}
+
 	if (do_background) {
 		pid = fork();
 		if (pid == -1) {
@@ -1583,6 +2378,9 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 	spc.write_mutex = &spc_write_mutex;
 	spc.shared_progress = sp;
 	spc.fi = &fi_args;
+	spc.target_latency = target_latency;
+	spc.limit_min = limit_min;
+	spc.limit_max = throughput_limit;
 	ret = pthread_create(&t_prog, NULL, scrub_progress_cycle, &spc);
 	if (ret) {
 		if (do_print) {
@@ -1595,13 +2393,13 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 
 	err = 0;
 	for (i = 0; i < fi_args.num_devices; ++i) {
-		/* Revert to the older scrub limit. */
-		ret = write_scrub_device_limit(fdmnt, di_args[i].devid, sp[i].old_limit);
-		if (ret < 0) {
-			errno = -ret;
-			warning("failed to reset scrub throughput limit on devid %llu: %m",
-				di_args[i].devid);
-		}
+		/*
+		 * Revert to the older scrub limit, with --target-latency once
+		 * the progress thread stopped adjusting it.
+		 */
+		if (!spc.throttle)
+			scrub_reset_device_limit(fdmnt, di_args[i].devid,
+						 sp[i].old_limit);
 
 		if (sp[i].skip)
 			continue;
@@ -1687,6 +2485,10 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 	if (!ret)
 		ret = pthread_join(t_prog, &terr);
 
+	for (i = 0; spc.throttle && i < fi_args.num_devices; ++i)
+		scrub_reset_device_limit(fdmnt, di_args[i].devid,
+					 sp[i].old_limit);
+
 	/* check for errors from the handling of the progress thread */
 	if (do_print && ret) {
 		errno = ret;
@@ -1700,6 +2502,8 @@ static int scrub_start(const struct cmd_struct *cmd, int argc, char **argv,
 	}
 
 	if (do_record) {
+		if (spc.state)
+			scrub_state_update(spc.state, sp, fi_args.num_devices);
 		ret = scrub_write_progress(&spc_write_mutex, fsid, sp,
 					   fi_args.num_devices);
 		if (ret && do_print) {
@@ -1714,8 +2518,18 @@ out:
 	free_history(past_scrubs);
 	free(di_args);
 	free(t_devs);
+	for (i = 0; sp && i < fi_args.num_devices; ++i)
+		free(sp[i].ranges);
 	free(sp);
 	free(spc.progress);
+	for (i = 0; spc.throttle && i < fi_args.num_devices; ++i) {
+		if (spc.throttle[i].stat_fd >= 0)
+			close(spc.throttle[i].stat_fd);
+	}
+	free(spc.throttle);
+	if (spc.state)
+		munmap(spc.state, scrub_state_size(fi_args.num_devices));
+	free(filters);
 	if (prg_fd > -1) {
 		close(prg_fd);
 		if (sock_path[0])
@@ -1735,6 +2549,10 @@ out:
 		warning("errors detected during scrubbing, %d corrected", e_correctable);
 
 	return 0;
+
+out_filters:
+	free(filters);
+	return 1;
 }
 
 static const char * const cmd_scrub_start_usage[] = {
@@ -1749,6 +2567,20 @@ static const char * const cmd_scrub_start_usage[] = {
 	OPTLINE("-n", "set ioprio classdata (see ionice(1) manpage)"),
 	OPTLINE("-f", "force starting new scrub even if a scrub is already running this is useful when scrub stats record file is damaged"),
 	OPTLINE("--limit", "set the throughput limit for each device"),
+	OPTLINE("--target-latency TIME", "adjust the limit of each device to keep "
+		"the average read latency of the device under TIME (us, ms or s "
+		"suffix, default ms), --limit is the highest limit"),
+	OPTLINE("--limit-min SIZE", "lowest limit set by --target-latency "
+		"(default 1MiB)"),
+	OPTLINE("--filter FILTERS", "scrub only the block groups matching the "
+		"FILTERS, comma separated: profiles=P1|P2, usage=MIN..MAX, "
+		"generation=GEN (extents newer than GEN, scrubbed newest first), "
+		"vrange=START..END, can be repeated to match any"),
+	OPTLINE("--prioritize", "scrub the block groups of --filter first, then "
+		"the rest of the devices"),
+	OPTLINE("--offline", "scrub the unmounted filesystem on <device> without "
+		"the kernel, read only and in the foreground, one thread reads "
+		"each device"),
 	OPTLINE("-q", "deprecated, alias for global -q option"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_QUIET,
@@ -1831,6 +2663,687 @@ static int cmd_scrub_resume(const struct cmd_struct *cmd, int argc, char **argv)
 }
 static DEFINE_SIMPLE_COMMAND(scrub_resume, "resume");
 
+/* Devices of a filesystem managed by scrub schedule */
+struct scrub_schedule_dev {
+	u64 devid;
+	/* Limit before the scrub, restored when it ends */
+	u64 old_limit;
+	/* Index to scrub_schedule::controllers */
+	int controller;
+};
+
+struct scrub_schedule_fs {
+	const char *path;
+	int fd;
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
+	struct scrub_schedule_dev *devs;
+	int nr_devs;
+	/* The process running 'scrub start -B', 0 if not running */
+	pid_t pid;
+	/* Scrubbed in the current cycle, or failed */
+	bool done;
+	/* Continue the interrupted scrub of the current cycle */
+	bool resume;
+};
+
+struct scrub_schedule {
+	struct scrub_schedule_fs *fs;
+	int nr_fs;
+	/* Controller of each device and the number of devices scrubbed */
+	char **controllers;
+	int *controller_active;
+	int nr_controllers;
+	int active_devs;
+	int total_devs;
+	int max_devs;
+	int max_per_controller;
+	/* Throughput of all scrubbed devices, 0 for unlimited */
+	u64 limit;
+	u64 target_latency;
+	u64 limit_min;
+	bool readonly;
+	int failed;
+	int uncorrectable;
+};
+
+static volatile sig_atomic_t scrub_schedule_stop;
+
+static void scrub_schedule_signal(int signal)
+{
+	scrub_schedule_stop = signal;
+}
+
+static bool is_pci_address(const char *str, size_t len)
+{
+	/* Domain:bus:slot.function, e.g. 0000:00:1f.2 */
+	static const char pattern[] = "xxxx:xx:xx.x";
+
+	if (len != strlen(pattern))
+		return false;
+	for (int i = 0; i < len; i++) {
+		if (pattern[i] == 'x' ? !isxdigit(str[i]) : str[i] != pattern[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Identify the controller of the block device @path by the sysfs path of the
+ * closest PCI device above it, e.g. the HBA of a SCSI disk or an NVMe
+ * controller.  Other devices are their own controller, the partitions of a
+ * disk share it.
+ */
+static char *scrub_device_controller(const char *path)
+{
+	char sysfs[PATH_MAX];
+	char real[PATH_MAX];
+	struct stat st;
+	char *end = NULL;
+	char *comp;
+
+	if (stat(path, &st) < 0 || !S_ISBLK(st.st_mode))
+		return strdup(path);
+	/* /sys/devices/pci0000:00/0000:00:1f.2/ata1/host0/.../block/sda/sda1 */
+	snprintf(sysfs, sizeof(sysfs), "/sys/dev/block/%u:%u",
+		 major(st.st_rdev), minor(st.st_rdev));
+	if (!realpath(sysfs, real))
+		return strdup(sysfs);
+	comp = real;
+	while (*comp) {
+		size_t len = strcspn(comp, "/");
+
+		if (is_pci_address(comp, len))
+			end = comp + len;
+		else if (!end && len == 5 && strncmp(comp, "block", 5) == 0 &&
+			 comp[len] == '/')
+			end = comp + len + 1 + strcspn(comp + len + 1, "/");
+		comp += len;
+		if (*comp == '/')
+			comp++;
+	}
+	if (end)
+		*end = 0;
+	return strdup(real);
+}
+
+static int scrub_schedule_controller(struct scrub_schedule *ss,
+				     const char *path)
+{
+	char *key;
+	char **controllers;
+	int *active;
+	int i;
+
+	key = scrub_device_controller(path);
+	if (!key)
+		return -ENOMEM;
+	for (i = 0; i < ss->nr_controllers; i++) {
+		if (strcmp(ss->controllers[i], key) == 0) {
+			free(key);
+			return i;
+		}
+	}
+	controllers = realloc(ss->controllers, (i + 1) * sizeof(*controllers));
+	if (controllers)
+		ss->controllers = controllers;
+	active = realloc(ss->controller_active, (i + 1) * sizeof(*active));
+	if (active)
+		ss->controller_active = active;
+	if (!controllers || !active) {
+		free(key);
+		return -ENOMEM;
+	}
+	ss->controllers[i] = key;
+	ss->controller_active[i] = 0;
+	ss->nr_controllers++;
+	pr_verbose(LOG_VERBOSE, "controller of %s: %s\n", path, key);
+	return i;
+}
+
+static int scrub_schedule_add(struct scrub_schedule *ss, const char *path)
+{
+	struct scrub_schedule_fs *fs = &ss->fs[ss->nr_fs];
+	struct btrfs_ioctl_fs_info_args fi_args;
+	struct btrfs_ioctl_dev_info_args *di_args = NULL;
+	int ret;
+
+	fs->path = path;
+	fs->fd = btrfs_open_mnt(path);
+	if (fs->fd < 0)
+		return fs->fd;
+	ss->nr_fs++;
+
+	ret = get_fs_info(path, &fi_args, &di_args);
+	if (ret) {
+		errno = -ret;
+		error("getting dev info of %s failed: %m", path);
+		return ret;
+	}
+	if (!fi_args.num_devices) {
+		error("no devices found for %s", path);
+		ret = -ENODEV;
+		goto out;
+	}
+	uuid_unparse(fi_args.fsid, fs->fsid);
+	for (int i = 0; i < ss->nr_fs - 1; i++) {
+		if (strcmp(ss->fs[i].fsid, fs->fsid) == 0) {
+			error("%s and %s are the same filesystem, fsid %s",
+			      ss->fs[i].path, path, fs->fsid);
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+	fs->devs = calloc(fi_args.num_devices, sizeof(*fs->devs));
+	if (!fs->devs) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (int i = 0; i < fi_args.num_devices; i++) {
+		fs->devs[i].devid = di_args[i].devid;
+		ret = scrub_schedule_controller(ss, (const char *)di_args[i].path);
+		if (ret < 0) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			goto out;
+		}
+		fs->devs[i].controller = ret;
+		fs->nr_devs++;
+	}
+	ss->total_devs += fs->nr_devs;
+	ret = 0;
+out:
+	free(di_args);
+	return ret;
+}
+
+/*
+ * Find what's left to scrub of @fs in the cycle started at @cycle_start.  A
+ * scrub started in the cycle and interrupted or canceled is resumed, the
+ * devices not scrubbed since the start of the cycle need a new scrub.
+ */
+static void scrub_schedule_check(struct scrub_schedule_fs *fs, u64 cycle_start)
+{
+	struct scrub_file_record **past_scrubs;
+	bool start = false;
+	bool resume = false;
+
+	past_scrubs = scrub_read_history(fs->fsid);
+	for (int i = 0; i < fs->nr_devs; i++) {
+		struct scrub_file_record *last;
+
+		last = last_dev_scrub(past_scrubs, fs->devs[i].devid);
+		if (!last || last->stats.t_start < cycle_start)
+			start = true;
+		else if (last->stats.canceled || !last->stats.finished)
+			resume = true;
+	}
+	free_history(past_scrubs);
+	fs->resume = resume;
+	fs->done = !start && !resume;
+}
+
+/* Whether @fs can be scrubbed now, one filesystem can always be scrubbed */
+static bool scrub_schedule_fits(struct scrub_schedule *ss,
+				struct scrub_schedule_fs *fs)
+{
+	if (!ss->active_devs)
+		return true;
+	if (ss->max_devs && ss->active_devs + fs->nr_devs > ss->max_devs)
+		return false;
+	for (int i = 0; ss->max_per_controller && i < fs->nr_devs; i++) {
+		int controller = fs->devs[i].controller;
+		int nr = 0;
+
+		for (int j = 0; j < fs->nr_devs; j++) {
+			if (fs->devs[j].controller == controller)
+				nr++;
+		}
+		if (ss->controller_active[controller] + nr > ss->max_per_controller)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * The limit of each scrubbed device.  The --limit is split among the devices
+ * scrubbed now, or with --target-latency among all the devices that can be
+ * scrubbed at once, as the limit of each scrub can't be changed while its
+ * latency is adjusted.
+ */
+static u64 scrub_schedule_share(const struct scrub_schedule *ss)
+{
+	int nr = ss->active_devs;
+
+	if (!ss->limit)
+		return 0;
+	if (ss->target_latency)
+		nr = ss->max_devs ? min(ss->max_devs, ss->total_devs) : ss->total_devs;
+	if (nr < 1)
+		nr = 1;
+	return max(ss->limit / nr, 1ULL);
+}
+
+/* Set the limits of the running scrubs but @skip to the current share */
+static void scrub_schedule_rebalance(struct scrub_schedule *ss,
+				     struct scrub_schedule_fs *skip)
+{
+	u64 share = scrub_schedule_share(ss);
+
+	if (!ss->limit || ss->target_latency)
+		return;
+	for (int i = 0; i < ss->nr_fs; i++) {
+		struct scrub_schedule_fs *fs = &ss->fs[i];
+
+		if (!fs->pid || fs == skip)
+			continue;
+		for (int j = 0; j < fs->nr_devs; j++)
+			write_scrub_device_limit(fs->fd, fs->devs[j].devid, share);
+	}
+}
+
+static void scrub_schedule_account(struct scrub_schedule *ss,
+				   struct scrub_schedule_fs *fs, int sign)
+{
+	for (int i = 0; i < fs->nr_devs; i++)
+		ss->controller_active[fs->devs[i].controller] += sign;
+	ss->active_devs += sign * fs->nr_devs;
+}
+
+/* Scrub @fs in a child process by 'scrub start -B' or 'scrub resume -B' */
+static int scrub_schedule_start(struct scrub_schedule *ss,
+				struct scrub_schedule_fs *fs)
+{
+	const struct cmd_struct *cmd;
+	char limit[32];
+	char latency[32];
+	char limit_min[32];
+	char *args[16];
+	int nr = 0;
+	u64 share;
+	pid_t pid;
+
+	for (int i = 0; i < fs->nr_devs; i++)
+		fs->devs[i].old_limit = read_scrub_device_limit(fs->fd,
+							fs->devs[i].devid);
+	scrub_schedule_account(ss, fs, 1);
+	share = scrub_schedule_share(ss);
+
+	cmd = fs->resume ? &cmd_struct_scrub_resume : &cmd_struct_scrub_start;
+	args[nr++] = (char *)cmd->token;
+	args[nr++] = "-B";
+	if (ss->readonly)
+		args[nr++] = "-r";
+	if (share) {
+		snprintf(limit, sizeof(limit), "%llu", share);
+		args[nr++] = "--limit";
+		args[nr++] = limit;
+	}
+	if (ss->target_latency) {
+		snprintf(latency, sizeof(latency), "%lluus", ss->target_latency);
+		snprintf(limit_min, sizeof(limit_min), "%llu", ss->limit_min);
+		args[nr++] = "--target-latency";
+		args[nr++] = latency;
+		args[nr++] = "--limit-min";
+		args[nr++] = limit_min;
+	}
+	args[nr++] = (char *)fs->path;
+	args[nr] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		error("cannot scrub %s, fork failed: %m", fs->path);
+		scrub_schedule_account(ss, fs, -1);
+		return -errno;
+	}
+	if (pid == 0) {
+		/* Not stopped by the terminal, SIGINT is sent by the schedule */
+		setpgid(0, 0);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		optind = 0;
+		exit(scrub_start(cmd, nr, args, fs->resume));
+	}
+	fs->pid = pid;
+	pr_verbose(LOG_DEFAULT, "scrub schedule: %s %s, fsid %s",
+		   fs->resume ? "resuming" : "starting", fs->path, fs->fsid);
+	if (share)
+		pr_verbose(LOG_DEFAULT, " (limit %s/s per device)\n",
+			   pretty_size(share));
+	else
+		pr_verbose(LOG_DEFAULT, "\n");
+	scrub_schedule_rebalance(ss, fs);
+	return 0;
+}
+
+static void scrub_schedule_finish(struct scrub_schedule *ss, pid_t pid,
+				  int status)
+{
+	struct scrub_schedule_fs *fs = NULL;
+	int ret;
+
+	for (int i = 0; i < ss->nr_fs; i++) {
+		if (ss->fs[i].pid == pid) {
+			fs = &ss->fs[i];
+			break;
+		}
+	}
+	if (!fs)
+		return;
+
+	ret = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+	/* 2 is nothing to resume, the scrub has finished in the meantime */
+	if (ret == 3) {
+		ss->uncorrectable++;
+	} else if (ret && ret != 2) {
+		error("scrub of %s failed with error %d", fs->path, ret);
+		ss->failed++;
+	}
+	for (int i = 0; i < fs->nr_devs; i++)
+		scrub_reset_device_limit(fs->fd, fs->devs[i].devid,
+					 fs->devs[i].old_limit);
+	fs->pid = 0;
+	fs->done = true;
+	scrub_schedule_account(ss, fs, -1);
+	scrub_schedule_rebalance(ss, NULL);
+}
+
+/* The start of the current cycle and its end, or 0 if it's not finished */
+static int scrub_schedule_read_cycle(u64 *cycle_start, u64 *cycle_end)
+{
+	FILE *file;
+	int ret;
+
+	file = fopen(SCRUB_SCHEDULE_FILE, "r");
+	if (!file)
+		return -errno;
+	ret = fscanf(file, SCRUB_SCHEDULE_VERSION_PREFIX ":"
+		     SCRUB_SCHEDULE_VERSION "\ncycle_start:%llu|cycle_end:%llu",
+		     cycle_start, cycle_end);
+	fclose(file);
+	return ret == 2 ? 0 : -EINVAL;
+}
+
+static void scrub_schedule_write_cycle(u64 cycle_start, u64 cycle_end)
+{
+	const char *tmp = SCRUB_SCHEDULE_FILE "_tmp";
+	int fd;
+	int ret;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		goto fail;
+	ret = dprintf(fd, SCRUB_SCHEDULE_VERSION_PREFIX ":"
+		      SCRUB_SCHEDULE_VERSION "\ncycle_start:%llu|cycle_end:%llu\n",
+		      cycle_start, cycle_end);
+	close(fd);
+	if (ret < 0 || rename(tmp, SCRUB_SCHEDULE_FILE) < 0)
+		goto fail;
+	return;
+fail:
+	warning("failed to record the scrub cycle in %s: %m",
+		SCRUB_SCHEDULE_FILE);
+}
+
+/* Sleep until @when, return false if interrupted by a signal to stop */
+static bool scrub_schedule_sleep(u64 when)
+{
+	u64 now;
+
+	while (!scrub_schedule_stop && (now = time(NULL)) < when)
+		sleep(min_t(u64, when - now, 60));
+	return !scrub_schedule_stop;
+}
+
+static u64 parse_scrub_interval(const char *str)
+{
+	char *end;
+	u64 value;
+
+	errno = 0;
+	value = strtoull(str, &end, 10);
+	if (errno || end == str || str[0] == '-')
+		goto invalid;
+	if (*end == 0 || strcmp(end, "s") == 0)
+		;
+	else if (strcmp(end, "m") == 0)
+		value *= 60;
+	else if (strcmp(end, "h") == 0)
+		value *= 3600;
+	else if (strcmp(end, "d") == 0)
+		value *= 86400;
+	else
+		goto invalid;
+	if (!value)
+		goto invalid;
+	return value;
+
+invalid:
+	error("invalid interval: %s", str);
+	exit(1);
+}
+
+static const char * const cmd_scrub_schedule_usage[] = {
+	"btrfs scrub schedule [options] <path> [<path>...]",
+	"Scrub several filesystems with a common throughput and concurrency budget",
+	"The filesystems are scrubbed as by 'scrub start -B' in the given order,",
+	"as many at once as the limits allow.  The cycle of scrubs is recorded and",
+	"continued if interrupted, the interrupted scrubs are resumed.",
+	"",
+	OPTLINE("-r", "read only mode"),
+	OPTLINE("--limit SIZE", "throughput limit of all the scrubbed devices "
+		"together, split evenly among them"),
+	OPTLINE("--max-devices NUM", "scrub at most NUM devices at once, "
+		"default unlimited"),
+	OPTLINE("--max-per-controller NUM", "scrub at most NUM devices behind "
+		"one controller at once, default unlimited"),
+	OPTLINE("--target-latency TIME", "adjust the limit of each device to the "
+		"read latency, see 'scrub start'"),
+	OPTLINE("--limit-min SIZE", "lowest limit set by --target-latency "
+		"(default 1MiB)"),
+	OPTLINE("--interval TIME", "start a new cycle TIME after the start of "
+		"the last one (s, m, h or d suffix, default s), otherwise exit "
+		"after one cycle"),
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_QUIET,
+	NULL
+};
+
+static int cmd_scrub_schedule(const struct cmd_struct *cmd, int argc,
+			      char **argv)
+{
+	struct scrub_schedule ss = { 0 };
+	struct sigaction sa = {
+		.sa_handler = scrub_schedule_signal,
+	};
+	char datafile[] = SCRUB_SCHEDULE_FILE;
+	u64 interval = 0;
+	u64 cycle_start = 0;
+	u64 cycle_end = 0;
+	int nr_paths;
+	int ret = 1;
+
+	ss.limit_min = SCRUB_THROTTLE_LIMIT_MIN;
+	optind = 0;
+	while (1) {
+		int c;
+		enum {
+			GETOPT_VAL_LIMIT = GETOPT_VAL_FIRST,
+			GETOPT_VAL_MAX_DEVICES,
+			GETOPT_VAL_MAX_PER_CONTROLLER,
+			GETOPT_VAL_TARGET_LATENCY,
+			GETOPT_VAL_LIMIT_MIN,
+			GETOPT_VAL_INTERVAL,
+		};
+		static const struct option long_options[] = {
+			{"limit", required_argument, NULL, GETOPT_VAL_LIMIT},
+			{"max-devices", required_argument, NULL,
+				GETOPT_VAL_MAX_DEVICES},
+			{"max-per-controller", required_argument, NULL,
+				GETOPT_VAL_MAX_PER_CONTROLLER},
+			{"target-latency", required_argument, NULL,
+				GETOPT_VAL_TARGET_LATENCY},
+			{"limit-min", required_argument, NULL, GETOPT_VAL_LIMIT_MIN},
+			{"interval", required_argument, NULL, GETOPT_VAL_INTERVAL},
+			{ NULL, 0, NULL, 0 }
+		};
+
+		c = getopt_long(argc, argv, "r", long_options, NULL);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'r':
+			ss.readonly = true;
+			break;
+		case GETOPT_VAL_LIMIT:
+			ss.limit = arg_strtou64_with_suffix(optarg);
+			break;
+		case GETOPT_VAL_MAX_DEVICES:
+			ss.max_devs = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_MAX_PER_CONTROLLER:
+			ss.max_per_controller = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_TARGET_LATENCY:
+			ss.target_latency = parse_scrub_latency(optarg);
+			break;
+		case GETOPT_VAL_LIMIT_MIN:
+			ss.limit_min = arg_strtou64_with_suffix(optarg);
+			if (!ss.limit_min) {
+				error("--limit-min must be greater than 0");
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_INTERVAL:
+			interval = parse_scrub_interval(optarg);
+			break;
+		default:
+			usage_unknown_option(cmd, argv);
+		}
+	}
+
+	if (check_argc_min(argc - optind, 1))
+		return 1;
+
+	nr_paths = argc - optind;
+	ss.fs = calloc(nr_paths, sizeof(*ss.fs));
+	if (!ss.fs) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return 1;
+	}
+	for (int i = 0; i < nr_paths; i++) {
+		if (scrub_schedule_add(&ss, argv[optind + i]))
+			goto out;
+	}
+	if (ss.target_latency && ss.limit &&
+	    scrub_schedule_share(&ss) < ss.limit_min) {
+		error("--limit split among the devices is lower than --limit-min");
+		goto out;
+	}
+
+	if (mkdir_p(datafile))
+		warning("cannot create the scrub schedule file, mkdir %s failed: %m",
+			datafile);
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (scrub_schedule_read_cycle(&cycle_start, &cycle_end) == 0 &&
+	    !cycle_end) {
+		time_t t = cycle_start;
+
+		pr_verbose(LOG_DEFAULT,
+			   "scrub schedule: continuing the cycle started at %s",
+			   ctime(&t));
+	} else {
+		if (interval && cycle_start &&
+		    !scrub_schedule_sleep(cycle_start + interval))
+			goto out;
+		cycle_start = time(NULL);
+		scrub_schedule_write_cycle(cycle_start, 0);
+	}
+
+	while (1) {
+		for (int i = 0; i < ss.nr_fs; i++)
+			scrub_schedule_check(&ss.fs[i], cycle_start);
+
+		while (!scrub_schedule_stop) {
+			bool running = false;
+			pid_t pid;
+			int status;
+
+			for (int i = 0; i < ss.nr_fs; i++) {
+				struct scrub_schedule_fs *fs = &ss.fs[i];
+
+				if (!fs->done && !fs->pid &&
+				    scrub_schedule_fits(&ss, fs) &&
+				    scrub_schedule_start(&ss, fs) < 0)
+					fs->done = true;
+				if (fs->pid)
+					running = true;
+			}
+			if (!running)
+				break;
+			pid = waitpid(-1, &status, 0);
+			if (pid > 0)
+				scrub_schedule_finish(&ss, pid, status);
+			else if (errno != EINTR)
+				break;
+		}
+		if (scrub_schedule_stop)
+			break;
+
+		cycle_end = time(NULL);
+		scrub_schedule_write_cycle(cycle_start, cycle_end);
+		pr_verbose(LOG_DEFAULT, "scrub schedule: cycle finished in %llus\n",
+			   cycle_end - cycle_start);
+		if (!interval || !scrub_schedule_sleep(cycle_start + interval))
+			break;
+		cycle_start = time(NULL);
+		scrub_schedule_write_cycle(cycle_start, 0);
+	}
+
+	/* The scrubs record their progress when canceled by SIGINT */
+	for (int i = 0; i < ss.nr_fs; i++) {
+		if (ss.fs[i].pid)
+			kill(ss.fs[i].pid, SIGINT);
+	}
+	while (ss.active_devs) {
+		pid_t pid;
+		int status;
+
+		pid = waitpid(-1, &status, 0);
+		if (pid > 0)
+			scrub_schedule_finish(&ss, pid, status);
+		else if (errno != EINTR)
+			break;
+	}
+	if (scrub_schedule_stop) {
+		pr_verbose(LOG_DEFAULT,
+			   "scrub schedule: stopped, the cycle continues on the next start\n");
+		ret = 1;
+	} else if (ss.failed) {
+		ret = 1;
+	} else if (ss.uncorrectable) {
+		error("there are uncorrectable errors on %d filesystems",
+		      ss.uncorrectable);
+		ret = 3;
+	} else {
+		ret = 0;
+	}
+out:
+	for (int i = 0; i < ss.nr_fs; i++) {
+		free(ss.fs[i].devs);
+		close(ss.fs[i].fd);
+	}
+	free(ss.fs);
+	for (int i = 0; i < ss.nr_controllers; i++)
+		free(ss.controllers[i]);
+	free(ss.controllers);
+	free(ss.controller_active);
+	return ret;
+}
+static DEFINE_SIMPLE_COMMAND(scrub_schedule, "schedule");
+
 static const char * const cmd_scrub_status_usage[] = {
 	"btrfs scrub status [-dR] <path>|<device>",
 	"Show status of running or finished scrub",
@@ -1838,9 +3351,104 @@ static const char * const cmd_scrub_status_usage[] = {
 	OPTLINE("-d", "stats per device"),
 	OPTLINE("-R", "print raw stats"),
 	HELPINFO_UNITS_LONG,
+	HELPINFO_INSERT_GLOBALS,
+	HELPINFO_INSERT_FORMAT,
 	NULL
 };
 
+static const struct rowspec scrub_status_rowspec[] = {
+	{ .key = "uuid", .fmt = "uuid", .out_text = "UUID", .out_json = "uuid" },
+	{ .key = "devid", .fmt = "%llu", .out_text = "devid", .out_json = "devid" },
+	{ .key = "path", .fmt = "str", .out_text = "path", .out_json = "path" },
+	{ .key = "status", .fmt = "str", .out_text = "status", .out_json = "status" },
+	{ .key = "t_start", .fmt = "%llu", .out_text = "t_start", .out_json = "t_start" },
+	{ .key = "t_resumed", .fmt = "%llu", .out_text = "t_resumed", .out_json = "t_resumed" },
+	{ .key = "duration", .fmt = "%llu", .out_text = "duration", .out_json = "duration" },
+	{ .key = "bytes_used", .fmt = "%llu", .out_text = "bytes_used", .out_json = "bytes_used" },
+	{ .key = "limit", .fmt = "%llu", .out_text = "limit", .out_json = "limit" },
+	{ .key = "data_extents_scrubbed", .fmt = "%llu", .out_text = "data_extents_scrubbed", .out_json = "data_extents_scrubbed" },
+	{ .key = "tree_extents_scrubbed", .fmt = "%llu", .out_text = "tree_extents_scrubbed", .out_json = "tree_extents_scrubbed" },
+	{ .key = "data_bytes_scrubbed", .fmt = "%llu", .out_text = "data_bytes_scrubbed", .out_json = "data_bytes_scrubbed" },
+	{ .key = "tree_bytes_scrubbed", .fmt = "%llu", .out_text = "tree_bytes_scrubbed", .out_json = "tree_bytes_scrubbed" },
+	{ .key = "read_errors", .fmt = "%llu", .out_text = "read_errors", .out_json = "read_errors" },
+	{ .key = "csum_errors", .fmt = "%llu", .out_text = "csum_errors", .out_json = "csum_errors" },
+	{ .key = "verify_errors", .fmt = "%llu", .out_text = "verify_errors", .out_json = "verify_errors" },
+	{ .key = "no_csum", .fmt = "%llu", .out_text = "no_csum", .out_json = "no_csum" },
+	{ .key = "csum_discards", .fmt = "%llu", .out_text = "csum_discards", .out_json = "csum_discards" },
+	{ .key = "super_errors", .fmt = "%llu", .out_text = "super_errors", .out_json = "super_errors" },
+	{ .key = "malloc_errors", .fmt = "%llu", .out_text = "malloc_errors", .out_json = "malloc_errors" },
+	{ .key = "uncorrectable_errors", .fmt = "%llu", .out_text = "uncorrectable_errors", .out_json = "uncorrectable_errors" },
+	{ .key = "unverified_errors", .fmt = "%llu", .out_text = "unverified_errors", .out_json = "unverified_errors" },
+	{ .key = "corrected_errors", .fmt = "%llu", .out_text = "corrected_errors", .out_json = "corrected_errors" },
+	{ .key = "last_physical", .fmt = "%llu", .out_text = "last_physical", .out_json = "last_physical" },
+	ROWSPEC_END
+};
+
+/*
+ * Print the status of each device in json, the raw values and the times in
+ * seconds since the epoch.
+ */
+static void print_scrub_status_json(int fdmnt, const u8 *fsid,
+				    struct btrfs_ioctl_dev_info_args *di_args,
+				    int nr_devices,
+				    struct scrub_file_record **past_scrubs,
+				    int in_progress)
+{
+	struct format_ctx fctx;
+
+	fmt_start(&fctx, scrub_status_rowspec, 24, 0);
+	fmt_print_start_group(&fctx, "scrub-status", JSON_TYPE_MAP);
+	fmt_print(&fctx, "uuid", fsid);
+	fmt_print_start_group(&fctx, "devices", JSON_TYPE_ARRAY);
+	for (int i = 0; i < nr_devices; i++) {
+		struct scrub_file_record *last_scrub;
+		struct btrfs_scrub_progress *p;
+		struct scrub_stats *ss;
+		const char *status;
+
+		last_scrub = last_dev_scrub(past_scrubs, di_args[i].devid);
+		fmt_print_start_group(&fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(&fctx, "devid", di_args[i].devid);
+		fmt_print(&fctx, "path", (const char *)di_args[i].path);
+		fmt_print(&fctx, "bytes_used", di_args[i].bytes_used);
+		fmt_print(&fctx, "limit",
+			  read_scrub_device_limit(fdmnt, di_args[i].devid));
+		if (!last_scrub || !last_scrub->stats.t_start) {
+			fmt_print(&fctx, "status", "none");
+			fmt_print_end_group(&fctx, NULL);
+			continue;
+		}
+		p = &last_scrub->p;
+		ss = &last_scrub->stats;
+		status = in_progress ? "running" :
+			 ss->canceled ? "aborted" :
+			 ss->finished ? "finished" : "interrupted";
+		fmt_print(&fctx, "status", status);
+		fmt_print(&fctx, "t_start", (u64)ss->t_start);
+		fmt_print(&fctx, "t_resumed", (u64)ss->t_resumed);
+		fmt_print(&fctx, "duration", ss->duration);
+		fmt_print(&fctx, "data_extents_scrubbed", p->data_extents_scrubbed);
+		fmt_print(&fctx, "tree_extents_scrubbed", p->tree_extents_scrubbed);
+		fmt_print(&fctx, "data_bytes_scrubbed", p->data_bytes_scrubbed);
+		fmt_print(&fctx, "tree_bytes_scrubbed", p->tree_bytes_scrubbed);
+		fmt_print(&fctx, "read_errors", p->read_errors);
+		fmt_print(&fctx, "csum_errors", p->csum_errors);
+		fmt_print(&fctx, "verify_errors", p->verify_errors);
+		fmt_print(&fctx, "no_csum", p->no_csum);
+		fmt_print(&fctx, "csum_discards", p->csum_discards);
+		fmt_print(&fctx, "super_errors", p->super_errors);
+		fmt_print(&fctx, "malloc_errors", p->malloc_errors);
+		fmt_print(&fctx, "uncorrectable_errors", p->uncorrectable_errors);
+		fmt_print(&fctx, "unverified_errors", p->unverified_errors);
+		fmt_print(&fctx, "corrected_errors", p->corrected_errors);
+		fmt_print(&fctx, "last_physical", p->last_physical);
+		fmt_print_end_group(&fctx, NULL);
+	}
+	fmt_print_end_group(&fctx, "devices");
+	fmt_print_end_group(&fctx, "scrub-status");
+	fmt_end(&fctx);
+}
+
 static int cmd_scrub_status(const struct cmd_struct *cmd, int argc, char **argv)
 {
 	char *path;
@@ -1911,37 +3519,50 @@ static int cmd_scrub_status(const struct cmd_struct *cmd, int argc, char **argv)
 
 	uuid_unparse(fi_args.fsid, fsid);
 
-	fdres = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (fdres == -1) {
-		error("failed to create socket to receive progress information: %m");
-		err = 1;
-		goto out;
-	}
-	scrub_datafile(SCRUB_PROGRESS_SOCKET_PATH, fsid,
-			NULL, addr.sun_path, sizeof(addr.sun_path));
-	/* ignore EOVERFLOW, just use shorter name and hope for the best */
-	addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
-	ret = connect(fdres, (struct sockaddr *)&addr, sizeof(addr));
-	if (ret == -1) {
-		close(fdres);
-		fdres = scrub_open_file_r(SCRUB_DATA_FILE, fsid);
-		if (fdres < 0 && fdres != -ENOENT) {
-			errno = -fdres;
-			warning("failed to open status file: %m");
+	/* A running scrub updates the binary state, no need to ask it */
+	past_scrubs = scrub_read_state(fsid);
+	if (!past_scrubs) {
+		fdres = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fdres == -1) {
+			error("failed to create socket to receive progress information: %m");
 			err = 1;
 			goto out;
 		}
-	}
+		scrub_datafile(SCRUB_PROGRESS_SOCKET_PATH, fsid,
+				NULL, addr.sun_path, sizeof(addr.sun_path));
+		/* ignore EOVERFLOW, just use shorter name and hope for the best */
+		addr.sun_path[sizeof(addr.sun_path) - 1] = '\0';
+		ret = connect(fdres, (struct sockaddr *)&addr, sizeof(addr));
+		if (ret == -1) {
+			close(fdres);
+			fdres = scrub_open_file_r(SCRUB_DATA_FILE, fsid);
+			if (fdres < 0 && fdres != -ENOENT) {
+				errno = -fdres;
+				warning("failed to open status file: %m");
+				err = 1;
+				goto out;
+			}
+		}
 
-	if (fdres >= 0) {
-		past_scrubs = scrub_read_file(fdres, 1);
-		if (IS_ERR(past_scrubs)) {
-			errno = -PTR_ERR(past_scrubs);
-			warning("failed to read status: %m");
+		if (fdres >= 0) {
+			past_scrubs = scrub_read_file(fdres, 1);
+			if (IS_ERR(past_scrubs)) {
+				errno = -PTR_ERR(past_scrubs);
+				warning("failed to read status: %m");
+			}
 		}
 	}
+
 	in_progress = is_scrub_running_in_kernel(fdmnt, di_args, fi_args.num_devices);
 
+	if (bconf.output_format == CMD_FORMAT_JSON) {
+		print_scrub_status_json(fdmnt, fi_args.fsid, di_args,
+					fi_args.num_devices,
+					IS_ERR(past_scrubs) ? NULL : past_scrubs,
+					in_progress);
+		goto out;
+	}
+
 	pr_verbose(LOG_DEFAULT, "UUID:             %s\n", fsid);
 
 	if (do_stats_per_dev) {
@@ -2003,7 +3624,7 @@ out:
 
 	return !!err;
 }
-static DEFINE_SIMPLE_COMMAND(scrub_status, "status");
+static DEFINE_COMMAND_WITH_FLAGS(scrub_status, "status", CMD_FORMAT_JSON);
 
 static const char * const cmd_scrub_limit_usage[] = {
 	"btrfs scrub limit [options] <path>",
@@ -2221,6 +3842,7 @@ static const struct cmd_group scrub_cmd_group = {
 		&cmd_struct_scrub_resume,
 		&cmd_struct_scrub_status,
 		&cmd_struct_scrub_limit,
+		&cmd_struct_scrub_schedule,
 		NULL
 	}
 };
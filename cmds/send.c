@@ -22,12 +22,16 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <poll.h>
 #include <getopt.h>
 #include <limits.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/uapi/btrfs.h"
 #include "common/utils.h"
@@ -37,17 +41,39 @@
 #include "common/sysfs-utils.h"
 #include "common/string-utils.h"
 #include "common/messages.h"
+#include "common/stats.h"
 #include "cmds/commands.h"
 
 #define BTRFS_SEND_BUF_SIZE_V1	(SZ_64K)
 #define BTRFS_MAX_COMPRESSED	(SZ_128K)
 #define BTRFS_SEND_BUF_SIZE_V2	(SZ_16K + BTRFS_MAX_COMPRESSED)
 
+/* Stream compressed by --compress-stream, in independent frames of this size */
+#define SEND_COMPRESS_FRAME_SIZE	(SZ_4M)
+#define SEND_COMPRESS_MAX_THREADS	(64)
+#define SEND_COMPRESS_MAX_LEVEL		(19)
+
+/* Subvolumes sent in parallel by --jobs */
+#define SEND_MAX_JOBS			(64)
+
+/*
+ * The frames are listed in a seek table at the end of the stream, in the
+ * skippable frame of the zstd seekable format. The decompression skips it.
+ */
+#define SEND_SEEK_TABLE_MAGIC		(0x184D2A5E)
+#define SEND_SEEKABLE_MAGIC		(0x8F92EAB1)
+
+struct send_compress;
 
 struct btrfs_send {
 	int send_fd;
 	int dump_fd;
 	int mnt_fd;
+	/* The subvolumes searched for the parents, see find_good_parent() */
+	struct subvol_uuid_cache uuid_cache;
+
+	/* The stream compression, or NULL */
+	struct send_compress *compress;
 
 	u64 *clone_sources;
 	u64 clone_sources_count;
@@ -61,7 +87,8 @@ static int get_root_id(struct btrfs_send *sctx, const char *path, u64 *root_id)
 {
 	struct subvol_info *si;
 
-	si = subvol_uuid_search(sctx->mnt_fd, 0, NULL, 0, path, subvol_search_by_path);
+	si = subvol_uuid_cache_search(&sctx->uuid_cache, 0, NULL, 0, path,
+				      subvol_search_by_path);
 	if (IS_ERR_OR_NULL(si)) {
 		if (!si)
 			return -ENOENT;
@@ -79,13 +106,13 @@ static struct subvol_info *get_parent(struct btrfs_send *sctx, u64 root_id)
 	struct subvol_info *si_tmp;
 	struct subvol_info *si;
 
-	si_tmp = subvol_uuid_search(sctx->mnt_fd, root_id, NULL, 0, NULL,
-			subvol_search_by_root_id);
+	si_tmp = subvol_uuid_cache_search(&sctx->uuid_cache, root_id, NULL, 0,
+					  NULL, subvol_search_by_root_id);
 	if (IS_ERR_OR_NULL(si_tmp))
 		return si_tmp;
 
-	si = subvol_uuid_search(sctx->mnt_fd, 0, si_tmp->parent_uuid, 0, NULL,
-			subvol_search_by_uuid);
+	si = subvol_uuid_cache_search(&sctx->uuid_cache, 0, si_tmp->parent_uuid,
+				      0, NULL, subvol_search_by_uuid);
 	free(si_tmp->path);
 	free(si_tmp);
 	return si;
@@ -133,7 +160,7 @@ static int find_good_parent(struct btrfs_send *sctx, u64 root_id, u64 *found)
 
 		free(parent2->path);
 		free(parent2);
-		parent2 = subvol_uuid_search(sctx->mnt_fd,
+		parent2 = subvol_uuid_cache_search(&sctx->uuid_cache,
 				sctx->clone_sources[i], NULL, 0, NULL,
 				subvol_search_by_root_id);
 		if (IS_ERR_OR_NULL(parent2)) {
@@ -200,14 +227,349 @@ static int add_clone_source(struct btrfs_send *sctx, u64 root_id)
 	return 0;
 }
 
+#if COMPRESSION_ZSTD
+
+struct send_compress_frame {
+	char *in;
+	size_t in_len;
+	void *out;
+	size_t out_len;
+	int ret;
+	bool done;
+};
+
+/*
+ * Compress the stream by frames, each by one of the threads.
+ *
+ * The frames are filled in order by the thread reading the stream from the
+ * kernel and queued when full. They're written in the same order once
+ * compressed, before their buffers are filled again. The frames continue
+ * across the subvolumes sent by one command.
+ */
+struct send_compress {
+	pthread_mutex_t mutex;
+	pthread_cond_t queued_cond;
+	pthread_cond_t done_cond;
+	bool stop;
+
+	int level;
+	unsigned int nr_threads;
+	pthread_t *threads;
+
+	struct send_compress_frame *frames;
+	unsigned int nr_frames;
+	/* The frame being filled, the next to compress and to write */
+	u64 fill_seq;
+	u64 take_seq;
+	u64 write_seq;
+
+	/* Compressed and decompressed size of each frame written */
+	u32 *seek_table;
+	u64 nr_seek_entries;
+	u64 seek_table_size;
+};
+
+static void *send_compress_worker(void *arg)
+{
+	struct send_compress *comp = arg;
+	ZSTD_CCtx *cctx;
+
+	cctx = ZSTD_createCCtx();
+
+	pthread_mutex_lock(&comp->mutex);
+	while (true) {
+		struct send_compress_frame *frame;
+		size_t zret;
+
+		while (comp->take_seq == comp->fill_seq && !comp->stop)
+			pthread_cond_wait(&comp->queued_cond, &comp->mutex);
+		if (comp->take_seq == comp->fill_seq)
+			break;
+		frame = &comp->frames[comp->take_seq % comp->nr_frames];
+		comp->take_seq++;
+		pthread_mutex_unlock(&comp->mutex);
+
+		if (cctx) {
+			zret = ZSTD_compressCCtx(cctx, frame->out,
+					ZSTD_compressBound(SEND_COMPRESS_FRAME_SIZE),
+					frame->in, frame->in_len, comp->level);
+			if (ZSTD_isError(zret)) {
+				error("stream compression failed: %s",
+				      ZSTD_getErrorName(zret));
+				frame->ret = -EINVAL;
+			} else {
+				frame->out_len = zret;
+				frame->ret = 0;
+			}
+		} else {
+			frame->ret = -ENOMEM;
+		}
+
+		pthread_mutex_lock(&comp->mutex);
+		frame->done = true;
+		pthread_cond_broadcast(&comp->done_cond);
+	}
+	pthread_mutex_unlock(&comp->mutex);
+	ZSTD_freeCCtx(cctx);
+	return NULL;
+}
+
+static int send_compress_write(int fd, const void *buf, size_t len)
+{
+	size_t written = 0;
+
+	while (written < len) {
+		u64 start = stats_io_start();
+		ssize_t ret;
+
+		ret = write(fd, buf + written, len - written);
+		stats_op("send output", max_t(ssize_t, ret, 0), start);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			error("failed to write the compressed stream: %m");
+			return ret;
+		}
+		written += ret;
+	}
+	return 0;
+}
+
+/* Wait for the oldest frame compressed and write it */
+static int send_compress_write_frame(struct send_compress *comp, int fd)
+{
+	struct send_compress_frame *frame;
+	int ret;
+
+	frame = &comp->frames[comp->write_seq % comp->nr_frames];
+	pthread_mutex_lock(&comp->mutex);
+	while (!frame->done)
+		pthread_cond_wait(&comp->done_cond, &comp->mutex);
+	pthread_mutex_unlock(&comp->mutex);
+	comp->write_seq++;
+
+	if (frame->ret < 0)
+		return frame->ret;
+	ret = send_compress_write(fd, frame->out, frame->out_len);
+	if (ret < 0)
+		return ret;
+
+	if (comp->nr_seek_entries * 2 == comp->seek_table_size) {
+		u64 size = max_t(u64, 1024, comp->seek_table_size * 2);
+		u32 *table;
+
+		table = realloc(comp->seek_table, size * sizeof(u32));
+		if (!table) {
+			error_msg(ERROR_MSG_MEMORY, "stream seek table");
+			return -ENOMEM;
+		}
+		comp->seek_table = table;
+		comp->seek_table_size = size;
+	}
+	comp->seek_table[comp->nr_seek_entries * 2] = cpu_to_le32(frame->out_len);
+	comp->seek_table[comp->nr_seek_entries * 2 + 1] = cpu_to_le32(frame->in_len);
+	comp->nr_seek_entries++;
+	return 0;
+}
+
+/* Queue the frame being filled to the threads */
+static void send_compress_queue(struct send_compress *comp)
+{
+	pthread_mutex_lock(&comp->mutex);
+	comp->fill_seq++;
+	pthread_cond_broadcast(&comp->queued_cond);
+	pthread_mutex_unlock(&comp->mutex);
+}
+
+/*
+ * Return the frame to fill with the stream, its buffer is free once all the
+ * frames before it were written.
+ */
+static struct send_compress_frame *send_compress_get_frame(struct send_compress *comp,
+							   int fd, int *ret)
+{
+	struct send_compress_frame *frame;
+
+	*ret = 0;
+	while (comp->fill_seq - comp->write_seq >= comp->nr_frames) {
+		*ret = send_compress_write_frame(comp, fd);
+		if (*ret < 0)
+			return NULL;
+	}
+	frame = &comp->frames[comp->fill_seq % comp->nr_frames];
+	if (frame->done) {
+		frame->done = false;
+		frame->in_len = 0;
+	}
+	return frame;
+}
+
+/* Read the stream from the kernel to the frames */
+static int send_compress_read(struct send_compress *comp, int send_fd,
+			      int dump_fd)
+{
+	while (true) {
+		struct send_compress_frame *frame;
+		ssize_t rbytes;
+		u64 start;
+		int ret;
+
+		frame = send_compress_get_frame(comp, dump_fd, &ret);
+		if (!frame)
+			return ret;
+		/* The read waits for the kernel, the pipe is copied to the frame */
+		start = stats_io_start();
+		rbytes = read(send_fd, frame->in + frame->in_len,
+			      SEND_COMPRESS_FRAME_SIZE - frame->in_len);
+		stats_op("send kernel wait", max_t(ssize_t, rbytes, 0), start);
+		if (rbytes < 0) {
+			ret = -errno;
+			error("failed to read stream from kernel: %m");
+			return ret;
+		}
+		/* The rest of the frame may come from the next subvolume */
+		if (rbytes == 0)
+			return 0;
+		frame->in_len += rbytes;
+		if (frame->in_len == SEND_COMPRESS_FRAME_SIZE)
+			send_compress_queue(comp);
+	}
+}
+
+/* Write the last frames and the seek table */
+static int send_compress_finish(struct send_compress *comp, int fd)
+{
+	struct send_compress_frame *frame;
+	__le32 header[2];
+	struct {
+		__le32 nr_frames;
+		u8 descriptor;
+		__le32 magic;
+	} __attribute__((packed)) footer;
+	size_t table_len;
+	int ret;
+
+	frame = &comp->frames[comp->fill_seq % comp->nr_frames];
+	if (!frame->done && frame->in_len)
+		send_compress_queue(comp);
+	while (comp->write_seq < comp->fill_seq) {
+		ret = send_compress_write_frame(comp, fd);
+		if (ret < 0)
+			return ret;
+	}
+
+	table_len = comp->nr_seek_entries * 2 * sizeof(u32);
+	header[0] = cpu_to_le32(SEND_SEEK_TABLE_MAGIC);
+	header[1] = cpu_to_le32(table_len + sizeof(footer));
+	footer.nr_frames = cpu_to_le32(comp->nr_seek_entries);
+	footer.descriptor = 0;
+	footer.magic = cpu_to_le32(SEND_SEEKABLE_MAGIC);
+	ret = send_compress_write(fd, header, sizeof(header));
+	if (ret < 0)
+		return ret;
+	ret = send_compress_write(fd, comp->seek_table, table_len);
+	if (ret < 0)
+		return ret;
+	return send_compress_write(fd, &footer, sizeof(footer));
+}
+
+static void send_compress_free(struct send_compress *comp)
+{
+	if (!comp)
+		return;
+
+	pthread_mutex_lock(&comp->mutex);
+	comp->stop = true;
+	pthread_cond_broadcast(&comp->queued_cond);
+	pthread_mutex_unlock(&comp->mutex);
+	for (unsigned int i = 0; i < comp->nr_threads; i++)
+		pthread_join(comp->threads[i], NULL);
+	for (unsigned int i = 0; i < comp->nr_frames; i++) {
+		free(comp->frames[i].in);
+		free(comp->frames[i].out);
+	}
+	pthread_cond_destroy(&comp->done_cond);
+	pthread_cond_destroy(&comp->queued_cond);
+	pthread_mutex_destroy(&comp->mutex);
+	free(comp->seek_table);
+	free(comp->frames);
+	free(comp->threads);
+	free(comp);
+}
+
+static struct send_compress *send_compress_start(int level,
+						 unsigned int nr_threads)
+{
+	struct send_compress *comp;
+
+	comp = calloc(1, sizeof(*comp));
+	if (!comp)
+		return NULL;
+	pthread_mutex_init(&comp->mutex, NULL);
+	pthread_cond_init(&comp->queued_cond, NULL);
+	pthread_cond_init(&comp->done_cond, NULL);
+	comp->level = level;
+
+	/* Keep the threads busy while the oldest frame is written */
+	comp->nr_frames = nr_threads * 2;
+	comp->frames = calloc(comp->nr_frames, sizeof(*comp->frames));
+	comp->threads = calloc(nr_threads, sizeof(*comp->threads));
+	if (!comp->frames || !comp->threads)
+		goto fail;
+	for (unsigned int i = 0; i < comp->nr_frames; i++) {
+		comp->frames[i].in = malloc(SEND_COMPRESS_FRAME_SIZE);
+		comp->frames[i].out = malloc(ZSTD_compressBound(SEND_COMPRESS_FRAME_SIZE));
+		if (!comp->frames[i].in || !comp->frames[i].out)
+			goto fail;
+	}
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		if (pthread_create(&comp->threads[i], NULL, send_compress_worker,
+				   comp))
+			break;
+		comp->nr_threads++;
+	}
+	if (comp->nr_threads)
+		return comp;
+fail:
+	send_compress_free(comp);
+	return NULL;
+}
+
+#else
+
+static int send_compress_read(struct send_compress *comp, int send_fd,
+			      int dump_fd)
+{
+	return -EOPNOTSUPP;
+}
+
+static int send_compress_finish(struct send_compress *comp, int fd)
+{
+	return -EOPNOTSUPP;
+}
+
+static void send_compress_free(struct send_compress *comp)
+{
+}
+
+#endif
+
 static void *read_sent_data(void *arg)
 {
 	int ret;
 	struct btrfs_send *sctx = (struct btrfs_send*)arg;
 
+	if (sctx->compress) {
+		ret = send_compress_read(sctx->compress, sctx->send_fd,
+					 sctx->dump_fd);
+		goto out;
+	}
+
 	while (1) {
 		size_t splice_buf_size = BTRFS_SEND_BUF_SIZE_V1;
 		ssize_t sbytes;
+		u64 start;
 
 		if(sctx->proto > 1){
 			splice_buf_size = BTRFS_SEND_BUF_SIZE_V2;
@@ -215,9 +577,24 @@ static void *read_sent_data(void *arg)
 			/* Try to change pipe buffer size */
 			fcntl(sctx->dump_fd, F_SETPIPE_SZ, splice_buf_size);
 		}
+		/*
+		 * The splice blocks both on the empty pipe and on the output,
+		 * wait for the stream first to tell the kernel time from the
+		 * output time
+		 */
+		if (stats_enabled) {
+			struct pollfd pfd = { .fd = sctx->send_fd, .events = POLLIN };
+
+			start = stats_now_ns();
+			while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+				;
+			stats_op("send kernel wait", 0, start);
+		}
 		/* Source is a pipe, output is either file or stdout */
+		start = stats_io_start();
 		sbytes = splice(sctx->send_fd, NULL, sctx->dump_fd,
 				NULL, splice_buf_size, SPLICE_F_MORE);
+		stats_op("send output", max_t(ssize_t, sbytes, 0), start);
 		if (sbytes < 0) {
 			ret = -errno;
 			error("failed to read stream from kernel: %m");
@@ -246,6 +623,7 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 	void *t_err = NULL;
 	int subvol_fd = -1;
 	int pipefd[2] = {-1, -1};
+	u64 start;
 
 	subvol_fd = openat(send->mnt_fd, subvol, O_RDONLY | O_NOATIME);
 	if (subvol_fd < 0) {
@@ -294,13 +672,19 @@ static int do_send(struct btrfs_send *send, u64 parent_root_id,
 		io_send.flags |= BTRFS_SEND_FLAG_OMIT_STREAM_HEADER;
 	if (!is_last_subvol)
 		io_send.flags |= BTRFS_SEND_FLAG_OMIT_END_CMD;
+	start = stats_io_start();
 	ret = ioctl(subvol_fd, BTRFS_IOC_SEND, &io_send);
+	stats_op("send ioctl", 0, start);
 	if (ret < 0) {
 		ret = -errno;
 		error("send ioctl failed with %d: %m", ret);
 		if (ret == -EINVAL && (!is_first_subvol || !is_last_subvol))
 			pr_stderr(LOG_DEFAULT,
 				"Try upgrading your kernel or don't use -e.\n");
+		/* The reader uses @send, don't leave it running */
+		close(pipefd[1]);
+		pipefd[1] = -1;
+		pthread_join(t_read, NULL);
 		goto out;
 	}
 	pr_stderr(LOG_INFO, "BTRFS_IOC_SEND returned %d\n", ret);
@@ -336,6 +720,297 @@ out:
 	return ret;
 }
 
+/* A subvolume sent by one of the threads of --jobs */
+struct send_job {
+	const char *arg;
+	char *subvol;
+	/* Spool file or the file in --output-dir, -1 when sent to the output */
+	int fd;
+	/* The stream went to the output directly, there's nothing to copy */
+	bool direct;
+	bool done;
+	int ret;
+};
+
+/*
+ * Send the subvolumes by several threads. Each stream is spooled to a
+ * temporary file unless all the previous ones are in the output already, the
+ * main thread copies them to the output in the order of the arguments, so the
+ * result is the same as if sent one after another.
+ */
+struct send_jobs {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	const struct btrfs_send *send;
+	int dir_fd;
+	u64 parent_root_id;
+	u64 flags;
+	bool new_end_cmd_semantic;
+
+	struct send_job *jobs;
+	int nr_jobs;
+	/* The next job to start */
+	int next;
+	/* The jobs before this one are in the output */
+	int written;
+	bool stop;
+};
+
+static int send_job_open_spool(void)
+{
+	const char *tmpdir = getenv("TMPDIR") ?: "/tmp";
+	char *path;
+	int fd;
+
+	if (asprintf(&path, "%s/btrfs-send-XXXXXX", tmpdir) < 0)
+		return -ENOMEM;
+	fd = mkstemp(path);
+	if (fd < 0) {
+		fd = -errno;
+		error("cannot create temporary file in %s: %m", tmpdir);
+	} else {
+		/* Nobody else needs the file, let it go away with the descriptor */
+		unlink(path);
+	}
+	free(path);
+	return fd;
+}
+
+static int send_job_run(struct send_jobs *sj, int index)
+{
+	struct send_job *job = &sj->jobs[index];
+	struct btrfs_send send;
+	int is_first_subvol = 1;
+	int is_last_subvol = 1;
+
+	memcpy(&send, sj->send, sizeof(send));
+	if (sj->dir_fd >= 0) {
+		char *name = path_basename(job->subvol);
+
+		job->fd = openat(sj->dir_fd, name, O_CREAT | O_WRONLY | O_TRUNC, 0600);
+		if (job->fd < 0) {
+			int ret = -errno;
+
+			error("cannot create '%s': %m", name);
+			return ret;
+		}
+	} else if (!job->direct) {
+		job->fd = send_job_open_spool();
+		if (job->fd < 0)
+			return job->fd;
+	}
+	if (job->fd >= 0) {
+		send.dump_fd = job->fd;
+		send.compress = NULL;
+	}
+
+	if (sj->new_end_cmd_semantic) {
+		is_first_subvol = (index == 0);
+		is_last_subvol = (index == sj->nr_jobs - 1);
+	}
+	pr_stderr(LOG_DEFAULT, "At subvol %s\n", job->arg);
+	return do_send(&send, sj->parent_root_id, is_first_subvol,
+		       is_last_subvol, job->subvol, sj->flags);
+}
+
+static void *send_job_worker(void *arg)
+{
+	struct send_jobs *sj = arg;
+
+	while (true) {
+		struct send_job *job;
+		int index;
+		int ret;
+
+		pthread_mutex_lock(&sj->mutex);
+		if (sj->stop || sj->next == sj->nr_jobs) {
+			pthread_mutex_unlock(&sj->mutex);
+			break;
+		}
+		index = sj->next++;
+		job = &sj->jobs[index];
+		job->direct = (sj->dir_fd < 0 && index == sj->written);
+		pthread_mutex_unlock(&sj->mutex);
+
+		ret = send_job_run(sj, index);
+
+		pthread_mutex_lock(&sj->mutex);
+		job->ret = ret;
+		job->done = true;
+		if (ret < 0)
+			sj->stop = true;
+		pthread_cond_broadcast(&sj->cond);
+		pthread_mutex_unlock(&sj->mutex);
+	}
+	return NULL;
+}
+
+/* Append the spooled stream of a job to the output */
+static int send_job_copy(const struct btrfs_send *send, int fd)
+{
+	char *buf;
+	int ret = 0;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		ret = -errno;
+		error("cannot seek the temporary file: %m");
+		return ret;
+	}
+	if (send->compress)
+		return send_compress_read(send->compress, fd, send->dump_fd);
+
+	buf = malloc(SZ_1M);
+	if (!buf)
+		return -ENOMEM;
+	while (true) {
+		ssize_t rbytes;
+		ssize_t written = 0;
+
+		rbytes = read(fd, buf, SZ_1M);
+		if (rbytes < 0) {
+			ret = -errno;
+			error("cannot read the temporary file: %m");
+			break;
+		}
+		if (rbytes == 0)
+			break;
+		while (written < rbytes) {
+			ssize_t wbytes;
+
+			wbytes = write(send->dump_fd, buf + written, rbytes - written);
+			if (wbytes < 0) {
+				ret = -errno;
+				error("failed to write the stream: %m");
+				goto out;
+			}
+			written += wbytes;
+		}
+	}
+out:
+	free(buf);
+	return ret;
+}
+
+static int send_jobs_run(const struct btrfs_send *send, char **args,
+			 int nr_args, unsigned int nr_threads,
+			 const char *output_dir, u64 parent_root_id, u64 flags,
+			 bool new_end_cmd_semantic)
+{
+	struct send_jobs sj = { 0 };
+	pthread_t *threads = NULL;
+	unsigned int started = 0;
+	int ret = 0;
+	int i;
+
+	pthread_mutex_init(&sj.mutex, NULL);
+	pthread_cond_init(&sj.cond, NULL);
+	sj.send = send;
+	sj.dir_fd = -1;
+	sj.parent_root_id = parent_root_id;
+	sj.flags = flags;
+	sj.new_end_cmd_semantic = new_end_cmd_semantic;
+	sj.nr_jobs = nr_args;
+	sj.jobs = calloc(nr_args, sizeof(*sj.jobs));
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!sj.jobs || !threads) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (i = 0; i < nr_args; i++) {
+		sj.jobs[i].arg = args[i];
+		sj.jobs[i].fd = -1;
+		sj.jobs[i].subvol = realpath(args[i], NULL);
+		if (!sj.jobs[i].subvol) {
+			ret = -errno;
+			error("realpath %s failed: %m", args[i]);
+			goto out;
+		}
+	}
+
+	if (output_dir) {
+		/* The files are named by the subvolumes, they must not clash */
+		for (i = 0; i < nr_args; i++) {
+			char *name = path_basename(sj.jobs[i].subvol);
+
+			for (int j = 0; j < i; j++) {
+				if (strcmp(name, path_basename(sj.jobs[j].subvol)) == 0) {
+					error("subvolumes %s and %s have the same name",
+					      args[j], args[i]);
+					ret = -EINVAL;
+					goto out;
+				}
+			}
+		}
+		sj.dir_fd = open(output_dir, O_RDONLY | O_DIRECTORY);
+		if (sj.dir_fd < 0) {
+			ret = -errno;
+			error("cannot open directory '%s': %m", output_dir);
+			goto out;
+		}
+	}
+
+	nr_threads = min_t(unsigned int, nr_threads, nr_args);
+	for (started = 0; started < nr_threads; started++) {
+		ret = pthread_create(&threads[started], NULL, send_job_worker, &sj);
+		if (ret) {
+			ret = -ret;
+			errno = -ret;
+			error("thread setup failed: %m");
+			break;
+		}
+	}
+
+	/*
+	 * The jobs start in order and a failed one stops only the following
+	 * ones, so each job waited for here either finishes or the loop ends at
+	 * an earlier failure.
+	 */
+	for (i = 0; i < nr_args && !ret; i++) {
+		struct send_job *job = &sj.jobs[i];
+
+		pthread_mutex_lock(&sj.mutex);
+		while (!job->done)
+			pthread_cond_wait(&sj.cond, &sj.mutex);
+		pthread_mutex_unlock(&sj.mutex);
+		if (job->ret < 0) {
+			ret = job->ret;
+			break;
+		}
+		if (sj.dir_fd < 0 && !job->direct) {
+			ret = send_job_copy(send, job->fd);
+			close(job->fd);
+			job->fd = -1;
+		}
+		pthread_mutex_lock(&sj.mutex);
+		sj.written = i + 1;
+		pthread_mutex_unlock(&sj.mutex);
+	}
+
+	pthread_mutex_lock(&sj.mutex);
+	if (ret < 0)
+		sj.stop = true;
+	pthread_mutex_unlock(&sj.mutex);
+	for (unsigned int t = 0; t < started; t++)
+		pthread_join(threads[t], NULL);
+
+out:
+	if (sj.jobs) {
+		for (i = 0; i < nr_args; i++) {
+			if (sj.jobs[i].fd >= 0)
+				close(sj.jobs[i].fd);
+			free(sj.jobs[i].subvol);
+		}
+	}
+	if (sj.dir_fd >= 0)
+		close(sj.dir_fd);
+	free(sj.jobs);
+	free(threads);
+	pthread_cond_destroy(&sj.cond);
+	pthread_mutex_destroy(&sj.mutex);
+	return ret;
+}
+
 static int init_root_path(struct btrfs_send *sctx, const char *subvol)
 {
 	int ret = 0;
@@ -362,6 +1037,7 @@ static int init_root_path(struct btrfs_send *sctx, const char *subvol)
 		error("cannot open '%s': %m", sctx->root_path);
 		goto out;
 	}
+	subvol_uuid_cache_init(&sctx->uuid_cache, sctx->mnt_fd);
 
 	if (ret < 0) {
 		errno = -ret;
@@ -428,6 +1104,7 @@ out:
 
 static void free_send_info(struct btrfs_send *sctx)
 {
+	subvol_uuid_cache_release(&sctx->uuid_cache);
 	if (sctx->mnt_fd >= 0) {
 		close(sctx->mnt_fd);
 		sctx->mnt_fd = -1;
@@ -486,6 +1163,17 @@ static const char * const cmd_send_usage[] = {
 	OPTLINE("--proto N", "use protocol version N, or 0 to use the highest version "
 		"supported by the sending kernel (default: 1)"),
 	OPTLINE("--compressed-data", "send data that is compressed on the filesystem directly without decompressing it"),
+	OPTLINE("--compress-stream <algo>[:<level>]", "compress the whole stream by the algorithm, "
+		"only zstd (levels 1..19, default 3), or 'no'"),
+	OPTLINE("--compress-threads <N>", "number of threads compressing the stream "
+		"(1..64), default is the number of online CPUs"),
+	OPTLINE("--jobs <N>", "number of subvolumes sent in parallel (1..64, default: 1), "
+		"the streams are written in the order of the arguments"),
+	OPTLINE("--output-dir <dir>", "write the stream of each subvolume to a file "
+		"named as the subvolume in <dir> instead of one stream"),
+	OPTLINE("--stats[=json]", "print the time of the send ioctl, of waiting "
+		"for the stream from the kernel and of writing it out to stderr "
+		"at the end, same as the global option --stats"),
 	OPTLINE("-v|--verbose", "deprecated, alias for global -v option"),
 	OPTLINE("-q|--quiet", "deprecated, alias for global -q option"),
 	HELPINFO_INSERT_GLOBALS,
@@ -494,6 +1182,47 @@ static const char * const cmd_send_usage[] = {
 	NULL
 };
 
+/* Parse the --compress-stream value, level 0 means no compression */
+static int parse_compress_stream(const char *str, int *level)
+{
+	const char *colon;
+	size_t type_size;
+
+	if (strcmp(str, "no") == 0) {
+		*level = 0;
+		return 0;
+	}
+
+	colon = strchr(str, ':');
+	if (colon)
+		type_size = colon - str;
+	else
+		type_size = strlen(str);
+
+	if (type_size != strlen("zstd") || strncmp(str, "zstd", type_size) != 0) {
+		error("unknown stream compression algorithm: %s", str);
+		return 1;
+	}
+#if COMPRESSION_ZSTD
+	*level = ZSTD_CLEVEL_DEFAULT;
+	if (colon) {
+		u64 tmplevel = arg_strtou64(colon + 1);
+
+		if (tmplevel > SEND_COMPRESS_MAX_LEVEL) {
+			error("compression level %llu out of range [1..%d]",
+			      tmplevel, SEND_COMPRESS_MAX_LEVEL);
+			return 1;
+		}
+		if (tmplevel)
+			*level = tmplevel;
+	}
+	return 0;
+#else
+	error("zstd support not compiled in");
+	return 1;
+#endif
+}
+
 static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 {
 	char *subvol = NULL;
@@ -509,6 +1238,11 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 	bool new_end_cmd_semantic = false;
 	u64 send_flags = 0;
 	u64 proto = 0;
+	int compress_level = 0;
+	u64 compress_threads = 0;
+	u64 jobs = 1;
+	char *output_dir = NULL;
+	bool parallel;
 
 	memset(&send, 0, sizeof(send));
 	send.dump_fd = fileno(stdout);
@@ -532,6 +1266,10 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 			GETOPT_VAL_SEND_NO_DATA = GETOPT_VAL_FIRST,
 			GETOPT_VAL_PROTO,
 			GETOPT_VAL_COMPRESSED_DATA,
+			GETOPT_VAL_COMPRESS_STREAM,
+			GETOPT_VAL_COMPRESS_THREADS,
+			GETOPT_VAL_JOBS,
+			GETOPT_VAL_OUTPUT_DIR,
 		};
 		static const struct option long_options[] = {
 			{ "verbose", no_argument, NULL, 'v' },
@@ -539,6 +1277,13 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 			{ "no-data", no_argument, NULL, GETOPT_VAL_SEND_NO_DATA },
 			{ "proto", required_argument, NULL, GETOPT_VAL_PROTO },
 			{ "compressed-data", no_argument, NULL, GETOPT_VAL_COMPRESSED_DATA },
+			{ "compress-stream", required_argument, NULL,
+				GETOPT_VAL_COMPRESS_STREAM },
+			{ "compress-threads", required_argument, NULL,
+				GETOPT_VAL_COMPRESS_THREADS },
+			{ "jobs", required_argument, NULL, GETOPT_VAL_JOBS },
+			{ "output-dir", required_argument, NULL, GETOPT_VAL_OUTPUT_DIR },
+			{ "stats", optional_argument, NULL, GETOPT_VAL_STATS },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "vqec:f:i:p:", long_options, NULL);
@@ -639,6 +1384,28 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 		case GETOPT_VAL_COMPRESSED_DATA:
 			send_flags |= BTRFS_SEND_FLAG_COMPRESSED;
 			break;
+		case GETOPT_VAL_COMPRESS_STREAM:
+			if (parse_compress_stream(optarg, &compress_level)) {
+				ret = 1;
+				goto out;
+			}
+			break;
+		case GETOPT_VAL_COMPRESS_THREADS:
+			compress_threads = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_JOBS:
+			jobs = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_OUTPUT_DIR:
+			output_dir = optarg;
+			break;
+		case GETOPT_VAL_STATS:
+			if (stats_enable(optarg)) {
+				error("invalid stats format: %s", optarg);
+				ret = 1;
+				goto out;
+			}
+			break;
 		default:
 			usage_unknown_option(cmd, argv);
 		}
@@ -647,6 +1414,44 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 	if (check_argc_min(argc - optind, 1))
 		return 1;
 
+	if (compress_threads > SEND_COMPRESS_MAX_THREADS) {
+		error("number of compression threads out of range: %llu > %d",
+		      compress_threads, SEND_COMPRESS_MAX_THREADS);
+		ret = 1;
+		goto out;
+	}
+
+	if (jobs < 1 || jobs > SEND_MAX_JOBS) {
+		error("number of jobs out of range: %llu, must be 1..%d",
+		      jobs, SEND_MAX_JOBS);
+		ret = 1;
+		goto out;
+	}
+
+	if (jobs > 1 && !full_send && !snapshot_parent) {
+		error("--jobs needs a full send or -p, the parents found among the clone sources depend on the previous subvolumes");
+		ret = 1;
+		goto out;
+	}
+
+	if (output_dir) {
+		if (outname[0]) {
+			error("--output-dir and -f cannot be used together");
+			ret = 1;
+			goto out;
+		}
+		if (new_end_cmd_semantic) {
+			error("--output-dir writes complete streams, -e cannot be used");
+			ret = 1;
+			goto out;
+		}
+		if (compress_level) {
+			error("--output-dir and --compress-stream cannot be used together");
+			ret = 1;
+			goto out;
+		}
+	}
+
 	if (outname[0]) {
 		int tmpfd;
 
@@ -669,7 +1474,7 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 		}
 	}
 
-	if (isatty(send.dump_fd)) {
+	if (!output_dir && isatty(send.dump_fd)) {
 		error(
 	    "not dumping send stream into a terminal, redirect it into a file");
 		ret = 1;
@@ -776,7 +1581,31 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 	pr_stderr(LOG_INFO, "Protocol version requested: %u (supported %u)\n",
 		send.proto, send.proto_supported);
 
-	for (i = optind; i < argc; i++) {
+#if COMPRESSION_ZSTD
+	if (compress_level) {
+		if (!compress_threads)
+			compress_threads = min_t(u64, SEND_COMPRESS_MAX_THREADS,
+						 max_t(long, 1, sysconf(_SC_NPROCESSORS_ONLN)));
+		send.compress = send_compress_start(compress_level,
+						    compress_threads);
+		if (!send.compress) {
+			error("failed to start the stream compression");
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+#endif
+
+	parallel = (jobs > 1 || output_dir);
+	if (parallel) {
+		ret = send_jobs_run(&send, argv + optind, argc - optind, jobs,
+				    output_dir, parent_root_id, send_flags,
+				    new_end_cmd_semantic);
+		if (ret < 0)
+			goto out;
+	}
+
+	for (i = optind; i < argc && !parallel; i++) {
 		int is_first_subvol;
 		int is_last_subvol;
 
@@ -831,9 +1660,16 @@ static int cmd_send(const struct cmd_struct *cmd, int argc, char **argv)
 		}
 	}
 
+	if (send.compress) {
+		ret = send_compress_finish(send.compress, send.dump_fd);
+		if (ret < 0)
+			goto out;
+	}
+
 	ret = 0;
 
 out:
+	send_compress_free(send.compress);
 	free(subvol);
 	free(snapshot_parent);
 	free(send.clone_sources);
@@ -28,6 +28,7 @@
 #include <uuid/uuid.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/uapi/btrfs.h"
@@ -149,9 +150,31 @@ struct root_info {
 
 	char *full_path;
 
+	/* 0 until resolve_root() is called, then 1 or -ENOENT */
+	int resolved;
+
 	int deleted;
 };
 
+/*
+ * Path of a directory inside a subvolume, as returned by the INO_LOOKUP
+ * ioctl, shared by all the subvolumes referenced from the directory.
+ */
+struct dir_path {
+	struct rb_node node;
+	u64 tree_id;
+	u64 dir_id;
+	char *path;
+};
+
+struct dir_path_key {
+	u64 tree_id;
+	u64 dir_id;
+};
+
+/* Buffer of the tree search of the root tree, a few thousand root items */
+#define SUBVOL_SEARCH_BUF_SIZE		(SZ_1M)
+
 typedef int (*btrfs_list_filter_func)(struct root_info *, u64);
 typedef int (*btrfs_list_comp_func)(const struct root_info *a,
 				    const struct root_info *b);
@@ -681,93 +704,159 @@ static void free_root_info(struct rb_node *node)
  * for a given root_info, search through the root_lookup tree to construct
  * the full path name to it.
  *
+ * The parents are resolved on the way and keep their full path, so the
+ * parents shared by many subvolumes are resolved only once.
+ *
  * This can't be called until all the root_info->path fields are filled
  * in by lookup_ino_path
  */
 static int resolve_root(struct rb_root *rl, struct root_info *ri,
 		       u64 top_id)
 {
-	char *full_path = NULL;
-	int len = 0;
+	struct root_info **chain = NULL;
 	struct root_info *found;
+	int nr = 0;
+	int alloc = 0;
+	int ret = 0;
+	int i;
 
 	/*
-	 * we go backwards from the root_info object and add pathnames
-	 * from parent directories as we go.
+	 * we go backwards from the root_info object until the top or the
+	 * first parent already resolved.
 	 */
 	found = ri;
-	while (1) {
-		char *tmp;
+	while (found && !found->resolved) {
 		u64 next;
-		int add_len;
-
-		/*
-		 * ref_tree = 0 indicates the subvolume
-		 * has been deleted.
-		 */
-		if (!found->ref_tree) {
-			free(full_path);
-			return -ENOENT;
-		}
 
-		add_len = strlen(found->path);
+		if (nr == alloc) {
+			struct root_info **tmp;
 
-		if (full_path) {
-			/* room for / and for null */
-			tmp = malloc(add_len + 2 + len);
+			alloc = alloc ? alloc * 2 : 16;
+			tmp = realloc(chain, alloc * sizeof(*chain));
 			if (!tmp) {
 				error_msg(ERROR_MSG_MEMORY, NULL);
 				exit(1);
 			}
-			memcpy(tmp + add_len + 1, full_path, len);
-			tmp[add_len] = '/';
-			memcpy(tmp, found->path, add_len);
-			tmp [add_len + len + 1] = '\0';
-			free(full_path);
-			full_path = tmp;
-			len += add_len + 1;
-		} else {
-			full_path = strdup(found->path);
-			len = add_len;
+			chain = tmp;
 		}
-		if (!ri->top_id)
-			ri->top_id = found->ref_tree;
+		chain[nr++] = found;
 
-		next = found->ref_tree;
-		if (next == top_id)
+		/*
+		 * ref_tree = 0 indicates the subvolume
+		 * has been deleted.
+		 */
+		if (!found->ref_tree) {
+			ret = -ENOENT;
 			break;
+		}
+		if (!found->top_id)
+			found->top_id = found->ref_tree;
+
+		next = found->ref_tree;
 		/*
-		* if the ref_tree = BTRFS_FS_TREE_OBJECTID,
-		* we are at the top
-		*/
-		if (next == BTRFS_FS_TREE_OBJECTID)
+		 * if the ref_tree = BTRFS_FS_TREE_OBJECTID,
+		 * we are at the top
+		 */
+		if (next == top_id || next == BTRFS_FS_TREE_OBJECTID) {
+			found = NULL;
 			break;
+		}
 		/*
-		* if the ref_tree wasn't in our tree of roots, the
-		* subvolume was deleted.
-		*/
+		 * if the ref_tree wasn't in our tree of roots, the
+		 * subvolume was deleted.
+		 */
 		found = root_tree_search(rl, next);
-		if (!found) {
-			free(full_path);
-			return -ENOENT;
+		if (!found)
+			ret = -ENOENT;
+	}
+	if (!ret && found && found->resolved < 0)
+		ret = found->resolved;
+
+	/* Now add the pathnames from the top down to the root_info object */
+	for (i = nr - 1; i >= 0; i--) {
+		struct root_info *entry = chain[i];
+		char *full_path;
+
+		if (ret) {
+			entry->resolved = ret;
+			continue;
 		}
+		if (found) {
+			int len = strlen(found->full_path);
+			int add_len = strlen(entry->path);
+
+			/* room for / and for null */
+			full_path = malloc(len + add_len + 2);
+			if (full_path) {
+				memcpy(full_path, found->full_path, len);
+				full_path[len] = '/';
+				memcpy(full_path + len + 1, entry->path, add_len + 1);
+			}
+		} else {
+			full_path = strdup(entry->path);
+		}
+		if (!full_path) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			exit(1);
+		}
+		entry->full_path = full_path;
+		entry->resolved = 1;
+		found = entry;
 	}
+	free(chain);
+
+	return ret;
+}
 
-	ri->full_path = full_path;
+static int cmp_dir_path(const struct rb_node *node, const void *data)
+{
+	const struct dir_path *dir = rb_entry(node, struct dir_path, node);
+	const struct dir_path_key *key = data;
 
+	if (key->tree_id < dir->tree_id)
+		return -1;
+	if (key->tree_id > dir->tree_id)
+		return 1;
+	if (key->dir_id < dir->dir_id)
+		return -1;
+	if (key->dir_id > dir->dir_id)
+		return 1;
 	return 0;
 }
 
+static int cmp_dir_path_nodes(const struct rb_node *node1,
+			      const struct rb_node *node2)
+{
+	const struct dir_path *dir = rb_entry(node2, struct dir_path, node);
+	struct dir_path_key key = { .tree_id = dir->tree_id, .dir_id = dir->dir_id };
+
+	return cmp_dir_path(node1, &key);
+}
+
+static void free_dir_path(struct rb_node *node)
+{
+	struct dir_path *dir = rb_entry(node, struct dir_path, node);
+
+	free(dir->path);
+	free(dir);
+}
+FREE_RB_BASED_TREE(dir_path, free_dir_path);
+
 /*
  * for a single root_info, ask the kernel to give us a path name
  * inside it's ref_root for the dir_id where it lives.
  *
  * This fills in root_info->path with the path to the directory and and
- * appends this root's name.
+ * appends this root's name.  The subvolumes in the root directory of their
+ * ref_tree need no lookup, the other directories are looked up once and
+ * cached in @dirs.
  */
-static int lookup_ino_path(int fd, struct root_info *ri)
+static int lookup_ino_path(int fd, struct root_info *ri, struct rb_root *dirs)
 {
 	struct btrfs_ioctl_ino_lookup_args args;
+	struct dir_path_key key;
+	struct dir_path *dir;
+	struct rb_node *node;
 	int ret;
 
 	if (ri->path)
@@ -776,48 +865,98 @@ static int lookup_ino_path(int fd, struct root_info *ri)
 	if (!ri->ref_tree)
 		return -ENOENT;
 
-	memset(&args, 0, sizeof(args));
-	args.treeid = ri->ref_tree;
-	args.objectid = ri->dir_id;
-
-	ret = ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args);
-	if (ret < 0) {
-		if (errno == ENOENT) {
-			ri->ref_tree = 0;
-			return -ENOENT;
+	if (ri->dir_id == BTRFS_FIRST_FREE_OBJECTID) {
+		/* we're at the root of ref_tree */
+		ri->path = strdup(ri->name);
+		if (!ri->path) {
+			perror("strdup failed");
+			exit(1);
 		}
-		error("failed to lookup path for root %llu: %m", ri->ref_tree);
-		return ret;
+		return 0;
 	}
 
-	if (args.name[0]) {
+	key.tree_id = ri->ref_tree;
+	key.dir_id = ri->dir_id;
+	node = rb_search(dirs, &key, cmp_dir_path, NULL);
+	if (node) {
+		dir = rb_entry(node, struct dir_path, node);
+	} else {
+		memset(&args, 0, sizeof(args));
+		args.treeid = ri->ref_tree;
+		args.objectid = ri->dir_id;
+
+		ret = ioctl(fd, BTRFS_IOC_INO_LOOKUP, &args);
+		if (ret < 0) {
+			if (errno == ENOENT) {
+				ri->ref_tree = 0;
+				return -ENOENT;
+			}
+			error("failed to lookup path for root %llu: %m", ri->ref_tree);
+			return ret;
+		}
+
 		/*
 		 * we're in a subdirectory of ref_tree, the kernel ioctl
 		 * puts a / in there for us
 		 */
-		ri->path = malloc(strlen(ri->name) + strlen(args.name) + 1);
-		if (!ri->path) {
+		dir = malloc(sizeof(*dir));
+		if (dir)
+			dir->path = strdup(args.name);
+		if (!dir || !dir->path) {
 			error_msg(ERROR_MSG_MEMORY, NULL);
 			exit(1);
 		}
-		strcpy(ri->path, args.name);
-		strcat(ri->path, ri->name);
-	} else {
-		/* we're at the root of ref_tree */
-		ri->path = strdup(ri->name);
-		if (!ri->path) {
-			perror("strdup failed");
-			exit(1);
-		}
+		dir->tree_id = key.tree_id;
+		dir->dir_id = key.dir_id;
+		rb_insert(dirs, &dir->node, cmp_dir_path_nodes);
 	}
+
+	ri->path = malloc(strlen(ri->name) + strlen(dir->path) + 1);
+	if (!ri->path) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		exit(1);
+	}
+	strcpy(ri->path, dir->path);
+	strcat(ri->path, ri->name);
+	return 0;
+}
+
+/*
+ * Search the root tree with a buffer large enough for thousands of items,
+ * falling back to the v1 ioctl and its 4KiB buffer on kernels without v2.
+ */
+static int subvol_search_ioctl(int fd, struct btrfs_ioctl_search_args_v2 *args2,
+			       bool *use_v1)
+{
+	struct btrfs_ioctl_search_args args1;
+	int ret;
+
+	if (!*use_v1) {
+		args2->key.nr_items = (u32)-1;
+		args2->buf_size = SUBVOL_SEARCH_BUF_SIZE;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, args2);
+		if (ret == 0 || errno != ENOTTY)
+			return ret;
+		*use_v1 = true;
+	}
+
+	memcpy(&args1.key, &args2->key, sizeof(args1.key));
+	args1.key.nr_items = 4096;
+	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args1);
+	if (ret < 0)
+		return ret;
+	memcpy(&args2->key, &args1.key, sizeof(args2->key));
+	memcpy(args2->buf, args1.buf, sizeof(args1.buf));
 	return 0;
 }
 
 static int list_subvol_search(int fd, struct rb_root *root_lookup)
 {
 	int ret;
-	struct btrfs_tree_search_args args;
+	struct btrfs_ioctl_search_args_v2 *args;
 	struct btrfs_ioctl_search_key *sk;
+	bool use_v1 = false;
+	char *buf;
 	struct btrfs_root_ref *ref;
 	struct btrfs_root_item *ri;
 	unsigned long off;
@@ -831,8 +970,13 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 
 	root_lookup->rb_node = NULL;
 
-	memset(&args, 0, sizeof(args));
-	sk = btrfs_tree_search_sk(&args);
+	args = calloc(1, sizeof(*args) + SUBVOL_SEARCH_BUF_SIZE);
+	if (!args) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+	sk = &args->key;
+	buf = (char *)args->buf;
 	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
 	/* Search both live and deleted subvolumes */
 	sk->min_type = BTRFS_ROOT_ITEM_KEY;
@@ -843,10 +987,9 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 	sk->max_transid = (u64)-1;
 
 	while(1) {
-		sk->nr_items = 4096;
-		ret = btrfs_tree_search_ioctl(fd, &args);
+		ret = subvol_search_ioctl(fd, args, &use_v1);
 		if (ret < 0)
-			return ret;
+			goto out;
 		if (sk->nr_items == 0)
 			break;
 
@@ -859,10 +1002,10 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 		for (i = 0; i < sk->nr_items; i++) {
 			struct btrfs_ioctl_search_header sh;
 
-			memcpy(&sh, btrfs_tree_search_data(&args, off), sizeof(sh));
+			memcpy(&sh, buf + off, sizeof(sh));
 			off += sizeof(sh);
 			if (sh.type == BTRFS_ROOT_BACKREF_KEY) {
-				ref = btrfs_tree_search_data(&args, off);
+				ref = (struct btrfs_root_ref *)(buf + off);
 				name_len = btrfs_stack_root_ref_name_len(ref);
 				name = (char *)(ref + 1);
 				dir_id = btrfs_stack_root_ref_dirid(ref);
@@ -878,7 +1021,7 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 				u8 puuid[BTRFS_UUID_SIZE];
 				u8 ruuid[BTRFS_UUID_SIZE];
 
-				ri = btrfs_tree_search_data(&args, off);
+				ri = (struct btrfs_root_item *)(buf + off);
 				gen = btrfs_root_generation(ri);
 				flags = btrfs_root_flags(ri);
 				if(sh.len >= sizeof(struct btrfs_root_item)) {
@@ -929,8 +1072,11 @@ static int list_subvol_search(int fd, struct rb_root *root_lookup)
 		if (sk->min_objectid > sk->max_objectid)
 			break;
 	}
+	ret = 0;
 
-	return 0;
+out:
+	free(args);
+	return ret;
 }
 
 static int filter_by_rootid(struct root_info *ri, u64 data)
@@ -1100,20 +1246,17 @@ static int filter_root(struct root_info *ri,
 	return 1;
 }
 
-static void filter_and_sort_subvol(struct rb_root *all_subvols,
-				    struct rb_root *sort_tree,
-				    struct btrfs_list_filter_set *filter_set,
-				    struct btrfs_list_comparer_set *comp_set,
-				    u64 top_id)
+/*
+ * Resolve the full paths of all subvolumes before filtering, the full path
+ * filter changes the paths the children would be resolved from.
+ */
+static void resolve_all_subvols(struct rb_root *all_subvols, u64 top_id)
 {
 	struct rb_node *n;
 	struct root_info *entry;
 	int ret;
 
-	sort_tree->rb_node = NULL;
-
-	n = rb_last(all_subvols);
-	while (n) {
+	for (n = rb_first(all_subvols); n; n = rb_next(n)) {
 		entry = to_root_info(n);
 
 		ret = resolve_root(all_subvols, entry, top_id);
@@ -1131,6 +1274,24 @@ static void filter_and_sort_subvol(struct rb_root *all_subvols,
 				entry->deleted = 0;
 			}
 		}
+	}
+}
+
+static void filter_and_sort_subvol(struct rb_root *all_subvols,
+				    struct rb_root *sort_tree,
+				    struct btrfs_list_filter_set *filter_set,
+				    struct btrfs_list_comparer_set *comp_set)
+{
+	struct rb_node *n;
+	struct root_info *entry;
+	int ret;
+
+	sort_tree->rb_node = NULL;
+
+	n = rb_last(all_subvols);
+	while (n) {
+		entry = to_root_info(n);
+
 		ret = filter_root(entry, filter_set);
 		if (ret)
 			sort_tree_insert(sort_tree, entry, comp_set);
@@ -1348,56 +1509,92 @@ static void print_one_subvol_info_json(struct format_ctx *fctx,
 }
 
 
-static void print_all_subvol_info(struct rb_root *sorted_tree,
-		  enum btrfs_list_layout layout, const char *raw_prefix)
+static void print_subvol_info_start(struct format_ctx *fctx,
+				    enum btrfs_list_layout layout)
 {
-	struct rb_node *n;
-	struct root_info *entry;
-	struct format_ctx fctx;
-
 	if (layout == BTRFS_LIST_LAYOUT_TABLE) {
 		print_all_subvol_info_tab_head();
 	} else if (layout == BTRFS_LIST_LAYOUT_JSON) {
-		fmt_start(&fctx, btrfs_subvolume_rowspec, 1, 0);
-		fmt_print_start_group(&fctx, "subvolume-list", JSON_TYPE_ARRAY);
+		fmt_start(fctx, btrfs_subvolume_rowspec, 1, 0);
+		fmt_print_start_group(fctx, "subvolume-list", JSON_TYPE_ARRAY);
 	}
+}
 
-	n = rb_first(sorted_tree);
-	while (n) {
-		entry = to_root_info_sorted(n);
-
-		/* The toplevel subvolume is not listed by default */
-		if (entry->root_id == BTRFS_FS_TREE_OBJECTID)
-			goto next;
+static void print_one_subvol_info(struct format_ctx *fctx,
+				  struct root_info *entry,
+				  enum btrfs_list_layout layout,
+				  const char *raw_prefix)
+{
+	/* The toplevel subvolume is not listed by default */
+	if (entry->root_id == BTRFS_FS_TREE_OBJECTID)
+		return;
 
-		switch (layout) {
-		case BTRFS_LIST_LAYOUT_DEFAULT:
-			print_one_subvol_info_default(entry);
-			break;
-		case BTRFS_LIST_LAYOUT_TABLE:
-			print_one_subvol_info_table(entry);
-			break;
-		case BTRFS_LIST_LAYOUT_RAW:
-			print_one_subvol_info_raw(entry, raw_prefix);
-			break;
-		case BTRFS_LIST_LAYOUT_JSON:
-			print_one_subvol_info_json(&fctx, entry);
-			break;
-		}
-next:
-		n = rb_next(n);
+	switch (layout) {
+	case BTRFS_LIST_LAYOUT_DEFAULT:
+		print_one_subvol_info_default(entry);
+		break;
+	case BTRFS_LIST_LAYOUT_TABLE:
+		print_one_subvol_info_table(entry);
+		break;
+	case BTRFS_LIST_LAYOUT_RAW:
+		print_one_subvol_info_raw(entry, raw_prefix);
+		break;
+	case BTRFS_LIST_LAYOUT_JSON:
+		print_one_subvol_info_json(fctx, entry);
+		break;
 	}
+}
 
+static void print_subvol_info_end(struct format_ctx *fctx,
+				  enum btrfs_list_layout layout)
+{
 	if (layout == BTRFS_LIST_LAYOUT_JSON) {
-		fmt_print_end_group(&fctx, "subvolume-list");
-		fmt_end(&fctx);
+		fmt_print_end_group(fctx, "subvolume-list");
+		fmt_end(fctx);
+	}
+}
+
+static void print_all_subvol_info(struct rb_root *sorted_tree,
+		  enum btrfs_list_layout layout, const char *raw_prefix)
+{
+	struct rb_node *n;
+	struct format_ctx fctx;
+
+	print_subvol_info_start(&fctx, layout);
+	for (n = rb_first(sorted_tree); n; n = rb_next(n))
+		print_one_subvol_info(&fctx, to_root_info_sorted(n), layout,
+				      raw_prefix);
+	print_subvol_info_end(&fctx, layout);
+}
+
+/*
+ * Without sort options the subvolumes are listed by root id, the order of
+ * @all_subvols, so they're printed as they pass the filters without building
+ * the sorted tree.
+ */
+static void print_filtered_subvol_info(struct rb_root *all_subvols,
+				       struct btrfs_list_filter_set *filter_set,
+				       enum btrfs_list_layout layout,
+				       const char *raw_prefix)
+{
+	struct rb_node *n;
+	struct root_info *entry;
+	struct format_ctx fctx;
+
+	print_subvol_info_start(&fctx, layout);
+	for (n = rb_first(all_subvols); n; n = rb_next(n)) {
+		entry = to_root_info(n);
+		if (filter_root(entry, filter_set))
+			print_one_subvol_info(&fctx, entry, layout, raw_prefix);
 	}
+	print_subvol_info_end(&fctx, layout);
 }
 
 static int btrfs_list_subvols(int fd, struct rb_root *root_lookup)
 {
 	int ret;
 	struct rb_node *n;
+	struct rb_root dirs = RB_ROOT;
 
 	ret = list_subvol_search(fd, root_lookup);
 	if (ret) {
@@ -1414,13 +1611,15 @@ static int btrfs_list_subvols(int fd, struct rb_root *root_lookup)
 		struct root_info *entry;
 
 		entry = to_root_info(n);
-		ret = lookup_ino_path(fd, entry);
+		ret = lookup_ino_path(fd, entry, &dirs);
 		if (ret && ret != -ENOENT)
-			return ret;
+			break;
+		ret = 0;
 		n = rb_next(n);
 	}
+	free_dir_path_tree(&dirs);
 
-	return 0;
+	return ret;
 }
 
 static int btrfs_list_subvols_print(int fd, struct btrfs_list_filter_set *filter_set,
@@ -1443,12 +1642,20 @@ static int btrfs_list_subvols_print(int fd, struct btrfs_list_filter_set *filter
 	}
 
 	ret = btrfs_list_subvols(fd, &root_lookup);
-	if (ret)
+	if (ret) {
+		rb_free_nodes(&root_lookup, free_root_info);
 		return ret;
-	filter_and_sort_subvol(&root_lookup, &root_sort, filter_set,
-				 comp_set, top_id);
+	}
+	resolve_all_subvols(&root_lookup, top_id);
 
-	print_all_subvol_info(&root_sort, layout, raw_prefix);
+	if (comp_set && comp_set->ncomps) {
+		filter_and_sort_subvol(&root_lookup, &root_sort, filter_set,
+				       comp_set);
+		print_all_subvol_info(&root_sort, layout, raw_prefix);
+	} else {
+		print_filtered_subvol_info(&root_lookup, filter_set, layout,
+					   raw_prefix);
+	}
 	rb_free_nodes(&root_lookup, free_root_info);
 
 	return 0;
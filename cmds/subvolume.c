@@ -25,6 +25,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <getopt.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <stdbool.h>
 #include <time.h>
@@ -47,6 +48,7 @@
 #include "common/format-output.h"
 #include "common/tree-search.h"
 #include "common/parse-utils.h"
+#include "common/sort-utils.h"
 #include "cmds/commands.h"
 #include "cmds/qgroup.h"
 
@@ -74,49 +76,188 @@ const struct rowspec btrfs_subvolume_rowspec[] = {
 	ROWSPEC_END
 };
 
+/* Polling interval of subvolume sync without -s, doubled while nothing changes */
+#define SUBVOL_SYNC_MIN_INTERVAL_MS		(50)
+#define SUBVOL_SYNC_MAX_INTERVAL_MS		(1000)
+
+static void subvol_gone(uint64_t *id, size_t *done, size_t count)
+{
+	(*done)++;
+	pr_verbose(LOG_DEFAULT, "Subvolume id %" PRIu64 " is gone (%zu/%zu)\n",
+		   *id, *done, count);
+	*id = 0;
+}
+
+/*
+ * Block in the kernel until each of the subvolumes is cleaned.  Return 0 if
+ * all are gone, or 1 if the ioctl is not supported, not permitted or the
+ * subvolume is not deleted yet (EEXIST) and the rest is left to the polling.
+ */
+static int wait_for_subvolume_sync(int fd, size_t count, uint64_t *ids,
+				   size_t *done)
+{
+	for (size_t i = 0; i < count; i++) {
+		struct btrfs_ioctl_subvol_wait arg = {
+			.subvolid = ids[i],
+			.mode = BTRFS_SUBVOL_SYNC_WAIT_FOR_ONE,
+		};
+		int ret;
+
+		if (!ids[i])
+			continue;
+		do {
+			ret = ioctl(fd, BTRFS_IOC_SUBVOL_SYNC_WAIT, &arg);
+		} while (ret < 0 && errno == EINTR);
+		/* Not found, it's been cleaned already */
+		if (ret < 0 && errno != ENOENT)
+			return 1;
+		subvol_gone(&ids[i], done, count);
+	}
+	return 0;
+}
+
+/*
+ * Clear the @ids, sorted and unique, whose root item is gone.  The root items
+ * of all of them are found by one search of the root tree over their range.
+ * Return the number of the remaining ids or a negative errno.
+ */
+static int find_remaining_subvolumes(int fd, size_t count, uint64_t *ids,
+				     size_t *done)
+{
+	struct btrfs_tree_search_args args;
+	struct btrfs_ioctl_search_key *sk = btrfs_tree_search_sk(&args);
+	struct btrfs_ioctl_search_header sh = { 0 };
+	size_t first = 0;
+	size_t pos;
+	int remaining = 0;
+	int ret;
+
+	while (first < count && !ids[first])
+		first++;
+	if (first == count)
+		return 0;
+
+	memset(&args, 0, sizeof(args));
+	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	sk->min_objectid = ids[first];
+	sk->min_type = BTRFS_ROOT_ITEM_KEY;
+	sk->max_objectid = ids[count - 1];
+	sk->max_type = BTRFS_ROOT_ITEM_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	pos = first;
+	while (1) {
+		unsigned long off = 0;
+
+		sk->nr_items = 4096;
+		ret = btrfs_tree_search_ioctl(fd, &args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			break;
+
+		for (int i = 0; i < sk->nr_items; i++) {
+			memcpy(&sh, btrfs_tree_search_data(&args, off), sizeof(sh));
+			off += sizeof(sh) + sh.len;
+			if (sh.type != BTRFS_ROOT_ITEM_KEY)
+				continue;
+			for (; pos < count && ids[pos] <= sh.objectid; pos++) {
+				if (!ids[pos])
+					continue;
+				if (ids[pos] == sh.objectid)
+					remaining++;
+				else
+					subvol_gone(&ids[pos], done, count);
+			}
+		}
+
+		if (sh.objectid == sk->max_objectid)
+			break;
+		sk->min_objectid = sh.objectid + 1;
+		sk->min_type = BTRFS_ROOT_ITEM_KEY;
+		sk->min_offset = 0;
+	}
+	for (; pos < count; pos++) {
+		if (ids[pos])
+			subvol_gone(&ids[pos], done, count);
+	}
+
+	return remaining;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+	struct timespec ts = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000L,
+	};
+
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Wait until the deleted subvolumes of @ids are cleaned, by the kernel if it
+ * can wait for them, or by polling.  The polling interval is @sleep_interval
+ * seconds, or adaptive if it's 0: it starts short and doubles each time no
+ * subvolume is gone, up to a second.
+ */
 static int wait_for_subvolume_cleaning(int fd, size_t count, uint64_t *ids,
 				       int sleep_interval)
 {
-	size_t i;
-	enum btrfs_util_error err;
 	size_t done = 0;
+	size_t nr = 0;
+	unsigned int interval_ms = SUBVOL_SYNC_MIN_INTERVAL_MS;
 	bool statvfs_warned = false;
 
+	/* The search matches the sorted ids against the root items in order */
+	radix_sort_u64(ids, count, sizeof(*ids), 0);
+	for (size_t i = 0; i < count; i++) {
+		if (nr == 0 || ids[nr - 1] != ids[i])
+			ids[nr++] = ids[i];
+	}
+	count = nr;
+
 	pr_verbose(LOG_DEFAULT, "Waiting for %zu subvolume%s\n", count,
 			(count > 1 ? "s" : ""));
+	if (wait_for_subvolume_sync(fd, count, ids, &done) == 0)
+		return 0;
+
 	while (1) {
 		struct statvfs st;
+		size_t last_done = done;
 		int ret;
-		bool clean = true;
 
-		for (i = 0; i < count; i++) {
-			if (!ids[i])
-				continue;
-			err = btrfs_util_subvolume_get_info_fd(fd, ids[i], NULL);
-			if (err == BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND) {
-				done++;
-				pr_verbose(LOG_DEFAULT, "Subvolume id %" PRIu64 " is gone (%zu/%zu)\n",
-				       ids[i], done, count);
-				ids[i] = 0;
-			} else if (err) {
-				error_btrfs_util(err);
-				return -errno;
-			} else {
-				clean = false;
-			}
+		ret = find_remaining_subvolumes(fd, count, ids, &done);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot search for the subvolumes: %m");
+			return ret;
 		}
-		if (clean)
+		if (ret == 0)
 			break;
 
 		ret = fstatvfs(fd, &st);
-		if (ret < 0 && !statvfs_warned) {
-			statvfs_warned = true;
-			warning("cannot check read-only status of the filesystem: %m");
+		if (ret < 0) {
+			if (!statvfs_warned) {
+				statvfs_warned = true;
+				warning("cannot check read-only status of the filesystem: %m");
+			}
 		} else if (st.f_flag & ST_RDONLY) {
 			warning("filesystem is now read-only");
 			return 1;
 		}
-		sleep(sleep_interval);
+
+		if (sleep_interval) {
+			sleep(sleep_interval);
+			continue;
+		}
+		if (done != last_done)
+			interval_ms = SUBVOL_SYNC_MIN_INTERVAL_MS;
+		sleep_ms(interval_ms);
+		interval_ms = min_t(unsigned int, interval_ms * 2,
+				    SUBVOL_SYNC_MAX_INTERVAL_MS);
 	}
 
 	return 0;
@@ -317,9 +458,95 @@ static int wait_for_commit(int fd)
 	return 0;
 }
 
+/*
+ * Delete the subvolumes by @ids in the filesystem of @path one after another,
+ * and wait for one transaction commit at the end with @commit_after.
+ */
+static int delete_subvolumes_by_id(const char *path, const u64 *ids,
+				   size_t nr, bool commit_after,
+				   bool commit_each)
+{
+	enum btrfs_util_error *errors;
+	enum btrfs_util_error err;
+	uint64_t default_subvol_id = 0;
+	uint64_t *todo;
+	size_t nr_todo = 0;
+	int ret = 0;
+	int fd;
+	size_t i;
+
+	fd = btrfs_open_dir(path);
+	if (fd < 0)
+		return 1;
+
+	todo = calloc(nr, sizeof(*todo));
+	errors = calloc(nr, sizeof(*errors));
+	if (!todo || !errors) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = 1;
+		goto out;
+	}
+
+	err = btrfs_util_subvolume_get_default_fd(fd, &default_subvol_id);
+	if (err == BTRFS_UTIL_ERROR_SEARCH_FAILED) {
+		if (geteuid() != 0)
+			warning("cannot read default subvolume id: %m");
+	}
+
+	for (i = 0; i < nr; i++) {
+		char *subvol = NULL;
+
+		err = btrfs_util_subvolume_get_path_fd(fd, ids[i], &subvol);
+		if (ids[i] == default_subvol_id) {
+			warning("not deleting default subvolume id %llu '%s/%s'",
+				ids[i], path, subvol ? subvol : "");
+			free(subvol);
+			ret = 1;
+			continue;
+		}
+
+		pr_verbose(LOG_DEFAULT, "Delete subvolume %llu (%s): ", ids[i],
+			   commit_each || (commit_after && i + 1 == nr) ?
+			   "commit" : "no-commit");
+		if (!err)
+			pr_verbose(LOG_DEFAULT, "'%s/%s'\n", path, subvol);
+		else
+			pr_verbose(LOG_DEFAULT, "subvolid=%llu\n", ids[i]);
+		free(subvol);
+		todo[nr_todo++] = ids[i];
+	}
+
+	if (bconf_is_dry_run() || nr_todo == 0)
+		goto out;
+
+	if (commit_each) {
+		for (i = 0; i < nr_todo; i++)
+			btrfs_util_subvolume_delete_many_fd(fd, &todo[i], 1,
+					BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT,
+					&errors[i]);
+	} else {
+		btrfs_util_subvolume_delete_many_fd(fd, todo, nr_todo,
+				commit_after ? BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT : 0,
+				errors);
+	}
+	for (i = 0; i < nr_todo; i++) {
+		if (errors[i]) {
+			error("cannot delete subvolume %llu: %s", (u64)todo[i],
+			      btrfs_util_strerror(errors[i]));
+			ret = 1;
+		}
+	}
+
+out:
+	free(errors);
+	free(todo);
+	close(fd);
+	return ret;
+}
+
 static const char * const cmd_subvolume_delete_usage[] = {
 	"btrfs subvolume delete [options] <subvolume> [<subvolume>...]\n"
-	"btrfs subvolume delete [options] -i|--subvolid <subvolid> <path>",
+	"btrfs subvolume delete [options] -i|--subvolid <subvolid> [-i <subvolid>...] <path>",
 	"Delete subvolume(s)",
 	"Delete subvolumes from the filesystem, specified by a path or id. The",
 	"corresponding directory is removed instantly but the data blocks are",
@@ -331,7 +558,7 @@ static const char * const cmd_subvolume_delete_usage[] = {
 	"",
 	OPTLINE("-c|--commit-after", "wait for transaction commit at the end of the operation"),
 	OPTLINE("-C|--commit-each", "wait for transaction commit after deleting each subvolume"),
-	OPTLINE("-i|--subvolid", "subvolume id of the to be removed subvolume"),
+	OPTLINE("-i|--subvolid", "subvolume id of the to be removed subvolume, can be given multiple times"),
 	OPTLINE("-R|--recursive", "delete accessible subvolumes beneath each subvolume recursively, "
 		"this is not atomic, may need root to delete subvolumes not accessible by the user"),
 	OPTLINE("-v|--verbose", "deprecated, alias for global -v option"),
@@ -357,6 +584,8 @@ static int cmd_subvolume_delete(const struct cmd_struct *cmd, int argc, char **a
 	int flags = 0;
 	u8 fsid[BTRFS_FSID_SIZE];
 	u64 subvolid = 0;
+	u64 *subvolids = NULL;
+	size_t nr_subvolids = 0;
 	char uuidbuf[BTRFS_UUID_UNPARSED_SIZE];
 	char full_subvolpath[BTRFS_SUBVOL_NAME_MAX];
 	struct seen_fsid *seen_fsid_hash[SEEN_FSID_HASH_SIZE] = { NULL, };
@@ -387,9 +616,20 @@ static int cmd_subvolume_delete(const struct cmd_struct *cmd, int argc, char **a
 		case 'C':
 			commit_mode = COMMIT_EACH;
 			break;
-		case 'i':
-			subvolid = arg_strtou64(optarg);
+		case 'i': {
+			u64 *tmp;
+
+			tmp = realloc(subvolids, (nr_subvolids + 1) * sizeof(*subvolids));
+			if (!tmp) {
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				free(subvolids);
+				return 1;
+			}
+			subvolids = tmp;
+			subvolids[nr_subvolids++] = arg_strtou64(optarg);
+			subvolid = subvolids[0];
 			break;
+		}
 		case 'R':
 			flags |= BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE;
 			break;
@@ -401,15 +641,20 @@ static int cmd_subvolume_delete(const struct cmd_struct *cmd, int argc, char **a
 		}
 	}
 
-	if (check_argc_min(argc - optind, 1))
+	if (check_argc_min(argc - optind, 1)) {
+		free(subvolids);
 		return 1;
+	}
 
 	/* When using --subvolid, ensure that we have only one argument */
-	if (subvolid > 0 && check_argc_exact(argc - optind, 1))
+	if (subvolid > 0 && check_argc_exact(argc - optind, 1)) {
+		free(subvolids);
 		return 1;
+	}
 
 	if (subvolid > 0 && flags & BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE) {
 		error("option --recursive is not supported with --subvolid");
+		free(subvolids);
 		return 1;
 	}
 
@@ -417,6 +662,16 @@ static int cmd_subvolume_delete(const struct cmd_struct *cmd, int argc, char **a
 		   !commit_mode ? "none (default)" :
 		   commit_mode == COMMIT_AFTER ? "at the end" : "after each");
 
+	if (nr_subvolids > 1) {
+		ret = delete_subvolumes_by_id(argv[optind], subvolids,
+					      nr_subvolids,
+					      commit_mode == COMMIT_AFTER,
+					      commit_mode == COMMIT_EACH);
+		free(subvolids);
+		return ret;
+	}
+	free(subvolids);
+
 	cnt = optind;
 
 	/* Check the following syntax: subvolume delete --subvolid <subvolid> <path> */
@@ -645,7 +900,8 @@ keep_fd:
 static DEFINE_COMMAND_WITH_FLAGS(subvolume_delete, "delete", CMD_DRY_RUN);
 
 static const char * const cmd_subvolume_snapshot_usage[] = {
-	"btrfs subvolume snapshot [-r] [-i <qgroupid>] <subvolume> { <subdir>/<name> | <subdir> }",
+	"btrfs subvolume snapshot [-r] [-i <qgroupid>] <subvolume> { <subdir>/<name> | <subdir> }\n"
+	"btrfs subvolume snapshot [options] <subvolume> <dest> [<subvolume> <dest>...]",
 	"",
 	"Create a snapshot of a <subvolume>. Call it <name> and place it in the <subdir>.",
 	"(<subvolume> will look like a new sub-directory, but is actually a btrfs subvolume",
@@ -653,68 +909,64 @@ static const char * const cmd_subvolume_snapshot_usage[] = {
 	"",
 	"When only <subdir> is given, the subvolume will be named the basename of <subvolume>.",
 	"",
+	"With more pairs of <subvolume> and destination all the snapshots are created,",
+	"the snapshots created at the same time share the transaction commit.",
+	"",
 	OPTLINE("-r", "make the new snapshot readonly"),
 	OPTLINE("-i <qgroupid>", "Add the new snapshot to a qgroup (a quota group). This option can be given multiple times."),
+	OPTLINE("--threads <num>", "number of snapshots created at the same time (default: 1)"),
 	HELPINFO_INSERT_GLOBALS,
 	HELPINFO_INSERT_QUIET,
 	NULL
 };
 
-static int cmd_subvolume_snapshot(const struct cmd_struct *cmd, int argc, char **argv)
-{
-	char	*subvol, *dst;
-	int	res, retval;
-	char	*dstdir = NULL;
-	enum btrfs_util_error err;
-	struct btrfs_util_qgroup_inherit *inherit = NULL;
-	int flags = 0;
+#define SNAPSHOT_MAX_THREADS		(64)
 
-	optind = 0;
-	while (1) {
-		int c = getopt(argc, argv, "i:r");
-		if (c < 0)
-			break;
+/* The snapshots created by one thread */
+struct snapshot_batch {
+	const char **sources;
+	const char **paths;
+	size_t nr;
+	int flags;
+	struct btrfs_util_qgroup_inherit *inherit;
+	enum btrfs_util_error *errors;
+};
 
-		switch (c) {
-		case 'i':
-			res = qgroup_inherit_add_group(&inherit, optarg);
-			if (res) {
-				retval = res;
-				goto out;
-			}
-			break;
-		case 'r':
-			flags |= BTRFS_UTIL_CREATE_SNAPSHOT_READ_ONLY;
-			break;
-		default:
-			usage_unknown_option(cmd, argv);
-		}
-	}
+static void *snapshot_batch_fn(void *arg)
+{
+	struct snapshot_batch *batch = arg;
 
-	if (check_argc_exact(argc - optind, 2)) {
-		retval = 1;
-		goto out;
-	}
+	btrfs_util_subvolume_snapshot_many(batch->sources, batch->paths,
+					   batch->nr, batch->flags,
+					   batch->inherit, batch->errors);
+	return NULL;
+}
 
-	subvol = argv[optind];
-	dst = argv[optind + 1];
+/*
+ * Return the path of the snapshot of @subvol for the destination @dst, which
+ * is either the new name or the directory to create it in, or NULL on error.
+ */
+static char *snapshot_dest_path(const char *subvol, const char *dst)
+{
+	enum btrfs_util_error err;
+	char *dstdir;
+	int res;
 
-	retval = 1;	/* failure */
 	err = btrfs_util_subvolume_is_valid(subvol);
 	if (err) {
 		error_btrfs_util(err);
-		goto out;
+		return NULL;
 	}
 
 	res = path_is_dir(dst);
 	if (res < 0 && res != -ENOENT) {
 		errno = -res;
 		error("cannot access %s: %m", dst);
-		goto out;
+		return NULL;
 	}
 	if (res == 0) {
 		error("'%s' exists and it is not a directory", dst);
-		goto out;
+		return NULL;
 	}
 
 	if (res > 0) {
@@ -728,7 +980,7 @@ static int cmd_subvolume_snapshot(const struct cmd_struct *cmd, int argc, char *
 		if (!dstdir) {
 			error_msg(ERROR_MSG_MEMORY, NULL);
 			free(dupname);
-			goto out;
+			return NULL;
 		}
 
 		dstdir[0] = 0;
@@ -741,25 +993,151 @@ static int cmd_subvolume_snapshot(const struct cmd_struct *cmd, int argc, char *
 		dstdir = strdup(dst);
 	}
 
-	err = btrfs_util_subvolume_snapshot(subvol, dstdir, flags, NULL, inherit);
-	if (err) {
-		error_btrfs_util(err);
+	return dstdir;
+}
+
+static int cmd_subvolume_snapshot(const struct cmd_struct *cmd, int argc, char **argv)
+{
+	int	res, retval;
+	const char **sources = NULL;
+	const char **paths = NULL;
+	enum btrfs_util_error *errors = NULL;
+	struct snapshot_batch batches[SNAPSHOT_MAX_THREADS];
+	pthread_t threads[SNAPSHOT_MAX_THREADS];
+	unsigned int nr_threads = 1;
+	unsigned int started;
+	size_t nr = 0, per_thread, i;
+	struct btrfs_util_qgroup_inherit *inherit = NULL;
+	int flags = 0;
+
+	optind = 0;
+	while (1) {
+		enum { GETOPT_VAL_THREADS = GETOPT_VAL_FIRST };
+		static const struct option long_options[] = {
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ NULL, 0, NULL, 0 }
+		};
+		int c = getopt_long(argc, argv, "i:r", long_options, NULL);
+		if (c < 0)
+			break;
+
+		switch (c) {
+		case 'i':
+			res = qgroup_inherit_add_group(&inherit, optarg);
+			if (res) {
+				retval = res;
+				goto out;
+			}
+			break;
+		case 'r':
+			flags |= BTRFS_UTIL_CREATE_SNAPSHOT_READ_ONLY;
+			break;
+		case GETOPT_VAL_THREADS: {
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp == 0 || tmp > SNAPSHOT_MAX_THREADS) {
+				error("number of threads out of range: %llu, allowed 1..%u",
+				      tmp, SNAPSHOT_MAX_THREADS);
+				retval = 1;
+				goto out;
+			}
+			nr_threads = tmp;
+			break;
+		}
+		default:
+			usage_unknown_option(cmd, argv);
+		}
+	}
+
+	if (check_argc_min(argc - optind, 2)) {
+		retval = 1;
+		goto out;
+	}
+	if ((argc - optind) % 2) {
+		error("the last subvolume has no destination: %s", argv[argc - 1]);
+		retval = 1;
 		goto out;
 	}
 
-	retval = 0;	/* success */
+	retval = 1;	/* failure */
+	nr = (argc - optind) / 2;
+	sources = calloc(nr, sizeof(*sources));
+	paths = calloc(nr, sizeof(*paths));
+	errors = calloc(nr, sizeof(*errors));
+	if (!sources || !paths || !errors) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		goto out;
+	}
 
-	if (flags & BTRFS_UTIL_CREATE_SNAPSHOT_READ_ONLY)
-		pr_verbose(LOG_DEFAULT,
-			   "Create readonly snapshot of '%s' in '%s'\n",
-			   subvol, dstdir);
-	else
-		pr_verbose(LOG_DEFAULT,
-			   "Create snapshot of '%s' in '%s'\n",
-			   subvol, dstdir);
+	for (i = 0; i < nr; i++) {
+		sources[i] = argv[optind + 2 * i];
+		paths[i] = snapshot_dest_path(sources[i], argv[optind + 2 * i + 1]);
+		if (!paths[i])
+			goto out;
+	}
+
+	if (nr == 1) {
+		errors[0] = btrfs_util_subvolume_snapshot(sources[0], paths[0],
+							  flags, NULL, inherit);
+		if (errors[0]) {
+			error_btrfs_util(errors[0]);
+			goto out;
+		}
+	} else {
+		/*
+		 * The kernel commits the transaction for each snapshot, the
+		 * snapshots created in parallel are committed together.
+		 */
+		nr_threads = min_t(size_t, nr_threads, nr);
+		per_thread = (nr + nr_threads - 1) / nr_threads;
+		for (i = 0; i < nr_threads; i++) {
+			size_t first = i * per_thread;
+
+			batches[i].sources = sources + first;
+			batches[i].paths = paths + first;
+			batches[i].nr = min_t(size_t, per_thread, nr - first);
+			batches[i].flags = flags;
+			batches[i].inherit = inherit;
+			batches[i].errors = errors + first;
+		}
+		for (started = 1; started < nr_threads; started++) {
+			if (pthread_create(&threads[started], NULL,
+					   snapshot_batch_fn, &batches[started]))
+				break;
+		}
+		/* Not started batches are done by this thread */
+		for (i = started; i < nr_threads; i++)
+			snapshot_batch_fn(&batches[i]);
+		snapshot_batch_fn(&batches[0]);
+		for (i = 1; i < started; i++)
+			pthread_join(threads[i], NULL);
+	}
+
+	retval = 0;	/* success */
+	for (i = 0; i < nr; i++) {
+		if (errors[i]) {
+			error("cannot create snapshot of '%s' in '%s': %s",
+			      sources[i], paths[i], btrfs_util_strerror(errors[i]));
+			retval = 1;
+		} else if (flags & BTRFS_UTIL_CREATE_SNAPSHOT_READ_ONLY) {
+			pr_verbose(LOG_DEFAULT,
+				   "Create readonly snapshot of '%s' in '%s'\n",
+				   sources[i], paths[i]);
+		} else {
+			pr_verbose(LOG_DEFAULT,
+				   "Create snapshot of '%s' in '%s'\n",
+				   sources[i], paths[i]);
+		}
+	}
 
 out:
-	free(dstdir);
+	if (paths) {
+		for (i = 0; i < nr; i++)
+			free((char *)paths[i]);
+	}
+	free(paths);
+	free(sources);
+	free(errors);
 	btrfs_util_qgroup_inherit_destroy(inherit);
 
 	return retval;
@@ -1726,9 +2104,10 @@ static const char * const cmd_subvolume_sync_usage[] = {
 	"after deletion.",
 	"If no subvolume id is given, wait until all current deletion requests",
 	"are completed, but do not wait for subvolumes deleted meanwhile.",
-	"The status of subvolume ids is checked periodically.",
+	"The kernel is asked to wait for the subvolumes if it can, otherwise their",
+	"status is checked periodically.",
 	"",
-	OPTLINE("-s <N>", "sleep N seconds between checks (default: 1)"),
+	OPTLINE("-s <N>", "sleep N seconds between checks (default: adaptive, up to 1)"),
 	NULL
 };
 
@@ -1738,7 +2117,7 @@ static int cmd_subvolume_sync(const struct cmd_struct *cmd, int argc, char **arg
 	int ret = 1;
 	uint64_t *ids = NULL;
 	size_t id_count, i;
-	int sleep_interval = 1;
+	int sleep_interval = 0;
 	enum btrfs_util_error err;
 
 	optind = 0;
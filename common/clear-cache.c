@@ -38,16 +38,201 @@
 /*
  * Number of free space cache inodes to delete in one transaction.
  *
- * This is to speedup the v1 space cache deletion for large fs.
+ * This is to speedup the v1 space cache deletion for large fs, while keeping
+ * the dirty tree blocks of one transaction bounded.
  */
-#define NR_BLOCK_GROUP_CLUSTER		(16)
+#define NR_CACHE_INODE_CLUSTER		(1024)
+
+static int cmp_u64(const void *a, const void *b)
+{
+	const u64 *va = a;
+	const u64 *vb = b;
+
+	return (*va < *vb ? -1 : *va > *vb ? 1 : 0);
+}
+
+/*
+ * Search for the first item at or after @key, with the path prepared for
+ * deletion of the items of its leaf.
+ *
+ * Return 0 if found, >0 if there is no item after @key, <0 for error.
+ */
+static int search_first_item_for_delete(struct btrfs_trans_handle *trans,
+					struct btrfs_root *root,
+					struct btrfs_key *key,
+					struct btrfs_path *path)
+{
+	int ret;
+
+	ret = btrfs_search_slot(trans, root, key, path, -1, 1);
+	if (ret < 0)
+		return ret;
+	if (path->slots[0] < btrfs_header_nritems(path->nodes[0]))
+		return 0;
+
+	ret = btrfs_next_leaf(root, path);
+	if (ret)
+		return ret;
+	/* The path of btrfs_next_leaf() is not COWed, search again */
+	btrfs_item_key_to_cpu(path->nodes[0], key, path->slots[0]);
+	btrfs_release_path(path);
+	ret = btrfs_search_slot(trans, root, key, path, -1, 1);
+	if (ret > 0)
+		ret = -EUCLEAN;
+	return ret;
+}
+
+/*
+ * Delete the free space headers of all block groups from the root tree, a
+ * leaf worth of items at a time, and return the cache inode numbers sorted.
+ */
+static int delete_free_space_headers(struct btrfs_trans_handle *trans,
+				     u64 **inos_ret, u32 *nr_inos_ret)
+{
+	struct btrfs_root *tree_root = trans->fs_info->tree_root;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	u64 *inos = NULL;
+	u32 nr_inos = 0;
+	u32 max_inos = 0;
+	int ret;
+
+	while (1) {
+		struct extent_buffer *leaf;
+		int slot;
+		int nr = 0;
+
+		key.objectid = BTRFS_FREE_SPACE_OBJECTID;
+		key.type = 0;
+		key.offset = 0;
+		ret = search_first_item_for_delete(trans, tree_root, &key, &path);
+		if (ret < 0)
+			goto out;
+		if (ret > 0)
+			break;
+		leaf = path.nodes[0];
+
+		for (slot = path.slots[0]; slot < btrfs_header_nritems(leaf); slot++) {
+			struct btrfs_free_space_header *header;
+			struct btrfs_disk_key location;
+
+			btrfs_item_key_to_cpu(leaf, &key, slot);
+			if (key.objectid != BTRFS_FREE_SPACE_OBJECTID || key.type != 0)
+				break;
+			if (nr_inos == max_inos) {
+				u64 *tmp;
+
+				max_inos = max(1024U, max_inos * 2);
+				tmp = realloc(inos, max_inos * sizeof(*inos));
+				if (!tmp) {
+					ret = -ENOMEM;
+					goto out;
+				}
+				inos = tmp;
+			}
+			header = btrfs_item_ptr(leaf, slot, struct btrfs_free_space_header);
+			btrfs_free_space_key(leaf, header, &location);
+			inos[nr_inos++] = btrfs_disk_key_objectid(&location);
+			nr++;
+		}
+		if (!nr)
+			break;
+		ret = btrfs_del_items(trans, tree_root, &path, path.slots[0], nr);
+		if (ret < 0) {
+			error("failed to remove free space headers: %d", ret);
+			goto out;
+		}
+		btrfs_release_path(&path);
+	}
+	ret = 0;
+	qsort(inos, nr_inos, sizeof(*inos), cmp_u64);
+	*inos_ret = inos;
+	*nr_inos_ret = nr_inos;
+	inos = NULL;
+out:
+	btrfs_release_path(&path);
+	free(inos);
+	return ret;
+}
+
+/*
+ * Delete the inode and the file extents of one free space cache inode, all of
+ * the items of a leaf in one go.
+ */
+static int delete_cache_inode(struct btrfs_trans_handle *trans, u64 ino)
+{
+	struct btrfs_root *tree_root = trans->fs_info->tree_root;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	while (1) {
+		struct extent_buffer *leaf;
+		int slot;
+		int nr = 0;
+
+		key.objectid = ino;
+		key.type = 0;
+		key.offset = 0;
+		ret = search_first_item_for_delete(trans, tree_root, &key, &path);
+		if (ret < 0)
+			break;
+		if (ret > 0) {
+			ret = 0;
+			break;
+		}
+		leaf = path.nodes[0];
+		for (slot = path.slots[0]; slot < btrfs_header_nritems(leaf); slot++) {
+			struct btrfs_file_extent_item *fi;
+			u64 disk_bytenr;
+			u64 disk_num_bytes;
+
+			btrfs_item_key_to_cpu(leaf, &key, slot);
+			if (key.objectid != ino ||
+			    (key.type != BTRFS_INODE_ITEM_KEY &&
+			     key.type != BTRFS_EXTENT_DATA_KEY))
+				break;
+			nr++;
+			if (key.type != BTRFS_EXTENT_DATA_KEY)
+				continue;
+
+			fi = btrfs_item_ptr(leaf, slot, struct btrfs_file_extent_item);
+			if (btrfs_file_extent_type(leaf, fi) == BTRFS_FILE_EXTENT_INLINE)
+				continue;
+			disk_bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+			disk_num_bytes = btrfs_file_extent_disk_num_bytes(leaf, fi);
+			if (!disk_bytenr)
+				continue;
+			ret = btrfs_free_extent(trans, disk_bytenr, disk_num_bytes, 0,
+						tree_root->objectid, ino, key.offset);
+			if (ret < 0) {
+				error("failed to remove backref for disk bytenr %llu: %d",
+				      disk_bytenr, ret);
+				goto out;
+			}
+		}
+		if (!nr) {
+			ret = 0;
+			break;
+		}
+		ret = btrfs_del_items(trans, tree_root, &path, path.slots[0], nr);
+		if (ret < 0) {
+			error("failed to delete free space cache inode %llu: %d",
+			      ino, ret);
+			break;
+		}
+		btrfs_release_path(&path);
+	}
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
 
 int btrfs_clear_v1_cache(struct btrfs_fs_info *fs_info)
 {
 	struct btrfs_trans_handle *trans;
-	struct btrfs_block_group *bg_cache;
-	int nr_handled = 0;
-	u64 current = 0;
+	u64 *inos = NULL;
+	u32 nr_inos = 0;
 	int ret = 0;
 
 	trans = btrfs_start_transaction(fs_info->tree_root, 0);
@@ -59,41 +244,44 @@ int btrfs_clear_v1_cache(struct btrfs_fs_info *fs_info)
 	}
 
 	/* Clear all free space cache inodes and its extent data */
-	while (1) {
-		bg_cache = btrfs_lookup_first_block_group(fs_info, current);
-		if (!bg_cache)
-			break;
-		ret = btrfs_clear_free_space_cache(trans, bg_cache);
+	ret = delete_free_space_headers(trans, &inos, &nr_inos);
+	if (ret < 0) {
+		btrfs_abort_transaction(trans, ret);
+		return ret;
+	}
+
+	for (u32 i = 0; i < nr_inos; i++) {
+		ret = delete_cache_inode(trans, inos[i]);
 		if (ret < 0) {
 			btrfs_abort_transaction(trans, ret);
-			return ret;
+			goto out;
 		}
-		nr_handled++;
 
-		if (nr_handled == NR_BLOCK_GROUP_CLUSTER) {
+		if ((i + 1) % NR_CACHE_INODE_CLUSTER == 0) {
 			ret = btrfs_commit_transaction(trans, fs_info->tree_root);
 			if (ret < 0) {
 				errno = -ret;
-				error_msg(ERROR_MSG_START_TRANS, "%m");
-				return ret;
+				error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+				goto out;
 			}
 			trans = btrfs_start_transaction(fs_info->tree_root, 0);
 			if (IS_ERR(trans)) {
 				ret = PTR_ERR(trans);
 				errno = -ret;
 				error_msg(ERROR_MSG_START_TRANS, "%m");
-				return ret;
+				goto out;
 			}
 		}
-		current = bg_cache->start + bg_cache->length;
 	}
 
 	btrfs_set_super_cache_generation(fs_info->super_copy, (u64)-1);
 	ret = btrfs_commit_transaction(trans, fs_info->tree_root);
 	if (ret < 0) {
 		errno = -ret;
-		error_msg(ERROR_MSG_START_TRANS, "%m");
+		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
 	}
+out:
+	free(inos);
 	return ret;
 }
 
@@ -213,70 +401,6 @@ static int check_cache_range(struct btrfs_root *root,
 			     u64 offset, u64 bytes)
 {
 	struct btrfs_free_space *entry;
-	u64 *logical;
-	u64 bytenr;
-	int stripe_len;
-	int i, nr, ret;
-
-	for (i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
-		bytenr = btrfs_sb_offset(i);
-		ret = btrfs_rmap_block(root->fs_info,
-				       cache->start, bytenr,
-				       &logical, &nr, &stripe_len);
-		if (ret)
-			return ret;
-
-		while (nr--) {
-			if (logical[nr] + stripe_len <= offset)
-				continue;
-			if (offset + bytes <= logical[nr])
-				continue;
-			if (logical[nr] == offset) {
-				if (stripe_len >= bytes) {
-					free(logical);
-					return 0;
-				}
-				bytes -= stripe_len;
-				offset += stripe_len;
-			} else if (logical[nr] < offset) {
-				if (logical[nr] + stripe_len >=
-				    offset + bytes) {
-					free(logical);
-					return 0;
-				}
-				bytes = (offset + bytes) -
-					(logical[nr] + stripe_len);
-				offset = logical[nr] + stripe_len;
-			} else {
-				/*
-				 * Could be tricky, the super may land in the
-				 * middle of the area we're checking.  First
-				 * check the easiest case, it's at the end.
-				 */
-				if (logical[nr] + stripe_len >=
-				    bytes + offset) {
-					bytes = logical[nr] - offset;
-					continue;
-				}
-
-				/* Check the left side */
-				ret = check_cache_range(root, cache,
-							offset,
-							logical[nr] - offset);
-				if (ret) {
-					free(logical);
-					return ret;
-				}
-
-				/* Now we continue with the right side */
-				bytes = (offset + bytes) -
-					(logical[nr] + stripe_len);
-				offset = logical[nr] + stripe_len;
-			}
-		}
-
-		free(logical);
-	}
 
 	entry = btrfs_find_free_space(cache->free_space_ctl, offset, bytes);
 	if (!entry) {
@@ -302,6 +426,33 @@ static int check_cache_range(struct btrfs_root *root,
 	return 0;
 }
 
+/*
+ * The super block copies are not free space in the cache, mark them used so
+ * the free ranges of the block group end at them. This maps the copies once
+ * per block group and not for each free range.
+ */
+static int mark_super_stripes_used(struct btrfs_fs_info *fs_info,
+				   struct btrfs_block_group *cache,
+				   struct extent_io_tree *used)
+{
+	u64 *logical;
+	int stripe_len;
+	int nr;
+	int ret;
+
+	for (int i = 0; i < BTRFS_SUPER_MIRROR_MAX; i++) {
+		ret = btrfs_rmap_block(fs_info, cache->start, btrfs_sb_offset(i),
+				       &logical, &nr, &stripe_len);
+		if (ret)
+			return ret;
+		while (nr--)
+			set_extent_dirty(used, logical[nr],
+					 logical[nr] + stripe_len - 1, GFP_NOFS);
+		free(logical);
+	}
+	return 0;
+}
+
 static int verify_space_cache(struct btrfs_root *root,
 			      struct btrfs_block_group *cache,
 			      struct extent_io_tree *used)
@@ -404,6 +555,13 @@ static int check_space_cache(struct btrfs_root *root, struct task_ctx *task_ctx)
 				continue;
 		}
 
+		ret = mark_super_stripes_used(fs_info, cache, &used);
+		if (ret) {
+			errno = -ret;
+			fprintf(stderr, "could not map super stripes: %m\n");
+			error++;
+			continue;
+		}
 		ret = verify_space_cache(root, cache, &used);
 		if (ret) {
 			fprintf(stderr, "cache appears valid but isn't %llu\n",
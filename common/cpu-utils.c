@@ -15,6 +15,8 @@
  */
 
 #include <stdio.h>
+#include <unistd.h>
+#include <sched.h>
 #include "common/cpu-utils.h"
 
 unsigned long __cpu_flags = CPU_FLAG_NONE;
@@ -58,6 +60,8 @@ void cpu_print_flags(void) {
 	FLAG(SHA);
 	FLAG(AVX);
 	FLAG(AVX2);
+	FLAG(AVX512BW);
+	FLAG(NEON);
 	putchar(10);
 }
 #undef FLAG
@@ -86,6 +90,8 @@ void cpu_detect_flags(void)
 		__cpu_flags |= CPU_FLAG_AVX;
 	if (__builtin_cpu_supports("avx2"))
 		__cpu_flags |= CPU_FLAG_AVX2;
+	if (__builtin_cpu_supports("avx512bw"))
+		__cpu_flags |= CPU_FLAG_AVX512BW;
 
 	/* Flags unsupported by builtins */
 	__cpuidex(7, 0, a, b, c, d);
@@ -95,6 +101,19 @@ void cpu_detect_flags(void)
 	__cpu_flags_orig = __cpu_flags;
 }
 
+#elif defined(__aarch64__)
+
+/* Advanced SIMD is mandatory on aarch64 */
+void cpu_detect_flags(void)
+{
+	__cpu_flags = CPU_FLAG_NEON;
+	__cpu_flags_orig = __cpu_flags;
+}
+
+#endif
+
+#if defined(__x86_64__) || defined(__aarch64__)
+
 void cpu_set_level(unsigned long topbit)
 {
 	if (topbit)
@@ -117,3 +136,18 @@ void cpu_set_level(unsigned long topbit) { }
 void cpu_reset_level(void) { }
 
 #endif
+
+/*
+ * Number of CPUs the process may run on, i.e. the online CPUs limited by the
+ * affinity mask (taskset, cgroup cpusets).
+ */
+unsigned int cpu_nr_usable(void)
+{
+	cpu_set_t set;
+	long nr_cpus;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+		return CPU_COUNT(&set);
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	return nr_cpus > 0 ? nr_cpus : 1;
+}
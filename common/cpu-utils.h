@@ -15,7 +15,7 @@
  */
 
 /*
- * Detect CPU feature bits at runtime (x86_64 only)
+ * Detect CPU feature bits at runtime (x86_64 and aarch64 only)
  */
 
 #ifndef __CPU_UTILS_H__
@@ -38,6 +38,8 @@ enum cpu_feature {
 	ENUM_CPU_BIT(CPU_FLAG_SHA),
 	ENUM_CPU_BIT(CPU_FLAG_AVX),
 	ENUM_CPU_BIT(CPU_FLAG_AVX2),
+	ENUM_CPU_BIT(CPU_FLAG_AVX512BW),
+	ENUM_CPU_BIT(CPU_FLAG_NEON),
 };
 
 #undef ENUM_CPU_BIT
@@ -51,6 +53,7 @@ void cpu_detect_flags(void);
 void cpu_set_level(unsigned long topbit);
 void cpu_reset_level(void);
 void cpu_print_flags(void);
+unsigned int cpu_nr_usable(void);
 
 static inline bool cpu_has_feature(enum cpu_feature f)
 {
@@ -30,6 +30,7 @@
 #include <dirent.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <blkid/blkid.h>
 #include <uuid/uuid.h>
 #ifdef HAVE_LIBUDEV
@@ -219,7 +220,7 @@ int btrfs_add_to_fsid(struct btrfs_trans_handle *trans,
 	return 0;
 
 out:
-	free(device->zone_info);
+	btrfs_free_zone_info(device->zone_info);
 	free(device);
 	free(buf);
 	return ret;
@@ -439,16 +440,113 @@ static bool is_multipath_path_device(dev_t device)
 }
 #endif
 
+/* Threads reading the super blocks of the devices found by blkid */
+#define SCAN_PROBE_THREADS		(16)
+
+/* A device found by blkid, probed by btrfs_scan_devices() */
+struct scan_probe {
+	char path[PATH_MAX];
+	struct btrfs_super_block super;
+	enum {
+		SCAN_PROBE_SKIP,
+		SCAN_PROBE_OPEN_FAILED,
+		SCAN_PROBE_READ_FAILED,
+		SCAN_PROBE_OK,
+	} result;
+	int err;
+};
+
+struct scan_probes {
+	struct scan_probe *probes;
+	int nr;
+	int next;
+	pthread_mutex_t mutex;
+};
+
+static void scan_probe_one(struct scan_probe *probe)
+{
+	struct stat dev_stat;
+	int fd;
+	int ret;
+
+	probe->result = SCAN_PROBE_SKIP;
+	if (stat(probe->path, &dev_stat) < 0)
+		return;
+
+	if (is_multipath_path_device(dev_stat.st_rdev))
+		return;
+
+	fd = open(probe->path, O_RDONLY);
+	if (fd < 0) {
+		probe->result = SCAN_PROBE_OPEN_FAILED;
+		probe->err = errno;
+		return;
+	}
+	ret = btrfs_read_dev_super(fd, &probe->super, BTRFS_SUPER_INFO_OFFSET,
+				   SBREAD_DEFAULT);
+	close(fd);
+	if (ret < 0) {
+		probe->result = SCAN_PROBE_READ_FAILED;
+		probe->err = EIO;
+		return;
+	}
+	probe->result = SCAN_PROBE_OK;
+}
+
+static void *scan_probe_worker(void *arg)
+{
+	struct scan_probes *sp = arg;
+
+	pthread_mutex_lock(&sp->mutex);
+	while (sp->next < sp->nr) {
+		struct scan_probe *probe = &sp->probes[sp->next++];
+
+		pthread_mutex_unlock(&sp->mutex);
+		scan_probe_one(probe);
+		pthread_mutex_lock(&sp->mutex);
+	}
+	pthread_mutex_unlock(&sp->mutex);
+	return NULL;
+}
+
+/*
+ * Read the super blocks of all the probed devices, in parallel as the devices
+ * can be slow to open and read, e.g. many LUNs behind multipath.
+ */
+static void scan_probe_all(struct scan_probe *probes, int nr)
+{
+	struct scan_probes sp = {
+		.probes = probes,
+		.nr = nr,
+	};
+	pthread_t threads[SCAN_PROBE_THREADS];
+	int nr_threads = min(nr, SCAN_PROBE_THREADS);
+	int i;
+
+	pthread_mutex_init(&sp.mutex, NULL);
+	for (i = 0; i < nr_threads && nr_threads > 1; i++) {
+		if (pthread_create(&threads[i], NULL, scan_probe_worker, &sp))
+			break;
+	}
+	nr_threads = i;
+	/* The rest of the devices, or all if no thread could be started */
+	scan_probe_worker(&sp);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&sp.mutex);
+}
+
 int btrfs_scan_devices(int verbose)
 {
-	int fd = -1;
 	int ret;
 	u64 num_devices;
 	struct btrfs_fs_devices *tmp_devices;
+	struct scan_probe *probes = NULL;
+	int nr_probes = 0;
+	int alloc_probes = 0;
 	blkid_dev_iterate iter = NULL;
 	blkid_dev dev = NULL;
 	blkid_cache cache = NULL;
-	char path[PATH_MAX];
 
 	if (btrfs_scan_done)
 		return 0;
@@ -463,46 +561,317 @@ int btrfs_scan_devices(int verbose)
 	iter = blkid_dev_iterate_begin(cache);
 	blkid_dev_set_search(iter, "TYPE", "btrfs");
 	while (blkid_dev_next(iter, &dev) == 0) {
-		struct stat dev_stat;
-
 		dev = blkid_verify(cache, dev);
 		if (!dev)
 			continue;
+		if (nr_probes == alloc_probes) {
+			struct scan_probe *tmp;
+
+			alloc_probes = max(16, alloc_probes * 2);
+			tmp = realloc(probes, alloc_probes * sizeof(*probes));
+			if (!tmp) {
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				ret = -ENOMEM;
+				goto out;
+			}
+			probes = tmp;
+		}
 		/* if we are here its definitely a btrfs disk*/
-		strncpy_null(path, blkid_dev_devname(dev), sizeof(path));
+		strncpy_null(probes[nr_probes].path, blkid_dev_devname(dev),
+			     sizeof(probes[nr_probes].path));
+		nr_probes++;
+	}
 
-		if (stat(path, &dev_stat) < 0)
-			continue;
+	scan_probe_all(probes, nr_probes);
 
-		if (is_multipath_path_device(dev_stat.st_rdev))
-			continue;
+	/* Register in the order of blkid, the same as a serial scan */
+	for (int i = 0; i < nr_probes; i++) {
+		struct scan_probe *probe = &probes[i];
 
-		fd = open(path, O_RDONLY);
-		if (fd < 0) {
-			error("cannot open %s: %m", path);
+		switch (probe->result) {
+		case SCAN_PROBE_SKIP:
+			continue;
+		case SCAN_PROBE_OPEN_FAILED:
+			errno = probe->err;
+			error("cannot open %s: %m", probe->path);
 			continue;
+		case SCAN_PROBE_READ_FAILED:
+			errno = probe->err;
+			error("cannot scan %s: %m", probe->path);
+			continue;
+		case SCAN_PROBE_OK:
+			break;
 		}
-		ret = btrfs_scan_one_device(fd, path, &tmp_devices,
-				&num_devices, BTRFS_SUPER_INFO_OFFSET,
-				SBREAD_DEFAULT);
+		ret = btrfs_scan_one_super(probe->path, &probe->super,
+					   &tmp_devices, &num_devices);
 		if (ret) {
 			errno = -ret;
-			error("cannot scan %s: %m", path);
-			close (fd);
+			error("cannot scan %s: %m", probe->path);
 			continue;
 		}
-		pr_verbose(verbose, "registered: %s\n", path);
-
-		close(fd);
+		pr_verbose(verbose, "registered: %s\n", probe->path);
 	}
+	ret = 0;
+	btrfs_scan_done = 1;
+out:
+	free(probes);
 	blkid_dev_iterate_end(iter);
 	blkid_put_cache(cache);
 
-	btrfs_scan_done = 1;
+	return ret;
+}
 
+/*
+ * Optional cache of the btrfs devices found by btrfs_scan_devices(), in the
+ * file set by the environment variable SCAN_CACHE_ENV.  One line per device:
+ *
+ *   <fsid> <devid> <generation> <major>:<minor> <path>
+ *
+ * Only block devices are cached.  See btrfs_scan_devices_cached().
+ */
+#define SCAN_CACHE_ENV			"BTRFS_DEVICE_SCAN_CACHE"
+#define SCAN_CACHE_HEADER		"# btrfs device scan cache v1"
+
+struct scan_cache_entry {
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 devid;
+	u64 generation;
+	dev_t rdev;
+	char path[PATH_MAX];
+};
+
+static int scan_cache_parse(const char *line, struct scan_cache_entry *entry)
+{
+	char fsid[BTRFS_UUID_UNPARSED_SIZE];
+	unsigned int maj, min;
+	int path_pos = 0;
+
+	if (sscanf(line, "%36s %llu %llu %u:%u %n", fsid, &entry->devid,
+		   &entry->generation, &maj, &min, &path_pos) != 5 || !path_pos)
+		return -EINVAL;
+	if (uuid_parse(fsid, entry->fsid))
+		return -EINVAL;
+	entry->rdev = makedev(maj, min);
+	strncpy_null(entry->path, line + path_pos, sizeof(entry->path));
+	entry->path[strcspn(entry->path, "\n")] = 0;
+	if (!entry->path[0])
+		return -EINVAL;
 	return 0;
 }
 
+/* Read all entries of the cache, return the number of entries or <0 */
+static int scan_cache_read(const char *cache_path,
+			   struct scan_cache_entry **entries_ret)
+{
+	struct scan_cache_entry *entries = NULL;
+	char *line = NULL;
+	size_t len = 0;
+	int nr = 0;
+	int alloc = 0;
+	FILE *file;
+
+	file = fopen(cache_path, "r");
+	if (!file)
+		return -errno;
+	if (getline(&line, &len, file) < 0 ||
+	    strncmp(line, SCAN_CACHE_HEADER, strlen(SCAN_CACHE_HEADER)) != 0) {
+		nr = -EINVAL;
+		goto out;
+	}
+	while (getline(&line, &len, file) >= 0) {
+		if (nr == alloc) {
+			struct scan_cache_entry *tmp;
+
+			alloc = max(16, alloc * 2);
+			tmp = realloc(entries, alloc * sizeof(*entries));
+			if (!tmp) {
+				nr = -ENOMEM;
+				goto out;
+			}
+			entries = tmp;
+		}
+		if (scan_cache_parse(line, &entries[nr]) < 0) {
+			nr = -EINVAL;
+			goto out;
+		}
+		nr++;
+	}
+out:
+	free(line);
+	fclose(file);
+	if (nr < 0) {
+		free(entries);
+		return nr;
+	}
+	*entries_ret = entries;
+	return nr;
+}
+
+/* Write the cache atomically, by a rename of a temporary file */
+static void scan_cache_write(const char *cache_path,
+			     const struct scan_cache_entry *entries, int nr)
+{
+	char tmp_path[PATH_MAX];
+	FILE *file;
+	int ret;
+
+	ret = snprintf(tmp_path, sizeof(tmp_path), "%s.%d", cache_path, getpid());
+	if (ret < 0 || ret >= sizeof(tmp_path))
+		return;
+	file = fopen(tmp_path, "w");
+	if (!file)
+		return;
+	fprintf(file, "%s\n", SCAN_CACHE_HEADER);
+	for (int i = 0; i < nr; i++) {
+		char fsid[BTRFS_UUID_UNPARSED_SIZE];
+
+		uuid_unparse(entries[i].fsid, fsid);
+		fprintf(file, "%s %llu %llu %u:%u %s\n", fsid, entries[i].devid,
+			entries[i].generation, major(entries[i].rdev),
+			minor(entries[i].rdev), entries[i].path);
+	}
+	if (fclose(file) != 0 || rename(tmp_path, cache_path) < 0)
+		unlink(tmp_path);
+}
+
+/* Write the cache from all the devices registered by a full scan */
+static void scan_cache_write_scanned(const char *cache_path)
+{
+	struct scan_cache_entry *entries = NULL;
+	struct btrfs_fs_devices *fs_devices;
+	struct btrfs_device *device;
+	int nr = 0;
+	int alloc = 0;
+
+	list_for_each_entry(fs_devices, btrfs_scanned_uuids(), fs_list) {
+		list_for_each_entry(device, &fs_devices->devices, dev_list) {
+			struct scan_cache_entry *entry;
+			struct stat st;
+
+			if (!device->name || stat(device->name, &st) < 0 ||
+			    !S_ISBLK(st.st_mode))
+				continue;
+			if (nr == alloc) {
+				struct scan_cache_entry *tmp;
+
+				alloc = max(16, alloc * 2);
+				tmp = realloc(entries, alloc * sizeof(*entries));
+				if (!tmp)
+					goto out;
+				entries = tmp;
+			}
+			entry = &entries[nr++];
+			memcpy(entry->fsid, fs_devices->fsid, BTRFS_FSID_SIZE);
+			entry->devid = device->devid;
+			entry->generation = device->generation;
+			entry->rdev = st.st_rdev;
+			strncpy_null(entry->path, device->name, sizeof(entry->path));
+		}
+	}
+	scan_cache_write(cache_path, entries, nr);
+out:
+	free(entries);
+}
+
+/*
+ * Register the devices of @fs_devices listed in the cache.  Each device must
+ * still be the same block device, with the same fsid and devid in its super
+ * block, and the same generation as the already scanned device.
+ *
+ * Return 0 if all @total_devs devices have been registered, 1 if the cache is
+ * stale or lacks a device, or <0 on error.
+ */
+static int scan_cache_register(const char *cache_path,
+			       struct btrfs_fs_devices *fs_devices,
+			       u64 total_devs)
+{
+	struct scan_cache_entry *entries = NULL;
+	bool changed = false;
+	int nr;
+	int ret = 0;
+
+	if (fs_devices->changing_fsid || fs_devices->inconsistent_super)
+		return 1;
+
+	nr = scan_cache_read(cache_path, &entries);
+	if (nr < 0)
+		return 1;
+
+	for (int i = 0; i < nr; i++) {
+		struct scan_cache_entry *entry = &entries[i];
+		struct btrfs_super_block super;
+		struct btrfs_fs_devices *tmp_devices;
+		struct stat st;
+		u64 num_devices;
+		int fd;
+
+		if (memcmp(entry->fsid, fs_devices->fsid, BTRFS_FSID_SIZE))
+			continue;
+		if (stat(entry->path, &st) < 0 || !S_ISBLK(st.st_mode) ||
+		    st.st_rdev != entry->rdev) {
+			ret = 1;
+			break;
+		}
+		fd = open(entry->path, O_RDONLY);
+		if (fd < 0) {
+			ret = 1;
+			break;
+		}
+		ret = btrfs_read_dev_super(fd, &super, BTRFS_SUPER_INFO_OFFSET,
+					   SBREAD_DEFAULT);
+		close(fd);
+		if (ret < 0 ||
+		    memcmp(super.fsid, fs_devices->fsid, BTRFS_FSID_SIZE) ||
+		    btrfs_stack_device_id(&super.dev_item) != entry->devid ||
+		    btrfs_super_generation(&super) != fs_devices->latest_generation) {
+			ret = 1;
+			break;
+		}
+		ret = btrfs_scan_one_super(entry->path, &super, &tmp_devices,
+					   &num_devices);
+		if (ret < 0)
+			break;
+		if (entry->generation != btrfs_super_generation(&super)) {
+			entry->generation = btrfs_super_generation(&super);
+			changed = true;
+		}
+	}
+	if (!ret && fs_devices->num_devices < total_devs)
+		ret = 1;
+	if (!ret && changed)
+		scan_cache_write(cache_path, entries, nr);
+	free(entries);
+	return ret;
+}
+
+/*
+ * Find the other devices of the multi-device filesystem @fs_devices, with
+ * @total_devs devices, whose first device has been scanned already.
+ *
+ * Without the cache this is btrfs_scan_devices().  With the cache, the cached
+ * devices of the filesystem are validated and registered, and only if any of
+ * them is stale or missing all the devices are scanned and the cache is
+ * rewritten.
+ */
+int btrfs_scan_devices_cached(struct btrfs_fs_devices *fs_devices,
+			      u64 total_devs)
+{
+	const char *cache_path = getenv(SCAN_CACHE_ENV);
+	int ret;
+
+	if (!cache_path || !cache_path[0] || btrfs_scan_done)
+		return btrfs_scan_devices(0);
+
+	ret = scan_cache_register(cache_path, fs_devices, total_devs);
+	if (ret <= 0)
+		return ret;
+
+	ret = btrfs_scan_devices(0);
+	if (!ret)
+		scan_cache_write_scanned(cache_path);
+	return ret;
+}
+
 int btrfs_scan_argv_devices(int dev_optind, int dev_argc, char **dev_argv)
 {
 	int ret;
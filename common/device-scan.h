@@ -38,6 +38,7 @@ enum {
 
 struct btrfs_root;
 struct btrfs_trans_handle;
+struct btrfs_fs_devices;
 
 struct seen_fsid {
 	u8 fsid[BTRFS_FSID_SIZE];
@@ -46,6 +47,8 @@ struct seen_fsid {
 };
 
 int btrfs_scan_devices(int verbose);
+int btrfs_scan_devices_cached(struct btrfs_fs_devices *fs_devices,
+			      u64 total_devs);
 int btrfs_scan_argv_devices(int dev_optind, int argc, char **argv);
 int btrfs_register_one_device(const char *fname);
 int btrfs_register_all_devices(void);
@@ -30,6 +30,8 @@
 #include <fcntl.h>
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <time.h>
 #include <blkid/blkid.h>
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/disk-io.h"
@@ -80,23 +82,166 @@ static int discard_supported(const char *device)
 }
 
 /*
- * Discard blocks in the given range in 1G chunks, the process is interruptible
+ * Ranges of a device processed by up to DEVICE_QUEUE_DEPTH threads, each
+ * with one request in flight.
  */
-int device_discard_blocks(int fd, u64 start, u64 len)
+struct device_ranges {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int fd;
+	u64 nr;
+	u64 next;
+	int running;
+	u64 done_bytes;
+	int ret;
+	device_range_fn_t fn;
+	void *priv;
+};
+
+static void *device_range_worker(void *arg)
 {
-	while (len > 0) {
-		/* 1G granularity */
-		u64 chunk_size = min_t(u64, len, SZ_1G);
+	struct device_ranges *dr = arg;
+
+	pthread_mutex_lock(&dr->mutex);
+	while (!dr->ret && dr->next < dr->nr) {
+		const u64 index = dr->next++;
+		u64 bytes = 0;
 		int ret;
 
-		ret = discard_range(fd, start, chunk_size);
-		if (ret)
-			return ret;
-		len -= chunk_size;
-		start += chunk_size;
+		pthread_mutex_unlock(&dr->mutex);
+		ret = dr->fn(dr->fd, index, dr->priv, &bytes);
+		pthread_mutex_lock(&dr->mutex);
+		if (ret && !dr->ret)
+			dr->ret = ret;
+		dr->done_bytes += bytes;
 	}
+	dr->running--;
+	pthread_cond_signal(&dr->cond);
+	pthread_mutex_unlock(&dr->mutex);
+	return NULL;
+}
 
-	return 0;
+static double elapsed_seconds(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+	       (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Process @nr ranges of the device by @fn, in parallel, with the first error
+ * returned.  No more ranges are started after an error.
+ *
+ * With @progress, a line starting with it is printed every second with the
+ * bytes done out of @total_bytes and the throughput.
+ */
+int device_process_ranges(int fd, u64 nr, u64 total_bytes,
+			  device_range_fn_t fn, void *priv, const char *progress)
+{
+	struct device_ranges dr = {
+		.fd = fd,
+		.nr = nr,
+		.fn = fn,
+		.priv = priv,
+	};
+	pthread_t threads[DEVICE_QUEUE_DEPTH];
+	struct timespec start;
+	int nr_threads = min_t(u64, nr, DEVICE_QUEUE_DEPTH);
+	int i;
+
+	if (nr_threads <= 1) {
+		for (u64 index = 0; index < nr; index++) {
+			u64 bytes;
+			int ret;
+
+			ret = fn(fd, index, priv, &bytes);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	pthread_mutex_init(&dr.mutex, NULL);
+	pthread_cond_init(&dr.cond, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_mutex_lock(&dr.mutex);
+		dr.running++;
+		pthread_mutex_unlock(&dr.mutex);
+		if (pthread_create(&threads[i], NULL, device_range_worker, &dr)) {
+			pthread_mutex_lock(&dr.mutex);
+			dr.running--;
+			pthread_mutex_unlock(&dr.mutex);
+			break;
+		}
+	}
+	nr_threads = i;
+	/* Do the work here if no thread could be started */
+	if (nr_threads == 0) {
+		dr.running++;
+		device_range_worker(&dr);
+	}
+
+	pthread_mutex_lock(&dr.mutex);
+	while (dr.running) {
+		struct timespec timeout;
+		double elapsed;
+
+		if (!progress) {
+			pthread_cond_wait(&dr.cond, &dr.mutex);
+			continue;
+		}
+		clock_gettime(CLOCK_REALTIME, &timeout);
+		timeout.tv_sec++;
+		if (pthread_cond_timedwait(&dr.cond, &dr.mutex, &timeout) != ETIMEDOUT)
+			continue;
+		elapsed = elapsed_seconds(&start);
+		printf("%s: %s of %s done, %s/s\n", progress,
+		       pretty_size(dr.done_bytes), pretty_size(total_bytes),
+		       pretty_size(dr.done_bytes / elapsed));
+		fflush(stdout);
+	}
+	pthread_mutex_unlock(&dr.mutex);
+
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&dr.mutex);
+	pthread_cond_destroy(&dr.cond);
+	return dr.ret;
+}
+
+struct discard_ranges {
+	u64 start;
+	u64 len;
+};
+
+static int discard_one_range(int fd, u64 index, void *priv, u64 *bytes)
+{
+	const struct discard_ranges *ranges = priv;
+	const u64 offset = index * SZ_1G;
+	const u64 len = min_t(u64, ranges->len - offset, SZ_1G);
+	int ret;
+
+	ret = discard_range(fd, ranges->start + offset, len);
+	if (!ret)
+		*bytes = len;
+	return ret;
+}
+
+/*
+ * Discard blocks in the given range in 1G chunks, the process is
+ * interruptible.  The chunks are discarded in parallel, see
+ * device_process_ranges().
+ */
+int device_discard_blocks(int fd, u64 start, u64 len, const char *progress)
+{
+	struct discard_ranges ranges = { .start = start, .len = len };
+
+	return device_process_ranges(fd, DIV_ROUND_UP(len, SZ_1G), len,
+				     discard_one_range, &ranges, progress);
 }
 
 /*
@@ -199,7 +344,7 @@ static int btrfs_wipe_existing_sb(int fd, struct btrfs_zoned_device_info *zinfo)
 			ret = -1;
 		}
 	} else {
-		struct blk_zone *zone = &zinfo->zones[offset / zinfo->zone_size];
+		struct blk_zone *zone = btrfs_get_zone(zinfo, offset / zinfo->zone_size);
 
 		ret = btrfs_reset_dev_zone(fd, zone);
 		if (ret < 0) {
@@ -226,6 +371,7 @@ int btrfs_prepare_device(int fd, const char *file, u64 *byte_count_ret,
 			 u64 max_byte_count, unsigned opflags)
 {
 	struct btrfs_zoned_device_info *zinfo = NULL;
+	char progress[PATH_MAX + 32];
 	u64 byte_count;
 	struct stat st;
 	int i, ret;
@@ -253,15 +399,19 @@ int btrfs_prepare_device(int fd, const char *file, u64 *byte_count_ret,
 		}
 
 		if (!zinfo->emulated) {
-			if (opflags & PREP_DEVICE_VERBOSE)
+			if (opflags & PREP_DEVICE_VERBOSE) {
 				printf("Resetting device zones %s (%llu zones) ...\n",
 				       file, byte_count / zinfo->zone_size);
+				snprintf(progress, sizeof(progress),
+					 "Resetting zones %s", file);
+			}
 			/*
 			 * We cannot ignore zone reset errors for a zoned block
 			 * device as this could result in the inability to write
 			 * to non-empty sequential zones of the device.
 			 */
-			ret = btrfs_reset_zones(fd, zinfo, byte_count);
+			ret = btrfs_reset_zones(fd, zinfo, byte_count,
+					(opflags & PREP_DEVICE_VERBOSE) ? progress : NULL);
 			if (ret) {
 				if (ret == EBUSY) {
 					error("zoned: device '%s' contains an active zone outside of fs range", file);
@@ -279,10 +429,14 @@ int btrfs_prepare_device(int fd, const char *file, u64 *byte_count_ret,
 		 * optimization.
 		 */
 		if (discard_supported(file)) {
-			if (opflags & PREP_DEVICE_VERBOSE)
+			if (opflags & PREP_DEVICE_VERBOSE) {
 				printf("Performing full device TRIM %s (%s) ...\n",
 				       file, pretty_size(byte_count));
-			device_discard_blocks(fd, 0, byte_count);
+				snprintf(progress, sizeof(progress), "TRIM %s",
+					 file);
+			}
+			device_discard_blocks(fd, 0, byte_count,
+				(opflags & PREP_DEVICE_VERBOSE) ? progress : NULL);
 		}
 	}
 
@@ -306,12 +460,12 @@ int btrfs_prepare_device(int fd, const char *file, u64 *byte_count_ret,
 		goto err;
 	}
 
-	free(zinfo);
+	btrfs_free_zone_info(zinfo);
 	*byte_count_ret = byte_count;
 	return 0;
 
 err:
-	free(zinfo);
+	btrfs_free_zone_info(zinfo);
 	return 1;
 }
 
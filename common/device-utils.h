@@ -20,6 +20,7 @@
 #include "kerncompat.h"
 #include <stdbool.h>
 #include <unistd.h>
+#include "common/stats.h"
 
 struct btrfs_ioctl_dev_info_args;
 struct stat;
@@ -37,10 +38,21 @@ enum {
 /* Placeholder to denote no results for the zone_unusable sysfs value */
 #define DEVICE_ZONE_UNUSABLE_UNKNOWN		((u64)-1)
 
+/* Ranges of a device processed in parallel by device_process_ranges() */
+#define DEVICE_QUEUE_DEPTH			(8)
+
+/*
+ * Process the range @index of a device, set @bytes to its size when done.
+ * Return 0 or an error, which stops the processing.
+ */
+typedef int (*device_range_fn_t)(int fd, u64 index, void *priv, u64 *bytes);
+
 /*
  * Generic block device helpers
  */
-int device_discard_blocks(int fd, u64 start, u64 len);
+int device_process_ranges(int fd, u64 nr, u64 total_bytes,
+			  device_range_fn_t fn, void *priv, const char *progress);
+int device_discard_blocks(int fd, u64 start, u64 len, const char *progress);
 int device_zero_blocks(int fd, off_t start, size_t len, const bool direct);
 u64 device_get_partition_size(const char *dev);
 u64 device_get_partition_size_fd(int fd);
@@ -59,16 +71,16 @@ ssize_t btrfs_direct_pread(int fd, void *buf, size_t count, off_t offset);
 ssize_t btrfs_direct_pwrite(int fd, const void *buf, size_t count, off_t offset);
 
 #ifdef BTRFS_ZONED
-static inline ssize_t btrfs_pwrite(int fd, const void *buf, size_t count,
-				   off_t offset, bool direct)
+static inline ssize_t __btrfs_pwrite(int fd, const void *buf, size_t count,
+				     off_t offset, bool direct)
 {
 	if (!direct)
 		return pwrite(fd, buf, count, offset);
 
 	return btrfs_direct_pwrite(fd, buf, count, offset);
 }
-static inline ssize_t btrfs_pread(int fd, void *buf, size_t count,
-				  off_t offset, bool direct)
+static inline ssize_t __btrfs_pread(int fd, void *buf, size_t count,
+				    off_t offset, bool direct)
 {
 	if (!direct)
 		return pread(fd, buf, count, offset);
@@ -76,10 +88,30 @@ static inline ssize_t btrfs_pread(int fd, void *buf, size_t count,
 	return btrfs_direct_pread(fd, buf, count, offset);
 }
 #else
-#define btrfs_pwrite(fd, buf, count, offset, direct) \
+#define __btrfs_pwrite(fd, buf, count, offset, direct) \
 	({ (void)(direct); pwrite(fd, buf, count, offset); })
-#define btrfs_pread(fd, buf, count, offset, direct) \
+#define __btrfs_pread(fd, buf, count, offset, direct) \
 	({ (void)(direct); pread(fd, buf, count, offset); })
 #endif
 
+static inline ssize_t btrfs_pwrite(int fd, const void *buf, size_t count,
+				   off_t offset, bool direct)
+{
+	u64 start = stats_io_start();
+	ssize_t ret = __btrfs_pwrite(fd, buf, count, offset, direct);
+
+	stats_io_done(fd, true, ret, start);
+	return ret;
+}
+
+static inline ssize_t btrfs_pread(int fd, void *buf, size_t count,
+				  off_t offset, bool direct)
+{
+	u64 start = stats_io_start();
+	ssize_t ret = __btrfs_pread(fd, buf, count, offset, direct);
+
+	stats_io_done(fd, false, ret, start);
+	return ret;
+}
+
 #endif
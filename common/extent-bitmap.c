@@ -0,0 +1,219 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "common/extent-bitmap.h"
+#include "common/messages.h"
+
+void extent_bitmap_init(struct extent_bitmap *bitmap, u32 unit)
+{
+	UASSERT(is_power_of_2(unit));
+	bitmap->chunks = RB_ROOT;
+	bitmap->last = NULL;
+	bitmap->unit_shift = ilog2(unit);
+}
+
+void extent_bitmap_release(struct extent_bitmap *bitmap)
+{
+	struct rb_node *node;
+
+	while ((node = rb_first(&bitmap->chunks))) {
+		rb_erase(node, &bitmap->chunks);
+		free(rb_entry(node, struct extent_bitmap_chunk, node));
+	}
+	bitmap->last = NULL;
+}
+
+/*
+ * Return the chunk of @index, or if @next is true the first chunk after it
+ * when it doesn't exist.
+ */
+static struct extent_bitmap_chunk *search_chunk(struct extent_bitmap *bitmap,
+						u64 index, bool next)
+{
+	struct rb_node *node = bitmap->chunks.rb_node;
+	struct extent_bitmap_chunk *found = NULL;
+
+	if (bitmap->last && bitmap->last->index == index)
+		return bitmap->last;
+
+	while (node) {
+		struct extent_bitmap_chunk *chunk;
+
+		chunk = rb_entry(node, struct extent_bitmap_chunk, node);
+		if (index < chunk->index) {
+			if (next)
+				found = chunk;
+			node = node->rb_left;
+		} else if (index > chunk->index) {
+			node = node->rb_right;
+		} else {
+			return chunk;
+		}
+	}
+	return found;
+}
+
+static struct extent_bitmap_chunk *add_chunk(struct extent_bitmap *bitmap,
+					     u64 index)
+{
+	struct rb_node **p = &bitmap->chunks.rb_node;
+	struct rb_node *parent = NULL;
+	struct extent_bitmap_chunk *chunk;
+
+	while (*p) {
+		parent = *p;
+		chunk = rb_entry(parent, struct extent_bitmap_chunk, node);
+		if (index < chunk->index)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	chunk = calloc(1, sizeof(*chunk));
+	if (!chunk)
+		return NULL;
+	chunk->index = index;
+	rb_link_node(&chunk->node, parent, p);
+	rb_insert_color(&chunk->node, &bitmap->chunks);
+	return chunk;
+}
+
+/*
+ * Make @chunk the cached one.  An empty chunk is kept only while it's cached,
+ * so that setting and clearing the same bits doesn't allocate each time.
+ */
+static void set_last_chunk(struct extent_bitmap *bitmap,
+			   struct extent_bitmap_chunk *chunk)
+{
+	struct extent_bitmap_chunk *last = bitmap->last;
+
+	if (last == chunk)
+		return;
+	if (last && last->nr_set == 0) {
+		rb_erase(&last->node, &bitmap->chunks);
+		free(last);
+	}
+	bitmap->last = chunk;
+}
+
+static inline bool chunk_test_bit(const struct extent_bitmap_chunk *chunk,
+				  u32 bit)
+{
+	return chunk->bits[BIT_WORD(bit)] & BIT_MASK(bit);
+}
+
+int extent_bitmap_set(struct extent_bitmap *bitmap, u64 start, u64 len)
+{
+	u64 unit = start >> bitmap->unit_shift;
+	const u64 end = (start + len) >> bitmap->unit_shift;
+
+	while (unit < end) {
+		const u64 index = unit / EXTENT_BITMAP_CHUNK_BITS;
+		struct extent_bitmap_chunk *chunk;
+		u32 bit = unit % EXTENT_BITMAP_CHUNK_BITS;
+
+		chunk = search_chunk(bitmap, index, false);
+		if (!chunk) {
+			chunk = add_chunk(bitmap, index);
+			if (!chunk)
+				return -ENOMEM;
+		}
+		set_last_chunk(bitmap, chunk);
+		for (; bit < EXTENT_BITMAP_CHUNK_BITS && unit < end; bit++, unit++) {
+			if (chunk_test_bit(chunk, bit))
+				continue;
+			set_bit(bit, chunk->bits);
+			chunk->nr_set++;
+		}
+	}
+	return 0;
+}
+
+void extent_bitmap_clear(struct extent_bitmap *bitmap, u64 start, u64 len)
+{
+	u64 unit = start >> bitmap->unit_shift;
+	const u64 end = (start + len) >> bitmap->unit_shift;
+
+	while (unit < end) {
+		const u64 index = unit / EXTENT_BITMAP_CHUNK_BITS;
+		struct extent_bitmap_chunk *chunk;
+		u32 bit = unit % EXTENT_BITMAP_CHUNK_BITS;
+
+		chunk = search_chunk(bitmap, index, true);
+		if (!chunk)
+			return;
+		if (chunk->index != index) {
+			unit = chunk->index * EXTENT_BITMAP_CHUNK_BITS;
+			continue;
+		}
+		set_last_chunk(bitmap, chunk);
+		for (; bit < EXTENT_BITMAP_CHUNK_BITS && unit < end; bit++, unit++) {
+			if (!chunk_test_bit(chunk, bit))
+				continue;
+			clear_bit(bit, chunk->bits);
+			chunk->nr_set--;
+		}
+	}
+}
+
+int extent_bitmap_find_first(struct extent_bitmap *bitmap, u64 from,
+			     u64 *start_ret, u64 *end_ret)
+{
+	const u64 from_unit = from >> bitmap->unit_shift;
+	struct extent_bitmap_chunk *chunk;
+	struct rb_node *node;
+	u64 first = 0;
+	u32 bit;
+	bool found = false;
+
+	chunk = search_chunk(bitmap, from_unit / EXTENT_BITMAP_CHUNK_BITS, true);
+	for (; chunk; chunk = node ? rb_entry(node, struct extent_bitmap_chunk, node) : NULL) {
+		node = rb_next(&chunk->node);
+		if (chunk->nr_set == 0)
+			continue;
+
+		if (!found) {
+			bit = 0;
+			if (chunk->index == from_unit / EXTENT_BITMAP_CHUNK_BITS)
+				bit = from_unit % EXTENT_BITMAP_CHUNK_BITS;
+			bit = find_next_bit(chunk->bits, EXTENT_BITMAP_CHUNK_BITS, bit);
+			if (bit >= EXTENT_BITMAP_CHUNK_BITS)
+				continue;
+			first = chunk->index * EXTENT_BITMAP_CHUNK_BITS + bit;
+			found = true;
+		} else {
+			/* Continuing a range from the previous chunk */
+			if (chunk->index * EXTENT_BITMAP_CHUNK_BITS !=
+			    *end_ret || !chunk_test_bit(chunk, 0))
+				break;
+			bit = 0;
+		}
+
+		bit = find_next_zero_bit(chunk->bits, EXTENT_BITMAP_CHUNK_BITS, bit);
+		/* Temporarily the end unit, exclusive */
+		*end_ret = chunk->index * EXTENT_BITMAP_CHUNK_BITS + bit;
+		if (bit < EXTENT_BITMAP_CHUNK_BITS)
+			break;
+	}
+	if (!found)
+		return 1;
+	*start_ret = first << bitmap->unit_shift;
+	*end_ret = (*end_ret << bitmap->unit_shift) - 1;
+	return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_EXTENT_BITMAP_H__
+#define __BTRFS_EXTENT_BITMAP_H__
+
+#include "kerncompat.h"
+#include "kernel-lib/rbtree.h"
+#include "kernel-lib/rbtree_types.h"
+#include "kernel-lib/bitops.h"
+
+/*
+ * Set of byte ranges aligned to a fixed unit, one bit per unit.
+ *
+ * A lighter replacement of extent_io_tree for users that track only one bit
+ * (e.g. dirty tree blocks): setting and clearing bits doesn't allocate, split
+ * or merge anything once the bitmap chunk covering the range exists.
+ */
+
+/* Units covered by one chunk, 128MiB of 4KiB units */
+#define EXTENT_BITMAP_CHUNK_BITS	(32768)
+
+struct extent_bitmap_chunk {
+	struct rb_node node;
+	/* Chunk number, the first unit is index * EXTENT_BITMAP_CHUNK_BITS */
+	u64 index;
+	u32 nr_set;
+	unsigned long bits[BITS_TO_LONGS(EXTENT_BITMAP_CHUNK_BITS)];
+};
+
+struct extent_bitmap {
+	struct rb_root chunks;
+	/* Last used chunk, ranges tend to be set and cleared close together */
+	struct extent_bitmap_chunk *last;
+	u32 unit_shift;
+};
+
+void extent_bitmap_init(struct extent_bitmap *bitmap, u32 unit);
+void extent_bitmap_release(struct extent_bitmap *bitmap);
+
+/* Set and clear the units of [start, start + len), both must be unit aligned */
+int extent_bitmap_set(struct extent_bitmap *bitmap, u64 start, u64 len);
+void extent_bitmap_clear(struct extent_bitmap *bitmap, u64 start, u64 len);
+
+/*
+ * Find the first range of set units at or after @from, return 0 and the range
+ * in [@start_ret, @end_ret] (inclusive) or 1 if there is none.
+ */
+int extent_bitmap_find_first(struct extent_bitmap *bitmap, u64 from,
+			     u64 *start_ret, u64 *end_ret);
+
+#endif
@@ -19,80 +19,433 @@
 #include "kerncompat.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include "common/internal.h"
 #include "common/extent-cache.h"
-#include "common/rbtree-utils.h"
 
-struct cache_extent_search_range {
+/*
+ * The node sizes are multiples of the 64 byte cache lines, the leaves are
+ * 4 lines and the internal nodes 8 lines.  A search reads the keys of one
+ * internal node per level and then the pointers of a leaf, the iteration
+ * only walks the pointer arrays of the linked leaves.
+ */
+#define CACHE_LEAF_SLOTS	(28)
+#define CACHE_NODE_SLOTS	(20)
+
+struct cache_key {
 	u64 objectid;
 	u64 start;
-	u64 size;
 };
 
-static int cache_tree_comp_range(const struct rb_node *node, const void *data)
+/* Common header of the leaves (level 0) and internal nodes */
+struct cache_tree_node {
+	struct cache_tree_node *parent;
+	u16 nr;
+	u16 level;
+};
+
+struct cache_tree_leaf {
+	struct cache_tree_node node;
+	struct cache_tree_leaf *prev;
+	struct cache_tree_leaf *next;
+	struct cache_extent *items[CACHE_LEAF_SLOTS];
+};
+
+/*
+ * The key of child i is a copy of the key of its first item when it was
+ * split off, the key of child 0 is unused.
+ */
+struct cache_tree_inner {
+	struct cache_tree_node node;
+	struct cache_key keys[CACHE_NODE_SLOTS];
+	struct cache_tree_node *children[CACHE_NODE_SLOTS];
+};
+
+static struct cache_tree_leaf *to_leaf(struct cache_tree_node *node)
 {
-	const struct cache_extent *entry;
-	const struct cache_extent_search_range *range;
+	return container_of(node, struct cache_tree_leaf, node);
+}
 
-	range = (const struct cache_extent_search_range *)data;
-	entry = rb_entry(node, struct cache_extent, rb_node);
+static struct cache_tree_inner *to_inner(struct cache_tree_node *node)
+{
+	return container_of(node, struct cache_tree_inner, node);
+}
 
-	if (entry->start + entry->size <= range->start)
-		return 1;
-	else if (range->start + range->size <= entry->start)
+/* Compare the keys, by the objectid first only for the *2 helpers */
+static int cache_key_cmp(const struct cache_key *k1, const struct cache_key *k2,
+			 bool objectid)
+{
+	if (objectid) {
+		if (k1->objectid < k2->objectid)
+			return -1;
+		if (k1->objectid > k2->objectid)
+			return 1;
+	}
+	if (k1->start < k2->start)
 		return -1;
-	else
-		return 0;
+	if (k1->start > k2->start)
+		return 1;
+	return 0;
 }
 
-static int cache_tree_comp_nodes(const struct rb_node *node1, const struct rb_node *node2)
+static int cache_extent_cmp(const struct cache_extent *ce,
+			    const struct cache_key *key, bool objectid)
 {
-	const struct cache_extent *entry;
-	struct cache_extent_search_range range;
+	const struct cache_key ce_key = {
+		.objectid = ce->objectid,
+		.start = ce->start,
+	};
 
-	entry = rb_entry(node2, struct cache_extent, rb_node);
-	range.start = entry->start;
-	range.size = entry->size;
+	return cache_key_cmp(&ce_key, key, objectid);
+}
 
-	return cache_tree_comp_range(node1, (void *)&range);
+/* Position between two items of the tree, before items[slot] of the leaf */
+struct cache_pos {
+	struct cache_tree_leaf *leaf;
+	int slot;
+};
+
+static struct cache_extent *pos_prev(const struct cache_pos *pos)
+{
+	struct cache_tree_leaf *leaf = pos->leaf;
+
+	if (!leaf)
+		return NULL;
+	if (pos->slot > 0)
+		return leaf->items[pos->slot - 1];
+	if (!leaf->prev)
+		return NULL;
+	return leaf->prev->items[leaf->prev->node.nr - 1];
 }
 
-static int cache_tree_comp_range2(const struct rb_node *node, const void *data)
+static struct cache_extent *pos_next(const struct cache_pos *pos)
 {
-	const struct cache_extent *entry;
-	const struct cache_extent_search_range *range;
+	struct cache_tree_leaf *leaf = pos->leaf;
+
+	if (!leaf)
+		return NULL;
+	if (pos->slot < leaf->node.nr)
+		return leaf->items[pos->slot];
+	if (!leaf->next)
+		return NULL;
+	return leaf->next->items[0];
+}
 
-	range = (struct cache_extent_search_range *)data;
-	entry = rb_entry(node, struct cache_extent, rb_node);
+/* Index of the first item of @leaf greater than @key */
+static int leaf_upper_bound(const struct cache_tree_leaf *leaf,
+			    const struct cache_key *key, bool objectid)
+{
+	int lo = 0;
+	int hi = leaf->node.nr;
 
-	if (entry->objectid < range->objectid)
-		return 1;
-	else if (entry->objectid > range->objectid)
-		return -1;
-	else if (entry->start + entry->size <= range->start)
-		return 1;
-	else if (range->start + range->size <= entry->start)
-		return -1;
-	else
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (cache_extent_cmp(leaf->items[mid], key, objectid) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Index of the child of @inner to descend to for @key */
+static int inner_child(const struct cache_tree_inner *inner,
+		       const struct cache_key *key, bool objectid)
+{
+	int lo = 1;
+	int hi = inner->node.nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (cache_key_cmp(&inner->keys[mid], key, objectid) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+static struct cache_tree_leaf *leftmost_leaf(struct cache_tree_node *node)
+{
+	while (node->level)
+		node = to_inner(node)->children[0];
+	return to_leaf(node);
+}
+
+static struct cache_tree_leaf *rightmost_leaf(struct cache_tree_node *node)
+{
+	while (node->level)
+		node = to_inner(node)->children[node->nr - 1];
+	return to_leaf(node);
+}
+
+/*
+ * Find the position after the last item not greater than @key.
+ *
+ * The keys of the internal nodes can be out of date if the items were changed
+ * in place, the search then lands in a neighbour leaf and moves over.
+ */
+static void cache_tree_find(struct cache_tree *tree, const struct cache_key *key,
+			    bool objectid, struct cache_pos *pos)
+{
+	struct cache_tree_node *node = tree->root;
+	struct cache_tree_leaf *leaf;
+	int slot;
+
+	pos->leaf = NULL;
+	pos->slot = 0;
+	if (!node)
+		return;
+
+	while (node->level) {
+		struct cache_tree_inner *inner = to_inner(node);
+
+		node = inner->children[inner_child(inner, key, objectid)];
+	}
+	leaf = to_leaf(node);
+	while (true) {
+		slot = leaf_upper_bound(leaf, key, objectid);
+		if (slot == 0 && leaf->prev &&
+		    cache_extent_cmp(leaf->prev->items[leaf->prev->node.nr - 1],
+				     key, objectid) > 0)
+			leaf = leaf->prev;
+		else if (slot == leaf->node.nr && leaf->next &&
+			 cache_extent_cmp(leaf->next->items[0], key, objectid) <= 0)
+			leaf = leaf->next;
+		else
+			break;
+	}
+	pos->leaf = leaf;
+	pos->slot = slot;
+}
+
+static int leaf_slot(const struct cache_tree_leaf *leaf,
+		     const struct cache_extent *pe)
+{
+	for (int i = 0; i < leaf->node.nr; i++) {
+		if (leaf->items[i] == pe)
+			return i;
+	}
+	BUG();
+}
+
+static int inner_slot(const struct cache_tree_inner *inner,
+		      const struct cache_tree_node *child)
+{
+	for (int i = 0; i < inner->node.nr; i++) {
+		if (inner->children[i] == child)
+			return i;
+	}
+	BUG();
+}
+
+static bool is_rightmost(const struct cache_tree_node *node)
+{
+	for (; node->parent; node = node->parent) {
+		const struct cache_tree_inner *parent = to_inner(node->parent);
+
+		if (parent->children[parent->node.nr - 1] != node)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Add @right with its first key @key after @left to their parent, split the
+ * parent if it's full.
+ */
+static int insert_child(struct cache_tree *tree, struct cache_tree_node *left,
+			struct cache_tree_node *right, const struct cache_key *key)
+{
+	struct cache_tree_inner *inner;
+	struct cache_tree_inner *split;
+	int slot;
+	int ret;
+
+	if (!left->parent) {
+		inner = calloc(1, sizeof(*inner));
+		if (!inner)
+			return -ENOMEM;
+		inner->node.level = left->level + 1;
+		inner->node.nr = 2;
+		inner->children[0] = left;
+		inner->children[1] = right;
+		inner->keys[1] = *key;
+		left->parent = &inner->node;
+		right->parent = &inner->node;
+		tree->root = &inner->node;
 		return 0;
+	}
+
+	inner = to_inner(left->parent);
+	slot = inner_slot(inner, left) + 1;
+	if (inner->node.nr == CACHE_NODE_SLOTS) {
+		const int keep = CACHE_NODE_SLOTS / 2;
+
+		split = calloc(1, sizeof(*split));
+		if (!split)
+			return -ENOMEM;
+		split->node.level = inner->node.level;
+
+		/* Appending, as in the sorted inserts, leaves full nodes behind */
+		if (slot == CACHE_NODE_SLOTS && is_rightmost(&inner->node)) {
+			split->children[0] = right;
+			split->node.nr = 1;
+			right->parent = &split->node;
+			ret = insert_child(tree, &inner->node, &split->node, key);
+			if (ret < 0)
+				free(split);
+			return ret;
+		}
+
+		split->node.nr = CACHE_NODE_SLOTS - keep;
+		memcpy(split->children, inner->children + keep,
+		       split->node.nr * sizeof(split->children[0]));
+		memcpy(split->keys, inner->keys + keep,
+		       split->node.nr * sizeof(split->keys[0]));
+		ret = insert_child(tree, &inner->node, &split->node, &split->keys[0]);
+		if (ret < 0) {
+			free(split);
+			return ret;
+		}
+		for (int i = 0; i < split->node.nr; i++)
+			split->children[i]->parent = &split->node;
+		inner->node.nr = keep;
+		if (slot > keep) {
+			inner = split;
+			slot -= keep;
+		}
+	}
+	memmove(inner->children + slot + 1, inner->children + slot,
+		(inner->node.nr - slot) * sizeof(inner->children[0]));
+	memmove(inner->keys + slot + 1, inner->keys + slot,
+		(inner->node.nr - slot) * sizeof(inner->keys[0]));
+	inner->children[slot] = right;
+	inner->keys[slot] = *key;
+	inner->node.nr++;
+	right->parent = &inner->node;
+	return 0;
+}
+
+static int leaf_insert(struct cache_tree *tree, struct cache_tree_leaf *leaf,
+		       int slot, struct cache_extent *pe)
+{
+	struct cache_tree_leaf *split;
+	struct cache_key key;
+	int keep;
+	int ret;
+
+	if (leaf->node.nr == CACHE_LEAF_SLOTS) {
+		split = calloc(1, sizeof(*split));
+		if (!split)
+			return -ENOMEM;
+		/* Appending to the last leaf fills the leaves completely */
+		keep = (slot == CACHE_LEAF_SLOTS && !leaf->next) ?
+			CACHE_LEAF_SLOTS : CACHE_LEAF_SLOTS / 2;
+		if (keep == CACHE_LEAF_SLOTS) {
+			split->items[0] = pe;
+			split->node.nr = 1;
+		} else {
+			split->node.nr = CACHE_LEAF_SLOTS - keep;
+			memcpy(split->items, leaf->items + keep,
+			       split->node.nr * sizeof(split->items[0]));
+		}
+		key.objectid = split->items[0]->objectid;
+		key.start = split->items[0]->start;
+		ret = insert_child(tree, &leaf->node, &split->node, &key);
+		if (ret < 0) {
+			free(split);
+			return ret;
+		}
+		split->prev = leaf;
+		split->next = leaf->next;
+		if (leaf->next)
+			leaf->next->prev = split;
+		leaf->next = split;
+		if (keep == CACHE_LEAF_SLOTS) {
+			pe->leaf = split;
+			return 0;
+		}
+		for (int i = 0; i < split->node.nr; i++)
+			split->items[i]->leaf = split;
+		leaf->node.nr = keep;
+		if (slot > keep) {
+			leaf = split;
+			slot -= keep;
+		}
+	}
+	memmove(leaf->items + slot + 1, leaf->items + slot,
+		(leaf->node.nr - slot) * sizeof(leaf->items[0]));
+	leaf->items[slot] = pe;
+	leaf->node.nr++;
+	pe->leaf = leaf;
+	return 0;
 }
 
-static int cache_tree_comp_nodes2(const struct rb_node *node1, const struct rb_node *node2)
+static bool cache_extent_overlap(const struct cache_extent *ce, u64 objectid,
+				 u64 start, u64 size, bool match_objectid)
 {
-	const struct cache_extent *entry;
-	struct cache_extent_search_range range;
+	if (match_objectid && ce->objectid != objectid)
+		return false;
+	return ce->start < start + size && start < ce->start + ce->size;
+}
 
-	entry = rb_entry(node2, struct cache_extent, rb_node);
-	range.objectid = entry->objectid;
-	range.start = entry->start;
-	range.size = entry->size;
+static int __insert_cache_extent(struct cache_tree *tree,
+				 struct cache_extent *pe, bool objectid)
+{
+	const struct cache_key key = {
+		.objectid = pe->objectid,
+		.start = pe->start,
+	};
+	struct cache_extent *prev;
+	struct cache_extent *next;
+	struct cache_tree_leaf *leaf;
+	struct cache_pos pos;
+
+	if (!tree->root) {
+		leaf = calloc(1, sizeof(*leaf));
+		if (!leaf)
+			return -ENOMEM;
+		leaf->items[0] = pe;
+		leaf->node.nr = 1;
+		pe->leaf = leaf;
+		tree->root = &leaf->node;
+		return 0;
+	}
 
-	return cache_tree_comp_range2(node1, &range);
+	/* Sorted inserts append to the last leaf without the search */
+	leaf = rightmost_leaf(tree->root);
+	if (cache_extent_cmp(leaf->items[leaf->node.nr - 1], &key, objectid) < 0) {
+		pos.leaf = leaf;
+		pos.slot = leaf->node.nr;
+	} else {
+		cache_tree_find(tree, &key, objectid, &pos);
+	}
+
+	prev = pos_prev(&pos);
+	next = pos_next(&pos);
+	if (prev && (cache_extent_cmp(prev, &key, objectid) == 0 ||
+		     cache_extent_overlap(prev, pe->objectid, pe->start,
+					  pe->size, objectid)))
+		return -EEXIST;
+	if (next && cache_extent_overlap(next, pe->objectid, pe->start,
+					 pe->size, objectid))
+		return -EEXIST;
+
+	/* Keep the first key of the leaf, the parent has a copy of it */
+	if (pos.slot == 0 && pos.leaf->prev) {
+		pos.leaf = pos.leaf->prev;
+		pos.slot = pos.leaf->node.nr;
+	}
+	return leaf_insert(tree, pos.leaf, pos.slot, pe);
 }
 
 void cache_tree_init(struct cache_tree *tree)
 {
-	tree->root = RB_ROOT;
+	tree->root = NULL;
 }
 
 static struct cache_extent *alloc_cache_extent(u64 start, u64 size)
@@ -125,128 +478,170 @@ int add_cache_extent(struct cache_tree *tree, u64 start, u64 size)
 
 int insert_cache_extent(struct cache_tree *tree, struct cache_extent *pe)
 {
-	return rb_insert(&tree->root, &pe->rb_node, cache_tree_comp_nodes);
+	return __insert_cache_extent(tree, pe, false);
 }
 
 int insert_cache_extent2(struct cache_tree *tree, struct cache_extent *pe)
 {
-	return rb_insert(&tree->root, &pe->rb_node, cache_tree_comp_nodes2);
+	return __insert_cache_extent(tree, pe, true);
 }
 
 struct cache_extent *lookup_cache_extent(struct cache_tree *tree,
 					 u64 start, u64 size)
 {
-	struct rb_node *node;
+	const struct cache_key key = { .start = start };
 	struct cache_extent *entry;
-	struct cache_extent_search_range range;
-
-	range.start = start;
-	range.size = size;
-	node = rb_search(&tree->root, &range, cache_tree_comp_range, NULL);
-	if (!node)
-		return NULL;
-
-	entry = rb_entry(node, struct cache_extent, rb_node);
-	return entry;
+	struct cache_pos pos;
+
+	cache_tree_find(tree, &key, false, &pos);
+	entry = pos_prev(&pos);
+	if (entry && cache_extent_overlap(entry, 0, start, size, false))
+		return entry;
+	entry = pos_next(&pos);
+	if (entry && cache_extent_overlap(entry, 0, start, size, false))
+		return entry;
+	return NULL;
 }
 
 struct cache_extent *lookup_cache_extent2(struct cache_tree *tree,
 					 u64 objectid, u64 start, u64 size)
 {
-	struct rb_node *node;
+	const struct cache_key key = { .objectid = objectid, .start = start };
 	struct cache_extent *entry;
-	struct cache_extent_search_range range;
-
-	range.objectid = objectid;
-	range.start = start;
-	range.size = size;
-	node = rb_search(&tree->root, &range, cache_tree_comp_range2, NULL);
-	if (!node)
-		return NULL;
-
-	entry = rb_entry(node, struct cache_extent, rb_node);
-	return entry;
+	struct cache_pos pos;
+
+	cache_tree_find(tree, &key, true, &pos);
+	entry = pos_prev(&pos);
+	if (entry && cache_extent_overlap(entry, objectid, start, size, true))
+		return entry;
+	entry = pos_next(&pos);
+	if (entry && cache_extent_overlap(entry, objectid, start, size, true))
+		return entry;
+	return NULL;
 }
 
 struct cache_extent *search_cache_extent(struct cache_tree *tree, u64 start)
 {
-	struct rb_node *next;
-	struct rb_node *node;
+	const struct cache_key key = { .start = start };
 	struct cache_extent *entry;
-	struct cache_extent_search_range range;
-
-	range.start = start;
-	range.size = 1;
-	node = rb_search(&tree->root, &range, cache_tree_comp_range, &next);
-	if (!node)
-		node = next;
-	if (!node)
-		return NULL;
+	struct cache_pos pos;
 
-	entry = rb_entry(node, struct cache_extent, rb_node);
-	return entry;
+	cache_tree_find(tree, &key, false, &pos);
+	entry = pos_prev(&pos);
+	if (entry && cache_extent_overlap(entry, 0, start, 1, false))
+		return entry;
+	return pos_next(&pos);
 }
 
 struct cache_extent *search_cache_extent2(struct cache_tree *tree,
 					 u64 objectid, u64 start)
 {
-	struct rb_node *next;
-	struct rb_node *node;
+	const struct cache_key key = { .objectid = objectid, .start = start };
 	struct cache_extent *entry;
-	struct cache_extent_search_range range;
+	struct cache_pos pos;
 
-	range.objectid = objectid;
-	range.start = start;
-	range.size = 1;
-	node = rb_search(&tree->root, &range, cache_tree_comp_range2, &next);
-	if (!node)
-		node = next;
-	if (!node)
-		return NULL;
-
-	entry = rb_entry(node, struct cache_extent, rb_node);
-	return entry;
+	cache_tree_find(tree, &key, true, &pos);
+	entry = pos_prev(&pos);
+	if (entry && cache_extent_overlap(entry, objectid, start, 1, true))
+		return entry;
+	return pos_next(&pos);
 }
 
 struct cache_extent *first_cache_extent(struct cache_tree *tree)
 {
-	struct rb_node *node = rb_first(&tree->root);
-
-	if (!node)
+	if (!tree->root)
 		return NULL;
-	return rb_entry(node, struct cache_extent, rb_node);
+	return leftmost_leaf(tree->root)->items[0];
 }
 
 struct cache_extent *last_cache_extent(struct cache_tree *tree)
 {
-	struct rb_node *node = rb_last(&tree->root);
+	struct cache_tree_leaf *leaf;
 
-	if (!node)
+	if (!tree->root)
 		return NULL;
-	return rb_entry(node, struct cache_extent, rb_node);
+	leaf = rightmost_leaf(tree->root);
+	return leaf->items[leaf->node.nr - 1];
 }
 
 struct cache_extent *prev_cache_extent(struct cache_extent *pe)
 {
-	struct rb_node *node = rb_prev(&pe->rb_node);
+	struct cache_pos pos = {
+		.leaf = pe->leaf,
+		.slot = leaf_slot(pe->leaf, pe),
+	};
 
-	if (!node)
-		return NULL;
-	return rb_entry(node, struct cache_extent, rb_node);
+	return pos_prev(&pos);
 }
 
 struct cache_extent *next_cache_extent(struct cache_extent *pe)
 {
-	struct rb_node *node = rb_next(&pe->rb_node);
+	struct cache_pos pos = {
+		.leaf = pe->leaf,
+		.slot = leaf_slot(pe->leaf, pe) + 1,
+	};
 
-	if (!node)
-		return NULL;
-	return rb_entry(node, struct cache_extent, rb_node);
+	return pos_next(&pos);
+}
+
+/*
+ * Remove the empty @node from its parent and free it.  The nodes are not
+ * merged when they get less full, only the empty ones go away.
+ */
+static void remove_node(struct cache_tree *tree, struct cache_tree_node *node)
+{
+	struct cache_tree_node *parent = node->parent;
+	struct cache_tree_inner *inner;
+	int slot;
+
+	if (node->level)
+		free(to_inner(node));
+	else
+		free(to_leaf(node));
+	if (!parent) {
+		tree->root = NULL;
+		return;
+	}
+
+	inner = to_inner(parent);
+	slot = inner_slot(inner, node);
+	memmove(inner->children + slot, inner->children + slot + 1,
+		(inner->node.nr - slot - 1) * sizeof(inner->children[0]));
+	memmove(inner->keys + slot, inner->keys + slot + 1,
+		(inner->node.nr - slot - 1) * sizeof(inner->keys[0]));
+	inner->node.nr--;
+	if (!inner->node.nr) {
+		remove_node(tree, parent);
+		return;
+	}
+
+	/* Drop the levels with a single child */
+	while (tree->root->level && tree->root->nr == 1) {
+		struct cache_tree_inner *root = to_inner(tree->root);
+
+		tree->root = root->children[0];
+		tree->root->parent = NULL;
+		free(root);
+	}
 }
 
 void remove_cache_extent(struct cache_tree *tree, struct cache_extent *pe)
 {
-	rb_erase(&pe->rb_node, &tree->root);
+	struct cache_tree_leaf *leaf = pe->leaf;
+	int slot = leaf_slot(leaf, pe);
+
+	memmove(leaf->items + slot, leaf->items + slot + 1,
+		(leaf->node.nr - slot - 1) * sizeof(leaf->items[0]));
+	leaf->node.nr--;
+	pe->leaf = NULL;
+	if (leaf->node.nr)
+		return;
+
+	if (leaf->prev)
+		leaf->prev->next = leaf->next;
+	if (leaf->next)
+		leaf->next->prev = leaf->prev;
+	remove_node(tree, &leaf->node);
 }
 
 void cache_tree_free_extents(struct cache_tree *tree,
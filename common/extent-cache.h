@@ -20,15 +20,27 @@
 #define __BTRFS_EXTENT_CACHE_H__
 
 #include "kerncompat.h"
-#include "kernel-lib/rbtree.h"
-#include "kernel-lib/rbtree_types.h"
 
+struct cache_tree_node;
+struct cache_tree_leaf;
+
+/*
+ * Ranges kept in a B+tree, the leaves hold arrays of pointers to the
+ * cache_extent structures and are linked for the in-order iteration.  Each
+ * cache_extent points back to its leaf so next_cache_extent() and
+ * prev_cache_extent() don't need the tree.
+ *
+ * The keys copied to the internal nodes only route the search, the
+ * start (and objectid for the *2 helpers) of the cache_extent decides.  The
+ * range may be changed in place while in the tree as long as it stays
+ * between its neighbours.
+ */
 struct cache_tree {
-	struct rb_root root;
+	struct cache_tree_node *root;
 };
 
 struct cache_extent {
-	struct rb_node rb_node;
+	struct cache_tree_leaf *leaf;
 	u64 objectid;
 	u64 start;
 	u64 size;
@@ -71,7 +83,7 @@ void remove_cache_extent(struct cache_tree *tree, struct cache_extent *pe);
 
 static inline int cache_tree_empty(struct cache_tree *tree)
 {
-	return RB_EMPTY_ROOT(&tree->root);
+	return tree->root == NULL;
 }
 
 typedef void (*free_cache_extent)(struct cache_extent *pe);
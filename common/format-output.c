@@ -29,72 +29,204 @@
 #include "common/units.h"
 #include "cmds/commands.h"
 
+/*
+ * Value types of the rowspec formats, resolved once per printed value instead
+ * of comparing the format string at each step.
+ */
+enum fmt_type {
+	FMT_TYPE_PRINTF,
+	FMT_TYPE_U64,
+	FMT_TYPE_STRING,
+	FMT_TYPE_FLOAT,
+	FMT_TYPE_BOOL,
+	FMT_TYPE_STR,
+	FMT_TYPE_UUID,
+	FMT_TYPE_DATE_TIME,
+	FMT_TYPE_DURATION,
+	FMT_TYPE_LIST,
+	FMT_TYPE_MAP,
+	FMT_TYPE_QGROUPID,
+	FMT_TYPE_SIZE_OR_NONE,
+	FMT_TYPE_SIZE,
+	FMT_TYPE_UNKNOWN,
+};
+
+static enum fmt_type fmt_get_type(const char *fmt)
+{
+	static const struct {
+		const char *fmt;
+		enum fmt_type type;
+	} types[] = {
+		{ "%llu", FMT_TYPE_U64 },
+		{ "%s", FMT_TYPE_STRING },
+		{ "%.2f", FMT_TYPE_FLOAT },
+		{ "bool", FMT_TYPE_BOOL },
+		{ "str", FMT_TYPE_STR },
+		{ "uuid", FMT_TYPE_UUID },
+		{ "date-time", FMT_TYPE_DATE_TIME },
+		{ "duration", FMT_TYPE_DURATION },
+		{ "list", FMT_TYPE_LIST },
+		{ "map", FMT_TYPE_MAP },
+		{ "qgroupid", FMT_TYPE_QGROUPID },
+		{ "size-or-none", FMT_TYPE_SIZE_OR_NONE },
+		{ "size", FMT_TYPE_SIZE },
+	};
+
+	for (int i = 0; i < ARRAY_SIZE(types); i++)
+		if (strcmp(types[i].fmt, fmt) == 0)
+			return types[i].type;
+	if (fmt[0] == '%')
+		return FMT_TYPE_PRINTF;
+	return FMT_TYPE_UNKNOWN;
+}
+
+/*
+ * All output goes to the stdout buffer without locking it for each character,
+ * the commands mix the formatted values with their own printf calls so there
+ * can't be a separate buffer.
+ */
+static void fmt_write(const char *buf, size_t len)
+{
+	fwrite_unlocked(buf, 1, len, stdout);
+}
+
+static void fmt_puts(const char *str)
+{
+	fmt_write(str, strlen(str));
+}
+
+static void fmt_putc(char c)
+{
+	putchar_unlocked(c);
+}
+
+static void fmt_put_u64(u64 value)
+{
+	char buf[20];
+	char *p = buf + sizeof(buf);
+
+	do {
+		*--p = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	fmt_write(p, buf + sizeof(buf) - p);
+}
+
+static void fmt_put_spaces(int count)
+{
+	static const char spaces[] = "                                ";
+
+	while (count > 0) {
+		int chunk = min_t(int, count, sizeof(spaces) - 1);
+
+		fmt_write(spaces, chunk);
+		count -= chunk;
+	}
+}
+
+/* Print "name": with the name not escaped, the names are constant strings */
+static void fmt_put_name(const char *name)
+{
+	fmt_putc('"');
+	fmt_puts(name);
+	fmt_write("\": ", 3);
+}
+
 static void print_uuid(const u8 *uuid)
 {
 	char uuidparse[BTRFS_UUID_UNPARSED_SIZE];
 
 	if (uuid_is_null(uuid)) {
-		printf("null");
+		fmt_write("null", 4);
 	} else {
 		uuid_unparse(uuid, uuidparse);
-		printf("%s", uuidparse);
+		fmt_write(uuidparse, BTRFS_UUID_UNPARSED_SIZE - 1);
 	}
 }
 
-static void print_escaped(const char *str)
+/*
+ * Escape @len bytes of @str to a JSON string without the quotes, @dest must
+ * have room for FMT_JSON_ESCAPE_MAX times @len. Return the length written.
+ */
+size_t fmt_escape_json(char *dest, const char *str, size_t len)
 {
-	while (*str) {
-		switch (*str) {
+	static const char hex[] = "0123456789abcdef";
+	char *p = dest;
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		switch (c) {
 		case '\b':			/* 0x08 */
-			putchar('\\');
-			putchar('b');
+			*p++ = '\\';
+			*p++ = 'b';
 			break;
 		case '\t':			/* 0x09 */
-			putchar('\\');
-			putchar('t');
+			*p++ = '\\';
+			*p++ = 't';
 			break;
 		case '\n':			/* 0x0a */
-			putchar('\\');
-			putchar('n');
+			*p++ = '\\';
+			*p++ = 'n';
 			break;
 		case '\f':			/* 0x0c */
-			putchar('\\');
-			putchar('f');
+			*p++ = '\\';
+			*p++ = 'f';
 			break;
 		case '\r':			/* 0x0d */
-			putchar('\\');
-			putchar('r');
+			*p++ = '\\';
+			*p++ = 'r';
 			break;
 		/* Other control characters from 0 .. 31 */
 		case '\v':			/* 0x0b */
 		case 0x00 ... 0x07:
 		case 0x0e ... 0x1f:
-			printf("\\u%04x", *str);
+			memcpy(p, "\\u00", 4);
+			p[4] = hex[c >> 4];
+			p[5] = hex[c & 0xf];
+			p += 6;
 			break;
 		/* '/' (solidus) not escaped */
 		case '"':
 		case '\\':
-			putchar('\\');
+			*p++ = '\\';
 			fallthrough;
 		default:
-			putchar(*str);
+			*p++ = c;
 		}
+	}
+	return p - dest;
+}
+
+/*
+ * Print @str escaped, the runs of characters that need no escaping are written
+ * directly from the string.
+ */
+static void print_escaped(const char *str)
+{
+	while (*str) {
+		const char *run = str;
+		char buf[FMT_JSON_ESCAPE_MAX];
+
+		while (*str && (unsigned char)*str >= 0x20 && *str != '"' && *str != '\\')
+			str++;
+		if (str != run)
+			fmt_write(run, str - run);
+		if (!*str)
+			break;
+		fmt_write(buf, fmt_escape_json(buf, str, 1));
 		str++;
 	}
 }
 
 static void fmt_indent1(int indent)
 {
-	while (indent--)
-		putchar(' ');
+	fmt_put_spaces(indent);
 }
 
 static void fmt_indent2(int indent)
 {
-	while (indent--) {
-		putchar(' ');
-		putchar(' ');
-	}
+	fmt_put_spaces(2 * indent);
 }
 
 static void fmt_error(struct format_ctx *fctx)
@@ -127,47 +259,40 @@ static void fmt_separator(struct format_ctx *fctx)
 		/* Check current depth */
 		if (fctx->memb[fctx->depth] == 0) {
 			/* First member, only indent */
-			putchar('\n');
-			fmt_indent2(fctx->depth);
+			fmt_putc('\n');
 			fctx->memb[fctx->depth] = 1;
-		} else if (fctx->memb[fctx->depth] == 1) {
-			/* Something has been printed already */
-			printf(",\n");
-			fmt_indent2(fctx->depth);
-			fctx->memb[fctx->depth] = 2;
 		} else {
-			/* N-th member */
-			printf(",\n");
-			fmt_indent2(fctx->depth);
+			/* Something has been printed already, N-th member */
+			fmt_write(",\n", 2);
+			fctx->memb[fctx->depth] = 2;
 		}
+		fmt_indent2(fctx->depth);
 	}
 }
 
 /* Detect formats or values that must not be quoted (null, bool) */
-static bool fmt_set_unquoted(struct format_ctx *fctx, const struct rowspec *row,
-			     va_list args)
+static bool fmt_set_unquoted(enum fmt_type type, va_list args)
 {
-	static const char *types[] = { "%llu", "bool" };
-
-	for (int i = 0; i < sizeof(types) / sizeof(types[0]); i++)
-		if (strcmp(types[i], row->fmt) == 0)
-			return true;
-
-	/* Null value */
-	if (strcmp("uuid", row->fmt) == 0) {
+	switch (type) {
+	case FMT_TYPE_U64:
+	case FMT_TYPE_FLOAT:
+	case FMT_TYPE_BOOL:
+		return true;
+	case FMT_TYPE_UUID: {
+		/* Null value */
 		va_list tmpargs;
 		const u8 *uuid;
+		bool ret;
 
 		va_copy(tmpargs, args);
 		uuid = va_arg(tmpargs, const u8 *);
-
-		if (uuid_is_null(uuid)) {
-			va_end(tmpargs);
-			return true;
-		}
+		ret = uuid_is_null(uuid);
 		va_end(tmpargs);
+		return ret;
+	}
+	default:
+		return false;
 	}
-	return false;
 }
 
 void fmt_start(struct format_ctx *fctx, const struct rowspec *spec, int width,
@@ -180,13 +305,13 @@ void fmt_start(struct format_ctx *fctx, const struct rowspec *spec, int width,
 	fctx->depth = 1;
 
 	if (bconf.output_format & CMD_FORMAT_JSON) {
-		putchar('{');
+		fmt_putc('{');
 		/* The top level is a map and is the first one */
 		fctx->jtype[fctx->depth] = JSON_TYPE_MAP;
 		fctx->memb[fctx->depth] = 0;
 		fmt_print_start_group(fctx, "__header", JSON_TYPE_MAP);
 		fmt_separator(fctx);
-		printf("\"version\": \"1\"");
+		fmt_puts("\"version\": \"1\"");
 		fctx->memb[fctx->depth] = 1;
 		fmt_print_end_group(fctx, "__header");
 	}
@@ -201,7 +326,7 @@ void fmt_end(struct format_ctx *fctx)
 	if (bconf.output_format & CMD_FORMAT_JSON) {
 		fmt_dec_depth(fctx);
 		fmt_separator(fctx);
-		printf("}\n");
+		fmt_write("}\n", 2);
 	}
 }
 
@@ -212,32 +337,28 @@ void fmt_start_list_value(struct format_ctx *fctx)
 	} else if (bconf.output_format == CMD_FORMAT_JSON) {
 		fmt_separator(fctx);
 		fmt_indent2(fctx->depth);
-		putchar('"');
+		fmt_putc('"');
 	}
 }
 
 void fmt_end_list_value(struct format_ctx *fctx)
 {
 	if (bconf.output_format == CMD_FORMAT_TEXT)
-		putchar('\n');
+		fmt_putc('\n');
 	else if (bconf.output_format == CMD_FORMAT_JSON)
-		putchar('"');
+		fmt_putc('"');
 }
 
-void fmt_start_value(struct format_ctx *fctx, const struct rowspec *row)
+static void __fmt_start_value(struct format_ctx *fctx, enum fmt_type type)
 {
+	const bool group = (type == FMT_TYPE_LIST || type == FMT_TYPE_MAP);
+
 	if (bconf.output_format == CMD_FORMAT_TEXT) {
-		if (strcmp(row->fmt, "list") == 0)
-			putchar('\n');
-		else if (strcmp(row->fmt, "map") == 0)
-			putchar('\n');
+		if (group)
+			fmt_putc('\n');
 	} else if (bconf.output_format == CMD_FORMAT_JSON) {
-		if (strcmp(row->fmt, "list") == 0) {
-		} else if (strcmp(row->fmt, "map") == 0) {
-		} else if (fctx->unquoted) {
-		} else {
-			putchar('"');
-		}
+		if (!group && !fctx->unquoted)
+			fmt_putc('"');
 	}
 }
 
@@ -246,20 +367,28 @@ void fmt_start_value(struct format_ctx *fctx, const struct rowspec *row)
  * - json does delayed continuation "," in case there's a following object
  * - plain text always ends with a newline
  */
-void fmt_end_value(struct format_ctx *fctx, const struct rowspec *row)
+static void __fmt_end_value(struct format_ctx *fctx, enum fmt_type type)
 {
+	const bool group = (type == FMT_TYPE_LIST || type == FMT_TYPE_MAP);
+
 	if (bconf.output_format == CMD_FORMAT_TEXT)
-		putchar('\n');
+		fmt_putc('\n');
 	if (bconf.output_format == CMD_FORMAT_JSON) {
-		if (strcmp(row->fmt, "list") == 0) {
-		} else if (strcmp(row->fmt, "map") == 0) {
-		} else if (fctx->unquoted) {
-		} else {
-			putchar('"');
-		}
+		if (!group && !fctx->unquoted)
+			fmt_putc('"');
 	}
 }
 
+void fmt_start_value(struct format_ctx *fctx, const struct rowspec *row)
+{
+	__fmt_start_value(fctx, fmt_get_type(row->fmt));
+}
+
+void fmt_end_value(struct format_ctx *fctx, const struct rowspec *row)
+{
+	__fmt_end_value(fctx, fmt_get_type(row->fmt));
+}
+
 void fmt_print_start_group(struct format_ctx *fctx, const char *name,
 		enum json_type jtype)
 {
@@ -269,11 +398,11 @@ void fmt_print_start_group(struct format_ctx *fctx, const char *name,
 		fctx->jtype[fctx->depth] = jtype;
 		fctx->memb[fctx->depth] = 0;
 		if (name)
-			printf("\"%s\": ", name);
+			fmt_put_name(name);
 		if (jtype == JSON_TYPE_MAP)
-			putchar('{');
+			fmt_putc('{');
 		else if (jtype == JSON_TYPE_ARRAY)
-			putchar('[');
+			fmt_putc('[');
 		else
 			fmt_error(fctx);
 	}
@@ -286,38 +415,48 @@ void fmt_print_end_group(struct format_ctx *fctx, const char *name)
 		const enum json_type jtype = fctx->jtype[fctx->depth];
 
 		fmt_dec_depth(fctx);
-		putchar('\n');
+		fmt_putc('\n');
 		fmt_indent2(fctx->depth);
 		if (jtype == JSON_TYPE_MAP)
-			putchar('}');
+			fmt_putc('}');
 		else if (jtype == JSON_TYPE_ARRAY)
-			putchar(']');
+			fmt_putc(']');
 		else
 			fmt_error(fctx);
 	}
 }
 
+/*
+ * Find the row of @key, the rows are usually printed in the order of the
+ * rowspec so the one after the last printed is tried first.
+ */
+static const struct rowspec *fmt_find_row(struct format_ctx *fctx, const char *key)
+{
+	const struct rowspec *row = fctx->next_row;
+
+	if (!row || !row->key || strcmp(key, row->key) != 0) {
+		for (row = &fctx->rowspec[0]; row->key; row++)
+			if (strcmp(key, row->key) == 0)
+				break;
+		if (!row->key) {
+			internal_error("unknown key: %s", key);
+			exit(1);
+		}
+	}
+	fctx->next_row = row + 1;
+	return row;
+}
+
 /* Use rowspec to print according to currently set output format */
 void fmt_print(struct format_ctx *fctx, const char* key, ...)
 {
 	va_list args;
 	const struct rowspec *row;
-	bool found = false;
+	enum fmt_type type;
 
 	va_start(args, key);
-	row = &fctx->rowspec[0];
-
-	while (row->key) {
-		if (strcmp(key, row->key) == 0) {
-			found = true;
-			break;
-		}
-		row++;
-	}
-	if (!found) {
-		internal_error("unknown key: %s", key);
-		exit(1);
-	}
+	row = fmt_find_row(fctx, key);
+	type = fmt_get_type(row->fmt);
 
 	if (bconf.output_format == CMD_FORMAT_TEXT) {
 		const bool print_colon = row->out_text[0];
@@ -327,47 +466,59 @@ void fmt_print(struct format_ctx *fctx, const char* key, ...)
 		fmt_indent1(fctx->indent);
 		len = strlen(row->out_text);
 
-		printf("%s", row->out_text);
+		fmt_write(row->out_text, len);
 		if (print_colon) {
-			putchar(':');
+			fmt_putc(':');
 			len++;
 		}
 		/* Align start for the value */
 		fmt_indent1(fctx->width - len);
 	} else if (bconf.output_format == CMD_FORMAT_JSON) {
-		if (strcmp(row->fmt, "list") == 0) {
+		if (type == FMT_TYPE_LIST) {
 			fmt_print_start_group(fctx, row->out_json,
 					JSON_TYPE_ARRAY);
-		} else if (strcmp(row->fmt, "map") == 0) {
+		} else if (type == FMT_TYPE_MAP) {
 			fmt_print_start_group(fctx, row->out_json,
 					JSON_TYPE_MAP);
 		} else {
 			/* Simple key/values */
 			fmt_separator(fctx);
 			if (row->out_json)
-				printf("\"%s\": ", row->out_json);
+				fmt_put_name(row->out_json);
 		}
 	}
 
-	fctx->unquoted = fmt_set_unquoted(fctx, row, args);
-	fmt_start_value(fctx, row);
+	fctx->unquoted = fmt_set_unquoted(type, args);
+	__fmt_start_value(fctx, type);
+
+	switch (type) {
+	case FMT_TYPE_U64:
+		fmt_put_u64(va_arg(args, u64));
+		break;
+	case FMT_TYPE_STRING: {
+		const char *str = va_arg(args, const char *);
 
-	if (row->fmt[0] == '%') {
+		fmt_puts(str ? str : "(null)");
+		break;
+	}
+	case FMT_TYPE_FLOAT:
+	case FMT_TYPE_PRINTF:
 		vprintf(row->fmt, args);
-	} else if (strcmp(row->fmt, "bool") == 0) {
+		break;
+	case FMT_TYPE_BOOL: {
 		/* Bool is passed as int to varargs */
 		bool value = va_arg(args, int);
 
-		printf("%s", value ? "true" : "false");
-	} else if (strcmp(row->fmt, "str") == 0) {
-		const char *str = va_arg(args, const char *);
-
-		print_escaped(str);
-	} else if (strcmp(row->fmt, "uuid") == 0) {
-		const u8 *uuid = va_arg(args, const u8*);
-
-		print_uuid(uuid);
-	} else if (strcmp(row->fmt, "date-time") == 0) {
+		fmt_puts(value ? "true" : "false");
+		break;
+	}
+	case FMT_TYPE_STR:
+		print_escaped(va_arg(args, const char *));
+		break;
+	case FMT_TYPE_UUID:
+		print_uuid(va_arg(args, const u8 *));
+		break;
+	case FMT_TYPE_DATE_TIME: {
 		const time_t ts = va_arg(args, time_t);
 
 		if (ts) {
@@ -375,12 +526,13 @@ void fmt_print(struct format_ctx *fctx, const char* key, ...)
 			struct tm tm;
 
 			localtime_r(&ts, &tm);
-			strftime(tstr, 256, "%Y-%m-%d %X %z", &tm);
-			printf("%s", tstr);
+			fmt_write(tstr, strftime(tstr, 256, "%Y-%m-%d %X %z", &tm));
 		} else {
-			putchar('-');
+			fmt_putc('-');
 		}
-	} else if (strcmp(row->fmt, "duration") == 0) {
+		break;
+	}
+	case FMT_TYPE_DURATION: {
 		const u64 seconds = va_arg(args, u64);
 		unsigned int days = seconds / (24 * 60 * 60);
 		unsigned int hours = (seconds % (24 * 60 * 60)) / (60 * 60);
@@ -391,9 +543,12 @@ void fmt_print(struct format_ctx *fctx, const char* key, ...)
 			printf("%u days %02u:%02u:%02u", days, hours, minutes, sec);
 		else
 			printf("%02u:%02u:%02u", hours, minutes, sec);
-	} else if (strcmp(row->fmt, "list") == 0) {
-	} else if (strcmp(row->fmt, "map") == 0) {
-	} else if (strcmp(row->fmt, "qgroupid") == 0) {
+		break;
+	}
+	case FMT_TYPE_LIST:
+	case FMT_TYPE_MAP:
+		break;
+	case FMT_TYPE_QGROUPID: {
 		/*
 		 * Level is u16 but promoted to int when it's a vararg, callers
 		 * should add explicit cast.
@@ -401,24 +556,33 @@ void fmt_print(struct format_ctx *fctx, const char* key, ...)
 		const int level = va_arg(args, int);
 		const u64 id = va_arg(args, u64);
 
-		printf("%hu/%llu", level, id);
-	} else if (strcmp(row->fmt, "size-or-none") == 0) {
+		fmt_put_u64((u16)level);
+		fmt_putc('/');
+		fmt_put_u64(id);
+		break;
+	}
+	case FMT_TYPE_SIZE_OR_NONE: {
 		const u64 size = va_arg(args, u64);
 		const unsigned int unit_mode = va_arg(args, unsigned int);
 
 		if (size)
-			printf("%s", pretty_size_mode(size, unit_mode));
+			fmt_puts(pretty_size_mode(size, unit_mode));
 		else
-			putchar('-');
-	} else if (strcmp(row->fmt, "size") == 0) {
+			fmt_putc('-');
+		break;
+	}
+	case FMT_TYPE_SIZE: {
 		const u64 size = va_arg(args, u64);
 		const unsigned int unit_mode = va_arg(args, unsigned int);
 
-		printf("%s", pretty_size_mode(size, unit_mode));
-	} else {
+		fmt_puts(pretty_size_mode(size, unit_mode));
+		break;
+	}
+	case FMT_TYPE_UNKNOWN:
 		internal_error("unknown format %s", row->fmt);
+		break;
 	}
 
-	fmt_end_value(fctx, row);
+	__fmt_end_value(fctx, type);
 	va_end(args);
 }
@@ -56,6 +56,9 @@ struct rowspec {
 #define	ROWSPEC_END	{ .key = NULL },
 #define JSON_NESTING_LIMIT	16
 
+/* Longest escape of one character by fmt_escape_json(), \u00XX */
+#define FMT_JSON_ESCAPE_MAX	6
+
 /*
  * Nested types
  */
@@ -80,6 +83,8 @@ struct format_ctx {
 	enum json_type memb[JSON_NESTING_LIMIT];
 	/* Set if the value needs to be printed unquoted */
 	bool unquoted;
+	/* Row after the last printed one, looked up first */
+	const struct rowspec *next_row;
 };
 
 void fmt_start(struct format_ctx *fctx, const struct rowspec *spec, int width,
@@ -98,4 +103,6 @@ void fmt_print_start_group(struct format_ctx *fctx, const char *name,
 		enum json_type jtype);
 void fmt_print_end_group(struct format_ctx *fctx, const char *name);
 
+size_t fmt_escape_json(char *dest, const char *str, size_t len);
+
 #endif
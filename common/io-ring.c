@@ -0,0 +1,230 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#if HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+#include "common/internal.h"
+#include "common/io-ring.h"
+
+#if HAVE_LINUX_IO_URING_H && defined(__NR_io_uring_setup)
+
+int io_ring_init(struct io_ring *ring, unsigned int entries)
+{
+	struct io_uring_params params;
+	void *map;
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) {
+		ring->fd = -1;
+		return -errno;
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sq_map_size = params.sq_off.array +
+			    params.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = params.cq_off.cqes +
+			    params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		ring->sq_map_size = ring->cq_map_size =
+			max(ring->sq_map_size, ring->cq_map_size);
+	map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		goto fail;
+	ring->sq_map = map;
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_map = map;
+	} else {
+		map = mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, ring->fd,
+			   IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED)
+			goto fail;
+		ring->cq_map = map;
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	map = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (map == MAP_FAILED)
+		goto fail;
+	ring->sqes = map;
+
+	ring->sq_head = ring->sq_map + params.sq_off.head;
+	ring->sq_tail = ring->sq_map + params.sq_off.tail;
+	ring->sq_mask = ring->sq_map + params.sq_off.ring_mask;
+	ring->sq_array = ring->sq_map + params.sq_off.array;
+	ring->cq_head = ring->cq_map + params.cq_off.head;
+	ring->cq_tail = ring->cq_map + params.cq_off.tail;
+	ring->cq_mask = ring->cq_map + params.cq_off.ring_mask;
+	ring->cqes = ring->cq_map + params.cq_off.cqes;
+	return 0;
+
+fail:
+	io_ring_release(ring);
+	return -errno;
+}
+
+void io_ring_release(struct io_ring *ring)
+{
+	if (ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map)
+		munmap(ring->sq_map, ring->sq_map_size);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+/* Get the next entry of the submission queue, zeroed */
+static struct io_uring_sqe *io_ring_sqe(struct io_ring *ring)
+{
+	const unsigned int index = *ring->sq_tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = (struct io_uring_sqe *)ring->sqes + index;
+
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void io_ring_queue(struct io_ring *ring)
+{
+	const unsigned int tail = *ring->sq_tail;
+	const unsigned int index = tail & *ring->sq_mask;
+
+	ring->sq_array[index] = index;
+	/* The kernel reads the entry once it sees the tail */
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+}
+
+/* Queue a write of @len bytes of @buf to @fd, the buffer must stay valid */
+void io_ring_write(struct io_ring *ring, int fd, const void *buf, size_t len,
+		   u64 offset, u64 user_data)
+{
+	struct io_uring_sqe *sqe = io_ring_sqe(ring);
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	io_ring_queue(ring);
+}
+
+/*
+ * Queue a statx() of @path relative to @dirfd, the path and @buf must stay
+ * valid until it's reaped.  The result is 0 or -errno.
+ */
+void io_ring_statx(struct io_ring *ring, int dirfd, const char *path,
+		   int flags, unsigned int mask, struct statx *buf,
+		   u64 user_data)
+{
+	struct io_uring_sqe *sqe = io_ring_sqe(ring);
+
+	sqe->opcode = IORING_OP_STATX;
+	sqe->fd = dirfd;
+	sqe->addr = (unsigned long)path;
+	sqe->len = mask;
+	sqe->off = (unsigned long)buf;
+	sqe->statx_flags = flags;
+	sqe->user_data = user_data;
+	io_ring_queue(ring);
+}
+
+/*
+ * Submit the queued requests and wait until at least @wait_nr completions can
+ * be reaped.
+ */
+int io_ring_submit(struct io_ring *ring, unsigned int wait_nr)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit,
+			      wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0,
+			      NULL, 0);
+		if (ret >= 0)
+			ring->to_submit -= min_t(unsigned int, ret,
+						 ring->to_submit);
+	} while ((ret < 0 && errno == EINTR) || (ret >= 0 && ring->to_submit));
+	return ret < 0 ? -errno : 0;
+}
+
+/*
+ * Consume one completion, return the user data of the request and its
+ * result, e.g. the number of bytes written or -errno. Return false if there's none.
+ */
+bool io_ring_reap(struct io_ring *ring, u64 *user_data, int *res)
+{
+	const unsigned int head = *ring->cq_head;
+	struct io_uring_cqe *cqe;
+
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+		return false;
+	cqe = (struct io_uring_cqe *)ring->cqes + (head & *ring->cq_mask);
+	*user_data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+#else
+
+int io_ring_init(struct io_ring *ring, unsigned int entries)
+{
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	return -EOPNOTSUPP;
+}
+
+void io_ring_release(struct io_ring *ring)
+{
+}
+
+void io_ring_write(struct io_ring *ring, int fd, const void *buf, size_t len,
+		   u64 offset, u64 user_data)
+{
+}
+
+void io_ring_statx(struct io_ring *ring, int dirfd, const char *path,
+		   int flags, unsigned int mask, struct statx *buf,
+		   u64 user_data)
+{
+}
+
+int io_ring_submit(struct io_ring *ring, unsigned int wait_nr)
+{
+	return -EOPNOTSUPP;
+}
+
+bool io_ring_reap(struct io_ring *ring, u64 *user_data, int *res)
+{
+	return false;
+}
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_IO_RING_H__
+#define __BTRFS_IO_RING_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include <sys/types.h>
+
+struct statx;
+
+/*
+ * Minimal io_uring for queueing writes and stats from one thread, using the
+ * syscalls directly so there's no dependency on liburing.
+ *
+ * The requests are queued by io_ring_write() or io_ring_statx() and submitted
+ * in batches by io_ring_submit(), the completions are consumed by
+ * io_ring_reap() with the user data of the request.  There can't be more
+ * requests queued and not reaped than the entries of the ring, the caller
+ * accounts for that.
+ *
+ * Without the kernel headers or support, io_ring_init() fails and the caller
+ * is expected to fall back to synchronous calls.
+ */
+struct io_ring {
+	int fd;
+	unsigned int entries;
+	/* Queued and not submitted yet */
+	unsigned int to_submit;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	void *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	void *cqes;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	size_t sqes_size;
+};
+
+int io_ring_init(struct io_ring *ring, unsigned int entries);
+void io_ring_release(struct io_ring *ring);
+void io_ring_write(struct io_ring *ring, int fd, const void *buf, size_t len,
+		   u64 offset, u64 user_data);
+void io_ring_statx(struct io_ring *ring, int dirfd, const char *path,
+		   int flags, unsigned int mask, struct statx *buf,
+		   u64 user_data);
+int io_ring_submit(struct io_ring *ring, unsigned int wait_nr);
+bool io_ring_reap(struct io_ring *ring, u64 *user_data, int *res);
+
+#endif
@@ -71,7 +71,7 @@ int check_mounted_where(int fd, const char *file, char *where, int size,
 
 	/* scan other devices */
 	if (is_btrfs && total_devs > 1) {
-		ret = btrfs_scan_devices(0);
+		ret = btrfs_scan_devices_cached(fs_devices_mnt, total_devs);
 		if (ret)
 			return ret;
 	}
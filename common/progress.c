@@ -0,0 +1,111 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "common/progress.h"
+
+void progress_init(struct progress_estimator *est, u64 total)
+{
+	memset(est, 0, sizeof(*est));
+	est->total = total;
+	est->eta = -1.0;
+}
+
+static double timespec_seconds(const struct timespec *end,
+			       const struct timespec *start)
+{
+	return (end->tv_sec - start->tv_sec) +
+		(end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+ * Add a sample of the amount done at time @now. The amount may only grow, a
+ * smaller value restarts the estimate (eg. a balance resumed from the start).
+ */
+void progress_update_at(struct progress_estimator *est, u64 done,
+			const struct timespec *now)
+{
+	const struct progress_sample *oldest;
+	const struct progress_sample *last;
+	struct progress_sample *sample;
+	double elapsed;
+
+	if (est->nr_samples && done < est->done)
+		progress_init(est, est->total);
+
+	if (est->nr_samples == PROGRESS_SAMPLES) {
+		sample = &est->samples[est->first];
+		est->first = (est->first + 1) % PROGRESS_SAMPLES;
+	} else {
+		sample = &est->samples[(est->first + est->nr_samples) % PROGRESS_SAMPLES];
+		est->nr_samples++;
+	}
+	sample->time = *now;
+	sample->done = done;
+	est->done = done;
+
+	est->rate = 0.0;
+	est->avg_rate = 0.0;
+	est->eta = -1.0;
+	if (est->nr_samples < 2)
+		return;
+
+	last = &est->samples[(est->first + est->nr_samples - 2) % PROGRESS_SAMPLES];
+	elapsed = timespec_seconds(&sample->time, &last->time);
+	if (elapsed > 0)
+		est->rate = (done - last->done) / elapsed;
+
+	oldest = &est->samples[est->first];
+	elapsed = timespec_seconds(&sample->time, &oldest->time);
+	if (elapsed > 0)
+		est->avg_rate = (done - oldest->done) / elapsed;
+
+	if (done >= est->total)
+		est->eta = 0.0;
+	else if (est->avg_rate > 0)
+		est->eta = (est->total - done) / est->avg_rate;
+}
+
+void progress_update(struct progress_estimator *est, u64 done)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	progress_update_at(est, done, &now);
+}
+
+/* Time left as [[D:]HH:]MM:SS, or "unknown" before the rate is known */
+char *progress_eta_string(const struct progress_estimator *est, char *buf,
+			  size_t size)
+{
+	unsigned long long sec;
+
+	if (est->eta < 0) {
+		snprintf(buf, size, "unknown");
+		return buf;
+	}
+	sec = (unsigned long long)(est->eta + 0.5);
+	if (sec >= 86400)
+		snprintf(buf, size, "%llud %02llu:%02llu:%02llu", sec / 86400,
+			 sec / 3600 % 24, sec / 60 % 60, sec % 60);
+	else if (sec >= 3600)
+		snprintf(buf, size, "%02llu:%02llu:%02llu", sec / 3600,
+			 sec / 60 % 60, sec % 60);
+	else
+		snprintf(buf, size, "%02llu:%02llu", sec / 60, sec % 60);
+	return buf;
+}
@@ -0,0 +1,58 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_PROGRESS_H__
+#define __BTRFS_PROGRESS_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include <time.h>
+
+/* Samples kept for the moving average, one per period of the caller */
+#define PROGRESS_SAMPLES		(60)
+
+struct progress_sample {
+	struct timespec time;
+	u64 done;
+};
+
+/*
+ * Rate and time left of a long running operation, from the amount done sampled
+ * periodically, eg. bytes of replace or chunks of balance.
+ */
+struct progress_estimator {
+	u64 total;
+	u64 done;
+	/* Ring of the last samples, oldest at @first */
+	struct progress_sample samples[PROGRESS_SAMPLES];
+	int first;
+	int nr_samples;
+	/* Per second, since the previous sample */
+	double rate;
+	/* Per second, over all the samples kept */
+	double avg_rate;
+	/* Seconds to finish at the average rate, negative if not known */
+	double eta;
+};
+
+void progress_init(struct progress_estimator *est, u64 total);
+void progress_update(struct progress_estimator *est, u64 done);
+void progress_update_at(struct progress_estimator *est, u64 done,
+			const struct timespec *now);
+char *progress_eta_string(const struct progress_estimator *est, char *buf,
+			  size_t size);
+
+#endif
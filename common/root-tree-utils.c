@@ -225,185 +225,220 @@ abort:
 	return ret;
 }
 
-static int remove_all_tree_items(struct btrfs_root *root)
+/* One subvolume id of an item of the uuid tree */
+struct uuid_entry {
+	struct btrfs_key key;
+	u64 subvol_id;
+};
+
+struct uuid_entries {
+	struct uuid_entry *entries;
+	size_t nr;
+	size_t alloc;
+	/* Root items of the subvolumes without uuid, one is generated for them */
+	struct btrfs_key *no_uuid;
+	size_t nr_no_uuid;
+};
+
+static int cmp_uuid_entry(const void *a, const void *b)
 {
-	struct btrfs_trans_handle *trans;
+	const struct uuid_entry *ea = a;
+	const struct uuid_entry *eb = b;
 	int ret;
 
-	trans = btrfs_start_transaction(root, 1);
-	if (IS_ERR(trans)) {
-		ret = PTR_ERR(trans);
-		errno = -ret;
-		error_msg(ERROR_MSG_START_TRANS,
-			  "remove all items for tree %lld: %m",
-			  root->root_key.objectid);
-		return ret;
-	}
-	ret = btrfs_clear_tree(trans, root);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to empty root %lld: %m",
-			root->root_key.objectid);
-		btrfs_abort_transaction(trans, ret);
+	ret = btrfs_comp_cpu_keys(&ea->key, &eb->key);
+	if (ret)
 		return ret;
+	if (ea->subvol_id < eb->subvol_id)
+		return -1;
+	return ea->subvol_id > eb->subvol_id;
+}
+
+static int add_uuid_entry(struct uuid_entries *ue, const u8 *uuid, u8 type,
+			  u64 subvol_id)
+{
+	if (ue->nr == ue->alloc) {
+		size_t alloc = max_t(size_t, ue->alloc * 2, 1024);
+		struct uuid_entry *tmp;
+
+		tmp = realloc(ue->entries, alloc * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		ue->entries = tmp;
+		ue->alloc = alloc;
 	}
-	ret = btrfs_commit_transaction(trans, root);
-	if (ret < 0) {
-		errno = -ret;
-		error_msg(ERROR_MSG_COMMIT_TRANS,
-			  "removal all items for tree %lld: %m",
-			  root->root_key.objectid);
-	}
-	return ret;
+	btrfs_uuid_to_key(uuid, type, &ue->entries[ue->nr].key);
+	ue->entries[ue->nr].subvol_id = subvol_id;
+	ue->nr++;
+	return 0;
 }
 
-static int rescan_subvol_uuid(struct btrfs_trans_handle *trans,
-			      struct btrfs_key *subvol_key)
+static int add_root_item_uuids(struct uuid_entries *ue,
+			       struct btrfs_root_item *root_item,
+			       const struct btrfs_key *root_key)
 {
-	struct btrfs_fs_info *fs_info = trans->fs_info;
-	struct btrfs_root *subvol;
+	const u64 subvol_id = root_key->objectid;
 	int ret;
 
-	UASSERT(is_fstree(subvol_key->objectid));
+	if (uuid_is_null(root_item->uuid)) {
+		struct btrfs_key *tmp;
 
-	/*
-	 * Read out the subvolume root and updates root::root_item.
-	 * This is to avoid de-sync between in-memory and on-disk root_items.
-	 */
-	subvol = btrfs_read_fs_root(fs_info, subvol_key);
-	if (IS_ERR(subvol)) {
-		ret = PTR_ERR(subvol);
-		error("failed to read subvolume %llu: %m",
-			subvol_key->objectid);
-		btrfs_abort_transaction(trans, ret);
-		return ret;
-	}
-	/* The uuid is not set, regenerate one. */
-	if (uuid_is_null(subvol->root_item.uuid)) {
-		uuid_generate(subvol->root_item.uuid);
-		ret = btrfs_update_root(trans, fs_info->tree_root, &subvol->root_key,
-					&subvol->root_item);
-		if (ret < 0) {
-			error("failed to update subvolume %llu: %m",
-			      subvol_key->objectid);
-			btrfs_abort_transaction(trans, ret);
+		tmp = realloc(ue->no_uuid, (ue->nr_no_uuid + 1) * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		ue->no_uuid = tmp;
+		ue->no_uuid[ue->nr_no_uuid++] = *root_key;
+	} else {
+		ret = add_uuid_entry(ue, root_item->uuid, BTRFS_UUID_KEY_SUBVOL,
+				     subvol_id);
+		if (ret < 0)
 			return ret;
-		}
-	}
-	ret = btrfs_uuid_tree_add(trans, subvol->root_item.uuid,
-				  BTRFS_UUID_KEY_SUBVOL,
-				  subvol->root_key.objectid);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to add uuid for subvolume %llu: %m",
-		      subvol_key->objectid);
-		btrfs_abort_transaction(trans, ret);
-		return ret;
 	}
-	if (!uuid_is_null(subvol->root_item.received_uuid)) {
-		ret = btrfs_uuid_tree_add(trans, subvol->root_item.uuid,
-					  BTRFS_UUID_KEY_RECEIVED_SUBVOL,
-					  subvol->root_key.objectid);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to add received_uuid for subvol %llu: %m",
-			      subvol->root_key.objectid);
-			btrfs_abort_transaction(trans, ret);
+	if (!uuid_is_null(root_item->received_uuid)) {
+		ret = add_uuid_entry(ue, root_item->received_uuid,
+				     BTRFS_UUID_KEY_RECEIVED_SUBVOL, subvol_id);
+		if (ret < 0)
 			return ret;
-		}
 	}
 	return 0;
 }
 
-static int rescan_uuid_tree(struct btrfs_fs_info *fs_info)
+/*
+ * Collect the uuids of the fs tree and all subvolumes from their root items,
+ * in one pass over the root tree.
+ */
+static int collect_subvol_uuids(struct btrfs_fs_info *fs_info,
+				struct uuid_entries *ue)
 {
 	struct btrfs_root *tree_root = fs_info->tree_root;
-	struct btrfs_root *uuid_root = fs_info->uuid_root;
-	struct btrfs_trans_handle *trans;
 	struct btrfs_path path = { 0 };
-	struct btrfs_key key = { 0 };
+	struct btrfs_key key;
 	int ret;
 
-	UASSERT(uuid_root);
-	trans = btrfs_start_transaction(uuid_root, 1);
-	if (IS_ERR(trans)) {
-		ret = PTR_ERR(trans);
-		errno = -ret;
-		error_msg(ERROR_MSG_START_TRANS, "rescan uuid tree: %m");
-		return ret;
-	}
-	key.objectid = BTRFS_LAST_FREE_OBJECTID;
+	key.objectid = BTRFS_FS_TREE_OBJECTID;
 	key.type = BTRFS_ROOT_ITEM_KEY;
-	key.offset = (u64)-1;
-	/* Iterate through all subvolumes except fs tree. */
+	key.offset = 0;
+	ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+
 	while (true) {
+		struct extent_buffer *leaf = path.nodes[0];
+		struct btrfs_root_item root_item = { 0 };
 		struct btrfs_key found_key;
-		struct extent_buffer *leaf;
-		int slot;
+		u32 item_size;
 
-		/* No more subvolume. */
-		if (key.objectid < BTRFS_FIRST_FREE_OBJECTID) {
-			ret = 0;
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(tree_root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &found_key, path.slots[0]);
+		if (found_key.objectid > BTRFS_LAST_FREE_OBJECTID)
 			break;
+		if (found_key.type != BTRFS_ROOT_ITEM_KEY ||
+		    !is_fstree(found_key.objectid)) {
+			path.slots[0]++;
+			continue;
 		}
-		ret = btrfs_search_slot(NULL, tree_root, &key, &path, 0, 0);
-		if (ret < 0) {
+
+		/* Older root items don't have the uuids, they're left zero */
+		item_size = btrfs_item_size(leaf, path.slots[0]);
+		read_extent_buffer(leaf, &root_item,
+				   btrfs_item_ptr_offset(leaf, path.slots[0]),
+				   min_t(u32, item_size, sizeof(root_item)));
+		ret = add_root_item_uuids(ue, &root_item, &found_key);
+		if (ret < 0)
+			goto out;
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/* Generate the missing uuids, through the roots to keep them in sync */
+static int generate_subvol_uuids(struct btrfs_trans_handle *trans,
+				 struct uuid_entries *ue)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	int ret;
+
+	for (size_t i = 0; i < ue->nr_no_uuid; i++) {
+		struct btrfs_key *key = &ue->no_uuid[i];
+		struct btrfs_root *subvol;
+
+		subvol = btrfs_read_fs_root(fs_info, key);
+		if (IS_ERR(subvol)) {
+			ret = PTR_ERR(subvol);
 			errno = -ret;
-			error_msg(ERROR_MSG_READ, "iterate subvolumes: %m");
-			btrfs_abort_transaction(trans, ret);
+			error("failed to read subvolume %llu: %m", key->objectid);
 			return ret;
 		}
-		if (ret > 0) {
-			ret = btrfs_previous_item(tree_root, &path,
-						  BTRFS_FIRST_FREE_OBJECTID,
-						  BTRFS_ROOT_ITEM_KEY);
-			if (ret < 0) {
-				errno = -ret;
-				btrfs_release_path(&path);
-				error_msg(ERROR_MSG_READ, "iterate subvolumes: %m");
-				btrfs_abort_transaction(trans, ret);
-				return ret;
-			}
-			/* No more subvolume. */
-			if (ret > 0) {
-				ret = 0;
-				btrfs_release_path(&path);
-				break;
-			}
-		}
-		leaf = path.nodes[0];
-		slot = path.slots[0];
-		btrfs_item_key_to_cpu(leaf, &found_key, slot);
-		btrfs_release_path(&path);
-		key.objectid = found_key.objectid - 1;
-
-		ret = rescan_subvol_uuid(trans, &found_key);
+		uuid_generate(subvol->root_item.uuid);
+		ret = btrfs_update_root(trans, fs_info->tree_root,
+					&subvol->root_key, &subvol->root_item);
 		if (ret < 0) {
 			errno = -ret;
-			error("failed to rescan the uuid of subvolume %llu: %m",
-			      found_key.objectid);
-			btrfs_abort_transaction(trans, ret);
+			error("failed to update subvolume %llu: %m", key->objectid);
 			return ret;
 		}
+		ret = add_uuid_entry(ue, subvol->root_item.uuid,
+				     BTRFS_UUID_KEY_SUBVOL, key->objectid);
+		if (ret < 0)
+			return ret;
 	}
+	return 0;
+}
 
-	/* Update fs tree uuid. */
-	key.objectid = BTRFS_FS_TREE_OBJECTID;
-	key.type = BTRFS_ROOT_ITEM_KEY;
-	key.offset = 0;
-	ret = rescan_subvol_uuid(trans, &key);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to rescan the uuid of subvolume %llu: %m",
-		      key.objectid);
-		btrfs_abort_transaction(trans, ret);
-		return ret;
-	}
-	ret = btrfs_commit_transaction(trans, uuid_root);
-	if (ret < 0) {
-		errno = -ret;
-		error_msg(ERROR_MSG_COMMIT_TRANS, "rescan uuid tree: %m");
+/*
+ * Fill the empty uuid tree from the sorted entries, the subvolume ids of the
+ * same uuid and type are merged into one item.
+ */
+static int load_uuid_tree(struct btrfs_trans_handle *trans,
+			  struct uuid_entries *ue)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	const u32 max_ids = BTRFS_MAX_ITEM_SIZE(fs_info) / sizeof(__le64);
+	struct btrfs_bulk_loader loader;
+	__le64 *ids;
+	int ret = 0;
+
+	ids = malloc(max_ids * sizeof(*ids));
+	if (!ids)
+		return -ENOMEM;
+	qsort(ue->entries, ue->nr, sizeof(*ue->entries), cmp_uuid_entry);
+	btrfs_bulk_loader_init(&loader, trans, fs_info->uuid_root, 100);
+	for (size_t i = 0; i < ue->nr; ) {
+		const struct btrfs_key *key = &ue->entries[i].key;
+		u32 nr_ids = 0;
+
+		for (; i < ue->nr &&
+		       btrfs_comp_cpu_keys(&ue->entries[i].key, key) == 0; i++) {
+			if (nr_ids == max_ids) {
+				ret = -EOVERFLOW;
+				error("too many subvolumes with uuid key (0x%016llx, 0x%016llx)",
+				      key->objectid, key->offset);
+				goto out;
+			}
+			ids[nr_ids++] = cpu_to_le64(ue->entries[i].subvol_id);
+		}
+		ret = btrfs_bulk_loader_add(&loader, key, ids,
+					    nr_ids * sizeof(*ids));
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to add uuid item (0x%016llx, 0x%016llx): %m",
+			      key->objectid, key->offset);
+			goto out;
+		}
 	}
+out:
+	btrfs_bulk_loader_release(&loader);
+	free(ids);
 	return ret;
 }
 
@@ -418,23 +453,34 @@ static int rescan_uuid_tree(struct btrfs_fs_info *fs_info)
  * tree.
  * And if a subvolume has its UUID initialized, it will not be touched and
  * added to the new uuid tree.
+ *
+ * The root items are read in one pass over the root tree and the items are
+ * loaded in the key order, all in one transaction.
  */
 int btrfs_rebuild_uuid_tree(struct btrfs_fs_info *fs_info)
 {
-	struct btrfs_root *uuid_root;
+	struct uuid_entries ue = { 0 };
+	struct btrfs_trans_handle *trans;
 	struct btrfs_key key;
 	int ret;
 
+	ret = collect_subvol_uuids(fs_info, &ue);
+	if (ret < 0) {
+		errno = -ret;
+		error_msg(ERROR_MSG_READ, "iterate subvolumes: %m");
+		goto out;
+	}
+
+	trans = btrfs_start_transaction(fs_info->tree_root, 1);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		errno = -ret;
+		error_msg(ERROR_MSG_START_TRANS, "rebuild uuid tree: %m");
+		goto out;
+	}
 	if (!fs_info->uuid_root) {
-		struct btrfs_trans_handle *trans;
+		struct btrfs_root *uuid_root;
 
-		trans = btrfs_start_transaction(fs_info->tree_root, 1);
-		if (IS_ERR(trans)) {
-			ret = PTR_ERR(trans);
-			errno = -ret;
-			error_msg(ERROR_MSG_START_TRANS, "create uuid tree: %m");
-			return ret;
-		}
 		key.objectid = BTRFS_UUID_TREE_OBJECTID;
 		key.type = BTRFS_ROOT_ITEM_KEY;
 		key.offset = 0;
@@ -443,31 +489,35 @@ int btrfs_rebuild_uuid_tree(struct btrfs_fs_info *fs_info)
 			ret = PTR_ERR(uuid_root);
 			errno = -ret;
 			error("failed to create uuid root: %m");
-			btrfs_abort_transaction(trans, ret);
-			return ret;
+			goto abort;
 		}
 		add_root_to_dirty_list(uuid_root);
 		fs_info->uuid_root = uuid_root;
-		ret = btrfs_commit_transaction(trans, fs_info->tree_root);
-		if (ret < 0) {
-			errno = -ret;
-			error_msg(ERROR_MSG_COMMIT_TRANS, "create uuid tree: %m");
-			return ret;
-		}
 	} else {
-		ret = remove_all_tree_items(fs_info->uuid_root);
+		ret = btrfs_clear_tree(trans, fs_info->uuid_root);
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to clear the existing uuid tree: %m");
-			return ret;
+			goto abort;
 		}
 	}
-	UASSERT(fs_info->uuid_root);
-	ret = rescan_uuid_tree(fs_info);
+
+	ret = generate_subvol_uuids(trans, &ue);
+	if (ret < 0)
+		goto abort;
+	ret = load_uuid_tree(trans, &ue);
+	if (ret < 0)
+		goto abort;
+	ret = btrfs_commit_transaction(trans, fs_info->tree_root);
 	if (ret < 0) {
 		errno = -ret;
-		error("failed to rescan the uuid tree: %m");
-		return ret;
+		error_msg(ERROR_MSG_COMMIT_TRANS, "rebuild uuid tree: %m");
 	}
-	return 0;
+	goto out;
+abort:
+	btrfs_abort_transaction(trans, ret);
+out:
+	free(ue.entries);
+	free(ue.no_uuid);
+	return ret;
 }
@@ -28,6 +28,7 @@
 #include "crypto/crc32c.h"
 #include "common/send-stream.h"
 #include "common/messages.h"
+#include "common/stats.h"
 
 struct btrfs_send_attribute {
 	u16 tlv_type;
@@ -39,9 +40,18 @@ struct btrfs_send_attribute {
 	char *data;
 };
 
+/*
+ * Size of the buffer the stream is read to, the commands are parsed in place
+ * and more of them are read by one read(2) call
+ */
+#define SEND_STREAM_READ_BUF_SIZE	(SZ_1M)
+
 struct btrfs_send_stream {
 	char *read_buf;
 	size_t read_buf_size;
+	/* The bytes read to read_buf and not parsed yet */
+	size_t read_start;
+	size_t read_end;
 	int fd;
 
 	int cmd;
@@ -56,47 +66,145 @@ struct btrfs_send_stream {
 
 	struct btrfs_send_ops *ops;
 	void *user;
+	/* The last command was a clone, ops->clone_end is due */
+	bool in_clones;
 } __attribute__((aligned(64)));
 
 /*
- * Read len bytes to buf.
+ * The bytes read ahead past the end of the last stream processed, i.e. the
+ * start of the next stream of the same fd. They can't be put back to a pipe,
+ * the next call of btrfs_read_and_process_send_stream() for the fd starts with
+ * them.  Kept by each thread, so several threads can read their own fds.
+ */
+static __thread struct {
+	int fd;
+	char *buf;
+	size_t size;
+	size_t start;
+	size_t end;
+} read_ahead = { .fd = -1 };
+
+/* Names of the commands accounted by --stats, with the time of the callbacks */
+static const char * const cmd_stats_names[BTRFS_SEND_C_MAX + 1] = {
+	[BTRFS_SEND_C_UNSPEC]		= "stream unknown",
+	[BTRFS_SEND_C_SUBVOL]		= "stream subvol",
+	[BTRFS_SEND_C_SNAPSHOT]		= "stream snapshot",
+	[BTRFS_SEND_C_MKFILE]		= "stream mkfile",
+	[BTRFS_SEND_C_MKDIR]		= "stream mkdir",
+	[BTRFS_SEND_C_MKNOD]		= "stream mknod",
+	[BTRFS_SEND_C_MKFIFO]		= "stream mkfifo",
+	[BTRFS_SEND_C_MKSOCK]		= "stream mksock",
+	[BTRFS_SEND_C_SYMLINK]		= "stream symlink",
+	[BTRFS_SEND_C_RENAME]		= "stream rename",
+	[BTRFS_SEND_C_LINK]		= "stream link",
+	[BTRFS_SEND_C_UNLINK]		= "stream unlink",
+	[BTRFS_SEND_C_RMDIR]		= "stream rmdir",
+	[BTRFS_SEND_C_SET_XATTR]	= "stream set_xattr",
+	[BTRFS_SEND_C_REMOVE_XATTR]	= "stream remove_xattr",
+	[BTRFS_SEND_C_WRITE]		= "stream write",
+	[BTRFS_SEND_C_CLONE]		= "stream clone",
+	[BTRFS_SEND_C_TRUNCATE]		= "stream truncate",
+	[BTRFS_SEND_C_CHMOD]		= "stream chmod",
+	[BTRFS_SEND_C_CHOWN]		= "stream chown",
+	[BTRFS_SEND_C_UTIMES]		= "stream utimes",
+	[BTRFS_SEND_C_END]		= "stream end",
+	[BTRFS_SEND_C_UPDATE_EXTENT]	= "stream update_extent",
+	[BTRFS_SEND_C_FALLOCATE]	= "stream fallocate",
+	[BTRFS_SEND_C_FILEATTR]		= "stream fileattr",
+	[BTRFS_SEND_C_ENCODED_WRITE]	= "stream encoded_write",
+	[BTRFS_SEND_C_ENABLE_VERITY]	= "stream enable_verity",
+};
+
+/* Reads the stream, read(2) unless set by btrfs_send_stream_set_read() */
+static ssize_t (*stream_read)(int fd, void *buf, size_t count) = read;
+
+/*
+ * Read the streams by @read_fn instead of read(2), e.g. to decompress them.
+ * It's called with the same fd for all the streams of the fd.
+ */
+void btrfs_send_stream_set_read(ssize_t (*read_fn)(int fd, void *buf,
+						  size_t count))
+{
+	stream_read = read_fn ? read_fn : read;
+}
+
+/*
+ * Drop the bytes read ahead from @fd by the calling thread, before the fd is
+ * closed and its number possibly reused for another stream.
+ */
+void btrfs_send_stream_forget(int fd)
+{
+	if (read_ahead.fd != fd)
+		return;
+	free(read_ahead.buf);
+	read_ahead.buf = NULL;
+	read_ahead.fd = -1;
+}
+
+/*
+ * Make at least len bytes available at read_buf + read_start, reading as much
+ * of the stream as fits to the buffer.
+ *
  * Return:
  *   0 - success
  * < 0 - negative errno in case of error
  * > 0 - no data read, EOF
  */
-static int read_buf(struct btrfs_send_stream *sctx, char *buf, size_t len)
+static int fill_buf(struct btrfs_send_stream *sctx, size_t len)
 {
-	int ret;
-	size_t pos = 0;
+	size_t avail = sctx->read_end - sctx->read_start;
 
-	while (pos < len) {
+	if (avail >= len)
+		return 0;
+
+	/* Move the partial command to the start, grow for large commands */
+	if (sctx->read_start + len > sctx->read_buf_size) {
+		if (len > sctx->read_buf_size) {
+			char *new_read_buf;
+
+			new_read_buf = realloc(sctx->read_buf, len);
+			if (!new_read_buf) {
+				errno = ENOMEM;
+				error_msg(ERROR_MSG_MEMORY, "read buffer for command");
+				return -ENOMEM;
+			}
+			sctx->read_buf = new_read_buf;
+			sctx->read_buf_size = len;
+		}
+		memmove(sctx->read_buf, sctx->read_buf + sctx->read_start, avail);
+		sctx->read_start = 0;
+		sctx->read_end = avail;
+	}
+
+	while (sctx->read_end - sctx->read_start < len) {
+		u64 start = stats_io_start();
 		ssize_t rbytes;
 
-		rbytes = read(sctx->fd, buf + pos, len - pos);
+		rbytes = stream_read(sctx->fd, sctx->read_buf + sctx->read_end,
+				     sctx->read_buf_size - sctx->read_end);
+		stats_op("stream read", max_t(ssize_t, rbytes, 0), start);
 		if (rbytes < 0) {
-			ret = -errno;
 			error("read from stream failed: %m");
-			goto out;
+			return -errno;
 		}
 		if (rbytes == 0) {
-			ret = 1;
-			goto out_eof;
+			avail = sctx->read_end - sctx->read_start;
+			if (avail == 0)
+				return 1;
+			error("short read from stream: expected %zu read %zu",
+			      len, avail);
+			return -EIO;
 		}
-		pos += rbytes;
-	}
-	ret = 0;
-
-out_eof:
-	if (0 < pos && pos < len) {
-		error("short read from stream: expected %zu read %zu", len, pos);
-		ret = -EIO;
-	} else {
-		sctx->stream_pos += pos;
+		sctx->read_end += rbytes;
 	}
+	return 0;
+}
 
-out:
-	return ret;
+/* Mark len bytes of the buffer as parsed */
+static void consume_buf(struct btrfs_send_stream *sctx, size_t len)
+{
+	sctx->read_start += len;
+	sctx->stream_pos += len;
 }
 
 /*
@@ -121,7 +229,7 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 
 	memset(sctx->cmd_attrs, 0, sizeof(sctx->cmd_attrs));
 
-	ret = read_buf(sctx, sctx->read_buf, sizeof(*cmd_hdr));
+	ret = fill_buf(sctx, sizeof(*cmd_hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -131,27 +239,11 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 	}
 
 	/* The read_buf does not guarantee any alignment for any structures. */
-	cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
+	cmd_hdr = (struct btrfs_cmd_header *)(sctx->read_buf + sctx->read_start);
 	cmd_len = get_unaligned_le32(&cmd_hdr->len);
 	cmd = get_unaligned_le16(&cmd_hdr->cmd);
 	buf_len = sizeof(*cmd_hdr) + cmd_len;
-	if (sctx->read_buf_size < buf_len) {
-		void *new_read_buf;
-
-		new_read_buf = realloc(sctx->read_buf, buf_len);
-		if (!new_read_buf) {
-			ret = -ENOMEM;
-			errno = -ret;
-			error_msg(ERROR_MSG_MEMORY, "read buffer for command");
-			goto out;
-		}
-		sctx->read_buf = new_read_buf;
-		sctx->read_buf_size = buf_len;
-		/* We need to reset cmd_hdr after realloc of sctx->read_buf */
-		cmd_hdr = (struct btrfs_cmd_header *)sctx->read_buf;
-	}
-	data = sctx->read_buf + sizeof(*cmd_hdr);
-	ret = read_buf(sctx, data, cmd_len);
+	ret = fill_buf(sctx, buf_len);
 	if (ret < 0)
 		goto out;
 	if (ret) {
@@ -159,13 +251,16 @@ static int read_cmd(struct btrfs_send_stream *sctx)
 		error("unexpected EOF in stream");
 		goto out;
 	}
+	/* The buffer may have been moved or reallocated */
+	cmd_hdr = (struct btrfs_cmd_header *)(sctx->read_buf + sctx->read_start);
+	data = (char *)(cmd_hdr + 1);
+	consume_buf(sctx, buf_len);
 
 	crc = get_unaligned_le32(&cmd_hdr->crc);
 	/* In send, CRC is computed with header crc = 0, replicate that */
 	put_unaligned_le32(0, &cmd_hdr->crc);
 
-	crc2 = crc32c(0, (unsigned char*)sctx->read_buf,
-			sizeof(*cmd_hdr) + cmd_len);
+	crc2 = crc32c(0, (unsigned char*)cmd_hdr, buf_len);
 
 	if (crc != crc2) {
 		ret = -EINVAL;
@@ -388,10 +483,24 @@ static int read_and_process_cmd(struct btrfs_send_stream *sctx)
 	int len;
 	int xattr_len;
 	int fallocate_mode;
+	int clone_ret = 0;
+	size_t cmd_pos;
+	u64 start;
 
+	cmd_pos = sctx->stream_pos;
 	ret = read_cmd(sctx);
 	if (ret)
 		goto out;
+	start = stats_io_start();
+
+	/* The end of the stream is handled by the caller */
+	if (sctx->in_clones && sctx->cmd != BTRFS_SEND_C_CLONE &&
+	    sctx->cmd != BTRFS_SEND_C_END) {
+		sctx->in_clones = false;
+		clone_ret = sctx->ops->clone_end(sctx->user);
+		stats_op("stream clone_end", 0, start);
+		start = stats_io_start();
+	}
 
 	switch (sctx->cmd) {
 	case BTRFS_SEND_C_SUBVOL:
@@ -507,6 +616,7 @@ static int read_and_process_cmd(struct btrfs_send_stream *sctx)
 		ret = sctx->ops->clone(path, offset, len, clone_uuid,
 				clone_ctransid, clone_path, clone_offset,
 				sctx->user);
+		sctx->in_clones = sctx->ops->clone_end != NULL;
 		break;
 	case BTRFS_SEND_C_SET_XATTR:
 		TLV_GET_STRING(sctx, BTRFS_SEND_A_PATH, &path);
@@ -576,7 +686,10 @@ static int read_and_process_cmd(struct btrfs_send_stream *sctx)
 		ret = sctx->ops->fileattr(path, fileattr, sctx->user);
 		break;
 	}
-
+	if (stats_enabled)
+		stats_op(sctx->cmd <= BTRFS_SEND_C_MAX ?
+			 cmd_stats_names[sctx->cmd] : cmd_stats_names[0],
+			 sctx->stream_pos - cmd_pos, start);
 
 tlv_get_failed:
 out:
@@ -584,6 +697,9 @@ out:
 	free(path_to);
 	free(clone_path);
 	free(xattr_name);
+	/* The failed clones count as an error of this command */
+	if (clone_ret < 0 && ret == 0)
+		ret = clone_ret;
 	return ret;
 }
 
@@ -606,15 +722,38 @@ int btrfs_read_and_process_send_stream(int fd,
 	sctx.fd = fd;
 	sctx.ops = ops;
 	sctx.user = user;
+	sctx.in_clones = false;
 	sctx.stream_pos = 0;
+	sctx.read_start = 0;
+	sctx.read_end = 0;
+
+	if (read_ahead.buf && read_ahead.fd == fd) {
+		sctx.read_buf = read_ahead.buf;
+		sctx.read_buf_size = read_ahead.size;
+		sctx.read_start = read_ahead.start;
+		sctx.read_end = read_ahead.end;
+	} else {
+		free(read_ahead.buf);
+		sctx.read_buf = malloc(SEND_STREAM_READ_BUF_SIZE);
+		if (!sctx.read_buf) {
+			ret = -ENOMEM;
+			error_msg(ERROR_MSG_MEMORY, "send stream read buffer");
+			goto out;
+		}
+		sctx.read_buf_size = SEND_STREAM_READ_BUF_SIZE;
+	}
+	read_ahead.buf = NULL;
+	read_ahead.fd = -1;
 
-	ret = read_buf(&sctx, (char*)&hdr, sizeof(hdr));
+	ret = fill_buf(&sctx, sizeof(hdr));
 	if (ret < 0)
 		goto out;
 	if (ret) {
 		ret = -ENODATA;
 		goto out;
 	}
+	memcpy(&hdr, sctx.read_buf + sctx.read_start, sizeof(hdr));
+	consume_buf(&sctx, sizeof(hdr));
 
 	if (strcmp(hdr.magic, BTRFS_SEND_STREAM_MAGIC)) {
 		ret = -EINVAL;
@@ -630,14 +769,6 @@ int btrfs_read_and_process_send_stream(int fd,
 		goto out;
 	}
 
-	sctx.read_buf = malloc(BTRFS_SEND_BUF_SIZE_V1);
-	if (!sctx.read_buf) {
-		ret = -ENOMEM;
-		error_msg(ERROR_MSG_MEMORY, "send stream read buffer");
-		goto out;
-	}
-	sctx.read_buf_size = BTRFS_SEND_BUF_SIZE_V1;
-
 	while (1) {
 		ret = read_and_process_cmd(&sctx);
 		if (ret < 0) {
@@ -651,9 +782,27 @@ int btrfs_read_and_process_send_stream(int fd,
 			break;
 		}
 	}
-	free(sctx.read_buf);
+
+	if (sctx.in_clones) {
+		u64 start = stats_io_start();
+		int err = ops->clone_end(user);
+
+		stats_op("stream clone_end", 0, start);
+		if (err < 0)
+			last_err = err;
+	}
 
 out:
+	/* Keep the start of the next stream for the next call */
+	if (sctx.read_buf && sctx.read_end > sctx.read_start) {
+		read_ahead.fd = fd;
+		read_ahead.buf = sctx.read_buf;
+		read_ahead.size = sctx.read_buf_size;
+		read_ahead.start = sctx.read_start;
+		read_ahead.end = sctx.read_end;
+	} else {
+		free(sctx.read_buf);
+	}
 	if (last_err && !ret)
 		ret = last_err;
 
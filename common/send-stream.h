@@ -20,6 +20,7 @@
 #define __BTRFS_SEND_STREAM_H__
 
 #include "kerncompat.h"
+#include <sys/types.h>
 
 struct timespec;
 
@@ -65,11 +66,20 @@ struct btrfs_send_ops {
 	int (*enable_verity)(const char *path, u8 algorithm, u32 block_size,
 			     int salt_len, char *salt,
 			     int sig_len, char *sig, void *user);
+	/*
+	 * Optional, called when a run of clone commands ends, before the next
+	 * command or at the end of the stream.  Lets the receiver merge
+	 * contiguous clones and apply them at once.
+	 */
+	int (*clone_end)(void *user);
 };
 
 int btrfs_read_and_process_send_stream(int fd,
 				       struct btrfs_send_ops *ops, void *user,
 				       int honor_end_cmd,
 				       u64 max_errors);
+void btrfs_send_stream_set_read(ssize_t (*read_fn)(int fd, void *buf,
+						  size_t count));
+void btrfs_send_stream_forget(int fd);
 
 #endif
@@ -148,17 +148,8 @@ static int btrfs_read_root_item_raw(int mnt_fd, u64 root_id, size_t buf_len,
  * generation numbers as then we know the root was once mounted with an older
  * kernel that was not aware of the root item structure change.
  */
-static int btrfs_read_root_item(int mnt_fd, u64 root_id,
-				struct btrfs_root_item *item)
+static void btrfs_root_item_fixup(struct btrfs_root_item *item, u32 read_len)
 {
-	int ret;
-	u32 read_len;
-
-	ret = btrfs_read_root_item_raw(mnt_fd, root_id, sizeof(*item),
-				       &read_len, item);
-	if (ret)
-		return ret;
-
 	if (read_len < sizeof(*item) ||
 	    btrfs_root_generation(item) != btrfs_root_generation_v2(item)) {
 		/*
@@ -175,7 +166,19 @@ static int btrfs_read_root_item(int mnt_fd, u64 root_id,
 			sizeof(*item) - offsetof(struct btrfs_root_item,
 						 generation_v2));
 	}
+}
+
+static int btrfs_read_root_item(int mnt_fd, u64 root_id,
+				struct btrfs_root_item *item)
+{
+	int ret;
+	u32 read_len;
 
+	ret = btrfs_read_root_item_raw(mnt_fd, root_id, sizeof(*item),
+				       &read_len, item);
+	if (ret)
+		return ret;
+	btrfs_root_item_fixup(item, read_len);
 	return 0;
 }
 
@@ -274,6 +277,19 @@ static int btrfs_subvolid_resolve_sub(int fd, char *path, size_t *path_len,
 	return 0;
 }
 
+static void subvol_info_from_root_item(struct subvol_info *info, u64 root_id,
+				       const struct btrfs_root_item *root_item)
+{
+	info->root_id = root_id;
+	memcpy(info->uuid, root_item->uuid, BTRFS_UUID_SIZE);
+	memcpy(info->received_uuid, root_item->received_uuid, BTRFS_UUID_SIZE);
+	memcpy(info->parent_uuid, root_item->parent_uuid, BTRFS_UUID_SIZE);
+	info->ctransid = btrfs_root_ctransid(root_item);
+	info->otransid = btrfs_root_otransid(root_item);
+	info->stransid = btrfs_root_stransid(root_item);
+	info->rtransid = btrfs_root_rtransid(root_item);
+}
+
 struct subvol_info *subvol_uuid_search(int mnt_fd,
 				       u64 root_id, const u8 *uuid, u64 transid,
 				       const char *path,
@@ -313,14 +329,7 @@ struct subvol_info *subvol_uuid_search(int mnt_fd,
 		ret = -ENOMEM;
 		goto out;
 	}
-	info->root_id = root_id;
-	memcpy(info->uuid, root_item.uuid, BTRFS_UUID_SIZE);
-	memcpy(info->received_uuid, root_item.received_uuid, BTRFS_UUID_SIZE);
-	memcpy(info->parent_uuid, root_item.parent_uuid, BTRFS_UUID_SIZE);
-	info->ctransid = btrfs_root_ctransid(&root_item);
-	info->otransid = btrfs_root_otransid(&root_item);
-	info->stransid = btrfs_root_stransid(&root_item);
-	info->rtransid = btrfs_root_rtransid(&root_item);
+	subvol_info_from_root_item(info, root_id, &root_item);
 	if (type == subvol_search_by_path) {
 		info->path = strdup(path);
 		if (!info->path) {
@@ -348,3 +357,334 @@ out:
 
 	return info;
 }
+
+/*
+ * Advance the search key past the item of @sh, return false at the end of
+ * the key space.
+ */
+static bool subvol_uuid_cache_next_key(struct btrfs_ioctl_search_key *sk,
+				       const struct btrfs_ioctl_search_header *sh)
+{
+	sk->min_objectid = sh->objectid;
+	sk->min_type = sh->type;
+	sk->min_offset = sh->offset;
+	if (sk->min_offset < (u64)-1) {
+		sk->min_offset++;
+		return true;
+	}
+	sk->min_offset = 0;
+	if (sk->min_type < (u8)-1) {
+		sk->min_type++;
+		return true;
+	}
+	sk->min_type = 0;
+	if (sk->min_objectid < sk->max_objectid) {
+		sk->min_objectid++;
+		return true;
+	}
+	return false;
+}
+
+static int subvol_uuid_cache_add_subvol(struct subvol_uuid_cache *cache,
+					u64 root_id,
+					const struct btrfs_root_item *item)
+{
+	struct subvol_info *info;
+
+	/* The last of the root items of the subvolume, like the search */
+	if (cache->nr_subvols &&
+	    cache->subvols[cache->nr_subvols - 1].root_id == root_id) {
+		info = &cache->subvols[cache->nr_subvols - 1];
+	} else {
+		if (cache->nr_subvols == cache->alloc_subvols) {
+			size_t nr = max_t(size_t, 64, cache->alloc_subvols * 2);
+
+			info = realloc(cache->subvols, nr * sizeof(*info));
+			if (!info)
+				return -ENOMEM;
+			cache->subvols = info;
+			cache->alloc_subvols = nr;
+		}
+		info = &cache->subvols[cache->nr_subvols++];
+	}
+	memset(info, 0, sizeof(*info));
+	subvol_info_from_root_item(info, root_id, item);
+	return 0;
+}
+
+static int subvol_uuid_cache_load_subvols(struct subvol_uuid_cache *cache)
+{
+	struct btrfs_tree_search_args args;
+	struct btrfs_ioctl_search_key *sk;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	sk = btrfs_tree_search_sk(&args);
+	sk->tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	sk->min_objectid = BTRFS_FS_TREE_OBJECTID;
+	sk->max_objectid = BTRFS_LAST_FREE_OBJECTID;
+	sk->max_type = BTRFS_ROOT_ITEM_KEY;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (1) {
+		struct btrfs_ioctl_search_header sh;
+		unsigned long off = 0;
+
+		sk->nr_items = 4096;
+		ret = btrfs_tree_search_ioctl(cache->mnt_fd, &args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			return 0;
+
+		for (int i = 0; i < sk->nr_items; i++) {
+			struct btrfs_root_item item;
+
+			memcpy(&sh, btrfs_tree_search_data(&args, off), sizeof(sh));
+			off += sizeof(sh);
+			if (sh.type == BTRFS_ROOT_ITEM_KEY &&
+			    (sh.objectid == BTRFS_FS_TREE_OBJECTID ||
+			     sh.objectid >= BTRFS_FIRST_FREE_OBJECTID)) {
+				memset(&item, 0, sizeof(item));
+				memcpy(&item, btrfs_tree_search_data(&args, off),
+				       min_t(u32, sh.len, sizeof(item)));
+				btrfs_root_item_fixup(&item, sh.len);
+				ret = subvol_uuid_cache_add_subvol(cache,
+							sh.objectid, &item);
+				if (ret < 0)
+					return ret;
+			}
+			off += sh.len;
+		}
+		if (!subvol_uuid_cache_next_key(sk, &sh))
+			return 0;
+	}
+}
+
+static int subvol_uuid_cache_add_uuid(struct subvol_uuid_cache *cache,
+				      const struct btrfs_ioctl_search_header *sh,
+				      const void *item)
+{
+	struct subvol_uuid_cache_uuid *entry;
+	__le64 lesubid;
+
+	if ((sh->len & (sizeof(u64) - 1)) || sh->len == 0)
+		return 0;
+	if (cache->nr_uuids == cache->alloc_uuids) {
+		size_t nr = max_t(size_t, 128, cache->alloc_uuids * 2);
+
+		entry = realloc(cache->uuids, nr * sizeof(*entry));
+		if (!entry)
+			return -ENOMEM;
+		cache->uuids = entry;
+		cache->alloc_uuids = nr;
+	}
+	entry = &cache->uuids[cache->nr_uuids++];
+	/* The reverse of btrfs_uuid_to_key() */
+	put_unaligned_le64(sh->objectid, entry->uuid);
+	put_unaligned_le64(sh->offset, entry->uuid + sizeof(u64));
+	entry->type = sh->type;
+	/* The first stored id, like btrfs_uuid_tree_lookup_any() */
+	memcpy(&lesubid, item, sizeof(lesubid));
+	entry->root_id = le64_to_cpu(lesubid);
+	return 0;
+}
+
+static int subvol_uuid_cache_load_uuids(struct subvol_uuid_cache *cache)
+{
+	struct btrfs_tree_search_args args;
+	struct btrfs_ioctl_search_key *sk;
+	int ret;
+
+	memset(&args, 0, sizeof(args));
+	sk = btrfs_tree_search_sk(&args);
+	sk->tree_id = BTRFS_UUID_TREE_OBJECTID;
+	sk->max_objectid = (u64)-1;
+	sk->max_type = (u8)-1;
+	sk->max_offset = (u64)-1;
+	sk->max_transid = (u64)-1;
+
+	while (1) {
+		struct btrfs_ioctl_search_header sh;
+		unsigned long off = 0;
+
+		sk->nr_items = 4096;
+		ret = btrfs_tree_search_ioctl(cache->mnt_fd, &args);
+		if (ret < 0)
+			return -errno;
+		if (sk->nr_items == 0)
+			return 0;
+
+		for (int i = 0; i < sk->nr_items; i++) {
+			memcpy(&sh, btrfs_tree_search_data(&args, off), sizeof(sh));
+			off += sizeof(sh);
+			if (sh.type == BTRFS_UUID_KEY_SUBVOL ||
+			    sh.type == BTRFS_UUID_KEY_RECEIVED_SUBVOL) {
+				ret = subvol_uuid_cache_add_uuid(cache, &sh,
+					btrfs_tree_search_data(&args, off));
+				if (ret < 0)
+					return ret;
+			}
+			off += sh.len;
+		}
+		if (!subvol_uuid_cache_next_key(sk, &sh))
+			return 0;
+	}
+}
+
+static int subvol_uuid_cache_cmp(const void *a, const void *b)
+{
+	const struct subvol_uuid_cache_uuid *entry1 = a;
+	const struct subvol_uuid_cache_uuid *entry2 = b;
+
+	if (entry1->type != entry2->type)
+		return entry1->type < entry2->type ? -1 : 1;
+	return memcmp(entry1->uuid, entry2->uuid, BTRFS_UUID_SIZE);
+}
+
+static void subvol_uuid_cache_clear(struct subvol_uuid_cache *cache)
+{
+	for (size_t i = 0; i < cache->nr_subvols; i++)
+		free(cache->subvols[i].path);
+	cache->nr_subvols = 0;
+	cache->nr_uuids = 0;
+	cache->loaded = false;
+	cache->searches = 0;
+}
+
+static int subvol_uuid_cache_load(struct subvol_uuid_cache *cache)
+{
+	int ret;
+
+	subvol_uuid_cache_clear(cache);
+	ret = subvol_uuid_cache_load_subvols(cache);
+	if (ret == 0)
+		ret = subvol_uuid_cache_load_uuids(cache);
+	if (ret < 0) {
+		subvol_uuid_cache_clear(cache);
+		return ret;
+	}
+	/* The root items come sorted by the root id */
+	qsort(cache->uuids, cache->nr_uuids, sizeof(*cache->uuids),
+	      subvol_uuid_cache_cmp);
+	cache->loaded = true;
+	return 0;
+}
+
+void subvol_uuid_cache_init(struct subvol_uuid_cache *cache, int mnt_fd)
+{
+	memset(cache, 0, sizeof(*cache));
+	cache->mnt_fd = mnt_fd;
+}
+
+/* Reload the cache on the next search, e.g. after a subvolume is created */
+void subvol_uuid_cache_invalidate(struct subvol_uuid_cache *cache)
+{
+	subvol_uuid_cache_clear(cache);
+}
+
+void subvol_uuid_cache_release(struct subvol_uuid_cache *cache)
+{
+	subvol_uuid_cache_clear(cache);
+	free(cache->subvols);
+	free(cache->uuids);
+	memset(cache, 0, sizeof(*cache));
+}
+
+static struct subvol_info *subvol_uuid_cache_find(struct subvol_uuid_cache *cache,
+						  u64 root_id)
+{
+	size_t lo = 0;
+	size_t hi = cache->nr_subvols;
+
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+
+		if (cache->subvols[mid].root_id == root_id)
+			return &cache->subvols[mid];
+		if (cache->subvols[mid].root_id < root_id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+/*
+ * Same as subvol_uuid_search() but served from the subvolumes and UUIDs read
+ * from the root and UUID trees at once, instead of searching them for each
+ * call. The path of a subvolume is resolved on the first search returning it.
+ * The returned info is a copy to be freed by the caller.
+ *
+ * The trees are read once there were SUBVOL_UUID_CACHE_DIRECT searches since
+ * the cache was invalidated, the first ones search the trees directly as
+ * reading all subvolumes costs more for a few searches. The searches by path
+ * always resolve the path.
+ */
+struct subvol_info *subvol_uuid_cache_search(struct subvol_uuid_cache *cache,
+					     u64 root_id, const u8 *uuid,
+					     u64 transid, const char *path,
+					     enum subvol_search_type type)
+{
+	struct subvol_info *cached;
+	struct subvol_info *info;
+	int ret;
+
+	if (type == subvol_search_by_path ||
+	    (!cache->loaded &&
+	     (++cache->searches <= SUBVOL_UUID_CACHE_DIRECT ||
+	      subvol_uuid_cache_load(cache) < 0)))
+		return subvol_uuid_search(cache->mnt_fd, root_id, uuid, transid,
+					  path, type);
+
+	switch (type) {
+	case subvol_search_by_received_uuid:
+	case subvol_search_by_uuid: {
+		struct subvol_uuid_cache_uuid key = { 0 };
+		struct subvol_uuid_cache_uuid *found;
+
+		memcpy(key.uuid, uuid, BTRFS_UUID_SIZE);
+		key.type = type == subvol_search_by_uuid ?
+			   BTRFS_UUID_KEY_SUBVOL : BTRFS_UUID_KEY_RECEIVED_SUBVOL;
+		found = bsearch(&key, cache->uuids, cache->nr_uuids,
+				sizeof(*cache->uuids), subvol_uuid_cache_cmp);
+		if (!found)
+			return ERR_PTR(-ENOENT);
+		root_id = found->root_id;
+		break;
+	}
+	case subvol_search_by_root_id:
+		break;
+	default:
+		return ERR_PTR(-EINVAL);
+	}
+
+	cached = subvol_uuid_cache_find(cache, root_id);
+	if (!cached)
+		return ERR_PTR(-ENOENT);
+	if (!cached->path) {
+		char *resolved = malloc(PATH_MAX);
+
+		if (!resolved)
+			return ERR_PTR(-ENOMEM);
+		ret = btrfs_subvolid_resolve(cache->mnt_fd, resolved, PATH_MAX,
+					     root_id);
+		if (ret) {
+			free(resolved);
+			return ERR_PTR(ret);
+		}
+		cached->path = resolved;
+	}
+
+	info = malloc(sizeof(*info));
+	if (!info)
+		return ERR_PTR(-ENOMEM);
+	*info = *cached;
+	info->path = strdup(cached->path);
+	if (!info->path) {
+		free(info);
+		return ERR_PTR(-ENOMEM);
+	}
+	return info;
+}
@@ -21,6 +21,7 @@
 
 #include "kerncompat.h"
 #include <stddef.h>
+#include <stdbool.h>
 #include "kernel-shared/uapi/btrfs.h"
 
 enum subvol_search_type {
@@ -53,6 +54,43 @@ struct subvol_info *subvol_uuid_search(int mnt_fd,
 				       const char *path,
 				       enum subvol_search_type type);
 
+/* Searches before the subvolumes are read, see subvol_uuid_cache_search() */
+#define SUBVOL_UUID_CACHE_DIRECT	(8)
+
+struct subvol_uuid_cache_uuid {
+	u8 uuid[BTRFS_UUID_SIZE];
+	/* BTRFS_UUID_KEY_SUBVOL or BTRFS_UUID_KEY_RECEIVED_SUBVOL */
+	u8 type;
+	u64 root_id;
+};
+
+/*
+ * The subvolumes of a mounted filesystem for the repeated searches by root id,
+ * uuid and received uuid, see subvol_uuid_cache_search()
+ */
+struct subvol_uuid_cache {
+	int mnt_fd;
+	bool loaded;
+	/* Searches since the cache was invalidated */
+	unsigned int searches;
+	/* Sorted by root id, the paths resolved on demand */
+	struct subvol_info *subvols;
+	size_t nr_subvols;
+	size_t alloc_subvols;
+	/* The items of the UUID tree, sorted by type and uuid */
+	struct subvol_uuid_cache_uuid *uuids;
+	size_t nr_uuids;
+	size_t alloc_uuids;
+};
+
+void subvol_uuid_cache_init(struct subvol_uuid_cache *cache, int mnt_fd);
+void subvol_uuid_cache_invalidate(struct subvol_uuid_cache *cache);
+void subvol_uuid_cache_release(struct subvol_uuid_cache *cache);
+struct subvol_info *subvol_uuid_cache_search(struct subvol_uuid_cache *cache,
+					     u64 root_id, const u8 *uuid,
+					     u64 transid, const char *path,
+					     enum subvol_search_type type);
+
 int btrfs_subvolid_resolve(int fd, char *path, size_t path_len, u64 subvol_id);
 
 #endif
@@ -0,0 +1,111 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include "kernel-lib/sizes.h"
+#include "common/slab.h"
+#include "common/internal.h"
+
+void object_slab_init(struct object_slab *slab, size_t obj_size,
+		      size_t chunk_size)
+{
+	memset(slab, 0, sizeof(*slab));
+	/* The free list link is stored in the free objects */
+	slab->obj_size = round_up(obj_size, sizeof(void *));
+	slab->chunk_size = max(chunk_size, slab->obj_size);
+}
+
+static int add_chunk(struct object_slab *slab)
+{
+	char *chunk;
+	size_t nr_objs;
+	int ret;
+
+	if (slab->nr_chunks == slab->max_chunks) {
+		unsigned int max_chunks = max(slab->max_chunks * 2, 16U);
+		void **chunks;
+
+		chunks = realloc(slab->chunks, max_chunks * sizeof(*chunks));
+		if (!chunks)
+			return -ENOMEM;
+		slab->chunks = chunks;
+		slab->max_chunks = max_chunks;
+	}
+	/*
+	 * Only the huge page sized chunks are aligned, aligning the small ones
+	 * would leave gaps of up to the chunk size between them in the heap.
+	 */
+	if (slab->chunk_size >= SZ_2M) {
+		ret = posix_memalign((void **)&chunk, SZ_2M, slab->chunk_size);
+		if (ret)
+			return -ENOMEM;
+#ifdef MADV_HUGEPAGE
+		madvise(chunk, slab->chunk_size, MADV_HUGEPAGE);
+#endif
+	} else {
+		chunk = malloc(slab->chunk_size);
+		if (!chunk)
+			return -ENOMEM;
+	}
+	slab->chunks[slab->nr_chunks++] = chunk;
+	/* Thread the new objects on the free list, in address order */
+	nr_objs = slab->chunk_size / slab->obj_size;
+	for (size_t i = nr_objs; i > 0; i--) {
+		void **next = (void **)(chunk + (i - 1) * slab->obj_size);
+
+		*next = slab->free_list;
+		slab->free_list = next;
+	}
+	return 0;
+}
+
+void *object_slab_alloc(struct object_slab *slab)
+{
+	void *obj;
+
+	if (!slab->free_list && add_chunk(slab) < 0)
+		return NULL;
+	obj = slab->free_list;
+	slab->free_list = *(void **)obj;
+	return obj;
+}
+
+void *object_slab_zalloc(struct object_slab *slab)
+{
+	void *obj = object_slab_alloc(slab);
+
+	if (obj)
+		memset(obj, 0, slab->obj_size);
+	return obj;
+}
+
+void object_slab_free(struct object_slab *slab, void *obj)
+{
+	*(void **)obj = slab->free_list;
+	slab->free_list = obj;
+}
+
+void object_slab_release(struct object_slab *slab)
+{
+	for (unsigned int i = 0; i < slab->nr_chunks; i++)
+		free(slab->chunks[i]);
+	free(slab->chunks);
+	object_slab_init(slab, slab->obj_size, slab->chunk_size);
+}
@@ -0,0 +1,48 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_SLAB_H__
+#define __BTRFS_SLAB_H__
+
+#include "kerncompat.h"
+
+/*
+ * Fixed size object allocator, objects are carved from large chunks and kept
+ * on a free list until all the chunks are released at once.
+ *
+ * There's no per-object header, so small records don't pay the malloc
+ * overhead, and dropping a whole set of records is one release instead of a
+ * free() per object.  Chunks of 2MiB and more are 2MiB aligned to allow
+ * transparent huge pages.
+ */
+struct object_slab {
+	size_t obj_size;
+	size_t chunk_size;
+	void *free_list;
+	void **chunks;
+	unsigned int nr_chunks;
+	unsigned int max_chunks;
+};
+
+void object_slab_init(struct object_slab *slab, size_t obj_size,
+		      size_t chunk_size);
+void *object_slab_alloc(struct object_slab *slab);
+void *object_slab_zalloc(struct object_slab *slab);
+void object_slab_free(struct object_slab *slab, void *obj);
+/* Free all the chunks, all objects become invalid */
+void object_slab_release(struct object_slab *slab);
+
+#endif
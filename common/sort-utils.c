@@ -14,11 +14,15 @@
  * Boston, MA 021110-1307, USA.
  */
 
+#include "kerncompat.h"
+#include <stdlib.h>
 #include <strings.h>
 #include <string.h>
 #include <ctype.h>
 #include "common/sort-utils.h"
 #include "common/messages.h"
+#include "common/internal.h"
+#include "common/thread-pool.h"
 
 int compare_init(struct compare *comp, const struct sortdef *sortdef)
 {
@@ -211,3 +215,361 @@ int compare_setup_sort(struct compare *comp, const struct sortdef *sdef, const c
 
 	return 0;
 }
+
+/*
+ * LSD radix sort with 8 bit digits.  Small records are moved by each pass,
+ * larger ones are sorted as an array of their keys and indexes which is then
+ * used to move the records once.  The digits that are the same in all keys are
+ * found by counting all of them in advance and skipped, so small values like
+ * device ids take one pass.
+ */
+
+#define RADIX_BITS		8
+#define RADIX_BUCKETS		(1U << RADIX_BITS)
+#define RADIX_KEY_DIGITS	(64 / RADIX_BITS)
+#define RADIX_MAX_KEYS		2
+/* Records up to this size are sorted directly */
+#define RADIX_DIRECT_MAX	(sizeof(u64) * (RADIX_MAX_KEYS + 1))
+/* Below this many records the threads are not worth the synchronization */
+#define RADIX_PARALLEL_MIN	(64 * 1024)
+
+enum radix_phase {
+	/* Count all digits of the keys */
+	RADIX_COUNT_ALL,
+	/* Count the digit of the pass */
+	RADIX_COUNT,
+	/* Move the elements to the buckets of the digit of the pass */
+	RADIX_SCATTER,
+};
+
+struct radix_ctx {
+	const char *src;
+	char *dst;
+	size_t esize;
+	size_t key_offsets[RADIX_MAX_KEYS];
+	int nr_keys;
+	enum radix_phase phase;
+	/* Digit of the pass, RADIX_KEY_DIGITS for each key */
+	unsigned int digit;
+};
+
+/* Part of the elements counted or moved by one thread in one phase */
+struct radix_job {
+	size_t start;
+	size_t end;
+	/* Counts of each digit value, turned to offsets for the scatter */
+	size_t count[RADIX_MAX_KEYS * RADIX_KEY_DIGITS][RADIX_BUCKETS];
+};
+
+static inline u64 radix_load_key(const char *elem, size_t key_offset)
+{
+	u64 key;
+
+	memcpy(&key, elem + key_offset, sizeof(key));
+	return key;
+}
+
+static inline unsigned int radix_digit_value(const struct radix_ctx *ctx,
+					     const char *elem, unsigned int digit)
+{
+	u64 key = radix_load_key(elem, ctx->key_offsets[digit / RADIX_KEY_DIGITS]);
+
+	return (key >> (digit % RADIX_KEY_DIGITS * RADIX_BITS)) & (RADIX_BUCKETS - 1);
+}
+
+/* Copy one element, with constant sizes for the common ones */
+static inline void radix_copy(char *dst, const char *src, size_t esize)
+{
+	switch (esize) {
+	case 8:
+		memcpy(dst, src, 8);
+		break;
+	case 16:
+		memcpy(dst, src, 16);
+		break;
+	case 24:
+		memcpy(dst, src, 24);
+		break;
+	default:
+		memcpy(dst, src, esize);
+	}
+}
+
+static void radix_process(void *arg, void *data, void *thread_data)
+{
+	const struct radix_ctx *ctx = arg;
+	struct radix_job *job = data;
+	const size_t esize = ctx->esize;
+	size_t *count = job->count[ctx->digit];
+
+	switch (ctx->phase) {
+	case RADIX_COUNT_ALL:
+		memset(job->count, 0, sizeof(job->count));
+		for (size_t i = job->start; i < job->end; i++) {
+			const char *elem = ctx->src + i * esize;
+
+			for (int k = 0; k < ctx->nr_keys; k++) {
+				u64 key = radix_load_key(elem, ctx->key_offsets[k]);
+
+				for (int d = 0; d < RADIX_KEY_DIGITS; d++) {
+					job->count[k * RADIX_KEY_DIGITS + d][key & (RADIX_BUCKETS - 1)]++;
+					key >>= RADIX_BITS;
+				}
+			}
+		}
+		break;
+	case RADIX_COUNT:
+		memset(count, 0, sizeof(job->count[0]));
+		for (size_t i = job->start; i < job->end; i++)
+			count[radix_digit_value(ctx, ctx->src + i * esize, ctx->digit)]++;
+		break;
+	case RADIX_SCATTER:
+		for (size_t i = job->start; i < job->end; i++) {
+			const char *elem = ctx->src + i * esize;
+			unsigned int value = radix_digit_value(ctx, elem, ctx->digit);
+
+			radix_copy(ctx->dst + count[value]++ * esize, elem, esize);
+		}
+		break;
+	}
+}
+
+static const struct thread_pool_ops radix_pool_ops = {
+	.process = radix_process,
+};
+
+static void radix_run_jobs(struct radix_ctx *ctx, struct thread_pool *pool,
+			   struct radix_job *jobs, unsigned int nr_jobs,
+			   enum radix_phase phase)
+{
+	ctx->phase = phase;
+	if (!pool) {
+		radix_process(ctx, &jobs[0], NULL);
+		return;
+	}
+	for (unsigned int i = 0; i < nr_jobs; i++)
+		thread_pool_push(pool, &jobs[i]);
+	while (thread_pool_pop(pool))
+		;
+}
+
+/* Check if all elements have the same value of @digit */
+static bool radix_digit_trivial(const struct radix_job *jobs, unsigned int nr_jobs,
+				unsigned int digit, size_t nmemb)
+{
+	for (unsigned int b = 0; b < RADIX_BUCKETS; b++) {
+		size_t total = 0;
+
+		for (unsigned int j = 0; j < nr_jobs; j++)
+			total += jobs[j].count[digit][b];
+		if (total)
+			return total == nmemb;
+	}
+	return true;
+}
+
+/* Turn the counts of @digit to the offsets of each job in the buckets */
+static void radix_count_to_offsets(struct radix_job *jobs, unsigned int nr_jobs,
+				   unsigned int digit)
+{
+	size_t offset = 0;
+
+	for (unsigned int b = 0; b < RADIX_BUCKETS; b++) {
+		for (unsigned int j = 0; j < nr_jobs; j++) {
+			size_t count = jobs[j].count[digit][b];
+
+			jobs[j].count[digit][b] = offset;
+			offset += count;
+		}
+	}
+}
+
+/*
+ * Sort the @nmemb elements at ctx->src, ctx->dst is an array of the same
+ * size.  Return the array with the sorted elements, which is one of the two.
+ */
+static const char *radix_sort_elements(struct radix_ctx *ctx, size_t nmemb,
+				       struct thread_pool *pool,
+				       struct radix_job *jobs, unsigned int nr_jobs)
+{
+	bool moved = false;
+
+	ctx->digit = 0;
+	radix_run_jobs(ctx, pool, jobs, nr_jobs, RADIX_COUNT_ALL);
+
+	/* Least significant key and digit first, each pass is stable */
+	for (int k = ctx->nr_keys - 1; k >= 0; k--) {
+		for (int d = 0; d < RADIX_KEY_DIGITS; d++) {
+			const char *src = ctx->src;
+
+			ctx->digit = k * RADIX_KEY_DIGITS + d;
+			if (radix_digit_trivial(jobs, nr_jobs, ctx->digit, nmemb))
+				continue;
+			/* Counts per job depend on the order, one job has all */
+			if (moved && nr_jobs > 1)
+				radix_run_jobs(ctx, pool, jobs, nr_jobs, RADIX_COUNT);
+			radix_count_to_offsets(jobs, nr_jobs, ctx->digit);
+			radix_run_jobs(ctx, pool, jobs, nr_jobs, RADIX_SCATTER);
+			ctx->src = ctx->dst;
+			ctx->dst = (char *)src;
+			moved = true;
+		}
+	}
+	return ctx->src;
+}
+
+/* Move the records to the order of the sorted @entries, one cycle at a time */
+static void radix_apply_order(void *base, size_t nmemb, size_t size,
+			      u64 *entries, size_t esize)
+{
+	const size_t step = esize / sizeof(u64);
+	char *records = base;
+	char *gather;
+	char tmp[size];
+
+	/* The index is the first member of each entry */
+	gather = malloc(nmemb * size);
+	if (gather) {
+		for (size_t i = 0; i < nmemb; i++)
+			memcpy(gather + i * size, records + entries[i * step] * size, size);
+		memcpy(records, gather, nmemb * size);
+		free(gather);
+		return;
+	}
+
+	for (size_t i = 0; i < nmemb; i++) {
+		size_t j = i;
+
+		if (entries[i * step] == i)
+			continue;
+		memcpy(tmp, records + i * size, size);
+		while (entries[j * step] != i) {
+			size_t next = entries[j * step];
+
+			memcpy(records + j * size, records + next * size, size);
+			entries[j * step] = j;
+			j = next;
+		}
+		memcpy(records + j * size, tmp, size);
+		entries[j * step] = j;
+	}
+}
+
+struct radix_fallback_keys {
+	size_t offsets[RADIX_MAX_KEYS];
+	int nr;
+};
+
+static int radix_fallback_cmp(const void *a, const void *b, void *data)
+{
+	const struct radix_fallback_keys *keys = data;
+
+	for (int i = 0; i < keys->nr; i++) {
+		u64 ka = radix_load_key(a, keys->offsets[i]);
+		u64 kb = radix_load_key(b, keys->offsets[i]);
+
+		if (ka != kb)
+			return ka < kb ? -1 : 1;
+	}
+	return 0;
+}
+
+static void radix_sort(void *base, size_t nmemb, size_t size,
+		       const size_t *key_offsets, int nr_keys,
+		       unsigned int nr_threads)
+{
+	const bool direct = (size <= RADIX_DIRECT_MAX);
+	struct radix_ctx ctx = { .nr_keys = nr_keys };
+	struct thread_pool pool = { 0 };
+	struct radix_job *jobs;
+	unsigned int nr_jobs;
+	u64 *entries = NULL;
+	char *tmp;
+	const char *sorted;
+	size_t per_job;
+
+	if (nmemb < 2)
+		return;
+	if (nmemb < RADIX_PARALLEL_MIN)
+		nr_threads = 0;
+	nr_jobs = max(nr_threads, 1U);
+
+	/* Entries of the larger records are the index followed by the keys */
+	ctx.esize = direct ? size : sizeof(u64) * (nr_keys + 1);
+	if (!direct)
+		entries = malloc(nmemb * ctx.esize);
+	tmp = malloc(nmemb * ctx.esize);
+	jobs = calloc(nr_jobs, sizeof(*jobs));
+	if ((!direct && !entries) || !tmp || !jobs)
+		goto fallback;
+	if (nr_threads && thread_pool_init(&pool, &radix_pool_ops, &ctx,
+					   nr_threads, nr_jobs) < 0)
+		goto fallback;
+
+	if (direct) {
+		for (int k = 0; k < nr_keys; k++)
+			ctx.key_offsets[k] = key_offsets[k];
+		ctx.src = base;
+	} else {
+		const size_t step = ctx.esize / sizeof(u64);
+
+		for (size_t i = 0; i < nmemb; i++) {
+			entries[i * step] = i;
+			for (int k = 0; k < nr_keys; k++)
+				entries[i * step + k + 1] =
+					radix_load_key((char *)base + i * size,
+						       key_offsets[k]);
+		}
+		for (int k = 0; k < nr_keys; k++)
+			ctx.key_offsets[k] = sizeof(u64) * (k + 1);
+		ctx.src = (char *)entries;
+	}
+	ctx.dst = tmp;
+
+	per_job = (nmemb + nr_jobs - 1) / nr_jobs;
+	for (unsigned int j = 0; j < nr_jobs; j++) {
+		jobs[j].start = min_t(size_t, nmemb, j * per_job);
+		jobs[j].end = min_t(size_t, nmemb, jobs[j].start + per_job);
+	}
+
+	sorted = radix_sort_elements(&ctx, nmemb, nr_threads ? &pool : NULL,
+				     jobs, nr_jobs);
+	if (!direct)
+		radix_apply_order(base, nmemb, size, (u64 *)sorted, ctx.esize);
+	else if (sorted != base)
+		memcpy(base, sorted, nmemb * size);
+	goto out;
+
+fallback:
+	{
+		struct radix_fallback_keys keys = { .nr = nr_keys };
+
+		for (int k = 0; k < nr_keys; k++)
+			keys.offsets[k] = key_offsets[k];
+		qsort_r(base, nmemb, size, radix_fallback_cmp, &keys);
+	}
+out:
+	thread_pool_release(&pool);
+	free(jobs);
+	free(tmp);
+	free(entries);
+}
+
+void radix_sort_u64(void *base, size_t nmemb, size_t size, size_t key_offset)
+{
+	radix_sort(base, nmemb, size, &key_offset, 1, 0);
+}
+
+void radix_sort_u64_pair(void *base, size_t nmemb, size_t size,
+			 size_t key1_offset, size_t key2_offset)
+{
+	const size_t key_offsets[RADIX_MAX_KEYS] = { key1_offset, key2_offset };
+
+	radix_sort(base, nmemb, size, key_offsets, 2, 0);
+}
+
+void radix_sort_u64_parallel(void *base, size_t nmemb, size_t size,
+			     size_t key_offset, unsigned int nr_threads)
+{
+	radix_sort(base, nmemb, size, &key_offset, 1, nr_threads);
+}
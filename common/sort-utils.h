@@ -18,6 +18,7 @@
 #define __COMMON_SORT_UTILS_H__
 
 #include <stdbool.h>
+#include <stddef.h>
 
 /*
  * Example:
@@ -101,4 +102,18 @@ const char *compare_id_name(const struct compare *comp, int id);
 bool compare_has_id(const struct compare *comp, int id);
 int compare_setup_sort(struct compare *comp, const struct sortdef *sdef, const char *def);
 
+/*
+ * Stable sort of @nmemb records of @size bytes by the u64 at @key_offset in
+ * each record, or by the pair of u64 at @key1_offset and @key2_offset.  The
+ * keys are compared as unsigned numbers, like the usual comparators do.
+ *
+ * The parallel variant splits each pass between @nr_threads, arrays that are
+ * too small for that to pay off are sorted by the caller thread.
+ */
+void radix_sort_u64(void *base, size_t nmemb, size_t size, size_t key_offset);
+void radix_sort_u64_pair(void *base, size_t nmemb, size_t size,
+			 size_t key1_offset, size_t key2_offset);
+void radix_sort_u64_parallel(void *base, size_t nmemb, size_t size,
+			     size_t key_offset, unsigned int nr_threads);
+
 #endif
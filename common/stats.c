@@ -0,0 +1,484 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <errno.h>
+#include <pthread.h>
+#include "kernel-shared/ctree.h"
+#include "common/format-output.h"
+#include "common/internal.h"
+#include "common/units.h"
+#include "common/stats.h"
+
+/*
+ * Devices are looked up by the file descriptor, resolved to a path on first
+ * use, the descriptors opened for the same path share the device
+ */
+#define STATS_MAX_DEVICES		(64)
+#define STATS_MAX_FDS			(256)
+/* Log2 buckets of the latency in microseconds, the last one is open ended */
+#define STATS_LAT_BUCKETS		(24)
+#define STATS_MAX_PHASES		(32)
+#define STATS_MAX_CSUMS			(8)
+#define STATS_MAX_OPS			(64)
+
+struct stats_io {
+	u64 ops;
+	u64 bytes;
+	u64 errors;
+	u64 time_ns;
+	u64 latency[STATS_LAT_BUCKETS];
+};
+
+struct stats_device {
+	char *path;
+	struct stats_io read;
+	struct stats_io write;
+	/* Reads from the mmap of the device, there's no latency to measure */
+	u64 mapped_ops;
+	u64 mapped_bytes;
+};
+
+struct stats_fd {
+	int fd;
+	struct stats_device *dev;
+};
+
+struct stats_op {
+	const char *name;
+	u64 count;
+	u64 bytes;
+	u64 time_ns;
+};
+
+struct stats_phase {
+	const char *name;
+	u64 start_ns;
+};
+
+bool stats_enabled;
+
+static enum stats_format stats_format;
+static u64 stats_start_ns;
+
+static pthread_mutex_t stats_devices_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_device stats_devices[STATS_MAX_DEVICES];
+static int stats_nr_devices;
+static struct stats_fd stats_fds[STATS_MAX_FDS];
+static int stats_nr_fds;
+
+static pthread_mutex_t stats_ops_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_op stats_ops[STATS_MAX_OPS];
+static int stats_nr_ops;
+
+static struct stats_phase stats_phases[STATS_MAX_PHASES];
+static int stats_nr_phases;
+
+static u64 stats_eb_hits;
+static u64 stats_eb_misses;
+static u64 stats_eb_evictions;
+static u64 stats_csum_bytes[STATS_MAX_CSUMS];
+
+static char *resolve_fd_path(int fd)
+{
+	char proc[64];
+	char path[PATH_MAX];
+	ssize_t len;
+
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+	len = readlink(proc, path, sizeof(path) - 1);
+	if (len < 0)
+		snprintf(path, sizeof(path), "fd %d", fd);
+	else
+		path[len] = 0;
+	return strdup(path);
+}
+
+static struct stats_device *find_device(int fd)
+{
+	struct stats_device *dev = NULL;
+	char *path;
+	int nr;
+
+	nr = __atomic_load_n(&stats_nr_fds, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nr; i++) {
+		if (stats_fds[i].fd == fd)
+			return stats_fds[i].dev;
+	}
+
+	pthread_mutex_lock(&stats_devices_lock);
+	for (int i = 0; i < stats_nr_fds; i++) {
+		if (stats_fds[i].fd == fd) {
+			dev = stats_fds[i].dev;
+			goto out;
+		}
+	}
+	if (stats_nr_fds >= STATS_MAX_FDS)
+		goto out;
+	path = resolve_fd_path(fd);
+	if (!path)
+		goto out;
+	for (int i = 0; i < stats_nr_devices; i++) {
+		if (strcmp(stats_devices[i].path, path) == 0) {
+			dev = &stats_devices[i];
+			free(path);
+			break;
+		}
+	}
+	if (!dev) {
+		if (stats_nr_devices >= STATS_MAX_DEVICES) {
+			free(path);
+			goto out;
+		}
+		dev = &stats_devices[stats_nr_devices];
+		dev->path = path;
+		__atomic_store_n(&stats_nr_devices, stats_nr_devices + 1,
+				 __ATOMIC_RELEASE);
+	}
+	stats_fds[stats_nr_fds].fd = fd;
+	stats_fds[stats_nr_fds].dev = dev;
+	__atomic_store_n(&stats_nr_fds, stats_nr_fds + 1, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&stats_devices_lock);
+	return dev;
+}
+
+static int latency_bucket(u64 ns)
+{
+	u64 us = ns / 1000;
+
+	if (!us)
+		return 0;
+	return min_t(int, 64 - __builtin_clzll(us), STATS_LAT_BUCKETS - 1);
+}
+
+void __stats_io_done(int fd, bool write, ssize_t bytes, u64 start_ns)
+{
+	struct stats_device *dev = find_device(fd);
+	struct stats_io *io;
+	u64 ns = stats_now_ns() - start_ns;
+
+	if (!dev)
+		return;
+	io = write ? &dev->write : &dev->read;
+	__atomic_fetch_add(&io->ops, 1, __ATOMIC_RELAXED);
+	if (bytes < 0)
+		__atomic_fetch_add(&io->errors, 1, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_add(&io->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&io->time_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&io->latency[latency_bucket(ns)], 1, __ATOMIC_RELAXED);
+}
+
+void __stats_io_mapped(int fd, u64 bytes)
+{
+	struct stats_device *dev = find_device(fd);
+
+	if (!dev)
+		return;
+	__atomic_fetch_add(&dev->mapped_ops, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&dev->mapped_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void __stats_csum(u16 csum_type, u64 bytes)
+{
+	if (csum_type < STATS_MAX_CSUMS)
+		__atomic_fetch_add(&stats_csum_bytes[csum_type], bytes,
+				   __ATOMIC_RELAXED);
+}
+
+void __stats_eb_cache(bool hit)
+{
+	__atomic_fetch_add(hit ? &stats_eb_hits : &stats_eb_misses, 1,
+			   __ATOMIC_RELAXED);
+}
+
+void __stats_eb_evict(void)
+{
+	__atomic_fetch_add(&stats_eb_evictions, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * The operations are looked up by the name pointer first, the same name
+ * passed from other places is found by the string
+ */
+static struct stats_op *find_op(const char *name)
+{
+	struct stats_op *op = NULL;
+	int nr;
+
+	nr = __atomic_load_n(&stats_nr_ops, __ATOMIC_ACQUIRE);
+	for (int i = 0; i < nr; i++) {
+		if (stats_ops[i].name == name)
+			return &stats_ops[i];
+	}
+
+	pthread_mutex_lock(&stats_ops_lock);
+	for (int i = 0; i < stats_nr_ops; i++) {
+		if (strcmp(stats_ops[i].name, name) == 0) {
+			op = &stats_ops[i];
+			goto out;
+		}
+	}
+	if (stats_nr_ops >= STATS_MAX_OPS)
+		goto out;
+	op = &stats_ops[stats_nr_ops];
+	op->name = name;
+	__atomic_store_n(&stats_nr_ops, stats_nr_ops + 1, __ATOMIC_RELEASE);
+out:
+	pthread_mutex_unlock(&stats_ops_lock);
+	return op;
+}
+
+void __stats_op(const char *name, u64 bytes, u64 start_ns)
+{
+	struct stats_op *op = find_op(name);
+
+	if (!op)
+		return;
+	__atomic_fetch_add(&op->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&op->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&op->time_ns, stats_now_ns() - start_ns,
+			   __ATOMIC_RELAXED);
+}
+
+/*
+ * Start a phase of the wall time named by the static string @name, ending the
+ * previous one.  Only the main thread should mark the phases.
+ */
+void stats_phase(const char *name)
+{
+	if (!stats_enabled || stats_nr_phases >= STATS_MAX_PHASES)
+		return;
+	stats_phases[stats_nr_phases].name = name;
+	stats_phases[stats_nr_phases].start_ns = stats_now_ns();
+	stats_nr_phases++;
+}
+
+static u64 phase_time(int i, u64 now)
+{
+	u64 end = (i + 1 < stats_nr_phases) ? stats_phases[i + 1].start_ns : now;
+
+	return end - stats_phases[i].start_ns;
+}
+
+static u64 peak_rss(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+	/* Kilobytes on Linux */
+	return (u64)ru.ru_maxrss * 1024;
+}
+
+/* Upper bound of the latency bucket @i in microseconds */
+static u64 bucket_limit_us(int i)
+{
+	return 1ULL << i;
+}
+
+static const char *format_us(u64 us, char *buf, size_t size)
+{
+	if (us < 1000)
+		snprintf(buf, size, "%lluus", us);
+	else if (us < 1000 * 1000)
+		snprintf(buf, size, "%llums", us / 1000);
+	else
+		snprintf(buf, size, "%llus", us / (1000 * 1000));
+	return buf;
+}
+
+static void print_io_text(const char *name, const struct stats_io *io)
+{
+	char buf[32];
+	bool first = true;
+
+	if (!io->ops)
+		return;
+	fprintf(stderr, "    %-6s %llu ops, %s, %llu errors, avg %s\n", name,
+		io->ops, pretty_size(io->bytes), io->errors,
+		format_us(io->time_ns / io->ops / 1000, buf, sizeof(buf)));
+	fprintf(stderr, "           latency:");
+	for (int i = 0; i < STATS_LAT_BUCKETS; i++) {
+		if (!io->latency[i])
+			continue;
+		fprintf(stderr, "%s %s%s %llu", first ? "" : ",",
+			i == STATS_LAT_BUCKETS - 1 ? ">=" : "<",
+			format_us(bucket_limit_us(i == STATS_LAT_BUCKETS - 1 ? i - 1 : i),
+				  buf, sizeof(buf)),
+			io->latency[i]);
+		first = false;
+	}
+	fputc('\n', stderr);
+}
+
+static void print_stats_text(u64 now)
+{
+	fprintf(stderr, "Stats:\n");
+	fprintf(stderr, "  Wall time:      %llu.%03llus\n",
+		(now - stats_start_ns) / 1000000000ULL,
+		(now - stats_start_ns) / 1000000ULL % 1000);
+	fprintf(stderr, "  Peak RSS:       %s\n", pretty_size(peak_rss()));
+	for (int i = 0; i < stats_nr_phases; i++) {
+		u64 ns = phase_time(i, now);
+
+		fprintf(stderr, "  Phase %-20s %llu.%03llus\n", stats_phases[i].name,
+			ns / 1000000000ULL, ns / 1000000ULL % 1000);
+	}
+	for (int i = 0; i < stats_nr_ops; i++) {
+		u64 ns = stats_ops[i].time_ns;
+
+		fprintf(stderr, "  Op %-28s %llu calls, %s, %llu.%06llus\n",
+			stats_ops[i].name, stats_ops[i].count,
+			pretty_size(stats_ops[i].bytes),
+			ns / 1000000000ULL, ns / 1000ULL % 1000000);
+	}
+	for (int i = 0; i < stats_nr_devices; i++) {
+		fprintf(stderr, "  Device %s:\n", stats_devices[i].path);
+		print_io_text("read", &stats_devices[i].read);
+		print_io_text("write", &stats_devices[i].write);
+		if (stats_devices[i].mapped_ops)
+			fprintf(stderr, "    mapped %llu ops, %s\n",
+				stats_devices[i].mapped_ops,
+				pretty_size(stats_devices[i].mapped_bytes));
+	}
+	fprintf(stderr, "  Extent buffer cache: %llu hits, %llu misses, %llu evictions\n",
+		stats_eb_hits, stats_eb_misses, stats_eb_evictions);
+	for (int i = 0; i < STATS_MAX_CSUMS; i++) {
+		if (stats_csum_bytes[i])
+			fprintf(stderr, "  Checksummed %-8s %s\n",
+				btrfs_super_csum_name(i),
+				pretty_size(stats_csum_bytes[i]));
+	}
+}
+
+static void print_json_string(const char *str)
+{
+	size_t len = strlen(str);
+	char *buf = malloc(len * FMT_JSON_ESCAPE_MAX + 1);
+
+	fputc('"', stderr);
+	if (buf) {
+		fwrite(buf, 1, fmt_escape_json(buf, str, len), stderr);
+		free(buf);
+	}
+	fputc('"', stderr);
+}
+
+static void print_io_json(const char *name, const struct stats_io *io)
+{
+	bool first = true;
+
+	fprintf(stderr, "\"%s\":{\"ops\":%llu,\"bytes\":%llu,\"errors\":%llu,\"time_ns\":%llu,\"latency\":[",
+		name, io->ops, io->bytes, io->errors, io->time_ns);
+	for (int i = 0; i < STATS_LAT_BUCKETS; i++) {
+		if (!io->latency[i])
+			continue;
+		if (i == STATS_LAT_BUCKETS - 1)
+			fprintf(stderr, "%s{\"lt_us\":null,\"count\":%llu}",
+				first ? "" : ",", io->latency[i]);
+		else
+			fprintf(stderr, "%s{\"lt_us\":%llu,\"count\":%llu}",
+				first ? "" : ",", bucket_limit_us(i), io->latency[i]);
+		first = false;
+	}
+	fprintf(stderr, "]}");
+}
+
+static void print_stats_json(u64 now)
+{
+	bool first = true;
+
+	fprintf(stderr, "{\"stats\":{\"wall_time_ns\":%llu,\"peak_rss_bytes\":%llu,\"phases\":[",
+		now - stats_start_ns, peak_rss());
+	for (int i = 0; i < stats_nr_phases; i++) {
+		fprintf(stderr, "%s{\"name\":", i ? "," : "");
+		print_json_string(stats_phases[i].name);
+		fprintf(stderr, ",\"time_ns\":%llu}", phase_time(i, now));
+	}
+	fprintf(stderr, "],\"ops\":[");
+	for (int i = 0; i < stats_nr_ops; i++) {
+		fprintf(stderr, "%s{\"name\":", i ? "," : "");
+		print_json_string(stats_ops[i].name);
+		fprintf(stderr, ",\"count\":%llu,\"bytes\":%llu,\"time_ns\":%llu}",
+			stats_ops[i].count, stats_ops[i].bytes,
+			stats_ops[i].time_ns);
+	}
+	fprintf(stderr, "],\"devices\":[");
+	for (int i = 0; i < stats_nr_devices; i++) {
+		fprintf(stderr, "%s{\"path\":", i ? "," : "");
+		print_json_string(stats_devices[i].path);
+		fputc(',', stderr);
+		print_io_json("read", &stats_devices[i].read);
+		fputc(',', stderr);
+		print_io_json("write", &stats_devices[i].write);
+		fprintf(stderr, ",\"mapped\":{\"ops\":%llu,\"bytes\":%llu}}",
+			stats_devices[i].mapped_ops,
+			stats_devices[i].mapped_bytes);
+	}
+	fprintf(stderr, "],\"eb_cache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu},\"csum\":[",
+		stats_eb_hits, stats_eb_misses, stats_eb_evictions);
+	for (int i = 0; i < STATS_MAX_CSUMS; i++) {
+		if (!stats_csum_bytes[i])
+			continue;
+		fprintf(stderr, "%s{\"type\":\"%s\",\"bytes\":%llu}",
+			first ? "" : ",", btrfs_super_csum_name(i),
+			stats_csum_bytes[i]);
+		first = false;
+	}
+	fprintf(stderr, "]}}\n");
+}
+
+static void stats_print(void)
+{
+	u64 now = stats_now_ns();
+
+	/* Not synchronized with threads still running, the numbers may lag */
+	if (stats_format == STATS_JSON)
+		print_stats_json(now);
+	else
+		print_stats_text(now);
+	for (int i = 0; i < stats_nr_devices; i++)
+		free(stats_devices[i].path);
+}
+
+/*
+ * Enable the accounting and print it at exit, @format is "text", "json" or
+ * NULL for text.  Return -EINVAL for an unknown format.
+ */
+int stats_enable(const char *format)
+{
+	if (!format || strcmp(format, "text") == 0)
+		stats_format = STATS_TEXT;
+	else if (strcmp(format, "json") == 0)
+		stats_format = STATS_JSON;
+	else
+		return -EINVAL;
+
+	if (!stats_enabled) {
+		stats_start_ns = stats_now_ns();
+		stats_enabled = true;
+		atexit(stats_print);
+	}
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_STATS_H__
+#define __BTRFS_STATS_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include <time.h>
+
+/*
+ * Accounting of the I/O, caches and memory of one run of a tool, enabled by
+ * the global option --stats and printed to stderr on exit.
+ *
+ * The counters are updated only when enabled, the hooks in the I/O paths
+ * check stats_enabled first so they cost a predictable branch otherwise.
+ */
+
+enum stats_format {
+	STATS_TEXT,
+	STATS_JSON,
+};
+
+extern bool stats_enabled;
+
+int stats_enable(const char *format);
+void stats_phase(const char *name);
+
+void __stats_io_done(int fd, bool write, ssize_t bytes, u64 start_ns);
+void __stats_io_mapped(int fd, u64 bytes);
+void __stats_csum(u16 csum_type, u64 bytes);
+void __stats_eb_cache(bool hit);
+void __stats_eb_evict(void);
+void __stats_op(const char *name, u64 bytes, u64 start_ns);
+
+static inline u64 stats_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Start of an I/O to be passed to stats_io_done() or stats_op(), 0 when
+ * disabled
+ */
+static inline u64 stats_io_start(void)
+{
+	return stats_enabled ? stats_now_ns() : 0;
+}
+
+static inline void stats_io_done(int fd, bool write, ssize_t bytes, u64 start_ns)
+{
+	if (stats_enabled)
+		__stats_io_done(fd, write, bytes, start_ns);
+}
+
+/* Read of @bytes served from a mapping of the device, without a syscall */
+static inline void stats_io_mapped(int fd, u64 bytes)
+{
+	if (stats_enabled)
+		__stats_io_mapped(fd, bytes);
+}
+
+static inline void stats_csum(u16 csum_type, u64 bytes)
+{
+	if (stats_enabled)
+		__stats_csum(csum_type, bytes);
+}
+
+static inline void stats_eb_cache(bool hit)
+{
+	if (stats_enabled)
+		__stats_eb_cache(hit);
+}
+
+static inline void stats_eb_evict(void)
+{
+	if (stats_enabled)
+		__stats_eb_evict();
+}
+
+/*
+ * Account a call of the operation named by the static string @name that
+ * started at @start_ns and transferred @bytes, e.g. a stage of a pipeline
+ */
+static inline void stats_op(const char *name, u64 bytes, u64 start_ns)
+{
+	if (stats_enabled)
+		__stats_op(name, bytes, start_ns);
+}
+
+#endif
@@ -22,10 +22,17 @@
 #include "common/string-table.h"
 #include "common/internal.h"
 
-/*
- * Create an array of char* which will point to table cell strings
- */
-struct string_table *table_create(unsigned int columns, unsigned int rows)
+/* Room for a cell string, longer strings are truncated */
+#define TABLE_CELL_SIZE		100
+#define TABLE_CHUNK_SIZE	(16 * 1024)
+
+struct string_table_chunk {
+	struct string_table_chunk *next;
+	size_t used;
+	char data[TABLE_CHUNK_SIZE];
+};
+
+static struct string_table *__table_create(unsigned int columns, unsigned int rows)
 {
 	struct string_table *tab;
 	size_t size;
@@ -36,6 +43,11 @@ struct string_table *table_create(unsigned int columns, unsigned int rows)
 	if (!tab)
 		return NULL;
 
+	tab->widths = calloc(columns, sizeof(*tab->widths));
+	if (!tab->widths) {
+		free(tab);
+		return NULL;
+	}
 	tab->ncols = columns;
 	tab->nrows = rows;
 	tab->spacing = STRING_TABLE_SPACING_1;
@@ -43,6 +55,177 @@ struct string_table *table_create(unsigned int columns, unsigned int rows)
 	return tab;
 }
 
+/*
+ * Create an array of char* which will point to table cell strings
+ */
+struct string_table *table_create(unsigned int columns, unsigned int rows)
+{
+	return __table_create(columns, rows);
+}
+
+/*
+ * Create a table printed while it's being filled, only the @hrows header rows
+ * and up to @window body rows are kept in memory.
+ *
+ * The rows must be written in increasing order, once a row past the buffered
+ * ones is written the buffered rows are printed.  The column widths not set by
+ * table_set_width() are found from the header and the first @window rows.
+ */
+struct string_table *table_create_stream(unsigned int columns, unsigned int hrows,
+					 unsigned int window)
+{
+	struct string_table *tab;
+
+	tab = __table_create(columns, hrows + window);
+	if (!tab)
+		return NULL;
+	tab->hrows = hrows;
+	tab->window = window;
+	tab->stream_base = hrows;
+	tab->stream_end = hrows;
+	return tab;
+}
+
+/* Set a fixed @width of @column instead of the longest of its cells */
+void table_set_width(struct string_table *tab, unsigned int column, unsigned int width)
+{
+	if (column < tab->ncols)
+		tab->widths[column] = width;
+}
+
+/* Get room for one cell string, the next one is allocated after its end */
+static char *table_alloc_cell(struct string_table *tab)
+{
+	struct string_table_chunk *chunk = tab->chunks;
+
+	if (!chunk || chunk->used + TABLE_CELL_SIZE > TABLE_CHUNK_SIZE) {
+		chunk = malloc(sizeof(*chunk));
+		if (!chunk)
+			return NULL;
+		chunk->next = tab->chunks;
+		chunk->used = 0;
+		tab->chunks = chunk;
+	}
+	return chunk->data + chunk->used;
+}
+
+/* Drop all cell strings, the first chunk is kept for reuse */
+static void table_reset_cells(struct string_table *tab)
+{
+	struct string_table_chunk *chunk = tab->chunks;
+
+	memset(tab->cells, 0, tab->ncols * tab->nrows * sizeof(char *));
+	if (!chunk)
+		return;
+	while (chunk->next) {
+		struct string_table_chunk *next = chunk->next;
+
+		chunk->next = next->next;
+		free(next);
+	}
+	chunk->used = 0;
+}
+
+/*
+ * Widths of the columns, the fixed ones or the longest text of the first
+ * @prescan rows.
+ */
+static void table_get_sizes(struct string_table *tab, unsigned int *sizes,
+			    unsigned int prescan)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < tab->ncols; i++) {
+		sizes[i] = tab->widths[i];
+		if (sizes[i] || tab->stream_started)
+			continue;
+		for (j = 0; j < prescan; j++) {
+			int idx = i + j * tab->ncols;
+			int len;
+
+			if (!tab->cells[idx])
+				continue;
+
+			len = strlen(tab->cells[idx]) - 1;
+			if (len == 0 || tab->cells[idx][0] == '*')
+				continue;
+
+			if (len > sizes[i])
+				sizes[i] = len;
+		}
+	}
+}
+
+static void table_put_spaces(unsigned int count)
+{
+	static const char spaces[] = "                                ";
+
+	while (count) {
+		unsigned int chunk = min_t(unsigned int, count, sizeof(spaces) - 1);
+
+		fwrite_unlocked(spaces, 1, chunk, stdout);
+		count -= chunk;
+	}
+}
+
+/* Print the rows in cells from @from to @to (not inclusive) */
+static void table_print_rows(struct string_table *tab, const unsigned int *sizes,
+			     unsigned int from, unsigned int to)
+{
+	unsigned int i, j;
+
+	for (j = from; j < to; j++) {
+		for (i = 0; i < tab->ncols; i++) {
+			int idx = i + j * tab->ncols;
+			char *cell = tab->cells[idx];
+
+			if (!cell || !strlen(cell)) {
+				table_put_spaces(sizes[i]);
+			} else if (cell && cell[0] == '*' && cell[1]) {
+				int k = sizes[i];
+
+				while (k--)
+					putchar_unlocked(cell[1]);
+			} else {
+				size_t len = strlen(cell + 1);
+				unsigned int pad = sizes[i] > len ? sizes[i] - len : 0;
+
+				if (cell[0] != '<')
+					table_put_spaces(pad);
+				fwrite_unlocked(cell + 1, 1, len, stdout);
+				if (cell[0] == '<')
+					table_put_spaces(pad);
+			}
+			if (i != (tab->ncols - 1)) {
+				putchar_unlocked(' ');
+				if (tab->spacing == STRING_TABLE_SPACING_2)
+					putchar_unlocked(' ');
+			}
+		}
+		putchar_unlocked('\n');
+	}
+}
+
+/*
+ * Print the buffered rows of a streaming table, the header too if it has not
+ * been printed yet, and start buffering the next window of rows.
+ */
+static void table_stream_flush(struct string_table *tab)
+{
+	unsigned int rows = 0;
+
+	if (tab->stream_end > tab->stream_base)
+		rows = min(tab->stream_end - tab->stream_base, tab->window);
+	if (!tab->stream_started) {
+		table_get_sizes(tab, tab->widths, tab->hrows + rows);
+		tab->stream_started = true;
+		table_print_rows(tab, tab->widths, 0, tab->hrows);
+	}
+	table_print_rows(tab, tab->widths, tab->hrows, tab->hrows + rows);
+	table_reset_cells(tab);
+	tab->stream_base += tab->window;
+}
+
 /*
  * This is like a vprintf, but stores the results in a cell of the table.
  */
@@ -50,23 +233,37 @@ __attribute__ ((format (printf, 4, 0)))
 char *table_vprintf(struct string_table *tab, unsigned int column, unsigned int row,
 			  const char *fmt, va_list ap)
 {
-	unsigned int idx = tab->ncols * row + column;
-	char *msg = calloc(100, 1);
-
-	if (!msg)
-		return NULL;
-
-	if (column >= tab->ncols || row >= tab->nrows) {
-		free(msg);
+	unsigned int slot = row;
+	char *msg;
+	int len;
+
+	if (tab->window && row >= tab->hrows) {
+		if (row < tab->stream_base) {
+			/* Printed already */
+			slot = tab->nrows;
+		} else {
+			while (row >= tab->stream_base + tab->window)
+				table_stream_flush(tab);
+			slot = tab->hrows + row - tab->stream_base;
+			tab->stream_end = max(tab->stream_end, row + 1);
+		}
+	}
+	if (column >= tab->ncols || slot >= tab->nrows) {
 		error("attempt to write outside of table: col %u row %u fmt %s",
 			column, row, fmt);
 		return NULL;
 	}
 
-	if (tab->cells[idx])
-		free(tab->cells[idx]);
-	tab->cells[idx] = msg;
-	vsnprintf(msg, 99, fmt, ap);
+	msg = table_alloc_cell(tab);
+	if (!msg)
+		return NULL;
+	len = vsnprintf(msg, TABLE_CELL_SIZE - 1, fmt, ap);
+	if (len < 0) {
+		msg[0] = 0;
+		len = 0;
+	}
+	tab->chunks->used += min(len, TABLE_CELL_SIZE - 2) + 1;
+	tab->cells[tab->ncols * slot + column] = msg;
 
 	return msg;
 }
@@ -93,6 +290,9 @@ char *table_printf(struct string_table *tab, unsigned int column, unsigned int r
  * @from:    row from which to start
  * @to:      upper row limit (not inclusive), 0 for the whole table
  *
+ * A streaming table prints all the rows not printed yet, regardless of the
+ * range.
+ *
  * Formatting:
  * <TEXT - the TEXT is left aligned
  * >TEXT - the TEXT is right aligned
@@ -102,9 +302,13 @@ char *table_printf(struct string_table *tab, unsigned int column, unsigned int r
 void table_dump_range(struct string_table *tab, unsigned int from, unsigned int to)
 {
 	unsigned int sizes[tab->ncols];
-	unsigned int i, j;
 	unsigned int prescan;
 
+	if (tab->window) {
+		table_stream_flush(tab);
+		return;
+	}
+
 	if (to == 0)
 		to = tab->nrows;
 
@@ -116,49 +320,8 @@ void table_dump_range(struct string_table *tab, unsigned int from, unsigned int
 	prescan = max_t(unsigned int, 100, to);
 	prescan = min_t(unsigned int, tab->nrows, prescan);
 
-	for (i = 0; i < tab->ncols; i++) {
-		sizes[i] = 0;
-		for (j = 0; j < prescan; j++) {
-			int idx = i + j * tab->ncols;
-			int len;
-
-			if (!tab->cells[idx])
-				continue;
-
-			len = strlen(tab->cells[idx]) - 1;
-			if (len == 0 || tab->cells[idx][0] == '*')
-				continue;
-
-			if (len > sizes[i])
-				sizes[i] = len;
-		}
-	}
-
-	for (j = from; j < to; j++) {
-		for (i = 0; i < tab->ncols; i++) {
-			int idx = i + j * tab->ncols;
-			char *cell = tab->cells[idx];
-
-			if (!cell || !strlen(cell)) {
-				printf("%*s", sizes[i], "");
-			} else if (cell && cell[0] == '*' && cell[1]) {
-				int k = sizes[i];
-
-				while (k--)
-					putchar(cell[1]);
-			} else {
-				printf("%*s",
-					cell[0] == '<' ? -sizes[i] : sizes[i],
-					cell + 1);
-			}
-			if (i != (tab->ncols - 1)) {
-				putchar(' ');
-				if (tab->spacing == STRING_TABLE_SPACING_2)
-					putchar(' ');
-			}
-		}
-		putchar('\n');
-	}
+	table_get_sizes(tab, sizes, prescan);
+	table_print_rows(tab, sizes, from, to);
 }
 
 /*
@@ -166,30 +329,31 @@ void table_dump_range(struct string_table *tab, unsigned int from, unsigned int
  */
 void table_free(struct string_table *tab)
 {
-	unsigned int i, count;
-
-	count = tab->ncols * tab->nrows;
-
-	for (i = 0; i < count; i++)
-		if (tab->cells[i])
-			free(tab->cells[i]);
+	while (tab->chunks) {
+		struct string_table_chunk *next = tab->chunks->next;
 
+		free(tab->chunks);
+		tab->chunks = next;
+	}
+	free(tab->widths);
 	free(tab);
 }
 
+/*
+ * Forget the cells of the rows, their strings are freed with the table or
+ * reused once the whole table is cleared.
+ */
 void table_clear_range(struct string_table *tab, unsigned int from, unsigned int to)
 {
-	unsigned int row, col;
+	unsigned int row;
 
 	if (to == 0)
 		to = tab->nrows;
 
-	for (row = from; row < to; row++) {
-		char **rowstart = &tab->cells[row * tab->ncols];
-
-		for (col = 0; col < tab->ncols; col++) {
-			free(rowstart[col]);
-			rowstart[col] = NULL;
-		}
+	if (from == 0 && to >= tab->nrows) {
+		table_reset_cells(tab);
+		return;
 	}
+	for (row = from; row < to; row++)
+		memset(&tab->cells[row * tab->ncols], 0, tab->ncols * sizeof(char *));
 }
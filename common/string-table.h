@@ -18,27 +18,49 @@
 #define __STRING_TABLE_H__
 
 #include <stdarg.h>
+#include <stdbool.h>
 
 enum string_table_spacing {
 	STRING_TABLE_SPACING_1,
 	STRING_TABLE_SPACING_2,
 };
 
+struct string_table_chunk;
+
 struct string_table {
 	unsigned int ncols;
 	unsigned int nrows;
 	/* How many rows are header (names and separators). */
 	unsigned int hrows;
 	enum string_table_spacing spacing;
+
+	/* The cell strings are allocated from chunks freed with the table */
+	struct string_table_chunk *chunks;
+	/* Width of each column, 0 to find it from the cells of the table */
+	unsigned int *widths;
+
+	/*
+	 * Streaming table, the body rows are printed each time @window rows
+	 * are filled.  The row numbers are absolute, the first buffered one is
+	 * @stream_base, @stream_end is after the last one written.
+	 */
+	unsigned int window;
+	unsigned int stream_base;
+	unsigned int stream_end;
+	bool stream_started;
+
 	char *cells[];
 };
 
 struct string_table *table_create(unsigned int columns, unsigned int rows);
+struct string_table *table_create_stream(unsigned int columns, unsigned int hrows,
+					 unsigned int window);
 __attribute__ ((format (printf, 4, 0)))
 char *table_printf(struct string_table *tab, unsigned int column, unsigned int row,
 			  const char *fmt, ...);
 char *table_vprintf(struct string_table *tab, unsigned int column, unsigned int row,
 			  const char *fmt, va_list ap);
+void table_set_width(struct string_table *tab, unsigned int column, unsigned int width);
 void table_free(struct string_table *tab);
 
 void table_dump_range(struct string_table *tab, unsigned int from, unsigned int to);
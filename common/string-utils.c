@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <limits.h>
 #include <ctype.h>
+#include "common/internal.h"
 #include "common/string-utils.h"
 #include "common/messages.h"
 #include "common/parse-utils.h"
@@ -65,6 +66,48 @@ char *strncpy_null(char *dest, const char *src, size_t n)
 	return dest;
 }
 
+/*
+ * Escape @len bytes of @str like string_print_escape_special_len() to @dest,
+ * which must have room for STRING_ESCAPE_MAX times @len. Returns the length
+ * written.
+ */
+size_t string_escape_special(char *dest, const char *str, size_t len)
+{
+	char *p = dest;
+
+	for (size_t i = 0; i < len; i++) {
+		char c = str[i];
+
+		/* The common case, printable ASCII */
+		if (c > ' ' && c < 0x7f && c != '\\') {
+			*p++ = c;
+			continue;
+		}
+		*p++ = '\\';
+		switch (c) {
+		case '\a': *p++ = 'a'; break;
+		case '\b': *p++ = 'b'; break;
+		case '\e': *p++ = 'e'; break;
+		case '\f': *p++ = 'f'; break;
+		case '\n': *p++ = 'n'; break;
+		case '\r': *p++ = 'r'; break;
+		case '\t': *p++ = 't'; break;
+		case '\v': *p++ = 'v'; break;
+		case ' ':  *p++ = ' '; break;
+		case '\\': *p++ = '\\'; break;
+		default:
+			if (!isprint(c)) {
+				*p++ = '0' + ((c & 0300) >> 6);
+				*p++ = '0' + ((c & 070) >> 3);
+				*p++ = '0' + (c & 07);
+			} else {
+				p[-1] = c;
+			}
+		}
+	}
+	return p - dest;
+}
+
 /*
  * Print a string and escape characters (in a C way) that could break the line.
  * Returns the length of the escaped characters. Unprintable characters are
@@ -72,35 +115,17 @@ char *strncpy_null(char *dest, const char *src, size_t n)
  */
 int string_print_escape_special_len(const char *str, size_t str_len)
 {
-	size_t i;
+	char buf[256 * STRING_ESCAPE_MAX];
 	int len = 0;
 
-	for (i = 0; i < str_len; i++) {
-		char c = str[i];
+	while (str_len) {
+		size_t chunk = min_t(size_t, str_len, 256);
+		size_t out = string_escape_special(buf, str, chunk);
 
-		len++;
-		switch (c) {
-		case '\a': putchar('\\'); putchar('a'); len++; break;
-		case '\b': putchar('\\'); putchar('b'); len++; break;
-		case '\e': putchar('\\'); putchar('e'); len++; break;
-		case '\f': putchar('\\'); putchar('f'); len++; break;
-		case '\n': putchar('\\'); putchar('n'); len++; break;
-		case '\r': putchar('\\'); putchar('r'); len++; break;
-		case '\t': putchar('\\'); putchar('t'); len++; break;
-		case '\v': putchar('\\'); putchar('v'); len++; break;
-		case ' ':  putchar('\\'); putchar(' '); len++; break;
-		case '\\': putchar('\\'); putchar('\\'); len++; break;
-		default:
-			  if (!isprint(c)) {
-				  printf("\\%c%c%c",
-						  '0' + ((c & 0300) >> 6),
-						  '0' + ((c & 070) >> 3),
-						  '0' + (c & 07));
-				  len += 3;
-			  } else {
-				  putchar(c);
-			  }
-		}
+		fwrite(buf, 1, out, stdout);
+		len += out;
+		str += chunk;
+		str_len -= chunk;
 	}
 	return len;
 }
@@ -24,6 +24,10 @@ int string_has_prefix(const char *str, const char *prefix);
 
 char *strncpy_null(char *dest, const char *src, size_t n);
 
+/* Longest escape of one character by string_escape_special(), \ooo */
+#define STRING_ESCAPE_MAX	4
+
+size_t string_escape_special(char *dest, const char *str, size_t len);
 int string_print_escape_special_len(const char *str, size_t len);
 static inline int string_print_escape_special(const char *str)
 {
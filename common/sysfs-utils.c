@@ -15,6 +15,9 @@
  */
 
 #include "kerncompat.h"
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <uuid/uuid.h>
@@ -202,3 +205,42 @@ int sysfs_write_fsid_file_u64(int fd, const char *name, u64 value)
 	close(fd);
 	return ret;
 }
+
+/*
+ * Open the I/O statistics of the block device @path, the stat file of the
+ * block layer, and return the file descriptor or error.  The file can be read
+ * repeatedly with sysfs_read_blockdev_stat().
+ */
+int sysfs_open_blockdev_stat(const char *path)
+{
+	char name[PATH_MAX];
+	struct stat st;
+	int ret;
+
+	if (stat(path, &st) < 0)
+		return -errno;
+	if (!S_ISBLK(st.st_mode))
+		return -ENOTBLK;
+
+	snprintf(name, sizeof(name), "/sys/dev/block/%u:%u/stat",
+		 major(st.st_rdev), minor(st.st_rdev));
+	ret = open(name, O_RDONLY);
+	return (ret < 0 ? -errno : ret);
+}
+
+int sysfs_read_blockdev_stat(int fd, struct sysfs_blockdev_stat *stat)
+{
+	char buf[256];
+	int ret;
+
+	ret = sysfs_read_file(fd, buf, sizeof(buf) - 1);
+	if (ret < 0)
+		return ret;
+
+	/* See Documentation/block/stat.rst, the sectors are always 512 bytes */
+	ret = sscanf(buf, "%llu %*u %llu %*u %llu %*u %llu", &stat->read_ios,
+		     &stat->read_sectors, &stat->write_ios, &stat->write_sectors);
+	if (ret != 4)
+		return -EINVAL;
+	return 0;
+}
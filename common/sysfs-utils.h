@@ -20,6 +20,14 @@
 #include "kerncompat.h"
 #include <stddef.h>
 
+/* Counters of the block layer stat file of a device */
+struct sysfs_blockdev_stat {
+	u64 read_ios;
+	u64 read_sectors;
+	u64 write_ios;
+	u64 write_sectors;
+};
+
 int sysfs_open_file(const char *name);
 int sysfs_open_file_rw(const char *name);
 int sysfs_open_fsid_file(int fd, const char *filename);
@@ -31,5 +39,7 @@ int sysfs_read_file(int fd, char *buf, size_t size);
 int sysfs_write_file(int fd, const char *buf, size_t size);
 int sysfs_read_file_u64(const char *name, u64 *value);
 int sysfs_write_file_u64(const char *name, u64 value);
+int sysfs_open_blockdev_stat(const char *path);
+int sysfs_read_blockdev_stat(int fd, struct sysfs_blockdev_stat *stat);
 
 #endif
@@ -0,0 +1,166 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include "common/internal.h"
+#include "common/messages.h"
+#include "common/cpu-utils.h"
+#include "common/thread-pool.h"
+
+/*
+ * Default number of threads for CPU bound jobs, up to @max_threads.  A single
+ * CPU gets no threads, the caller processes the jobs itself.
+ */
+unsigned int thread_pool_default_threads(unsigned int max_threads)
+{
+	unsigned int nr_cpus = cpu_nr_usable();
+
+	return nr_cpus > 1 ? min(nr_cpus, max_threads) : 0;
+}
+
+static void *thread_pool_worker(void *data)
+{
+	struct thread_pool *pool = data;
+	void *thread_data = NULL;
+
+	if (pool->ops->thread_init)
+		thread_data = pool->ops->thread_init(pool->arg);
+
+	pthread_mutex_lock(&pool->mutex);
+	while (true) {
+		struct thread_pool_slot *slot;
+
+		while (pool->next_seq == pool->head_seq && !pool->stop)
+			pthread_cond_wait(&pool->queued_cond, &pool->mutex);
+		if (pool->stop)
+			break;
+		slot = &pool->slots[pool->next_seq % pool->nr_slots];
+		pool->next_seq++;
+		pthread_mutex_unlock(&pool->mutex);
+
+		pool->ops->process(pool->arg, slot->job, thread_data);
+
+		pthread_mutex_lock(&pool->mutex);
+		slot->done = true;
+		pthread_cond_broadcast(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (pool->ops->thread_exit)
+		pool->ops->thread_exit(pool->arg, thread_data);
+	return NULL;
+}
+
+/*
+ * Start up to @nr_threads processing the jobs, fewer if the threads can't be
+ * created.  The data of the threads from ops->thread_init can be NULL if it
+ * can't be allocated, ops->process must handle that.
+ */
+int thread_pool_init(struct thread_pool *pool, const struct thread_pool_ops *ops,
+		     void *arg, unsigned int nr_threads, unsigned int nr_slots)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->ops = ops;
+	pool->arg = arg;
+	pool->nr_slots = max(nr_slots, 1U);
+	pool->slots = calloc(pool->nr_slots, sizeof(*pool->slots));
+	if (!pool->slots)
+		return -ENOMEM;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->queued_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	if (nr_threads) {
+		pool->threads = calloc(nr_threads, sizeof(*pool->threads));
+		if (!pool->threads)
+			nr_threads = 0;
+	}
+	for (; pool->nr_threads < nr_threads; pool->nr_threads++) {
+		if (pthread_create(&pool->threads[pool->nr_threads], NULL,
+				   thread_pool_worker, pool))
+			break;
+	}
+	if (!pool->nr_threads && ops->thread_init)
+		pool->caller_data = ops->thread_init(arg);
+	return 0;
+}
+
+/* Stop the threads, the jobs not popped yet may be left unprocessed */
+void thread_pool_release(struct thread_pool *pool)
+{
+	if (!pool->slots)
+		return;
+	pthread_mutex_lock(&pool->mutex);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->mutex);
+	for (unsigned int i = 0; i < pool->nr_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+	if (!pool->nr_threads && pool->ops->thread_exit)
+		pool->ops->thread_exit(pool->arg, pool->caller_data);
+	free(pool->threads);
+	free(pool->slots);
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->queued_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/* Queue @job for processing, the pool must not be full */
+void thread_pool_push(struct thread_pool *pool, void *job)
+{
+	struct thread_pool_slot *slot;
+
+	UASSERT(!thread_pool_full(pool));
+	slot = &pool->slots[pool->head_seq % pool->nr_slots];
+	slot->job = job;
+	slot->done = false;
+	if (!pool->nr_threads) {
+		pool->head_seq++;
+		return;
+	}
+	pthread_mutex_lock(&pool->mutex);
+	pool->head_seq++;
+	pthread_cond_signal(&pool->queued_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/*
+ * Wait for the oldest pushed job to be done and return it, or return NULL if
+ * there's no job.
+ */
+void *thread_pool_pop(struct thread_pool *pool)
+{
+	struct thread_pool_slot *slot;
+
+	if (thread_pool_empty(pool))
+		return NULL;
+	slot = &pool->slots[pool->tail_seq % pool->nr_slots];
+	if (pool->nr_threads) {
+		pthread_mutex_lock(&pool->mutex);
+		while (!slot->done)
+			pthread_cond_wait(&pool->done_cond, &pool->mutex);
+		pthread_mutex_unlock(&pool->mutex);
+	} else {
+		pool->next_seq++;
+		pool->ops->process(pool->arg, slot->job, pool->caller_data);
+	}
+	pool->tail_seq++;
+	return slot->job;
+}
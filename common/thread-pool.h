@@ -0,0 +1,89 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_THREAD_POOL_H__
+#define __BTRFS_THREAD_POOL_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+#include <pthread.h>
+
+/*
+ * Pool of worker threads processing the jobs pushed by one thread, which
+ * pops them back in the order they were pushed once they're done.
+ *
+ * The jobs are owned by the caller, usually a ring of nr_slots jobs indexed
+ * by head_seq, which is the sequence number of the next pushed job.  At most
+ * nr_slots jobs can be pushed and not popped, this bounds the memory and the
+ * work done ahead of the consumer.
+ *
+ * With no threads, the jobs are processed by the caller when they're popped,
+ * so a tool has the same code path for --threads 0.
+ */
+struct thread_pool_ops {
+	/* Process one job, called by several threads at once */
+	void (*process)(void *arg, void *job, void *thread_data);
+	/* Optional, allocate and free the data of each thread */
+	void *(*thread_init)(void *arg);
+	void (*thread_exit)(void *arg, void *thread_data);
+};
+
+struct thread_pool_slot {
+	void *job;
+	bool done;
+};
+
+struct thread_pool {
+	const struct thread_pool_ops *ops;
+	void *arg;
+
+	pthread_mutex_t mutex;
+	/* Signaled when a job is pushed or the pool stops */
+	pthread_cond_t queued_cond;
+	/* Signaled when a job is done */
+	pthread_cond_t done_cond;
+	struct thread_pool_slot *slots;
+	unsigned int nr_slots;
+	/* Next job to push, to process and to pop */
+	u64 head_seq;
+	u64 next_seq;
+	u64 tail_seq;
+	bool stop;
+
+	pthread_t *threads;
+	unsigned int nr_threads;
+	/* Data for processing the jobs without threads */
+	void *caller_data;
+};
+
+unsigned int thread_pool_default_threads(unsigned int max_threads);
+int thread_pool_init(struct thread_pool *pool, const struct thread_pool_ops *ops,
+		     void *arg, unsigned int nr_threads, unsigned int nr_slots);
+void thread_pool_release(struct thread_pool *pool);
+void thread_pool_push(struct thread_pool *pool, void *job);
+void *thread_pool_pop(struct thread_pool *pool);
+
+static inline bool thread_pool_full(const struct thread_pool *pool)
+{
+	return pool->head_seq - pool->tail_seq >= pool->nr_slots;
+}
+
+static inline bool thread_pool_empty(const struct thread_pool *pool)
+{
+	return pool->head_seq == pool->tail_seq;
+}
+
+#endif
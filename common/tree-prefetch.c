@@ -0,0 +1,529 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "kernel-lib/list.h"
+#include "kernel-lib/rbtree.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/tree-checker.h"
+#include "kernel-shared/volumes.h"
+#include "common/device-utils.h"
+#include "common/extent-cache.h"
+#include "common/messages.h"
+#include "common/slab.h"
+#include "common/tree-prefetch.h"
+#include "crypto/hash.h"
+
+enum tree_prefetch_state {
+	/* In tree_prefetch::queued, sorted by the physical address */
+	PREFETCH_QUEUED,
+	/* In tree_prefetch::urgent, the submitter is waiting for it */
+	PREFETCH_URGENT,
+	PREFETCH_READING,
+	/* In tree_prefetch::done */
+	PREFETCH_DONE,
+};
+
+struct tree_prefetch_req {
+	/* Index of in-flight requests by bytenr, only used by the submitter */
+	struct cache_extent cache;
+	struct rb_node node;
+	struct list_head list;
+	u64 transid;
+	u64 physical;
+	struct btrfs_device *device;
+	int fd;
+	int mirror;
+	int ret;
+	/* Protected by tree_prefetch::lock */
+	enum tree_prefetch_state state;
+	/* The worker verified the checksum of @data */
+	bool csum_ok;
+	/* NULL for page cache readahead, the worker drops the request */
+	char *data;
+};
+
+struct tree_prefetch {
+	struct btrfs_fs_info *fs_info;
+	pthread_mutex_t lock;
+	pthread_cond_t queued_cond;
+	pthread_cond_t done_cond;
+	/*
+	 * Requests waiting for a worker, served in one direction of the
+	 * physical address from @last_physical and then from the start again.
+	 * The urgent ones go first.
+	 */
+	struct rb_root queued;
+	struct list_head urgent;
+	u64 last_physical;
+	/* Requests read by a worker, waiting to be reaped */
+	struct list_head done;
+	struct cache_tree inflight;
+	unsigned int nr_inflight;
+	/* Submitting more reaps the completed requests first */
+	unsigned int max_inflight;
+	/*
+	 * Read buffers of the requests, allocated and freed only by the
+	 * submitting thread. Churning them through malloc fragments the heap
+	 * shared with the callers' records.
+	 */
+	struct object_slab data_slab;
+	unsigned int nr_threads;
+	/* Verify the checksums in the workers */
+	bool worker_csum;
+	bool stop;
+	pthread_t *threads;
+};
+
+static int compare_req(const struct tree_prefetch_req *req, u64 physical, int fd)
+{
+	if (req->physical != physical)
+		return req->physical < physical ? -1 : 1;
+	if (req->fd != fd)
+		return req->fd < fd ? -1 : 1;
+	return 0;
+}
+
+static void queue_req(struct tree_prefetch *tp, struct tree_prefetch_req *req)
+{
+	struct rb_node **p = &tp->queued.rb_node;
+	struct rb_node *parent = NULL;
+
+	while (*p) {
+		parent = *p;
+		if (compare_req(rb_entry(parent, struct tree_prefetch_req, node),
+				req->physical, req->fd) > 0)
+			p = &(*p)->rb_left;
+		else
+			p = &(*p)->rb_right;
+	}
+	req->state = PREFETCH_QUEUED;
+	rb_link_node(&req->node, parent, p);
+	rb_insert_color(&req->node, &tp->queued);
+}
+
+/* Take the next request for a worker, or NULL if there is none */
+static struct tree_prefetch_req *dequeue_req(struct tree_prefetch *tp)
+{
+	struct tree_prefetch_req *req;
+	struct rb_node *node = tp->queued.rb_node;
+	struct rb_node *next = NULL;
+
+	if (!list_empty(&tp->urgent)) {
+		req = list_first_entry(&tp->urgent, struct tree_prefetch_req, list);
+		list_del_init(&req->list);
+		goto out;
+	}
+	while (node) {
+		req = rb_entry(node, struct tree_prefetch_req, node);
+		if (req->physical >= tp->last_physical) {
+			next = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	if (!next)
+		next = rb_first(&tp->queued);
+	if (!next)
+		return NULL;
+	req = rb_entry(next, struct tree_prefetch_req, node);
+	rb_erase(&req->node, &tp->queued);
+	tp->last_physical = req->physical;
+out:
+	req->state = PREFETCH_READING;
+	return req;
+}
+
+static bool prefetch_csum_ok(struct tree_prefetch *tp, const u8 *data)
+{
+	struct btrfs_fs_info *fs_info = tp->fs_info;
+	u8 result[BTRFS_CSUM_SIZE];
+
+	if (btrfs_csum_data(fs_info->csum_type, data + BTRFS_CSUM_SIZE, result,
+			    fs_info->nodesize - BTRFS_CSUM_SIZE))
+		return false;
+	return memcmp(result, data, fs_info->csum_size) == 0;
+}
+
+static void *tree_prefetch_worker(void *arg)
+{
+	struct tree_prefetch *tp = arg;
+	const u32 nodesize = tp->fs_info->nodesize;
+	char *scratch = NULL;
+
+	pthread_mutex_lock(&tp->lock);
+	while (true) {
+		struct tree_prefetch_req *req;
+		ssize_t ret;
+		u64 start;
+
+		while (RB_EMPTY_ROOT(&tp->queued) && list_empty(&tp->urgent) &&
+		       !tp->stop)
+			pthread_cond_wait(&tp->queued_cond, &tp->lock);
+		req = dequeue_req(tp);
+		if (!req)
+			break;
+		pthread_mutex_unlock(&tp->lock);
+
+		if (!req->data) {
+			if (!scratch)
+				scratch = malloc(nodesize);
+			if (scratch) {
+				start = btrfs_device_read_start(req->device);
+				ret = btrfs_pread(req->fd, scratch, nodesize,
+						  req->physical, false);
+				btrfs_device_read_end(req->device, start);
+			}
+			free(req);
+			pthread_mutex_lock(&tp->lock);
+			continue;
+		}
+
+		start = btrfs_device_read_start(req->device);
+		ret = btrfs_pread(req->fd, req->data, nodesize, req->physical,
+				  false);
+		btrfs_device_read_end(req->device, start);
+		if (ret < 0)
+			req->ret = -errno;
+		else if (ret < nodesize)
+			req->ret = -EIO;
+		else
+			req->ret = 0;
+		if (req->ret == 0 && tp->worker_csum)
+			req->csum_ok = prefetch_csum_ok(tp, (u8 *)req->data);
+
+		pthread_mutex_lock(&tp->lock);
+		req->state = PREFETCH_DONE;
+		list_add_tail(&req->list, &tp->done);
+		pthread_cond_signal(&tp->done_cond);
+	}
+	pthread_mutex_unlock(&tp->lock);
+	free(scratch);
+	return NULL;
+}
+
+struct tree_prefetch *tree_prefetch_alloc(struct btrfs_fs_info *fs_info,
+					  unsigned int nr_threads)
+{
+	struct tree_prefetch *tp;
+	int ret = 0;
+
+	tp = calloc(1, sizeof(*tp));
+	if (!tp)
+		return NULL;
+	if (!nr_threads)
+		nr_threads = TREE_PREFETCH_DEFAULT_THREADS;
+	tp->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!tp->threads) {
+		free(tp);
+		return NULL;
+	}
+	tp->fs_info = fs_info;
+	pthread_mutex_init(&tp->lock, NULL);
+	pthread_cond_init(&tp->queued_cond, NULL);
+	pthread_cond_init(&tp->done_cond, NULL);
+	tp->queued = RB_ROOT;
+	INIT_LIST_HEAD(&tp->urgent);
+	INIT_LIST_HEAD(&tp->done);
+	cache_tree_init(&tp->inflight);
+	tp->max_inflight = nr_threads * TREE_PREFETCH_INFLIGHT_PER_THREAD;
+	/* The 2M aligned chunks keep the buffers aligned for O_DIRECT too */
+	object_slab_init(&tp->data_slab, fs_info->nodesize, SZ_2M);
+	tp->worker_csum = !fs_info->skip_csum_check &&
+			  (CRYPTO_HASH_THREAD_SAFE ||
+			   fs_info->csum_type == BTRFS_CSUM_TYPE_CRC32 ||
+			   fs_info->csum_type == BTRFS_CSUM_TYPE_XXHASH);
+
+	for (tp->nr_threads = 0; tp->nr_threads < nr_threads; tp->nr_threads++) {
+		ret = pthread_create(&tp->threads[tp->nr_threads], NULL,
+				     tree_prefetch_worker, tp);
+		if (ret)
+			break;
+	}
+	if (tp->nr_threads == 0) {
+		errno = ret;
+		warning("cannot start tree prefetch threads: %m");
+		tree_prefetch_free(tp);
+		return NULL;
+	}
+	return tp;
+}
+
+static void free_prefetch_req(struct tree_prefetch *tp,
+			      struct tree_prefetch_req *req)
+{
+	if (req->data)
+		object_slab_free(&tp->data_slab, req->data);
+	free(req);
+}
+
+/*
+ * Turn a completed request into an uptodate extent buffer. A failed or
+ * corrupted read of the first mirror is retried synchronously, including the
+ * other mirrors.
+ */
+static struct extent_buffer *complete_prefetch_req(struct tree_prefetch *tp,
+						   struct tree_prefetch_req *req)
+{
+	struct btrfs_fs_info *fs_info = tp->fs_info;
+	struct btrfs_tree_parent_check check = { .transid = req->transid };
+	struct extent_buffer *eb;
+	int ret;
+
+	eb = btrfs_find_create_tree_block(fs_info, req->cache.start);
+	if (!eb)
+		return NULL;
+	if (btrfs_buffer_uptodate(eb, req->transid, 0))
+		return eb;
+
+	ret = btrfs_read_extent_buffer_prefetched(eb, &check, req->mirror,
+						  req->ret ? NULL : req->data,
+						  req->csum_ok);
+	if (ret) {
+		free_extent_buffer_nocache(eb);
+		return NULL;
+	}
+	if (btrfs_header_level(eb) > 0)
+		extent_buffer_mark_hot(eb);
+	return eb;
+}
+
+static struct tree_prefetch_req *reap_one(struct tree_prefetch *tp)
+{
+	struct tree_prefetch_req *req = NULL;
+
+	pthread_mutex_lock(&tp->lock);
+	while (list_empty(&tp->done) && tp->nr_inflight)
+		pthread_cond_wait(&tp->done_cond, &tp->lock);
+	if (!list_empty(&tp->done)) {
+		req = list_first_entry(&tp->done, struct tree_prefetch_req, list);
+		list_del_init(&req->list);
+	}
+	pthread_mutex_unlock(&tp->lock);
+
+	if (req) {
+		remove_cache_extent(&tp->inflight, &req->cache);
+		tp->nr_inflight--;
+	}
+	return req;
+}
+
+void tree_prefetch_free(struct tree_prefetch *tp)
+{
+	struct tree_prefetch_req *req;
+
+	if (!tp)
+		return;
+
+	pthread_mutex_lock(&tp->lock);
+	tp->stop = true;
+	pthread_cond_broadcast(&tp->queued_cond);
+	pthread_mutex_unlock(&tp->lock);
+	for (int i = 0; i < tp->nr_threads; i++)
+		pthread_join(tp->threads[i], NULL);
+
+	/* Workers drain the queue before exit, no need to go through it */
+	while ((req = reap_one(tp)))
+		free_prefetch_req(tp, req);
+
+	pthread_cond_destroy(&tp->done_cond);
+	pthread_cond_destroy(&tp->queued_cond);
+	pthread_mutex_destroy(&tp->lock);
+	object_slab_release(&tp->data_slab);
+	free(tp->threads);
+	free(tp);
+}
+
+/*
+ * Queue the tree block at @bytenr for reading, blocks already cached or in
+ * flight are skipped.
+ *
+ * Return 0 if the block is queued or not needed, <0 on error.
+ */
+int tree_prefetch_submit(struct tree_prefetch *tp, u64 bytenr, u64 transid)
+{
+	struct btrfs_fs_info *fs_info = tp->fs_info;
+	struct btrfs_bio_stripe stripe;
+	struct tree_prefetch_req *req;
+	struct extent_buffer *eb;
+	struct btrfs_device *device;
+	u64 length = fs_info->nodesize;
+	int mirror;
+	int ret;
+
+	/* Restore reads from the metadump, prefetching does not apply */
+	if (fs_info->on_restoring)
+		return 0;
+	if (lookup_cache_extent(&tp->inflight, bytenr, fs_info->nodesize))
+		return 0;
+	/* Keep the memory of the blocks read ahead bounded */
+	while (tp->nr_inflight >= tp->max_inflight)
+		free_extent_buffer(tree_prefetch_reap(tp));
+	eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
+	if (eb && btrfs_buffer_uptodate(eb, transid, 0)) {
+		free_extent_buffer(eb);
+		return 0;
+	}
+	free_extent_buffer(eb);
+
+	mirror = btrfs_read_mirror(fs_info, bytenr);
+	ret = btrfs_map_block_stripe(fs_info, bytenr, &length, NULL, mirror,
+				     &stripe);
+	if (ret < 0)
+		return ret;
+	device = stripe.dev;
+	if (!device || device->fd < 0 || length < fs_info->nodesize)
+		return 0;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return -ENOMEM;
+	/* The device could be opened with O_DIRECT for zoned mode */
+	req->data = object_slab_alloc(&tp->data_slab);
+	if (!req->data) {
+		free(req);
+		return -ENOMEM;
+	}
+	req->cache.start = bytenr;
+	req->cache.size = fs_info->nodesize;
+	req->transid = transid;
+	req->device = device;
+	req->fd = device->fd;
+	req->mirror = mirror;
+	req->physical = stripe.physical;
+	device->total_ios++;
+	/* Accounted when queued, the worker only tracks the reads in flight */
+	btrfs_device_account_read(device, fs_info->nodesize);
+
+	ret = insert_cache_extent(&tp->inflight, &req->cache);
+	if (ret < 0) {
+		free_prefetch_req(tp, req);
+		return ret;
+	}
+	tp->nr_inflight++;
+
+	pthread_mutex_lock(&tp->lock);
+	queue_req(tp, req);
+	pthread_cond_signal(&tp->queued_cond);
+	pthread_mutex_unlock(&tp->lock);
+	return 0;
+}
+
+/*
+ * Read the tree block at @bytenr in the background only to get it into the
+ * page cache. Nothing is verified or cached here, the following
+ * read_tree_block() does the usual read and checks but doesn't wait for the
+ * device.
+ *
+ * Unlike tree_prefetch_submit() the blocks are not tracked, the caller should
+ * not queue the same block repeatedly.
+ */
+void tree_prefetch_readahead(struct tree_prefetch *tp, u64 bytenr)
+{
+	struct btrfs_fs_info *fs_info = tp->fs_info;
+	struct btrfs_bio_stripe stripe;
+	struct tree_prefetch_req *req;
+	u64 length = fs_info->nodesize;
+
+	/* Zoned devices are opened with O_DIRECT and bypass the page cache */
+	if (fs_info->on_restoring || fs_info->zoned)
+		return;
+	if (btrfs_map_block_stripe(fs_info, bytenr, &length, NULL,
+				   btrfs_read_mirror(fs_info, bytenr), &stripe))
+		return;
+	if (!stripe.dev || stripe.dev->fd < 0 || length < fs_info->nodesize)
+		return;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return;
+	req->device = stripe.dev;
+	req->fd = stripe.dev->fd;
+	req->physical = stripe.physical;
+
+	pthread_mutex_lock(&tp->lock);
+	queue_req(tp, req);
+	pthread_cond_signal(&tp->queued_cond);
+	pthread_mutex_unlock(&tp->lock);
+}
+
+/*
+ * Return the next completed and verified extent buffer, waiting for the
+ * reads in flight if needed. The caller must release the reference.
+ *
+ * Return NULL if there's nothing in flight. Blocks that could not be read are
+ * skipped, reading them again reports the error.
+ */
+struct extent_buffer *tree_prefetch_reap(struct tree_prefetch *tp)
+{
+	struct tree_prefetch_req *req;
+
+	while ((req = reap_one(tp))) {
+		struct extent_buffer *eb;
+
+		eb = complete_prefetch_req(tp, req);
+		free_prefetch_req(tp, req);
+		if (eb)
+			return eb;
+	}
+	return NULL;
+}
+
+/*
+ * Reap completed requests into the extent buffer cache until the block at
+ * @bytenr is no longer in flight, so the following read_tree_block() finds it
+ * cached.
+ */
+void tree_prefetch_wait(struct tree_prefetch *tp, u64 bytenr)
+{
+	struct cache_extent *cache;
+
+	/* Don't wait for the whole queue before it in the sorted order */
+	cache = lookup_cache_extent(&tp->inflight, bytenr, tp->fs_info->nodesize);
+	if (cache) {
+		struct tree_prefetch_req *req;
+
+		req = container_of(cache, struct tree_prefetch_req, cache);
+		pthread_mutex_lock(&tp->lock);
+		if (req->state == PREFETCH_QUEUED) {
+			rb_erase(&req->node, &tp->queued);
+			list_add_tail(&req->list, &tp->urgent);
+			req->state = PREFETCH_URGENT;
+		}
+		pthread_mutex_unlock(&tp->lock);
+	}
+
+	while (lookup_cache_extent(&tp->inflight, bytenr, tp->fs_info->nodesize)) {
+		struct extent_buffer *eb;
+
+		eb = tree_prefetch_reap(tp);
+		if (!eb && !tp->nr_inflight)
+			break;
+		free_extent_buffer(eb);
+	}
+}
+
+unsigned int tree_prefetch_inflight(const struct tree_prefetch *tp)
+{
+	return tp->nr_inflight;
+}
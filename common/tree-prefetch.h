@@ -0,0 +1,59 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_TREE_PREFETCH_H__
+#define __BTRFS_TREE_PREFETCH_H__
+
+#include "kerncompat.h"
+#include <stdbool.h>
+
+struct btrfs_fs_info;
+struct extent_buffer;
+struct tree_prefetch;
+
+#define TREE_PREFETCH_DEFAULT_THREADS		(16)
+#define TREE_PREFETCH_MAX_THREADS		(256)
+/* Blocks queued or read but not reaped yet, per thread */
+#define TREE_PREFETCH_INFLIGHT_PER_THREAD	(64)
+
+/*
+ * Asynchronous tree block prefetch queue.
+ *
+ * Tree blocks are submitted by bytenr and read by a pool of threads, so
+ * there are up to nr_threads reads in flight instead of one blocking read at
+ * a time. The workers do the raw reads and verify the checksums, the blocks
+ * are checked and inserted into the extent buffer cache by the submitting
+ * thread when reaped.
+ *
+ * The queued blocks are read in the order of their physical address, except
+ * for the one tree_prefetch_wait() waits for. At most
+ * TREE_PREFETCH_INFLIGHT_PER_THREAD blocks per thread are in flight, further
+ * submissions reap the completed ones first.
+ *
+ * Blocks queued by tree_prefetch_readahead() are only read into the page
+ * cache and never reaped, for callers that need the exact behaviour of the
+ * synchronous reads.
+ */
+struct tree_prefetch *tree_prefetch_alloc(struct btrfs_fs_info *fs_info,
+					  unsigned int nr_threads);
+void tree_prefetch_free(struct tree_prefetch *tp);
+int tree_prefetch_submit(struct tree_prefetch *tp, u64 bytenr, u64 transid);
+void tree_prefetch_readahead(struct tree_prefetch *tp, u64 bytenr);
+struct extent_buffer *tree_prefetch_reap(struct tree_prefetch *tp);
+void tree_prefetch_wait(struct tree_prefetch *tp, u64 bytenr);
+unsigned int tree_prefetch_inflight(const struct tree_prefetch *tp);
+
+#endif
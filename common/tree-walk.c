@@ -0,0 +1,196 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <errno.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/tree-checker.h"
+#include "kernel-shared/volumes.h"
+#include "common/messages.h"
+#include "common/sort-utils.h"
+#include "common/tree-prefetch.h"
+#include "common/tree-walk.h"
+
+/*
+ * Tree walk in physical order.
+ *
+ * The tree is visited breadth first, all child pointers of one level are
+ * collected, mapped to their device and physical offset and sorted, so each
+ * level is read in one sweep over every device instead of seeking back and
+ * forth in the logical tree order. The reads are queued ahead by a bounded
+ * window of TREE_WALK_WINDOW blocks.
+ *
+ * The memory used is proportional to the number of blocks of the widest level
+ * (about 40 bytes each), i.e. the number of leaves for a full walk.
+ */
+
+struct walk_block {
+	u64 devid;
+	u64 physical;
+	u64 bytenr;
+	u64 transid;
+	u64 owner;
+	int level;
+};
+
+struct walk_level {
+	struct walk_block *blocks;
+	size_t nr;
+	size_t capacity;
+};
+
+static int queue_children(struct walk_level *wl, struct extent_buffer *node)
+{
+	const u32 nritems = btrfs_header_nritems(node);
+
+	if (wl->nr + nritems > wl->capacity) {
+		size_t capacity = max_t(size_t, wl->capacity * 2, wl->nr + nritems);
+		struct walk_block *blocks;
+
+		blocks = realloc(wl->blocks, capacity * sizeof(*blocks));
+		if (!blocks)
+			return -ENOMEM;
+		wl->blocks = blocks;
+		wl->capacity = capacity;
+	}
+	for (u32 i = 0; i < nritems; i++) {
+		struct walk_block *blk = &wl->blocks[wl->nr++];
+
+		blk->bytenr = btrfs_node_blockptr(node, i);
+		blk->transid = btrfs_node_ptr_generation(node, i);
+		blk->owner = btrfs_header_owner(node);
+		blk->level = btrfs_header_level(node) - 1;
+	}
+	return 0;
+}
+
+static void sort_physical(struct btrfs_fs_info *fs_info, struct walk_level *wl)
+{
+	for (size_t i = 0; i < wl->nr; i++) {
+		struct walk_block *blk = &wl->blocks[i];
+		struct btrfs_bio_stripe stripe;
+		u64 length = fs_info->nodesize;
+		int ret;
+
+		ret = btrfs_map_block_stripe(fs_info, blk->bytenr, &length,
+					     NULL, 0, &stripe);
+		if (ret < 0 || !stripe.dev) {
+			/* Unmapped blocks go last, reading them reports it */
+			blk->devid = (u64)-1;
+			blk->physical = blk->bytenr;
+		} else {
+			blk->devid = stripe.dev->devid;
+			blk->physical = stripe.physical;
+		}
+	}
+	radix_sort_u64_pair(wl->blocks, wl->nr, sizeof(struct walk_block),
+			    offsetof(struct walk_block, devid),
+			    offsetof(struct walk_block, physical));
+}
+
+/*
+ * Visit all blocks of the tree starting at @root_node, down to @lowest_level,
+ * calling @fn for each of them (starting with @root_node itself). Blocks of
+ * the same level are visited in physical order, there's no ordering between
+ * siblings in the logical key order.
+ *
+ * Return 0 if all blocks were visited, the negative value returned by @fn, or
+ * -EIO if a block can't be read (unless TREE_WALK_CONTINUE_ON_ERROR is set).
+ */
+int btrfs_walk_tree_physical(struct extent_buffer *root_node, int lowest_level,
+			     unsigned int flags, tree_walk_fn_t fn, void *priv)
+{
+	struct btrfs_fs_info *fs_info = root_node->fs_info;
+	struct walk_level cur = { 0 };
+	struct walk_level next = { 0 };
+	struct tree_prefetch *tp = NULL;
+	int ret;
+
+	ret = fn(root_node, priv);
+	if (ret < 0)
+		return ret;
+	if (ret == TREE_WALK_SKIP_CHILDREN ||
+	    btrfs_header_level(root_node) <= lowest_level)
+		return 0;
+
+	ret = queue_children(&cur, root_node);
+	if (ret < 0)
+		goto out;
+
+	while (cur.nr) {
+		struct walk_level tmp;
+
+		/*
+		 * Small trees are not worth starting the threads, reads are
+		 * also synchronous if they can't be started.
+		 */
+		if (!tp && cur.nr >= TREE_WALK_PREFETCH_MIN)
+			tp = tree_prefetch_alloc(fs_info, 0);
+		sort_physical(fs_info, &cur);
+		for (size_t start = 0; start < cur.nr; start += TREE_WALK_WINDOW) {
+			const size_t end = min_t(size_t, cur.nr,
+						 start + TREE_WALK_WINDOW);
+
+			for (size_t i = start; i < end && tp; i++)
+				tree_prefetch_submit(tp, cur.blocks[i].bytenr,
+						     cur.blocks[i].transid);
+
+			for (size_t i = start; i < end; i++) {
+				struct walk_block *blk = &cur.blocks[i];
+				struct btrfs_tree_parent_check check = {
+					.owner_root = blk->owner,
+					.transid = blk->transid,
+					.level = blk->level,
+				};
+				struct extent_buffer *eb;
+
+				if (tp)
+					tree_prefetch_wait(tp, blk->bytenr);
+				eb = read_tree_block(fs_info, blk->bytenr, &check);
+				if (!extent_buffer_uptodate(eb)) {
+					error("failed to read tree block %llu",
+					      blk->bytenr);
+					if (!IS_ERR(eb))
+						free_extent_buffer(eb);
+					if (flags & TREE_WALK_CONTINUE_ON_ERROR)
+						continue;
+					ret = -EIO;
+					goto out;
+				}
+				ret = fn(eb, priv);
+				if (ret == 0 && blk->level > lowest_level)
+					ret = queue_children(&next, eb);
+				free_extent_buffer(eb);
+				if (ret < 0)
+					goto out;
+			}
+		}
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		next.nr = 0;
+	}
+	ret = 0;
+out:
+	tree_prefetch_free(tp);
+	free(cur.blocks);
+	free(next.blocks);
+	return ret;
+}
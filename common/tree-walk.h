@@ -0,0 +1,45 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_TREE_WALK_H__
+#define __BTRFS_TREE_WALK_H__
+
+#include "kerncompat.h"
+
+struct extent_buffer;
+
+/* Return value of the callback to not descend into the children */
+#define TREE_WALK_SKIP_CHILDREN		(1)
+
+/* Report unreadable blocks and go on instead of failing the walk */
+#define TREE_WALK_CONTINUE_ON_ERROR	(1U << 0)
+
+/* Number of blocks of one level read ahead at a time */
+#define TREE_WALK_WINDOW		(1024)
+/* Minimum number of blocks on a level to start reading ahead */
+#define TREE_WALK_PREFETCH_MIN		(64)
+
+/*
+ * Callback for each tree block visited, the buffer is released after it
+ * returns. Return 0 to continue, TREE_WALK_SKIP_CHILDREN to not visit the
+ * children of this node, or <0 to abort the walk.
+ */
+typedef int (*tree_walk_fn_t)(struct extent_buffer *eb, void *priv);
+
+int btrfs_walk_tree_physical(struct extent_buffer *root_node, int lowest_level,
+			     unsigned int flags, tree_walk_fn_t fn, void *priv);
+
+#endif
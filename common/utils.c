@@ -1046,16 +1046,255 @@ bool bconf_is_dry_run(void)
 	return bconf.dry_run == 1;
 }
 
-/* Returns total size of main memory in bytes, -1UL if error. */
+/*
+ * The memory cgroup of the process, the deepest existing directories of the
+ * paths in /proc/self/cgroup, under the mount points of cgroup v2 and the
+ * memory controller of v1. Empty if not found.
+ */
+static struct {
+	bool init;
+	char v2[PATH_MAX];
+	size_t v2_mount_len;
+	char v1[PATH_MAX];
+	size_t v1_mount_len;
+} memory_cgroup;
+
+static size_t cgroup_find_dir(char *dir, const char *mount, const char *path)
+{
+	const size_t mount_len = strlen(mount);
+	char *slash;
+
+	if (access(mount, F_OK) < 0 ||
+	    snprintf(dir, PATH_MAX, "%s%s", mount, path) >= PATH_MAX) {
+		dir[0] = 0;
+		return 0;
+	}
+	/* With a cgroup namespace the path may be above the mounted root */
+	while (strlen(dir) > mount_len && access(dir, F_OK) < 0) {
+		slash = strrchr(dir, '/');
+		*slash = 0;
+	}
+	if (strlen(dir) < mount_len)
+		strcpy(dir, mount);
+	return mount_len;
+}
+
+static void memory_cgroup_init(void)
+{
+	char line[PATH_MAX + 64];
+	FILE *file;
+
+	memory_cgroup.init = true;
+	file = fopen("/proc/self/cgroup", "r");
+	if (!file)
+		return;
+	while (fgets(line, sizeof(line), file)) {
+		char *controllers;
+		char *path;
+		char *tok;
+		char *saveptr;
+
+		controllers = strchr(line, ':');
+		if (!controllers)
+			continue;
+		controllers++;
+		path = strchr(controllers, ':');
+		if (!path)
+			continue;
+		*path++ = 0;
+		path[strcspn(path, "\n")] = 0;
+
+		if (controllers[0] == 0) {
+			/* Under unified/ on the hybrid setups */
+			memory_cgroup.v2_mount_len = cgroup_find_dir(memory_cgroup.v2,
+					"/sys/fs/cgroup/unified", path);
+			if (!memory_cgroup.v2[0])
+				memory_cgroup.v2_mount_len = cgroup_find_dir(
+						memory_cgroup.v2,
+						"/sys/fs/cgroup", path);
+			continue;
+		}
+		for (tok = strtok_r(controllers, ",", &saveptr); tok;
+		     tok = strtok_r(NULL, ",", &saveptr)) {
+			if (strcmp(tok, "memory") == 0)
+				memory_cgroup.v1_mount_len = cgroup_find_dir(
+						memory_cgroup.v1,
+						"/sys/fs/cgroup/memory", path);
+		}
+	}
+	fclose(file);
+}
+
+/*
+ * Read the value of @key in the file @dir/@name, or its first value if @key
+ * is NULL. A limit of "max" is read as U64_MAX.
+ */
+static bool read_proc_u64(const char *dir, const char *name, const char *key,
+			  u64 *value)
+{
+	char path[PATH_MAX];
+	char line[256];
+	const size_t key_len = key ? strlen(key) : 0;
+	bool found = false;
+	FILE *file;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path))
+		return false;
+	file = fopen(path, "r");
+	if (!file)
+		return false;
+	while (!found && fgets(line, sizeof(line), file)) {
+		const char *str = line;
+
+		if (key) {
+			if (strncmp(line, key, key_len) != 0 ||
+			    (line[key_len] != ' ' && line[key_len] != ':'))
+				continue;
+			str += key_len + 1;
+			while (*str == ' ')
+				str++;
+		}
+		if (strncmp(str, "max", 3) == 0) {
+			*value = U64_MAX;
+			found = true;
+		} else if (isdigit(*str)) {
+			*value = strtoull(str, NULL, 10);
+			found = true;
+		}
+		if (!key)
+			break;
+	}
+	fclose(file);
+	return found;
+}
+
+/*
+ * Return the lowest memory limit of the cgroup at @dir and its parents up to
+ * the mount point, and the memory left below it in @headroom if not NULL. The
+ * usage doesn't count the inactive page cache, which is reclaimed first.
+ */
+static u64 cgroup_memory_limit_at(const char *dir, size_t mount_len,
+				  const char *limit_name, const char *usage_name,
+				  const char *inactive_key, u64 *headroom)
+{
+	char path[PATH_MAX];
+	u64 limit = U64_MAX;
+
+	strcpy(path, dir);
+	while (true) {
+		u64 level_limit;
+		u64 usage;
+		u64 inactive;
+		char *slash;
+
+		if (read_proc_u64(path, limit_name, NULL, &level_limit) &&
+		    level_limit < U64_MAX) {
+			limit = min(limit, level_limit);
+			if (headroom &&
+			    read_proc_u64(path, usage_name, NULL, &usage)) {
+				if (read_proc_u64(path, "memory.stat",
+						  inactive_key, &inactive))
+					usage -= min(usage, inactive);
+				usage = level_limit - min(usage, level_limit);
+				*headroom = min(*headroom, usage);
+			}
+		}
+		if (strlen(path) <= mount_len)
+			break;
+		slash = strrchr(path, '/');
+		*slash = 0;
+	}
+	return limit;
+}
+
+static u64 cgroup_memory_limit(u64 *headroom)
+{
+	u64 limit = U64_MAX;
+
+	if (!memory_cgroup.init)
+		memory_cgroup_init();
+	if (headroom)
+		*headroom = U64_MAX;
+	if (memory_cgroup.v2[0])
+		limit = min(limit, cgroup_memory_limit_at(memory_cgroup.v2,
+					memory_cgroup.v2_mount_len,
+					"memory.max", "memory.current",
+					"inactive_file", headroom));
+	if (memory_cgroup.v1[0])
+		limit = min(limit, cgroup_memory_limit_at(memory_cgroup.v1,
+					memory_cgroup.v1_mount_len,
+					"memory.limit_in_bytes",
+					"memory.usage_in_bytes",
+					"total_inactive_file", headroom));
+	return limit;
+}
+
+/*
+ * Returns total size of main memory in bytes, or the memory limit of the
+ * cgroup of the process if it's lower, -1UL if error.
+ */
 unsigned long total_memory(void)
 {
         struct sysinfo si;
+	u64 total;
 
         if (sysinfo(&si) < 0) {
                 error("can't determine memory size");
                 return -1UL;
         }
-        return si.totalram * si.mem_unit;       /* bytes */
+	total = (u64)si.totalram * si.mem_unit;
+	return min(total, cgroup_memory_limit(NULL));
+}
+
+/*
+ * Return the memory available without swapping or reclaiming the memory of
+ * the cgroup of the process, in bytes.
+ */
+u64 available_memory(void)
+{
+	u64 available = U64_MAX;
+	u64 headroom;
+
+	if (read_proc_u64("/proc", "meminfo", "MemAvailable", &available))
+		available *= SZ_1K;
+	cgroup_memory_limit(&headroom);
+	return min(available, headroom);
+}
+
+/*
+ * Return the share of the time some tasks of the cgroup of the process, or of
+ * the system, were stalled on memory over the last 10 seconds, in hundredths
+ * of a percent. Return -1 if the pressure stall information is not available.
+ */
+int memory_pressure(void)
+{
+	const char *dir = "/proc/pressure";
+	const char *name = "memory";
+	char path[PATH_MAX];
+	char line[256];
+	unsigned int whole;
+	unsigned int frac;
+	int ret = -1;
+	FILE *file;
+
+	if (!memory_cgroup.init)
+		memory_cgroup_init();
+	if (memory_cgroup.v2[0] &&
+	    snprintf(path, sizeof(path), "%s/memory.pressure",
+		     memory_cgroup.v2) < sizeof(path) &&
+	    access(path, R_OK) == 0) {
+		dir = memory_cgroup.v2;
+		name = "memory.pressure";
+	}
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	file = fopen(path, "r");
+	if (!file)
+		return -1;
+	if (fgets(line, sizeof(line), file) &&
+	    sscanf(line, "some avg10=%u.%u", &whole, &frac) == 2)
+		ret = min(whole, 100U) * 100 + min(frac, 99U);
+	fclose(file);
+	return ret;
 }
 
 void print_device_info(struct btrfs_device *device, char *prefix)
@@ -82,6 +82,8 @@ int count_digits(u64 num);
 u64 div_factor(u64 num, int factor);
 
 unsigned long total_memory(void);
+u64 available_memory(void);
+int memory_pressure(void);
 
 void print_device_info(struct btrfs_device *device, char *prefix);
 void print_all_devices(struct list_head *devices);
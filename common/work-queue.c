@@ -0,0 +1,99 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <errno.h>
+#include <sched.h>
+#include "common/work-queue.h"
+
+int work_queue_init(struct work_queue *wq, unsigned int size)
+{
+	unsigned long nr = 1;
+	unsigned long i;
+
+	while (nr < size)
+		nr <<= 1;
+
+	wq->slots = calloc(nr, sizeof(*wq->slots));
+	if (!wq->slots)
+		return -ENOMEM;
+	for (i = 0; i < nr; i++)
+		wq->slots[i].seq = i;
+	wq->mask = nr - 1;
+	wq->head = 0;
+	wq->tail = 0;
+	sem_init(&wq->filled, 0, 0);
+	sem_init(&wq->free, 0, nr);
+	return 0;
+}
+
+void work_queue_release(struct work_queue *wq)
+{
+	sem_destroy(&wq->filled);
+	sem_destroy(&wq->free);
+	free(wq->slots);
+	wq->slots = NULL;
+}
+
+static void sem_wait_nointr(sem_t *sem)
+{
+	while (sem_wait(sem) < 0 && errno == EINTR)
+		;
+}
+
+/*
+ * Wait until the slot is at @seq.  The semaphores guarantee there's a free or
+ * filled slot, but the one at our position may be still being filled or
+ * emptied by the thread of the previous lap, this takes a few instructions.
+ */
+static struct work_queue_slot *wait_slot(struct work_queue *wq,
+					 unsigned long pos, unsigned long seq)
+{
+	struct work_queue_slot *slot = &wq->slots[pos & wq->mask];
+
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+		sched_yield();
+	return slot;
+}
+
+void work_queue_push(struct work_queue *wq, void *item)
+{
+	struct work_queue_slot *slot;
+	unsigned long pos;
+
+	sem_wait_nointr(&wq->free);
+	pos = __atomic_fetch_add(&wq->head, 1, __ATOMIC_RELAXED);
+	slot = wait_slot(wq, pos, pos);
+	slot->item = item;
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	sem_post(&wq->filled);
+}
+
+void *work_queue_pop(struct work_queue *wq)
+{
+	struct work_queue_slot *slot;
+	unsigned long pos;
+	void *item;
+
+	sem_wait_nointr(&wq->filled);
+	pos = __atomic_fetch_add(&wq->tail, 1, __ATOMIC_RELAXED);
+	slot = wait_slot(wq, pos, pos + 1);
+	item = slot->item;
+	__atomic_store_n(&slot->seq, pos + wq->mask + 1, __ATOMIC_RELEASE);
+	sem_post(&wq->free);
+	return item;
+}
@@ -0,0 +1,61 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+#ifndef __BTRFS_WORK_QUEUE_H__
+#define __BTRFS_WORK_QUEUE_H__
+
+#include "kerncompat.h"
+#include <semaphore.h>
+
+/*
+ * Bounded queue of work items passed between threads, any number of threads
+ * can push and pop.
+ *
+ * The items are kept in a ring of slots, each with a sequence number telling
+ * if it's free or filled for the current lap of the ring.  The positions are
+ * taken by an atomic increment, there's no lock shared by the threads.  Two
+ * counting semaphores block the threads popping from an empty queue or
+ * pushing to a full one, they don't take a lock either unless there's a
+ * thread to wake up.
+ *
+ * The items are popped in the order they were pushed, but each thread
+ * finishes its item at its own pace.  NULL can be pushed, e.g. to tell a
+ * worker to exit.
+ */
+struct work_queue_slot {
+	unsigned long seq;
+	void *item;
+};
+
+struct work_queue {
+	struct work_queue_slot *slots;
+	unsigned long mask;
+	/* Next position to push to and to pop from */
+	unsigned long head __attribute__ ((aligned(64)));
+	unsigned long tail __attribute__ ((aligned(64)));
+	sem_t filled;
+	sem_t free;
+};
+
+/* @size is rounded up to a power of two */
+int work_queue_init(struct work_queue *wq, unsigned int size);
+void work_queue_release(struct work_queue *wq);
+/* Wait for a free slot if the queue is full */
+void work_queue_push(struct work_queue *wq, void *item);
+/* Wait for an item if the queue is empty */
+void *work_queue_pop(struct work_queue *wq);
+
+#endif
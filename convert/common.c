@@ -286,7 +286,7 @@ static int setup_temp_root_tree(int fd, struct btrfs_mkfs_config *cfg,
 	UASSERT(root_bytenr < extent_bytenr && extent_bytenr < dev_bytenr &&
 	        dev_bytenr < fs_bytenr && fs_bytenr < csum_bytenr &&
 		csum_bytenr < bgt_bytenr);
-	buf = malloc(sizeof(*buf) + cfg->nodesize);
+	buf = alloc_extent_buffer_inline(cfg->nodesize);
 	if (!buf)
 		return -ENOMEM;
 
@@ -448,7 +448,7 @@ static int setup_temp_chunk_tree(int fd, struct btrfs_mkfs_config *cfg,
 				meta_chunk_start, sys_chunk_start);
 		return -EINVAL;
 	}
-	buf = malloc(sizeof(*buf) + cfg->nodesize);
+	buf = alloc_extent_buffer_inline(cfg->nodesize);
 	if (!buf)
 		return -ENOMEM;
 	ret = setup_temp_extent_buffer(buf, cfg, chunk_bytenr,
@@ -515,7 +515,7 @@ static int setup_temp_dev_tree(int fd, struct btrfs_mkfs_config *cfg,
 				meta_chunk_start, sys_chunk_start);
 		return -EINVAL;
 	}
-	buf = malloc(sizeof(*buf) + cfg->nodesize);
+	buf = alloc_extent_buffer_inline(cfg->nodesize);
 	if (!buf)
 		return -ENOMEM;
 	ret = setup_temp_extent_buffer(buf, cfg, dev_bytenr,
@@ -538,7 +538,7 @@ static int setup_temp_empty_tree(int fd, struct btrfs_mkfs_config *cfg,
 	struct extent_buffer *buf = NULL;
 	int ret;
 
-	buf = malloc(sizeof(*buf) + cfg->nodesize);
+	buf = alloc_extent_buffer_inline(cfg->nodesize);
 	if (!buf)
 		return -ENOMEM;
 	ret = setup_temp_extent_buffer(buf, cfg, root_bytenr, owner);
@@ -622,7 +622,7 @@ static int insert_temp_extent_item(int fd, struct extent_buffer *buf,
 	 * Since we do 1:1 mapping for convert case, we can directly
 	 * read the bytenr from disk
 	 */
-	tmp = malloc(sizeof(*tmp) + cfg->nodesize);
+	tmp = alloc_extent_buffer_inline(cfg->nodesize);
 	if (!tmp)
 		return -ENOMEM;
 	ret = setup_temp_extent_buffer(tmp, cfg, bytenr, ref_root);
@@ -691,7 +691,7 @@ static int setup_temp_extent_tree(int fd, struct btrfs_mkfs_config *cfg,
 	UASSERT(chunk_bytenr < root_bytenr && root_bytenr < extent_bytenr &&
 		extent_bytenr < dev_bytenr && dev_bytenr < fs_bytenr &&
 		fs_bytenr < csum_bytenr && csum_bytenr < bgt_bytenr);
-	extent_buf = malloc(sizeof(*extent_buf) + cfg->nodesize);
+	extent_buf = alloc_extent_buffer_inline(cfg->nodesize);
 	if (!extent_buf) {
 		ret = -ENOMEM;
 		goto out;
@@ -703,7 +703,7 @@ static int setup_temp_extent_tree(int fd, struct btrfs_mkfs_config *cfg,
 		goto out;
 
 	if (is_bgt) {
-		bg_buf = malloc(sizeof(*bg_buf) + cfg->nodesize);
+		bg_buf = alloc_extent_buffer_inline(cfg->nodesize);
 		if (!bg_buf) {
 			ret = -ENOMEM;
 			goto out;
@@ -30,6 +30,9 @@ struct btrfs_mkfs_config;
 
 #define SOURCE_FS_UUID_SIZE	(16)
 
+/* Threads reading the inodes of the source filesystem */
+#define CONVERT_MAX_THREADS	(64)
+
 struct btrfs_convert_context {
 	u32 blocksize;
 	u64 first_data_block;
@@ -37,6 +40,10 @@ struct btrfs_convert_context {
 	u64 inodes_count;
 	u64 free_inodes_count;
 	u64 total_bytes;
+	/*
+	 * Free space for btrfs after the initial calculation, free_space is
+	 * updated later so this is what we really had for the ENOSPC report.
+	 */
 	u64 free_bytes_initial;
 	char *label;
 	u8 fs_uuid[SOURCE_FS_UUID_SIZE];
@@ -51,14 +58,10 @@ struct btrfs_convert_context {
 	/* Free space which is not covered by data_chunks */
 	struct cache_tree free_space;
 
-	/*
-	 * Free space reserved for ENOSPC report, it's just a copy free_space.
-	 * But after initial calculation, free_space_initial is no longer
-	 * updated, so we have a good idea on how much free space we really
-	 * have for btrfs.
-	 */
-	struct cache_tree free_space_initial;
 	void *fs_data;
+
+	/* Threads reading the inodes while they're inserted, if supported */
+	unsigned int nr_threads;
 };
 
 int make_convert_btrfs(int fd, struct btrfs_mkfs_config *cfg,
@@ -95,6 +95,7 @@
 #include <string.h>
 #include <uuid/uuid.h>
 #include "kernel-lib/sizes.h"
+#include "kernel-lib/raid56.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/extent_io.h"
@@ -111,16 +112,19 @@
 #include "common/cpu-utils.h"
 #include "common/messages.h"
 #include "common/task-utils.h"
+#include "common/thread-pool.h"
 #include "common/help.h"
 #include "common/parse-utils.h"
 #include "common/string-utils.h"
 #include "common/fsfeatures.h"
 #include "common/device-scan.h"
+#include "common/device-utils.h"
 #include "common/box.h"
 #include "common/open-utils.h"
 #include "common/extent-tree-utils.h"
 #include "common/root-tree-utils.h"
 #include "common/clear-cache.h"
+#include "common/stats.h"
 #include "common/utils.h"
 #include "cmds/commands.h"
 #include "check/repair.h"
@@ -186,21 +190,24 @@ static inline int convert_check_state(struct btrfs_convert_context *cctx)
 	return cctx->convert_ops->check_state(cctx);
 }
 
+/* Bytes of data read and checksummed at once by csum_disk_extent() */
+#define CSUM_EXTENT_BATCH	(SZ_1M)
+
 static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root,
 			    u64 disk_bytenr, u64 num_bytes)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
-	u32 blocksize = fs_info->sectorsize;
 	u64 offset;
+	u64 read_len;
 	char *buffer;
 	int ret = 0;
 
-	buffer = malloc(blocksize);
+	buffer = malloc(min_t(u64, num_bytes, CSUM_EXTENT_BATCH));
 	if (!buffer)
 		return -ENOMEM;
-	for (offset = 0; offset < num_bytes; offset += blocksize) {
-		u64 read_len = blocksize;
+	for (offset = 0; offset < num_bytes; offset += read_len) {
+		read_len = min_t(u64, num_bytes - offset, CSUM_EXTENT_BATCH);
 
 		ret = read_data_from_disk(fs_info, buffer,
 					  disk_bytenr + offset, &read_len, 0);
@@ -212,8 +219,8 @@ static int csum_disk_extent(struct btrfs_trans_handle *trans,
 			ret = -EIO;
 			break;
 		}
-		ret = btrfs_csum_file_block(trans, disk_bytenr + offset,
-					    BTRFS_EXTENT_CSUM_OBJECTID,
+		ret = btrfs_csum_file_range(trans, disk_bytenr + offset,
+					    read_len, BTRFS_EXTENT_CSUM_OBJECTID,
 					    fs_info->csum_type, buffer);
 		if (ret)
 			break;
@@ -222,12 +229,265 @@ static int csum_disk_extent(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+/* Bytes read and checksummed at once by each thread of the csum reader */
+#define CSUM_READER_CHUNK	(SZ_4M)
+
+struct csum_chunk {
+	u64 start;
+	u64 len;
+	u8 *csums;
+	int ret;
+	bool done;
+};
+
+/*
+ * Read the used space of the source filesystem ahead of the image creation
+ * and calculate the data checksums by threads.
+ *
+ * The image file maps the source data at the same logical address as on the
+ * device, so the chunks are read from the device directly in the increasing
+ * order of the address, which is the order the image file extents are
+ * created and consume the checksums.
+ */
+struct csum_reader {
+	struct btrfs_fs_info *fs_info;
+	int fd;
+	struct cache_tree *used;
+
+	pthread_mutex_t mutex;
+	/* Signaled when a chunk is done */
+	pthread_cond_t done_cond;
+	/* Signaled when a chunk is consumed or the reader stops */
+	pthread_cond_t space_cond;
+	/* Ring of the chunks in flight, indexed by their sequence number */
+	struct csum_chunk *chunks;
+	unsigned int nr_chunks;
+	u64 head_seq;
+	u64 next_seq;
+	/* Start of the next chunk to be claimed, in the used extent @cur */
+	struct cache_extent *cur;
+	u64 cur_offset;
+	bool stop;
+
+	pthread_t *threads;
+	unsigned int nr_threads;
+};
+
+static void *csum_reader_worker(void *arg)
+{
+	struct csum_reader *reader = arg;
+	struct btrfs_fs_info *fs_info = reader->fs_info;
+	char *buf;
+
+	buf = malloc(CSUM_READER_CHUNK);
+
+	pthread_mutex_lock(&reader->mutex);
+	while (!reader->stop && reader->cur) {
+		struct csum_chunk *chunk;
+		struct cache_extent *cache = reader->cur;
+		u64 offset = 0;
+
+		if (reader->next_seq >= reader->head_seq + reader->nr_chunks) {
+			pthread_cond_wait(&reader->space_cond, &reader->mutex);
+			continue;
+		}
+		chunk = &reader->chunks[reader->next_seq % reader->nr_chunks];
+		reader->next_seq++;
+		chunk->start = reader->cur_offset;
+		chunk->len = min_t(u64, cache->start + cache->size - chunk->start,
+				   CSUM_READER_CHUNK);
+		chunk->ret = 0;
+		chunk->done = false;
+		reader->cur_offset += chunk->len;
+		if (reader->cur_offset >= cache->start + cache->size) {
+			reader->cur = next_cache_extent(cache);
+			if (reader->cur)
+				reader->cur_offset = reader->cur->start;
+		}
+		pthread_mutex_unlock(&reader->mutex);
+
+		if (!buf)
+			chunk->ret = -ENOMEM;
+		while (!chunk->ret && offset < chunk->len) {
+			ssize_t ret;
+
+			ret = btrfs_pread(reader->fd, buf + offset,
+					  chunk->len - offset,
+					  chunk->start + offset, false);
+			if (ret < 0)
+				chunk->ret = -errno;
+			else if (ret == 0)
+				chunk->ret = -EIO;
+			else
+				offset += ret;
+		}
+		if (!chunk->ret)
+			btrfs_csum_data_batch(fs_info->csum_type, (const u8 *)buf,
+					      chunk->csums, fs_info->sectorsize,
+					      chunk->len / fs_info->sectorsize);
+
+		pthread_mutex_lock(&reader->mutex);
+		chunk->done = true;
+		pthread_cond_broadcast(&reader->done_cond);
+	}
+	pthread_mutex_unlock(&reader->mutex);
+	free(buf);
+	return NULL;
+}
+
+static void csum_reader_free(struct csum_reader *reader)
+{
+	if (!reader)
+		return;
+	pthread_mutex_lock(&reader->mutex);
+	reader->stop = true;
+	pthread_cond_broadcast(&reader->space_cond);
+	pthread_mutex_unlock(&reader->mutex);
+	for (unsigned int i = 0; i < reader->nr_threads; i++)
+		pthread_join(reader->threads[i], NULL);
+	for (unsigned int i = 0; i < reader->nr_chunks; i++)
+		free(reader->chunks[i].csums);
+	free(reader->chunks);
+	free(reader->threads);
+	pthread_cond_destroy(&reader->space_cond);
+	pthread_cond_destroy(&reader->done_cond);
+	pthread_mutex_destroy(&reader->mutex);
+	free(reader);
+}
+
+/*
+ * Start @nr_threads reading the extents of @used from @fd, NULL if there
+ * are no threads or they can't be used, the checksums are then calculated by
+ * csum_disk_extent() as the extents are created.
+ */
+static struct csum_reader *csum_reader_start(struct btrfs_fs_info *fs_info,
+					     int fd, struct cache_tree *used,
+					     unsigned int nr_threads)
+{
+	struct csum_reader *reader;
+	const size_t csums_size = CSUM_READER_CHUNK / fs_info->sectorsize *
+				  fs_info->csum_size;
+
+	if (!nr_threads || !first_cache_extent(used))
+		return NULL;
+	/* Same as for the data checksums of btrfs check */
+	if (!CRYPTO_HASH_THREAD_SAFE &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_CRC32 &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_XXHASH)
+		return NULL;
+
+	reader = calloc(1, sizeof(*reader));
+	if (!reader)
+		return NULL;
+	reader->fs_info = fs_info;
+	reader->fd = fd;
+	reader->used = used;
+	reader->cur = first_cache_extent(used);
+	reader->cur_offset = reader->cur->start;
+	pthread_mutex_init(&reader->mutex, NULL);
+	pthread_cond_init(&reader->done_cond, NULL);
+	pthread_cond_init(&reader->space_cond, NULL);
+
+	reader->nr_chunks = nr_threads * 2;
+	reader->chunks = calloc(reader->nr_chunks, sizeof(*reader->chunks));
+	reader->threads = calloc(nr_threads, sizeof(*reader->threads));
+	if (!reader->chunks || !reader->threads)
+		goto fail;
+	for (unsigned int i = 0; i < reader->nr_chunks; i++) {
+		reader->chunks[i].csums = malloc(csums_size);
+		if (!reader->chunks[i].csums)
+			goto fail;
+	}
+	for (; reader->nr_threads < nr_threads; reader->nr_threads++) {
+		if (pthread_create(&reader->threads[reader->nr_threads], NULL,
+				   csum_reader_worker, reader))
+			break;
+	}
+	if (reader->nr_threads)
+		return reader;
+fail:
+	csum_reader_free(reader);
+	return NULL;
+}
+
+/*
+ * Insert the checksums of [@disk_bytenr, @disk_bytenr + @num_bytes) from the
+ * chunks of @reader, the chunks before the range are skipped, the parts not
+ * covered by the chunks are checksummed by csum_disk_extent().
+ */
+static int csum_reader_insert(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root,
+			      struct csum_reader *reader,
+			      u64 disk_bytenr, u64 num_bytes)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	const u64 end = disk_bytenr + num_bytes;
+	u64 cur = disk_bytenr;
+	int ret = 0;
+
+	while (cur < end) {
+		struct csum_chunk *chunk = NULL;
+		u64 len;
+
+		pthread_mutex_lock(&reader->mutex);
+		while (reader->head_seq < reader->next_seq || reader->cur) {
+			if (reader->head_seq < reader->next_seq) {
+				chunk = &reader->chunks[reader->head_seq %
+							reader->nr_chunks];
+				if (chunk->done)
+					break;
+				chunk = NULL;
+			}
+			pthread_cond_wait(&reader->done_cond, &reader->mutex);
+		}
+		pthread_mutex_unlock(&reader->mutex);
+
+		/* No more chunks */
+		if (!chunk)
+			return csum_disk_extent(trans, root, cur, end - cur);
+		if (chunk->ret) {
+			errno = -chunk->ret;
+			error("failed to read bytenr %llu len %llu: %m",
+			      chunk->start, chunk->len);
+			return chunk->ret;
+		}
+		if (chunk->start > cur) {
+			len = min(chunk->start, end) - cur;
+			ret = csum_disk_extent(trans, root, cur, len);
+			if (ret < 0)
+				return ret;
+			cur += len;
+			continue;
+		}
+		if (chunk->start + chunk->len > cur) {
+			const u64 index = (cur - chunk->start) / fs_info->sectorsize;
+
+			len = min(chunk->start + chunk->len, end) - cur;
+			ret = btrfs_insert_data_csums(trans, cur, len,
+					BTRFS_EXTENT_CSUM_OBJECTID,
+					fs_info->csum_type,
+					chunk->csums + index * fs_info->csum_size);
+			if (ret < 0)
+				return ret;
+			cur += len;
+		}
+		if (chunk->start + chunk->len <= cur) {
+			pthread_mutex_lock(&reader->mutex);
+			reader->head_seq++;
+			pthread_cond_broadcast(&reader->space_cond);
+			pthread_mutex_unlock(&reader->mutex);
+		}
+	}
+	return ret;
+}
+
 static int create_image_file_range(struct btrfs_trans_handle *trans,
 				      struct btrfs_root *root,
 				      struct cache_tree *used,
 				      struct btrfs_inode_item *inode,
 				      u64 ino, u64 bytenr, u64 *ret_len,
-				      u32 convert_flags)
+				      u32 convert_flags,
+				      struct csum_reader *csum_reader)
 {
 	struct cache_extent *cache;
 	struct btrfs_block_group *bg_cache;
@@ -343,7 +603,11 @@ static int create_image_file_range(struct btrfs_trans_handle *trans,
 		return ret;
 
 	if (datacsum) {
-		ret = csum_disk_extent(trans, root, bytenr, len);
+		if (csum_reader)
+			ret = csum_reader_insert(trans, root, csum_reader,
+						 bytenr, len);
+		else
+			ret = csum_disk_extent(trans, root, bytenr, len);
 		if (ret < 0) {
 			errno = -ret;
 			error(
@@ -414,7 +678,7 @@ static int migrate_one_reserved_range(struct btrfs_trans_handle *trans,
 			break;
 		}
 
-		ret = pread(fd, buf, cur_len, cur_off);
+		ret = btrfs_pread(fd, buf, cur_len, cur_off, false);
 		if (ret < cur_len) {
 			ret = (ret < 0 ? ret : -EIO);
 			free(buf);
@@ -752,22 +1016,19 @@ out:
 	return ret;
 }
 
-static int copy_free_space_tree(struct btrfs_convert_context *cctx)
+/*
+ * Sum the free space left for btrfs once the used space is known, only to be
+ * reported, the free space of the new filesystem is found from its extent tree
+ * when it's finalized.
+ */
+static void count_free_space(struct btrfs_convert_context *cctx)
 {
-	struct cache_tree *src = &cctx->free_space;
-	struct cache_tree *dst = &cctx->free_space_initial;
 	struct cache_extent *cache;
-	int ret = 0;
 
-	for (cache = search_cache_extent(src, 0);
+	for (cache = first_cache_extent(&cctx->free_space);
 	     cache;
-	     cache = next_cache_extent(cache)) {
-		ret = add_merge_cache_extent(dst, cache->start, cache->size);
-		if (ret < 0)
-			return ret;
+	     cache = next_cache_extent(cache))
 		cctx->free_bytes_initial += cache->size;
-	}
-	return ret;
 }
 
 /*
@@ -786,7 +1047,8 @@ static int convert_read_used_space(struct btrfs_convert_context *cctx)
 	if (ret < 0)
 		return ret;
 
-	return copy_free_space_tree(cctx);
+	count_free_space(cctx);
+	return 0;
 }
 
 /*
@@ -806,6 +1068,7 @@ static int create_image(struct btrfs_root *root,
 	struct btrfs_key key;
 	struct cache_extent *cache;
 	struct cache_tree used_tmp;
+	struct csum_reader *csum_reader = NULL;
 	u64 cur;
 	u64 ino;
 	u64 flags = BTRFS_INODE_READONLY;
@@ -878,6 +1141,9 @@ static int create_image(struct btrfs_root *root,
 	ret = wipe_reserved_ranges(&used_tmp, 0, 0);
 	if (ret < 0)
 		goto out;
+	if (convert_flags & CONVERT_FLAG_DATACSUM)
+		csum_reader = csum_reader_start(root->fs_info, fd, &used_tmp,
+						cctx->nr_threads);
 
 	/*
 	 * Start from 1M, as 0~1M is reserved, and create_image_file_range()
@@ -889,7 +1155,7 @@ static int create_image(struct btrfs_root *root,
 
 		ret = create_image_file_range(trans, root, &used_tmp,
 						&buf, ino, cur, &len,
-						convert_flags);
+						convert_flags, csum_reader);
 		if (ret < 0)
 			goto out;
 		cur += len;
@@ -911,6 +1177,7 @@ static int create_image(struct btrfs_root *root,
 			btrfs_item_ptr_offset(path.nodes[0], path.slots[0]),
 			sizeof(buf));
 out:
+	csum_reader_free(csum_reader);
 	free_extent_cache_tree(&used_tmp);
 	btrfs_release_path(&path);
 	btrfs_commit_transaction(trans, root);
@@ -1170,7 +1437,7 @@ abort:
 static int do_convert(const char *devname, u32 convert_flags, u32 nodesize,
 		const char *fslabel, int progress,
 		struct btrfs_mkfs_features *features, u16 csum_type,
-		char fsid[BTRFS_UUID_UNPARSED_SIZE])
+		char fsid[BTRFS_UUID_UNPARSED_SIZE], unsigned int nr_threads)
 {
 	int ret;
 	int fd = -1;
@@ -1188,6 +1455,7 @@ static int do_convert(const char *devname, u32 convert_flags, u32 nodesize,
 
 	memset(&mkfs_cfg, 0, sizeof(mkfs_cfg));
 	init_convert_context(&cctx);
+	cctx.nr_threads = nr_threads;
 	ret = convert_open_fs(devname, &cctx);
 	if (ret)
 		goto fail;
@@ -1277,6 +1545,7 @@ static int do_convert(const char *devname, u32 convert_flags, u32 nodesize,
 	mkfs_cfg.leaf_data_size = __BTRFS_LEAF_DATA_SIZE(nodesize);
 
 	printf("Create initial btrfs filesystem\n");
+	stats_phase("creating filesystem");
 	ret = make_convert_btrfs(fd, &mkfs_cfg, &cctx);
 	if (ret) {
 		errno = -ret;
@@ -1297,6 +1566,7 @@ static int do_convert(const char *devname, u32 convert_flags, u32 nodesize,
 	}
 
 	printf("Create %s image file\n", cctx.convert_ops->name);
+	stats_phase("creating image file");
 	snprintf(subvol_name, sizeof(subvol_name), "%s_saved",
 			cctx.convert_ops->name);
 	key.objectid = CONV_IMAGE_SUBVOL_OBJECTID;
@@ -1316,6 +1586,7 @@ static int do_convert(const char *devname, u32 convert_flags, u32 nodesize,
 	}
 
 	printf("Create btrfs metadata\n");
+	stats_phase("copying inodes");
 	ret = pthread_mutex_init(&ctx.mutex, NULL);
 	if (ret) {
 		error("failed to initialize mutex: %d", ret);
@@ -1372,6 +1643,7 @@ static int do_convert(const char *devname, u32 convert_flags, u32 nodesize,
 	 * If this step succeed, we get a mountable btrfs. Otherwise
 	 * the source fs is left unchanged.
 	 */
+	stats_phase("finalizing");
 	ret = migrate_super_block(fd, mkfs_cfg.super_bytenr);
 	if (ret) {
 		error("unable to migrate super block: %d", ret);
@@ -1426,12 +1698,165 @@ fail:
 	return -1;
 }
 
+/*
+ * Read the data checksums of the @nr sectors at @logical into @csums, -ENOENT
+ * if any is missing.
+ */
+static int read_data_csums(struct btrfs_fs_info *fs_info, u64 logical, u64 nr,
+			   u8 *csums)
+{
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+
+	while (nr) {
+		struct btrfs_path path = { 0 };
+		struct btrfs_csum_item *item;
+		struct btrfs_key key;
+		u64 item_end;
+		u64 count;
+
+		item = btrfs_lookup_csum(NULL, btrfs_csum_root(fs_info, logical),
+					 &path, logical,
+					 BTRFS_EXTENT_CSUM_OBJECTID,
+					 fs_info->csum_type, 0);
+		if (IS_ERR(item)) {
+			btrfs_release_path(&path);
+			return PTR_ERR(item) == -EFBIG ? -ENOENT : PTR_ERR(item);
+		}
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		item_end = key.offset + (u64)btrfs_item_size(path.nodes[0],
+				path.slots[0]) / csum_size * sectorsize;
+		count = min(nr, (item_end - logical) / sectorsize);
+		read_extent_buffer(path.nodes[0], csums, (unsigned long)item,
+				   count * csum_size);
+		btrfs_release_path(&path);
+
+		logical += count * sectorsize;
+		csums += count * csum_size;
+		nr -= count;
+	}
+	return 0;
+}
+
+/*
+ * Verify the @data of the image file in the reserved @range against the data
+ * checksums of the file extents covering it, before it's written back.
+ */
+static int verify_reserved_range(struct btrfs_root *root, u64 ino,
+				 const struct simple_range *range,
+				 const char *data)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	u8 *expected;
+	u8 *found;
+	int ret;
+
+	expected = malloc(range->len / sectorsize * csum_size);
+	found = malloc(range->len / sectorsize * csum_size);
+	if (!expected || !found) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	key.objectid = ino;
+	key.type = BTRFS_EXTENT_DATA_KEY;
+	key.offset = range->start;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	/* The extent starting before the range */
+	if (ret > 0) {
+		ret = btrfs_previous_item(root, &path, ino,
+					  BTRFS_EXTENT_DATA_KEY);
+		if (ret < 0)
+			goto out;
+		if (ret > 0) {
+			btrfs_release_path(&path);
+			ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+			if (ret < 0)
+				goto out;
+		}
+	}
+
+	while (1) {
+		struct extent_buffer *leaf = path.nodes[0];
+		struct btrfs_file_extent_item *fi;
+		u64 disk_bytenr;
+		u64 start;
+		u64 end;
+		u64 nr;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf))
+			goto next;
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != ino || key.type != BTRFS_EXTENT_DATA_KEY ||
+		    key.offset >= range_end(range))
+			break;
+		fi = btrfs_item_ptr(leaf, path.slots[0],
+				    struct btrfs_file_extent_item);
+		disk_bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+		start = max(key.offset, range->start);
+		end = min(key.offset + btrfs_file_extent_num_bytes(leaf, fi),
+			  range_end(range));
+		/* Holes have no checksums */
+		if (disk_bytenr == 0 || end <= start)
+			goto next;
+
+		nr = (end - start) / sectorsize;
+		disk_bytenr += btrfs_file_extent_offset(leaf, fi) +
+			       start - key.offset;
+		ret = read_data_csums(fs_info, disk_bytenr, nr, expected);
+		if (ret == -ENOENT) {
+			warning("no data checksums for bytenr %llu len %llu, not verified",
+				disk_bytenr, nr * sectorsize);
+			ret = 0;
+			goto next;
+		}
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to read data checksums of bytenr %llu len %llu: %m",
+			      disk_bytenr, nr * sectorsize);
+			goto out;
+		}
+		btrfs_csum_data_batch(fs_info->csum_type,
+				      (const u8 *)data + start - range->start,
+				      found, sectorsize, nr);
+		for (u64 i = 0; i < nr; i++) {
+			if (memcmp(expected + i * csum_size,
+				   found + i * csum_size, csum_size) == 0)
+				continue;
+			error("checksum mismatch of the image at offset %llu bytenr %llu",
+			      start + i * sectorsize, disk_bytenr + i * sectorsize);
+			ret = -EIO;
+			goto out;
+		}
+next:
+		ret = btrfs_next_item(root, &path);
+		if (ret) {
+			if (ret > 0)
+				ret = 0;
+			break;
+		}
+	}
+out:
+	btrfs_release_path(&path);
+	free(expected);
+	free(found);
+	return ret;
+}
+
 /*
  * Read out data of convert image which is in btrfs reserved ranges so we can
- * use them to overwrite the ranges during rollback.
+ * use them to overwrite the ranges during rollback.  With @datasum the data
+ * is verified against its checksums.
  */
 static int read_reserved_ranges(struct btrfs_root *root, u64 ino,
-				u64 total_bytes, char *reserved_ranges[])
+				u64 total_bytes, bool datasum,
+				char *reserved_ranges[])
 {
 	int i;
 	int ret = 0;
@@ -1452,6 +1877,12 @@ static int read_reserved_ranges(struct btrfs_root *root, u64 ino,
 			break;
 		}
 		ret = 0;
+		if (datasum) {
+			ret = verify_reserved_range(root, ino, range,
+						    reserved_ranges[i]);
+			if (ret < 0)
+				break;
+		}
 	}
 	return ret;
 }
@@ -1508,7 +1939,8 @@ out:
  * that case we will read them out for later use.
  */
 static int check_convert_image(struct btrfs_root *image_root, u64 ino,
-			       u64 total_size, char *reserved_ranges[])
+			       u64 total_size, bool datasum,
+			       char *reserved_ranges[])
 {
 	struct btrfs_key key;
 	struct btrfs_path path = { 0 };
@@ -1632,11 +2064,46 @@ next:
 	}
 
 	/* So far so good, read old data located in btrfs reserved ranges */
-	ret = read_reserved_ranges(image_root, ino, total_size,
+	ret = read_reserved_ranges(image_root, ino, total_size, datasum,
 				   reserved_ranges);
 	return ret;
 }
 
+/* Compare the written reserved ranges with the data of the image */
+static int verify_written_ranges(int fd, u64 fsize, char *reserved_ranges[])
+{
+	char *buf;
+	int ret = 0;
+
+	buf = malloc(btrfs_reserved_ranges[0].len);
+	if (!buf)
+		return -ENOMEM;
+	for (int i = 0; i < ARRAY_SIZE(btrfs_reserved_ranges); i++) {
+		const struct simple_range *range = &btrfs_reserved_ranges[i];
+		ssize_t size;
+
+		if (range_end(range) >= fsize)
+			continue;
+		UASSERT(range->len <= btrfs_reserved_ranges[0].len);
+		size = pread(fd, buf, range->len, range->start);
+		if (size < 0) {
+			ret = -errno;
+			error("failed to read back range [%llu, %llu): %m",
+			      range->start, range_end(range));
+			break;
+		}
+		if (size < range->len ||
+		    memcmp(buf, reserved_ranges[i], range->len) != 0) {
+			error("range [%llu, %llu) was not written correctly",
+			      range->start, range_end(range));
+			ret = -EIO;
+			break;
+		}
+	}
+	free(buf);
+	return ret;
+}
+
 /*
  * btrfs rollback is just reverted convert:
  * |<---------------Btrfs fs------------------------------>|
@@ -1688,6 +2155,7 @@ static int do_rollback(const char *devname)
 	u64 fsize;
 	u64 root_dir;
 	u64 ino;
+	bool datasum;
 	int fd = -1;
 	int ret;
 	int i;
@@ -1802,10 +2270,15 @@ static int do_rollback(const char *devname)
 	inode_item = btrfs_item_ptr(path.nodes[0], path.slots[0],
 				    struct btrfs_inode_item);
 	total_bytes = btrfs_inode_size(path.nodes[0], inode_item);
+	datasum = !(btrfs_inode_flags(path.nodes[0], inode_item) &
+		    BTRFS_INODE_NODATASUM);
 	btrfs_release_path(&path);
 
 	/* Check if we can rollback the image */
-	ret = check_convert_image(image_root, ino, total_bytes, reserved_ranges);
+	printf("  Checking image:  %s\n", datasum ? "with data checksums" :
+						   "without data checksums");
+	ret = check_convert_image(image_root, ino, total_bytes, datasum,
+				  reserved_ranges);
 	if (ret < 0) {
 		error("old fs image can't be rolled back");
 		goto close_fs;
@@ -1844,8 +2317,18 @@ close_fs:
 			goto free_mem;
 		}
 		ret = 0;
+		printf("  Restored range:  [%llu, %llu)\n", range->start,
+		       range->start + real_size);
 	}
 
+	/* Read the ranges back, the old fs must not be left half restored */
+	if (fsync(fd) < 0) {
+		ret = -errno;
+		error("failed to sync %s: %m", devname);
+		goto free_mem;
+	}
+	ret = verify_written_ranges(fd, fsize, reserved_ranges);
+
 free_mem:
 	for (i = 0; i < ARRAY_SIZE(btrfs_reserved_ranges); i++)
 		free(reserved_ranges[i]);
@@ -1874,8 +2357,10 @@ static const char * const convert_usage[] = {
 	OPTLINE("-p|--progress", "show converting progress (default)"),
 	OPTLINE("-O|--features LIST", "comma separated list of filesystem features"),
 	OPTLINE("--no-progress", "show only overview, not the detailed progress"),
+	OPTLINE("--threads N", "number of threads reading the inodes of ext2/3/4 or the tree of reiserfs and checksumming the data, default is the number of online CPUs up to 16, 0 does it in the main thread"),
 	"",
 	"General:",
+	OPTLINE("--stats[=json]", "print I/O, cache and memory statistics to stderr on exit"),
 	OPTLINE("--version", "print the btrfs-convert version, builtin features and exit"),
 	OPTLINE("--help", "print this help and exit"),
 	"",
@@ -1917,15 +2402,17 @@ int BOX_MAIN(convert)(int argc, char *argv[])
 	u16 csum_type = BTRFS_CSUM_TYPE_CRC32;
 	u32 copy_fsid = 0;
 	char fsid[BTRFS_UUID_UNPARSED_SIZE] = {0};
+	unsigned int nr_threads = (unsigned int)-1;
 
 	cpu_detect_flags();
 	hash_init_accel();
+	raid6_init_accel();
 	btrfs_config_init();
 	btrfs_assert_feature_buf_size();
 
 	while(1) {
 		enum { GETOPT_VAL_NO_PROGRESS = GETOPT_VAL_FIRST, GETOPT_VAL_CHECKSUM,
-			GETOPT_VAL_UUID, GETOPT_VAL_VERSION };
+			GETOPT_VAL_UUID, GETOPT_VAL_VERSION, GETOPT_VAL_THREADS };
 		static const struct option long_options[] = {
 			{ "no-progress", no_argument, NULL,
 				GETOPT_VAL_NO_PROGRESS },
@@ -1943,6 +2430,8 @@ int BOX_MAIN(convert)(int argc, char *argv[])
 			{ "copy-label", no_argument, NULL, 'L' },
 			{ "uuid", required_argument, NULL, GETOPT_VAL_UUID },
 			{ "nodesize", required_argument, NULL, 'N' },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "stats", optional_argument, NULL, GETOPT_VAL_STATS },
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP },
 			{ "version", no_argument, NULL, GETOPT_VAL_VERSION },
 			{ NULL, 0, NULL, 0 }
@@ -2036,16 +2525,38 @@ int BOX_MAIN(convert)(int argc, char *argv[])
 					strncpy_null(fsid, optarg, sizeof(fsid));
 				}
 				break;
+			case GETOPT_VAL_THREADS:
+			{
+				u64 tmp = arg_strtou64(optarg);
+
+				if (tmp > CONVERT_MAX_THREADS) {
+					error("number of threads out of range: %llu > %u",
+					      tmp, CONVERT_MAX_THREADS);
+					return 1;
+				}
+				nr_threads = tmp;
+				break;
+			}
 			case GETOPT_VAL_VERSION:
 				help_builtin_features("btrfs-convert, part of ");
 				ret = 0;
 				goto success;
+			case GETOPT_VAL_STATS:
+				if (stats_enable(optarg)) {
+					error("invalid stats format: %s", optarg);
+					return 1;
+				}
+				break;
 			case GETOPT_VAL_HELP:
 			default:
 				usage(&convert_cmd, c != GETOPT_VAL_HELP);
 		}
 	}
 
+	/* More threads than this would only wait for the inserts */
+	if (nr_threads == (unsigned int)-1)
+		nr_threads = thread_pool_default_threads(16);
+
 	printf("btrfs-convert from %s\n\n", PACKAGE_STRING);
 
 	set_argv0(argv);
@@ -2087,7 +2598,7 @@ int BOX_MAIN(convert)(int argc, char *argv[])
 		cf |= copy_fsid;
 		cf |= copylabel;
 		ret = do_convert(file, cf, nodesize, fslabel, progress, &features,
-				 csum_type, fsid);
+				 csum_type, fsid, nr_threads);
 	}
 	if (ret)
 		return 1;
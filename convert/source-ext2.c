@@ -20,6 +20,8 @@
 #include <sys/stat.h>
 #include <linux/limits.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <pthread.h>
 #include <limits.h>
 #include <stdio.h>
@@ -35,6 +37,67 @@
 #include "convert/source-fs.h"
 #include "convert/source-ext2.h"
 
+/* Size of the buffer of the inode scans, instead of 8 blocks by default */
+#define EXT2_INODE_SCAN_BUFFER		(SZ_1M)
+
+/*
+ * Start reading @nr blocks from @block into the page cache of the device,
+ * libext2fs reads them later through its own descriptor without waiting.
+ */
+static void ext2_readahead_blocks(int fd, ext2_filsys fs, blk64_t block,
+				  blk64_t nr)
+{
+	if (fd < 0 || !block || !nr)
+		return;
+	posix_fadvise(fd, block * fs->blocksize, nr * fs->blocksize,
+		      POSIX_FADV_WILLNEED);
+}
+
+static bool ext2_group_inode_uninit(ext2_filsys fs, u32 group)
+{
+	return ext2fs_has_group_desc_csum(fs) &&
+	       ext2fs_bg_flags_test(fs, group, EXT2_BG_INODE_UNINIT);
+}
+
+/*
+ * Read ahead the bitmaps of all groups at once, they're read one by one by
+ * ext2fs_read_*_bitmap().  Libext2fs doesn't read the uninitialized ones.
+ */
+static void ext2_readahead_bitmaps(ext2_filsys fs, const char *name)
+{
+	bool csum = ext2fs_has_group_desc_csum(fs);
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	if (fd < 0)
+		return;
+	for (u32 group = 0; group < fs->group_desc_count; group++) {
+		if (!csum ||
+		    !ext2fs_bg_flags_test(fs, group, EXT2_BG_BLOCK_UNINIT))
+			ext2_readahead_blocks(fd, fs,
+					ext2fs_block_bitmap_loc(fs, group), 1);
+		if (!ext2_group_inode_uninit(fs, group))
+			ext2_readahead_blocks(fd, fs,
+					ext2fs_inode_bitmap_loc(fs, group), 1);
+	}
+	close(fd);
+}
+
+/* Read ahead the part of the inode table of @group that has been used */
+static void ext2_readahead_inode_table(int fd, ext2_filsys fs, u32 group)
+{
+	u64 nr_inodes = EXT2_INODES_PER_GROUP(fs->super);
+
+	if (ext2_group_inode_uninit(fs, group))
+		return;
+	if (ext2fs_has_group_desc_csum(fs))
+		nr_inodes -= min_t(u64, nr_inodes,
+				   ext2fs_bg_itable_unused(fs, group));
+	ext2_readahead_blocks(fd, fs, ext2fs_inode_table_loc(fs, group),
+			DIV_ROUND_UP(nr_inodes * EXT2_INODE_SIZE(fs->super),
+				     fs->blocksize));
+}
+
 /*
  * Open Ext2fs in readonly mode, read block allocation bitmap and
  * inode bitmap into memory.
@@ -71,6 +134,7 @@ static int ext2_open_fs(struct btrfs_convert_context *cctx, const char *name)
 		      ro_feature & ~EXT2_LIB_FEATURE_COMPAT_SUPP);
 		goto fail;
 	}
+	ext2_readahead_bitmaps(ext2_fs, name);
 	ret = ext2fs_read_inode_bitmap(ext2_fs);
 	if (ret) {
 		error("ext2fs_read_inode_bitmap: %s", error_message(ret));
@@ -118,26 +182,40 @@ static int __ext2_add_one_block(ext2_filsys fs, char *bitmap,
 				unsigned long group_nr, struct cache_tree *used)
 {
 	unsigned long offset;
+	unsigned long nr;
 	unsigned i;
 	int ret = 0;
 
 	offset = fs->super->s_first_data_block;
 	offset /= EXT2FS_CLUSTER_RATIO(fs);
 	offset += group_nr * EXT2_CLUSTERS_PER_GROUP(fs->super);
-	for (i = 0; i < EXT2_CLUSTERS_PER_GROUP(fs->super); i++) {
-		if ((i + offset) >= ext2fs_blocks_count(fs->super))
-			break;
-
-		if (ext2fs_test_bit(i, bitmap)) {
-			u64 start;
+	nr = EXT2_CLUSTERS_PER_GROUP(fs->super);
+	if (offset + nr > ext2fs_blocks_count(fs->super))
+		nr = ext2fs_blocks_count(fs->super) - offset;
+	for (i = 0; i < nr; i++) {
+		u64 start;
+		u64 len = fs->blocksize;
+
+		/* Whole bytes of free clusters */
+		if (i % 8 == 0 && bitmap[i / 8] == 0) {
+			i += 7;
+			continue;
+		}
+		if (!ext2fs_test_bit(i, bitmap))
+			continue;
 
-			start = (i + offset) * EXT2FS_CLUSTER_RATIO(fs);
-			start *= fs->blocksize;
-			ret = add_merge_cache_extent(used, start,
-						     fs->blocksize);
-			if (ret < 0)
-				break;
+		start = (i + offset) * EXT2FS_CLUSTER_RATIO(fs);
+		start *= fs->blocksize;
+		/* Add the runs of used blocks at once without bigalloc */
+		if (EXT2FS_CLUSTER_RATIO(fs) == 1) {
+			while (i + 1 < nr && ext2fs_test_bit(i + 1, bitmap)) {
+				len += fs->blocksize;
+				i++;
+			}
 		}
+		ret = add_merge_cache_extent(used, start, len);
+		if (ret < 0)
+			break;
 	}
 	return ret;
 }
@@ -209,6 +287,23 @@ static u8 ext2_filetype_conversion_table[EXT2_FT_MAX] = {
 	[EXT2_FT_SYMLINK]	= BTRFS_FT_SYMLINK,
 };
 
+/* Make room for one more element of an array of the inode copy */
+static int ext2_copy_grow(void **array, u32 *max, u32 nr, size_t size)
+{
+	void *tmp;
+	u32 new_max;
+
+	if (nr < *max)
+		return 0;
+	new_max = max_t(u32, 16, *max * 2);
+	tmp = realloc(*array, (size_t)new_max * size);
+	if (!tmp)
+		return -ENOMEM;
+	*array = tmp;
+	*max = new_max;
+	return 0;
+}
+
 static int ext2_dir_iterate_proc(ext2_ino_t dir, int entry,
 			    struct ext2_dir_entry *dirent,
 			    int offset, int blocksize,
@@ -219,6 +314,8 @@ static int ext2_dir_iterate_proc(ext2_ino_t dir, int entry,
 	u64 objectid;
 	char dotdot[] = "..";
 	struct dir_iterate_data *idata = (struct dir_iterate_data *)priv_data;
+	struct ext2_inode_copy *copy = idata->copy;
+	struct ext2_dirent_copy *dirent_copy;
 	int name_len;
 
 	name_len = dirent->name_len & 0xFF;
@@ -244,99 +341,135 @@ static int ext2_dir_iterate_proc(ext2_ino_t dir, int entry,
 		return BLOCK_ABORT;
 	}
 
-	ret = convert_insert_dirent(idata->trans, idata->root, dirent->name,
-				    name_len, idata->objectid, objectid,
-				    ext2_filetype_conversion_table[file_type],
-				    idata->index_cnt, idata->inode);
-	if (ret < 0) {
-		idata->errcode = ret;
-		return BLOCK_ABORT;
+	ret = ext2_copy_grow((void **)&copy->dirents, &copy->max_dirents,
+			     copy->nr_dirents, sizeof(*copy->dirents));
+	if (ret < 0)
+		goto error;
+	while (copy->names_len + name_len > copy->names_size) {
+		u32 size = max_t(u32, SZ_4K, copy->names_size * 2);
+		char *names;
+
+		names = realloc(copy->names, size);
+		if (!names) {
+			ret = -ENOMEM;
+			goto error;
+		}
+		copy->names = names;
+		copy->names_size = size;
 	}
-
-	idata->index_cnt++;
+	memcpy(copy->names + copy->names_len, dirent->name, name_len);
+
+	dirent_copy = &copy->dirents[copy->nr_dirents++];
+	dirent_copy->objectid = objectid;
+	dirent_copy->name_offset = copy->names_len;
+	dirent_copy->name_len = name_len;
+	dirent_copy->file_type = ext2_filetype_conversion_table[file_type];
+	copy->names_len += name_len;
 	return 0;
+error:
+	idata->errcode = ret;
+	return BLOCK_ABORT;
 }
 
-static int ext2_create_dir_entries(struct btrfs_trans_handle *trans,
-			      struct btrfs_root *root, u64 objectid,
-			      struct btrfs_inode_item *btrfs_inode,
-			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
+static int ext2_read_dir_entries(ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
+				 struct ext2_inode_copy *copy)
 {
-	int ret;
 	errcode_t err;
 	struct dir_iterate_data data = {
-		.trans		= trans,
-		.root		= root,
-		.inode		= btrfs_inode,
-		.objectid	= objectid,
-		.index_cnt	= 2,
+		.copy		= copy,
 		.parent		= 0,
 		.errcode	= 0,
 	};
 
 	err = ext2fs_dir_iterate2(ext2_fs, ext2_ino, 0, NULL,
 				  ext2_dir_iterate_proc, &data);
-	if (err)
-		goto error;
-	ret = data.errcode;
-	if (ret == 0 && data.parent == objectid) {
-		ret = btrfs_insert_inode_ref(trans, root, "..", 2,
-					     objectid, objectid, 0);
+	if (err) {
+		error("ext2fs_dir_iterate2: %s", error_message(err));
+		return -1;
 	}
-	return ret;
-error:
-	error("ext2fs_dir_iterate2: %s", error_message(err));
-	return -1;
+	copy->parent = data.parent;
+	return data.errcode;
 }
 
-static int ext2_block_iterate_proc(ext2_filsys fs, blk_t *blocknr,
-			        e2_blkcnt_t blockcnt, blk_t ref_block,
-			        int ref_offset, void *priv_data)
+static int ext2_create_dir_entries(struct btrfs_trans_handle *trans,
+			      struct btrfs_root *root, u64 objectid,
+			      struct btrfs_inode_item *btrfs_inode,
+			      const struct ext2_inode_copy *copy)
 {
+	u64 index_cnt = 2;
 	int ret;
-	struct blk_iterate_data *idata;
-	idata = (struct blk_iterate_data *)priv_data;
-	ret = block_iterate_proc(*blocknr, blockcnt, idata);
-	if (ret) {
-		idata->errcode = ret;
-		return BLOCK_ABORT;
+
+	for (u32 i = 0; i < copy->nr_dirents; i++) {
+		const struct ext2_dirent_copy *dirent = &copy->dirents[i];
+
+		ret = convert_insert_dirent(trans, root,
+					    copy->names + dirent->name_offset,
+					    dirent->name_len, objectid,
+					    dirent->objectid, dirent->file_type,
+					    index_cnt, btrfs_inode);
+		if (ret < 0)
+			return ret;
+		index_cnt++;
 	}
+	if (copy->parent == objectid)
+		return btrfs_insert_inode_ref(trans, root, "..", 2,
+					      objectid, objectid, 0);
 	return 0;
 }
 
-static int iterate_one_file_extent(struct blk_iterate_data *data, u64 filepos,
-				   u64 len, u64 disk_bytenr, bool prealloced)
+/* Record the next blocks of a file, merged with the previous ones if possible */
+static int ext2_add_block_run(struct ext2_inode_copy *copy, u64 disk_block,
+			      u64 file_block, u64 nr)
 {
-	const int sectorsize = data->trans->fs_info->sectorsize;
-	const int sectorbits = ilog2(sectorsize);
+	struct ext2_block_run *run;
 	int ret;
 
-	UASSERT(len > 0);
-	for (int i = 0; i < len; i += sectorsize) {
-		/*
-		 * Just treat preallocated extent as hole.
-		 *
-		 * As there is no way to utilize the preallocated space, since
-		 * any file extent would also be shared by ext2 image.
-		 */
-		if (prealloced)
-			ret = block_iterate_proc(0, (filepos + i) >> sectorbits, data);
-		else
-			ret = block_iterate_proc((disk_bytenr + i) >> sectorbits,
-						 (filepos + i) >> sectorbits, data);
+	if (copy->nr_runs) {
+		run = &copy->runs[copy->nr_runs - 1];
+		if (run->file_block + run->nr == file_block &&
+		    ((disk_block == 0 && run->disk_block == 0) ||
+		     (disk_block && run->disk_block &&
+		      run->disk_block + run->nr == disk_block))) {
+			run->nr += nr;
+			return 0;
+		}
+	}
+	ret = ext2_copy_grow((void **)&copy->runs, &copy->max_runs,
+			     copy->nr_runs, sizeof(*copy->runs));
+	if (ret < 0)
+		return ret;
+	run = &copy->runs[copy->nr_runs++];
+	run->file_block = file_block;
+	run->disk_block = disk_block;
+	run->nr = nr;
+	return 0;
+}
 
-		if (ret < 0)
-			return ret;
+struct ext2_blocks_data {
+	struct ext2_inode_copy *copy;
+	int errcode;
+};
+
+static int ext2_block_iterate_proc(ext2_filsys fs, blk_t *blocknr,
+			        e2_blkcnt_t blockcnt, blk_t ref_block,
+			        int ref_offset, void *priv_data)
+{
+	int ret;
+	struct ext2_blocks_data *idata;
+	idata = (struct ext2_blocks_data *)priv_data;
+	ret = ext2_add_block_run(idata->copy, *blocknr, blockcnt, 1);
+	if (ret) {
+		idata->errcode = ret;
+		return BLOCK_ABORT;
 	}
 	return 0;
 }
 
-static int iterate_file_extents(struct blk_iterate_data *data, ext2_filsys ext2fs,
-				ext2_ino_t ext2_ino, u32 convert_flags)
+static int iterate_file_extents(struct ext2_blocks_data *data, ext2_filsys ext2fs,
+				ext2_ino_t ext2_ino, u32 sectorsize)
 {
 	ext2_extent_handle_t handle = NULL;
 	struct ext2fs_extent extent;
-	const int sectorsize = data->trans->fs_info->sectorsize;
 	const int sectorbits = ilog2(sectorsize);
 	int op = EXT2_EXTENT_ROOT;
 	errcode_t errcode;
@@ -370,9 +503,19 @@ static int iterate_file_extents(struct blk_iterate_data *data, ext2_filsys ext2f
 		filepos = extent.e_lblk << sectorbits;
 		len = extent.e_len << sectorbits;
 		disk_bytenr = extent.e_pblk << sectorbits;
+		UASSERT(len > 0);
 
-		ret = iterate_one_file_extent(data, filepos, len, disk_bytenr,
-					      extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT);
+		/*
+		 * Just treat preallocated extent as hole.
+		 *
+		 * As there is no way to utilize the preallocated space, since
+		 * any file extent would also be shared by ext2 image.
+		 */
+		if (extent.e_flags & EXT2_EXTENT_FLAGS_UNINIT)
+			disk_bytenr = 0;
+		ret = ext2_add_block_run(data->copy, disk_bytenr >> sectorbits,
+					 filepos >> sectorbits,
+					 DIV_ROUND_UP(len, sectorsize));
 		if (ret < 0)
 			goto out;
 	}
@@ -381,20 +524,48 @@ out:
 	return ret;
 }
 
+/* Read the data blocks of a file as runs of the inode copy */
+static int ext2_read_file_blocks(ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
+				 u32 sectorsize, struct ext2_inode_copy *copy)
+{
+	struct ext2_blocks_data data = { .copy = copy };
+	errcode_t err;
+	int ret;
+
+	/*
+	 * For inodes without extent block maps, go with the older
+	 * ext2fs_block_iterate2().
+	 * Otherwise use ext2fs_extent_*() based solution, as that can provide
+	 * UNINIT extent flags.
+	 */
+	if ((copy->ext2_inode.i_flags & EXT4_EXTENTS_FL) == 0) {
+		err = ext2fs_block_iterate2(ext2_fs, ext2_ino,
+					    BLOCK_FLAG_DATA_ONLY, NULL,
+					    ext2_block_iterate_proc, &data);
+		if (err) {
+			error("ext2fs_block_iterate2: %s", error_message(err));
+			return -EIO;
+		}
+	} else {
+		ret = iterate_file_extents(&data, ext2_fs, ext2_ino, sectorsize);
+		if (ret < 0)
+			return ret;
+	}
+	return data.errcode;
+}
+
 /*
  * traverse file's data blocks, record these data blocks as file extents.
  */
 static int ext2_create_file_extents(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 objectid,
 			       struct btrfs_inode_item *btrfs_inode,
-			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
+			       const struct ext2_inode_copy *copy,
 			       u32 convert_flags)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
-	int ret;
+	int ret = 0;
 	char *buffer = NULL;
-	errcode_t err;
-	struct ext2_inode ext2_inode = { 0 };
 	u32 last_block;
 	u32 sectorsize = root->fs_info->sectorsize;
 	u64 inode_size = btrfs_stack_inode_size(btrfs_inode);
@@ -405,7 +576,7 @@ static int ext2_create_file_extents(struct btrfs_trans_handle *trans,
 		meet_inline_size_limit = inode_size <= btrfs_symlink_max_size(fs_info);
 		if (!meet_inline_size_limit) {
 			error("symlink too large for ext2 inode %u, has %llu max %u",
-			     ext2_ino, inode_size, btrfs_symlink_max_size(fs_info));
+			     copy->ext2_ino, inode_size, btrfs_symlink_max_size(fs_info));
 			return -ENAMETOOLONG;
 		}
 	} else {
@@ -415,31 +586,17 @@ static int ext2_create_file_extents(struct btrfs_trans_handle *trans,
 	init_blk_iterate_data(&data, trans, root, btrfs_inode, objectid,
 			convert_flags & CONVERT_FLAG_DATACSUM);
 
-	err = ext2fs_read_inode(ext2_fs, ext2_ino, &ext2_inode);
-	if (err) {
-		error("failed to read ext2 inode %u: %s", ext2_ino, error_message(err));
-		return -EIO;
-	}
-	/*
-	 * For inodes without extent block maps, go with the older
-	 * ext2fs_block_iterate2().
-	 * Otherwise use ext2fs_extent_*() based solution, as that can provide
-	 * UNINIT extent flags.
-	 */
-	if ((ext2_inode.i_flags & EXT4_EXTENTS_FL) == 0) {
-		err = ext2fs_block_iterate2(ext2_fs, ext2_ino,
-					    BLOCK_FLAG_DATA_ONLY, NULL,
-					    ext2_block_iterate_proc, &data);
-		if (err) {
-			error("ext2fs_block_iterate2: %s", error_message(err));
-			return -EIO;
+	for (u32 i = 0; i < copy->nr_runs && !ret; i++) {
+		const struct ext2_block_run *run = &copy->runs[i];
+
+		for (u64 nr = 0; nr < run->nr; nr++) {
+			ret = block_iterate_proc(run->disk_block ?
+						 run->disk_block + nr : 0,
+						 run->file_block + nr, &data);
+			if (ret)
+				break;
 		}
-	} else {
-		ret = iterate_file_extents(&data, ext2_fs, ext2_ino, convert_flags);
-		if (ret < 0)
-			goto fail;
 	}
-	ret = data.errcode;
 	if (ret)
 		goto fail;
 	if ((convert_flags & CONVERT_FLAG_INLINE_DATA) && data.first_block == 0
@@ -484,28 +641,27 @@ fail:
 static int ext2_create_symlink(struct btrfs_trans_handle *trans,
 			      struct btrfs_root *root, u64 objectid,
 			      struct btrfs_inode_item *btrfs_inode,
-			      ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
-			      struct ext2_inode *ext2_inode)
+			      const struct ext2_inode_copy *copy)
 {
 	int ret;
-	char *pathname;
+	const char *pathname;
 	u64 inode_size = btrfs_stack_inode_size(btrfs_inode);
 
-	if (ext2fs_inode_data_blocks2(ext2_fs, ext2_inode)) {
+	if (copy->data_blocks) {
 		if (inode_size > btrfs_symlink_max_size(trans->fs_info)) {
 			error("symlink too large for ext2 inode %u, has %llu max %u",
-				ext2_ino, inode_size,
+				copy->ext2_ino, inode_size,
 				btrfs_symlink_max_size(trans->fs_info));
 			return -ENAMETOOLONG;
 		}
 		ret = ext2_create_file_extents(trans, root, objectid,
-				btrfs_inode, ext2_fs, ext2_ino,
+				btrfs_inode, copy,
 				CONVERT_FLAG_DATACSUM |
 				CONVERT_FLAG_INLINE_DATA);
 		return ret;
 	}
 
-	pathname = (char *)&(ext2_inode->i_block[0]);
+	pathname = (const char *)&(copy->ext2_inode.i_block[0]);
 	BUG_ON(pathname[inode_size] != 0);
 	ret = btrfs_insert_inline_extent(trans, root, objectid, 0,
 					 pathname, inode_size,
@@ -628,11 +784,11 @@ static char *xattr_prefix_table[] = {
 	[6] =	"security.",
 };
 
-static int ext2_copy_single_xattr(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root, u64 objectid,
-			     struct ext2_ext_attr_entry *entry,
-			     const void *data, u32 datalen)
+static int ext2_read_single_xattr(struct ext2_inode_copy *copy,
+				  struct ext2_ext_attr_entry *entry,
+				  const void *data, u32 datalen)
 {
+	struct ext2_xattr_copy *xattr;
 	int ret = 0;
 	int name_len;
 	int name_index;
@@ -661,23 +817,55 @@ static int ext2_copy_single_xattr(struct btrfs_trans_handle *trans,
 	}
 	strncpy_null(namebuf, xattr_prefix_table[name_index], XATTR_NAME_MAX + 1);
 	strncat(namebuf, EXT2_EXT_ATTR_NAME(entry), entry->e_name_len);
-	if (name_len + datalen > BTRFS_LEAF_DATA_SIZE(root->fs_info) -
-	    sizeof(struct btrfs_item) - sizeof(struct btrfs_dir_item)) {
-		error("skip large xattr on inode %llu name %.*s",
-			objectid - INO_OFFSET, name_len, namebuf);
+
+	ret = ext2_copy_grow((void **)&copy->xattrs, &copy->max_xattrs,
+			     copy->nr_xattrs, sizeof(*copy->xattrs));
+	if (ret < 0)
+		goto out;
+	xattr = &copy->xattrs[copy->nr_xattrs];
+	xattr->name = malloc(name_len + datalen);
+	if (!xattr->name) {
+		ret = -ENOMEM;
 		goto out;
 	}
-	ret = btrfs_insert_xattr_item(trans, root, namebuf, name_len,
-				      data, datalen, objectid);
+	memcpy(xattr->name, namebuf, name_len);
+	xattr->name_len = name_len;
+	xattr->data = xattr->name + name_len;
+	memcpy(xattr->data, data, datalen);
+	xattr->datalen = datalen;
+	copy->nr_xattrs++;
 out:
 	free(databuf);
 	return ret;
 }
 
 static int ext2_copy_extended_attrs(struct btrfs_trans_handle *trans,
-			       struct btrfs_root *root, u64 objectid,
-			       struct btrfs_inode_item *btrfs_inode,
-			       ext2_filsys ext2_fs, ext2_ino_t ext2_ino)
+				    struct btrfs_root *root, u64 objectid,
+				    const struct ext2_inode_copy *copy)
+{
+	for (u32 i = 0; i < copy->nr_xattrs; i++) {
+		const struct ext2_xattr_copy *xattr = &copy->xattrs[i];
+		int ret;
+
+		if (xattr->name_len + xattr->datalen >
+		    BTRFS_LEAF_DATA_SIZE(root->fs_info) -
+		    sizeof(struct btrfs_item) - sizeof(struct btrfs_dir_item)) {
+			error("skip large xattr on inode %llu name %.*s",
+			      objectid - INO_OFFSET, xattr->name_len,
+			      xattr->name);
+			continue;
+		}
+		ret = btrfs_insert_xattr_item(trans, root, xattr->name,
+					      xattr->name_len, xattr->data,
+					      xattr->datalen, objectid);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+static int ext2_read_extended_attrs(ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
+				    struct ext2_inode_copy *copy)
 {
 	int ret = 0;
 	int inline_ea = 0;
@@ -734,8 +922,7 @@ static int ext2_copy_extended_attrs(struct btrfs_trans_handle *trans,
 			data = (void *)EXT2_XATTR_IFIRST(ext2_inode) +
 				entry->e_value_offs;
 			datalen = entry->e_value_size;
-			ret = ext2_copy_single_xattr(trans, root, objectid,
-						entry, data, datalen);
+			ret = ext2_read_single_xattr(copy, entry, data, datalen);
 			if (ret)
 				goto out;
 			entry = EXT2_EXT_ATTR_NEXT(entry);
@@ -767,8 +954,7 @@ static int ext2_copy_extended_attrs(struct btrfs_trans_handle *trans,
 			goto out;
 		data = buffer + entry->e_value_offs;
 		datalen = entry->e_value_size;
-		ret = ext2_copy_single_xattr(trans, root, objectid,
-					entry, data, datalen);
+		ret = ext2_read_single_xattr(copy, entry, data, datalen);
 		if (ret)
 			goto out;
 		entry = EXT2_EXT_ATTR_NEXT(entry);
@@ -965,32 +1151,26 @@ static void ext2_convert_inode_flags(struct btrfs_inode_item *dst,
 }
 
 /*
- * copy a single inode. do all the required works, such as cloning
- * inode item, creating file extents and creating directory entries.
+ * Read everything of an inode from ext2 needed to copy it, without touching
+ * btrfs, so it can be done by threads with their own @ext2_fs handle.
  */
-static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
-			     struct btrfs_root *root, u64 objectid,
-			     ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
-			     struct ext2_inode *ext2_inode,
-			     u32 convert_flags)
+static int ext2_read_inode_copy(ext2_filsys ext2_fs, ext2_ino_t ext2_ino,
+				struct ext2_inode *ext2_inode, u32 convert_flags,
+				u32 sectorsize, struct ext2_inode_copy *copy)
 {
-	int ret;
+	struct btrfs_inode_item *btrfs_inode = &copy->btrfs_inode;
 	int s_inode_size;
-	struct btrfs_inode_item btrfs_inode;
-	struct btrfs_key inode_key;
-	struct btrfs_path path = { 0 };
-
-	inode_key.objectid = objectid;
-	inode_key.type = BTRFS_INODE_ITEM_KEY;
-	inode_key.offset = 0;
+	int ret;
 
+	copy->ext2_ino = ext2_ino;
+	copy->ext2_inode = *ext2_inode;
 	if (ext2_inode->i_links_count == 0)
 		return 0;
 
-	ext2_copy_inode_item(&btrfs_inode, ext2_inode, ext2_fs->blocksize);
+	ext2_copy_inode_item(btrfs_inode, ext2_inode, ext2_fs->blocksize);
 	s_inode_size = EXT2_INODE_SIZE(ext2_fs->super);
 	if (s_inode_size > EXT2_GOOD_OLD_INODE_SIZE) {
-		ret = ext4_copy_inode_timespec_extra(&btrfs_inode, ext2_ino,
+		ret = ext4_copy_inode_timespec_extra(btrfs_inode, ext2_ino,
 				s_inode_size, ext2_fs);
 		if (ret)
 			return ret;
@@ -998,11 +1178,71 @@ static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 
 	if (!(convert_flags & CONVERT_FLAG_DATACSUM)
 	    && S_ISREG(ext2_inode->i_mode)) {
-		u32 flags = btrfs_stack_inode_flags(&btrfs_inode) |
+		u32 flags = btrfs_stack_inode_flags(btrfs_inode) |
 			    BTRFS_INODE_NODATASUM;
-		btrfs_set_stack_inode_flags(&btrfs_inode, flags);
+		btrfs_set_stack_inode_flags(btrfs_inode, flags);
 	}
-	ext2_convert_inode_flags(&btrfs_inode, ext2_inode);
+	ext2_convert_inode_flags(btrfs_inode, ext2_inode);
+
+	switch (ext2_inode->i_mode & S_IFMT) {
+	case S_IFREG:
+		ret = ext2_read_file_blocks(ext2_fs, ext2_ino, sectorsize, copy);
+		break;
+	case S_IFDIR:
+		ret = ext2_read_dir_entries(ext2_fs, ext2_ino, copy);
+		break;
+	case S_IFLNK:
+		copy->data_blocks = ext2fs_inode_data_blocks2(ext2_fs, ext2_inode);
+		ret = 0;
+		if (copy->data_blocks)
+			ret = ext2_read_file_blocks(ext2_fs, ext2_ino,
+						    sectorsize, copy);
+		break;
+	default:
+		ret = 0;
+		break;
+	}
+	if (ret)
+		return ret;
+
+	if (convert_flags & CONVERT_FLAG_XATTR)
+		ret = ext2_read_extended_attrs(ext2_fs, ext2_ino, copy);
+	return ret;
+}
+
+static void ext2_release_inode_copy(struct ext2_inode_copy *copy)
+{
+	free(copy->runs);
+	free(copy->dirents);
+	free(copy->names);
+	for (u32 i = 0; i < copy->nr_xattrs; i++)
+		free(copy->xattrs[i].name);
+	free(copy->xattrs);
+	memset(copy, 0, sizeof(*copy));
+}
+
+/*
+ * copy a single inode. do all the required works, such as cloning
+ * inode item, creating file extents and creating directory entries.
+ */
+static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root, u64 objectid,
+			     struct ext2_inode_copy *copy,
+			     u32 convert_flags)
+{
+	int ret;
+	struct btrfs_inode_item *btrfs_inode = &copy->btrfs_inode;
+	struct btrfs_key inode_key;
+	struct btrfs_path path = { 0 };
+
+	inode_key.objectid = objectid;
+	inode_key.type = BTRFS_INODE_ITEM_KEY;
+	inode_key.offset = 0;
+
+	if (copy->ext2_inode.i_links_count == 0)
+		return 0;
+	if (copy->ret)
+		return copy->ret;
 
 	/*
 	 * The inode may already be created (with dummy contents), in that
@@ -1018,23 +1258,23 @@ static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 		 * tree-checker. File extents/dir items/xattrs require the
 		 * previous item to have the same key objectid.
 		 */
-		ret = btrfs_insert_inode(trans, root, objectid, &btrfs_inode);
+		ret = btrfs_insert_inode(trans, root, objectid, btrfs_inode);
 		if (ret < 0)
 			return ret;
 	}
 
-	switch (ext2_inode->i_mode & S_IFMT) {
+	switch (copy->ext2_inode.i_mode & S_IFMT) {
 	case S_IFREG:
 		ret = ext2_create_file_extents(trans, root, objectid,
-			&btrfs_inode, ext2_fs, ext2_ino, convert_flags);
+			btrfs_inode, copy, convert_flags);
 		break;
 	case S_IFDIR:
 		ret = ext2_create_dir_entries(trans, root, objectid,
-				&btrfs_inode, ext2_fs, ext2_ino);
+				btrfs_inode, copy);
 		break;
 	case S_IFLNK:
 		ret = ext2_create_symlink(trans, root, objectid,
-				&btrfs_inode, ext2_fs, ext2_ino, ext2_inode);
+				btrfs_inode, copy);
 		break;
 	default:
 		ret = 0;
@@ -1044,8 +1284,7 @@ static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 		return ret;
 
 	if (convert_flags & CONVERT_FLAG_XATTR) {
-		ret = ext2_copy_extended_attrs(trans, root, objectid,
-				&btrfs_inode, ext2_fs, ext2_ino);
+		ret = ext2_copy_extended_attrs(trans, root, objectid, copy);
 		if (ret)
 			return ret;
 	}
@@ -1059,9 +1298,9 @@ static int ext2_copy_single_inode(struct btrfs_trans_handle *trans,
 		ret = -ENOENT;
 	if (ret < 0)
 		return ret;
-	write_extent_buffer(path.nodes[0], &btrfs_inode,
+	write_extent_buffer(path.nodes[0], btrfs_inode,
 			    btrfs_item_ptr_offset(path.nodes[0], path.slots[0]),
-			    sizeof(btrfs_inode));
+			    sizeof(*btrfs_inode));
 	btrfs_release_path(&path);
 	return 0;
 }
@@ -1082,84 +1321,327 @@ static bool ext2_is_special_inode(ext2_filsys ext2_fs, ext2_ino_t ino)
 	return 0;
 }
 
+/* The inodes of one group, read ahead of their insertion */
+struct ext2_copy_group {
+	struct ext2_inode_copy *copies;
+	u32 nr_copies;
+	u32 max_copies;
+	/* Error of the inode scan, after the inodes read before it */
+	errcode_t err;
+	bool done;
+};
+
+struct ext2_copy_pipeline {
+	ext2_filsys ext2_fs;
+	u32 convert_flags;
+	u32 sectorsize;
+
+	pthread_mutex_t mutex;
+	/* Signaled when a group is read */
+	pthread_cond_t done_cond;
+	/* Signaled when a group is inserted or the copy stops */
+	pthread_cond_t space_cond;
+	struct ext2_copy_group *groups;
+	u32 nr_groups;
+	/* Next group to be claimed by a reader */
+	u32 next_group;
+	/* Group being inserted, readers stay within the window after it */
+	u32 insert_group;
+	u32 window;
+	bool stop;
+
+	/* Descriptor for the readahead, the inode tables before are read */
+	int ra_fd;
+	u32 ra_group;
+};
+
+struct ext2_copy_worker {
+	struct ext2_copy_pipeline *pipe;
+	ext2_filsys ext2_fs;
+	pthread_t thread;
+};
+
+static void ext2_release_copy_group(struct ext2_copy_group *group)
+{
+	for (u32 i = 0; i < group->nr_copies; i++)
+		ext2_release_inode_copy(&group->copies[i]);
+	free(group->copies);
+	memset(group, 0, sizeof(*group));
+}
+
+/*
+ * Read the used inodes of group @index, the errors of each inode are kept in
+ * its copy and the scan error in the group, to be reported in inode order.
+ */
+static void ext2_read_copy_group(struct ext2_copy_pipeline *pipe,
+				 ext2_filsys ext2_fs, ext2_inode_scan scan,
+				 u32 index, struct ext2_copy_group *group)
+{
+	u64 last_ino = (u64)(index + 1) * EXT2_INODES_PER_GROUP(ext2_fs->super);
+	struct ext2_inode ext2_inode;
+	ext2_ino_t ext2_ino;
+	errcode_t err;
+
+	/* No inode has been used in the group, its table isn't initialized */
+	if (ext2_group_inode_uninit(ext2_fs, index))
+		return;
+
+	err = ext2fs_inode_scan_goto_blockgroup(scan, index);
+	while (!err) {
+		struct ext2_inode_copy *copy;
+
+		err = ext2fs_get_next_inode(scan, &ext2_ino, &ext2_inode);
+		if (err || ext2_ino == 0 || ext2_ino > last_ino)
+			break;
+		if (ext2_is_special_inode(ext2_fs, ext2_ino))
+			continue;
+		if (ext2_copy_grow((void **)&group->copies, &group->max_copies,
+				   group->nr_copies, sizeof(*group->copies))) {
+			err = EXT2_ET_NO_MEMORY;
+			break;
+		}
+		copy = &group->copies[group->nr_copies++];
+		copy->ret = ext2_read_inode_copy(ext2_fs, ext2_ino, &ext2_inode,
+						 pipe->convert_flags,
+						 pipe->sectorsize, copy);
+	}
+	group->err = err;
+}
+
+/*
+ * Read ahead the inode tables up to a window after group @index, which is
+ * about to be read, called under the pipeline mutex with threads.
+ */
+static void ext2_copy_readahead(struct ext2_copy_pipeline *pipe, u32 index,
+				u32 *start, u32 *end)
+{
+	*start = max(pipe->ra_group, index);
+	*end = min(index + 1 + pipe->window, pipe->nr_groups);
+	if (*end > *start)
+		pipe->ra_group = *end;
+}
+
+static void *ext2_copy_worker_fn(void *arg)
+{
+	struct ext2_copy_worker *worker = arg;
+	struct ext2_copy_pipeline *pipe = worker->pipe;
+	ext2_inode_scan scan = NULL;
+	errcode_t err;
+
+	err = ext2fs_open_inode_scan(worker->ext2_fs,
+			EXT2_INODE_SCAN_BUFFER / worker->ext2_fs->blocksize,
+			&scan);
+
+	pthread_mutex_lock(&pipe->mutex);
+	while (!pipe->stop && pipe->next_group < pipe->nr_groups) {
+		struct ext2_copy_group *group;
+		u32 index;
+		u32 ra_start;
+		u32 ra_end;
+
+		if (pipe->next_group >= pipe->insert_group + pipe->window) {
+			pthread_cond_wait(&pipe->space_cond, &pipe->mutex);
+			continue;
+		}
+		index = pipe->next_group++;
+		group = &pipe->groups[index];
+		ext2_copy_readahead(pipe, index, &ra_start, &ra_end);
+		pthread_mutex_unlock(&pipe->mutex);
+
+		for (u32 i = ra_start; i < ra_end; i++)
+			ext2_readahead_inode_table(pipe->ra_fd, pipe->ext2_fs, i);
+
+		if (err)
+			group->err = err;
+		else
+			ext2_read_copy_group(pipe, worker->ext2_fs, scan, index,
+					     group);
+
+		pthread_mutex_lock(&pipe->mutex);
+		group->done = true;
+		pthread_cond_broadcast(&pipe->done_cond);
+	}
+	pthread_mutex_unlock(&pipe->mutex);
+
+	if (scan)
+		ext2fs_close_inode_scan(scan);
+	return NULL;
+}
+
 /*
  * scan ext2's inode bitmap and copy all used inodes.
+ *
+ * The inodes are read by groups, by threads with an ext2 handle of their own
+ * as libext2fs handles can't be shared, and inserted in the order of the
+ * inode numbers by this thread.  Without threads the groups are read here
+ * right before they're inserted.
  */
 static int ext2_copy_inodes(struct btrfs_convert_context *cctx,
 			    struct btrfs_root *root,
 			    u32 convert_flags, struct task_ctx *p)
 {
 	ext2_filsys ext2_fs = cctx->fs_data;
+	struct ext2_copy_pipeline pipe = { 0 };
+	struct ext2_copy_worker *workers = NULL;
+	ext2_inode_scan ext2_scan = NULL;
+	unsigned int nr_threads = min_t(unsigned int, cctx->nr_threads,
+					CONVERT_MAX_THREADS);
+	unsigned int nr_started = 0;
 	int ret = 0;
 	errcode_t err;
-	ext2_inode_scan ext2_scan;
-	struct ext2_inode ext2_inode;
-	ext2_ino_t ext2_ino;
 	u64 objectid;
 	struct btrfs_trans_handle *trans;
 
+	pipe.ext2_fs = ext2_fs;
+	pipe.convert_flags = convert_flags;
+	pipe.sectorsize = root->fs_info->sectorsize;
+	pipe.nr_groups = ext2_fs->group_desc_count;
+	pipe.window = nr_threads + 4;
+	pipe.ra_fd = open(ext2_fs->device_name, O_RDONLY);
+	pthread_mutex_init(&pipe.mutex, NULL);
+	pthread_cond_init(&pipe.done_cond, NULL);
+	pthread_cond_init(&pipe.space_cond, NULL);
+	pipe.groups = calloc(pipe.nr_groups, sizeof(*pipe.groups));
+	if (!pipe.groups) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
 	trans = btrfs_start_transaction(root, 1);
-	if (IS_ERR(trans))
-		return PTR_ERR(trans);
-	err = ext2fs_open_inode_scan(ext2_fs, 0, &ext2_scan);
-	if (err) {
-		error("ext2fs_open_inode_scan failed: %s", error_message(err));
-		btrfs_commit_transaction(trans, root);
-		return -EIO;
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		goto out_free;
 	}
-	while (!(err = ext2fs_get_next_inode(ext2_scan, &ext2_ino,
-					     &ext2_inode))) {
-		/* no more inodes */
-		if (ext2_ino == 0)
-			break;
-		if (ext2_is_special_inode(ext2_fs, ext2_ino))
-			continue;
-		objectid = ext2_ino + INO_OFFSET;
-		ret = ext2_copy_single_inode(trans, root,
-					objectid, ext2_fs, ext2_ino,
-					&ext2_inode, convert_flags);
-		pthread_mutex_lock(&p->mutex);
-		p->cur_copy_inodes++;
-		pthread_mutex_unlock(&p->mutex);
+	if (nr_threads) {
+		workers = calloc(nr_threads, sizeof(*workers));
+		if (!workers) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+	for (nr_started = 0; nr_started < nr_threads; nr_started++) {
+		struct ext2_copy_worker *worker = &workers[nr_started];
+
+		worker->pipe = &pipe;
+		err = ext2fs_open(ext2_fs->device_name,
+				  EXT2_FLAG_SOFTSUPP_FEATURES | EXT2_FLAG_64BITS,
+				  0, 0, unix_io_manager, &worker->ext2_fs);
+		if (err) {
+			error("ext2fs_open: %s", error_message(err));
+			ret = -EIO;
+			goto out;
+		}
+		ret = pthread_create(&worker->thread, NULL, ext2_copy_worker_fn,
+				     worker);
 		if (ret) {
-			error("failed to copy ext2 inode %llu: %d",
-					(unsigned long long)ext2_ino, ret);
+			ext2fs_close(worker->ext2_fs);
+			errno = ret;
+			error("failed to start inode reading thread: %m");
+			ret = -ret;
 			goto out;
 		}
-		/*
-		 * blocks_used is the number of new tree blocks allocated in
-		 * current transaction.
-		 * Use a small amount of it to workaround a bug where delayed
-		 * ref may fail to locate tree blocks in extent tree.
-		 *
-		 * 2M is the threshold to kick chunk preallocator into work,
-		 * For default (16K) nodesize it will be 128 tree blocks,
-		 * large enough to contain over 300 inlined files or
-		 * around 26k file extents. Which should be good enough.
-		 */
-		if (trans->blocks_used >= SZ_2M / root->fs_info->nodesize) {
-			ret = btrfs_commit_transaction(trans, root);
-			if (ret < 0) {
-				errno = -ret;
-				error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+	}
+	if (!nr_threads) {
+		err = ext2fs_open_inode_scan(ext2_fs,
+				EXT2_INODE_SCAN_BUFFER / ext2_fs->blocksize,
+				&ext2_scan);
+		if (err) {
+			error("ext2fs_open_inode_scan failed: %s",
+			      error_message(err));
+			ret = -EIO;
+			goto out;
+		}
+	}
+
+	for (u32 index = 0; index < pipe.nr_groups; index++) {
+		struct ext2_copy_group *group = &pipe.groups[index];
+
+		if (nr_threads) {
+			pthread_mutex_lock(&pipe.mutex);
+			while (!group->done)
+				pthread_cond_wait(&pipe.done_cond, &pipe.mutex);
+			pthread_mutex_unlock(&pipe.mutex);
+		} else {
+			u32 ra_start;
+			u32 ra_end;
+
+			ext2_copy_readahead(&pipe, index, &ra_start, &ra_end);
+			for (u32 i = ra_start; i < ra_end; i++)
+				ext2_readahead_inode_table(pipe.ra_fd, ext2_fs, i);
+			ext2_read_copy_group(&pipe, ext2_fs, ext2_scan, index,
+					     group);
+		}
+
+		for (u32 i = 0; i < group->nr_copies; i++) {
+			struct ext2_inode_copy *copy = &group->copies[i];
+
+			objectid = copy->ext2_ino + INO_OFFSET;
+			ret = ext2_copy_single_inode(trans, root, objectid,
+						     copy, convert_flags);
+			pthread_mutex_lock(&p->mutex);
+			p->cur_copy_inodes++;
+			pthread_mutex_unlock(&p->mutex);
+			if (ret) {
+				error("failed to copy ext2 inode %llu: %d",
+				      (unsigned long long)copy->ext2_ino, ret);
 				goto out;
 			}
-			trans = btrfs_start_transaction(root, 1);
-			if (IS_ERR(trans)) {
-				ret = PTR_ERR(trans);
-				errno = -ret;
-				error_msg(ERROR_MSG_START_TRANS, "%m");
-				trans = NULL;
-				goto out;
+			ext2_release_inode_copy(copy);
+			/*
+			 * blocks_used is the number of new tree blocks allocated in
+			 * current transaction.
+			 * Use a small amount of it to workaround a bug where delayed
+			 * ref may fail to locate tree blocks in extent tree.
+			 *
+			 * 2M is the threshold to kick chunk preallocator into work,
+			 * For default (16K) nodesize it will be 128 tree blocks,
+			 * large enough to contain over 300 inlined files or
+			 * around 26k file extents. Which should be good enough.
+			 */
+			if (trans->blocks_used >= SZ_2M / root->fs_info->nodesize) {
+				ret = btrfs_commit_transaction(trans, root);
+				if (ret < 0) {
+					errno = -ret;
+					error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+					trans = NULL;
+					goto out;
+				}
+				trans = btrfs_start_transaction(root, 1);
+				if (IS_ERR(trans)) {
+					ret = PTR_ERR(trans);
+					errno = -ret;
+					error_msg(ERROR_MSG_START_TRANS, "%m");
+					trans = NULL;
+					goto out;
+				}
 			}
 		}
-	}
-	if (err) {
-		error("ext2fs_get_next_inode failed: %s", error_message(err));
-		ret = -EIO;
-		goto out;
+		if (group->err) {
+			error("ext2fs_get_next_inode failed: %s",
+			      error_message(group->err));
+			ret = -EIO;
+			goto out;
+		}
+		ext2_release_copy_group(group);
+
+		pthread_mutex_lock(&pipe.mutex);
+		pipe.insert_group = index + 1;
+		pthread_cond_broadcast(&pipe.space_cond);
+		pthread_mutex_unlock(&pipe.mutex);
 	}
 out:
+	pthread_mutex_lock(&pipe.mutex);
+	pipe.stop = true;
+	pthread_cond_broadcast(&pipe.space_cond);
+	pthread_mutex_unlock(&pipe.mutex);
+	for (unsigned int i = 0; i < nr_started; i++) {
+		pthread_join(workers[i].thread, NULL);
+		ext2fs_close(workers[i].ext2_fs);
+	}
+	free(workers);
+
 	if (ret < 0) {
 		if (trans)
 			btrfs_abort_transaction(trans, ret);
@@ -1170,7 +1652,19 @@ out:
 			error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
 		}
 	}
-	ext2fs_close_inode_scan(ext2_scan);
+	if (ext2_scan)
+		ext2fs_close_inode_scan(ext2_scan);
+out_free:
+	if (pipe.groups) {
+		for (u32 index = 0; index < pipe.nr_groups; index++)
+			ext2_release_copy_group(&pipe.groups[index]);
+		free(pipe.groups);
+	}
+	if (pipe.ra_fd >= 0)
+		close(pipe.ra_fd);
+	pthread_cond_destroy(&pipe.space_cond);
+	pthread_cond_destroy(&pipe.done_cond);
+	pthread_mutex_destroy(&pipe.mutex);
 
 	return ret;
 }
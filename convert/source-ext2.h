@@ -22,6 +22,7 @@
 #include "kerncompat.h"
 #include <ext2fs/ext2_fs.h>
 #include <ext2fs/ext2fs.h>
+#include "kernel-shared/uapi/btrfs_tree.h"
 #include "convert/source-fs.h"
 
 struct btrfs_inode_item;
@@ -50,6 +51,13 @@ struct btrfs_trans_handle;
 #define EXT2FS_CLUSTER_RATIO(fs)	(1)
 #define EXT2_CLUSTERS_PER_GROUP(s)	(EXT2_BLOCKS_PER_GROUP(s))
 #define EXT2FS_B2C(fs, blk)		(blk)
+#define ext2fs_block_bitmap_loc(fs, g)	((fs)->group_desc[(g)].bg_block_bitmap)
+#define ext2fs_inode_bitmap_loc(fs, g)	((fs)->group_desc[(g)].bg_inode_bitmap)
+#define ext2fs_inode_table_loc(fs, g)	((fs)->group_desc[(g)].bg_inode_table)
+#define ext2fs_bg_flags_test(fs, g, f)	((fs)->group_desc[(g)].bg_flags & (f))
+#define ext2fs_bg_itable_unused(fs, g)	((fs)->group_desc[(g)].bg_itable_unused)
+#define ext2fs_has_group_desc_csum(fs)	\
+	EXT2_HAS_RO_COMPAT_FEATURE((fs)->super, EXT4_FEATURE_RO_COMPAT_GDT_CSUM)
 #endif
 
 /*
@@ -66,12 +74,63 @@ struct btrfs_trans_handle;
 	((struct ext2_ext_attr_entry *) ((void *)EXT2_XATTR_IHDR(inode) + \
 		sizeof(EXT2_XATTR_IHDR(inode)->h_magic)))
 
-struct dir_iterate_data {
-	struct btrfs_trans_handle *trans;
-	struct btrfs_root *root;
-	struct btrfs_inode_item *inode;
+/*
+ * The inodes are read from ext2 by inode groups into the following records,
+ * possibly by threads, and then inserted into btrfs in the inode order.
+ */
+
+/* Blocks of a file, disk block 0 for a hole or preallocated blocks */
+struct ext2_block_run {
+	u64 file_block;
+	u64 disk_block;
+	u64 nr;
+};
+
+struct ext2_dirent_copy {
 	u64 objectid;
-	u64 index_cnt;
+	/* Offset of the name in ext2_inode_copy::names */
+	u32 name_offset;
+	u16 name_len;
+	u8 file_type;
+};
+
+struct ext2_xattr_copy {
+	char *name;
+	int name_len;
+	/* Converted to the btrfs format for ACLs, allocated with the name */
+	void *data;
+	u32 datalen;
+};
+
+struct ext2_inode_copy {
+	ext2_ino_t ext2_ino;
+	struct ext2_inode ext2_inode;
+	struct btrfs_inode_item btrfs_inode;
+	/* Error reading the inode, reported when it's inserted */
+	int ret;
+
+	/* Regular files and symlinks with data blocks */
+	bool data_blocks;
+	struct ext2_block_run *runs;
+	u32 nr_runs;
+	u32 max_runs;
+
+	/* Directories, the objectid of their ".." entry */
+	u64 parent;
+	struct ext2_dirent_copy *dirents;
+	u32 nr_dirents;
+	u32 max_dirents;
+	char *names;
+	u32 names_len;
+	u32 names_size;
+
+	struct ext2_xattr_copy *xattrs;
+	u32 nr_xattrs;
+	u32 max_xattrs;
+};
+
+struct dir_iterate_data {
+	struct ext2_inode_copy *copy;
 	u64 parent;
 	int errcode;
 };
@@ -27,6 +27,7 @@
 #include "common/utils.h"
 #include "common/internal.h"
 #include "common/messages.h"
+#include "common/device-utils.h"
 #include "common/extent-cache.h"
 #include "common/extent-tree-utils.h"
 #include "convert/common.h"
@@ -84,7 +85,6 @@ void init_convert_context(struct btrfs_convert_context *cctx)
 	cache_tree_init(&cctx->used_space);
 	cache_tree_init(&cctx->data_chunks);
 	cache_tree_init(&cctx->free_space);
-	cache_tree_init(&cctx->free_space_initial);
 }
 
 void clean_convert_context(struct btrfs_convert_context *cctx)
@@ -92,7 +92,6 @@ void clean_convert_context(struct btrfs_convert_context *cctx)
 	free_extent_cache_tree(&cctx->used_space);
 	free_extent_cache_tree(&cctx->data_chunks);
 	free_extent_cache_tree(&cctx->free_space);
-	free_extent_cache_tree(&cctx->free_space_initial);
 }
 
 int block_iterate_proc(u64 disk_block, u64 file_block,
@@ -229,7 +228,8 @@ int read_disk_extent(struct btrfs_root *root, u64 bytenr,
 	int ret;
 	struct btrfs_fs_devices *fs_devs = root->fs_info->fs_devices;
 
-	ret = pread(fs_devs->latest_bdev, buffer, num_bytes, bytenr);
+	ret = btrfs_pread(fs_devs->latest_bdev, buffer, num_bytes, bytenr,
+			  false);
 	if (ret != num_bytes)
 		goto fail;
 	ret = 0;
@@ -26,6 +26,7 @@
 #include <string.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <unistd.h>
 #include <reiserfs/reiserfs_lib.h>
 #include "kernel-lib/bitops.h"
 #include "kernel-shared/disk-io.h"
@@ -33,6 +34,7 @@
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/file-item.h"
 #include "common/extent-cache.h"
+#include "common/device-utils.h"
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/extent-tree-utils.h"
@@ -136,46 +138,55 @@ static void reiserfs_close_fs(struct btrfs_convert_context *cxt)
 	reiserfs_close(fs);
 }
 
-static int compare_objectids(const void *p1, const void *p2)
+static inline u32 objectid_slot(u64 objectid, u32 slots)
 {
-	u64 v1 = *(u64 *)p1;
-	u64 v2 = *(u64 *)p2;
+	return (objectid * 0x9E3779B97F4A7C15ULL) >> 32 & (slots - 1);
+}
 
-	if (v1 > v2)
-		return 1;
-	else if (v1 < v2)
-		return -1;
-	return 0;
+/* Find the slot of @objectid in the hash set or the free slot for it */
+static u64 *find_objectid_slot(u64 *objectids, u32 slots, u64 objectid)
+{
+	u32 i = objectid_slot(objectid, slots);
+
+	while (objectids[i] && objectids[i] != objectid)
+		i = (i + 1) & (slots - 1);
+	return &objectids[i];
 }
 
 static int lookup_cached_objectid(reiserfs_filsys_t fs, u64 objectid)
 {
 	struct reiserfs_convert_info *info = fs->fs_vp;
-	u64 *result;
 
 	if (!info->objectids)
 		return 0;
-	result = bsearch(&objectid, info->objectids, info->used_slots,
-			 sizeof(u64), compare_objectids);
-	return result != NULL;
+	return *find_objectid_slot(info->objectids, info->alloced_slots,
+				   objectid) == objectid;
 }
 
 static int insert_cached_objectid(reiserfs_filsys_t fs, u64 objectid)
 {
 	struct reiserfs_convert_info *info = fs->fs_vp;
 
-	if (info->used_slots + 1 >= info->alloced_slots) {
-		u64 *objectids = realloc(info->objectids,
-				    (info->alloced_slots + 1000) * sizeof(u64));
+	/* Keep the set at most 3/4 full so the probes stay short */
+	if ((info->used_slots + 1) * 4 > info->alloced_slots * 3) {
+		u32 slots = max_t(u32, 1024, info->alloced_slots * 2);
+		u64 *objectids = calloc(slots, sizeof(u64));
 
 		if (!objectids)
 			return -ENOMEM;
+		for (u32 i = 0; i < info->alloced_slots; i++) {
+			if (info->objectids[i])
+				*find_objectid_slot(objectids, slots,
+						    info->objectids[i]) =
+					info->objectids[i];
+		}
+		free(info->objectids);
 		info->objectids = objectids;
-		info->alloced_slots += 1000;
+		info->alloced_slots = slots;
 	}
-	info->objectids[info->used_slots++] = objectid;
-
-	qsort(info->objectids, info->used_slots, sizeof(u64), compare_objectids);
+	*find_objectid_slot(info->objectids, info->alloced_slots, objectid) =
+		objectid;
+	info->used_slots++;
 	return 0;
 }
 
@@ -912,6 +923,134 @@ static int reiserfs_copy_xattrs(reiserfs_filsys_t fs, struct btrfs_root *root)
 				    reiserfs_copy_xattr_dir, &data);
 }
 
+/* Add the children of the internal node in @buf to the next level */
+static int reiserfs_prefetch_children(struct reiserfs_prefetch *pf,
+				      const char *buf)
+{
+	const struct block_head *blkh = (const struct block_head *)buf;
+	const u32 blocksize = pf->fs->fs_blocksize;
+	const struct disk_child *dc;
+	u32 nr_items = get_blkh_nr_items(blkh);
+	u32 *children;
+
+	/* The read-ahead is advisory, a bad node is found by the copy */
+	if (get_blkh_level(blkh) != pf->level ||
+	    BLKH_SIZE + nr_items * KEY_SIZE + (nr_items + 1) * DC_SIZE > blocksize)
+		return 0;
+	dc = (const struct disk_child *)(buf + BLKH_SIZE + nr_items * KEY_SIZE);
+
+	pthread_mutex_lock(&pf->mutex);
+	if (pf->nr_children + nr_items + 1 > pf->max_children) {
+		u32 max = max_t(u32, pf->max_children * 2,
+				pf->nr_children + nr_items + 1);
+
+		children = realloc(pf->children, max * sizeof(*children));
+		if (!children) {
+			pthread_mutex_unlock(&pf->mutex);
+			return -ENOMEM;
+		}
+		pf->children = children;
+		pf->max_children = max;
+	}
+	for (u32 i = 0; i <= nr_items; i++)
+		pf->children[pf->nr_children++] = get_dc_child_blocknr(&dc[i]);
+	pthread_mutex_unlock(&pf->mutex);
+	return 0;
+}
+
+static void *reiserfs_prefetch_worker(void *arg)
+{
+	struct reiserfs_prefetch *pf = arg;
+	const u32 blocksize = pf->fs->fs_blocksize;
+	char *buf;
+	int ret = 0;
+
+	buf = malloc(blocksize);
+	if (!buf)
+		ret = -ENOMEM;
+
+	pthread_mutex_lock(&pf->mutex);
+	while (!ret && !pf->err && pf->next < pf->nr_blocks) {
+		u32 block = pf->blocks[pf->next++];
+
+		pthread_mutex_unlock(&pf->mutex);
+		if (btrfs_pread(pf->fs->fs_dev, buf, blocksize,
+				(u64)block * blocksize, false) == blocksize &&
+		    pf->level > DISK_LEAF_NODE_LEVEL)
+			ret = reiserfs_prefetch_children(pf, buf);
+		pthread_mutex_lock(&pf->mutex);
+	}
+	if (ret && !pf->err)
+		pf->err = ret;
+	pthread_mutex_unlock(&pf->mutex);
+	free(buf);
+	return NULL;
+}
+
+/*
+ * Read the tree of @fs level by level by @nr_threads into the page cache
+ * before it's copied.  The copy walks the tree by directories and reads one
+ * node at a time through the handle of libreiserfs, which isn't thread safe,
+ * so the nodes are read ahead by their block numbers in parallel instead.
+ */
+static int reiserfs_prefetch_tree(reiserfs_filsys_t fs, unsigned int nr_threads)
+{
+	struct reiserfs_prefetch pf = {
+		.fs = fs,
+		.level = get_sb_tree_height(fs->fs_ondisk_sb),
+	};
+	pthread_t *threads;
+	u32 root = get_sb_root_block(fs->fs_ondisk_sb);
+	/* More than this would be evicted before the copy gets to it */
+	u64 max_bytes = (u64)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+	int ret = 0;
+
+	if (!nr_threads)
+		return 0;
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+	pthread_mutex_init(&pf.mutex, NULL);
+	pf.blocks = &root;
+	pf.nr_blocks = 1;
+
+	for (; pf.level >= DISK_LEAF_NODE_LEVEL; pf.level--) {
+		unsigned int started = 0;
+
+		if ((u64)pf.nr_blocks * fs->fs_blocksize > max_bytes)
+			break;
+		pf.next = 0;
+		pf.nr_children = 0;
+		for (; started < min_t(u32, nr_threads, pf.nr_blocks); started++) {
+			if (pthread_create(&threads[started], NULL,
+					   reiserfs_prefetch_worker, &pf))
+				break;
+		}
+		/* Nothing is read ahead without threads, the copy reads it */
+		if (!started)
+			break;
+		for (unsigned int i = 0; i < started; i++)
+			pthread_join(threads[i], NULL);
+		ret = pf.err;
+		if (ret < 0)
+			break;
+
+		/* The children of this level are the blocks of the next one */
+		if (pf.blocks != &root)
+			free(pf.blocks);
+		pf.blocks = pf.children;
+		pf.nr_blocks = pf.nr_children;
+		pf.children = NULL;
+		pf.max_children = 0;
+	}
+	if (pf.blocks != &root)
+		free(pf.blocks);
+	free(pf.children);
+	pthread_mutex_destroy(&pf.mutex);
+	free(threads);
+	return ret;
+}
+
 static int reiserfs_copy_inodes(struct btrfs_convert_context *cxt,
 				struct btrfs_root *root,
 				u32 convert_flags,
@@ -928,6 +1067,10 @@ static int reiserfs_copy_inodes(struct btrfs_convert_context *cxt,
 	if (ret)
 		goto out;
 
+	ret = reiserfs_prefetch_tree(fs, cxt->nr_threads);
+	if (ret)
+		goto out;
+
 	ret = reiserfs_copy_meta(fs, root, convert_flags,
 				 REISERFS_ROOT_PARENT_OBJECTID,
 				 REISERFS_ROOT_OBJECTID, &type);
@@ -22,6 +22,7 @@
 #include "kerncompat.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <pthread.h>
 #include <reiserfs/misc.h>
 #include <reiserfs/io.h>
 #include <reiserfs/reiserfs_lib.h>
@@ -44,12 +45,33 @@ struct reiserfs_convert_info {
 	/* only set during copy_inodes */
 	struct task_ctx *progress;
 
-	/* used to track hardlinks */
-	unsigned used_slots;
-	unsigned alloced_slots;
+	/*
+	 * Used to track hardlinks, open addressing hash set of the objectids,
+	 * 0 is a free slot.  The number of slots is a power of two.
+	 */
+	u32 used_slots;
+	u32 alloced_slots;
 	u64 *objectids;
 };
 
+/* Read-ahead of one level of the tree by threads */
+struct reiserfs_prefetch {
+	reiserfs_filsys_t fs;
+	pthread_mutex_t mutex;
+	int level;
+	int err;
+
+	/* Blocks of the level, the next one to read */
+	u32 *blocks;
+	u32 nr_blocks;
+	u32 next;
+
+	/* Children of the internal nodes, the blocks of the next level */
+	u32 *children;
+	u32 nr_children;
+	u32 max_children;
+};
+
 struct reiserfs_blk_iterate_data {
 	struct blk_iterate_data blk_data;
 	char *inline_data;
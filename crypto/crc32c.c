@@ -10,11 +10,21 @@
 
 #include <inttypes.h>
 #include <stdio.h>
+#include <string.h>
 #include "crypto/crc32c.h"
 #include "common/cpu-utils.h"
 
 static uint32_t crc32c_ref(uint32_t crc, unsigned char const *data, uint32_t length);
 static uint32_t (*crc32c_impl)(uint32_t crc, unsigned char const *data, uint32_t length) = crc32c_ref;
+static void crc32c_batch_ref(uint32_t seed, unsigned char const *data,
+			     uint32_t length, uint32_t nr, uint32_t *crcs);
+static void (*crc32c_batch_impl)(uint32_t seed, unsigned char const *data,
+				 uint32_t length, uint32_t nr, uint32_t *crcs) = crc32c_batch_ref;
+static void crc32c_vec_ref(uint32_t seed, unsigned char const *const *data,
+			   const uint32_t *lengths, uint32_t nr, uint32_t *crcs);
+static void (*crc32c_vec_impl)(uint32_t seed, unsigned char const *const *data,
+			       const uint32_t *lengths, uint32_t nr,
+			       uint32_t *crcs) = crc32c_vec_ref;
 
 #ifdef __x86_64__
 
@@ -87,6 +97,150 @@ static uint32_t crc32c_sse42(uint32_t crc, unsigned char const *data, uint32_t l
 	return crc;
 }
 
+static inline uint64_t crc32c_hw_u64(uint64_t crc, uint64_t data)
+{
+	__asm__("crc32q %1, %0" : "+r"(crc) : "rm"(data));
+	return crc;
+}
+
+/*
+ * Three buffers at a time, the crc32 instruction has a latency of 3 cycles
+ * but a throughput of one per cycle, so interleaving three independent
+ * streams keeps it busy.  This is faster than the PCLMUL version that does
+ * the same on one buffer but has to combine the partial results.
+ */
+static void crc32c_sse42_x3(uint32_t seed, unsigned char const *data,
+			    uint32_t length, uint32_t *crcs)
+{
+	unsigned char const *data0 = data;
+	unsigned char const *data1 = data + length;
+	unsigned char const *data2 = data + 2 * length;
+	uint64_t crc0 = seed;
+	uint64_t crc1 = seed;
+	uint64_t crc2 = seed;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= length; i += 8) {
+		uint64_t val0, val1, val2;
+
+		memcpy(&val0, data0 + i, sizeof(val0));
+		memcpy(&val1, data1 + i, sizeof(val1));
+		memcpy(&val2, data2 + i, sizeof(val2));
+		crc0 = crc32c_hw_u64(crc0, val0);
+		crc1 = crc32c_hw_u64(crc1, val1);
+		crc2 = crc32c_hw_u64(crc2, val2);
+	}
+	crcs[0] = crc0;
+	crcs[1] = crc1;
+	crcs[2] = crc2;
+	if (i < length) {
+		crcs[0] = crc32c_intel_le_hw_byte(crcs[0], data0 + i, length - i);
+		crcs[1] = crc32c_intel_le_hw_byte(crcs[1], data1 + i, length - i);
+		crcs[2] = crc32c_intel_le_hw_byte(crcs[2], data2 + i, length - i);
+	}
+}
+
+static inline uint32_t crc32c_hw_u8(uint32_t crc, uint8_t data)
+{
+	__asm__("crc32b %1, %0" : "+r"(crc) : "rm"(data));
+	return crc;
+}
+
+/* Less than 8 bytes in at most three steps, the tail of short buffers */
+static inline uint32_t crc32c_hw_tail(uint32_t crc, unsigned char const *data,
+				      uint32_t length)
+{
+	if (length & 4) {
+		uint32_t val;
+
+		memcpy(&val, data, sizeof(val));
+		__asm__("crc32l %1, %0" : "+r"(crc) : "rm"(val));
+		data += 4;
+	}
+	if (length & 2) {
+		uint16_t val;
+
+		memcpy(&val, data, sizeof(val));
+		__asm__("crc32w %1, %0" : "+r"(crc) : "rm"(val));
+		data += 2;
+	}
+	if (length & 1)
+		crc = crc32c_hw_u8(crc, *data);
+	return crc;
+}
+
+static inline uint32_t crc32c_hw_short(uint64_t crc, unsigned char const *data,
+				       uint32_t length)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= length; i += 8) {
+		uint64_t val;
+
+		memcpy(&val, data + i, sizeof(val));
+		crc = crc32c_hw_u64(crc, val);
+	}
+	return crc32c_hw_tail(crc, data + i, length - i);
+}
+
+/*
+ * Three buffers of different lengths at a time, interleaved by 8 bytes while
+ * all of them have that much left.  The rest is independent for each buffer
+ * and overlaps in the pipeline anyway.
+ */
+static void crc32c_vec_sse42_x3(uint32_t seed, unsigned char const *const *data,
+				const uint32_t *lengths, uint32_t *crcs)
+{
+	unsigned char const *data0 = data[0];
+	unsigned char const *data1 = data[1];
+	unsigned char const *data2 = data[2];
+	uint32_t common = lengths[0];
+	uint64_t crc0 = seed;
+	uint64_t crc1 = seed;
+	uint64_t crc2 = seed;
+	uint32_t i;
+
+	if (lengths[1] < common)
+		common = lengths[1];
+	if (lengths[2] < common)
+		common = lengths[2];
+	for (i = 0; i + 8 <= common; i += 8) {
+		uint64_t val0, val1, val2;
+
+		memcpy(&val0, data0 + i, sizeof(val0));
+		memcpy(&val1, data1 + i, sizeof(val1));
+		memcpy(&val2, data2 + i, sizeof(val2));
+		crc0 = crc32c_hw_u64(crc0, val0);
+		crc1 = crc32c_hw_u64(crc1, val1);
+		crc2 = crc32c_hw_u64(crc2, val2);
+	}
+	crcs[0] = crc32c_hw_short(crc0, data0 + i, lengths[0] - i);
+	crcs[1] = crc32c_hw_short(crc1, data1 + i, lengths[1] - i);
+	crcs[2] = crc32c_hw_short(crc2, data2 + i, lengths[2] - i);
+}
+
+static void crc32c_vec_sse42(uint32_t seed, unsigned char const *const *data,
+			     const uint32_t *lengths, uint32_t nr, uint32_t *crcs)
+{
+	uint32_t i;
+
+	for (i = 0; i + 3 <= nr; i += 3)
+		crc32c_vec_sse42_x3(seed, data + i, lengths + i, crcs + i);
+	for (; i < nr; i++)
+		crcs[i] = crc32c_hw_short(seed, data[i], lengths[i]);
+}
+
+static void crc32c_batch_sse42(uint32_t seed, unsigned char const *data,
+			       uint32_t length, uint32_t nr, uint32_t *crcs)
+{
+	uint32_t i;
+
+	for (i = 0; i + 3 <= nr; i += 3)
+		crc32c_sse42_x3(seed, data + (size_t)i * length, length, crcs + i);
+	crc32c_batch_ref(seed, data + (size_t)i * length, length, nr - i,
+			 crcs + i);
+}
+
 void crc32c_init_accel(void)
 {
 	/*
@@ -106,6 +260,14 @@ void crc32c_init_accel(void)
 		/* printf("CRC32c: fallback\n"); */
 		crc32c_impl = crc32c_ref;
 	}
+
+	if (cpu_has_feature(CPU_FLAG_SSE42)) {
+		crc32c_batch_impl = crc32c_batch_sse42;
+		crc32c_vec_impl = crc32c_vec_sse42;
+	} else {
+		crc32c_batch_impl = crc32c_batch_ref;
+		crc32c_vec_impl = crc32c_vec_ref;
+	}
 }
 
 #else
@@ -113,6 +275,8 @@ void crc32c_init_accel(void)
 void crc32c_init_accel(void)
 {
 	crc32c_impl = crc32c_ref;
+	crc32c_batch_impl = crc32c_batch_ref;
+	crc32c_vec_impl = crc32c_vec_ref;
 }
 
 #endif /* __x86_64__ */
@@ -207,9 +371,51 @@ static uint32_t crc32c_ref(uint32_t crc, unsigned char const *data, uint32_t len
 
 uint32_t crc32c_le(uint32_t crc, unsigned char const *data, uint32_t length)
 {
-	/* Use by-byte access for unaligned buffers */
-	if ((unsigned long)data % sizeof(unsigned long))
-		return crc32c_ref(crc, data, length);
+	/* Use by-byte access for the unaligned start of the buffer */
+	uint32_t head = -(unsigned long)data % sizeof(unsigned long);
+
+	if (head) {
+		if (head > length)
+			head = length;
+		crc = crc32c_ref(crc, data, head);
+		data += head;
+		length -= head;
+	}
 
 	return crc32c_impl(crc, data, length);
 }
+
+static void crc32c_batch_ref(uint32_t seed, unsigned char const *data,
+			     uint32_t length, uint32_t nr, uint32_t *crcs)
+{
+	for (uint32_t i = 0; i < nr; i++)
+		crcs[i] = crc32c_le(seed, data + (size_t)i * length, length);
+}
+
+/*
+ * Calculate crc32c of @nr consecutive buffers of @length bytes each starting
+ * at @data, all with the same @seed.  The results are stored to @crcs.
+ */
+void crc32c_le_batch(uint32_t seed, unsigned char const *data, uint32_t length,
+		     uint32_t nr, uint32_t *crcs)
+{
+	crc32c_batch_impl(seed, data, length, nr, crcs);
+}
+
+static void crc32c_vec_ref(uint32_t seed, unsigned char const *const *data,
+			   const uint32_t *lengths, uint32_t nr, uint32_t *crcs)
+{
+	for (uint32_t i = 0; i < nr; i++)
+		crcs[i] = crc32c_le(seed, data[i], lengths[i]);
+}
+
+/*
+ * Calculate crc32c of @nr buffers at @data with @lengths bytes each, all with
+ * the same @seed.  Meant for many short buffers like names, the results are
+ * stored to @crcs.
+ */
+void crc32c_le_vec(uint32_t seed, unsigned char const *const *data,
+		   const uint32_t *lengths, uint32_t nr, uint32_t *crcs)
+{
+	crc32c_vec_impl(seed, data, lengths, nr, crcs);
+}
@@ -22,6 +22,10 @@
 #include <inttypes.h>
 
 uint32_t crc32c_le(uint32_t seed, unsigned char const *data, uint32_t length);
+void crc32c_le_batch(uint32_t seed, unsigned char const *data, uint32_t length,
+		     uint32_t nr, uint32_t *crcs);
+void crc32c_le_vec(uint32_t seed, unsigned char const *const *data,
+		   const uint32_t *lengths, uint32_t nr, uint32_t *crcs);
 void crc32c_init_accel(void);
 
 #define crc32c(seed, data, length) crc32c_le(seed, (unsigned char const *)data, length)
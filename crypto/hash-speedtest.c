@@ -19,15 +19,31 @@
 #include <getopt.h>
 #include <unistd.h>
 #include <fnmatch.h>
+#include <pthread.h>
+#include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
+#if COMPRESSION_LZO
+#include <lzo/lzo1x.h>
+#endif
 #if HAVE_LINUX_PERF_EVENT_H == 1 && HAVE_LINUX_HW_BREAKPOINT_H == 1
 #include <linux/perf_event.h>
 #include <linux/hw_breakpoint.h>
 #include <sys/syscall.h>
 #define HAVE_PERF
 #endif
+#include "kernel-lib/raid56.h"
+#include "kernel-lib/sizes.h"
+#include "kernel-shared/volumes.h"
 #include "crypto/hash.h"
 #include "common/messages.h"
 #include "common/cpu-utils.h"
+#include "common/utils.h"
+#include "common/string-utils.h"
+#include "common/format-output.h"
+#include "common/help.h"
+#include "cmds/commands.h"
 
 #ifdef __x86_64__
 static const int cycles_supported = 1;
@@ -41,8 +57,11 @@ enum {
 	UNITS_PERF,
 };
 
-const int blocksize = 4096;
+/* The iterations are for 4K blocks, scaled down for larger blocks */
 int iterations = 100000;
+/* Blocks hashed by one call of the batch functions */
+int batch_blocks = 16;
+int nr_threads = 1;
 
 #ifdef __x86_64__
 static __always_inline unsigned long long rdtsc(void)
@@ -149,6 +168,175 @@ static int hash_null_nop(const u8 *buf, size_t length, u8 *out)
        return 0;
 }
 
+/*
+ * Each block is followed by scratch space for the RAID stripes and the
+ * compressed output, see thread_buffer_blocks().
+ */
+static inline u8 *scratch_block(const u8 *buf, size_t length, int nr)
+{
+	return (u8 *)buf + (nr + 1) * length;
+}
+
+/*
+ * RAID6 over the input block as each data stripe, the throughput is per data
+ * stripe.
+ */
+#define RAID6_DISKS		(8)
+
+static int raid6_gen(const u8 *buf, size_t length, u8 *out)
+{
+	void *ptrs[RAID6_DISKS];
+
+	for (int i = 0; i < RAID6_DISKS - 2; i++)
+		ptrs[i] = (void *)buf;
+	ptrs[RAID6_DISKS - 2] = scratch_block(buf, length, RAID6_DISKS - 2);
+	ptrs[RAID6_DISKS - 1] = scratch_block(buf, length, RAID6_DISKS - 1);
+	raid6_gen_syndrome(RAID6_DISKS, length, ptrs);
+	memcpy(out, ptrs[RAID6_DISKS - 1], CRYPTO_HASH_SIZE_MAX);
+
+	return 0;
+}
+
+/* Recover the first two data stripes */
+static int raid6_recov(const u8 *buf, size_t length, u8 *out)
+{
+	void *ptrs[RAID6_DISKS];
+
+	for (int i = 0; i < RAID6_DISKS; i++)
+		ptrs[i] = scratch_block(buf, length, i);
+	memcpy(ptrs[2], buf, length);
+	raid6_recov_data2(RAID6_DISKS, length, 0, 1, ptrs);
+	memcpy(out, ptrs[0], CRYPTO_HASH_SIZE_MAX);
+
+	return 0;
+}
+
+/*
+ * RAID5 parity of the data stripes, the same as for RAID6.  The parity is
+ * calculated for whole stripes, so this is done in BTRFS_STRIPE_LEN chunks
+ * and needs the block size to be a multiple of it.
+ */
+static int raid5_gen(const u8 *buf, size_t length, u8 *out)
+{
+	void *ptrs[RAID6_DISKS - 1];
+
+	for (size_t offset = 0; offset < length; offset += BTRFS_STRIPE_LEN) {
+		for (int i = 0; i < RAID6_DISKS - 2; i++)
+			ptrs[i] = (u8 *)buf + offset;
+		ptrs[RAID6_DISKS - 2] = scratch_block(buf, length, 0) + offset;
+		raid5_gen_result(RAID6_DISKS - 1, BTRFS_STRIPE_LEN,
+				 RAID6_DISKS - 2, ptrs);
+	}
+	memcpy(out, scratch_block(buf, length, 0), CRYPTO_HASH_SIZE_MAX);
+
+	return 0;
+}
+
+/*
+ * Compressors, the output goes to the scratch space.  The throughput is for
+ * the uncompressed data.
+ */
+static int zlib_compress_level(const u8 *buf, size_t length, u8 *out, int level)
+{
+	uLongf out_len = 2 * length;
+	int ret;
+
+	ret = compress2(scratch_block(buf, length, 0), &out_len, buf, length, level);
+	if (ret != Z_OK)
+		return -EINVAL;
+	memcpy(out, &out_len, sizeof(out_len));
+
+	return 0;
+}
+
+static int zlib_1(const u8 *buf, size_t length, u8 *out)
+{
+	return zlib_compress_level(buf, length, out, 1);
+}
+
+static int zlib_3(const u8 *buf, size_t length, u8 *out)
+{
+	return zlib_compress_level(buf, length, out, 3);
+}
+
+static int zlib_9(const u8 *buf, size_t length, u8 *out)
+{
+	return zlib_compress_level(buf, length, out, 9);
+}
+
+#if COMPRESSION_ZSTD
+static __thread ZSTD_CCtx *zstd_ctx;
+
+static int zstd_compress_level(const u8 *buf, size_t length, u8 *out, int level)
+{
+	size_t out_len;
+
+	if (!zstd_ctx) {
+		zstd_ctx = ZSTD_createCCtx();
+		if (!zstd_ctx)
+			return -ENOMEM;
+	}
+	out_len = ZSTD_compressCCtx(zstd_ctx, scratch_block(buf, length, 0),
+				    2 * length, buf, length, level);
+	if (ZSTD_isError(out_len))
+		return -EINVAL;
+	memcpy(out, &out_len, sizeof(out_len));
+
+	return 0;
+}
+
+static int zstd_1(const u8 *buf, size_t length, u8 *out)
+{
+	return zstd_compress_level(buf, length, out, 1);
+}
+
+static int zstd_3(const u8 *buf, size_t length, u8 *out)
+{
+	return zstd_compress_level(buf, length, out, 3);
+}
+
+static int zstd_9(const u8 *buf, size_t length, u8 *out)
+{
+	return zstd_compress_level(buf, length, out, 9);
+}
+
+static int zstd_15(const u8 *buf, size_t length, u8 *out)
+{
+	return zstd_compress_level(buf, length, out, 15);
+}
+#endif
+
+#if COMPRESSION_LZO
+static __thread void *lzo_wrkmem;
+
+/* The kernel compresses each sector separately */
+static int lzo_compress(const u8 *buf, size_t length, u8 *out)
+{
+	const size_t sectorsize = min_t(size_t, length, SZ_4K);
+	u8 *dest = scratch_block(buf, length, 0);
+	lzo_uint total = 0;
+
+	if (!lzo_wrkmem) {
+		lzo_wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+		if (!lzo_wrkmem)
+			return -ENOMEM;
+	}
+	for (size_t offset = 0; offset < length; offset += sectorsize) {
+		lzo_uint out_len;
+		int ret;
+
+		ret = lzo1x_1_compress(buf + offset, sectorsize, dest + total,
+				       &out_len, lzo_wrkmem);
+		if (ret != LZO_E_OK)
+			return -EINVAL;
+		total += out_len;
+	}
+	memcpy(out, &total, sizeof(total));
+
+	return 0;
+}
+#endif
+
 static const char *units_to_desc(int units)
 {
 	switch (units) {
@@ -169,79 +357,361 @@ static const char *units_to_str(int units)
 	return "unknown";
 }
 
+struct contestant {
+	char name[16];
+	int (*digest)(const u8 *buf, size_t length, u8 *out);
+	/* Or hash batch_blocks blocks at once */
+	int (*batch)(const u8 *buf, size_t length, size_t nr, u8 *out);
+	int digest_size;
+	u64 cycles;
+	u64 time;
+	unsigned long cpu_flag;
+	int backend;
+	/* The block size must be a multiple of this, if set */
+	u32 size_align;
+};
+
+static struct contestant contestants[] = {
+	{ .name = "NULL-NOP", .digest = hash_null_nop, .digest_size = 32 },
+	{ .name = "NULL-MEMCPY", .digest = hash_null_memcpy, .digest_size = 32 },
+	{ .name = "CRC32C-ref", .digest = hash_crc32c, .digest_size = 4,
+	  .cpu_flag = CPU_FLAG_NONE },
+	{ .name = "CRC32C-NI", .digest = hash_crc32c, .digest_size = 4,
+	  .cpu_flag = CPU_FLAG_PCLMUL },
+	{ .name = "XXHASH", .digest = hash_xxhash, .digest_size = 8 },
+	{ .name = "SHA256-ref", .digest = hash_sha256, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "SHA256-gcrypt", .digest = hash_sha256, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
+	{ .name = "SHA256-sodium", .digest = hash_sha256, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
+	{ .name = "SHA256-kcapi", .digest = hash_sha256, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
+	{ .name = "SHA256-botan", .digest = hash_sha256, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BOTAN + 1 },
+	{ .name = "SHA256-openssl", .digest = hash_sha256, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_OPENSSL + 1 },
+	{ .name = "SHA256-NI", .digest = hash_sha256, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_SHA, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "BLAKE2-ref", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "BLAKE2-gcrypt", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
+	{ .name = "BLAKE2-sodium", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
+	{ .name = "BLAKE2-kcapi", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
+	{ .name = "BLAKE2-botan", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BOTAN + 1 },
+	{ .name = "BLAKE2-openssl", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_OPENSSL + 1 },
+	{ .name = "BLAKE2-SSE2", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_SSE2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "BLAKE2-SSE41", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_SSE41, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "BLAKE2-AVX2", .digest = hash_blake2b, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_AVX2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
+	{ .name = "CRC32C-batch", .batch = hash_crc32c_batch, .digest_size = 4 },
+	{ .name = "XXHASH-batch", .batch = hash_xxhash_batch, .digest_size = 8 },
+	{ .name = "SHA256-batch", .batch = hash_sha256_batch, .digest_size = 32 },
+	{ .name = "BLAKE2-batch", .batch = hash_blake2b_batch, .digest_size = 32 },
+	{ .name = "RAID5GEN-ref", .digest = raid5_gen, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE, .size_align = BTRFS_STRIPE_LEN },
+	{ .name = "RAID6GEN-ref", .digest = raid6_gen, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE },
+	{ .name = "RAID6GEN-SSE2", .digest = raid6_gen, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_SSE2 },
+	{ .name = "RAID6GEN-AVX2", .digest = raid6_gen, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_AVX2 },
+	{ .name = "RAID6GEN-AVX512", .digest = raid6_gen, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_AVX512BW },
+	{ .name = "RAID6GEN-NEON", .digest = raid6_gen, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NEON },
+	{ .name = "RAID6REC-ref", .digest = raid6_recov, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NONE },
+	{ .name = "RAID6REC-AVX2", .digest = raid6_recov, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_AVX2 },
+	{ .name = "RAID6REC-AVX512", .digest = raid6_recov, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_AVX512BW },
+	{ .name = "RAID6REC-NEON", .digest = raid6_recov, .digest_size = 32,
+	  .cpu_flag = CPU_FLAG_NEON },
+	{ .name = "ZLIB-1", .digest = zlib_1, .digest_size = 32 },
+	{ .name = "ZLIB-3", .digest = zlib_3, .digest_size = 32 },
+	{ .name = "ZLIB-9", .digest = zlib_9, .digest_size = 32 },
+#if COMPRESSION_ZSTD
+	{ .name = "ZSTD-1", .digest = zstd_1, .digest_size = 32 },
+	{ .name = "ZSTD-3", .digest = zstd_3, .digest_size = 32 },
+	{ .name = "ZSTD-9", .digest = zstd_9, .digest_size = 32 },
+	{ .name = "ZSTD-15", .digest = zstd_15, .digest_size = 32 },
+#endif
+#if COMPRESSION_LZO
+	{ .name = "LZO", .digest = lzo_compress, .digest_size = 32 },
+#endif
+};
+
+/* Block sizes of --sweep, from a sector to a large extent */
+static const u32 sweep_sizes[] = {
+	SZ_4K, SZ_8K, SZ_16K, SZ_32K, SZ_64K, SZ_128K, SZ_256K, SZ_512K, SZ_1M
+};
+
+/*
+ * Work for the threads, set up by the main thread before each run.  With
+ * more threads each of them runs the same contestant on its own buffer.
+ */
+static struct {
+	const struct contestant *c;
+	u32 blocksize;
+	int calls;
+	bool exit;
+	pthread_barrier_t start;
+	pthread_barrier_t end;
+} job;
+
+struct bench_thread {
+	pthread_t tid;
+	u8 *buf;
+	u8 *out;
+	int ret;
+};
+
+static struct bench_thread *threads;
+
+/* Blocks in the buffer of each thread, input blocks plus scratch space */
+static int thread_buffer_blocks(void)
+{
+	return max(batch_blocks, RAID6_DISKS + 1);
+}
+
+/* Text-like compressible data, different in each block */
+static void fill_buffer(u8 *buf, size_t size)
+{
+	static const char *words[] = {
+		"btrfs ", "extent ", "block ", "group ", "chunk ", "tree ",
+		"item ", "key ", "root ", "inode ", "0x1f2e ", "\n",
+	};
+	u32 seed = 1;
+	size_t i = 0;
+
+	while (i < size) {
+		const char *word;
+
+		seed = seed * 1103515245 + 12345;
+		word = words[(seed >> 16) % ARRAY_SIZE(words)];
+		for (; *word && i < size; word++)
+			buf[i++] = *word;
+	}
+}
+
+/* Free the per-thread compression contexts */
+static void free_thread_state(void)
+{
+#if COMPRESSION_ZSTD
+	ZSTD_freeCCtx(zstd_ctx);
+	zstd_ctx = NULL;
+#endif
+#if COMPRESSION_LZO
+	free(lzo_wrkmem);
+	lzo_wrkmem = NULL;
+#endif
+}
+
+static int run_contestant(struct bench_thread *bt)
+{
+	const struct contestant *c = job.c;
+
+	for (int iter = 0; iter < job.calls; iter++) {
+		int ret;
+
+		/* Make the input different without touching all of it */
+		memcpy(bt->buf, &iter, sizeof(iter));
+		if (c->batch)
+			ret = c->batch(bt->buf, job.blocksize, batch_blocks, bt->out);
+		else
+			ret = c->digest(bt->buf, job.blocksize, bt->out);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+static void *bench_thread_fn(void *arg)
+{
+	struct bench_thread *bt = arg;
+
+	while (1) {
+		pthread_barrier_wait(&job.start);
+		if (job.exit)
+			break;
+		bt->ret = run_contestant(bt);
+		pthread_barrier_wait(&job.end);
+	}
+	free_thread_state();
+	return NULL;
+}
+
+static int start_threads(u32 max_blocksize)
+{
+	const size_t buf_size = (size_t)thread_buffer_blocks() * max_blocksize;
+	int ret;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	if (!threads)
+		return -ENOMEM;
+	for (int i = 0; i < nr_threads; i++) {
+		threads[i].buf = malloc(buf_size);
+		threads[i].out = malloc(batch_blocks * CRYPTO_HASH_SIZE_MAX);
+		if (!threads[i].buf || !threads[i].out)
+			return -ENOMEM;
+		fill_buffer(threads[i].buf, buf_size);
+	}
+	/* A single thread runs in main, perf counts only the main thread */
+	if (nr_threads == 1)
+		return 0;
+
+	pthread_barrier_init(&job.start, NULL, nr_threads + 1);
+	pthread_barrier_init(&job.end, NULL, nr_threads + 1);
+	for (int i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&threads[i].tid, NULL, bench_thread_fn,
+				     &threads[i]);
+		if (ret) {
+			/* The rest isn't run, the barriers would wait forever */
+			error("failed to create thread: %m");
+			exit(1);
+		}
+	}
+	return 0;
+}
+
+static void stop_threads(void)
+{
+	if (nr_threads > 1) {
+		job.exit = true;
+		pthread_barrier_wait(&job.start);
+		for (int i = 0; i < nr_threads; i++)
+			pthread_join(threads[i].tid, NULL);
+		pthread_barrier_destroy(&job.start);
+		pthread_barrier_destroy(&job.end);
+	} else {
+		free_thread_state();
+	}
+	for (int i = 0; i < nr_threads; i++) {
+		free(threads[i].buf);
+		free(threads[i].out);
+	}
+	free(threads);
+}
+
+/* Run the current job on all threads, return the first error */
+static int run_job(int units, u64 *cycles, u64 *time)
+{
+	u64 start, end;
+	u64 tstart, tend;
+	int ret = 0;
+
+	if (nr_threads == 1) {
+		tstart = get_time();
+		start = get_cycles(units);
+		ret = run_contestant(&threads[0]);
+		end = get_cycles(units);
+		tend = get_time();
+	} else {
+		pthread_barrier_wait(&job.start);
+		tstart = get_time();
+		start = get_cycles(units);
+		pthread_barrier_wait(&job.end);
+		end = get_cycles(units);
+		tend = get_time();
+		for (int i = 0; i < nr_threads && !ret; i++)
+			ret = threads[i].ret;
+	}
+	*cycles = end - start;
+	*time = tend - tstart;
+	return ret;
+}
+
+static const struct rowspec speedtest_rowspec[] = {
+	{ .key = "implementation", .fmt = "str", .out_text = "implementation",
+	  .out_json = "implementation" },
+	{ .key = "units", .fmt = "str", .out_text = "units", .out_json = "units" },
+	{ .key = "name", .fmt = "str", .out_text = "name", .out_json = "name" },
+	{ .key = "blocksize", .fmt = "%llu", .out_text = "blocksize",
+	  .out_json = "blocksize" },
+	{ .key = "batch", .fmt = "%llu", .out_text = "batch", .out_json = "batch" },
+	{ .key = "threads", .fmt = "%llu", .out_text = "threads",
+	  .out_json = "threads" },
+	{ .key = "blocks", .fmt = "%llu", .out_text = "blocks",
+	  .out_json = "blocks" },
+	{ .key = "total", .fmt = "%llu", .out_text = "total", .out_json = "total" },
+	{ .key = "per-block", .fmt = "%llu", .out_text = "per-block",
+	  .out_json = "per-block" },
+	{ .key = "bytes-per-sec", .fmt = "%llu", .out_text = "bytes-per-sec",
+	  .out_json = "bytes-per-sec" },
+	ROWSPEC_END
+};
+
+static const char * const speedtest_usage[] = {
+	"hash-speedtest [options] [iterations]",
+	"",
+	"Measure the checksum, RAID56 and compression implementations.",
+	"The iterations are for 4K blocks, larger blocks do proportionally less.",
+	"",
+	"-c|--cycles          measure CPU cycles (default)",
+	"-t|--time            measure time",
+	"-p|--perf            measure cycles by perf events",
+	"-f|--filter GLOB     run only the matching contestants",
+	"-b|--blocksize SIZE  size of one block (default 4K)",
+	"--sweep              run all block sizes from 4K to 1M",
+	"--batch NR           blocks hashed at once by the batch contestants (default 16)",
+	"--threads NR         run on NR threads at the same time, sum the throughput",
+	"--json               print the results in json",
+	NULL
+};
+
+static void print_usage(void)
+{
+	for (int i = 0; speedtest_usage[i]; i++)
+		printf("%s\n", speedtest_usage[i]);
+}
+
 int main(int argc, char **argv) {
-	u8 buf[blocksize];
-	u8 hash[32];
-	int idx;
-	int iter;
+	struct format_ctx fctx;
 	char *filter = NULL;
-	struct contestant {
-		char name[16];
-		int (*digest)(const u8 *buf, size_t length, u8 *out);
-		int digest_size;
-		u64 cycles;
-		u64 time;
-		unsigned long cpu_flag;
-		int backend;
-	} contestants[] = {
-		{ .name = "NULL-NOP", .digest = hash_null_nop, .digest_size = 32 },
-		{ .name = "NULL-MEMCPY", .digest = hash_null_memcpy, .digest_size = 32 },
-		{ .name = "CRC32C-ref", .digest = hash_crc32c, .digest_size = 4,
-		  .cpu_flag = CPU_FLAG_NONE },
-		{ .name = "CRC32C-NI", .digest = hash_crc32c, .digest_size = 4,
-		  .cpu_flag = CPU_FLAG_PCLMUL },
-		{ .name = "XXHASH", .digest = hash_xxhash, .digest_size = 8 },
-		{ .name = "SHA256-ref", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "SHA256-gcrypt", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
-		{ .name = "SHA256-sodium", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
-		{ .name = "SHA256-kcapi", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
-		{ .name = "SHA256-botan", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BOTAN + 1 },
-		{ .name = "SHA256-openssl", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_OPENSSL + 1 },
-		{ .name = "SHA256-NI", .digest = hash_sha256, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_SHA, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-ref", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-gcrypt", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBGCRYPT + 1 },
-		{ .name = "BLAKE2-sodium", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBSODIUM + 1 },
-		{ .name = "BLAKE2-kcapi", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_LIBKCAPI + 1 },
-		{ .name = "BLAKE2-botan", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_BOTAN + 1 },
-		{ .name = "BLAKE2-openssl", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_NONE, .backend = CRYPTOPROVIDER_OPENSSL + 1 },
-		{ .name = "BLAKE2-SSE2", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_SSE2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-SSE41", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_SSE41, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-		{ .name = "BLAKE2-AVX2", .digest = hash_blake2b, .digest_size = 32,
-		  .cpu_flag = CPU_FLAG_AVX2, .backend = CRYPTOPROVIDER_BUILTIN + 1 },
-	};
+	u32 blocksizes[ARRAY_SIZE(sweep_sizes)] = { SZ_4K };
+	int nr_blocksizes = 1;
 	int units = UNITS_CYCLES;
+	bool json = false;
+	int ret;
 
+	btrfs_config_init();
 	cpu_detect_flags();
-	cpu_print_flags();
 	hash_init_accel();
+	raid6_init_accel();
 
 	optind = 0;
 	while (1) {
+		enum {
+			GETOPT_VAL_SWEEP = GETOPT_VAL_FIRST,
+			GETOPT_VAL_BATCH,
+			GETOPT_VAL_THREADS,
+			GETOPT_VAL_JSON,
+		};
 		static const struct option long_options[] = {
 			{ "cycles", no_argument, NULL, 'c' },
 			{ "time", no_argument, NULL, 't' },
 			{ "perf", no_argument, NULL, 'p' },
 			{ "filter", required_argument, NULL, 'f' },
+			{ "blocksize", required_argument, NULL, 'b' },
+			{ "sweep", no_argument, NULL, GETOPT_VAL_SWEEP },
+			{ "batch", required_argument, NULL, GETOPT_VAL_BATCH },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "json", no_argument, NULL, GETOPT_VAL_JSON },
+			{ "help", no_argument, NULL, 'h' },
 			{ NULL, 0, NULL, 0}
 		};
 		int c;
+		u64 size;
 
-		c = getopt_long(argc, argv, "cf:tp", long_options, NULL);
+		c = getopt_long(argc, argv, "b:cf:tph", long_options, NULL);
 		if (c < 0)
 			break;
 		switch (c) {
@@ -255,7 +725,6 @@ int main(int argc, char **argv) {
 		case 'f':
 			free(filter);
 			filter = strdup(optarg);
-			printf("Use filter: %s\n", filter);
 			break;
 		case 't':
 			units = UNITS_TIME;
@@ -268,8 +737,42 @@ int main(int argc, char **argv) {
 			}
 			units = UNITS_PERF;
 			break;
+		case 'b':
+			size = arg_strtou64_with_suffix(optarg);
+			if (size == 0 || size % SZ_4K || size > SZ_16M) {
+				error("block size must be a multiple of 4K up to 16M: %s",
+				      optarg);
+				return 1;
+			}
+			blocksizes[0] = size;
+			nr_blocksizes = 1;
+			break;
+		case GETOPT_VAL_SWEEP:
+			memcpy(blocksizes, sweep_sizes, sizeof(sweep_sizes));
+			nr_blocksizes = ARRAY_SIZE(sweep_sizes);
+			break;
+		case GETOPT_VAL_BATCH:
+			batch_blocks = arg_strtou64(optarg);
+			if (batch_blocks < 1 || batch_blocks > 1024) {
+				error("batch must be from 1 to 1024: %s", optarg);
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_THREADS:
+			nr_threads = arg_strtou64(optarg);
+			if (nr_threads < 1 || nr_threads > 1024) {
+				error("threads must be from 1 to 1024: %s", optarg);
+				return 1;
+			}
+			break;
+		case GETOPT_VAL_JSON:
+			json = true;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
 		default:
-			error("unknown option");
+			print_usage();
 			return 1;
 		}
 	}
@@ -279,72 +782,137 @@ int main(int argc, char **argv) {
 		if (iterations < 1)
 			iterations = 1;
 	}
+	if (units == UNITS_PERF && nr_threads > 1) {
+		error("perf events count only the main thread, use --time");
+		return 1;
+	}
 
-	memset(buf, 0, 4096);
+	ret = start_threads(blocksizes[nr_blocksizes - 1]);
+	if (ret < 0) {
+		error_msg(ERROR_MSG_MEMORY, "thread buffers");
+		return 1;
+	}
 
-	printf("Block size:     %d\n", blocksize);
-	printf("Iterations:     %d\n", iterations);
-	printf("Implementation: %s\n", CRYPTOPROVIDER);
-	printf("Units:          %s\n", units_to_desc(units));
-	printf("\n");
+	if (json) {
+		bconf.output_format = CMD_FORMAT_JSON;
+		fmt_start(&fctx, speedtest_rowspec, 0, 0);
+		fmt_print_start_group(&fctx, "hash-speedtest", JSON_TYPE_MAP);
+		fmt_print(&fctx, "implementation", CRYPTOPROVIDER);
+		fmt_print(&fctx, "units", units_to_str(units));
+		fmt_print_start_group(&fctx, "results", JSON_TYPE_ARRAY);
+	} else {
+		cpu_print_flags();
+		if (filter)
+			printf("Use filter: %s\n", filter);
+		if (nr_blocksizes == 1)
+			printf("Block size:     %u\n", blocksizes[0]);
+		else
+			printf("Block size:     %u-%u\n", blocksizes[0],
+			       blocksizes[nr_blocksizes - 1]);
+		printf("Iterations:     %d\n", iterations);
+		printf("Batch:          %d\n", batch_blocks);
+		printf("Threads:        %d\n", nr_threads);
+		printf("Implementation: %s\n", CRYPTOPROVIDER);
+		printf("Units:          %s\n", units_to_desc(units));
+		printf("\n");
+	}
 
-	for (idx = 0; idx < ARRAY_SIZE(contestants); idx++) {
-		struct contestant *c = &contestants[idx];
-		u64 start, end;
-		u64 tstart, tend;
-		u64 total = 0;
+	for (int bs = 0; bs < nr_blocksizes; bs++) {
+		const u32 blocksize = blocksizes[bs];
+		const int blocks = max_t(u64, 1, (u64)iterations * SZ_4K / blocksize);
+
+		if (!json && nr_blocksizes > 1)
+			printf("Block size %u, iterations %d:\n", blocksize, blocks);
+
+		for (int idx = 0; idx < ARRAY_SIZE(contestants); idx++) {
+			struct contestant *c = &contestants[idx];
+			const int per_call = c->batch ? batch_blocks : 1;
+			const int calls = DIV_ROUND_UP(blocks, per_call);
+			u64 total = 0;
+			u64 nr_blocks;
+			u64 bytes_per_sec;
+
+			if (c->cpu_flag != 0 && !cpu_has_feature(c->cpu_flag)) {
+				if (!json)
+					printf("%15s: no CPU support\n", c->name);
+				continue;
+			}
+			/* Backend not compiled in */
+			if (c->backend == 1)
+				continue;
+
+			if (c->digest == hash_null_memcpy)
+				/* Always run NULL-MEMCPY to warm up memory. */;
+			else if (filter && fnmatch(filter, c->name, FNM_CASEFOLD) != 0)
+				continue;
+
+			if (c->size_align && blocksize % c->size_align) {
+				if (!json)
+					printf("%15s: block size not supported\n", c->name);
+				continue;
+			}
 
-		if (c->cpu_flag != 0 && !cpu_has_feature(c->cpu_flag)) {
-			printf("%14s: no CPU support\n", c->name);
-			continue;
-		}
-		/* Backend not compiled in */
-		if (c->backend == 1)
-			continue;
+			if (!json) {
+				printf("%15s: ", c->name);
+				fflush(stdout);
+			}
 
-		if (c->digest == hash_null_memcpy)
-			/* Always run NULL-MEMCPY to warm up memory. */;
-		else if (filter && fnmatch(filter, c->name, FNM_CASEFOLD) != 0)
-			continue;
+			if (c->cpu_flag) {
+				cpu_set_level(c->cpu_flag);
+				hash_init_accel();
+				raid6_init_accel();
+			}
+			job.c = c;
+			job.blocksize = blocksize;
+			job.calls = calls;
+			ret = run_job(units, &c->cycles, &c->time);
+			cpu_reset_level();
+			hash_init_accel();
+			raid6_init_accel();
+			if (ret < 0) {
+				errno = -ret;
+				error("%s failed: %m", c->name);
+				continue;
+			}
 
-		printf("%14s: ", c->name);
-		fflush(stdout);
+			if (units == UNITS_CYCLES || units == UNITS_PERF)
+				total = c->cycles;
+			if (units == UNITS_TIME)
+				total = c->time;
+
+			nr_blocks = (u64)calls * per_call;
+			bytes_per_sec = (double)nr_blocks * blocksize * nr_threads *
+					1000000000 / max_t(u64, c->time, 1);
+
+			if (json) {
+				fmt_print_start_group(&fctx, NULL, JSON_TYPE_MAP);
+				fmt_print(&fctx, "name", c->name);
+				fmt_print(&fctx, "blocksize", (u64)blocksize);
+				fmt_print(&fctx, "batch", (u64)per_call);
+				fmt_print(&fctx, "threads", (u64)nr_threads);
+				fmt_print(&fctx, "blocks", nr_blocks);
+				fmt_print(&fctx, "total", total);
+				fmt_print(&fctx, "per-block", total / nr_blocks);
+				fmt_print(&fctx, "bytes-per-sec", bytes_per_sec);
+				fmt_print_end_group(&fctx, NULL);
+				continue;
+			}
 
-		if (c->cpu_flag) {
-			cpu_set_level(c->cpu_flag);
-			hash_init_accel();
-		}
-		tstart = get_time();
-		start = get_cycles(units);
-		for (iter = 0; iter < iterations; iter++) {
-			memset(buf, iter & 0xFF, blocksize);
-			memset(hash, 0, 32);
-			c->digest(buf, blocksize, hash);
+			printf("%s: %12llu, %s/i %8llu",
+					units_to_str(units), total,
+					units_to_str(units), total / nr_blocks);
+			if (c->digest != hash_null_nop)
+				printf(", %12.3f MiB/s", (double)bytes_per_sec / SZ_1M);
+			putchar('\n');
 		}
-		end = get_cycles(units);
-		tend = get_time();
-		c->cycles = end - start;
-		c->time = tend - tstart;
-		cpu_reset_level();
-
-		if (units == UNITS_CYCLES || units == UNITS_PERF)
-			total = c->cycles;
-		if (units == UNITS_TIME)
-			total = c->time;
-
-		printf("%s: %12llu, %s/i %8llu",
-				units_to_str(units), total,
-				units_to_str(units), total / iterations);
-		if (idx > 0) {
-			float t;
-			float mb;
-
-			t = (float)c->time / 1000 / 1000 / 1000;
-			mb = blocksize * iterations / 1024 / 1024;
-			printf(", %12.3f MiB/s", mb / t);
-		}
-		putchar('\n');
 	}
+
+	if (json) {
+		fmt_print_end_group(&fctx, "results");
+		fmt_print_end_group(&fctx, "hash-speedtest");
+		fmt_end(&fctx);
+	}
+	stop_threads();
 	perf_finish();
 	free(filter);
 
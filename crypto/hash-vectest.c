@@ -32,6 +32,7 @@ struct hash_testspec {
 	size_t count;
 	unsigned long cpu_flag;
 	int (*hash)(const u8 *buf, size_t length, u8 *out);
+	int (*hash_batch)(const u8 *buf, size_t length, size_t nr, u8 *out);
 	int backend;
 };
 
@@ -434,27 +435,39 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(crc32c_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_crc32c,
+		.hash_batch = hash_crc32c_batch,
 	}, {
 		.name = "CRC32C-NI",
 		.digest_size = 4,
 		.testvec = crc32c_tv,
 		.count = ARRAY_SIZE(crc32c_tv),
 		.cpu_flag = CPU_FLAG_PCLMUL,
-		.hash = hash_crc32c
+		.hash = hash_crc32c,
+		.hash_batch = hash_crc32c_batch
+	}, {
+		.name = "CRC32C-SSE42",
+		.digest_size = 4,
+		.testvec = crc32c_tv,
+		.count = ARRAY_SIZE(crc32c_tv),
+		.cpu_flag = CPU_FLAG_SSE42,
+		.hash = hash_crc32c,
+		.hash_batch = hash_crc32c_batch
 	}, {
 		.name = "XXHASH",
 		.digest_size = 8,
 		.testvec = xxhash64_tv,
 		.count = ARRAY_SIZE(xxhash64_tv),
 		.cpu_flag = CPU_FLAG_NONE,
-		.hash = hash_xxhash
+		.hash = hash_xxhash,
+		.hash_batch = hash_xxhash_batch
 	}, {
 		.name = "SHA256-ref",
 		.digest_size = 32,
 		.testvec = sha256_tv,
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
-		.hash = hash_sha256
+		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch
 	}, {
 		.name = "SHA256-gcrypt",
 		.digest_size = 32,
@@ -462,6 +475,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch,
 		.backend = CRYPTOPROVIDER_LIBGCRYPT + 1
 	}, {
 		.name = "SHA256-sodium",
@@ -470,6 +484,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch,
 		.backend = CRYPTOPROVIDER_LIBSODIUM + 1
 	}, {
 		.name = "SHA256-kcapi",
@@ -478,6 +493,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch,
 		.backend = CRYPTOPROVIDER_LIBKCAPI + 1
 	}, {
 		.name = "SHA256-botan",
@@ -486,6 +502,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch,
 		.backend = CRYPTOPROVIDER_BOTAN + 1
 	}, {
 		.name = "SHA256-openssl",
@@ -494,6 +511,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch,
 		.backend = CRYPTOPROVIDER_OPENSSL + 1
 	}, {
 		.name = "SHA256-NI",
@@ -502,6 +520,16 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(sha256_tv),
 		.cpu_flag = CPU_FLAG_SHA,
 		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch,
+		.backend = CRYPTOPROVIDER_BUILTIN + 1
+	}, {
+		.name = "SHA256-AVX2",
+		.digest_size = 32,
+		.testvec = sha256_tv,
+		.count = ARRAY_SIZE(sha256_tv),
+		.cpu_flag = CPU_FLAG_AVX2,
+		.hash = hash_sha256,
+		.hash_batch = hash_sha256_batch,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-ref",
@@ -510,6 +538,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-gcrypt",
@@ -518,6 +547,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_LIBGCRYPT + 1
 	}, {
 		.name = "BLAKE2-sodium",
@@ -526,6 +556,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_LIBSODIUM + 1
 	}, {
 		.name = "BLAKE2-kcapi",
@@ -534,6 +565,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_LIBKCAPI + 1
 	}, {
 		.name = "BLAKE2-botan",
@@ -542,6 +574,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_BOTAN + 1
 	}, {
 		.name = "BLAKE2-openssl",
@@ -550,6 +583,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_NONE,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_OPENSSL + 1
 	}, {
 		.name = "BLAKE2-SSE2",
@@ -558,6 +592,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_SSE2,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-SSE41",
@@ -566,6 +601,7 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_SSE41,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}, {
 		.name = "BLAKE2-AVX2",
@@ -574,10 +610,59 @@ static const struct hash_testspec test_spec[] = {
 		.count = ARRAY_SIZE(blake2b_256_tv),
 		.cpu_flag = CPU_FLAG_AVX2,
 		.hash = hash_blake2b,
+		.hash_batch = hash_blake2b_batch,
 		.backend = CRYPTOPROVIDER_BUILTIN + 1
 	}
 };
 
+/*
+ * Compare the batch digests of buffers with different contents and of sizes
+ * where the padding takes one or two blocks against the single buffer ones.
+ */
+static int test_hash_batch(const struct hash_testspec *spec)
+{
+	static const size_t lengths[] = { 0, 1, 55, 56, 64, 100, 4096 };
+	/* Not a multiple of any of the interleave factors */
+	const size_t nr = 19;
+	u8 *buf;
+	u8 *csums;
+	int ret = 0;
+
+	buf = malloc(nr * 4096);
+	csums = malloc(nr * spec->digest_size);
+	if (!buf || !csums) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (int i = 0; i < nr * 4096; i++)
+		buf[i] = i * 7 + i / 4096;
+
+	for (int i = 0; i < ARRAY_SIZE(lengths); i++) {
+		const size_t len = lengths[i];
+		bool match = true;
+
+		ret = spec->hash_batch(buf, len, nr, csums);
+		if (ret < 0)
+			goto out;
+		for (int j = 0; j < nr; j++) {
+			u8 csum[CRYPTO_HASH_SIZE_MAX];
+
+			ret = spec->hash(buf + j * len, len, csum);
+			if (ret < 0)
+				goto out;
+			if (memcmp(csum, csums + j * spec->digest_size,
+				   spec->digest_size) != 0)
+				match = false;
+		}
+		printf("%s batch length %zu: %s\n", spec->name, len,
+		       match ? "match" : "MISMATCH");
+	}
+out:
+	free(buf);
+	free(csums);
+	return ret;
+}
+
 static int test_hash(const struct hash_testspec *spec)
 {
 	int i;
@@ -628,6 +713,21 @@ static int test_hash(const struct hash_testspec *spec)
 		}
 	}
 
+	if (header && spec->hash_batch) {
+		int ret;
+
+		if (spec->cpu_flag) {
+			cpu_set_level(spec->cpu_flag);
+			hash_init_accel();
+		}
+		ret = test_hash_batch(spec);
+		cpu_reset_level();
+		if (ret < 0) {
+			error("hash %s batch = %d", spec->name, ret);
+			return 1;
+		}
+	}
+
 	return 0;
 }
 
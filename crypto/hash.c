@@ -15,6 +15,7 @@
  */
 
 #include "kerncompat.h"
+#include "common/internal.h"
 #include "crypto/hash.h"
 #include "crypto/crc32c.h"
 #include "crypto/xxhash.h"
@@ -49,6 +50,49 @@ int hash_xxhash(const u8 *buf, size_t length, u8 *out)
 	return 0;
 }
 
+int hash_crc32c_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	u32 crcs[64];
+
+	while (nr) {
+		const u32 batch = min_t(size_t, nr, ARRAY_SIZE(crcs));
+
+		crc32c_le_batch(~0, buf, length, batch, crcs);
+		for (u32 i = 0; i < batch; i++)
+			put_unaligned_le32(~crcs[i], out + i * sizeof(u32));
+		buf += batch * length;
+		out += batch * sizeof(u32);
+		nr -= batch;
+	}
+
+	return 0;
+}
+
+/* XXH64 already processes 4 independent lanes of one buffer */
+int hash_xxhash_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	for (size_t i = 0; i < nr; i++)
+		hash_xxhash(buf + i * length, length, out + i * sizeof(u64));
+
+	return 0;
+}
+
+/* Fallback for providers without a batch interface, for 32 byte digests */
+static inline int hash_batch_loop(int (*hash)(const u8 *, size_t, u8 *),
+				  const u8 *buf, size_t length, size_t nr,
+				  u8 *out)
+{
+	for (size_t i = 0; i < nr; i++) {
+		int ret;
+
+		ret = hash(buf + i * length, length, out + i * CRYPTO_HASH_SIZE_MAX);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
 /*
  * Implementations of cryptographic primitives
  */
@@ -83,6 +127,19 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 	return 0;
 }
 
+int hash_sha256_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	sha256_batch(buf, length, nr, out);
+
+	return 0;
+}
+
+/* The compression function is already vectorized with SSE/AVX2 */
+int hash_blake2b_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_blake2b, buf, length, nr, out);
+}
+
 #endif
 
 #if CRYPTOPROVIDER_LIBGCRYPT == 1
@@ -106,6 +163,17 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 	return 0;
 }
 
+
+int hash_sha256_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_sha256, buf, length, nr, out);
+}
+
+int hash_blake2b_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_blake2b, buf, length, nr, out);
+}
+
 #endif
 
 #if CRYPTOPROVIDER_LIBSODIUM == 1
@@ -129,6 +197,17 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 			NULL, 0);
 }
 
+
+int hash_sha256_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_sha256, buf, length, nr, out);
+}
+
+int hash_blake2b_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_blake2b, buf, length, nr, out);
+}
+
 #endif
 
 #if CRYPTOPROVIDER_LIBKCAPI == 1
@@ -180,6 +259,17 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 	return ret;
 }
 
+
+int hash_sha256_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_sha256, buf, length, nr, out);
+}
+
+int hash_blake2b_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_blake2b, buf, length, nr, out);
+}
+
 #endif
 
 #if CRYPTOPROVIDER_BOTAN == 1
@@ -235,6 +325,17 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 	return 0;
 }
 
+
+int hash_sha256_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_sha256, buf, length, nr, out);
+}
+
+int hash_blake2b_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_blake2b, buf, length, nr, out);
+}
+
 #endif
 
 #if CRYPTOPROVIDER_OPENSSL == 1
@@ -288,4 +389,15 @@ int hash_blake2b(const u8 *buf, size_t len, u8 *out)
 	return 0;
 }
 
+
+int hash_sha256_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_sha256, buf, length, nr, out);
+}
+
+int hash_blake2b_batch(const u8 *buf, size_t length, size_t nr, u8 *out)
+{
+	return hash_batch_loop(hash_blake2b, buf, length, nr, out);
+}
+
 #endif
@@ -22,11 +22,29 @@
 
 #define CRYPTO_HASH_SIZE_MAX	32
 
+/*
+ * The libkcapi and botan wrappers keep one static handle for SHA256 and
+ * BLAKE2b, these must not be used by more threads at once.  The other
+ * providers and the builtin hashes don't have any shared state.
+ */
+#define CRYPTO_HASH_THREAD_SAFE	(CRYPTOPROVIDER_LIBKCAPI != 1 && \
+				 CRYPTOPROVIDER_BOTAN != 1)
+
 int hash_crc32c(const u8 *buf, size_t length, u8 *out);
 int hash_xxhash(const u8 *buf, size_t length, u8 *out);
 int hash_sha256(const u8 *buf, size_t length, u8 *out);
 int hash_blake2b(const u8 *buf, size_t length, u8 *out);
 
+/*
+ * Hash @nr consecutive buffers of @length bytes each starting at @buf, the
+ * digests are stored packed one after another to @out, each in the size of
+ * the algorithm (4 for crc32c, 8 for xxhash, 32 for sha256 and blake2b).
+ */
+int hash_crc32c_batch(const u8 *buf, size_t length, size_t nr, u8 *out);
+int hash_xxhash_batch(const u8 *buf, size_t length, size_t nr, u8 *out);
+int hash_sha256_batch(const u8 *buf, size_t length, size_t nr, u8 *out);
+int hash_blake2b_batch(const u8 *buf, size_t length, size_t nr, u8 *out);
+
 void hash_init_accel(void);
 void hash_init_crc32c(void);
 
@@ -210,8 +210,12 @@ extern int hmacResult(HMACContext *context,
                       uint8_t digest[USHAMaxHashSize]);
 
 void sha256_init_accel(void);
+void sha256_batch(const uint8_t *data, uint32_t length, uint32_t nr,
+		  uint8_t *out);
 
 /* Export for optimized version to silent -Wmissing-prototypes. */
 void sha256_process_x86(uint32_t state[8], const uint8_t data[], uint32_t length);
+void sha256_process_avx2_x8(uint32_t state[64], const uint8_t *data[8],
+			    uint32_t blocks);
 
 #endif /* _SHA_H_ */
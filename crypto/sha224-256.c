@@ -40,6 +40,7 @@
  *   to hash the final few bits of the input.
  */
 
+#include <string.h>
 #include "crypto/sha.h"
 #include "crypto/sha-private.h"
 #include "common/cpu-utils.h"
@@ -107,6 +108,120 @@ static void sha256_process_x86_dispatch(SHA256Context *context)
 }
 #endif
 
+static void sha256_batch_ref(const uint8_t *data, uint32_t length, uint32_t nr,
+			     uint8_t *out);
+static void (*sha256_batch_impl)(const uint8_t *data, uint32_t length,
+				 uint32_t nr, uint8_t *out) = sha256_batch_ref;
+
+#if HAVE_CFLAG_msha == 1 || HAVE_CFLAG_mavx2 == 1
+/*
+ * Copy the last partial block of the @length bytes long message at @data to
+ * @tail and append the padding.  Return the number of blocks in @tail.
+ */
+static uint32_t sha256_pad_last_block(const uint8_t *data, uint32_t length,
+		uint8_t tail[2 * SHA256_Message_Block_Size])
+{
+	const uint32_t rest = length % SHA256_Message_Block_Size;
+	const uint64_t bits = (uint64_t)length * 8;
+	uint32_t blocks = 1;
+
+	/* The 0x80 byte and the 64bit length must fit after the data */
+	if (rest + 9 > SHA256_Message_Block_Size)
+		blocks = 2;
+	memset(tail, 0, blocks * SHA256_Message_Block_Size);
+	memcpy(tail, data + length - rest, rest);
+	tail[rest] = 0x80;
+	for (int i = 0; i < 8; i++)
+		tail[blocks * SHA256_Message_Block_Size - 1 - i] = bits >> (i * 8);
+
+	return blocks;
+}
+
+static void sha256_put_digest(const uint32_t *state, uint32_t stride,
+			      uint8_t out[SHA256HashSize])
+{
+	for (int i = 0; i < SHA256HashSize / 4; i++) {
+		const uint32_t word = state[i * stride];
+
+		out[i * 4] = word >> 24;
+		out[i * 4 + 1] = word >> 16;
+		out[i * 4 + 2] = word >> 8;
+		out[i * 4 + 3] = word;
+	}
+}
+#endif
+
+static void sha256_batch_ref(const uint8_t *data, uint32_t length, uint32_t nr,
+			     uint8_t *out)
+{
+	for (uint32_t i = 0; i < nr; i++) {
+		SHA256Context context;
+
+		SHA256Reset(&context);
+		SHA256Input(&context, data + (size_t)i * length, length);
+		SHA256Result(&context, out + i * SHA256HashSize);
+	}
+}
+
+#if HAVE_CFLAG_msha == 1
+/*
+ * Feed the whole blocks directly to the SHA extension instead of copying the
+ * message byte by byte to the context.
+ */
+static void sha256_batch_x86(const uint8_t *data, uint32_t length, uint32_t nr,
+			     uint8_t *out)
+{
+	const uint32_t full = length - length % SHA256_Message_Block_Size;
+
+	for (uint32_t i = 0; i < nr; i++) {
+		const uint8_t *msg = data + (size_t)i * length;
+		uint8_t tail[2 * SHA256_Message_Block_Size];
+		uint32_t state[SHA256HashSize / 4];
+		uint32_t blocks;
+
+		memcpy(state, SHA256_H0, sizeof(state));
+		sha256_process_x86(state, msg, full);
+		blocks = sha256_pad_last_block(msg, length, tail);
+		sha256_process_x86(state, tail, blocks * SHA256_Message_Block_Size);
+		sha256_put_digest(state, 1, out + i * SHA256HashSize);
+	}
+}
+#endif
+
+#if HAVE_CFLAG_mavx2 == 1
+/* Use the multi-lane version when there's no SHA extension, 8 lanes */
+static void sha256_batch_avx2(const uint8_t *data, uint32_t length, uint32_t nr,
+			      uint8_t *out)
+{
+	const uint32_t full = length / SHA256_Message_Block_Size;
+	uint32_t i;
+
+	for (i = 0; i + 8 <= nr; i += 8) {
+		uint8_t tail[8][2 * SHA256_Message_Block_Size];
+		uint32_t state[8 * 8];
+		const uint8_t *msg[8];
+		uint32_t blocks = 0;
+
+		for (int word = 0; word < 8; word++)
+			for (int lane = 0; lane < 8; lane++)
+				state[word * 8 + lane] = SHA256_H0[word];
+		for (int lane = 0; lane < 8; lane++)
+			msg[lane] = data + (size_t)(i + lane) * length;
+		sha256_process_avx2_x8(state, msg, full);
+		for (int lane = 0; lane < 8; lane++) {
+			blocks = sha256_pad_last_block(msg[lane], length, tail[lane]);
+			msg[lane] = tail[lane];
+		}
+		sha256_process_avx2_x8(state, msg, blocks);
+		for (int lane = 0; lane < 8; lane++)
+			sha256_put_digest(&state[lane], 8,
+					  out + (i + lane) * SHA256HashSize);
+	}
+	sha256_batch_ref(data + (size_t)i * length, length, nr - i,
+			 out + i * SHA256HashSize);
+}
+#endif
+
 void sha256_init_accel(void)
 {
 #if HAVE_CFLAG_msha == 1
@@ -115,6 +230,26 @@ void sha256_init_accel(void)
 	else
 #endif
 		sha256_process_message_block = SHA224_256ProcessMessageBlock;
+
+	sha256_batch_impl = sha256_batch_ref;
+#if HAVE_CFLAG_mavx2 == 1
+	if (cpu_has_feature(CPU_FLAG_AVX2))
+		sha256_batch_impl = sha256_batch_avx2;
+#endif
+#if HAVE_CFLAG_msha == 1
+	if (cpu_has_feature(CPU_FLAG_SHA))
+		sha256_batch_impl = sha256_batch_x86;
+#endif
+}
+
+/*
+ * Calculate SHA-256 of @nr consecutive messages of @length bytes each starting
+ * at @data, the digests are stored one after another to @out.
+ */
+void sha256_batch(const uint8_t *data, uint32_t length, uint32_t nr,
+		  uint8_t *out)
+{
+	sha256_batch_impl(data, length, nr, out);
 }
 
 /*
@@ -0,0 +1,163 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * SHA-256 of 8 independent messages at once, one message per 32bit lane of
+ * the AVX2 registers.
+ */
+
+#ifdef __AVX2__
+
+#include <stdint.h>
+#include <immintrin.h>
+#include "sha.h"
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)	_mm256_or_si256(_mm256_srli_epi32((x), (n)), \
+					_mm256_slli_epi32((x), 32 - (n)))
+#define ADD(a, b)	_mm256_add_epi32((a), (b))
+#define XOR(a, b)	_mm256_xor_si256((a), (b))
+
+#define BSIG0(x)	XOR(XOR(ROR((x), 2), ROR((x), 13)), ROR((x), 22))
+#define BSIG1(x)	XOR(XOR(ROR((x), 6), ROR((x), 11)), ROR((x), 25))
+#define SSIG0(x)	XOR(XOR(ROR((x), 7), ROR((x), 18)), _mm256_srli_epi32((x), 3))
+#define SSIG1(x)	XOR(XOR(ROR((x), 17), ROR((x), 19)), _mm256_srli_epi32((x), 10))
+#define CH(x, y, z)	XOR(_mm256_and_si256((x), (y)), _mm256_andnot_si256((x), (z)))
+#define MAJ(x, y, z)	_mm256_or_si256(_mm256_and_si256((x), (y)), \
+				_mm256_and_si256((z), _mm256_or_si256((x), (y))))
+
+/*
+ * Load 32 bytes at @offset of each of the 8 blocks and transpose them, so
+ * that @w[i] holds the big endian word i of all the lanes.
+ */
+static inline void load_transpose(__m256i w[8], const uint8_t *data[8],
+				  uint32_t offset)
+{
+	const __m256i bswap = _mm256_set_epi8(
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3,
+			12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+	__m256i r[8];
+	__m256i t[8];
+
+	for (int i = 0; i < 8; i++)
+		r[i] = _mm256_shuffle_epi8(_mm256_loadu_si256(
+				(const __m256i *)(data[i] + offset)), bswap);
+
+	t[0] = _mm256_unpacklo_epi32(r[0], r[1]);
+	t[1] = _mm256_unpackhi_epi32(r[0], r[1]);
+	t[2] = _mm256_unpacklo_epi32(r[2], r[3]);
+	t[3] = _mm256_unpackhi_epi32(r[2], r[3]);
+	t[4] = _mm256_unpacklo_epi32(r[4], r[5]);
+	t[5] = _mm256_unpackhi_epi32(r[4], r[5]);
+	t[6] = _mm256_unpacklo_epi32(r[6], r[7]);
+	t[7] = _mm256_unpackhi_epi32(r[6], r[7]);
+
+	r[0] = _mm256_unpacklo_epi64(t[0], t[2]);
+	r[1] = _mm256_unpackhi_epi64(t[0], t[2]);
+	r[2] = _mm256_unpacklo_epi64(t[1], t[3]);
+	r[3] = _mm256_unpackhi_epi64(t[1], t[3]);
+	r[4] = _mm256_unpacklo_epi64(t[4], t[6]);
+	r[5] = _mm256_unpackhi_epi64(t[4], t[6]);
+	r[6] = _mm256_unpacklo_epi64(t[5], t[7]);
+	r[7] = _mm256_unpackhi_epi64(t[5], t[7]);
+
+	w[0] = _mm256_permute2x128_si256(r[0], r[4], 0x20);
+	w[1] = _mm256_permute2x128_si256(r[1], r[5], 0x20);
+	w[2] = _mm256_permute2x128_si256(r[2], r[6], 0x20);
+	w[3] = _mm256_permute2x128_si256(r[3], r[7], 0x20);
+	w[4] = _mm256_permute2x128_si256(r[0], r[4], 0x31);
+	w[5] = _mm256_permute2x128_si256(r[1], r[5], 0x31);
+	w[6] = _mm256_permute2x128_si256(r[2], r[6], 0x31);
+	w[7] = _mm256_permute2x128_si256(r[3], r[7], 0x31);
+}
+
+/*
+ * Process @blocks 64 byte blocks of each of the 8 messages at @data.
+ *
+ * @state holds the intermediate hash of the lanes, word i of lane l is
+ * state[i * 8 + l].  Like sha256_process_x86(), the caller sets the initial
+ * state and pads the final blocks.
+ */
+void sha256_process_avx2_x8(uint32_t state[64], const uint8_t *data[8],
+			    uint32_t blocks)
+{
+	__m256i s[8];
+	const uint8_t *p[8];
+
+	for (int i = 0; i < 8; i++) {
+		s[i] = _mm256_loadu_si256((const __m256i *)&state[i * 8]);
+		p[i] = data[i];
+	}
+
+	while (blocks--) {
+		__m256i w[16];
+		__m256i a = s[0], b = s[1], c = s[2], d = s[3];
+		__m256i e = s[4], f = s[5], g = s[6], h = s[7];
+
+		load_transpose(&w[0], p, 0);
+		load_transpose(&w[8], p, 32);
+
+		for (int t = 0; t < 64; t++) {
+			__m256i t1, t2;
+
+			if (t >= 16) {
+				w[t & 15] = ADD(ADD(SSIG1(w[(t - 2) & 15]), w[(t - 7) & 15]),
+						ADD(SSIG0(w[(t - 15) & 15]), w[t & 15]));
+			}
+			t1 = ADD(ADD(h, BSIG1(e)), ADD(CH(e, f, g),
+				 ADD(_mm256_set1_epi32(K[t]), w[t & 15])));
+			t2 = ADD(BSIG0(a), MAJ(a, b, c));
+			h = g;
+			g = f;
+			f = e;
+			e = ADD(d, t1);
+			d = c;
+			c = b;
+			b = a;
+			a = ADD(t1, t2);
+		}
+
+		s[0] = ADD(s[0], a);
+		s[1] = ADD(s[1], b);
+		s[2] = ADD(s[2], c);
+		s[3] = ADD(s[3], d);
+		s[4] = ADD(s[4], e);
+		s[5] = ADD(s[5], f);
+		s[6] = ADD(s[6], g);
+		s[7] = ADD(s[7], h);
+
+		for (int i = 0; i < 8; i++)
+			p[i] += SHA256_Message_Block_Size;
+	}
+
+	for (int i = 0; i < 8; i++)
+		_mm256_storeu_si256((__m256i *)&state[i * 8], s[i]);
+}
+
+#endif
@@ -21,7 +21,13 @@
 #include <unistd.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
+#include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/extent_io.h"
@@ -58,26 +64,15 @@ const struct dump_version dump_versions[] = {
 
 const struct dump_version *current_version = &dump_versions[0];
 
-int detect_version(FILE *in)
+/*
+ * Detect the format from the header of the first cluster, read by the caller
+ * as the image could be a stream that can't be rewound.
+ */
+int detect_version(const struct meta_cluster *cluster)
 {
-	struct meta_cluster *cluster;
-	u8 buf[IMAGE_BLOCK_SIZE];
 	bool found = false;
 	int i;
-	int ret;
-
-	if (fseek(in, 0, SEEK_SET) < 0) {
-		error("seek failed: %m");
-		return -errno;
-	}
-	ret = fread(buf, IMAGE_BLOCK_SIZE, 1, in);
-	if (!ret) {
-		error("failed to read header");
-		return -EIO;
-	}
 
-	fseek(in, 0, SEEK_SET);
-	cluster = (struct meta_cluster *)buf;
 	for (i = 0; i < ARRAY_SIZE(dump_versions); i++) {
 		if (get_unaligned_le64(&cluster->header.magic) == dump_versions[i].magic_cpu) {
 			found = true;
@@ -93,6 +88,157 @@ int detect_version(FILE *in)
 	return 0;
 }
 
+/*
+ * Decompress a whole item read from the image, @size is the size of @out and
+ * is set to the decompressed size.
+ */
+int decompress_item(int compress_method, u8 *out, size_t *size, const u8 *in,
+		    size_t in_size)
+{
+	int ret;
+
+#if COMPRESSION_ZSTD
+	if (compress_method == COMPRESS_ZSTD) {
+		size_t zret;
+
+		zret = ZSTD_decompress(out, *size, in, in_size);
+		if (ZSTD_isError(zret)) {
+			error("decompression failed: %s",
+			      ZSTD_getErrorName(zret));
+			return -EIO;
+		}
+		*size = zret;
+		return 0;
+	}
+#endif
+	ret = uncompress(out, (unsigned long *)size, in, in_size);
+	if (ret != Z_OK) {
+		error("decompression failed with %d", ret);
+		return -EIO;
+	}
+	return 0;
+}
+
+/*
+ * Read the header of a delta from the first block of an image.  Return 1 if
+ * it's a delta, 0 if not.
+ */
+int read_delta_header(const struct meta_delta_header *header,
+		      struct image_info *info)
+{
+	u32 csum;
+
+	if (get_unaligned_le64(&header->magic) != IMAGE_DELTA_MAGIC)
+		return 0;
+	csum = ~crc32c(~(u32)0, (const u8 *)header,
+		       offsetof(struct meta_delta_header, csum));
+	if (csum != get_unaligned_le32(&header->csum)) {
+		error("bad checksum of the delta header in metadump image");
+		return -EUCLEAN;
+	}
+	memcpy(info->fsid, header->fsid, BTRFS_FSID_SIZE);
+	info->generation = get_unaligned_le64(&header->generation);
+	info->delta = true;
+	info->base_generation = get_unaligned_le64(&header->base_generation);
+	return 1;
+}
+
+/*
+ * Read the filesystem and generation of the image at @path, from the header
+ * of a delta or from the superblock in the first cluster.
+ */
+int read_image_info(const char *path, struct image_info *info)
+{
+	const struct dump_version *version = current_version;
+	union {
+		struct meta_cluster cluster;
+		struct meta_delta_header delta;
+		char bytes[IMAGE_BLOCK_SIZE];
+	} block;
+	u8 super_buf[BTRFS_SUPER_INFO_SIZE];
+	struct btrfs_super_block *super = (struct btrfs_super_block *)super_buf;
+	struct meta_cluster_item *item = NULL;
+	u8 *buffer = NULL;
+	size_t size = 0;
+	u32 nritems;
+	FILE *in;
+	int ret;
+
+	memset(info, 0, sizeof(*info));
+	in = fopen(path, "r");
+	if (!in) {
+		error("unable to open metadump image %s: %m", path);
+		return -errno;
+	}
+	if (fread(&block, IMAGE_BLOCK_SIZE, 1, in) != 1) {
+		error("unable to read metadump image %s", path);
+		ret = -EIO;
+		goto out;
+	}
+	ret = read_delta_header(&block.delta, info);
+	if (ret) {
+		ret = min(ret, 0);
+		goto out;
+	}
+
+	ret = detect_version(&block.cluster);
+	if (ret < 0)
+		goto out;
+	nritems = get_unaligned_le32(&block.cluster.header.nritems);
+	for (u32 i = 0; i < min_t(u32, nritems, ITEMS_PER_CLUSTER); i++) {
+		item = &block.cluster.items[i];
+		size = get_unaligned_le32(&item->size);
+		if (get_unaligned_le64(&item->bytenr) == BTRFS_SUPER_INFO_OFFSET)
+			break;
+		if (fseek(in, size, SEEK_CUR)) {
+			error("seek failed: %m");
+			ret = -EIO;
+			goto out;
+		}
+		item = NULL;
+	}
+	if (!item) {
+		error("superblock not found in metadump image %s", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	buffer = malloc(size);
+	if (!buffer) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+	if (fread(buffer, size, 1, in) != 1) {
+		error("unable to read superblock from metadump image %s", path);
+		ret = -EIO;
+		goto out;
+	}
+	if (block.cluster.header.compress != COMPRESS_NONE) {
+		size_t out_size = BTRFS_SUPER_INFO_SIZE;
+
+		ret = decompress_item(block.cluster.header.compress, super_buf,
+				      &out_size, buffer, size);
+		if (ret < 0)
+			goto out;
+		size = out_size;
+	} else if (size >= BTRFS_SUPER_INFO_SIZE) {
+		memcpy(super_buf, buffer, BTRFS_SUPER_INFO_SIZE);
+	}
+	if (size < BTRFS_SUPER_INFO_SIZE) {
+		error("superblock truncated in metadump image %s", path);
+		ret = -EUCLEAN;
+		goto out;
+	}
+	memcpy(info->fsid, super->fsid, BTRFS_FSID_SIZE);
+	info->generation = btrfs_super_generation(super);
+out:
+	current_version = version;
+	free(buffer);
+	fclose(in);
+	return ret;
+}
+
 void csum_block(u8 *buf, size_t len)
 {
 	u16 csum_size = btrfs_csum_type_size(BTRFS_CSUM_TYPE_CRC32);
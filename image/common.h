@@ -21,9 +21,17 @@
 #include <stdio.h>
 
 struct btrfs_fs_info;
+struct meta_cluster;
+struct meta_delta_header;
+struct image_info;
 
 void csum_block(u8 *buf, size_t len);
-int detect_version(FILE *in);
+int detect_version(const struct meta_cluster *cluster);
+int decompress_item(int compress_method, u8 *out, size_t *size, const u8 *in,
+		    size_t in_size);
+int read_delta_header(const struct meta_delta_header *header,
+		      struct image_info *info);
+int read_image_info(const char *path, struct image_info *info);
 int update_disk_super_on_device(struct btrfs_fs_info *info,
 				const char *other_dev, u64 cur_devid);
 void write_backup_supers(int fd, u8 *buf);
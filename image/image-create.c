@@ -25,6 +25,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #include "kernel-lib/list.h"
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
@@ -39,58 +42,240 @@
 #include "kernel-shared/tree-checker.h"
 #include "common/internal.h"
 #include "common/messages.h"
+#include "common/tree-walk.h"
+#include "common/tree-prefetch.h"
+#include "crypto/crc32c.h"
 #include "image/sanitize.h"
 #include "image/metadump.h"
 #include "image/common.h"
 
+#if COMPRESSION_ZSTD
+/*
+ * Each worker keeps its own context, the parameters are set once and the
+ * buffers are reused for all the items it compresses.
+ */
+static ZSTD_CCtx *zstd_create_cctx(struct metadump_struct *md)
+{
+	ZSTD_CCtx *cctx;
+	size_t zret;
+
+	cctx = ZSTD_createCCtx();
+	if (!cctx)
+		return NULL;
+
+	zret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel,
+				      md->compress_level);
+	/* Verified by the restore like the adler32 of the zlib stream */
+	if (!ZSTD_isError(zret))
+		zret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_checksumFlag, 1);
+	if (!ZSTD_isError(zret) && md->compress_long) {
+		zret = ZSTD_CCtx_setParameter(cctx,
+				ZSTD_c_enableLongDistanceMatching, 1);
+		if (!ZSTD_isError(zret))
+			zret = ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog,
+						      ZSTD_LONG_WINDOW_LOG);
+	}
+	if (ZSTD_isError(zret)) {
+		error("failed to set zstd parameters: %s",
+		      ZSTD_getErrorName(zret));
+		ZSTD_freeCCtx(cctx);
+		return NULL;
+	}
+	return cctx;
+}
+#endif
+
+static void set_error(struct metadump_struct *md, int error)
+{
+	int old = 0;
+
+	__atomic_compare_exchange_n(&md->error, &old, error, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static bool has_name(struct btrfs_key *key)
+{
+	switch (key->type) {
+	case BTRFS_DIR_ITEM_KEY:
+	case BTRFS_DIR_INDEX_KEY:
+	case BTRFS_INODE_REF_KEY:
+	case BTRFS_INODE_EXTREF_KEY:
+	case BTRFS_XATTR_ITEM_KEY:
+		return true;
+	default:
+		break;
+	}
+
+	return false;
+}
+
+/*
+ * zero inline extents and csum items
+ */
+static void zero_items(struct metadump_struct *md, struct extent_buffer *src)
+{
+	u8 *dst = (u8 *)src->data;
+	struct btrfs_file_extent_item *fi;
+	struct btrfs_key key;
+	u32 nritems = btrfs_header_nritems(src);
+	size_t size;
+	unsigned long ptr;
+	int i, extent_type;
+
+	for (i = 0; i < nritems; i++) {
+		btrfs_item_key_to_cpu(src, &key, i);
+		if (key.type == BTRFS_CSUM_ITEM_KEY) {
+			size = btrfs_item_size(src, i);
+			memset(dst + btrfs_item_nr_offset(src, 0) +
+			       btrfs_item_offset(src, i), 0, size);
+			continue;
+		}
+
+		if (md->sanitize_names && has_name(&key)) {
+			sanitize_name(md->sanitize_names, &md->name_tree, dst,
+					src, &key, i);
+			continue;
+		}
+
+		if (key.type != BTRFS_EXTENT_DATA_KEY)
+			continue;
+
+		fi = btrfs_item_ptr(src, i, struct btrfs_file_extent_item);
+		extent_type = btrfs_file_extent_type(src, fi);
+		if (extent_type != BTRFS_FILE_EXTENT_INLINE)
+			continue;
+
+		ptr = btrfs_file_extent_inline_start(fi);
+		size = btrfs_file_extent_inline_item_len(src, i);
+		memset(dst + ptr, 0, size);
+	}
+}
+
+/*
+ * Zero useless data in the block, sanitize the names and update the checksum,
+ * in place
+ */
+static void transform_block(struct metadump_struct *md, u8 *buf, u64 bytenr)
+{
+	struct extent_buffer eb = {
+		.start = bytenr,
+		.len = md->root->fs_info->nodesize,
+		.fs_info = md->root->fs_info,
+		.data = (char *)buf,
+	};
+	int level;
+	size_t size;
+	u32 nritems;
+
+	level = btrfs_header_level(&eb);
+	nritems = btrfs_header_nritems(&eb);
+
+	if (nritems == 0) {
+		size = sizeof(struct btrfs_header);
+		memset(buf + size, 0, eb.len - size);
+	} else if (level == 0) {
+		size = btrfs_item_nr_offset(&eb, 0) +
+			btrfs_item_offset(&eb, nritems - 1) -
+			btrfs_item_nr_offset(&eb, nritems);
+		memset(buf + btrfs_item_nr_offset(&eb, nritems), 0, size);
+		zero_items(md, &eb);
+	} else {
+		size = offsetof(struct btrfs_node, ptrs) +
+			sizeof(struct btrfs_key_ptr) * nritems;
+		memset(buf + size, 0, eb.len - size);
+	}
+	csum_block(buf, eb.len);
+}
+
+/*
+ * Transform the tree blocks of the item read, done by the workers if there are
+ * any so the walk only reads the blocks.
+ */
+static void transform_item(struct metadump_struct *md, struct async_work *async)
+{
+	u32 nodesize = md->root->fs_info->nodesize;
+
+	if (async->data || async->start == BTRFS_SUPER_INFO_OFFSET)
+		return;
+
+	for (u64 offset = 0; offset < async->size; offset += nodesize)
+		transform_block(md, async->buffer + offset,
+				async->start + offset);
+}
+
 static void *dump_worker(void *data)
 {
 	struct metadump_struct *md = (struct metadump_struct *)data;
 	struct async_work *async;
+#if COMPRESSION_ZSTD
+	ZSTD_CCtx *zstd_cctx = NULL;
+#endif
 	int ret;
 
-	while (1) {
-		pthread_mutex_lock(&md->mutex);
-		while (list_empty(&md->list)) {
-			if (md->done) {
-				pthread_mutex_unlock(&md->mutex);
-				goto out;
-			}
-			pthread_cond_wait(&md->cond, &md->mutex);
+#if COMPRESSION_ZSTD
+	if (md->compress_method == COMPRESS_ZSTD) {
+		zstd_cctx = zstd_create_cctx(md);
+		if (!zstd_cctx) {
+			error("failed to create zstd compression context");
+			set_error(md, -ENOMEM);
 		}
-		async = list_entry(md->list.next, struct async_work, list);
-		list_del_init(&async->list);
-		pthread_mutex_unlock(&md->mutex);
+	}
+#endif
 
-		if (md->compress_level > 0) {
-			u8 *orig = async->buffer;
+	/* After an error the items are only marked done until told to exit */
+	while ((async = work_queue_pop(&md->queue))) {
+		u8 *orig = async->buffer;
 
+		if (__atomic_load_n(&md->error, __ATOMIC_RELAXED))
+			goto done;
+
+		transform_item(md, async);
+		if (md->compress_method == COMPRESS_NONE)
+			goto done;
+
+#if COMPRESSION_ZSTD
+		if (md->compress_method == COMPRESS_ZSTD)
+			async->bufsize = ZSTD_compressBound(async->size);
+		else
+#endif
 			async->bufsize = compressBound(async->size);
-			async->buffer = malloc(async->bufsize);
-			if (!async->buffer) {
-				error_msg(ERROR_MSG_MEMORY, "async buffer");
-				pthread_mutex_lock(&md->mutex);
-				if (!md->error)
-					md->error = -ENOMEM;
-				pthread_mutex_unlock(&md->mutex);
-				pthread_exit(NULL);
-			}
+		async->buffer = malloc(async->bufsize);
+		if (!async->buffer) {
+			error_msg(ERROR_MSG_MEMORY, "async buffer");
+			set_error(md, -ENOMEM);
+			async->buffer = orig;
+			goto done;
+		}
+
+#if COMPRESSION_ZSTD
+		if (md->compress_method == COMPRESS_ZSTD) {
+			size_t zret;
 
+			zret = ZSTD_compress2(zstd_cctx, async->buffer,
+					      async->bufsize, orig, async->size);
+			if (ZSTD_isError(zret))
+				async->error = 1;
+			else
+				async->bufsize = zret;
+		} else
+#endif
+		{
 			ret = compress2(async->buffer,
-					 (unsigned long *)&async->bufsize,
-					 orig, async->size, md->compress_level);
+					(unsigned long *)&async->bufsize,
+					orig, async->size, md->compress_level);
 
 			if (ret != Z_OK)
 				async->error = 1;
-
-			free(orig);
 		}
 
-		pthread_mutex_lock(&md->mutex);
-		md->num_ready++;
-		pthread_mutex_unlock(&md->mutex);
+		free(orig);
+done:
+		__atomic_store_n(&async->done, 1, __ATOMIC_RELEASE);
+		sem_post(&md->completed);
 	}
-out:
+#if COMPRESSION_ZSTD
+	ZSTD_freeCCtx(zstd_cctx);
+#endif
 	pthread_exit(NULL);
 }
 
@@ -98,47 +283,238 @@ static void meta_cluster_init(struct metadump_struct *md, u64 start)
 {
 	struct meta_cluster_header *header;
 
-	md->num_items = 0;
-	md->num_ready = 0;
 	header = &md->cluster.header;
 	header->magic = cpu_to_le64(current_version->magic_cpu);
 	header->bytenr = cpu_to_le64(start);
 	header->nritems = cpu_to_le32(0);
-	header->compress = md->compress_level > 0 ?
-			   COMPRESS_ZLIB : COMPRESS_NONE;
+	header->compress = md->compress_method;
 }
 
-static void metadump_destroy(struct metadump_struct *md, int num_threads)
+/*
+ * Items of a cluster, written to the image once they are all compressed.
+ * The workers compress the items of the next clusters meanwhile.
+ */
+struct dump_cluster {
+	struct list_head list;
+	struct list_head items;
+};
+
+static void wait_item(struct metadump_struct *md, struct async_work *async)
 {
-	int i;
-	struct rb_node *n;
+	/*
+	 * Each item compressed posts once, so there's a post to come as long
+	 * as the item is not done.  The posts of the items done meanwhile are
+	 * consumed by the loop or the next waits.
+	 */
+	while (!__atomic_load_n(&async->done, __ATOMIC_ACQUIRE))
+		while (sem_wait(&md->completed) < 0 && errno == EINTR)
+			;
+}
 
-	pthread_mutex_lock(&md->mutex);
-	md->done = 1;
-	pthread_cond_broadcast(&md->cond);
-	pthread_mutex_unlock(&md->mutex);
+static bool cluster_done(struct dump_cluster *cluster)
+{
+	struct async_work *async;
 
+	list_for_each_entry(async, &cluster->items, ordered) {
+		if (!__atomic_load_n(&async->done, __ATOMIC_ACQUIRE))
+			return false;
+	}
+	return true;
+}
+
+static void free_items(struct metadump_struct *md, struct list_head *items)
+{
+	struct async_work *async;
+
+	while (!list_empty(items)) {
+		async = list_first_entry(items, struct async_work, ordered);
+		/* Don't free it under a worker */
+		wait_item(md, async);
+		list_del_init(&async->ordered);
+		free(async->buffer);
+		free(async);
+	}
+}
+
+/* Read @len bytes of the data extent of the item at @offset */
+static int read_data_range(struct metadump_struct *md,
+			   struct async_work *async, u64 offset, u64 len)
+{
+	struct btrfs_root *root = md->root;
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	u64 bytes_left = len;
+	u64 logical = async->start + offset;
+	u64 read_len;
+	int num_copies;
+	int ret = 0;
+
+	num_copies = btrfs_num_copies(root->fs_info, logical, bytes_left);
+
+	/*
+	 * Try our best to read data, just like read_tree_block(), from the
+	 * mirror picked by the read policy first
+	 */
+	while (bytes_left) {
+		int mirror = btrfs_read_mirror(fs_info, logical);
+
+		for (int tried = 0; tried < num_copies; tried++) {
+			read_len = bytes_left;
+			ret = read_data_from_disk(fs_info,
+					(char *)(async->buffer + offset),
+					logical, &read_len, mirror);
+			if (ret == 0)
+				break;
+			mirror = mirror % num_copies + 1;
+		}
+		if (ret < 0)
+			return -EIO;
+		offset += read_len;
+		logical += read_len;
+		bytes_left -= read_len;
+	}
+	return 0;
+}
+
+/* Piece of a data extent queued to the data readers */
+struct data_read {
+	struct async_work *async;
+	u64 offset;
+	u64 len;
+};
+
+static void *data_reader(void *data)
+{
+	struct metadump_struct *md = data;
+	struct data_read *piece;
+
+	while ((piece = work_queue_pop(&md->data_queue))) {
+		struct async_work *async = piece->async;
+
+		if (read_data_range(md, async, piece->offset, piece->len))
+			__atomic_store_n(&async->read_error, 1,
+					 __ATOMIC_RELAXED);
+		free(piece);
+		__atomic_sub_fetch(&async->reading, 1, __ATOMIC_RELEASE);
+		sem_post(&md->data_read);
+	}
+	pthread_exit(NULL);
+}
+
+/*
+ * Queue the reads of a data extent to the data readers in pieces, in the
+ * order of the walk, which follows the physical order inside the chunks.
+ * The read is waited for by read_data_extent() in the order of the items.
+ */
+static int submit_data_extent(struct metadump_struct *md,
+			      struct async_work *async)
+{
+	for (u64 offset = 0; offset < async->size; offset += DATA_READ_SIZE) {
+		struct data_read *piece;
+
+		piece = malloc(sizeof(*piece));
+		if (!piece)
+			return -ENOMEM;
+		piece->async = async;
+		piece->offset = offset;
+		piece->len = min_t(u64, async->size - offset, DATA_READ_SIZE);
+		__atomic_add_fetch(&async->reading, 1, __ATOMIC_RELAXED);
+		work_queue_push(&md->data_queue, piece);
+	}
+	return 0;
+}
+
+/* Wait for the pieces of the item queued to the readers */
+static void wait_data_extent(struct metadump_struct *md,
+			     struct async_work *async)
+{
+	/* Same as wait_item(), each piece read posts once */
+	while (__atomic_load_n(&async->reading, __ATOMIC_ACQUIRE))
+		while (sem_wait(&md->data_read) < 0 && errno == EINTR)
+			;
+}
+
+static int read_data_extent(struct metadump_struct *md,
+			    struct async_work *async)
+{
+	if (!md->num_data_readers)
+		return read_data_range(md, async, 0, async->size);
+
+	wait_data_extent(md, async);
+	return async->read_error ? -EIO : 0;
+}
+
+static void stop_workers(struct metadump_struct *md, int num_threads)
+{
+	int i;
+
+	for (i = 0; i < num_threads; i++)
+		work_queue_push(&md->queue, NULL);
 	for (i = 0; i < num_threads; i++)
 		pthread_join(md->threads[i], NULL);
+}
+
+static void stop_data_readers(struct metadump_struct *md)
+{
+	for (int i = 0; i < md->num_data_readers; i++)
+		work_queue_push(&md->data_queue, NULL);
+	for (int i = 0; i < md->num_data_readers; i++)
+		pthread_join(md->data_readers[i], NULL);
+	md->num_data_readers = 0;
+}
+
+static void metadump_destroy(struct metadump_struct *md, int num_threads)
+{
+	struct rb_node *n;
 
-	pthread_cond_destroy(&md->cond);
-	pthread_mutex_destroy(&md->mutex);
+	stop_workers(md, num_threads);
+	/* The data readers can still be reading the items */
+	stop_data_readers(md);
+	/* Left by an error */
+	while (!list_empty(&md->reading)) {
+		struct async_work *async;
 
-	while ((n = rb_first(&md->name_tree))) {
+		async = list_first_entry(&md->reading, struct async_work,
+					 ordered);
+		list_del(&async->ordered);
+		free(async->buffer);
+		free(async);
+	}
+	tree_prefetch_free(md->prefetch);
+	while (!list_empty(&md->clusters)) {
+		struct dump_cluster *cluster;
+
+		cluster = list_first_entry(&md->clusters, struct dump_cluster,
+					   list);
+		free_items(md, &cluster->items);
+		list_del(&cluster->list);
+		free(cluster);
+	}
+	free_items(md, &md->ordered);
+	work_queue_release(&md->queue);
+	if (md->data_queue.slots)
+		work_queue_release(&md->data_queue);
+	sem_destroy(&md->completed);
+	sem_destroy(&md->data_read);
+	free(md->index_items);
+
+	while ((n = rb_first(&md->name_tree.root))) {
 		struct name *name;
 
 		name = rb_entry(n, struct name, n);
-		rb_erase(n, &md->name_tree);
+		rb_erase(n, &md->name_tree.root);
 		free(name->val);
 		free(name->sub);
 		free(name);
 	}
+	pthread_mutex_destroy(&md->name_tree.lock);
 	extent_io_tree_release(&md->seen);
 }
 
 static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
-			 FILE *out, int num_threads, int compress_level,
-			 bool dump_data, enum sanitize_mode sanitize_names)
+			 FILE *out, int num_threads, int compress_method,
+			 int compress_level, bool compress_long,
+			 bool dump_data, enum sanitize_mode sanitize_names,
+			 bool index, int num_readers)
 {
 	int i, ret = 0;
 
@@ -147,19 +523,45 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 		current_version = &dump_versions[1];
 
 	memset(md, 0, sizeof(*md));
-	INIT_LIST_HEAD(&md->list);
+	INIT_LIST_HEAD(&md->reading);
 	INIT_LIST_HEAD(&md->ordered);
+	INIT_LIST_HEAD(&md->clusters);
 	extent_io_tree_init(NULL, &md->seen, 0);
 	md->root = root;
 	md->out = out;
 	md->pending_start = (u64)-1;
+	md->compress_method = compress_method;
 	md->compress_level = compress_level;
+	md->compress_long = compress_long;
 	md->sanitize_names = sanitize_names;
-	md->name_tree.rb_node = NULL;
+	md->index = index;
+	md->name_tree.root = RB_ROOT;
+	pthread_mutex_init(&md->name_tree.lock, NULL);
 	md->num_threads = num_threads;
-	pthread_cond_init(&md->cond, NULL);
-	pthread_mutex_init(&md->mutex, NULL);
-	meta_cluster_init(md, 0);
+	ret = work_queue_init(&md->queue, num_threads * WORKER_QUEUE_DEPTH);
+	if (ret < 0)
+		return ret;
+	sem_init(&md->completed, 0, 0);
+	sem_init(&md->data_read, 0, 0);
+	/* The blocks are read synchronously if the readers can't be started */
+	if (num_readers)
+		md->prefetch = tree_prefetch_alloc(root->fs_info, num_readers);
+	/* And so is the data */
+	if (dump_data && num_readers) {
+		int nr = min(num_readers, MAX_DATA_READERS);
+
+		ret = work_queue_init(&md->data_queue, nr * WORKER_QUEUE_DEPTH);
+		if (ret < 0) {
+			metadump_destroy(md, 0);
+			return ret;
+		}
+		for (i = 0; i < nr; i++) {
+			if (pthread_create(&md->data_readers[i], NULL,
+					   data_reader, md))
+				break;
+			md->num_data_readers++;
+		}
+	}
 
 	if (!num_threads)
 		return 0;
@@ -171,45 +573,11 @@ static int metadump_init(struct metadump_struct *md, struct btrfs_root *root,
 	}
 
 	if (ret)
-		metadump_destroy(md, i + 1);
+		metadump_destroy(md, i);
 
 	return ret;
 }
 
-static int read_data_extent(struct metadump_struct *md,
-			    struct async_work *async)
-{
-	struct btrfs_root *root = md->root;
-	struct btrfs_fs_info *fs_info = root->fs_info;
-	u64 bytes_left = async->size;
-	u64 logical = async->start;
-	u64 offset = 0;
-	u64 read_len;
-	int num_copies;
-	int cur_mirror;
-	int ret;
-
-	num_copies = btrfs_num_copies(root->fs_info, logical, bytes_left);
-
-	/* Try our best to read data, just like read_tree_block() */
-	for (cur_mirror = 1; cur_mirror <= num_copies; cur_mirror++) {
-		while (bytes_left) {
-			read_len = bytes_left;
-			ret = read_data_from_disk(fs_info,
-					(char *)(async->buffer + offset),
-					logical, &read_len, cur_mirror);
-			if (ret < 0)
-				break;
-			offset += read_len;
-			logical += read_len;
-			bytes_left -= read_len;
-		}
-	}
-	if (bytes_left)
-		return -EIO;
-	return 0;
-}
-
 static int get_dev_fd(struct btrfs_root *root)
 {
 	struct btrfs_device *dev;
@@ -225,39 +593,55 @@ static int write_zero(FILE *out, size_t size)
 	return fwrite(zero, size, 1, out);
 }
 
-static int write_buffers(struct metadump_struct *md, u64 *next)
+static int add_index_item(struct metadump_struct *md,
+			  struct async_work *async, u64 offset)
+{
+	struct meta_index_item *item;
+
+	if (md->index_nr == md->index_alloc) {
+		u64 alloc = max_t(u64, md->index_alloc * 2, 1024);
+
+		item = realloc(md->index_items, alloc * sizeof(*item));
+		if (!item) {
+			error_msg(ERROR_MSG_MEMORY, "image index");
+			return -ENOMEM;
+		}
+		md->index_items = item;
+		md->index_alloc = alloc;
+	}
+	item = &md->index_items[md->index_nr++];
+	item->bytenr = cpu_to_le64(async->start);
+	item->len = cpu_to_le32(async->size);
+	item->size = cpu_to_le32(async->bufsize);
+	item->offset = cpu_to_le64(offset);
+	return 0;
+}
+
+static int write_buffers(struct metadump_struct *md,
+			 struct dump_cluster *cluster)
 {
 	struct meta_cluster_header *header = &md->cluster.header;
 	struct meta_cluster_item *item;
 	struct async_work *async;
-	u64 bytenr = 0;
+	u64 bytenr = md->out_bytenr;
 	u32 nritems = 0;
 	int ret;
-	int err = 0;
-
-	if (list_empty(&md->ordered))
-		goto out;
+	int err;
 
 	/* wait until all buffers are compressed */
-	while (!err && md->num_items > md->num_ready) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&md->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&md->mutex);
-		err = md->error;
-	}
+	list_for_each_entry(async, &cluster->items, ordered)
+		wait_item(md, async);
 
+	err = __atomic_load_n(&md->error, __ATOMIC_RELAXED);
 	if (err) {
 		errno = -err;
 		error("one of the threads failed: %m");
-		goto out;
+		return err;
 	}
 
 	/* setup and write index block */
-	list_for_each_entry(async, &md->ordered, ordered) {
+	meta_cluster_init(md, bytenr);
+	list_for_each_entry(async, &cluster->items, ordered) {
 		item = &md->cluster.items[nritems];
 		item->bytenr = cpu_to_le64(async->start);
 		item->size = cpu_to_le32(async->bufsize);
@@ -272,141 +656,183 @@ static int write_buffers(struct metadump_struct *md, u64 *next)
 	}
 
 	/* write buffers */
-	bytenr += get_unaligned_le64(&header->bytenr) + IMAGE_BLOCK_SIZE;
-	while (!list_empty(&md->ordered)) {
-		async = list_entry(md->ordered.next, struct async_work,
-				   ordered);
-		list_del_init(&async->ordered);
-
+	bytenr += IMAGE_BLOCK_SIZE;
+	list_for_each_entry(async, &cluster->items, ordered) {
+		if (md->index) {
+			ret = add_index_item(md, async, bytenr);
+			if (ret < 0)
+				return ret;
+		}
 		bytenr += async->bufsize;
-		if (!err)
-			ret = fwrite(async->buffer, async->bufsize, 1,
-				     md->out);
+		ret = fwrite(async->buffer, async->bufsize, 1, md->out);
 		if (ret != 1) {
 			error("unable to write out cluster: %m");
-			err = -errno;
-			ret = 0;
+			return -errno;
 		}
-
-		free(async->buffer);
-		free(async);
 	}
 
 	/* zero unused space in the last block */
-	if (!err && bytenr & IMAGE_BLOCK_MASK) {
+	if (bytenr & IMAGE_BLOCK_MASK) {
 		size_t size = IMAGE_BLOCK_SIZE - (bytenr & IMAGE_BLOCK_MASK);
 
 		bytenr += size;
 		ret = write_zero(md->out, size);
 		if (ret != 1) {
 			error("unable to zero out buffer: %m");
-			err = -errno;
+			return -errno;
 		}
 	}
-out:
-	*next = bytenr;
-	return err;
+	md->out_bytenr = bytenr;
+	return 0;
 }
 
-static bool has_name(struct btrfs_key *key)
+/*
+ * Move the items of the cluster being filled to the list of clusters to
+ * write.  Write the clusters whose items are compressed, or all of them if
+ * @done, and wait for the oldest one if there are too many.  After an error
+ * the clusters are dropped.
+ */
+static int write_clusters(struct metadump_struct *md, bool done)
 {
-	switch (key->type) {
-	case BTRFS_DIR_ITEM_KEY:
-	case BTRFS_DIR_INDEX_KEY:
-	case BTRFS_INODE_REF_KEY:
-	case BTRFS_INODE_EXTREF_KEY:
-	case BTRFS_XATTR_ITEM_KEY:
-		return true;
-	default:
-		break;
+	struct dump_cluster *cluster;
+	int ret = 0;
+
+	if (md->num_items) {
+		cluster = malloc(sizeof(*cluster));
+		if (!cluster)
+			return -ENOMEM;
+		INIT_LIST_HEAD(&cluster->items);
+		list_splice_init(&md->ordered, &cluster->items);
+		md->num_items = 0;
+		list_add_tail(&cluster->list, &md->clusters);
+		md->num_clusters++;
 	}
 
-	return false;
+	while (!list_empty(&md->clusters)) {
+		cluster = list_first_entry(&md->clusters, struct dump_cluster,
+					   list);
+		if (!done && !ret && md->num_clusters <= MAX_PENDING_CLUSTERS &&
+		    !cluster_done(cluster))
+			break;
+		if (!ret)
+			ret = write_buffers(md, cluster);
+		free_items(md, &cluster->items);
+		list_del(&cluster->list);
+		md->num_clusters--;
+		free(cluster);
+	}
+	if (ret)
+		set_error(md, ret);
+	return ret;
 }
 
 /*
- * zero inline extents and csum items
+ * Read the tree blocks of the item, or the data extent, into its buffer.  The
+ * tree blocks are usually read ahead by the readers already.
  */
-static void zero_items(struct metadump_struct *md, u8 *dst,
-		       struct extent_buffer *src)
+static int read_item(struct metadump_struct *md, struct async_work *async)
 {
-	struct btrfs_file_extent_item *fi;
-	struct btrfs_key key;
-	u32 nritems = btrfs_header_nritems(src);
-	size_t size;
-	unsigned long ptr;
-	int i, extent_type;
+	struct extent_buffer *eb;
+	u64 start = async->start;
+	u64 size = async->size;
+	size_t offset = 0;
+	int ret;
 
-	for (i = 0; i < nritems; i++) {
-		btrfs_item_key_to_cpu(src, &key, i);
-		if (key.type == BTRFS_CSUM_ITEM_KEY) {
-			size = btrfs_item_size(src, i);
-			memset(dst + btrfs_item_nr_offset(src, 0) +
-			       btrfs_item_offset(src, i), 0, size);
-			continue;
-		}
+	if (async->data)
+		return read_data_extent(md, async);
 
-		if (md->sanitize_names && has_name(&key)) {
-			sanitize_name(md->sanitize_names, &md->name_tree, dst,
-					src, &key, i);
-			continue;
+	/*
+	 * Balance can make the mapping not cover the super block, so
+	 * just copy directly from one of the devices.
+	 */
+	if (start == BTRFS_SUPER_INFO_OFFSET) {
+		int fd = get_dev_fd(md->root);
+
+		ret = pread(fd, async->buffer, size, start);
+		if (ret < size) {
+			error("unable to read superblock at %llu: %m", start);
+			return -errno;
 		}
+		return 0;
+	}
 
-		if (key.type != BTRFS_EXTENT_DATA_KEY)
-			continue;
+	while (size > 0) {
+		struct btrfs_tree_parent_check check = { 0 };
+		u64 this_read = min((u64)md->root->fs_info->nodesize, size);
 
-		fi = btrfs_item_ptr(src, i, struct btrfs_file_extent_item);
-		extent_type = btrfs_file_extent_type(src, fi);
-		if (extent_type != BTRFS_FILE_EXTENT_INLINE)
-			continue;
+		if (md->prefetch)
+			tree_prefetch_wait(md->prefetch, start);
+		eb = read_tree_block(md->root->fs_info, start, &check);
+		if (!extent_buffer_uptodate(eb)) {
+			error("unable to read metadata block %llu", start);
+			return -EIO;
+		}
+		memcpy(async->buffer + offset, eb->data, eb->len);
+		free_extent_buffer(eb);
+		start += this_read;
+		offset += this_read;
+		size -= this_read;
+	}
+	return 0;
+}
 
-		ptr = btrfs_file_extent_inline_start(fi);
-		size = btrfs_file_extent_inline_item_len(src, i);
-		memset(dst + ptr, 0, size);
+/* Add the item read to the cluster and pass it to the workers */
+static int queue_item(struct metadump_struct *md, struct async_work *async)
+{
+	int ret = 0;
+
+	list_add_tail(&async->ordered, &md->ordered);
+	md->num_items++;
+	if (md->num_threads) {
+		work_queue_push(&md->queue, async);
+	} else {
+		transform_item(md, async);
+		async->done = 1;
 	}
+	if (md->num_items >= ITEMS_PER_CLUSTER) {
+		ret = write_clusters(md, false);
+		if (ret) {
+			errno = -ret;
+			error("unable to write buffers: %m");
+		}
+	}
+	return ret;
 }
 
 /*
- * copy buffer and zero useless data in the buffer
+ * Read the items in the order they were added, keeping MAX_READ_AHEAD_SIZE of
+ * them with the blocks queued to the readers, or all if @done.
  */
-static void copy_buffer(struct metadump_struct *md, u8 *dst, struct extent_buffer *src)
+static int read_items(struct metadump_struct *md, int done)
 {
-	int level;
-	size_t size;
-	u32 nritems;
-
-	memcpy(dst, src->data, src->len);
-	if (src->start == BTRFS_SUPER_INFO_OFFSET)
-		return;
-
-	level = btrfs_header_level(src);
-	nritems = btrfs_header_nritems(src);
+	struct async_work *async;
+	int ret;
 
-	if (nritems == 0) {
-		size = sizeof(struct btrfs_header);
-		memset(dst + size, 0, src->len - size);
-	} else if (level == 0) {
-		size = btrfs_item_nr_offset(src, 0) +
-			btrfs_item_offset(src, nritems - 1) -
-			btrfs_item_nr_offset(src, nritems);
-		memset(dst + btrfs_item_nr_offset(src, nritems), 0, size);
-		zero_items(md, dst, src);
-	} else {
-		size = offsetof(struct btrfs_node, ptrs) +
-			sizeof(struct btrfs_key_ptr) * nritems;
-		memset(dst + size, 0, src->len - size);
+	while (!list_empty(&md->reading)) {
+		if (!done && (md->prefetch || md->num_data_readers) &&
+		    md->reading_size <= MAX_READ_AHEAD_SIZE)
+			break;
+		async = list_first_entry(&md->reading, struct async_work,
+					 ordered);
+		list_del_init(&async->ordered);
+		md->reading_size -= async->size;
+		ret = read_item(md, async);
+		if (ret) {
+			free(async->buffer);
+			free(async);
+			return ret;
+		}
+		ret = queue_item(md, async);
+		if (ret)
+			return ret;
 	}
-	csum_block(dst, src->len);
+	return 0;
 }
 
 static int flush_pending(struct metadump_struct *md, int done)
 {
-	struct async_work *async = NULL;
-	struct extent_buffer *eb;
-	u64 start = 0;
-	u64 size;
-	size_t offset;
-	int ret = 0;
+	struct async_work *async;
+	int ret;
 
 	if (md->pending_size) {
 		async = calloc(1, sizeof(*async));
@@ -416,60 +842,35 @@ static int flush_pending(struct metadump_struct *md, int done)
 		async->start = md->pending_start;
 		async->size = md->pending_size;
 		async->bufsize = async->size;
+		async->data = md->data;
 		async->buffer = malloc(async->bufsize);
 		if (!async->buffer) {
 			free(async);
 			return -ENOMEM;
 		}
-		offset = 0;
-		start = async->start;
-		size = async->size;
 
-		if (md->data) {
-			ret = read_data_extent(md, async);
-			if (ret) {
+		if (async->data && md->num_data_readers) {
+			ret = submit_data_extent(md, async);
+			if (ret < 0) {
+				/* Wait for the pieces queued before freeing */
+				wait_data_extent(md, async);
 				free(async->buffer);
 				free(async);
 				return ret;
 			}
 		}
-
-		/*
-		 * Balance can make the mapping not cover the super block, so
-		 * just copy directly from one of the devices.
-		 */
-		if (start == BTRFS_SUPER_INFO_OFFSET) {
-			int fd = get_dev_fd(md->root);
-
-			ret = pread(fd, async->buffer, size, start);
-			if (ret < size) {
-				free(async->buffer);
-				free(async);
-				error("unable to read superblock at %llu: %m", start);
-				return -errno;
-			}
-			size = 0;
-			ret = 0;
-		}
-
-		while (!md->data && size > 0) {
-			struct btrfs_tree_parent_check check = { 0 };
-			u64 this_read = min((u64)md->root->fs_info->nodesize,
-					size);
-
-			eb = read_tree_block(md->root->fs_info, start, &check);
-			if (!extent_buffer_uptodate(eb)) {
-				free(async->buffer);
-				free(async);
-				error("unable to read metadata block %llu", start);
-				return -EIO;
-			}
-			copy_buffer(md, async->buffer + offset, eb);
-			free_extent_buffer(eb);
-			start += this_read;
-			offset += this_read;
-			size -= this_read;
+		/* Errors are reported by the read of the item */
+		if (md->prefetch && !async->data &&
+		    async->start != BTRFS_SUPER_INFO_OFFSET) {
+			u32 nodesize = md->root->fs_info->nodesize;
+
+			for (u64 bytenr = async->start;
+			     bytenr < async->start + async->size;
+			     bytenr += nodesize)
+				tree_prefetch_submit(md->prefetch, bytenr, 0);
 		}
+		list_add_tail(&async->ordered, &md->reading);
+		md->reading_size += async->size;
 
 		md->pending_start = (u64)-1;
 		md->pending_size = 0;
@@ -477,30 +878,108 @@ static int flush_pending(struct metadump_struct *md, int done)
 		return 0;
 	}
 
-	pthread_mutex_lock(&md->mutex);
-	if (async) {
-		list_add_tail(&async->ordered, &md->ordered);
-		md->num_items++;
-		if (md->compress_level > 0) {
-			list_add_tail(&async->list, &md->list);
-			pthread_cond_signal(&md->cond);
-		} else {
-			md->num_ready++;
-		}
-	}
-	if (md->num_items >= ITEMS_PER_CLUSTER || done) {
-		ret = write_buffers(md, &start);
-		if (ret) {
-			errno = -ret;
-			error("unable to write buffers: %m");
-		} else {
-			meta_cluster_init(md, start);
-		}
+	ret = read_items(md, done);
+	if (ret || !done)
+		return ret;
+
+	ret = write_clusters(md, true);
+	if (ret) {
+		errno = -ret;
+		error("unable to write buffers: %m");
 	}
-	pthread_mutex_unlock(&md->mutex);
 	return ret;
 }
 
+static int index_item_cmp(const void *a, const void *b)
+{
+	const struct meta_index_item *ia = a;
+	const struct meta_index_item *ib = b;
+
+	if (le64_to_cpu(ia->bytenr) < le64_to_cpu(ib->bytenr))
+		return -1;
+	if (le64_to_cpu(ia->bytenr) > le64_to_cpu(ib->bytenr))
+		return 1;
+	return 0;
+}
+
+/* Write the index of the items after the last cluster */
+static int write_index(struct metadump_struct *md)
+{
+	union {
+		struct meta_index_header header;
+		char bytes[IMAGE_BLOCK_SIZE];
+	} block = { 0 };
+	size_t size = md->index_nr * sizeof(struct meta_index_item);
+	int ret;
+
+	if (md->index_nr)
+		qsort(md->index_items, md->index_nr,
+		      sizeof(struct meta_index_item), index_item_cmp);
+
+	block.header.magic = cpu_to_le64(IMAGE_INDEX_MAGIC);
+	block.header.bytenr = cpu_to_le64(md->out_bytenr);
+	block.header.nritems = cpu_to_le64(md->index_nr);
+	block.header.csum = cpu_to_le32(~crc32c(~(u32)0, (u8 *)md->index_items,
+						 size));
+
+	ret = fwrite(&block, IMAGE_BLOCK_SIZE, 1, md->out);
+	if (ret == 1 && size)
+		ret = fwrite(md->index_items, size, 1, md->out);
+	if (ret == 1 && (size & IMAGE_BLOCK_MASK))
+		ret = write_zero(md->out, IMAGE_BLOCK_SIZE -
+				 (size & IMAGE_BLOCK_MASK));
+	if (ret == 1)
+		ret = fwrite(&block, IMAGE_BLOCK_SIZE, 1, md->out);
+	if (ret != 1) {
+		error("unable to write out the index: %m");
+		return -errno;
+	}
+	return 0;
+}
+
+/*
+ * Start a delta of the image of generation @base, the blocks and extents not
+ * newer are left out.  The fsid of @base is not checked if it's not set.
+ */
+static int write_delta_header(struct metadump_struct *md,
+			      const struct image_info *base)
+{
+	struct btrfs_super_block *super = md->root->fs_info->super_copy;
+	static const u8 zero_fsid[BTRFS_FSID_SIZE];
+	union {
+		struct meta_delta_header header;
+		char bytes[IMAGE_BLOCK_SIZE];
+	} block = { 0 };
+	int ret;
+
+	if (memcmp(base->fsid, zero_fsid, BTRFS_FSID_SIZE) &&
+	    memcmp(base->fsid, super->fsid, BTRFS_FSID_SIZE)) {
+		error("the base image is not of the filesystem dumped");
+		return -EINVAL;
+	}
+	if (base->generation > btrfs_super_generation(super)) {
+		error("the base generation %llu is newer than the filesystem %llu",
+		      base->generation, btrfs_super_generation(super));
+		return -EINVAL;
+	}
+
+	block.header.magic = cpu_to_le64(IMAGE_DELTA_MAGIC);
+	block.header.bytenr = 0;
+	memcpy(block.header.fsid, super->fsid, BTRFS_FSID_SIZE);
+	block.header.base_generation = cpu_to_le64(base->generation);
+	block.header.generation = cpu_to_le64(btrfs_super_generation(super));
+	block.header.csum = cpu_to_le32(~crc32c(~(u32)0, (u8 *)&block.header,
+				offsetof(struct meta_delta_header, csum)));
+	ret = fwrite(&block, IMAGE_BLOCK_SIZE, 1, md->out);
+	if (ret != 1) {
+		error("unable to write out the delta header: %m");
+		return -errno;
+	}
+	md->out_bytenr = IMAGE_BLOCK_SIZE;
+	md->min_generation = base->generation;
+	return 0;
+}
+
 static int add_extent(u64 start, u64 size, struct metadump_struct *md,
 		      int data)
 {
@@ -513,81 +992,139 @@ static int add_extent(u64 start, u64 size, struct metadump_struct *md,
 			return ret;
 		md->pending_start = start;
 	}
-	readahead_tree_block(md->root->fs_info, start, 0);
+	if (!md->prefetch)
+		readahead_tree_block(md->root->fs_info, start, 0);
 	md->pending_size += size;
 	md->data = data;
 	return 0;
 }
 
-static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
-			    struct metadump_struct *metadump, int root_tree)
+struct copy_tree_walk {
+	struct metadump_struct *metadump;
+	int root_tree;
+	/* Subtrees not newer are skipped, for a delta */
+	u64 min_generation;
+	/* Root nodes referenced by root items found in a root tree walk */
+	u64 *roots;
+	size_t nr_roots;
+};
+
+static int add_tree_block(struct metadump_struct *metadump, u64 bytenr)
 {
-	struct extent_buffer *tmp;
-	struct btrfs_root_item *ri;
-	struct btrfs_key key;
-	struct btrfs_fs_info *fs_info = root->fs_info;
-	struct btrfs_tree_parent_check check = { 0 };
-	u64 bytenr;
-	int level;
-	int nritems = 0;
-	int i = 0;
+	struct btrfs_fs_info *fs_info = metadump->root->fs_info;
 	int ret;
 
-	bytenr = btrfs_header_bytenr(eb);
 	if (test_range_bit(&metadump->seen, bytenr,
 			   bytenr + fs_info->nodesize - 1, EXTENT_DIRTY, 1,
 			   NULL))
-		return 0;
+		return TREE_WALK_SKIP_CHILDREN;
 
 	set_extent_dirty(&metadump->seen, bytenr,
 			 bytenr + fs_info->nodesize - 1, GFP_NOFS);
 
-	ret = add_extent(btrfs_header_bytenr(eb), fs_info->nodesize,
-			 metadump, 0);
+	ret = add_extent(bytenr, fs_info->nodesize, metadump, 0);
 	if (ret) {
-		error("unable to add metadata block %llu: %d",
-				btrfs_header_bytenr(eb), ret);
+		error("unable to add metadata block %llu: %d", bytenr, ret);
 		return ret;
 	}
+	return 0;
+}
 
-	if (btrfs_header_level(eb) == 0 && !root_tree)
-		return 0;
+static int copy_tree_block(struct extent_buffer *eb, void *priv)
+{
+	struct copy_tree_walk *ctw = priv;
+	int nritems = btrfs_header_nritems(eb);
+	int level = btrfs_header_level(eb);
+	int ret;
 
-	level = btrfs_header_level(eb);
-	nritems = btrfs_header_nritems(eb);
-	for (i = 0; i < nritems; i++) {
-		if (level == 0) {
-			btrfs_item_key_to_cpu(eb, &key, i);
-			if (key.type != BTRFS_ROOT_ITEM_KEY)
+	/* Nothing below a block was changed since it was written */
+	if (btrfs_header_generation(eb) <= ctw->min_generation)
+		return TREE_WALK_SKIP_CHILDREN;
+	ret = add_tree_block(ctw->metadump, btrfs_header_bytenr(eb));
+	if (ret)
+		return ret;
+
+	/* Leaves of other than root trees are not read, only added */
+	if (level == 1 && !ctw->root_tree) {
+		for (int i = 0; i < nritems; i++) {
+			if (btrfs_node_ptr_generation(eb, i) <=
+			    ctw->min_generation)
 				continue;
-			ri = btrfs_item_ptr(eb, i, struct btrfs_root_item);
-			bytenr = btrfs_disk_root_bytenr(eb, ri);
-			tmp = read_tree_block(fs_info, bytenr, &check);
-			if (!extent_buffer_uptodate(tmp)) {
-				error("unable to read log root block");
-				return -EIO;
-			}
-			ret = copy_tree_blocks(root, tmp, metadump, 0);
-			free_extent_buffer(tmp);
-			if (ret)
-				return ret;
-		} else {
-			bytenr = btrfs_node_blockptr(eb, i);
-			tmp = read_tree_block(fs_info, bytenr, &check);
-			if (!extent_buffer_uptodate(tmp)) {
-				error("unable to read log root block");
-				return -EIO;
-			}
-			ret = copy_tree_blocks(root, tmp, metadump, root_tree);
-			free_extent_buffer(tmp);
-			if (ret)
+			ret = add_tree_block(ctw->metadump,
+					     btrfs_node_blockptr(eb, i));
+			if (ret < 0)
 				return ret;
 		}
+		return 0;
 	}
+	if (level > 0 || !ctw->root_tree)
+		return 0;
+
+	for (int i = 0; i < nritems; i++) {
+		struct btrfs_root_item *ri;
+		struct btrfs_key key;
+		u64 *roots;
 
+		btrfs_item_key_to_cpu(eb, &key, i);
+		if (key.type != BTRFS_ROOT_ITEM_KEY)
+			continue;
+		roots = realloc(ctw->roots, (ctw->nr_roots + 1) * sizeof(u64));
+		if (!roots)
+			return -ENOMEM;
+		ri = btrfs_item_ptr(eb, i, struct btrfs_root_item);
+		roots[ctw->nr_roots++] = btrfs_disk_root_bytenr(eb, ri);
+		ctw->roots = roots;
+	}
 	return 0;
 }
 
+/*
+ * Add all blocks of the tree at @eb, the tree blocks are read in physical
+ * order. For root trees (@root_tree set) the trees referenced by the root
+ * items are added too.
+ */
+static int copy_tree_blocks(struct btrfs_root *root, struct extent_buffer *eb,
+			    struct metadump_struct *metadump, int root_tree)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct copy_tree_walk ctw = {
+		.metadump = metadump,
+		.root_tree = root_tree,
+		.min_generation = metadump->min_generation,
+	};
+	int ret;
+
+	/* A delta has the whole chunk tree, its items are mapped by it */
+	if (btrfs_header_owner(eb) == BTRFS_CHUNK_TREE_OBJECTID)
+		ctw.min_generation = 0;
+
+	ret = btrfs_walk_tree_physical(eb, root_tree ? 0 : 1, 0,
+				       copy_tree_block, &ctw);
+	if (ret < 0)
+		goto out;
+
+	ctw.root_tree = 0;
+	for (size_t i = 0; i < ctw.nr_roots; i++) {
+		struct btrfs_tree_parent_check check = { 0 };
+		struct extent_buffer *tmp;
+
+		tmp = read_tree_block(fs_info, ctw.roots[i], &check);
+		if (!extent_buffer_uptodate(tmp)) {
+			error("unable to read log root block");
+			ret = -EIO;
+			goto out;
+		}
+		ret = btrfs_walk_tree_physical(tmp, 1, 0, copy_tree_block, &ctw);
+		free_extent_buffer(tmp);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	free(ctw.roots);
+	return ret;
+}
+
 static int copy_log_trees(struct btrfs_root *root,
 			  struct metadump_struct *metadump)
 {
@@ -651,7 +1188,9 @@ static int copy_space_cache(struct btrfs_root *root,
 		fi = btrfs_item_ptr(leaf, path->slots[0],
 				    struct btrfs_file_extent_item);
 		if (btrfs_file_extent_type(leaf, fi) !=
-		    BTRFS_FILE_EXTENT_REG) {
+		    BTRFS_FILE_EXTENT_REG ||
+		    btrfs_file_extent_generation(leaf, fi) <=
+		    metadump->min_generation) {
 			path->slots[0]++;
 			continue;
 		}
@@ -687,6 +1226,7 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 	key.type = BTRFS_EXTENT_ITEM_KEY;
 	key.offset = 0;
 
+	path->reada = READA_FORWARD;
 	ret = btrfs_search_slot(NULL, extent_root, &key, path, 0, 0);
 	if (ret < 0) {
 		error("extent root not found: %d", ret);
@@ -735,16 +1275,24 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 		if (btrfs_item_size(leaf, path->slots[0]) >= sizeof(*ei)) {
 			ei = btrfs_item_ptr(leaf, path->slots[0],
 					    struct btrfs_extent_item);
-			if (btrfs_extent_flags(leaf, ei) &
-			    BTRFS_EXTENT_FLAG_TREE_BLOCK ||
-			    (dump_data && (btrfs_extent_flags(leaf, ei) &
-					   BTRFS_EXTENT_FLAG_DATA))) {
+			/* A delta has only the extents newer than its base */
+			if (btrfs_extent_generation(leaf, ei) >
+			    metadump->min_generation &&
+			    (btrfs_extent_flags(leaf, ei) &
+			     BTRFS_EXTENT_FLAG_TREE_BLOCK ||
+			     (dump_data && (btrfs_extent_flags(leaf, ei) &
+					    BTRFS_EXTENT_FLAG_DATA)))) {
 				bool is_data;
 
 				is_data = btrfs_extent_flags(leaf, ei) &
 					  BTRFS_EXTENT_FLAG_DATA;
-				ret = add_extent(bytenr, num_bytes, metadump,
-						 is_data);
+				/* The chunk tree blocks are already added */
+				if (is_data ||
+				    !test_range_bit(&metadump->seen, bytenr,
+						    bytenr + num_bytes - 1,
+						    EXTENT_DIRTY, 1, NULL))
+					ret = add_extent(bytenr, num_bytes,
+							 metadump, is_data);
 				if (ret) {
 					error("unable to add block %llu: %d",
 						bytenr, ret);
@@ -766,8 +1314,10 @@ static int copy_from_extent_tree(struct metadump_struct *metadump,
 }
 
 int create_metadump(const char *input, FILE *out, int num_threads,
-		    int compress_level, enum sanitize_mode sanitize,
-		    int walk_trees, bool dump_data)
+		    int compress_method, int compress_level, bool compress_long,
+		    enum sanitize_mode sanitize, int walk_trees, bool dump_data,
+		    bool index, int num_readers, const struct image_info *base,
+		    const char *sanitize_cache)
 {
 	struct btrfs_root *root;
 	struct btrfs_path path = { 0 };
@@ -776,20 +1326,38 @@ int create_metadump(const char *input, FILE *out, int num_threads,
 	int err = 0;
 
 	root = open_ctree(input, 0, OPEN_CTREE_ALLOW_TRANSID_MISMATCH |
-			  OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS);
+			  OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS |
+			  OPEN_CTREE_LAZY_BLOCK_GROUPS);
 	if (!root) {
 		error("open ctree failed");
 		return -EIO;
 	}
 
 	ret = metadump_init(&metadump, root, out, num_threads,
-			    compress_level, dump_data, sanitize);
+			    compress_method, compress_level, compress_long,
+			    dump_data, sanitize, index, num_readers);
 	if (ret) {
 		error("failed to initialize metadump: %d", ret);
 		close_ctree(root);
 		return ret;
 	}
 
+	if (sanitize_cache) {
+		ret = sanitize_cache_load(&metadump.name_tree.root, sanitize_cache);
+		if (ret) {
+			err = ret;
+			goto out;
+		}
+	}
+
+	if (base) {
+		ret = write_delta_header(&metadump, base);
+		if (ret) {
+			err = ret;
+			goto out;
+		}
+	}
+
 	ret = add_extent(BTRFS_SUPER_INFO_OFFSET, BTRFS_SUPER_INFO_SIZE,
 			&metadump, 0);
 	if (ret) {
@@ -813,6 +1381,17 @@ int create_metadump(const char *input, FILE *out, int num_threads,
 			goto out;
 		}
 	} else {
+		/*
+		 * The chunk tree goes first so a restore from a stream does
+		 * not have to hold back the items to find it.
+		 */
+		ret = copy_tree_blocks(root, root->fs_info->chunk_root->node,
+				       &metadump, 0);
+		if (ret) {
+			err = ret;
+			goto out;
+		}
+
 		ret = copy_from_extent_tree(&metadump, &path, dump_data);
 		if (ret) {
 			err = ret;
@@ -834,6 +1413,16 @@ out:
 			err = ret;
 		error("failed to flush pending data: %d", ret);
 	}
+	if (!err && index) {
+		ret = write_index(&metadump);
+		if (ret)
+			err = ret;
+	}
+	if (!err && sanitize_cache) {
+		ret = sanitize_cache_save(&metadump.name_tree.root, sanitize_cache);
+		if (ret)
+			err = ret;
+	}
 
 	metadump_destroy(&metadump, num_threads);
 
@@ -17,6 +17,7 @@
 #include "kerncompat.h"
 #include <sys/stat.h>
 #include <linux/fs.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -27,6 +28,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
 #include "kernel-lib/list.h"
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
@@ -41,15 +45,36 @@
 #include "kernel-shared/tree-checker.h"
 #include "common/internal.h"
 #include "common/messages.h"
+#include "common/device-utils.h"
 #include "common/extent-cache.h"
+#include "crypto/crc32c.h"
 #include "image/common.h"
 #include "image/metadump.h"
 
-static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
+static void set_error(struct mdrestore_struct *mdres, int error)
+{
+	int old = 0;
+
+	__atomic_compare_exchange_n(&mdres->error, &old, error, false,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Let the workers finish the queued items and exit */
+static void stop_workers(struct mdrestore_struct *mdres)
 {
-	struct rb_node *n;
 	int i;
 
+	for (i = 0; i < mdres->num_threads; i++)
+		work_queue_push(&mdres->queue, NULL);
+	for (i = 0; i < mdres->num_threads; i++)
+		pthread_join(mdres->threads[i], NULL);
+	mdres->num_threads = 0;
+}
+
+static void mdrestore_destroy(struct mdrestore_struct *mdres)
+{
+	struct rb_node *n;
+
 	while ((n = rb_first(&mdres->chunk_tree))) {
 		struct fs_chunk *entry;
 
@@ -59,16 +84,26 @@ static void mdrestore_destroy(struct mdrestore_struct *mdres, int num_threads)
 		free(entry);
 	}
 	free_extent_cache_tree(&mdres->sys_chunks);
-	pthread_mutex_lock(&mdres->mutex);
-	mdres->done = 1;
-	pthread_cond_broadcast(&mdres->cond);
-	pthread_mutex_unlock(&mdres->mutex);
-
-	for (i = 0; i < num_threads; i++)
-		pthread_join(mdres->threads[i], NULL);
-
-	pthread_cond_destroy(&mdres->cond);
+	free_extent_cache_tree(&mdres->chunk_blocks);
+	free_extent_cache_tree(&mdres->chunk_pending);
+	stop_workers(mdres);
+	if (mdres->super_item) {
+		free(mdres->super_item->buffer);
+		free(mdres->super_item);
+	}
+	while (!list_empty(&mdres->list)) {
+		struct async_work *async;
+
+		async = list_first_entry(&mdres->list, struct async_work, list);
+		list_del(&async->list);
+		free(async->buffer);
+		free(async);
+	}
+	work_queue_release(&mdres->queue);
 	pthread_mutex_destroy(&mdres->mutex);
+	free(mdres->chunk_buffer);
+	free(mdres->index);
+	free(mdres->index_buffer);
 	free(mdres->original_super);
 }
 
@@ -107,7 +142,7 @@ static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size)
 {
 	struct extent_buffer *eb;
 
-	eb = calloc(1, sizeof(struct extent_buffer) + size);
+	eb = alloc_extent_buffer_inline(size);
 	if (!eb)
 		return NULL;
 
@@ -168,8 +203,7 @@ static u64 logical_to_physical(struct mdrestore_struct *mdres, u64 logical,
 	search.logical = logical;
 	entry = tree_search(&mdres->chunk_tree, &search.l, chunk_cmp, 1);
 	if (!entry) {
-		if (mdres->in != stdin)
-			warning("cannot find a chunk, using logical");
+		warning("cannot find a chunk, using logical");
 		return logical;
 	}
 	fs_chunk = rb_entry(entry, struct fs_chunk, l);
@@ -396,6 +430,242 @@ static void update_super_old(u8 *buffer)
 	csum_block(buffer, BTRFS_SUPER_INFO_SIZE);
 }
 
+/*
+ * Set the compression method of the items of the cluster, from its header.
+ */
+static int set_compress_method(struct mdrestore_struct *mdres,
+			       struct meta_cluster_header *header)
+{
+	switch (header->compress) {
+	case COMPRESS_NONE:
+	case COMPRESS_ZLIB:
+		break;
+	case COMPRESS_ZSTD:
+#if !COMPRESSION_ZSTD
+		error("image compressed by zstd but the support is not compiled in");
+		return -EOPNOTSUPP;
+#endif
+		break;
+	default:
+		error("unknown compression method in metadump image: %u",
+		      header->compress);
+		return -EINVAL;
+	}
+	mdres->compress_method = header->compress;
+	return 0;
+}
+
+/*
+ * Writes of a worker to the target devices.  The physically adjacent blocks
+ * are gathered and written by one call.  Each device has two streams, the
+ * second copy of DUP has a stream of its own so the copies don't break each
+ * other's runs.  The buffers are allocated on the first write to the stream.
+ */
+#define RESTORE_WRITE_SIZE	SZ_1M
+
+struct restore_stream {
+	int fd;
+	u8 *buffer;
+	u64 start;
+	u32 len;
+};
+
+struct restore_writer {
+	int nr_streams;
+	struct restore_stream *streams;
+};
+
+static int restore_pwrite(int fd, const u8 *buffer, u64 len, u64 bytenr)
+{
+	ssize_t ret;
+
+	ret = btrfs_pwrite(fd, buffer, len, bytenr, false);
+	if (ret == len)
+		return 0;
+	if (ret < 0) {
+		ret = -errno;
+		error("unable to write to device: %m");
+		return ret;
+	}
+	error("short write");
+	return -EIO;
+}
+
+/*
+ * The first pass writes to the output only, the fixup pass of a multi-device
+ * restore writes to all the devices of the opened filesystem.
+ */
+static int restore_writer_init(struct restore_writer *writer,
+			       struct mdrestore_struct *mdres)
+{
+	struct btrfs_device *device;
+	int nr_devices = 1;
+	int i = 0;
+
+	memset(writer, 0, sizeof(*writer));
+	if (mdres->fixup_offset)
+		nr_devices = mdres->info->fs_devices->num_devices;
+	writer->streams = calloc(nr_devices * 2, sizeof(*writer->streams));
+	if (!writer->streams)
+		return -ENOMEM;
+	writer->nr_streams = nr_devices * 2;
+
+	if (!mdres->fixup_offset) {
+		writer->streams[0].fd = fileno(mdres->out);
+		writer->streams[1].fd = fileno(mdres->out);
+		return 0;
+	}
+	list_for_each_entry(device, &mdres->info->fs_devices->devices, dev_list) {
+		if (i == writer->nr_streams)
+			break;
+		writer->streams[i++].fd = device->fd;
+		writer->streams[i++].fd = device->fd;
+	}
+	/* Not all devices are listed, the rest is written directly */
+	writer->nr_streams = i;
+	return 0;
+}
+
+static int restore_writer_flush(struct restore_writer *writer)
+{
+	int ret = 0;
+
+	for (int i = 0; i < writer->nr_streams; i++) {
+		struct restore_stream *stream = &writer->streams[i];
+
+		if (stream->len && !ret)
+			ret = restore_pwrite(stream->fd, stream->buffer,
+					     stream->len, stream->start);
+		stream->len = 0;
+	}
+	return ret;
+}
+
+static void restore_writer_release(struct restore_writer *writer)
+{
+	for (int i = 0; i < writer->nr_streams; i++)
+		free(writer->streams[i].buffer);
+	free(writer->streams);
+}
+
+static struct restore_stream *restore_stream(struct restore_writer *writer,
+					     int fd, int copy)
+{
+	struct restore_stream *stream;
+
+	for (int i = 0; i < writer->nr_streams; i += 2) {
+		if (writer->streams[i].fd != fd)
+			continue;
+		stream = &writer->streams[i + copy];
+		if (!stream->buffer)
+			stream->buffer = malloc(RESTORE_WRITE_SIZE);
+		return stream->buffer ? stream : NULL;
+	}
+	return NULL;
+}
+
+/* Write directly without @writer or a stream for @fd */
+static int restore_write(struct restore_writer *writer, int fd, int copy,
+			 const u8 *buffer, u64 len, u64 bytenr)
+{
+	struct restore_stream *stream = NULL;
+	int ret;
+
+	if (writer)
+		stream = restore_stream(writer, fd, copy);
+	if (!stream)
+		return restore_pwrite(fd, buffer, len, bytenr);
+
+	if (stream->len && (bytenr != stream->start + stream->len ||
+			    stream->len + len > RESTORE_WRITE_SIZE)) {
+		ret = restore_pwrite(fd, stream->buffer, stream->len,
+				     stream->start);
+		stream->len = 0;
+		if (ret < 0)
+			return ret;
+	}
+	if (len >= RESTORE_WRITE_SIZE)
+		return restore_pwrite(fd, buffer, len, bytenr);
+	if (!stream->len)
+		stream->start = bytenr;
+	memcpy(stream->buffer + stream->len, buffer, len);
+	stream->len += len;
+	return 0;
+}
+
+/*
+ * Write @len bytes at @logical to the devices of the multi-device target.
+ * Only the chunk mapping is done under the lock, the stripes are written by
+ * the workers concurrently, each device has its streams in @writer.
+ *
+ * RAID56 needs the parity of the whole stripe and the zoned devices need the
+ * writes in order, those are written by write_data_to_disk() under the lock.
+ */
+static int restore_write_mapped(struct mdrestore_struct *mdres,
+				struct restore_writer *writer,
+				const u8 *buffer, u64 logical, u64 len)
+{
+	struct btrfs_fs_info *info = mdres->info;
+	int ret = 0;
+
+	if (info->zoned) {
+		pthread_mutex_lock(&mdres->mutex);
+		ret = write_data_to_disk(info, buffer, logical, len);
+		pthread_mutex_unlock(&mdres->mutex);
+		return ret;
+	}
+
+	while (len) {
+		struct btrfs_multi_bio *multi = NULL;
+		u64 *raid_map = NULL;
+		u64 this_len = len;
+
+		pthread_mutex_lock(&mdres->mutex);
+		ret = btrfs_map_block(info, WRITE, logical, &this_len, &multi,
+				      0, &raid_map);
+		if (!ret && raid_map) {
+			this_len = min(this_len, len);
+			ret = write_data_to_disk(info, buffer, logical,
+						 this_len);
+			kfree(raid_map);
+			kfree(multi);
+			multi = NULL;
+		}
+		pthread_mutex_unlock(&mdres->mutex);
+		if (ret) {
+			error("failed to write logical %llu: %d", logical, ret);
+			return ret < 0 ? ret : -EIO;
+		}
+		this_len = min(this_len, len);
+
+		for (int i = 0; multi && i < multi->num_stripes; i++) {
+			struct btrfs_bio_stripe *stripe = &multi->stripes[i];
+			int copy = 0;
+
+			if (stripe->dev->fd < 0) {
+				error("device %llu is missing", stripe->dev->devid);
+				ret = -EIO;
+				break;
+			}
+			/* DUP, both copies are on the same device */
+			for (int j = 0; j < i; j++)
+				if (multi->stripes[j].dev == stripe->dev)
+					copy = 1;
+			ret = restore_write(writer, stripe->dev->fd, copy,
+					    buffer, this_len, stripe->physical);
+			if (ret < 0)
+				break;
+		}
+		kfree(multi);
+		if (ret < 0)
+			return ret;
+		buffer += this_len;
+		logical += this_len;
+		len -= this_len;
+	}
+	return 0;
+}
+
 /*
  * Restore one item.
  *
@@ -403,18 +673,28 @@ static void update_super_old(u8 *buffer)
  * For compressed data, since we can have very large decompressed data
  * (up to 256M), we need to consider memory usage. So here we will fill buffer
  * then write the decompressed buffer to output.
+ *
+ * Called by the workers without a lock, except for the superblock which is
+ * restored before the other items are queued, without @writer.
  */
 static int restore_one_work(struct mdrestore_struct *mdres,
-			    struct async_work *async, u8 *buffer, int bufsize)
+			    struct async_work *async, u8 *buffer, int bufsize,
+			    struct restore_writer *writer)
 {
 	z_stream strm;
+#if COMPRESSION_ZSTD
+	ZSTD_DStream *zstd_strm = NULL;
+	ZSTD_inBuffer zstd_in = { async->buffer, async->bufsize, 0 };
+	ZSTD_outBuffer zstd_out = { buffer, bufsize, 0 };
+	size_t zret;
+#endif
 	/* Offset inside work->buffer */
 	int buf_offset = 0;
 	/* Offset for output */
 	int out_offset = 0;
 	int out_len;
 	int outfd = fileno(mdres->out);
-	int compress_method = mdres->compress_method;
+	int compress_method = async->compress;
 	int ret;
 
 	UASSERT(is_power_of_2(bufsize));
@@ -433,6 +713,23 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 			return ret;
 		}
 	}
+#if COMPRESSION_ZSTD
+	if (compress_method == COMPRESS_ZSTD) {
+		zstd_strm = ZSTD_createDStream();
+		if (!zstd_strm) {
+			error_msg(ERROR_MSG_MEMORY, "zstd stream");
+			return -ENOMEM;
+		}
+		zret = ZSTD_DCtx_setParameter(zstd_strm, ZSTD_d_windowLogMax,
+					      ZSTD_LONG_WINDOW_LOG);
+		if (ZSTD_isError(zret)) {
+			error("failed to initialize decompress parameters: %s",
+			      ZSTD_getErrorName(zret));
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+#endif
 	while (buf_offset < async->bufsize) {
 		bool compress_end = false;
 		int read_size = min_t(u64, async->bufsize - buf_offset, bufsize);
@@ -443,15 +740,14 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 				strm.avail_out = bufsize;
 				strm.next_out = buffer;
 			}
-			pthread_mutex_unlock(&mdres->mutex);
 			ret = inflate(&strm, Z_NO_FLUSH);
-			pthread_mutex_lock(&mdres->mutex);
 			switch (ret) {
 			case Z_NEED_DICT:
 				ret = Z_DATA_ERROR;
 				fallthrough;
 			case Z_DATA_ERROR:
 			case Z_MEM_ERROR:
+				error("decompression failed with %d", ret);
 				goto out;
 			}
 			if (ret == Z_STREAM_END) {
@@ -459,6 +755,28 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 				compress_end = true;
 			}
 			out_len = bufsize - strm.avail_out;
+#if COMPRESSION_ZSTD
+		} else if (compress_method == COMPRESS_ZSTD) {
+			zstd_out.pos = 0;
+			zret = ZSTD_decompressStream(zstd_strm, &zstd_out,
+						     &zstd_in);
+			if (ZSTD_isError(zret)) {
+				error("decompression failed: %s",
+				      ZSTD_getErrorName(zret));
+				ret = -EIO;
+				goto out;
+			}
+			if (zret == 0) {
+				compress_end = true;
+			} else if (zstd_in.pos == zstd_in.size &&
+				   zstd_out.pos < zstd_out.size) {
+				error("decompression failed: truncated item");
+				ret = -EIO;
+				goto out;
+			}
+			ret = 0;
+			out_len = zstd_out.pos;
+#endif
 		} else {
 			/* No compress, read as much data as possible */
 			memcpy(buffer, async->buffer + buf_offset, read_size);
@@ -479,7 +797,7 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 					if (ret < 0)
 						goto out;
 				}
-			} else if (!mdres->old_restore) {
+			} else if (!mdres->old_restore && !async->base) {
 				ret = fixup_chunk_tree_block(mdres, async,
 							     buffer, out_len);
 				if (ret)
@@ -505,23 +823,28 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 				else
 					bytenr = logical;
 
-				ret = pwrite(outfd, buffer + offset, chunk_size, bytenr);
-				if (ret != chunk_size)
-					goto write_error;
+				ret = restore_write(writer, outfd, 0,
+						    buffer + offset, chunk_size,
+						    bytenr);
+				if (ret < 0)
+					goto out;
 
-				if (physical_dup)
-					ret = pwrite(outfd, buffer + offset,
-						       chunk_size, physical_dup);
-				if (ret != chunk_size)
-					goto write_error;
+				if (physical_dup) {
+					ret = restore_write(writer, outfd, 1,
+							    buffer + offset,
+							    chunk_size,
+							    physical_dup);
+					if (ret < 0)
+						goto out;
+				}
 
 				size -= chunk_size;
 				offset += chunk_size;
 				continue;
 			}
 		} else if (async->start != BTRFS_SUPER_INFO_OFFSET) {
-			ret = write_data_to_disk(mdres->info, buffer,
-						 async->start, out_len);
+			ret = restore_write_mapped(mdres, writer, buffer,
+						   async->start, out_len);
 			if (ret) {
 				error("failed to write data");
 				exit(1);
@@ -533,90 +856,88 @@ static int restore_one_work(struct mdrestore_struct *mdres,
 		    !mdres->multi_devices)
 			write_backup_supers(outfd, buffer);
 		out_offset += out_len;
-		if (compress_end) {
-			inflateEnd(&strm);
+		if (compress_end)
 			break;
-		}
-	}
-	return ret;
-
-write_error:
-	if (ret < 0) {
-		error("unable to write to device: %m");
-		ret = -errno;
-	} else {
-		error("short write");
-		ret = -EIO;
 	}
 out:
 	if (compress_method == COMPRESS_ZLIB)
 		inflateEnd(&strm);
+#if COMPRESSION_ZSTD
+	ZSTD_freeDStream(zstd_strm);
+#endif
 	return ret;
 }
 
 static void *restore_worker(void *data)
 {
 	struct mdrestore_struct *mdres = (struct mdrestore_struct *)data;
+	struct restore_writer writer;
 	struct async_work *async;
 	u8 *buffer;
 	int ret;
 	int buffer_size = SZ_512K;
 
 	buffer = malloc(buffer_size);
-	if (!buffer) {
+	ret = restore_writer_init(&writer, mdres);
+	if (!buffer || ret < 0) {
 		error_msg(ERROR_MSG_MEMORY, "restore worker buffer");
-		pthread_mutex_lock(&mdres->mutex);
-		if (!mdres->error)
-			mdres->error = -ENOMEM;
-		pthread_mutex_unlock(&mdres->mutex);
-		pthread_exit(NULL);
+		set_error(mdres, -ENOMEM);
 	}
 
-	while (1) {
-		pthread_mutex_lock(&mdres->mutex);
-		while (!mdres->nodesize || list_empty(&mdres->list)) {
-			if (mdres->done) {
-				pthread_mutex_unlock(&mdres->mutex);
-				goto out;
-			}
-			pthread_cond_wait(&mdres->cond, &mdres->mutex);
-		}
-		async = list_entry(mdres->list.next, struct async_work, list);
-		list_del_init(&async->list);
-
-		ret = restore_one_work(mdres, async, buffer, buffer_size);
-		if (ret < 0) {
-			mdres->error = ret;
-			pthread_mutex_unlock(&mdres->mutex);
-			goto out;
+	/* After an error the items are only freed until told to exit */
+	while ((async = work_queue_pop(&mdres->queue))) {
+		if (!__atomic_load_n(&mdres->error, __ATOMIC_RELAXED)) {
+			ret = restore_one_work(mdres, async, buffer,
+					       buffer_size, &writer);
+			if (ret < 0)
+				set_error(mdres, ret);
 		}
-		mdres->num_items--;
-		pthread_mutex_unlock(&mdres->mutex);
-
 		free(async->buffer);
 		free(async);
 	}
-out:
+	/* The gathered writes are done before the workers are joined */
+	if (!__atomic_load_n(&mdres->error, __ATOMIC_RELAXED)) {
+		ret = restore_writer_flush(&writer);
+		if (ret < 0)
+			set_error(mdres, ret);
+	}
+	restore_writer_release(&writer);
 	free(buffer);
 	pthread_exit(NULL);
 }
 
+static int start_workers(struct mdrestore_struct *mdres, int num_threads)
+{
+	int ret = 0;
+
+	for (int i = 0; i < num_threads; i++) {
+		ret = pthread_create(&mdres->threads[i], NULL, restore_worker,
+				     mdres);
+		if (ret) {
+			/* pthread_create returns errno directly */
+			ret = -ret;
+			break;
+		}
+		mdres->num_threads++;
+	}
+	return ret;
+}
+
 static int mdrestore_init(struct mdrestore_struct *mdres,
 			  FILE *in, FILE *out, int old_restore,
 			  int num_threads, int fixup_offset,
-			  struct btrfs_fs_info *info, int multi_devices)
+			  struct btrfs_fs_info *info, int multi_devices,
+			  bool stream)
 {
-	int i, ret = 0;
+	int ret = 0;
 
-	ret = detect_version(in);
-	if (ret < 0)
-		return ret;
 	memset(mdres, 0, sizeof(*mdres));
-	pthread_cond_init(&mdres->cond, NULL);
 	pthread_mutex_init(&mdres->mutex, NULL);
 	INIT_LIST_HEAD(&mdres->list);
 	INIT_LIST_HEAD(&mdres->overlapping_chunks);
 	cache_tree_init(&mdres->sys_chunks);
+	cache_tree_init(&mdres->chunk_blocks);
+	cache_tree_init(&mdres->chunk_pending);
 	mdres->in = in;
 	mdres->out = out;
 	mdres->old_restore = old_restore;
@@ -624,6 +945,7 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 	mdres->fixup_offset = fixup_offset;
 	mdres->info = info;
 	mdres->multi_devices = multi_devices;
+	mdres->stream_chunks = stream && !multi_devices && !old_restore;
 	mdres->clear_space_cache = 0;
 	mdres->last_physical_offset = 0;
 	mdres->alloced_chunks = 0;
@@ -632,21 +954,17 @@ static int mdrestore_init(struct mdrestore_struct *mdres,
 	if (!mdres->original_super)
 		return -ENOMEM;
 
-	if (!num_threads)
-		return 0;
-
-	mdres->num_threads = num_threads;
-	for (i = 0; i < num_threads; i++) {
-		ret = pthread_create(&mdres->threads[i], NULL, restore_worker,
-				     mdres);
-		if (ret) {
-			/* pthread_create returns errno directly */
-			ret = -ret;
-			break;
-		}
+	/* The items are restored only by the workers */
+	num_threads = max(num_threads, 1);
+	ret = work_queue_init(&mdres->queue, num_threads * WORKER_QUEUE_DEPTH);
+	if (ret < 0) {
+		free(mdres->original_super);
+		return ret;
 	}
+
+	ret = start_workers(mdres, num_threads);
 	if (ret)
-		mdrestore_destroy(mdres, i + 1);
+		mdrestore_destroy(mdres);
 	return ret;
 }
 
@@ -840,45 +1158,47 @@ static int read_chunk_tree_block(struct mdrestore_struct *mdres,
  */
 static bool is_in_sys_chunks(struct mdrestore_struct *mdres, u64 start, u64 len)
 {
-	struct rb_node *node = mdres->sys_chunks.root.rb_node;
-	struct cache_extent *entry;
-	struct cache_extent *next;
-	struct cache_extent *prev;
-
 	if (start > mdres->sys_chunk_end)
 		return false;
+	return lookup_cache_extent(&mdres->sys_chunks, start, len) != NULL;
+}
 
-	while (node) {
-		entry = rb_entry(node, struct cache_extent, rb_node);
-		if (start > entry->start) {
-			if (!node->rb_right)
-				break;
-			node = node->rb_right;
-		} else if (start < entry->start) {
-			if (!node->rb_left)
-				break;
-			node = node->rb_left;
-		} else {
-			/* Already in a system chunk */
-			return true;
-		}
+/*
+ * Record a chunk tree block found in the stream, and the blocks it points to
+ * that were not found yet.  Return 1 if the block was found before.
+ */
+static int track_chunk_block(struct mdrestore_struct *mdres,
+			     struct extent_buffer *eb)
+{
+	u32 nodesize = mdres->nodesize;
+	u64 bytenr = btrfs_header_bytenr(eb);
+	struct cache_extent *ce;
+	int i;
+	int ret;
+
+	if (lookup_cache_extent(&mdres->chunk_blocks, bytenr, nodesize))
+		return 1;
+	ret = add_cache_extent(&mdres->chunk_blocks, bytenr, nodesize);
+	if (ret < 0)
+		return ret;
+	ce = lookup_cache_extent(&mdres->chunk_pending, bytenr, nodesize);
+	if (ce) {
+		remove_cache_extent(&mdres->chunk_pending, ce);
+		free(ce);
 	}
-	if (!node)
-		return false;
-	entry = rb_entry(node, struct cache_extent, rb_node);
-	/* Now we have entry which is the nearst chunk around @start */
-	if (start > entry->start) {
-		prev = entry;
-		next = next_cache_extent(entry);
-	} else {
-		prev = prev_cache_extent(entry);
-		next = entry;
+	if (btrfs_header_level(eb) == 0)
+		return 0;
+	for (i = 0; i < btrfs_header_nritems(eb); i++) {
+		u64 child = btrfs_node_blockptr(eb, i);
+
+		if (lookup_cache_extent(&mdres->chunk_blocks, child, nodesize) ||
+		    lookup_cache_extent(&mdres->chunk_pending, child, nodesize))
+			continue;
+		ret = add_cache_extent(&mdres->chunk_pending, child, nodesize);
+		if (ret < 0)
+			return ret;
 	}
-	if (prev && prev->start + prev->size > start)
-		return true;
-	if (next && start + len > next->start)
-		return true;
-	return false;
+	return 0;
 }
 
 static int read_chunk_block(struct mdrestore_struct *mdres, u8 *buffer,
@@ -922,6 +1242,16 @@ static int read_chunk_block(struct mdrestore_struct *mdres, u8 *buffer,
 			ret = -EUCLEAN;
 			break;
 		}
+		if (mdres->stream_chunks) {
+			ret = track_chunk_block(mdres, eb);
+			if (ret < 0)
+				break;
+			/* Don't add the chunks of a duplicate block twice */
+			if (ret > 0) {
+				ret = 0;
+				continue;
+			}
+		}
 		/*
 		 * No need to search node, as we will iterate all tree blocks
 		 * in chunk tree, only need to bother leaves.
@@ -948,7 +1278,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 	struct meta_cluster *cluster;
 	struct meta_cluster_header *header;
 	struct meta_cluster_item *item;
-	u64 current_cluster = 0, bytenr;
+	u64 current_cluster = mdres->image_start, bytenr;
 	u64 item_bytenr;
 	u32 bufsize, nritems, i;
 	u32 max_size = current_version->max_pending_size * 2;
@@ -968,7 +1298,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 		return -ENOMEM;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		tmp = malloc(max_size);
 		if (!tmp) {
 			error_msg(ERROR_MSG_MEMORY, NULL);
@@ -1004,6 +1334,10 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 		ret = 0;
 
 		header = &cluster->header;
+		/* The index of the items follows the last cluster */
+		if (get_unaligned_le64(&header->magic) == IMAGE_INDEX_MAGIC &&
+		    get_unaligned_le64(&header->bytenr) == current_cluster)
+			goto out;
 		if (get_unaligned_le64(&header->magic) != current_version->magic_cpu ||
 		    get_unaligned_le64(&header->bytenr) != current_cluster) {
 			error("bad header in metadump image");
@@ -1044,7 +1378,7 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 				continue;
 			}
 
-			if (mdres->compress_method == COMPRESS_ZLIB) {
+			if (mdres->compress_method != COMPRESS_NONE) {
 				ret = fread(tmp, bufsize, 1, mdres->in);
 				if (ret != 1) {
 					error("read error: %m");
@@ -1053,15 +1387,11 @@ static int search_for_chunk_blocks(struct mdrestore_struct *mdres)
 				}
 
 				size = max_size;
-				ret = uncompress(buffer,
-						 (unsigned long *)&size, tmp,
-						 bufsize);
-				if (ret != Z_OK) {
-					error("decompression failed with %d",
-							ret);
-					ret = -EIO;
+				ret = decompress_item(mdres->compress_method,
+						      buffer, &size, tmp,
+						      bufsize);
+				if (ret < 0)
 					goto out;
-				}
 			} else {
 				ret = fread(buffer, bufsize, 1, mdres->in);
 				if (ret != 1) {
@@ -1105,10 +1435,6 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 	u8 *buffer;
 	int ret;
 
-	/* We can't seek with stdin so don't bother doing this */
-	if (mdres->in == stdin)
-		return 0;
-
 	ret = fread(cluster, IMAGE_BLOCK_SIZE, 1, mdres->in);
 	if (ret <= 0) {
 		error("unable to read cluster: %m");
@@ -1118,12 +1444,14 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 
 	header = &cluster->header;
 	if (get_unaligned_le64(&header->magic) != current_version->magic_cpu ||
-	    get_unaligned_le64(&header->bytenr) != 0) {
+	    get_unaligned_le64(&header->bytenr) != mdres->image_start) {
 		error("bad header in metadump image");
 		return -EIO;
 	}
 
-	mdres->compress_method = header->compress;
+	ret = set_compress_method(mdres, header);
+	if (ret < 0)
+		return ret;
 	nritems = get_unaligned_le32(&header->nritems);
 	for (i = 0; i < nritems; i++) {
 		item = &cluster->items[i];
@@ -1154,7 +1482,7 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 		return -EIO;
 	}
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		size_t size = BTRFS_SUPER_INFO_SIZE;
 		u8 *tmp;
 
@@ -1163,12 +1491,12 @@ static int build_chunk_tree(struct mdrestore_struct *mdres,
 			free(buffer);
 			return -ENOMEM;
 		}
-		ret = uncompress(tmp, (unsigned long *)&size, buffer, get_unaligned_le32(&item->size));
-		if (ret != Z_OK) {
-			error("decompression failed with %d", ret);
+		ret = decompress_item(mdres->compress_method, tmp, &size,
+				      buffer, get_unaligned_le32(&item->size));
+		if (ret < 0) {
 			free(buffer);
 			free(tmp);
-			return -EIO;
+			return ret;
 		}
 		free(buffer);
 		buffer = tmp;
@@ -1244,13 +1572,13 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 	struct btrfs_super_block *super;
 	u8 *buffer = NULL;
 	u8 *outbuf;
-	int ret;
+	int ret = 0;
 
 	/* We've already been initialized */
 	if (mdres->nodesize)
 		return 0;
 
-	if (mdres->compress_method == COMPRESS_ZLIB) {
+	if (mdres->compress_method != COMPRESS_NONE) {
 		/*
 		 * We know this item is superblock, its should only be 4K.
 		 * Don't need to waste memory following max_pending_size as it
@@ -1261,12 +1589,11 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 		buffer = malloc(size);
 		if (!buffer)
 			return -ENOMEM;
-		ret = uncompress(buffer, (unsigned long *)&size,
-				 async->buffer, async->bufsize);
-		if (ret != Z_OK) {
-			error("decompression failed with %d", ret);
+		ret = decompress_item(mdres->compress_method, buffer, &size,
+				      async->buffer, async->bufsize);
+		if (ret < 0) {
 			free(buffer);
-			return -EIO;
+			return ret;
 		}
 		outbuf = buffer;
 	} else {
@@ -1282,12 +1609,188 @@ static int fill_mdres_info(struct mdrestore_struct *mdres,
 		memcpy(mdres->fsid, super->fsid, BTRFS_FSID_SIZE);
 	memcpy(mdres->uuid, super->dev_item.uuid, BTRFS_UUID_SIZE);
 	mdres->devid = get_unaligned_le64(&super->dev_item.devid);
+
+	/* The chunk tree is looked up from its root, see hold_stream_item() */
+	if (mdres->stream_chunks) {
+		ret = btrfs_check_super(super, 0);
+		if (ret < 0) {
+			error("invalid superblock");
+			goto out;
+		}
+		ret = add_sys_array(mdres, super);
+		if (ret < 0) {
+			error("failed to read system chunk array");
+			goto out;
+		}
+		ret = add_cache_extent(&mdres->chunk_pending,
+				       btrfs_super_chunk_root(super),
+				       mdres->nodesize);
+	}
+out:
 	free(buffer);
-	return 0;
+	return ret;
 }
 
-static int add_cluster(struct meta_cluster *cluster,
-		       struct mdrestore_struct *mdres, u64 *next)
+/*
+ * The superblock is restored first, the other items need the state set up
+ * from it and the chunk tree blocks are fixed up according to the original
+ * one.  Queue the items read before it.
+ */
+static int restore_super_item(struct mdrestore_struct *mdres,
+			      struct async_work *async)
+{
+	u8 buffer[BTRFS_SUPER_INFO_SIZE];
+	int ret;
+
+	ret = fill_mdres_info(mdres, async);
+	if (ret) {
+		error("unable to set up restore state");
+		goto out;
+	}
+	ret = restore_one_work(mdres, async, buffer, BTRFS_SUPER_INFO_SIZE,
+			       NULL);
+	if (ret < 0)
+		goto out;
+	ret = 0;
+	mdres->have_super = true;
+	while (!list_empty(&mdres->list)) {
+		struct async_work *tmp;
+
+		tmp = list_first_entry(&mdres->list, struct async_work, list);
+		list_del_init(&tmp->list);
+		work_queue_push(&mdres->queue, tmp);
+	}
+out:
+	free(async->buffer);
+	free(async);
+	return ret;
+}
+
+/*
+ * Look for the chunk tree blocks in an item read from a stream.
+ */
+static int scan_chunk_item(struct mdrestore_struct *mdres,
+			   struct async_work *async)
+{
+	u32 max_size = current_version->max_pending_size * 2;
+	u8 *buffer = async->buffer;
+	size_t size = async->bufsize;
+	int ret;
+
+	/* Data items can't be merged with tree blocks, skip them */
+	if (async->bufsize > max_size)
+		return 0;
+	if (async->compress != COMPRESS_NONE)
+		size = current_version->max_pending_size;
+	if (!is_in_sys_chunks(mdres, async->start, size))
+		return 0;
+
+	if (async->compress != COMPRESS_NONE) {
+		if (!mdres->chunk_buffer) {
+			mdres->chunk_buffer = malloc(max_size);
+			if (!mdres->chunk_buffer) {
+				error_msg(ERROR_MSG_MEMORY, NULL);
+				return -ENOMEM;
+			}
+		}
+		size = max_size;
+		ret = decompress_item(mdres->compress_method,
+				      mdres->chunk_buffer, &size,
+				      async->buffer, async->bufsize);
+		if (ret < 0)
+			return ret;
+		buffer = mdres->chunk_buffer;
+	}
+
+	ret = read_chunk_block(mdres, buffer, async->start, size, 0);
+	if (ret < 0)
+		error("failed to search tree blocks in item bytenr %llu size %zu",
+		      async->start, size);
+	return ret;
+}
+
+/*
+ * A stream can't be searched for the chunk tree before the restore, so the
+ * items are held back while the blocks of the chunk tree are looked up in
+ * them, starting from the root referenced by the superblock.  Once all are
+ * found the mapping of the chunks is complete, the superblock is restored
+ * and the items held back are queued.
+ *
+ * The dump puts the chunk tree right after the superblock, older images have
+ * it in the order of the addresses which is usually near the start too.
+ */
+static int hold_stream_item(struct mdrestore_struct *mdres,
+			    struct async_work *async)
+{
+	struct async_work *super;
+	int ret;
+
+	if (async->start == BTRFS_SUPER_INFO_OFFSET) {
+		struct async_work *tmp;
+
+		if (mdres->super_item) {
+			error("duplicate superblock in metadump image");
+			free(async->buffer);
+			free(async);
+			return -EUCLEAN;
+		}
+		mdres->super_item = async;
+		ret = fill_mdres_info(mdres, async);
+		if (ret) {
+			error("unable to set up restore state");
+			return ret;
+		}
+		list_for_each_entry(tmp, &mdres->list, list) {
+			ret = scan_chunk_item(mdres, tmp);
+			if (ret < 0)
+				return ret;
+		}
+	} else {
+		list_add_tail(&async->list, &mdres->list);
+		mdres->held_size += async->bufsize;
+		if (mdres->super_item) {
+			ret = scan_chunk_item(mdres, async);
+			if (ret < 0)
+				return ret;
+		}
+	}
+
+	if (!mdres->super_item || !cache_tree_empty(&mdres->chunk_pending)) {
+		if (mdres->held_size > MAX_STREAM_HELD_SIZE) {
+			error(
+	"chunk tree not found in the first %lluMiB of the image, restore it from a file",
+			      mdres->held_size / SZ_1M);
+			return -E2BIG;
+		}
+		return 0;
+	}
+
+	if (!list_empty(&mdres->overlapping_chunks))
+		remap_overlapping_chunks(mdres);
+	super = mdres->super_item;
+	mdres->super_item = NULL;
+	mdres->held_size = 0;
+	return restore_super_item(mdres, super);
+}
+
+/*
+ * The superblock and the items in the chunks removed since the base image
+ * are not restored from it, the chunk tree blocks are overwritten by those of
+ * the delta.
+ */
+static bool is_base_item_restored(struct mdrestore_struct *mdres,
+				  struct async_work *async)
+{
+	struct fs_chunk search;
+
+	if (async->start == BTRFS_SUPER_INFO_OFFSET)
+		return false;
+	search.logical = async->start;
+	return tree_search(&mdres->chunk_tree, &search.l, chunk_cmp, 1) != NULL;
+}
+
+static int add_cluster(struct meta_cluster *cluster,
+		       struct mdrestore_struct *mdres, u64 *next)
 {
 	struct meta_cluster_item *item;
 	struct meta_cluster_header *header = &cluster->header;
@@ -1296,9 +1799,9 @@ static int add_cluster(struct meta_cluster *cluster,
 	u32 i, nritems;
 	int ret;
 
-	pthread_mutex_lock(&mdres->mutex);
-	mdres->compress_method = header->compress;
-	pthread_mutex_unlock(&mdres->mutex);
+	ret = set_compress_method(mdres, header);
+	if (ret < 0)
+		return ret;
 
 	bytenr = get_unaligned_le64(&header->bytenr) + IMAGE_BLOCK_SIZE;
 	nritems = get_unaligned_le32(&header->nritems);
@@ -1311,6 +1814,7 @@ static int add_cluster(struct meta_cluster *cluster,
 		}
 		async->start = get_unaligned_le64(&item->bytenr);
 		async->bufsize = get_unaligned_le32(&item->size);
+		async->compress = mdres->compress_method;
 		async->buffer = malloc(async->bufsize);
 		if (!async->buffer) {
 			error_msg(ERROR_MSG_MEMORY, "async buffer");
@@ -1326,21 +1830,27 @@ static int add_cluster(struct meta_cluster *cluster,
 		}
 		bytenr += async->bufsize;
 
-		pthread_mutex_lock(&mdres->mutex);
-		if (async->start == BTRFS_SUPER_INFO_OFFSET) {
-			ret = fill_mdres_info(mdres, async);
-			if (ret) {
-				error("unable to set up restore state");
-				pthread_mutex_unlock(&mdres->mutex);
+		if (mdres->base) {
+			if (is_base_item_restored(mdres, async)) {
+				async->base = true;
+				work_queue_push(&mdres->queue, async);
+			} else {
 				free(async->buffer);
 				free(async);
-				return ret;
 			}
+		} else if (mdres->stream_chunks && !mdres->have_super) {
+			ret = hold_stream_item(mdres, async);
+			if (ret)
+				return ret;
+		} else if (async->start == BTRFS_SUPER_INFO_OFFSET) {
+			ret = restore_super_item(mdres, async);
+			if (ret)
+				return ret;
+		} else if (!mdres->have_super) {
+			list_add_tail(&async->list, &mdres->list);
+		} else {
+			work_queue_push(&mdres->queue, async);
 		}
-		list_add_tail(&async->list, &mdres->list);
-		mdres->num_items++;
-		pthread_cond_signal(&mdres->cond);
-		pthread_mutex_unlock(&mdres->mutex);
 	}
 	if (bytenr & IMAGE_BLOCK_MASK) {
 		char buffer[IMAGE_BLOCK_MASK];
@@ -1357,26 +1867,397 @@ static int add_cluster(struct meta_cluster *cluster,
 	return 0;
 }
 
-static int wait_for_worker(struct mdrestore_struct *mdres)
+/*
+ * Read the index of the items, its header is in the last block of the image.
+ */
+static int read_index(struct mdrestore_struct *mdres)
+{
+	union {
+		struct meta_index_header header;
+		char bytes[IMAGE_BLOCK_SIZE];
+	} block;
+	struct stat st;
+	u64 bytenr;
+	u64 nritems;
+	size_t size;
+	u32 csum;
+
+	if (fstat(fileno(mdres->in), &st) < 0) {
+		error("failed to stat metadump image: %m");
+		return -errno;
+	}
+	if (st.st_size < IMAGE_BLOCK_SIZE * 2 ||
+	    fseek(mdres->in, -IMAGE_BLOCK_SIZE, SEEK_END) ||
+	    fread(&block, IMAGE_BLOCK_SIZE, 1, mdres->in) != 1 ||
+	    le64_to_cpu(block.header.magic) != IMAGE_INDEX_MAGIC) {
+		error("metadump image has no index, create it with --index");
+		return -ENOENT;
+	}
+
+	bytenr = le64_to_cpu(block.header.bytenr);
+	nritems = le64_to_cpu(block.header.nritems);
+	if (nritems > st.st_size / sizeof(struct meta_index_item) ||
+	    bytenr + IMAGE_BLOCK_SIZE + nritems * sizeof(struct meta_index_item) >
+	    st.st_size) {
+		error("bad index in metadump image");
+		return -EUCLEAN;
+	}
+	size = nritems * sizeof(struct meta_index_item);
+	mdres->index = malloc(max_t(size_t, size, 1));
+	if (!mdres->index) {
+		error_msg(ERROR_MSG_MEMORY, "image index");
+		return -ENOMEM;
+	}
+	if (fseek(mdres->in, bytenr + IMAGE_BLOCK_SIZE, SEEK_SET) ||
+	    (size && fread(mdres->index, size, 1, mdres->in) != 1)) {
+		error("unable to read the index: %m");
+		return -EIO;
+	}
+	csum = ~crc32c(~(u32)0, (u8 *)mdres->index, size);
+	if (csum != le32_to_cpu(block.header.csum)) {
+		error("index checksum mismatch in metadump image");
+		return -EUCLEAN;
+	}
+	mdres->index_nr = nritems;
+	mdres->index_cached = (u64)-1;
+
+	/* The chunk tree is searched from the start */
+	if (fseek(mdres->in, 0, SEEK_SET)) {
+		error("seek failed: %m");
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Find the item containing @bytenr in the index */
+static s64 index_lookup(struct mdrestore_struct *mdres, u64 bytenr)
 {
+	s64 start = 0;
+	s64 end = mdres->index_nr;
+	struct meta_index_item *item;
+
+	while (start < end) {
+		s64 mid = start + (end - start) / 2;
+
+		if (le64_to_cpu(mdres->index[mid].bytenr) <= bytenr)
+			start = mid + 1;
+		else
+			end = mid;
+	}
+	if (start == 0)
+		return -ENOENT;
+	item = &mdres->index[start - 1];
+	if (bytenr >= le64_to_cpu(item->bytenr) + le32_to_cpu(item->len))
+		return -ENOENT;
+	return start - 1;
+}
+
+/* Read item @nr of the index as it is in the image, to be restored */
+static struct async_work *read_index_item(struct mdrestore_struct *mdres,
+					  u64 nr)
+{
+	struct meta_index_item *item = &mdres->index[nr];
+	struct async_work *async;
+
+	async = calloc(1, sizeof(*async));
+	if (!async) {
+		error_msg(ERROR_MSG_MEMORY, "async data");
+		return NULL;
+	}
+	async->start = le64_to_cpu(item->bytenr);
+	async->bufsize = le32_to_cpu(item->size);
+	async->compress = mdres->compress_method;
+	async->buffer = malloc(async->bufsize);
+	if (!async->buffer) {
+		error_msg(ERROR_MSG_MEMORY, "async buffer");
+		free(async);
+		return NULL;
+	}
+	if (fseek(mdres->in, le64_to_cpu(item->offset), SEEK_SET) ||
+	    fread(async->buffer, async->bufsize, 1, mdres->in) != 1) {
+		error("unable to read item at %llu: %m",
+		      le64_to_cpu(item->offset));
+		free(async->buffer);
+		free(async);
+		return NULL;
+	}
+	return async;
+}
+
+/* Read and decompress item @nr of the index to mdres->index_buffer */
+static int read_index_data(struct mdrestore_struct *mdres, u64 nr)
+{
+	struct async_work *async;
+	size_t len = le32_to_cpu(mdres->index[nr].len);
+	size_t size = len;
 	int ret = 0;
 
-	pthread_mutex_lock(&mdres->mutex);
-	ret = mdres->error;
-	while (!ret && mdres->num_items > 0) {
-		struct timespec ts = {
-			.tv_sec = 0,
-			.tv_nsec = 10000000,
-		};
-		pthread_mutex_unlock(&mdres->mutex);
-		nanosleep(&ts, NULL);
-		pthread_mutex_lock(&mdres->mutex);
-		ret = mdres->error;
+	if (mdres->index_cached == nr)
+		return 0;
+	mdres->index_cached = (u64)-1;
+	async = read_index_item(mdres, nr);
+	if (!async)
+		return -EIO;
+	free(mdres->index_buffer);
+	mdres->index_buffer = malloc(len);
+	if (!mdres->index_buffer) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out;
 	}
-	pthread_mutex_unlock(&mdres->mutex);
+	if (async->compress != COMPRESS_NONE) {
+		ret = decompress_item(mdres->compress_method,
+				      mdres->index_buffer, &size,
+				      async->buffer, async->bufsize);
+		if (ret < 0)
+			goto out;
+	} else {
+		size = min_t(size_t, len, async->bufsize);
+		memcpy(mdres->index_buffer, async->buffer, size);
+	}
+	if (size != len) {
+		error("item %llu has wrong length %zu, expected %zu",
+		      async->start, size, len);
+		ret = -EUCLEAN;
+		goto out;
+	}
+	mdres->index_cached = nr;
+out:
+	free(async->buffer);
+	free(async);
+	return ret;
+}
+
+struct index_walk {
+	u64 bytenr;
+	int level;
+};
+
+/*
+ * Select the items of the index with the blocks of the tree at @bytenr.  For
+ * the root tree, the roots of the trees of @filter are saved to @roots and
+ * the roots of the global trees to @global_roots, indexed by the tree id.
+ */
+static int select_tree(struct mdrestore_struct *mdres, u64 bytenr,
+		       u8 *selected, const struct restore_filter *filter,
+		       u64 *roots, u64 *global_roots)
+{
+	struct extent_buffer *eb;
+	struct index_walk *stack;
+	size_t nr = 0;
+	size_t alloc = 64;
+	int ret = 0;
+
+	eb = alloc_dummy_eb(0, mdres->nodesize);
+	stack = malloc(alloc * sizeof(*stack));
+	if (!eb || !stack) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		ret = -ENOMEM;
+		goto out;
+	}
+	stack[nr].bytenr = bytenr;
+	stack[nr++].level = -1;
+
+	while (nr) {
+		struct meta_index_item *item;
+		u64 start;
+		s64 item_nr;
+		int level;
+		int i;
+
+		bytenr = stack[--nr].bytenr;
+		level = stack[nr].level;
+		item_nr = index_lookup(mdres, bytenr);
+		if (item_nr < 0) {
+			error("tree block %llu not found in metadump image",
+			      bytenr);
+			ret = -ENOENT;
+			goto out;
+		}
+		item = &mdres->index[item_nr];
+		start = le64_to_cpu(item->bytenr);
+		if (bytenr + mdres->nodesize > start + le32_to_cpu(item->len)) {
+			error("tree block %llu crosses the item end", bytenr);
+			ret = -EUCLEAN;
+			goto out;
+		}
+		ret = read_index_data(mdres, item_nr);
+		if (ret < 0)
+			goto out;
+		memcpy(eb->data, mdres->index_buffer + bytenr - start,
+		       mdres->nodesize);
+		/* The levels go down, so a damaged tree can't loop */
+		if (btrfs_header_bytenr(eb) != bytenr ||
+		    (level >= 0 && btrfs_header_level(eb) != level)) {
+			error("bad tree block %llu in metadump image", bytenr);
+			ret = -EUCLEAN;
+			goto out;
+		}
+		selected[item_nr] = 1;
+
+		level = btrfs_header_level(eb);
+		for (i = 0; i < btrfs_header_nritems(eb); i++) {
+			struct btrfs_root_item *ri;
+			struct btrfs_key key;
+			int j;
+
+			if (level) {
+				if (nr == alloc) {
+					struct index_walk *tmp;
+
+					alloc *= 2;
+					tmp = realloc(stack,
+						      alloc * sizeof(*stack));
+					if (!tmp) {
+						error_msg(ERROR_MSG_MEMORY, NULL);
+						ret = -ENOMEM;
+						goto out;
+					}
+					stack = tmp;
+				}
+				stack[nr].bytenr = btrfs_node_blockptr(eb, i);
+				stack[nr++].level = level - 1;
+				continue;
+			}
+			if (!roots)
+				break;
+			btrfs_item_key_to_cpu(eb, &key, i);
+			if (key.type != BTRFS_ROOT_ITEM_KEY)
+				continue;
+			ri = btrfs_item_ptr(eb, i, struct btrfs_root_item);
+			if (key.objectid < BTRFS_FIRST_FREE_OBJECTID &&
+			    key.objectid != BTRFS_FS_TREE_OBJECTID)
+				global_roots[key.objectid] =
+					btrfs_disk_root_bytenr(eb, ri);
+			for (j = 0; j < filter->nr_trees; j++)
+				if (key.objectid == filter->trees[j])
+					roots[j] = btrfs_disk_root_bytenr(eb, ri);
+		}
+	}
+out:
+	free(stack);
+	free(eb);
 	return ret;
 }
 
+/*
+ * Restore the superblock, the chunk and root trees and the trees and ranges
+ * of @filter, looked up through the index.  The global trees like the extent,
+ * device and checksum trees are restored too, the filesystem can't be opened
+ * without them.
+ */
+static int restore_selected(struct mdrestore_struct *mdres,
+			    const struct restore_filter *filter)
+{
+	struct btrfs_super_block *super;
+	struct async_work *async;
+	u64 roots[MAX_RESTORE_FILTER] = { 0 };
+	u64 global_roots[BTRFS_FIRST_FREE_OBJECTID] = { 0 };
+	u64 chunk_root;
+	u64 tree_root;
+	s64 super_nr;
+	u8 *selected;
+	u64 nr;
+	int i;
+	int ret;
+
+	super_nr = index_lookup(mdres, BTRFS_SUPER_INFO_OFFSET);
+	if (super_nr < 0) {
+		error("superblock not found in metadump image");
+		return -EINVAL;
+	}
+	ret = read_index_data(mdres, super_nr);
+	if (ret < 0)
+		return ret;
+	super = (struct btrfs_super_block *)mdres->index_buffer;
+	chunk_root = btrfs_super_chunk_root(super);
+	tree_root = btrfs_super_root(super);
+
+	selected = calloc(mdres->index_nr, 1);
+	if (!selected) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	selected[super_nr] = 1;
+	ret = select_tree(mdres, chunk_root, selected, NULL, NULL, NULL);
+	if (ret < 0)
+		goto out;
+	ret = select_tree(mdres, tree_root, selected, filter, roots,
+			  global_roots);
+	if (ret < 0)
+		goto out;
+	for (i = 0; i < BTRFS_FIRST_FREE_OBJECTID; i++) {
+		if (!global_roots[i])
+			continue;
+		ret = select_tree(mdres, global_roots[i], selected, NULL, NULL,
+				  NULL);
+		if (ret < 0)
+			goto out;
+	}
+	for (i = 0; i < filter->nr_trees; i++) {
+		if (filter->trees[i] == BTRFS_ROOT_TREE_OBJECTID ||
+		    filter->trees[i] == BTRFS_CHUNK_TREE_OBJECTID)
+			continue;
+		if (!roots[i]) {
+			error("tree %llu not found in metadump image",
+			      filter->trees[i]);
+			ret = -ENOENT;
+			goto out;
+		}
+		ret = select_tree(mdres, roots[i], selected, NULL, NULL, NULL);
+		if (ret < 0)
+			goto out;
+	}
+	for (nr = 0; nr < mdres->index_nr; nr++) {
+		u64 start = le64_to_cpu(mdres->index[nr].bytenr);
+		u64 end = start + le32_to_cpu(mdres->index[nr].len);
+
+		for (i = 0; i < filter->nr_ranges; i++) {
+			if (start < filter->range_start[i] + filter->range_len[i] &&
+			    end > filter->range_start[i])
+				selected[nr] = 1;
+		}
+	}
+
+	async = read_index_item(mdres, super_nr);
+	if (!async) {
+		ret = -EIO;
+		goto out;
+	}
+	ret = restore_super_item(mdres, async);
+	if (ret < 0)
+		goto out;
+	for (nr = 0; nr < mdres->index_nr; nr++) {
+		if (!selected[nr] || nr == super_nr)
+			continue;
+		if (__atomic_load_n(&mdres->error, __ATOMIC_RELAXED))
+			break;
+		async = read_index_item(mdres, nr);
+		if (!async) {
+			ret = -EIO;
+			goto out;
+		}
+		work_queue_push(&mdres->queue, async);
+	}
+out:
+	free(selected);
+	return ret;
+}
+
+static int wait_for_worker(struct mdrestore_struct *mdres)
+{
+	stop_workers(mdres);
+	if (!mdres->error && mdres->super_item) {
+		error("chunk tree blocks missing in metadump image");
+		return -EINVAL;
+	}
+	if (!mdres->error && !list_empty(&mdres->list)) {
+		error("superblock not found in metadump image");
+		return -EINVAL;
+	}
+	return mdres->error;
+}
+
 static int iter_tree_blocks(struct btrfs_fs_info *fs_info,
 			    struct extent_buffer *eb, bool pin)
 {
@@ -1762,16 +2643,155 @@ error:
 	return ret;
 }
 
+/* Check that the delta at @path applies to the image restored before it */
+static int check_delta_base(const struct image_info *base, const char *path,
+			    const struct image_info *info)
+{
+	if (!info->delta) {
+		error("%s is not a delta image", path);
+		return -EINVAL;
+	}
+	if (memcmp(base->fsid, info->fsid, BTRFS_FSID_SIZE)) {
+		error("delta image %s is not of the filesystem of its base image",
+		      path);
+		return -EINVAL;
+	}
+	/* The base must have all blocks the delta does not, and be older */
+	if (info->base_generation > base->generation ||
+	    base->generation > info->generation) {
+		error(
+"delta image %s of generation %llu to %llu does not apply to generation %llu",
+		      path, info->base_generation, info->generation,
+		      base->generation);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * The base images are restored oldest first, the first one is a full image
+ * and each other is a delta of the one before, as is the image restored.
+ */
+static int check_bases(const char *input, const struct image_info *delta,
+		       const char * const *bases, int nr_bases)
+{
+	struct image_info base;
+	struct image_info info;
+	int ret;
+
+	for (int i = 0; i < nr_bases; i++) {
+		ret = read_image_info(bases[i], &info);
+		if (ret < 0)
+			return ret;
+		if (i == 0 && info.delta) {
+			error("the first base image %s is a delta, its base images are needed too",
+			      bases[i]);
+			return -EINVAL;
+		}
+		if (i > 0) {
+			ret = check_delta_base(&base, bases[i], &info);
+			if (ret < 0)
+				return ret;
+		}
+		base = info;
+	}
+	return check_delta_base(&base, input, delta);
+}
+
+/*
+ * Restore the items of a base image before those of the delta.  They're
+ * mapped by the chunk tree of the delta, which has all its blocks and the
+ * superblock, the other items newer than the base overwrite these.  So all
+ * items are written before the next image is read.
+ */
+static int restore_base(struct mdrestore_struct *mdres, const char *path,
+			struct meta_cluster *cluster)
+{
+	const struct dump_version *version = current_version;
+	struct meta_cluster_header *header = &cluster->header;
+	struct image_info info;
+	FILE *in = mdres->in;
+	int num_threads = mdres->num_threads;
+	u64 bytenr = 0;
+	int ret;
+
+	mdres->in = fopen(path, "r");
+	if (!mdres->in) {
+		error("unable to open metadump image %s: %m", path);
+		mdres->in = in;
+		return -errno;
+	}
+	if (fread(cluster, IMAGE_BLOCK_SIZE, 1, mdres->in) != 1) {
+		error("unable to read metadump image %s", path);
+		ret = -EIO;
+		goto out;
+	}
+	ret = read_delta_header((struct meta_delta_header *)cluster, &info);
+	if (ret < 0)
+		goto out;
+	if (ret > 0) {
+		bytenr = IMAGE_BLOCK_SIZE;
+		if (fread(cluster, IMAGE_BLOCK_SIZE, 1, mdres->in) != 1) {
+			error("unable to read metadump image %s", path);
+			ret = -EIO;
+			goto out;
+		}
+	}
+	ret = detect_version(cluster);
+	if (ret < 0)
+		goto out;
+	if (fseek(mdres->in, bytenr, SEEK_SET)) {
+		error("seek failed: %m");
+		ret = -EIO;
+		goto out;
+	}
+
+	mdres->base = true;
+	while (!__atomic_load_n(&mdres->error, __ATOMIC_RELAXED)) {
+		if (fread(cluster, IMAGE_BLOCK_SIZE, 1, mdres->in) != 1)
+			break;
+		if (get_unaligned_le64(&header->magic) == IMAGE_INDEX_MAGIC &&
+		    get_unaligned_le64(&header->bytenr) == bytenr)
+			break;
+		if (get_unaligned_le64(&header->magic) != current_version->magic_cpu ||
+		    get_unaligned_le64(&header->bytenr) != bytenr) {
+			error("bad header in metadump image %s", path);
+			ret = -EIO;
+			break;
+		}
+		ret = add_cluster(cluster, mdres, &bytenr);
+		if (ret) {
+			error("failed to add cluster: %d", ret);
+			break;
+		}
+	}
+	mdres->base = false;
+	stop_workers(mdres);
+	if (!ret)
+		ret = mdres->error;
+	if (!ret)
+		ret = start_workers(mdres, num_threads);
+out:
+	current_version = version;
+	fclose(mdres->in);
+	mdres->in = in;
+	return ret;
+}
+
 int restore_metadump(const char *input, FILE *out, int old_restore,
 		     int num_threads, int fixup_offset, const char *target,
-		     int multi_devices)
+		     int multi_devices, const struct restore_filter *filter,
+		     const char * const *bases, int nr_bases)
 {
 	struct meta_cluster *cluster = NULL;
 	struct meta_cluster_header *header;
 	struct mdrestore_struct mdrestore;
 	struct btrfs_fs_info *info = NULL;
-	u64 bytenr = 0;
+	struct image_info delta = { 0 };
+	u64 image_start = 0;
+	u64 bytenr;
 	FILE *in = NULL;
+	bool stream;
 	int ret = 0;
 
 	if (!strcmp(input, "-")) {
@@ -1784,6 +2804,18 @@ int restore_metadump(const char *input, FILE *out, int old_restore,
 		}
 	}
 
+	/*
+	 * A pipe is restored in one pass, read it in larger blocks and let
+	 * the writer run ahead while the items are decompressed.
+	 */
+	stream = lseek(fileno(in), 0, SEEK_CUR) < 0;
+	if (stream) {
+		setvbuf(in, NULL, _IOFBF, SZ_1M);
+#ifdef F_SETPIPE_SZ
+		fcntl(fileno(in), F_SETPIPE_SZ, SZ_1M);
+#endif
+	}
+
 	/* NOTE: open with write mode */
 	if (fixup_offset) {
 		struct open_ctree_args oca = { 0 };
@@ -1807,14 +2839,72 @@ int restore_metadump(const char *input, FILE *out, int old_restore,
 		goto failed_info;
 	}
 
+	/* Keep the first cluster of a stream, it can't be read again */
+	ret = fread(cluster, IMAGE_BLOCK_SIZE, 1, in);
+	if (!ret) {
+		error("failed to read header");
+		ret = -EIO;
+		goto failed_cluster;
+	}
+	/* A delta starts with its header, the clusters follow */
+	ret = read_delta_header((struct meta_delta_header *)cluster, &delta);
+	if (ret < 0)
+		goto failed_cluster;
+	if (ret > 0) {
+		image_start = IMAGE_BLOCK_SIZE;
+		ret = fread(cluster, IMAGE_BLOCK_SIZE, 1, in);
+		if (!ret) {
+			error("failed to read header");
+			ret = -EIO;
+			goto failed_cluster;
+		}
+	}
+	ret = detect_version(cluster);
+	if (ret < 0)
+		goto failed_cluster;
+	if (delta.delta && !nr_bases) {
+		error(
+	"the image is a delta of generation %llu to %llu, restore it with its base images",
+		      delta.base_generation, delta.generation);
+		ret = -EINVAL;
+		goto failed_cluster;
+	}
+	if (nr_bases) {
+		if (stream) {
+			error("restore of a delta needs the images in files");
+			ret = -EINVAL;
+			goto failed_cluster;
+		}
+		ret = check_bases(input, &delta, bases, nr_bases);
+		if (ret < 0)
+			goto failed_cluster;
+	}
+	if (!stream && fseek(in, image_start, SEEK_SET)) {
+		error("seek failed: %m");
+		ret = -EIO;
+		goto failed_cluster;
+	}
+
 	ret = mdrestore_init(&mdrestore, in, out, old_restore, num_threads,
-			     fixup_offset, info, multi_devices);
+			     fixup_offset, info, multi_devices, stream);
 	if (ret) {
 		error("failed to initialize metadata restore state: %d", ret);
 		goto failed_cluster;
 	}
+	mdrestore.image_start = image_start;
+
+	if (filter) {
+		if (stream) {
+			error("restore of selected trees needs the image in a file");
+			ret = -EINVAL;
+			goto out;
+		}
+		ret = read_index(&mdrestore);
+		if (ret < 0)
+			goto out;
+	}
 
-	if (!multi_devices && !old_restore) {
+	if (!stream && !multi_devices && !old_restore) {
 		ret = build_chunk_tree(&mdrestore, cluster);
 		if (ret) {
 			error("failed to build chunk tree");
@@ -1824,17 +2914,32 @@ int restore_metadump(const char *input, FILE *out, int old_restore,
 			remap_overlapping_chunks(&mdrestore);
 	}
 
-	if (in != stdin && fseek(in, 0, SEEK_SET)) {
+	for (int i = 0; i < nr_bases; i++) {
+		ret = restore_base(&mdrestore, bases[i], cluster);
+		if (ret < 0)
+			goto out;
+	}
+
+	if (!stream && fseek(in, image_start, SEEK_SET)) {
 		error("seek failed: %m");
+		ret = -EIO;
 		goto out;
 	}
 
-	while (!mdrestore.error) {
-		ret = fread(cluster, IMAGE_BLOCK_SIZE, 1, in);
-		if (!ret)
-			break;
+	bytenr = image_start;
+	if (filter)
+		ret = restore_selected(&mdrestore, filter);
+	while (!filter && !__atomic_load_n(&mdrestore.error, __ATOMIC_RELAXED)) {
+		if (!stream || bytenr != image_start) {
+			ret = fread(cluster, IMAGE_BLOCK_SIZE, 1, in);
+			if (!ret)
+				break;
+		}
 
 		header = &cluster->header;
+		if (get_unaligned_le64(&header->magic) == IMAGE_INDEX_MAGIC &&
+		    get_unaligned_le64(&header->bytenr) == bytenr)
+			break;
 		if (get_unaligned_le64(&header->magic) != current_version->magic_cpu ||
 		    get_unaligned_le64(&header->bytenr) != bytenr) {
 			error("bad header in metadump image");
@@ -1847,9 +2952,14 @@ int restore_metadump(const char *input, FILE *out, int old_restore,
 			break;
 		}
 	}
+	/* The image was not read completely, the workers are stopped at out */
+	if (ret < 0)
+		goto out;
 	ret = wait_for_worker(&mdrestore);
+	if (ret)
+		goto out;
 
-	if (!ret && !multi_devices && !old_restore &&
+	if (!multi_devices && !old_restore && !filter &&
 	    btrfs_super_num_devices(mdrestore.original_super) != 1) {
 		struct btrfs_root *root;
 
@@ -1876,7 +2986,11 @@ int restore_metadump(const char *input, FILE *out, int old_restore,
 		struct stat st;
 		u64 dev_size;
 
-		if (!info) {
+		if (filter) {
+			/* Not all trees are restored, it can't be opened */
+			dev_size = btrfs_stack_device_total_bytes(
+					&mdrestore.original_super->dev_item);
+		} else if (!info) {
 			root = open_ctree_fd(fileno(out), target, 0,
 					     OPEN_CTREE_ALLOW_TRANSID_MISMATCH |
 					     OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS);
@@ -1920,7 +3034,7 @@ int restore_metadump(const char *input, FILE *out, int old_restore,
 		}
 	}
 out:
-	mdrestore_destroy(&mdrestore, num_threads);
+	mdrestore_destroy(&mdrestore);
 failed_cluster:
 	free(cluster);
 failed_info:
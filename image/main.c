@@ -24,6 +24,12 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#if COMPRESSION_ZSTD
+#include <zstd.h>
+#endif
+#include "kernel-lib/raid56.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/volumes.h"
@@ -36,7 +42,10 @@
 #include "common/utils.h"
 #include "common/help.h"
 #include "common/open-utils.h"
+#include "common/device-utils.h"
+#include "common/tree-prefetch.h"
 #include "common/string-utils.h"
+#include "common/stats.h"
 #include "cmds/commands.h"
 #include "image/metadump.h"
 #include "image/sanitize.h"
@@ -49,14 +58,33 @@ static const char * const image_usage[] = {
 	"Options:",
 	OPTLINE("-r", "restore metadump image"),
 	OPTLINE("-c value", "compression level (0 ~ 9)"),
-	OPTLINE("-t value", "number of threads (1 ~ 32)"),
+	OPTLINE("--compress ALGO[:LEVEL]", "compress the image by algorithm and level, ALGO can be 'no', zlib, zstd"),
+	OPTLINE("", "Built-in:"),
+#if COMPRESSION_ZSTD
+	OPTLINE("", "- ZSTD: yes (levels 1..19)"),
+#else
+	OPTLINE("", "- ZSTD: no"),
+#endif
+	OPTLINE("", "- ZLIB: yes (levels 1..9)"),
+	OPTLINE("--compress-long", "use long distance matching of zstd, needs more memory"),
+	OPTLINE("-t value", "number of threads (1 ~ 128)"),
+	OPTLINE("--readers N", "number of threads reading the tree blocks ahead of the dump, default 16, 0 reads them synchronously"),
 	OPTLINE("-o", "don't mess with the chunk tree when restoring"),
 	OPTLINE("-s", "sanitize file names, use once to just use garbage, use twice if you want crc collisions"),
+	OPTLINE("--sanitize-cache FILE", "keep the crc collisions of the names in FILE for the next dumps, needs -ss"),
 	OPTLINE("-w", "walk all trees instead of using extent tree, do this if your extent tree is broken"),
 	OPTLINE("-m", "restore for multiple devices"),
 	OPTLINE("-d", "also dump data, conflicts with -w"),
+	OPTLINE("--index", "write an index of the items at the end of the image"),
+	OPTLINE("--tree ID", "restore only the tree ID (and the chunk, root and other global trees) from an indexed image, can be repeated"),
+	OPTLINE("--range START,LEN", "restore only the items in the logical range from an indexed image, can be repeated"),
+	OPTLINE("--since IMAGE", "dump only the metadata changed after the image IMAGE was dumped, as a delta"),
+	OPTLINE("--min-generation GEN", "dump only the metadata newer than generation GEN, as a delta"),
+	OPTLINE("--base IMAGE", "restore a delta on top of the base IMAGE, repeat for each base, the oldest first"),
+	OPTLINE("--discard", "discard the whole target block device before the restore"),
 	"",
 	"General:",
+	OPTLINE("--stats[=json]", "print I/O, cache and memory statistics to stderr on exit"),
 	OPTLINE("--version", "print the btrfs-image version, builtin featurues and exit"),
 	OPTLINE("--help", "print this help and exit"),
 	"",
@@ -69,12 +97,128 @@ static const struct cmd_struct image_cmd = {
 	.usagestr = image_usage
 };
 
+/* Levels of zstd from 20 on need the larger windows of the ultra mode */
+#define IMAGE_ZSTD_MAX_LEVEL		(19)
+
+static int parse_range(const char *str, struct restore_filter *filter)
+{
+	char start[32];
+	const char *comma;
+
+	if (filter->nr_ranges == MAX_RESTORE_FILTER) {
+		error("too many ranges, at most %d", MAX_RESTORE_FILTER);
+		return 1;
+	}
+	comma = strchr(str, ',');
+	if (!comma || comma == str || comma - str >= sizeof(start)) {
+		error("invalid range %s, expected START,LEN", str);
+		return 1;
+	}
+	memcpy(start, str, comma - str);
+	start[comma - str] = 0;
+	filter->range_start[filter->nr_ranges] = arg_strtou64(start);
+	filter->range_len[filter->nr_ranges] =
+		arg_strtou64_with_suffix(comma + 1);
+	filter->nr_ranges++;
+	return 0;
+}
+
+static int parse_compression(const char *str, int *method, int *level)
+{
+	const char *colon;
+	size_t type_size;
+	int default_level, max_level;
+
+	if (strcmp(str, "no") == 0) {
+		*method = COMPRESS_NONE;
+		*level = 0;
+		return 0;
+	}
+
+	colon = strchr(str, ':');
+	if (colon)
+		type_size = colon - str;
+	else
+		type_size = strlen(str);
+
+	if (type_size == strlen("zlib") && strncmp(str, "zlib", type_size) == 0) {
+		*method = COMPRESS_ZLIB;
+		max_level = Z_BEST_COMPRESSION;
+		default_level = 6;
+	} else if (type_size == strlen("zstd") &&
+		   strncmp(str, "zstd", type_size) == 0) {
+#if COMPRESSION_ZSTD
+		*method = COMPRESS_ZSTD;
+		max_level = IMAGE_ZSTD_MAX_LEVEL;
+		default_level = ZSTD_CLEVEL_DEFAULT;
+#else
+		error("zstd support not compiled in");
+		return 1;
+#endif
+	} else {
+		error("unknown compression algorithm: %s", str);
+		return 1;
+	}
+
+	*level = default_level;
+	if (colon) {
+		u64 tmplevel = arg_strtou64(colon + 1);
+
+		if (tmplevel > max_level) {
+			error("compression level %llu out of range [1..%d]",
+			      tmplevel, max_level);
+			return 1;
+		}
+		if (tmplevel)
+			*level = tmplevel;
+	}
+
+	return 0;
+}
+
+/*
+ * The restore writes only the metadata, discard the rest of a device so it
+ * doesn't keep the old content.  A file target is truncated and the unused
+ * space stays sparse.
+ */
+static void discard_target(int fd, const char *target)
+{
+	struct stat st;
+	int ret;
+
+	if (fstat(fd, &st) < 0 || !S_ISBLK(st.st_mode)) {
+		warning("--discard ignored, %s is not a block device", target);
+		return;
+	}
+	ret = device_discard_blocks(fd, 0,
+				    device_get_partition_size_fd_stat(fd, &st),
+				    NULL);
+	if (ret) {
+		errno = ret;
+		warning("failed to discard %s: %m", target);
+	}
+}
+
 int BOX_MAIN(image)(int argc, char *argv[])
 {
 	char *source;
 	char *target;
 	u64 num_threads = 0;
+	u64 num_readers = TREE_PREFETCH_DEFAULT_THREADS;
+	bool readers_set = false;
 	u64 compress_level = 0;
+	int compress_method = COMPRESS_NONE;
+	int level;
+	bool compress_long = false;
+	bool index = false;
+	struct restore_filter filter = { 0 };
+	struct image_info base = { 0 };
+	const char *since = NULL;
+	const char *sanitize_cache = NULL;
+	bool delta = false;
+	const char *bases[MAX_DELTA_BASES];
+	int nr_bases = 0;
+	bool discard = false;
 	int create = 1;
 	int old_restore = 0;
 	int walk_trees = 0;
@@ -88,13 +232,34 @@ int BOX_MAIN(image)(int argc, char *argv[])
 
 	cpu_detect_flags();
 	hash_init_accel();
+	raid6_init_accel();
 	btrfs_config_init();
 
 	while (1) {
-		enum { GETOPT_VAL_VERSION = GETOPT_VAL_FIRST };
+		enum { GETOPT_VAL_VERSION = GETOPT_VAL_FIRST,
+		       GETOPT_VAL_COMPRESS, GETOPT_VAL_COMPRESS_LONG,
+		       GETOPT_VAL_INDEX, GETOPT_VAL_TREE, GETOPT_VAL_RANGE,
+		       GETOPT_VAL_READERS, GETOPT_VAL_SINCE,
+		       GETOPT_VAL_MIN_GENERATION, GETOPT_VAL_BASE,
+		       GETOPT_VAL_SANITIZE_CACHE, GETOPT_VAL_DISCARD };
 		static const struct option long_options[] = {
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP},
 			{ "version", no_argument, NULL, GETOPT_VAL_VERSION },
+			{ "compress", required_argument, NULL, GETOPT_VAL_COMPRESS },
+			{ "compress-long", no_argument, NULL,
+				GETOPT_VAL_COMPRESS_LONG },
+			{ "index", no_argument, NULL, GETOPT_VAL_INDEX },
+			{ "tree", required_argument, NULL, GETOPT_VAL_TREE },
+			{ "range", required_argument, NULL, GETOPT_VAL_RANGE },
+			{ "readers", required_argument, NULL, GETOPT_VAL_READERS },
+			{ "since", required_argument, NULL, GETOPT_VAL_SINCE },
+			{ "min-generation", required_argument, NULL,
+				GETOPT_VAL_MIN_GENERATION },
+			{ "base", required_argument, NULL, GETOPT_VAL_BASE },
+			{ "sanitize-cache", required_argument, NULL,
+				GETOPT_VAL_SANITIZE_CACHE },
+			{ "stats", optional_argument, NULL, GETOPT_VAL_STATS },
+			{ "discard", no_argument, NULL, GETOPT_VAL_DISCARD },
 			{ NULL, 0, NULL, 0 }
 		};
 		int c = getopt_long(argc, argv, "rc:t:oswmd", long_options, NULL);
@@ -119,6 +284,76 @@ int BOX_MAIN(image)(int argc, char *argv[])
 					compress_level);
 				return 1;
 			}
+			compress_method = compress_level ? COMPRESS_ZLIB :
+							   COMPRESS_NONE;
+			break;
+		case GETOPT_VAL_COMPRESS:
+			if (parse_compression(optarg, &compress_method, &level))
+				return 1;
+			compress_level = level;
+			break;
+		case GETOPT_VAL_COMPRESS_LONG:
+			compress_long = true;
+			break;
+		case GETOPT_VAL_INDEX:
+			index = true;
+			break;
+		case GETOPT_VAL_TREE:
+			if (filter.nr_trees == MAX_RESTORE_FILTER) {
+				error("too many trees, at most %d",
+				      MAX_RESTORE_FILTER);
+				return 1;
+			}
+			filter.trees[filter.nr_trees++] = arg_strtou64(optarg);
+			break;
+		case GETOPT_VAL_RANGE:
+			if (parse_range(optarg, &filter))
+				return 1;
+			break;
+		case GETOPT_VAL_READERS:
+			num_readers = arg_strtou64(optarg);
+			if (num_readers > TREE_PREFETCH_MAX_THREADS) {
+				error("number of readers out of range: %llu > %d",
+				      num_readers, TREE_PREFETCH_MAX_THREADS);
+				return 1;
+			}
+			readers_set = true;
+			break;
+		case GETOPT_VAL_SINCE:
+			if (delta) {
+				error("--since and --min-generation can't be used together");
+				return 1;
+			}
+			since = optarg;
+			delta = true;
+			break;
+		case GETOPT_VAL_MIN_GENERATION:
+			if (delta) {
+				error("--since and --min-generation can't be used together");
+				return 1;
+			}
+			base.generation = arg_strtou64(optarg);
+			delta = true;
+			break;
+		case GETOPT_VAL_BASE:
+			if (nr_bases == MAX_DELTA_BASES) {
+				error("too many base images, at most %d",
+				      MAX_DELTA_BASES);
+				return 1;
+			}
+			bases[nr_bases++] = optarg;
+			break;
+		case GETOPT_VAL_SANITIZE_CACHE:
+			sanitize_cache = optarg;
+			break;
+		case GETOPT_VAL_DISCARD:
+			discard = true;
+			break;
+		case GETOPT_VAL_STATS:
+			if (stats_enable(optarg)) {
+				error("invalid stats format: %s", optarg);
+				return 1;
+			}
 			break;
 		case 'o':
 			old_restore = 1;
@@ -163,6 +398,10 @@ int BOX_MAIN(image)(int argc, char *argv[])
 		usage(&image_cmd, 1);
 	}
 #endif
+	if (sanitize_cache && sanitize != SANITIZE_COLLISIONS) {
+		error("--sanitize-cache needs -ss");
+		usage_error++;
+	}
 	if (create) {
 		if (old_restore) {
 			error(
@@ -173,11 +412,49 @@ int BOX_MAIN(image)(int argc, char *argv[])
 			error("-d conflicts with -w option");
 			usage_error++;
 		}
+		if (compress_long && compress_method != COMPRESS_ZSTD) {
+			error("--compress-long needs zstd compression");
+			usage_error++;
+		}
+		if (filter.nr_trees || filter.nr_ranges) {
+			error("--tree and --range are options of the restore");
+			usage_error++;
+		}
+		if (nr_bases) {
+			error("--base is an option of the restore");
+			usage_error++;
+		}
+		if (discard) {
+			error("--discard is an option of the restore");
+			usage_error++;
+		}
 	} else {
 		if (walk_trees || sanitize != SANITIZE_NONE || compress_level ||
-		    dump_data) {
+		    compress_long || dump_data) {
 			error(
-		"using -w, -s, -c, -d options for restore makes no sense");
+	"using -w, -s, -c, -d, --compress options for restore makes no sense");
+			usage_error++;
+		}
+		if (index) {
+			error("--index is an option of the dump");
+			usage_error++;
+		}
+		if (readers_set) {
+			error("--readers is an option of the dump");
+			usage_error++;
+		}
+		if (delta) {
+			error("--since and --min-generation are options of the dump");
+			usage_error++;
+		}
+		if (nr_bases && (multi_devices || old_restore ||
+				 filter.nr_trees || filter.nr_ranges)) {
+			error("--base can't be used with -m, -o, --tree or --range");
+			usage_error++;
+		}
+		if ((filter.nr_trees || filter.nr_ranges) &&
+		    (multi_devices || old_restore)) {
+			error("--tree and --range can't be used with -m or -o");
 			usage_error++;
 		}
 		if (multi_devices && dev_cnt < 2) {
@@ -196,6 +473,10 @@ int BOX_MAIN(image)(int argc, char *argv[])
 	source = argv[optind];
 	target = argv[optind + 1];
 
+	/* Before the target is created, it could be the same file */
+	if (since && read_image_info(since, &base) < 0)
+		return 1;
+
 	if (create && !strcmp(target, "-")) {
 		out = stdout;
 	} else {
@@ -206,7 +487,9 @@ int BOX_MAIN(image)(int argc, char *argv[])
 		}
 	}
 
-	if (compress_level > 0 || create == 0) {
+	/* The names are sanitized by the workers too, even if not compressed */
+	if (compress_method != COMPRESS_NONE || create == 0 ||
+	    sanitize != SANITIZE_NONE) {
 		if (num_threads == 0) {
 			long tmp = sysconf(_SC_NPROCESSORS_ONLN);
 
@@ -229,12 +512,20 @@ int BOX_MAIN(image)(int argc, char *argv[])
 					source);
 		}
 
+		stats_phase("dumping");
 		ret = create_metadump(source, out, num_threads,
-				      compress_level, sanitize, walk_trees,
-				      dump_data);
+				      compress_method, compress_level,
+				      compress_long, sanitize, walk_trees,
+				      dump_data, index, num_readers,
+				      delta ? &base : NULL, sanitize_cache);
 	} else {
+		if (discard)
+			discard_target(fileno(out), target);
+		stats_phase("restoring");
 		ret = restore_metadump(source, out, old_restore, num_threads,
-				       0, target, multi_devices);
+				       0, target, multi_devices,
+				       filter.nr_trees || filter.nr_ranges ?
+				       &filter : NULL, bases, nr_bases);
 	}
 	if (ret) {
 		error("%s failed: %d", (create) ? "create" : "restore", ret);
@@ -281,7 +572,7 @@ int BOX_MAIN(image)(int argc, char *argv[])
 
 		/* fix metadata block to map correct chunk */
 		ret = restore_metadump(source, out, 0, num_threads, 1,
-				       target, 1);
+				       target, 1, NULL, NULL, 0);
 		if (ret) {
 			error("unable to fixup metadump: %d", ret);
 			exit(1);
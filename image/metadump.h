@@ -19,11 +19,15 @@
 
 #include "kerncompat.h"
 #include <pthread.h>
+#include <semaphore.h>
 #include "kernel-lib/list.h"
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
+#include "common/work-queue.h"
 #include "image/sanitize.h"
 
+struct tree_prefetch;
+
 #define IMAGE_BLOCK_SIZE		SZ_1K
 #define IMAGE_BLOCK_MASK		(IMAGE_BLOCK_SIZE - 1)
 
@@ -32,8 +36,29 @@
 
 #define COMPRESS_NONE		0
 #define COMPRESS_ZLIB		1
+#define COMPRESS_ZSTD		2
+
+/*
+ * Window of the zstd long distance matching, the default of the zstd tools
+ * and the largest one they decompress without extra options
+ */
+#define ZSTD_LONG_WINDOW_LOG	(27)
 
-#define MAX_WORKER_THREADS	(32)
+#define MAX_WORKER_THREADS	(128)
+/* Items queued to the workers, per worker */
+#define WORKER_QUEUE_DEPTH	(4)
+/* Filled clusters kept while their items are compressed */
+#define MAX_PENDING_CLUSTERS	(4)
+/* Items of the dump whose tree blocks are read ahead by the readers */
+#define MAX_READ_AHEAD_SIZE	(SZ_16M)
+/* Threads reading the data extents of the dump and the size of their reads */
+#define MAX_DATA_READERS	(8)
+#define DATA_READ_SIZE		(SZ_1M)
+/*
+ * Items held back by a restore from a stream until the chunk tree is found,
+ * the dump puts it right after the superblock
+ */
+#define MAX_STREAM_HELD_SIZE	(SZ_256M)
 
 struct dump_version {
 	u64 magic_cpu;
@@ -53,6 +78,17 @@ struct async_work {
 	u8 *buffer;
 	size_t bufsize;
 	int error;
+	/* Compression method of the item, from the cluster header on restore */
+	u8 compress;
+	/* Compressed by a worker, on dump */
+	int done;
+	/* Data extent, on dump */
+	bool data;
+	/* Pieces of the data extent being read and if any failed, on dump */
+	int reading;
+	int read_error;
+	/* Item of a base image of a delta, on restore */
+	bool base;
 };
 
 struct meta_cluster_item {
@@ -73,6 +109,72 @@ struct meta_cluster {
 	struct meta_cluster_item items[];
 } __attribute__ ((__packed__));
 
+/*
+ * Optional index of the items after the last cluster, sorted by the logical
+ * address.  The header is in a block of its own at the start of the index,
+ * where the restore of the clusters stops, and a copy is in the last block of
+ * the image to find the index from there.
+ */
+#define IMAGE_INDEX_MAGIC	0x786469506d55445fULL /* ascii _DUmPidx, no null */
+
+struct meta_index_header {
+	__le64 magic;
+	/* Offset of the index in the image */
+	__le64 bytenr;
+	__le64 nritems;
+	/* crc32c of the index items */
+	__le32 csum;
+} __attribute__ ((__packed__));
+
+/*
+ * Header of a delta image in its first block, the clusters follow it.  Only
+ * the tree blocks and extents newer than the base generation are in the
+ * delta, besides the superblock and the whole chunk tree, the rest is
+ * restored from the base images.
+ */
+#define IMAGE_DELTA_MAGIC	0x746c64506d55445fULL /* ascii _DUmPdlt, no null */
+#define MAX_DELTA_BASES		(64)
+
+struct meta_delta_header {
+	__le64 magic;
+	__le64 bytenr;
+	u8 fsid[BTRFS_FSID_SIZE];
+	__le64 base_generation;
+	/* Generation of the superblock in the delta */
+	__le64 generation;
+	/* crc32c of the fields above */
+	__le32 csum;
+} __attribute__ ((__packed__));
+
+/* Filesystem and generation of an image, see read_image_info() */
+struct image_info {
+	u8 fsid[BTRFS_FSID_SIZE];
+	u64 generation;
+	bool delta;
+	u64 base_generation;
+};
+
+struct meta_index_item {
+	/* Logical address and length of the item restored */
+	__le64 bytenr;
+	__le32 len;
+	/* Size of the item in the image, compressed or not */
+	__le32 size;
+	/* Offset of the item in the image */
+	__le64 offset;
+} __attribute__ ((__packed__));
+
+/* Trees and logical ranges restored from an indexed image */
+#define MAX_RESTORE_FILTER	(32)
+
+struct restore_filter {
+	u64 trees[MAX_RESTORE_FILTER];
+	int nr_trees;
+	u64 range_start[MAX_RESTORE_FILTER];
+	u64 range_len[MAX_RESTORE_FILTER];
+	int nr_ranges;
+};
+
 struct fs_chunk {
 	u64 logical;
 	u64 physical;
@@ -95,22 +197,47 @@ struct metadump_struct {
 
 	pthread_t threads[MAX_WORKER_THREADS];
 	size_t num_threads;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
-	struct rb_root name_tree;
+	/* Items to compress, NULL stops a worker */
+	struct work_queue queue;
+	/* Posted by the workers for each item compressed */
+	sem_t completed;
+	struct name_tree name_tree;
 
 	struct extent_io_tree seen;
 
-	struct list_head list;
+	/* Readers of the tree blocks and the items they read ahead */
+	struct tree_prefetch *prefetch;
+	struct list_head reading;
+	u64 reading_size;
+	/* Readers of the data extents, the pieces are queued as struct data_read */
+	pthread_t data_readers[MAX_DATA_READERS];
+	int num_data_readers;
+	struct work_queue data_queue;
+	/* Posted by the data readers for each piece read */
+	sem_t data_read;
+
+	/* Items of the cluster being filled */
 	struct list_head ordered;
 	size_t num_items;
-	size_t num_ready;
+	/* Filled clusters written once their items are compressed */
+	struct list_head clusters;
+	size_t num_clusters;
+	/* Offset of the next cluster in the image */
+	u64 out_bytenr;
+	/* Only the blocks and extents newer are dumped, in a delta */
+	u64 min_generation;
+	/* Items written, if the index is written after the clusters */
+	bool index;
+	struct meta_index_item *index_items;
+	u64 index_nr;
+	u64 index_alloc;
 
 	u64 pending_start;
 	u64 pending_size;
 
+	int compress_method;
 	int compress_level;
-	int done;
+	bool compress_long;
 	int data;
 	enum sanitize_mode sanitize_names;
 
@@ -129,7 +256,8 @@ struct mdrestore_struct {
 	pthread_t threads[MAX_WORKER_THREADS];
 	size_t num_threads;
 	pthread_mutex_t mutex;
-	pthread_cond_t cond;
+	/* Items to restore, NULL stops a worker */
+	struct work_queue queue;
 
 	/*
 	 * Records system chunk ranges, so restore can use this to determine
@@ -138,10 +266,27 @@ struct mdrestore_struct {
 	struct cache_tree sys_chunks;
 	struct rb_root chunk_tree;
 	struct rb_root physical_tree;
+	/* Items held back until the superblock is restored, then queued */
 	struct list_head list;
+	/*
+	 * Restore from a stream, the chunk tree blocks are looked up in the
+	 * items as they are read.  The superblock and the other items are
+	 * held back until all blocks of the chunk tree are found.
+	 */
+	bool stream_chunks;
+	struct async_work *super_item;
+	/* Chunk tree blocks found and those referenced but not found yet */
+	struct cache_tree chunk_blocks;
+	struct cache_tree chunk_pending;
+	u64 held_size;
+	u8 *chunk_buffer;
+	/* Index read from the image and the last item read through it */
+	struct meta_index_item *index;
+	u64 index_nr;
+	u64 index_cached;
+	u8 *index_buffer;
 	struct list_head overlapping_chunks;
 	struct btrfs_super_block *original_super;
-	size_t num_items;
 	u32 nodesize;
 	u64 devid;
 	u64 alloced_chunks;
@@ -152,7 +297,11 @@ struct mdrestore_struct {
 	u8 fsid[BTRFS_FSID_SIZE];
 
 	int compress_method;
-	int done;
+	bool have_super;
+	/* Offset of the first cluster, after the header of a delta */
+	u64 image_start;
+	/* The items read are of a base image of the delta */
+	bool base;
 	int error;
 	int old_restore;
 	int fixup_offset;
@@ -161,11 +310,14 @@ struct mdrestore_struct {
 	struct btrfs_fs_info *info;
 };
 
-int create_metadump(const char *input, FILE *out, int num_threads, int
-		    compress_level, enum sanitize_mode sanitize, int
-		    walk_trees, bool dump_data);
+int create_metadump(const char *input, FILE *out, int num_threads,
+		    int compress_method, int compress_level, bool compress_long,
+		    enum sanitize_mode sanitize, int walk_trees, bool dump_data,
+		    bool index, int num_readers, const struct image_info *base,
+		    const char *sanitize_cache);
 int restore_metadump(const char *input, FILE *out, int old_restore,
 		     int num_threads, int fixup_offset, const char *target,
-		     int multi_devices);
+		     int multi_devices, const struct restore_filter *filter,
+		     const char * const *bases, int nr_bases);
 
 #endif
@@ -15,9 +15,15 @@
  */
 
 #include "kerncompat.h"
+#include <fcntl.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
@@ -138,53 +144,103 @@ static bool find_collision_is_suffix_valid(const char *suffix)
 	return true;
 }
 
+/*
+ * Difference of the CRC32C of a prefix of length l when its first byte is
+ * changed by xor with d, in first_byte_delta[l][d].  The CRC is linear so it
+ * does not depend on the other bytes, the tables are calculated for each
+ * length when first needed.  Printable characters differ from ' ' only in
+ * the lower 7 bits.
+ */
+static u32 *first_byte_delta[BTRFS_NAME_LEN + 1];
+static pthread_mutex_t first_byte_delta_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const u32 *find_collision_first_byte_delta(u32 len)
+{
+	u32 basis[7];
+	u32 *delta;
+	u8 *buf;
+	int bit;
+
+	pthread_mutex_lock(&first_byte_delta_lock);
+	if (first_byte_delta[len]) {
+		delta = first_byte_delta[len];
+		goto out;
+	}
+
+	delta = malloc(128 * sizeof(u32));
+	buf = calloc(1, len);
+	if (!delta || !buf) {
+		free(delta);
+		free(buf);
+		delta = NULL;
+		goto out;
+	}
+	for (bit = 0; bit < 7; bit++) {
+		buf[0] = 1 << bit;
+		basis[bit] = crc32c(0, buf, len);
+	}
+	free(buf);
+
+	delta[0] = 0;
+	for (u32 d = 1; d < 128; d++) {
+		bit = ffs(d) - 1;
+		delta[d] = delta[d & (d - 1)] ^ basis[bit];
+	}
+	first_byte_delta[len] = delta;
+out:
+	pthread_mutex_unlock(&first_byte_delta_lock);
+	return delta;
+}
+
+/*
+ * Enumerate the printable prefixes, with the first byte changing the fastest,
+ * and calculate the suffix matching the CRC for each.  The CRC of the prefix
+ * is calculated only when a byte other than the first changes, the first
+ * byte is accounted for by the precalculated difference.
+ */
 static int find_collision_reverse_crc32c(struct name *val, u32 name_len)
 {
 	unsigned long checksum;
 	unsigned long current_checksum;
-	int found = 0;
+	const u32 *delta;
+	u32 base;
 	int i;
 
 	/* There are no same length collisions of 4 or less bytes */
-	if (name_len <= 4)
+	if (name_len <= 4 || name_len > BTRFS_NAME_LEN)
 		return 0;
 	checksum = crc32c(~1, val->val, name_len);
 	name_len -= 4;
+	delta = find_collision_first_byte_delta(name_len);
+	if (!delta)
+		return 0;
 	memset(val->sub, ' ', name_len);
-	i = 0;
 	while (1) {
-		current_checksum = crc32c(~1, val->sub, name_len);
-		find_collision_calc_suffix(current_checksum,
-					   checksum,
-					   val->sub + name_len);
-		if (find_collision_is_suffix_valid(val->sub + name_len) &&
-		    memcmp(val->sub, val->val, val->len)) {
-			found = 1;
-			break;
+		base = crc32c(~1, val->sub, name_len);
+		for (int c = ' '; c <= 126; c++) {
+			if (c == '/')
+				continue;
+			val->sub[0] = c;
+			current_checksum = base ^ delta[c ^ ' '];
+			find_collision_calc_suffix(current_checksum,
+						   checksum,
+						   val->sub + name_len);
+			if (find_collision_is_suffix_valid(val->sub + name_len) &&
+			    memcmp(val->sub, val->val, val->len))
+				return 1;
 		}
+		val->sub[0] = ' ';
 
-		if (val->sub[i] == 126) {
-			do {
-				i++;
-				if (i >= name_len)
-					break;
-			} while (val->sub[i] == 126);
-
-			if (i >= name_len)
-				break;
-			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
-			memset(val->sub, ' ', i);
-			i = 0;
-			continue;
-		} else {
+		for (i = 1; i < name_len && val->sub[i] == 126; i++)
+			;
+		if (i >= name_len)
+			break;
+		val->sub[i]++;
+		if (val->sub[i] == '/')
 			val->sub[i]++;
-			if (val->sub[i] == '/')
-				val->sub[i]++;
-		}
+		memset(val->sub, ' ', i);
 	}
-	return found;
+	return 0;
 }
 
 static void tree_insert(struct rb_root *root, struct rb_node *ins,
@@ -238,23 +294,49 @@ static int name_cmp(struct rb_node *a, struct rb_node *b, int fuzz)
 	struct name *entry = rb_entry(a, struct name, n);
 	struct name *ins = rb_entry(b, struct name, n);
 	u32 len;
+	int ret;
 
 	len = min(ins->len, entry->len);
-	return memcmp(ins->val, entry->val, len);
+	ret = memcmp(ins->val, entry->val, len);
+	if (ret)
+		return ret;
+	/* A name is not the same as a longer one it's a prefix of */
+	if (ins->len < entry->len)
+		return -1;
+	return ins->len > entry->len;
+}
+
+static void fill_garbage(struct name_tree *name_tree, char *buf, u32 len)
+{
+	pthread_mutex_lock(&name_tree->lock);
+	for (u32 i = 0; i < len; i++) {
+		char c = rand_range(94) + 33;
+
+		if (c == '/')
+			c++;
+		buf[i] = c;
+	}
+	pthread_mutex_unlock(&name_tree->lock);
 }
 
-static char *find_collision(struct rb_root *name_tree, char *name,
+/*
+ * The collision is searched without the lock, if another worker found one for
+ * the same name meanwhile, that one is used so all the names match.
+ */
+static char *find_collision(struct name_tree *name_tree, char *name,
 			    u32 name_len)
 {
 	struct name *val;
 	struct rb_node *entry;
 	struct name tmp;
+	char *sub;
 	int found;
-	int i;
 
 	tmp.val = name;
 	tmp.len = name_len;
-	entry = tree_search(name_tree, &tmp.n, name_cmp, 0);
+	pthread_mutex_lock(&name_tree->lock);
+	entry = tree_search(&name_tree->root, &tmp.n, name_cmp, 0);
+	pthread_mutex_unlock(&name_tree->lock);
 	if (entry) {
 		val = rb_entry(entry, struct name, n);
 		free(name);
@@ -286,40 +368,165 @@ static char *find_collision(struct rb_root *name_tree, char *name,
 		warning(
 "cannot find a hash collision for '%.*s', generating garbage, it won't match indexes",
 			val->len, val->val);
-		for (i = 0; i < name_len; i++) {
-			char c = rand_range(94) + 33;
+		fill_garbage(name_tree, val->sub, name_len);
+	}
 
-			if (c == '/')
-				c++;
-			val->sub[i] = c;
+	pthread_mutex_lock(&name_tree->lock);
+	entry = tree_search(&name_tree->root, &val->n, name_cmp, 0);
+	if (entry) {
+		sub = rb_entry(entry, struct name, n)->sub;
+		free(val->val);
+		free(val->sub);
+		free(val);
+	} else {
+		tree_insert(&name_tree->root, &val->n, name_cmp);
+		sub = val->sub;
+	}
+	pthread_mutex_unlock(&name_tree->lock);
+	return sub;
+}
+
+static bool is_collision(const struct name *val)
+{
+	return val->len > 4 && memcmp(val->val, val->sub, val->len) &&
+	       crc32c(~1, val->val, val->len) == crc32c(~1, val->sub, val->len);
+}
+
+/*
+ * Load the collisions calculated by earlier dumps from the cache at @path
+ * into @name_tree, a missing cache is not an error.
+ */
+int sanitize_cache_load(struct rb_root *name_tree, const char *path)
+{
+	char magic[sizeof(SANITIZE_CACHE_MAGIC) - 1];
+	struct name *val = NULL;
+	__le32 len;
+	FILE *file;
+	int ret = 0;
+
+	file = fopen(path, "r");
+	if (!file) {
+		if (errno == ENOENT)
+			return 0;
+		ret = -errno;
+		error("cannot open name cache %s: %m", path);
+		return ret;
+	}
+	if (fread(magic, sizeof(magic), 1, file) != 1 ||
+	    memcmp(magic, SANITIZE_CACHE_MAGIC, sizeof(magic))) {
+		error("%s is not a name cache", path);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	while (fread(&len, sizeof(len), 1, file) == 1) {
+		if (le32_to_cpu(len) > BTRFS_NAME_LEN)
+			goto corrupted;
+		val = calloc(1, sizeof(*val));
+		if (val) {
+			val->len = le32_to_cpu(len);
+			val->val = malloc(val->len);
+			val->sub = malloc(val->len);
 		}
+		if (!val || !val->val || !val->sub) {
+			error_msg(ERROR_MSG_MEMORY, "name cache");
+			ret = -ENOMEM;
+			goto out;
+		}
+		if (fread(val->val, val->len, 1, file) != 1 ||
+		    fread(val->sub, val->len, 1, file) != 1 ||
+		    !is_collision(val))
+			goto corrupted;
+		if (tree_search(name_tree, &val->n, name_cmp, 0)) {
+			free(val->val);
+			free(val->sub);
+			free(val);
+		} else {
+			tree_insert(name_tree, &val->n, name_cmp);
+		}
+		val = NULL;
+	}
+	if (!ferror(file))
+		goto out;
+corrupted:
+	error("name cache %s is corrupted", path);
+	ret = -EUCLEAN;
+out:
+	if (val) {
+		free(val->val);
+		free(val->sub);
+		free(val);
 	}
+	fclose(file);
+	return ret;
+}
 
-	tree_insert(name_tree, &val->n, name_cmp);
-	return val->sub;
+/*
+ * Save the collisions of @name_tree to the cache at @path, replacing it.  The
+ * names that got garbage are not saved.
+ */
+int sanitize_cache_save(struct rb_root *name_tree, const char *path)
+{
+	struct rb_node *n;
+	char *tmp_path;
+	FILE *file;
+	int fd;
+	int ret = 0;
+
+	tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+	if (!tmp_path)
+		return -ENOMEM;
+	sprintf(tmp_path, "%s.tmp", path);
+
+	/* The original names are in it */
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || !(file = fdopen(fd, "w"))) {
+		ret = -errno;
+		error("cannot create name cache %s: %m", tmp_path);
+		if (fd >= 0)
+			close(fd);
+		goto out;
+	}
+	fwrite(SANITIZE_CACHE_MAGIC, sizeof(SANITIZE_CACHE_MAGIC) - 1, 1, file);
+	for (n = rb_first(name_tree); n; n = rb_next(n)) {
+		struct name *val = rb_entry(n, struct name, n);
+		__le32 len = cpu_to_le32(val->len);
+
+		if (!is_collision(val))
+			continue;
+		fwrite(&len, sizeof(len), 1, file);
+		fwrite(val->val, val->len, 1, file);
+		fwrite(val->sub, val->len, 1, file);
+	}
+	if (ferror(file) || fflush(file) || fsync(fileno(file)))
+		ret = -EIO;
+	if (fclose(file) && !ret)
+		ret = -errno;
+	if (!ret && rename(tmp_path, path))
+		ret = -errno;
+	if (ret) {
+		errno = -ret;
+		error("cannot write name cache %s: %m", path);
+		unlink(tmp_path);
+	}
+out:
+	free(tmp_path);
+	return ret;
 }
 
-static char *generate_garbage(u32 name_len)
+static char *generate_garbage(struct name_tree *name_tree, u32 name_len)
 {
 	char *buf = malloc(name_len);
-	int i;
 
 	if (!buf)
 		return NULL;
 
-	for (i = 0; i < name_len; i++) {
-		char c = rand_range(94) + 33;
-
-		if (c == '/')
-			c++;
-		buf[i] = c;
-	}
-
+	fill_garbage(name_tree, buf, name_len);
 	return buf;
 }
 
 static void sanitize_dir_item(enum sanitize_mode sanitize,
-		struct rb_root *name_tree, struct extent_buffer *eb, int slot)
+		struct name_tree *name_tree, struct extent_buffer *eb, int slot)
 {
 	struct btrfs_dir_item *dir_item;
 	char *buf;
@@ -349,7 +556,7 @@ static void sanitize_dir_item(enum sanitize_mode sanitize,
 			read_extent_buffer(eb, buf, name_ptr, name_len);
 			garbage = find_collision(name_tree, buf, name_len);
 		} else {
-			garbage = generate_garbage(name_len);
+			garbage = generate_garbage(name_tree, name_len);
 		}
 		if (!garbage) {
 			error_msg(ERROR_MSG_MEMORY, "sanitize name");
@@ -365,7 +572,7 @@ static void sanitize_dir_item(enum sanitize_mode sanitize,
 }
 
 static void sanitize_inode_ref(enum sanitize_mode sanitize,
-		struct rb_root *name_tree, struct extent_buffer *eb, int slot,
+		struct name_tree *name_tree, struct extent_buffer *eb, int slot,
 		int ext)
 {
 	struct btrfs_inode_extref *extref;
@@ -404,7 +611,7 @@ static void sanitize_inode_ref(enum sanitize_mode sanitize,
 			read_extent_buffer(eb, buf, name_ptr, len);
 			garbage = find_collision(name_tree, buf, len);
 		} else {
-			garbage = generate_garbage(len);
+			garbage = generate_garbage(name_tree, len);
 		}
 
 		if (!garbage) {
@@ -435,7 +642,7 @@ static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size)
 {
 	struct extent_buffer *eb;
 
-	eb = calloc(1, sizeof(struct extent_buffer) + size);
+	eb = alloc_extent_buffer_inline(size);
 	if (!eb)
 		return NULL;
 
@@ -444,7 +651,7 @@ static struct extent_buffer *alloc_dummy_eb(u64 bytenr, u32 size)
 	return eb;
 }
 
-void sanitize_name(enum sanitize_mode sanitize, struct rb_root *name_tree,
+void sanitize_name(enum sanitize_mode sanitize, struct name_tree *name_tree,
 		u8 *dst, struct extent_buffer *src, struct btrfs_key *key,
 		int slot)
 {
@@ -18,6 +18,7 @@
 #define __BTRFS_IMAGE_SANITIZE_H__
 
 #include "kerncompat.h"
+#include <pthread.h>
 #include "kernel-lib/rbtree_types.h"
 
 struct btrfs_key;
@@ -30,6 +31,15 @@ struct name {
 	u32 len;
 };
 
+/*
+ * Names sanitized so far, shared by the dump workers.  The lock protects the
+ * tree and the random generator, the collisions are searched without it.
+ */
+struct name_tree {
+	struct rb_root root;
+	pthread_mutex_t lock;
+};
+
 /*
  * Filenames and xattrs can be obfuscated so they don't appear in the image
  * dump. In basic mode (NAMES) a random string will be generated but such names
@@ -44,7 +54,16 @@ enum sanitize_mode {
 	SANITIZE_COLLISIONS
 };
 
-void sanitize_name(enum sanitize_mode sanitize, struct rb_root *name_tree,
+/*
+ * Cache of the collisions of the names, kept by the dumps with
+ * --sanitize-cache between runs.  The records are the length of the name, the
+ * name and its collision.
+ */
+#define SANITIZE_CACHE_MAGIC	"_DUmPsan"
+
+int sanitize_cache_load(struct rb_root *name_tree, const char *path);
+int sanitize_cache_save(struct rb_root *name_tree, const char *path);
+void sanitize_name(enum sanitize_mode sanitize, struct name_tree *name_tree,
 		u8 *dst, struct extent_buffer *src, struct btrfs_key *key,
 		int slot);
 
@@ -30,6 +30,7 @@
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-lib/raid56.h"
 #include "common/messages.h"
+#include "common/cpu-utils.h"
 
 /*
  * This is the C data type to use
@@ -83,7 +84,8 @@ static inline __attribute_const__ unative_t MASK(unative_t v)
 }
 
 
-void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+static void raid6_gen_syndrome_intx1(int disks, size_t start, size_t bytes,
+				     void **ptrs)
 {
 	uint8_t **dptr = (uint8_t **)ptrs;
 	uint8_t *p, *q;
@@ -95,7 +97,7 @@ void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
 	p = dptr[z0+1];		/* XOR parity */
 	q = dptr[z0+2];		/* RS syndrome */
 
-	for ( d = 0 ; d < bytes ; d += NSIZE*1 ) {
+	for ( d = start ; d < bytes ; d += NSIZE*1 ) {
 		wq0 = wp0 = get_unaligned_native(&dptr[z0][d+0*NSIZE]);
 		for ( z = z0-1 ; z >= 0 ; z-- ) {
 			wd0 = get_unaligned_native(&dptr[z][d+0*NSIZE]);
@@ -111,6 +113,53 @@ void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
 	}
 }
 
+static struct {
+	size_t (*gen_syndrome)(int disks, size_t bytes, void **ptrs);
+	size_t (*recov_data2)(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+			      u8 pbmul, u8 qmul);
+	size_t (*recov_datap)(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul);
+} raid6_accel;
+
+void raid6_init_accel(void)
+{
+	memset(&raid6_accel, 0, sizeof(raid6_accel));
+	if (0);
+#if HAVE_CFLAG_mavx512bw == 1
+	else if (cpu_has_feature(CPU_FLAG_AVX512BW)) {
+		raid6_accel.gen_syndrome = raid6_gen_syndrome_avx512;
+		raid6_accel.recov_data2 = raid6_recov_data2_avx512;
+		raid6_accel.recov_datap = raid6_recov_datap_avx512;
+	}
+#endif
+#if HAVE_CFLAG_mavx2 == 1
+	else if (cpu_has_feature(CPU_FLAG_AVX2)) {
+		raid6_accel.gen_syndrome = raid6_gen_syndrome_avx2;
+		raid6_accel.recov_data2 = raid6_recov_data2_avx2;
+		raid6_accel.recov_datap = raid6_recov_datap_avx2;
+	}
+#endif
+#if HAVE_CFLAG_msse2 == 1
+	else if (cpu_has_feature(CPU_FLAG_SSE2))
+		raid6_accel.gen_syndrome = raid6_gen_syndrome_sse2;
+#endif
+#ifdef __aarch64__
+	else if (cpu_has_feature(CPU_FLAG_NEON)) {
+		raid6_accel.gen_syndrome = raid6_gen_syndrome_neon;
+		raid6_accel.recov_data2 = raid6_recov_data2_neon;
+		raid6_accel.recov_datap = raid6_recov_datap_neon;
+	}
+#endif
+}
+
+void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs)
+{
+	size_t done = 0;
+
+	if (raid6_accel.gen_syndrome)
+		done = raid6_accel.gen_syndrome(disks, bytes, ptrs);
+	raid6_gen_syndrome_intx1(disks, done, bytes, ptrs);
+}
+
 static void xor_range(char *dst, const char*src, size_t size)
 {
 	/* Move to DWORD aligned */
@@ -186,6 +235,7 @@ int raid6_recov_data2(int nr_devs, size_t stripe_len, int dest1, int dest2,
 	u8 px, qx, db;
 	const u8 *pbmul;	/* P multiplier table for B data */
 	const u8 *qmul;		/* Q multiplier table (for both) */
+	u8 pbidx, qidx;
 	char *zero_mem1, *zero_mem2;
 	int ret = 0;
 
@@ -224,8 +274,22 @@ int raid6_recov_data2(int nr_devs, size_t stripe_len, int dest1, int dest2,
 	data[nr_devs - 1] = q;
 
 	/* Now, pick the proper data tables */
-	pbmul = raid6_gfmul[raid6_gfexi[dest2 - dest1]];
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[dest1]^raid6_gfexp[dest2]]];
+	pbidx = raid6_gfexi[dest2 - dest1];
+	qidx = raid6_gfinv[raid6_gfexp[dest1] ^ raid6_gfexp[dest2]];
+	pbmul = raid6_gfmul[pbidx];
+	qmul  = raid6_gfmul[qidx];
+
+	if (raid6_accel.recov_data2) {
+		size_t done;
+
+		done = raid6_accel.recov_data2(stripe_len, p, q, dp, dq,
+					       pbidx, qidx);
+		p += done;
+		q += done;
+		dp += done;
+		dq += done;
+		stripe_len -= done;
+	}
 
 	/* Now do it... */
 	while ( stripe_len-- ) {
@@ -250,6 +314,7 @@ int raid6_recov_datap(int nr_devs, size_t stripe_len, int dest1, void **data)
 {
 	u8 *p, *q, *dq;
 	const u8 *qmul;		/* Q multiplier table */
+	u8 qidx;
 	char *zero_mem;
 
 	p = (u8 *)data[nr_devs - 2];
@@ -272,7 +337,18 @@ int raid6_recov_datap(int nr_devs, size_t stripe_len, int dest1, void **data)
 	data[nr_devs - 1] = q;
 
 	/* Now, pick the proper data tables */
-	qmul  = raid6_gfmul[raid6_gfinv[raid6_gfexp[dest1]]];
+	qidx = raid6_gfinv[raid6_gfexp[dest1]];
+	qmul  = raid6_gfmul[qidx];
+
+	if (raid6_accel.recov_datap) {
+		size_t done;
+
+		done = raid6_accel.recov_datap(stripe_len, p, q, dq, qidx);
+		p += done;
+		q += done;
+		dq += done;
+		stripe_len -= done;
+	}
 
 	/* Now do it... */
 	while ( stripe_len-- ) {
@@ -28,6 +28,29 @@
 void raid6_gen_syndrome(int disks, size_t bytes, void **ptrs);
 int raid5_gen_result(int nr_devs, size_t stripe_len, int dest, void **data);
 
+/* Select the RAID6 implementation, must be called after cpu_detect_flags() */
+void raid6_init_accel(void);
+
+/*
+ * Accelerated RAID6 implementations, process a prefix of @bytes and return
+ * its length, the rest is done by the portable code.
+ *
+ * The recovery multipliers are indexes into raid6_gfmul/raid6_vgfmul.
+ */
+size_t raid6_gen_syndrome_sse2(int disks, size_t bytes, void **ptrs);
+size_t raid6_gen_syndrome_avx2(int disks, size_t bytes, void **ptrs);
+size_t raid6_recov_data2_avx2(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+			      u8 pbmul, u8 qmul);
+size_t raid6_recov_datap_avx2(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul);
+size_t raid6_gen_syndrome_avx512(int disks, size_t bytes, void **ptrs);
+size_t raid6_recov_data2_avx512(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+				u8 pbmul, u8 qmul);
+size_t raid6_recov_datap_avx512(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul);
+size_t raid6_gen_syndrome_neon(int disks, size_t bytes, void **ptrs);
+size_t raid6_recov_data2_neon(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+			      u8 pbmul, u8 qmul);
+size_t raid6_recov_datap_neon(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul);
+
 /*
  * Headers synchronized from kernel include/linux/raid/pq.h
  * No modification at all.
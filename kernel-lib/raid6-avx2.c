@@ -0,0 +1,127 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+
+/*
+ * RAID6 syndrome generation and recovery using AVX2, based on the kernel
+ * lib/raid6/avx2.c and lib/raid6/recov_avx2.c.
+ */
+
+#include "kerncompat.h"
+#include "kernel-lib/raid56.h"
+
+#ifdef __AVX2__
+
+#include <immintrin.h>
+
+size_t raid6_gen_syndrome_avx2(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	const int z0 = disks - 3;
+	u8 *p = dptr[z0 + 1];
+	u8 *q = dptr[z0 + 2];
+	const __m256i x1d = _mm256_set1_epi8(0x1d);
+	const __m256i zero = _mm256_setzero_si256();
+	size_t d;
+
+	for (d = 0; d + 64 <= bytes; d += 64) {
+		__m256i wp0, wq0, wp1, wq1;
+
+		wp0 = wq0 = _mm256_loadu_si256((const __m256i *)&dptr[z0][d]);
+		wp1 = wq1 = _mm256_loadu_si256((const __m256i *)&dptr[z0][d + 32]);
+		for (int z = z0 - 1; z >= 0; z--) {
+			__m256i wd0 = _mm256_loadu_si256((const __m256i *)&dptr[z][d]);
+			__m256i wd1 = _mm256_loadu_si256((const __m256i *)&dptr[z][d + 32]);
+			__m256i w20, w21;
+
+			wp0 = _mm256_xor_si256(wp0, wd0);
+			wp1 = _mm256_xor_si256(wp1, wd1);
+			/* Multiply Q by 2 in GF(2^8) */
+			w20 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq0), x1d);
+			w21 = _mm256_and_si256(_mm256_cmpgt_epi8(zero, wq1), x1d);
+			wq0 = _mm256_xor_si256(_mm256_add_epi8(wq0, wq0), w20);
+			wq1 = _mm256_xor_si256(_mm256_add_epi8(wq1, wq1), w21);
+			wq0 = _mm256_xor_si256(wq0, wd0);
+			wq1 = _mm256_xor_si256(wq1, wd1);
+		}
+		_mm256_storeu_si256((__m256i *)&p[d], wp0);
+		_mm256_storeu_si256((__m256i *)&p[d + 32], wp1);
+		_mm256_storeu_si256((__m256i *)&q[d], wq0);
+		_mm256_storeu_si256((__m256i *)&q[d + 32], wq1);
+	}
+	return d;
+}
+
+/* Multiply by a constant using the low/high nibble tables of raid6_vgfmul */
+static inline __m256i gf_mul(__m256i lo, __m256i hi, __m256i x)
+{
+	const __m256i x0f = _mm256_set1_epi8(0x0f);
+	__m256i l = _mm256_and_si256(x, x0f);
+	__m256i h = _mm256_and_si256(_mm256_srli_epi16(x, 4), x0f);
+
+	return _mm256_xor_si256(_mm256_shuffle_epi8(lo, l),
+				_mm256_shuffle_epi8(hi, h));
+}
+
+static inline __m256i load_table(const u8 *table)
+{
+	return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)table));
+}
+
+size_t raid6_recov_data2_avx2(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+			      u8 pbmul, u8 qmul)
+{
+	const __m256i pblo = load_table(raid6_vgfmul[pbmul]);
+	const __m256i pbhi = load_table(raid6_vgfmul[pbmul] + 16);
+	const __m256i qlo = load_table(raid6_vgfmul[qmul]);
+	const __m256i qhi = load_table(raid6_vgfmul[qmul] + 16);
+	size_t d;
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		__m256i px, qx, db;
+
+		px = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&p[d]),
+				      _mm256_loadu_si256((const __m256i *)&dp[d]));
+		qx = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&q[d]),
+				      _mm256_loadu_si256((const __m256i *)&dq[d]));
+		qx = gf_mul(qlo, qhi, qx);
+		db = _mm256_xor_si256(gf_mul(pblo, pbhi, px), qx);
+		_mm256_storeu_si256((__m256i *)&dq[d], db);
+		_mm256_storeu_si256((__m256i *)&dp[d], _mm256_xor_si256(db, px));
+	}
+	return d;
+}
+
+size_t raid6_recov_datap_avx2(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul)
+{
+	const __m256i qlo = load_table(raid6_vgfmul[qmul]);
+	const __m256i qhi = load_table(raid6_vgfmul[qmul] + 16);
+	size_t d;
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		__m256i x;
+
+		x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&q[d]),
+				     _mm256_loadu_si256((const __m256i *)&dq[d]));
+		x = gf_mul(qlo, qhi, x);
+		_mm256_storeu_si256((__m256i *)&dq[d], x);
+		x = _mm256_xor_si256(x, _mm256_loadu_si256((const __m256i *)&p[d]));
+		_mm256_storeu_si256((__m256i *)&p[d], x);
+	}
+	return d;
+}
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+
+/*
+ * RAID6 syndrome generation and recovery using AVX-512BW, based on the kernel
+ * lib/raid6/avx512.c and lib/raid6/recov_avx512.c.
+ */
+
+#include "kerncompat.h"
+#include "kernel-lib/raid56.h"
+
+#ifdef __AVX512BW__
+
+#include <immintrin.h>
+
+size_t raid6_gen_syndrome_avx512(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	const int z0 = disks - 3;
+	u8 *p = dptr[z0 + 1];
+	u8 *q = dptr[z0 + 2];
+	const __m512i x1d = _mm512_set1_epi8(0x1d);
+	size_t d;
+
+	for (d = 0; d + 128 <= bytes; d += 128) {
+		__m512i wp0, wq0, wp1, wq1;
+
+		wp0 = wq0 = _mm512_loadu_si512(&dptr[z0][d]);
+		wp1 = wq1 = _mm512_loadu_si512(&dptr[z0][d + 64]);
+		for (int z = z0 - 1; z >= 0; z--) {
+			__m512i wd0 = _mm512_loadu_si512(&dptr[z][d]);
+			__m512i wd1 = _mm512_loadu_si512(&dptr[z][d + 64]);
+			__m512i w20, w21;
+
+			wp0 = _mm512_xor_si512(wp0, wd0);
+			wp1 = _mm512_xor_si512(wp1, wd1);
+			/* Multiply Q by 2 in GF(2^8) */
+			w20 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq0), x1d);
+			w21 = _mm512_maskz_mov_epi8(_mm512_movepi8_mask(wq1), x1d);
+			wq0 = _mm512_xor_si512(_mm512_add_epi8(wq0, wq0), w20);
+			wq1 = _mm512_xor_si512(_mm512_add_epi8(wq1, wq1), w21);
+			wq0 = _mm512_xor_si512(wq0, wd0);
+			wq1 = _mm512_xor_si512(wq1, wd1);
+		}
+		_mm512_storeu_si512(&p[d], wp0);
+		_mm512_storeu_si512(&p[d + 64], wp1);
+		_mm512_storeu_si512(&q[d], wq0);
+		_mm512_storeu_si512(&q[d + 64], wq1);
+	}
+	return d;
+}
+
+/* Multiply by a constant using the low/high nibble tables of raid6_vgfmul */
+static inline __m512i gf_mul(__m512i lo, __m512i hi, __m512i x)
+{
+	const __m512i x0f = _mm512_set1_epi8(0x0f);
+	__m512i l = _mm512_and_si512(x, x0f);
+	__m512i h = _mm512_and_si512(_mm512_srli_epi16(x, 4), x0f);
+
+	return _mm512_xor_si512(_mm512_shuffle_epi8(lo, l),
+				_mm512_shuffle_epi8(hi, h));
+}
+
+static inline __m512i load_table(const u8 *table)
+{
+	return _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)table));
+}
+
+size_t raid6_recov_data2_avx512(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+				u8 pbmul, u8 qmul)
+{
+	const __m512i pblo = load_table(raid6_vgfmul[pbmul]);
+	const __m512i pbhi = load_table(raid6_vgfmul[pbmul] + 16);
+	const __m512i qlo = load_table(raid6_vgfmul[qmul]);
+	const __m512i qhi = load_table(raid6_vgfmul[qmul] + 16);
+	size_t d;
+
+	for (d = 0; d + 64 <= bytes; d += 64) {
+		__m512i px, qx, db;
+
+		px = _mm512_xor_si512(_mm512_loadu_si512(&p[d]),
+				      _mm512_loadu_si512(&dp[d]));
+		qx = _mm512_xor_si512(_mm512_loadu_si512(&q[d]),
+				      _mm512_loadu_si512(&dq[d]));
+		qx = gf_mul(qlo, qhi, qx);
+		db = _mm512_xor_si512(gf_mul(pblo, pbhi, px), qx);
+		_mm512_storeu_si512(&dq[d], db);
+		_mm512_storeu_si512(&dp[d], _mm512_xor_si512(db, px));
+	}
+	return d;
+}
+
+size_t raid6_recov_datap_avx512(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul)
+{
+	const __m512i qlo = load_table(raid6_vgfmul[qmul]);
+	const __m512i qhi = load_table(raid6_vgfmul[qmul] + 16);
+	size_t d;
+
+	for (d = 0; d + 64 <= bytes; d += 64) {
+		__m512i x;
+
+		x = _mm512_xor_si512(_mm512_loadu_si512(&q[d]),
+				     _mm512_loadu_si512(&dq[d]));
+		x = gf_mul(qlo, qhi, x);
+		_mm512_storeu_si512(&dq[d], x);
+		_mm512_storeu_si512(&p[d],
+				    _mm512_xor_si512(x, _mm512_loadu_si512(&p[d])));
+	}
+	return d;
+}
+
+#endif
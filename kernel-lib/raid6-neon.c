@@ -0,0 +1,112 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+
+/*
+ * RAID6 syndrome generation and recovery using aarch64 Advanced SIMD, based
+ * on the kernel lib/raid6/neon.uc and lib/raid6/recov_neon_inner.c.
+ */
+
+#include "kerncompat.h"
+#include "kernel-lib/raid56.h"
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+
+#include <arm_neon.h>
+
+size_t raid6_gen_syndrome_neon(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	const int z0 = disks - 3;
+	u8 *p = dptr[z0 + 1];
+	u8 *q = dptr[z0 + 2];
+	const uint8x16_t x1d = vdupq_n_u8(0x1d);
+	size_t d;
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		uint8x16_t wp0, wq0, wp1, wq1;
+
+		wp0 = wq0 = vld1q_u8(&dptr[z0][d]);
+		wp1 = wq1 = vld1q_u8(&dptr[z0][d + 16]);
+		for (int z = z0 - 1; z >= 0; z--) {
+			uint8x16_t wd0 = vld1q_u8(&dptr[z][d]);
+			uint8x16_t wd1 = vld1q_u8(&dptr[z][d + 16]);
+			uint8x16_t w20, w21;
+
+			wp0 = veorq_u8(wp0, wd0);
+			wp1 = veorq_u8(wp1, wd1);
+			/* Multiply Q by 2 in GF(2^8) */
+			w20 = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(wq0), 7));
+			w21 = vreinterpretq_u8_s8(vshrq_n_s8(vreinterpretq_s8_u8(wq1), 7));
+			wq0 = veorq_u8(vshlq_n_u8(wq0, 1), vandq_u8(w20, x1d));
+			wq1 = veorq_u8(vshlq_n_u8(wq1, 1), vandq_u8(w21, x1d));
+			wq0 = veorq_u8(wq0, wd0);
+			wq1 = veorq_u8(wq1, wd1);
+		}
+		vst1q_u8(&p[d], wp0);
+		vst1q_u8(&p[d + 16], wp1);
+		vst1q_u8(&q[d], wq0);
+		vst1q_u8(&q[d + 16], wq1);
+	}
+	return d;
+}
+
+/* Multiply by a constant using the low/high nibble tables of raid6_vgfmul */
+static inline uint8x16_t gf_mul(uint8x16_t lo, uint8x16_t hi, uint8x16_t x)
+{
+	return veorq_u8(vqtbl1q_u8(lo, vandq_u8(x, vdupq_n_u8(0x0f))),
+			vqtbl1q_u8(hi, vshrq_n_u8(x, 4)));
+}
+
+size_t raid6_recov_data2_neon(size_t bytes, u8 *p, u8 *q, u8 *dp, u8 *dq,
+			      u8 pbmul, u8 qmul)
+{
+	const uint8x16_t pblo = vld1q_u8(raid6_vgfmul[pbmul]);
+	const uint8x16_t pbhi = vld1q_u8(raid6_vgfmul[pbmul] + 16);
+	const uint8x16_t qlo = vld1q_u8(raid6_vgfmul[qmul]);
+	const uint8x16_t qhi = vld1q_u8(raid6_vgfmul[qmul] + 16);
+	size_t d;
+
+	for (d = 0; d + 16 <= bytes; d += 16) {
+		uint8x16_t px, qx, db;
+
+		px = veorq_u8(vld1q_u8(&p[d]), vld1q_u8(&dp[d]));
+		qx = veorq_u8(vld1q_u8(&q[d]), vld1q_u8(&dq[d]));
+		qx = gf_mul(qlo, qhi, qx);
+		db = veorq_u8(gf_mul(pblo, pbhi, px), qx);
+		vst1q_u8(&dq[d], db);
+		vst1q_u8(&dp[d], veorq_u8(db, px));
+	}
+	return d;
+}
+
+size_t raid6_recov_datap_neon(size_t bytes, u8 *p, u8 *q, u8 *dq, u8 qmul)
+{
+	const uint8x16_t qlo = vld1q_u8(raid6_vgfmul[qmul]);
+	const uint8x16_t qhi = vld1q_u8(raid6_vgfmul[qmul] + 16);
+	size_t d;
+
+	for (d = 0; d + 16 <= bytes; d += 16) {
+		uint8x16_t x;
+
+		x = gf_mul(qlo, qhi, veorq_u8(vld1q_u8(&q[d]), vld1q_u8(&dq[d])));
+		vst1q_u8(&dq[d], x);
+		vst1q_u8(&p[d], veorq_u8(x, vld1q_u8(&p[d])));
+	}
+	return d;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+
+/*
+ * RAID6 syndrome generation using SSE2, based on the kernel lib/raid6/sse2.c.
+ * There's no byte shuffle in SSE2, recovery uses the portable code.
+ */
+
+#include "kerncompat.h"
+#include "kernel-lib/raid56.h"
+
+#ifdef __SSE2__
+
+#include <emmintrin.h>
+
+size_t raid6_gen_syndrome_sse2(int disks, size_t bytes, void **ptrs)
+{
+	u8 **dptr = (u8 **)ptrs;
+	const int z0 = disks - 3;
+	u8 *p = dptr[z0 + 1];
+	u8 *q = dptr[z0 + 2];
+	const __m128i x1d = _mm_set1_epi8(0x1d);
+	const __m128i zero = _mm_setzero_si128();
+	size_t d;
+
+	for (d = 0; d + 32 <= bytes; d += 32) {
+		__m128i wp0, wq0, wp1, wq1;
+
+		wp0 = wq0 = _mm_loadu_si128((const __m128i *)&dptr[z0][d]);
+		wp1 = wq1 = _mm_loadu_si128((const __m128i *)&dptr[z0][d + 16]);
+		for (int z = z0 - 1; z >= 0; z--) {
+			__m128i wd0 = _mm_loadu_si128((const __m128i *)&dptr[z][d]);
+			__m128i wd1 = _mm_loadu_si128((const __m128i *)&dptr[z][d + 16]);
+			__m128i w20, w21;
+
+			wp0 = _mm_xor_si128(wp0, wd0);
+			wp1 = _mm_xor_si128(wp1, wd1);
+			/* Multiply Q by 2 in GF(2^8) */
+			w20 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq0), x1d);
+			w21 = _mm_and_si128(_mm_cmpgt_epi8(zero, wq1), x1d);
+			wq0 = _mm_xor_si128(_mm_add_epi8(wq0, wq0), w20);
+			wq1 = _mm_xor_si128(_mm_add_epi8(wq1, wq1), w21);
+			wq0 = _mm_xor_si128(wq0, wd0);
+			wq1 = _mm_xor_si128(wq1, wd1);
+		}
+		_mm_storeu_si128((__m128i *)&p[d], wp0);
+		_mm_storeu_si128((__m128i *)&p[d + 16], wp1);
+		_mm_storeu_si128((__m128i *)&q[d], wq0);
+		_mm_storeu_si128((__m128i *)&q[d + 16], wq1);
+	}
+	return d;
+}
+
+#endif
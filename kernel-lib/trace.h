@@ -3,6 +3,38 @@
 
 #include "kerncompat.h"
 
+/*
+ * With --enable-usdt the tracepoints are USDT probes of provider "btrfs",
+ * e.g. for bpftrace:
+ *
+ *   bpftrace -e 'usdt:./btrfs:btrfs:tree_block_read { @[arg2] = count(); }'
+ *
+ * A disabled probe is a single nop instruction, the arguments are only
+ * evaluated when a tracer is attached.  Otherwise they compile to nothing.
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define btrfs_probe1(name, a)				\
+	DTRACE_PROBE1(btrfs, name, a)
+#define btrfs_probe2(name, a, b)			\
+	DTRACE_PROBE2(btrfs, name, a, b)
+#define btrfs_probe3(name, a, b, c)			\
+	DTRACE_PROBE3(btrfs, name, a, b, c)
+#define btrfs_probe4(name, a, b, c, d)			\
+	DTRACE_PROBE4(btrfs, name, a, b, c, d)
+#define btrfs_probe5(name, a, b, c, d, e)		\
+	DTRACE_PROBE5(btrfs, name, a, b, c, d, e)
+#define btrfs_probe6(name, a, b, c, d, e, f)		\
+	DTRACE_PROBE6(btrfs, name, a, b, c, d, e, f)
+#else
+#define btrfs_probe1(name, a)				do { } while (0)
+#define btrfs_probe2(name, a, b)			do { } while (0)
+#define btrfs_probe3(name, a, b, c)			do { } while (0)
+#define btrfs_probe4(name, a, b, c, d)			do { } while (0)
+#define btrfs_probe5(name, a, b, c, d, e)		do { } while (0)
+#define btrfs_probe6(name, a, b, c, d, e, f)		do { } while (0)
+#endif
+
 struct btrfs_work;
 struct btrfs_fs_info;
 struct extent_state;
@@ -10,59 +42,114 @@ struct extent_io_tree;
 
 static inline void trace_btrfs_workqueue_alloc(void *ret, const char *name)
 {
+	btrfs_probe2(workqueue_alloc, ret, name);
 }
 
 static inline void trace_btrfs_ordered_sched(struct btrfs_work *work)
 {
+	btrfs_probe1(ordered_sched, work);
 }
 
 static inline void trace_btrfs_all_work_done(struct btrfs_fs_info *fs_info,
 					     struct btrfs_work *work)
 {
+	btrfs_probe2(all_work_done, fs_info, work);
 }
 
 static inline void trace_btrfs_work_sched(struct btrfs_work *work)
 {
+	btrfs_probe1(work_sched, work);
 }
 
 static inline void trace_btrfs_work_queued(struct btrfs_work *work)
 {
+	btrfs_probe1(work_queued, work);
 }
 
 static inline void trace_btrfs_workqueue_destroy(void *wq)
 {
+	btrfs_probe1(workqueue_destroy, wq);
 }
 
 static inline void trace_alloc_extent_state(struct extent_state *state,
 					    gfp_t mask, unsigned long ip)
 {
+	btrfs_probe2(alloc_extent_state, state, ip);
 }
 
 static inline void trace_free_extent_state(struct extent_state *state,
 					   unsigned long ip)
 {
+	btrfs_probe2(free_extent_state, state, ip);
 }
 
 static inline void trace_btrfs_clear_extent_bit(struct extent_io_tree *tree,
 						u64 start, u64 end, u32 bits)
 {
+	btrfs_probe4(clear_extent_bit, tree, start, end, bits);
 }
 
 static inline void trace_btrfs_set_extent_bit(struct extent_io_tree *tree,
 					      u64 start, u64 end, u32 bits)
 {
+	btrfs_probe4(set_extent_bit, tree, start, end, bits);
 }
 
 static inline void trace_btrfs_convert_extent_bit(struct extent_io_tree *tree,
 						  u64 start, u64 end, u32 bits,
 						  u32 clear_bits)
 {
+	btrfs_probe5(convert_extent_bit, tree, start, end, bits, clear_bits);
 }
 
 static inline void trace_btrfs_cow_block(struct btrfs_root *root,
 					 struct extent_buffer *buf,
 					 struct extent_buffer *cow)
 {
+	btrfs_probe3(cow_block, root, buf, cow);
+}
+
+/* Tree block @bytenr of @level read from disk, @ret is 0 or -errno */
+static inline void trace_btrfs_tree_block_read(u64 bytenr, u64 owner, int level,
+					       int ret)
+{
+	btrfs_probe4(tree_block_read, bytenr, owner, level, ret);
+}
+
+/* Tree block @bytenr of @level written in transaction @transid */
+static inline void trace_btrfs_tree_block_write(u64 bytenr, u64 owner, int level,
+						u64 transid)
+{
+	btrfs_probe4(tree_block_write, bytenr, owner, level, transid);
+}
+
+/* Lookup of tree block @bytenr in the extent buffer cache */
+static inline void trace_btrfs_eb_cache(u64 bytenr, bool hit)
+{
+	btrfs_probe2(eb_cache, bytenr, hit);
+}
+
+static inline void trace_btrfs_transaction_commit_start(u64 transid)
+{
+	btrfs_probe1(transaction_commit_start, transid);
+}
+
+/* Transaction @transid written with the super blocks, @ret is 0 or -errno */
+static inline void trace_btrfs_transaction_commit(u64 transid, int ret)
+{
+	btrfs_probe2(transaction_commit, transid, ret);
+}
+
+/* @nr blocks of @len bytes checksummed at once */
+static inline void trace_btrfs_csum_batch(u16 csum_type, size_t len, size_t nr)
+{
+	btrfs_probe3(csum_batch, csum_type, len, nr);
+}
+
+static inline void trace_btrfs_search_slot(u64 root_id, u64 objectid, u8 type,
+					   u64 offset, int ins_len, int cow)
+{
+	btrfs_probe6(search_slot, root_id, objectid, type, offset, ins_len, cow);
 }
 
 #endif /* __PROGS_TRACE_H__ */
@@ -6,6 +6,7 @@
 #include "kerncompat.h"
 #include <stddef.h>
 #include <string.h>
+#include <stdbool.h>
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/uapi/btrfs.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
@@ -53,21 +54,60 @@ static inline void put_unaligned_le8(u8 val, void *p)
 			    offsetof(type, member),			\
 			   sizeof(((type *)0)->member)))
 
-#define DECLARE_BTRFS_SETGET_BITS(bits)					\
-u##bits btrfs_get_token_##bits(struct btrfs_map_token *token,		\
-			       const void *ptr, unsigned long off);	\
-void btrfs_set_token_##bits(struct btrfs_map_token *token,		\
-			    const void *ptr, unsigned long off,		\
-			    u##bits val);				\
-u##bits btrfs_get_##bits(const struct extent_buffer *eb,		\
-			 const void *ptr, unsigned long off);		\
-void btrfs_set_##bits(struct extent_buffer *eb, void *ptr,		\
-		      unsigned long off, u##bits val);
-
-DECLARE_BTRFS_SETGET_BITS(8)
-DECLARE_BTRFS_SETGET_BITS(16)
-DECLARE_BTRFS_SETGET_BITS(32)
-DECLARE_BTRFS_SETGET_BITS(64)
+/*
+ * MODIFIED:
+ *  - The extent buffer data are one contiguous buffer eb->data, not an array
+ *    of folios, so the generic helpers are inlined loads and stores at the
+ *    member offset, the bounds are checked only by debugging builds (D=ebounds)
+ */
+#ifdef DEBUG_EB_BOUNDS
+#include "kernel-shared/messages.h"
+
+bool btrfs_check_setget_bounds(const struct extent_buffer *eb,
+			       const void *ptr, unsigned off, int size);
+#define CHECK_SETGET_BOUNDS(eb, ptr, off, size)				\
+	ASSERT(btrfs_check_setget_bounds((eb), (ptr), (off), (size)))
+#else
+#define CHECK_SETGET_BOUNDS(eb, ptr, off, size)	do { } while (0)
+#endif
+
+#define DEFINE_BTRFS_SETGET_BITS(bits)					\
+static __always_inline u##bits btrfs_get_token_##bits(			\
+		struct btrfs_map_token *token,				\
+		const void *ptr, unsigned long off)			\
+{									\
+	const unsigned long member_offset = (unsigned long)ptr + off;	\
+	CHECK_SETGET_BOUNDS(token->eb, ptr, off, sizeof(u##bits));	\
+	return get_unaligned_le##bits(token->kaddr + member_offset);	\
+}									\
+static __always_inline u##bits btrfs_get_##bits(			\
+		const struct extent_buffer *eb,				\
+		const void *ptr, unsigned long off)			\
+{									\
+	const unsigned long member_offset = (unsigned long)ptr + off;	\
+	CHECK_SETGET_BOUNDS(eb, ptr, off, sizeof(u##bits));		\
+	return get_unaligned_le##bits(eb->data + member_offset);	\
+}									\
+static __always_inline void btrfs_set_token_##bits(			\
+		struct btrfs_map_token *token,				\
+		const void *ptr, unsigned long off, u##bits val)	\
+{									\
+	const unsigned long member_offset = (unsigned long)ptr + off;	\
+	CHECK_SETGET_BOUNDS(token->eb, ptr, off, sizeof(u##bits));	\
+	put_unaligned_le##bits(val, token->kaddr + member_offset);	\
+}									\
+static __always_inline void btrfs_set_##bits(struct extent_buffer *eb,	\
+		void *ptr, unsigned long off, u##bits val)		\
+{									\
+	const unsigned long member_offset = (unsigned long)ptr + off;	\
+	CHECK_SETGET_BOUNDS(eb, ptr, off, sizeof(u##bits));		\
+	put_unaligned_le##bits(val, eb->data + member_offset);		\
+}
+
+DEFINE_BTRFS_SETGET_BITS(8)
+DEFINE_BTRFS_SETGET_BITS(16)
+DEFINE_BTRFS_SETGET_BITS(32)
+DEFINE_BTRFS_SETGET_BITS(64)
 
 #define BTRFS_SETGET_FUNCS(name, type, member, bits)			\
 static inline u##bits btrfs_##name(const struct extent_buffer *eb,	\
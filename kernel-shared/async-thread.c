@@ -6,10 +6,14 @@
 
 #include "kerncompat.h"
 #include <stddef.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "kernel-lib/bitops.h"
 #include "kernel-lib/trace.h"
 #include "kernel-shared/async-thread.h"
 #include "common/internal.h"
+#include "common/messages.h"
 
 enum {
 	WORK_DONE_BIT,
@@ -19,17 +23,58 @@ enum {
 #define NO_THRESHOLD (-1)
 #define DFT_THRESHOLD (32)
 
-struct btrfs_workqueue {
-	struct workqueue_struct *normal_wq;
+/*
+ * Unlike in kernel, there's no workqueue infrastructure to build on and the
+ * spinlocks and atomics of kerncompat.h are not real, so the work items of
+ * all workqueues are executed by one pool of threads implemented here, and
+ * the state shared by the threads is protected by pthread locks.
+ *
+ * The threads are started on demand, up to the number of online CPUs, and
+ * exit when the last workqueue is destroyed.  Each workqueue keeps its own
+ * list of queued work and runs at most current_active items at a time, the
+ * workqueues with runnable work are served round robin.
+ */
+struct btrfs_work_pool {
+	pthread_mutex_t lock;
+	/* Signaled when work is queued, or on exit */
+	pthread_cond_t work_cond;
+	/* Signaled when a workqueue becomes idle */
+	pthread_cond_t idle_cond;
+	/* Workqueues with queued work that may run now */
+	struct list_head ready_list;
+	pthread_t *threads;
+	int nr_threads;
+	int max_threads;
+	int nr_idle;
+	/* Number of allocated workqueues */
+	int nr_users;
+	bool stop;
+};
 
+static struct btrfs_work_pool work_pool = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.idle_cond = PTHREAD_COND_INITIALIZER,
+	.ready_list = LIST_HEAD_INIT(work_pool.ready_list),
+};
+
+struct btrfs_workqueue {
 	/* File system this workqueue services */
 	struct btrfs_fs_info *fs_info;
 
+	/* Queued work not yet running, protected by the pool lock */
+	struct list_head queued_list;
+	int nr_queued;
+	int nr_running;
+
+	/* Entry in the pool ready list */
+	struct list_head ready_list;
+
 	/* List head pointing to ordered work list */
 	struct list_head ordered_list;
 
-	/* Spinlock for ordered_list */
-	spinlock_t list_lock;
+	/* Lock for ordered_list */
+	pthread_mutex_t list_lock;
 
 	/* Thresholding related variants */
 	atomic_t pending;
@@ -37,13 +82,16 @@ struct btrfs_workqueue {
 	/* Up limit of concurrency workers */
 	int limit_active;
 
-	/* Current number of concurrency workers */
+	/*
+	 * Current number of concurrency workers, changed with both thres_lock
+	 * and the pool lock held
+	 */
 	int current_active;
 
 	/* Threshold to change current_active */
 	int thresh;
 	unsigned int count;
-	spinlock_t thres_lock;
+	pthread_mutex_t thres_lock;
 };
 
 struct btrfs_fs_info * __pure btrfs_workqueue_owner(const struct btrfs_workqueue *wq)
@@ -67,7 +115,136 @@ bool btrfs_workqueue_normal_congested(const struct btrfs_workqueue *wq)
 	if (wq->thresh == NO_THRESHOLD)
 		return false;
 
-	return atomic_read(&wq->pending) > wq->thresh * 2;
+	return __atomic_load_n(&wq->pending, __ATOMIC_RELAXED) > wq->thresh * 2;
+}
+
+/* Pool lock held, whether a worker can take work of @wq now */
+static bool can_run_work(const struct btrfs_workqueue *wq)
+{
+	return wq->nr_queued > 0 && wq->nr_running < wq->current_active;
+}
+
+/* Pool lock held, put @wq to the ready list if it has work to run */
+static void update_ready(struct btrfs_workqueue *wq)
+{
+	if (can_run_work(wq)) {
+		if (list_empty(&wq->ready_list))
+			list_add_tail(&wq->ready_list, &work_pool.ready_list);
+	} else if (!list_empty(&wq->ready_list)) {
+		list_del_init(&wq->ready_list);
+	}
+}
+
+static void *work_pool_thread(void *arg)
+{
+	pthread_mutex_lock(&work_pool.lock);
+	while (1) {
+		struct btrfs_workqueue *wq;
+		struct btrfs_work *work;
+
+		if (list_empty(&work_pool.ready_list)) {
+			if (work_pool.stop)
+				break;
+			work_pool.nr_idle++;
+			pthread_cond_wait(&work_pool.work_cond, &work_pool.lock);
+			work_pool.nr_idle--;
+			continue;
+		}
+
+		wq = list_first_entry(&work_pool.ready_list, struct btrfs_workqueue,
+				      ready_list);
+		work = list_first_entry(&wq->queued_list, struct btrfs_work,
+					queued_list);
+		list_del_init(&work->queued_list);
+		wq->nr_queued--;
+		wq->nr_running++;
+		/* Round robin, the next worker serves another workqueue first */
+		list_del_init(&wq->ready_list);
+		update_ready(wq);
+		pthread_mutex_unlock(&work_pool.lock);
+
+		/* The work can be freed by its functions, don't touch it after */
+		work->normal_work.func(&work->normal_work);
+
+		pthread_mutex_lock(&work_pool.lock);
+		wq->nr_running--;
+		update_ready(wq);
+		if (!list_empty(&wq->ready_list))
+			pthread_cond_signal(&work_pool.work_cond);
+		if (wq->nr_queued == 0 && wq->nr_running == 0)
+			pthread_cond_broadcast(&work_pool.idle_cond);
+	}
+	pthread_mutex_unlock(&work_pool.lock);
+	return NULL;
+}
+
+/* Pool lock held, start a thread if no thread is waiting for work */
+static void work_pool_wake(void)
+{
+	if (work_pool.nr_idle == 0 && work_pool.nr_threads < work_pool.max_threads) {
+		int ret;
+
+		ret = pthread_create(&work_pool.threads[work_pool.nr_threads], NULL,
+				     work_pool_thread, NULL);
+		if (ret == 0) {
+			work_pool.nr_threads++;
+			return;
+		}
+		/* Keep going with the threads we have */
+		if (work_pool.nr_threads == 0) {
+			errno = ret;
+			error("cannot start workqueue thread: %m");
+			exit(1);
+		}
+	}
+	pthread_cond_signal(&work_pool.work_cond);
+}
+
+static int work_pool_get(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&work_pool.lock);
+	if (work_pool.nr_users == 0) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		work_pool.max_threads = max_t(long, 1, nr_cpus);
+		work_pool.threads = calloc(work_pool.max_threads,
+					   sizeof(*work_pool.threads));
+		if (!work_pool.threads) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		work_pool.nr_threads = 0;
+		work_pool.stop = false;
+	}
+	work_pool.nr_users++;
+out:
+	pthread_mutex_unlock(&work_pool.lock);
+	return ret;
+}
+
+static void work_pool_put(void)
+{
+	pthread_t *threads;
+	int nr_threads;
+
+	pthread_mutex_lock(&work_pool.lock);
+	if (--work_pool.nr_users > 0) {
+		pthread_mutex_unlock(&work_pool.lock);
+		return;
+	}
+	work_pool.stop = true;
+	pthread_cond_broadcast(&work_pool.work_cond);
+	threads = work_pool.threads;
+	nr_threads = work_pool.nr_threads;
+	work_pool.threads = NULL;
+	work_pool.nr_threads = 0;
+	pthread_mutex_unlock(&work_pool.lock);
+
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
 }
 
 struct btrfs_workqueue *btrfs_alloc_workqueue(struct btrfs_fs_info *fs_info,
@@ -80,13 +257,13 @@ struct btrfs_workqueue *btrfs_alloc_workqueue(struct btrfs_fs_info *fs_info,
 		return NULL;
 
 	ret->fs_info = fs_info;
-	ret->limit_active = limit_active;
+	ret->limit_active = max(limit_active, 1);
 	atomic_set(&ret->pending, 0);
 	if (thresh == 0)
 		thresh = DFT_THRESHOLD;
 	/* For low threshold, disabling threshold is a better choice */
 	if (thresh < DFT_THRESHOLD) {
-		ret->current_active = limit_active;
+		ret->current_active = ret->limit_active;
 		ret->thresh = NO_THRESHOLD;
 	} else {
 		/*
@@ -98,20 +275,31 @@ struct btrfs_workqueue *btrfs_alloc_workqueue(struct btrfs_fs_info *fs_info,
 		ret->thresh = thresh;
 	}
 
-	ret->normal_wq = alloc_workqueue("btrfs-%s", flags, ret->current_active,
-					 name);
-	if (!ret->normal_wq) {
+	if (work_pool_get() < 0) {
 		kfree(ret);
 		return NULL;
 	}
 
+	INIT_LIST_HEAD(&ret->queued_list);
+	INIT_LIST_HEAD(&ret->ready_list);
 	INIT_LIST_HEAD(&ret->ordered_list);
-	spin_lock_init(&ret->list_lock);
-	spin_lock_init(&ret->thres_lock);
+	pthread_mutex_init(&ret->list_lock, NULL);
+	pthread_mutex_init(&ret->thres_lock, NULL);
 	trace_btrfs_workqueue_alloc(ret, name);
 	return ret;
 }
 
+/* Counterpart of workqueue_set_max_active(), with thres_lock held */
+static void set_current_active(struct btrfs_workqueue *wq, int current_active)
+{
+	pthread_mutex_lock(&work_pool.lock);
+	wq->current_active = current_active;
+	update_ready(wq);
+	if (!list_empty(&wq->ready_list))
+		work_pool_wake();
+	pthread_mutex_unlock(&work_pool.lock);
+}
+
 /*
  * Hook for threshold which will be called in btrfs_queue_work.
  * This hook WILL be called in IRQ handler context,
@@ -121,7 +309,7 @@ static inline void thresh_queue_hook(struct btrfs_workqueue *wq)
 {
 	if (wq->thresh == NO_THRESHOLD)
 		return;
-	atomic_inc(&wq->pending);
+	__atomic_add_fetch(&wq->pending, 1, __ATOMIC_RELAXED);
 }
 
 /*
@@ -133,13 +321,12 @@ static inline void thresh_exec_hook(struct btrfs_workqueue *wq)
 {
 	int new_current_active;
 	long pending;
-	int need_change = 0;
 
 	if (wq->thresh == NO_THRESHOLD)
 		return;
 
-	atomic_dec(&wq->pending);
-	spin_lock(&wq->thres_lock);
+	__atomic_sub_fetch(&wq->pending, 1, __ATOMIC_RELAXED);
+	pthread_mutex_lock(&wq->thres_lock);
 	/*
 	 * Use wq->count to limit the calling frequency of
 	 * workqueue_set_max_active.
@@ -154,22 +341,16 @@ static inline void thresh_exec_hook(struct btrfs_workqueue *wq)
 	 * pending may be changed later, but it's OK since we really
 	 * don't need it so accurate to calculate new_max_active.
 	 */
-	pending = atomic_read(&wq->pending);
+	pending = __atomic_load_n(&wq->pending, __ATOMIC_RELAXED);
 	if (pending > wq->thresh)
 		new_current_active++;
 	if (pending < wq->thresh / 2)
 		new_current_active--;
 	new_current_active = clamp(new_current_active, 1, wq->limit_active);
-	if (new_current_active != wq->current_active)  {
-		need_change = 1;
-		wq->current_active = new_current_active;
-	}
+	if (new_current_active != wq->current_active)
+		set_current_active(wq, new_current_active);
 out:
-	spin_unlock(&wq->thres_lock);
-
-	if (need_change) {
-		workqueue_set_max_active(wq->normal_wq, wq->current_active);
-	}
+	pthread_mutex_unlock(&wq->thres_lock);
 }
 
 static void run_ordered_work(struct btrfs_workqueue *wq,
@@ -177,25 +358,24 @@ static void run_ordered_work(struct btrfs_workqueue *wq,
 {
 	struct list_head *list = &wq->ordered_list;
 	struct btrfs_work *work;
-	spinlock_t *lock = &wq->list_lock;
-	unsigned long flags;
+	pthread_mutex_t *lock = &wq->list_lock;
 	bool free_self = false;
 
 	while (1) {
-		spin_lock_irqsave(lock, flags);
+		pthread_mutex_lock(lock);
 		if (list_empty(list))
 			break;
 		work = list_entry(list->next, struct btrfs_work,
 				  ordered_list);
-		if (!test_bit(WORK_DONE_BIT, &work->flags))
-			break;
 		/*
 		 * Orders all subsequent loads after reading WORK_DONE_BIT,
-		 * paired with the smp_mb__before_atomic in btrfs_work_helper
-		 * this guarantees that the ordered function will see all
-		 * updates from ordinary work function.
+		 * paired with the release in btrfs_work_helper this
+		 * guarantees that the ordered function will see all updates
+		 * from ordinary work function.
 		 */
-		smp_rmb();
+		if (!(__atomic_load_n(&work->flags, __ATOMIC_ACQUIRE) &
+		      BIT_MASK(WORK_DONE_BIT)))
+			break;
 
 		/*
 		 * we are going to call the ordered done function, but
@@ -203,16 +383,17 @@ static void run_ordered_work(struct btrfs_workqueue *wq,
 		 * that later work items that are done don't have their
 		 * functions called before this one returns
 		 */
-		if (test_and_set_bit(WORK_ORDER_DONE_BIT, &work->flags))
+		if (__atomic_fetch_or(&work->flags, BIT_MASK(WORK_ORDER_DONE_BIT),
+				      __ATOMIC_RELAXED) & BIT_MASK(WORK_ORDER_DONE_BIT))
 			break;
 		trace_btrfs_ordered_sched(work);
-		spin_unlock_irqrestore(lock, flags);
+		pthread_mutex_unlock(lock);
 		work->ordered_func(work);
 
 		/* now take the lock again and drop our item from the list */
-		spin_lock_irqsave(lock, flags);
+		pthread_mutex_lock(lock);
 		list_del(&work->ordered_list);
-		spin_unlock_irqrestore(lock, flags);
+		pthread_mutex_unlock(lock);
 
 		if (work == self) {
 			/*
@@ -247,7 +428,7 @@ static void run_ordered_work(struct btrfs_workqueue *wq,
 			trace_btrfs_all_work_done(wq->fs_info, work);
 		}
 	}
-	spin_unlock_irqrestore(lock, flags);
+	pthread_mutex_unlock(lock);
 
 	if (free_self) {
 		self->ordered_free(self);
@@ -282,10 +463,9 @@ static void btrfs_work_helper(struct work_struct *normal_work)
 		 * Ensures all memory accesses done in the work function are
 		 * ordered before setting the WORK_DONE_BIT. Ensuring the thread
 		 * which is going to executed the ordered work sees them.
-		 * Pairs with the smp_rmb in run_ordered_work.
+		 * Pairs with the acquire in run_ordered_work.
 		 */
-		smp_mb__before_atomic();
-		set_bit(WORK_DONE_BIT, &work->flags);
+		__atomic_fetch_or(&work->flags, BIT_MASK(WORK_DONE_BIT), __ATOMIC_RELEASE);
 		run_ordered_work(wq, work);
 	} else {
 		/* NB: work must not be dereferenced past this point. */
@@ -301,40 +481,62 @@ void btrfs_init_work(struct btrfs_work *work, btrfs_func_t func,
 	work->ordered_free = ordered_free;
 	INIT_WORK(&work->normal_work, btrfs_work_helper);
 	INIT_LIST_HEAD(&work->ordered_list);
+	INIT_LIST_HEAD(&work->queued_list);
 	work->flags = 0;
 }
 
 void btrfs_queue_work(struct btrfs_workqueue *wq, struct btrfs_work *work)
 {
-	unsigned long flags;
-
 	work->wq = wq;
 	thresh_queue_hook(wq);
 	if (work->ordered_func) {
-		spin_lock_irqsave(&wq->list_lock, flags);
+		pthread_mutex_lock(&wq->list_lock);
 		list_add_tail(&work->ordered_list, &wq->ordered_list);
-		spin_unlock_irqrestore(&wq->list_lock, flags);
+		pthread_mutex_unlock(&wq->list_lock);
 	}
 	trace_btrfs_work_queued(work);
-	queue_work(wq->normal_wq, &work->normal_work);
+
+	pthread_mutex_lock(&work_pool.lock);
+	list_add_tail(&work->queued_list, &wq->queued_list);
+	wq->nr_queued++;
+	update_ready(wq);
+	if (!list_empty(&wq->ready_list))
+		work_pool_wake();
+	pthread_mutex_unlock(&work_pool.lock);
 }
 
 void btrfs_destroy_workqueue(struct btrfs_workqueue *wq)
 {
 	if (!wq)
 		return;
-	destroy_workqueue(wq->normal_wq);
+	btrfs_flush_workqueue(wq);
+	pthread_mutex_destroy(&wq->list_lock);
+	pthread_mutex_destroy(&wq->thres_lock);
+	work_pool_put();
 	trace_btrfs_workqueue_destroy(wq);
 	kfree(wq);
 }
 
 void btrfs_workqueue_set_max(struct btrfs_workqueue *wq, int limit_active)
 {
-	if (wq)
-		wq->limit_active = limit_active;
+	if (!wq)
+		return;
+	limit_active = max(limit_active, 1);
+	pthread_mutex_lock(&wq->thres_lock);
+	wq->limit_active = limit_active;
+	if (wq->thresh == NO_THRESHOLD || wq->current_active > limit_active)
+		set_current_active(wq, limit_active);
+	pthread_mutex_unlock(&wq->thres_lock);
 }
 
+/*
+ * Wait until all the work queued so far and the work queued by it is done,
+ * including the ordered functions.
+ */
 void btrfs_flush_workqueue(struct btrfs_workqueue *wq)
 {
-	flush_workqueue(wq->normal_wq);
+	pthread_mutex_lock(&work_pool.lock);
+	while (wq->nr_queued > 0 || wq->nr_running > 0)
+		pthread_cond_wait(&work_pool.idle_cond, &work_pool.lock);
+	pthread_mutex_unlock(&work_pool.lock);
 }
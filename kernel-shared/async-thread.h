@@ -24,6 +24,7 @@ struct btrfs_work {
 	/* Don't touch things below */
 	struct work_struct normal_work;
 	struct list_head ordered_list;
+	struct list_head queued_list;
 	struct btrfs_workqueue *wq;
 	unsigned long flags;
 };
@@ -32,6 +32,7 @@
 #include "kernel-shared/uapi/btrfs.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "common/internal.h"
+#include "common/extent-cache.h"
 
 #define pr_debug(...) do { } while (0)
 
@@ -935,6 +936,125 @@ static int btrfs_find_all_leafs(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
+/*
+ * Cache of the complete root set of tree blocks (and extents) looked up by
+ * btrfs_find_all_roots(), so blocks shared by many snapshots are resolved once
+ * instead of once per referencing extent.
+ *
+ * Entries are tagged with the filesystem generation, which is bumped by each
+ * new transaction, and are only used while no transaction is running, so
+ * backrefs changed since the lookup are never trusted.
+ */
+#define BLOCK_ROOTS_CACHE_MAX		(SZ_64K)
+
+struct btrfs_block_roots_cache {
+	struct cache_tree tree;
+	/* Least recently used entry first */
+	struct list_head lru;
+	u32 nr_entries;
+};
+
+struct block_roots {
+	/* start is the bytenr, size is always 1 */
+	struct cache_extent cache;
+	struct list_head lru;
+	u64 generation;
+	u32 nr_roots;
+	u64 roots[];
+};
+
+static void drop_block_roots(struct btrfs_block_roots_cache *cache,
+			     struct block_roots *entry)
+{
+	remove_cache_extent(&cache->tree, &entry->cache);
+	list_del(&entry->lru);
+	cache->nr_entries--;
+	kfree(entry);
+}
+
+void btrfs_free_block_roots_cache(struct btrfs_fs_info *fs_info)
+{
+	struct btrfs_block_roots_cache *cache = fs_info->block_roots_cache;
+
+	if (!cache)
+		return;
+	while (!list_empty(&cache->lru))
+		drop_block_roots(cache, list_first_entry(&cache->lru,
+						struct block_roots, lru));
+	kfree(cache);
+	fs_info->block_roots_cache = NULL;
+}
+
+static bool can_cache_block_roots(struct btrfs_fs_info *fs_info,
+				  struct btrfs_trans_handle *trans, u64 time_seq)
+{
+	if (trans || time_seq || fs_info->running_transaction)
+		return false;
+	if (!fs_info->block_roots_cache) {
+		struct btrfs_block_roots_cache *cache;
+
+		cache = kmalloc(sizeof(*cache), GFP_NOFS);
+		if (!cache)
+			return false;
+		cache_tree_init(&cache->tree);
+		INIT_LIST_HEAD(&cache->lru);
+		cache->nr_entries = 0;
+		fs_info->block_roots_cache = cache;
+	}
+	return true;
+}
+
+static struct block_roots *lookup_block_roots(struct btrfs_fs_info *fs_info,
+					      u64 bytenr)
+{
+	struct btrfs_block_roots_cache *cache = fs_info->block_roots_cache;
+	struct cache_extent *ce;
+	struct block_roots *entry;
+
+	ce = lookup_cache_extent(&cache->tree, bytenr, 1);
+	if (!ce)
+		return NULL;
+	entry = container_of(ce, struct block_roots, cache);
+	if (entry->generation != fs_info->generation) {
+		drop_block_roots(cache, entry);
+		return NULL;
+	}
+	list_move_tail(&entry->lru, &cache->lru);
+	return entry;
+}
+
+/* Failing to cache is not an error, the roots are looked up again next time */
+static void insert_block_roots(struct btrfs_fs_info *fs_info, u64 bytenr,
+			       struct ulist *roots)
+{
+	struct btrfs_block_roots_cache *cache = fs_info->block_roots_cache;
+	struct block_roots *entry;
+	struct ulist_node *node;
+	struct ulist_iterator uiter;
+	u32 nr = 0;
+
+	if (cache->nr_entries >= BLOCK_ROOTS_CACHE_MAX)
+		drop_block_roots(cache, list_first_entry(&cache->lru,
+						struct block_roots, lru));
+
+	entry = kmalloc(sizeof(*entry) + roots->nnodes * sizeof(u64), GFP_NOFS);
+	if (!entry)
+		return;
+	entry->cache.start = bytenr;
+	entry->cache.size = 1;
+	entry->generation = fs_info->generation;
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(roots, &uiter)))
+		entry->roots[nr++] = node->val;
+	entry->nr_roots = nr;
+	if (insert_cache_extent(&cache->tree, &entry->cache)) {
+		kfree(entry);
+		return;
+	}
+	list_add_tail(&entry->lru, &cache->lru);
+	cache->nr_entries++;
+}
+
 /*
  * walk all backrefs for a given extent to find all roots that reference this
  * extent. Walking a backref means finding all extents that reference this
@@ -948,9 +1068,9 @@ static int btrfs_find_all_leafs(struct btrfs_trans_handle *trans,
  *
  * returns 0 on success, < 0 on error.
  */
-static int __btrfs_find_all_roots(struct btrfs_trans_handle *trans,
-				  struct btrfs_fs_info *fs_info, u64 bytenr,
-				  u64 time_seq, struct ulist **roots)
+static int walk_all_roots(struct btrfs_trans_handle *trans,
+			  struct btrfs_fs_info *fs_info, u64 bytenr,
+			  u64 time_seq, struct ulist *roots)
 {
 	struct ulist *tmp;
 	struct ulist_node *node = NULL;
@@ -960,19 +1080,13 @@ static int __btrfs_find_all_roots(struct btrfs_trans_handle *trans,
 	tmp = ulist_alloc(GFP_NOFS);
 	if (!tmp)
 		return -ENOMEM;
-	*roots = ulist_alloc(GFP_NOFS);
-	if (!*roots) {
-		ulist_free(tmp);
-		return -ENOMEM;
-	}
 
 	ULIST_ITER_INIT(&uiter);
 	while (1) {
 		ret = find_parent_nodes(trans, fs_info, bytenr,
-					time_seq, tmp, *roots, NULL);
+					time_seq, tmp, roots, NULL);
 		if (ret < 0 && ret != -ENOENT) {
 			ulist_free(tmp);
-			ulist_free(*roots);
 			return ret;
 		}
 		node = ulist_next(tmp, &uiter);
@@ -986,6 +1100,92 @@ static int __btrfs_find_all_roots(struct btrfs_trans_handle *trans,
 	return 0;
 }
 
+/*
+ * Same as walk_all_roots() but recursive, so that the root set of each parent
+ * block is complete on its own and can be cached and reused.
+ *
+ * Backrefs lead one level up, so the recursion is bounded by the tree height
+ * unless the backrefs are corrupted and loop; deeper than that fall back to
+ * the iterative walk, which handles loops.
+ */
+static int find_all_roots_cached(struct btrfs_fs_info *fs_info, u64 bytenr,
+				 struct ulist *roots, int depth)
+{
+	struct block_roots *entry;
+	struct ulist *parents;
+	struct ulist *found;
+	struct ulist_node *node;
+	struct ulist_iterator uiter;
+	int ret;
+	u32 i;
+
+	entry = lookup_block_roots(fs_info, bytenr);
+	if (entry) {
+		for (i = 0; i < entry->nr_roots; i++) {
+			ret = ulist_add(roots, entry->roots[i], 0, GFP_NOFS);
+			if (ret < 0)
+				return ret;
+		}
+		return 0;
+	}
+
+	if (depth > BTRFS_MAX_LEVEL)
+		return walk_all_roots(NULL, fs_info, bytenr, 0, roots);
+
+	parents = ulist_alloc(GFP_NOFS);
+	found = ulist_alloc(GFP_NOFS);
+	if (!parents || !found) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = find_parent_nodes(NULL, fs_info, bytenr, 0, parents, found, NULL);
+	if (ret < 0 && ret != -ENOENT)
+		goto out;
+
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(parents, &uiter))) {
+		ret = find_all_roots_cached(fs_info, node->val, found, depth + 1);
+		if (ret < 0)
+			goto out;
+		cond_resched();
+	}
+	insert_block_roots(fs_info, bytenr, found);
+
+	ULIST_ITER_INIT(&uiter);
+	while ((node = ulist_next(found, &uiter))) {
+		ret = ulist_add(roots, node->val, 0, GFP_NOFS);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	ulist_free(parents);
+	ulist_free(found);
+	return ret;
+}
+
+static int __btrfs_find_all_roots(struct btrfs_trans_handle *trans,
+				  struct btrfs_fs_info *fs_info, u64 bytenr,
+				  u64 time_seq, struct ulist **roots)
+{
+	int ret;
+
+	*roots = ulist_alloc(GFP_NOFS);
+	if (!*roots)
+		return -ENOMEM;
+
+	if (can_cache_block_roots(fs_info, trans, time_seq))
+		ret = find_all_roots_cached(fs_info, bytenr, *roots, 0);
+	else
+		ret = walk_all_roots(trans, fs_info, bytenr, time_seq, *roots);
+	if (ret < 0) {
+		ulist_free(*roots);
+		*roots = NULL;
+	}
+	return ret;
+}
+
 int btrfs_find_all_roots(struct btrfs_trans_handle *trans,
 			 struct btrfs_fs_info *fs_info, u64 bytenr,
 			 u64 time_seq, struct ulist **roots)
@@ -19,8 +19,10 @@
 #include "kerncompat.h"
 #include <errno.h>
 #include <string.h>
+#include <pthread.h>
 #include "kernel-lib/bitops.h"
 #include "kernel-lib/sizes.h"
+#include "kernel-lib/trace.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/transaction.h"
@@ -29,6 +31,7 @@
 #include "kernel-shared/volumes.h"
 #include "common/internal.h"
 #include "common/messages.h"
+#include "common/tree-prefetch.h"
 
 static int split_node(struct btrfs_trans_handle *trans, struct btrfs_root
 		      *root, struct btrfs_path *path, int level);
@@ -756,6 +759,26 @@ static int noinline check_block(struct btrfs_fs_info *fs_info,
 	return -EIO;
 }
 
+/*
+ * Compare a key in the extent buffer to @key, decoding only the members that
+ * are needed.  The objectid decides most comparisons during a search.
+ */
+static __always_inline int comp_disk_key(const struct btrfs_disk_key *disk,
+					 const struct btrfs_key *key)
+{
+	u64 objectid = btrfs_disk_key_objectid(disk);
+	u64 offset;
+
+	if (objectid != key->objectid)
+		return objectid < key->objectid ? -1 : 1;
+	if (disk->type != key->type)
+		return disk->type < key->type ? -1 : 1;
+	offset = btrfs_disk_key_offset(disk);
+	if (offset != key->offset)
+		return offset < key->offset ? -1 : 1;
+	return 0;
+}
+
 /*
  * search for key in the extent_buffer.  The items start at offset p,
  * and they are item_size apart.  There are 'max' items in p.
@@ -765,24 +788,24 @@ static int noinline check_block(struct btrfs_fs_info *fs_info,
  * the array.
  *
  * slot may point to max if the key is bigger than all of the keys
+ *
+ * Always inlined so the leaf and node variants get a constant item size.
  */
-static int generic_bin_search(struct extent_buffer *eb, unsigned long p,
-			      int item_size, const struct btrfs_key *key,
-			      int max, int *slot)
+static __always_inline int generic_bin_search(struct extent_buffer *eb,
+					      unsigned long p, int item_size,
+					      const struct btrfs_key *key,
+					      int max, int *slot)
 {
+	const char *base = eb->data + p;
 	int low = 0;
 	int high = max;
 	int mid;
 	int ret;
-	unsigned long offset;
-	struct btrfs_disk_key *tmp;
 
 	while(low < high) {
 		mid = (low + high) / 2;
-		offset = p + mid * item_size;
-
-		tmp = (struct btrfs_disk_key *)(eb->data + offset);
-		ret = btrfs_comp_keys(tmp, key);
+		ret = comp_disk_key((const struct btrfs_disk_key *)
+				    (base + mid * item_size), key);
 
 		if (ret < 0)
 			low = mid + 1;
@@ -1246,6 +1269,111 @@ static void reada_for_search(struct btrfs_fs_info *fs_info,
 	}
 }
 
+/*
+ * Readahead of the sequential scans by btrfs_next_leaf() starts with
+ * READA_MIN_BLOCKS leaves and doubles each time the scan gets halfway through
+ * the blocks read ahead, up to READA_MAX_BYTES.  Each node covers hundreds
+ * of leaves, a few of them are enough.
+ */
+#define READA_MIN_BLOCKS		(16)
+#define READA_MAX_BYTES			(SZ_4M)
+#define READA_NODE_BLOCKS		(4)
+/* Leaves stepped over by btrfs_next_leaf() to read ahead without path->reada */
+#define READA_AUTO_LEAVES		(4)
+#define READA_PREFETCH_THREADS		(4)
+
+/*
+ * Prefetch engine for the readahead of @fs_info, shared by all the paths and
+ * started on first use, e.g. the first window that grows past the initial
+ * size.  Returns NULL if it can't be used, the blocks then go to
+ * readahead(2) one by one.
+ */
+struct tree_prefetch *btrfs_reada_prefetch(struct btrfs_fs_info *fs_info)
+{
+	static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+	struct tree_prefetch *tp;
+
+	tp = __atomic_load_n(&fs_info->reada_prefetch, __ATOMIC_ACQUIRE);
+	if (tp || fs_info->reada_prefetch_failed)
+		return tp;
+	/* Zoned devices bypass the page cache, the metadump has no devices */
+	if (fs_info->zoned || fs_info->on_restoring)
+		return NULL;
+	pthread_mutex_lock(&alloc_lock);
+	tp = fs_info->reada_prefetch;
+	if (!tp && !fs_info->reada_prefetch_failed) {
+		tp = tree_prefetch_alloc(fs_info, READA_PREFETCH_THREADS);
+		if (tp)
+			__atomic_store_n(&fs_info->reada_prefetch, tp,
+					 __ATOMIC_RELEASE);
+		else
+			fs_info->reada_prefetch_failed = true;
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return tp;
+}
+
+/* Stop the readahead, before closing the devices */
+void btrfs_reada_free(struct btrfs_fs_info *fs_info)
+{
+	tree_prefetch_free(fs_info->reada_prefetch);
+	fs_info->reada_prefetch = NULL;
+}
+
+/*
+ * Read ahead the blocks following @slot of the node at @level for a scan
+ * going through it sequentially.  The next batch is started when half of the
+ * previous one has been consumed, so the reads stay ahead of the scan.
+ */
+static void reada_sequential(struct btrfs_fs_info *fs_info,
+			     struct btrfs_path *path, int level, int slot)
+{
+	struct extent_buffer *node = path->nodes[level];
+	struct tree_prefetch *tp = NULL;
+	u32 window = path->reada_window[level];
+	u32 end = path->reada_end[level];
+	u32 max_window;
+	u32 nritems;
+	u32 nr;
+
+	if (!node || level == 0)
+		return;
+	if (window && slot < end && end - slot > window / 2)
+		return;
+
+	if (level == 1)
+		max_window = max_t(u32, READA_MAX_BYTES / fs_info->nodesize,
+				   READA_MIN_BLOCKS);
+	else
+		max_window = READA_NODE_BLOCKS;
+	if (!window)
+		window = min_t(u32, READA_MIN_BLOCKS, max_window);
+	else
+		window = min(window * 2, max_window);
+	path->reada_window[level] = window;
+	if (window > READA_MIN_BLOCKS)
+		tp = btrfs_reada_prefetch(fs_info);
+
+	nritems = btrfs_header_nritems(node);
+	nr = max_t(u32, end, slot + 1);
+	end = min(slot + 1 + window, nritems);
+	for (; nr < end; nr++) {
+		u64 bytenr = btrfs_node_blockptr(node, nr);
+		u64 gen = btrfs_node_ptr_generation(node, nr);
+		struct extent_buffer *eb;
+
+		if (!tp) {
+			readahead_tree_block(fs_info, bytenr, gen);
+			continue;
+		}
+		eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
+		if (!(eb && btrfs_buffer_uptodate(eb, gen, 0)))
+			tree_prefetch_readahead(tp, bytenr);
+		free_extent_buffer(eb);
+	}
+	path->reada_end[level] = max_t(u32, end, path->reada_end[level]);
+}
+
 /*
  * Find the first key in @fs_root that matches all the following conditions:
  *
@@ -1326,6 +1454,8 @@ int btrfs_search_slot(struct btrfs_trans_handle *trans,
 	struct btrfs_fs_info *fs_info = root->fs_info;
 	u8 lowest_level = 0;
 
+	trace_btrfs_search_slot(root->root_key.objectid, key->objectid, key->type,
+				key->offset, ins_len, cow);
 	lowest_level = p->lowest_level;
 	WARN_ON(lowest_level && ins_len > 0);
 	WARN_ON(p->nodes[0] != NULL);
@@ -1350,6 +1480,7 @@ again:
 			WARN_ON(1);
 		level = btrfs_header_level(b);
 		p->nodes[level] = b;
+		p->reada_end[level] = 0;
 		ret = check_block(fs_info, p, level);
 		if (ret)
 			return -1;
@@ -1897,6 +2028,64 @@ int btrfs_leaf_free_space(const struct extent_buffer *leaf)
 	return ret;
 }
 
+/*
+ * Decode all item headers of @leaf into @items.
+ *
+ * The arrays are sized for the largest item count of the leaf size on first
+ * use, so a reused @items does not reallocate for same sized leaves.
+ *
+ * Return 0 on success, -EUCLEAN if nritems can't fit in the leaf and -ENOMEM
+ * on allocation failure.
+ */
+int btrfs_leaf_items_decode(const struct extent_buffer *leaf,
+			    struct btrfs_leaf_items *items)
+{
+	const u32 nr = btrfs_header_nritems(leaf);
+	const u32 max = __BTRFS_LEAF_DATA_SIZE(leaf->len) / sizeof(struct btrfs_item);
+	const char *p = leaf->data + btrfs_item_nr_offset(leaf, 0);
+	u32 i;
+
+	items->nr = 0;
+	if (nr > max)
+		return -EUCLEAN;
+	if (max > items->capacity) {
+		btrfs_leaf_items_release(items);
+		items->keys = malloc(max * sizeof(*items->keys));
+		items->types = malloc(max * sizeof(*items->types));
+		items->offsets = malloc(max * sizeof(*items->offsets));
+		items->sizes = malloc(max * sizeof(*items->sizes));
+		if (!items->keys || !items->types || !items->offsets ||
+		    !items->sizes) {
+			btrfs_leaf_items_release(items);
+			return -ENOMEM;
+		}
+		items->capacity = max;
+	}
+
+	/* Read the packed on-disk items directly, they're contiguous in data */
+	for (i = 0; i < nr; i++, p += sizeof(struct btrfs_item)) {
+		const struct btrfs_item *item = (const struct btrfs_item *)p;
+
+		items->keys[i].objectid = get_unaligned_le64(&item->key.objectid);
+		items->keys[i].type = item->key.type;
+		items->keys[i].offset = get_unaligned_le64(&item->key.offset);
+		items->types[i] = item->key.type;
+		items->offsets[i] = get_unaligned_le32(&item->offset);
+		items->sizes[i] = get_unaligned_le32(&item->size);
+	}
+	items->nr = nr;
+	return 0;
+}
+
+void btrfs_leaf_items_release(struct btrfs_leaf_items *items)
+{
+	free(items->keys);
+	free(items->types);
+	free(items->offsets);
+	free(items->sizes);
+	memset(items, 0, sizeof(*items));
+}
+
 /*
  * push some data in the path leaf to the right, trying to free up at
  * least data_size bytes.  returns zero if the push worked, nonzero otherwise
@@ -2274,6 +2463,24 @@ static noinline int copy_for_split(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+/*
+ * Check if the path's leaf is the last one of the tree, i.e. the path points
+ * to the last slot of all the nodes above it.
+ */
+static bool path_leaf_is_rightmost(const struct btrfs_path *path)
+{
+	int level;
+
+	for (level = 1; level < BTRFS_MAX_LEVEL; level++) {
+		if (!path->nodes[level])
+			break;
+		if (path->slots[level] + 1 <
+		    btrfs_header_nritems(path->nodes[level]))
+			return false;
+	}
+	return true;
+}
+
 /*
  * split the path's leaf in two, making sure there is at least data_size
  * available for the resulting leaf level of the path.
@@ -2332,6 +2539,16 @@ again:
 	nritems = btrfs_header_nritems(l);
 	mid = (nritems + 1) / 2;
 
+	/*
+	 * Appending after the last item of the tree, as done by inserts with
+	 * ascending keys (mkfs --rootdir, convert, repair), move only the last
+	 * tenth of the items.  A middle split leaves the left leaf half empty
+	 * until the next split pushes the items back to it.
+	 */
+	if (!extend && data_size && slot == nritems && nritems > 1 &&
+	    path_leaf_is_rightmost(path))
+		mid = nritems - max_t(u32, nritems / 10, 1);
+
 	if (mid <= slot) {
 		if (nritems == 1 ||
 		    leaf_space_used(l, mid, nritems - mid) + data_size >
@@ -2832,6 +3049,200 @@ int btrfs_insert_item(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+void btrfs_bulk_loader_init(struct btrfs_bulk_loader *loader,
+			    struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root, unsigned int fill_percent)
+{
+	const u32 leaf_data_size = BTRFS_LEAF_DATA_SIZE(root->fs_info);
+
+	memset(loader, 0, sizeof(*loader));
+	loader->trans = trans;
+	loader->root = root;
+	fill_percent = min(fill_percent, 100U);
+	loader->leaf_reserve = leaf_data_size * (100 - fill_percent) / 100;
+}
+
+void btrfs_bulk_loader_release(struct btrfs_bulk_loader *loader)
+{
+	btrfs_release_path(&loader->path);
+}
+
+/*
+ * Check if @key goes right after the last item of the leaf of @path, IOW
+ * appending @key doesn't need any search.  That's the case beyond the last
+ * key of the tree or before the first key of the next leaf.
+ */
+static bool bulk_loader_can_append(const struct btrfs_path *path,
+				   const struct btrfs_key *key)
+{
+	struct extent_buffer *leaf = path->nodes[0];
+	u32 nritems = btrfs_header_nritems(leaf);
+	struct btrfs_key last;
+	int level;
+
+	for (level = 1; level < BTRFS_MAX_LEVEL && path->nodes[level]; level++) {
+		struct btrfs_key next;
+
+		if (path->slots[level] ==
+		    btrfs_header_nritems(path->nodes[level]) - 1)
+			continue;
+		btrfs_node_key_to_cpu(path->nodes[level], &next,
+				      path->slots[level] + 1);
+		if (btrfs_comp_cpu_keys(key, &next) >= 0)
+			return false;
+		break;
+	}
+	if (nritems == 0)
+		return true;
+	btrfs_item_key_to_cpu(leaf, &last, nritems - 1);
+	return btrfs_comp_cpu_keys(&last, key) < 0;
+}
+
+/*
+ * Start a new empty leaf right of the current one for @key.
+ *
+ * Unlike split_leaf() nothing is moved, the current leaf stays as full as it
+ * is.  Return 1 if the parent node has no room for the new pointer.
+ */
+static int bulk_loader_new_leaf(struct btrfs_bulk_loader *loader,
+				const struct btrfs_key *key)
+{
+	struct btrfs_trans_handle *trans = loader->trans;
+	struct btrfs_root *root = loader->root;
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	struct btrfs_path *path = &loader->path;
+	struct btrfs_disk_key disk_key;
+	struct extent_buffer *right;
+	int ret;
+
+	if (!path->nodes[1]) {
+		ret = insert_new_root(trans, root, path, 1);
+		if (ret)
+			return ret;
+	}
+	if (btrfs_header_nritems(path->nodes[1]) >=
+	    BTRFS_NODEPTRS_PER_BLOCK(fs_info))
+		return 1;
+
+	btrfs_cpu_key_to_disk(&disk_key, key);
+	right = btrfs_alloc_tree_block(trans, root, 0, root->root_key.objectid,
+				       &disk_key, 0, path->nodes[0]->start, 0,
+				       BTRFS_NESTING_NORMAL);
+	if (IS_ERR(right))
+		return PTR_ERR(right);
+
+	memset_extent_buffer(right, 0, 0, sizeof(struct btrfs_header));
+	btrfs_set_header_bytenr(right, right->start);
+	btrfs_set_header_generation(right, trans->transid);
+	btrfs_set_header_backref_rev(right, BTRFS_MIXED_BACKREF_REV);
+	btrfs_set_header_owner(right, root->root_key.objectid);
+	btrfs_set_header_level(right, 0);
+	write_extent_buffer_fsid(right, fs_info->fs_devices->metadata_uuid);
+	write_extent_buffer_chunk_tree_uuid(right, fs_info->chunk_tree_uuid);
+	root_add_used(root, fs_info->nodesize);
+
+	ret = insert_ptr(trans, root, path, &disk_key, right->start,
+			 path->slots[1] + 1, 1);
+	if (ret) {
+		free_extent_buffer(right);
+		return ret;
+	}
+	free_extent_buffer(path->nodes[0]);
+	path->nodes[0] = right;
+	path->slots[0] = 0;
+	path->slots[1] += 1;
+	btrfs_mark_buffer_dirty(right);
+	return 0;
+}
+
+/*
+ * Add one item of a key-sorted stream to the tree.
+ *
+ * While the keys come after the last key of the tree, or fall in the gap
+ * before the next leaf, items are appended to the cached leaf without any
+ * search, and a full leaf is followed by a new empty one instead of being
+ * split.  Any other key is inserted the regular way.
+ *
+ * Return 0 on success, -EEXIST if the key already exists and < 0 on error.
+ */
+int btrfs_bulk_loader_add(struct btrfs_bulk_loader *loader,
+			  const struct btrfs_key *key, const void *data,
+			  u32 size)
+{
+	struct btrfs_trans_handle *trans = loader->trans;
+	struct btrfs_root *root = loader->root;
+	struct btrfs_path *path = &loader->path;
+	const u32 needed = size + sizeof(struct btrfs_item);
+	struct btrfs_disk_key disk_key;
+	struct extent_buffer *leaf;
+	unsigned int data_end;
+	u32 nritems;
+	int ret;
+
+	if (path->nodes[0] && !bulk_loader_can_append(path, key))
+		btrfs_release_path(path);
+again:
+	if (!path->nodes[0]) {
+		/* Split full nodes on the way down, but never the leaf */
+		path->search_for_split = 1;
+		ret = btrfs_search_slot(trans, root, key, path, 0, 1);
+		path->search_for_split = 0;
+		if (ret == 0)
+			ret = -EEXIST;
+		if (ret < 0)
+			goto error;
+
+		if (!bulk_loader_can_append(path, key)) {
+			btrfs_release_path(path);
+			ret = btrfs_insert_empty_item(trans, root, path, key, size);
+			if (ret < 0)
+				goto error;
+			leaf = path->nodes[0];
+			write_extent_buffer(leaf, data,
+					    btrfs_item_ptr_offset(leaf, path->slots[0]),
+					    size);
+			btrfs_mark_buffer_dirty(leaf);
+			return 0;
+		}
+	}
+
+	leaf = path->nodes[0];
+	if (btrfs_header_nritems(leaf) &&
+	    btrfs_leaf_free_space(leaf) < needed + loader->leaf_reserve) {
+		ret = bulk_loader_new_leaf(loader, key);
+		if (ret < 0)
+			goto error;
+		if (ret > 0) {
+			btrfs_release_path(path);
+			goto again;
+		}
+		leaf = path->nodes[0];
+	}
+	if (btrfs_leaf_free_space(leaf) < needed) {
+		ret = -EOVERFLOW;
+		goto error;
+	}
+
+	nritems = btrfs_header_nritems(leaf);
+	data_end = leaf_data_end(leaf) - size;
+	btrfs_cpu_key_to_disk(&disk_key, key);
+	btrfs_set_item_key(leaf, &disk_key, nritems);
+	btrfs_set_item_offset(leaf, nritems, data_end);
+	btrfs_set_item_size(leaf, nritems, size);
+	btrfs_set_header_nritems(leaf, nritems + 1);
+	write_extent_buffer(leaf, data, btrfs_item_ptr_offset(leaf, nritems),
+			    size);
+	btrfs_mark_buffer_dirty(leaf);
+	path->slots[0] = nritems;
+	if (nritems == 0)
+		fixup_low_keys(path, &disk_key, 1);
+	return 0;
+
+error:
+	btrfs_release_path(path);
+	return ret;
+}
+
 /*
  * delete the pointer from a given node.
  *
@@ -3066,6 +3477,18 @@ int btrfs_prev_leaf(struct btrfs_root *root, struct btrfs_path *path)
  * returns 0 if it found something or 1 if there are no greater leaves.
  * returns < 0 on io errors.
  */
+/*
+ * Start readahead of the tree blocks following @slot of the node at @level,
+ * if path->reada is set.  For callers that walk the tree sideways by
+ * themselves instead of using btrfs_next_leaf().
+ */
+void btrfs_readahead_siblings(struct btrfs_fs_info *fs_info,
+			      struct btrfs_path *path, int level, int slot)
+{
+	if (path->reada)
+		reada_sequential(fs_info, path, level, slot);
+}
+
 int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 				  struct btrfs_path *path)
 {
@@ -3073,8 +3496,13 @@ int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 	int level = path->lowest_level + 1;
 	struct extent_buffer *c;
 	struct extent_buffer *next = NULL;
+	bool reada;
 
 	BUG_ON(path->lowest_level + 1 >= BTRFS_MAX_LEVEL);
+	/* A scan going leaf after leaf reads ahead even if not asked to */
+	if (path->reada_seq < READA_AUTO_LEAVES)
+		path->reada_seq++;
+	reada = path->reada || path->reada_seq >= READA_AUTO_LEAVES;
 	do {
 		if (!path->nodes[level])
 			return 1;
@@ -3088,8 +3516,8 @@ int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 			continue;
 		}
 
-		if (path->reada)
-			reada_for_search(fs_info, path, level, slot, 0);
+		if (reada)
+			reada_sequential(fs_info, path, level, slot);
 
 		next = btrfs_read_node_slot(c, slot);
 		if (!extent_buffer_uptodate(next))
@@ -3103,6 +3531,7 @@ int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 		free_extent_buffer(c);
 		path->nodes[level] = next;
 		path->slots[level] = 0;
+		path->reada_end[level] = 0;
 		/*
 		 * Fsck will happily load corrupt blocks in order to fix them,
 		 * so we need an extra check just to make sure this block isn't
@@ -3112,8 +3541,8 @@ int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 			return -EIO;
 		if (level == path->lowest_level)
 			break;
-		if (path->reada)
-			reada_for_search(fs_info, path, level, 0, 0);
+		if (reada)
+			reada_sequential(fs_info, path, level, 0);
 		next = btrfs_read_node_slot(next, 0);
 		if (!extent_buffer_uptodate(next))
 			return -EIO;
@@ -32,10 +32,12 @@
 #include "kernel-shared/locking.h"
 #include "crypto/crc32c.h"
 #include "common/extent-cache.h"
+#include "common/extent-bitmap.h"
 
 struct btrfs_root;
 struct btrfs_trans_handle;
 struct btrfs_free_space_ctl;
+struct btrfs_block_roots_cache;
 
 /*
  * Fake signature for an unfinalized filesystem, which only has barebone tree
@@ -49,6 +51,8 @@ struct btrfs_free_space_ctl;
 
 struct btrfs_mapping_tree {
 	struct cache_tree cache_tree;
+	/* Chunk of the last btrfs_map_block(), reset when chunks are removed */
+	struct cache_extent *last_hit;
 };
 
 static inline unsigned long btrfs_chunk_item_size(int num_stripes)
@@ -164,6 +168,14 @@ struct btrfs_path {
 	/* The kernel locking scheme is not done in userspace. */
 	u8 locks[BTRFS_MAX_LEVEL];
 	u8 reada;
+	/*
+	 * Adaptive readahead of btrfs_next_leaf(): the window of each level in
+	 * blocks, the slot of nodes[level] the readahead got to and the number
+	 * of leaves stepped over so far.
+	 */
+	u16 reada_window[BTRFS_MAX_LEVEL];
+	u16 reada_end[BTRFS_MAX_LEVEL];
+	u8 reada_seq;
 	/* keep some upper locks as we walk down */
 	u8 lowest_level;
 
@@ -297,8 +309,17 @@ struct btrfs_block_group {
 	u64 global_root_id;
 };
 
+/* Index of fs_info::fs_root_tree by objectid, see btrfs_read_fs_root() */
+struct fs_root_hash {
+	struct btrfs_root **slots;
+	unsigned int bits;
+	u64 nr_entries;
+};
+
 struct btrfs_device;
 struct btrfs_fs_devices;
+struct raid56_read_cache;
+struct tree_prefetch;
 struct btrfs_fs_info {
 	u8 chunk_tree_uuid[BTRFS_UUID_SIZE];
 	u8 *new_chunk_tree_uuid;
@@ -313,16 +334,43 @@ struct btrfs_fs_info {
 
 	struct rb_root global_roots_tree;
 	struct rb_root fs_root_tree;
+	struct fs_root_hash fs_root_hash;
 
 	/* the log root tree is a directory of all the other log roots */
 	struct btrfs_root *log_root_tree;
 
 	struct cache_tree extent_cache;
+	struct extent_buffer_hash eb_hash;
+	/* Allocators for nodesize extent buffers of the cache */
+	struct object_slab eb_header_slab;
+	struct object_slab eb_data_slab;
+	/* Full stripes read for RAID56 recovery, see read_raid56() */
+	struct raid56_read_cache *raid56_cache;
+	/* Readahead of the sequential tree scans, see reada_sequential() */
+	struct tree_prefetch *reada_prefetch;
+	bool reada_prefetch_failed;
 	u64 max_cache_size;
 	u64 cache_size;
+	/* Part of cache_size used by buffers on lru_hot */
+	u64 hot_cache_size;
+	/*
+	 * Upper bound of max_cache_size adapted to the memory pressure, 0 if
+	 * the size is fixed, see adapt_extent_buffer_cache()
+	 */
+	u64 cache_size_limit;
+	u64 cache_adapt_ns;
+	u32 cache_allocs;
+	/* Cold and hot lists of the extent buffer cache, see extent_io.c */
 	struct list_head lru;
-
-	struct extent_io_tree dirty_buffers;
+	struct list_head lru_hot;
+	/* Lookups by read_tree_block() found up to date or read from disk */
+	u64 eb_cache_hits;
+	u64 eb_cache_misses;
+	/* Tags of the verified tree blocks, see tree_block_verified() */
+	u64 *verified_blocks;
+
+	/* Start of the dirty tree blocks, one bit per BTRFS_MIN_BLOCKSIZE */
+	struct extent_bitmap dirty_buffers;
 	struct extent_io_tree free_space_cache;
 	struct extent_io_tree pinned_extents;
 	struct extent_io_tree extent_ins;
@@ -374,6 +422,10 @@ struct btrfs_fs_info {
 	unsigned int hide_names:1;
 	unsigned int allow_transid_mismatch:1;
 	unsigned int skip_leaf_item_checks:1;
+	/* Tree blocks reference device mappings, see OPEN_CTREE_MMAP */
+	unsigned int mmap_tree_blocks:1;
+	/* Block groups are read on first lookup, see OPEN_CTREE_LAZY_BLOCK_GROUPS */
+	unsigned int lazy_block_groups:1;
 	unsigned int rebuilding_extent_tree:1;
 	unsigned int active_zone_tracking:1;
 
@@ -385,6 +437,9 @@ struct btrfs_fs_info {
 	struct cache_tree *fsck_extent_cache;
 	struct cache_tree *corrupt_blocks;
 
+	/* Roots referencing tree blocks, see btrfs_find_all_roots() */
+	struct btrfs_block_roots_cache *block_roots_cache;
+
 	/*
 	 * For converting to/from bg tree feature, this records the bytenr
 	 * of the last processed block group item.
@@ -901,6 +956,14 @@ static inline u64 btrfs_name_hash(const char *name, int len)
 	return crc32c((u32)~1, name, len);
 }
 
+/* btrfs_name_hash() of @nr names at once */
+static inline void btrfs_name_hash_batch(const char *const *names,
+					 const u32 *lens, u32 nr, u32 *hashes)
+{
+	crc32c_le_vec((u32)~1, (unsigned char const *const *)names, lens, nr,
+		      hashes);
+}
+
 /*
  * Figure the key offset of an extended inode ref
  */
@@ -984,6 +1047,8 @@ u64 add_new_free_space(struct btrfs_block_group *block_group,
 		       struct btrfs_fs_info *info, u64 start, u64 end);
 u64 hash_extent_data_ref(u64 root_objectid, u64 owner, u64 offset);
 int btrfs_convert_one_bg(struct btrfs_trans_handle *trans, u64 bytenr);
+int btrfs_convert_bgs(struct btrfs_trans_handle *trans, const u64 *bytenrs,
+		      int nr);
 
 /* ctree.c */
 int btrfs_comp_cpu_keys(const struct btrfs_key *k1, const struct btrfs_key *k2);
@@ -1074,6 +1139,29 @@ int btrfs_insert_empty_items(struct btrfs_trans_handle *trans,
 			     struct btrfs_path *path,
 			     const struct btrfs_item_batch *batch);
 
+/*
+ * Loader for a key-sorted item stream, appending at the right edge of the tree
+ * or of the gaps between the existing leaves, and filling each leaf up to the
+ * fill factor instead of splitting it.  Must be released before the
+ * transaction is committed.
+ */
+struct btrfs_bulk_loader {
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root;
+	/* Path to the leaf appended to, valid between two appends */
+	struct btrfs_path path;
+	/* Bytes of leaf data left free when starting a new leaf */
+	u32 leaf_reserve;
+};
+
+void btrfs_bulk_loader_init(struct btrfs_bulk_loader *loader,
+			    struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root, unsigned int fill_percent);
+int btrfs_bulk_loader_add(struct btrfs_bulk_loader *loader,
+			  const struct btrfs_key *key, const void *data,
+			  u32 size);
+void btrfs_bulk_loader_release(struct btrfs_bulk_loader *loader);
+
 static inline int btrfs_insert_empty_item(struct btrfs_trans_handle *trans,
 					  struct btrfs_root *root,
 					  struct btrfs_path *path,
@@ -1092,6 +1180,10 @@ static inline int btrfs_insert_empty_item(struct btrfs_trans_handle *trans,
 
 int btrfs_next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 				  struct btrfs_path *path);
+void btrfs_readahead_siblings(struct btrfs_fs_info *fs_info,
+			      struct btrfs_path *path, int level, int slot);
+struct tree_prefetch *btrfs_reada_prefetch(struct btrfs_fs_info *fs_info);
+void btrfs_reada_free(struct btrfs_fs_info *fs_info);
 
 /*
  * Walk up the tree as far as necessary to find the next leaf.
@@ -1130,6 +1222,26 @@ void btrfs_set_item_key_safe(struct btrfs_fs_info *fs_info,
 			     struct btrfs_path *path,
 			     const struct btrfs_key *new_key);
 
+/*
+ * Items of a leaf decoded in one pass into parallel arrays, for callers that
+ * scan every item of many leaves.  Zero initialize, reuse for any number of
+ * leaves and free with btrfs_leaf_items_release().
+ */
+struct btrfs_leaf_items {
+	u32 nr;
+	u32 capacity;
+	struct btrfs_key *keys;
+	/* Copy of keys[].type, for type filtering without touching the keys */
+	u8 *types;
+	/* Item data offset, relative to btrfs_item_nr_offset(leaf, 0) */
+	u32 *offsets;
+	u32 *sizes;
+};
+
+int btrfs_leaf_items_decode(const struct extent_buffer *leaf,
+			    struct btrfs_leaf_items *items);
+void btrfs_leaf_items_release(struct btrfs_leaf_items *items);
+
 int btrfs_super_csum_size(const struct btrfs_super_block *sb);
 const char *btrfs_super_csum_name(u16 csum_type);
 const char *btrfs_super_csum_driver(u16 csum_type);
@@ -1178,6 +1290,24 @@ struct btrfs_dir_item *btrfs_match_dir_item_name(struct btrfs_root *root,
 			      struct btrfs_path *path,
 			      const char *name, int name_len);
 
+/* Slots hashed at once by btrfs_leaf_name_hash() */
+#define BTRFS_LEAF_NAME_HASHES		64
+
+/*
+ * Name hashes of the dir and xattr items in a window of slots of a leaf.
+ * Zero initialize for each leaf.
+ */
+struct btrfs_leaf_name_hashes {
+	int start;
+	int nr;
+	u64 mask;
+	u32 hashes[BTRFS_LEAF_NAME_HASHES];
+};
+
+bool btrfs_leaf_name_hash(const struct extent_buffer *leaf,
+			  struct btrfs_leaf_name_hashes *names, int slot,
+			  u32 *hash);
+
 /* inode-item.c */
 int btrfs_insert_inode_ref(struct btrfs_trans_handle *trans,
 			   struct btrfs_root *root,
@@ -18,13 +18,16 @@
  */
 
 #include "kerncompat.h"
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include "kernel-lib/rbtree.h"
+#include "kernel-lib/sizes.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/delayed-ref.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/messages.h"
+#include "common/sort-utils.h"
 
 struct kmem_cache *btrfs_delayed_ref_head_cachep;
 struct kmem_cache *btrfs_delayed_tree_ref_cachep;
@@ -609,6 +612,124 @@ static void init_delayed_ref_common(struct btrfs_fs_info *fs_info,
 	INIT_LIST_HEAD(&ref->add_list);
 }
 
+/*
+ * Offline transactions can add millions of tree refs before running them, and
+ * nothing looks at the heads in the meantime.  The refs are appended to
+ * delayed_refs->batch instead of being merged into the rbtrees one by one.
+ * Before the heads are run, the batch is sorted by bytenr, stable so the refs
+ * of each extent stay in the order they were added, and merged into the heads
+ * in one pass.  The refs of one extent are adjacent and update the same head
+ * without looking it up again.
+ *
+ * The batch is also merged each time it reaches DELAYED_REF_BATCH_MAX refs, to
+ * bound the memory of refs that would cancel each other.
+ */
+#define DELAYED_REF_BATCH_MIN		(256)
+#define DELAYED_REF_BATCH_MAX		(SZ_64K)
+
+bool btrfs_delayed_refs_empty(struct btrfs_delayed_ref_root *delayed_refs)
+{
+	return RB_EMPTY_ROOT(&delayed_refs->href_root) && !delayed_refs->batch_nr;
+}
+
+static void free_delayed_ref_batch(struct btrfs_delayed_ref_root *delayed_refs)
+{
+	kfree(delayed_refs->batch);
+	delayed_refs->batch = NULL;
+	delayed_refs->batch_nr = 0;
+	delayed_refs->batch_size = 0;
+}
+
+/*
+ * Merge the batched refs into the head rbtree, must be done before the heads
+ * are looked at.
+ *
+ * Return 0 or -ENOMEM, the refs not merged yet are left in the batch.
+ */
+int btrfs_flush_delayed_ref_batch(struct btrfs_trans_handle *trans)
+{
+	struct btrfs_delayed_ref_root *delayed_refs = &trans->delayed_refs;
+	struct btrfs_delayed_ref_head *head = NULL;
+	unsigned long i;
+
+	if (!delayed_refs->batch_nr)
+		return 0;
+
+	radix_sort_u64(delayed_refs->batch, delayed_refs->batch_nr,
+		       sizeof(struct btrfs_delayed_ref_batch),
+		       offsetof(struct btrfs_delayed_ref_batch, bytenr));
+	for (i = 0; i < delayed_refs->batch_nr; i++) {
+		struct btrfs_delayed_ref_batch *entry = &delayed_refs->batch[i];
+		struct btrfs_delayed_tree_ref *ref = entry->ref;
+		bool is_system = (ref->root == BTRFS_CHUNK_TREE_OBJECTID);
+
+		if (head && head->bytenr == entry->bytenr) {
+			struct btrfs_delayed_ref_head update;
+
+			init_delayed_ref_head(&update, NULL, entry->bytenr,
+					      ref->node.num_bytes, ref->root, 0,
+					      entry->action, false, is_system);
+			update.extent_op = entry->extent_op;
+			update_existing_head_ref(delayed_refs, head, &update,
+						 NULL);
+		} else {
+			head = kmalloc(sizeof(*head), GFP_NOFS);
+			if (!head) {
+				memmove(delayed_refs->batch, entry,
+					(delayed_refs->batch_nr - i) *
+					sizeof(*entry));
+				delayed_refs->batch_nr -= i;
+				return -ENOMEM;
+			}
+			init_delayed_ref_head(head, NULL, entry->bytenr,
+					      ref->node.num_bytes, ref->root, 0,
+					      entry->action, false, is_system);
+			head->extent_op = entry->extent_op;
+			head = add_delayed_ref_head(trans, head, NULL,
+						    entry->action, NULL, NULL,
+						    NULL);
+		}
+		if (insert_delayed_ref(trans, delayed_refs, head, &ref->node) > 0)
+			kfree(ref);
+	}
+	free_delayed_ref_batch(delayed_refs);
+	return 0;
+}
+
+static int batch_delayed_tree_ref(struct btrfs_trans_handle *trans,
+				  struct btrfs_delayed_tree_ref *ref,
+				  struct btrfs_delayed_extent_op *extent_op,
+				  int action)
+{
+	struct btrfs_delayed_ref_root *delayed_refs = &trans->delayed_refs;
+	struct btrfs_delayed_ref_batch *entry;
+
+	if (delayed_refs->batch_nr >= DELAYED_REF_BATCH_MAX) {
+		int ret;
+
+		ret = btrfs_flush_delayed_ref_batch(trans);
+		if (ret < 0)
+			return ret;
+	}
+	if (delayed_refs->batch_nr == delayed_refs->batch_size) {
+		unsigned long size = max_t(unsigned long, DELAYED_REF_BATCH_MIN,
+					   delayed_refs->batch_size * 2);
+		struct btrfs_delayed_ref_batch *batch;
+
+		batch = realloc(delayed_refs->batch, size * sizeof(*batch));
+		if (!batch)
+			return -ENOMEM;
+		delayed_refs->batch = batch;
+		delayed_refs->batch_size = size;
+	}
+	entry = &delayed_refs->batch[delayed_refs->batch_nr++];
+	entry->bytenr = ref->node.bytenr;
+	entry->ref = ref;
+	entry->extent_op = extent_op;
+	entry->action = action;
+	return 0;
+}
+
 /*
  * add a delayed tree ref.  This does all of the accounting required
  * to make sure the delayed ref is eventually processed before this
@@ -643,6 +764,17 @@ int btrfs_add_delayed_tree_ref(struct btrfs_fs_info *fs_info,
 	ref->parent = parent;
 	ref->level = level;
 
+	/* The ref mods are only known once the head is updated */
+	if (!old_ref_mod && !new_ref_mod) {
+		ret = batch_delayed_tree_ref(trans, ref, extent_op, action);
+		if (ret < 0)
+			kfree(ref);
+		return ret;
+	}
+
+	ret = btrfs_flush_delayed_ref_batch(trans);
+	if (ret < 0)
+		goto free_ref;
 	head_ref = kmalloc(sizeof(*head_ref), GFP_NOFS);
 	if (!head_ref)
 		goto free_ref;
@@ -676,6 +808,13 @@ void btrfs_destroy_delayed_refs(struct btrfs_trans_handle *trans)
 	struct btrfs_delayed_ref_root *delayed_refs;
 
 	delayed_refs = &trans->delayed_refs;
+	if (btrfs_flush_delayed_ref_batch(trans) < 0) {
+		for (unsigned long i = 0; i < delayed_refs->batch_nr; i++) {
+			btrfs_free_delayed_extent_op(delayed_refs->batch[i].extent_op);
+			kfree(delayed_refs->batch[i].ref);
+		}
+	}
+	free_delayed_ref_batch(delayed_refs);
 	if (RB_EMPTY_ROOT(&delayed_refs->href_root))
 		return;
 	while ((node = rb_first(&delayed_refs->href_root)) != NULL) {
@@ -169,6 +169,17 @@ struct btrfs_delayed_data_ref {
 	u64 offset;
 };
 
+/*
+ * A tree ref added by btrfs_add_delayed_tree_ref() and not merged into the
+ * head rbtree yet, see btrfs_flush_delayed_ref_batch().
+ */
+struct btrfs_delayed_ref_batch {
+	u64 bytenr;
+	struct btrfs_delayed_tree_ref *ref;
+	struct btrfs_delayed_extent_op *extent_op;
+	int action;
+};
+
 enum btrfs_delayed_ref_flags {
 	/* Indicate that we are flushing delayed refs for the commit */
 	BTRFS_DELAYED_REFS_FLUSHING,
@@ -201,6 +212,11 @@ struct btrfs_delayed_ref_root {
 
 	u64 run_delayed_start;
 
+	/* Refs appended in the order of addition, not in href_root yet */
+	struct btrfs_delayed_ref_batch *batch;
+	unsigned long batch_nr;
+	unsigned long batch_size;
+
 	/*
 	 * To make qgroup to skip given root.
 	 * This is for snapshot, as btrfs_qgroup_inherit() will manually
@@ -442,5 +458,7 @@ int cleanup_ref_head(struct btrfs_trans_handle *trans,
 		     struct btrfs_fs_info *fs_info,
 		     struct btrfs_delayed_ref_head *head);
 void btrfs_destroy_delayed_refs(struct btrfs_trans_handle *trans);
+int btrfs_flush_delayed_ref_batch(struct btrfs_trans_handle *trans);
+bool btrfs_delayed_refs_empty(struct btrfs_delayed_ref_root *delayed_refs);
 
 #endif
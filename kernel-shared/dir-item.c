@@ -25,6 +25,7 @@
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/extent_io.h"
+#include "kernel-shared/messages.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/transaction.h"
 
@@ -384,3 +385,84 @@ struct btrfs_dir_item *btrfs_match_dir_item_name(struct btrfs_root *root,
 	}
 	return NULL;
 }
+
+/*
+ * Hash the name of the first entry of the dir and xattr items in @nr slots of
+ * @leaf from @start in one batch.  Return the mask of the slots with the hash
+ * stored in @hashes, bit i for slot @start + i.  Items not fitting in the
+ * leaf are left out, so the leaf doesn't need to be validated first.
+ */
+static u64 leaf_name_hashes(const struct extent_buffer *leaf, int start,
+			    int nr, u32 *hashes)
+{
+	const char *names[BTRFS_LEAF_NAME_HASHES];
+	u32 lens[BTRFS_LEAF_NAME_HASHES];
+	u32 crcs[BTRFS_LEAF_NAME_HASHES];
+	int index[BTRFS_LEAF_NAME_HASHES];
+	int nritems = btrfs_header_nritems(leaf);
+	u64 mask = 0;
+	int count = 0;
+	int i;
+
+	ASSERT(nr <= BTRFS_LEAF_NAME_HASHES);
+	for (i = 0; i < nr && start + i < nritems; i++) {
+		int slot = start + i;
+		struct btrfs_disk_key disk_key;
+		struct btrfs_dir_item *di;
+		unsigned long ptr;
+		u32 size;
+		u16 name_len;
+
+		if (btrfs_item_nr_offset(leaf, slot) + sizeof(struct btrfs_item) >
+		    leaf->len)
+			break;
+		btrfs_item_key(leaf, &disk_key, slot);
+		if (btrfs_disk_key_type(&disk_key) != BTRFS_DIR_ITEM_KEY &&
+		    btrfs_disk_key_type(&disk_key) != BTRFS_XATTR_ITEM_KEY)
+			continue;
+		ptr = btrfs_item_ptr_offset(leaf, slot);
+		size = btrfs_item_size(leaf, slot);
+		if (size < sizeof(*di) || ptr + size > leaf->len)
+			continue;
+		di = (struct btrfs_dir_item *)ptr;
+		name_len = btrfs_dir_name_len(leaf, di);
+		if (name_len > size - sizeof(*di))
+			continue;
+		names[count] = leaf->data + (unsigned long)(di + 1);
+		lens[count] = name_len;
+		index[count++] = i;
+	}
+
+	if (!count)
+		return 0;
+	btrfs_name_hash_batch(names, lens, count, crcs);
+	for (i = 0; i < count; i++) {
+		hashes[index[i]] = crcs[i];
+		mask |= 1ULL << index[i];
+	}
+	return mask;
+}
+
+/*
+ * Get the hash of the first name in the dir or xattr item at @slot of @leaf.
+ * The names of the following slots are hashed in the same batch, for callers
+ * going through the leaf in slot order.
+ *
+ * Return false if the item is of other type or doesn't fit in the leaf, the
+ * caller hashes the name itself then.
+ */
+bool btrfs_leaf_name_hash(const struct extent_buffer *leaf,
+			  struct btrfs_leaf_name_hashes *names, int slot,
+			  u32 *hash)
+{
+	if (slot < names->start || slot >= names->start + names->nr) {
+		names->start = slot;
+		names->nr = BTRFS_LEAF_NAME_HASHES;
+		names->mask = leaf_name_hashes(leaf, slot, names->nr,
+					       names->hashes);
+	}
+	if (!(names->mask & (1ULL << (slot - names->start))))
+		return false;
+	*hash = names->hashes[slot - names->start];
+	return true;
+}
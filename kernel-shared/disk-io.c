@@ -18,6 +18,7 @@
 
 #include "kerncompat.h"
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <linux/fs.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -26,11 +27,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include "kernel-lib/bitops.h"
 #include "kernel-lib/list.h"
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/rbtree_types.h"
+#include "kernel-lib/trace.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/extent-io-tree.h"
 #include "kernel-shared/extent_io.h"
@@ -38,6 +42,7 @@
 #include "kernel-shared/messages.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "kernel-shared/ctree.h"
+#include "kernel-shared/backref.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/volumes.h"
 #include "kernel-shared/transaction.h"
@@ -51,6 +56,8 @@
 #include "common/rbtree-utils.h"
 #include "common/device-scan.h"
 #include "common/device-utils.h"
+#include "common/stats.h"
+#include "common/tree-prefetch.h"
 
 struct btrfs_fs_devices;
 struct btrfs_key;
@@ -162,25 +169,50 @@ static void print_tree_block_error(struct btrfs_fs_info *fs_info,
 	}
 }
 
+static const struct {
+	int (*hash)(const u8 *buf, size_t length, u8 *out);
+	int (*hash_batch)(const u8 *buf, size_t length, size_t nr, u8 *out);
+} btrfs_csum_hashes[] = {
+	[BTRFS_CSUM_TYPE_CRC32] = { hash_crc32c, hash_crc32c_batch },
+	[BTRFS_CSUM_TYPE_XXHASH] = { hash_xxhash, hash_xxhash_batch },
+	[BTRFS_CSUM_TYPE_SHA256] = { hash_sha256, hash_sha256_batch },
+	[BTRFS_CSUM_TYPE_BLAKE2] = { hash_blake2b, hash_blake2b_batch },
+};
+
+static bool csum_type_valid(u16 csum_type)
+{
+	if (csum_type < ARRAY_SIZE(btrfs_csum_hashes) &&
+	    btrfs_csum_hashes[csum_type].hash)
+		return true;
+	fprintf(stderr, "ERROR: unknown csum type: %d\n", csum_type);
+	ASSERT(0);
+	return false;
+}
+
 int btrfs_csum_data(u16 csum_type, const u8 *data, u8 *out, size_t len)
 {
 	memset(out, 0, BTRFS_CSUM_SIZE);
 
-	switch (csum_type) {
-	case BTRFS_CSUM_TYPE_CRC32:
-		return hash_crc32c(data, len, out);
-	case BTRFS_CSUM_TYPE_XXHASH:
-		return hash_xxhash(data, len, out);
-	case BTRFS_CSUM_TYPE_SHA256:
-		return hash_sha256(data, len, out);
-	case BTRFS_CSUM_TYPE_BLAKE2:
-		return hash_blake2b(data, len, out);
-	default:
-		fprintf(stderr, "ERROR: unknown csum type: %d\n", csum_type);
-		ASSERT(0);
-	}
+	if (!csum_type_valid(csum_type))
+		return -1;
+	stats_csum(csum_type, len);
+	return btrfs_csum_hashes[csum_type].hash(data, len, out);
+}
 
-	return -1;
+/*
+ * Calculate the checksums of @nr consecutive blocks of @len bytes at @data.
+ *
+ * Unlike btrfs_csum_data(), the checksums are stored packed in @out, each
+ * taking btrfs_csum_type_size() bytes, the same as in the csum items.
+ */
+int btrfs_csum_data_batch(u16 csum_type, const u8 *data, u8 *out, size_t len,
+			  size_t nr)
+{
+	if (!csum_type_valid(csum_type))
+		return -1;
+	trace_btrfs_csum_batch(csum_type, len, nr);
+	stats_csum(csum_type, (u64)len * nr);
+	return btrfs_csum_hashes[csum_type].hash_batch(data, len, nr, out);
 }
 
 static int __csum_tree_block_size(struct extent_buffer *buf, u16 csum_size,
@@ -255,21 +287,19 @@ void readahead_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 {
 	struct extent_buffer *eb;
 	u64 length;
-	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_bio_stripe stripe;
 	struct btrfs_device *device;
 
 	eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
 	if (!(eb && btrfs_buffer_uptodate(eb, parent_transid, 0)) &&
-	    !btrfs_map_block(fs_info, READ, bytenr, &length, &multi, 0,
-			     NULL)) {
-		device = multi->stripes[0].dev;
+	    !btrfs_map_block_stripe(fs_info, bytenr, &length, NULL,
+				    btrfs_read_mirror(fs_info, bytenr), &stripe)) {
+		device = stripe.dev;
 		device->total_ios++;
-		readahead(device->fd, multi->stripes[0].physical,
-				fs_info->nodesize);
+		readahead(device->fd, stripe.physical, fs_info->nodesize);
 	}
 
 	free_extent_buffer(eb);
-	kfree(multi);
 }
 
 static int verify_parent_transid(struct extent_buffer *eb, u64 parent_transid,
@@ -320,6 +350,8 @@ static int read_on_restore(struct extent_buffer *eb)
 
 	ret = btrfs_pread(device->fd, eb->data, eb->len, eb->start,
 			  eb->fs_info->zoned);
+	if (ret > 0)
+		btrfs_device_account_read(device, ret);
 	if (ret != eb->len)
 		ret = -EIO;
 	else
@@ -327,12 +359,60 @@ static int read_on_restore(struct extent_buffer *eb)
 	return ret;
 }
 
+/*
+ * Point the extent buffer directly into the mapping of the device holding
+ * @mirror, if the whole block is contiguous on one device.
+ *
+ * Return 0 if the buffer has been mapped, >0 if it needs to be read instead.
+ */
+static int map_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb,
+			int mirror)
+{
+	struct btrfs_bio_stripe stripe;
+	struct btrfs_device *device;
+	u64 len = eb->len;
+	u64 physical;
+	u64 type;
+	char *map;
+	int ret;
+
+	ret = btrfs_map_block_stripe(info, eb->start, &len, &type, mirror,
+				     &stripe);
+	if (ret)
+		return 1;
+	/* Rebuilding from P/Q needs a private buffer */
+	if (len < eb->len ||
+	    (mirror > 1 && type & BTRFS_BLOCK_GROUP_RAID56_MASK))
+		return 1;
+	device = stripe.dev;
+	physical = stripe.physical;
+
+	map = btrfs_device_map(device);
+	if (!map || physical + eb->len > device->map_size)
+		return 1;
+	if (!extent_buffer_map_data(eb, map + physical))
+		return 1;
+	device->total_ios++;
+	btrfs_device_account_read(device, eb->len);
+	stats_io_mapped(device->fd, eb->len);
+	return 0;
+}
+
 int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirror)
 {
 	unsigned long offset = 0;
 	int ret = 0;
 	unsigned long bytes_left = eb->len;
 
+	if (info->mmap_tree_blocks && !info->on_restoring && !info->zoned) {
+		ret = map_whole_eb(info, eb, mirror);
+		if (ret <= 0)
+			return ret;
+	}
+	ret = extent_buffer_unmap_data(eb);
+	if (ret < 0)
+		return ret;
+
 	while (bytes_left) {
 		u64 read_len = bytes_left;
 
@@ -350,22 +430,115 @@ int read_whole_eb(struct btrfs_fs_info *info, struct extent_buffer *eb, int mirr
 	return 0;
 }
 
-int btrfs_read_extent_buffer(struct extent_buffer *eb,
-			     struct btrfs_tree_parent_check *check)
+/*
+ * Tree blocks that passed the checksum and tree-checker verification, so the
+ * next read of the same block after its extent buffer got evicted can skip
+ * both.  It's a direct mapped table indexed by bytenr, the entries are
+ * tags of the block location, generation, mirror and the stored checksum.
+ * Colliding blocks replace each other and are only verified again.
+ */
+#define VERIFIED_BLOCKS_BITS		(20)
+
+static void verified_blocks_init(struct btrfs_fs_info *fs_info)
+{
+	/* Large enough to be mapped lazily, untouched entries cost nothing */
+	fs_info->verified_blocks = calloc(1UL << VERIFIED_BLOCKS_BITS,
+					  sizeof(u64));
+}
+
+static u64 *verified_blocks_slot(struct btrfs_fs_info *fs_info,
+				 struct extent_buffer *eb)
+{
+	u64 index = (eb->start >> 12) * 0x9E3779B97F4A7C15ULL;
+
+	return &fs_info->verified_blocks[index >> (64 - VERIFIED_BLOCKS_BITS)];
+}
+
+static u64 verified_blocks_tag(struct btrfs_fs_info *fs_info,
+			       struct extent_buffer *eb, int mirror)
+{
+	u64 csum[2] = { 0 };
+	u64 tag;
+
+	read_extent_buffer(eb, csum, 0, min_t(u32, fs_info->csum_size,
+					      sizeof(csum)));
+	tag = (eb->start ^ csum[0]) * 0x9E3779B97F4A7C15ULL;
+	tag ^= (btrfs_header_generation(eb) ^ csum[1]) * 0xC2B2AE3D27D4EB4FULL;
+	tag += mirror;
+	/* Zero is an empty entry */
+	return tag | 1;
+}
+
+/*
+ * Blocks read without checksum verification are not recorded, nor the ones
+ * of the temporary filesystem of mkfs which get lighter checks.
+ */
+static bool verified_blocks_usable(struct btrfs_fs_info *fs_info)
+{
+	return fs_info->verified_blocks && !fs_info->skip_csum_check &&
+	       btrfs_super_magic(fs_info->super_copy) != BTRFS_MAGIC_TEMPORARY;
+}
+
+static bool tree_block_verified(struct btrfs_fs_info *fs_info,
+				struct extent_buffer *eb, int mirror)
+{
+	if (!verified_blocks_usable(fs_info))
+		return false;
+	return __atomic_load_n(verified_blocks_slot(fs_info, eb),
+			       __ATOMIC_RELAXED) ==
+	       verified_blocks_tag(fs_info, eb, mirror);
+}
+
+static void mark_tree_block_verified(struct btrfs_fs_info *fs_info,
+				     struct extent_buffer *eb, int mirror)
+{
+	if (!verified_blocks_usable(fs_info))
+		return;
+	__atomic_store_n(verified_blocks_slot(fs_info, eb),
+			 verified_blocks_tag(fs_info, eb, mirror),
+			 __ATOMIC_RELAXED);
+}
+
+/*
+ * Read and verify the tree block, trying all mirrors from @first_mirror.
+ *
+ * If @first_data is not NULL, it's the already read content of the first
+ * mirror and is used instead of reading it again.  With @first_csum_ok its
+ * checksum has been verified too.
+ */
+static int __btrfs_read_extent_buffer(struct extent_buffer *eb,
+				      struct btrfs_tree_parent_check *check,
+				      int first_mirror, const void *first_data,
+				      bool first_csum_ok)
 {
 	struct btrfs_fs_info *fs_info = eb->fs_info;
 	int ret;
 	u64 best_transid = 0;
-	int mirror_num = 1;
+	int mirror_num = first_mirror;
 	int good_mirror = 0;
 	int candidate_mirror = 0;
 	int num_copies;
+	int tried = 0;
 	int ignore = 0;
+	bool verified;
 
 	num_copies = btrfs_num_copies(fs_info, eb->start, eb->len);
+	if (mirror_num > num_copies)
+		mirror_num = 1;
 	while (1) {
-		ret = read_whole_eb(fs_info, eb, mirror_num);
-		if (ret == 0 && csum_tree_block(fs_info, eb, 1) == 0 &&
+		if (mirror_num == first_mirror && first_data) {
+			ret = extent_buffer_unmap_data(eb);
+			if (ret == 0)
+				write_extent_buffer(eb, first_data, 0, eb->len);
+		} else {
+			ret = read_whole_eb(fs_info, eb, mirror_num);
+		}
+		verified = (ret == 0 &&
+			    tree_block_verified(fs_info, eb, mirror_num));
+		if (ret == 0 &&
+		    (verified ||
+		     (mirror_num == first_mirror && first_data && first_csum_ok) ||
+		     csum_tree_block(fs_info, eb, 1) == 0) &&
 		    check_tree_block(fs_info, eb) == 0 &&
 		    verify_parent_transid(eb, check->transid, ignore) == 0) {
 			if (eb->flags & EXTENT_BUFFER_BAD_TRANSID &&
@@ -382,10 +555,14 @@ int btrfs_read_extent_buffer(struct extent_buffer *eb,
 			 * possible, or bad key order can go into tools like
 			 * btrfs ins dump-tree.
 			 */
-			if (btrfs_header_level(eb))
+			if (verified)
+				ret = 0;
+			else if (btrfs_header_level(eb))
 				ret = __btrfs_check_node(eb);
 			else
 				ret = __btrfs_check_leaf(eb);
+			if (!ret && !verified)
+				mark_tree_block_verified(fs_info, eb, mirror_num);
 			if (!ret || candidate_mirror == mirror_num) {
 				btrfs_set_buffer_uptodate(eb);
 				return 0;
@@ -417,8 +594,8 @@ int btrfs_read_extent_buffer(struct extent_buffer *eb,
 			best_transid = btrfs_header_generation(eb);
 			good_mirror = mirror_num;
 		}
-		mirror_num++;
-		if (mirror_num > num_copies) {
+		mirror_num = mirror_num % num_copies + 1;
+		if (++tried >= num_copies) {
 			if (!fs_info->allow_transid_mismatch) {
 				ret = -EIO;
 				break;
@@ -434,6 +611,29 @@ int btrfs_read_extent_buffer(struct extent_buffer *eb,
 	return ret;
 }
 
+int btrfs_read_extent_buffer(struct extent_buffer *eb,
+			     struct btrfs_tree_parent_check *check)
+{
+	return __btrfs_read_extent_buffer(eb, check,
+					  btrfs_read_mirror(eb->fs_info, eb->start),
+					  NULL, false);
+}
+
+/*
+ * Same as btrfs_read_extent_buffer(), but @mirror has already been read into
+ * @data (e.g. by a prefetch), which can be NULL if that read failed.
+ * @csum_ok tells that the checksum of @data has been verified already.
+ */
+int btrfs_read_extent_buffer_prefetched(struct extent_buffer *eb,
+					struct btrfs_tree_parent_check *check,
+					int mirror, const void *data, bool csum_ok)
+{
+	/* The prefetch only warmed the page cache, map the block instead */
+	if (eb->fs_info->mmap_tree_blocks)
+		data = NULL;
+	return __btrfs_read_extent_buffer(eb, check, mirror, data, csum_ok);
+}
+
 struct extent_buffer *read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 				      struct btrfs_tree_parent_check *check)
 {
@@ -457,10 +657,18 @@ struct extent_buffer *read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 	if (!eb)
 		return ERR_PTR(-ENOMEM);
 
-	if (btrfs_buffer_uptodate(eb, check->transid, 0))
+	if (btrfs_buffer_uptodate(eb, check->transid, 0)) {
+		fs_info->eb_cache_hits++;
+		trace_btrfs_eb_cache(bytenr, true);
+		stats_eb_cache(true);
 		return eb;
+	}
 
+	fs_info->eb_cache_misses++;
+	trace_btrfs_eb_cache(bytenr, false);
+	stats_eb_cache(false);
 	ret = btrfs_read_extent_buffer(eb, check);
+	trace_btrfs_tree_block_read(bytenr, check->owner_root, check->level, ret);
 	if (ret) {
 		/*
 		 * We failed to read this tree block, it be should deleted right
@@ -469,13 +677,16 @@ struct extent_buffer *read_tree_block(struct btrfs_fs_info *fs_info, u64 bytenr,
 		free_extent_buffer_nocache(eb);
 		return ERR_PTR(ret);
 	}
+	/* Nodes are shared by all searches below them, keep them cached */
+	if (btrfs_header_level(eb) > 0)
+		extent_buffer_mark_hot(eb);
 
 	return eb;
 }
 
-int write_tree_block(struct btrfs_trans_handle *trans,
-		     struct btrfs_fs_info *fs_info,
-		     struct extent_buffer *eb)
+static void prepare_tree_block_write(struct btrfs_trans_handle *trans,
+				     struct btrfs_fs_info *fs_info,
+				     struct extent_buffer *eb)
 {
 	if (check_tree_block(fs_info, eb)) {
 		print_tree_block_error(fs_info, eb,
@@ -488,10 +699,400 @@ int write_tree_block(struct btrfs_trans_handle *trans,
 
 	btrfs_set_header_flag(eb, BTRFS_HEADER_FLAG_WRITTEN);
 	csum_tree_block(fs_info, eb, 0);
+	trace_btrfs_tree_block_write(eb->start, btrfs_header_owner(eb),
+				     btrfs_header_level(eb),
+				     btrfs_header_generation(eb));
+}
 
+int write_tree_block(struct btrfs_trans_handle *trans,
+		     struct btrfs_fs_info *fs_info,
+		     struct extent_buffer *eb)
+{
+	prepare_tree_block_write(trans, fs_info, eb);
 	return write_data_to_disk(fs_info, eb->data, eb->start, eb->len);
 }
 
+static int flush_tree_block_writes(struct btrfs_fs_info *fs_info,
+				   struct tree_block_writeback *wb);
+
+/* Write the queued blocks of the current RAID56 full stripe of @wb */
+static int tree_block_writeback_flush_stripe(struct btrfs_fs_info *fs_info,
+					     struct tree_block_writeback *wb)
+{
+	int ret;
+
+	if (!wb->stripe_nr)
+		return 0;
+	ret = write_raid56_full_stripe(fs_info, wb->stripe_ebs, wb->stripe_nr);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to write RAID56 full stripe at %llu: %m",
+		      wb->stripe_start);
+	}
+	for (unsigned int i = 0; i < wb->stripe_nr; i++)
+		free_extent_buffer(wb->stripe_ebs[i]);
+	wb->stripe_nr = 0;
+	return ret;
+}
+
+/*
+ * Queue a block of the RAID56 full stripe at @full_stripe_start.  The blocks
+ * are written in the logical order by the transaction commit, so the blocks
+ * of one full stripe come in a row and the previous stripe can be written as
+ * soon as another one starts.  The parity is then calculated once and the
+ * data are not read back if the full stripe is covered.
+ */
+static int queue_tree_block_stripe(struct btrfs_fs_info *fs_info,
+				   struct tree_block_writeback *wb,
+				   struct extent_buffer *eb,
+				   u64 full_stripe_start)
+{
+	int ret;
+
+	if (wb->stripe_nr && wb->stripe_start != full_stripe_start) {
+		ret = tree_block_writeback_flush_stripe(fs_info, wb);
+		if (ret < 0)
+			return ret;
+	}
+	if (wb->stripe_nr == wb->stripe_max) {
+		unsigned int max = max(16U, wb->stripe_max * 2);
+		struct extent_buffer **tmp;
+
+		tmp = realloc(wb->stripe_ebs, max * sizeof(*tmp));
+		if (!tmp)
+			return -ENOMEM;
+		wb->stripe_ebs = tmp;
+		wb->stripe_max = max;
+	}
+	wb->stripe_start = full_stripe_start;
+	wb->stripe_ebs[wb->stripe_nr++] = eb;
+	extent_buffer_get(eb);
+	return 0;
+}
+
+/*
+ * Same as write_tree_block(), but queue the write in @wb, to be submitted by
+ * tree_block_writeback_flush().  The buffer is referenced until then and must
+ * not be modified.
+ *
+ * The blocks of RAID56 chunks are gathered per full stripe and written with
+ * the parity once.  On zoned filesystems the blocks come in the order of the
+ * write pointers of the block groups, which is kept by the sorted flush.
+ * A block that can't be queued is written after the queued ones are flushed.
+ */
+int write_tree_block_batched(struct btrfs_trans_handle *trans,
+			     struct btrfs_fs_info *fs_info,
+			     struct extent_buffer *eb,
+			     struct tree_block_writeback *wb)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 len = eb->len;
+	int ret;
+
+	prepare_tree_block_write(trans, fs_info, eb);
+	if (!wb->writes) {
+		wb->writes = calloc(TREE_BLOCK_WRITEBACK_MAX,
+				    sizeof(struct tree_block_write));
+		if (!wb->writes)
+			goto write_now;
+	}
+
+	ret = btrfs_map_block(fs_info, WRITE, eb->start, &len, &multi, 0,
+			      &raid_map);
+	if (ret) {
+		error("couldn't map tree block %llu", eb->start);
+		return -EIO;
+	}
+	if (raid_map && len >= eb->len) {
+		u64 full_stripe_start = raid_map[0];
+
+		kfree(multi);
+		kfree(raid_map);
+		return queue_tree_block_stripe(fs_info, wb, eb,
+					       full_stripe_start);
+	}
+	if (raid_map || len < eb->len) {
+		kfree(multi);
+		kfree(raid_map);
+		goto write_now;
+	}
+
+	if (wb->nr + multi->num_stripes > TREE_BLOCK_WRITEBACK_MAX) {
+		ret = flush_tree_block_writes(fs_info, wb);
+		if (ret < 0) {
+			kfree(multi);
+			return ret;
+		}
+	}
+	for (int i = 0; i < multi->num_stripes; i++) {
+		struct tree_block_write *write;
+
+		if (multi->stripes[i].dev->fd <= 0) {
+			kfree(multi);
+			return -EIO;
+		}
+		write = &wb->writes[wb->nr++];
+		write->dev = multi->stripes[i].dev;
+		write->physical = multi->stripes[i].physical;
+		write->eb = eb;
+		extent_buffer_get(eb);
+	}
+	kfree(multi);
+	return 0;
+
+write_now:
+	/* Keep the order of the writes, submit the queued ones first */
+	ret = tree_block_writeback_flush(fs_info, wb);
+	if (ret < 0)
+		return ret;
+	return write_data_to_disk(fs_info, eb->data, eb->start, eb->len);
+}
+
+static int cmp_tree_block_write(const void *a, const void *b)
+{
+	const struct tree_block_write *wa = a;
+	const struct tree_block_write *wb = b;
+
+	if (wa->dev->devid < wb->dev->devid)
+		return -1;
+	if (wa->dev->devid > wb->dev->devid)
+		return 1;
+	if (wa->dev != wb->dev)
+		return (uintptr_t)wa->dev < (uintptr_t)wb->dev ? -1 : 1;
+	if (wa->physical < wb->physical)
+		return -1;
+	if (wa->physical > wb->physical)
+		return 1;
+	return 0;
+}
+
+/* Write the whole @iov array, restarting after short writes */
+static int pwritev_full(int fd, struct iovec *iov, int iovcnt, u64 offset)
+{
+	while (iovcnt) {
+		u64 start = stats_io_start();
+		ssize_t ret;
+
+		ret = pwritev(fd, iov, iovcnt, offset);
+		stats_io_done(fd, true, ret, start);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			return -EIO;
+		offset += ret;
+		while (iovcnt && ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+/* Drop the queued writes of @wb without submitting them */
+void tree_block_writeback_release(struct tree_block_writeback *wb)
+{
+	for (unsigned int i = 0; i < wb->nr; i++)
+		free_extent_buffer(wb->writes[i].eb);
+	wb->nr = 0;
+	free(wb->writes);
+	wb->writes = NULL;
+	for (unsigned int i = 0; i < wb->stripe_nr; i++)
+		free_extent_buffer(wb->stripe_ebs[i]);
+	wb->stripe_nr = 0;
+	wb->stripe_max = 0;
+	free(wb->stripe_ebs);
+	wb->stripe_ebs = NULL;
+}
+
+/*
+ * Copy the blocks in @iov to the aligned @staging buffer and write them with
+ * one direct write, the write pointer of a zone must not see partial writes.
+ */
+static int write_staged(int fd, char *staging, struct iovec *iov, int iovcnt,
+			u64 offset)
+{
+	size_t len = 0;
+	ssize_t ret;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(staging + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+	ret = btrfs_pwrite(fd, staging, len, offset, true);
+	/* pwrite() sets errno, the direct write can return -errno without it */
+	if (ret < 0)
+		return ret == -1 ? -errno : ret;
+	if ((size_t)ret != len)
+		return -EIO;
+	return 0;
+}
+
+/*
+ * Submit @nr writes to the same device, sorted by the physical offset,
+ * physically adjacent blocks are merged into one vectored write, or one
+ * staged write of at most TREE_BLOCK_ZONED_WRITE_MAX on zoned devices.
+ */
+static int write_tree_blocks_dev(struct tree_block_write *writes,
+				 unsigned int nr, bool zoned)
+{
+	struct iovec iov[min(IOV_MAX, TREE_BLOCK_WRITEBACK_MAX)];
+	struct btrfs_device *dev = writes[0].dev;
+	char *staging = NULL;
+	unsigned int i = 0;
+	int ret = 0;
+
+	if (zoned && posix_memalign((void **)&staging, SZ_4K,
+				    TREE_BLOCK_ZONED_WRITE_MAX))
+		return -ENOMEM;
+
+	while (i < nr) {
+		u64 physical = writes[i].physical;
+		u64 end = physical;
+		int iovcnt = 0;
+
+		while (i < nr && iovcnt < ARRAY_SIZE(iov) &&
+		       writes[i].physical == end) {
+			if (zoned && iovcnt && end + writes[i].eb->len - physical >
+					       TREE_BLOCK_ZONED_WRITE_MAX)
+				break;
+			iov[iovcnt].iov_base = writes[i].eb->data;
+			iov[iovcnt].iov_len = writes[i].eb->len;
+			end += writes[i].eb->len;
+			dev->total_ios++;
+			iovcnt++;
+			i++;
+		}
+		if (zoned)
+			ret = write_staged(dev->fd, staging, iov, iovcnt, physical);
+		else
+			ret = pwritev_full(dev->fd, iov, iovcnt, physical);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to write tree blocks at %llu on devid %llu: %m",
+			      physical, dev->devid);
+			break;
+		}
+	}
+	free(staging);
+	return ret;
+}
+
+struct tree_block_dev_writes {
+	struct tree_block_write *writes;
+	unsigned int nr;
+	bool zoned;
+	pthread_t thread;
+	bool started;
+	int ret;
+};
+
+static void *write_tree_blocks_dev_thread(void *arg)
+{
+	struct tree_block_dev_writes *dw = arg;
+
+	dw->ret = write_tree_blocks_dev(dw->writes, dw->nr, dw->zoned);
+	return NULL;
+}
+
+/*
+ * Submit the writes queued in @wb->writes.
+ *
+ * The writes of each device are submitted by a thread of their own, so the
+ * copies of DUP, RAID1* and RAID10 blocks on different devices are written
+ * concurrently.  All of them are done when this returns.
+ */
+static int flush_tree_block_writes(struct btrfs_fs_info *fs_info,
+				   struct tree_block_writeback *wb)
+{
+	struct tree_block_dev_writes *dws;
+	unsigned int nr_devs = 1;
+	unsigned int i;
+	int ret = 0;
+
+	if (!wb->nr)
+		return 0;
+	qsort(wb->writes, wb->nr, sizeof(struct tree_block_write),
+	      cmp_tree_block_write);
+	for (i = 1; i < wb->nr; i++) {
+		if (wb->writes[i].dev != wb->writes[i - 1].dev)
+			nr_devs++;
+	}
+
+	dws = NULL;
+	if (nr_devs > 1)
+		dws = calloc(nr_devs, sizeof(*dws));
+	if (!dws) {
+		/* One device or no memory, write the devices one by one */
+		for (i = 0; i < wb->nr && !ret; ) {
+			struct tree_block_write *first = &wb->writes[i];
+
+			while (i < wb->nr && wb->writes[i].dev == first->dev)
+				i++;
+			ret = write_tree_blocks_dev(first,
+						    &wb->writes[i] - first,
+						    fs_info->zoned);
+		}
+		goto out;
+	}
+
+	nr_devs = 0;
+	for (i = 0; i < wb->nr; i++) {
+		if (i == 0 || wb->writes[i].dev != wb->writes[i - 1].dev) {
+			dws[nr_devs].writes = &wb->writes[i];
+			dws[nr_devs].zoned = fs_info->zoned;
+			nr_devs++;
+		}
+		dws[nr_devs - 1].nr++;
+	}
+	/* The last device is written by this thread, or if threads fail */
+	for (i = 0; i < nr_devs - 1; i++) {
+		if (pthread_create(&dws[i].thread, NULL,
+				   write_tree_blocks_dev_thread, &dws[i]) == 0)
+			dws[i].started = true;
+	}
+	for (i = 0; i < nr_devs; i++) {
+		if (!dws[i].started)
+			write_tree_blocks_dev_thread(&dws[i]);
+	}
+	for (i = 0; i < nr_devs; i++) {
+		if (dws[i].started)
+			pthread_join(dws[i].thread, NULL);
+		if (dws[i].ret < 0 && !ret)
+			ret = dws[i].ret;
+	}
+	free(dws);
+out:
+	for (i = 0; i < wb->nr; i++)
+		free_extent_buffer(wb->writes[i].eb);
+	wb->nr = 0;
+	return ret;
+}
+
+/*
+ * Submit all writes queued in @wb, including the current RAID56 full stripe.
+ *
+ * Flushing to stable storage is left to the superblock write.
+ */
+int tree_block_writeback_flush(struct btrfs_fs_info *fs_info,
+			       struct tree_block_writeback *wb)
+{
+	int ret;
+
+	ret = tree_block_writeback_flush_stripe(fs_info, wb);
+	if (ret < 0)
+		return ret;
+	return flush_tree_block_writes(fs_info, wb);
+}
+
 void btrfs_setup_root(struct btrfs_root *root, struct btrfs_fs_info *fs_info,
 		      u64 objectid)
 {
@@ -781,6 +1382,79 @@ struct btrfs_root *btrfs_extent_root(struct btrfs_fs_info *fs_info,
 	return btrfs_global_root(fs_info, &key);
 }
 
+/*
+ * Subvolume roots are looked up for every backref by check and qgroup verify,
+ * the hash finds them in constant time with thousands of subvolumes.  The
+ * roots are never removed from fs_root_tree until close, the hash is insert
+ * only.
+ */
+#define FS_ROOT_HASH_MIN_BITS		(6)
+
+static inline u64 fs_root_hash_slot(const struct fs_root_hash *hash,
+				    u64 objectid)
+{
+	return (objectid * 0x9E3779B97F4A7C15ULL) >> (64 - hash->bits);
+}
+
+static struct btrfs_root *fs_root_hash_lookup(const struct fs_root_hash *hash,
+					      u64 objectid)
+{
+	u64 mask;
+	u64 slot;
+
+	if (!hash->slots)
+		return NULL;
+	mask = (1ULL << hash->bits) - 1;
+	slot = fs_root_hash_slot(hash, objectid);
+	while (hash->slots[slot]) {
+		if (hash->slots[slot]->objectid == objectid)
+			return hash->slots[slot];
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+static void fs_root_hash_add(struct fs_root_hash *hash, struct btrfs_root *root)
+{
+	const u64 mask = (1ULL << hash->bits) - 1;
+	u64 slot = fs_root_hash_slot(hash, root->objectid);
+
+	while (hash->slots[slot])
+		slot = (slot + 1) & mask;
+	hash->slots[slot] = root;
+	hash->nr_entries++;
+}
+
+static int fs_root_hash_insert(struct fs_root_hash *hash,
+			       struct btrfs_root *root)
+{
+	/* Keep the load factor below 1/2 */
+	if (!hash->slots || (hash->nr_entries + 1) * 2 > (1ULL << hash->bits)) {
+		struct fs_root_hash new = {
+			.bits = hash->slots ? hash->bits + 1 :
+					      FS_ROOT_HASH_MIN_BITS,
+		};
+
+		new.slots = calloc(1ULL << new.bits, sizeof(*new.slots));
+		if (!new.slots)
+			return -ENOMEM;
+		for (u64 i = 0; hash->slots && i < (1ULL << hash->bits); i++) {
+			if (hash->slots[i])
+				fs_root_hash_add(&new, hash->slots[i]);
+		}
+		free(hash->slots);
+		*hash = new;
+	}
+	fs_root_hash_add(hash, root);
+	return 0;
+}
+
+static void fs_root_hash_release(struct fs_root_hash *hash)
+{
+	free(hash->slots);
+	memset(hash, 0, sizeof(*hash));
+}
+
 struct btrfs_root *btrfs_read_fs_root(struct btrfs_fs_info *fs_info,
 				      struct btrfs_key *location)
 {
@@ -817,6 +1491,10 @@ struct btrfs_root *btrfs_read_fs_root(struct btrfs_fs_info *fs_info,
 
 	BUG_ON(location->objectid == BTRFS_TREE_RELOC_OBJECTID);
 
+	root = fs_root_hash_lookup(&fs_info->fs_root_hash, objectid);
+	if (root)
+		return root;
+	/* The hash couldn't be grown, the tree still has all of them */
 	node = rb_search(&fs_info->fs_root_tree, (void *)&objectid,
 			 btrfs_fs_roots_compare_objectids, NULL);
 	if (node)
@@ -829,6 +1507,7 @@ struct btrfs_root *btrfs_read_fs_root(struct btrfs_fs_info *fs_info,
 	ret = rb_insert(&fs_info->fs_root_tree, &root->rb_node,
 			btrfs_fs_roots_compare_roots);
 	BUG_ON(ret);
+	fs_root_hash_insert(&fs_info->fs_root_hash, root);
 	return root;
 }
 
@@ -851,6 +1530,7 @@ void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 		kfree(fs_info->stripe_root);
 
 	free_global_roots_tree(&fs_info->global_roots_tree);
+	btrfs_free_block_roots_cache(fs_info);
 	kfree(fs_info->tree_root);
 	kfree(fs_info->chunk_root);
 	kfree(fs_info->dev_root);
@@ -858,6 +1538,8 @@ void btrfs_free_fs_info(struct btrfs_fs_info *fs_info)
 	kfree(fs_info->block_group_root);
 	kfree(fs_info->super_copy);
 	kfree(fs_info->log_root_tree);
+	free(fs_info->verified_blocks);
+	free(fs_info->fs_root_hash.slots);
 	kfree(fs_info);
 }
 
@@ -885,7 +1567,8 @@ struct btrfs_fs_info *btrfs_new_fs_info(int writable, u64 sb_bytenr)
 		goto free_all;
 
 	extent_buffer_init_cache(fs_info);
-	extent_io_tree_init(fs_info, &fs_info->dirty_buffers, 0);
+	verified_blocks_init(fs_info);
+	extent_bitmap_init(&fs_info->dirty_buffers, BTRFS_MIN_BLOCKSIZE);
 	extent_io_tree_init(fs_info, &fs_info->free_space_cache, 0);
 	extent_io_tree_init(fs_info, &fs_info->pinned_extents, 0);
 	extent_io_tree_init(fs_info, &fs_info->extent_ins, 0);
@@ -960,7 +1643,7 @@ int btrfs_check_fs_compatibility(struct btrfs_super_block *sb,
 	return 0;
 }
 
-static int find_best_backup_root(struct btrfs_super_block *super)
+int find_best_backup_root(struct btrfs_super_block *super)
 {
 	struct btrfs_root_backup *backup;
 	u64 orig_gen = btrfs_super_generation(super);
@@ -1020,6 +1703,75 @@ static inline bool maybe_load_block_groups(struct btrfs_fs_info *fs_info,
 	return false;
 }
 
+/*
+ * Lazy loading is only possible for read-only access, allocation needs the
+ * complete space info, and not while converting to or from the block group
+ * tree as the items are split between two trees then.
+ */
+static inline bool can_load_block_groups_lazily(struct btrfs_fs_info *fs_info,
+						u64 flags)
+{
+	if (!(flags & OPEN_CTREE_LAZY_BLOCK_GROUPS) || (flags & OPEN_CTREE_WRITES))
+		return false;
+	if (btrfs_super_flags(fs_info->super_copy) &
+	    BTRFS_SUPER_FLAG_CHANGING_BG_TREE)
+		return false;
+	return true;
+}
+
+/*
+ * Start readahead of the root nodes of the ROOT_ITEMs in @leaf from @slot on,
+ * of the trees with @objectid, or of all subvolume trees if it's 0.  Reading
+ * the roots one by one afterwards then doesn't wait for each of them.  Only
+ * the page cache is warmed, the root nodes are read and verified as usual
+ * when the roots are read.
+ */
+void btrfs_readahead_root_nodes(struct extent_buffer *leaf, int slot,
+				u64 objectid)
+{
+	struct btrfs_fs_info *fs_info = leaf->fs_info;
+	struct tree_prefetch *tp = NULL;
+	const u32 nritems = btrfs_header_nritems(leaf);
+	int nr = 0;
+
+	/* A single root is read right away, there's nothing to overlap */
+	for (int i = slot; i < nritems && nr < 2; i++) {
+		struct btrfs_key key;
+
+		btrfs_item_key_to_cpu(leaf, &key, i);
+		if (key.type == BTRFS_ROOT_ITEM_KEY &&
+		    (objectid ? key.objectid == objectid : is_fstree(key.objectid)))
+			nr++;
+	}
+	if (nr < 2)
+		return;
+	tp = btrfs_reada_prefetch(fs_info);
+
+	for (int i = slot; i < nritems; i++) {
+		struct btrfs_root_item *ri;
+		struct btrfs_key key;
+		struct extent_buffer *eb;
+		u64 bytenr;
+		u64 gen;
+
+		btrfs_item_key_to_cpu(leaf, &key, i);
+		if (key.type != BTRFS_ROOT_ITEM_KEY ||
+		    !(objectid ? key.objectid == objectid : is_fstree(key.objectid)))
+			continue;
+		ri = btrfs_item_ptr(leaf, i, struct btrfs_root_item);
+		bytenr = btrfs_disk_root_bytenr(leaf, ri);
+		gen = btrfs_disk_root_generation(leaf, ri);
+		if (!tp) {
+			readahead_tree_block(fs_info, bytenr, gen);
+			continue;
+		}
+		eb = btrfs_find_tree_block(fs_info, bytenr, fs_info->nodesize);
+		if (!(eb && btrfs_buffer_uptodate(eb, gen, 0)))
+			tree_prefetch_readahead(tp, bytenr);
+		free_extent_buffer(eb);
+	}
+}
+
 static int load_global_roots_objectid(struct btrfs_fs_info *fs_info,
 				      struct btrfs_path *path, u64 objectid,
 				      unsigned flags, char *str)
@@ -1041,6 +1793,7 @@ static int load_global_roots_objectid(struct btrfs_fs_info *fs_info,
 		return ret;
 	}
 	ret = 0;
+	btrfs_readahead_root_nodes(path->nodes[0], path->slots[0], objectid);
 
 	while (1) {
 		if (path->slots[0] >= btrfs_header_nritems(path->nodes[0])) {
@@ -1050,6 +1803,7 @@ static int load_global_roots_objectid(struct btrfs_fs_info *fs_info,
 					ret = 0;
 				break;
 			}
+			btrfs_readahead_root_nodes(path->nodes[0], 0, objectid);
 		}
 		btrfs_item_key_to_cpu(path->nodes[0], &key,
 				      path->slots[0]);
@@ -1307,7 +2061,12 @@ int btrfs_setup_all_roots(struct btrfs_fs_info *fs_info, u64 root_tree_bytenr,
 	}
 
 	if (maybe_load_block_groups(fs_info, flags)) {
-		ret = btrfs_read_block_groups(fs_info);
+		if (can_load_block_groups_lazily(fs_info, flags)) {
+			fs_info->lazy_block_groups = 1;
+			ret = 0;
+		} else {
+			ret = btrfs_read_block_groups(fs_info);
+		}
 		/*
 		 * If we don't find any blockgroups (ENOENT) we're either
 		 * restoring or creating the filesystem, where it's expected,
@@ -1387,8 +2146,11 @@ void btrfs_cleanup_all_caches(struct btrfs_fs_info *fs_info)
 		free_extent_buffer(eb);
 	}
 	free_mapping_cache_tree(&fs_info->mapping_tree.cache_tree);
-	extent_io_tree_release(&fs_info->dirty_buffers);
+	fs_info->mapping_tree.last_hit = NULL;
+	extent_bitmap_release(&fs_info->dirty_buffers);
 	extent_buffer_free_cache(fs_info);
+	raid56_read_cache_free(fs_info);
+	btrfs_reada_free(fs_info);
 	extent_io_tree_release(&fs_info->free_space_cache);
 	extent_io_tree_release(&fs_info->pinned_extents);
 	extent_io_tree_release(&fs_info->extent_ins);
@@ -1427,7 +2189,7 @@ int btrfs_scan_fs_devices(int fd, const char *path,
 	}
 
 	if (!skip_devices && total_devs != 1) {
-		ret = btrfs_scan_devices(0);
+		ret = btrfs_scan_devices_cached(*fs_devices, total_devs);
 		if (ret)
 			return ret;
 	}
@@ -1525,6 +2287,12 @@ static struct btrfs_fs_info *__open_ctree_fd(int fp, struct open_ctree_args *oca
 		fs_info->allow_transid_mismatch = 1;
 	if (flags & OPEN_CTREE_SKIP_LEAF_ITEM_CHECKS)
 		fs_info->skip_leaf_item_checks = 1;
+	if ((flags & OPEN_CTREE_MMAP) && !(flags & OPEN_CTREE_WRITES))
+		fs_info->mmap_tree_blocks = 1;
+	if (oca->max_cache_size) {
+		fs_info->max_cache_size = oca->max_cache_size;
+		fs_info->cache_size_limit = 0;
+	}
 
 	if ((flags & OPEN_CTREE_RECOVER_SUPER)
 	     && (flags & OPEN_CTREE_TEMPORARY_SUPER)) {
@@ -2040,7 +2808,7 @@ static int write_dev_supers(struct btrfs_fs_info *fs_info,
 		 * super_copy is BTRFS_SUPER_INFO_SIZE bytes and is
 		 * zero filled, we can use it directly
 		 */
-		ret = sbwrite(device->fd, fs_info->super_copy, fs_info->super_bytenr);
+		ret = sbwrite(device->fd, sb, fs_info->super_bytenr);
 		if (ret != BTRFS_SUPER_INFO_SIZE) {
 			errno = EIO;
 			error(
@@ -2073,7 +2841,7 @@ static int write_dev_supers(struct btrfs_fs_info *fs_info,
 		 * super_copy is BTRFS_SUPER_INFO_SIZE bytes and is
 		 * zero filled, we can use it directly
 		 */
-		ret = sbwrite(device->fd, fs_info->super_copy, bytenr);
+		ret = sbwrite(device->fd, sb, bytenr);
 		if (ret != BTRFS_SUPER_INFO_SIZE) {
 			errno = EIO;
 			error(
@@ -2183,19 +2951,54 @@ static void backup_super_roots(struct btrfs_fs_info *info)
 	}
 }
 
+struct dev_super_write {
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_device *dev;
+	struct btrfs_super_block *sb;
+	pthread_t thread;
+	bool started;
+	int ret;
+};
+
+static void *write_dev_supers_thread(void *arg)
+{
+	struct dev_super_write *sw = arg;
+
+	sw->ret = write_dev_supers(sw->fs_info, sw->sb, sw->dev);
+	return NULL;
+}
+
+/*
+ * Write the superblocks of all writeable devices.
+ *
+ * Each device gets its own copy of the superblock, with its dev_item filled
+ * in, and the devices are written in parallel.  The ordering guarantees of
+ * write_dev_supers() hold per device.
+ */
 int write_all_supers(struct btrfs_fs_info *fs_info)
 {
 	struct list_head *head = &fs_info->fs_devices->devices;
 	struct btrfs_device *dev;
 	struct btrfs_super_block *sb;
 	struct btrfs_dev_item *dev_item;
-	int ret;
+	struct dev_super_write *writes;
+	int nr_writes = 0;
+	int nr_devs = 0;
+	int ret = 0;
 	u64 flags;
 
 	backup_super_roots(fs_info);
 	sb = fs_info->super_copy;
 	dev_item = &sb->dev_item;
+	list_for_each_entry(dev, head, dev_list)
+		nr_devs++;
+	writes = calloc(nr_devs, sizeof(*writes));
+	if (!writes && nr_devs)
+		return -ENOMEM;
+
 	list_for_each_entry(dev, head, dev_list) {
+		struct dev_super_write *sw = &writes[nr_writes];
+
 		if (!dev->writeable)
 			continue;
 
@@ -2214,11 +3017,42 @@ int write_all_supers(struct btrfs_fs_info *fs_info)
 		flags = btrfs_super_flags(sb);
 		btrfs_set_super_flags(sb, flags | BTRFS_HEADER_FLAG_WRITTEN);
 
-		ret = write_dev_supers(fs_info, sb, dev);
-		if (ret < 0)
-			return ret;
+		if (posix_memalign((void **)&sw->sb, BTRFS_SUPER_INFO_SIZE,
+				   BTRFS_SUPER_INFO_SIZE)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		memcpy(sw->sb, sb, BTRFS_SUPER_INFO_SIZE);
+		sw->fs_info = fs_info;
+		sw->dev = dev;
+		nr_writes++;
 	}
-	return 0;
+
+	/* The last device is written by this thread, or if threads fail */
+	for (int i = 0; i < nr_writes - 1; i++) {
+		if (pthread_create(&writes[i].thread, NULL,
+				   write_dev_supers_thread, &writes[i]) == 0)
+			writes[i].started = true;
+	}
+	for (int i = 0; i < nr_writes; i++) {
+		if (!writes[i].started)
+			write_dev_supers_thread(&writes[i]);
+	}
+	for (int i = 0; i < nr_writes; i++) {
+		if (writes[i].started)
+			pthread_join(writes[i].thread, NULL);
+		if (writes[i].ret < 0 && !ret)
+			ret = writes[i].ret;
+	}
+
+	/* Leave the in-memory copy as it was written to the last device */
+	if (nr_writes)
+		memcpy(sb, writes[nr_writes - 1].sb, BTRFS_SUPER_INFO_SIZE);
+out:
+	for (int i = 0; i < nr_devs; i++)
+		free(writes[i].sb);
+	free(writes);
+	return ret;
 }
 
 int write_ctree_super(struct btrfs_trans_handle *trans)
@@ -2299,8 +3133,10 @@ skip_commit:
 	btrfs_free_block_groups(fs_info);
 
 	free_fs_roots_tree(&fs_info->fs_root_tree);
+	fs_root_hash_release(&fs_info->fs_root_hash);
 
 	btrfs_release_all_roots(fs_info);
+	btrfs_reada_free(fs_info);
 	ret = btrfs_close_devices(fs_info->fs_devices);
 	if (fs_info->initial_fd >= 0)
 		close(fs_info->initial_fd);
@@ -118,6 +118,19 @@ enum btrfs_open_ctree_flags {
 	 * Use the superblock of the latest device for the transaction commit.
 	 */
 	OPEN_CTREE_USE_LATEST_BDEV		= (1U << 18),
+
+	/*
+	 * Read-only access only: map the image files and let tree blocks
+	 * reference the mapping instead of reading them into private buffers.
+	 * Opt-in, a truncated or unreadable file raises SIGBUS.
+	 */
+	OPEN_CTREE_MMAP				= (1U << 19),
+
+	/*
+	 * Read-only access only: don't read all block group items at open
+	 * time, read each one on the first lookup of its block group.
+	 */
+	OPEN_CTREE_LAZY_BLOCK_GROUPS		= (1U << 20),
 };
 
 /*
@@ -141,6 +154,33 @@ enum btrfs_read_sb_flags {
 	SBREAD_IGNORE_FSID_MISMATCH = (1U << 2),
 };
 
+/*
+ * Write-back of tree blocks collected during a transaction commit, flushed
+ * sorted by device offset with adjacent blocks merged into one pwritev().
+ */
+#define TREE_BLOCK_WRITEBACK_MAX	(4096)
+/*
+ * Zoned devices are written with O_DIRECT, the adjacent blocks are copied to
+ * an aligned buffer of this size and written at the write pointer at once.
+ */
+#define TREE_BLOCK_ZONED_WRITE_MAX	(SZ_4M)
+
+struct tree_block_write {
+	struct btrfs_device *dev;
+	u64 physical;
+	struct extent_buffer *eb;
+};
+
+struct tree_block_writeback {
+	struct tree_block_write *writes;
+	unsigned int nr;
+	/* Blocks of the RAID56 full stripe at stripe_start, written at once */
+	struct extent_buffer **stripe_ebs;
+	unsigned int stripe_nr;
+	unsigned int stripe_max;
+	u64 stripe_start;
+};
+
 /*
  * Use macro to define mirror super block position,
  * so we can use it in static array initialization
@@ -194,6 +234,8 @@ struct open_ctree_args {
 	u64 root_tree_bytenr;
 	u64 chunk_tree_bytenr;
 	unsigned flags;
+	/* Memory budget of the extent buffer cache, 0 for the default */
+	u64 max_cache_size;
 };
 
 struct btrfs_fs_info *open_ctree_fs_info(struct open_ctree_args *oca);
@@ -210,6 +252,7 @@ int write_ctree_super(struct btrfs_trans_handle *trans);
 int btrfs_check_super(struct btrfs_super_block *sb, unsigned sbflags);
 int btrfs_read_dev_super(int fd, struct btrfs_super_block *sb, u64 sb_bytenr,
 		unsigned sbflags);
+int find_best_backup_root(struct btrfs_super_block *super);
 int btrfs_map_bh_to_logical(struct btrfs_root *root, struct extent_buffer *bh,
 			    u64 logical);
 struct extent_buffer *btrfs_find_tree_block(struct btrfs_fs_info *fs_info,
@@ -218,12 +261,16 @@ struct btrfs_root *btrfs_read_fs_root(struct btrfs_fs_info *fs_info,
 				      struct btrfs_key *location);
 struct btrfs_root *btrfs_read_fs_root_no_cache(struct btrfs_fs_info *fs_info,
 					       struct btrfs_key *location);
+void btrfs_readahead_root_nodes(struct extent_buffer *leaf, int slot,
+				u64 objectid);
 int btrfs_free_fs_root(struct btrfs_root *root);
 void btrfs_mark_buffer_dirty(struct extent_buffer *buf);
 int btrfs_buffer_uptodate(struct extent_buffer *buf, u64 parent_transid,
 			  int atomic);
 int btrfs_set_buffer_uptodate(struct extent_buffer *buf);
 int btrfs_csum_data(u16 csum_type, const u8 *data, u8 *out, size_t len);
+int btrfs_csum_data_batch(u16 csum_type, const u8 *data, u8 *out, size_t len,
+			  size_t nr);
 
 int btrfs_open_device(struct btrfs_device *dev);
 int csum_tree_block_size(struct extent_buffer *buf, u16 csum_sectorsize,
@@ -234,6 +281,13 @@ int btrfs_read_buffer(struct extent_buffer *buf, u64 parent_transid);
 int write_tree_block(struct btrfs_trans_handle *trans,
 		     struct btrfs_fs_info *fs_info,
 		     struct extent_buffer *eb);
+int write_tree_block_batched(struct btrfs_trans_handle *trans,
+			     struct btrfs_fs_info *fs_info,
+			     struct extent_buffer *eb,
+			     struct tree_block_writeback *wb);
+int tree_block_writeback_flush(struct btrfs_fs_info *fs_info,
+			       struct tree_block_writeback *wb);
+void tree_block_writeback_release(struct tree_block_writeback *wb);
 int btrfs_fs_roots_compare_roots(const struct rb_node *node1, const struct rb_node *node2);
 struct btrfs_root *btrfs_create_tree(struct btrfs_trans_handle *trans,
 				     struct btrfs_key *key);
@@ -253,6 +307,9 @@ int btrfs_find_and_setup_root(struct btrfs_root *tree_root,
 			      u64 objectid, struct btrfs_root *root);
 int btrfs_read_extent_buffer(struct extent_buffer *eb,
 			     struct btrfs_tree_parent_check *check);
+int btrfs_read_extent_buffer_prefetched(struct extent_buffer *eb,
+					struct btrfs_tree_parent_check *check,
+					int mirror, const void *data, bool csum_ok);
 
 static inline struct btrfs_root *btrfs_block_group_root(
 						struct btrfs_fs_info *fs_info)
@@ -4,6 +4,7 @@
 #include <errno.h>
 #include "kernel-lib/trace.h"
 #include "kernel-lib/rbtree.h"
+#include "kernel-lib/rbtree_augmented.h"
 #include "kernel-shared/messages.h"
 #include "kernel-shared/extent-io-tree.h"
 #include "kernel-shared/misc.h"
@@ -128,6 +129,60 @@ void extent_io_tree_init(struct btrfs_fs_info *fs_info,
 		lockdep_set_class(&tree->lock, &file_extent_tree_class);
 }
 
+/*
+ * MODIFIED:
+ *  - The tree is augmented with the largest EXTENT_DIRTY state of each subtree.
+ *    Every change of the range or bits of a state in the tree must be followed
+ *    by extent_state_changed().
+ */
+static inline u64 extent_state_dirty_size(const struct extent_state *state)
+{
+	if (!(state->state & EXTENT_DIRTY))
+		return 0;
+	return state->end + 1 - state->start;
+}
+
+static inline u64 extent_state_compute_max(struct extent_state *state)
+{
+	u64 max = extent_state_dirty_size(state);
+	struct extent_state *child;
+
+	if (state->rb_node.rb_left) {
+		child = rb_entry(state->rb_node.rb_left, struct extent_state, rb_node);
+		max = max(max, child->subtree_max_dirty);
+	}
+	if (state->rb_node.rb_right) {
+		child = rb_entry(state->rb_node.rb_right, struct extent_state, rb_node);
+		max = max(max, child->subtree_max_dirty);
+	}
+	return max;
+}
+
+RB_DECLARE_CALLBACKS(static, extent_state_augment, struct extent_state, rb_node,
+		     u64, subtree_max_dirty, extent_state_compute_max)
+
+static inline void extent_state_changed(struct extent_state *state)
+{
+	extent_state_augment_propagate(&state->rb_node, NULL);
+}
+
+static void extent_state_link(struct extent_io_tree *tree,
+			      struct extent_state *state,
+			      struct rb_node *parent, struct rb_node **node)
+{
+	rb_link_node(&state->rb_node, parent, node);
+	state->subtree_max_dirty = 0;
+	extent_state_changed(state);
+	rb_insert_augmented(&state->rb_node, &tree->state, &extent_state_augment);
+}
+
+static inline void extent_state_erase(struct extent_io_tree *tree,
+				      struct extent_state *state)
+{
+	rb_erase_augmented(&state->rb_node, &tree->state, &extent_state_augment);
+	RB_CLEAR_NODE(&state->rb_node);
+}
+
 void extent_io_tree_release(struct extent_io_tree *tree)
 {
 	spin_lock(&tree->lock);
@@ -143,8 +198,7 @@ void extent_io_tree_release(struct extent_io_tree *tree)
 
 		node = rb_first(&tree->state);
 		state = rb_entry(node, struct extent_state, rb_node);
-		rb_erase(&state->rb_node, &tree->state);
-		RB_CLEAR_NODE(&state->rb_node);
+		extent_state_erase(tree, state);
 		/*
 		 * btree io trees aren't supposed to have tasks waiting for
 		 * changes in the flags of extent states ever.
@@ -372,8 +426,8 @@ static void merge_state(struct extent_io_tree *tree, struct extent_state *state)
 		if (tree->inode)
 			btrfs_merge_delalloc_extent(tree->inode, state, other);
 		state->start = other->start;
-		rb_erase(&other->rb_node, &tree->state);
-		RB_CLEAR_NODE(&other->rb_node);
+		extent_state_changed(state);
+		extent_state_erase(tree, other);
 		free_extent_state(other);
 	}
 	other = next_state(state);
@@ -382,8 +436,8 @@ static void merge_state(struct extent_io_tree *tree, struct extent_state *state)
 		if (tree->inode)
 			btrfs_merge_delalloc_extent(tree->inode, state, other);
 		state->end = other->end;
-		rb_erase(&other->rb_node, &tree->state);
-		RB_CLEAR_NODE(&other->rb_node);
+		extent_state_changed(state);
+		extent_state_erase(tree, other);
 		free_extent_state(other);
 	}
 }
@@ -401,6 +455,8 @@ static void set_state_bits(struct extent_io_tree *tree,
 	ret = add_extent_changeset(state, bits_to_set, changeset, 1);
 	BUG_ON(ret < 0);
 	state->state |= bits_to_set;
+	if (extent_state_in_tree(state))
+		extent_state_changed(state);
 }
 
 /*
@@ -442,8 +498,7 @@ static int insert_state(struct extent_io_tree *tree,
 		}
 	}
 
-	rb_link_node(&state->rb_node, parent, node);
-	rb_insert_color(&state->rb_node, &tree->state);
+	extent_state_link(tree, state, parent, node);
 
 	merge_state(tree, state);
 	return 0;
@@ -458,8 +513,7 @@ static void insert_state_fast(struct extent_io_tree *tree,
 			      struct extent_changeset *changeset)
 {
 	set_state_bits(tree, state, bits, changeset);
-	rb_link_node(&state->rb_node, parent, node);
-	rb_insert_color(&state->rb_node, &tree->state);
+	extent_state_link(tree, state, parent, node);
 	merge_state(tree, state);
 }
 
@@ -490,6 +544,7 @@ static int split_state(struct extent_io_tree *tree, struct extent_state *orig,
 	prealloc->end = split - 1;
 	prealloc->state = orig->state;
 	orig->start = split;
+	extent_state_changed(orig);
 
 	parent = &orig->rb_node;
 	node = &parent;
@@ -509,8 +564,7 @@ static int split_state(struct extent_io_tree *tree, struct extent_state *orig,
 		}
 	}
 
-	rb_link_node(&prealloc->rb_node, parent, node);
-	rb_insert_color(&prealloc->rb_node, &tree->state);
+	extent_state_link(tree, prealloc, parent, node);
 
 	return 0;
 }
@@ -537,13 +591,14 @@ static struct extent_state *clear_state_bit(struct extent_io_tree *tree,
 	ret = add_extent_changeset(state, bits_to_clear, changeset, 0);
 	BUG_ON(ret < 0);
 	state->state &= ~bits_to_clear;
+	if (extent_state_in_tree(state))
+		extent_state_changed(state);
 	if (wake)
 		wake_up(&state->wq);
 	if (state->state == 0) {
 		next = next_state(state);
 		if (extent_state_in_tree(state)) {
-			rb_erase(&state->rb_node, &tree->state);
-			RB_CLEAR_NODE(&state->rb_node);
+			extent_state_erase(tree, state);
 			free_extent_state(state);
 		} else {
 			WARN_ON(1);
@@ -881,6 +936,55 @@ out:
 	return ret;
 }
 
+static struct extent_state *first_dirty_fit(struct rb_node *node, u64 start,
+					    u64 min_size)
+{
+	while (node) {
+		struct extent_state *state;
+		struct extent_state *found;
+
+		state = rb_entry(node, struct extent_state, rb_node);
+		if (state->subtree_max_dirty < min_size)
+			return NULL;
+		if (state->end >= start) {
+			found = first_dirty_fit(node->rb_left, start, min_size);
+			if (found)
+				return found;
+			if ((state->state & EXTENT_DIRTY) &&
+			    state->end + 1 - max(state->start, start) >= min_size)
+				return state;
+		}
+		node = node->rb_right;
+	}
+	return NULL;
+}
+
+/*
+ * MODIFIED:
+ *  - Find the first EXTENT_DIRTY range at or after @start with at least
+ *    @min_size bytes after @start, skipping smaller ones without visiting them.
+ *
+ * Return 0 if we find something, and update @start_ret (not below @start) and
+ * @end_ret.
+ * Return 1 if we found nothing.
+ */
+int find_first_dirty_fit(struct extent_io_tree *tree, u64 start, u64 min_size,
+			 u64 *start_ret, u64 *end_ret)
+{
+	struct extent_state *state;
+	int ret = 1;
+
+	spin_lock(&tree->lock);
+	state = first_dirty_fit(tree->state.rb_node, start, max_t(u64, min_size, 1));
+	if (state) {
+		*start_ret = max(state->start, start);
+		*end_ret = state->end;
+		ret = 0;
+	}
+	spin_unlock(&tree->lock);
+	return ret;
+}
+
 /*
  * Find a contiguous area of bits
  *
@@ -103,6 +103,13 @@ struct extent_state {
 	refcount_t refs;
 	u32 state;
 
+	/*
+	 * MODIFIED:
+	 *  - Largest EXTENT_DIRTY state in the subtree, so that free space can
+	 *    be searched by size, see find_first_dirty_fit().
+	 */
+	u64 subtree_max_dirty;
+
 #ifdef CONFIG_BTRFS_DEBUG
 	struct list_head leak_list;
 #endif
@@ -224,6 +231,8 @@ static inline int set_extent_new(struct extent_io_tree *tree, u64 start,
 int find_first_extent_bit(struct extent_io_tree *tree, u64 start,
 			  u64 *start_ret, u64 *end_ret, u32 bits,
 			  struct extent_state **cached_state);
+int find_first_dirty_fit(struct extent_io_tree *tree, u64 start, u64 min_size,
+			 u64 *start_ret, u64 *end_ret);
 void find_first_clear_extent_bit(struct extent_io_tree *tree, u64 start,
 				 u64 *start_ret, u64 *end_ret, u32 bits);
 int find_contiguous_extent_bit(struct extent_io_tree *tree, u64 start,
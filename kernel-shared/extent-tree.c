@@ -252,6 +252,66 @@ static struct btrfs_block_group *block_group_cache_tree_search(
 	return ret;
 }
 
+static int read_one_block_group(struct btrfs_fs_info *fs_info,
+				struct btrfs_path *path);
+
+/*
+ * Read the block group item of the chunk [@start, @start + @length) for
+ * filesystems opened with OPEN_CTREE_LAZY_BLOCK_GROUPS.
+ */
+static struct btrfs_block_group *read_block_group_lazily(
+		struct btrfs_fs_info *info, u64 start, u64 length)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = start;
+	key.type = BTRFS_BLOCK_GROUP_ITEM_KEY;
+	key.offset = length;
+	ret = btrfs_search_slot(NULL, btrfs_block_group_root(info), &key,
+				&path, 0, 0);
+	if (ret == 0)
+		ret = read_one_block_group(info, &path);
+	btrfs_release_path(&path);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to read block group %llu: %m", start);
+	}
+	if (ret)
+		return NULL;
+	return block_group_cache_tree_search(info, start, 0);
+}
+
+/*
+ * Same as block_group_cache_tree_search(), reading the block groups of the
+ * chunks in the way first if they are loaded lazily.
+ */
+static struct btrfs_block_group *lookup_block_group(struct btrfs_fs_info *info,
+						    u64 bytenr, int next)
+{
+	struct btrfs_block_group *cache;
+	struct btrfs_block_group *found;
+	struct cache_extent *ce;
+
+	cache = block_group_cache_tree_search(info, bytenr, next);
+	if (!info->lazy_block_groups || (cache && cache->start <= bytenr))
+		return cache;
+
+	while ((ce = search_cache_extent(&info->mapping_tree.cache_tree, bytenr))) {
+		if (!next && ce->start > bytenr)
+			break;
+		/* The next loaded block group comes before this chunk */
+		if (cache && cache->start <= ce->start)
+			return cache;
+		found = read_block_group_lazily(info, ce->start, ce->size);
+		if (found || !next)
+			return found;
+		bytenr = ce->start + ce->size;
+	}
+	return next ? cache : NULL;
+}
+
 /*
  * Return the block group that contains @bytenr, otherwise return the next one
  * that starts after @bytenr
@@ -259,7 +319,7 @@ static struct btrfs_block_group *block_group_cache_tree_search(
 struct btrfs_block_group *btrfs_lookup_first_block_group(
 		struct btrfs_fs_info *info, u64 bytenr)
 {
-	return block_group_cache_tree_search(info, bytenr, 1);
+	return lookup_block_group(info, bytenr, 1);
 }
 
 /*
@@ -268,7 +328,7 @@ struct btrfs_block_group *btrfs_lookup_first_block_group(
 struct btrfs_block_group *btrfs_lookup_block_group(
 		struct btrfs_fs_info *info, u64 bytenr)
 {
-	return block_group_cache_tree_search(info, bytenr, 0);
+	return lookup_block_group(info, bytenr, 0);
 }
 
 static int block_group_bits(struct btrfs_block_group *cache, u64 bits)
@@ -307,25 +367,14 @@ again:
 		return 0;
 	}
 
-	while(1) {
-		ret = find_first_extent_bit(&root->fs_info->free_space_cache,
-					    last, &start, &end, EXTENT_DIRTY,
-					    NULL);
-		if (ret) {
-			goto new_group;
-		}
-
-		start = max(last, start);
-		last = end + 1;
-		if (last - start < num) {
-			continue;
-		}
-		if (start + num > cache->start + cache->length) {
-			goto new_group;
-		}
-		*start_ret = start;
-		return 0;
-	}
+	ret = find_first_dirty_fit(&root->fs_info->free_space_cache, last, num,
+				   &start, &end);
+	if (ret)
+		goto new_group;
+	if (start + num > cache->start + cache->length)
+		goto new_group;
+	*start_ret = start;
+	return 0;
 out:
 	*start_ret = last;
 	cache = btrfs_lookup_block_group(root->fs_info, search_start);
@@ -2394,66 +2443,43 @@ int btrfs_reserve_extent(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
-static int alloc_reserved_tree_block(struct btrfs_trans_handle *trans,
-				      struct btrfs_delayed_ref_node *node,
-				      struct btrfs_delayed_extent_op *extent_op)
+/* Key and item size of the extent item of a tree block */
+static void reserved_tree_block_key(struct btrfs_fs_info *fs_info,
+				    struct btrfs_delayed_ref_node *node,
+				    struct btrfs_key *ins, u32 *size)
 {
-
-	struct btrfs_root *extent_root = btrfs_extent_root(trans->fs_info,
-							   node->bytenr);
 	struct btrfs_delayed_tree_ref *ref = btrfs_delayed_node_to_tree_ref(node);
-	bool skinny_metadata = btrfs_fs_incompat(trans->fs_info, SKINNY_METADATA);
-	struct btrfs_fs_info *fs_info = trans->fs_info;
-	struct btrfs_extent_item *extent_item;
-	struct btrfs_extent_inline_ref *iref;
-	struct btrfs_space_info *sinfo;
-	struct extent_buffer *leaf;
-	struct btrfs_path *path;
-	struct btrfs_key ins;
-	u32 size = sizeof(*extent_item) + sizeof(*iref);
-	u64 start, end;
-	int ret;
-
-	sinfo = btrfs_find_space_info(fs_info, BTRFS_BLOCK_GROUP_METADATA);
-	ASSERT(sinfo);
 
-	ins.objectid = node->bytenr;
-	if (skinny_metadata) {
-		ins.type = BTRFS_METADATA_ITEM_KEY;
-		ins.offset = ref->level;
+	*size = sizeof(struct btrfs_extent_item) +
+		sizeof(struct btrfs_extent_inline_ref);
+	ins->objectid = node->bytenr;
+	if (btrfs_fs_incompat(fs_info, SKINNY_METADATA)) {
+		ins->type = BTRFS_METADATA_ITEM_KEY;
+		ins->offset = ref->level;
 	} else {
-		ins.type = BTRFS_EXTENT_ITEM_KEY;
-		ins.offset = node->num_bytes;
-		size += sizeof(struct btrfs_tree_block_info);
+		ins->type = BTRFS_EXTENT_ITEM_KEY;
+		ins->offset = node->num_bytes;
+		*size += sizeof(struct btrfs_tree_block_info);
 	}
+}
 
-	if (ref->root == BTRFS_EXTENT_TREE_OBJECTID) {
-		ret = find_first_extent_bit(&trans->fs_info->extent_ins,
-					    node->bytenr, &start, &end,
-					    EXTENT_LOCKED, NULL);
-		ASSERT(!ret);
-		ASSERT(start == node->bytenr);
-		ASSERT(end == node->bytenr + node->num_bytes - 1);
-	}
-
-	path = btrfs_alloc_path();
-	if (!path)
-		return -ENOMEM;
-
-	ret = btrfs_insert_empty_item(trans, extent_root, path, &ins, size);
-	if (ret)
-		return ret;
+static void fill_reserved_tree_block(struct btrfs_trans_handle *trans,
+				     struct extent_buffer *leaf, int slot,
+				     struct btrfs_delayed_ref_node *node,
+				     struct btrfs_delayed_extent_op *extent_op)
+{
+	struct btrfs_delayed_tree_ref *ref = btrfs_delayed_node_to_tree_ref(node);
+	struct btrfs_extent_item *extent_item;
+	struct btrfs_extent_inline_ref *iref;
 
-	leaf = path->nodes[0];
-	extent_item = btrfs_item_ptr(leaf, path->slots[0],
-				     struct btrfs_extent_item);
+	extent_item = btrfs_item_ptr(leaf, slot, struct btrfs_extent_item);
 	btrfs_set_extent_refs(leaf, extent_item, 1);
 	btrfs_set_extent_generation(leaf, extent_item, trans->transid);
 	btrfs_set_extent_flags(leaf, extent_item,
 			       extent_op->flags_to_set |
 			       BTRFS_EXTENT_FLAG_TREE_BLOCK);
 
-	if (skinny_metadata) {
+	if (btrfs_fs_incompat(trans->fs_info, SKINNY_METADATA)) {
 		iref = (struct btrfs_extent_inline_ref *)(extent_item + 1);
 	} else {
 		struct btrfs_tree_block_info *block_info;
@@ -2465,15 +2491,35 @@ static int alloc_reserved_tree_block(struct btrfs_trans_handle *trans,
 
 	btrfs_set_extent_inline_ref_type(leaf, iref, BTRFS_TREE_BLOCK_REF_KEY);
 	btrfs_set_extent_inline_ref_offset(leaf, iref, ref->root);
+}
 
-	btrfs_mark_buffer_dirty(leaf);
-	btrfs_free_path(path);
+/* Account a tree block whose extent item has been inserted */
+static int finish_reserved_tree_block(struct btrfs_trans_handle *trans,
+				      struct btrfs_delayed_ref_node *node)
+{
+	struct btrfs_delayed_tree_ref *ref = btrfs_delayed_node_to_tree_ref(node);
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_space_info *sinfo;
+	u64 start, end;
+	int ret;
+
+	sinfo = btrfs_find_space_info(fs_info, BTRFS_BLOCK_GROUP_METADATA);
+	ASSERT(sinfo);
 
-	ret = remove_from_free_space_tree(trans, ins.objectid, fs_info->nodesize);
+	if (ref->root == BTRFS_EXTENT_TREE_OBJECTID) {
+		ret = find_first_extent_bit(&trans->fs_info->extent_ins,
+					    node->bytenr, &start, &end,
+					    EXTENT_LOCKED, NULL);
+		ASSERT(!ret);
+		ASSERT(start == node->bytenr);
+		ASSERT(end == node->bytenr + node->num_bytes - 1);
+	}
+
+	ret = remove_from_free_space_tree(trans, node->bytenr, fs_info->nodesize);
 	if (ret)
 		return ret;
 
-	ret = update_block_group(trans, ins.objectid, fs_info->nodesize, 1, 0);
+	ret = update_block_group(trans, node->bytenr, fs_info->nodesize, 1, 0);
 	if (sinfo) {
 		if (fs_info->nodesize > sinfo->bytes_reserved) {
 			WARN_ON(1);
@@ -2491,6 +2537,37 @@ static int alloc_reserved_tree_block(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+static int alloc_reserved_tree_block(struct btrfs_trans_handle *trans,
+				      struct btrfs_delayed_ref_node *node,
+				      struct btrfs_delayed_extent_op *extent_op)
+{
+	struct btrfs_root *extent_root = btrfs_extent_root(trans->fs_info,
+							   node->bytenr);
+	struct btrfs_path *path;
+	struct btrfs_key ins;
+	u32 size;
+	int ret;
+
+	reserved_tree_block_key(trans->fs_info, node, &ins, &size);
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+
+	ret = btrfs_insert_empty_item(trans, extent_root, path, &ins, size);
+	if (ret) {
+		btrfs_free_path(path);
+		return ret;
+	}
+
+	fill_reserved_tree_block(trans, path->nodes[0], path->slots[0], node,
+				 extent_op);
+	btrfs_mark_buffer_dirty(path->nodes[0]);
+	btrfs_free_path(path);
+
+	return finish_reserved_tree_block(trans, node);
+}
+
 static int alloc_tree_block(struct btrfs_trans_handle *trans,
 			    struct btrfs_root *root, u64 parent,
 			    u64 root_objectid, u64 generation,
@@ -3475,6 +3552,8 @@ static int free_block_group_cache(struct btrfs_trans_handle *trans,
 			goto out;
 	}
 	remove_cache_extent(&fs_info->mapping_tree.cache_tree, ce);
+	if (fs_info->mapping_tree.last_hit == ce)
+		fs_info->mapping_tree.last_hit = NULL;
 	kfree(map);
 out:
 	return ret;
@@ -3790,6 +3869,156 @@ static int run_one_delayed_ref(struct btrfs_trans_handle *trans,
 	return ret;
 }
 
+/*
+ * Most of the heads of a large transaction are tree blocks allocated in it,
+ * each with the one ref adding the extent item.  Being sorted by bytenr, a
+ * run of them usually goes to one place in the extent tree.
+ */
+#define RESERVED_BATCH_MAX		64
+
+static bool is_reserved_tree_block(struct btrfs_delayed_ref_head *head)
+{
+	struct btrfs_delayed_ref_node *ref;
+	struct rb_node *node;
+
+	if (!head->must_insert_reserved || head->is_data || !head->extent_op ||
+	    !head->extent_op->update_flags)
+		return false;
+	node = rb_first(&head->ref_tree);
+	if (!node || rb_next(node))
+		return false;
+	ref = rb_entry(node, struct btrfs_delayed_ref_node, ref_node);
+	return ref->action == BTRFS_ADD_DELAYED_REF && ref->ref_mod == 1 &&
+	       (ref->type == BTRFS_TREE_BLOCK_REF_KEY ||
+		ref->type == BTRFS_SHARED_BLOCK_REF_KEY);
+}
+
+/*
+ * Insert the extent items of the reserved tree blocks starting at the
+ * selected head @first with one search, as many as fit before the next
+ * item in the extent tree.  Return the number of heads run, 0 if the heads
+ * are left to run one by one.
+ */
+static int run_reserved_tree_blocks(struct btrfs_trans_handle *trans,
+				    struct btrfs_delayed_ref_head *first)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_delayed_ref_root *delayed_refs = &trans->delayed_refs;
+	struct btrfs_delayed_ref_head *heads[RESERVED_BATCH_MAX];
+	struct btrfs_key keys[RESERVED_BATCH_MAX];
+	u32 sizes[RESERVED_BATCH_MAX];
+	struct btrfs_item_batch batch;
+	struct btrfs_root *extent_root;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key next;
+	struct rb_node *node;
+	u32 max_size = BTRFS_LEAF_DATA_SIZE(fs_info) / 4;
+	u32 total = 0;
+	bool bounded;
+	int scanned = 0;
+	int nr = 0;
+	int ret;
+	int i;
+
+	if (!is_reserved_tree_block(first))
+		return 0;
+	extent_root = btrfs_extent_root(fs_info, first->bytenr);
+	/*
+	 * Other heads in between are skipped, they are either run later or
+	 * have an item in the extent tree bounding the batch below.
+	 */
+	for (node = &first->href_node; node && nr < RESERVED_BATCH_MAX &&
+	     scanned < 2 * RESERVED_BATCH_MAX; node = rb_next(node), scanned++) {
+		struct btrfs_delayed_ref_head *head;
+
+		head = rb_entry(node, struct btrfs_delayed_ref_head, href_node);
+		if (btrfs_extent_root(fs_info, head->bytenr) != extent_root)
+			break;
+		if ((head != first && head->processing) ||
+		    !is_reserved_tree_block(head))
+			continue;
+		reserved_tree_block_key(fs_info,
+			rb_entry(rb_first(&head->ref_tree),
+				 struct btrfs_delayed_ref_node, ref_node),
+			&keys[nr], &sizes[nr]);
+		if (total + sizes[nr] + sizeof(struct btrfs_item) > max_size)
+			break;
+		total += sizes[nr] + sizeof(struct btrfs_item);
+		heads[nr++] = head;
+	}
+	if (nr < 2)
+		return 0;
+
+	/* The items go to one slot, so they must all sort before the next one */
+	ret = btrfs_search_slot(NULL, extent_root, &keys[0], &path, 0, 0);
+	if (ret <= 0) {
+		/* Errors and existing items are reported by the single run */
+		btrfs_release_path(&path);
+		return 0;
+	}
+	if (path.slots[0] < btrfs_header_nritems(path.nodes[0])) {
+		btrfs_item_key_to_cpu(path.nodes[0], &next, path.slots[0]);
+		bounded = true;
+	} else {
+		bounded = !find_next_key(&path, &next);
+	}
+	btrfs_release_path(&path);
+	while (bounded && nr > 0 && btrfs_comp_cpu_keys(&keys[nr - 1], &next) >= 0)
+		nr--;
+	if (nr < 2)
+		return 0;
+
+	batch.keys = keys;
+	batch.data_sizes = sizes;
+	batch.total_data_size = 0;
+	for (i = 0; i < nr; i++)
+		batch.total_data_size += sizes[i];
+	batch.nr = nr;
+	ret = btrfs_insert_empty_items(trans, extent_root, &path, &batch);
+	if (ret) {
+		btrfs_release_path(&path);
+		return ret;
+	}
+	for (i = 0; i < nr; i++) {
+		struct btrfs_delayed_ref_head *head = heads[i];
+
+		fill_reserved_tree_block(trans, path.nodes[0], path.slots[0] + i,
+			rb_entry(rb_first(&head->ref_tree),
+				 struct btrfs_delayed_ref_node, ref_node),
+			head->extent_op);
+	}
+	btrfs_mark_buffer_dirty(path.nodes[0]);
+	btrfs_release_path(&path);
+
+	for (i = 0; i < nr; i++) {
+		struct btrfs_delayed_ref_head *head = heads[i];
+		struct btrfs_delayed_ref_node *ref;
+
+		if (head != first) {
+			head->processing = true;
+			delayed_refs->num_heads_ready--;
+		}
+		ref = rb_entry(rb_first(&head->ref_tree),
+			       struct btrfs_delayed_ref_node, ref_node);
+		ref->in_tree = 0;
+		rb_erase(&ref->ref_node, &head->ref_tree);
+		RB_CLEAR_NODE(&ref->ref_node);
+		if (!list_empty(&ref->add_list))
+			list_del(&ref->add_list);
+		head->ref_mod -= ref->ref_mod;
+		head->must_insert_reserved = false;
+
+		ret = finish_reserved_tree_block(trans, ref);
+		btrfs_put_delayed_ref(ref);
+		if (ret < 0)
+			return ret;
+		ret = cleanup_ref_head(trans, fs_info, head);
+		ASSERT(ret == 0);
+	}
+	delayed_refs->run_delayed_start = keys[nr - 1].objectid + fs_info->nodesize;
+	return nr;
+}
+
 int btrfs_run_delayed_refs(struct btrfs_trans_handle *trans, unsigned long nr)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
@@ -3803,9 +4032,20 @@ int btrfs_run_delayed_refs(struct btrfs_trans_handle *trans, unsigned long nr)
 	delayed_refs = &trans->delayed_refs;
 	while (1) {
 		if (!locked_ref) {
+			/* Including the refs added by running the previous ones */
+			ret = btrfs_flush_delayed_ref_batch(trans);
+			if (ret < 0)
+				return ret;
 			locked_ref = btrfs_select_ref_head(trans);
 			if (!locked_ref)
 				break;
+			ret = run_reserved_tree_blocks(trans, locked_ref);
+			if (ret < 0)
+				return ret;
+			if (ret > 0) {
+				locked_ref = NULL;
+				continue;
+			}
 		}
 		/*
 		 * We need to try and merge add/drops of the same ref since we
@@ -3934,3 +4174,189 @@ int btrfs_convert_one_bg(struct btrfs_trans_handle *trans, u64 bytenr)
 	}
 	return ret;
 }
+
+/*
+ * Delete the items of the block groups @bgs from @root, the items next to each
+ * other in a leaf are deleted at once.
+ */
+static int remove_block_group_items(struct btrfs_trans_handle *trans,
+				    struct btrfs_root *root,
+				    struct btrfs_block_group **bgs, int nr)
+{
+	int i = 0;
+
+	while (i < nr) {
+		struct btrfs_path path = { 0 };
+		struct extent_buffer *leaf;
+		struct btrfs_key key;
+		int slot;
+		int nr_items = 1;
+		int ret;
+
+		key.objectid = bgs[i]->start;
+		key.type = BTRFS_BLOCK_GROUP_ITEM_KEY;
+		key.offset = bgs[i]->length;
+		ret = btrfs_search_slot(trans, root, &key, &path, -1, 1);
+		if (ret > 0)
+			ret = -ENOENT;
+		if (ret < 0) {
+			btrfs_release_path(&path);
+			error("failed to delete block group item %llu from the old root: %d",
+			      bgs[i]->start, ret);
+			return ret;
+		}
+		leaf = path.nodes[0];
+		slot = path.slots[0];
+		while (i + nr_items < nr &&
+		       slot + nr_items < btrfs_header_nritems(leaf)) {
+			const struct btrfs_block_group *next = bgs[i + nr_items];
+
+			btrfs_item_key_to_cpu(leaf, &key, slot + nr_items);
+			if (key.objectid != next->start ||
+			    key.type != BTRFS_BLOCK_GROUP_ITEM_KEY ||
+			    key.offset != next->length)
+				break;
+			nr_items++;
+		}
+		ret = btrfs_del_items(trans, root, &path, slot, nr_items);
+		btrfs_release_path(&path);
+		if (ret < 0) {
+			error("failed to delete block group item %llu from the old root: %d",
+			      bgs[i]->start, ret);
+			return ret;
+		}
+		i += nr_items;
+	}
+	return 0;
+}
+
+/*
+ * Insert the items of the block groups @bgs into the block group tree, which
+ * has no items in their range, as many at once as fit into a leaf.
+ */
+static int insert_block_group_items(struct btrfs_trans_handle *trans,
+				    struct btrfs_block_group **bgs, int nr)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_root *root = fs_info->block_group_root;
+	const u32 item_size = sizeof(struct btrfs_block_group_item);
+	/* Half of a leaf, so that a split makes enough room */
+	const int max_items = BTRFS_LEAF_DATA_SIZE(fs_info) /
+			      (sizeof(struct btrfs_item) + item_size) / 2;
+	struct btrfs_key *keys;
+	u32 *sizes;
+	int ret = 0;
+
+	keys = malloc(max_items * sizeof(*keys));
+	sizes = malloc(max_items * sizeof(*sizes));
+	if (!keys || !sizes) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for (int i = 0; i < max_items; i++)
+		sizes[i] = item_size;
+
+	for (int i = 0; i < nr; i += max_items) {
+		struct btrfs_path path = { 0 };
+		struct btrfs_item_batch batch;
+		struct extent_buffer *leaf;
+
+		batch.keys = keys;
+		batch.data_sizes = sizes;
+		batch.nr = min(nr - i, max_items);
+		batch.total_data_size = batch.nr * item_size;
+		for (int k = 0; k < batch.nr; k++) {
+			keys[k].objectid = bgs[i + k]->start;
+			keys[k].type = BTRFS_BLOCK_GROUP_ITEM_KEY;
+			keys[k].offset = bgs[i + k]->length;
+		}
+		ret = btrfs_insert_empty_items(trans, root, &path, &batch);
+		if (ret < 0) {
+			btrfs_release_path(&path);
+			error("failed to insert block group item %llu into the new root: %d",
+			      bgs[i]->start, ret);
+			goto out;
+		}
+		leaf = path.nodes[0];
+		for (int k = 0; k < batch.nr; k++) {
+			const struct btrfs_block_group *bg = bgs[i + k];
+			struct btrfs_block_group_item bgi;
+
+			btrfs_set_stack_block_group_used(&bgi, bg->used);
+			btrfs_set_stack_block_group_chunk_objectid(&bgi,
+							bg->global_root_id);
+			btrfs_set_stack_block_group_flags(&bgi, bg->flags);
+			write_extent_buffer(leaf, &bgi,
+				btrfs_item_ptr_offset(leaf, path.slots[0] + k),
+				item_size);
+		}
+		btrfs_mark_buffer_dirty(leaf);
+		btrfs_release_path(&path);
+	}
+out:
+	free(keys);
+	free(sizes);
+	return ret;
+}
+
+/*
+ * Convert the block groups at @bytenrs in one go, they must be sorted and the
+ * last one must be right before the last converted block group.
+ *
+ * The old items are deleted by runs of adjacent items and the new items of the
+ * block group tree are inserted by leaves.  The items inserted into the extent
+ * tree are interleaved with the extent items and inserted one by one.
+ */
+int btrfs_convert_bgs(struct btrfs_trans_handle *trans, const u64 *bytenrs,
+		      int nr)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	const bool to_bg_tree = !btrfs_fs_compat_ro(fs_info, BLOCK_GROUP_TREE);
+	struct btrfs_block_group **bgs;
+	int ret = 0;
+
+	ASSERT(fs_info->block_group_root);
+	ASSERT(btrfs_super_flags(fs_info->super_copy) &
+	       BTRFS_SUPER_FLAG_CHANGING_BG_TREE);
+
+	if (!nr)
+		return 0;
+	bgs = malloc(nr * sizeof(*bgs));
+	if (!bgs)
+		return -ENOMEM;
+	for (int i = 0; i < nr; i++) {
+		bgs[i] = btrfs_lookup_block_group(fs_info, bytenrs[i]);
+		if (!bgs[i]) {
+			error("failed to find block group for bytenr %llu",
+			      bytenrs[i]);
+			ret = -ENOENT;
+			goto out;
+		}
+	}
+
+	/*
+	 * As we haven't yet update last_converted_bg_bytenr, the old root is
+	 * still the block group root.
+	 */
+	ret = remove_block_group_items(trans, btrfs_block_group_root(fs_info),
+				       bgs, nr);
+	if (ret < 0)
+		goto out;
+	fs_info->last_converted_bg_bytenr = bytenrs[0];
+
+	if (to_bg_tree) {
+		ret = insert_block_group_items(trans, bgs, nr);
+		goto out;
+	}
+	for (int i = 0; i < nr; i++) {
+		ret = insert_block_group_item(trans, bgs[i]);
+		if (ret < 0) {
+			error("failed to insert block group item into the new root: %d",
+			      ret);
+			goto out;
+		}
+	}
+out:
+	free(bgs);
+	return ret;
+}
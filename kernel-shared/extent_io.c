@@ -22,6 +22,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/mman.h>
 #include "kernel-lib/list.h"
 #include "kernel-lib/raid56.h"
 #include "kernel-lib/bitmap.h"
@@ -38,20 +39,182 @@
 #include "common/utils.h"
 #include "common/device-utils.h"
 #include "common/internal.h"
+#include "common/slab.h"
+#include "common/stats.h"
+#include "common/thread-pool.h"
 
 static void free_extent_buffer_final(struct extent_buffer *eb);
 
+/*
+ * Exact bytenr lookups of cached extent buffers go through an open addressing
+ * hash table (linear probing), the cache tree is only used for range queries
+ * and overlap detection.
+ */
+#define EB_HASH_MIN_BITS		(10)
+
+static inline u64 eb_hash_slot(const struct extent_buffer_hash *hash,
+			       u64 bytenr)
+{
+	/* Tree blocks are at least sector aligned, the low bits are zero */
+	return ((bytenr >> 12) * 0x9E3779B97F4A7C15ULL) >> (64 - hash->bits);
+}
+
+static int eb_hash_resize(struct extent_buffer_hash *hash, unsigned int bits)
+{
+	struct extent_buffer **old_slots = hash->slots;
+	const u64 old_nr = hash->slots ? (1ULL << hash->bits) : 0;
+	struct extent_buffer **slots;
+
+	slots = calloc(1ULL << bits, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	hash->slots = slots;
+	hash->bits = bits;
+	for (u64 i = 0; i < old_nr; i++) {
+		struct extent_buffer *eb = old_slots[i];
+		const u64 mask = (1ULL << bits) - 1;
+		u64 slot;
+
+		if (!eb)
+			continue;
+		slot = eb_hash_slot(hash, eb->start);
+		while (slots[slot])
+			slot = (slot + 1) & mask;
+		slots[slot] = eb;
+	}
+	free(old_slots);
+	return 0;
+}
+
+static struct extent_buffer *eb_hash_lookup(const struct extent_buffer_hash *hash,
+					    u64 bytenr)
+{
+	u64 mask;
+	u64 slot;
+
+	if (!hash->slots)
+		return NULL;
+	mask = (1ULL << hash->bits) - 1;
+	slot = eb_hash_slot(hash, bytenr);
+	while (hash->slots[slot]) {
+		if (hash->slots[slot]->start == bytenr)
+			return hash->slots[slot];
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+static int eb_hash_insert(struct extent_buffer_hash *hash,
+			  struct extent_buffer *eb)
+{
+	u64 mask;
+	u64 slot;
+
+	/* Keep the load factor below 1/2 */
+	if (!hash->slots || (hash->nr_entries + 1) * 2 > (1ULL << hash->bits)) {
+		int ret;
+
+		ret = eb_hash_resize(hash, hash->slots ? hash->bits + 1 :
+						EB_HASH_MIN_BITS);
+		if (ret < 0)
+			return ret;
+	}
+	mask = (1ULL << hash->bits) - 1;
+	slot = eb_hash_slot(hash, eb->start);
+	while (hash->slots[slot])
+		slot = (slot + 1) & mask;
+	hash->slots[slot] = eb;
+	hash->nr_entries++;
+	return 0;
+}
+
+static void eb_hash_remove(struct extent_buffer_hash *hash,
+			   struct extent_buffer *eb)
+{
+	u64 mask;
+	u64 hole;
+	u64 slot;
+
+	if (!hash->slots)
+		return;
+	mask = (1ULL << hash->bits) - 1;
+	slot = eb_hash_slot(hash, eb->start);
+	while (hash->slots[slot] && hash->slots[slot] != eb)
+		slot = (slot + 1) & mask;
+	if (!hash->slots[slot])
+		return;
+
+	/*
+	 * Shift back the following entries of the probe sequence into the
+	 * hole, unless their home slot is cyclically in (hole, slot].
+	 */
+	hole = slot;
+	hash->slots[hole] = NULL;
+	hash->nr_entries--;
+	while (true) {
+		u64 home;
+
+		slot = (slot + 1) & mask;
+		if (!hash->slots[slot])
+			break;
+		home = eb_hash_slot(hash, hash->slots[slot]->start);
+		if (hole <= slot ? (hole < home && home <= slot) :
+				   (hole < home || home <= slot))
+			continue;
+		hash->slots[hole] = hash->slots[slot];
+		hash->slots[slot] = NULL;
+		hole = slot;
+	}
+}
+
+/*
+ * Cached extent buffers have their structure and data allocated from two
+ * slabs, so the frequent allocations and frees of tree blocks don't fragment
+ * the heap. The data chunks are 2M aligned to allow transparent huge pages.
+ */
+#define EB_HEADER_SLAB_CHUNK		(SZ_64K)
+#define EB_DATA_SLAB_CHUNK		(SZ_2M)
+
+/*
+ * The extent buffer cache uses a 2Q-like replacement policy, so that a single
+ * large sequential walk (e.g. the extent tree pass of check, or dumping all
+ * trees) does not push out the upper level nodes every later search needs:
+ *
+ * - newly allocated buffers are put on the cold list (fs_info->lru)
+ * - buffers found uptodate in the cache again, and tree nodes (level > 0)
+ *   once read, are moved to the hot list (fs_info->lru_hot)
+ * - trimming evicts cold buffers first, then hot leaves, and hot nodes only as
+ *   the last resort
+ *
+ * The hot list is limited to 3/4 of the cache budget, so stale hot leaves
+ * still give way to a new working set.
+ *
+ * The budget starts at a quarter of the memory, or of the memory limit of the
+ * cgroup, and follows the memory pressure, see adapt_extent_buffer_cache().
+ */
 void extent_buffer_init_cache(struct btrfs_fs_info *fs_info)
 {
 	fs_info->max_cache_size = total_memory() / 4;
+	fs_info->cache_size_limit = fs_info->max_cache_size;
+	fs_info->cache_adapt_ns = 0;
+	fs_info->cache_allocs = 0;
 	fs_info->cache_size = 0;
+	fs_info->hot_cache_size = 0;
 	INIT_LIST_HEAD(&fs_info->lru);
+	INIT_LIST_HEAD(&fs_info->lru_hot);
+	memset(&fs_info->eb_hash, 0, sizeof(fs_info->eb_hash));
+	object_slab_init(&fs_info->eb_header_slab, sizeof(struct extent_buffer),
+		     EB_HEADER_SLAB_CHUNK);
+	/* The nodesize is not known yet, set on the first allocation */
+	object_slab_init(&fs_info->eb_data_slab, 0, EB_DATA_SLAB_CHUNK);
 }
 
 void extent_buffer_free_cache(struct btrfs_fs_info *fs_info)
 {
 	struct extent_buffer *eb;
 
+	list_splice_tail_init(&fs_info->lru_hot, &fs_info->lru);
 	while(!list_empty(&fs_info->lru)) {
 		eb = list_entry(fs_info->lru.next, struct extent_buffer, lru);
 		if (eb->refs) {
@@ -71,6 +234,11 @@ void extent_buffer_free_cache(struct btrfs_fs_info *fs_info)
 
 	free_extent_cache_tree(&fs_info->extent_cache);
 	fs_info->cache_size = 0;
+	fs_info->hot_cache_size = 0;
+	free(fs_info->eb_hash.slots);
+	memset(&fs_info->eb_hash, 0, sizeof(fs_info->eb_hash));
+	object_slab_release(&fs_info->eb_header_slab);
+	object_slab_release(&fs_info->eb_data_slab);
 }
 
 /*
@@ -129,19 +297,52 @@ void extent_buffer_bitmap_clear(struct extent_buffer *eb, unsigned long start,
 	}
 }
 
-static struct extent_buffer *__alloc_extent_buffer(struct btrfs_fs_info *info,
-						   u64 bytenr, u32 blocksize)
+/*
+ * Allocate the structure and data of an extent buffer from the slabs, this
+ * is only for buffers which are inserted into the cache, and thus are
+ * guaranteed to be freed before the slabs are released.
+ */
+static struct extent_buffer *alloc_slab_extent_buffer(struct btrfs_fs_info *info,
+						      u32 blocksize)
 {
 	struct extent_buffer *eb;
+	char *data;
+
+	if (!info->eb_data_slab.obj_size && !info->eb_data_slab.nr_chunks)
+		object_slab_init(&info->eb_data_slab, blocksize, EB_DATA_SLAB_CHUNK);
+	if (info->eb_data_slab.obj_size != blocksize)
+		return NULL;
 
-	eb = calloc(1, sizeof(struct extent_buffer) + blocksize);
+	eb = object_slab_alloc(&info->eb_header_slab);
+	if (!eb)
+		return NULL;
+	data = object_slab_alloc(&info->eb_data_slab);
+	if (!data) {
+		object_slab_free(&info->eb_header_slab, eb);
+		return NULL;
+	}
+	memset(eb, 0, sizeof(*eb));
+	eb->data = data;
+	eb->flags = EXTENT_BUFFER_SLAB;
+	return eb;
+}
+
+static struct extent_buffer *__alloc_extent_buffer(struct btrfs_fs_info *info,
+						   u64 bytenr, u32 blocksize,
+						   bool cached)
+{
+	struct extent_buffer *eb = NULL;
+
+	if (cached)
+		eb = alloc_slab_extent_buffer(info, blocksize);
+	if (!eb)
+		eb = alloc_extent_buffer_inline(blocksize);
 	if (!eb)
 		return NULL;
 
 	eb->start = bytenr;
 	eb->len = blocksize;
 	eb->refs = 1;
-	eb->flags = 0;
 	eb->cache_node.start = bytenr;
 	eb->cache_node.size = blocksize;
 	eb->fs_info = info;
@@ -152,11 +353,44 @@ static struct extent_buffer *__alloc_extent_buffer(struct btrfs_fs_info *info,
 	return eb;
 }
 
+/*
+ * Make the data of a cached extent buffer reference @addr, which must stay
+ * valid for the lifetime of the buffer (a device mapping).
+ *
+ * Only slab allocated buffers can be mapped, return false for others so the
+ * caller reads into the buffer instead.
+ */
+bool extent_buffer_map_data(struct extent_buffer *eb, char *addr)
+{
+	if (!(eb->flags & EXTENT_BUFFER_SLAB))
+		return false;
+	if (!(eb->flags & EXTENT_BUFFER_MMAP))
+		object_slab_free(&eb->fs_info->eb_data_slab, eb->data);
+	eb->data = addr;
+	eb->flags |= EXTENT_BUFFER_MMAP;
+	return true;
+}
+
+/* Give a mapped extent buffer its own data again, the content is undefined */
+int extent_buffer_unmap_data(struct extent_buffer *eb)
+{
+	char *data;
+
+	if (!(eb->flags & EXTENT_BUFFER_MMAP))
+		return 0;
+	data = object_slab_alloc(&eb->fs_info->eb_data_slab);
+	if (!data)
+		return -ENOMEM;
+	eb->data = data;
+	eb->flags &= ~EXTENT_BUFFER_MMAP;
+	return 0;
+}
+
 struct extent_buffer *btrfs_clone_extent_buffer(struct extent_buffer *src)
 {
 	struct extent_buffer *new;
 
-	new = __alloc_extent_buffer(src->fs_info, src->start, src->len);
+	new = __alloc_extent_buffer(src->fs_info, src->start, src->len, false);
 	if (!new)
 		return NULL;
 
@@ -172,8 +406,19 @@ static void free_extent_buffer_final(struct extent_buffer *eb)
 	list_del_init(&eb->lru);
 	if (!(eb->flags & EXTENT_BUFFER_DUMMY)) {
 		remove_cache_extent(&eb->fs_info->extent_cache, &eb->cache_node);
+		eb_hash_remove(&eb->fs_info->eb_hash, eb);
 		BUG_ON(eb->fs_info->cache_size < eb->len);
 		eb->fs_info->cache_size -= eb->len;
+		if (eb->flags & EXTENT_BUFFER_HOT) {
+			BUG_ON(eb->fs_info->hot_cache_size < eb->len);
+			eb->fs_info->hot_cache_size -= eb->len;
+		}
+	}
+	if (eb->flags & EXTENT_BUFFER_SLAB) {
+		if (!(eb->flags & EXTENT_BUFFER_MMAP))
+			object_slab_free(&eb->fs_info->eb_data_slab, eb->data);
+		object_slab_free(&eb->fs_info->eb_header_slab, eb);
+		return;
 	}
 	kfree(eb);
 }
@@ -212,23 +457,54 @@ void free_extent_buffer_stale(struct extent_buffer *eb)
 	free_extent_buffer_internal(eb, 1);
 }
 
+/*
+ * Move the extent buffer to the hot list of the cache.
+ *
+ * Used for buffers which are likely to be accessed again, either because they
+ * have already been hit in the cache, or because they are tree nodes.
+ */
+void extent_buffer_mark_hot(struct extent_buffer *eb)
+{
+	struct btrfs_fs_info *fs_info = eb->fs_info;
+
+	if (eb->flags & EXTENT_BUFFER_DUMMY)
+		return;
+	if (!(eb->flags & EXTENT_BUFFER_HOT)) {
+		eb->flags |= EXTENT_BUFFER_HOT;
+		fs_info->hot_cache_size += eb->len;
+	}
+	list_move_tail(&eb->lru, &fs_info->lru_hot);
+}
+
+/*
+ * Record a cache hit. Only buffers with valid content are promoted, so a
+ * readahead lookup followed by the actual read does not count as reuse.
+ */
+static void extent_buffer_cache_hit(struct extent_buffer *eb)
+{
+	if (eb->flags & (EXTENT_BUFFER_HOT | EXTENT_BUFFER_UPTODATE))
+		extent_buffer_mark_hot(eb);
+	else
+		list_move_tail(&eb->lru, &eb->fs_info->lru);
+}
+
 struct extent_buffer *find_extent_buffer(struct btrfs_fs_info *fs_info,
 					 u64 bytenr)
 {
-	struct extent_buffer *eb = NULL;
-	struct cache_extent *cache;
+	struct extent_buffer *eb;
 
-	cache = lookup_cache_extent(&fs_info->extent_cache, bytenr,
-				    fs_info->nodesize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == fs_info->nodesize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &fs_info->lru);
-		eb->refs++;
-	}
+	eb = eb_hash_lookup(&fs_info->eb_hash, bytenr);
+	if (!eb || eb->len != fs_info->nodesize)
+		return NULL;
+	extent_buffer_cache_hit(eb);
+	eb->refs++;
 	return eb;
 }
 
+/*
+ * Range lookup, used to iterate cached (mostly dirty) buffers, which is not
+ * an indication of reuse so the buffer stays on its current list.
+ */
 struct extent_buffer *find_first_extent_buffer(struct btrfs_fs_info *fs_info,
 					       u64 start)
 {
@@ -238,22 +514,95 @@ struct extent_buffer *find_first_extent_buffer(struct btrfs_fs_info *fs_info,
 	cache = search_cache_extent(&fs_info->extent_cache, start);
 	if (cache) {
 		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &fs_info->lru);
 		eb->refs++;
 	}
 	return eb;
 }
 
-static void trim_extent_buffer_cache(struct btrfs_fs_info *fs_info)
+static bool extent_buffer_is_node(const struct extent_buffer *eb)
+{
+	return (eb->flags & EXTENT_BUFFER_UPTODATE) && btrfs_header_level(eb) > 0;
+}
+
+/*
+ * Free unreferenced buffers from the least recently used end of @list until
+ * the accounted size pointed to by @size drops to @limit.
+ */
+static void evict_extent_buffers(struct btrfs_fs_info *fs_info,
+				 struct list_head *list, const u64 *size,
+				 u64 limit, bool keep_nodes)
 {
 	struct extent_buffer *eb, *tmp;
 
-	list_for_each_entry_safe(eb, tmp, &fs_info->lru, lru) {
-		if (eb->refs == 0)
-			free_extent_buffer_final(eb);
-		if (fs_info->cache_size <= ((fs_info->max_cache_size * 9) / 10))
+	list_for_each_entry_safe(eb, tmp, list, lru) {
+		if (*size <= limit)
 			break;
+		if (eb->refs)
+			continue;
+		if (keep_nodes && extent_buffer_is_node(eb))
+			continue;
+		free_extent_buffer_final(eb);
+		stats_eb_evict();
+	}
+}
+
+static void trim_extent_buffer_cache(struct btrfs_fs_info *fs_info)
+{
+	const u64 target = (fs_info->max_cache_size * 9) / 10;
+	const u64 hot_limit = (fs_info->max_cache_size * 3) / 4;
+
+	evict_extent_buffers(fs_info, &fs_info->lru_hot,
+			     &fs_info->hot_cache_size, hot_limit, true);
+	evict_extent_buffers(fs_info, &fs_info->lru, &fs_info->cache_size,
+			     target, false);
+	evict_extent_buffers(fs_info, &fs_info->lru_hot, &fs_info->cache_size,
+			     target, true);
+	evict_extent_buffers(fs_info, &fs_info->lru_hot, &fs_info->cache_size,
+			     target, false);
+}
+
+/*
+ * Shrink the budget of the cache by half while some tasks stall on memory for
+ * EB_CACHE_PRESSURE_HIGH of the time or the memory is about to run out, down
+ * to 1/16 of the initial one. Grow it back by a quarter when the cache is full
+ * and there's no pressure and twice the increase is available.
+ *
+ * The pressure is checked every EB_CACHE_ADAPT_ALLOCS buffers allocated, at
+ * most once in EB_CACHE_ADAPT_INTERVAL_NS.
+ */
+#define EB_CACHE_ADAPT_ALLOCS		(4096)
+#define EB_CACHE_ADAPT_INTERVAL_NS	(1000000000ULL)
+/* The share of the time stalled, in hundredths of a percent */
+#define EB_CACHE_PRESSURE_HIGH		(1000)
+#define EB_CACHE_PRESSURE_LOW		(100)
+
+static void adapt_extent_buffer_cache(struct btrfs_fs_info *fs_info)
+{
+	const u64 limit = fs_info->cache_size_limit;
+	const u64 step = fs_info->max_cache_size / 4;
+	const u64 now = stats_now_ns();
+	u64 available;
+	int pressure;
+
+	if (now < fs_info->cache_adapt_ns)
+		return;
+	fs_info->cache_adapt_ns = now + EB_CACHE_ADAPT_INTERVAL_NS;
+
+	pressure = memory_pressure();
+	available = available_memory();
+	if (pressure >= EB_CACHE_PRESSURE_HIGH || available < limit / 16) {
+		fs_info->max_cache_size = max(fs_info->max_cache_size / 2,
+					      limit / 16);
+		if (fs_info->cache_size >= fs_info->max_cache_size)
+			trim_extent_buffer_cache(fs_info);
+		return;
 	}
+	if (pressure <= EB_CACHE_PRESSURE_LOW &&
+	    fs_info->max_cache_size < limit &&
+	    fs_info->cache_size >= (fs_info->max_cache_size * 3) / 4 &&
+	    available / 2 >= step)
+		fs_info->max_cache_size = min(fs_info->max_cache_size + step,
+					      limit);
 }
 
 struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
@@ -262,30 +611,45 @@ struct extent_buffer *alloc_extent_buffer(struct btrfs_fs_info *fs_info,
 	struct extent_buffer *eb;
 	struct cache_extent *cache;
 
-	cache = lookup_cache_extent(&fs_info->extent_cache, bytenr, blocksize);
-	if (cache && cache->start == bytenr &&
-	    cache->size == blocksize) {
-		eb = container_of(cache, struct extent_buffer, cache_node);
-		list_move_tail(&eb->lru, &fs_info->lru);
+	eb = eb_hash_lookup(&fs_info->eb_hash, bytenr);
+	if (eb && eb->len == blocksize) {
+		extent_buffer_cache_hit(eb);
 		eb->refs++;
 	} else {
 		int ret;
 
+		/* Slow path, drop any cached buffer overlapping the new one */
+		cache = lookup_cache_extent(&fs_info->extent_cache, bytenr,
+					    blocksize);
 		if (cache) {
 			eb = container_of(cache, struct extent_buffer,
 					  cache_node);
 			free_extent_buffer(eb);
 		}
-		eb = __alloc_extent_buffer(fs_info, bytenr, blocksize);
+		eb = __alloc_extent_buffer(fs_info, bytenr, blocksize, true);
 		if (!eb)
 			return NULL;
 		ret = insert_cache_extent(&fs_info->extent_cache, &eb->cache_node);
 		if (ret) {
-			kfree(eb);
+			eb->refs = 0;
+			eb->flags |= EXTENT_BUFFER_DUMMY;
+			free_extent_buffer_final(eb);
+			return NULL;
+		}
+		ret = eb_hash_insert(&fs_info->eb_hash, eb);
+		if (ret) {
+			remove_cache_extent(&fs_info->extent_cache,
+					    &eb->cache_node);
+			eb->refs = 0;
+			eb->flags |= EXTENT_BUFFER_DUMMY;
+			free_extent_buffer_final(eb);
 			return NULL;
 		}
 		list_add_tail(&eb->lru, &fs_info->lru);
 		fs_info->cache_size += blocksize;
+		if (fs_info->cache_size_limit &&
+		    ++fs_info->cache_allocs % EB_CACHE_ADAPT_ALLOCS == 0)
+			adapt_extent_buffer_cache(fs_info);
 		if (fs_info->cache_size >= fs_info->max_cache_size)
 			trim_extent_buffer_cache(fs_info);
 	}
@@ -308,7 +672,7 @@ struct extent_buffer *alloc_dummy_extent_buffer(struct btrfs_fs_info *fs_info,
 {
 	struct extent_buffer *ret;
 
-	ret = __alloc_extent_buffer(fs_info, bytenr, blocksize);
+	ret = __alloc_extent_buffer(fs_info, bytenr, blocksize, false);
 	if (!ret)
 		return NULL;
 
@@ -317,67 +681,241 @@ struct extent_buffer *alloc_dummy_extent_buffer(struct btrfs_fs_info *fs_info,
 	return ret;
 }
 
-static int read_raid56(struct btrfs_fs_info *fs_info, void *buf, u64 logical,
-		       u64 len, int mirror, struct btrfs_multi_bio *multi,
-		       u64 *raid_map)
+/*
+ * Full stripes read for RAID56 recovery are kept for a while.  Tree blocks
+ * are smaller than a stripe, so reading the blocks next to a damaged one, or
+ * on a missing device, would read the same full stripe again and again.
+ */
+#define RAID56_CACHE_ENTRIES	(4)
+/* Threads reading the stripes of a full stripe at once */
+#define RAID56_READ_THREADS	(8)
+
+struct raid56_cache_entry {
+	/* Logical start of the full stripe, 0 if the entry is unused */
+	u64 start;
+	u64 type;
+	int num_stripes;
+	u64 last_used;
+	/* Stripes as read from the devices */
+	void **raw;
+	/* The stripes that could not be read */
+	unsigned long *read_failed;
+	/* Each data stripe rebuilt from the others, NULL if not done yet */
+	void **rebuilt;
+};
+
+struct raid56_stripe_read {
+	struct btrfs_bio_stripe *stripe;
+	void *buf;
+	bool zoned;
+	bool failed;
+};
+
+struct raid56_read_cache {
+	/* Reads can come from several threads, e.g. check --check-data-csum */
+	pthread_mutex_t lock;
+	struct thread_pool pool;
+	bool pool_started;
+	u64 clock;
+	struct raid56_cache_entry entries[RAID56_CACHE_ENTRIES];
+};
+
+static void raid56_entry_release(struct raid56_cache_entry *entry)
 {
-	const int tolerance = (multi->type & BTRFS_RAID_RAID6 ? 2 : 1);
-	const int num_stripes = multi->num_stripes;
-	const u64 full_stripe_start = raid_map[0];
-	void **pointers = NULL;
-	unsigned long *failed_stripe_bitmap = NULL;
-	int failed_a = -1;
-	int failed_b = -1;
-	int i;
+	for (int i = 0; i < entry->num_stripes; i++) {
+		if (entry->raw)
+			free(entry->raw[i]);
+		if (entry->rebuilt)
+			free(entry->rebuilt[i]);
+	}
+	free(entry->raw);
+	free(entry->rebuilt);
+	bitmap_free(entry->read_failed);
+	memset(entry, 0, sizeof(*entry));
+}
+
+static int raid56_entry_alloc(struct raid56_cache_entry *entry, int num_stripes)
+{
+	entry->num_stripes = num_stripes;
+	entry->raw = calloc(num_stripes, sizeof(void *));
+	entry->rebuilt = calloc(num_stripes, sizeof(void *));
+	entry->read_failed = bitmap_zalloc(num_stripes);
+	if (!entry->raw || !entry->rebuilt || !entry->read_failed)
+		goto fail;
+	for (int i = 0; i < num_stripes; i++) {
+		entry->raw[i] = malloc(BTRFS_STRIPE_LEN);
+		if (!entry->raw[i])
+			goto fail;
+	}
+	return 0;
+fail:
+	raid56_entry_release(entry);
+	return -ENOMEM;
+}
+
+static void raid56_read_stripe(void *arg, void *job, void *thread_data)
+{
+	struct raid56_stripe_read *read = job;
+	struct btrfs_device *device = read->stripe->dev;
+	u64 start;
 	int ret;
 
-	/* Only read repair should go this path */
-	ASSERT(mirror > 1);
-	ASSERT(raid_map);
+	start = btrfs_device_read_start(device);
+	ret = btrfs_pread(device->fd, read->buf, BTRFS_STRIPE_LEN,
+			  read->stripe->physical, read->zoned);
+	btrfs_device_read_end(device, start);
+	if (ret > 0)
+		btrfs_device_account_read(device, ret);
+	read->failed = (ret < BTRFS_STRIPE_LEN);
+}
 
-	/* The read length should be inside one stripe */
-	ASSERT(len <= BTRFS_STRIPE_LEN);
+static const struct thread_pool_ops raid56_read_ops = {
+	.process = raid56_read_stripe,
+};
 
-	pointers = calloc(num_stripes, sizeof(void *));
-	if (!pointers)
+static struct raid56_read_cache *raid56_read_cache(struct btrfs_fs_info *fs_info)
+{
+	struct raid56_read_cache *cache;
+	static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+	cache = __atomic_load_n(&fs_info->raid56_cache, __ATOMIC_ACQUIRE);
+	if (cache)
+		return cache;
+	pthread_mutex_lock(&alloc_lock);
+	cache = fs_info->raid56_cache;
+	if (!cache) {
+		cache = calloc(1, sizeof(*cache));
+		if (cache) {
+			pthread_mutex_init(&cache->lock, NULL);
+			__atomic_store_n(&fs_info->raid56_cache, cache,
+					 __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&alloc_lock);
+	return cache;
+}
+
+/* Read all stripes of the full stripe into @entry at once */
+static int raid56_read_full_stripe(struct btrfs_fs_info *fs_info,
+				   struct raid56_read_cache *cache,
+				   struct raid56_cache_entry *entry,
+				   struct btrfs_multi_bio *multi)
+{
+	struct raid56_stripe_read *reads;
+	int i;
+
+	reads = calloc(entry->num_stripes, sizeof(*reads));
+	if (!reads)
 		return -ENOMEM;
+	if (!cache->pool_started) {
+		int ret;
 
-	/* Allocate memory for the full stripe */
-	for (i = 0; i < num_stripes; i++) {
-		pointers[i] = kmalloc(BTRFS_STRIPE_LEN, GFP_KERNEL);
-		if (!pointers[i]) {
-			ret = -ENOMEM;
+		ret = thread_pool_init(&cache->pool, &raid56_read_ops, NULL,
+				       RAID56_READ_THREADS,
+				       2 * RAID56_READ_THREADS);
+		if (ret < 0) {
+			free(reads);
+			return ret;
+		}
+		cache->pool_started = true;
+	}
+
+	/*
+	 * The stripes in @multi are not rotated, thus can be used to read from
+	 * disk directly.
+	 */
+	for (i = 0; i < entry->num_stripes; i++) {
+		reads[i].stripe = &multi->stripes[i];
+		reads[i].buf = entry->raw[i];
+		reads[i].zoned = fs_info->zoned;
+		if (thread_pool_full(&cache->pool))
+			thread_pool_pop(&cache->pool);
+		thread_pool_push(&cache->pool, &reads[i]);
+	}
+	while (thread_pool_pop(&cache->pool))
+		;
+	for (i = 0; i < entry->num_stripes; i++)
+		if (reads[i].failed)
+			set_bit(i, entry->read_failed);
+	free(reads);
+	return 0;
+}
+
+/* Find the cached full stripe or read it into the least recently used entry */
+static struct raid56_cache_entry *raid56_get_entry(struct btrfs_fs_info *fs_info,
+						   struct raid56_read_cache *cache,
+						   struct btrfs_multi_bio *multi,
+						   u64 full_stripe_start, int *ret)
+{
+	struct raid56_cache_entry *entry = NULL;
+
+	*ret = 0;
+	for (int i = 0; i < RAID56_CACHE_ENTRIES; i++) {
+		struct raid56_cache_entry *cur = &cache->entries[i];
+
+		if (cur->start == full_stripe_start &&
+		    cur->num_stripes == multi->num_stripes &&
+		    cur->type == multi->type) {
+			entry = cur;
 			goto out;
 		}
+		if (!entry || cur->last_used < entry->last_used)
+			entry = cur;
+	}
+
+	raid56_entry_release(entry);
+	*ret = raid56_entry_alloc(entry, multi->num_stripes);
+	if (*ret < 0)
+		return NULL;
+	*ret = raid56_read_full_stripe(fs_info, cache, entry, multi);
+	if (*ret < 0) {
+		raid56_entry_release(entry);
+		return NULL;
 	}
+	entry->start = full_stripe_start;
+	entry->type = multi->type;
+out:
+	entry->last_used = ++cache->clock;
+	return entry;
+}
 
+/*
+ * Rebuild data stripe @target of the full stripe in @entry, treating it as
+ * corrupted, from a copy of the stripes as read.
+ */
+static int raid56_rebuild(struct raid56_cache_entry *entry, int target)
+{
+	const int tolerance = (entry->type & BTRFS_RAID_RAID6 ? 2 : 1);
+	const int num_stripes = entry->num_stripes;
+	unsigned long *failed_stripe_bitmap;
+	void **pointers;
+	int failed_a = -1;
+	int failed_b = -1;
+	int i;
+	int ret;
+
+	pointers = calloc(num_stripes, sizeof(void *));
 	failed_stripe_bitmap = bitmap_zalloc(num_stripes);
-	if (!failed_stripe_bitmap) {
+	if (!pointers || !failed_stripe_bitmap) {
 		ret = -ENOMEM;
 		goto out;
 	}
-
-	/*
-	 * Read the full stripe.
-	 *
-	 * The stripes in @multi is not rotated, thus can be used to read from
-	 * disk directly.
-	 */
 	for (i = 0; i < num_stripes; i++) {
-		ret = btrfs_pread(multi->stripes[i].dev->fd, pointers[i],
-				  BTRFS_STRIPE_LEN, multi->stripes[i].physical,
-				  fs_info->zoned);
-		if (ret < BTRFS_STRIPE_LEN)
+		pointers[i] = malloc(BTRFS_STRIPE_LEN);
+		if (!pointers[i]) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		memcpy(pointers[i], entry->raw[i], BTRFS_STRIPE_LEN);
+		if (test_bit(i, entry->read_failed))
 			set_bit(i, failed_stripe_bitmap);
 	}
 
 	/*
-	 * Get the failed index.
-	 *
 	 * Since we're reading using mirror_num > 1 already, it means the data
 	 * stripe where @logical lies in is definitely corrupted.
 	 */
-	set_bit((logical - full_stripe_start) / BTRFS_STRIPE_LEN, failed_stripe_bitmap);
+	set_bit(target, failed_stripe_bitmap);
 
 	/*
 	 * For RAID6, we don't have good way to exhaust all the combinations,
@@ -386,7 +924,7 @@ static int read_raid56(struct btrfs_fs_info *fs_info, void *buf, u64 logical,
 	 * If we only have one failed stripe (marked by above set_bit()), then
 	 * we have no better idea, fallback to use P corruption.
 	 */
-	if (multi->type & BTRFS_BLOCK_GROUP_RAID6 &&
+	if (entry->type & BTRFS_BLOCK_GROUP_RAID6 &&
 	    bitmap_weight(failed_stripe_bitmap, num_stripes) < 2)
 		set_bit(num_stripes - 2, failed_stripe_bitmap);
 
@@ -404,33 +942,103 @@ static int read_raid56(struct btrfs_fs_info *fs_info, void *buf, u64 logical,
 	}
 
 	/* Rebuild the full stripe */
-	ret = raid56_recov(num_stripes, BTRFS_STRIPE_LEN, multi->type,
+	ret = raid56_recov(num_stripes, BTRFS_STRIPE_LEN, entry->type,
 			   failed_a, failed_b, pointers);
 	ASSERT(ret == 0);
 
+	/* Keep the rebuilt stripe, the others are freed */
+	entry->rebuilt[target] = pointers[target];
+	pointers[target] = NULL;
+	ret = 0;
+out:
+	bitmap_free(failed_stripe_bitmap);
+	if (pointers)
+		for (i = 0; i < num_stripes; i++)
+			free(pointers[i]);
+	free(pointers);
+	return ret;
+}
+
+static int read_raid56(struct btrfs_fs_info *fs_info, void *buf, u64 logical,
+		       u64 len, int mirror, struct btrfs_multi_bio *multi,
+		       u64 *raid_map)
+{
+	const u64 full_stripe_start = raid_map[0];
+	const int target = (logical - full_stripe_start) / BTRFS_STRIPE_LEN;
+	struct raid56_read_cache *cache;
+	struct raid56_cache_entry *entry;
+	int ret;
+
+	/* Only read repair should go this path */
+	ASSERT(mirror > 1);
+	ASSERT(raid_map);
+
+	/* The read length should be inside one stripe */
+	ASSERT(len <= BTRFS_STRIPE_LEN);
+
+	cache = raid56_read_cache(fs_info);
+	if (!cache)
+		return -ENOMEM;
+	pthread_mutex_lock(&cache->lock);
+	entry = raid56_get_entry(fs_info, cache, multi, full_stripe_start, &ret);
+	if (!entry)
+		goto out;
+	if (!entry->rebuilt[target]) {
+		ret = raid56_rebuild(entry, target);
+		if (ret < 0)
+			goto out;
+	}
+
 	/* Now copy the data back to original buf */
-	memcpy(buf, pointers[failed_a] + (logical - full_stripe_start) %
+	memcpy(buf, entry->rebuilt[target] + (logical - full_stripe_start) %
 			BTRFS_STRIPE_LEN, len);
 	ret = 0;
 out:
-	kfree(failed_stripe_bitmap);
-	for (i = 0; i < num_stripes; i++)
-		kfree(pointers[i]);
-	kfree(pointers);
+	pthread_mutex_unlock(&cache->lock);
 	return ret;
 }
 
+/* Forget the full stripe at @full_stripe_start, it's being written */
+void raid56_read_cache_drop(struct btrfs_fs_info *fs_info, u64 full_stripe_start)
+{
+	struct raid56_read_cache *cache;
+
+	cache = __atomic_load_n(&fs_info->raid56_cache, __ATOMIC_ACQUIRE);
+	if (!cache)
+		return;
+	pthread_mutex_lock(&cache->lock);
+	for (int i = 0; i < RAID56_CACHE_ENTRIES; i++)
+		if (cache->entries[i].start == full_stripe_start)
+			raid56_entry_release(&cache->entries[i]);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void raid56_read_cache_free(struct btrfs_fs_info *fs_info)
+{
+	struct raid56_read_cache *cache = fs_info->raid56_cache;
+
+	if (!cache)
+		return;
+	thread_pool_release(&cache->pool);
+	for (int i = 0; i < RAID56_CACHE_ENTRIES; i++)
+		raid56_entry_release(&cache->entries[i]);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+	fs_info->raid56_cache = NULL;
+}
+
 int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 logical,
 			u64 *len, int mirror)
 {
-	struct btrfs_multi_bio *multi = NULL;
+	struct btrfs_bio_stripe stripe;
 	struct btrfs_device *device;
 	u64 read_len = *len;
-	u64 *raid_map = NULL;
+	u64 type;
+	u64 start;
 	int ret;
 
-	ret = btrfs_map_block(info, READ, logical, &read_len, &multi, mirror,
-			      &raid_map);
+	ret = btrfs_map_block_stripe(info, logical, &read_len, &type, mirror,
+				     &stripe);
 	if (ret) {
 		fprintf(stderr, "Couldn't map the block %llu\n", logical);
 		return -EIO;
@@ -438,7 +1046,17 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 logical,
 	read_len = min(*len, read_len);
 
 	/* We need to rebuild from P/Q */
-	if (mirror > 1 && multi->type & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+	if (mirror > 1 && type & BTRFS_BLOCK_GROUP_RAID56_MASK) {
+		struct btrfs_multi_bio *multi = NULL;
+		u64 *raid_map = NULL;
+
+		ret = btrfs_map_block(info, READ, logical, &read_len, &multi,
+				      mirror, &raid_map);
+		if (ret) {
+			fprintf(stderr, "Couldn't map the block %llu\n", logical);
+			return -EIO;
+		}
+		read_len = min(*len, read_len);
 		ret = read_raid56(info, buf, logical, read_len, mirror, multi,
 				  raid_map);
 		kfree(multi);
@@ -446,17 +1064,17 @@ int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 logical,
 		*len = read_len;
 		return ret;
 	}
-	kfree(raid_map);
-	device = multi->stripes[0].dev;
+	device = stripe.dev;
 
-	if (device->fd <= 0) {
-		kfree(multi);
+	if (device->fd <= 0)
 		return -EIO;
-	}
 
-	ret = btrfs_pread(device->fd, buf, read_len,
-			  multi->stripes[0].physical, info->zoned);
-	kfree(multi);
+	start = btrfs_device_read_start(device);
+	ret = btrfs_pread(device->fd, buf, read_len, stripe.physical,
+			  info->zoned);
+	btrfs_device_read_end(device, start);
+	if (ret > 0)
+		btrfs_device_account_read(device, ret);
 	if (ret < 0) {
 		fprintf(stderr, "Error reading %llu, %d\n", logical,
 			ret);
@@ -511,14 +1129,13 @@ int write_data_to_disk(struct btrfs_fs_info *info, const void *buf, u64 offset,
 			this_len = min(this_len, bytes_left);
 			this_len = min(this_len, (u64)info->nodesize);
 
-			eb = kmalloc(sizeof(struct extent_buffer) + this_len, GFP_KERNEL);
+			eb = alloc_extent_buffer_inline(this_len);
 			if (!eb) {
 				error_msg(ERROR_MSG_MEMORY, "extent buffer");
 				ret = -ENOMEM;
 				goto out;
 			}
 
-			memset(eb, 0, sizeof(struct extent_buffer) + this_len);
 			eb->start = offset;
 			eb->len = this_len;
 
@@ -577,11 +1194,14 @@ out:
 
 int set_extent_buffer_dirty(struct extent_buffer *eb)
 {
-	struct extent_io_tree *tree = &eb->fs_info->dirty_buffers;
+	struct extent_bitmap *dirty = &eb->fs_info->dirty_buffers;
+	int ret;
+
 	if (!(eb->flags & EXTENT_BUFFER_DIRTY)) {
+		ret = extent_bitmap_set(dirty, eb->start, eb->len);
+		if (ret < 0)
+			return ret;
 		eb->flags |= EXTENT_BUFFER_DIRTY;
-		set_extent_dirty(tree, eb->start, eb->start + eb->len - 1,
-				 GFP_NOFS);
 		extent_buffer_get(eb);
 	}
 	return 0;
@@ -590,11 +1210,11 @@ int set_extent_buffer_dirty(struct extent_buffer *eb)
 int btrfs_clear_buffer_dirty(struct btrfs_trans_handle *trans,
 			     struct extent_buffer *eb)
 {
-	struct extent_io_tree *tree = &eb->fs_info->dirty_buffers;
+	struct extent_bitmap *dirty = &eb->fs_info->dirty_buffers;
+
 	if (eb->flags & EXTENT_BUFFER_DIRTY) {
 		eb->flags &= ~EXTENT_BUFFER_DIRTY;
-		clear_extent_dirty(tree, eb->start, eb->start + eb->len - 1,
-				   NULL);
+		extent_bitmap_clear(dirty, eb->start, eb->len);
 		free_extent_buffer(eb);
 	}
 	return 0;
@@ -23,11 +23,18 @@
 #include "kernel-lib/bitops.h"
 #include "kernel-lib/list.h"
 #include "common/extent-cache.h"
+#include "common/slab.h"
 
 #define EXTENT_BUFFER_UPTODATE		(1U << 0)
 #define EXTENT_BUFFER_DIRTY		(1U << 1)
 #define EXTENT_BUFFER_BAD_TRANSID	(1U << 2)
 #define EXTENT_BUFFER_DUMMY		(1U << 3)
+/* On the hot list of the extent buffer cache */
+#define EXTENT_BUFFER_HOT		(1U << 4)
+/* Header and data allocated from the fs_info slabs */
+#define EXTENT_BUFFER_SLAB		(1U << 5)
+/* Data references a device mapping, see OPEN_CTREE_MMAP */
+#define EXTENT_BUFFER_MMAP		(1U << 6)
 
 #define BLOCK_GROUP_DATA	(1U << 1)
 #define BLOCK_GROUP_METADATA	(1U << 2)
@@ -64,7 +71,33 @@ struct extent_buffer {
 	int refs;
 	u32 flags;
 	struct btrfs_fs_info *fs_info;
-	char data[] __attribute__((aligned(8)));
+	/*
+	 * Points right after the structure for standalone buffers, or to a
+	 * separately allocated block for buffers from the slab.
+	 */
+	char *data;
+};
+
+/*
+ * Allocate a standalone extent buffer with @size bytes of data following the
+ * structure.
+ */
+static inline struct extent_buffer *alloc_extent_buffer_inline(u32 size)
+{
+	struct extent_buffer *eb;
+
+	eb = calloc(1, sizeof(struct extent_buffer) + size);
+	if (!eb)
+		return NULL;
+	eb->data = (char *)(eb + 1);
+	return eb;
+}
+
+/* Hash table of cached extent buffers indexed by start, see extent_io.c */
+struct extent_buffer_hash {
+	struct extent_buffer **slots;
+	unsigned int bits;
+	u64 nr_entries;
 };
 
 static inline void extent_buffer_get(struct extent_buffer *eb)
@@ -133,6 +166,8 @@ int extent_buffer_test_bit(const struct extent_buffer *eb, unsigned long start,
 int set_extent_buffer_dirty(struct extent_buffer *eb);
 int btrfs_clear_buffer_dirty(struct btrfs_trans_handle *trans,
 			     struct extent_buffer *eb);
+void raid56_read_cache_drop(struct btrfs_fs_info *fs_info, u64 full_stripe_start);
+void raid56_read_cache_free(struct btrfs_fs_info *fs_info);
 int read_data_from_disk(struct btrfs_fs_info *info, void *buf, u64 logical,
 			u64 *len, int mirror);
 int write_data_to_disk(struct btrfs_fs_info *info, const void *buf, u64 offset,
@@ -143,6 +178,9 @@ void extent_buffer_bitmap_set(struct extent_buffer *eb, unsigned long start,
                               unsigned long pos, unsigned long len);
 void extent_buffer_init_cache(struct btrfs_fs_info *fs_info);
 void extent_buffer_free_cache(struct btrfs_fs_info *fs_info);
+void extent_buffer_mark_hot(struct extent_buffer *eb);
+bool extent_buffer_map_data(struct extent_buffer *eb, char *addr);
+int extent_buffer_unmap_data(struct extent_buffer *eb);
 void btrfs_readahead_node_child(struct extent_buffer *node, int slot);
 
 #endif
@@ -26,9 +26,6 @@
 #include "kernel-shared/extent_io.h"
 #include "common/internal.h"
 
-#define MAX_CSUM_ITEMS(r, size) ((((BTRFS_LEAF_DATA_SIZE(r->fs_info) - \
-			       sizeof(struct btrfs_item) * 2) / \
-			       size) - 1))
 int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 			     struct btrfs_root *root,
 			     u64 ino, u64 file_pos,
@@ -165,8 +162,8 @@ fail:
 	return ERR_PTR(ret);
 }
 
-int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
-			  u64 csum_objectid, u32 csum_type, const char *data)
+static int csum_one_sector(struct btrfs_trans_handle *trans, u64 logical,
+			   u64 csum_objectid, u32 csum_type, const u8 *csum)
 {
 	struct btrfs_root *root = btrfs_csum_root(trans->fs_info, logical);
 	int ret = 0;
@@ -178,7 +175,6 @@ int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
 	struct btrfs_csum_item *item;
 	struct extent_buffer *leaf = NULL;
 	u64 csum_offset;
-	u8 csum_result[BTRFS_CSUM_SIZE];
 	u32 sectorsize = root->fs_info->sectorsize;
 	u32 nritems;
 	u32 ins_size;
@@ -298,15 +294,232 @@ csum:
 	item = (struct btrfs_csum_item *)((unsigned char *)item +
 					  csum_offset * csum_size);
 found:
-	btrfs_csum_data(csum_type, (u8 *)data, csum_result, sectorsize);
-	write_extent_buffer(leaf, csum_result, (unsigned long)item,
-			    csum_size);
+	write_extent_buffer(leaf, csum, (unsigned long)item, csum_size);
 	btrfs_mark_buffer_dirty(path->nodes[0]);
 fail:
 	btrfs_free_path(path);
 	return ret;
 }
 
+int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
+			  u64 csum_objectid, u32 csum_type, const char *data)
+{
+	u8 csum[BTRFS_CSUM_SIZE];
+
+	btrfs_csum_data(csum_type, (const u8 *)data, csum,
+			trans->fs_info->sectorsize);
+	return csum_one_sector(trans, logical, csum_objectid, csum_type, csum);
+}
+
+/*
+ * Find how the csum item that would be inserted at @logical relates to the
+ * existing ones.
+ *
+ * Return 1 if an existing item already covers @logical, 0 otherwise with
+ * @prev_nr set to the number of csums of an item ending exactly at @logical
+ * (or 0) and @next_offset set to the start of the next item (or -1).
+ */
+static int find_csum_neighbors(struct btrfs_root *root, u64 logical,
+			       u64 csum_objectid, u16 csum_size,
+			       u32 *prev_nr, u64 *next_offset)
+{
+	const u32 sectorsize = root->fs_info->sectorsize;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	*prev_nr = 0;
+	*next_offset = (u64)-1;
+
+	key.objectid = csum_objectid;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = logical;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	/* Exact match, or an item before covering @logical */
+	if (ret == 0) {
+		ret = 1;
+		goto out;
+	}
+	if (path.slots[0] > 0) {
+		struct extent_buffer *leaf = path.nodes[0];
+		u32 nr;
+
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0] - 1);
+		nr = btrfs_item_size(leaf, path.slots[0] - 1) / csum_size;
+		if (key.objectid == csum_objectid &&
+		    key.type == BTRFS_EXTENT_CSUM_KEY) {
+			u64 end = key.offset + (u64)nr * sectorsize;
+
+			if (end > logical)
+				goto out;
+			if (end == logical)
+				*prev_nr = nr;
+		}
+	}
+	if (path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+		ret = btrfs_next_leaf(root, &path);
+		if (ret < 0)
+			goto out;
+		if (ret > 0) {
+			ret = 0;
+			goto out;
+		}
+	}
+	btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+	if (key.objectid == csum_objectid && key.type == BTRFS_EXTENT_CSUM_KEY)
+		*next_offset = key.offset;
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/*
+ * Extend the csum item ending at @logical with @nr csums.
+ *
+ * Return 1 if the item could not be found after making room for it.
+ */
+static int extend_csum_item(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root, u64 logical,
+			    u64 csum_objectid, u16 csum_size, const u8 *csums,
+			    u32 nr)
+{
+	struct btrfs_path path = { 0 };
+	struct extent_buffer *leaf;
+	struct btrfs_key key;
+	u32 item_size;
+	int ret;
+
+	key.objectid = csum_objectid;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = logical;
+	path.search_for_extension = 1;
+	ret = btrfs_search_slot(trans, root, &key, &path, nr * csum_size, 1);
+	path.search_for_extension = 0;
+	if (ret < 0)
+		goto out;
+	ret = 1;
+	if (path.slots[0] == 0)
+		goto out;
+	path.slots[0]--;
+	leaf = path.nodes[0];
+	btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+	item_size = btrfs_item_size(leaf, path.slots[0]);
+	if (key.objectid != csum_objectid || key.type != BTRFS_EXTENT_CSUM_KEY ||
+	    key.offset + item_size / csum_size * root->fs_info->sectorsize != logical)
+		goto out;
+
+	btrfs_extend_item(&path, nr * csum_size);
+	write_extent_buffer(leaf, csums,
+			    btrfs_item_ptr_offset(leaf, path.slots[0]) + item_size,
+			    nr * csum_size);
+	btrfs_mark_buffer_dirty(leaf);
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/*
+ * Insert the csums of the sector aligned range [@logical, @logical + @len),
+ * @csums being the array of csums of each sector.
+ *
+ * Unlike calling btrfs_csum_file_block() for each sector, this needs one tree
+ * search per csum item, which is extended or inserted with as many csums as
+ * fit.  Sectors that already have a csum are overwritten one by one.
+ */
+int btrfs_insert_data_csums(struct btrfs_trans_handle *trans, u64 logical,
+			    u64 len, u64 csum_objectid, u32 csum_type,
+			    const u8 *csums)
+{
+	struct btrfs_root *root = btrfs_csum_root(trans->fs_info, logical);
+	const u32 sectorsize = trans->fs_info->sectorsize;
+	const u16 csum_size = btrfs_csum_type_size(csum_type);
+	const u32 max_nr = MAX_CSUM_ITEMS(root, csum_size);
+	u64 nr_left = len / sectorsize;
+	int ret = 0;
+
+	while (nr_left) {
+		struct btrfs_path path = { 0 };
+		struct btrfs_key key;
+		u64 next_offset;
+		u32 prev_nr;
+		u32 nr;
+
+		ret = find_csum_neighbors(root, logical, csum_objectid,
+					  csum_size, &prev_nr, &next_offset);
+		if (ret < 0)
+			break;
+		if (ret > 0) {
+			ret = csum_one_sector(trans, logical, csum_objectid,
+					      csum_type, csums);
+			if (ret < 0)
+				break;
+			nr = 1;
+			goto next;
+		}
+
+		nr = min_t(u64, nr_left,
+			   max_t(u64, 1, (next_offset - logical) / sectorsize));
+		if (prev_nr && prev_nr < max_nr) {
+			nr = min(nr, max_nr - prev_nr);
+			ret = extend_csum_item(trans, root, logical,
+					       csum_objectid, csum_size, csums,
+					       nr);
+			if (ret < 0)
+				break;
+			if (ret == 0)
+				goto next;
+		}
+
+		nr = min(nr, max_nr);
+		key.objectid = csum_objectid;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = logical;
+		ret = btrfs_insert_empty_item(trans, root, &path, &key,
+					      nr * csum_size);
+		if (ret < 0)
+			break;
+		write_extent_buffer(path.nodes[0], csums,
+				    btrfs_item_ptr_offset(path.nodes[0],
+							  path.slots[0]),
+				    nr * csum_size);
+		btrfs_mark_buffer_dirty(path.nodes[0]);
+		btrfs_release_path(&path);
+next:
+		logical += (u64)nr * sectorsize;
+		csums += nr * csum_size;
+		nr_left -= nr;
+	}
+	return ret;
+}
+
+/*
+ * Calculate and insert the csums of the sector aligned range
+ * [@logical, @logical + @len) whose content is @data.
+ */
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans, u64 logical,
+			  u64 len, u64 csum_objectid, u32 csum_type,
+			  const char *data)
+{
+	const u32 sectorsize = trans->fs_info->sectorsize;
+	const u16 csum_size = btrfs_csum_type_size(csum_type);
+	const u64 nr = len / sectorsize;
+	u8 *csums;
+	int ret;
+
+	csums = malloc(nr * csum_size);
+	if (!csums)
+		return -ENOMEM;
+	btrfs_csum_data_batch(csum_type, (const u8 *)data, csums, sectorsize, nr);
+	ret = btrfs_insert_data_csums(trans, logical, len, csum_objectid,
+				      csum_type, csums);
+	free(csums);
+	return ret;
+}
+
 /*
  * helper function for csum removal, this expects the
  * key to describe the csum pointed to by the path, and it expects
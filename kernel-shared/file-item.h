@@ -23,6 +23,11 @@ struct list_head;
 #define BTRFS_FILE_EXTENT_INLINE_DATA_START		\
 		(offsetof(struct btrfs_file_extent_item, disk_bytenr))
 
+/* Maximum number of checksums of @size bytes in one csum item */
+#define MAX_CSUM_ITEMS(r, size) ((((BTRFS_LEAF_DATA_SIZE(r->fs_info) - \
+			       sizeof(struct btrfs_item) * 2) / \
+			       size) - 1))
+
 static inline u32 BTRFS_MAX_INLINE_DATA_SIZE(const struct btrfs_fs_info *info)
 {
 	return BTRFS_MAX_ITEM_SIZE(info) - BTRFS_FILE_EXTENT_INLINE_DATA_START;
@@ -89,6 +94,12 @@ int btrfs_insert_file_extent(struct btrfs_trans_handle *trans,
 			     struct btrfs_file_extent_item *stack_fi);
 int btrfs_csum_file_block(struct btrfs_trans_handle *trans, u64 logical,
 			  u64 csum_objectid, u32 csum_type, const char *data);
+int btrfs_insert_data_csums(struct btrfs_trans_handle *trans, u64 logical,
+			    u64 len, u64 csum_objectid, u32 csum_type,
+			    const u8 *csums);
+int btrfs_csum_file_range(struct btrfs_trans_handle *trans, u64 logical,
+			  u64 len, u64 csum_objectid, u32 csum_type,
+			  const char *data);
 struct btrfs_csum_item *
 btrfs_lookup_csum(struct btrfs_trans_handle *trans,
 		  struct btrfs_root *root,
@@ -19,6 +19,9 @@
 #include "kerncompat.h"
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "kernel-lib/bitops.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
@@ -1441,6 +1444,320 @@ out:
 	return ret;
 }
 
+/* Free space of one block group, for the bulk population of a new tree */
+struct bulk_free_space {
+	struct btrfs_block_group *bg;
+	/* Free ranges in ascending order, start and length */
+	u64 (*ranges)[2];
+	u32 nr_ranges;
+	u32 max_ranges;
+	/* The block group bitmap, built only if it's stored as bitmaps */
+	unsigned long *bitmap;
+};
+
+/* Upper limit of the threads building the bitmaps */
+#define BULK_FREE_SPACE_MAX_THREADS		(16)
+
+struct bulk_free_space_workers {
+	struct btrfs_fs_info *fs_info;
+	struct bulk_free_space *bgs;
+	u32 nr_bgs;
+	/* Next block group to build */
+	u32 next;
+	int ret;
+};
+
+static int bulk_add_free_range(struct bulk_free_space *fs, u64 start, u64 end)
+{
+	if (start >= end)
+		return 0;
+	if (fs->nr_ranges == fs->max_ranges) {
+		u32 max_ranges = max(64U, fs->max_ranges * 2);
+		u64 (*ranges)[2];
+
+		ranges = realloc(fs->ranges, max_ranges * sizeof(*ranges));
+		if (!ranges)
+			return -ENOMEM;
+		fs->ranges = ranges;
+		fs->max_ranges = max_ranges;
+	}
+	fs->ranges[fs->nr_ranges][0] = start;
+	fs->ranges[fs->nr_ranges][1] = end - start;
+	fs->nr_ranges++;
+	return 0;
+}
+
+/*
+ * Find the free space of all block groups in one pass over the extent tree,
+ * the gaps between the extent and metadata items of each block group.
+ */
+static int bulk_scan_extent_tree(struct btrfs_fs_info *fs_info,
+				 struct bulk_free_space *bgs, u32 nr_bgs)
+{
+	struct btrfs_root *extent_root = btrfs_extent_root(fs_info, 0);
+	struct btrfs_path *path;
+	struct btrfs_key key;
+	u64 cursor = bgs[0].bg->start;
+	u32 i = 0;
+	int ret;
+
+	path = btrfs_alloc_path();
+	if (!path)
+		return -ENOMEM;
+	path->reada = READA_FORWARD;
+
+	key.objectid = bgs[0].bg->start;
+	key.type = BTRFS_EXTENT_ITEM_KEY;
+	key.offset = 0;
+	ret = btrfs_search_slot_for_read(extent_root, &key, path, 1, 0);
+	if (ret < 0)
+		goto out;
+	if (ret > 0)
+		goto done;
+
+	while (1) {
+		struct btrfs_block_group *bg = bgs[i].bg;
+		u64 end;
+
+		btrfs_item_key_to_cpu(path->nodes[0], &key, path->slots[0]);
+		if (key.type != BTRFS_EXTENT_ITEM_KEY &&
+		    key.type != BTRFS_METADATA_ITEM_KEY)
+			goto next;
+
+		/* Close the block groups before the extent */
+		while (key.objectid >= bg->start + bg->length) {
+			ret = bulk_add_free_range(&bgs[i], cursor,
+						  bg->start + bg->length);
+			if (ret < 0)
+				goto out;
+			if (++i == nr_bgs)
+				goto done;
+			bg = bgs[i].bg;
+			cursor = bg->start;
+		}
+		if (key.objectid < bg->start)
+			goto next;
+
+		ret = bulk_add_free_range(&bgs[i], cursor, key.objectid);
+		if (ret < 0)
+			goto out;
+		if (key.type == BTRFS_METADATA_ITEM_KEY)
+			end = key.objectid + fs_info->nodesize;
+		else
+			end = key.objectid + key.offset;
+		cursor = max(cursor, end);
+next:
+		ret = btrfs_next_item(extent_root, path);
+		if (ret < 0)
+			goto out;
+		if (ret)
+			break;
+	}
+done:
+	/* The end of the last block group with extents and the empty ones */
+	for (; i < nr_bgs; i++) {
+		struct btrfs_block_group *bg = bgs[i].bg;
+
+		if (cursor < bg->start)
+			cursor = bg->start;
+		ret = bulk_add_free_range(&bgs[i], cursor, bg->start + bg->length);
+		if (ret < 0)
+			goto out;
+	}
+	ret = 0;
+out:
+	btrfs_free_path(path);
+	return ret;
+}
+
+static void *bulk_build_bitmaps(void *arg)
+{
+	struct bulk_free_space_workers *workers = arg;
+	const u32 sectorsize = workers->fs_info->sectorsize;
+
+	while (1) {
+		const u32 i = __atomic_fetch_add(&workers->next, 1, __ATOMIC_RELAXED);
+		struct bulk_free_space *fs;
+		u32 bitmap_size;
+
+		if (i >= workers->nr_bgs)
+			break;
+		fs = &workers->bgs[i];
+		if (fs->nr_ranges <= fs->bg->bitmap_high_thresh)
+			continue;
+
+		bitmap_size = free_space_bitmap_size(workers->fs_info, fs->bg->length);
+		fs->bitmap = alloc_bitmap(bitmap_size);
+		if (!fs->bitmap) {
+			workers->ret = -ENOMEM;
+			break;
+		}
+		for (u32 r = 0; r < fs->nr_ranges; r++) {
+			const u64 first = div_u64(fs->ranges[r][0] - fs->bg->start,
+						  sectorsize);
+			const u64 last = div_u64(fs->ranges[r][0] + fs->ranges[r][1] -
+						 fs->bg->start, sectorsize);
+
+			le_bitmap_set(fs->bitmap, first, last - first);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Build the bitmaps of the block groups with more free extents than the
+ * threshold for the bitmap format, spread over a pool of threads.
+ */
+static int bulk_build_all_bitmaps(struct btrfs_fs_info *fs_info,
+				  struct bulk_free_space *bgs, u32 nr_bgs)
+{
+	struct bulk_free_space_workers workers = {
+		.fs_info = fs_info,
+		.bgs = bgs,
+		.nr_bgs = nr_bgs,
+	};
+	pthread_t threads[BULK_FREE_SPACE_MAX_THREADS];
+	long nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	u32 nr_bitmaps = 0;
+	int started = 0;
+
+	for (u32 i = 0; i < nr_bgs; i++) {
+		if (bgs[i].nr_ranges > bgs[i].bg->bitmap_high_thresh)
+			nr_bitmaps++;
+	}
+	nr_threads = min_t(long, nr_threads, BULK_FREE_SPACE_MAX_THREADS);
+	nr_threads = min_t(long, nr_threads, nr_bitmaps);
+
+	for (int i = 1; i < nr_threads; i++) {
+		if (pthread_create(&threads[started], NULL, bulk_build_bitmaps,
+				   &workers))
+			break;
+		started++;
+	}
+	/* The caller takes part, and does all the work if no thread started */
+	bulk_build_bitmaps(&workers);
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+	return workers.ret;
+}
+
+static int bulk_load_block_group(struct btrfs_bulk_loader *loader,
+				 struct bulk_free_space *fs)
+{
+	struct btrfs_fs_info *fs_info = loader->trans->fs_info;
+	struct btrfs_block_group *bg = fs->bg;
+	struct btrfs_free_space_info info = { 0 };
+	struct btrfs_key key;
+	const u64 end = bg->start + bg->length;
+	int ret;
+
+	info.extent_count = cpu_to_le32(fs->nr_ranges);
+	if (fs->bitmap)
+		info.flags = cpu_to_le32(BTRFS_FREE_SPACE_USING_BITMAPS);
+	key.objectid = bg->start;
+	key.type = BTRFS_FREE_SPACE_INFO_KEY;
+	key.offset = bg->length;
+	ret = btrfs_bulk_loader_add(loader, &key, &info, sizeof(info));
+	if (ret < 0)
+		return ret;
+
+	if (fs->bitmap) {
+		const u64 bitmap_range = fs_info->sectorsize * BTRFS_FREE_SPACE_BITMAP_BITS;
+		char *bitmap_cursor = (char *)fs->bitmap;
+
+		for (u64 i = bg->start; i < end; ) {
+			const u64 extent_size = min(end - i, bitmap_range);
+			const u32 data_size = free_space_bitmap_size(fs_info, extent_size);
+
+			key.objectid = i;
+			key.type = BTRFS_FREE_SPACE_BITMAP_KEY;
+			key.offset = extent_size;
+			ret = btrfs_bulk_loader_add(loader, &key, bitmap_cursor,
+						    data_size);
+			if (ret < 0)
+				return ret;
+			i += extent_size;
+			bitmap_cursor += data_size;
+		}
+		return 0;
+	}
+
+	for (u32 r = 0; r < fs->nr_ranges; r++) {
+		key.objectid = fs->ranges[r][0];
+		key.type = BTRFS_FREE_SPACE_EXTENT_KEY;
+		key.offset = fs->ranges[r][1];
+		ret = btrfs_bulk_loader_add(loader, &key, NULL, 0);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Populate the new and empty free space tree for all block groups at once.
+ * Unlike populate_free_space_tree() for each block group, the extent tree is
+ * scanned once, the bitmaps are built in parallel and the items appended in
+ * key order, each in its final format.
+ */
+static int bulk_populate_free_space_tree(struct btrfs_trans_handle *trans,
+					 struct btrfs_root *free_space_root)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_bulk_loader loader = { 0 };
+	struct btrfs_block_group *block_group;
+	struct bulk_free_space *bgs = NULL;
+	u64 start = BTRFS_SUPER_INFO_OFFSET + BTRFS_SUPER_INFO_SIZE;
+	u32 nr_bgs = 0;
+	u32 max_bgs = 0;
+	int ret = 0;
+
+	if (btrfs_fs_incompat(fs_info, EXTENT_TREE_V2))
+		return -EINVAL;
+
+	while ((block_group = btrfs_lookup_first_block_group(fs_info, start))) {
+		if (nr_bgs == max_bgs) {
+			struct bulk_free_space *tmp;
+
+			max_bgs = max(64U, max_bgs * 2);
+			tmp = realloc(bgs, max_bgs * sizeof(*bgs));
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			bgs = tmp;
+		}
+		memset(&bgs[nr_bgs], 0, sizeof(*bgs));
+		bgs[nr_bgs].bg = block_group;
+		nr_bgs++;
+		start = block_group->start + block_group->length;
+	}
+	if (!nr_bgs)
+		goto out;
+
+	ret = bulk_scan_extent_tree(fs_info, bgs, nr_bgs);
+	if (ret < 0)
+		goto out;
+	ret = bulk_build_all_bitmaps(fs_info, bgs, nr_bgs);
+	if (ret < 0)
+		goto out;
+
+	btrfs_bulk_loader_init(&loader, trans, free_space_root, 100);
+	for (u32 i = 0; i < nr_bgs; i++) {
+		ret = bulk_load_block_group(&loader, &bgs[i]);
+		if (ret < 0)
+			break;
+	}
+	btrfs_bulk_loader_release(&loader);
+out:
+	for (u32 i = 0; i < nr_bgs; i++) {
+		free(bgs[i].ranges);
+		kvfree(bgs[i].bitmap);
+	}
+	free(bgs);
+	return ret;
+}
+
 #define btrfs_set_fs_compat_ro(__fs_info, opt) \
 	__btrfs_set_fs_compat_ro((__fs_info), BTRFS_FEATURE_COMPAT_RO_##opt)
 
@@ -1466,8 +1783,6 @@ int btrfs_create_free_space_tree(struct btrfs_fs_info *fs_info)
 	struct btrfs_trans_handle *trans;
 	struct btrfs_root *tree_root = fs_info->tree_root;
 	struct btrfs_root *free_space_root;
-	struct btrfs_block_group *block_group;
-	u64 start = BTRFS_SUPER_INFO_OFFSET + BTRFS_SUPER_INFO_SIZE;
 	struct btrfs_key root_key = {
 		.objectid = BTRFS_FREE_SPACE_TREE_OBJECTID,
 		.type = BTRFS_ROOT_ITEM_KEY,
@@ -1489,15 +1804,9 @@ int btrfs_create_free_space_tree(struct btrfs_fs_info *fs_info)
 		goto abort;
 	add_root_to_dirty_list(free_space_root);
 
-	do {
-		block_group = btrfs_lookup_first_block_group(fs_info, start);
-		if (!block_group)
-			break;
-		start = block_group->start + block_group->length;
-		ret = populate_free_space_tree(trans, block_group);
-		if (ret)
-			goto abort;
-	} while (block_group);
+	ret = bulk_populate_free_space_tree(trans, free_space_root);
+	if (ret)
+		goto abort;
 
 	btrfs_set_fs_compat_ro(fs_info, FREE_SPACE_TREE);
 	btrfs_set_fs_compat_ro(fs_info, FREE_SPACE_TREE_VALID);
@@ -91,9 +91,12 @@ out:
 	return ret;
 }
 
-/* Check the dir_item/index conflicts before insert */
-int btrfs_check_dir_conflict(struct btrfs_root *root, const char *name,
-			     int namelen, u64 dir, u64 index)
+/*
+ * Check the dir_item/index conflicts before insert, the directory inode is
+ * verified unless @dir_valid.
+ */
+static int check_dir_conflict(struct btrfs_root *root, const char *name,
+			      int namelen, u64 dir, u64 index, bool dir_valid)
 {
 	struct btrfs_path *path;
 	struct btrfs_key key;
@@ -105,6 +108,9 @@ int btrfs_check_dir_conflict(struct btrfs_root *root, const char *name,
 	if (!path)
 		return -ENOMEM;
 
+	if (dir_valid)
+		goto name_conflict;
+
 	/* Given dir exists? */
 	key.objectid = dir;
 	key.type = BTRFS_INODE_ITEM_KEY;
@@ -126,6 +132,7 @@ int btrfs_check_dir_conflict(struct btrfs_root *root, const char *name,
 	}
 	btrfs_release_path(path);
 
+name_conflict:
 	/* Name conflicting? */
 	dir_item = btrfs_lookup_dir_item(NULL, root, path, dir, name,
 					 namelen, 0);
@@ -158,6 +165,40 @@ out:
 	return ret;
 }
 
+int btrfs_check_dir_conflict(struct btrfs_root *root, const char *name,
+			     int namelen, u64 dir, u64 index)
+{
+	return check_dir_conflict(root, name, namelen, dir, index, false);
+}
+
+static struct btrfs_dir_index_cache *dir_index_cache_find(
+		struct btrfs_trans_handle *trans, struct btrfs_root *root,
+		u64 dir)
+{
+	for (int i = 0; i < BTRFS_DIR_INDEX_CACHE_SIZE; i++) {
+		struct btrfs_dir_index_cache *cache = &trans->dir_index_cache[i];
+
+		if (cache->dir == dir &&
+		    cache->root_objectid == root->root_key.objectid)
+			return cache;
+	}
+	return NULL;
+}
+
+/* Remember the next free index of @dir, replacing the oldest directory */
+static void dir_index_cache_add(struct btrfs_trans_handle *trans,
+				struct btrfs_root *root, u64 dir, u64 next_index)
+{
+	struct btrfs_dir_index_cache *cache;
+
+	cache = &trans->dir_index_cache[trans->dir_index_cache_next];
+	trans->dir_index_cache_next = (trans->dir_index_cache_next + 1) %
+				      BTRFS_DIR_INDEX_CACHE_SIZE;
+	cache->root_objectid = root->root_key.objectid;
+	cache->dir = dir;
+	cache->next_index = next_index;
+}
+
 /* Similar to btrfs_inherit_iflags(), but different interfaces. */
 static int inherit_inode_flags(struct btrfs_trans_handle *trans,
 			       struct btrfs_root *root, u64 ino, u64 parent_ino)
@@ -225,6 +266,7 @@ int btrfs_add_link(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 	struct btrfs_path *path;
 	struct btrfs_key key;
 	struct btrfs_inode_item *inode_item;
+	struct btrfs_dir_index_cache *cache;
 	u32 nlink;
 	u64 inode_size;
 	u64 ret_index = 0;
@@ -234,15 +276,35 @@ int btrfs_add_link(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 	if (!path)
 		return -ENOMEM;
 
+	cache = dir_index_cache_find(trans, root, parent_ino);
 	if (index && *index) {
 		ret_index = *index;
+	} else if (cache) {
+		ret_index = cache->next_index;
 	} else {
 		ret = btrfs_find_free_dir_index(root, parent_ino, &ret_index);
 		if (ret < 0)
 			goto out;
 	}
 
-	ret = btrfs_check_dir_conflict(root, name, namelen, parent_ino, ret_index);
+	ret = check_dir_conflict(root, name, namelen, parent_ino, ret_index,
+				 cache != NULL);
+	if (ret < 0 && cache) {
+		/*
+		 * The cached index may have been used by an item inserted
+		 * directly, drop it and redo all the checks to get the error.
+		 */
+		cache->dir = 0;
+		cache = NULL;
+		if (!(index && *index)) {
+			ret = btrfs_find_free_dir_index(root, parent_ino,
+							&ret_index);
+			if (ret < 0)
+				goto out;
+		}
+		ret = check_dir_conflict(root, name, namelen, parent_ino,
+					 ret_index, false);
+	}
 	if (ret < 0 && !(ignore_existed && ret == -EEXIST))
 		goto out;
 
@@ -311,6 +373,12 @@ int btrfs_add_link(struct btrfs_trans_handle *trans, struct btrfs_root *root,
 	btrfs_mark_buffer_dirty(path->nodes[0]);
 	btrfs_release_path(path);
 
+	/* An explicit index is remembered only if the directory is known */
+	if (cache)
+		cache->next_index = max(cache->next_index, ret_index + 1);
+	else if (!(index && *index))
+		dir_index_cache_add(trans, root, parent_ino, ret_index + 1);
+
 out:
 	btrfs_free_path(path);
 	if (ret == 0 && index)
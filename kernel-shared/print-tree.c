@@ -38,6 +38,32 @@
 #include "common/internal.h"
 #include "common/messages.h"
 #include "common/string-utils.h"
+#include "common/tree-prefetch.h"
+
+/* Reads the children of the printed nodes ahead, if set */
+static struct tree_prefetch *print_prefetch;
+
+void btrfs_print_tree_set_prefetch(struct tree_prefetch *tp)
+{
+	print_prefetch = tp;
+}
+
+/*
+ * Print the decimal @value without going through printf, for the fields
+ * printed for every item and node pointer.
+ */
+static void fput_u64(FILE *stream, u64 value)
+{
+	char buf[24];
+	char *p = buf + sizeof(buf);
+
+	*--p = 0;
+	do {
+		*--p = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	fputs(p, stream);
+}
 
 static void print_dir_item_type(struct extent_buffer *eb,
                                 struct btrfs_dir_item *di)
@@ -893,7 +919,7 @@ void print_objectid(FILE *stream, u64 objectid, u8 type)
 		}
 		fallthrough;
 	default:
-		fprintf(stream, "%llu", (unsigned long long)objectid);
+		fput_u64(stream, objectid);
 	}
 }
 
@@ -903,9 +929,9 @@ void btrfs_print_key(struct btrfs_disk_key *disk_key)
 	u8 type = btrfs_disk_key_type(disk_key);
 	u64 offset = btrfs_disk_key_offset(disk_key);
 
-	printf("key (");
+	fputs("key (", stdout);
 	print_objectid(stdout, objectid, type);
-	printf(" ");
+	putchar(' ');
 	print_key_type(stdout, objectid, type);
 	switch (type) {
 	case BTRFS_QGROUP_RELATION_KEY:
@@ -939,10 +965,13 @@ void btrfs_print_key(struct btrfs_disk_key *disk_key)
 		printf(")");
 		break;
 	default:
-		if (offset == (u64)-1)
-			printf(" -1)");
-		else
-			printf(" %llu)", (unsigned long long)offset);
+		if (offset == (u64)-1) {
+			fputs(" -1)", stdout);
+		} else {
+			putchar(' ');
+			fput_u64(stdout, offset);
+			putchar(')');
+		}
 		break;
 	}
 }
@@ -1476,6 +1505,85 @@ static void print_dev_replace_item(struct extent_buffer *eb, struct btrfs_dev_re
 	print_u64_timespec(btrfs_dev_replace_time_started(eb, ptr), "\t\tstop time ");
 }
 
+/* Common fields of the json lines of a node pointer or an item */
+static void print_slot_jsonl(struct extent_buffer *eb, u32 slot,
+			     struct btrfs_disk_key *disk_key)
+{
+	fputs("{\"block\":", stdout);
+	fput_u64(stdout, eb->start);
+	fputs(",\"owner\":", stdout);
+	fput_u64(stdout, btrfs_header_owner(eb));
+	fputs(",\"generation\":", stdout);
+	fput_u64(stdout, btrfs_header_generation(eb));
+	fputs(",\"level\":", stdout);
+	fput_u64(stdout, btrfs_header_level(eb));
+	fputs(",\"slot\":", stdout);
+	fput_u64(stdout, slot);
+	fputs(",\"key\":[", stdout);
+	fput_u64(stdout, btrfs_disk_key_objectid(disk_key));
+	putchar(',');
+	fput_u64(stdout, btrfs_disk_key_type(disk_key));
+	putchar(',');
+	fput_u64(stdout, btrfs_disk_key_offset(disk_key));
+	putchar(']');
+}
+
+static void print_node_ptr_jsonl(struct extent_buffer *eb, u32 slot)
+{
+	struct btrfs_disk_key disk_key;
+
+	btrfs_node_key(eb, &disk_key, slot);
+	print_slot_jsonl(eb, slot, &disk_key);
+	fputs(",\"blockptr\":", stdout);
+	fput_u64(stdout, btrfs_node_blockptr(eb, slot));
+	fputs(",\"ptr_generation\":", stdout);
+	fput_u64(stdout, btrfs_node_ptr_generation(eb, slot));
+	fputs("}\n", stdout);
+}
+
+/* Items that contain names, their data is not printed with hide_names */
+static bool item_has_names(u8 type)
+{
+	switch (type) {
+	case BTRFS_INODE_REF_KEY:
+	case BTRFS_INODE_EXTREF_KEY:
+	case BTRFS_DIR_ITEM_KEY:
+	case BTRFS_DIR_INDEX_KEY:
+	case BTRFS_XATTR_ITEM_KEY:
+	case BTRFS_ROOT_REF_KEY:
+	case BTRFS_ROOT_BACKREF_KEY:
+	case BTRFS_EXTENT_DATA_KEY:
+		return true;
+	}
+	return false;
+}
+
+/* The item data is printed raw in hex, it's not decoded */
+static void print_item_jsonl(struct extent_buffer *eb, u32 slot)
+{
+	static const char hex[] = "0123456789abcdef";
+	struct btrfs_disk_key disk_key;
+	const u8 *data = (const u8 *)eb->data + btrfs_item_ptr_offset(eb, slot);
+	const u32 size = btrfs_item_size(eb, slot);
+
+	btrfs_item_key(eb, &disk_key, slot);
+	print_slot_jsonl(eb, slot, &disk_key);
+	fputs(",\"offset\":", stdout);
+	fput_u64(stdout, btrfs_item_offset(eb, slot));
+	fputs(",\"size\":", stdout);
+	fput_u64(stdout, size);
+	if (!(eb->fs_info && eb->fs_info->hide_names &&
+	      item_has_names(btrfs_disk_key_type(&disk_key)))) {
+		fputs(",\"data\":\"", stdout);
+		for (u32 i = 0; i < size; i++) {
+			putchar(hex[data[i] >> 4]);
+			putchar(hex[data[i] & 0xf]);
+		}
+		putchar('"');
+	}
+	fputs("}\n", stdout);
+}
+
 void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
 {
 	struct btrfs_disk_key disk_key;
@@ -1484,7 +1592,10 @@ void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
 	u32 nr;
 	const bool print_csum_items = (mode & BTRFS_PRINT_TREE_CSUM_ITEMS) && eb->fs_info;
 
-	print_header_info(eb, mode);
+	if (!(mode & BTRFS_PRINT_TREE_JSONL))
+		print_header_info(eb, mode);
+	else
+		fflush(stdout);
 	nr = btrfs_header_nritems(eb);
 	for (i = 0; i < nr; i++) {
 		u32 item_size;
@@ -1502,6 +1613,7 @@ void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
 		if (btrfs_item_offset(eb, i) > leaf_data_size ||
 		    btrfs_item_size(eb, i) + btrfs_item_offset(eb, i) >
 		    leaf_data_size) {
+			fflush(stdout);
 			error(
 "leaf %llu slot %u pointer invalid, offset %u size %u leaf data limit %u",
 			      btrfs_header_bytenr(eb), i,
@@ -1519,11 +1631,19 @@ void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
 		type = btrfs_disk_key_type(&disk_key);
 		offset = btrfs_disk_key_offset(&disk_key);
 
-		printf("\titem %u ", i);
+		if (mode & BTRFS_PRINT_TREE_JSONL) {
+			print_item_jsonl(eb, i);
+			continue;
+		}
+		fputs("\titem ", stdout);
+		fput_u64(stdout, i);
+		putchar(' ');
 		btrfs_print_key(&disk_key);
-		printf(" itemoff %u itemsize %u\n",
-			btrfs_item_offset(eb, i),
-			btrfs_item_size(eb, i));
+		fputs(" itemoff ", stdout);
+		fput_u64(stdout, btrfs_item_offset(eb, i));
+		fputs(" itemsize ", stdout);
+		fput_u64(stdout, btrfs_item_size(eb, i));
+		putchar('\n');
 
 		if (type == 0 && objectid == BTRFS_FREE_SPACE_OBJECTID)
 			print_free_space_header(eb, i);
@@ -1654,10 +1774,31 @@ void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode)
 			print_dev_replace_item(eb, ptr);
 			break;
 		};
-		fflush(stdout);
 	}
 }
 
+/* Queue the children of @node from @slot to be read while printing */
+static void prefetch_children(struct extent_buffer *node, int slot)
+{
+	const u32 nr = min_t(u32, btrfs_header_nritems(node),
+			     BTRFS_NODEPTRS_PER_EXTENT_BUFFER(node));
+
+	if (!print_prefetch || btrfs_header_level(node) == 0)
+		return;
+	for (; slot < nr; slot++)
+		tree_prefetch_submit(print_prefetch, btrfs_node_blockptr(node, slot),
+				     btrfs_node_ptr_generation(node, slot));
+}
+
+static struct extent_buffer *print_read_node_slot(struct extent_buffer *parent,
+						  int slot)
+{
+	if (print_prefetch && slot < btrfs_header_nritems(parent))
+		tree_prefetch_wait(print_prefetch,
+				   btrfs_node_blockptr(parent, slot));
+	return btrfs_read_node_slot(parent, slot);
+}
+
 /* Helper function to reach the leftmost tree block at @path->lowest_level */
 static int search_leftmost_tree_block(struct btrfs_fs_info *fs_info,
 				      struct btrfs_path *path, int root_level)
@@ -1678,7 +1819,9 @@ static int search_leftmost_tree_block(struct btrfs_fs_info *fs_info,
 		struct extent_buffer *eb;
 
 		path->slots[i] = 0;
-		eb = btrfs_read_node_slot(path->nodes[i], 0);
+		if (i == path->lowest_level + 1)
+			prefetch_children(path->nodes[i], 0);
+		eb = print_read_node_slot(path->nodes[i], 0);
 		if (!extent_buffer_uptodate(eb)) {
 			ret = -EIO;
 			goto out;
@@ -1719,7 +1862,7 @@ static int next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 			continue;
 		}
 
-		next = btrfs_read_node_slot(eb, slot);
+		next = print_read_node_slot(eb, slot);
 		if (!extent_buffer_uptodate(next))
 			return -EIO;
 		break;
@@ -1733,7 +1876,9 @@ static int next_sibling_tree_block(struct btrfs_fs_info *fs_info,
 		path->slots[level] = 0;
 		if (level == path->lowest_level)
 			break;
-		next = btrfs_read_node_slot(next, 0);
+		if (level == path->lowest_level + 1)
+			prefetch_children(next, 0);
+		next = print_read_node_slot(next, 0);
 		if (!extent_buffer_uptodate(next))
 			return -EIO;
 	}
@@ -1796,12 +1941,16 @@ static void dfs_print_children(struct extent_buffer *root_eb, unsigned int mode)
 	mode |= BTRFS_PRINT_TREE_DFS;
 	mode &= ~(BTRFS_PRINT_TREE_BFS);
 
+	prefetch_children(root_eb, 0);
 	for (i = 0; i < nr; i++) {
 		struct btrfs_tree_parent_check check = {
 			.owner_root = btrfs_header_owner(root_eb),
 			.transid = btrfs_node_ptr_generation(root_eb, i),
 			.level = root_eb_level,
 		};
+		if (print_prefetch)
+			tree_prefetch_wait(print_prefetch,
+					   btrfs_node_blockptr(root_eb, i));
 		next = read_tree_block(fs_info, btrfs_node_blockptr(root_eb, i),
 				       &check);
 		if (!extent_buffer_uptodate(next)) {
@@ -1857,19 +2006,27 @@ void btrfs_print_tree(struct extent_buffer *eb, unsigned int mode)
 		warning(
 		"node nr_items corrupted, has %u limit %u, continue anyway",
 			nr, BTRFS_NODEPTRS_PER_EXTENT_BUFFER(eb));
-	print_header_info(eb, mode);
+	if (!(mode & BTRFS_PRINT_TREE_JSONL))
+		print_header_info(eb, mode);
+	else
+		fflush(stdout);
 	ptr_num = BTRFS_NODEPTRS_PER_EXTENT_BUFFER(eb);
 	for (i = 0; i < nr && i < ptr_num; i++) {
 		u64 blocknr = btrfs_node_blockptr(eb, i);
 
+		if (mode & BTRFS_PRINT_TREE_JSONL) {
+			print_node_ptr_jsonl(eb, i);
+			continue;
+		}
 		btrfs_node_key(eb, &disk_key, i);
 		btrfs_disk_key_to_cpu(&key, &disk_key);
-		printf("\t");
+		putchar('\t');
 		btrfs_print_key(&disk_key);
-		printf(" block %llu gen %llu\n",
-		       (unsigned long long)blocknr,
-		       (unsigned long long)btrfs_node_ptr_generation(eb, i));
-		fflush(stdout);
+		fputs(" block ", stdout);
+		fput_u64(stdout, blocknr);
+		fputs(" gen ", stdout);
+		fput_u64(stdout, btrfs_node_ptr_generation(eb, i));
+		putchar('\n');
 	}
 	if (!follow)
 		return;
@@ -26,6 +26,7 @@ struct btrfs_chunk;
 struct btrfs_disk_key;
 struct btrfs_super_block;
 struct extent_buffer;
+struct tree_prefetch;
 
 enum {
 	/* Depth-first search, nodes and leaves can be interleaved */
@@ -38,10 +39,13 @@ enum {
 	BTRFS_PRINT_TREE_CSUM_HEADERS	= (1U << 3),
 	/* Print checksums in checksum items */
 	BTRFS_PRINT_TREE_CSUM_ITEMS	= (1U << 4),
+	/* One json object per line for each node pointer and item, raw data */
+	BTRFS_PRINT_TREE_JSONL		= (1U << 5),
 	BTRFS_PRINT_TREE_DEFAULT = BTRFS_PRINT_TREE_BFS,
 };
 
 void btrfs_print_tree(struct extent_buffer *eb, unsigned int mode);
+void btrfs_print_tree_set_prefetch(struct tree_prefetch *tp);
 void __btrfs_print_leaf(struct extent_buffer *eb, unsigned int mode);
 
 static inline void btrfs_print_leaf(struct extent_buffer *eb)
@@ -18,6 +18,7 @@
 #include <stdlib.h>
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/bitops.h"
+#include "kernel-lib/trace.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/delayed-ref.h"
@@ -270,12 +271,11 @@ int commit_tree_roots(struct btrfs_trans_handle *trans,
 static void clean_dirty_buffers(struct btrfs_trans_handle *trans)
 {
 	struct btrfs_fs_info *fs_info = trans->fs_info;
-	struct extent_io_tree *tree = &fs_info->dirty_buffers;
+	struct extent_bitmap *dirty = &fs_info->dirty_buffers;
 	struct extent_buffer *eb;
 	u64 start, end;
 
-	while (find_first_extent_bit(tree, 0, &start, &end, EXTENT_DIRTY,
-				     NULL) == 0) {
+	while (extent_bitmap_find_first(dirty, 0, &start, &end) == 0) {
 		while (start <= end) {
 			eb = find_first_extent_buffer(fs_info, start);
 			BUG_ON(!eb || eb->start != start);
@@ -293,13 +293,13 @@ int __commit_transaction(struct btrfs_trans_handle *trans,
 	u64 end;
 	struct btrfs_fs_info *fs_info = root->fs_info;
 	struct extent_buffer *eb;
-	struct extent_io_tree *tree = &fs_info->dirty_buffers;
+	struct extent_bitmap *dirty = &fs_info->dirty_buffers;
+	struct tree_block_writeback wb = { 0 };
 	int ret;
 
 	while(1) {
 again:
-		ret = find_first_extent_bit(tree, 0, &start, &end,
-					    EXTENT_DIRTY, NULL);
+		ret = extent_bitmap_find_first(dirty, 0, &start, &end);
 		if (ret)
 			break;
 
@@ -309,7 +309,7 @@ again:
 		while(start <= end) {
 			eb = find_first_extent_buffer(fs_info, start);
 			BUG_ON(!eb || eb->start != start);
-			ret = write_tree_block(trans, fs_info, eb);
+			ret = write_tree_block_batched(trans, fs_info, eb, &wb);
 			if (ret < 0) {
 				free_extent_buffer(eb);
 				errno = -ret;
@@ -322,8 +322,11 @@ again:
 			free_extent_buffer(eb);
 		}
 	}
-	return 0;
+	ret = tree_block_writeback_flush(fs_info, &wb);
+	tree_block_writeback_release(&wb);
+	return ret;
 cleanup:
+	tree_block_writeback_release(&wb);
 	/*
 	 * Mark all remaining dirty ebs clean, as they have no chance to be written
 	 * back anymore.
@@ -340,6 +343,7 @@ int btrfs_commit_transaction(struct btrfs_trans_handle *trans,
 	struct btrfs_fs_info *fs_info = root->fs_info;
 	struct btrfs_space_info *sinfo;
 
+	trace_btrfs_transaction_commit_start(transid);
 	if (trans->fs_info->transaction_aborted) {
 		ret = -EROFS;
 		goto error;
@@ -383,7 +387,7 @@ commit_tree:
 	 * tree refs, while run such delayed tree refs can dirty block groups
 	 * again, we need to exhause both dirty blocks and delayed refs
 	 */
-	while (!RB_EMPTY_ROOT(&trans->delayed_refs.href_root) ||
+	while (!btrfs_delayed_refs_empty(&trans->delayed_refs) ||
 	       !list_empty(&trans->dirty_bgs)) {
 		ret = btrfs_write_dirty_block_groups(trans);
 		if (ret < 0)
@@ -397,7 +401,7 @@ commit_tree:
 		goto error;
 
 	/* There should be no pending delayed refs now */
-	if (!RB_EMPTY_ROOT(&trans->delayed_refs.href_root)) {
+	if (!btrfs_delayed_refs_empty(&trans->delayed_refs)) {
 		error("uncommitted delayed refs detected");
 		goto error;
 	}
@@ -415,12 +419,14 @@ commit_tree:
 				transid, sinfo->flags, sinfo->bytes_reserved);
 		}
 	}
+	trace_btrfs_transaction_commit(transid, ret);
 	return ret;
 error:
 	btrfs_abort_transaction(trans, ret);
 	clean_dirty_buffers(trans);
 	btrfs_destroy_delayed_refs(trans);
 	kfree(trans);
+	trace_btrfs_transaction_commit(transid, ret);
 	return ret;
 }
 
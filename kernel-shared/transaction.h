@@ -132,6 +132,20 @@ enum {
 
 #define TRANS_EXTWRITERS	(__TRANS_START | __TRANS_ATTACH)
 
+#define BTRFS_DIR_INDEX_CACHE_SIZE	(8)
+
+/*
+ * Next free DIR_INDEX of a directory in one transaction, so consecutive
+ * btrfs_add_link() calls to the same directory don't search for the last index
+ * and verify the directory inode each time.  The directory of dir == 0 is
+ * unused.
+ */
+struct btrfs_dir_index_cache {
+	u64 root_objectid;
+	u64 dir;
+	u64 next_index;
+};
+
 struct btrfs_trans_handle {
 	struct btrfs_fs_info *fs_info;
 	u64 transid;
@@ -145,6 +159,8 @@ struct btrfs_trans_handle {
 	struct btrfs_block_group *block_group;
 	struct btrfs_delayed_ref_root delayed_refs;
 	struct list_head dirty_bgs;
+	struct btrfs_dir_index_cache dir_index_cache[BTRFS_DIR_INDEX_CACHE_SIZE];
+	unsigned int dir_index_cache_next;
 };
 
 /*
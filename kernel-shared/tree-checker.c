@@ -536,7 +536,7 @@ static int check_root_key(struct extent_buffer *leaf, struct btrfs_key *key,
 
 static int check_dir_item(struct extent_buffer *leaf,
 			  struct btrfs_key *key, struct btrfs_key *prev_key,
-			  int slot)
+			  int slot, struct btrfs_leaf_name_hashes *names)
 {
 	struct btrfs_fs_info *fs_info = leaf->fs_info;
 	struct btrfs_dir_item *di;
@@ -654,9 +654,12 @@ static int check_dir_item(struct extent_buffer *leaf,
 		    key->type == BTRFS_XATTR_ITEM_KEY) {
 			char namebuf[max(BTRFS_NAME_LEN, XATTR_NAME_MAX)];
 
-			read_extent_buffer(leaf, namebuf,
-					(unsigned long)(di + 1), name_len);
-			name_hash = btrfs_name_hash(namebuf, name_len);
+			if (cur > 0 ||
+			    !btrfs_leaf_name_hash(leaf, names, slot, &name_hash)) {
+				read_extent_buffer(leaf, namebuf,
+						(unsigned long)(di + 1), name_len);
+				name_hash = btrfs_name_hash(namebuf, name_len);
+			}
 			if (unlikely(key->offset != name_hash)) {
 				dir_item_err(leaf, slot,
 		"name hash mismatch with key, have 0x%016x expect 0x%016llx",
@@ -1811,7 +1814,8 @@ static int check_dev_extent_item(const struct extent_buffer *leaf,
 static enum btrfs_tree_block_status check_leaf_item(struct extent_buffer *leaf,
 						    struct btrfs_key *key,
 						    int slot,
-						    struct btrfs_key *prev_key)
+						    struct btrfs_key *prev_key,
+						    struct btrfs_leaf_name_hashes *names)
 {
 	struct btrfs_fs_info *fs_info = leaf->fs_info;
 	int ret = 0;
@@ -1830,7 +1834,7 @@ static enum btrfs_tree_block_status check_leaf_item(struct extent_buffer *leaf,
 	case BTRFS_DIR_ITEM_KEY:
 	case BTRFS_DIR_INDEX_KEY:
 	case BTRFS_XATTR_ITEM_KEY:
-		ret = check_dir_item(leaf, key, prev_key, slot);
+		ret = check_dir_item(leaf, key, prev_key, slot, names);
 		break;
 	case BTRFS_INODE_REF_KEY:
 		ret = check_inode_ref(leaf, key, prev_key, slot);
@@ -1882,6 +1886,7 @@ enum btrfs_tree_block_status __btrfs_check_leaf(struct extent_buffer *leaf)
 	/* No valid key type is 0, so all key should be larger than this key */
 	struct btrfs_key prev_key = {0, 0, 0};
 	struct btrfs_key key;
+	struct btrfs_leaf_name_hashes names = { 0 };
 	u32 nritems = btrfs_header_nritems(leaf);
 	int slot;
 	bool check_item_data = btrfs_header_flag(leaf, BTRFS_HEADER_FLAG_WRITTEN);
@@ -2030,7 +2035,8 @@ enum btrfs_tree_block_status __btrfs_check_leaf(struct extent_buffer *leaf)
 			 * Check if the item size and content meet other
 			 * criteria
 			 */
-			ret = check_leaf_item(leaf, &key, slot, &prev_key);
+			ret = check_leaf_item(leaf, &key, slot, &prev_key,
+					      &names);
 			if (unlikely(ret != BTRFS_TREE_BLOCK_CLEAN))
 				return ret;
 		}
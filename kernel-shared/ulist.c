@@ -19,8 +19,9 @@
  */
 
 #include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
-#include "kernel-lib/rbtree.h"
 #include "kernel-shared/ulist.h"
 #include "kernel-shared/messages.h"
 
@@ -51,6 +52,12 @@
  * It is also useful for tree enumeration which could be done elegantly
  * recursively, but is not possible due to kernel stack limitations. The
  * loop would be similar to the above.
+ *
+ * The nodes are kept in the order of addition, the first ULIST_INLINE_NODES
+ * inside struct ulist so the common case of a handful of values never
+ * allocates, and the rest in fixed-size blocks.  Lookups scan the inline nodes
+ * linearly, and once there are more use an open addressing hash table over
+ * all of them.
  */
 
 /*
@@ -63,9 +70,11 @@
  */
 void ulist_init(struct ulist *ulist)
 {
-	INIT_LIST_HEAD(&ulist->nodes);
-	ulist->root = RB_ROOT;
 	ulist->nnodes = 0;
+	ulist->blocks = NULL;
+	ulist->nr_blocks = 0;
+	ulist->table = NULL;
+	ulist->table_bits = 0;
 }
 
 /*
@@ -78,14 +87,17 @@ void ulist_init(struct ulist *ulist)
  */
 void ulist_release(struct ulist *ulist)
 {
-	struct ulist_node *node;
-	struct ulist_node *next;
+	unsigned long i;
 
-	list_for_each_entry_safe(node, next, &ulist->nodes, list) {
-		kfree(node);
-	}
-	ulist->root = RB_ROOT;
-	INIT_LIST_HEAD(&ulist->nodes);
+	for (i = 0; i < ulist->nr_blocks; i++)
+		kfree(ulist->blocks[i]);
+	kfree(ulist->blocks);
+	kfree(ulist->table);
+	ulist->blocks = NULL;
+	ulist->nr_blocks = 0;
+	ulist->table = NULL;
+	ulist->table_bits = 0;
+	ulist->nnodes = 0;
 }
 
 /*
@@ -136,51 +148,106 @@ void ulist_free(struct ulist *ulist)
 	kfree(ulist);
 }
 
-static struct ulist_node *ulist_rbtree_search(struct ulist *ulist, u64 val)
+static inline struct ulist_node *ulist_node_at(const struct ulist *ulist,
+					       unsigned long index)
 {
-	struct rb_node *n = ulist->root.rb_node;
-	struct ulist_node *u = NULL;
-
-	while (n) {
-		u = rb_entry(n, struct ulist_node, rb_node);
-		if (u->val < val)
-			n = n->rb_right;
-		else if (u->val > val)
-			n = n->rb_left;
-		else
-			return u;
-	}
-	return NULL;
+	if (index < ULIST_INLINE_NODES)
+		return (struct ulist_node *)&ulist->inline_nodes[index];
+	index -= ULIST_INLINE_NODES;
+	return &ulist->blocks[index / ULIST_BLOCK_NODES][index % ULIST_BLOCK_NODES];
 }
 
-static void ulist_rbtree_erase(struct ulist *ulist, struct ulist_node *node)
+static inline u32 ulist_hash(const struct ulist *ulist, u64 val)
 {
-	rb_erase(&node->rb_node, &ulist->root);
-	list_del(&node->list);
-	kfree(node);
-	BUG_ON(ulist->nnodes == 0);
-	ulist->nnodes--;
+	/* Fibonacci hashing, the top bits are well mixed */
+	return (val * 0x61c8864680b583ebULL) >> (64 - ulist->table_bits);
+}
+
+static void ulist_hash_insert(struct ulist *ulist, u64 val, unsigned long index)
+{
+	const u32 mask = (1U << ulist->table_bits) - 1;
+	u32 slot = ulist_hash(ulist, val);
+
+	while (ulist->table[slot])
+		slot = (slot + 1) & mask;
+	ulist->table[slot] = index + 1;
+}
+
+static void ulist_hash_rebuild(struct ulist *ulist)
+{
+	unsigned long i;
+
+	memset(ulist->table, 0, sizeof(u32) << ulist->table_bits);
+	for (i = 0; i < ulist->nnodes; i++)
+		ulist_hash_insert(ulist, ulist_node_at(ulist, i)->val, i);
+}
+
+/* Return the index of the node with @val, or -1 if there's none */
+static long ulist_search(const struct ulist *ulist, u64 val)
+{
+	u32 mask;
+	u32 slot;
+
+	if (!ulist->table) {
+		unsigned long i;
+
+		for (i = 0; i < ulist->nnodes; i++) {
+			if (ulist->inline_nodes[i].val == val)
+				return i;
+		}
+		return -1;
+	}
+
+	mask = (1U << ulist->table_bits) - 1;
+	for (slot = ulist_hash(ulist, val); ulist->table[slot];
+	     slot = (slot + 1) & mask) {
+		const unsigned long index = ulist->table[slot] - 1;
+
+		if (ulist_node_at(ulist, index)->val == val)
+			return index;
+	}
+	return -1;
 }
 
-static int ulist_rbtree_insert(struct ulist *ulist, struct ulist_node *ins)
+/*
+ * Make room for one more node, allocating its block and growing the hash table
+ * to stay at most half full.  The ulist content is unchanged on failure.
+ */
+static int ulist_grow(struct ulist *ulist, gfp_t gfp_mask)
 {
-	struct rb_node **p = &ulist->root.rb_node;
-	struct rb_node *parent = NULL;
-	struct ulist_node *cur = NULL;
-
-	while (*p) {
-		parent = *p;
-		cur = rb_entry(parent, struct ulist_node, rb_node);
-
-		if (cur->val < ins->val)
-			p = &(*p)->rb_right;
-		else if (cur->val > ins->val)
-			p = &(*p)->rb_left;
-		else
-			return -EEXIST;
+	const unsigned long block = (ulist->nnodes - ULIST_INLINE_NODES) /
+				    ULIST_BLOCK_NODES;
+
+	if (ulist->nnodes < ULIST_INLINE_NODES)
+		return 0;
+
+	if (block >= ulist->nr_blocks) {
+		struct ulist_node **blocks;
+
+		blocks = realloc(ulist->blocks, (block + 1) * sizeof(*blocks));
+		if (!blocks)
+			return -ENOMEM;
+		ulist->blocks = blocks;
+		blocks[block] = kmalloc(ULIST_BLOCK_NODES * sizeof(struct ulist_node),
+					gfp_mask);
+		if (!blocks[block])
+			return -ENOMEM;
+		ulist->nr_blocks = block + 1;
+	}
+
+	if (!ulist->table || (ulist->nnodes + 1) * 2 > (1UL << ulist->table_bits)) {
+		const u32 bits = ulist->table ? ulist->table_bits + 1 :
+				 ilog2(ULIST_INLINE_NODES) + 2;
+		u32 *table;
+
+		table = kmalloc(sizeof(u32) << bits, gfp_mask);
+		if (!table)
+			return -ENOMEM;
+		kfree(ulist->table);
+		ulist->table = table;
+		ulist->table_bits = bits;
+		ulist_hash_rebuild(ulist);
 	}
-	rb_link_node(&ins->rb_node, parent, p);
-	rb_insert_color(&ins->rb_node, &ulist->root);
 	return 0;
 }
 
@@ -213,25 +280,26 @@ int ulist_add(struct ulist *ulist, u64 val, u64 aux, gfp_t gfp_mask)
 int ulist_add_merge(struct ulist *ulist, u64 val, u64 aux,
 		    u64 *old_aux, gfp_t gfp_mask)
 {
-	int ret;
 	struct ulist_node *node;
+	long index;
+	int ret;
 
-	node = ulist_rbtree_search(ulist, val);
-	if (node) {
+	index = ulist_search(ulist, val);
+	if (index >= 0) {
 		if (old_aux)
-			*old_aux = node->aux;
+			*old_aux = ulist_node_at(ulist, index)->aux;
 		return 0;
 	}
-	node = kmalloc(sizeof(*node), gfp_mask);
-	if (!node)
-		return -ENOMEM;
 
+	ret = ulist_grow(ulist, gfp_mask);
+	if (ret < 0)
+		return ret;
+
+	node = ulist_node_at(ulist, ulist->nnodes);
 	node->val = val;
 	node->aux = aux;
-
-	ret = ulist_rbtree_insert(ulist, node);
-	ASSERT(!ret);
-	list_add_tail(&node->list, &ulist->nodes);
+	if (ulist->table)
+		ulist_hash_insert(ulist, val, ulist->nnodes);
 	ulist->nnodes++;
 
 	return 1;
@@ -245,23 +313,30 @@ int ulist_add_merge(struct ulist *ulist, u64 val, u64 aux,
  * @aux:	aux to delete
  *
  * The deletion will only be done when *BOTH* val and aux matches.
+ * The following nodes move down by one, so pointers to them and running
+ * iterations are invalidated.
  * Return 0 for successful delete.
  * Return > 0 for not found.
  */
 int ulist_del(struct ulist *ulist, u64 val, u64 aux)
 {
-	struct ulist_node *node;
+	unsigned long i;
+	long index;
 
-	node = ulist_rbtree_search(ulist, val);
+	index = ulist_search(ulist, val);
 	/* Not found */
-	if (!node)
+	if (index < 0)
 		return 1;
 
-	if (node->aux != aux)
+	if (ulist_node_at(ulist, index)->aux != aux)
 		return 1;
 
 	/* Found and delete */
-	ulist_rbtree_erase(ulist, node);
+	for (i = index; i + 1 < ulist->nnodes; i++)
+		*ulist_node_at(ulist, i) = *ulist_node_at(ulist, i + 1);
+	ulist->nnodes--;
+	if (ulist->table)
+		ulist_hash_rebuild(ulist);
 	return 0;
 }
 
@@ -284,17 +359,7 @@ int ulist_del(struct ulist *ulist, u64 val, u64 aux)
  */
 struct ulist_node *ulist_next(const struct ulist *ulist, struct ulist_iterator *uiter)
 {
-	struct ulist_node *node;
-
-	if (list_empty(&ulist->nodes))
+	if (uiter->index >= ulist->nnodes)
 		return NULL;
-	if (uiter->cur_list && uiter->cur_list->next == &ulist->nodes)
-		return NULL;
-	if (uiter->cur_list) {
-		uiter->cur_list = uiter->cur_list->next;
-	} else {
-		uiter->cur_list = ulist->nodes.next;
-	}
-	node = list_entry(uiter->cur_list, struct ulist_node, list);
-	return node;
+	return ulist_node_at(ulist, uiter->index++);
 }
@@ -23,8 +23,6 @@
 
 #include "kerncompat.h"
 #include <stddef.h>
-#include "kernel-lib/rbtree_types.h"
-#include "kernel-lib/list.h"
 
 /*
  * ulist is a generic data structure to hold a collection of unique u64
@@ -34,7 +32,7 @@
  *
  */
 struct ulist_iterator {
-	struct list_head *cur_list;  /* hint to start search */
+	unsigned long index;	/* index of the next node to return */
 };
 
 /*
@@ -43,19 +41,35 @@ struct ulist_iterator {
 struct ulist_node {
 	u64 val;		/* value to store */
 	u64 aux;		/* auxiliary value saved along with the val */
-
-	struct list_head list;  /* used to link node */
-	struct rb_node rb_node;	/* used to speed up search */
 };
 
+/* Nodes stored in struct ulist itself, most ulists never grow past this */
+#define ULIST_INLINE_NODES	(4)
+/* Nodes per allocated block once the inline ones are used up */
+#define ULIST_BLOCK_NODES	(64)
+
 struct ulist {
 	/*
 	 * number of elements stored in list
 	 */
 	unsigned long nnodes;
 
-	struct list_head nodes;
-	struct rb_root root;
+	/* The first nodes in the order of addition */
+	struct ulist_node inline_nodes[ULIST_INLINE_NODES];
+
+	/*
+	 * The rest of the nodes, in blocks of ULIST_BLOCK_NODES which are
+	 * never moved so node pointers stay valid while adding.
+	 */
+	struct ulist_node **blocks;
+	unsigned long nr_blocks;
+
+	/*
+	 * Open addressing hash of node index + 1 (0 is a free slot), only
+	 * allocated once the inline nodes are not enough for a linear search.
+	 */
+	u32 *table;
+	u32 table_bits;
 };
 
 void ulist_init(struct ulist *ulist);
@@ -85,6 +99,6 @@ static inline int ulist_add_merge_ptr(struct ulist *ulist, u64 val, void *aux,
 struct ulist_node *ulist_next(const struct ulist *ulist,
 			      struct ulist_iterator *uiter);
 
-#define ULIST_ITER_INIT(uiter) ((uiter)->cur_list = NULL)
+#define ULIST_ITER_INIT(uiter) ((uiter)->index = 0)
 
 #endif
@@ -18,6 +18,7 @@
 
 #include "kerncompat.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
@@ -39,6 +40,7 @@
 #include "common/messages.h"
 #include "common/utils.h"
 #include "common/device-utils.h"
+#include "common/stats.h"
 
 const struct btrfs_raid_attr btrfs_raid_array[BTRFS_NR_RAID_TYPES] = {
 	[BTRFS_RAID_RAID10] = {
@@ -618,6 +620,48 @@ static int device_list_add(const char *path,
 	return 0;
 }
 
+/*
+ * Map the whole device read-only for OPEN_CTREE_MMAP.
+ *
+ * The mapping is private and writable, so tree blocks referencing it can
+ * still be modified in memory without anything reaching the device.  The
+ * mapping is created on first use and is torn down in btrfs_close_devices().
+ *
+ * Only image files are mapped.  The pages not written in memory still follow
+ * the device, a block device could be changed by a mounted filesystem after
+ * the blocks were verified.  Reading a truncated file or a failing page of
+ * the mapping raises SIGBUS instead of an error of pread, that's why the mode
+ * is only used when asked for.
+ *
+ * Return the start of the mapping, or NULL if the device can't be mapped and
+ * the caller has to fall back to pread.
+ */
+char *btrfs_device_map(struct btrfs_device *device)
+{
+	struct stat st;
+	u64 size;
+	void *map;
+
+	if (device->map || device->map_failed)
+		return device->map;
+
+	device->map_failed = true;
+	if (device->fd < 0 || fstat(device->fd, &st) < 0 || !S_ISREG(st.st_mode))
+		return NULL;
+	size = device_get_partition_size_fd_stat(device->fd, &st);
+	if (size == 0 || size > SIZE_MAX)
+		return NULL;
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		   device->fd, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+	madvise(map, size, MADV_RANDOM);
+	device->map = map;
+	device->map_size = size;
+	device->map_failed = false;
+	return device->map;
+}
+
 int btrfs_close_devices(struct btrfs_fs_devices *fs_devices)
 {
 	struct btrfs_fs_devices *seed_devices;
@@ -636,6 +680,10 @@ again:
 					device->devid);
 				ret = -errno;
 			}
+			if (device->map) {
+				munmap(device->map, device->map_size);
+				device->map = NULL;
+			}
 			if (posix_fadvise(device->fd, 0, 0, POSIX_FADV_DONTNEED))
 				fprintf(stderr, "Warning, could not drop caches\n");
 			close(device->fd);
@@ -646,7 +694,7 @@ again:
 		/* free the memory */
 		kfree(device->name);
 		kfree(device->label);
-		kfree(device->zone_info);
+		btrfs_free_zone_info(device->zone_info);
 		kfree(device);
 	}
 
@@ -686,6 +734,8 @@ int btrfs_open_devices(struct btrfs_fs_info *fs_info,
 	struct btrfs_device *device;
 	int ret;
 
+	/* Pick up the read policy before any threads read */
+	btrfs_get_read_policy();
 	list_for_each_entry(device, &fs_devices->devices, dev_list) {
 		if (!device->fs_info)
 			device->fs_info = fs_info;
@@ -733,14 +783,24 @@ int btrfs_scan_one_device(int fd, const char *path,
 	if (ret < 0)
 		return -EIO;
 
-	if (btrfs_super_flags(&disk_super) & BTRFS_SUPER_FLAG_METADUMP)
+	return btrfs_scan_one_super(path, &disk_super, fs_devices_ret,
+				    total_devs);
+}
+
+/*
+ * Same as btrfs_scan_one_device() with the super block already read by the
+ * caller, e.g. from several devices in parallel.
+ */
+int btrfs_scan_one_super(const char *path, struct btrfs_super_block *disk_super,
+			 struct btrfs_fs_devices **fs_devices_ret,
+			 u64 *total_devs)
+{
+	if (btrfs_super_flags(disk_super) & BTRFS_SUPER_FLAG_METADUMP)
 		*total_devs = 1;
 	else
-		*total_devs = btrfs_super_num_devices(&disk_super);
-
-	ret = device_list_add(path, &disk_super, fs_devices_ret);
+		*total_devs = btrfs_super_num_devices(disk_super);
 
-	return ret;
+	return device_list_add(path, disk_super, fs_devices_ret);
 }
 
 static u64 dev_extent_search_start(struct btrfs_device *device, u64 start)
@@ -1864,6 +1924,139 @@ int btrfs_num_copies(struct btrfs_fs_info *fs_info, u64 logical, u64 len)
 	return ret;
 }
 
+static struct cache_extent *lookup_chunk_map(struct btrfs_mapping_tree *map_tree,
+					     u64 logical);
+
+static const char * const read_policy_names[BTRFS_NR_READ_POLICY] = {
+	[BTRFS_READ_POLICY_FIRST]	= "first",
+	[BTRFS_READ_POLICY_ROUND_ROBIN]	= "round-robin",
+	[BTRFS_READ_POLICY_QUEUE]	= "queue",
+	[BTRFS_READ_POLICY_LATENCY]	= "latency",
+};
+
+/* Each Nth read with the latency policy refreshes the averages of all devices */
+#define READ_LATENCY_PROBE	64
+
+static enum btrfs_read_policy read_policy = BTRFS_READ_POLICY_FIRST;
+static bool read_policy_set;
+static u64 read_policy_seq;
+
+/* Select the read policy by name, overriding the environment */
+int btrfs_set_read_policy(const char *name)
+{
+	for (int i = 0; i < BTRFS_NR_READ_POLICY; i++) {
+		if (strcmp(name, read_policy_names[i]) == 0) {
+			read_policy = i;
+			read_policy_set = true;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+/*
+ * The read policy, from the environment if not set otherwise.  First called
+ * when the devices are opened, before there are any reading threads.
+ */
+enum btrfs_read_policy btrfs_get_read_policy(void)
+{
+	if (!read_policy_set) {
+		const char *name = getenv(BTRFS_READ_POLICY_ENV);
+
+		read_policy_set = true;
+		if (name && btrfs_set_read_policy(name) < 0)
+			warning("unknown read policy %s=%s, using the first mirror",
+				BTRFS_READ_POLICY_ENV, name);
+	}
+	return read_policy;
+}
+
+/* Start a read from @device, return the start time for the latency policy */
+u64 btrfs_device_read_start(struct btrfs_device *device)
+{
+	__atomic_add_fetch(&device->reads_inflight, 1, __ATOMIC_RELAXED);
+	if (read_policy == BTRFS_READ_POLICY_LATENCY)
+		return stats_now_ns();
+	return 0;
+}
+
+void btrfs_device_read_end(struct btrfs_device *device, u64 start_ns)
+{
+	__atomic_sub_fetch(&device->reads_inflight, 1, __ATOMIC_RELAXED);
+	if (start_ns) {
+		u64 latency = stats_now_ns() - start_ns;
+		u64 avg = __atomic_load_n(&device->read_latency_ns,
+					  __ATOMIC_RELAXED);
+
+		/* Moving average, the first read sets it */
+		avg = avg ? avg - avg / 8 + latency / 8 : latency;
+		__atomic_store_n(&device->read_latency_ns, avg, __ATOMIC_RELAXED);
+	}
+}
+
+static u64 read_cost(const struct btrfs_device *device)
+{
+	if (!device || device->fd < 0)
+		return U64_MAX;
+	if (read_policy == BTRFS_READ_POLICY_QUEUE)
+		return __atomic_load_n(&device->reads_inflight, __ATOMIC_RELAXED);
+	return __atomic_load_n(&device->read_latency_ns, __ATOMIC_RELAXED);
+}
+
+/*
+ * Pick the mirror to read first at @logical by the read policy, the other
+ * ones are tried on errors as usual.
+ *
+ * Only RAID1* and RAID10 have a choice of devices, the copies of DUP are on
+ * one device and the mirrors of RAID56 are rebuilt from the parity.
+ * Consecutive stripes alternate the mirrors, which also breaks the ties of
+ * the queue and latency policies, so serial reads spread over the devices.
+ */
+int btrfs_read_mirror(struct btrfs_fs_info *fs_info, u64 logical)
+{
+	struct cache_extent *ce;
+	struct map_lookup *map;
+	struct btrfs_bio_stripe *stripes;
+	u64 stripe_nr;
+	int num_copies;
+	int best;
+
+	if (read_policy == BTRFS_READ_POLICY_FIRST)
+		return 1;
+	ce = lookup_chunk_map(&fs_info->mapping_tree, logical);
+	if (!ce || ce->start > logical)
+		return 1;
+	map = container_of(ce, struct map_lookup, ce);
+	stripe_nr = (logical - ce->start) / map->stripe_len;
+	if (map->type & BTRFS_BLOCK_GROUP_RAID1_MASK) {
+		stripes = map->stripes;
+		num_copies = map->num_stripes;
+	} else if (map->type & BTRFS_BLOCK_GROUP_RAID10) {
+		int factor = map->num_stripes / map->sub_stripes;
+
+		stripes = &map->stripes[(stripe_nr % factor) * map->sub_stripes];
+		num_copies = map->sub_stripes;
+		stripe_nr /= factor;
+	} else {
+		return 1;
+	}
+
+	best = stripe_nr % num_copies;
+	if (read_policy == BTRFS_READ_POLICY_ROUND_ROBIN)
+		return best + 1;
+	if (read_policy == BTRFS_READ_POLICY_LATENCY &&
+	    __atomic_add_fetch(&read_policy_seq, 1, __ATOMIC_RELAXED) %
+	    READ_LATENCY_PROBE == 0)
+		return best + 1;
+	for (int i = 1; i < num_copies; i++) {
+		int mirror = (stripe_nr + i) % num_copies;
+
+		if (read_cost(stripes[mirror].dev) < read_cost(stripes[best].dev))
+			best = mirror;
+	}
+	return best + 1;
+}
+
 int btrfs_next_bg(struct btrfs_fs_info *fs_info, u64 *logical,
 		  u64 *size, u64 type)
 {
@@ -1992,13 +2185,44 @@ static void sort_parity_stripes(struct btrfs_multi_bio *bbio, u64 *raid_map)
 	}
 }
 
+static int map_block(struct btrfs_fs_info *fs_info, int rw,
+		     u64 logical, u64 *length, u64 *type,
+		     struct btrfs_multi_bio **multi_ret, int mirror_num,
+		     u64 **raid_map_ret, struct btrfs_multi_bio *single);
+
 int btrfs_map_block(struct btrfs_fs_info *fs_info, int rw,
 		    u64 logical, u64 *length,
 		    struct btrfs_multi_bio **multi_ret, int mirror_num,
 		    u64 **raid_map_ret)
 {
-	return __btrfs_map_block(fs_info, rw, logical, length, NULL,
-				 multi_ret, mirror_num, raid_map_ret);
+	return map_block(fs_info, rw, logical, length, NULL, multi_ret,
+			 mirror_num, raid_map_ret, NULL);
+}
+
+/*
+ * Map a read of @logical to a single stripe, like btrfs_map_block() without
+ * a raid map, but filling @stripe instead of allocating a multi bio.
+ *
+ * For RAID56 mirrors > 1 this returns the parity stripe, rebuilding the data
+ * needs the full btrfs_map_block().
+ */
+int btrfs_map_block_stripe(struct btrfs_fs_info *fs_info, u64 logical,
+			   u64 *length, u64 *type, int mirror_num,
+			   struct btrfs_bio_stripe *stripe)
+{
+	union {
+		struct btrfs_multi_bio multi;
+		u8 raw[btrfs_multi_bio_size(1)];
+	} single;
+	struct btrfs_multi_bio *multi = NULL;
+	int ret;
+
+	ret = map_block(fs_info, READ, logical, length, type, &multi,
+			mirror_num, NULL, &single.multi);
+	if (ret < 0)
+		return ret;
+	*stripe = multi->stripes[0];
+	return 0;
 }
 
 static bool btrfs_need_stripe_tree_update(struct btrfs_fs_info *fs_info, u64 map_type)
@@ -2090,10 +2314,43 @@ error:
 	return ret;
 }
 
+/*
+ * Find the chunk containing @logical, or the next one after it.  The last
+ * chunk found is remembered, as consecutive lookups tend to hit the same one.
+ * Data reads of check can map blocks from several threads, the hint is only
+ * accessed atomically.
+ */
+static struct cache_extent *lookup_chunk_map(struct btrfs_mapping_tree *map_tree,
+					     u64 logical)
+{
+	struct cache_extent *ce = __atomic_load_n(&map_tree->last_hit,
+						  __ATOMIC_RELAXED);
+
+	if (ce && ce->start <= logical && logical - ce->start < ce->size)
+		return ce;
+	ce = search_cache_extent(&map_tree->cache_tree, logical);
+	if (ce && ce->start <= logical)
+		__atomic_store_n(&map_tree->last_hit, ce, __ATOMIC_RELAXED);
+	return ce;
+}
+
 int __btrfs_map_block(struct btrfs_fs_info *fs_info, int rw,
 		      u64 logical, u64 *length, u64 *type,
 		      struct btrfs_multi_bio **multi_ret, int mirror_num,
 		      u64 **raid_map_ret)
+{
+	return map_block(fs_info, rw, logical, length, type, multi_ret,
+			 mirror_num, raid_map_ret, NULL);
+}
+
+/*
+ * If @single is set, it's used instead of allocating the multi bio, only for
+ * reads without raid map, which always need one stripe.
+ */
+static int map_block(struct btrfs_fs_info *fs_info, int rw,
+		     u64 logical, u64 *length, u64 *type,
+		     struct btrfs_multi_bio **multi_ret, int mirror_num,
+		     u64 **raid_map_ret, struct btrfs_multi_bio *single)
 {
 	struct btrfs_mapping_tree *map_tree = &fs_info->mapping_tree;
 	struct cache_extent *ce;
@@ -2112,8 +2369,9 @@ int __btrfs_map_block(struct btrfs_fs_info *fs_info, int rw,
 	if (multi_ret && rw == READ) {
 		stripes_allocated = 1;
 	}
+	ASSERT(!single || (multi_ret && rw == READ && !raid_map_ret));
 again:
-	ce = search_cache_extent(&map_tree->cache_tree, logical);
+	ce = lookup_chunk_map(map_tree, logical);
 	if (!ce) {
 		kfree(multi);
 		*length = (u64)-1;
@@ -2125,7 +2383,10 @@ again:
 		return -ENOENT;
 	}
 
-	if (multi_ret) {
+	if (multi_ret && single) {
+		multi = single;
+		memset(multi, 0, btrfs_multi_bio_size(1));
+	} else if (multi_ret) {
 		multi = kzalloc(btrfs_multi_bio_size(stripes_allocated),
 				GFP_NOFS);
 		if (!multi)
@@ -2732,18 +2993,17 @@ struct list_head *btrfs_scanned_uuids(void)
 	return &fs_uuids;
 }
 
-static int rmw_eb(struct btrfs_fs_info *info,
-		  struct extent_buffer *eb, struct extent_buffer *orig_eb)
+/*
+ * Copy the part of @orig_eb overlapping the stripe @eb, return the number of
+ * bytes copied.
+ */
+static unsigned long copy_eb_overlap(struct extent_buffer *eb,
+				     const struct extent_buffer *orig_eb)
 {
-	int ret;
 	unsigned long orig_off = 0;
 	unsigned long dest_off = 0;
 	unsigned long copy_len = eb->len;
 
-	ret = read_whole_eb(info, eb, 0);
-	if (ret)
-		return ret;
-
 	if (eb->start + eb->len <= orig_eb->start ||
 	    eb->start >= orig_eb->start + orig_eb->len)
 		return 0;
@@ -2764,18 +3024,20 @@ static int rmw_eb(struct btrfs_fs_info *info,
 		copy_len = eb->len - dest_off;
 
 	memcpy(eb->data + dest_off, orig_eb->data + orig_off, copy_len);
-	return 0;
+	return copy_len;
 }
 
+/*
+ * Fill the data stripes of a full stripe from the @nr_orig non-overlapping
+ * buffers @orig_ebs, the stripes not fully covered by them are read first.
+ */
 static int split_eb_for_raid56(struct btrfs_fs_info *info,
-			       struct extent_buffer *orig_eb,
+			       struct extent_buffer **orig_ebs, int nr_orig,
 			       struct extent_buffer **ebs,
 			       u64 stripe_len, u64 *raid_map,
 			       int num_stripes)
 {
 	struct extent_buffer **tmp_ebs;
-	u64 start = orig_eb->start;
-	u64 this_eb_start;
 	int i;
 	int ret = 0;
 
@@ -2788,7 +3050,7 @@ static int split_eb_for_raid56(struct btrfs_fs_info *info,
 		if (raid_map[i] >= BTRFS_RAID5_P_STRIPE)
 			break;
 
-		tmp_ebs[i] = calloc(1, sizeof(**tmp_ebs) + stripe_len);
+		tmp_ebs[i] = alloc_extent_buffer_inline(stripe_len);
 		if (!tmp_ebs[i]) {
 			ret = -ENOMEM;
 			goto clean_up;
@@ -2797,6 +3059,7 @@ static int split_eb_for_raid56(struct btrfs_fs_info *info,
 
 	for (i = 0; i < num_stripes; i++) {
 		struct extent_buffer *eb = tmp_ebs[i];
+		u64 covered = 0;
 
 		if (raid_map[i] >= BTRFS_RAID5_P_STRIPE)
 			break;
@@ -2807,17 +3070,21 @@ static int split_eb_for_raid56(struct btrfs_fs_info *info,
 		eb->flags = 0;
 		eb->fs_info = info;
 
-		this_eb_start = raid_map[i];
-
-		if (start > this_eb_start ||
-		    start + orig_eb->len < this_eb_start + stripe_len) {
-			ret = rmw_eb(info, eb, orig_eb);
+		for (int j = 0; j < nr_orig; j++) {
+			if (eb->start < orig_ebs[j]->start + orig_ebs[j]->len &&
+			    orig_ebs[j]->start < eb->start + stripe_len)
+				covered += min(eb->start + stripe_len,
+					       orig_ebs[j]->start + orig_ebs[j]->len) -
+					   max(eb->start, orig_ebs[j]->start);
+		}
+		/* Read-modify-write of the stripes written only partially */
+		if (covered < stripe_len) {
+			ret = read_whole_eb(info, eb, 0);
 			if (ret)
 				goto clean_up;
-		} else {
-			memcpy(eb->data, orig_eb->data + eb->start - start,
-			       stripe_len);
 		}
+		for (int j = 0; j < nr_orig; j++)
+			copy_eb_overlap(eb, orig_ebs[j]);
 		ebs[i] = eb;
 	}
 	kfree(tmp_ebs);
@@ -2829,18 +3096,18 @@ clean_up:
 	return ret;
 }
 
-int write_raid56_with_parity(struct btrfs_fs_info *info,
-			     struct extent_buffer *eb,
-			     struct btrfs_multi_bio *multi,
-			     u64 stripe_len, u64 *raid_map)
+static int write_raid56_ebs(struct btrfs_fs_info *info,
+			    struct extent_buffer **orig_ebs, int nr_orig,
+			    struct btrfs_multi_bio *multi,
+			    u64 stripe_len, u64 *raid_map)
 {
 	struct extent_buffer **ebs, *p_eb = NULL, *q_eb = NULL;
 	int i;
 	int ret;
-	int alloc_size = eb->len;
 	void **pointers;
 
-	ebs = kmalloc(sizeof(*ebs) * multi->num_stripes, GFP_KERNEL);
+	raid56_read_cache_drop(info, raid_map[0]);
+	ebs = kzalloc(sizeof(*ebs) * multi->num_stripes, GFP_KERNEL);
 	pointers = kmalloc(sizeof(*pointers) * multi->num_stripes, GFP_KERNEL);
 	if (!ebs || !pointers) {
 		kfree(ebs);
@@ -2848,11 +3115,8 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 		return -ENOMEM;
 	}
 
-	if (stripe_len > alloc_size)
-		alloc_size = stripe_len;
-
-	ret = split_eb_for_raid56(info, eb, ebs, stripe_len, raid_map,
-				  multi->num_stripes);
+	ret = split_eb_for_raid56(info, orig_ebs, nr_orig, ebs, stripe_len,
+				  raid_map, multi->num_stripes);
 	if (ret)
 		goto out;
 
@@ -2865,7 +3129,7 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 			}
 			continue;
 		}
-		new_eb = kmalloc(sizeof(*eb) + alloc_size, GFP_KERNEL);
+		new_eb = alloc_extent_buffer_inline(stripe_len);
 		if (!new_eb) {
 			ret = -ENOMEM;
 			goto out_free_split;
@@ -2906,10 +3170,8 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 	}
 
 out_free_split:
-	for (i = 0; i < multi->num_stripes; i++) {
-		if (ebs[i] != eb)
-			kfree(ebs[i]);
-	}
+	for (i = 0; i < multi->num_stripes; i++)
+		kfree(ebs[i]);
 out:
 	kfree(ebs);
 	kfree(pointers);
@@ -2917,6 +3179,54 @@ out:
 	return ret;
 }
 
+int write_raid56_with_parity(struct btrfs_fs_info *info,
+			     struct extent_buffer *eb,
+			     struct btrfs_multi_bio *multi,
+			     u64 stripe_len, u64 *raid_map)
+{
+	return write_raid56_ebs(info, &eb, 1, multi, stripe_len, raid_map);
+}
+
+/*
+ * Write the @nr tree blocks @ebs of one RAID56 full stripe together with the
+ * parity, the data stripes fully covered by the blocks are not read.
+ */
+int write_raid56_full_stripe(struct btrfs_fs_info *info,
+			     struct extent_buffer **ebs, int nr)
+{
+	struct btrfs_multi_bio *multi = NULL;
+	u64 *raid_map = NULL;
+	u64 stripe_len = ebs[0]->len;
+	u64 full_stripe_end;
+	int nr_data = 0;
+	int ret;
+
+	ret = btrfs_map_block(info, WRITE, ebs[0]->start, &stripe_len, &multi,
+			      0, &raid_map);
+	if (ret)
+		return -EIO;
+	if (!raid_map) {
+		ret = -EINVAL;
+		goto out;
+	}
+	while (nr_data < multi->num_stripes &&
+	       raid_map[nr_data] < BTRFS_RAID5_P_STRIPE)
+		nr_data++;
+	full_stripe_end = raid_map[0] + nr_data * stripe_len;
+	for (int i = 0; i < nr; i++) {
+		if (ebs[i]->start < raid_map[0] ||
+		    ebs[i]->start + ebs[i]->len > full_stripe_end) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+	ret = write_raid56_ebs(info, ebs, nr, multi, stripe_len, raid_map);
+out:
+	kfree(multi);
+	kfree(raid_map);
+	return ret;
+}
+
 /*
  * Get stripe length from chunk item and its stripe items
  *
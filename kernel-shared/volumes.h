@@ -40,11 +40,22 @@ struct btrfs_device {
 	struct btrfs_fs_info *fs_info;
 
 	u64 total_ios;
+	/* Reads from the device, see btrfs_device_account_read() */
+	u64 read_ios;
+	u64 read_bytes;
+	/* For the read policy, see btrfs_device_read_start() */
+	u32 reads_inflight;
+	u64 read_latency_ns;
 
 	int fd;
 
 	int writeable;
 
+	/* Read-only private mapping of the whole device, for OPEN_CTREE_MMAP */
+	char *map;
+	u64 map_size;
+	bool map_failed;
+
 	char *name;
 
 	/* these are read off the super block, only in the progs */
@@ -81,6 +92,22 @@ struct btrfs_device {
 	u8 uuid[BTRFS_UUID_SIZE];
 };
 
+/* How the mirror to read first is picked, see btrfs_read_mirror() */
+enum btrfs_read_policy {
+	/* The first mirror, the other ones only on errors */
+	BTRFS_READ_POLICY_FIRST,
+	/* Alternate the mirrors by the stripe number */
+	BTRFS_READ_POLICY_ROUND_ROBIN,
+	/* The device with the fewest reads in flight */
+	BTRFS_READ_POLICY_QUEUE,
+	/* The device with the lowest average read latency */
+	BTRFS_READ_POLICY_LATENCY,
+	BTRFS_NR_READ_POLICY,
+};
+
+/* Environment variable selecting the read policy for all tools */
+#define BTRFS_READ_POLICY_ENV	"BTRFS_READ_POLICY"
+
 enum btrfs_chunk_allocation_policy {
 	BTRFS_CHUNK_ALLOC_REGULAR,
 	BTRFS_CHUNK_ALLOC_ZONED,
@@ -248,6 +275,20 @@ static inline u64 calc_stripe_length(u64 type, u64 length, int num_stripes)
 	return stripe_size;
 }
 
+/* Data can be read by several threads, e.g. by check --check-data-csum */
+static inline void btrfs_device_account_read(struct btrfs_device *device,
+					     u64 bytes)
+{
+	__atomic_add_fetch(&device->read_ios, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&device->read_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+int btrfs_set_read_policy(const char *name);
+enum btrfs_read_policy btrfs_get_read_policy(void);
+int btrfs_read_mirror(struct btrfs_fs_info *fs_info, u64 logical);
+u64 btrfs_device_read_start(struct btrfs_device *device);
+void btrfs_device_read_end(struct btrfs_device *device, u64 start_ns);
+
 int __btrfs_map_block(struct btrfs_fs_info *fs_info, int rw,
 		      u64 logical, u64 *length, u64 *type,
 		      struct btrfs_multi_bio **multi_ret, int mirror_num,
@@ -256,6 +297,9 @@ int btrfs_map_block(struct btrfs_fs_info *fs_info, int rw,
 		    u64 logical, u64 *length,
 		    struct btrfs_multi_bio **multi_ret, int mirror_num,
 		    u64 **raid_map_ret);
+int btrfs_map_block_stripe(struct btrfs_fs_info *fs_info, u64 logical,
+			   u64 *length, u64 *type, int mirror_num,
+			   struct btrfs_bio_stripe *stripe);
 int btrfs_next_bg(struct btrfs_fs_info *map_tree, u64 *logical,
 		     u64 *size, u64 type);
 static inline int btrfs_next_bg_metadata(struct btrfs_fs_info *fs_info,
@@ -283,6 +327,7 @@ int btrfs_alloc_data_chunk(struct btrfs_trans_handle *trans,
 int btrfs_open_devices(struct btrfs_fs_info *fs_info,
 		       struct btrfs_fs_devices *fs_devices, int flags);
 int btrfs_close_devices(struct btrfs_fs_devices *fs_devices);
+char *btrfs_device_map(struct btrfs_device *device);
 void btrfs_close_all_devices(void);
 int btrfs_insert_dev_extent(struct btrfs_trans_handle *trans,
 			    struct btrfs_device *device,
@@ -295,6 +340,9 @@ int btrfs_update_device(struct btrfs_trans_handle *trans,
 int btrfs_scan_one_device(int fd, const char *path,
 			  struct btrfs_fs_devices **fs_devices_ret,
 			  u64 *total_devs, u64 super_offset, unsigned sbflags);
+int btrfs_scan_one_super(const char *path, struct btrfs_super_block *disk_super,
+			 struct btrfs_fs_devices **fs_devices_ret,
+			 u64 *total_devs);
 int btrfs_num_copies(struct btrfs_fs_info *fs_info, u64 logical, u64 len);
 struct list_head *btrfs_scanned_uuids(void);
 int btrfs_add_system_chunk(struct btrfs_fs_info *fs_info, struct btrfs_key *key,
@@ -309,6 +357,8 @@ int write_raid56_with_parity(struct btrfs_fs_info *info,
 			     struct extent_buffer *eb,
 			     struct btrfs_multi_bio *multi,
 			     u64 stripe_len, u64 *raid_map);
+int write_raid56_full_stripe(struct btrfs_fs_info *info,
+			     struct extent_buffer **ebs, int nr);
 u64 btrfs_stripe_length(struct btrfs_fs_info *fs_info,
 			struct extent_buffer *leaf,
 			struct btrfs_chunk *chunk);
@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include "kernel-lib/list.h"
 #include "kernel-lib/bitmap.h"
 #include "kernel-shared/volumes.h"
@@ -38,8 +39,10 @@
 #include "common/messages.h"
 #include "mkfs/common.h"
 
-/* Maximum number of zones to report per ioctl(BLKREPORTZONE) call */
+/* Zones reported per ioctl(BLKREPORTZONE) call when loaded on demand */
 #define BTRFS_REPORT_NR_ZONES  		4096
+/* Zones reported per ioctl(BLKREPORTZONE) call when loading all zones */
+#define BTRFS_REPORT_NR_ZONES_ALL	65536
 /* Invalid allocation pointer value for missing devices */
 #define WP_MISSING_DEV			((u64)-1)
 /* Pseudo write pointer value for conventional zone */
@@ -68,8 +71,6 @@ static u64 emulated_zone_size = DEFAULT_EMULATED_ZONE_SIZE;
  */
 #define BTRFS_MIN_ACTIVE_ZONES		(BTRFS_SUPER_MIRROR_MAX + 5)
 
-static int btrfs_get_dev_zone_info(struct btrfs_device *device);
-
 enum btrfs_zoned_model zoned_model(const char *file)
 {
 	const char host_aware[] = "host-aware";
@@ -286,17 +287,128 @@ int btrfs_reset_dev_zone(int fd, struct blk_zone *zone)
 	return 0;
 }
 
+/*
+ * Report @nr zones starting at zone number @first from the device into the
+ * zone array, with up to @batch zones per ioctl. Zones that were already loaded
+ * are reported again.
+ */
+static void load_zones(struct btrfs_zoned_device_info *zinfo, u32 first, u32 nr,
+		       unsigned int batch)
+{
+	const u64 zone_sectors = zinfo->zone_size >> SECTOR_SHIFT;
+	const u32 end = first + nr;
+	size_t rep_size;
+	u64 sector = (u64)first * zone_sectors;
+	struct blk_zone_report *rep;
+	struct blk_zone *zone;
+	unsigned int i;
+	int ret;
+
+	batch = min(batch, nr);
+	rep_size = sizeof(struct blk_zone_report) + sizeof(struct blk_zone) * batch;
+	rep = kmalloc(rep_size, GFP_KERNEL);
+	if (!rep) {
+		error_msg(ERROR_MSG_MEMORY, "zone report");
+		exit(1);
+	}
+
+	zone = (struct blk_zone *)(rep + 1);
+	while (sector < (u64)end * zone_sectors) {
+		memset(rep, 0, rep_size);
+		rep->sector = sector;
+		rep->nr_zones = min_t(u64, batch, end - sector / zone_sectors);
+
+		if (!zinfo->emulated) {
+			ret = ioctl(zinfo->fd, BLKREPORTZONE, rep);
+			if (ret != 0) {
+				error("zoned: ioctl BLKREPORTZONE failed (%m)");
+				exit(1);
+			}
+		} else {
+			ret = emulate_report_zones(zinfo->file, zinfo->fd,
+						   sector << SECTOR_SHIFT,
+						   zone, rep->nr_zones);
+			if (ret < 0) {
+				error("zoned: failed to emulate BLKREPORTZONE");
+				exit(1);
+			}
+			rep->nr_zones = ret;
+		}
+
+		if (!rep->nr_zones)
+			break;
+
+		for (i = 0; i < rep->nr_zones; i++) {
+			const u64 zno = zone[i].start / zone_sectors;
+
+			if (zno >= end)
+				break;
+			memcpy(&zinfo->zones[zno], &zone[i], sizeof(struct blk_zone));
+			switch (zone[i].cond) {
+			case BLK_ZONE_COND_IMP_OPEN:
+			case BLK_ZONE_COND_EXP_OPEN:
+			case BLK_ZONE_COND_CLOSED:
+				set_bit(zno, zinfo->active_zones);
+				break;
+			default:
+				clear_bit(zno, zinfo->active_zones);
+				break;
+			}
+		}
+
+		sector = zone[rep->nr_zones - 1].start +
+			 zone[rep->nr_zones - 1].len;
+	}
+
+	/* Zones past the end of the report stay zeroed, as conventional */
+	for (u32 zno = first; zno < end; zno++)
+		set_bit(zno, zinfo->zones_loaded);
+
+	kfree(rep);
+}
+
+/*
+ * Return the zone @zno of the device, reporting it and its neighbours from the
+ * device on the first access. Loading is not thread safe, callers processing
+ * zones in parallel must use btrfs_load_all_zones() first.
+ */
+struct blk_zone *btrfs_get_zone(struct btrfs_zoned_device_info *zinfo, u32 zno)
+{
+	ASSERT(zno < zinfo->nr_zones);
+
+	if (!test_bit(zno, zinfo->zones_loaded)) {
+		const u32 first = round_down(zno, BTRFS_REPORT_NR_ZONES);
+
+		load_zones(zinfo, first,
+			   min_t(u32, BTRFS_REPORT_NR_ZONES, zinfo->nr_zones - first),
+			   BTRFS_REPORT_NR_ZONES);
+	}
+	return &zinfo->zones[zno];
+}
+
+/* Make sure all zones of the device are loaded, eg. before a full scan */
+void btrfs_load_all_zones(struct btrfs_zoned_device_info *zinfo)
+{
+	u32 first;
+
+	first = find_first_zero_bit(zinfo->zones_loaded, zinfo->nr_zones);
+	if (first < zinfo->nr_zones)
+		load_zones(zinfo, first, zinfo->nr_zones - first,
+			   BTRFS_REPORT_NR_ZONES_ALL);
+}
+
+/*
+ * Read the zone geometry of the device. The zones themselves are reported on
+ * first access, except for devices with limited active zones where the active
+ * zones need to be counted up front.
+ */
 static int report_zones(int fd, const char *file,
 			struct btrfs_zoned_device_info *zinfo)
 {
 	u64 device_size;
 	u64 zone_bytes = zone_size(file);
-	size_t rep_size;
-	u64 sector = 0;
 	struct stat st;
-	struct blk_zone_report *rep;
-	struct blk_zone *zone;
-	unsigned int i, nreported = 0, nactive = 0;
+	unsigned int i, nactive = 0;
 	unsigned int max_active_zones;
 	int ret;
 
@@ -360,6 +472,12 @@ static int report_zones(int fd, const char *file,
 		exit(1);
 	}
 
+	zinfo->zones_loaded = bitmap_zalloc(zinfo->nr_zones);
+	if (!zinfo->zones_loaded) {
+		error_msg(ERROR_MSG_MEMORY, "zone information");
+		exit(1);
+	}
+
 	zinfo->active_zones = bitmap_zalloc(zinfo->nr_zones);
 	if (!zinfo->active_zones) {
 		error_msg(ERROR_MSG_MEMORY, "active zone bitmap");
@@ -374,66 +492,20 @@ static int report_zones(int fd, const char *file,
 	}
 	zinfo->max_active_zones = max_active_zones;
 
-	/* Allocate a zone report */
-	rep_size = sizeof(struct blk_zone_report) +
-		   sizeof(struct blk_zone) * BTRFS_REPORT_NR_ZONES;
-	rep = kmalloc(rep_size, GFP_KERNEL);
-	if (!rep) {
-		error_msg(ERROR_MSG_MEMORY, "zone report");
+	zinfo->emulated = (zinfo->model == ZONED_NONE);
+	zinfo->fd = fd;
+	zinfo->file = strdup(file);
+	if (!zinfo->file) {
+		error_msg(ERROR_MSG_MEMORY, "zone information");
 		exit(1);
 	}
 
-	/* Get zone information */
-	zone = (struct blk_zone *)(rep + 1);
-	while (nreported < zinfo->nr_zones) {
-		memset(rep, 0, rep_size);
-		rep->sector = sector;
-		rep->nr_zones = BTRFS_REPORT_NR_ZONES;
-
-		if (zinfo->model != ZONED_NONE) {
-			ret = ioctl(fd, BLKREPORTZONE, rep);
-			if (ret != 0) {
-				error("zoned: ioctl BLKREPORTZONE failed (%m)");
-				exit(1);
-			}
-			zinfo->emulated = false;
-		} else {
-			ret = emulate_report_zones(file, fd,
-						   sector << SECTOR_SHIFT,
-						   zone, BTRFS_REPORT_NR_ZONES);
-			if (ret < 0) {
-				error("zoned: failed to emulate BLKREPORTZONE");
-				exit(1);
-			}
-			zinfo->emulated = true;
-		}
-
-		if (!rep->nr_zones)
-			break;
-
-		for (i = 0; i < rep->nr_zones; i++) {
-			if (nreported >= zinfo->nr_zones)
-				break;
-			memcpy(&zinfo->zones[nreported], &zone[i],
-			       sizeof(struct blk_zone));
-			switch (zone[i].cond) {
-			case BLK_ZONE_COND_EMPTY:
-				break;
-			case BLK_ZONE_COND_IMP_OPEN:
-			case BLK_ZONE_COND_EXP_OPEN:
-			case BLK_ZONE_COND_CLOSED:
-				set_bit(nreported, zinfo->active_zones);
+	if (max_active_zones) {
+		btrfs_load_all_zones(zinfo);
+		for (i = 0; i < zinfo->nr_zones; i++) {
+			if (test_bit(i, zinfo->active_zones))
 				nactive++;
-				break;
-			}
-			nreported++;
 		}
-
-		sector = zone[rep->nr_zones - 1].start +
-			 zone[rep->nr_zones - 1].len;
-	}
-
-	if (max_active_zones) {
 		if (nactive > max_active_zones) {
 			error("zoned: %u active zones on %s exceeds max_active_zones %u",
 			      nactive, file, max_active_zones);
@@ -442,49 +514,58 @@ static int report_zones(int fd, const char *file,
 		zinfo->active_zones_left = max_active_zones - nactive;
 	}
 
-	kfree(rep);
-
 	return 0;
 }
 
+static int reset_one_zone(int fd, u64 index, void *priv, u64 *bytes)
+{
+	struct btrfs_zoned_device_info *zinfo = priv;
+	struct blk_zone *zone = btrfs_get_zone(zinfo, index);
+	int ret;
+
+	if (zone->type == BLK_ZONE_TYPE_CONVENTIONAL) {
+		ret = device_discard_blocks(fd, zone->start << SECTOR_SHIFT,
+					    zinfo->zone_size, NULL);
+		if (ret == EOPNOTSUPP)
+			ret = 0;
+	} else if (zone->cond != BLK_ZONE_COND_EMPTY) {
+		ret = btrfs_reset_dev_zone(fd, zone);
+	} else {
+		ret = 0;
+	}
+	if (!ret)
+		*bytes = zinfo->zone_size;
+	return ret;
+}
+
 /*
  * Discard blocks in the zones of a zoned block device. Process this with zone
  * size granularity so that blocks in conventional zones are discarded using
  * discard_range and blocks in sequential zones are reset though a zone reset.
+ * The zones are processed in parallel, see device_process_ranges().
  *
  * We need to ensure that zones outside of the fs are not active, so that the fs
  * can use all the active zones. Return EBUSY if there is an active zone.
  */
-int btrfs_reset_zones(int fd, struct btrfs_zoned_device_info *zinfo, u64 byte_count)
+int btrfs_reset_zones(int fd, struct btrfs_zoned_device_info *zinfo, u64 byte_count,
+		      const char *progress)
 {
 	unsigned int i;
-	int ret = 0;
+	int ret;
 
 	ASSERT(zinfo);
 	ASSERT(IS_ALIGNED(byte_count, zinfo->zone_size));
 
-	/* Zone size granularity */
-	for (i = 0; i < zinfo->nr_zones; i++) {
-		if (byte_count == 0)
-			break;
+	/* The zones are reset in parallel and all of them are checked */
+	btrfs_load_all_zones(zinfo);
 
-		if (zinfo->zones[i].type == BLK_ZONE_TYPE_CONVENTIONAL) {
-			ret = device_discard_blocks(fd,
-					     zinfo->zones[i].start << SECTOR_SHIFT,
-					     zinfo->zone_size);
-			if (ret == EOPNOTSUPP)
-				ret = 0;
-		} else if (zinfo->zones[i].cond != BLK_ZONE_COND_EMPTY) {
-			ret = btrfs_reset_dev_zone(fd, &zinfo->zones[i]);
-		} else {
-			ret = 0;
-		}
-
-		if (ret)
-			return ret;
+	/* Zone size granularity */
+	i = min_t(u64, zinfo->nr_zones, byte_count / zinfo->zone_size);
+	ret = device_process_ranges(fd, i, (u64)i * zinfo->zone_size,
+				    reset_one_zone, zinfo, progress);
+	if (ret)
+		return ret;
 
-		byte_count -= zinfo->zone_size;
-	}
 	for (; i < zinfo->nr_zones; i++) {
 		const enum blk_zone_cond cond = zinfo->zones[i].cond;
 
@@ -922,7 +1003,8 @@ static int btrfs_load_zone_info(struct btrfs_fs_info *fs_info, int zone_idx,
 	 * pointer to determine the allocation offset within the zone.
 	 */
 	WARN_ON(!IS_ALIGNED(info->physical, fs_info->zone_size));
-	zone = device->zone_info->zones[info->physical / fs_info->zone_size];
+	zone = *btrfs_get_zone(device->zone_info,
+			       info->physical / fs_info->zone_size);
 
 	if (zone.type == BLK_ZONE_TYPE_CONVENTIONAL) {
 		error("zoned: unexpected conventional zone %llu on device %s (devid %llu)",
@@ -1332,7 +1414,7 @@ int btrfs_reset_chunk_zones(struct btrfs_fs_info *fs_info, u64 devid,
 		if (!zone_is_sequential(zinfo, offset))
 			continue;
 
-		reset = &zinfo->zones[offset / zinfo->zone_size];
+		reset = btrfs_get_zone(zinfo, offset / zinfo->zone_size);
 		if (btrfs_reset_dev_zone(device->fd, reset)) {
 			error("zoned: failed to reset zone %llu: %m",
 			      offset / zinfo->zone_size);
@@ -1355,7 +1437,7 @@ int btrfs_wipe_temporary_sb(struct btrfs_fs_devices *fs_devices)
 		if (!zinfo)
 			continue;
 
-		ret = btrfs_reset_dev_zone(dev->fd, &zinfo->zones[0]);
+		ret = btrfs_reset_dev_zone(dev->fd, btrfs_get_zone(zinfo, 0));
 		if (ret)
 			break;
 	}
@@ -1373,10 +1455,30 @@ bool btrfs_sb_zone_exists(struct btrfs_device *device, u64 bytenr)
 
 #endif
 
+struct zone_info_thread {
+	struct btrfs_device *device;
+	pthread_t tid;
+	bool started;
+	int ret;
+};
+
+static void *get_dev_zone_info_thread(void *arg)
+{
+	struct zone_info_thread *thread = arg;
+	struct btrfs_device *device = thread->device;
+
+	thread->ret = btrfs_get_zone_info(device->fd, device->name,
+					  &device->zone_info);
+	return NULL;
+}
+
 int btrfs_get_dev_zone_info_all_devices(struct btrfs_fs_info *fs_info)
 {
 	struct btrfs_fs_devices *fs_devices = fs_info->fs_devices;
 	struct btrfs_device *device;
+	struct zone_info_thread *threads;
+	int nr_devices = 0;
+	int nr_threads = 0;
 	int ret = 0;
 
 	/* fs_info->zone_size might not set yet. Use the incomapt flag here. */
@@ -1385,40 +1487,47 @@ int btrfs_get_dev_zone_info_all_devices(struct btrfs_fs_info *fs_info)
 
 	list_for_each_entry(device, &fs_devices->devices, dev_list) {
 		/* We can skip reading of zone info for missing devices */
-		if (device->fd == -1)
+		if (device->fd == -1 || device->zone_info)
 			continue;
-
-		ret = btrfs_get_dev_zone_info(device);
-		if (ret)
-			break;
+		nr_devices++;
 	}
-
-	return ret;
-}
-
-static int btrfs_get_dev_zone_info(struct btrfs_device *device)
-{
-	struct btrfs_fs_info *fs_info = device->fs_info;
-	int ret;
+	if (!nr_devices)
+		return 0;
 
 	/*
-	 * Cannot use btrfs_is_zoned here, since fs_info::zone_size might not
-	 * yet be set.
+	 * Devices that need all zones up front for the active zone accounting
+	 * are reported concurrently, the rest is cheap as zones load on demand.
 	 */
-	if (!btrfs_fs_incompat(fs_info, ZONED))
-		return 0;
-
-	if (device->zone_info)
-		return 0;
-
-	ret = btrfs_get_zone_info(device->fd, device->name, &device->zone_info);
-	if (ret)
-		return ret;
-
-	if (device->zone_info->max_active_zones)
-		fs_info->active_zone_tracking = 1;
+	threads = calloc(nr_devices, sizeof(*threads));
+	if (!threads) {
+		error_msg(ERROR_MSG_MEMORY, "zone information");
+		return -ENOMEM;
+	}
+	list_for_each_entry(device, &fs_devices->devices, dev_list) {
+		if (device->fd == -1 || device->zone_info)
+			continue;
+		threads[nr_threads].device = device;
+		if (nr_devices == 1 ||
+		    pthread_create(&threads[nr_threads].tid, NULL,
+				   get_dev_zone_info_thread, &threads[nr_threads])) {
+			get_dev_zone_info_thread(&threads[nr_threads]);
+		} else {
+			threads[nr_threads].started = true;
+		}
+		nr_threads++;
+	}
+	for (int i = 0; i < nr_threads; i++) {
+		if (threads[i].started)
+			pthread_join(threads[i].tid, NULL);
+		if (threads[i].ret && !ret)
+			ret = threads[i].ret;
+		if (threads[i].device->zone_info &&
+		    threads[i].device->zone_info->max_active_zones)
+			fs_info->active_zone_tracking = 1;
+	}
+	free(threads);
 
-	return 0;
+	return ret;
 }
 
 int btrfs_get_zone_info(int fd, const char *file,
@@ -1447,7 +1556,7 @@ int btrfs_get_zone_info(int fd, const char *file,
 	/* Get zone information */
 	ret = report_zones(fd, file, zinfo);
 	if (ret != 0) {
-		kfree(zinfo);
+		btrfs_free_zone_info(zinfo);
 		return ret;
 	}
 	*zinfo_ret = zinfo;
@@ -1464,6 +1573,17 @@ int btrfs_get_zone_info(int fd, const char *file,
 	return 0;
 }
 
+void btrfs_free_zone_info(struct btrfs_zoned_device_info *zinfo)
+{
+	if (!zinfo)
+		return;
+	free(zinfo->zones);
+	free(zinfo->zones_loaded);
+	free(zinfo->active_zones);
+	free(zinfo->file);
+	free(zinfo);
+}
+
 int btrfs_check_zoned_mode(struct btrfs_fs_info *fs_info)
 {
 	struct btrfs_fs_devices *fs_devices = fs_info->fs_devices;
@@ -73,21 +73,30 @@ struct btrfs_zoned_device_info {
 	u64			zone_size;
 	u32			nr_zones;
 	unsigned int            max_active_zones;
+	/* Use btrfs_get_zone(), the zones are reported from the device on demand */
 	struct blk_zone		*zones;
+	/* Zones already reported, cached for the life of the zone info */
+	unsigned long		*zones_loaded;
 	atomic_t                active_zones_left;
 	unsigned long           *active_zones;
 	bool			emulated;
+	/* The device to report the zones from */
+	int			fd;
+	char			*file;
 };
 
 enum btrfs_zoned_model zoned_model(const char *file);
 u64 zone_size(const char *file);
 int btrfs_get_zone_info(int fd, const char *file,
 			struct btrfs_zoned_device_info **zinfo);
+void btrfs_free_zone_info(struct btrfs_zoned_device_info *zinfo);
 int btrfs_get_dev_zone_info_all_devices(struct btrfs_fs_info *fs_info);
 int btrfs_check_zoned_mode(struct btrfs_fs_info *fs_info);
 
 #ifdef BTRFS_ZONED
 size_t btrfs_sb_io(int fd, void *buf, off_t offset, int rw);
+struct blk_zone *btrfs_get_zone(struct btrfs_zoned_device_info *zinfo, u32 zno);
+void btrfs_load_all_zones(struct btrfs_zoned_device_info *zinfo);
 
 /*
  * Read BTRFS_SUPER_INFO_SIZE bytes from fd to buf
@@ -126,7 +135,7 @@ static inline bool zone_is_sequential(struct btrfs_zoned_device_info *zinfo,
 		return false;
 
 	zno = bytenr / zinfo->zone_size;
-	return zinfo->zones[zno].type == BLK_ZONE_TYPE_SEQWRITE_REQ;
+	return btrfs_get_zone(zinfo, zno)->type == BLK_ZONE_TYPE_SEQWRITE_REQ;
 }
 
 static inline bool btrfs_dev_is_empty_zone(struct btrfs_device *device, u64 pos)
@@ -138,7 +147,7 @@ static inline bool btrfs_dev_is_empty_zone(struct btrfs_device *device, u64 pos)
 		return true;
 
 	zno = pos / zinfo->zone_size;
-	return zinfo->zones[zno].cond == BLK_ZONE_COND_EMPTY;
+	return btrfs_get_zone(zinfo, zno)->cond == BLK_ZONE_COND_EMPTY;
 }
 
 bool zoned_profile_supported(u64 map_type, bool rst);
@@ -151,7 +160,8 @@ bool btrfs_redirty_extent_buffer_for_zoned(struct btrfs_fs_info *fs_info,
 					   u64 start, u64 end);
 int btrfs_reset_chunk_zones(struct btrfs_fs_info *fs_info, u64 devid,
 			    u64 offset, u64 length);
-int btrfs_reset_zones(int fd, struct btrfs_zoned_device_info *zinfo, u64 byte_count);
+int btrfs_reset_zones(int fd, struct btrfs_zoned_device_info *zinfo, u64 byte_count,
+		      const char *progress);
 int zero_zone_blocks(int fd, struct btrfs_zoned_device_info *zinfo, off_t start,
 		     size_t len);
 int btrfs_wipe_temporary_sb(struct btrfs_fs_devices *fs_devices);
@@ -205,7 +215,8 @@ static inline int btrfs_reset_chunk_zones(struct btrfs_fs_info *fs_info,
 	return 0;
 }
 
-static inline int btrfs_reset_zones(int fd, struct btrfs_zoned_device_info *zinfo, u64 byte_count)
+static inline int btrfs_reset_zones(int fd, struct btrfs_zoned_device_info *zinfo, u64 byte_count,
+				    const char *progress)
 {
 	return -EOPNOTSUPP;
 }
@@ -26,8 +26,8 @@
 #include <sys/time.h>
 
 #define BTRFS_UTIL_VERSION_MAJOR 1
-#define BTRFS_UTIL_VERSION_MINOR 3
-#define BTRFS_UTIL_VERSION_PATCH 2
+#define BTRFS_UTIL_VERSION_MINOR 8
+#define BTRFS_UTIL_VERSION_PATCH 0
 
 #ifdef __cplusplus
 extern "C" {
@@ -69,6 +69,8 @@ enum btrfs_util_error {
 	BTRFS_UTIL_ERROR_GET_SUBVOL_ROOTREF_FAILED,
 	BTRFS_UTIL_ERROR_INO_LOOKUP_USER_FAILED,
 	BTRFS_UTIL_ERROR_FS_INFO_FAILED,
+	BTRFS_UTIL_ERROR_SYNC_NOTIFIER_FAILED,
+	BTRFS_UTIL_ERROR_BUFFER_TOO_SMALL,
 };
 
 /**
@@ -159,6 +161,111 @@ enum btrfs_util_error btrfs_util_wait_sync_fd(int fd, uint64_t transid);
 enum btrfs_util_error btrfs_util_fs_wait_sync_fd(int fd, uint64_t transid)
 LIBBTRFSUTIL_ALIAS(btrfs_util_wait_sync_fd);
 
+struct btrfs_util_sync_notifier;
+
+/**
+ * struct btrfs_util_sync_event - Result of a wait for a transaction added to a
+ * sync notifier, see btrfs_util_sync_notifier_read().
+ */
+struct btrfs_util_sync_event {
+	/** @transid: Transaction ID passed to btrfs_util_sync_notifier_add(). */
+	uint64_t transid;
+
+	/**
+	 * @error: %BTRFS_UTIL_OK if the transaction is committed,
+	 * %BTRFS_UTIL_ERROR_WAIT_SYNC_FAILED if the wait failed.
+	 */
+	enum btrfs_util_error error;
+
+	/** @errnum: The errno of the failed wait, zero otherwise. */
+	int errnum;
+};
+
+/**
+ * btrfs_util_sync_notifier_create() - Create a notifier of transaction commits
+ * for an event loop.
+ * @path: Path on a Btrfs filesystem.
+ * @nr_threads: Number of threads waiting for the transactions, at most 64, or
+ * zero for the default of 4.
+ * @ret: Returned notifier.
+ *
+ * The transactions added by btrfs_util_sync_notifier_add() are waited for by
+ * the internal threads of the notifier, so the caller does not block in
+ * btrfs_util_fs_wait_sync().  The file descriptor returned by
+ * btrfs_util_sync_notifier_get_fd() becomes readable when there are results,
+ * which are read by btrfs_util_sync_notifier_read().
+ *
+ * The transactions are committed in order, a committed transaction completes
+ * all the added ones with a lower or equal ID, so a thread usually waits for
+ * many of them.  The threads are needed only for the failures and the IDs
+ * added while they're blocked in the kernel.
+ *
+ * Return: %BTRFS_UTIL_OK on success, non-zero error code on failure.
+ */
+enum btrfs_util_error btrfs_util_sync_notifier_create(const char *path,
+						      unsigned int nr_threads,
+						      struct btrfs_util_sync_notifier **ret);
+
+/**
+ * btrfs_util_sync_notifier_create_fd() - See btrfs_util_sync_notifier_create().
+ *
+ * The file descriptor is duplicated, the caller can close it.
+ */
+enum btrfs_util_error btrfs_util_sync_notifier_create_fd(int fd,
+							 unsigned int nr_threads,
+							 struct btrfs_util_sync_notifier **ret);
+
+/**
+ * btrfs_util_sync_notifier_get_fd() - Get the file descriptor to poll for the
+ * results of a sync notifier.
+ * @notifier: Notifier returned by btrfs_util_sync_notifier_create().
+ *
+ * The descriptor is readable (POLLIN) while there are results not read by
+ * btrfs_util_sync_notifier_read().  It must not be read or closed by the
+ * caller.
+ *
+ * Return: File descriptor.
+ */
+int btrfs_util_sync_notifier_get_fd(const struct btrfs_util_sync_notifier *notifier);
+
+/**
+ * btrfs_util_sync_notifier_add() - Add a transaction to wait for.
+ * @notifier: Notifier returned by btrfs_util_sync_notifier_create().
+ * @transid: Transaction ID, e.g. from btrfs_util_fs_start_sync(), zero is not
+ * accepted.
+ *
+ * Each added transaction gets one result, also if the same ID is added more
+ * times.  A transaction known to be committed already is completed right away.
+ *
+ * Return: %BTRFS_UTIL_OK on success, non-zero error code on failure.
+ */
+enum btrfs_util_error btrfs_util_sync_notifier_add(struct btrfs_util_sync_notifier *notifier,
+						   uint64_t transid);
+
+/**
+ * btrfs_util_sync_notifier_read() - Read the results of the waits.
+ * @notifier: Notifier returned by btrfs_util_sync_notifier_create().
+ * @events: Array for the results.
+ * @n: Number of entries of @events, returned number of the results read.
+ *
+ * This does not block, zero results are returned if there are none.  The
+ * results are in the order the waits finished.
+ *
+ * Return: %BTRFS_UTIL_OK on success, non-zero error code on failure.
+ */
+enum btrfs_util_error btrfs_util_sync_notifier_read(struct btrfs_util_sync_notifier *notifier,
+						    struct btrfs_util_sync_event *events,
+						    size_t *n);
+
+/**
+ * btrfs_util_sync_notifier_destroy() - Destroy a sync notifier.
+ * @notifier: Notifier returned by btrfs_util_sync_notifier_create(), or %NULL.
+ *
+ * The results not read are dropped.  This does not wait for the threads
+ * blocked in the kernel, they exit when their transaction is committed.
+ */
+void btrfs_util_sync_notifier_destroy(struct btrfs_util_sync_notifier *notifier);
+
 /**
  * btrfs_util_is_subvolume() - Alias of btrfs_util_subvolume_is_valid(), do not use in new code.
  */
@@ -368,6 +475,37 @@ enum btrfs_util_error btrfs_util_subvolume_get_info_fd(int fd, uint64_t id,
 						       struct btrfs_util_subvolume_info *subvol)
 LIBBTRFSUTIL_ALIAS(btrfs_util_subvolume_info_fd);
 
+/**
+ * btrfs_util_subvolume_get_info_many() - Get information about many
+ * subvolumes.
+ * @path: Path in a Btrfs filesystem. This may be any path in the filesystem.
+ * @ids: Array of IDs of the subvolumes, in any order.
+ * @n: Number of IDs in the @ids array.
+ * @subvols: Returned information about the subvolume of each ID, an array of
+ * @n entries. The entry of a subvolume that does not exist has an ID of zero.
+ *
+ * This is faster than btrfs_util_subvolume_get_info() for each ID, the root
+ * items and references of all the subvolumes are read together by a few tree
+ * searches over the sorted IDs.
+ *
+ * This requires appropriate privilege (CAP_SYS_ADMIN).
+ *
+ * Return: %BTRFS_UTIL_OK on success, non-zero error code on failure.
+ */
+enum btrfs_util_error btrfs_util_subvolume_get_info_many(const char *path,
+							 const uint64_t *ids,
+							 size_t n,
+							 struct btrfs_util_subvolume_info *subvols);
+
+/**
+ * btrfs_util_subvolume_get_info_many_fd() - See
+ * btrfs_util_subvolume_get_info_many().
+ */
+enum btrfs_util_error btrfs_util_subvolume_get_info_many_fd(int fd,
+							    const uint64_t *ids,
+							    size_t n,
+							    struct btrfs_util_subvolume_info *subvols);
+
 /**
  * btrfs_util_get_subvolume_read_only() - Alias of btrfs_util_subvolume_get_read_only(), do not use in new code.
  */
@@ -620,6 +758,29 @@ enum btrfs_util_error btrfs_util_subvolume_snapshot_fd2(int fd, int parent_fd,
 							struct btrfs_util_qgroup_inherit *qgroup_inherit)
 LIBBTRFSUTIL_ALIAS(btrfs_util_create_snapshot_fd2);
 
+/**
+ * btrfs_util_subvolume_snapshot_many() - Create many snapshots.
+ * @sources: Array of paths of the existing subvolumes to snapshot.
+ * @paths: Array of paths where to create the snapshot of each source.
+ * @n: Number of snapshots.
+ * @flags: See btrfs_util_subvolume_snapshot().
+ * @qgroup_inherit: See btrfs_util_subvolume_snapshot().
+ * @errors: Optional array of @n returned results of each snapshot.
+ *
+ * The snapshots are created one after another, a failed snapshot does not stop
+ * the others. The kernel commits the transaction of each snapshot before it
+ * returns, the snapshots created concurrently from several threads are
+ * committed together.
+ *
+ * Return: %BTRFS_UTIL_OK if all the snapshots were created, the error code of
+ * the first failed snapshot otherwise.
+ */
+enum btrfs_util_error btrfs_util_subvolume_snapshot_many(const char * const *sources,
+							 const char * const *paths,
+							 size_t n, int flags,
+							 struct btrfs_util_qgroup_inherit *qgroup_inherit,
+							 enum btrfs_util_error *errors);
+
 /**
  * BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE - Delete subvolumes beneath the given
  * subvolume before attempting to delete the given subvolume.
@@ -629,7 +790,14 @@ LIBBTRFSUTIL_ALIAS(btrfs_util_create_snapshot_fd2);
  * It requires appropriate privilege (CAP_SYS_ADMIN).
  */
 #define BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE	(1U << 0)
-#define BTRFS_UTIL_DELETE_SUBVOLUME_MASK	((1U << 1) - 1)
+/**
+ * BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT - Wait for the transaction commit after
+ * the deletion, once after all of them for btrfs_util_subvolume_delete_many().
+ *
+ * Otherwise the deleted subvolume may appear again after a crash.
+ */
+#define BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT	(1U << 1)
+#define BTRFS_UTIL_DELETE_SUBVOLUME_MASK	((1U << 2) - 1)
 
 /**
  * btrfs_util_delete_subvolume() - Alias of btrfs_util_subvolume_delete(), do not use in new code.
@@ -690,6 +858,37 @@ enum btrfs_util_error btrfs_util_delete_subvolume_by_id_fd(int fd, uint64_t subv
 enum btrfs_util_error btrfs_util_subvolume_delete_by_id_fd(int fd, uint64_t subvolid)
 LIBBTRFSUTIL_ALIAS(btrfs_util_delete_subvolume_by_id_fd);
 
+/**
+ * btrfs_util_subvolume_delete_many() - Delete many subvolumes or snapshots
+ * using their subvolume ids.
+ * @path: Path in a Btrfs filesystem. This may be any path in the filesystem.
+ * @ids: Array of subvolume ids of the subvolumes to delete.
+ * @n: Number of ids in the @ids array.
+ * @flags: Bitmask of BTRFS_UTIL_DELETE_SUBVOLUME_* flags, only
+ * %BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT is supported.
+ * @errors: Optional array of @n returned results of each deletion.
+ *
+ * The subvolumes are deleted one after another, a failed deletion does not stop
+ * the others. With %BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT, the transaction commit
+ * is waited for once at the end.
+ *
+ * Return: %BTRFS_UTIL_OK if all the subvolumes were deleted (and committed),
+ * the error code of the first failure otherwise.
+ */
+enum btrfs_util_error btrfs_util_subvolume_delete_many(const char *path,
+						       const uint64_t *ids,
+						       size_t n, int flags,
+						       enum btrfs_util_error *errors);
+
+/**
+ * btrfs_util_subvolume_delete_many_fd() - See
+ * btrfs_util_subvolume_delete_many().
+ */
+enum btrfs_util_error btrfs_util_subvolume_delete_many_fd(int fd,
+							  const uint64_t *ids,
+							  size_t n, int flags,
+							  enum btrfs_util_error *errors);
+
 struct btrfs_util_subvolume_iterator;
 
 /**
@@ -767,6 +966,26 @@ void btrfs_util_destroy_subvolume_iterator(struct btrfs_util_subvolume_iterator
 void btrfs_util_subvolume_iter_destroy(struct btrfs_util_subvolume_iterator *iter)
 LIBBTRFSUTIL_ALIAS(btrfs_util_destroy_subvolume_iterator);
 
+/**
+ * btrfs_util_subvolume_iter_set_search_buffer_size() - Set the size of the
+ * buffer for the results of the tree searches of a subvolume iterator.
+ * @iter: Iterator to modify.
+ * @size: Size of the buffer in bytes, from 4KiB to 16MiB. The default is 64KiB.
+ *
+ * The privileged iterator reads the subvolume references of each subvolume
+ * with BTRFS_IOC_TREE_SEARCH_V2 (or the v1 ioctl on kernels < 3.15 which can
+ * only use 4KiB). A bigger buffer needs fewer ioctls for subvolumes with many
+ * children, e.g. thousands of snapshots. One buffer is allocated for each
+ * level of nesting of the subvolumes. This has no effect for the unprivileged
+ * iterator.
+ *
+ * This must be called before the first btrfs_util_subvolume_iter_next().
+ *
+ * Return: %BTRFS_UTIL_OK on success, non-zero error code on failure.
+ */
+enum btrfs_util_error btrfs_util_subvolume_iter_set_search_buffer_size(struct btrfs_util_subvolume_iterator *iter,
+								       size_t size);
+
 /**
  * btrfs_util_subvolume_iterator_fd() -Alias of btrfs_util_subvolume_iterator_get_fd(), do not use in new code.
  */
@@ -828,7 +1047,10 @@ enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(struct btrfs_util_
  * @subvol: Returned subvolume information.
  *
  * This convenience function basically combines
- * btrfs_util_subvolume_iter_next() and btrfs_util_subvolume_info().
+ * btrfs_util_subvolume_iter_next() and btrfs_util_subvolume_info(). The
+ * privileged iterator gets the information of the subvolumes found by the
+ * same tree search together with btrfs_util_subvolume_get_info_many(), so it
+ * may be slightly older than the subvolume returned.
  *
  * This requires appropriate privilege (CAP_SYS_ADMIN) for kernels < 4.18. See
  * btrfs_util_create_subvolume_iterator().
@@ -923,6 +1145,119 @@ enum btrfs_util_error btrfs_util_qgroup_inherit_add_group(struct btrfs_util_qgro
 void btrfs_util_qgroup_inherit_get_groups(const struct btrfs_util_qgroup_inherit *inherit,
 					  const uint64_t **groups, size_t *n);
 
+/**
+ * BTRFS_UTIL_QGROUP_LIMIT_MAX_REFERENCED - The limit of the referenced bytes
+ * of a qgroup is set, see &struct btrfs_util_qgroup_info.
+ */
+#define BTRFS_UTIL_QGROUP_LIMIT_MAX_REFERENCED	(1ULL << 0)
+/**
+ * BTRFS_UTIL_QGROUP_LIMIT_MAX_EXCLUSIVE - The limit of the exclusive bytes of
+ * a qgroup is set.
+ */
+#define BTRFS_UTIL_QGROUP_LIMIT_MAX_EXCLUSIVE	(1ULL << 1)
+
+/**
+ * struct btrfs_util_qgroup_info - Usage and limits of a qgroup.
+ */
+struct btrfs_util_qgroup_info {
+	/** @id: ID of the qgroup, the level in the upper 16 bits. */
+	uint64_t id;
+
+	/** @generation: Transaction ID when the usage was last updated. */
+	uint64_t generation;
+
+	/** @referenced: Bytes of the extents referenced by the qgroup. */
+	uint64_t referenced;
+
+	/** @referenced_compressed: Compressed bytes of @referenced. */
+	uint64_t referenced_compressed;
+
+	/** @exclusive: Bytes of the extents referenced only by the qgroup. */
+	uint64_t exclusive;
+
+	/** @exclusive_compressed: Compressed bytes of @exclusive. */
+	uint64_t exclusive_compressed;
+
+	/**
+	 * @limit_flags: Limits set, %BTRFS_UTIL_QGROUP_LIMIT_MAX_REFERENCED or
+	 * %BTRFS_UTIL_QGROUP_LIMIT_MAX_EXCLUSIVE, and the other flags of the
+	 * limit item.
+	 */
+	uint64_t limit_flags;
+
+	/** @max_referenced: Limit of @referenced. */
+	uint64_t max_referenced;
+
+	/** @max_exclusive: Limit of @exclusive. */
+	uint64_t max_exclusive;
+
+	/** @rsv_referenced: Reserved referenced bytes, unused. */
+	uint64_t rsv_referenced;
+
+	/** @rsv_exclusive: Reserved exclusive bytes, unused. */
+	uint64_t rsv_exclusive;
+};
+
+/**
+ * struct btrfs_util_qgroup_relation - Membership of a qgroup in a higher level
+ * one.
+ */
+struct btrfs_util_qgroup_relation {
+	/** @member: ID of the member qgroup. */
+	uint64_t member;
+
+	/** @parent: ID of the qgroup it's a member of. */
+	uint64_t parent;
+};
+
+/**
+ * btrfs_util_qgroup_get_all() - Get the usage, limits and relations of all
+ * qgroups.
+ * @path: Path in a Btrfs filesystem. This may be any path in the filesystem.
+ * @min_transid: If not zero, only return the qgroups changed since this
+ * transaction ID.
+ * @qgroups: Array for the qgroups, sorted by ID.
+ * @n_qgroups: Number of entries of @qgroups, returned number of qgroups.
+ * @relations: Array for the relations, sorted by member and parent, or %NULL
+ * to not get them.
+ * @n_relations: Number of entries of @relations, returned number of relations,
+ * or %NULL if @relations is %NULL.
+ *
+ * The items of the quota tree are read by a few tree searches with a large
+ * buffer, instead of the ioctls of the qgroups one by one.
+ *
+ * With @min_transid, the usage of the qgroups returned was updated at or after
+ * that transaction, or their limit items are in tree blocks written since then
+ * so the limits may have changed.  This usually reads only a small part of
+ * the tree.  Pass the highest @generation returned by the previous call, the
+ * qgroups updated by that transaction are returned again.  The qgroups removed
+ * meanwhile are not returned, the relations are always all returned.
+ *
+ * If an array is too small, it's filled with the first entries,
+ * %BTRFS_UTIL_ERROR_BUFFER_TOO_SMALL is returned and its number is set to the
+ * number of entries needed.
+ *
+ * This requires appropriate privilege (CAP_SYS_ADMIN).  The search fails with
+ * errno %ENOENT if quotas are not enabled.
+ *
+ * Return: %BTRFS_UTIL_OK on success, non-zero error code on failure.
+ */
+enum btrfs_util_error btrfs_util_qgroup_get_all(const char *path,
+						uint64_t min_transid,
+						struct btrfs_util_qgroup_info *qgroups,
+						size_t *n_qgroups,
+						struct btrfs_util_qgroup_relation *relations,
+						size_t *n_relations);
+
+/**
+ * btrfs_util_qgroup_get_all_fd() - See btrfs_util_qgroup_get_all().
+ */
+enum btrfs_util_error btrfs_util_qgroup_get_all_fd(int fd, uint64_t min_transid,
+						   struct btrfs_util_qgroup_info *qgroups,
+						   size_t *n_qgroups,
+						   struct btrfs_util_qgroup_relation *relations,
+						   size_t *n_relations);
+
 #undef LIBBTRFSUTIL_ALIAS
 
 #ifdef __cplusplus
@@ -21,6 +21,7 @@
 #define _LIBBTRFSUTIL_BTRFSUTIL_INTERNAL_H_
 
 #include <asm/byteorder.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
@@ -91,4 +92,8 @@ static inline __u32 btrfs_search_header_len(const struct btrfs_ioctl_search_head
 	return ((const struct __unagligned_u32 *)(const void *)(&sh->len))->x;
 }
 
+/* Tree search shared by the library, see subvolume.c */
+int tree_search_v2(int fd, struct btrfs_ioctl_search_args_v2 *search,
+		   bool *search_v1);
+
 #endif /* _LIBBTRFSUTIL_BTRFSUTIL_INTERNAL_H_ */
@@ -53,6 +53,9 @@ static const char * const error_messages[] = {
 		"Could not resolve subvolume path with BTRFS_IOC_INO_LOOKUP_USER",
 	[BTRFS_UTIL_ERROR_FS_INFO_FAILED] =
 		"Could not get filesystem information",
+	[BTRFS_UTIL_ERROR_SYNC_NOTIFIER_FAILED] =
+		"Could not set up the sync notifier",
+	[BTRFS_UTIL_ERROR_BUFFER_TOO_SMALL] = "Buffer too small",
 };
 
 PUBLIC const char *btrfs_util_strerror(enum btrfs_util_error err)
@@ -19,7 +19,11 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 
 #include "btrfsutil_internal.h"
@@ -112,3 +116,332 @@ PUBLIC enum btrfs_util_error btrfs_util_wait_sync_fd(int fd, uint64_t transid)
 }
 PUBLIC enum btrfs_util_error btrfs_util_fs_wait_sync_fd(int fd, uint64_t transid)
 LIBBTRFSUTIL_ALIAS(btrfs_util_wait_sync_fd);
+
+#define SYNC_NOTIFIER_DEFAULT_THREADS	4
+#define SYNC_NOTIFIER_MAX_THREADS	64
+
+struct btrfs_util_sync_notifier {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* Duplicate of the caller's descriptor for the waits */
+	int fd;
+	/* Counter of the results, reset when all of them are read */
+	int event_fd;
+	/* Added transaction IDs not completed yet, unordered */
+	uint64_t *pending;
+	size_t nr_pending;
+	size_t pending_capacity;
+	/* Results not read yet */
+	struct btrfs_util_sync_event *events;
+	size_t nr_events;
+	size_t events_capacity;
+	/* Highest ID known to be committed */
+	uint64_t committed;
+	/* ID waited for by each thread, zero if it's idle */
+	uint64_t waiting[SYNC_NOTIFIER_MAX_THREADS];
+	unsigned int nr_threads;
+	/* The caller and each thread, the last one frees the notifier */
+	unsigned int refs;
+	bool closing;
+};
+
+static void sync_notifier_put(struct btrfs_util_sync_notifier *notifier)
+{
+	bool last;
+
+	pthread_mutex_lock(&notifier->lock);
+	last = --notifier->refs == 0;
+	pthread_mutex_unlock(&notifier->lock);
+	if (!last)
+		return;
+
+	close(notifier->event_fd);
+	close(notifier->fd);
+	pthread_cond_destroy(&notifier->cond);
+	pthread_mutex_destroy(&notifier->lock);
+	free(notifier->pending);
+	free(notifier->events);
+	free(notifier);
+}
+
+/* Append a result and signal the descriptor, called with the lock held */
+static bool sync_notifier_push(struct btrfs_util_sync_notifier *notifier,
+			       uint64_t transid, int errnum)
+{
+	struct btrfs_util_sync_event *event;
+
+	if (notifier->nr_events == notifier->events_capacity) {
+		size_t capacity = notifier->events_capacity ?
+				  notifier->events_capacity * 2 : 64;
+		struct btrfs_util_sync_event *events;
+
+		events = reallocarray(notifier->events, capacity, sizeof(*events));
+		if (!events)
+			return false;
+		notifier->events = events;
+		notifier->events_capacity = capacity;
+	}
+	event = &notifier->events[notifier->nr_events++];
+	event->transid = transid;
+	event->error = errnum ? BTRFS_UTIL_ERROR_WAIT_SYNC_FAILED : BTRFS_UTIL_OK;
+	event->errnum = errnum;
+	/* Can't fail before the counter overflows */
+	eventfd_write(notifier->event_fd, 1);
+	return true;
+}
+
+/*
+ * Complete the pending IDs by the result of the wait for @transid, all the
+ * lower ones are committed too if it succeeded.  An ID that can't be completed
+ * for lack of memory stays pending and is waited for again.
+ */
+static void sync_notifier_complete(struct btrfs_util_sync_notifier *notifier,
+				   uint64_t transid, int errnum)
+{
+	size_t i = 0;
+
+	if (!errnum && transid > notifier->committed)
+		notifier->committed = transid;
+	while (i < notifier->nr_pending) {
+		uint64_t pending = notifier->pending[i];
+
+		if ((pending == transid || (!errnum && pending < transid)) &&
+		    sync_notifier_push(notifier, pending, errnum)) {
+			notifier->pending[i] = notifier->pending[--notifier->nr_pending];
+			continue;
+		}
+		i++;
+	}
+}
+
+/*
+ * Find the lowest pending ID not waited for by another thread, called with the
+ * lock held.  Return zero if there's none.
+ */
+static uint64_t sync_notifier_next(const struct btrfs_util_sync_notifier *notifier)
+{
+	uint64_t next = 0;
+
+	for (size_t i = 0; i < notifier->nr_pending; i++) {
+		uint64_t transid = notifier->pending[i];
+		bool waited = false;
+
+		if (next && transid >= next)
+			continue;
+		for (unsigned int j = 0; j < notifier->nr_threads; j++) {
+			if (notifier->waiting[j] == transid) {
+				waited = true;
+				break;
+			}
+		}
+		if (!waited)
+			next = transid;
+	}
+	return next;
+}
+
+static void *sync_notifier_thread(void *arg)
+{
+	struct btrfs_util_sync_notifier *notifier = arg;
+	unsigned int slot;
+
+	pthread_mutex_lock(&notifier->lock);
+	slot = notifier->nr_threads++;
+	while (!notifier->closing) {
+		uint64_t transid = sync_notifier_next(notifier);
+		int errnum = 0;
+		int ret;
+
+		if (!transid) {
+			pthread_cond_wait(&notifier->cond, &notifier->lock);
+			continue;
+		}
+		notifier->waiting[slot] = transid;
+		pthread_mutex_unlock(&notifier->lock);
+
+		ret = ioctl(notifier->fd, BTRFS_IOC_WAIT_SYNC, &transid);
+		if (ret == -1)
+			errnum = errno;
+
+		pthread_mutex_lock(&notifier->lock);
+		notifier->waiting[slot] = 0;
+		sync_notifier_complete(notifier, transid, errnum);
+		/* The others may have skipped the ID this one waited for */
+		pthread_cond_broadcast(&notifier->cond);
+	}
+	pthread_mutex_unlock(&notifier->lock);
+
+	sync_notifier_put(notifier);
+	return NULL;
+}
+
+/* Take over @fd, it's closed on failure */
+static enum btrfs_util_error sync_notifier_create(int fd, unsigned int nr_threads,
+						  struct btrfs_util_sync_notifier **ret)
+{
+	struct btrfs_util_sync_notifier *notifier;
+	pthread_attr_t attr;
+	unsigned int started = 0;
+	int errnum = 0;
+
+	notifier = calloc(1, sizeof(*notifier));
+	if (!notifier) {
+		SAVE_ERRNO_AND_CLOSE(fd);
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+	}
+	notifier->fd = fd;
+	notifier->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (notifier->event_fd == -1) {
+		SAVE_ERRNO_AND_CLOSE(fd);
+		free(notifier);
+		return BTRFS_UTIL_ERROR_SYNC_NOTIFIER_FAILED;
+	}
+	pthread_mutex_init(&notifier->lock, NULL);
+	pthread_cond_init(&notifier->cond, NULL);
+	notifier->refs = 1;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&notifier->lock);
+	for (; started < nr_threads; started++) {
+		pthread_t thread;
+
+		errnum = pthread_create(&thread, &attr, sync_notifier_thread,
+					notifier);
+		if (errnum)
+			break;
+		notifier->refs++;
+	}
+	pthread_mutex_unlock(&notifier->lock);
+	pthread_attr_destroy(&attr);
+
+	if (errnum) {
+		btrfs_util_sync_notifier_destroy(notifier);
+		errno = errnum;
+		return BTRFS_UTIL_ERROR_SYNC_NOTIFIER_FAILED;
+	}
+
+	*ret = notifier;
+	return BTRFS_UTIL_OK;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_sync_notifier_create(const char *path,
+							     unsigned int nr_threads,
+							     struct btrfs_util_sync_notifier **ret)
+{
+	int fd;
+
+	if (nr_threads > SYNC_NOTIFIER_MAX_THREADS) {
+		errno = EINVAL;
+		return BTRFS_UTIL_ERROR_INVALID_ARGUMENT;
+	}
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return BTRFS_UTIL_ERROR_OPEN_FAILED;
+
+	return sync_notifier_create(fd, nr_threads ?: SYNC_NOTIFIER_DEFAULT_THREADS,
+				    ret);
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_sync_notifier_create_fd(int fd,
+								unsigned int nr_threads,
+								struct btrfs_util_sync_notifier **ret)
+{
+	int dup_fd;
+
+	if (nr_threads > SYNC_NOTIFIER_MAX_THREADS) {
+		errno = EINVAL;
+		return BTRFS_UTIL_ERROR_INVALID_ARGUMENT;
+	}
+
+	dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (dup_fd == -1)
+		return BTRFS_UTIL_ERROR_OPEN_FAILED;
+
+	return sync_notifier_create(dup_fd,
+				    nr_threads ?: SYNC_NOTIFIER_DEFAULT_THREADS,
+				    ret);
+}
+
+PUBLIC int btrfs_util_sync_notifier_get_fd(const struct btrfs_util_sync_notifier *notifier)
+{
+	return notifier->event_fd;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_sync_notifier_add(struct btrfs_util_sync_notifier *notifier,
+							  uint64_t transid)
+{
+	enum btrfs_util_error err = BTRFS_UTIL_OK;
+
+	if (!transid) {
+		errno = EINVAL;
+		return BTRFS_UTIL_ERROR_INVALID_ARGUMENT;
+	}
+
+	pthread_mutex_lock(&notifier->lock);
+	if (transid <= notifier->committed) {
+		if (!sync_notifier_push(notifier, transid, 0)) {
+			errno = ENOMEM;
+			err = BTRFS_UTIL_ERROR_NO_MEMORY;
+		}
+		goto out;
+	}
+	if (notifier->nr_pending == notifier->pending_capacity) {
+		size_t capacity = notifier->pending_capacity ?
+				  notifier->pending_capacity * 2 : 64;
+		uint64_t *pending;
+
+		pending = reallocarray(notifier->pending, capacity,
+				       sizeof(*pending));
+		if (!pending) {
+			errno = ENOMEM;
+			err = BTRFS_UTIL_ERROR_NO_MEMORY;
+			goto out;
+		}
+		notifier->pending = pending;
+		notifier->pending_capacity = capacity;
+	}
+	notifier->pending[notifier->nr_pending++] = transid;
+	pthread_cond_signal(&notifier->cond);
+out:
+	pthread_mutex_unlock(&notifier->lock);
+	return err;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_sync_notifier_read(struct btrfs_util_sync_notifier *notifier,
+							   struct btrfs_util_sync_event *events,
+							   size_t *n)
+{
+	size_t nr;
+
+	pthread_mutex_lock(&notifier->lock);
+	nr = *n < notifier->nr_events ? *n : notifier->nr_events;
+	memcpy(events, notifier->events, nr * sizeof(*events));
+	notifier->nr_events -= nr;
+	memmove(notifier->events, notifier->events + nr,
+		notifier->nr_events * sizeof(*events));
+	if (!notifier->nr_events) {
+		eventfd_t count;
+
+		/* Not readable until the next result */
+		eventfd_read(notifier->event_fd, &count);
+	}
+	pthread_mutex_unlock(&notifier->lock);
+
+	*n = nr;
+	return BTRFS_UTIL_OK;
+}
+
+PUBLIC void btrfs_util_sync_notifier_destroy(struct btrfs_util_sync_notifier *notifier)
+{
+	if (!notifier)
+		return;
+
+	pthread_mutex_lock(&notifier->lock);
+	notifier->closing = true;
+	pthread_cond_broadcast(&notifier->cond);
+	pthread_mutex_unlock(&notifier->lock);
+
+	sync_notifier_put(notifier);
+}
@@ -37,8 +37,12 @@ typedef struct {
 extern PyTypeObject BtrfsUtilError_type;
 extern PyStructSequence_Desc SubvolumeInfo_desc;
 extern PyTypeObject SubvolumeInfo_type;
+extern PyTypeObject SubvolumeInfoArray_type;
 extern PyTypeObject SubvolumeIterator_type;
 extern PyTypeObject QgroupInherit_type;
+extern PyStructSequence_Desc QgroupInfo_desc;
+extern PyTypeObject QgroupInfo_type;
+extern PyTypeObject SyncNotifier_type;
 
 struct path_arg {
 	bool allow_fd;
@@ -67,14 +71,19 @@ PyObject *is_subvolume(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *subvolume_id(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *subvolume_path(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *subvolume_info(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *subvolume_info_many(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *subvolume_info_array(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *get_subvolume_read_only(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *set_subvolume_read_only(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *get_default_subvolume(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *set_default_subvolume(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *create_subvolume(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *create_snapshot(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *create_snapshots(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *delete_subvolume(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *delete_subvolumes(PyObject *self, PyObject *args, PyObject *kwds);
 PyObject *deleted_subvolumes(PyObject *self, PyObject *args, PyObject *kwds);
+PyObject *qgroup_info(PyObject *self, PyObject *args, PyObject *kwds);
 
 void add_module_constants(PyObject *m);
 
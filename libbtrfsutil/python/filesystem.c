@@ -92,3 +92,197 @@ PyObject *wait_sync(PyObject *self, PyObject *args, PyObject *kwds)
 	path_cleanup(&path);
 	Py_RETURN_NONE;
 }
+
+typedef struct {
+	PyObject_HEAD
+	struct btrfs_util_sync_notifier *notifier;
+} SyncNotifier;
+
+static void SyncNotifier_dealloc(SyncNotifier *self)
+{
+	btrfs_util_sync_notifier_destroy(self->notifier);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int SyncNotifier_init(SyncNotifier *self, PyObject *args,
+			     PyObject *kwds)
+{
+	static char *keywords[] = {"path", "threads", NULL};
+	struct path_arg path = {.allow_fd = true};
+	enum btrfs_util_error err;
+	unsigned int threads = 0;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|I:SyncNotifier",
+					 keywords, &path_converter, &path,
+					 &threads))
+		return -1;
+
+	btrfs_util_sync_notifier_destroy(self->notifier);
+	self->notifier = NULL;
+	if (path.path)
+		err = btrfs_util_sync_notifier_create(path.path, threads,
+						      &self->notifier);
+	else
+		err = btrfs_util_sync_notifier_create_fd(path.fd, threads,
+							 &self->notifier);
+	if (err) {
+		SetFromBtrfsUtilErrorWithPath(err, &path);
+		path_cleanup(&path);
+		return -1;
+	}
+
+	path_cleanup(&path);
+	return 0;
+}
+
+static bool SyncNotifier_check(SyncNotifier *self)
+{
+	if (!self->notifier) {
+		PyErr_SetString(PyExc_ValueError,
+				"operation on closed notifier");
+		return false;
+	}
+	return true;
+}
+
+static PyObject *SyncNotifier_add(SyncNotifier *self, PyObject *args,
+				  PyObject *kwds)
+{
+	static char *keywords[] = {"transid", NULL};
+	unsigned long long transid;
+	enum btrfs_util_error err;
+
+	if (!SyncNotifier_check(self))
+		return NULL;
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "K:add", keywords,
+					 &transid))
+		return NULL;
+
+	err = btrfs_util_sync_notifier_add(self->notifier, transid);
+	if (err) {
+		SetFromBtrfsUtilError(err);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyObject *SyncNotifier_read(SyncNotifier *self)
+{
+	struct btrfs_util_sync_event events[64];
+	enum btrfs_util_error err;
+	PyObject *ret;
+
+	if (!SyncNotifier_check(self))
+		return NULL;
+
+	ret = PyList_New(0);
+	if (!ret)
+		return NULL;
+	for (;;) {
+		size_t n = sizeof(events) / sizeof(events[0]);
+
+		err = btrfs_util_sync_notifier_read(self->notifier, events, &n);
+		if (err) {
+			SetFromBtrfsUtilError(err);
+			Py_DECREF(ret);
+			return NULL;
+		}
+		for (size_t i = 0; i < n; i++) {
+			PyObject *tmp;
+
+			tmp = Py_BuildValue("Ki",
+					    (unsigned long long)events[i].transid,
+					    events[i].errnum);
+			if (!tmp || PyList_Append(ret, tmp) == -1) {
+				Py_XDECREF(tmp);
+				Py_DECREF(ret);
+				return NULL;
+			}
+			Py_DECREF(tmp);
+		}
+		if (n < sizeof(events) / sizeof(events[0]))
+			break;
+	}
+	return ret;
+}
+
+static PyObject *SyncNotifier_close(SyncNotifier *self)
+{
+	btrfs_util_sync_notifier_destroy(self->notifier);
+	self->notifier = NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *SyncNotifier_fileno(SyncNotifier *self)
+{
+	if (!SyncNotifier_check(self))
+		return NULL;
+	return PyLong_FromLong(btrfs_util_sync_notifier_get_fd(self->notifier));
+}
+
+static PyObject *SyncNotifier_enter(SyncNotifier *self)
+{
+	Py_INCREF((PyObject *)self);
+	return (PyObject *)self;
+}
+
+static PyObject *SyncNotifier_exit(SyncNotifier *self, PyObject *args,
+				   PyObject *kwds)
+{
+	static char *keywords[] = {"exc_type", "exc_value", "traceback", NULL};
+	PyObject *exc_type, *exc_value, *traceback;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OOO:__exit__", keywords,
+					 &exc_type, &exc_value, &traceback))
+		return NULL;
+
+	return SyncNotifier_close(self);
+}
+
+#define SyncNotifier_DOC	\
+	 "SyncNotifier(path, threads=0) -> new sync notifier\n\n"			\
+	 "Create a notifier of transaction commits, the transactions added by\n"	\
+	 "add() are waited for by the internal threads and fileno() becomes\n"		\
+	 "readable when there are results to read().\n\n"				\
+	 "Arguments:\n"									\
+	 "path -- string, bytes, path-like object, or open file descriptor\n"		\
+	 "threads -- number of threads waiting for the transactions, 0 for the\n"	\
+	 "default"
+
+static PyMethodDef SyncNotifier_methods[] = {
+	{"add", (PyCFunction)SyncNotifier_add,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "add(transid)\n\n"
+	 "Add a transaction to wait for, each added transaction gets one result.\n\n"
+	 "Arguments:\n"
+	 "transid -- transaction ID, e.g. from start_sync()"},
+	{"read", (PyCFunction)SyncNotifier_read,
+	 METH_NOARGS,
+	 "read() -> list of (transid, errno)\n\n"
+	 "Read the results of the waits without blocking, errno is 0 if the\n"
+	 "transaction is committed."},
+	{"close", (PyCFunction)SyncNotifier_close,
+	 METH_NOARGS,
+	 "close()\n\n"
+	 "Close this notifier, the results not read are dropped."},
+	{"fileno", (PyCFunction)SyncNotifier_fileno,
+	 METH_NOARGS,
+	 "fileno() -> int\n\n"
+	 "Get the file descriptor to poll for the results."},
+	{"__enter__", (PyCFunction)SyncNotifier_enter,
+	 METH_NOARGS, ""},
+	{"__exit__", (PyCFunction)SyncNotifier_exit,
+	 METH_VARARGS | METH_KEYWORDS, ""},
+	{},
+};
+
+PyTypeObject SyncNotifier_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name		= "btrfsutil.SyncNotifier",
+	.tp_basicsize		= sizeof(SyncNotifier),
+	.tp_dealloc		= (destructor)SyncNotifier_dealloc,
+	.tp_flags		= Py_TPFLAGS_DEFAULT,
+	.tp_doc			= SyncNotifier_DOC,
+	.tp_methods		= SyncNotifier_methods,
+	.tp_init		= (initproc)SyncNotifier_init,
+};
@@ -169,6 +169,26 @@ static PyMethodDef btrfsutil_methods[] = {
 	 "path -- string, bytes, path-like object, or open file descriptor\n"
 	 "id -- if not zero, instead of returning information about the\n"
 	 "given path, return information about the subvolume with this ID"},
+	{"subvolume_info_many", (PyCFunction)subvolume_info_many,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "subvolume_info_many(path, ids) -> list of SubvolumeInfo\n\n"
+	 "Get information about many subvolumes at once. The list has the\n"
+	 "information of the subvolume of each ID in the same order, or None\n"
+	 "if the subvolume does not exist. This requires CAP_SYS_ADMIN.\n\n"
+	 "Arguments:\n"
+	 "path -- string, bytes, path-like object, or open file descriptor\n"
+	 "ids -- sequence of int subvolume IDs"},
+	{"subvolume_info_array", (PyCFunction)subvolume_info_array,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "subvolume_info_array(path, ids=None) -> SubvolumeInfoArray\n\n"
+	 "Get information about many subvolumes at once into an array which\n"
+	 "supports the buffer protocol, e.g., for numpy.asarray(). The GIL is\n"
+	 "released while reading the information. This requires\n"
+	 "CAP_SYS_ADMIN.\n\n"
+	 "Arguments:\n"
+	 "path -- string, bytes, path-like object, or open file descriptor\n"
+	 "ids -- sequence of int subvolume IDs; if None, all of the subvolumes\n"
+	 "of the filesystem"},
 	{"get_subvolume_read_only", (PyCFunction)get_subvolume_read_only,
 	 METH_VARARGS | METH_KEYWORDS,
 	 "get_subvolume_read_only(path) -> bool\n\n"
@@ -205,6 +225,20 @@ static PyMethodDef btrfsutil_methods[] = {
 	 "async_ -- no longer used\n"
 	 "qgroup_inherit -- optional QgroupInherit object of qgroups to\n"
 	 "inherit from"},
+	{"create_snapshots", (PyCFunction)create_snapshots,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "create_snapshots(sources, paths, recursive=False, read_only=False,\n"
+	 "                 qgroup_inherit=None)\n\n"
+	 "Create many snapshots one after another. All of them are attempted,\n"
+	 "the first failure is raised at the end.\n\n"
+	 "Arguments:\n"
+	 "sources -- sequence of string, bytes, or path-like objects\n"
+	 "paths -- sequence of string, bytes, or path-like objects, where to\n"
+	 "create the snapshot of each source\n"
+	 "recursive -- also snapshot child subvolumes\n"
+	 "read_only -- create read-only snapshots\n"
+	 "qgroup_inherit -- optional QgroupInherit object of qgroups to\n"
+	 "inherit from"},
 	{"create_snapshot", (PyCFunction)create_snapshot,
 	 METH_VARARGS | METH_KEYWORDS,
 	 "create_snapshot(source, path, recursive=False, read_only=False,\n"
@@ -220,12 +254,23 @@ static PyMethodDef btrfsutil_methods[] = {
 	 "inherit from"},
 	{"delete_subvolume", (PyCFunction)delete_subvolume,
 	 METH_VARARGS | METH_KEYWORDS,
-	 "delete_subvolume(path, recursive=False)\n\n"
+	 "delete_subvolume(path, recursive=False, commit=False)\n\n"
 	 "Delete a subvolume or snapshot.\n\n"
 	 "Arguments:\n"
 	 "path -- string, bytes, or path-like object\n"
 	 "recursive -- if the given subvolume has child subvolumes, delete\n"
-	 "them instead of failing"},
+	 "them instead of failing\n"
+	 "commit -- wait for the transaction commit after the deletion"},
+	{"delete_subvolumes", (PyCFunction)delete_subvolumes,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "delete_subvolumes(path, ids, commit=False)\n\n"
+	 "Delete many subvolumes or snapshots by their IDs. All of them are\n"
+	 "attempted, the first failure is raised at the end.\n\n"
+	 "Arguments:\n"
+	 "path -- string, bytes, path-like object, or open file descriptor\n"
+	 "ids -- sequence of int subvolume IDs\n"
+	 "commit -- wait for the transaction commit once after all the\n"
+	 "deletions"},
 	{"deleted_subvolumes", (PyCFunction)deleted_subvolumes,
 	 METH_VARARGS | METH_KEYWORDS,
 	 "deleted_subvolumes(path)\n\n"
@@ -233,6 +278,16 @@ static PyMethodDef btrfsutil_methods[] = {
 	 "cleaned up\n\n"
 	 "Arguments:\n"
 	 "path -- string, bytes, path-like object, or open file descriptor"},
+	{"qgroup_info", (PyCFunction)qgroup_info,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "qgroup_info(path, min_transid=0) -> (list of QgroupInfo,\n"
+	 "                                     list of (member, parent))\n\n"
+	 "Get the usage and limits of all qgroups, sorted by ID, and their\n"
+	 "relations by a few tree searches. This requires CAP_SYS_ADMIN.\n\n"
+	 "Arguments:\n"
+	 "path -- string, bytes, path-like object, or open file descriptor\n"
+	 "min_transid -- if not zero, only get the qgroups changed since this\n"
+	 "transaction ID, the relations are always all returned"},
 	{},
 };
 
@@ -256,14 +311,24 @@ PyInit_btrfsutil(void)
 	if (PyStructSequence_InitType2(&SubvolumeInfo_type, &SubvolumeInfo_desc) < 0)
 		return NULL;
 
+	if (PyType_Ready(&SubvolumeInfoArray_type) < 0)
+		return NULL;
+
 	SubvolumeIterator_type.tp_new = PyType_GenericNew;
 	if (PyType_Ready(&SubvolumeIterator_type) < 0)
 		return NULL;
 
+	if (PyStructSequence_InitType2(&QgroupInfo_type, &QgroupInfo_desc) < 0)
+		return NULL;
+
 	QgroupInherit_type.tp_new = PyType_GenericNew;
 	if (PyType_Ready(&QgroupInherit_type) < 0)
 		return NULL;
 
+	SyncNotifier_type.tp_new = PyType_GenericNew;
+	if (PyType_Ready(&SyncNotifier_type) < 0)
+		return NULL;
+
 	m = PyModule_Create(&btrfsutilmodule);
 	if (!m)
 		return NULL;
@@ -275,6 +340,10 @@ PyInit_btrfsutil(void)
 	Py_INCREF(&SubvolumeInfo_type);
 	PyModule_AddObject(m, "SubvolumeInfo", (PyObject *)&SubvolumeInfo_type);
 
+	Py_INCREF(&SubvolumeInfoArray_type);
+	PyModule_AddObject(m, "SubvolumeInfoArray",
+			   (PyObject *)&SubvolumeInfoArray_type);
+
 	Py_INCREF(&SubvolumeIterator_type);
 	PyModule_AddObject(m, "SubvolumeIterator",
 			   (PyObject *)&SubvolumeIterator_type);
@@ -283,7 +352,18 @@ PyInit_btrfsutil(void)
 	PyModule_AddObject(m, "QgroupInherit",
 			   (PyObject *)&QgroupInherit_type);
 
+	Py_INCREF(&QgroupInfo_type);
+	PyModule_AddObject(m, "QgroupInfo", (PyObject *)&QgroupInfo_type);
+
+	Py_INCREF(&SyncNotifier_type);
+	PyModule_AddObject(m, "SyncNotifier",
+			   (PyObject *)&SyncNotifier_type);
+
 	add_module_constants(m);
+	PyModule_AddIntConstant(m, "QGROUP_LIMIT_MAX_REFERENCED",
+				BTRFS_UTIL_QGROUP_LIMIT_MAX_REFERENCED);
+	PyModule_AddIntConstant(m, "QGROUP_LIMIT_MAX_EXCLUSIVE",
+				BTRFS_UTIL_QGROUP_LIMIT_MAX_EXCLUSIVE);
 
 	return m;
 }
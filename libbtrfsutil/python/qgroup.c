@@ -112,3 +112,145 @@ PyTypeObject QgroupInherit_type = {
 	.tp_methods		= QgroupInherit_methods,
 	.tp_init		= (initproc)QgroupInherit_init,
 };
+
+static PyObject *qgroup_info_to_object(const struct btrfs_util_qgroup_info *info)
+{
+	PyObject *ret, *tmp;
+
+	ret = PyStructSequence_New(&QgroupInfo_type);
+	if (ret == NULL)
+		return NULL;
+
+#define SET_UINT64(i, field)					\
+	tmp = PyLong_FromUnsignedLongLong(info->field);		\
+	if (tmp == NULL) {					\
+		Py_DECREF(ret);					\
+		return NULL;					\
+	}							\
+	PyStructSequence_SET_ITEM(ret, i, tmp);
+
+	SET_UINT64(0, id);
+	SET_UINT64(1, generation);
+	SET_UINT64(2, referenced);
+	SET_UINT64(3, referenced_compressed);
+	SET_UINT64(4, exclusive);
+	SET_UINT64(5, exclusive_compressed);
+	SET_UINT64(6, limit_flags);
+	SET_UINT64(7, max_referenced);
+	SET_UINT64(8, max_exclusive);
+	SET_UINT64(9, rsv_referenced);
+	SET_UINT64(10, rsv_exclusive);
+
+#undef SET_UINT64
+
+	return ret;
+}
+
+PyObject *qgroup_info(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *keywords[] = {"path", "min_transid", NULL};
+	struct path_arg path = {.allow_fd = true};
+	struct btrfs_util_qgroup_info *qgroups = NULL;
+	struct btrfs_util_qgroup_relation *relations = NULL;
+	size_t n_qgroups = 1024, n_relations = 1024;
+	PyObject *qgroups_list = NULL, *relations_list = NULL, *ret = NULL;
+	enum btrfs_util_error err;
+	uint64_t min_transid = 0;
+	size_t i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|K:qgroup_info",
+					 keywords, &path_converter, &path,
+					 &min_transid))
+		return NULL;
+
+	/* The numbers needed are returned if the arrays are too small */
+	do {
+		void *tmp;
+
+		tmp = realloc(qgroups, (n_qgroups ? n_qgroups : 1) * sizeof(*qgroups));
+		if (!tmp) {
+			PyErr_NoMemory();
+			goto out;
+		}
+		qgroups = tmp;
+		tmp = realloc(relations,
+			      (n_relations ? n_relations : 1) * sizeof(*relations));
+		if (!tmp) {
+			PyErr_NoMemory();
+			goto out;
+		}
+		relations = tmp;
+
+		Py_BEGIN_ALLOW_THREADS
+		if (path.path)
+			err = btrfs_util_qgroup_get_all(path.path, min_transid,
+							qgroups, &n_qgroups,
+							relations, &n_relations);
+		else
+			err = btrfs_util_qgroup_get_all_fd(path.fd, min_transid,
+							   qgroups, &n_qgroups,
+							   relations, &n_relations);
+		Py_END_ALLOW_THREADS
+	} while (err == BTRFS_UTIL_ERROR_BUFFER_TOO_SMALL);
+	if (err) {
+		SetFromBtrfsUtilErrorWithPath(err, &path);
+		goto out;
+	}
+
+	qgroups_list = PyList_New(n_qgroups);
+	if (!qgroups_list)
+		goto out;
+	for (i = 0; i < n_qgroups; i++) {
+		PyObject *tmp = qgroup_info_to_object(&qgroups[i]);
+
+		if (!tmp)
+			goto out;
+		PyList_SET_ITEM(qgroups_list, i, tmp);
+	}
+
+	relations_list = PyList_New(n_relations);
+	if (!relations_list)
+		goto out;
+	for (i = 0; i < n_relations; i++) {
+		PyObject *tmp = Py_BuildValue("KK", relations[i].member,
+					      relations[i].parent);
+
+		if (!tmp)
+			goto out;
+		PyList_SET_ITEM(relations_list, i, tmp);
+	}
+
+	ret = PyTuple_Pack(2, qgroups_list, relations_list);
+
+out:
+	Py_XDECREF(relations_list);
+	Py_XDECREF(qgroups_list);
+	free(relations);
+	free(qgroups);
+	path_cleanup(&path);
+	return ret;
+}
+
+static PyStructSequence_Field QgroupInfo_fields[] = {
+	{"id", "int ID of this qgroup, the level in the upper 16 bits"},
+	{"generation", "int transaction ID when the usage was last updated"},
+	{"referenced", "int bytes referenced by this qgroup"},
+	{"referenced_compressed", "int compressed bytes referenced by this qgroup"},
+	{"exclusive", "int bytes referenced only by this qgroup"},
+	{"exclusive_compressed", "int compressed bytes referenced only by this qgroup"},
+	{"limit_flags", "int flags of the limits set"},
+	{"max_referenced", "int limit of the referenced bytes"},
+	{"max_exclusive", "int limit of the exclusive bytes"},
+	{"rsv_referenced", "int reserved referenced bytes, unused"},
+	{"rsv_exclusive", "int reserved exclusive bytes, unused"},
+	{},
+};
+
+PyStructSequence_Desc QgroupInfo_desc = {
+	"btrfsutil.QgroupInfo",
+	"Usage and limits of a Btrfs qgroup.",
+	QgroupInfo_fields,
+	11,
+};
+
+PyTypeObject QgroupInfo_type;
@@ -186,6 +186,75 @@ PyObject *subvolume_info(PyObject *self, PyObject *args, PyObject *kwds)
 	return subvolume_info_to_object(&subvol);
 }
 
+PyObject *subvolume_info_many(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *keywords[] = {"path", "ids", NULL};
+	struct path_arg path = {.allow_fd = true};
+	struct btrfs_util_subvolume_info *subvols = NULL;
+	enum btrfs_util_error err;
+	PyObject *ids_obj, *seq, *ret = NULL;
+	uint64_t *ids = NULL;
+	Py_ssize_t n, i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&O:subvolume_info_many",
+					 keywords, &path_converter, &path,
+					 &ids_obj))
+		return NULL;
+
+	seq = PySequence_Fast(ids_obj, "ids must be a sequence of ints");
+	if (!seq)
+		goto out;
+	n = PySequence_Fast_GET_SIZE(seq);
+	ids = malloc((n ? n : 1) * sizeof(*ids));
+	subvols = malloc((n ? n : 1) * sizeof(*subvols));
+	if (!ids || !subvols) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		ids[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+		if (PyErr_Occurred())
+			goto out;
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (path.path)
+		err = btrfs_util_subvolume_get_info_many(path.path, ids, n, subvols);
+	else
+		err = btrfs_util_subvolume_get_info_many_fd(path.fd, ids, n, subvols);
+	Py_END_ALLOW_THREADS
+	if (err) {
+		SetFromBtrfsUtilErrorWithPath(err, &path);
+		goto out;
+	}
+
+	ret = PyList_New(n);
+	if (!ret)
+		goto out;
+	for (i = 0; i < n; i++) {
+		PyObject *tmp;
+
+		if (subvols[i].id) {
+			tmp = subvolume_info_to_object(&subvols[i]);
+			if (!tmp) {
+				Py_CLEAR(ret);
+				goto out;
+			}
+		} else {
+			Py_INCREF(Py_None);
+			tmp = Py_None;
+		}
+		PyList_SET_ITEM(ret, i, tmp);
+	}
+
+out:
+	free(subvols);
+	free(ids);
+	Py_XDECREF(seq);
+	path_cleanup(&path);
+	return ret;
+}
+
 static PyStructSequence_Field SubvolumeInfo_fields[] = {
 	{"id", "int ID of this subvolume"},
 	{"parent_id", "int ID of the subvolume containing this subvolume"},
@@ -215,6 +284,348 @@ PyStructSequence_Desc SubvolumeInfo_desc = {
 
 PyTypeObject SubvolumeInfo_type;
 
+/*
+ * One element of a SubvolumeInfoArray, the fields of struct
+ * btrfs_util_subvolume_info in the layout described by
+ * SUBVOLUME_INFO_RECORD_FORMAT.  All the fields are 8 bytes or arrays of bytes,
+ * so there is no padding.
+ */
+struct subvolume_info_record {
+	uint64_t id;
+	uint64_t parent_id;
+	uint64_t dir_id;
+	uint64_t flags;
+	uint8_t uuid[16];
+	uint8_t parent_uuid[16];
+	uint8_t received_uuid[16];
+	uint64_t generation;
+	uint64_t ctransid;
+	uint64_t otransid;
+	uint64_t stransid;
+	uint64_t rtransid;
+	double ctime;
+	double otime;
+	double stime;
+	double rtime;
+};
+
+#define SUBVOLUME_INFO_RECORD_FORMAT					\
+	"T{Q:id:Q:parent_id:Q:dir_id:Q:flags:"				\
+	"16s:uuid:16s:parent_uuid:16s:received_uuid:"			\
+	"Q:generation:Q:ctransid:Q:otransid:Q:stransid:Q:rtransid:"	\
+	"d:ctime:d:otime:d:stime:d:rtime:}"
+
+typedef struct {
+	PyObject_HEAD
+	struct subvolume_info_record *records;
+	Py_ssize_t n;
+	Py_ssize_t shape[1];
+	Py_ssize_t strides[1];
+} SubvolumeInfoArray;
+
+static double timespec_to_double(const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1000000000.0;
+}
+
+static void subvolume_info_to_record(const struct btrfs_util_subvolume_info *subvol,
+				     struct subvolume_info_record *record)
+{
+	record->id = subvol->id;
+	record->parent_id = subvol->parent_id;
+	record->dir_id = subvol->dir_id;
+	record->flags = subvol->flags;
+	memcpy(record->uuid, subvol->uuid, 16);
+	memcpy(record->parent_uuid, subvol->parent_uuid, 16);
+	memcpy(record->received_uuid, subvol->received_uuid, 16);
+	record->generation = subvol->generation;
+	record->ctransid = subvol->ctransid;
+	record->otransid = subvol->otransid;
+	record->stransid = subvol->stransid;
+	record->rtransid = subvol->rtransid;
+	record->ctime = timespec_to_double(&subvol->ctime);
+	record->otime = timespec_to_double(&subvol->otime);
+	record->stime = timespec_to_double(&subvol->stime);
+	record->rtime = timespec_to_double(&subvol->rtime);
+}
+
+/* BTRFS_FS_TREE_OBJECTID, the top of all subvolumes */
+#define FS_TREE_OBJECTID	5
+
+/* Collect the IDs of all subvolumes of the filesystem, without the GIL. */
+static enum btrfs_util_error list_all_subvolume_ids(struct path_arg *path,
+						    uint64_t **ids_ret,
+						    size_t *n_ret)
+{
+	struct btrfs_util_subvolume_iterator *iter;
+	enum btrfs_util_error err;
+	uint64_t *ids = NULL;
+	size_t n = 0, capacity = 0;
+
+	if (path->path)
+		err = btrfs_util_subvolume_iter_create(path->path,
+						       FS_TREE_OBJECTID, 0,
+						       &iter);
+	else
+		err = btrfs_util_subvolume_iter_create_fd(path->fd,
+							  FS_TREE_OBJECTID, 0,
+							  &iter);
+	if (err)
+		return err;
+
+	for (;;) {
+		uint64_t id;
+
+		err = btrfs_util_subvolume_iter_next(iter, NULL, &id);
+		if (err == BTRFS_UTIL_ERROR_STOP_ITERATION) {
+			err = BTRFS_UTIL_OK;
+			break;
+		} else if (err) {
+			break;
+		}
+
+		if (n >= capacity) {
+			uint64_t *new_ids;
+
+			capacity = capacity ? capacity * 2 : 64;
+			new_ids = realloc(ids, capacity * sizeof(*ids));
+			if (!new_ids) {
+				err = BTRFS_UTIL_ERROR_NO_MEMORY;
+				break;
+			}
+			ids = new_ids;
+		}
+		ids[n++] = id;
+	}
+
+	btrfs_util_subvolume_iter_destroy(iter);
+	if (err) {
+		free(ids);
+		return err;
+	}
+	*ids_ret = ids;
+	*n_ret = n;
+	return BTRFS_UTIL_OK;
+}
+
+PyObject *subvolume_info_array(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *keywords[] = {"path", "ids", NULL};
+	struct path_arg path = {.allow_fd = true};
+	struct btrfs_util_subvolume_info *subvols = NULL;
+	struct subvolume_info_record *records = NULL;
+	enum btrfs_util_error err = BTRFS_UTIL_OK;
+	PyObject *ids_obj = Py_None, *seq = NULL;
+	SubvolumeInfoArray *ret = NULL;
+	uint64_t *ids = NULL;
+	size_t n = 0, i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|O:subvolume_info_array",
+					 keywords, &path_converter, &path,
+					 &ids_obj))
+		return NULL;
+
+	if (ids_obj != Py_None) {
+		seq = PySequence_Fast(ids_obj, "ids must be a sequence of ints");
+		if (!seq)
+			goto out;
+		n = PySequence_Fast_GET_SIZE(seq);
+		ids = malloc((n ? n : 1) * sizeof(*ids));
+		if (!ids) {
+			PyErr_NoMemory();
+			goto out;
+		}
+		for (i = 0; i < n; i++) {
+			ids[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+			if (PyErr_Occurred())
+				goto out;
+		}
+	}
+
+	Py_BEGIN_ALLOW_THREADS
+	if (!ids)
+		err = list_all_subvolume_ids(&path, &ids, &n);
+	if (!err) {
+		subvols = malloc((n ? n : 1) * sizeof(*subvols));
+		records = PyMem_RawMalloc((n ? n : 1) * sizeof(*records));
+		if (!subvols || !records)
+			err = BTRFS_UTIL_ERROR_NO_MEMORY;
+	}
+	if (!err) {
+		if (path.path)
+			err = btrfs_util_subvolume_get_info_many(path.path, ids,
+								 n, subvols);
+		else
+			err = btrfs_util_subvolume_get_info_many_fd(path.fd, ids,
+								    n, subvols);
+	}
+	if (!err) {
+		for (i = 0; i < n; i++)
+			subvolume_info_to_record(&subvols[i], &records[i]);
+	}
+	Py_END_ALLOW_THREADS
+	if (err) {
+		SetFromBtrfsUtilErrorWithPath(err, &path);
+		goto out;
+	}
+
+	ret = PyObject_New(SubvolumeInfoArray, &SubvolumeInfoArray_type);
+	if (!ret)
+		goto out;
+	ret->records = records;
+	records = NULL;
+	ret->n = n;
+	ret->shape[0] = n;
+	ret->strides[0] = sizeof(struct subvolume_info_record);
+
+out:
+	PyMem_RawFree(records);
+	free(subvols);
+	free(ids);
+	Py_XDECREF(seq);
+	path_cleanup(&path);
+	return (PyObject *)ret;
+}
+
+static void SubvolumeInfoArray_dealloc(SubvolumeInfoArray *self)
+{
+	PyMem_RawFree(self->records);
+	PyObject_Del(self);
+}
+
+static Py_ssize_t SubvolumeInfoArray_length(SubvolumeInfoArray *self)
+{
+	return self->n;
+}
+
+static PyObject *SubvolumeInfoArray_item(SubvolumeInfoArray *self,
+					 Py_ssize_t i)
+{
+	const struct subvolume_info_record *record;
+	PyObject *ret, *tmp;
+
+	if (i < 0 || i >= self->n) {
+		PyErr_SetString(PyExc_IndexError,
+				"SubvolumeInfoArray index out of range");
+		return NULL;
+	}
+	record = &self->records[i];
+	if (!record->id)
+		Py_RETURN_NONE;
+
+	ret = PyStructSequence_New(&SubvolumeInfo_type);
+	if (ret == NULL)
+		return NULL;
+
+#define SET_UINT64(i, field)					\
+	tmp = PyLong_FromUnsignedLongLong(record->field);	\
+	if (tmp == NULL) {					\
+		Py_DECREF(ret);					\
+		return NULL;					\
+	}							\
+	PyStructSequence_SET_ITEM(ret, i, tmp);
+
+#define SET_UUID(i, field)						\
+	tmp = PyBytes_FromStringAndSize((char *)record->field, 16);	\
+	if (tmp == NULL) {						\
+		Py_DECREF(ret);						\
+		return NULL;						\
+	}								\
+	PyStructSequence_SET_ITEM(ret, i, tmp);
+
+#define SET_TIME(i, field)				\
+	tmp = PyFloat_FromDouble(record->field);	\
+	if (tmp == NULL) {				\
+		Py_DECREF(ret);				\
+		return NULL;				\
+	}						\
+	PyStructSequence_SET_ITEM(ret, i, tmp);
+
+	SET_UINT64(0, id);
+	SET_UINT64(1, parent_id);
+	SET_UINT64(2, dir_id);
+	SET_UINT64(3, flags);
+	SET_UUID(4, uuid);
+	SET_UUID(5, parent_uuid);
+	SET_UUID(6, received_uuid);
+	SET_UINT64(7, generation);
+	SET_UINT64(8, ctransid);
+	SET_UINT64(9, otransid);
+	SET_UINT64(10, stransid);
+	SET_UINT64(11, rtransid);
+	SET_TIME(12, ctime);
+	SET_TIME(13, otime);
+	SET_TIME(14, stime);
+	SET_TIME(15, rtime);
+
+#undef SET_TIME
+#undef SET_UUID
+#undef SET_UINT64
+
+	return ret;
+}
+
+static int SubvolumeInfoArray_getbuffer(SubvolumeInfoArray *self,
+					Py_buffer *view, int flags)
+{
+	if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError,
+				"SubvolumeInfoArray is read-only");
+		view->obj = NULL;
+		return -1;
+	}
+
+	view->buf = self->records;
+	view->obj = (PyObject *)self;
+	Py_INCREF(self);
+	view->len = self->n * sizeof(struct subvolume_info_record);
+	view->readonly = 1;
+	view->itemsize = sizeof(struct subvolume_info_record);
+	view->format = NULL;
+	if ((flags & PyBUF_FORMAT) == PyBUF_FORMAT)
+		view->format = SUBVOLUME_INFO_RECORD_FORMAT;
+	view->ndim = 1;
+	view->shape = NULL;
+	if ((flags & PyBUF_ND) == PyBUF_ND)
+		view->shape = self->shape;
+	view->strides = NULL;
+	if ((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+		view->strides = self->strides;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PySequenceMethods SubvolumeInfoArray_as_sequence = {
+	.sq_length		= (lenfunc)SubvolumeInfoArray_length,
+	.sq_item		= (ssizeargfunc)SubvolumeInfoArray_item,
+};
+
+static PyBufferProcs SubvolumeInfoArray_as_buffer = {
+	.bf_getbuffer		= (getbufferproc)SubvolumeInfoArray_getbuffer,
+};
+
+#define SubvolumeInfoArray_DOC	\
+	"Information about many Btrfs subvolumes, returned by\n"		\
+	"subvolume_info_array().\n\n"						\
+	"Indexing it returns a SubvolumeInfo, or None if the subvolume does\n"	\
+	"not exist. It also supports the buffer protocol, exporting a\n"	\
+	"read-only array of structures with the fields of SubvolumeInfo,\n"	\
+	"which can be used without copying by memoryview or\n"		\
+	"numpy.asarray(). The times are in seconds, including the\n"		\
+	"fractional part, and the ID of a subvolume that does not exist is 0."
+
+PyTypeObject SubvolumeInfoArray_type = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name		= "btrfsutil.SubvolumeInfoArray",
+	.tp_basicsize		= sizeof(SubvolumeInfoArray),
+	.tp_dealloc		= (destructor)SubvolumeInfoArray_dealloc,
+	.tp_as_sequence		= &SubvolumeInfoArray_as_sequence,
+	.tp_as_buffer		= &SubvolumeInfoArray_as_buffer,
+	.tp_flags		= Py_TPFLAGS_DEFAULT,
+	.tp_doc			= SubvolumeInfoArray_DOC,
+};
+
 PyObject *get_subvolume_read_only(PyObject *self, PyObject *args, PyObject *kwds)
 {
 	static char *keywords[] = {"path", NULL};
@@ -397,21 +808,116 @@ PyObject *create_snapshot(PyObject *self, PyObject *args, PyObject *kwds)
 		Py_RETURN_NONE;
 }
 
+PyObject *create_snapshots(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *keywords[] = {
+		"sources", "paths", "recursive", "read_only", "qgroup_inherit",
+		NULL,
+	};
+	PyObject *sources_obj, *paths_obj, *sources_seq = NULL, *paths_seq = NULL;
+	struct path_arg *srcs = NULL, *dsts = NULL;
+	const char **src_paths = NULL, **dst_paths = NULL;
+	enum btrfs_util_error *errors = NULL;
+	enum btrfs_util_error err;
+	int recursive = 0, read_only = 0;
+	int flags = 0;
+	QgroupInherit *inherit = NULL;
+	PyObject *ret = NULL;
+	Py_ssize_t n = 0, i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|ppO!:create_snapshots",
+					 keywords, &sources_obj, &paths_obj,
+					 &recursive, &read_only,
+					 &QgroupInherit_type, &inherit))
+		return NULL;
+
+	sources_seq = PySequence_Fast(sources_obj, "sources must be a sequence");
+	if (!sources_seq)
+		goto out;
+	paths_seq = PySequence_Fast(paths_obj, "paths must be a sequence");
+	if (!paths_seq)
+		goto out;
+	if (PySequence_Fast_GET_SIZE(sources_seq) !=
+	    PySequence_Fast_GET_SIZE(paths_seq)) {
+		PyErr_SetString(PyExc_ValueError,
+				"sources and paths must have the same length");
+		goto out;
+	}
+
+	n = PySequence_Fast_GET_SIZE(sources_seq);
+	srcs = calloc(n ? n : 1, sizeof(*srcs));
+	dsts = calloc(n ? n : 1, sizeof(*dsts));
+	src_paths = calloc(n ? n : 1, sizeof(*src_paths));
+	dst_paths = calloc(n ? n : 1, sizeof(*dst_paths));
+	errors = calloc(n ? n : 1, sizeof(*errors));
+	if (!srcs || !dsts || !src_paths || !dst_paths || !errors) {
+		PyErr_NoMemory();
+		n = 0;
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (!path_converter(PySequence_Fast_GET_ITEM(sources_seq, i),
+				    &srcs[i]) ||
+		    !path_converter(PySequence_Fast_GET_ITEM(paths_seq, i),
+				    &dsts[i])) {
+			n = i + 1;
+			goto out;
+		}
+		src_paths[i] = srcs[i].path;
+		dst_paths[i] = dsts[i].path;
+	}
+
+	if (recursive)
+		flags |= BTRFS_UTIL_CREATE_SNAPSHOT_RECURSIVE;
+	if (read_only)
+		flags |= BTRFS_UTIL_CREATE_SNAPSHOT_READ_ONLY;
+
+	err = btrfs_util_subvolume_snapshot_many(src_paths, dst_paths, n, flags,
+						 inherit ? inherit->inherit : NULL,
+						 errors);
+	if (err) {
+		for (i = 0; i < n; i++) {
+			if (errors[i])
+				break;
+		}
+		SetFromBtrfsUtilErrorWithPaths(err, &srcs[i], &dsts[i]);
+		goto out;
+	}
+
+	Py_INCREF(Py_None);
+	ret = Py_None;
+out:
+	for (i = 0; i < n; i++) {
+		path_cleanup(&srcs[i]);
+		path_cleanup(&dsts[i]);
+	}
+	free(errors);
+	free(dst_paths);
+	free(src_paths);
+	free(dsts);
+	free(srcs);
+	Py_XDECREF(paths_seq);
+	Py_XDECREF(sources_seq);
+	return ret;
+}
+
 PyObject *delete_subvolume(PyObject *self, PyObject *args, PyObject *kwds)
 {
-	static char *keywords[] = {"path", "recursive", NULL};
+	static char *keywords[] = {"path", "recursive", "commit", NULL};
 	struct path_arg path = {.allow_fd = false};
 	enum btrfs_util_error err;
-	int recursive = 0;
+	int recursive = 0, commit = 0;
 	int flags = 0;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|p:delete_subvolume",
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|pp:delete_subvolume",
 					 keywords, &path_converter, &path,
-					 &recursive))
+					 &recursive, &commit))
 		return NULL;
 
 	if (recursive)
 		flags |= BTRFS_UTIL_DELETE_SUBVOLUME_RECURSIVE;
+	if (commit)
+		flags |= BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT;
 
 	err = btrfs_util_subvolume_delete(path.path, flags);
 	if (err) {
@@ -424,6 +930,58 @@ PyObject *delete_subvolume(PyObject *self, PyObject *args, PyObject *kwds)
 	Py_RETURN_NONE;
 }
 
+PyObject *delete_subvolumes(PyObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *keywords[] = {"path", "ids", "commit", NULL};
+	struct path_arg path = {.allow_fd = true};
+	enum btrfs_util_error err;
+	PyObject *ids_obj, *seq, *ret = NULL;
+	uint64_t *ids = NULL;
+	int commit = 0;
+	Py_ssize_t n, i;
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&O|p:delete_subvolumes",
+					 keywords, &path_converter, &path,
+					 &ids_obj, &commit))
+		return NULL;
+
+	seq = PySequence_Fast(ids_obj, "ids must be a sequence of ints");
+	if (!seq)
+		goto out;
+	n = PySequence_Fast_GET_SIZE(seq);
+	ids = malloc((n ? n : 1) * sizeof(*ids));
+	if (!ids) {
+		PyErr_NoMemory();
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		ids[i] = PyLong_AsUnsignedLongLong(PySequence_Fast_GET_ITEM(seq, i));
+		if (PyErr_Occurred())
+			goto out;
+	}
+
+	if (path.path)
+		err = btrfs_util_subvolume_delete_many(path.path, ids, n,
+				commit ? BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT : 0,
+				NULL);
+	else
+		err = btrfs_util_subvolume_delete_many_fd(path.fd, ids, n,
+				commit ? BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT : 0,
+				NULL);
+	if (err) {
+		SetFromBtrfsUtilErrorWithPath(err, &path);
+		goto out;
+	}
+
+	Py_INCREF(Py_None);
+	ret = Py_None;
+out:
+	free(ids);
+	Py_XDECREF(seq);
+	path_cleanup(&path);
+	return ret;
+}
+
 PyObject *deleted_subvolumes(PyObject *self, PyObject *args, PyObject *kwds)
 {
 	static char *keywords[] = {"path", NULL};
@@ -458,6 +1016,8 @@ typedef struct {
 	PyObject_HEAD
 	struct btrfs_util_subvolume_iterator *iter;
 	bool info;
+	/* The GIL is released in next(), another thread must not use iter */
+	bool busy;
 } SubvolumeIterator;
 
 static void SubvolumeIterator_dealloc(SubvolumeIterator *self)
@@ -468,8 +1028,10 @@ static void SubvolumeIterator_dealloc(SubvolumeIterator *self)
 
 static PyObject *SubvolumeIterator_next(SubvolumeIterator *self)
 {
+	struct btrfs_util_subvolume_info subvol;
 	enum btrfs_util_error err;
 	PyObject *ret, *tmp;
+	uint64_t id;
 	char *path;
 
 	if (!self->iter) {
@@ -477,60 +1039,58 @@ static PyObject *SubvolumeIterator_next(SubvolumeIterator *self)
 				"operation on closed iterator");
 		return NULL;
 	}
+	if (self->busy) {
+		PyErr_SetString(PyExc_ValueError, "iterator already executing");
+		return NULL;
+	}
 
-	if (self->info) {
-		struct btrfs_util_subvolume_info subvol;
-
+	self->busy = true;
+	Py_BEGIN_ALLOW_THREADS
+	if (self->info)
 		err = btrfs_util_subvolume_iter_next_info(self->iter, &path, &subvol);
-		if (err == BTRFS_UTIL_ERROR_STOP_ITERATION) {
-			PyErr_SetNone(PyExc_StopIteration);
-			return NULL;
-		} else if (err) {
-			SetFromBtrfsUtilError(err);
-			return NULL;
-		}
-
-		tmp = subvolume_info_to_object(&subvol);
-	} else {
-		uint64_t id;
-
+	else
 		err = btrfs_util_subvolume_iter_next(self->iter, &path, &id);
-		if (err == BTRFS_UTIL_ERROR_STOP_ITERATION) {
-			PyErr_SetNone(PyExc_StopIteration);
-			return NULL;
-		} else if (err) {
-			SetFromBtrfsUtilError(err);
-			return NULL;
-		}
+	Py_END_ALLOW_THREADS
+	self->busy = false;
+	if (err == BTRFS_UTIL_ERROR_STOP_ITERATION) {
+		PyErr_SetNone(PyExc_StopIteration);
+		return NULL;
+	} else if (err) {
+		SetFromBtrfsUtilError(err);
+		return NULL;
+	}
 
+	if (self->info)
+		tmp = subvolume_info_to_object(&subvol);
+	else
 		tmp = PyLong_FromUnsignedLongLong(id);
-
-	}
 	if (tmp) {
 		ret = Py_BuildValue("O&O", PyUnicode_DecodeFSDefault, path,
 				    tmp);
 		Py_DECREF(tmp);
-		free(path);
 	} else {
 		ret = NULL;
 	}
+	free(path);
 	return ret;
 }
 
 static int SubvolumeIterator_init(SubvolumeIterator *self, PyObject *args,
 				  PyObject *kwds)
 {
-	static char *keywords[] = {"path", "top", "info", "post_order", NULL};
+	static char *keywords[] = {"path", "top", "info", "post_order",
+				   "search_buffer_size", NULL};
 	struct path_arg path = {.allow_fd = true};
 	enum btrfs_util_error err;
 	unsigned long long top = 0;
 	int info = 0;
 	int post_order = 0;
+	Py_ssize_t search_buffer_size = 0;
 	int flags = 0;
 
-	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Kpp:SubvolumeIterator",
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|Kppn:SubvolumeIterator",
 					 keywords, &path_converter, &path, &top,
-					 &info, &post_order))
+					 &info, &post_order, &search_buffer_size))
 		return -1;
 
 	if (post_order)
@@ -547,6 +1107,18 @@ static int SubvolumeIterator_init(SubvolumeIterator *self, PyObject *args,
 		return -1;
 	}
 
+	if (search_buffer_size) {
+		err = btrfs_util_subvolume_iter_set_search_buffer_size(self->iter,
+								       search_buffer_size);
+		if (err) {
+			SetFromBtrfsUtilError(err);
+			btrfs_util_subvolume_iter_destroy(self->iter);
+			self->iter = NULL;
+			path_cleanup(&path);
+			return -1;
+		}
+	}
+
 	self->info = info;
 
 	return 0;
@@ -554,6 +1126,10 @@ static int SubvolumeIterator_init(SubvolumeIterator *self, PyObject *args,
 
 static PyObject *SubvolumeIterator_close(SubvolumeIterator *self)
 {
+	if (self->busy) {
+		PyErr_SetString(PyExc_ValueError, "iterator already executing");
+		return NULL;
+	}
 	if (self->iter) {
 		btrfs_util_subvolume_iter_destroy(self->iter);
 		self->iter = NULL;
@@ -591,7 +1167,8 @@ static PyObject *SubvolumeIterator_exit(SubvolumeIterator *self, PyObject *args,
 }
 
 #define SubvolumeIterator_DOC	\
-	 "SubvolumeIterator(path, top=0, info=False, post_order=False) -> new subvolume iterator\n\n"	\
+	 "SubvolumeIterator(path, top=0, info=False, post_order=False,\n"		\
+	 "                  search_buffer_size=0) -> new subvolume iterator\n\n"	\
 	 "Create a new iterator that produces tuples of (path, ID) representing\n"	\
 	 "subvolumes on a filesystem.\n\n"						\
 	 "Arguments:\n"									\
@@ -604,7 +1181,9 @@ static PyObject *SubvolumeIterator_exit(SubvolumeIterator *self, PyObject *args,
 	 "info -- bool indicating the iterator should yield SubvolumeInfo instead of\n"	\
 	 "the subvolume ID\n"								\
 	 "post_order -- bool indicating whether to yield parent subvolumes before\n"	\
-	 "child subvolumes (e.g., 'foo/bar' before 'foo')"
+	 "child subvolumes (e.g., 'foo/bar' before 'foo')\n"				\
+	 "search_buffer_size -- if not zero, size of the buffer for the tree\n"	\
+	 "searches of the privileged iterator, from 4KiB to 16MiB"
 
 static PyMethodDef SubvolumeIterator_methods[] = {
 	{"close", (PyCFunction)SubvolumeIterator_close,
@@ -16,6 +16,7 @@
 # along with libbtrfsutil.  If not, see <http://www.gnu.org/licenses/>.
 
 import os
+import select
 import time
 
 import btrfsutil
@@ -71,3 +72,29 @@ class TestFilesystem(BtrfsTestCase):
                 new_generation = self.super_generation()
                 self.assertGreater(new_generation, old_generation)
                 old_generation = new_generation
+
+    def test_sync_notifier(self):
+        old_generation = self.super_generation()
+        for arg in self.path_or_fd(self.mountpoint):
+            with self.subTest(type=type(arg)):
+                with btrfsutil.SyncNotifier(arg) as notifier:
+                    touch(arg)
+                    transid = btrfsutil.start_sync(arg)
+                    notifier.add(transid)
+                    notifier.add(transid)
+                    events = []
+                    while len(events) < 2:
+                        readable = select.select([notifier], [], [], 60)[0]
+                        self.assertEqual(readable, [notifier])
+                        events += notifier.read()
+                    self.assertEqual(events, [(transid, 0), (transid, 0)])
+                    self.assertEqual(notifier.read(), [])
+                    new_generation = self.super_generation()
+                    self.assertGreater(new_generation, old_generation)
+                    old_generation = new_generation
+
+                    # Committed already, completed right away
+                    notifier.add(transid)
+                    self.assertEqual(notifier.read(), [(transid, 0)])
+                    self.assertRaises(btrfsutil.BtrfsUtilError,
+                                      notifier.add, 0)
@@ -16,6 +16,7 @@
 # along with libbtrfsutil.  If not, see <http://www.gnu.org/licenses/>.
 
 import os
+import subprocess
 import unittest
 
 import btrfsutil
@@ -41,6 +42,48 @@ class TestQgroup(BtrfsTestCase):
         btrfsutil.create_subvolume(subvol)
         btrfsutil.create_snapshot(subvol, snapshot, qgroup_inherit=inherit)
 
+    def test_qgroup_info(self):
+        if os.path.exists('../../btrfs'):
+            btrfs = '../../btrfs'
+        else:
+            btrfs = 'btrfs'
+        subvol = os.path.join(self.mountpoint, 'subvol')
+
+        self.assertRaises(btrfsutil.BtrfsUtilError, btrfsutil.qgroup_info,
+                          self.mountpoint)
+        subprocess.check_call([btrfs, 'quota', 'enable', self.mountpoint])
+        subprocess.check_call([btrfs, 'quota', 'rescan', '-w', self.mountpoint])
+        btrfsutil.create_subvolume(subvol)
+        subprocess.check_call([btrfs, 'qgroup', 'create', '1/0', self.mountpoint])
+        subprocess.check_call([btrfs, 'qgroup', 'assign', '0/256', '1/0',
+                               self.mountpoint])
+        subprocess.check_call([btrfs, 'qgroup', 'limit', '1G', '0/256',
+                               self.mountpoint])
+        btrfsutil.sync(self.mountpoint)
+
+        for arg in self.path_or_fd(self.mountpoint):
+            with self.subTest(type=type(arg)):
+                qgroups, relations = btrfsutil.qgroup_info(arg)
+                self.assertEqual([qgroup.id for qgroup in qgroups],
+                                 [5, 256, 1 << 48])
+                self.assertEqual(relations, [(256, 1 << 48)])
+                self.assertEqual(qgroups[1].max_referenced, 1024 ** 3)
+                self.assertTrue(qgroups[1].limit_flags &
+                                btrfsutil.QGROUP_LIMIT_MAX_REFERENCED)
+                self.assertGreater(qgroups[0].referenced, 0)
+
+        transid = max(qgroup.generation for qgroup in qgroups)
+        with open(os.path.join(subvol, 'file'), 'wb') as f:
+            f.write(b'x' * 65536)
+        btrfsutil.sync(self.mountpoint)
+        changed, relations = btrfsutil.qgroup_info(self.mountpoint,
+                                                   transid + 1)
+        changed = {qgroup.id: qgroup for qgroup in changed}
+        self.assertGreater(changed[256].referenced, qgroups[1].referenced)
+        self.assertGreater(changed[256].generation, transid)
+        self.assertEqual(changed[256].max_referenced, 1024 ** 3)
+        self.assertEqual(relations, [(256, 1 << 48)])
+
 
 class TestQgroupInherit(unittest.TestCase):
     def test_new(self):
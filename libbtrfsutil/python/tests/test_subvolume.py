@@ -22,6 +22,8 @@ import os
 import os.path
 from pathlib import PurePath
 import subprocess
+import sys
+import threading
 import traceback
 
 import btrfsutil
@@ -172,6 +174,77 @@ class TestSubvolume(BtrfsTestCase):
                 self.assertEqual(e.exception.btrfsutilerror,
                                  btrfsutil.ERROR_SUBVOLUME_NOT_FOUND)
 
+    def test_subvolume_info_many(self):
+        ids = []
+        for i in range(100):
+            subvol = os.path.join(self.mountpoint, f'subvol{i}')
+            btrfsutil.create_subvolume(subvol)
+            ids.append(btrfsutil.subvolume_id(subvol))
+        btrfsutil.delete_subvolume(os.path.join(self.mountpoint, 'subvol50'))
+
+        # Unsorted, with duplicates, deleted and invalid IDs
+        ids = [ids[99], 5, ids[0], 2, ids[50], ids[0]] + ids[1:50] + [2**64 - 1]
+        for arg in self.path_or_fd(self.mountpoint):
+            with self.subTest(type=type(arg)):
+                infos = btrfsutil.subvolume_info_many(arg, ids)
+                self.assertEqual(len(infos), len(ids))
+                for id_, info in zip(ids, infos):
+                    if id_ in (2, ids[4], 2**64 - 1):
+                        self.assertIsNone(info)
+                    else:
+                        self.assertEqual(info, btrfsutil.subvolume_info(arg, id_))
+
+        self.assertEqual(btrfsutil.subvolume_info_many(self.mountpoint, []), [])
+
+    def test_subvolume_info_array(self):
+        ids = []
+        for i in range(10):
+            subvol = os.path.join(self.mountpoint, f'subvol{i}')
+            btrfsutil.create_subvolume(subvol)
+            ids.append(btrfsutil.subvolume_id(subvol))
+
+        for arg in self.path_or_fd(self.mountpoint):
+            with self.subTest(type=type(arg)):
+                array = btrfsutil.subvolume_info_array(arg)
+                self.assertEqual(len(array), len(ids))
+                self.assertEqual([info.id for info in array], ids)
+                for id_, info in zip(ids, array):
+                    expected = btrfsutil.subvolume_info(arg, id_)
+                    self.assertEqual(info[:12], expected[:12])
+
+                array = btrfsutil.subvolume_info_array(arg, [ids[3], 2])
+                self.assertEqual(array[0].id, ids[3])
+                self.assertIsNone(array[1])
+
+                view = memoryview(array)
+                self.assertTrue(view.readonly)
+                self.assertEqual(view.shape, (2,))
+                self.assertEqual(view.nbytes, 2 * view.itemsize)
+                self.assertEqual(int.from_bytes(view.tobytes()[:8], sys.byteorder),
+                                 ids[3])
+                self.assertEqual(view.tobytes()[view.itemsize:view.itemsize + 8],
+                                 bytes(8))
+
+        self.assertEqual(len(btrfsutil.subvolume_info_array(self.mountpoint, [])), 0)
+
+    def test_subvolume_iterator_threads(self):
+        for i in range(10):
+            btrfsutil.create_subvolume(os.path.join(self.mountpoint, f'subvol{i}'))
+
+        results = []
+        def list_subvolumes():
+            with btrfsutil.SubvolumeIterator(self.mountpoint) as it:
+                results.append(sorted(it))
+
+        threads = [threading.Thread(target=list_subvolumes) for i in range(4)]
+        for thread in threads:
+            thread.start()
+        for thread in threads:
+            thread.join()
+        self.assertEqual(len(results), 4)
+        for result in results:
+            self.assertEqual(result, results[0])
+
     @skipUnlessHaveNobody
     def test_subvolume_info_unprivileged(self):
         subvol = os.path.join(self.mountpoint, 'subvol')
@@ -355,6 +428,44 @@ class TestSubvolume(BtrfsTestCase):
         btrfsutil.delete_subvolume(subvol + '5', recursive=True)
         self.assertFalse(os.path.exists(subvol + '5'))
 
+        btrfsutil.create_subvolume(subvol + '6')
+        btrfsutil.delete_subvolume(subvol + '6', commit=True)
+        self.assertFalse(os.path.exists(subvol + '6'))
+
+    def test_create_delete_many(self):
+        subvol = os.path.join(self.mountpoint, 'subvol')
+        btrfsutil.create_subvolume(subvol)
+        sources = [subvol] * 20
+        paths = [os.path.join(self.mountpoint, f'snapshot{i}') for i in range(20)]
+
+        btrfsutil.create_snapshots(sources, paths, read_only=True)
+        ids = [btrfsutil.subvolume_id(path) for path in paths]
+        for path in paths:
+            self.assertTrue(btrfsutil.get_subvolume_read_only(path))
+
+        # The existing snapshots fail, the others are created
+        with self.assertRaises(btrfsutil.BtrfsUtilError):
+            btrfsutil.create_snapshots(sources[:2], [paths[0], subvol + '2'])
+        self.assertTrue(btrfsutil.is_subvolume(subvol + '2'))
+
+        btrfsutil.delete_subvolumes(self.mountpoint, ids)
+        for path in paths:
+            self.assertFalse(os.path.exists(path))
+
+        for arg in self.path_or_fd(self.mountpoint):
+            with self.subTest(type=type(arg)):
+                btrfsutil.create_snapshots(sources[:10], paths[:10])
+                ids = [btrfsutil.subvolume_id(path) for path in paths[:10]]
+                btrfsutil.delete_subvolumes(arg, ids, commit=True)
+        for path in paths:
+            self.assertFalse(os.path.exists(path))
+
+        # The deleted ids fail, the others are deleted
+        ids.append(btrfsutil.subvolume_id(subvol + '2'))
+        with self.assertRaises(btrfsutil.BtrfsUtilError):
+            btrfsutil.delete_subvolumes(self.mountpoint, ids)
+        self.assertFalse(os.path.exists(subvol + '2'))
+
     def test_deleted_subvolumes(self):
         subvol = os.path.join(self.mountpoint, 'subvol')
         btrfsutil.create_subvolume(subvol + '1')
@@ -486,6 +597,30 @@ class TestSubvolume(BtrfsTestCase):
         finally:
             os.chdir(pwd)
 
+    def test_subvolume_iterator_search_buffer_size(self):
+        pwd = os.getcwd()
+        try:
+            os.chdir(self.mountpoint)
+            os.mkdir('snapshots')
+            os.mkdir('other')
+            subvols = []
+            for i in range(200):
+                name = f'snapshots/snap{i:03}' if i % 2 else f'other/snap{i:03}'
+                btrfsutil.create_subvolume(name)
+                subvols.append((name, 256 + i))
+            subvols.sort()
+
+            for size in (4096, 64 * 1024, 16 * 1024 * 1024):
+                with btrfsutil.SubvolumeIterator('.', top=5,
+                                                 search_buffer_size=size) as it:
+                    self.assertEqual(sorted(it), subvols)
+
+            for size in (4095, 16 * 1024 * 1024 + 1):
+                with self.assertRaises(btrfsutil.BtrfsUtilError):
+                    btrfsutil.SubvolumeIterator('.', search_buffer_size=size)
+        finally:
+            os.chdir(pwd)
+
     def _skip_unless_have_unprivileged_subvolume_iterator(self, path):
         with drop_privs():
             try:
@@ -18,8 +18,11 @@
  */
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/ioctl.h>
 
 #include "btrfsutil_internal.h"
 
@@ -83,3 +86,428 @@ PUBLIC void btrfs_util_qgroup_inherit_get_groups(const struct btrfs_util_qgroup_
 	*groups = (const uint64_t *)&tmp->qgroups[0];
 	*n = tmp->num_qgroups;
 }
+
+/* Buffer of the tree searches of btrfs_util_qgroup_get_all_fd() */
+#define QGROUP_SEARCH_BUFFER_SIZE	(256 * 1024)
+
+/*
+ * The missing items of the qgroups changed since a transaction are read by
+ * one search over the IDs at most this far apart, the items in between are
+ * read and skipped.
+ */
+#define QGROUP_SEARCH_MAX_GAP		(64)
+
+struct qgroup_entry {
+	struct btrfs_util_qgroup_info info;
+	bool has_info;
+	bool has_limit;
+	/* The usage or the limits may have changed since the min_transid */
+	bool changed;
+};
+
+struct qgroup_search_ctx {
+	uint64_t min_transid;
+	struct qgroup_entry *entries;
+	size_t nr_entries;
+	size_t alloc_entries;
+	/* Item type filled by fill_missing_item() */
+	uint32_t fill_type;
+	struct btrfs_util_qgroup_relation *relations;
+	size_t nr_relations;
+	size_t alloc_relations;
+};
+
+typedef enum btrfs_util_error (*qgroup_item_fn)(const struct btrfs_ioctl_search_header *header,
+						struct qgroup_search_ctx *ctx);
+
+/*
+ * Call @fn for all the items in the key range of @search, continuing after the
+ * last item of each search.
+ */
+static enum btrfs_util_error search_quota_tree(int fd,
+					       struct btrfs_ioctl_search_args_v2 *search,
+					       bool *search_v1, qgroup_item_fn fn,
+					       struct qgroup_search_ctx *ctx)
+{
+	const struct btrfs_ioctl_search_key *sk = &search->key;
+
+	while (1) {
+		const struct btrfs_ioctl_search_header *header = NULL;
+		enum btrfs_util_error err;
+		size_t buf_off = 0;
+		uint64_t objectid;
+		uint32_t type;
+		uint64_t offset;
+		uint32_t i;
+
+		if (tree_search_v2(fd, search, search_v1) == -1)
+			return BTRFS_UTIL_ERROR_SEARCH_FAILED;
+		if (sk->nr_items == 0)
+			return BTRFS_UTIL_OK;
+
+		for (i = 0; i < sk->nr_items; i++) {
+			header = (struct btrfs_ioctl_search_header *)((char *)search->buf +
+								      buf_off);
+			buf_off += sizeof(*header) + btrfs_search_header_len(header);
+			err = fn(header, ctx);
+			if (err)
+				return err;
+		}
+
+		objectid = btrfs_search_header_objectid(header);
+		type = btrfs_search_header_type(header);
+		offset = btrfs_search_header_offset(header);
+		if (offset < UINT64_MAX) {
+			offset++;
+		} else if (type < UINT8_MAX) {
+			type++;
+			offset = 0;
+		} else if (objectid < UINT64_MAX) {
+			objectid++;
+			type = 0;
+			offset = 0;
+		} else {
+			return BTRFS_UTIL_OK;
+		}
+		if (objectid > sk->max_objectid ||
+		    (objectid == sk->max_objectid &&
+		     (type > sk->max_type ||
+		      (type == sk->max_type && offset > sk->max_offset))))
+			return BTRFS_UTIL_OK;
+		search->key.min_objectid = objectid;
+		search->key.min_type = type;
+		search->key.min_offset = offset;
+	}
+}
+
+static void set_search_range(struct btrfs_ioctl_search_args_v2 *search,
+			     uint64_t min_transid,
+			     uint64_t min_objectid, uint32_t min_type,
+			     uint64_t min_offset, uint64_t max_objectid,
+			     uint32_t max_type, uint64_t max_offset)
+{
+	search->key.min_transid = min_transid;
+	search->key.max_transid = UINT64_MAX;
+	search->key.min_objectid = min_objectid;
+	search->key.min_type = min_type;
+	search->key.min_offset = min_offset;
+	search->key.max_objectid = max_objectid;
+	search->key.max_type = max_type;
+	search->key.max_offset = max_offset;
+}
+
+static void copy_qgroup_info(struct btrfs_util_qgroup_info *info,
+			     const struct btrfs_qgroup_info_item *item)
+{
+	info->generation = get_unaligned_le64(&item->generation);
+	info->referenced = get_unaligned_le64(&item->rfer);
+	info->referenced_compressed = get_unaligned_le64(&item->rfer_cmpr);
+	info->exclusive = get_unaligned_le64(&item->excl);
+	info->exclusive_compressed = get_unaligned_le64(&item->excl_cmpr);
+}
+
+static void copy_qgroup_limit(struct btrfs_util_qgroup_info *info,
+			      const struct btrfs_qgroup_limit_item *item)
+{
+	info->limit_flags = get_unaligned_le64(&item->flags);
+	info->max_referenced = get_unaligned_le64(&item->max_rfer);
+	info->max_exclusive = get_unaligned_le64(&item->max_excl);
+	info->rsv_referenced = get_unaligned_le64(&item->rsv_rfer);
+	info->rsv_exclusive = get_unaligned_le64(&item->rsv_excl);
+}
+
+/*
+ * Add an entry for each info and limit item, they're merged by ID once all
+ * are read.
+ */
+static enum btrfs_util_error collect_qgroup_item(const struct btrfs_ioctl_search_header *header,
+						 struct qgroup_search_ctx *ctx)
+{
+	uint32_t type = btrfs_search_header_type(header);
+	uint32_t len = btrfs_search_header_len(header);
+	struct qgroup_entry *entry;
+
+	if (!((type == BTRFS_QGROUP_INFO_KEY &&
+	       len >= sizeof(struct btrfs_qgroup_info_item)) ||
+	      (type == BTRFS_QGROUP_LIMIT_KEY &&
+	       len >= sizeof(struct btrfs_qgroup_limit_item))))
+		return BTRFS_UTIL_OK;
+
+	if (ctx->nr_entries == ctx->alloc_entries) {
+		size_t alloc = ctx->alloc_entries ? ctx->alloc_entries * 2 : 256;
+
+		entry = realloc(ctx->entries, alloc * sizeof(*entry));
+		if (!entry)
+			return BTRFS_UTIL_ERROR_NO_MEMORY;
+		ctx->entries = entry;
+		ctx->alloc_entries = alloc;
+	}
+	entry = &ctx->entries[ctx->nr_entries++];
+	memset(entry, 0, sizeof(*entry));
+	entry->info.id = btrfs_search_header_offset(header);
+	if (type == BTRFS_QGROUP_INFO_KEY) {
+		copy_qgroup_info(&entry->info,
+				 (const struct btrfs_qgroup_info_item *)(header + 1));
+		entry->has_info = true;
+		entry->changed = entry->info.generation >= ctx->min_transid;
+	} else {
+		copy_qgroup_limit(&entry->info,
+				  (const struct btrfs_qgroup_limit_item *)(header + 1));
+		entry->has_limit = true;
+		/* The limit item has no generation, its tree block was written */
+		entry->changed = true;
+	}
+	return BTRFS_UTIL_OK;
+}
+
+static int qgroup_entry_cmp(const void *a, const void *b)
+{
+	const struct qgroup_entry *ea = a;
+	const struct qgroup_entry *eb = b;
+
+	if (ea->info.id != eb->info.id)
+		return ea->info.id < eb->info.id ? -1 : 1;
+	/* The info item first */
+	return eb->has_info - ea->has_info;
+}
+
+/* Merge the entries of the same qgroup and drop the unchanged ones */
+static void merge_qgroup_entries(struct qgroup_search_ctx *ctx)
+{
+	size_t nr = 0;
+	size_t i;
+
+	qsort(ctx->entries, ctx->nr_entries, sizeof(ctx->entries[0]),
+	      qgroup_entry_cmp);
+	for (i = 0; i < ctx->nr_entries; i++) {
+		struct qgroup_entry *entry = &ctx->entries[i];
+		struct qgroup_entry *prev = nr ? &ctx->entries[nr - 1] : NULL;
+
+		if (prev && prev->info.id == entry->info.id) {
+			if (entry->has_limit && !prev->has_limit) {
+				prev->info.limit_flags = entry->info.limit_flags;
+				prev->info.max_referenced = entry->info.max_referenced;
+				prev->info.max_exclusive = entry->info.max_exclusive;
+				prev->info.rsv_referenced = entry->info.rsv_referenced;
+				prev->info.rsv_exclusive = entry->info.rsv_exclusive;
+				prev->has_limit = true;
+			}
+			prev->changed |= entry->changed;
+			continue;
+		}
+		/* The unchanged qgroup may still be merged with its limit */
+		if (prev && !prev->changed)
+			nr--;
+		ctx->entries[nr++] = *entry;
+	}
+	if (nr && !ctx->entries[nr - 1].changed)
+		nr--;
+	ctx->nr_entries = nr;
+}
+
+static enum btrfs_util_error fill_missing_item(const struct btrfs_ioctl_search_header *header,
+					       struct qgroup_search_ctx *ctx)
+{
+	uint32_t type = btrfs_search_header_type(header);
+	uint32_t len = btrfs_search_header_len(header);
+	uint64_t id = btrfs_search_header_offset(header);
+	struct qgroup_entry *entry;
+	size_t lo = 0, hi = ctx->nr_entries;
+
+	if (type != ctx->fill_type)
+		return BTRFS_UTIL_OK;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ctx->entries[mid].info.id < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == ctx->nr_entries || ctx->entries[lo].info.id != id)
+		return BTRFS_UTIL_OK;
+
+	entry = &ctx->entries[lo];
+	if (type == BTRFS_QGROUP_INFO_KEY && !entry->has_info &&
+	    len >= sizeof(struct btrfs_qgroup_info_item)) {
+		copy_qgroup_info(&entry->info,
+				 (const struct btrfs_qgroup_info_item *)(header + 1));
+		entry->has_info = true;
+	} else if (type == BTRFS_QGROUP_LIMIT_KEY && !entry->has_limit &&
+		   len >= sizeof(struct btrfs_qgroup_limit_item)) {
+		copy_qgroup_limit(&entry->info,
+				  (const struct btrfs_qgroup_limit_item *)(header + 1));
+		entry->has_limit = true;
+	}
+	return BTRFS_UTIL_OK;
+}
+
+/*
+ * Read the items of @type of the changed qgroups not found in the tree blocks
+ * written since the min_transid, the IDs close to each other by one search.
+ */
+static enum btrfs_util_error fill_missing_items(int fd,
+						struct btrfs_ioctl_search_args_v2 *search,
+						bool *search_v1,
+						struct qgroup_search_ctx *ctx,
+						uint32_t type)
+{
+	enum btrfs_util_error err;
+	size_t start = 0;
+	size_t i;
+
+	ctx->fill_type = type;
+	while (start < ctx->nr_entries) {
+		const struct qgroup_entry *entry = &ctx->entries[start];
+		uint64_t last;
+
+		if (type == BTRFS_QGROUP_INFO_KEY ? entry->has_info : entry->has_limit) {
+			start++;
+			continue;
+		}
+		last = entry->info.id;
+		for (i = start + 1; i < ctx->nr_entries; i++) {
+			entry = &ctx->entries[i];
+			if (entry->info.id - last > QGROUP_SEARCH_MAX_GAP)
+				break;
+			if (!(type == BTRFS_QGROUP_INFO_KEY ? entry->has_info :
+							      entry->has_limit))
+				last = entry->info.id;
+		}
+		set_search_range(search, 0, 0, type, ctx->entries[start].info.id,
+				 0, type, last);
+		err = search_quota_tree(fd, search, search_v1, fill_missing_item,
+					ctx);
+		if (err)
+			return err;
+		start = i;
+	}
+	return BTRFS_UTIL_OK;
+}
+
+static enum btrfs_util_error collect_qgroup_relation(const struct btrfs_ioctl_search_header *header,
+						     struct qgroup_search_ctx *ctx)
+{
+	uint64_t objectid = btrfs_search_header_objectid(header);
+	uint64_t offset = btrfs_search_header_offset(header);
+	struct btrfs_util_qgroup_relation *relation;
+
+	/* Each relation has an item for both qgroups, use the member's */
+	if (btrfs_search_header_type(header) != BTRFS_QGROUP_RELATION_KEY ||
+	    objectid >= offset)
+		return BTRFS_UTIL_OK;
+
+	if (ctx->nr_relations == ctx->alloc_relations) {
+		size_t alloc = ctx->alloc_relations ? ctx->alloc_relations * 2 : 256;
+
+		relation = realloc(ctx->relations, alloc * sizeof(*relation));
+		if (!relation)
+			return BTRFS_UTIL_ERROR_NO_MEMORY;
+		ctx->relations = relation;
+		ctx->alloc_relations = alloc;
+	}
+	relation = &ctx->relations[ctx->nr_relations++];
+	relation->member = objectid;
+	relation->parent = offset;
+	return BTRFS_UTIL_OK;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_qgroup_get_all(const char *path,
+						       uint64_t min_transid,
+						       struct btrfs_util_qgroup_info *qgroups,
+						       size_t *n_qgroups,
+						       struct btrfs_util_qgroup_relation *relations,
+						       size_t *n_relations)
+{
+	enum btrfs_util_error err;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return BTRFS_UTIL_ERROR_OPEN_FAILED;
+
+	err = btrfs_util_qgroup_get_all_fd(fd, min_transid, qgroups, n_qgroups,
+					   relations, n_relations);
+	SAVE_ERRNO_AND_CLOSE(fd);
+	return err;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_qgroup_get_all_fd(int fd, uint64_t min_transid,
+							  struct btrfs_util_qgroup_info *qgroups,
+							  size_t *n_qgroups,
+							  struct btrfs_util_qgroup_relation *relations,
+							  size_t *n_relations)
+{
+	struct btrfs_ioctl_search_args_v2 *search;
+	struct qgroup_search_ctx ctx = { .min_transid = min_transid };
+	enum btrfs_util_error err;
+	bool search_v1 = false;
+	bool too_small = false;
+	size_t i;
+
+	if (!n_qgroups || (relations && !n_relations)) {
+		errno = EINVAL;
+		return BTRFS_UTIL_ERROR_INVALID_ARGUMENT;
+	}
+
+	search = malloc(sizeof(*search) + QGROUP_SEARCH_BUFFER_SIZE);
+	if (!search)
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+	memset(search, 0, sizeof(*search));
+	search->key.tree_id = BTRFS_QUOTA_TREE_OBJECTID;
+	search->buf_size = QGROUP_SEARCH_BUFFER_SIZE;
+
+	/*
+	 * The info and limit items are all at objectid zero, only the tree
+	 * blocks written since the min_transid are read.
+	 */
+	set_search_range(search, min_transid, 0, BTRFS_QGROUP_INFO_KEY, 0,
+			 0, BTRFS_QGROUP_LIMIT_KEY, UINT64_MAX);
+	err = search_quota_tree(fd, search, &search_v1, collect_qgroup_item,
+				&ctx);
+	if (err)
+		goto out;
+	merge_qgroup_entries(&ctx);
+
+	if (min_transid) {
+		err = fill_missing_items(fd, search, &search_v1, &ctx,
+					 BTRFS_QGROUP_INFO_KEY);
+		if (!err)
+			err = fill_missing_items(fd, search, &search_v1, &ctx,
+						 BTRFS_QGROUP_LIMIT_KEY);
+		if (err)
+			goto out;
+	}
+
+	if (relations) {
+		set_search_range(search, 0, 1, BTRFS_QGROUP_RELATION_KEY, 0,
+				 UINT64_MAX, BTRFS_QGROUP_RELATION_KEY,
+				 UINT64_MAX);
+		err = search_quota_tree(fd, search, &search_v1,
+					collect_qgroup_relation, &ctx);
+		if (err)
+			goto out;
+		if (ctx.nr_relations > *n_relations)
+			too_small = true;
+		for (i = 0; i < ctx.nr_relations && i < *n_relations; i++)
+			relations[i] = ctx.relations[i];
+		*n_relations = ctx.nr_relations;
+	}
+
+	if (ctx.nr_entries > *n_qgroups)
+		too_small = true;
+	for (i = 0; i < ctx.nr_entries && i < *n_qgroups; i++)
+		qgroups[i] = ctx.entries[i].info;
+	*n_qgroups = ctx.nr_entries;
+
+	if (too_small) {
+		errno = EOVERFLOW;
+		err = BTRFS_UTIL_ERROR_BUFFER_TOO_SMALL;
+	}
+
+out:
+	free(ctx.relations);
+	free(ctx.entries);
+	free(search);
+	return err;
+}
@@ -471,6 +471,246 @@ PUBLIC enum btrfs_util_error btrfs_util_subvolume_get_info_fd(int fd, uint64_t i
 							      struct btrfs_util_subvolume_info *subvol)
 LIBBTRFSUTIL_ALIAS(btrfs_util_subvolume_info_fd);
 
+/* Buffer of the tree searches of btrfs_util_subvolume_get_info_many_fd() */
+#define SUBVOLUME_INFO_SEARCH_BUFFER_SIZE	(64 * 1024)
+/*
+ * Largest gap between two requested IDs searched in one key range, the root
+ * tree items in between are read and skipped.
+ */
+#define SUBVOLUME_INFO_MAX_GAP			(16)
+
+/*
+ * Search the tree with TREE_SEARCH_V2 into the buffer of @search, or the v1
+ * ioctl and its 4KiB buffer if the kernel does not support v2 (@search_v1 is
+ * set then and used for the next searches).
+ */
+int tree_search_v2(int fd, struct btrfs_ioctl_search_args_v2 *search,
+		   bool *search_v1)
+{
+	struct btrfs_ioctl_search_args args;
+	int ret;
+
+	if (!*search_v1) {
+		search->key.nr_items = UINT32_MAX;
+		ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH_V2, search);
+		if (ret == 0 || errno != ENOTTY)
+			return ret;
+		*search_v1 = true;
+	}
+
+	args.key = search->key;
+	args.key.nr_items = 4096;
+	ret = ioctl(fd, BTRFS_IOC_TREE_SEARCH, &args);
+	if (ret == -1)
+		return ret;
+	search->key = args.key;
+	/* The buffer is never smaller than the v1 buffer */
+	memcpy(search->buf, args.buf, sizeof(args.buf));
+	return 0;
+}
+
+struct subvolume_info_request {
+	uint64_t id;
+	size_t index;
+};
+
+static int subvolume_info_request_cmp(const void *a, const void *b)
+{
+	const struct subvolume_info_request *ra = a;
+	const struct subvolume_info_request *rb = b;
+
+	if (ra->id != rb->id)
+		return ra->id < rb->id ? -1 : 1;
+	return ra->index < rb->index ? -1 : ra->index > rb->index;
+}
+
+/*
+ * Fill the info of the requests from @start to @end, sorted by ID and close
+ * to each other, from the ROOT_ITEM and ROOT_BACKREF items in one key range.
+ */
+static enum btrfs_util_error get_subvolume_info_range(int fd,
+						      struct btrfs_ioctl_search_args_v2 *search,
+						      bool *search_v1,
+						      const struct subvolume_info_request *reqs,
+						      size_t start, size_t end,
+						      struct btrfs_util_subvolume_info *subvols)
+{
+	size_t pos = start;
+
+	search->key.min_objectid = reqs[start].id;
+	search->key.min_type = BTRFS_ROOT_ITEM_KEY;
+	search->key.min_offset = 0;
+	search->key.max_objectid = reqs[end - 1].id;
+	search->key.max_type = BTRFS_ROOT_BACKREF_KEY;
+	search->key.max_offset = UINT64_MAX;
+
+	while (pos < end) {
+		const struct btrfs_ioctl_search_header *header = NULL;
+		size_t items_pos, buf_off = 0;
+		uint64_t objectid;
+		uint32_t type;
+		uint64_t offset;
+
+		if (tree_search_v2(fd, search, search_v1) == -1)
+			return BTRFS_UTIL_ERROR_SEARCH_FAILED;
+		if (search->key.nr_items == 0)
+			break;
+
+		for (items_pos = 0; items_pos < search->key.nr_items; items_pos++) {
+			size_t i;
+
+			header = (struct btrfs_ioctl_search_header *)((char *)search->buf +
+								      buf_off);
+			buf_off += sizeof(*header) + btrfs_search_header_len(header);
+
+			objectid = btrfs_search_header_objectid(header);
+			while (pos < end && reqs[pos].id < objectid)
+				pos++;
+			if (pos == end)
+				break;
+			if (reqs[pos].id != objectid)
+				continue;
+
+			/* The same ID may be requested more than once */
+			for (i = pos; i < end && reqs[i].id == objectid; i++) {
+				struct btrfs_util_subvolume_info *subvol;
+
+				subvol = &subvols[reqs[i].index];
+				if (btrfs_search_header_type(header) == BTRFS_ROOT_ITEM_KEY) {
+					const struct btrfs_root_item *root;
+
+					root = (const struct btrfs_root_item *)(header + 1);
+					subvol->id = objectid;
+					copy_root_item(subvol, root);
+				} else if (btrfs_search_header_type(header) == BTRFS_ROOT_BACKREF_KEY &&
+					   subvol->id && !subvol->parent_id) {
+					const struct btrfs_root_ref *ref;
+
+					ref = (const struct btrfs_root_ref *)(header + 1);
+					subvol->parent_id = btrfs_search_header_offset(header);
+					subvol->dir_id = get_unaligned_le64(&ref->dirid);
+				}
+			}
+			/* Like the single lookup, the first backref is enough */
+			if (objectid == reqs[end - 1].id &&
+			    btrfs_search_header_type(header) == BTRFS_ROOT_BACKREF_KEY) {
+				pos = end;
+				break;
+			}
+		}
+		if (pos == end)
+			break;
+
+		/* Continue after the last item, or at the next requested ID */
+		objectid = btrfs_search_header_objectid(header);
+		type = btrfs_search_header_type(header);
+		offset = btrfs_search_header_offset(header);
+		if (offset < UINT64_MAX) {
+			offset++;
+		} else if (type < UINT8_MAX) {
+			type++;
+			offset = 0;
+		} else {
+			objectid++;
+			type = 0;
+			offset = 0;
+		}
+		if (reqs[pos].id > objectid) {
+			objectid = reqs[pos].id;
+			type = BTRFS_ROOT_ITEM_KEY;
+			offset = 0;
+		}
+		if (objectid > search->key.max_objectid)
+			break;
+		search->key.min_objectid = objectid;
+		search->key.min_type = type;
+		search->key.min_offset = offset;
+	}
+
+	return BTRFS_UTIL_OK;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_get_info_many(const char *path,
+								const uint64_t *ids,
+								size_t n,
+								struct btrfs_util_subvolume_info *subvols)
+{
+	enum btrfs_util_error err;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return BTRFS_UTIL_ERROR_OPEN_FAILED;
+
+	err = btrfs_util_subvolume_get_info_many_fd(fd, ids, n, subvols);
+	SAVE_ERRNO_AND_CLOSE(fd);
+	return err;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_get_info_many_fd(int fd,
+								   const uint64_t *ids,
+								   size_t n,
+								   struct btrfs_util_subvolume_info *subvols)
+{
+	struct btrfs_ioctl_search_args_v2 *search = NULL;
+	struct subvolume_info_request *reqs;
+	enum btrfs_util_error err = BTRFS_UTIL_OK;
+	bool search_v1 = false;
+	size_t nr_reqs = 0;
+	size_t start, i;
+
+	memset(subvols, 0, n * sizeof(*subvols));
+	if (n == 0)
+		return BTRFS_UTIL_OK;
+
+	reqs = malloc(n * sizeof(*reqs));
+	if (!reqs)
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+
+	/* IDs that can't be subvolumes are not found */
+	for (i = 0; i < n; i++) {
+		if ((ids[i] < BTRFS_FIRST_FREE_OBJECTID &&
+		     ids[i] != BTRFS_FS_TREE_OBJECTID) ||
+		    ids[i] > BTRFS_LAST_FREE_OBJECTID)
+			continue;
+		reqs[nr_reqs].id = ids[i];
+		reqs[nr_reqs].index = i;
+		nr_reqs++;
+	}
+	if (nr_reqs == 0)
+		goto out;
+	qsort(reqs, nr_reqs, sizeof(*reqs), subvolume_info_request_cmp);
+
+	search = malloc(sizeof(*search) + SUBVOLUME_INFO_SEARCH_BUFFER_SIZE);
+	if (!search) {
+		err = BTRFS_UTIL_ERROR_NO_MEMORY;
+		goto out;
+	}
+	memset(search, 0, sizeof(*search));
+	search->key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+	search->key.min_transid = 0;
+	search->key.max_transid = UINT64_MAX;
+	search->buf_size = SUBVOLUME_INFO_SEARCH_BUFFER_SIZE;
+
+	/* Search the IDs close to each other in one range */
+	start = 0;
+	for (i = 1; i <= nr_reqs; i++) {
+		if (i < nr_reqs &&
+		    reqs[i].id - reqs[i - 1].id <= SUBVOLUME_INFO_MAX_GAP)
+			continue;
+		err = get_subvolume_info_range(fd, search, &search_v1, reqs,
+					       start, i, subvols);
+		if (err)
+			goto out;
+		start = i;
+	}
+
+out:
+	free(search);
+	free(reqs);
+	return err;
+}
+
 PUBLIC enum btrfs_util_error btrfs_util_get_subvolume_read_only_fd(int fd,
 								   bool *read_only_ret)
 {
@@ -786,11 +1026,19 @@ LIBBTRFSUTIL_ALIAS(btrfs_util_create_subvolume_fd);
 
 #define BTRFS_UTIL_SUBVOLUME_ITERATOR_CLOSE_FD (1U << 30)
 
+/* Default and allowed sizes of the tree search buffer of each stack entry */
+#define SUBVOLUME_ITERATOR_SEARCH_BUFFER_SIZE		(64 * 1024)
+#define SUBVOLUME_ITERATOR_SEARCH_BUFFER_MIN		(4096)
+#define SUBVOLUME_ITERATOR_SEARCH_BUFFER_MAX		(16 * 1024 * 1024)
+/* Number of directory paths cached by subvolume_iterator_next_tree_search() */
+#define SUBVOLUME_ITERATOR_DIR_CACHE			(64)
+
 struct search_stack_entry {
 	union {
 		/* Used for subvolume_iterator_next_tree_search(). */
 		struct {
-			struct btrfs_ioctl_search_args search;
+			/* Owned by the iterator, reused for each depth */
+			struct btrfs_ioctl_search_args_v2 *search;
 			size_t buf_off;
 		};
 		/* Used for subvolume_iterator_next_unprivileged(). */
@@ -815,6 +1063,34 @@ struct btrfs_util_subvolume_iterator {
 	size_t search_stack_len;
 	size_t search_stack_capacity;
 
+	/*
+	 * Tree search buffers for each depth of the stack, allocated on first
+	 * use, for subvolume_iterator_next_tree_search().
+	 */
+	struct btrfs_ioctl_search_args_v2 **search_bufs;
+	size_t search_buf_size;
+	/* The kernel does not have TREE_SEARCH_V2, use the 4KiB v1 */
+	bool search_v1;
+
+	/*
+	 * Paths of the directories in the parent subvolumes, by the tree and
+	 * directory ids, as returned by BTRFS_IOC_INO_LOOKUP.  Snapshots are
+	 * often created in the same few directories.
+	 */
+	struct {
+		uint64_t treeid;
+		uint64_t dirid;
+		char *path;
+	} dir_cache[SUBVOLUME_ITERATOR_DIR_CACHE];
+
+	/*
+	 * Info of the subvolumes pending in the search buffers, sorted by ID,
+	 * for btrfs_util_subvolume_iter_next_info().
+	 */
+	uint64_t *info_ids;
+	struct btrfs_util_subvolume_info *info_cache;
+	size_t info_cache_len;
+
 	char *cur_path;
 	size_t cur_path_capacity;
 };
@@ -880,15 +1156,25 @@ static enum btrfs_util_error append_to_search_stack(struct btrfs_util_subvolume_
 	if (iter->search_stack_len >= iter->search_stack_capacity) {
 		size_t new_capacity = iter->search_stack_capacity * 2;
 		struct search_stack_entry *new_search_stack;
+		struct btrfs_ioctl_search_args_v2 **new_search_bufs;
 
 		new_search_stack = reallocarray(iter->search_stack,
 						new_capacity,
 						sizeof(*iter->search_stack));
 		if (!new_search_stack)
 			return BTRFS_UTIL_ERROR_NO_MEMORY;
+		iter->search_stack = new_search_stack;
+
+		new_search_bufs = reallocarray(iter->search_bufs, new_capacity,
+					       sizeof(*iter->search_bufs));
+		if (!new_search_bufs)
+			return BTRFS_UTIL_ERROR_NO_MEMORY;
+		memset(&new_search_bufs[iter->search_stack_capacity], 0,
+		       (new_capacity - iter->search_stack_capacity) *
+		       sizeof(*new_search_bufs));
+		iter->search_bufs = new_search_bufs;
 
 		iter->search_stack_capacity = new_capacity;
-		iter->search_stack = new_search_stack;
 	}
 
 	entry = &iter->search_stack[iter->search_stack_len];
@@ -896,16 +1182,27 @@ static enum btrfs_util_error append_to_search_stack(struct btrfs_util_subvolume_
 	memset(entry, 0, sizeof(*entry));
 	entry->path_len = path_len;
 	if (iter->use_tree_search) {
-		entry->search.key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
-		entry->search.key.min_objectid = tree_id;
-		entry->search.key.max_objectid = tree_id;
-		entry->search.key.min_type = BTRFS_ROOT_REF_KEY;
-		entry->search.key.max_type = BTRFS_ROOT_REF_KEY;
-		entry->search.key.min_offset = 0;
-		entry->search.key.max_offset = UINT64_MAX;
-		entry->search.key.min_transid = 0;
-		entry->search.key.max_transid = UINT64_MAX;
-		entry->search.key.nr_items = 0;
+		struct btrfs_ioctl_search_args_v2 **search;
+
+		search = &iter->search_bufs[iter->search_stack_len];
+		if (!*search) {
+			*search = malloc(sizeof(**search) + iter->search_buf_size);
+			if (!*search)
+				return BTRFS_UTIL_ERROR_NO_MEMORY;
+		}
+		entry->search = *search;
+		memset(&entry->search->key, 0, sizeof(entry->search->key));
+		entry->search->key.tree_id = BTRFS_ROOT_TREE_OBJECTID;
+		entry->search->key.min_objectid = tree_id;
+		entry->search->key.max_objectid = tree_id;
+		entry->search->key.min_type = BTRFS_ROOT_REF_KEY;
+		entry->search->key.max_type = BTRFS_ROOT_REF_KEY;
+		entry->search->key.min_offset = 0;
+		entry->search->key.max_offset = UINT64_MAX;
+		entry->search->key.min_transid = 0;
+		entry->search->key.max_transid = UINT64_MAX;
+		entry->search->key.nr_items = 0;
+		entry->search->buf_size = iter->search_buf_size;
 	} else {
 		entry->id = tree_id;
 
@@ -1043,6 +1340,19 @@ PUBLIC enum btrfs_util_error btrfs_util_create_subvolume_iterator_fd(int fd,
 		goto out_iter;
 	}
 
+	iter->search_buf_size = SUBVOLUME_ITERATOR_SEARCH_BUFFER_SIZE;
+	iter->search_v1 = false;
+	memset(iter->dir_cache, 0, sizeof(iter->dir_cache));
+	iter->info_ids = NULL;
+	iter->info_cache = NULL;
+	iter->info_cache_len = 0;
+	iter->search_bufs = calloc(iter->search_stack_capacity,
+				   sizeof(*iter->search_bufs));
+	if (!iter->search_bufs) {
+		err = BTRFS_UTIL_ERROR_NO_MEMORY;
+		goto out_search_stack;
+	}
+
 	iter->cur_path_capacity = 256;
 	iter->cur_path = malloc(iter->cur_path_capacity);
 	if (!iter->cur_path) {
@@ -1061,6 +1371,8 @@ PUBLIC enum btrfs_util_error btrfs_util_create_subvolume_iterator_fd(int fd,
 out_cur_path:
 	free(iter->cur_path);
 out_search_stack:
+	free(iter->search_bufs ? iter->search_bufs[0] : NULL);
+	free(iter->search_bufs);
 	free(iter->search_stack);
 out_iter:
 	free(iter);
@@ -1241,6 +1553,44 @@ PUBLIC enum btrfs_util_error btrfs_util_subvolume_snapshot_fd2(int fd, int paren
 							       struct btrfs_util_qgroup_inherit *qgroup_inherit)
 LIBBTRFSUTIL_ALIAS(btrfs_util_create_snapshot_fd2);
 
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_snapshot_many(const char * const *sources,
+								const char * const *paths,
+								size_t n, int flags,
+								struct btrfs_util_qgroup_inherit *qgroup_inherit,
+								enum btrfs_util_error *errors)
+{
+	enum btrfs_util_error err, ret = BTRFS_UTIL_OK;
+	int saved_errno = 0;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		err = btrfs_util_subvolume_snapshot(sources[i], paths[i], flags,
+						    NULL, qgroup_inherit);
+		if (errors)
+			errors[i] = err;
+		if (err && !ret) {
+			ret = err;
+			saved_errno = errno;
+		}
+	}
+
+	if (ret)
+		errno = saved_errno;
+	return ret;
+}
+
+static enum btrfs_util_error wait_for_commit(int fd)
+{
+	enum btrfs_util_error err;
+	uint64_t transid;
+
+	err = btrfs_util_fs_start_sync_fd(fd, &transid);
+	if (err)
+		return err;
+
+	return btrfs_util_fs_wait_sync_fd(fd, transid);
+}
+
 static enum btrfs_util_error delete_subvolume_children(int parent_fd,
 						       const char *name)
 {
@@ -1338,6 +1688,9 @@ PUBLIC enum btrfs_util_error btrfs_util_delete_subvolume_fd(int parent_fd,
 	if (ret == -1)
 		return BTRFS_UTIL_ERROR_SNAP_DESTROY_FAILED;
 
+	if (flags & BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT)
+		return wait_for_commit(parent_fd);
+
 	return BTRFS_UTIL_OK;
 }
 PUBLIC enum btrfs_util_error btrfs_util_subvolume_delete_fd(int parent_fd,
@@ -1363,9 +1716,75 @@ PUBLIC enum btrfs_util_error btrfs_util_delete_subvolume_by_id_fd(int parent_fd,
 PUBLIC enum btrfs_util_error btrfs_util_subvolume_delete_by_id_fd(int fd, uint64_t subvolid)
 LIBBTRFSUTIL_ALIAS(btrfs_util_delete_subvolume_by_id_fd);
 
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_delete_many(const char *path,
+							      const uint64_t *ids,
+							      size_t n, int flags,
+							      enum btrfs_util_error *errors)
+{
+	enum btrfs_util_error err;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return BTRFS_UTIL_ERROR_OPEN_FAILED;
+
+	err = btrfs_util_subvolume_delete_many_fd(fd, ids, n, flags, errors);
+	SAVE_ERRNO_AND_CLOSE(fd);
+	return err;
+}
+
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_delete_many_fd(int fd,
+								 const uint64_t *ids,
+								 size_t n, int flags,
+								 enum btrfs_util_error *errors)
+{
+	enum btrfs_util_error err, ret = BTRFS_UTIL_OK;
+	int saved_errno = 0;
+	size_t i, deleted = 0;
+
+	if (flags & ~BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT) {
+		errno = EINVAL;
+		return BTRFS_UTIL_ERROR_INVALID_ARGUMENT;
+	}
+
+	for (i = 0; i < n; i++) {
+		err = btrfs_util_subvolume_delete_by_id_fd(fd, ids[i]);
+		if (errors)
+			errors[i] = err;
+		if (!err) {
+			deleted++;
+		} else if (!ret) {
+			ret = err;
+			saved_errno = errno;
+		}
+	}
+
+	/* One commit for all the deletions */
+	if (deleted && (flags & BTRFS_UTIL_DELETE_SUBVOLUME_COMMIT)) {
+		err = wait_for_commit(fd);
+		if (err && !ret) {
+			ret = err;
+			saved_errno = errno;
+		}
+	}
+
+	if (ret)
+		errno = saved_errno;
+	return ret;
+}
+
 PUBLIC void btrfs_util_destroy_subvolume_iterator(struct btrfs_util_subvolume_iterator *iter)
 {
 	if (iter) {
+		size_t i;
+
+		for (i = 0; i < iter->search_stack_capacity; i++)
+			free(iter->search_bufs[i]);
+		free(iter->search_bufs);
+		for (i = 0; i < SUBVOLUME_ITERATOR_DIR_CACHE; i++)
+			free(iter->dir_cache[i].path);
+		free(iter->info_ids);
+		free(iter->info_cache);
 		free(iter->cur_path);
 		free(iter->search_stack);
 		if (iter->cur_fd != iter->fd)
@@ -1378,6 +1797,44 @@ PUBLIC void btrfs_util_destroy_subvolume_iterator(struct btrfs_util_subvolume_it
 PUBLIC void btrfs_util_subvolume_iter_destroy(struct btrfs_util_subvolume_iterator *iter)
 LIBBTRFSUTIL_ALIAS(btrfs_util_destroy_subvolume_iterator);
 
+PUBLIC enum btrfs_util_error btrfs_util_subvolume_iter_set_search_buffer_size(struct btrfs_util_subvolume_iterator *iter,
+									   size_t size)
+{
+	struct search_stack_entry *top;
+	size_t i;
+
+	if (size < SUBVOLUME_ITERATOR_SEARCH_BUFFER_MIN ||
+	    size > SUBVOLUME_ITERATOR_SEARCH_BUFFER_MAX) {
+		errno = EINVAL;
+		return BTRFS_UTIL_ERROR_INVALID_ARGUMENT;
+	}
+
+	/* Only before the iteration started, the buffer is not used yet */
+	top = top_search_stack_entry(iter);
+	if (iter->search_stack_len != 1 || top->items_pos ||
+	    (iter->use_tree_search && top->search->key.nr_items)) {
+		errno = EINVAL;
+		return BTRFS_UTIL_ERROR_INVALID_ARGUMENT;
+	}
+
+	for (i = 0; i < iter->search_stack_capacity; i++) {
+		struct btrfs_ioctl_search_args_v2 *search;
+
+		if (!iter->search_bufs[i])
+			continue;
+		search = realloc(iter->search_bufs[i], sizeof(*search) + size);
+		if (!search)
+			return BTRFS_UTIL_ERROR_NO_MEMORY;
+		search->buf_size = size;
+		iter->search_bufs[i] = search;
+	}
+	if (iter->use_tree_search)
+		top->search = iter->search_bufs[0];
+	iter->search_buf_size = size;
+
+	return BTRFS_UTIL_OK;
+}
+
 PUBLIC int btrfs_util_subvolume_iterator_fd(const struct btrfs_util_subvolume_iterator *iter)
 {
 	return iter->fd;
@@ -1449,17 +1906,44 @@ static enum btrfs_util_error build_subvol_path_privileged(struct btrfs_util_subv
 		.treeid = btrfs_search_header_objectid(header),
 		.objectid = get_unaligned_le64(&ref->dirid),
 	};
+	size_t slot;
 	int ret;
 
+	slot = (lookup.treeid * 31 + lookup.objectid) % SUBVOLUME_ITERATOR_DIR_CACHE;
+	if (iter->dir_cache[slot].path &&
+	    iter->dir_cache[slot].treeid == lookup.treeid &&
+	    iter->dir_cache[slot].dirid == lookup.objectid)
+		goto build;
+
 	ret = ioctl(iter->fd, BTRFS_IOC_INO_LOOKUP, &lookup);
 	if (ret == -1)
 		return BTRFS_UTIL_ERROR_INO_LOOKUP_FAILED;
 
+	free(iter->dir_cache[slot].path);
+	iter->dir_cache[slot].path = strdup(lookup.name);
+	if (!iter->dir_cache[slot].path)
+		return BTRFS_UTIL_ERROR_NO_MEMORY;
+	iter->dir_cache[slot].treeid = lookup.treeid;
+	iter->dir_cache[slot].dirid = lookup.objectid;
+
+build:
 	return build_subvol_path(iter, name, get_unaligned_le16(&ref->name_len),
-				 lookup.name, strlen(lookup.name),
+				 iter->dir_cache[slot].path,
+				 strlen(iter->dir_cache[slot].path),
 				 path_len_ret);
 }
 
+/*
+ * Search the next ROOT_REF items of the subvolume of @top, with the v1 ioctl
+ * if the kernel does not support v2.
+ */
+static int subvolume_iterator_search(struct btrfs_util_subvolume_iterator *iter,
+				     struct search_stack_entry *top)
+{
+	top->search->buf_size = iter->search_buf_size;
+	return tree_search_v2(iter->fd, top->search, &iter->search_v1);
+}
+
 static enum btrfs_util_error build_subvol_path_unprivileged(struct btrfs_util_subvolume_iterator *iter,
 							    uint64_t treeid,
 							    uint64_t dirid,
@@ -1497,17 +1981,16 @@ static enum btrfs_util_error subvolume_iterator_next_tree_search(struct btrfs_ut
 				return BTRFS_UTIL_ERROR_STOP_ITERATION;
 
 			top = top_search_stack_entry(iter);
-			if (top->items_pos < top->search.key.nr_items) {
+			if (top->items_pos < top->search->key.nr_items) {
 				break;
 			} else {
-				top->search.key.nr_items = 4096;
-				ret = ioctl(iter->fd, BTRFS_IOC_TREE_SEARCH, &top->search);
+				ret = subvolume_iterator_search(iter, top);
 				if (ret == -1)
 					return BTRFS_UTIL_ERROR_SEARCH_FAILED;
 				top->items_pos = 0;
 				top->buf_off = 0;
 
-				if (top->search.key.nr_items == 0) {
+				if (top->search->key.nr_items == 0) {
 					/*
 					 * This never fails for use_tree_search.
 					 */
@@ -1519,11 +2002,12 @@ static enum btrfs_util_error subvolume_iterator_next_tree_search(struct btrfs_ut
 			}
 		}
 
-		header = (struct btrfs_ioctl_search_header *)(top->search.buf + top->buf_off);
+		header = (struct btrfs_ioctl_search_header *)((char *)top->search->buf +
+							      top->buf_off);
 
 		top->items_pos++;
 		top->buf_off += sizeof(*header) + btrfs_search_header_len(header);
-		top->search.key.min_offset = btrfs_search_header_offset(header) + 1;
+		top->search->key.min_offset = btrfs_search_header_offset(header) + 1;
 
 		/* This shouldn't happen, but handle it just in case. */
 		if (btrfs_search_header_type(header) != BTRFS_ROOT_REF_KEY)
@@ -1564,7 +2048,7 @@ out:
 		(*path_ret)[top->path_len] = '\0';
 	}
 	if (id_ret)
-		*id_ret = top->search.key.min_objectid;
+		*id_ret = top->search->key.min_objectid;
 	return BTRFS_UTIL_OK;
 }
 
@@ -1670,6 +2154,120 @@ PUBLIC enum btrfs_util_error btrfs_util_subvolume_iter_next(struct btrfs_util_su
 							     uint64_t *id_ret)
 LIBBTRFSUTIL_ALIAS(btrfs_util_subvolume_iterator_next);
 
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t ua = *(const uint64_t *)a;
+	uint64_t ub = *(const uint64_t *)b;
+
+	return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * Get the info of the subvolume @id from the cache, or refill the cache with
+ * the info of @id and of all the subvolumes still pending in the search
+ * buffers of the stack.  The info not cached yet is read together by one
+ * btrfs_util_subvolume_get_info_many_fd().
+ */
+static enum btrfs_util_error subvolume_iterator_get_info(struct btrfs_util_subvolume_iterator *iter,
+							 uint64_t id,
+							 struct btrfs_util_subvolume_info *subvol)
+{
+	struct btrfs_util_subvolume_info *cache, *new_info;
+	uint64_t *ids, *new_ids, *found;
+	size_t nr_ids = 1, nr_new = 0, capacity = 1;
+	enum btrfs_util_error err;
+	size_t i, j;
+
+	found = bsearch(&id, iter->info_ids, iter->info_cache_len,
+			sizeof(*iter->info_ids), compare_u64);
+	if (found) {
+		i = found - iter->info_ids;
+		goto out;
+	}
+
+	for (i = 0; i < iter->search_stack_len; i++) {
+		const struct search_stack_entry *entry = &iter->search_stack[i];
+
+		capacity += entry->search->key.nr_items - entry->items_pos;
+	}
+	ids = malloc(capacity * sizeof(*ids));
+	new_ids = malloc(capacity * sizeof(*new_ids));
+	cache = malloc(capacity * sizeof(*cache));
+	new_info = malloc(capacity * sizeof(*new_info));
+	if (!ids || !new_ids || !cache || !new_info) {
+		err = BTRFS_UTIL_ERROR_NO_MEMORY;
+		goto out_free;
+	}
+
+	ids[0] = id;
+	for (i = 0; i < iter->search_stack_len; i++) {
+		const struct search_stack_entry *entry = &iter->search_stack[i];
+		size_t buf_off = entry->buf_off;
+
+		for (j = entry->items_pos; j < entry->search->key.nr_items; j++) {
+			const struct btrfs_ioctl_search_header *header;
+
+			header = (struct btrfs_ioctl_search_header *)((char *)entry->search->buf +
+								      buf_off);
+			buf_off += sizeof(*header) + btrfs_search_header_len(header);
+			if (btrfs_search_header_type(header) == BTRFS_ROOT_REF_KEY)
+				ids[nr_ids++] = btrfs_search_header_offset(header);
+		}
+	}
+	qsort(ids, nr_ids, sizeof(*ids), compare_u64);
+	for (i = 1, j = 1; i < nr_ids; i++) {
+		if (ids[i] != ids[j - 1])
+			ids[j++] = ids[i];
+	}
+	nr_ids = j;
+
+	/* Keep the info already read of the subvolumes still pending */
+	for (i = 0; i < nr_ids; i++) {
+		found = bsearch(&ids[i], iter->info_ids, iter->info_cache_len,
+				sizeof(*iter->info_ids), compare_u64);
+		if (found)
+			cache[i] = iter->info_cache[found - iter->info_ids];
+		else
+			new_ids[nr_new++] = ids[i];
+	}
+	err = btrfs_util_subvolume_get_info_many_fd(iter->fd, new_ids, nr_new,
+						    new_info);
+	if (err)
+		goto out_free;
+	/* Both are sorted, merge the new info */
+	for (i = 0, j = 0; i < nr_ids && j < nr_new; i++) {
+		if (ids[i] == new_ids[j])
+			cache[i] = new_info[j++];
+	}
+
+	free(iter->info_ids);
+	free(iter->info_cache);
+	iter->info_ids = ids;
+	iter->info_cache = cache;
+	iter->info_cache_len = nr_ids;
+	free(new_info);
+	free(new_ids);
+
+	found = bsearch(&id, ids, nr_ids, sizeof(*ids), compare_u64);
+	i = found - ids;
+out:
+	/* Deleted since it was found by the iterator */
+	if (iter->info_cache[i].id == 0) {
+		errno = ENOENT;
+		return BTRFS_UTIL_ERROR_SUBVOLUME_NOT_FOUND;
+	}
+	if (subvol)
+		*subvol = iter->info_cache[i];
+	return BTRFS_UTIL_OK;
+
+out_free:
+	free(new_info);
+	free(cache);
+	free(new_ids);
+	free(ids);
+	return err;
+}
+
 PUBLIC enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(struct btrfs_util_subvolume_iterator *iter,
 								     char **path_ret,
 								     struct btrfs_util_subvolume_info *subvol)
@@ -1682,7 +2280,7 @@ PUBLIC enum btrfs_util_error btrfs_util_subvolume_iterator_next_info(struct btrf
 		return err;
 
 	if (iter->use_tree_search)
-		return btrfs_util_subvolume_get_info_fd(iter->fd, id, subvol);
+		return subvolume_iterator_get_info(iter, id, subvol);
 	else
 		return btrfs_util_subvolume_get_info_fd(iter->cur_fd, 0, subvol);
 }
@@ -421,7 +421,7 @@ int make_btrfs(int fd, struct btrfs_mkfs_config *cfg)
 		system_group_size = cfg->zone_size;
 	}
 
-	buf = malloc(sizeof(*buf) + max(cfg->sectorsize, cfg->nodesize));
+	buf = alloc_extent_buffer_inline(max(cfg->sectorsize, cfg->nodesize));
 	if (!buf)
 		return -ENOMEM;
 
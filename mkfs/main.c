@@ -26,11 +26,11 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <string.h>
-#include <pthread.h>
 #include <uuid/uuid.h>
 #include <blkid/blkid.h>
 #include "kernel-lib/list.h"
 #include "kernel-lib/list_sort.h"
+#include "kernel-lib/raid56.h"
 #include "kernel-lib/rbtree.h"
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
@@ -50,6 +50,7 @@
 #include "common/path-utils.h"
 #include "common/device-utils.h"
 #include "common/device-scan.h"
+#include "common/open-utils.h"
 #include "common/help.h"
 #include "common/rbtree-utils.h"
 #include "common/parse-utils.h"
@@ -59,6 +60,8 @@
 #include "common/string-utils.h"
 #include "common/string-table.h"
 #include "common/root-tree-utils.h"
+#include "common/stats.h"
+#include "common/thread-pool.h"
 #include "cmds/commands.h"
 #include "check/qgroup-verify.h"
 #include "mkfs/common.h"
@@ -463,13 +466,17 @@ static const char * const mkfs_usage[] = {
 	OPTLINE("", "- ro - create the subvolume as read-only"),
 	OPTLINE("", "- default - the SUBDIR will be a subvolume and also set as default (can be specified only once)"),
 	OPTLINE("", "- default-ro - like 'default' and is created as read-only subvolume (can be specified only once)"),
+	OPTLINE("--threads N", "(with --rootdir) number of threads reading and compressing the files, default is the number of online CPUs, 0 reads them in the main thread"),
+	OPTLINE("--dedupe", "(with --rootdir) write the files' extents of the same data once and share them"),
 	OPTLINE("--shrink", "(with --rootdir) shrink the filled filesystem to minimal size"),
+	OPTLINE("--update", "(with --rootdir) update the files of an existing filesystem created from --rootdir instead of creating a new one, only the changed files are written again"),
 	OPTLINE("-K|--nodiscard", "do not perform whole device TRIM"),
 	OPTLINE("-f|--force", "force overwrite of existing filesystem"),
 	"",
 	"General:",
 	OPTLINE("-q|--quiet", "no messages except errors"),
 	OPTLINE("-v|--verbose", "increase verbosity level, default is 1"),
+	OPTLINE("--stats[=json]", "print I/O, cache and memory statistics to stderr on exit"),
 	OPTLINE("-V|--version", "print the mkfs.btrfs version, builtin features and exit"),
 	OPTLINE("--help", "print this help and exit"),
 	"",
@@ -1024,7 +1031,7 @@ static int setup_raid_stripe_tree_root(struct btrfs_fs_info *fs_info)
 }
 
 /* Thread callback for device preparation */
-static void *prepare_one_device(void *ctx)
+static void prepare_one_device(void *arg, void *ctx, void *thread_data)
 {
 	struct prepare_device_progress *prepare_ctx = ctx;
 
@@ -1032,7 +1039,7 @@ static void *prepare_one_device(void *ctx)
 	if (prepare_ctx->fd < 0) {
 		error("unable to open %s: %m", prepare_ctx->file);
 		prepare_ctx->ret = -errno;
-		return NULL;
+		return;
 	}
 	prepare_ctx->ret = btrfs_prepare_device(prepare_ctx->fd,
 				prepare_ctx->file,
@@ -1042,9 +1049,12 @@ static void *prepare_one_device(void *ctx)
 				(opt_zero_end ? PREP_DEVICE_ZERO_END : 0) |
 				(opt_discard ? PREP_DEVICE_DISCARD : 0) |
 				(opt_zoned ? PREP_DEVICE_ZONED : 0));
-	return NULL;
 }
 
+static const struct thread_pool_ops prepare_device_ops = {
+	.process = prepare_one_device,
+};
+
 static int parse_compression(const char *str, enum btrfs_compression_type *type,
 			     unsigned int *level)
 {
@@ -1221,6 +1231,72 @@ cleanup:
 	return ret;
 }
 
+/*
+ * Update an existing filesystem created from --rootdir with the changes of
+ * the source directory, in one transaction.
+ */
+static int update_from_rootdir(const char *file, const char *source_dir,
+			       struct list_head *inode_flags_list,
+			       enum btrfs_compression_type compression,
+			       unsigned int compression_level, bool dedupe)
+{
+	struct open_ctree_args oca = { 0 };
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_trans_handle *trans;
+	struct btrfs_root *root;
+	int close_ret;
+	int ret;
+
+	ret = check_mounted(file);
+	if (ret < 0) {
+		errno = -ret;
+		error("could not check mount status of %s: %m", file);
+		return ret;
+	} else if (ret) {
+		error("%s is mounted", file);
+		return -EBUSY;
+	}
+
+	oca.filename = file;
+	oca.flags = OPEN_CTREE_WRITES | OPEN_CTREE_EXCLUSIVE;
+	fs_info = open_ctree_fs_info(&oca);
+	if (!fs_info) {
+		error("open ctree failed on %s", file);
+		return -EIO;
+	}
+	root = fs_info->fs_root;
+	pr_verbose(LOG_DEFAULT, "Update from:        %s\n", source_dir);
+
+	trans = btrfs_start_transaction(root, 1);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		errno = -ret;
+		error_msg(ERROR_MSG_START_TRANS, "%m");
+		goto out;
+	}
+	ret = btrfs_mkfs_update_dir(trans, source_dir, root, inode_flags_list,
+				    compression, compression_level, dedupe);
+	if (ret) {
+		errno = -ret;
+		error("error while updating filesystem: %m");
+		btrfs_abort_transaction(trans, ret);
+		goto out;
+	}
+	ret = btrfs_commit_transaction(trans, root);
+	if (ret) {
+		errno = -ret;
+		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+	}
+out:
+	close_ret = close_ctree(root);
+	if (!ret && close_ret) {
+		ret = close_ret;
+		errno = -ret;
+		error("failed to close ctree, filesystem may be inconsistent: %m");
+	}
+	return ret;
+}
+
 int BOX_MAIN(mkfs)(int argc, char **argv)
 {
 	char *file;
@@ -1238,7 +1314,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	u64 shrink_size;
 	int device_count = 0;
 	int saved_optind;
-	pthread_t *t_prepare = NULL;
+	struct thread_pool prepare_pool;
 	struct prepare_device_progress *prepare_ctx = NULL;
 	struct mkfs_allocation allocation = { 0 };
 	struct btrfs_mkfs_config mkfs_cfg;
@@ -1267,11 +1343,15 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	bool has_default_subvol = false;
 	enum btrfs_compression_type compression = BTRFS_COMPRESS_NONE;
 	unsigned int compression_level = 0;
+	unsigned int nr_threads = (unsigned int)-1;
+	bool dedupe = false;
+	bool update_rootdir = false;
 	LIST_HEAD(subvols);
 	LIST_HEAD(inode_flags_list);
 
 	cpu_detect_flags();
 	hash_init_accel();
+	raid6_init_accel();
 	btrfs_config_init();
 	btrfs_assert_feature_buf_size();
 
@@ -1284,6 +1364,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			GETOPT_VAL_DEVICE_UUID,
 			GETOPT_VAL_INODE_FLAGS,
 			GETOPT_VAL_COMPRESS,
+			GETOPT_VAL_THREADS,
+			GETOPT_VAL_DEDUPE,
+			GETOPT_VAL_UPDATE,
 		};
 		static const struct option long_options[] = {
 			{ "byte-count", required_argument, NULL, 'b' },
@@ -1311,12 +1394,16 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			{ "quiet", 0, NULL, 'q' },
 			{ "verbose", 0, NULL, 'v' },
 			{ "shrink", no_argument, NULL, GETOPT_VAL_SHRINK },
+			{ "threads", required_argument, NULL, GETOPT_VAL_THREADS },
+			{ "dedupe", no_argument, NULL, GETOPT_VAL_DEDUPE },
+			{ "update", no_argument, NULL, GETOPT_VAL_UPDATE },
 			{ "compress", required_argument, NULL,
 				GETOPT_VAL_COMPRESS },
 #if EXPERIMENTAL
 			{ "param", required_argument, NULL, GETOPT_VAL_PARAM },
 			{ "num-global-roots", required_argument, NULL, GETOPT_VAL_GLOBAL_ROOTS },
 #endif
+			{ "stats", optional_argument, NULL, GETOPT_VAL_STATS },
 			{ "help", no_argument, NULL, GETOPT_VAL_HELP },
 			{ NULL, 0, NULL, 0}
 		};
@@ -1452,6 +1539,25 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			case GETOPT_VAL_SHRINK:
 				shrink_rootdir = true;
 				break;
+			case GETOPT_VAL_THREADS:
+			{
+				u64 tmp = arg_strtou64(optarg);
+
+				if (tmp > ROOTDIR_MAX_THREADS) {
+					error("number of threads out of range: %llu > %u",
+					      tmp, ROOTDIR_MAX_THREADS);
+					ret = 1;
+					goto error;
+				}
+				nr_threads = tmp;
+				break;
+			}
+			case GETOPT_VAL_DEDUPE:
+				dedupe = true;
+				break;
+			case GETOPT_VAL_UPDATE:
+				update_rootdir = true;
+				break;
 			case GETOPT_VAL_CHECKSUM:
 				csum_type = parse_csum_type(optarg);
 				break;
@@ -1462,12 +1568,25 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 			case GETOPT_VAL_PARAM:
 				bconf_save_param(optarg);
 				break;
+			case GETOPT_VAL_STATS:
+				if (stats_enable(optarg)) {
+					error("invalid stats format: %s", optarg);
+					exit(1);
+				}
+				break;
 			case GETOPT_VAL_HELP:
 			default:
 				usage(&mkfs_cmd, c != GETOPT_VAL_HELP);
 		}
 	}
 
+	/* A single CPU would only switch between the threads */
+	if (nr_threads == (unsigned int)-1) {
+		long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		nr_threads = nr_cpus > 1 ? min_t(long, nr_cpus, ROOTDIR_MAX_THREADS) : 0;
+	}
+
 	pr_verbose(LOG_DEFAULT, "%s\n", PACKAGE_STRING);
 	pr_verbose(LOG_DEFAULT, "See %s for more information.\n\n", PACKAGE_URL);
 
@@ -1499,6 +1618,22 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		ret = 1;
 		goto error;
 	}
+	if (dedupe && source_dir == NULL) {
+		error("the option --dedupe must be used with --rootdir");
+		ret = 1;
+		goto error;
+	}
+	if (update_rootdir && source_dir == NULL) {
+		error("the option --update must be used with --rootdir");
+		ret = 1;
+		goto error;
+	}
+	if (update_rootdir && (shrink_rootdir || !list_empty(&subvols))) {
+		error("the option --update can't be used with --shrink or --subvol");
+		ret = 1;
+		goto error;
+	}
+
 	if (!list_empty(&subvols) && source_dir == NULL) {
 		error("option --subvol must be used with --rootdir");
 		ret = 1;
@@ -1609,6 +1744,13 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		}
 	}
 
+	if (update_rootdir) {
+		ret = update_from_rootdir(argv[optind], source_dir,
+					  &inode_flags_list, compression,
+					  compression_level, dedupe);
+		goto error;
+	}
+
 	if (*fs_uuid) {
 		uuid_t dummy_uuid;
 
@@ -1910,10 +2052,9 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		}
 	}
 
-	t_prepare = calloc(device_count, sizeof(*t_prepare));
 	prepare_ctx = calloc(device_count, sizeof(*prepare_ctx));
 
-	if (!t_prepare || !prepare_ctx) {
+	if (!prepare_ctx) {
 		error_msg(ERROR_MSG_MEMORY, "thread for preparing devices");
 		ret = 1;
 		goto error;
@@ -1928,24 +2069,24 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 		}
 	}
 
-	/* Start threads */
+	stats_phase("preparing devices");
+	/* Prepare the devices in parallel, the discard can take long */
+	ret = thread_pool_init(&prepare_pool, &prepare_device_ops, NULL,
+			       device_count, device_count);
+	if (ret < 0) {
+		error_msg(ERROR_MSG_MEMORY, "thread for preparing devices");
+		ret = 1;
+		goto error;
+	}
 	for (i = 0; i < device_count; i++) {
 		prepare_ctx[i].file = argv[optind + i - 1];
 		prepare_ctx[i].byte_count = byte_count;
 		prepare_ctx[i].dev_byte_count = byte_count;
-		ret = pthread_create(&t_prepare[i], NULL, prepare_one_device,
-				     &prepare_ctx[i]);
-		if (ret) {
-			errno = -ret;
-			error("failed to create thread for prepare device %s: %m",
-					prepare_ctx[i].file);
-			goto error;
-		}
+		thread_pool_push(&prepare_pool, &prepare_ctx[i]);
 	}
-
-	/* Wait for threads */
-	for (i = 0; i < device_count; i++)
-		pthread_join(t_prepare[i], NULL);
+	while (thread_pool_pop(&prepare_pool))
+		;
+	thread_pool_release(&prepare_pool);
 	ret = prepare_ctx[0].ret;
 
 	if (ret) {
@@ -1989,6 +2130,7 @@ int BOX_MAIN(mkfs)(int argc, char **argv)
 	else
 		mkfs_cfg.zone_size = 0;
 
+	stats_phase("creating filesystem");
 	ret = make_btrfs(prepare_ctx[0].fd, &mkfs_cfg);
 	if (ret) {
 		errno = -ret;
@@ -2205,9 +2347,11 @@ raid_groups:
 				   rif->inode_path);
 		}
 
+		stats_phase("populating from rootdir");
 		ret = btrfs_mkfs_fill_dir(trans, source_dir, root,
 					  &subvols, &inode_flags_list,
-					  compression, compression_level);
+					  compression, compression_level,
+					  nr_threads, dedupe);
 		if (ret) {
 			errno = -ret;
 			error("error while filling filesystem: %m");
@@ -2312,6 +2456,7 @@ raid_groups:
 	 */
 	fs_info->finalize_on_close = 1;
 out:
+	stats_phase("closing");
 	close_ret = close_ctree(root);
 
 	if (!close_ret) {
@@ -2337,7 +2482,6 @@ error:
 		for (i = 0; i < device_count; i++)
 			close(prepare_ctx[i].fd);
 	}
-	free(t_prepare);
 	free(prepare_ctx);
 	free(label);
 	free(source_dir);
@@ -18,6 +18,8 @@
 
 #include "kerncompat.h"
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
 #include <sys/xattr.h>
 #include <dirent.h>
 #include <unistd.h>
@@ -25,6 +27,7 @@
 #include <ftw.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #if COMPRESSION_ZSTD
@@ -52,6 +55,10 @@
 #include "common/root-tree-utils.h"
 #include "common/path-utils.h"
 #include "common/rbtree-utils.h"
+#include "common/slab.h"
+#include "common/io-ring.h"
+#include "crypto/hash.h"
+#include "crypto/crc32c.h"
 #include "mkfs/rootdir.h"
 
 #define LZO_LEN 4
@@ -108,7 +115,6 @@ struct inode_entry {
  * So we need @root as a search index to handle such case.
  */
 struct hardlink_entry {
-	struct rb_node node;
 	/*
 	 * The following three members are reported from the stat() of the
 	 * host filesystem.
@@ -130,7 +136,22 @@ struct hardlink_entry {
 	nlink_t found_nlink;
 };
 
-static struct rb_root hardlink_root = RB_ROOT;
+/*
+ * The hard link records are looked up in an open addressing hash table
+ * (linear probing) and allocated from a slab, there can be millions of them
+ * and they're all freed at once at the end.
+ */
+#define HARDLINK_HASH_MIN_BITS		(10)
+#define HARDLINK_SLAB_CHUNK		(SZ_64K)
+
+struct hardlink_table {
+	struct hardlink_entry **slots;
+	unsigned int bits;
+	u64 nr_entries;
+	struct object_slab slab;
+};
+
+static struct hardlink_table hardlinks;
 
 /*
  * The path towards the rootdir.
@@ -158,6 +179,29 @@ static u64 next_subvol_id = BTRFS_FIRST_FREE_OBJECTID;
 static u64 default_subvol_id;
 static enum btrfs_compression_type g_compression;
 static u64 g_compression_level;
+static bool g_dedupe;
+
+/*
+ * Compression state and buffers of a thread, set up on the first use and
+ * reused for all the files until the end.
+ */
+struct compress_ctx {
+	z_stream zlib;
+	bool zlib_ready;
+#if COMPRESSION_ZSTD
+	ZSTD_CCtx *zstd;
+#endif
+	/* Work memory of LZO */
+	char *wrkmem;
+	/* Data and compressed data of an extent, for the main thread */
+	char *buf;
+	char *comp_buf;
+	/* Digests of the sectors of an extent for --dedupe */
+	u8 *digests;
+};
+
+/* Of the main thread */
+static struct compress_ctx g_ctx;
 
 static inline struct inode_entry *rootdir_path_last(struct rootdir_path *path)
 {
@@ -192,46 +236,69 @@ static int rootdir_path_push(struct rootdir_path *path, struct btrfs_root *root,
 	return 0;
 }
 
-static int hardlink_compare_nodes(const struct rb_node *node1,
-				  const struct rb_node *node2)
+static inline u64 hardlink_hash_slot(const struct hardlink_table *table,
+				     const struct btrfs_root *root,
+				     dev_t st_dev, ino_t st_ino)
+{
+	u64 key = (u64)st_ino ^ ((u64)st_dev << 32) ^
+		  (root->root_key.objectid << 48);
+
+	return (key * 0x9E3779B97F4A7C15ULL) >> (64 - table->bits);
+}
+
+static inline bool hardlink_match(const struct hardlink_entry *entry,
+				  const struct btrfs_root *root,
+				  dev_t st_dev, ino_t st_ino)
 {
-	const struct hardlink_entry *entry1;
-	const struct hardlink_entry *entry2;
+	return entry->st_ino == st_ino && entry->st_dev == st_dev &&
+	       entry->root == root;
+}
 
-	entry1 = rb_entry(node1, struct hardlink_entry, node);
-	entry2 = rb_entry(node2, struct hardlink_entry, node);
-	UASSERT(entry1->root);
-	UASSERT(entry2->root);
+static int hardlink_hash_resize(struct hardlink_table *table, unsigned int bits)
+{
+	struct hardlink_entry **old_slots = table->slots;
+	const u64 old_nr = table->slots ? (1ULL << table->bits) : 0;
+	const u64 mask = (1ULL << bits) - 1;
+	struct hardlink_entry **slots;
 
-	if (entry1->st_dev < entry2->st_dev)
-		return -1;
-	if (entry1->st_dev > entry2->st_dev)
-		return 1;
-	if (entry1->st_ino < entry2->st_ino)
-		return -1;
-	if (entry1->st_ino > entry2->st_ino)
-		return 1;
-	if (entry1->root < entry2->root)
-		return -1;
-	if (entry1->root > entry2->root)
-		return 1;
+	slots = calloc(1ULL << bits, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	table->slots = slots;
+	table->bits = bits;
+	for (u64 i = 0; i < old_nr; i++) {
+		struct hardlink_entry *entry = old_slots[i];
+		u64 slot;
+
+		if (!entry)
+			continue;
+		slot = hardlink_hash_slot(table, entry->root, entry->st_dev,
+					  entry->st_ino);
+		while (slots[slot])
+			slot = (slot + 1) & mask;
+		slots[slot] = entry;
+	}
+	free(old_slots);
 	return 0;
 }
 
 static struct hardlink_entry *find_hard_link(struct btrfs_root *root,
 					     const struct stat *st)
 {
-	struct rb_node *node;
-	const struct hardlink_entry tmp = {
-		.st_dev = st->st_dev,
-		.st_ino = st->st_ino,
-		.root = root,
-	};
-
-	node = rb_search(&hardlink_root, &tmp,
-			(rb_compare_keys)hardlink_compare_nodes, NULL);
-	if (node)
-		return rb_entry(node, struct hardlink_entry, node);
+	u64 mask;
+	u64 slot;
+
+	if (!hardlinks.slots)
+		return NULL;
+	mask = (1ULL << hardlinks.bits) - 1;
+	slot = hardlink_hash_slot(&hardlinks, root, st->st_dev, st->st_ino);
+	while (hardlinks.slots[slot]) {
+		if (hardlink_match(hardlinks.slots[slot], root, st->st_dev,
+				   st->st_ino))
+			return hardlinks.slots[slot];
+		slot = (slot + 1) & mask;
+	}
 	return NULL;
 }
 
@@ -239,11 +306,30 @@ static int add_hard_link(struct btrfs_root *root, u64 btrfs_ino,
 			 const struct stat *st)
 {
 	struct hardlink_entry *new;
-	int ret;
+	u64 mask;
+	u64 slot;
 
 	UASSERT(st->st_nlink > 1);
 
-	new = calloc(1, sizeof(*new));
+	if (find_hard_link(root, st))
+		return -EEXIST;
+
+	/* Keep the load factor below 1/2 */
+	if (!hardlinks.slots ||
+	    (hardlinks.nr_entries + 1) * 2 > (1ULL << hardlinks.bits)) {
+		int ret;
+
+		if (!hardlinks.slots)
+			object_slab_init(&hardlinks.slab, sizeof(*new),
+					 HARDLINK_SLAB_CHUNK);
+		ret = hardlink_hash_resize(&hardlinks, hardlinks.slots ?
+					   hardlinks.bits + 1 :
+					   HARDLINK_HASH_MIN_BITS);
+		if (ret < 0)
+			return ret;
+	}
+
+	new = object_slab_zalloc(&hardlinks.slab);
 	if (!new)
 		return -ENOMEM;
 
@@ -253,19 +339,61 @@ static int add_hard_link(struct btrfs_root *root, u64 btrfs_ino,
 	new->st_dev = st->st_dev;
 	new->st_ino = st->st_ino;
 	new->st_nlink = st->st_nlink;
-	ret = rb_insert(&hardlink_root, &new->node, hardlink_compare_nodes);
-	if (ret) {
-		free(new);
-		return -EEXIST;
-	}
+
+	mask = (1ULL << hardlinks.bits) - 1;
+	slot = hardlink_hash_slot(&hardlinks, root, st->st_dev, st->st_ino);
+	while (hardlinks.slots[slot])
+		slot = (slot + 1) & mask;
+	hardlinks.slots[slot] = new;
+	hardlinks.nr_entries++;
 	return 0;
 }
 
-static void free_one_hardlink(struct rb_node *node)
+static void remove_hard_link(struct hardlink_entry *entry)
 {
-	struct hardlink_entry *entry = rb_entry(node, struct hardlink_entry, node);
+	const u64 mask = (1ULL << hardlinks.bits) - 1;
+	u64 hole;
+	u64 slot;
+
+	slot = hardlink_hash_slot(&hardlinks, entry->root, entry->st_dev,
+				  entry->st_ino);
+	while (hardlinks.slots[slot] != entry)
+		slot = (slot + 1) & mask;
+
+	/*
+	 * Shift back the following entries of the probe sequence into the
+	 * hole, unless their home slot is cyclically in (hole, slot].
+	 */
+	hole = slot;
+	hardlinks.slots[hole] = NULL;
+	hardlinks.nr_entries--;
+	while (true) {
+		const struct hardlink_entry *next;
+		u64 home;
+
+		slot = (slot + 1) & mask;
+		next = hardlinks.slots[slot];
+		if (!next)
+			break;
+		home = hardlink_hash_slot(&hardlinks, next->root, next->st_dev,
+					  next->st_ino);
+		if (hole <= slot ? (hole < home && home <= slot) :
+				   (hole < home || home <= slot))
+			continue;
+		hardlinks.slots[hole] = hardlinks.slots[slot];
+		hardlinks.slots[slot] = NULL;
+		hole = slot;
+	}
+	object_slab_free(&hardlinks.slab, entry);
+}
 
-	free(entry);
+static void free_hard_links(void)
+{
+	if (!hardlinks.slots)
+		return;
+	free(hardlinks.slots);
+	object_slab_release(&hardlinks.slab);
+	memset(&hardlinks, 0, sizeof(hardlinks));
 }
 
 static void stat_to_inode_item(struct btrfs_inode_item *dst, const struct stat *st)
@@ -284,11 +412,11 @@ static void stat_to_inode_item(struct btrfs_inode_item *dst, const struct stat *
 	btrfs_set_stack_inode_rdev(dst, 0);
 	btrfs_set_stack_inode_flags(dst, 0);
 	btrfs_set_stack_timespec_sec(&dst->atime, st->st_atime);
-	btrfs_set_stack_timespec_nsec(&dst->atime, 0);
+	btrfs_set_stack_timespec_nsec(&dst->atime, st->st_atim.tv_nsec);
 	btrfs_set_stack_timespec_sec(&dst->ctime, st->st_ctime);
-	btrfs_set_stack_timespec_nsec(&dst->ctime, 0);
+	btrfs_set_stack_timespec_nsec(&dst->ctime, st->st_ctim.tv_nsec);
 	btrfs_set_stack_timespec_sec(&dst->mtime, st->st_mtime);
-	btrfs_set_stack_timespec_nsec(&dst->mtime, 0);
+	btrfs_set_stack_timespec_nsec(&dst->mtime, st->st_mtim.tv_nsec);
 	btrfs_set_stack_timespec_sec(&dst->otime, 0);
 	btrfs_set_stack_timespec_nsec(&dst->otime, 0);
 }
@@ -377,6 +505,28 @@ fail:
 	return ret;
 }
 
+/* Insert the file extent item and a reference of its existing data extent */
+static int insert_file_extent_ref(struct btrfs_trans_handle *trans,
+				  struct btrfs_root *root, u64 ino,
+				  struct btrfs_inode_item *inode, u64 file_pos,
+				  struct btrfs_file_extent_item *stack_fi)
+{
+	u64 disk_bytenr = btrfs_stack_file_extent_disk_bytenr(stack_fi);
+	u64 disk_num_bytes = btrfs_stack_file_extent_disk_num_bytes(stack_fi);
+	u64 num_bytes = btrfs_stack_file_extent_num_bytes(stack_fi);
+	int ret;
+
+	ret = btrfs_insert_file_extent(trans, root, ino, file_pos, stack_fi);
+	if (ret)
+		return ret;
+	btrfs_set_stack_inode_nbytes(inode,
+			btrfs_stack_inode_nbytes(inode) + num_bytes);
+
+	return btrfs_inc_extent_ref(trans, disk_bytenr, disk_num_bytes,
+				    0, root->root_key.objectid, ino,
+				    file_pos);
+}
+
 static int insert_reserved_file_extent(struct btrfs_trans_handle *trans,
 				       struct btrfs_root *root, u64 ino,
 				       struct btrfs_inode_item *inode,
@@ -391,7 +541,6 @@ static int insert_reserved_file_extent(struct btrfs_trans_handle *trans,
 	struct btrfs_extent_item *ei;
 	u64 disk_bytenr = btrfs_stack_file_extent_disk_bytenr(stack_fi);
 	u64 disk_num_bytes = btrfs_stack_file_extent_disk_num_bytes(stack_fi);
-	u64 num_bytes = btrfs_stack_file_extent_num_bytes(stack_fi);
 	int ret;
 
 	extent_root = btrfs_extent_root(fs_info, disk_bytenr);
@@ -449,18 +598,7 @@ static int insert_reserved_file_extent(struct btrfs_trans_handle *trans,
 
 	btrfs_run_delayed_refs(trans, -1);
 
-	ret = btrfs_insert_file_extent(trans, root, ino, file_pos, stack_fi);
-	if (ret)
-		goto fail;
-	btrfs_set_stack_inode_nbytes(inode,
-			btrfs_stack_inode_nbytes(inode) + num_bytes);
-
-	ret = btrfs_inc_extent_ref(trans, disk_bytenr, disk_num_bytes,
-				   0, root->root_key.objectid, ino,
-				   file_pos);
-	if (ret)
-		goto fail;
-	ret = 0;
+	ret = insert_file_extent_ref(trans, root, ino, inode, file_pos, stack_fi);
 fail:
 	btrfs_free_path(path);
 	return ret;
@@ -470,69 +608,74 @@ fail:
  * Returns the size of the compressed data if successful, -E2BIG if it is
  * incompressible, or an error code.
  */
-static ssize_t zlib_compress_extent(bool first_sector, u32 sectorsize,
-				    const void *in_buf, size_t in_size,
-				    void *out_buf)
+static z_stream *get_zlib_stream(struct compress_ctx *ctx)
 {
 	int ret;
-	z_stream strm;
 
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	ret = deflateInit(&strm, g_compression_level);
+	if (ctx->zlib_ready) {
+		deflateReset(&ctx->zlib);
+		return &ctx->zlib;
+	}
+
+	ctx->zlib.zalloc = Z_NULL;
+	ctx->zlib.zfree = Z_NULL;
+	ctx->zlib.opaque = Z_NULL;
+	ret = deflateInit(&ctx->zlib, g_compression_level);
 	if (ret != Z_OK) {
-		error("deflateInit failed: %s", strm.msg);
-		return -EINVAL;
+		error("deflateInit failed: %s", ctx->zlib.msg);
+		return NULL;
 	}
+	ctx->zlib_ready = true;
+	return &ctx->zlib;
+}
 
-	strm.next_out = out_buf;
-	strm.avail_out = BTRFS_MAX_COMPRESSED;
-	strm.next_in = (void *)in_buf;
-	strm.avail_in = in_size;
+static ssize_t zlib_compress_extent(struct compress_ctx *ctx, bool first_sector,
+				    u32 sectorsize, const void *in_buf,
+				    size_t in_size, void *out_buf)
+{
+	int ret;
+	z_stream *strm;
+
+	strm = get_zlib_stream(ctx);
+	if (!strm)
+		return -EINVAL;
+
+	strm->next_out = out_buf;
+	strm->avail_out = BTRFS_MAX_COMPRESSED;
+	strm->next_in = (void *)in_buf;
+	strm->avail_in = in_size;
 
 	/*
 	 * Try to compress the first sector - if it would be larger,
 	 * return -E2BIG.
 	 */
 	if (first_sector) {
-		strm.avail_in = sectorsize;
+		strm->avail_in = sectorsize;
 
-		ret = deflate(&strm, Z_SYNC_FLUSH);
+		ret = deflate(strm, Z_SYNC_FLUSH);
 		if (ret != Z_OK) {
-			error("deflate failed: %s", strm.msg);
-			ret = -EINVAL;
-			goto out;
+			error("deflate failed: %s", strm->msg);
+			return -EINVAL;
 		}
 
-		if (strm.avail_out < BTRFS_MAX_COMPRESSED - sectorsize) {
-			ret = -E2BIG;
-			goto out;
-		}
+		if (strm->avail_out < BTRFS_MAX_COMPRESSED - sectorsize)
+			return -E2BIG;
 
-		strm.avail_in += in_size - sectorsize;
+		strm->avail_in += in_size - sectorsize;
 	}
 
-	ret = deflate(&strm, Z_FINISH);
+	ret = deflate(strm, Z_FINISH);
 
 	if (ret == Z_OK) {
-		ret = -E2BIG;
-		goto out;
+		return -E2BIG;
 	} else if (ret != Z_STREAM_END) {
-		error("deflate failed: %s", strm.msg);
-		ret = -EINVAL;
-		goto out;
+		error("deflate failed: %s", strm->msg);
+		return -EINVAL;
 	}
 
-	if (out_buf + BTRFS_MAX_COMPRESSED - (void *)strm.next_out > sectorsize)
-		ret = (void *)strm.next_out - out_buf;
-	else
-		ret = -E2BIG;
-
-out:
-	deflateEnd(&strm);
-
-	return ret;
+	if (out_buf + BTRFS_MAX_COMPRESSED - (void *)strm->next_out > sectorsize)
+		return (void *)strm->next_out - out_buf;
+	return -E2BIG;
 }
 
 #if COMPRESSION_LZO
@@ -601,38 +744,53 @@ static ssize_t lzo_compress_extent(u32 sectorsize, const void *in_buf,
  * Returns the size of the compressed data if successful, -E2BIG if it is
  * incompressible, or an error code.
  */
-static ssize_t zstd_compress_extent(bool first_sector, u32 sectorsize,
-				    const void *in_buf, size_t in_size,
-				    void *out_buf)
+/* Return the context of @ctx ready for a new frame of @size */
+static ZSTD_CCtx *get_zstd_ctx(struct compress_ctx *ctx, size_t size)
 {
-	ZSTD_CCtx *zstd_ctx;
-	ZSTD_inBuffer input;
-	ZSTD_outBuffer output;
 	size_t zstd_ret;
-	ssize_t ret;
 
-	zstd_ctx = ZSTD_createCCtx();
-	if (!zstd_ctx) {
-		error_msg(ERROR_MSG_MEMORY, NULL);
-		return -ENOMEM;
-	}
+	if (ctx->zstd) {
+		ZSTD_CCtx_reset(ctx->zstd, ZSTD_reset_session_only);
+	} else {
+		ctx->zstd = ZSTD_createCCtx();
+		if (!ctx->zstd) {
+			error_msg(ERROR_MSG_MEMORY, NULL);
+			return NULL;
+		}
 
-	zstd_ret = ZSTD_CCtx_setParameter(zstd_ctx, ZSTD_c_compressionLevel,
-					  g_compression_level);
-	if (ZSTD_isError(zstd_ret)) {
-		error("ZSTD_CCtx_setParameter failed: %s",
-		      ZSTD_getErrorName(zstd_ret));
-		ret = -EINVAL;
-		goto out;
+		zstd_ret = ZSTD_CCtx_setParameter(ctx->zstd,
+						  ZSTD_c_compressionLevel,
+						  g_compression_level);
+		if (ZSTD_isError(zstd_ret)) {
+			error("ZSTD_CCtx_setParameter failed: %s",
+			      ZSTD_getErrorName(zstd_ret));
+			ZSTD_freeCCtx(ctx->zstd);
+			ctx->zstd = NULL;
+			return NULL;
+		}
 	}
 
-	zstd_ret = ZSTD_CCtx_setPledgedSrcSize(zstd_ctx, in_size);
+	zstd_ret = ZSTD_CCtx_setPledgedSrcSize(ctx->zstd, size);
 	if (ZSTD_isError(zstd_ret)) {
 		error("ZSTD_CCtx_setPledgedSrcSize failed: %s",
 		      ZSTD_getErrorName(zstd_ret));
-		ret = -EINVAL;
-		goto out;
+		return NULL;
 	}
+	return ctx->zstd;
+}
+
+static ssize_t zstd_compress_extent(struct compress_ctx *ctx, bool first_sector,
+				    u32 sectorsize, const void *in_buf,
+				    size_t in_size, void *out_buf)
+{
+	ZSTD_CCtx *zstd_ctx;
+	ZSTD_inBuffer input;
+	ZSTD_outBuffer output;
+	size_t zstd_ret;
+
+	zstd_ctx = get_zstd_ctx(ctx, in_size);
+	if (!zstd_ctx)
+		return -EINVAL;
 
 	output.dst = out_buf;
 	output.size = BTRFS_MAX_COMPRESSED;
@@ -654,14 +812,11 @@ static ssize_t zstd_compress_extent(bool first_sector, u32 sectorsize,
 		if (ZSTD_isError(zstd_ret)) {
 			error("ZSTD_compressStream2 failed: %s",
 			      ZSTD_getErrorName(zstd_ret));
-			ret = -EINVAL;
-			goto out;
+			return -EINVAL;
 		}
 
-		if (zstd_ret != 0 || output.pos > sectorsize) {
-			ret = -E2BIG;
-			goto out;
-		}
+		if (zstd_ret != 0 || output.pos > sectorsize)
+			return -E2BIG;
 	}
 
 	input.size = in_size;
@@ -671,19 +826,12 @@ static ssize_t zstd_compress_extent(bool first_sector, u32 sectorsize,
 	if (ZSTD_isError(zstd_ret)) {
 		error("ZSTD_compressStream2 failed: %s",
 		      ZSTD_getErrorName(zstd_ret));
-		ret = -EINVAL;
-		goto out;
+		return -EINVAL;
 	}
 
 	if (zstd_ret == 0 && output.pos <= in_size - sectorsize)
-		ret = output.pos;
-	else
-		ret = -E2BIG;
-
-out:
-	ZSTD_freeCCtx(zstd_ctx);
-
-	return ret;
+		return output.pos;
+	return -E2BIG;
 }
 #endif
 
@@ -699,55 +847,162 @@ struct source_descriptor {
 	u64 size;
 	const char *path_name;
 	char *comp_buf;
-	char *wrkmem;
+	struct compress_ctx *ctx;
+	/* Don't report the errors, the data are read again */
+	bool quiet;
 };
 
-static int add_file_item_extent(struct btrfs_trans_handle *trans,
-				struct btrfs_root *root,
-				struct btrfs_inode_item *btrfs_inode,
-				u64 objectid,
-				const struct source_descriptor *source,
-				u64 file_pos)
+/* An extent read from the source file and possibly compressed */
+struct file_extent_data {
+	u64 file_pos;
+	/* Inode flags before and after the extent is read */
+	u64 flags;
+	u64 flags_after;
+	u64 to_read;
+	bool do_comp;
+	ssize_t comp_ret;
+	char *buf;
+	char *comp_buf;
+	/* The data written, compressed or not, padded to the sector size */
+	char *write_buf;
+	u64 to_write;
+	/* Digest of the written data for --dedupe */
+	bool hashed;
+	u8 digest[CRYPTO_HASH_SIZE_MAX];
+};
+
+/*
+ * Extents written with --dedupe, by the digest and the properties of their
+ * file extent items.  An extent with the same data is not written again but
+ * referenced by another file extent item, like a reflink.
+ */
+struct dedupe_entry {
+	struct rb_node node;
+	u8 digest[CRYPTO_HASH_SIZE_MAX];
+	u64 disk_num_bytes;
+	u64 ram_bytes;
+	bool compressed;
+	bool datasum;
+
+	u64 disk_bytenr;
+};
+
+static struct rb_root dedupe_root = RB_ROOT;
+
+static int dedupe_compare_nodes(const struct rb_node *node1,
+				const struct rb_node *node2)
 {
+	const struct dedupe_entry *entry1;
+	const struct dedupe_entry *entry2;
 	int ret;
-	u32 sectorsize = root->fs_info->sectorsize;
-	u64 bytes_read, first_block, to_read, to_write;
-	struct btrfs_key key;
-	struct btrfs_file_extent_item stack_fi = { 0 };
-	u64 buf_size;
-	char *write_buf;
-	bool do_comp = g_compression != BTRFS_COMPRESS_NONE;
-	bool datasum = true;
-	ssize_t comp_ret;
-	u64 flags = btrfs_stack_inode_flags(btrfs_inode);
 
-	if (flags & BTRFS_INODE_NOCOMPRESS)
-		do_comp = false;
+	entry1 = rb_entry(node1, struct dedupe_entry, node);
+	entry2 = rb_entry(node2, struct dedupe_entry, node);
 
-	if ((flags & BTRFS_INODE_NODATACOW) || (flags & BTRFS_INODE_NODATASUM)) {
-		datasum = false;
-		do_comp = false;
+	ret = memcmp(entry1->digest, entry2->digest, sizeof(entry1->digest));
+	if (ret)
+		return ret;
+	if (entry1->disk_num_bytes != entry2->disk_num_bytes)
+		return entry1->disk_num_bytes < entry2->disk_num_bytes ? -1 : 1;
+	if (entry1->ram_bytes != entry2->ram_bytes)
+		return entry1->ram_bytes < entry2->ram_bytes ? -1 : 1;
+	if (entry1->compressed != entry2->compressed)
+		return entry1->compressed ? 1 : -1;
+	if (entry1->datasum != entry2->datasum)
+		return entry1->datasum ? 1 : -1;
+	return 0;
+}
+
+static void free_one_dedupe_entry(struct rb_node *node)
+{
+	free(rb_entry(node, struct dedupe_entry, node));
+}
+
+/*
+ * Hash the sectors of the written data by the batch interface, the digest of
+ * the extent is the SHA256 of their digests.
+ */
+static int hash_file_extent(struct compress_ctx *ctx, u32 sectorsize,
+			    struct file_extent_data *ext)
+{
+	const u64 nr = ext->to_write / sectorsize;
+	int ret;
+
+	if (!ctx->digests) {
+		ctx->digests = malloc(MAX_EXTENT_SIZE / sectorsize *
+				      CRYPTO_HASH_SIZE_MAX);
+		if (!ctx->digests)
+			return -ENOMEM;
 	}
 
-	buf_size = do_comp ? BTRFS_MAX_COMPRESSED : MAX_EXTENT_SIZE;
-	to_read = min(file_pos + buf_size, source->size) - file_pos;
+	ret = hash_sha256_batch((const u8 *)ext->write_buf, sectorsize, nr,
+				ctx->digests);
+	if (ret < 0)
+		return ret;
+	ret = hash_sha256(ctx->digests, nr * CRYPTO_HASH_SIZE_MAX, ext->digest);
+	if (ret < 0)
+		return ret;
+	ext->hashed = true;
+	return 0;
+}
 
-	bytes_read = 0;
+static int read_source(const struct source_descriptor *source, char *buf,
+		       u64 file_pos, u64 len)
+{
+	u64 bytes_read = 0;
 
-	while (bytes_read < to_read) {
+	while (bytes_read < len) {
 		ssize_t ret_read;
 
-		ret_read = pread(source->fd, source->buf + bytes_read,
-				 to_read - bytes_read, file_pos + bytes_read);
+		ret_read = pread(source->fd, buf + bytes_read, len - bytes_read,
+				 file_pos + bytes_read);
 		if (ret_read < 0) {
-			error("cannot read %s at offset %llu length %llu: %m",
-			      source->path_name, file_pos + bytes_read,
-			      to_read - bytes_read);
-			return -errno;
+			int ret = -errno;
+
+			if (!source->quiet)
+				error("cannot read %s at offset %llu length %llu: %m",
+				      source->path_name, file_pos + bytes_read,
+				      len - bytes_read);
+			return ret;
 		}
 
 		bytes_read += ret_read;
 	}
+	return 0;
+}
+
+/*
+ * Read the extent of the file at @file_pos and compress it, update the inode
+ * flags in @ext the same way as the extent would be added.
+ */
+static int read_file_extent(const struct source_descriptor *source,
+			    u32 sectorsize, u64 file_pos, u64 flags,
+			    struct file_extent_data *ext)
+{
+	u64 bytes_read, to_read;
+	u64 buf_size;
+	bool do_comp = g_compression != BTRFS_COMPRESS_NONE;
+	ssize_t comp_ret = 0;
+	int ret;
+
+	ext->file_pos = file_pos;
+	ext->flags = flags;
+	ext->buf = source->buf;
+	ext->comp_buf = source->comp_buf;
+
+	if (flags & BTRFS_INODE_NOCOMPRESS)
+		do_comp = false;
+
+	if ((flags & BTRFS_INODE_NODATACOW) || (flags & BTRFS_INODE_NODATASUM))
+		do_comp = false;
+
+	buf_size = do_comp ? BTRFS_MAX_COMPRESSED : MAX_EXTENT_SIZE;
+	to_read = min(file_pos + buf_size, source->size) - file_pos;
+
+	ret = read_source(source, source->buf, file_pos, to_read);
+	if (ret < 0)
+		return ret;
+	bytes_read = to_read;
 
 	if (bytes_read <= sectorsize)
 		do_comp = false;
@@ -757,8 +1012,9 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 
 		switch (g_compression) {
 		case BTRFS_COMPRESS_ZLIB:
-			comp_ret = zlib_compress_extent(first_sector, sectorsize,
-							source->buf, bytes_read,
+			comp_ret = zlib_compress_extent(source->ctx, first_sector,
+							sectorsize, source->buf,
+							bytes_read,
 							source->comp_buf);
 			break;
 #if COMPRESSION_LZO
@@ -766,13 +1022,14 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 			comp_ret = lzo_compress_extent(sectorsize, source->buf,
 						       bytes_read,
 						       source->comp_buf,
-						       source->wrkmem);
+						       source->ctx->wrkmem);
 			break;
 #endif
 #if COMPRESSION_ZSTD
 		case BTRFS_COMPRESS_ZSTD:
-			comp_ret = zstd_compress_extent(first_sector, sectorsize,
-							source->buf, bytes_read,
+			comp_ret = zstd_compress_extent(source->ctx, first_sector,
+							sectorsize, source->buf,
+							bytes_read,
 							source->comp_buf);
 			break;
 #endif
@@ -793,40 +1050,66 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 
 		if (comp_ret == -E2BIG && first_sector) {
 			flags |= BTRFS_INODE_NOCOMPRESS;
-			btrfs_set_stack_inode_flags(btrfs_inode, flags);
 
 			buf_size = MAX_EXTENT_SIZE;
 			to_read = min(file_pos + buf_size, source->size) - file_pos;
 
-			while (bytes_read < to_read) {
-				ssize_t ret_read;
-
-				ret_read = pread(source->fd,
-						 source->buf + bytes_read,
-						 to_read - bytes_read,
-						 file_pos + bytes_read);
-				if (ret_read < 0) {
-					error("cannot read %s at offset %llu length %llu: %m",
-					      source->path_name,
-					      file_pos + bytes_read,
-					      to_read - bytes_read);
-					return -errno;
-				}
-
-				bytes_read += ret_read;
-			}
+			ret = read_source(source, source->buf + bytes_read,
+					  file_pos + bytes_read,
+					  to_read - bytes_read);
+			if (ret < 0)
+				return ret;
 		}
 	}
 
 	if (do_comp) {
-		u64 features;
+		flags |= BTRFS_INODE_COMPRESS;
+		ext->to_write = round_up(comp_ret, sectorsize);
+		ext->write_buf = source->comp_buf;
+		memset(ext->write_buf + comp_ret, 0, ext->to_write - comp_ret);
+	} else {
+		ext->to_write = round_up(to_read, sectorsize);
+		ext->write_buf = source->buf;
+		memset(ext->write_buf + to_read, 0, ext->to_write - to_read);
+	}
 
-		to_write = round_up(comp_ret, sectorsize);
-		write_buf = source->comp_buf;
-		memset(write_buf + comp_ret, 0, to_write - comp_ret);
+	ext->flags_after = flags;
+	ext->to_read = to_read;
+	ext->do_comp = do_comp;
+	ext->comp_ret = comp_ret;
+	ext->hashed = false;
 
-		flags |= BTRFS_INODE_COMPRESS;
-		btrfs_set_stack_inode_flags(btrfs_inode, flags);
+	/* The main thread hashes the extent if the workers can't */
+	if (g_dedupe && (CRYPTO_HASH_THREAD_SAFE || source->ctx == &g_ctx))
+		return hash_file_extent(source->ctx, sectorsize, ext);
+	return 0;
+}
+
+/* Write the extent read by read_file_extent() and insert its items */
+static int write_file_extent(struct btrfs_trans_handle *trans,
+			     struct btrfs_root *root,
+			     struct btrfs_inode_item *btrfs_inode,
+			     u64 objectid, const char *path_name,
+			     struct file_extent_data *ext)
+{
+	int ret;
+	u32 sectorsize = root->fs_info->sectorsize;
+	u64 first_block;
+	u64 to_write = ext->to_write;
+	struct btrfs_key key;
+	struct btrfs_file_extent_item stack_fi = { 0 };
+	struct dedupe_entry *dedupe = NULL;
+	char *write_buf = ext->write_buf;
+	bool datasum = true;
+
+	if ((ext->flags & BTRFS_INODE_NODATACOW) ||
+	    (ext->flags & BTRFS_INODE_NODATASUM))
+		datasum = false;
+
+	btrfs_set_stack_inode_flags(btrfs_inode, ext->flags_after);
+
+	if (ext->do_comp) {
+		u64 features;
 
 		if (g_compression == BTRFS_COMPRESS_ZSTD) {
 			features = btrfs_super_incompat_flags(trans->fs_info->super_copy);
@@ -839,51 +1122,296 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
 			btrfs_set_super_incompat_flags(trans->fs_info->super_copy,
 						       features);
 		}
-	} else {
-		to_write = round_up(to_read, sectorsize);
-		write_buf = source->buf;
-		memset(write_buf + to_read, 0, to_write - to_read);
 	}
 
-	ret = btrfs_reserve_extent(trans, root, to_write, 0, 0,
-				   (u64)-1, &key, 1);
-	if (ret)
-		return ret;
+	btrfs_set_stack_file_extent_type(&stack_fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_stack_file_extent_disk_num_bytes(&stack_fi, to_write);
+	btrfs_set_stack_file_extent_num_bytes(&stack_fi,
+					      round_up(ext->to_read, sectorsize));
+	btrfs_set_stack_file_extent_ram_bytes(&stack_fi,
+					      round_up(ext->to_read, sectorsize));
 
-	first_block = key.objectid;
+	if (ext->do_comp)
+		btrfs_set_stack_file_extent_compression(&stack_fi, g_compression);
 
-	ret = write_data_to_disk(root->fs_info, write_buf, first_block,
-				 to_write);
-	if (ret) {
-		error("failed to write %s", source->path_name);
-		return ret;
-	}
+	if (g_dedupe) {
+		struct rb_node *node;
 
-	if (datasum) {
-		for (unsigned int i = 0; i < to_write / sectorsize; i++) {
-			ret = btrfs_csum_file_block(trans, first_block + (i * sectorsize),
-					BTRFS_EXTENT_CSUM_OBJECTID,
-					root->fs_info->csum_type,
-					write_buf + (i * sectorsize));
+		if (!ext->hashed) {
+			ret = hash_file_extent(&g_ctx, sectorsize, ext);
+			if (ret < 0)
+				return ret;
+		}
+
+		dedupe = calloc(1, sizeof(*dedupe));
+		if (!dedupe)
+			return -ENOMEM;
+		memcpy(dedupe->digest, ext->digest, sizeof(dedupe->digest));
+		dedupe->disk_num_bytes = to_write;
+		dedupe->ram_bytes = round_up(ext->to_read, sectorsize);
+		dedupe->compressed = ext->do_comp;
+		dedupe->datasum = datasum;
+
+		node = rb_search(&dedupe_root, dedupe,
+				 (rb_compare_keys)dedupe_compare_nodes, NULL);
+		if (node) {
+			struct dedupe_entry *found;
+
+			free(dedupe);
+			found = rb_entry(node, struct dedupe_entry, node);
+			btrfs_set_stack_file_extent_disk_bytenr(&stack_fi,
+							found->disk_bytenr);
+			ret = insert_file_extent_ref(trans, root, objectid,
+						     btrfs_inode, ext->file_pos,
+						     &stack_fi);
 			if (ret)
 				return ret;
+			return ext->to_read;
 		}
 	}
 
-	btrfs_set_stack_file_extent_type(&stack_fi, BTRFS_FILE_EXTENT_REG);
+	ret = btrfs_reserve_extent(trans, root, to_write, 0, 0,
+				   (u64)-1, &key, 1);
+	if (ret)
+		goto fail;
+
+	first_block = key.objectid;
+
+	ret = write_data_to_disk(root->fs_info, write_buf, first_block,
+				 to_write);
+	if (ret) {
+		error("failed to write %s", path_name);
+		goto fail;
+	}
+
+	if (datasum) {
+		ret = btrfs_csum_file_range(trans, first_block, to_write,
+					    BTRFS_EXTENT_CSUM_OBJECTID,
+					    root->fs_info->csum_type, write_buf);
+		if (ret)
+			goto fail;
+	}
+
 	btrfs_set_stack_file_extent_disk_bytenr(&stack_fi, first_block);
-	btrfs_set_stack_file_extent_disk_num_bytes(&stack_fi, to_write);
-	btrfs_set_stack_file_extent_num_bytes(&stack_fi, round_up(to_read, sectorsize));
-	btrfs_set_stack_file_extent_ram_bytes(&stack_fi, round_up(to_read, sectorsize));
 
-	if (do_comp)
-		btrfs_set_stack_file_extent_compression(&stack_fi, g_compression);
+	ret = insert_reserved_file_extent(trans, root, objectid, btrfs_inode,
+					  ext->file_pos, &stack_fi);
+	if (ret)
+		goto fail;
+
+	if (dedupe) {
+		dedupe->disk_bytenr = first_block;
+		rb_insert(&dedupe_root, &dedupe->node, dedupe_compare_nodes);
+	}
+	return ext->to_read;
+fail:
+	free(dedupe);
+	return ret;
+}
+
+static int add_file_item_extent(struct btrfs_trans_handle *trans,
+				struct btrfs_root *root,
+				struct btrfs_inode_item *btrfs_inode,
+				u64 objectid,
+				const struct source_descriptor *source,
+				u64 file_pos)
+{
+	struct file_extent_data ext;
+	int ret;
+
+	ret = read_file_extent(source, root->fs_info->sectorsize, file_pos,
+			       btrfs_stack_inode_flags(btrfs_inode), &ext);
+	if (ret < 0)
+		return ret;
+
+	return write_file_extent(trans, root, btrfs_inode, objectid,
+				 source->path_name, &ext);
+}
+
+/*
+ * Uncompressed extents without --dedupe are copied from the source file to
+ * an image in a regular file by copy_file_range(), so the data aren't copied
+ * through the buffers and may be reflinked by the kernel if the source and
+ * the image are on the same filesystem.  The checksums are calculated from
+ * the source mapped to memory.  If the kernel can't copy between the files
+ * the data are read and written, and the following extents are read by
+ * read_file_extent() again.
+ */
+static bool g_copy_range;
+
+static bool can_copy_range(const struct btrfs_fs_info *fs_info)
+{
+	const struct btrfs_device *device;
+	struct stat st;
+
+	if (g_compression != BTRFS_COMPRESS_NONE || g_dedupe || fs_info->zoned)
+		return false;
+	if (fs_info->fs_devices->num_devices != 1)
+		return false;
+	device = list_first_entry(&fs_info->fs_devices->devices,
+				  struct btrfs_device, dev_list);
+	if (device->fd < 0 || fstat(device->fd, &st) < 0)
+		return false;
+	/* The fallback writes from unaligned buffers */
+	if (fcntl(device->fd, F_GETFL) & O_DIRECT)
+		return false;
+	return S_ISREG(st.st_mode);
+}
+
+/* Copy @len bytes of the source at @file_pos to @fd at @offset */
+static int copy_range_to_fd(const struct source_descriptor *source,
+			    u64 file_pos, int fd, u64 offset, u64 len)
+{
+	loff_t in_off = file_pos;
+	loff_t out_off = offset;
+	ssize_t ret;
+
+	while (g_copy_range && len) {
+		ret = copy_file_range(source->fd, &in_off, fd, &out_off, len, 0);
+		if (ret < 0) {
+			g_copy_range = false;
+			break;
+		}
+		if (ret == 0) {
+			error("cannot read %s at offset %llu: unexpected end of file",
+			      source->path_name, (unsigned long long)in_off);
+			return -EIO;
+		}
+		len -= ret;
+	}
+	if (!len)
+		return 0;
+
+	/* The rest fits in the buffer, the len is at most MAX_EXTENT_SIZE */
+	ret = read_source(source, source->buf, in_off, len);
+	if (ret < 0)
+		return ret;
+	ret = pwrite(fd, source->buf, len, out_off);
+	if (ret != len) {
+		ret = ret < 0 ? -errno : -EIO;
+		errno = -ret;
+		error("cannot write %s: %m", source->path_name);
+		return ret;
+	}
+	return 0;
+}
+
+static int copy_range_to_disk(struct btrfs_fs_info *fs_info,
+			      const struct source_descriptor *source,
+			      u64 file_pos, u64 logical, u64 len)
+{
+	while (len) {
+		struct btrfs_multi_bio *multi = NULL;
+		u64 this_len = len;
+		int ret;
+
+		ret = btrfs_map_block(fs_info, WRITE, logical, &this_len, &multi,
+				      0, NULL);
+		if (ret)
+			return ret < 0 ? ret : -EIO;
+		this_len = min(this_len, len);
+		for (int i = 0; i < multi->num_stripes && !ret; i++)
+			ret = copy_range_to_fd(source, file_pos,
+					       multi->stripes[i].dev->fd,
+					       multi->stripes[i].physical,
+					       this_len);
+		kfree(multi);
+		if (ret < 0)
+			return ret;
+		file_pos += this_len;
+		logical += this_len;
+		len -= this_len;
+	}
+	return 0;
+}
+
+/* The same as add_file_item_extent() for an uncompressed extent */
+static int copy_file_extent(struct btrfs_trans_handle *trans,
+			    struct btrfs_root *root,
+			    struct btrfs_inode_item *btrfs_inode,
+			    u64 objectid,
+			    const struct source_descriptor *source,
+			    u64 file_pos)
+{
+	struct btrfs_fs_info *fs_info = root->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	const u64 flags = btrfs_stack_inode_flags(btrfs_inode);
+	const u64 to_read = min(file_pos + MAX_EXTENT_SIZE, source->size) -
+			    file_pos;
+	const u64 to_write = round_up(to_read, sectorsize);
+	/* The full sectors are copied, the last one is padded by zeros */
+	const u64 copy_len = round_down(to_read, sectorsize);
+	const u64 tail = to_read - copy_len;
+	struct btrfs_file_extent_item stack_fi = { 0 };
+	struct btrfs_key key;
+	bool datasum = true;
+	u64 first_block;
+	int ret;
+
+	if ((flags & BTRFS_INODE_NODATACOW) || (flags & BTRFS_INODE_NODATASUM))
+		datasum = false;
+
+	ret = btrfs_reserve_extent(trans, root, to_write, 0, 0, (u64)-1, &key, 1);
+	if (ret)
+		return ret;
+	first_block = key.objectid;
+
+	ret = copy_range_to_disk(fs_info, source, file_pos, first_block,
+				 copy_len);
+	if (ret < 0) {
+		error("failed to write %s", source->path_name);
+		return ret;
+	}
+	if (tail) {
+		ret = read_source(source, source->buf, file_pos + copy_len, tail);
+		if (ret < 0)
+			return ret;
+		memset(source->buf + tail, 0, sectorsize - tail);
+		ret = write_data_to_disk(fs_info, source->buf,
+					 first_block + copy_len, sectorsize);
+		if (ret) {
+			error("failed to write %s", source->path_name);
+			return ret;
+		}
+	}
+
+	if (datasum && copy_len) {
+		void *map;
+
+		map = mmap(NULL, copy_len, PROT_READ, MAP_SHARED, source->fd,
+			   file_pos);
+		if (map == MAP_FAILED) {
+			ret = -errno;
+			error("cannot map %s at offset %llu: %m",
+			      source->path_name, file_pos);
+			return ret;
+		}
+		madvise(map, copy_len, MADV_SEQUENTIAL);
+		ret = btrfs_csum_file_range(trans, first_block, copy_len,
+					    BTRFS_EXTENT_CSUM_OBJECTID,
+					    fs_info->csum_type, map);
+		munmap(map, copy_len);
+		if (ret)
+			return ret;
+	}
+	if (datasum && tail) {
+		ret = btrfs_csum_file_range(trans, first_block + copy_len,
+					    sectorsize,
+					    BTRFS_EXTENT_CSUM_OBJECTID,
+					    fs_info->csum_type, source->buf);
+		if (ret)
+			return ret;
+	}
 
+	btrfs_set_stack_file_extent_type(&stack_fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_stack_file_extent_disk_bytenr(&stack_fi, first_block);
+	btrfs_set_stack_file_extent_disk_num_bytes(&stack_fi, to_write);
+	btrfs_set_stack_file_extent_num_bytes(&stack_fi, to_write);
+	btrfs_set_stack_file_extent_ram_bytes(&stack_fi, to_write);
 	ret = insert_reserved_file_extent(trans, root, objectid, btrfs_inode,
 					  file_pos, &stack_fi);
 	if (ret)
 		return ret;
-
 	return to_read;
 }
 
@@ -891,51 +1419,45 @@ static int add_file_item_extent(struct btrfs_trans_handle *trans,
  * Returns the size of the compressed data if successful, -E2BIG if it is
  * incompressible, or an error code.
  */
-static ssize_t zlib_compress_inline_extent(char *buf, u64 size, char **comp_buf)
+static ssize_t zlib_compress_inline_extent(struct compress_ctx *ctx, char *buf,
+					   u64 size, char **comp_buf)
 {
 	int zlib_ret;
 	ssize_t ret;
-	z_stream strm;
+	z_stream *strm;
 	char *out = NULL;
 
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	zlib_ret = deflateInit(&strm, g_compression_level);
-	if (zlib_ret != Z_OK) {
-		error("deflateInit failed: %s", strm.msg);
+	strm = get_zlib_stream(ctx);
+	if (!strm)
 		return -EINVAL;
-	}
 
 	out = malloc(size);
 	if (!out) {
 		error_msg(ERROR_MSG_MEMORY, NULL);
-		ret = -ENOMEM;
-		goto out;
+		return -ENOMEM;
 	}
 
-	strm.next_out = (Bytef *)out;
-	strm.avail_out = size;
-	strm.next_in = (Bytef *)buf;
-	strm.avail_in = size;
+	strm->next_out = (Bytef *)out;
+	strm->avail_out = size;
+	strm->next_in = (Bytef *)buf;
+	strm->avail_in = size;
 
-	zlib_ret = deflate(&strm, Z_FINISH);
+	zlib_ret = deflate(strm, Z_FINISH);
 	if (zlib_ret != Z_OK && zlib_ret != Z_STREAM_END) {
-		error("deflate failed: %s", strm.msg);
+		error("deflate failed: %s", strm->msg);
 		ret = -EINVAL;
 		goto out;
 	}
 
-	if (zlib_ret == Z_STREAM_END && strm.avail_out > 0) {
+	if (zlib_ret == Z_STREAM_END && strm->avail_out > 0) {
 		*comp_buf = out;
-		ret = size - strm.avail_out;
+		ret = size - strm->avail_out;
 		UASSERT(ret >= 0);
 	} else {
 		ret = -E2BIG;
 	}
 
 out:
-	deflateEnd(&strm);
 	if (ret < 0)
 		free(out);
 
@@ -1004,7 +1526,8 @@ out:
  * Returns the size of the compressed data if successful, -E2BIG if it is
  * incompressible, or an error code.
  */
-static ssize_t zstd_compress_inline_extent(char *buf, u64 size, char **comp_buf)
+static ssize_t zstd_compress_inline_extent(struct compress_ctx *ctx, char *buf,
+					   u64 size, char **comp_buf)
 {
 	ZSTD_CCtx *zstd_ctx;
 	ZSTD_inBuffer input;
@@ -1013,28 +1536,9 @@ static ssize_t zstd_compress_inline_extent(char *buf, u64 size, char **comp_buf)
 	ssize_t ret;
 	char *out = NULL;
 
-	zstd_ctx = ZSTD_createCCtx();
-	if (!zstd_ctx) {
-		error_msg(ERROR_MSG_MEMORY, NULL);
-		return -ENOMEM;
-	}
-
-	zstd_ret = ZSTD_CCtx_setParameter(zstd_ctx, ZSTD_c_compressionLevel,
-					  g_compression_level);
-	if (ZSTD_isError(zstd_ret)) {
-		error("ZSTD_CCtx_setParameter failed: %s",
-		      ZSTD_getErrorName(zstd_ret));
-		ret = -EINVAL;
-		goto out;
-	}
-
-	zstd_ret = ZSTD_CCtx_setPledgedSrcSize(zstd_ctx, size);
-	if (ZSTD_isError(zstd_ret)) {
-		error("ZSTD_CCtx_setPledgedSrcSize failed: %s",
-		      ZSTD_getErrorName(zstd_ret));
-		ret = -EINVAL;
-		goto out;
-	}
+	zstd_ctx = get_zstd_ctx(ctx, size);
+	if (!zstd_ctx)
+		return -EINVAL;
 
 	out = malloc(size);
 	if (!out) {
@@ -1071,117 +1575,15 @@ out:
 	if (ret < 0)
 		free(out);
 
-	ZSTD_freeCCtx(zstd_ctx);
-
 	return ret;
 }
 #endif
 
-static int add_file_items(struct btrfs_trans_handle *trans,
-			  struct btrfs_root *root,
-			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
-			  const struct stat *st, const char *path_name)
+/* Size of the buffer for the compressed data of one extent */
+static size_t compressed_buf_size(u32 sectorsize)
 {
-	struct btrfs_fs_info *fs_info = trans->fs_info;
-	int ret = -1;
-	ssize_t ret_read;
-	u32 sectorsize = fs_info->sectorsize;
-	u64 file_pos = 0;
-	char *buf = NULL, *comp_buf = NULL, *wrkmem = NULL;
-	struct source_descriptor source;
-	int fd;
-
-	if (st->st_size == 0)
-		return 0;
-
-	fd = open(path_name, O_RDONLY);
-	if (fd == -1) {
-		error("cannot open %s: %m", path_name);
-		return ret;
-	}
-
-	if (g_compression == BTRFS_COMPRESS_LZO) {
-#if COMPRESSION_LZO
-		wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
-		if (!wrkmem) {
-			ret = -ENOMEM;
-			goto end;
-		}
-#else
-		error("lzo support not compiled in");
-		ret = -EINVAL;
-		goto end;
-#endif
-	}
-
-	if (st->st_size <= BTRFS_MAX_INLINE_DATA_SIZE(fs_info) &&
-	    st->st_size < sectorsize) {
-		char *buffer = malloc(st->st_size);
-
-		if (!buffer) {
-			ret = -ENOMEM;
-			goto end;
-		}
-
-		ret_read = pread(fd, buffer, st->st_size, 0);
-		if (ret_read == -1) {
-			error("cannot read %s at offset %u length %zu: %m",
-			      path_name, 0, st->st_size);
-			free(buffer);
-			goto end;
-		}
-
-		switch (g_compression) {
-		case BTRFS_COMPRESS_ZLIB:
-			ret = zlib_compress_inline_extent(buffer, st->st_size,
-							  &comp_buf);
-			break;
 #if COMPRESSION_LZO
-		case BTRFS_COMPRESS_LZO:
-			ret = lzo_compress_inline_extent(buffer, st->st_size,
-							 &comp_buf, wrkmem);
-			break;
-#endif
-#if COMPRESSION_ZSTD
-		case BTRFS_COMPRESS_ZSTD:
-			ret = zstd_compress_inline_extent(buffer, st->st_size,
-							  &comp_buf);
-			break;
-#endif
-		default:
-			ret = -E2BIG;
-			break;
-		}
-
-		if (ret < 0) {
-			ret = btrfs_insert_inline_extent(trans, root, objectid,
-							 0, buffer, st->st_size,
-							 BTRFS_COMPRESS_NONE,
-							 st->st_size);
-		} else {
-			ret = btrfs_insert_inline_extent(trans, root, objectid,
-							 0, comp_buf, ret,
-							 g_compression,
-							 st->st_size);
-		}
-
-		free(buffer);
-		/* Update the inode nbytes for inline extents. */
-		btrfs_set_stack_inode_nbytes(btrfs_inode, st->st_size);
-		goto end;
-	}
-
-	buf = malloc(MAX_EXTENT_SIZE);
-	if (!buf) {
-		ret = -ENOMEM;
-		goto end;
-	}
-
 	if (g_compression == BTRFS_COMPRESS_LZO) {
-#if COMPRESSION_LZO
-		unsigned int sectors;
-		size_t comp_buf_len;
-
 		/*
 		 * LZO helpfully doesn't provide a way to specify the output
 		 * buffer size, so we need to allocate for the worst-case
@@ -1193,58 +1595,616 @@ static int add_file_items(struct btrfs_trans_handle *trans,
 		 * - the worst-case output size
 		 * - 3 bytes for possible padding
 		 */
+		return LZO_LEN + (LZO_LEN + lzo_max_outlen(sectorsize) +
+				  LZO_LEN - 1) * (BTRFS_MAX_COMPRESSED / sectorsize);
+	}
+#endif
+	return BTRFS_MAX_COMPRESSED;
+}
 
-		sectors = BTRFS_MAX_COMPRESSED / sectorsize;
-
-		comp_buf_len = LZO_LEN;
-		comp_buf_len += (LZO_LEN + lzo_max_outlen(sectorsize) +
-				 LZO_LEN - 1) * sectors;
-
-		comp_buf = malloc(comp_buf_len);
-		if (!comp_buf) {
-			ret = -ENOMEM;
-			goto end;
-		}
-
-		ret = lzo_init();
-		if (ret) {
-			error("lzo_init returned %i", ret);
-			ret = -EINVAL;
-			goto end;
-		}
-#else
-		error("lzo support not compiled in");
-		ret = -EINVAL;
-		goto end;
+/*
+ * Returns the size of the compressed data if successful, -E2BIG if it is
+ * incompressible, or an error code.
+ */
+static ssize_t compress_inline_extent(struct compress_ctx *ctx, char *buf,
+				      u64 size, char **comp_buf)
+{
+	switch (g_compression) {
+	case BTRFS_COMPRESS_ZLIB:
+		return zlib_compress_inline_extent(ctx, buf, size, comp_buf);
+#if COMPRESSION_LZO
+	case BTRFS_COMPRESS_LZO:
+		return lzo_compress_inline_extent(buf, size, comp_buf,
+						  ctx->wrkmem);
 #endif
-	} else if (g_compression != BTRFS_COMPRESS_NONE) {
-		comp_buf = malloc(BTRFS_MAX_COMPRESSED);
-		if (!comp_buf) {
-			ret = -ENOMEM;
-			goto end;
-		}
+#if COMPRESSION_ZSTD
+	case BTRFS_COMPRESS_ZSTD:
+		return zstd_compress_inline_extent(ctx, buf, size, comp_buf);
+#endif
+	default:
+		return -E2BIG;
 	}
+}
 
-	source.fd = fd;
-	source.buf = buf;
-	source.size = st->st_size;
-	source.path_name = path_name;
-	source.comp_buf = comp_buf;
-	source.wrkmem = wrkmem;
-
-	while (file_pos < st->st_size) {
-		ret = add_file_item_extent(trans, root, btrfs_inode, objectid,
-					   &source, file_pos);
-		if (ret < 0)
-			break;
-
-		file_pos += ret;
+/* Set up the work memory and, if @buffers, the extent buffers of @ctx */
+static int compress_ctx_prepare(struct compress_ctx *ctx, u32 sectorsize,
+				bool buffers)
+{
+#if COMPRESSION_LZO
+	if (g_compression == BTRFS_COMPRESS_LZO && !ctx->wrkmem) {
+		ctx->wrkmem = malloc(LZO1X_1_MEM_COMPRESS);
+		if (!ctx->wrkmem)
+			return -ENOMEM;
+	}
+#endif
+	if (!buffers)
+		return 0;
+	if (!ctx->buf) {
+		ctx->buf = malloc(MAX_EXTENT_SIZE);
+		if (!ctx->buf)
+			return -ENOMEM;
+	}
+	if (g_compression != BTRFS_COMPRESS_NONE && !ctx->comp_buf) {
+		ctx->comp_buf = malloc(compressed_buf_size(sectorsize));
+		if (!ctx->comp_buf)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+static void compress_ctx_release(struct compress_ctx *ctx)
+{
+	if (ctx->zlib_ready)
+		deflateEnd(&ctx->zlib);
+#if COMPRESSION_ZSTD
+	ZSTD_freeCCtx(ctx->zstd);
+#endif
+	free(ctx->wrkmem);
+	free(ctx->buf);
+	free(ctx->comp_buf);
+	free(ctx->digests);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+static bool is_inline_file(const struct btrfs_fs_info *fs_info, u64 size)
+{
+	return size <= BTRFS_MAX_INLINE_DATA_SIZE(fs_info) &&
+	       size < fs_info->sectorsize;
+}
+
+/*
+ * Read ahead and compression of the files by worker threads.
+ *
+ * The source directory is walked first and its entries are recorded, then
+ * they're added in the same order by the main thread while the workers read
+ * and compress the following regular files, in spans of MAX_EXTENT_SIZE.  The
+ * extents are still reserved, written and inserted by the main thread only,
+ * so the filesystem is the same as if the files were read synchronously.
+ *
+ * The extents depend on the inode flags, e.g. NOCOMPRESS is set if the
+ * beginning of the file is incompressible.  The workers guess the flags of
+ * the inode from --inode-flags and the parent directories, the spans after
+ * the first one of a file wait for the flags the first one ended with.  An
+ * extent prepared for other flags than the inode has when it's added is read
+ * again by the main thread.
+ */
+
+/* Data of the files queued to the workers at most */
+#define ROOTDIR_PREFETCH_SIZE		SZ_64M
+
+struct rootdir_entry {
+	char *path;
+	struct stat st;
+	int typeflag;
+	struct FTW ftw;
+	/* Inode flags guessed for the workers */
+	u64 flags;
+	/* The first span is done, the next ones start with @span_flags */
+	bool span_done;
+	bool span_failed;
+	u64 span_flags;
+};
+
+struct rootdir_span {
+	/* In rootdir_prefetch::spans */
+	struct list_head list;
+	/* In rootdir_prefetch::pending until a worker takes it */
+	struct list_head pending_list;
+	struct rootdir_entry *entry;
+	u64 start;
+	u64 len;
+	bool done;
+	/* Not read, left to the main thread */
+	bool failed;
+	char *buf;
+	char *comp_buf;
+	/* Result of compress_inline_extent() for an inline file */
+	ssize_t inline_ret;
+	int nr_extents;
+	struct file_extent_data extents[MAX_EXTENT_SIZE / BTRFS_MAX_COMPRESSED];
+};
+
+struct rootdir_prefetch {
+	pthread_mutex_t mutex;
+	/* New spans are pending or the workers stop */
+	pthread_cond_t work_cond;
+	/* A span is done */
+	pthread_cond_t done_cond;
+	/* The queued spans in the order of the entries */
+	struct list_head spans;
+	struct list_head pending;
+	u64 queued_bytes;
+	/* Freed spans of MAX_EXTENT_SIZE with their buffers, for reuse */
+	struct list_head free_spans;
+	bool stop;
+
+	/* Next span to be queued */
+	struct rootdir_entry *next_entry;
+	u64 next_pos;
+
+	const struct btrfs_fs_info *fs_info;
+	size_t comp_buf_size;
+	int nr_threads;
+	pthread_t *threads;
+};
+
+static struct rootdir_entry *g_entries;
+static u64 g_nr_entries;
+/* The entry being added, NULL if the files are not read ahead */
+static struct rootdir_entry *g_entry;
+static struct rootdir_prefetch g_prefetch;
+
+/* Spans of the whole MAX_EXTENT_SIZE keep their buffers when freed */
+static bool is_full_span(const struct rootdir_span *span)
+{
+	return span->len > BTRFS_MAX_COMPRESSED;
+}
+
+static int prefetch_span(struct rootdir_prefetch *pf, struct rootdir_span *span,
+			 struct compress_ctx *ctx, u64 *flags_ret)
+{
+	struct rootdir_entry *entry = span->entry;
+	struct source_descriptor source = { 0 };
+	u32 sectorsize = pf->fs_info->sectorsize;
+	u64 buf_len = span->len;
+	u64 flags = entry->flags;
+	u64 file_pos;
+	int ret = 0;
+
+	ret = compress_ctx_prepare(ctx, sectorsize, false);
+	if (ret < 0)
+		return ret;
+
+	if (span->start > 0) {
+		pthread_mutex_lock(&pf->mutex);
+		while (!entry->span_done)
+			pthread_cond_wait(&pf->done_cond, &pf->mutex);
+		flags = entry->span_flags;
+		if (entry->span_failed)
+			ret = -EAGAIN;
+		pthread_mutex_unlock(&pf->mutex);
+		if (ret < 0)
+			return ret;
+	}
+
+	source.fd = open(entry->path, O_RDONLY);
+	if (source.fd < 0)
+		return -errno;
+	source.size = entry->st.st_size;
+	source.path_name = entry->path;
+	source.ctx = ctx;
+	source.quiet = true;
+
+	if (is_full_span(span))
+		buf_len = MAX_EXTENT_SIZE;
+	if (!span->buf)
+		span->buf = malloc(round_up(buf_len, sectorsize));
+	if (!span->buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (is_inline_file(pf->fs_info, source.size)) {
+		ret = read_source(&source, span->buf, 0, span->len);
+		if (ret < 0)
+			goto out;
+		span->inline_ret = compress_inline_extent(ctx, span->buf,
+							  span->len,
+							  &span->comp_buf);
+		goto out;
+	}
+
+	if (g_compression != BTRFS_COMPRESS_NONE && !span->comp_buf) {
+		span->comp_buf = malloc(DIV_ROUND_UP(buf_len, BTRFS_MAX_COMPRESSED) *
+					pf->comp_buf_size);
+		if (!span->comp_buf) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	file_pos = span->start;
+	while (file_pos < span->start + span->len) {
+		struct file_extent_data *ext = &span->extents[span->nr_extents];
+
+		source.buf = span->buf + (file_pos - span->start);
+		if (span->comp_buf)
+			source.comp_buf = span->comp_buf +
+					  span->nr_extents * pf->comp_buf_size;
+		ret = read_file_extent(&source, sectorsize, file_pos, flags, ext);
+		if (ret < 0)
+			goto out;
+		flags = ext->flags_after;
+		file_pos += ext->to_read;
+		span->nr_extents++;
+	}
+	*flags_ret = flags;
+out:
+	close(source.fd);
+	return ret;
+}
+
+static void *prefetch_worker(void *data)
+{
+	struct rootdir_prefetch *pf = data;
+	struct compress_ctx ctx = { 0 };
+
+	pthread_mutex_lock(&pf->mutex);
+	while (true) {
+		struct rootdir_span *span;
+		u64 flags = 0;
+		int ret;
+
+		while (!pf->stop && list_empty(&pf->pending))
+			pthread_cond_wait(&pf->work_cond, &pf->mutex);
+		if (pf->stop)
+			break;
+
+		span = list_first_entry(&pf->pending, struct rootdir_span,
+					pending_list);
+		list_del_init(&span->pending_list);
+		pthread_mutex_unlock(&pf->mutex);
+
+		ret = prefetch_span(pf, span, &ctx, &flags);
+
+		pthread_mutex_lock(&pf->mutex);
+		span->failed = (ret < 0);
+		span->done = true;
+		if (span->start == 0) {
+			span->entry->span_done = true;
+			span->entry->span_failed = span->failed;
+			span->entry->span_flags = flags;
+		}
+		pthread_cond_broadcast(&pf->done_cond);
+	}
+	pthread_mutex_unlock(&pf->mutex);
+
+	compress_ctx_release(&ctx);
+	return NULL;
+}
+
+static void free_span(struct rootdir_span *span)
+{
+	free(span->buf);
+	free(span->comp_buf);
+	free(span);
+}
+
+/* Allocate a span of @len, called with the mutex held */
+static struct rootdir_span *alloc_span(struct rootdir_prefetch *pf, u64 len)
+{
+	struct rootdir_span *span;
+	char *buf, *comp_buf;
+
+	if (len <= BTRFS_MAX_COMPRESSED || list_empty(&pf->free_spans))
+		return calloc(1, sizeof(*span));
+
+	span = list_first_entry(&pf->free_spans, struct rootdir_span, list);
+	list_del(&span->list);
+	buf = span->buf;
+	comp_buf = span->comp_buf;
+	memset(span, 0, sizeof(*span));
+	span->buf = buf;
+	span->comp_buf = comp_buf;
+	return span;
+}
+
+/* Release the span removed from the lists, called with the mutex held */
+static void release_span(struct rootdir_prefetch *pf, struct rootdir_span *span)
+{
+	if (is_full_span(span) && span->buf)
+		list_add(&span->list, &pf->free_spans);
+	else
+		free_span(span);
+}
+
+/* Queue the spans of the next files, called with the mutex held */
+static void prefetch_queue(struct rootdir_prefetch *pf)
+{
+	struct rootdir_entry *end = g_entries + g_nr_entries;
+	bool queued = false;
+
+	while (pf->next_entry < end && pf->queued_bytes < ROOTDIR_PREFETCH_SIZE) {
+		struct rootdir_entry *entry = pf->next_entry;
+		struct rootdir_span *span;
+		u64 len;
+
+		if (!S_ISREG(entry->st.st_mode) || pf->next_pos >= entry->st.st_size) {
+			pf->next_entry++;
+			pf->next_pos = 0;
+			continue;
+		}
+
+		len = min_t(u64, MAX_EXTENT_SIZE, entry->st.st_size - pf->next_pos);
+		span = alloc_span(pf, len);
+		if (!span)
+			break;
+		span->entry = entry;
+		span->start = pf->next_pos;
+		span->len = len;
+		list_add_tail(&span->list, &pf->spans);
+		list_add_tail(&span->pending_list, &pf->pending);
+		pf->queued_bytes += span->len;
+		pf->next_pos += span->len;
+		queued = true;
+	}
+	if (queued)
+		pthread_cond_broadcast(&pf->work_cond);
+}
+
+/*
+ * Free the spans before @pos of @entry, the entries before it are added
+ * already, and queue the next ones.  Called with the mutex held.
+ */
+static void prefetch_advance(struct rootdir_prefetch *pf,
+			     struct rootdir_entry *entry, u64 pos)
+{
+	while (!list_empty(&pf->spans)) {
+		struct rootdir_span *span;
+
+		span = list_first_entry(&pf->spans, struct rootdir_span, list);
+		if (span->entry > entry ||
+		    (span->entry == entry && span->start + span->len > pos))
+			break;
+
+		if (!list_empty(&span->pending_list)) {
+			list_del_init(&span->pending_list);
+			if (span->start == 0) {
+				span->entry->span_done = true;
+				span->entry->span_failed = true;
+			}
+		} else {
+			while (!span->done)
+				pthread_cond_wait(&pf->done_cond, &pf->mutex);
+		}
+		list_del(&span->list);
+		pf->queued_bytes -= span->len;
+		release_span(pf, span);
+	}
+
+	/*
+	 * The spans of the entry were not queued in time and the data are read
+	 * by the main thread, continue with the next entry.
+	 */
+	if (pf->next_entry < entry) {
+		pf->next_entry = entry;
+		pf->next_pos = 0;
+	}
+	if (pf->next_entry == entry && pf->next_pos < pos) {
+		pf->next_entry++;
+		pf->next_pos = 0;
+	}
+	prefetch_queue(pf);
+}
+
+/* Return the span of @entry at @pos once it's read, NULL if there's none */
+static struct rootdir_span *prefetch_get_span(struct rootdir_entry *entry,
+					      u64 pos)
+{
+	struct rootdir_prefetch *pf = &g_prefetch;
+	struct rootdir_span *span = NULL;
+
+	pthread_mutex_lock(&pf->mutex);
+	prefetch_advance(pf, entry, pos);
+	if (!list_empty(&pf->spans)) {
+		span = list_first_entry(&pf->spans, struct rootdir_span, list);
+		if (span->entry == entry && span->start <= pos) {
+			while (!span->done)
+				pthread_cond_wait(&pf->done_cond, &pf->mutex);
+			if (span->failed)
+				span = NULL;
+		} else {
+			span = NULL;
+		}
+	}
+	pthread_mutex_unlock(&pf->mutex);
+	return span;
+}
+
+/*
+ * Return the extent of @entry at @pos if it was read ahead with the inode
+ * @flags, it's valid until the next call.
+ */
+static struct file_extent_data *prefetch_get_extent(struct rootdir_entry *entry,
+						    u64 pos, u64 flags)
+{
+	struct rootdir_span *span;
+
+	span = prefetch_get_span(entry, pos);
+	if (!span)
+		return NULL;
+	for (int i = 0; i < span->nr_extents; i++) {
+		if (span->extents[i].file_pos == pos &&
+		    span->extents[i].flags == flags)
+			return &span->extents[i];
+	}
+	return NULL;
+}
+
+static int prefetch_start(struct rootdir_prefetch *pf,
+			  const struct btrfs_fs_info *fs_info,
+			  unsigned int nr_threads)
+{
+	int ret;
+
+	pthread_mutex_init(&pf->mutex, NULL);
+	pthread_cond_init(&pf->work_cond, NULL);
+	pthread_cond_init(&pf->done_cond, NULL);
+	INIT_LIST_HEAD(&pf->spans);
+	INIT_LIST_HEAD(&pf->pending);
+	INIT_LIST_HEAD(&pf->free_spans);
+	pf->queued_bytes = 0;
+	pf->stop = false;
+	pf->next_entry = g_entries;
+	pf->next_pos = 0;
+	pf->fs_info = fs_info;
+	pf->comp_buf_size = compressed_buf_size(fs_info->sectorsize);
+	pf->nr_threads = 0;
+
+	pf->threads = calloc(nr_threads, sizeof(pthread_t));
+	if (!pf->threads)
+		return -ENOMEM;
+
+	for (int i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&pf->threads[i], NULL, prefetch_worker, pf);
+		if (ret) {
+			errno = ret;
+			warning("failed to create thread to read the files: %m");
+			break;
+		}
+		pf->nr_threads++;
+	}
+	return 0;
+}
+
+static void prefetch_stop(struct rootdir_prefetch *pf)
+{
+	struct rootdir_span *span, *tmp;
+
+	pthread_mutex_lock(&pf->mutex);
+	pf->stop = true;
+	pthread_cond_broadcast(&pf->work_cond);
+	pthread_mutex_unlock(&pf->mutex);
+
+	for (int i = 0; i < pf->nr_threads; i++)
+		pthread_join(pf->threads[i], NULL);
+	free(pf->threads);
+	pf->threads = NULL;
+	pf->nr_threads = 0;
+
+	list_for_each_entry_safe(span, tmp, &pf->spans, list) {
+		list_del(&span->list);
+		free_span(span);
+	}
+	list_for_each_entry_safe(span, tmp, &pf->free_spans, list) {
+		list_del(&span->list);
+		free_span(span);
+	}
+	INIT_LIST_HEAD(&pf->pending);
+
+	pthread_cond_destroy(&pf->done_cond);
+	pthread_cond_destroy(&pf->work_cond);
+	pthread_mutex_destroy(&pf->mutex);
+}
+
+static int add_file_items(struct btrfs_trans_handle *trans,
+			  struct btrfs_root *root,
+			  struct btrfs_inode_item *btrfs_inode, u64 objectid,
+			  const struct stat *st, const char *path_name)
+{
+	struct btrfs_fs_info *fs_info = trans->fs_info;
+	int ret = -1;
+	ssize_t ret_read;
+	u64 file_pos = 0;
+	struct source_descriptor source = { 0 };
+	int fd;
+
+	if (st->st_size == 0)
+		return 0;
+
+	fd = open(path_name, O_RDONLY);
+	if (fd == -1) {
+		error("cannot open %s: %m", path_name);
+		return ret;
+	}
+
+	ret = compress_ctx_prepare(&g_ctx, fs_info->sectorsize, true);
+	if (ret < 0)
+		goto end;
+
+	if (is_inline_file(fs_info, st->st_size)) {
+		struct rootdir_span *span = NULL;
+		char *buffer, *comp_buf = NULL;
+		ssize_t comp_ret;
+
+		if (g_entry)
+			span = prefetch_get_span(g_entry, 0);
+		if (span) {
+			buffer = span->buf;
+			comp_ret = span->inline_ret;
+			comp_buf = span->comp_buf;
+		} else {
+			buffer = g_ctx.buf;
+			ret_read = pread(fd, buffer, st->st_size, 0);
+			if (ret_read == -1) {
+				error("cannot read %s at offset %u length %zu: %m",
+				      path_name, 0, st->st_size);
+				ret = -1;
+				goto end;
+			}
+
+			comp_ret = compress_inline_extent(&g_ctx, buffer,
+							  st->st_size, &comp_buf);
+		}
+
+		if (comp_ret < 0) {
+			ret = btrfs_insert_inline_extent(trans, root, objectid,
+							 0, buffer, st->st_size,
+							 BTRFS_COMPRESS_NONE,
+							 st->st_size);
+		} else {
+			ret = btrfs_insert_inline_extent(trans, root, objectid,
+							 0, comp_buf, comp_ret,
+							 g_compression,
+							 st->st_size);
+		}
+
+		if (!span)
+			free(comp_buf);
+		/* Update the inode nbytes for inline extents. */
+		btrfs_set_stack_inode_nbytes(btrfs_inode, st->st_size);
+		goto end;
+	}
+
+	source.fd = fd;
+	source.buf = g_ctx.buf;
+	source.size = st->st_size;
+	source.path_name = path_name;
+	source.comp_buf = g_ctx.comp_buf;
+	source.ctx = &g_ctx;
+
+	while (file_pos < st->st_size) {
+		struct file_extent_data *ext = NULL;
+
+		if (g_entry)
+			ext = prefetch_get_extent(g_entry, file_pos,
+					btrfs_stack_inode_flags(btrfs_inode));
+		if (ext)
+			ret = write_file_extent(trans, root, btrfs_inode,
+						objectid, path_name, ext);
+		else if (g_copy_range)
+			ret = copy_file_extent(trans, root, btrfs_inode,
+					       objectid, &source, file_pos);
+		else
+			ret = add_file_item_extent(trans, root, btrfs_inode,
+						   objectid, &source, file_pos);
+		if (ret < 0)
+			break;
+
+		file_pos += ret;
 	}
 
 end:
-	free(wrkmem);
-	free(comp_buf);
-	free(buf);
 	close(fd);
 	return ret;
 }
@@ -1564,10 +2524,8 @@ static int ftw_add_inode(const char *full_path, const struct stat *st,
 			}
 			found->found_nlink++;
 			/* We found all hard links for it. Can remove the entry. */
-			if (found->found_nlink >= found->st_nlink) {
-				rb_erase(&found->node, &hardlink_root);
-				free(found);
-			}
+			if (found->found_nlink >= found->st_nlink)
+				remove_hard_link(found);
 			return 0;
 		}
 	}
@@ -1673,64 +2631,475 @@ static int ftw_add_inode(const char *full_path, const struct stat *st,
 	return 0;
 };
 
-static int set_default_subvolume(struct btrfs_trans_handle *trans)
+/*
+ * The inode flags the entry is likely to get for the workers reading ahead,
+ * from --inode-flags and the parent directory like inherit_inode_flags().
+ */
+static void guess_inode_flags(struct rootdir_entry *entry, u64 *dir_flags)
 {
-	struct btrfs_path path = { 0 };
-	struct btrfs_dir_item *di;
-	struct btrfs_key location;
-	struct extent_buffer *leaf;
-	struct btrfs_disk_key disk_key;
-	u64 features;
+	struct btrfs_inode_item inode_item = { 0 };
+	struct rootdir_inode_flags_entry *rif;
+	int level = entry->ftw.level;
+	u64 flags;
 
-	di = btrfs_lookup_dir_item(trans, trans->fs_info->tree_root, &path,
-				   btrfs_super_root_dir(trans->fs_info->super_copy),
-				   "default", 7, 1);
-	if (IS_ERR_OR_NULL(di)) {
-		btrfs_release_path(&path);
+	btrfs_set_stack_inode_mode(&inode_item, entry->st.st_mode);
+	list_for_each_entry(rif, g_inode_flags_list, list) {
+		if (strcmp(rif->full_path, entry->path) == 0) {
+			update_inode_flags(rif, &inode_item);
+			break;
+		}
+	}
+	flags = btrfs_stack_inode_flags(&inode_item);
 
-		if (di)
-			return PTR_ERR(di);
-		else
-			return -ENOENT;
+	if (level > 0 && (dir_flags[level - 1] & BTRFS_INODE_NODATACOW)) {
+		flags |= BTRFS_INODE_NODATACOW;
+		if (S_ISREG(entry->st.st_mode))
+			flags |= BTRFS_INODE_NODATASUM;
 	}
+	if (S_ISDIR(entry->st.st_mode))
+		dir_flags[level] = flags;
+	entry->flags = flags;
+}
 
-	leaf = path.nodes[0];
+/*
+ * Walk of the source directory in the same order and with the same arguments
+ * of the callback as nftw() with FTW_PHYS: pre-order, the entries of each
+ * directory in the order returned by readdir().
+ *
+ * All entries of a directory are read and stated before the first one is
+ * passed to the callback.  The stats are relative to the directory, so
+ * there's no lookup of the whole path for each entry, and are queued to
+ * io_uring in batches to be in flight together.  Without io_uring they're
+ * done one by one.  Only the directory being read is open.
+ */
+#define ROOTDIR_WALK_BATCH	64
 
-	location.objectid = default_subvol_id;
-	location.type = BTRFS_ROOT_ITEM_KEY;
-	location.offset = 0;
+typedef int (*rootdir_walk_fn)(const char *full_path, const struct stat *st,
+			       int typeflag, struct FTW *ftwbuf);
 
-	btrfs_cpu_key_to_disk(&disk_key, &location);
-	btrfs_set_dir_item_key(leaf, di, &disk_key);
+struct rootdir_dirent {
+	char *name;
+	struct stat st;
+	int typeflag;
+};
 
-	btrfs_mark_buffer_dirty(leaf);
+struct rootdir_walk {
+	rootdir_walk_fn fn;
+	struct io_ring ring;
+	bool use_ring;
+	/* Results of the queued stats, valid for the whole walk */
+	struct statx stx[ROOTDIR_WALK_BATCH];
+	/* Path of the entry passed to @fn */
+	char path[PATH_MAX];
+};
 
-	btrfs_release_path(&path);
+static void statx_to_stat(const struct statx *stx, struct stat *st)
+{
+	memset(st, 0, sizeof(*st));
+	st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+	st->st_ino = stx->stx_ino;
+	st->st_mode = stx->stx_mode;
+	st->st_nlink = stx->stx_nlink;
+	st->st_uid = stx->stx_uid;
+	st->st_gid = stx->stx_gid;
+	st->st_rdev = makedev(stx->stx_rdev_major, stx->stx_rdev_minor);
+	st->st_size = stx->stx_size;
+	st->st_blksize = stx->stx_blksize;
+	st->st_blocks = stx->stx_blocks;
+	st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	st->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	st->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
 
-	features = btrfs_super_incompat_flags(trans->fs_info->super_copy);
-	features |= BTRFS_FEATURE_INCOMPAT_DEFAULT_SUBVOL;
-	btrfs_set_super_incompat_flags(trans->fs_info->super_copy, features);
+static int stat_typeflag(const struct stat *st)
+{
+	if (S_ISDIR(st->st_mode))
+		return FTW_D;
+	if (S_ISLNK(st->st_mode))
+		return FTW_SL;
+	return FTW_F;
+}
 
-	return 0;
+static void walk_stat_one(int dirfd, struct rootdir_dirent *dirent)
+{
+	if (fstatat(dirfd, dirent->name, &dirent->st, AT_SYMLINK_NOFOLLOW)) {
+		memset(&dirent->st, 0, sizeof(dirent->st));
+		dirent->typeflag = FTW_NS;
+		return;
+	}
+	dirent->typeflag = stat_typeflag(&dirent->st);
 }
 
-int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir,
-			struct btrfs_root *root, struct list_head *subvols,
-			struct list_head *inode_flags_list,
-			enum btrfs_compression_type compression,
-			unsigned int compression_level)
+/* Stat up to ROOTDIR_WALK_BATCH entries of the directory @dirfd */
+static void walk_stat_batch(struct rootdir_walk *walk, int dirfd,
+			    struct rootdir_dirent *dirents, int nr)
 {
+	int done = 0;
 	int ret;
-	struct stat root_st;
 
-	ret = lstat(source_dir, &root_st);
-	if (ret) {
-		error("unable to lstat %s: %m", source_dir);
-		return -errno;
-	}
+	if (!walk->use_ring)
+		goto sync;
 
-	switch (compression) {
-	case BTRFS_COMPRESS_NONE:
+	for (int i = 0; i < nr; i++)
+		io_ring_statx(&walk->ring, dirfd, dirents[i].name,
+			      AT_SYMLINK_NOFOLLOW | AT_NO_AUTOMOUNT,
+			      STATX_BASIC_STATS, &walk->stx[i], i);
+	while (done < nr) {
+		u64 index;
+		int res;
+
+		ret = io_ring_submit(&walk->ring, 1);
+		if (ret < 0) {
+			/* The rest is stated synchronously from now on */
+			io_ring_release(&walk->ring);
+			walk->use_ring = false;
+			goto sync;
+		}
+		while (io_ring_reap(&walk->ring, &index, &res)) {
+			struct rootdir_dirent *dirent = &dirents[index];
+
+			done++;
+			/* E.g. a kernel without statx in io_uring, try again */
+			if (res < 0) {
+				walk_stat_one(dirfd, dirent);
+				continue;
+			}
+			statx_to_stat(&walk->stx[index], &dirent->st);
+			dirent->typeflag = stat_typeflag(&dirent->st);
+		}
+	}
+	return;
+sync:
+	for (int i = 0; i < nr; i++)
+		walk_stat_one(dirfd, &dirents[i]);
+}
+
+/*
+ * Read and stat the entries of the directory at walk->path, which is open as
+ * @dirfd and closed.
+ */
+static int walk_read_dir(struct rootdir_walk *walk, int dirfd,
+			 struct rootdir_dirent **dirents_ret, int *nr_ret)
+{
+	struct rootdir_dirent *dirents = NULL;
+	struct dirent *de;
+	DIR *dir;
+	int nr = 0;
+	int max = 0;
+	int ret = 0;
+
+	dir = fdopendir(dirfd);
+	if (!dir) {
+		ret = -errno;
+		close(dirfd);
+		return ret;
+	}
+	while (1) {
+		errno = 0;
+		de = readdir(dir);
+		if (!de) {
+			ret = -errno;
+			break;
+		}
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (nr == max) {
+			struct rootdir_dirent *tmp;
+
+			max = max_t(int, 64, max * 2);
+			tmp = realloc(dirents, max * sizeof(*dirents));
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			dirents = tmp;
+		}
+		dirents[nr].name = strdup(de->d_name);
+		if (!dirents[nr].name) {
+			ret = -ENOMEM;
+			break;
+		}
+		nr++;
+	}
+	if (!ret) {
+		for (int i = 0; i < nr; i += ROOTDIR_WALK_BATCH)
+			walk_stat_batch(walk, dirfd, dirents + i,
+					min(nr - i, ROOTDIR_WALK_BATCH));
+	}
+	closedir(dir);
+	if (ret) {
+		for (int i = 0; i < nr; i++)
+			free(dirents[i].name);
+		free(dirents);
+		return ret;
+	}
+	*dirents_ret = dirents;
+	*nr_ret = nr;
+	return 0;
+}
+
+/* Append @name to walk->path, return the offset of the name in it */
+static int walk_path_append(struct rootdir_walk *walk, const char *name)
+{
+	const int name_len = strlen(name);
+	int len = strlen(walk->path);
+
+	if (len && walk->path[len - 1] != '/')
+		walk->path[len++] = '/';
+	if (len + name_len >= PATH_MAX)
+		return -ENAMETOOLONG;
+	memcpy(walk->path + len, name, name_len + 1);
+	return len;
+}
+
+/*
+ * Pass the entry at walk->path to the callback and walk it if it's a
+ * directory.  Return the nonzero value of the callback, or -1 with errno set.
+ */
+static int walk_entry(struct rootdir_walk *walk, const struct stat *st,
+		      int typeflag, int level, int base)
+{
+	struct rootdir_dirent *dirents = NULL;
+	struct FTW ftw = { .base = base, .level = level };
+	const int len = strlen(walk->path);
+	int nr = 0;
+	int dirfd;
+	int ret;
+
+	if (typeflag != FTW_D)
+		return walk->fn(walk->path, st, typeflag, &ftw);
+
+	dirfd = open(walk->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dirfd < 0)
+		return walk->fn(walk->path, st, FTW_DNR, &ftw);
+	ret = walk->fn(walk->path, st, FTW_D, &ftw);
+	if (ret) {
+		close(dirfd);
+		return ret;
+	}
+	ret = walk_read_dir(walk, dirfd, &dirents, &nr);
+	if (ret < 0) {
+		errno = -ret;
+		return -1;
+	}
+
+	for (int i = 0; i < nr; i++) {
+		const int pos = walk_path_append(walk, dirents[i].name);
+
+		if (pos < 0) {
+			walk->path[len] = 0;
+			errno = -pos;
+			ret = -1;
+			break;
+		}
+		ret = walk_entry(walk, &dirents[i].st, dirents[i].typeflag,
+				 level + 1, pos);
+		walk->path[len] = 0;
+		if (ret)
+			break;
+	}
+	for (int i = 0; i < nr; i++)
+		free(dirents[i].name);
+	free(dirents);
+	return ret;
+}
+
+/* Like nftw(@dir, @fn, ..., FTW_PHYS) */
+static int walk_rootdir(const char *dir, rootdir_walk_fn fn)
+{
+	struct rootdir_walk *walk;
+	struct stat st;
+	const char *slash;
+	int typeflag;
+	int ret;
+
+	walk = calloc(1, sizeof(*walk));
+	if (!walk) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (strlen(dir) >= PATH_MAX) {
+		free(walk);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(walk->path, dir);
+	walk->fn = fn;
+	walk->use_ring = (io_ring_init(&walk->ring, ROOTDIR_WALK_BATCH) == 0);
+
+	if (lstat(dir, &st)) {
+		memset(&st, 0, sizeof(st));
+		typeflag = FTW_NS;
+	} else {
+		typeflag = stat_typeflag(&st);
+	}
+	slash = strrchr(dir, '/');
+	ret = walk_entry(walk, &st, typeflag, 0,
+			 slash && slash[1] ? slash + 1 - dir : 0);
+
+	if (walk->use_ring)
+		io_ring_release(&walk->ring);
+	free(walk);
+	return ret;
+}
+
+static u64 g_max_entries;
+static int g_max_level;
+/* The directory walked by btrfs_mkfs_size_dir() into g_entries */
+static char *g_entries_dir;
+
+static int ftw_record_entry(const char *full_path, const struct stat *st,
+			    int typeflag, struct FTW *ftwbuf)
+{
+	struct rootdir_entry *entry;
+
+	if (g_nr_entries == g_max_entries) {
+		u64 nr = max_t(u64, 1024, g_max_entries * 2);
+
+		entry = realloc(g_entries, nr * sizeof(*entry));
+		if (!entry)
+			return -ENOMEM;
+		g_entries = entry;
+		g_max_entries = nr;
+	}
+
+	entry = &g_entries[g_nr_entries];
+	memset(entry, 0, sizeof(*entry));
+	entry->path = strdup(full_path);
+	if (!entry->path)
+		return -ENOMEM;
+	entry->st = *st;
+	entry->typeflag = typeflag;
+	entry->ftw = *ftwbuf;
+	g_max_level = max(g_max_level, ftwbuf->level);
+	g_nr_entries++;
+	return 0;
+}
+
+static void free_entries(void)
+{
+	for (u64 i = 0; i < g_nr_entries; i++)
+		free(g_entries[i].path);
+	free(g_entries);
+	free(g_entries_dir);
+	g_entries = NULL;
+	g_nr_entries = 0;
+	g_max_entries = 0;
+	g_max_level = 0;
+	g_entries_dir = NULL;
+}
+
+/*
+ * Add the entries recorded by the walk in the same order, while the workers
+ * read the following files ahead.  The directory is walked only if it was not
+ * done for the size already.
+ */
+static int add_recorded_entries(struct btrfs_fs_info *fs_info,
+				const char *source_dir,
+				unsigned int nr_threads)
+{
+	u64 *dir_flags = NULL;
+	int ret;
+
+	if (g_entries_dir && strcmp(g_entries_dir, source_dir) != 0)
+		free_entries();
+	if (!g_entries_dir) {
+		ret = walk_rootdir(source_dir, ftw_record_entry);
+		if (ret)
+			goto out;
+	}
+
+	if (nr_threads) {
+		/* Walk order, the parent is before its entries */
+		dir_flags = calloc(g_max_level + 1, sizeof(*dir_flags));
+		if (!dir_flags) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		for (u64 i = 0; i < g_nr_entries; i++)
+			guess_inode_flags(&g_entries[i], dir_flags);
+		free(dir_flags);
+
+		ret = prefetch_start(&g_prefetch, fs_info, nr_threads);
+		if (ret < 0)
+			goto out;
+	}
+
+	for (u64 i = 0; i < g_nr_entries; i++) {
+		struct rootdir_entry *entry = &g_entries[i];
+
+		if (g_prefetch.nr_threads) {
+			g_entry = entry;
+			pthread_mutex_lock(&g_prefetch.mutex);
+			prefetch_advance(&g_prefetch, entry, 0);
+			pthread_mutex_unlock(&g_prefetch.mutex);
+		}
+		ret = ftw_add_inode(entry->path, &entry->st, entry->typeflag,
+				    &entry->ftw);
+		if (ret)
+			break;
+	}
+	g_entry = NULL;
+	if (nr_threads)
+		prefetch_stop(&g_prefetch);
+out:
+	free_entries();
+	return ret;
+}
+
+static int set_default_subvolume(struct btrfs_trans_handle *trans)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_dir_item *di;
+	struct btrfs_key location;
+	struct extent_buffer *leaf;
+	struct btrfs_disk_key disk_key;
+	u64 features;
+
+	di = btrfs_lookup_dir_item(trans, trans->fs_info->tree_root, &path,
+				   btrfs_super_root_dir(trans->fs_info->super_copy),
+				   "default", 7, 1);
+	if (IS_ERR_OR_NULL(di)) {
+		btrfs_release_path(&path);
+
+		if (di)
+			return PTR_ERR(di);
+		else
+			return -ENOENT;
+	}
+
+	leaf = path.nodes[0];
+
+	location.objectid = default_subvol_id;
+	location.type = BTRFS_ROOT_ITEM_KEY;
+	location.offset = 0;
+
+	btrfs_cpu_key_to_disk(&disk_key, &location);
+	btrfs_set_dir_item_key(leaf, di, &disk_key);
+
+	btrfs_mark_buffer_dirty(leaf);
+
+	btrfs_release_path(&path);
+
+	features = btrfs_super_incompat_flags(trans->fs_info->super_copy);
+	features |= BTRFS_FEATURE_INCOMPAT_DEFAULT_SUBVOL;
+	btrfs_set_super_incompat_flags(trans->fs_info->super_copy, features);
+
+	return 0;
+}
+
+/* Check the compression and set up the state of the fill */
+static int rootdir_fill_init(struct btrfs_trans_handle *trans,
+			     struct list_head *subvols,
+			     struct list_head *inode_flags_list,
+			     enum btrfs_compression_type compression,
+			     unsigned int compression_level, bool dedupe)
+{
+	switch (compression) {
+	case BTRFS_COMPRESS_NONE:
                 break;
 	case BTRFS_COMPRESS_LZO:
 #if !COMPRESSION_LZO
@@ -1761,14 +3130,59 @@ int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir
 		return -EINVAL;
 	}
 
+#if COMPRESSION_LZO
+	if (compression == BTRFS_COMPRESS_LZO) {
+		int ret = lzo_init();
+
+		if (ret) {
+			error("lzo_init returned %i", ret);
+			return -EINVAL;
+		}
+	}
+#endif
+
 	g_trans = trans;
 	g_subvols = subvols;
 	g_inode_flags_list = inode_flags_list;
 	g_compression = compression;
 	g_compression_level = compression_level;
+	g_dedupe = dedupe;
 	INIT_LIST_HEAD(&current_path.inode_list);
+	g_copy_range = can_copy_range(trans->fs_info);
+	return 0;
+}
+
+int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir,
+			struct btrfs_root *root, struct list_head *subvols,
+			struct list_head *inode_flags_list,
+			enum btrfs_compression_type compression,
+			unsigned int compression_level, unsigned int nr_threads,
+			bool dedupe)
+{
+	int ret;
+	struct stat root_st;
 
-	ret = nftw(source_dir, ftw_add_inode, 32, FTW_PHYS);
+	ret = lstat(source_dir, &root_st);
+	if (ret) {
+		error("unable to lstat %s: %m", source_dir);
+		return -errno;
+	}
+
+	ret = rootdir_fill_init(trans, subvols, inode_flags_list, compression,
+				compression_level, dedupe);
+	if (ret < 0)
+		return ret;
+
+	/* The data are copied by the kernel, there's nothing to read ahead */
+	if (g_copy_range)
+		nr_threads = 0;
+	if (nr_threads || g_entries_dir)
+		ret = add_recorded_entries(trans->fs_info, source_dir, nr_threads);
+	else
+		ret = walk_rootdir(source_dir, ftw_add_inode);
+	compress_ctx_release(&g_ctx);
+	rb_free_nodes(&dedupe_root, free_one_dedupe_entry);
+	free_hard_links();
 	if (ret) {
 		error("unable to traverse directory %s: %d", source_dir, ret);
 		return ret;
@@ -1785,10 +3199,628 @@ int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir
 		}
 	}
 
-	rb_free_nodes(&hardlink_root, free_one_hardlink);
 	return 0;
 }
 
+/*
+ * Update of an image filled from a source directory, by comparing the
+ * directories of the image and the source level by level, by names.
+ *
+ * An entry of the image is kept if it's of the same type as in the source,
+ * its inode item has the same mode, owner, size, mtime and ctime, and the
+ * xattrs have the same hash.  The other entries are unlinked, with their
+ * extents if it was the last link, and the changed and new entries are
+ * added the same way as by btrfs_mkfs_fill_dir().  The kept directories are
+ * updated in place and walked.
+ *
+ * The hard links are always added again, the links found in the source are
+ * linked to one new inode.  The subvolumes of the image are not supported.
+ */
+struct update_entry {
+	char *name;
+	u32 name_len;
+	u64 ino;
+	u64 index;
+	u8 type;
+	bool keep;
+};
+
+/* Sum of the crc32c of the name and the value of each xattr */
+struct xattr_sum {
+	u64 sum;
+	u32 nr;
+};
+
+/* Level of the directory the entries are added to by ftw_update_add() */
+static int g_update_level;
+
+static int ftw_update_add(const char *full_path, const struct stat *st,
+			  int typeflag, struct FTW *ftwbuf)
+{
+	struct FTW ftw = *ftwbuf;
+
+	ftw.level += g_update_level;
+	return ftw_add_inode(full_path, st, typeflag, &ftw);
+}
+
+static int cmp_update_entry(const void *a, const void *b)
+{
+	const struct update_entry *entry1 = a;
+	const struct update_entry *entry2 = b;
+
+	return strcmp(entry1->name, entry2->name);
+}
+
+static void free_update_entries(struct update_entry *entries, int nr)
+{
+	for (int i = 0; i < nr; i++)
+		free(entries[i].name);
+	free(entries);
+}
+
+/* Read the DIR_INDEX items of the directory @dir_ino */
+static int read_update_entries(struct btrfs_root *root, u64 dir_ino,
+			       struct update_entry **entries_ret, int *nr_ret)
+{
+	struct btrfs_path path = { 0 };
+	struct update_entry *entries = NULL;
+	struct btrfs_key key = {
+		.objectid = dir_ino,
+		.type = BTRFS_DIR_INDEX_KEY,
+		.offset = 0,
+	};
+	int nr = 0;
+	int max = 0;
+	int ret;
+
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		struct extent_buffer *leaf = path.nodes[0];
+		struct update_entry *entry;
+		struct btrfs_dir_item *di;
+		struct btrfs_key location;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != dir_ino || key.type != BTRFS_DIR_INDEX_KEY)
+			break;
+
+		di = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_dir_item);
+		btrfs_dir_item_key_to_cpu(leaf, di, &location);
+		if (location.type == BTRFS_ROOT_ITEM_KEY) {
+			error("subvolume in directory %llu can't be updated",
+			      dir_ino);
+			ret = -EOPNOTSUPP;
+			goto out;
+		}
+		if (nr == max) {
+			max = max_t(int, 64, max * 2);
+			entry = realloc(entries, max * sizeof(*entries));
+			if (!entry) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			entries = entry;
+		}
+		entry = &entries[nr];
+		memset(entry, 0, sizeof(*entry));
+		entry->name_len = btrfs_dir_name_len(leaf, di);
+		entry->name = malloc(entry->name_len + 1);
+		if (!entry->name) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		read_extent_buffer(leaf, entry->name, (unsigned long)(di + 1),
+				   entry->name_len);
+		entry->name[entry->name_len] = 0;
+		entry->ino = location.objectid;
+		entry->index = key.offset;
+		entry->type = btrfs_dir_ftype(leaf, di);
+		nr++;
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	if (ret < 0) {
+		free_update_entries(entries, nr);
+		return ret;
+	}
+	*entries_ret = entries;
+	*nr_ret = nr;
+	return 0;
+}
+
+static int source_xattr_sum(const char *path, struct xattr_sum *xs)
+{
+	char xattr_list[XATTR_LIST_MAX];
+	char value[XATTR_SIZE_MAX];
+	char *name;
+	ssize_t list_len;
+	ssize_t ret;
+
+	memset(xs, 0, sizeof(*xs));
+	list_len = llistxattr(path, xattr_list, XATTR_LIST_MAX);
+	if (list_len < 0)
+		return errno == ENOTSUP ? 0 : -errno;
+
+	for (name = xattr_list; name < xattr_list + list_len;
+	     name += strlen(name) + 1) {
+		ret = lgetxattr(path, name, value, XATTR_SIZE_MAX);
+		if (ret < 0)
+			return errno == ENOTSUP ? 0 : -errno;
+		xs->sum += crc32c(crc32c(~0, name, strlen(name)), value, ret);
+		xs->nr++;
+	}
+	return 0;
+}
+
+static int image_xattr_sum(struct btrfs_root *root, u64 ino,
+			   struct xattr_sum *xs)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key = {
+		.objectid = ino,
+		.type = BTRFS_XATTR_ITEM_KEY,
+		.offset = 0,
+	};
+	char *buf;
+	int ret;
+
+	memset(xs, 0, sizeof(*xs));
+	buf = malloc(XATTR_SIZE_MAX);
+	if (!buf)
+		return -ENOMEM;
+	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+	if (ret < 0)
+		goto out;
+	while (1) {
+		struct extent_buffer *leaf = path.nodes[0];
+		unsigned long ptr;
+		u32 cur = 0;
+		u32 total;
+
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				goto out;
+			if (ret > 0)
+				break;
+			continue;
+		}
+		btrfs_item_key_to_cpu(leaf, &key, path.slots[0]);
+		if (key.objectid != ino || key.type != BTRFS_XATTR_ITEM_KEY)
+			break;
+
+		/* Names of the same hash are in one item */
+		ptr = btrfs_item_ptr_offset(leaf, path.slots[0]);
+		total = btrfs_item_size(leaf, path.slots[0]);
+		while (cur < total) {
+			struct btrfs_dir_item *di;
+			u32 name_len;
+			u32 data_len;
+			u32 crc;
+
+			di = (struct btrfs_dir_item *)(ptr + cur);
+			name_len = btrfs_dir_name_len(leaf, di);
+			data_len = min_t(u32, btrfs_dir_data_len(leaf, di),
+					 XATTR_SIZE_MAX);
+			read_extent_buffer(leaf, buf, (unsigned long)(di + 1),
+					   name_len);
+			crc = crc32c(~0, buf, name_len);
+			read_extent_buffer(leaf, buf,
+					   (unsigned long)(di + 1) + name_len,
+					   data_len);
+			xs->sum += crc32c(crc, buf, data_len);
+			xs->nr++;
+			cur += sizeof(*di) + name_len +
+			       btrfs_dir_data_len(leaf, di);
+		}
+		path.slots[0]++;
+	}
+	ret = 0;
+out:
+	btrfs_release_path(&path);
+	free(buf);
+	return ret;
+}
+
+static int xattrs_changed(struct btrfs_root *root, u64 ino, const char *path)
+{
+	struct xattr_sum source;
+	struct xattr_sum image;
+	int ret;
+
+	ret = source_xattr_sum(path, &source);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to read xattrs of %s: %m", path);
+		return ret;
+	}
+	ret = image_xattr_sum(root, ino, &image);
+	if (ret < 0)
+		return ret;
+	return source.sum != image.sum || source.nr != image.nr;
+}
+
+/*
+ * Delete all items of the inode @ino and its data extents, or only the items
+ * of @type if it's not 0.  The items are deleted by leaves, they may continue
+ * on the next leaf.
+ */
+static int delete_inode_items(struct btrfs_root *root, u64 ino, u8 type)
+{
+	struct btrfs_trans_handle *trans = g_trans;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	int ret;
+
+	key.objectid = ino;
+	key.type = type;
+	key.offset = 0;
+	while (1) {
+		struct extent_buffer *leaf;
+		int start;
+		int nr = 0;
+
+		ret = btrfs_search_slot(trans, root, &key, &path, -1, 1);
+		if (ret < 0)
+			break;
+		leaf = path.nodes[0];
+		if (path.slots[0] >= btrfs_header_nritems(leaf)) {
+			/* The first item is on the next leaf, search it exactly */
+			ret = btrfs_next_leaf(root, &path);
+			if (ret < 0)
+				break;
+			if (ret > 0) {
+				ret = 0;
+				break;
+			}
+			btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+			btrfs_release_path(&path);
+			if (key.objectid != ino || (type && key.type != type)) {
+				ret = 0;
+				break;
+			}
+			continue;
+		}
+		start = path.slots[0];
+		for (int slot = start; slot < btrfs_header_nritems(leaf); slot++) {
+			struct btrfs_file_extent_item *fi;
+			u64 disk_bytenr;
+
+			btrfs_item_key_to_cpu(leaf, &key, slot);
+			if (key.objectid != ino || (type && key.type != type))
+				break;
+			nr++;
+			if (key.type != BTRFS_EXTENT_DATA_KEY)
+				continue;
+			fi = btrfs_item_ptr(leaf, slot,
+					    struct btrfs_file_extent_item);
+			if (btrfs_file_extent_type(leaf, fi) ==
+			    BTRFS_FILE_EXTENT_INLINE)
+				continue;
+			disk_bytenr = btrfs_file_extent_disk_bytenr(leaf, fi);
+			if (!disk_bytenr)
+				continue;
+			ret = btrfs_free_extent(trans, disk_bytenr,
+					btrfs_file_extent_disk_num_bytes(leaf, fi),
+					0, root->root_key.objectid, ino,
+					key.offset -
+					btrfs_file_extent_offset(leaf, fi));
+			if (ret < 0)
+				goto out;
+		}
+		if (!nr) {
+			ret = 0;
+			break;
+		}
+		ret = btrfs_del_items(trans, root, &path, start, nr);
+		if (ret < 0)
+			break;
+		btrfs_release_path(&path);
+		key.objectid = ino;
+		key.type = type;
+		key.offset = 0;
+	}
+out:
+	btrfs_release_path(&path);
+	return ret;
+}
+
+/* Unlink the entry of the directory @dir_ino, and its entries */
+static int remove_update_entry(struct btrfs_root *root, u64 dir_ino,
+			       const struct update_entry *entry)
+{
+	struct btrfs_inode_item inode_item;
+	int ret;
+
+	if (entry->type == BTRFS_FT_DIR) {
+		struct update_entry *entries;
+		int nr;
+
+		ret = read_update_entries(root, entry->ino, &entries, &nr);
+		if (ret < 0)
+			return ret;
+		for (int i = 0; i < nr && !ret; i++)
+			ret = remove_update_entry(root, entry->ino, &entries[i]);
+		free_update_entries(entries, nr);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = btrfs_unlink(g_trans, root, entry->ino, dir_ino, entry->index,
+			   entry->name, entry->name_len, 0);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to unlink inode %llu ('%s'): %m", entry->ino,
+		      entry->name);
+		return ret;
+	}
+	ret = read_inode_item(root, &inode_item, entry->ino);
+	if (ret < 0)
+		return ret;
+	if (btrfs_stack_inode_nlink(&inode_item))
+		return 0;
+	return delete_inode_items(root, entry->ino, 0);
+}
+
+/* The inode item and the xattrs of the entry match the source */
+static int update_entry_unchanged(struct btrfs_root *root,
+				  const struct update_entry *entry,
+				  const struct stat *st, const char *path)
+{
+	struct btrfs_inode_item inode_item;
+	int ret;
+
+	if (entry->type != ftype_to_btrfs_type(st->st_mode))
+		return 0;
+	/* Updated in place */
+	if (S_ISDIR(st->st_mode))
+		return 1;
+	if (st->st_nlink > 1)
+		return 0;
+
+	ret = read_inode_item(root, &inode_item, entry->ino);
+	if (ret < 0)
+		return ret;
+	if (btrfs_stack_inode_nlink(&inode_item) != 1 ||
+	    btrfs_stack_inode_mode(&inode_item) != st->st_mode ||
+	    btrfs_stack_inode_uid(&inode_item) != st->st_uid ||
+	    btrfs_stack_inode_gid(&inode_item) != st->st_gid ||
+	    btrfs_stack_inode_size(&inode_item) != st->st_size ||
+	    btrfs_stack_timespec_sec(&inode_item.mtime) != st->st_mtime ||
+	    btrfs_stack_timespec_nsec(&inode_item.mtime) != st->st_mtim.tv_nsec ||
+	    btrfs_stack_timespec_sec(&inode_item.ctime) != st->st_ctime ||
+	    btrfs_stack_timespec_nsec(&inode_item.ctime) != st->st_ctim.tv_nsec)
+		return 0;
+
+	ret = xattrs_changed(root, entry->ino, path);
+	if (ret < 0)
+		return ret;
+	return !ret;
+}
+
+/* Update the inode item and the xattrs of a kept directory */
+static int update_dir_inode(struct btrfs_root *root, u64 ino,
+			    const struct stat *st, const char *path)
+{
+	struct btrfs_inode_item inode_item;
+	struct btrfs_inode_item old;
+	int ret;
+
+	ret = read_inode_item(root, &inode_item, ino);
+	if (ret < 0)
+		return ret;
+	old = inode_item;
+	btrfs_set_stack_inode_uid(&inode_item, st->st_uid);
+	btrfs_set_stack_inode_gid(&inode_item, st->st_gid);
+	btrfs_set_stack_inode_mode(&inode_item, st->st_mode);
+	btrfs_set_stack_timespec_sec(&inode_item.ctime, st->st_ctime);
+	btrfs_set_stack_timespec_nsec(&inode_item.ctime, st->st_ctim.tv_nsec);
+	btrfs_set_stack_timespec_sec(&inode_item.mtime, st->st_mtime);
+	btrfs_set_stack_timespec_nsec(&inode_item.mtime, st->st_mtim.tv_nsec);
+	if (memcmp(&old, &inode_item, sizeof(old))) {
+		ret = update_inode_item(g_trans, root, &inode_item, ino);
+		if (ret < 0)
+			return ret;
+	}
+
+	ret = xattrs_changed(root, ino, path);
+	if (ret <= 0)
+		return ret;
+	ret = delete_inode_items(root, ino, BTRFS_XATTR_ITEM_KEY);
+	if (ret < 0)
+		return ret;
+	return add_xattr_item(g_trans, root, ino, path);
+}
+
+/*
+ * Update the directory @dir_ino at @level from walk->path, the path stack
+ * has its parents and itself.
+ */
+static int update_dir(struct btrfs_root *root, u64 dir_ino,
+		      const struct stat *st, struct rootdir_walk *walk,
+		      int level)
+{
+	struct rootdir_dirent *dirents = NULL;
+	struct update_entry *entries = NULL;
+	struct update_entry **found = NULL;
+	const int len = strlen(walk->path);
+	int nr_dirents = 0;
+	int nr_entries = 0;
+	int dirfd;
+	int ret;
+
+	dirfd = open(walk->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (dirfd < 0) {
+		ret = -errno;
+		error("cannot open directory %s: %m", walk->path);
+		return ret;
+	}
+	ret = walk_read_dir(walk, dirfd, &dirents, &nr_dirents);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot read directory %s: %m", walk->path);
+		return ret;
+	}
+	ret = read_update_entries(root, dir_ino, &entries, &nr_entries);
+	if (ret < 0)
+		goto out;
+	qsort(entries, nr_entries, sizeof(*entries), cmp_update_entry);
+	found = calloc(nr_dirents, sizeof(*found));
+	if (nr_dirents && !found) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* The entries of the image to keep, of the source to add */
+	for (int i = 0; i < nr_dirents; i++) {
+		struct update_entry key = { .name = dirents[i].name };
+		struct update_entry *entry;
+
+		entry = bsearch(&key, entries, nr_entries, sizeof(*entries),
+				cmp_update_entry);
+		if (!entry || dirents[i].typeflag == FTW_NS)
+			continue;
+		ret = walk_path_append(walk, dirents[i].name);
+		if (ret < 0) {
+			walk->path[len] = 0;
+			goto out;
+		}
+		ret = update_entry_unchanged(root, entry, &dirents[i].st,
+					     walk->path);
+		walk->path[len] = 0;
+		if (ret < 0)
+			goto out;
+		if (ret) {
+			entry->keep = true;
+			found[i] = entry;
+		}
+	}
+	for (int i = 0; i < nr_entries; i++) {
+		if (entries[i].keep)
+			continue;
+		ret = remove_update_entry(root, dir_ino, &entries[i]);
+		if (ret < 0)
+			goto out;
+	}
+
+	/* In the order of the source like btrfs_mkfs_fill_dir() */
+	for (int i = 0; i < nr_dirents; i++) {
+		struct rootdir_dirent *dirent = &dirents[i];
+		int base;
+
+		if (found[i] && !S_ISDIR(dirent->st.st_mode))
+			continue;
+		base = walk_path_append(walk, dirent->name);
+		if (base < 0) {
+			walk->path[len] = 0;
+			ret = base;
+			goto out;
+		}
+
+		if (found[i]) {
+			ret = rootdir_path_push(&current_path, root,
+						found[i]->ino);
+			if (ret == 0) {
+				ret = update_dir(root, found[i]->ino,
+						 &dirent->st, walk, level + 1);
+				rootdir_path_pop(&current_path);
+			}
+		} else if (dirent->typeflag == FTW_D) {
+			g_update_level = level + 1;
+			ret = walk_rootdir(walk->path, ftw_update_add);
+			while (current_path.level > level + 1)
+				rootdir_path_pop(&current_path);
+		} else {
+			struct FTW ftw = { .base = base, .level = level + 1 };
+
+			ret = ftw_add_inode(walk->path, &dirent->st,
+					    dirent->typeflag, &ftw);
+		}
+		walk->path[len] = 0;
+		if (ret)
+			goto out;
+	}
+
+	ret = update_dir_inode(root, dir_ino, st, walk->path);
+out:
+	for (int i = 0; i < nr_dirents; i++)
+		free(dirents[i].name);
+	free(dirents);
+	free_update_entries(entries, nr_entries);
+	free(found);
+	return ret;
+}
+
+int btrfs_mkfs_update_dir(struct btrfs_trans_handle *trans,
+			  const char *source_dir, struct btrfs_root *root,
+			  struct list_head *inode_flags_list,
+			  enum btrfs_compression_type compression,
+			  unsigned int compression_level, bool dedupe)
+{
+	LIST_HEAD(subvols);
+	struct rootdir_walk *walk;
+	struct stat root_st;
+	u64 root_ino = btrfs_root_dirid(&root->root_item);
+	int ret;
+
+	ret = lstat(source_dir, &root_st);
+	if (ret) {
+		error("unable to lstat %s: %m", source_dir);
+		return -errno;
+	}
+	if (!S_ISDIR(root_st.st_mode)) {
+		error("%s is not a directory", source_dir);
+		return -ENOTDIR;
+	}
+	if (strlen(source_dir) >= PATH_MAX)
+		return -ENAMETOOLONG;
+
+	ret = rootdir_fill_init(trans, &subvols, inode_flags_list, compression,
+				compression_level, dedupe);
+	if (ret < 0)
+		return ret;
+
+	walk = calloc(1, sizeof(*walk));
+	if (!walk)
+		return -ENOMEM;
+	strcpy(walk->path, source_dir);
+	walk->use_ring = (io_ring_init(&walk->ring, ROOTDIR_WALK_BATCH) == 0);
+
+	ret = rootdir_path_push(&current_path, root, root_ino);
+	if (ret == 0)
+		ret = update_dir(root, root_ino, &root_st, walk, 0);
+
+	compress_ctx_release(&g_ctx);
+	rb_free_nodes(&dedupe_root, free_one_dedupe_entry);
+	free_hard_links();
+	while (current_path.level > 0)
+		rootdir_path_pop(&current_path);
+	if (walk->use_ring)
+		io_ring_release(&walk->ring);
+	free(walk);
+	if (ret) {
+		error("unable to update from directory %s: %d", source_dir, ret);
+		return ret;
+	}
+	return 0;
+}
+
+/*
+ * Sum up the size and record the entries, btrfs_mkfs_fill_dir() adds them
+ * without walking the directory again.
+ */
 static int ftw_add_entry_size(const char *fpath, const struct stat *st,
 			      int type, struct FTW *ftwbuf)
 {
@@ -1803,7 +3835,7 @@ static int ftw_add_entry_size(const char *fpath, const struct stat *st,
 		ftw_data_size += round_up(st->st_size, fs_block_size);
 	ftw_meta_nr_inode++;
 
-	return 0;
+	return ftw_record_entry(fpath, st, type, ftwbuf);
 }
 
 u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
@@ -1825,16 +3857,20 @@ u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 	fs_block_size = sectorsize;
 	ftw_data_size = 0;
 	ftw_meta_nr_inode = 0;
+	free_entries();
 
 	/*
 	 * Symbolic link is not followed when creating files, so no need to
 	 * follow them here.
 	 */
-	ret = nftw(dir_name, ftw_add_entry_size, 10, FTW_PHYS);
+	ret = walk_rootdir(dir_name, ftw_add_entry_size);
 	if (ret < 0) {
 		error("ftw subdir walk of %s failed: %m", dir_name);
 		exit(1);
 	}
+	g_entries_dir = strdup(dir_name);
+	if (!g_entries_dir)
+		free_entries();
 
 
 	/*
@@ -34,6 +34,9 @@
 #define ZSTD_BTRFS_DEFAULT_LEVEL		3
 #define ZSTD_BTRFS_MAX_LEVEL			15
 
+/* Threads reading and compressing the files of --rootdir */
+#define ROOTDIR_MAX_THREADS			256
+
 struct btrfs_fs_info;
 struct btrfs_root;
 
@@ -63,7 +66,13 @@ int btrfs_mkfs_fill_dir(struct btrfs_trans_handle *trans, const char *source_dir
 			struct btrfs_root *root, struct list_head *subvols,
 			struct list_head *inode_flags_list,
 			enum btrfs_compression_type compression,
-			unsigned int compression_level);
+			unsigned int compression_level, unsigned int nr_threads,
+			bool dedupe);
+int btrfs_mkfs_update_dir(struct btrfs_trans_handle *trans,
+			  const char *source_dir, struct btrfs_root *root,
+			  struct list_head *inode_flags_list,
+			  enum btrfs_compression_type compression,
+			  unsigned int compression_level, bool dedupe);
 u64 btrfs_mkfs_size_dir(const char *dir_name, u32 sectorsize, u64 min_dev_size,
 			u64 meta_profile, u64 data_profile);
 int btrfs_mkfs_shrink_fs(struct btrfs_fs_info *fs_info, u64 *new_size_ret,
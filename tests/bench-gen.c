@@ -0,0 +1,630 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Generate the metadata of a large filesystem for benchmarks, on a device
+ * freshly created by mkfs.btrfs.
+ *
+ * The files are spread over directories in the top subvolume, each file has
+ * a number of data extents.  The items are appended to the fs tree by the
+ * bulk loader in key order, so millions of inodes take seconds.  The data is
+ * only allocated, never written, and the files are NODATASUM so there are no
+ * checksums to match it.  The snapshots share all of the fs tree.
+ */
+
+#include "kerncompat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/uapi/btrfs_tree.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/transaction.h"
+#include "kernel-shared/free-space-tree.h"
+#include "common/messages.h"
+#include "common/string-utils.h"
+#include "common/sort-utils.h"
+#include "common/root-tree-utils.h"
+
+/* Items added in one transaction, bounds the dirty metadata in memory */
+#define GEN_COMMIT_ITEMS	(256 * 1024)
+/* Largest data extent reserved at once and split to the file extents */
+#define GEN_ALLOC_BATCH		(SZ_64M)
+
+struct bench_gen {
+	struct btrfs_fs_info *fs_info;
+	struct btrfs_root *root;
+	struct btrfs_trans_handle *trans;
+	struct btrfs_bulk_loader loader;
+	u64 nr_items;
+
+	u64 nr_files;
+	u64 nr_dirs;
+	u64 files_per_dir;
+	u64 nr_extents;
+	u64 extent_size;
+	u64 fragment;
+	u64 nr_snapshots;
+	time_t now;
+};
+
+/* Entry of a directory, sorted by the name hash for the dir items */
+struct gen_dir_entry {
+	u64 hash;
+	u64 ino;
+};
+
+static u64 first_file_ino(const struct bench_gen *gen)
+{
+	return BTRFS_FIRST_FREE_OBJECTID + 1 + gen->nr_dirs;
+}
+
+static int entry_name(const struct bench_gen *gen, u64 ino, char *name)
+{
+	if (ino < first_file_ino(gen))
+		return sprintf(name, "dir%llu", ino - BTRFS_FIRST_FREE_OBJECTID - 1);
+	return sprintf(name, "file%llu", ino - first_file_ino(gen));
+}
+
+static int gen_start(struct bench_gen *gen)
+{
+	gen->trans = btrfs_start_transaction(gen->root, 1);
+	if (IS_ERR(gen->trans)) {
+		int ret = PTR_ERR(gen->trans);
+
+		errno = -ret;
+		error_msg(ERROR_MSG_START_TRANS, "%m");
+		return ret;
+	}
+	btrfs_bulk_loader_init(&gen->loader, gen->trans, gen->root, 100);
+	gen->nr_items = 0;
+	return 0;
+}
+
+static int gen_commit(struct bench_gen *gen)
+{
+	int ret;
+
+	btrfs_bulk_loader_release(&gen->loader);
+	ret = btrfs_commit_transaction(gen->trans, gen->root);
+	gen->trans = NULL;
+	if (ret < 0) {
+		errno = -ret;
+		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+	}
+	return ret;
+}
+
+/* Append one item to the fs tree, committing once in a while */
+static int gen_add(struct bench_gen *gen, u64 objectid, u8 type, u64 offset,
+		   const void *data, u32 size)
+{
+	struct btrfs_key key = {
+		.objectid = objectid,
+		.type = type,
+		.offset = offset,
+	};
+	int ret;
+
+	ret = btrfs_bulk_loader_add(&gen->loader, &key, data, size);
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot add item (%llu %u %llu): %m", objectid, type, offset);
+		return ret;
+	}
+	if (++gen->nr_items < GEN_COMMIT_ITEMS)
+		return 0;
+	ret = gen_commit(gen);
+	if (ret < 0)
+		return ret;
+	return gen_start(gen);
+}
+
+static int gen_add_inode(struct bench_gen *gen, u64 ino, u32 mode, u64 size,
+			 u64 nbytes, u64 flags)
+{
+	struct btrfs_inode_item ii = { 0 };
+
+	btrfs_set_stack_inode_generation(&ii, gen->trans->transid);
+	btrfs_set_stack_inode_transid(&ii, gen->trans->transid);
+	btrfs_set_stack_inode_size(&ii, size);
+	btrfs_set_stack_inode_nbytes(&ii, nbytes);
+	btrfs_set_stack_inode_nlink(&ii, 1);
+	btrfs_set_stack_inode_mode(&ii, mode);
+	btrfs_set_stack_inode_flags(&ii, flags);
+	btrfs_set_stack_timespec_sec(&ii.atime, gen->now);
+	btrfs_set_stack_timespec_sec(&ii.ctime, gen->now);
+	btrfs_set_stack_timespec_sec(&ii.mtime, gen->now);
+	btrfs_set_stack_timespec_sec(&ii.otime, gen->now);
+	return gen_add(gen, ino, BTRFS_INODE_ITEM_KEY, 0, &ii, sizeof(ii));
+}
+
+static int gen_add_inode_ref(struct bench_gen *gen, u64 ino, u64 parent,
+			     u64 index)
+{
+	char buf[sizeof(struct btrfs_inode_ref) + BTRFS_NAME_LEN];
+	struct btrfs_inode_ref *ref = (struct btrfs_inode_ref *)buf;
+	int len;
+
+	len = entry_name(gen, ino, buf + sizeof(*ref));
+	btrfs_set_stack_inode_ref_name_len(ref, len);
+	btrfs_set_stack_inode_ref_index(ref, index);
+	return gen_add(gen, ino, BTRFS_INODE_REF_KEY, parent, buf,
+		       sizeof(*ref) + len);
+}
+
+/* Fill one dir item of @ino at @buf, return its size */
+static u32 fill_dir_item(struct bench_gen *gen, u64 ino, char *buf)
+{
+	struct btrfs_dir_item *di = (struct btrfs_dir_item *)buf;
+	struct btrfs_key location = {
+		.objectid = ino,
+		.type = BTRFS_INODE_ITEM_KEY,
+	};
+	int len;
+
+	memset(di, 0, sizeof(*di));
+	len = entry_name(gen, ino, buf + sizeof(*di));
+	btrfs_cpu_key_to_disk(&di->location, &location);
+	btrfs_set_stack_dir_transid(di, gen->trans->transid);
+	btrfs_set_stack_dir_name_len(di, len);
+	btrfs_set_stack_dir_flags(di, ino < first_file_ino(gen) ?
+				  BTRFS_FT_DIR : BTRFS_FT_REG_FILE);
+	return sizeof(*di) + len;
+}
+
+/*
+ * Add the dir items and dir indexes of directory @dir with the inodes from
+ * @first to @first + @nr - 1, indexed from 2 in this order.
+ */
+static int gen_add_dir_entries(struct bench_gen *gen, u64 dir, u64 first, u64 nr)
+{
+	struct gen_dir_entry *entries;
+	char buf[4096];
+	int ret = 0;
+
+	entries = malloc(nr * sizeof(*entries));
+	if (!entries) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	for (u64 i = 0; i < nr; i++) {
+		char name[BTRFS_NAME_LEN];
+		int len = entry_name(gen, first + i, name);
+
+		entries[i].hash = btrfs_name_hash(name, len);
+		entries[i].ino = first + i;
+	}
+	radix_sort_u64(entries, nr, sizeof(*entries),
+		       offsetof(struct gen_dir_entry, hash));
+
+	for (u64 i = 0; i < nr && !ret; ) {
+		u32 size = 0;
+		u64 hash = entries[i].hash;
+
+		/* Names with the same hash share the item */
+		for (; i < nr && entries[i].hash == hash; i++) {
+			if (size + sizeof(struct btrfs_dir_item) + BTRFS_NAME_LEN > sizeof(buf)) {
+				error("too many names with hash %llu", hash);
+				ret = -EOVERFLOW;
+				break;
+			}
+			size += fill_dir_item(gen, entries[i].ino, buf + size);
+		}
+		if (!ret)
+			ret = gen_add(gen, dir, BTRFS_DIR_ITEM_KEY, hash, buf, size);
+	}
+	for (u64 i = 0; i < nr && !ret; i++)
+		ret = gen_add(gen, dir, BTRFS_DIR_INDEX_KEY, 2 + i, buf,
+			      fill_dir_item(gen, first + i, buf));
+	free(entries);
+	return ret;
+}
+
+static u64 dir_size(struct bench_gen *gen, u64 first, u64 nr)
+{
+	char name[BTRFS_NAME_LEN];
+	u64 size = 0;
+
+	for (u64 i = 0; i < nr; i++)
+		size += 2 * entry_name(gen, first + i, name);
+	return size;
+}
+
+static u64 dir_nr_files(const struct bench_gen *gen, u64 dir_nr)
+{
+	u64 first = dir_nr * gen->files_per_dir;
+
+	if (first >= gen->nr_files)
+		return 0;
+	return min(gen->files_per_dir, gen->nr_files - first);
+}
+
+static int gen_dirs(struct bench_gen *gen)
+{
+	const u64 top = BTRFS_FIRST_FREE_OBJECTID;
+	int ret;
+
+	ret = gen_add_dir_entries(gen, top, top + 1, gen->nr_dirs);
+	for (u64 d = 0; d < gen->nr_dirs && !ret; d++) {
+		const u64 ino = top + 1 + d;
+		const u64 first = first_file_ino(gen) + d * gen->files_per_dir;
+		const u64 nr = dir_nr_files(gen, d);
+
+		ret = gen_add_inode(gen, ino, S_IFDIR | 0755,
+				    dir_size(gen, first, nr), 0, 0);
+		if (!ret)
+			ret = gen_add_inode_ref(gen, ino, top, 2 + d);
+		if (!ret)
+			ret = gen_add_dir_entries(gen, ino, first, nr);
+	}
+	return ret;
+}
+
+/* Data extent item with the reference of file @ino at @offset */
+static int insert_data_extent(struct bench_gen *gen, u64 bytenr, u64 ino,
+			      u64 offset)
+{
+	struct btrfs_root *extent_root = btrfs_extent_root(gen->fs_info, bytenr);
+	struct btrfs_path path = { 0 };
+	struct btrfs_extent_item *ei;
+	struct btrfs_extent_inline_ref *iref;
+	struct btrfs_extent_data_ref *dref;
+	struct extent_buffer *leaf;
+	struct btrfs_key key = {
+		.objectid = bytenr,
+		.type = BTRFS_EXTENT_ITEM_KEY,
+		.offset = gen->extent_size,
+	};
+	int ret;
+
+	ret = btrfs_insert_empty_item(gen->trans, extent_root, &path, &key,
+			sizeof(*ei) + btrfs_extent_inline_ref_size(BTRFS_EXTENT_DATA_REF_KEY));
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot insert data extent %llu: %m", bytenr);
+		return ret;
+	}
+	leaf = path.nodes[0];
+	ei = btrfs_item_ptr(leaf, path.slots[0], struct btrfs_extent_item);
+	btrfs_set_extent_refs(leaf, ei, 1);
+	btrfs_set_extent_generation(leaf, ei, gen->trans->transid);
+	btrfs_set_extent_flags(leaf, ei, BTRFS_EXTENT_FLAG_DATA);
+	iref = (struct btrfs_extent_inline_ref *)(ei + 1);
+	btrfs_set_extent_inline_ref_type(leaf, iref, BTRFS_EXTENT_DATA_REF_KEY);
+	dref = (struct btrfs_extent_data_ref *)(&iref->offset);
+	btrfs_set_extent_data_ref_root(leaf, dref, BTRFS_FS_TREE_OBJECTID);
+	btrfs_set_extent_data_ref_objectid(leaf, dref, ino);
+	btrfs_set_extent_data_ref_offset(leaf, dref, offset);
+	btrfs_set_extent_data_ref_count(leaf, dref, 1);
+	btrfs_mark_buffer_dirty(leaf);
+	btrfs_release_path(&path);
+	gen->nr_items++;
+	return 0;
+}
+
+/*
+ * Allocate the extents of @nr files from file number @first.  With
+ * fragmentation the extents of the files are interleaved on disk, so each
+ * file is in as many pieces as it has extents.
+ */
+static int gen_alloc_extents(struct bench_gen *gen, u64 first, u64 nr,
+			     u64 *bytenrs)
+{
+	const u64 total = nr * gen->nr_extents;
+	const u64 per_batch = max(GEN_ALLOC_BATCH / gen->extent_size, 1ULL);
+	u64 pos = 0;
+	int ret;
+
+	while (pos < total) {
+		const u64 count = min(total - pos, per_batch);
+		struct btrfs_key ins;
+
+		ret = btrfs_reserve_extent(gen->trans, gen->root,
+					   count * gen->extent_size, 0, 0,
+					   (u64)-1, &ins, true);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot allocate data: %m");
+			return ret;
+		}
+		for (u64 i = 0; i < count; i++, pos++) {
+			const u64 file = pos % nr;
+			const u64 extent = pos / nr;
+			const u64 bytenr = ins.objectid + i * gen->extent_size;
+
+			bytenrs[file * gen->nr_extents + extent] = bytenr;
+			ret = insert_data_extent(gen, bytenr,
+						 first_file_ino(gen) + first + file,
+						 extent * gen->extent_size);
+			if (ret < 0)
+				return ret;
+		}
+		ret = btrfs_update_block_group(gen->trans, ins.objectid,
+					       ins.offset, 1, 0);
+		if (!ret)
+			ret = remove_from_free_space_tree(gen->trans, ins.objectid,
+							  ins.offset);
+		if (ret < 0) {
+			errno = -ret;
+			error("cannot account data at %llu: %m", ins.objectid);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+static int gen_files(struct bench_gen *gen)
+{
+	const u64 file_size = gen->nr_extents * gen->extent_size;
+	struct btrfs_file_extent_item fi = { 0 };
+	u64 *bytenrs;
+	int ret = 0;
+
+	bytenrs = calloc(gen->fragment * max(gen->nr_extents, 1ULL), sizeof(u64));
+	if (!bytenrs) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return -ENOMEM;
+	}
+	btrfs_set_stack_file_extent_type(&fi, BTRFS_FILE_EXTENT_REG);
+	btrfs_set_stack_file_extent_num_bytes(&fi, gen->extent_size);
+	btrfs_set_stack_file_extent_ram_bytes(&fi, gen->extent_size);
+	btrfs_set_stack_file_extent_disk_num_bytes(&fi, gen->extent_size);
+
+	for (u64 first = 0; first < gen->nr_files && !ret; first += gen->fragment) {
+		const u64 nr = min(gen->fragment, gen->nr_files - first);
+
+		if (gen->nr_extents)
+			ret = gen_alloc_extents(gen, first, nr, bytenrs);
+		for (u64 i = 0; i < nr && !ret; i++) {
+			const u64 file = first + i;
+			const u64 ino = first_file_ino(gen) + file;
+			const u64 dir = BTRFS_FIRST_FREE_OBJECTID + 1 +
+					file / gen->files_per_dir;
+
+			ret = gen_add_inode(gen, ino, S_IFREG | 0644, file_size,
+					    file_size, BTRFS_INODE_NODATASUM);
+			if (!ret)
+				ret = gen_add_inode_ref(gen, ino, dir,
+						2 + file % gen->files_per_dir);
+			btrfs_set_stack_file_extent_generation(&fi,
+						gen->trans->transid);
+			for (u64 e = 0; e < gen->nr_extents && !ret; e++) {
+				btrfs_set_stack_file_extent_disk_bytenr(&fi,
+						bytenrs[i * gen->nr_extents + e]);
+				ret = gen_add(gen, ino, BTRFS_EXTENT_DATA_KEY,
+					      e * gen->extent_size, &fi, sizeof(fi));
+			}
+		}
+	}
+	free(bytenrs);
+	return ret;
+}
+
+/* Size of the top directory is updated after its entries are added */
+static int update_top_dir(struct bench_gen *gen)
+{
+	struct btrfs_path path = { 0 };
+	struct btrfs_inode_item *ii;
+	struct btrfs_key key = {
+		.objectid = BTRFS_FIRST_FREE_OBJECTID,
+		.type = BTRFS_INODE_ITEM_KEY,
+	};
+	int ret;
+
+	btrfs_bulk_loader_release(&gen->loader);
+	ret = btrfs_search_slot(gen->trans, gen->root, &key, &path, 0, 1);
+	if (ret > 0)
+		ret = -ENOENT;
+	if (ret < 0) {
+		errno = -ret;
+		error("cannot find the top directory: %m");
+		return ret;
+	}
+	ii = btrfs_item_ptr(path.nodes[0], path.slots[0], struct btrfs_inode_item);
+	btrfs_set_inode_size(path.nodes[0], ii,
+			     btrfs_inode_size(path.nodes[0], ii) +
+			     dir_size(gen, BTRFS_FIRST_FREE_OBJECTID + 1, gen->nr_dirs));
+	btrfs_mark_buffer_dirty(path.nodes[0]);
+	btrfs_release_path(&path);
+	return 0;
+}
+
+/*
+ * Snapshot the top subvolume like the kernel does, a copy of its root node
+ * with a reference to each child.  All copies are made before the snapshots
+ * are linked in the top directory, so none contains another.
+ */
+static int gen_snapshots(struct bench_gen *gen)
+{
+	struct btrfs_fs_info *fs_info = gen->fs_info;
+	struct btrfs_root *root = gen->root;
+	struct btrfs_trans_handle *trans;
+	int ret;
+
+	ret = gen_start(gen);
+	if (ret < 0)
+		return ret;
+	trans = gen->trans;
+	for (u64 i = 0; i < gen->nr_snapshots; i++) {
+		struct btrfs_root_item item;
+		struct extent_buffer *node;
+		struct btrfs_key key = {
+			.objectid = BTRFS_FIRST_FREE_OBJECTID + i,
+			.type = BTRFS_ROOT_ITEM_KEY,
+			.offset = trans->transid,
+		};
+
+		ret = btrfs_copy_root(trans, root, root->node, &node, key.objectid);
+		if (ret < 0)
+			goto error;
+		memcpy(&item, &root->root_item, sizeof(item));
+		btrfs_set_root_bytenr(&item, node->start);
+		btrfs_set_root_level(&item, btrfs_header_level(node));
+		btrfs_set_root_generation(&item, trans->transid);
+		btrfs_set_root_generation_v2(&item, trans->transid);
+		btrfs_set_root_otransid(&item, trans->transid);
+		btrfs_set_root_refs(&item, 1);
+		memcpy(item.parent_uuid, root->root_item.uuid, BTRFS_UUID_SIZE);
+		memset(item.uuid, 0, BTRFS_UUID_SIZE);
+		free_extent_buffer(node);
+		ret = btrfs_insert_root(trans, fs_info->tree_root, &key, &item);
+		if (ret < 0)
+			goto error;
+	}
+	btrfs_set_root_last_snapshot(&root->root_item, trans->transid);
+
+	for (u64 i = 0; i < gen->nr_snapshots; i++) {
+		struct btrfs_root *snap;
+		struct btrfs_key key = {
+			.objectid = BTRFS_FIRST_FREE_OBJECTID + i,
+			.type = BTRFS_ROOT_ITEM_KEY,
+			.offset = (u64)-1,
+		};
+		char name[BTRFS_NAME_LEN];
+		int len;
+
+		snap = btrfs_read_fs_root(fs_info, &key);
+		if (IS_ERR(snap)) {
+			ret = PTR_ERR(snap);
+			goto error;
+		}
+		len = sprintf(name, "snap%llu", i);
+		ret = btrfs_link_subvolume(trans, root, BTRFS_FIRST_FREE_OBJECTID,
+					   name, len, snap);
+		if (ret < 0)
+			goto error;
+	}
+	return gen_commit(gen);
+error:
+	errno = -ret;
+	error("cannot create the snapshots: %m");
+	return ret;
+}
+
+__attribute__((noreturn))
+static void print_usage(int ret)
+{
+	printf("usage: bench-gen [options] <device>\n");
+	printf("Fill a filesystem freshly created by mkfs.btrfs with generated files\n\n");
+	printf("  -n|--files <N>          number of files (default: 100000)\n");
+	printf("  -d|--dirs <N>           number of directories with the files (default: 100)\n");
+	printf("  -e|--extents <N>        data extents of each file (default: 1)\n");
+	printf("  -s|--extent-size <SIZE> size of each extent (default: sectorsize)\n");
+	printf("  -f|--fragment <N>       interleave the extents of N files on disk (default: 1)\n");
+	printf("  -S|--snapshots <N>      snapshots of the top subvolume (default: 0)\n");
+	exit(ret);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_gen gen = {
+		.nr_files = 100000,
+		.nr_dirs = 100,
+		.nr_extents = 1,
+		.fragment = 1,
+	};
+	struct btrfs_root *root;
+	int ret;
+
+	while (1) {
+		static const struct option long_options[] = {
+			{ "files", required_argument, NULL, 'n' },
+			{ "dirs", required_argument, NULL, 'd' },
+			{ "extents", required_argument, NULL, 'e' },
+			{ "extent-size", required_argument, NULL, 's' },
+			{ "fragment", required_argument, NULL, 'f' },
+			{ "snapshots", required_argument, NULL, 'S' },
+			{ "help", no_argument, NULL, 'h' },
+			{ NULL, 0, NULL, 0 }
+		};
+		int c = getopt_long(argc, argv, "n:d:e:s:f:S:h", long_options, NULL);
+
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'n':
+			gen.nr_files = arg_strtou64(optarg);
+			break;
+		case 'd':
+			gen.nr_dirs = max(arg_strtou64(optarg), 1ULL);
+			break;
+		case 'e':
+			gen.nr_extents = arg_strtou64(optarg);
+			break;
+		case 's':
+			gen.extent_size = arg_strtou64_with_suffix(optarg);
+			break;
+		case 'f':
+			gen.fragment = max(arg_strtou64(optarg), 1ULL);
+			break;
+		case 'S':
+			gen.nr_snapshots = arg_strtou64(optarg);
+			break;
+		case 'h':
+			print_usage(0);
+		default:
+			print_usage(1);
+		}
+	}
+	if (optind + 1 != argc)
+		print_usage(1);
+
+	root = open_ctree(argv[optind], 0, OPEN_CTREE_WRITES);
+	if (!root) {
+		error("cannot open %s", argv[optind]);
+		return 1;
+	}
+	gen.fs_info = root->fs_info;
+	gen.root = gen.fs_info->fs_root;
+	if (!gen.extent_size)
+		gen.extent_size = gen.fs_info->sectorsize;
+	if (!IS_ALIGNED(gen.extent_size, gen.fs_info->sectorsize) ||
+	    gen.extent_size > BTRFS_MAX_EXTENT_SIZE) {
+		error("invalid extent size %llu", gen.extent_size);
+		ret = -EINVAL;
+		goto out;
+	}
+	gen.files_per_dir = max(DIV_ROUND_UP(gen.nr_files, gen.nr_dirs), 1ULL);
+	gen.now = time(NULL);
+
+	ret = gen_start(&gen);
+	if (!ret)
+		ret = gen_dirs(&gen);
+	if (!ret)
+		ret = gen_files(&gen);
+	if (!ret)
+		ret = update_top_dir(&gen);
+	if (!ret)
+		ret = gen_commit(&gen);
+	if (!ret && gen.nr_snapshots)
+		ret = gen_snapshots(&gen);
+	if (!ret)
+		ret = btrfs_rebuild_uuid_tree(gen.fs_info);
+	if (!ret)
+		printf("%llu files in %llu directories, %llu extents of %llu bytes, %llu snapshots\n",
+		       gen.nr_files, gen.nr_dirs, gen.nr_files * gen.nr_extents,
+		       gen.extent_size, gen.nr_snapshots);
+out:
+	if (ret && gen.trans)
+		btrfs_abort_transaction(gen.trans, ret);
+	ret = close_ctree(root) ?: ret;
+	return !!ret;
+}
@@ -0,0 +1,596 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * Micro benchmark of the data structures on the hot paths of the tools
+ *
+ * Each group runs its operations in a loop and reports the number of
+ * operations per second, the time and cache misses per operation.  The
+ * structures are filled in a scrambled order of the keys, the same for each
+ * run, so the results of two builds can be compared.  The tree operations
+ * need a scratch filesystem image, the items are inserted into the fs tree
+ * and deleted again.
+ */
+
+#include "kerncompat.h"
+#include <time.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#if HAVE_LINUX_PERF_EVENT_H == 1 && HAVE_LINUX_HW_BREAKPOINT_H == 1
+#include <linux/perf_event.h>
+#include <linux/hw_breakpoint.h>
+#include <sys/syscall.h>
+#define HAVE_PERF
+#endif
+#include "kernel-lib/raid56.h"
+#include "kernel-lib/sizes.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/transaction.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/extent-io-tree.h"
+#include "kernel-shared/ulist.h"
+#include "kernel-shared/volumes.h"
+#include "common/extent-cache.h"
+#include "common/fsfeatures.h"
+#include "common/messages.h"
+#include "common/cpu-utils.h"
+#include "common/utils.h"
+#include "common/string-utils.h"
+#include "common/format-output.h"
+#include "common/help.h"
+#include "crypto/hash.h"
+#include "cmds/commands.h"
+
+/* Objectid of the items inserted by the tree benchmarks */
+#define BENCH_OBJECTID		(BTRFS_LAST_FREE_OBJECTID - 1)
+#define BENCH_ITEM_SIZE		(32)
+/* Extent buffers allocated again and again by the cache hit benchmark */
+#define BENCH_EB_HOT		(1024)
+#define RAID6_DISKS		(8)
+
+struct bench {
+	const char *image;
+	u64 ops;
+	u64 *keys;
+	struct format_ctx fctx;
+	bool json;
+	/* Measurement in progress */
+	u64 start;
+	long long start_misses;
+};
+
+static int perf_fd = -1;
+
+#ifdef HAVE_PERF
+
+static int perf_init(void)
+{
+	static struct perf_event_attr attr = {
+		.type = PERF_TYPE_HARDWARE,
+		.config = PERF_COUNT_HW_CACHE_MISSES,
+		.exclude_kernel = 1,
+		.exclude_hv = 1,
+	};
+
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	return perf_fd;
+}
+
+static long long perf_cache_misses(void)
+{
+	long long misses;
+	int ret;
+
+	if (perf_fd < 0)
+		return 0;
+	ret = read(perf_fd, &misses, sizeof(misses));
+	if (ret != sizeof(misses))
+		return 0;
+	return misses;
+}
+
+#else
+static int perf_init(void)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+static long long perf_cache_misses(void) {
+	return 0;
+}
+#endif
+
+static inline u64 get_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+/*
+ * Distinct keys in a scrambled order, multiplication by an odd constant is a
+ * bijection on 32 bits.
+ */
+static u64 *bench_keys(u64 ops)
+{
+	u64 *keys;
+
+	keys = malloc(ops * sizeof(*keys));
+	if (!keys)
+		return NULL;
+	for (u64 i = 0; i < ops; i++)
+		keys[i] = (u32)((i + 1) * 2654435761U);
+	return keys;
+}
+
+static void bench_start(struct bench *b)
+{
+	b->start_misses = perf_cache_misses();
+	b->start = get_time();
+}
+
+static void bench_stop(struct bench *b, const char *name, u64 ops)
+{
+	const u64 time = max_t(u64, get_time() - b->start, 1);
+	const u64 misses = perf_cache_misses() - b->start_misses;
+	const u64 ops_per_sec = (double)ops * 1000000000 / time;
+	const double ns_per_op = (double)time / max_t(u64, ops, 1);
+	const double misses_per_op = (double)misses / max_t(u64, ops, 1);
+
+	if (b->json) {
+		fmt_print_start_group(&b->fctx, NULL, JSON_TYPE_MAP);
+		fmt_print(&b->fctx, "name", name);
+		fmt_print(&b->fctx, "ops", ops);
+		fmt_print(&b->fctx, "time", time);
+		fmt_print(&b->fctx, "ops-per-sec", ops_per_sec);
+		fmt_print(&b->fctx, "ns-per-op", ns_per_op);
+		fmt_print(&b->fctx, "cache-misses", misses);
+		fmt_print(&b->fctx, "cache-misses-per-op", misses_per_op);
+		fmt_print_end_group(&b->fctx, NULL);
+		return;
+	}
+	printf("%20s: %12llu ops/s %10.2f ns/op", name, ops_per_sec, ns_per_op);
+	if (perf_fd >= 0)
+		printf(" %10.2f misses/op", misses_per_op);
+	putchar('\n');
+}
+
+static int bench_cache_tree(struct bench *b)
+{
+	struct cache_tree tree;
+	u64 found = 0;
+	int ret = 0;
+
+	cache_tree_init(&tree);
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		ret = add_cache_extent(&tree, b->keys[i] * SZ_4K, SZ_4K);
+		if (ret < 0)
+			goto out;
+	}
+	bench_stop(b, "cache-tree-insert", b->ops);
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		if (lookup_cache_extent(&tree, b->keys[i] * SZ_4K, 1))
+			found++;
+	}
+	bench_stop(b, "cache-tree-search", b->ops);
+	if (found != b->ops)
+		ret = -ENOENT;
+out:
+	free_extent_cache_tree(&tree);
+	return ret;
+}
+
+static int bench_ulist(struct bench *b)
+{
+	struct ulist *ulist;
+	int ret = 0;
+
+	ulist = ulist_alloc(0);
+	if (!ulist)
+		return -ENOMEM;
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		ret = ulist_add(ulist, b->keys[i], i, 0);
+		if (ret < 0)
+			goto out;
+	}
+	bench_stop(b, "ulist-add", b->ops);
+
+	/* All of them again, nothing is added */
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		ret = ulist_add(ulist, b->keys[i], i, 0);
+		if (ret < 0)
+			goto out;
+	}
+	bench_stop(b, "ulist-add-existing", b->ops);
+	ret = 0;
+out:
+	ulist_free(ulist);
+	return ret;
+}
+
+/*
+ * Every other sector is set so the states are not merged, then they're all
+ * cleared.
+ */
+static int bench_extent_io_tree(struct bench *b, struct btrfs_fs_info *fs_info)
+{
+	struct extent_io_tree tree;
+	int ret = 0;
+
+	extent_io_tree_init(fs_info, &tree, 0);
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		const u64 start = b->keys[i] * 2 * SZ_4K;
+
+		ret = set_extent_dirty(&tree, start, start + SZ_4K - 1, GFP_NOFS);
+		if (ret < 0)
+			goto out;
+	}
+	bench_stop(b, "extent-io-tree-set", b->ops);
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		const u64 start = b->keys[i] * 2 * SZ_4K;
+
+		ret = clear_extent_dirty(&tree, start, start + SZ_4K - 1, NULL);
+		if (ret < 0)
+			goto out;
+	}
+	bench_stop(b, "extent-io-tree-clear", b->ops);
+	ret = 0;
+out:
+	extent_io_tree_release(&tree);
+	return ret;
+}
+
+/*
+ * The miss path allocates and inserts a new buffer, the unreferenced buffers
+ * stay in the cache until it's trimmed.  The hit path allocates the same small
+ * set of buffers again.
+ */
+static int bench_extent_buffer(struct bench *b, struct btrfs_fs_info *fs_info)
+{
+	const u32 nodesize = BTRFS_MKFS_DEFAULT_NODE_SIZE;
+	struct extent_buffer *eb;
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		eb = alloc_extent_buffer(fs_info, b->keys[i] * nodesize, nodesize);
+		if (!eb)
+			return -ENOMEM;
+		free_extent_buffer(eb);
+	}
+	bench_stop(b, "extent-buffer-miss", b->ops);
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		const u64 bytenr = b->keys[i % BENCH_EB_HOT] * nodesize;
+
+		eb = alloc_extent_buffer(fs_info, bytenr, nodesize);
+		if (!eb)
+			return -ENOMEM;
+		free_extent_buffer(eb);
+	}
+	bench_stop(b, "extent-buffer-hit", b->ops);
+	extent_buffer_free_cache(fs_info);
+	extent_buffer_init_cache(fs_info);
+	return 0;
+}
+
+static int bench_csum(struct bench *b)
+{
+	static const struct {
+		const char *name;
+		u16 csum_type;
+	} csums[] = {
+		{ "csum-crc32c", BTRFS_CSUM_TYPE_CRC32 },
+		{ "csum-xxhash", BTRFS_CSUM_TYPE_XXHASH },
+		{ "csum-sha256", BTRFS_CSUM_TYPE_SHA256 },
+		{ "csum-blake2", BTRFS_CSUM_TYPE_BLAKE2 },
+	};
+	u8 out[BTRFS_CSUM_SIZE];
+	u8 *buf;
+
+	buf = malloc(SZ_4K);
+	if (!buf)
+		return -ENOMEM;
+	for (int i = 0; i < SZ_4K; i++)
+		buf[i] = i * 13;
+	for (int c = 0; c < ARRAY_SIZE(csums); c++) {
+		bench_start(b);
+		for (u64 i = 0; i < b->ops; i++)
+			btrfs_csum_data(csums[c].csum_type, buf, out, SZ_4K);
+		bench_stop(b, csums[c].name, b->ops);
+	}
+	free(buf);
+	return 0;
+}
+
+/* One operation is one full stripe of each of the RAID6_DISKS devices */
+static int bench_raid(struct bench *b)
+{
+	void *ptrs[RAID6_DISKS];
+	u8 *buf;
+
+	buf = calloc(RAID6_DISKS, BTRFS_STRIPE_LEN);
+	if (!buf)
+		return -ENOMEM;
+	for (int i = 0; i < RAID6_DISKS; i++)
+		ptrs[i] = buf + i * BTRFS_STRIPE_LEN;
+	for (int i = 0; i < (RAID6_DISKS - 2) * BTRFS_STRIPE_LEN; i++)
+		buf[i] = i * 13;
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++)
+		raid5_gen_result(RAID6_DISKS - 1, BTRFS_STRIPE_LEN, RAID6_DISKS - 2, ptrs);
+	bench_stop(b, "raid5-gen", b->ops);
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++)
+		raid6_gen_syndrome(RAID6_DISKS, BTRFS_STRIPE_LEN, ptrs);
+	bench_stop(b, "raid6-gen", b->ops);
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++)
+		raid6_recov_data2(RAID6_DISKS, BTRFS_STRIPE_LEN, 0, 1,
+				  ptrs);
+	bench_stop(b, "raid6-recov", b->ops);
+
+	free(buf);
+	return 0;
+}
+
+/*
+ * The items are inserted in one transaction, searched in the committed tree and
+ * deleted in another transaction.
+ */
+static int bench_btree(struct bench *b)
+{
+	struct btrfs_root *root;
+	struct btrfs_trans_handle *trans;
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	u8 data[BENCH_ITEM_SIZE] = { 0 };
+	int ret;
+
+	root = open_ctree(b->image, BTRFS_SUPER_INFO_OFFSET, OPEN_CTREE_WRITES);
+	if (!root) {
+		error("cannot open ctree: %s", b->image);
+		return -EIO;
+	}
+	key.objectid = BENCH_OBJECTID;
+	key.type = BTRFS_STRING_ITEM_KEY;
+
+	trans = btrfs_start_transaction(root, 1);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		goto out;
+	}
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		key.offset = b->keys[i];
+		ret = btrfs_insert_item(trans, root, &key, data, sizeof(data));
+		if (ret < 0) {
+			btrfs_abort_transaction(trans, ret);
+			goto out;
+		}
+	}
+	bench_stop(b, "btree-insert", b->ops);
+	ret = btrfs_commit_transaction(trans, root);
+	if (ret < 0)
+		goto out;
+
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		key.offset = b->keys[i];
+		ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
+		btrfs_release_path(&path);
+		if (ret != 0) {
+			ret = ret > 0 ? -ENOENT : ret;
+			goto out;
+		}
+	}
+	bench_stop(b, "btree-search", b->ops);
+
+	trans = btrfs_start_transaction(root, 1);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		goto out;
+	}
+	bench_start(b);
+	for (u64 i = 0; i < b->ops; i++) {
+		key.offset = b->keys[i];
+		ret = btrfs_search_slot(trans, root, &key, &path, -1, 1);
+		if (ret == 0)
+			ret = btrfs_del_item(trans, root, &path);
+		else if (ret > 0)
+			ret = -ENOENT;
+		btrfs_release_path(&path);
+		if (ret < 0) {
+			btrfs_abort_transaction(trans, ret);
+			goto out;
+		}
+	}
+	bench_stop(b, "btree-delete", b->ops);
+	ret = btrfs_commit_transaction(trans, root);
+out:
+	close_ctree(root);
+	return ret;
+}
+
+static const char * const bench_micro_usage[] = {
+	"bench-micro [options] [iterations]",
+	"",
+	"Measure the operations of the core data structures, default iterations 100000.",
+	"The groups: btree cache-tree ulist extent-io-tree extent-buffer csum raid",
+	"",
+	"-f|--filter GLOB     run only the matching groups",
+	"-i|--image FILE      scratch filesystem image for the btree group, its fs tree",
+	"                     is modified, without it the group is skipped",
+	"--json               print the results in json",
+	NULL
+};
+
+static void print_usage(void)
+{
+	for (int i = 0; bench_micro_usage[i]; i++)
+		printf("%s\n", bench_micro_usage[i]);
+}
+
+static const struct rowspec bench_micro_rowspec[] = {
+	{ .key = "iterations", .fmt = "%llu", .out_json = "iterations" },
+	{ .key = "cache-misses-supported", .fmt = "bool",
+	  .out_json = "cache-misses-supported" },
+	{ .key = "name", .fmt = "str", .out_json = "name" },
+	{ .key = "ops", .fmt = "%llu", .out_json = "ops" },
+	{ .key = "time", .fmt = "%llu", .out_json = "time" },
+	{ .key = "ops-per-sec", .fmt = "%llu", .out_json = "ops-per-sec" },
+	{ .key = "ns-per-op", .fmt = "%.2f", .out_json = "ns-per-op" },
+	{ .key = "cache-misses", .fmt = "%llu", .out_json = "cache-misses" },
+	{ .key = "cache-misses-per-op", .fmt = "%.2f",
+	  .out_json = "cache-misses-per-op" },
+	ROWSPEC_END
+};
+
+static bool group_enabled(const char *filter, const char *name)
+{
+	return !filter || fnmatch(filter, name, FNM_CASEFOLD) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	struct bench b = { .ops = 100000 };
+	struct btrfs_fs_info *fs_info;
+	char *filter = NULL;
+	int ret = 0;
+
+	btrfs_config_init();
+	cpu_detect_flags();
+	hash_init_accel();
+	raid6_init_accel();
+
+	optind = 0;
+	while (1) {
+		enum { GETOPT_VAL_JSON = GETOPT_VAL_FIRST };
+		static const struct option long_options[] = {
+			{ "filter", required_argument, NULL, 'f' },
+			{ "image", required_argument, NULL, 'i' },
+			{ "json", no_argument, NULL, GETOPT_VAL_JSON },
+			{ "help", no_argument, NULL, 'h' },
+			{ NULL, 0, NULL, 0 }
+		};
+		int c;
+
+		c = getopt_long(argc, argv, "f:i:h", long_options, NULL);
+		if (c < 0)
+			break;
+		switch (c) {
+		case 'f':
+			free(filter);
+			filter = strdup(optarg);
+			break;
+		case 'i':
+			b.image = optarg;
+			break;
+		case GETOPT_VAL_JSON:
+			b.json = true;
+			break;
+		case 'h':
+			print_usage();
+			return 0;
+		default:
+			print_usage();
+			return 1;
+		}
+	}
+
+	if (argc - optind >= 1) {
+		b.ops = arg_strtou64(argv[optind]);
+		if (b.ops < 1 || b.ops > UINT_MAX) {
+			error("iterations must be from 1 to %u: %s", UINT_MAX,
+			      argv[optind]);
+			return 1;
+		}
+	}
+
+	b.keys = bench_keys(b.ops);
+	fs_info = btrfs_new_fs_info(0, BTRFS_SUPER_INFO_OFFSET);
+	if (!b.keys || !fs_info) {
+		error_msg(ERROR_MSG_MEMORY, NULL);
+		return 1;
+	}
+	if (perf_init() < 0 && !b.json)
+		printf("Cache misses not measured: %m\n");
+
+	if (b.json) {
+		bconf.output_format = CMD_FORMAT_JSON;
+		fmt_start(&b.fctx, bench_micro_rowspec, 0, 0);
+		fmt_print_start_group(&b.fctx, "bench-micro", JSON_TYPE_MAP);
+		fmt_print(&b.fctx, "iterations", b.ops);
+		fmt_print(&b.fctx, "cache-misses-supported", perf_fd >= 0);
+		fmt_print_start_group(&b.fctx, "results", JSON_TYPE_ARRAY);
+	} else {
+		printf("Iterations: %llu\n", b.ops);
+		if (filter)
+			printf("Use filter: %s\n", filter);
+		printf("\n");
+	}
+
+	if (group_enabled(filter, "btree")) {
+		if (b.image)
+			ret = bench_btree(&b);
+		else if (!b.json)
+			printf("%20s: skipped, no image\n", "btree");
+	}
+	if (!ret && group_enabled(filter, "cache-tree"))
+		ret = bench_cache_tree(&b);
+	if (!ret && group_enabled(filter, "ulist"))
+		ret = bench_ulist(&b);
+	if (!ret && group_enabled(filter, "extent-io-tree"))
+		ret = bench_extent_io_tree(&b, fs_info);
+	if (!ret && group_enabled(filter, "extent-buffer"))
+		ret = bench_extent_buffer(&b, fs_info);
+	if (!ret && group_enabled(filter, "csum"))
+		ret = bench_csum(&b);
+	if (!ret && group_enabled(filter, "raid"))
+		ret = bench_raid(&b);
+
+	if (b.json) {
+		fmt_print_end_group(&b.fctx, "results");
+		fmt_print_end_group(&b.fctx, "bench-micro");
+		fmt_end(&b.fctx);
+	}
+	if (ret < 0) {
+		errno = -ret;
+		error("benchmark failed: %m");
+	}
+
+	if (perf_fd >= 0)
+		close(perf_fd);
+	extent_buffer_free_cache(fs_info);
+	btrfs_free_fs_info(fs_info);
+	free(b.keys);
+	free(filter);
+	return !!ret;
+}
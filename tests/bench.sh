@@ -0,0 +1,173 @@
+#!/bin/bash
+#
+# Benchmark the offline tools on a generated metadata heavy filesystem
+#
+# The image is filled by bench-gen and each scenario runs with --stats=json,
+# the results are collected as JSON into bench-results.json.  Parameters are
+# passed by environment variables:
+#
+# BENCH_FILES      number of files (default: 100000)
+# BENCH_DIRS       number of directories with the files (default: 100)
+# BENCH_EXTENTS    data extents of each file (default: 1)
+# BENCH_FRAGMENT   interleave the extents of this many files (default: 1)
+# BENCH_SNAPSHOTS  snapshots of the top subvolume (default: 0)
+# BENCH_SIZE       size of the image (default: 16G, sparse)
+# BENCH_DIR        directory for the images and restored files (default: tests/)
+# BENCH_SEND_STREAM  send stream to parse by receive --dump, skipped if not set
+# BENCH_SKIP       space separated names of scenarios to skip
+
+LANG=C
+SCRIPT_DIR=$(dirname $(readlink -f "$0"))
+if [ -z "$TOP" ]; then
+	TOP=$(readlink -f "$SCRIPT_DIR/../")
+	TEST_TOP="$TOP/tests"
+else
+	TEST_TOP="$SCRIPT_DIR"
+fi
+for prog in btrfs mkfs.btrfs btrfs-image bench-gen; do
+	if ! [ -x "$TOP/$prog" ]; then
+		echo "ERROR: cannot execute $prog from TOP=$TOP"
+		exit 1
+	fi
+done
+if ! type -p jq > /dev/null; then
+	echo "ERROR: jq is needed to collect the results"
+	exit 1
+fi
+
+BENCH_FILES=${BENCH_FILES:-100000}
+BENCH_DIRS=${BENCH_DIRS:-100}
+BENCH_EXTENTS=${BENCH_EXTENTS:-1}
+BENCH_FRAGMENT=${BENCH_FRAGMENT:-1}
+BENCH_SNAPSHOTS=${BENCH_SNAPSHOTS:-0}
+BENCH_SIZE=${BENCH_SIZE:-16G}
+BENCH_DIR=${BENCH_DIR:-$TEST_TOP}
+RESULTS="$TEST_TOP/bench-results.json"
+LOG="$TEST_TOP/bench-results.txt"
+
+IMAGE="$BENCH_DIR/bench.img"
+DUMP="$BENCH_DIR/bench.dump"
+RESTORED_IMAGE="$BENCH_DIR/bench-restored.img"
+RESTORE_DIR="$BENCH_DIR/bench-restore"
+ROOTDIR_IMAGE="$BENCH_DIR/bench-rootdir.img"
+EXT4_IMAGE="$BENCH_DIR/bench-ext4.img"
+STATS="$BENCH_DIR/bench-stats.json"
+
+: > "$LOG"
+RESULT_LIST=()
+
+cleanup()
+{
+	rm -rf -- "$IMAGE" "$DUMP" "$RESTORED_IMAGE" "$RESTORE_DIR" \
+		"$ROOTDIR_IMAGE" "$EXT4_IMAGE" "$STATS"
+}
+trap cleanup EXIT
+
+skipped()
+{
+	[[ " $BENCH_SKIP " == *" $1 "* ]]
+}
+
+# Run scenario $1 as the command with the stats option as $2, rest of the
+# command follows.  The command must print the JSON stats as the last line
+# on stderr.
+run_scenario()
+{
+	local name="$1"
+	local stats_opt="$2"
+	local cmd
+
+	shift 2
+	if skipped "$name"; then
+		echo "    SKIP     $name"
+		return
+	fi
+	echo "    BENCH    $name"
+	echo "=== $name: $*" >> "$LOG"
+	cmd=("$1" "$stats_opt" "${@:2}")
+	if ! "${cmd[@]}" >> "$LOG" 2> "$STATS"; then
+		cat "$STATS" >> "$LOG"
+		echo "ERROR: $name failed, see $LOG"
+		exit 1
+	fi
+	grep -v '^{"stats"' "$STATS" >> "$LOG"
+	RESULT_LIST+=("$(tail -n 1 "$STATS" | jq -c --arg name "$name" \
+		--argjson files "$BENCH_FILES" '.stats |
+		(.wall_time_ns / 1e9) as $sec |
+		([.devices[].read.bytes] | add // 0) as $read |
+		([.devices[].write.bytes] | add // 0) as $written |
+		{
+			name: $name,
+			seconds: $sec,
+			files_per_sec: (if $sec > 0 then $files / $sec else null end),
+			read_bytes_per_sec: (if $sec > 0 then $read / $sec else null end),
+			write_bytes_per_sec: (if $sec > 0 then $written / $sec else null end),
+			peak_rss_bytes: .peak_rss_bytes,
+			read_ops: ([.devices[].read.ops] | add // 0),
+			read_bytes: $read,
+			mapped_bytes: ([.devices[].mapped.bytes] | add // 0),
+			write_ops: ([.devices[].write.ops] | add // 0),
+			write_bytes: $written,
+			stats: .
+		}')")
+}
+
+echo "    GEN      $BENCH_FILES files, $BENCH_EXTENTS extents, fragment $BENCH_FRAGMENT, $BENCH_SNAPSHOTS snapshots"
+cleanup
+mkdir -p "$BENCH_DIR"
+truncate -s "$BENCH_SIZE" "$IMAGE"
+"$TOP/mkfs.btrfs" -f -q "$IMAGE" >> "$LOG" 2>&1 || exit 1
+start=$(date +%s%N)
+"$TOP/bench-gen" --files "$BENCH_FILES" --dirs "$BENCH_DIRS" \
+	--extents "$BENCH_EXTENTS" --fragment "$BENCH_FRAGMENT" \
+	--snapshots "$BENCH_SNAPSHOTS" "$IMAGE" >> "$LOG" 2>&1 || exit 1
+gen_ns=$(( $(date +%s%N) - start ))
+
+run_scenario check --stats=json "$TOP/btrfs" check "$IMAGE"
+run_scenario check-lowmem --stats=json "$TOP/btrfs" check --mode=lowmem "$IMAGE"
+run_scenario tree-stats --stats=json "$TOP/btrfs" inspect-internal tree-stats "$IMAGE"
+run_scenario image-create --stats=json "$TOP/btrfs-image" "$IMAGE" "$DUMP"
+run_scenario image-restore --stats=json "$TOP/btrfs-image" -r "$DUMP" "$RESTORED_IMAGE"
+rm -f -- "$DUMP" "$RESTORED_IMAGE"
+mkdir -p "$RESTORE_DIR"
+run_scenario restore --stats=json "$TOP/btrfs" restore "$IMAGE" "$RESTORE_DIR"
+if ! skipped restore; then
+	truncate -s "$BENCH_SIZE" "$ROOTDIR_IMAGE"
+	run_scenario mkfs-rootdir --stats=json "$TOP/mkfs.btrfs" -f -q \
+		--rootdir "$RESTORE_DIR" "$ROOTDIR_IMAGE"
+	rm -f -- "$ROOTDIR_IMAGE"
+
+	# The ext4 image needs mkfs.ext4 with -d to copy the files
+	if [ -x "$TOP/btrfs-convert" ] &&
+	   "$TOP/btrfs-convert" --help 2>&1 | grep -q 'ext2/3/4: yes' &&
+	   type -p mkfs.ext4 > /dev/null &&
+	   truncate -s "$BENCH_SIZE" "$EXT4_IMAGE" &&
+	   mkfs.ext4 -q -F -d "$RESTORE_DIR" "$EXT4_IMAGE" >> "$LOG" 2>&1; then
+		run_scenario convert --stats=json "$TOP/btrfs-convert" "$EXT4_IMAGE"
+	else
+		echo "    SKIP     convert (needs btrfs-convert with ext4 and mkfs.ext4 -d)"
+	fi
+	rm -f -- "$EXT4_IMAGE"
+fi
+rm -rf -- "$RESTORE_DIR"
+if [ -n "$BENCH_SEND_STREAM" ]; then
+	run_scenario receive --stats=json "$TOP/btrfs" receive --dump -f "$BENCH_SEND_STREAM"
+else
+	echo "    SKIP     receive (set BENCH_SEND_STREAM)"
+fi
+
+printf '%s\n' "${RESULT_LIST[@]}" | jq -s \
+	--argjson files "$BENCH_FILES" --argjson dirs "$BENCH_DIRS" \
+	--argjson extents "$BENCH_EXTENTS" --argjson fragment "$BENCH_FRAGMENT" \
+	--argjson snapshots "$BENCH_SNAPSHOTS" --argjson gen "$gen_ns" '{
+		image: {
+			files: $files,
+			dirs: $dirs,
+			extents_per_file: $extents,
+			fragment: $fragment,
+			snapshots: $snapshots,
+			generate_seconds: ($gen / 1e9)
+		},
+		results: .
+	}' > "$RESULTS"
+echo "    RESULTS  $RESULTS"
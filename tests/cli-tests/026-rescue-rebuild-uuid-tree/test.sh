@@ -0,0 +1,47 @@
+#!/bin/bash
+# Test 'btrfs rescue rebuild-uuid-tree', the rebuilt tree must have the same
+# items as the one created by mkfs, also after it's been cleared
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+tmp=$(_mktemp_dir rescue-rebuild-uuid-tree)
+img=$(_mktemp rescue-rebuild-uuid-tree)
+
+subvols=()
+for i in $(seq 20); do
+	mkdir -p "$tmp/dir/subv$i"
+	echo "$i" > "$tmp/dir/subv$i/file"
+	subvols+=(--subvol "subv$i")
+done
+run_check "$TOP/mkfs.btrfs" -f --rootdir "$tmp/dir" "${subvols[@]}" "$img"
+
+dump_uuid_tree()
+{
+	run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t uuid "$img" |
+		grep -E '^[[:space:]]+(item|subvol_id)' |
+		sed -e 's/itemoff [0-9]*//'
+}
+
+dump_uuid_tree > "$tmp/mkfs"
+if [ $(grep -c UUID_KEY_SUBVOL "$tmp/mkfs") -ne 21 ]; then
+	_fail "unexpected number of uuid items after mkfs"
+fi
+
+run_check "$TOP/btrfs" rescue rebuild-uuid-tree "$img"
+dump_uuid_tree > "$tmp/rebuilt"
+if ! diff -q "$tmp/mkfs" "$tmp/rebuilt" > /dev/null; then
+	_fail "uuid tree differs after rebuild"
+fi
+
+run_check "$TOP/btrfs" rescue clear-uuid-tree "$img"
+run_check "$TOP/btrfs" rescue rebuild-uuid-tree "$img"
+dump_uuid_tree > "$tmp/rebuilt"
+if ! diff -q "$tmp/mkfs" "$tmp/rebuilt" > /dev/null; then
+	_fail "uuid tree differs after clear and rebuild"
+fi
+run_check "$TOP/btrfs" check "$img"
+
+rm -rf -- "$tmp" "$img"
@@ -0,0 +1,35 @@
+#!/bin/bash
+#
+# Repair the wrong link count and size of many inodes with the fixes committed
+# in batches, also when a batch ends in the middle of the inodes
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs
+check_prereq mkfs.btrfs
+check_prereq btrfs-corrupt-block
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir repair-batch)
+
+generate_rootdir_files "$tmp/dir" 100
+
+for mode in original lowmem; do
+	run_check_mkfs_test_dev --rootdir "$tmp/dir"
+	for ino in $(seq 257 2 355); do
+		run_check $SUDO_HELPER "$INTERNAL_BIN/btrfs-corrupt-block" -i "$ino" \
+			-f nlink "$TEST_DEV"
+		run_check $SUDO_HELPER "$INTERNAL_BIN/btrfs-corrupt-block" -i "$((ino + 1))" \
+			-f nbytes "$TEST_DEV"
+	done
+	run_mustfail "corrupted inodes not found" \
+		$SUDO_HELPER "$TOP/btrfs" check --mode "$mode" "$TEST_DEV"
+
+	run_check $SUDO_HELPER "$TOP/btrfs" check --mode "$mode" --repair --force \
+		--repair-batch 16 "$TEST_DEV"
+	run_check $SUDO_HELPER "$TOP/btrfs" check --mode "$mode" "$TEST_DEV"
+done
+
+rm -rf -- "$tmp"
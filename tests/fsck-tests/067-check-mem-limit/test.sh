@@ -0,0 +1,31 @@
+#!/bin/bash
+# Test 'btrfs check --mem-limit', the data extent records spilled to a scratch
+# file and merged back must give the same result as the original mode
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir check-mem-limit)
+
+# Enough data extents to fill the smallest spill buffer several times
+generate_rootdir_files "$tmp/dir" 5000
+run_check_mkfs_test_dev --rootdir "$tmp/dir"
+
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV" | sort > "$tmp/check.out"
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check --mem-limit 1M --tmpdir "$tmp" \
+	"$TEST_DEV" | sort > "$tmp/check-mem-limit.out"
+run_check diff -u "$tmp/check.out" "$tmp/check-mem-limit.out"
+
+run_mustfail "--tmpdir without --mem-limit" \
+	$SUDO_HELPER "$TOP/btrfs" check --tmpdir "$tmp" "$TEST_DEV"
+run_mustfail "--mem-limit in lowmem mode" \
+	$SUDO_HELPER "$TOP/btrfs" check --mem-limit 1M --mode lowmem "$TEST_DEV"
+run_mustfail "--mem-limit with --repair" \
+	$SUDO_HELPER "$TOP/btrfs" check --mem-limit 1M --repair --force "$TEST_DEV"
+
+rm -rf -- "$tmp"
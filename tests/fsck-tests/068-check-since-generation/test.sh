@@ -0,0 +1,34 @@
+#!/bin/bash
+# Test 'btrfs check --since-generation' and '--record-generation', the recorded
+# generation of a clean check must be accepted by the next one
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir check-since-generation)
+
+generate_rootdir_files "$tmp/dir" 100
+run_check_mkfs_test_dev --rootdir "$tmp/dir"
+
+run_check $SUDO_HELPER "$TOP/btrfs" check --mode lowmem \
+	--record-generation "$tmp/gen" "$TEST_DEV"
+generation=$(cat "$tmp/gen")
+run_check $SUDO_HELPER "$TOP/btrfs" check --mode lowmem \
+	--since-generation "$generation" "$TEST_DEV"
+run_check $SUDO_HELPER "$TOP/btrfs" check --mode lowmem --since-generation 1 "$TEST_DEV"
+
+run_mustfail "--since-generation in original mode" \
+	$SUDO_HELPER "$TOP/btrfs" check --since-generation 1 "$TEST_DEV"
+run_mustfail "--since-generation with --repair" \
+	$SUDO_HELPER "$TOP/btrfs" check --since-generation 1 --mode lowmem \
+	--repair --force "$TEST_DEV"
+run_mustfail "--since-generation newer than the filesystem" \
+	$SUDO_HELPER "$TOP/btrfs" check --mode lowmem \
+	--since-generation $((generation + 1)) "$TEST_DEV"
+
+rm -rf -- "$tmp"
@@ -0,0 +1,41 @@
+#!/bin/bash
+# Test 'btrfs check --checkpoint' and '--resume', a saved checkpoint can be
+# resumed from any phase and a finished one is refused
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir check-checkpoint)
+
+generate_rootdir_files "$tmp/dir" 100
+run_check_mkfs_test_dev --rootdir "$tmp/dir"
+
+run_check $SUDO_HELPER "$TOP/btrfs" check --mode lowmem --checkpoint "$tmp/ckpt" "$TEST_DEV"
+run_mustfail "resume of a finished check" \
+	$SUDO_HELPER "$TOP/btrfs" check --mode lowmem --resume "$tmp/ckpt" "$TEST_DEV"
+
+# Rewind the saved phase as if the check was interrupted there
+for phase in 2 3 5 7; do
+	sed -e "s/^phase .*/phase $phase/" "$tmp/ckpt" > "$tmp/ckpt.$phase"
+	run_check $SUDO_HELPER "$TOP/btrfs" check --mode lowmem \
+		--resume "$tmp/ckpt.$phase" "$TEST_DEV"
+done
+
+run_mustfail "--checkpoint in original mode" \
+	$SUDO_HELPER "$TOP/btrfs" check --checkpoint "$tmp/ckpt" "$TEST_DEV"
+run_mustfail "--checkpoint with --repair" \
+	$SUDO_HELPER "$TOP/btrfs" check --mode lowmem --repair --force \
+	--checkpoint "$tmp/ckpt" "$TEST_DEV"
+run_mustfail "--checkpoint and --resume together" \
+	$SUDO_HELPER "$TOP/btrfs" check --mode lowmem --checkpoint "$tmp/ckpt" \
+	--resume "$tmp/ckpt" "$TEST_DEV"
+run_mustfail "--resume with another --since-generation" \
+	$SUDO_HELPER "$TOP/btrfs" check --mode lowmem --since-generation 1 \
+	--resume "$tmp/ckpt.5" "$TEST_DEV"
+
+rm -rf -- "$tmp"
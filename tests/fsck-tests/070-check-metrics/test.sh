@@ -0,0 +1,39 @@
+#!/bin/bash
+# Test 'btrfs check --metrics' and '--progress-fd', a record for each phase
+# and the summary must be written in both modes
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir check-metrics)
+
+generate_rootdir_files "$tmp/dir" 100
+run_check_mkfs_test_dev --rootdir "$tmp/dir"
+
+for mode in original lowmem; do
+	run_check $SUDO_HELPER "$TOP/btrfs" check --mode "$mode" \
+		--metrics "$tmp/metrics" "$TEST_DEV"
+	if ! grep -q '^{"type":"summary","mode":"'"$mode"'","errors":false' "$tmp/metrics"; then
+		_fail "no summary in the metrics of $mode mode"
+	fi
+
+	# Open the descriptor under the root helper, sudo closes the inherited ones
+	run_check $SUDO_HELPER bash -c "exec 3> '$tmp/progress'; exec '$TOP/btrfs' \
+		check --mode $mode --progress-fd 3 '$TEST_DEV'"
+	if [ "$(grep -c '^{"type":"phase"' "$tmp/progress")" != 8 ]; then
+		_fail "missing phase records in $mode mode"
+	fi
+	if ! tail -n 1 "$tmp/progress" | grep -q '^{"type":"summary"'; then
+		_fail "summary is not the last record in $mode mode"
+	fi
+done
+
+run_mustfail "invalid --progress-fd" \
+	$SUDO_HELPER "$TOP/btrfs" check --progress-fd 1000 "$TEST_DEV"
+
+rm -rf -- "$tmp"
@@ -0,0 +1,35 @@
+#!/bin/bash
+# Test 'btrfs check --qgroup-workers', the qgroup report must not depend on the
+# number of threads accounting the extents
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir check-qgroup-workers)
+
+subvols=()
+for i in $(seq 8); do
+	generate_rootdir_files "$tmp/dir/subv$i" 50
+	subvols+=(--subvol "subv$i")
+done
+run_check_mkfs_test_dev -O quota --rootdir "$tmp/dir" "${subvols[@]}"
+
+run_check_stdout $SUDO_HELPER "$TOP/btrfs" check -Q --qgroup-workers 0 \
+	"$TEST_DEV" > "$tmp/report0"
+for workers in 1 3 16; do
+	run_check_stdout $SUDO_HELPER "$TOP/btrfs" check -Q --qgroup-workers "$workers" \
+		"$TEST_DEV" > "$tmp/report"
+	if ! diff -q "$tmp/report0" "$tmp/report" > /dev/null; then
+		_fail "qgroup report differs with $workers workers"
+	fi
+done
+
+run_mustfail "too many qgroup workers" \
+	$SUDO_HELPER "$TOP/btrfs" check --qgroup-workers 100000 "$TEST_DEV"
+
+rm -rf -- "$tmp"
@@ -37,10 +37,17 @@
 #include <assert.h>
 #include <time.h>
 #include <stdint.h>
+#include <pthread.h>
 #include "crypto/sha.h"
 
 #define CS_SIZE 32
 #define CHUNKS	128
+/* Read size of the file data, the strict sum depends on it */
+#define STRICT_READ	65536
+#define PERMISSIVE_READ	(1024 * 1024)
+/* Entries walked ahead of the ones summed, bounds the open files too */
+#define MAX_PENDING	256
+#define MAX_THREADS	64
 
 #ifndef SEEK_DATA
 #define SEEK_DATA 3
@@ -59,7 +66,35 @@ typedef struct _sum {
 	unsigned char	out[CS_SIZE];
 } sum_t;
 
-typedef int (*sum_file_data_t)(int fd, sum_t *dst);
+typedef int (*sum_file_data_t)(int fd, sum_t *dst, char *buf);
+
+enum entry_state {
+	/* Nothing to hash, or hashed already */
+	ENTRY_READY,
+	ENTRY_QUEUED,
+	ENTRY_HASHING,
+	ENTRY_HASHED,
+};
+
+/*
+ * The walk emits an entry for each name it sums, in the order of the serial
+ * walk, and a directory is followed by the entries of its children and an
+ * entry with dir_end set.  The file data is hashed by the threads, and the
+ * entries are folded to the checksum of their parent in the order they were
+ * emitted, so the result does not depend on the number of threads.
+ */
+struct entry {
+	char *path;
+	int is_dir;
+	int dir_end;
+	/* The file to hash to @cs, while queued or hashing */
+	int fd;
+	enum entry_state state;
+	sum_t meta;
+	sum_t cs;
+	/* The enclosing directory while its entries are folded */
+	struct entry *parent;
+};
 
 int gen_manifest = 0;
 int in_manifest = 0;
@@ -69,6 +104,22 @@ int n_excludes = 0;
 int verbose = 0;
 FILE *out_fp;
 FILE *in_fp;
+char *path_prefix;
+int nr_threads;
+sum_file_data_t sum_file_data;
+
+static pthread_mutex_t pending_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pending_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pending_hashed = PTHREAD_COND_INITIALIZER;
+static struct entry *pending[MAX_PENDING];
+/* Sequence numbers of the next entry to fold, to emit and to hash */
+static unsigned long pending_head;
+static unsigned long pending_tail;
+static unsigned long pending_next;
+static int pending_stop;
+/* The directory the folded entries are added to, NULL for the top one */
+static struct entry *fold_dir;
+static sum_t *fold_top;
 
 enum _flags {
 	FLAG_UID,
@@ -157,6 +208,7 @@ usage(void)
 	fprintf(stderr, "    -n           : reset all flags\n");
 	fprintf(stderr, "    -N           : set all flags\n");
 	fprintf(stderr, "    -x path      : exclude path when building checksum (multiple ok)\n");
+	fprintf(stderr, "    -j <num>     : hash the file data with num threads (default: 0, no threads)\n");
 	fprintf(stderr, "    -h           : this help\n\n");
 	fprintf(stderr, "The default field mask is ugoamCdtES. If the checksum/manifest is read from a\n");
 	fprintf(stderr, "file, the mask is taken from there and the values given on the command line\n");
@@ -164,7 +216,7 @@ usage(void)
 	exit(-1);
 }
 
-static char buf[65536];
+static char buf[PERMISSIVE_READ];
 
 static void *
 alloc(size_t sz)
@@ -329,23 +381,24 @@ out:
 }
 
 static int
-sum_file_data_permissive(int fd, sum_t *dst)
+sum_file_data_permissive(int fd, sum_t *dst, char *data)
 {
 	int ret;
 
 	while (1) {
-		ret = read(fd, buf, sizeof(buf));
+		ret = read(fd, data, PERMISSIVE_READ);
 		if (ret < 0)
 			return -errno;
-		sum_add(dst, buf, ret);
-		if (ret < sizeof(buf))
+		sum_add(dst, data, ret);
+		if (ret < PERMISSIVE_READ)
 			break;
 	}
 	return 0;
 }
 
+/* The offsets are added for each read, keep the read size for compatibility */
 static int
-sum_file_data_strict(int fd, sum_t *dst)
+sum_file_data_strict(int fd, sum_t *dst, char *data)
 {
 	int ret;
 	off_t pos;
@@ -358,7 +411,7 @@ sum_file_data_strict(int fd, sum_t *dst)
 		pos = lseek(fd, pos, SEEK_DATA);
 		if (pos == (off_t)-1)
 			return errno == ENXIO ? 0 : -2;
-		ret = read(fd, buf, sizeof(buf));
+		ret = read(fd, data, STRICT_READ);
 		assert(ret); /* eof found by lseek */
 		if (ret <= 0)
 			return ret;
@@ -367,7 +420,7 @@ sum_file_data_strict(int fd, sum_t *dst)
 				"adding to sum at file offset %llu, %d bytes\n",
 				(unsigned long long)pos, ret);
 		sum_add_u64(dst, (uint64_t)pos);
-		sum_add(dst, buf, ret);
+		sum_add(dst, data, ret);
 		pos += ret;
 	}
 }
@@ -513,7 +566,139 @@ malformed:
 }
 
 static void
-sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
+hash_entry(struct entry *e, char *data)
+{
+	int ret;
+
+	ret = sum_file_data(e->fd, &e->cs, data);
+	if (ret < 0) {
+		fprintf(stderr, "read failed for %s/%s: %m\n", path_prefix,
+			e->path);
+		exit(-1);
+	}
+	close(e->fd);
+	e->fd = -1;
+}
+
+static void *
+hash_thread(void *arg)
+{
+	char *data = alloc(PERMISSIVE_READ);
+	struct entry *e;
+
+	pthread_mutex_lock(&pending_lock);
+	while (1) {
+		while (pending_next < pending_tail &&
+		       pending[pending_next % MAX_PENDING]->state != ENTRY_QUEUED)
+			pending_next++;
+		if (pending_next == pending_tail) {
+			if (pending_stop)
+				break;
+			pthread_cond_wait(&pending_queued, &pending_lock);
+			continue;
+		}
+		e = pending[pending_next++ % MAX_PENDING];
+		e->state = ENTRY_HASHING;
+		pthread_mutex_unlock(&pending_lock);
+
+		hash_entry(e, data);
+
+		pthread_mutex_lock(&pending_lock);
+		e->state = ENTRY_HASHED;
+		pthread_cond_broadcast(&pending_hashed);
+	}
+	pthread_mutex_unlock(&pending_lock);
+	free(data);
+	return NULL;
+}
+
+/* Add the oldest emitted entry to the checksum of its directory */
+static void
+fold_entry(void)
+{
+	struct entry *e = pending[pending_head % MAX_PENDING];
+	sum_t *dircs;
+
+	pthread_mutex_lock(&pending_lock);
+	while (e->state == ENTRY_QUEUED || e->state == ENTRY_HASHING)
+		pthread_cond_wait(&pending_hashed, &pending_lock);
+	pending_head++;
+	/* Don't let the threads look at the slot once it's reused */
+	if (pending_next < pending_head)
+		pending_next = pending_head;
+	pthread_mutex_unlock(&pending_lock);
+
+	if (e->is_dir && !e->dir_end) {
+		e->parent = fold_dir;
+		fold_dir = e;
+		return;
+	}
+	if (e->dir_end) {
+		free(e->path);
+		free(e);
+		e = fold_dir;
+		fold_dir = e->parent;
+	}
+	dircs = fold_dir ? &fold_dir->cs : fold_top;
+
+	sum_fini(&e->cs);
+	if (gen_manifest || in_manifest) {
+		char *fn;
+		char *m;
+		char *c;
+
+		if (e->is_dir)
+			strcat(e->path, "/");
+		fn = escape(e->path);
+		m = sum_to_string(&e->meta);
+		c = sum_to_string(&e->cs);
+
+		if (gen_manifest)
+			fprintf(out_fp, "%s %s %s\n", fn, m, c);
+		if (in_manifest)
+			check_manifest(fn, m, c, 0);
+		free(c);
+		free(m);
+		free(fn);
+	}
+	sum_add_sum(dircs, &e->cs);
+	sum_add_sum(dircs, &e->meta);
+	free(e->path);
+	free(e);
+}
+
+static void
+emit_entry(struct entry *e)
+{
+	if (pending_tail - pending_head == MAX_PENDING)
+		fold_entry();
+	if (e->fd != -1 && !nr_threads) {
+		hash_entry(e, buf);
+		e->state = ENTRY_READY;
+	}
+	pthread_mutex_lock(&pending_lock);
+	pending[pending_tail++ % MAX_PENDING] = e;
+	if (e->state == ENTRY_QUEUED)
+		pthread_cond_signal(&pending_queued);
+	pthread_mutex_unlock(&pending_lock);
+}
+
+static struct entry *
+alloc_entry(char *path)
+{
+	struct entry *e = alloc(sizeof(*e));
+
+	memset(e, 0, sizeof(*e));
+	e->path = path;
+	e->fd = -1;
+	e->state = ENTRY_READY;
+	sum_init(&e->cs);
+	sum_init(&e->meta);
+	return e;
+}
+
+static void
+sum(int dirfd, int level, char *path_in)
 {
 	DIR *d;
 	struct dirent *de;
@@ -525,8 +710,6 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 	int fd;
 	int excl;
 	int error = 0;
-	sum_file_data_t sum_file_data = flags[FLAG_STRUCTURE] ?
-			sum_file_data_strict : sum_file_data_permissive;
 	struct stat dir_st;
 
 	if (fstat(dirfd, &dir_st)) {
@@ -565,12 +748,9 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 	qsort(namelist, entries, sizeof(*namelist), namecmp);
 	for (i = 0; i < entries; ++i) {
 		struct stat st;
-		sum_t cs;
-		sum_t meta;
+		struct entry *e;
 		char *path;
 
-		sum_init(&cs);
-		sum_init(&meta);
 		path = alloc(strlen(path_in) + strlen(namelist[i]) + 3);
 		sprintf(path, "%s/%s", path_in, namelist[i]);
 		for (excl = 0; excl < n_excludes; ++excl) {
@@ -597,81 +777,88 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 		if (st.st_dev != dir_st.st_dev)
 			goto next;
 
-		sum_add_u64(&meta, level);
-		sum_add(&meta, namelist[i], strlen(namelist[i]));
+		e = alloc_entry(path);
+		path = NULL;
+
+		sum_add_u64(&e->meta, level);
+		sum_add(&e->meta, namelist[i], strlen(namelist[i]));
 		if (!S_ISDIR(st.st_mode))
-			sum_add_u64(&meta, st.st_nlink);
+			sum_add_u64(&e->meta, st.st_nlink);
 		if (flags[FLAG_UID])
-			sum_add_u64(&meta, st.st_uid);
+			sum_add_u64(&e->meta, st.st_uid);
 		if (flags[FLAG_GID])
-			sum_add_u64(&meta, st.st_gid);
+			sum_add_u64(&e->meta, st.st_gid);
 		if (flags[FLAG_MODE])
-			sum_add_u64(&meta, st.st_mode);
+			sum_add_u64(&e->meta, st.st_mode);
 		if (flags[FLAG_ATIME])
-			sum_add_time(&meta, st.st_atime);
+			sum_add_time(&e->meta, st.st_atime);
 		if (flags[FLAG_MTIME])
-			sum_add_time(&meta, st.st_mtime);
+			sum_add_time(&e->meta, st.st_mtime);
 		if (flags[FLAG_CTIME])
-			sum_add_time(&meta, st.st_ctime);
+			sum_add_time(&e->meta, st.st_ctime);
 		if (flags[FLAG_XATTRS] &&
 		    (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode))) {
 			fd = openat(dirfd, namelist[i], 0);
 			if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
-				sum_add_u64(&meta, errno);
+				sum_add_u64(&e->meta, errno);
 			} else if (fd == -1) {
 				fprintf(stderr, "open failed for %s/%s: %m\n",
-					path_prefix, path);
+					path_prefix, e->path);
 				exit(-1);
 			} else {
-				ret = sum_xattrs(fd, &meta);
+				ret = sum_xattrs(fd, &e->meta);
 				close(fd);
 				if (ret < 0) {
 					errno = -ret;
 					fprintf(stderr,
 						"failed to read xattrs from "
 						"%s/%s: %m\n",
-						path_prefix, path);
+						path_prefix, e->path);
 					exit(-1);
 				}
 			}
 		}
 		if (S_ISDIR(st.st_mode)) {
+			struct entry *end;
+
+			e->is_dir = 1;
 			fd = openat(dirfd, namelist[i], 0);
 			if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
-				sum_add_u64(&meta, errno);
+				sum_add_u64(&e->meta, errno);
 			} else if (fd == -1) {
 				fprintf(stderr, "open failed for %s/%s: %m\n",
-					path_prefix, path);
+					path_prefix, e->path);
 				exit(-1);
-			} else {
-				sum(fd, level + 1, &cs, path_prefix, path);
+			}
+			sum_fini(&e->meta);
+			emit_entry(e);
+			if (fd != -1) {
+				sum(fd, level + 1, e->path);
 				close(fd);
 			}
+			end = alloc_entry(NULL);
+			end->is_dir = 1;
+			end->dir_end = 1;
+			emit_entry(end);
+			goto next;
 		} else if (S_ISREG(st.st_mode)) {
-			sum_add_u64(&meta, st.st_size);
+			sum_add_u64(&e->meta, st.st_size);
 			if (flags[FLAG_DATA]) {
 				if (verbose)
 					fprintf(stderr, "file %s\n",
 						namelist[i]);
 				fd = openat(dirfd, namelist[i], 0);
 				if (fd == -1 && flags[FLAG_OPEN_ERROR]) {
-					sum_add_u64(&meta, errno);
+					sum_add_u64(&e->meta, errno);
 				} else if (fd == -1) {
 					fprintf(stderr,
 						"open failed for %s/%s: %m\n",
-						path_prefix, path);
+						path_prefix, e->path);
 					exit(-1);
 				}
 				if (fd != -1) {
-					ret = sum_file_data(fd, &cs);
-					if (ret < 0) {
-						fprintf(stderr,
-							"read failed for "
-							"%s/%s: %m\n",
-							path_prefix, path);
-						exit(-1);
-					}
-					close(fd);
+					e->fd = fd;
+					e->state = ENTRY_QUEUED;
 				}
 			}
 		} else if (S_ISLNK(st.st_mode)) {
@@ -680,34 +867,13 @@ sum(int dirfd, int level, sum_t *dircs, char *path_prefix, char *path_in)
 				perror("readlink");
 				exit(-1);
 			}
-			sum_add(&cs, buf, ret);
+			sum_add(&e->cs, buf, ret);
 		} else if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode)) {
-			sum_add_u64(&cs, major(st.st_rdev));
-			sum_add_u64(&cs, minor(st.st_rdev));
-		}
-		sum_fini(&cs);
-		sum_fini(&meta);
-		if (gen_manifest || in_manifest) {
-			char *fn;
-			char *m;
-			char *c;
-
-			if (S_ISDIR(st.st_mode))
-				strcat(path, "/");
-			fn = escape(path);
-			m = sum_to_string(&meta);
-			c = sum_to_string(&cs);
-
-			if (gen_manifest)
-				fprintf(out_fp, "%s %s %s\n", fn, m, c);
-			if (in_manifest)
-				check_manifest(fn, m, c, 0);
-			free(c);
-			free(m);
-			free(fn);
+			sum_add_u64(&e->cs, major(st.st_rdev));
+			sum_add_u64(&e->cs, minor(st.st_rdev));
 		}
-		sum_add_sum(dircs, &cs);
-		sum_add_sum(dircs, &meta);
+		sum_fini(&e->meta);
+		emit_entry(e);
 next:
 		free(path);
 	}
@@ -737,7 +903,8 @@ main(int argc, char *argv[])
 	int plen;
 	int elen;
 	int n_flags = 0;
-	const char *allopts = "heEfuUgGoOaAmMcCdDtTsSnNw:r:vx:";
+	pthread_t threads[MAX_THREADS];
+	const char *allopts = "heEfuUgGoOaAmMcCdDtTsSnNw:r:vx:j:";
 
 	out_fp = stdout;
 	while ((c = getopt(argc, argv, allopts)) != EOF) {
@@ -806,6 +973,15 @@ main(int argc, char *argv[])
 		case 'v':
 			++verbose;
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 0 || nr_threads > MAX_THREADS) {
+				fprintf(stderr,
+					"number of threads must be 0 to %d\n",
+					MAX_THREADS);
+				exit(-1);
+			}
+			break;
 		case 'h':
 		case '?':
 			usage();
@@ -880,10 +1056,32 @@ main(int argc, char *argv[])
 	if (gen_manifest)
 		fprintf(out_fp, "Flags: %s\n", flagstring);
 
+	sum_file_data = flags[FLAG_STRUCTURE] ?
+			sum_file_data_strict : sum_file_data_permissive;
+	for (i = 0; i < nr_threads; i++) {
+		ret = pthread_create(&threads[i], NULL, hash_thread, NULL);
+		if (ret) {
+			errno = ret;
+			fprintf(stderr, "failed to create thread: %m\n");
+			exit(-1);
+		}
+	}
+
 	sum_init(&cs);
-	sum(fd, 1, &cs, path, "");
+	path_prefix = path;
+	fold_top = &cs;
+	sum(fd, 1, "");
+	while (pending_head < pending_tail)
+		fold_entry();
 	sum_fini(&cs);
 
+	pthread_mutex_lock(&pending_lock);
+	pending_stop = 1;
+	pthread_cond_broadcast(&pending_queued);
+	pthread_mutex_unlock(&pending_lock);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i], NULL);
+
 	close(fd);
 	if (in_manifest)
 		check_manifest("", "", "", 1);
@@ -11,8 +11,9 @@ prepare_test_dev
 convert_to_csum()
 {
 	local new_csum="$1"
+	shift
 
-	run_check "$TOP/btrfstune" --csum "$new_csum" "$TEST_DEV"
+	run_check "$TOP/btrfstune" --csum "$new_csum" "$@" "$TEST_DEV"
 	run_check "$TOP/btrfs" check --check-data-csum "$TEST_DEV"
 }
 
@@ -28,3 +29,7 @@ convert_to_csum xxhash
 convert_to_csum blake2
 convert_to_csum sha256
 convert_to_csum crc32c
+
+# The data checksums converted synchronously and by a fixed number of threads
+convert_to_csum xxhash --csum-threads 0
+convert_to_csum crc32c --csum-threads 4
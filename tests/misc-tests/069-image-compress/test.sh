@@ -0,0 +1,47 @@
+#!/bin/bash
+# Verify the compressed images restore to the same filesystem as the plain one,
+# with zlib and zstd (if built in) and one or more threads
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image-compress)
+
+mkdir "$tmp/rootdir"
+for i in $(seq 1 100); do
+	mkdir -p "$tmp/rootdir/dir$((i % 10))"
+	echo "$i" > "$tmp/rootdir/dir$((i % 10))/file$i"
+done
+run_check_mkfs_test_dev --rootdir "$tmp/rootdir"
+
+run_check "$TOP/btrfs-image" "$TEST_DEV" "$tmp/dump"
+run_check "$TOP/btrfs-image" -r "$tmp/dump" "$tmp/restored"
+run_check "$TOP/btrfs" check "$tmp/restored"
+
+options=("-c 9" "--compress zlib")
+if "$TOP/btrfs-image" --version | grep -q '+ZSTD'; then
+	options+=("--compress zstd" "--compress zstd:19"
+		  "--compress zstd --compress-long")
+fi
+
+for opt in "${options[@]}"; do
+	for threads in 1 4; do
+		run_check "$TOP/btrfs-image" $opt -t "$threads" "$TEST_DEV" \
+			"$tmp/dump-compressed"
+		run_check "$TOP/btrfs-image" -r -t "$threads" \
+			"$tmp/dump-compressed" "$tmp/restored-compressed"
+		if ! cmp -s "$tmp/restored" "$tmp/restored-compressed"; then
+			rm -rf -- "$tmp"
+			_fail "image restored from $opt differs"
+		fi
+		rm -f -- "$tmp/restored-compressed"
+	done
+done
+
+rm -rf -- "$tmp"
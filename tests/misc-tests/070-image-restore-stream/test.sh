@@ -0,0 +1,36 @@
+#!/bin/bash
+# Verify an image restored from a pipe is the same as restored from a file,
+# compressed or not
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image-stream)
+
+mkdir "$tmp/rootdir"
+for i in $(seq 1 1000); do
+	mkdir -p "$tmp/rootdir/dir$((i % 50))"
+	echo "$i" > "$tmp/rootdir/dir$((i % 50))/file$i"
+done
+run_check_mkfs_test_dev --rootdir "$tmp/rootdir"
+
+for opt in "-c 0" "-c 9"; do
+	run_check "$TOP/btrfs-image" $opt "$TEST_DEV" "$tmp/dump"
+	run_check "$TOP/btrfs-image" -r "$tmp/dump" "$tmp/restored"
+	cat "$tmp/dump" | run_check "$TOP/btrfs-image" -r -t 4 - \
+		"$tmp/restored-stream"
+	if ! cmp -s "$tmp/restored" "$tmp/restored-stream"; then
+		rm -rf -- "$tmp"
+		_fail "image restored from a pipe with $opt differs"
+	fi
+	run_check "$TOP/btrfs" check "$tmp/restored-stream"
+	rm -f -- "$tmp/restored" "$tmp/restored-stream"
+done
+
+rm -rf -- "$tmp"
@@ -0,0 +1,51 @@
+#!/bin/bash
+# Verify an indexed image restores like the plain one and that a tree restored
+# alone through the index is the same as in the full restore
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image-index)
+
+mkdir "$tmp/rootdir"
+for i in $(seq 1 1000); do
+	mkdir -p "$tmp/rootdir/dir$((i % 50))"
+	echo "$i" > "$tmp/rootdir/dir$((i % 50))/file$i"
+done
+run_check_mkfs_test_dev --rootdir "$tmp/rootdir"
+
+run_check "$TOP/btrfs-image" "$TEST_DEV" "$tmp/dump"
+run_check "$TOP/btrfs-image" -r "$tmp/dump" "$tmp/restored"
+run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t 5 \
+	"$tmp/restored" > "$tmp/fs-tree"
+
+for opt in "-c 0" "-c 9"; do
+	run_check "$TOP/btrfs-image" $opt --index "$TEST_DEV" "$tmp/dump-index"
+	run_check "$TOP/btrfs-image" -r "$tmp/dump-index" "$tmp/restored-index"
+	if ! cmp -s "$tmp/restored" "$tmp/restored-index"; then
+		rm -rf -- "$tmp"
+		_fail "image restored from the indexed image with $opt differs"
+	fi
+	rm -f -- "$tmp/restored-index"
+
+	run_check "$TOP/btrfs-image" -r --tree 5 "$tmp/dump-index" \
+		"$tmp/restored-tree"
+	run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t 5 \
+		"$tmp/restored-tree" > "$tmp/fs-tree-index"
+	if ! cmp -s "$tmp/fs-tree" "$tmp/fs-tree-index"; then
+		rm -rf -- "$tmp"
+		_fail "fs tree restored alone with $opt differs"
+	fi
+	rm -f -- "$tmp/restored-tree"
+done
+
+run_mustfail "restore of a tree from an image without index" \
+	"$TOP/btrfs-image" -r --tree 5 "$tmp/dump" "$tmp/restored-tree"
+
+rm -rf -- "$tmp"
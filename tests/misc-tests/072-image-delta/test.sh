@@ -0,0 +1,54 @@
+#!/bin/bash
+# Verify a chain of delta images restored on top of the base image has the
+# same trees as a full image of the changed filesystem
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image-delta)
+
+add_files() {
+	run_check_mount_test_dev
+	run_check $SUDO_HELPER mkdir -p "$TEST_MNT/$1"
+	for i in $(seq 1 200); do
+		run_check $SUDO_HELPER dd if=/dev/zero of="$TEST_MNT/$1/file$i" \
+			bs=1k count=1 status=none
+	done
+	run_check_umount_test_dev
+}
+
+run_check_mkfs_test_dev
+add_files dir1
+run_check "$TOP/btrfs-image" "$TEST_DEV" "$tmp/base"
+add_files dir2
+run_check "$TOP/btrfs-image" --since "$tmp/base" "$TEST_DEV" "$tmp/delta1"
+add_files dir3
+run_check "$TOP/btrfs-image" -c 9 --since "$tmp/delta1" "$TEST_DEV" "$tmp/delta2"
+
+run_check "$TOP/btrfs-image" "$TEST_DEV" "$tmp/full"
+run_check "$TOP/btrfs-image" -r "$tmp/full" "$tmp/restored-full"
+run_check "$TOP/btrfs-image" -r --base "$tmp/base" --base "$tmp/delta1" \
+	"$tmp/delta2" "$tmp/restored-delta"
+
+run_check_stdout "$TOP/btrfs" inspect-internal dump-tree \
+	"$tmp/restored-full" > "$tmp/trees-full"
+run_check_stdout "$TOP/btrfs" inspect-internal dump-tree \
+	"$tmp/restored-delta" > "$tmp/trees-delta"
+if ! cmp -s "$tmp/trees-full" "$tmp/trees-delta"; then
+	rm -rf -- "$tmp"
+	_fail "trees restored from the delta images differ"
+fi
+run_check "$TOP/btrfs" check "$tmp/restored-delta"
+
+run_mustfail "restore of a delta without its base" \
+	"$TOP/btrfs-image" -r "$tmp/delta2" "$tmp/restored"
+run_mustfail "restore of a delta on a wrong base" \
+	"$TOP/btrfs-image" -r --base "$tmp/base" "$tmp/delta2" "$tmp/restored"
+
+rm -rf -- "$tmp"
@@ -0,0 +1,49 @@
+#!/bin/bash
+# Verify the names sanitized with collisions are the same when loaded from
+# the cache of an earlier dump
+
+source "$TEST_TOP/common" || exit
+
+check_prereq btrfs-image
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir image-sanitize-cache)
+
+mkdir "$tmp/rootdir"
+for i in $(seq 1 500); do
+	touch "$tmp/rootdir/file_with_a_longer_name_$i"
+done
+run_check_mkfs_test_dev --rootdir "$tmp/rootdir"
+
+# The inode ref of the top directory has no collision, its garbage differs
+dump_names() {
+	run_check "$TOP/btrfs-image" -r "$1" "$tmp/restored"
+	run_check_stdout "$TOP/btrfs" inspect-internal dump-tree -t 5 \
+		"$tmp/restored" | grep 'name:' | grep -v 'namelen 2 '
+	rm -f -- "$tmp/restored"
+}
+
+run_check "$TOP/btrfs-image" -ss --sanitize-cache "$tmp/cache" "$TEST_DEV" \
+	"$tmp/dump1"
+run_check "$TOP/btrfs-image" -ss --sanitize-cache "$tmp/cache" "$TEST_DEV" \
+	"$tmp/dump2"
+dump_names "$tmp/dump1" > "$tmp/names1"
+dump_names "$tmp/dump2" > "$tmp/names2"
+if ! cmp -s "$tmp/names1" "$tmp/names2"; then
+	rm -rf -- "$tmp"
+	_fail "names sanitized through the cache differ"
+fi
+if grep -q file_with "$tmp/names1"; then
+	rm -rf -- "$tmp"
+	_fail "names not sanitized"
+fi
+
+run_mustfail "cache without -ss" \
+	"$TOP/btrfs-image" -s --sanitize-cache "$tmp/cache" "$TEST_DEV" \
+	"$tmp/dump3"
+
+rm -rf -- "$tmp"
@@ -0,0 +1,67 @@
+#!/bin/bash
+#
+# Receive a full and an incremental stream with many small files, renames,
+# hardlinks and removals by the threads (receive --threads) and verify the
+# received subvolumes are the same as the sent ones
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_prereq fssum
+
+setup_root_helper
+prepare_test_dev
+
+FSSUM_PROG="$INTERNAL_BIN/fssum"
+srcdir=./send-test-dir
+rm -rf "$srcdir"
+mkdir -p "$srcdir"
+run_check chmod a+rw "$srcdir"
+
+run_check_mkfs_test_dev
+run_check_mount_test_dev
+
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume create "$TEST_MNT/subv"
+for dir in $(seq 16); do
+	run_check $SUDO_HELPER mkdir "$TEST_MNT/subv/dir$dir"
+	for file in $(seq 64); do
+		run_check $SUDO_HELPER dd if=/dev/urandom \
+			of="$TEST_MNT/subv/dir$dir/file$file" bs=$((file * 512)) count=1
+	done
+	run_check $SUDO_HELPER setfattr -n user.dir -v "$dir" "$TEST_MNT/subv/dir$dir"
+	run_check $SUDO_HELPER chmod 0750 "$TEST_MNT/subv/dir$dir/file1"
+done
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" "$TEST_MNT/snap1"
+
+for dir in $(seq 8); do
+	run_check $SUDO_HELPER mv "$TEST_MNT/subv/dir$dir" "$TEST_MNT/subv/moved$dir"
+	run_check $SUDO_HELPER ln "$TEST_MNT/subv/moved$dir/file2" "$TEST_MNT/subv/link$dir"
+	run_check $SUDO_HELPER rm -f -- "$TEST_MNT/subv/moved$dir/file3"
+	run_check $SUDO_HELPER mv "$TEST_MNT/subv/moved$dir/file4" "$TEST_MNT/subv/moved$dir/file5"
+	run_check $SUDO_HELPER dd if=/dev/urandom of="$TEST_MNT/subv/moved$dir/file6" \
+		bs=4K count=4 conv=notrunc
+done
+run_check $SUDO_HELPER rm -rf -- "$TEST_MNT/subv/dir16"
+run_check $SUDO_HELPER "$TOP/btrfs" subvolume snapshot -r "$TEST_MNT/subv" "$TEST_MNT/snap2"
+
+run_check $FSSUM_PROG -A -f -w "$srcdir/snap1.fssum" "$TEST_MNT/snap1"
+run_check $FSSUM_PROG -A -f -w "$srcdir/snap2.fssum" "$TEST_MNT/snap2"
+run_check $SUDO_HELPER "$TOP/btrfs" send -f "$srcdir/snap1.stream" "$TEST_MNT/snap1"
+run_check $SUDO_HELPER "$TOP/btrfs" send -p "$TEST_MNT/snap1" -f "$srcdir/snap2.stream" \
+	"$TEST_MNT/snap2"
+run_check_umount_test_dev
+
+for threads in 1 4; do
+	run_check_mkfs_test_dev
+	run_check_mount_test_dev
+	run_check $SUDO_HELPER "$TOP/btrfs" receive --threads "$threads" \
+		-f "$srcdir/snap1.stream" "$TEST_MNT"
+	run_check $SUDO_HELPER "$TOP/btrfs" receive --threads "$threads" \
+		-f "$srcdir/snap2.stream" "$TEST_MNT"
+	run_check $FSSUM_PROG -r "$srcdir/snap1.fssum" "$TEST_MNT/snap1"
+	run_check $FSSUM_PROG -r "$srcdir/snap2.fssum" "$TEST_MNT/snap2"
+	run_check_umount_test_dev
+done
+
+rm -rf -- "$srcdir"
@@ -0,0 +1,36 @@
+#!/bin/bash
+#
+# Continue an interrupted restore (restore --resume), the truncated, deleted
+# and partially zeroed files must be restored again to the original contents
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir restore-resume)
+
+generate_rootdir_files "$tmp/src/small" 20 1000
+generate_rootdir_files "$tmp/src/large" 8 $((2 * 1024 * 1024))
+run_check_mkfs_test_dev --rootdir "$tmp/src"
+
+run_check mkdir "$tmp/dst"
+run_check $SUDO_HELPER "$TOP/btrfs" restore "$TEST_DEV" "$tmp/dst"
+run_check $SUDO_HELPER diff -r "$tmp/src" "$tmp/dst"
+
+run_check $SUDO_HELPER truncate -s 100K "$tmp/dst/large/file1"
+run_check $SUDO_HELPER rm -f -- "$tmp/dst/large/file2" "$tmp/dst/small/file3"
+# A zeroed range is only detected as missing when it's a hole
+run_check $SUDO_HELPER fallocate --punch-hole --offset 1M --length 128K \
+	"$tmp/dst/large/file4"
+if $SUDO_HELPER cmp -s "$tmp/src/large/file4" "$tmp/dst/large/file4"; then
+	_not_run "punching a hole not supported in $tmp"
+fi
+
+run_check $SUDO_HELPER "$TOP/btrfs" restore --resume "$TEST_DEV" "$tmp/dst"
+run_check $SUDO_HELPER diff -r "$tmp/src" "$tmp/dst"
+
+run_check $SUDO_HELPER rm -rf -- "$tmp"
@@ -0,0 +1,63 @@
+#!/bin/bash
+# Verify that mkfs.btrfs --rootdir creates the same filesystem when the files
+# are read and compressed by threads as when they're read by the main thread
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir mkfs-rootdir-threads)
+
+run_check mkdir -p "$tmp/dir/subdir" "$tmp/nocow" "$tmp/subv"
+for i in $(seq 1 100); do
+	run_check dd if=/dev/urandom of="$tmp/dir/small$i" bs=$((i * 37)) count=1 status=noxfer
+done
+for i in $(seq 1 10); do
+	run_check dd if=/dev/zero of="$tmp/dir/subdir/zero$i" bs=1M count="$i" status=noxfer
+	run_check dd if=/dev/urandom of="$tmp/dir/subdir/random$i" bs=300K count="$i" status=noxfer
+done
+# Incompressible beginning, NOCOMPRESS is set
+run_check dd if=/dev/urandom of="$tmp/dir/mixed" bs=1M count=2 status=noxfer
+run_check dd if=/dev/zero of="$tmp/dir/mixed" bs=1M count=2 seek=2 status=noxfer
+run_check cp "$tmp/dir/subdir/zero3" "$tmp/nocow/file"
+run_check cp "$tmp/dir/subdir/zero4" "$tmp/subv/file"
+run_check ln "$tmp/dir/subdir/zero5" "$tmp/dir/hardlink"
+
+dump_fs()
+{
+	run_check_stdout $SUDO_HELPER "$TOP/btrfs" inspect-internal dump-tree "$TEST_DEV" |
+		grep -v 'time\|fsid\|uuid\|UUID_KEY\|subvol_id'
+}
+
+run_test()
+{
+	local compress="$1"
+
+	run_check_mkfs_test_dev --rootdir "$tmp" --compress "$compress" \
+		--inode-flags nodatacow:nocow --subvol subv --threads 0
+	run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+	dump_fs > "$tmp.dump0"
+
+	run_check_mkfs_test_dev --rootdir "$tmp" --compress "$compress" \
+		--inode-flags nodatacow:nocow --subvol subv --threads 4
+	run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+	dump_fs > "$tmp.dump4"
+
+	if ! cmp -s "$tmp.dump0" "$tmp.dump4"; then
+		rm -f -- "$tmp.dump0" "$tmp.dump4"
+		_fail "filesystem created with threads differs for --compress $compress"
+	fi
+	rm -f -- "$tmp.dump0" "$tmp.dump4"
+}
+
+run_test no
+run_test zlib
+if "$TOP/mkfs.btrfs" --version | grep -q '+ZSTD'; then
+	run_test zstd
+fi
+
+run_check rm -rf -- "$tmp"
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Verify that mkfs.btrfs --rootdir --dedupe shares the extents of the same
+# data and the files are still the same
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+
+setup_root_helper
+prepare_test_dev
+
+tmp=$(_mktemp_dir mkfs-rootdir-dedupe)
+
+run_check mkdir -p "$tmp/dir" "$tmp/nocow"
+run_check dd if=/dev/urandom of="$tmp/dir/orig" bs=1M count=3 status=noxfer
+for i in $(seq 1 4); do
+	run_check cp "$tmp/dir/orig" "$tmp/dir/copy$i"
+done
+# Same first extent, different tail
+run_check cp "$tmp/dir/orig" "$tmp/dir/tail"
+run_check dd if=/dev/urandom of="$tmp/dir/tail" bs=4K count=1 seek=700 conv=notrunc status=noxfer
+run_check dd if=/dev/zero of="$tmp/dir/zero" bs=1M count=4 status=noxfer
+run_check cp "$tmp/dir/orig" "$tmp/nocow/copy"
+
+run_test()
+{
+	local compress="$1"
+	local refs
+	local extents
+
+	run_check_mkfs_test_dev --rootdir "$tmp" --compress "$compress" \
+		--inode-flags nodatacow:nocow --dedupe
+	run_check $SUDO_HELPER "$TOP/btrfs" check --check-data-csum "$TEST_DEV"
+
+	run_check_stdout $SUDO_HELPER "$TOP/btrfs" inspect-internal dump-tree -t 5 "$TEST_DEV" |
+		grep -o 'disk byte [0-9]*' | grep -v 'disk byte 0$' > "$tmp.refs"
+	refs=$(wc -l < "$tmp.refs")
+	extents=$(sort -u "$tmp.refs" | wc -l)
+	rm -f -- "$tmp.refs"
+	if [ "$extents" -ge "$refs" ]; then
+		_fail "no extents shared for --compress $compress: $extents of $refs"
+	fi
+
+	run_check_mount_test_dev
+	run_check $SUDO_HELPER diff -r "$tmp" "$TEST_MNT"
+	run_check_umount_test_dev
+}
+
+run_test no
+run_test zlib
+if "$TOP/mkfs.btrfs" --version | grep -q '+ZSTD'; then
+	run_test zstd
+fi
+
+run_check rm -rf -- "$tmp"
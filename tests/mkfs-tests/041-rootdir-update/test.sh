@@ -0,0 +1,53 @@
+#!/bin/bash
+# Verify that mkfs.btrfs --rootdir --update brings the filesystem to the state
+# of the changed source directory, with the files touched, rewritten in place,
+# renamed, deleted and added between the updates
+
+source "$TEST_TOP/common" || exit
+
+check_prereq mkfs.btrfs
+check_prereq btrfs
+check_prereq fssum
+
+setup_root_helper
+prepare_test_dev
+
+FSSUM_PROG="$INTERNAL_BIN/fssum"
+tmp=$(_mktemp_dir mkfs-rootdir-update)
+
+# Enough inodes for the items of some of them to cross the leaf boundaries
+run_check mkdir -p "$tmp/dir/subdir"
+run_check dd if=/dev/urandom of="$tmp/big" bs=1M count=2 status=noxfer
+for i in $(seq 1 300); do
+	run_check dd if=/dev/urandom of="$tmp/dir/file$i" bs=$((i * 53)) count=1 status=noxfer
+done
+for i in $(seq 1 50); do
+	run_check dd if=/dev/urandom of="$tmp/dir/subdir/data$i" bs=$((i * 4096 + 17)) count=1 status=noxfer
+done
+
+verify_fs()
+{
+	run_check $SUDO_HELPER "$TOP/btrfs" check "$TEST_DEV"
+	run_check "$FSSUM_PROG" -A -f -w "$tmp.fssum" "$tmp"
+	run_check_mount_test_dev
+	run_check "$FSSUM_PROG" -r "$tmp.fssum" "$TEST_MNT"
+	run_check_umount_test_dev
+	rm -f -- "$tmp.fssum"
+}
+
+run_check_mkfs_test_dev --rootdir "$tmp"
+verify_fs
+
+for i in 1 2 3; do
+	run_check find "$tmp" -type f -exec touch {} +
+	# Same size rewritten within the same second as the touch
+	run_check dd if=/dev/urandom of="$tmp/dir/file100" bs=5300 count=1 conv=notrunc status=noxfer
+	run_check mv "$tmp/dir/file$((i * 7))" "$tmp/dir/subdir/renamed$i"
+	run_check rm -f -- "$tmp/dir/file$((i * 11 + 1))"
+	run_check dd if=/dev/urandom of="$tmp/new$i" bs=9000 count=1 status=noxfer
+
+	run_check $SUDO_HELPER "$TOP/mkfs.btrfs" --rootdir "$tmp" --update "$TEST_DEV"
+	verify_fs
+done
+
+run_check rm -rf -- "$tmp"
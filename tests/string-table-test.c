@@ -104,6 +104,37 @@ static void test_simple_paginate()
 	table_free(tab);
 }
 
+static void test_stream()
+{
+	struct string_table *tab;
+	unsigned int window = 4;
+	int i;
+
+	tab = table_create_stream(3, 2, window);
+	if (!tab) {
+		fprintf(stderr, "ERROR: cannot allocate table\n");
+		return;
+	}
+	table_set_width(tab, 2, 12);
+	table_printf(tab, 0, 0, ">Id");
+	table_printf(tab, 1, 0, "<Name");
+	table_printf(tab, 2, 0, ">Size");
+	table_printf(tab, 0, 1, "*-");
+	table_printf(tab, 1, 1, "*-");
+	table_printf(tab, 2, 1, "*-");
+
+	puts("start");
+	for (i = 0; i < 3 * window + 1; i++) {
+		table_printf(tab, 0, tab->hrows + i, ">%d", 1U << i);
+		table_printf(tab, 1, tab->hrows + i, "<Text %d", 100 * i);
+		table_printf(tab, 2, tab->hrows + i, ">%d", 1000 * i);
+	}
+	table_dump(tab);
+	puts("end");
+
+	table_free(tab);
+}
+
 int main(int argc, char **argv)
 {
 	int testno;
@@ -111,6 +142,7 @@ int main(int argc, char **argv)
 		test_simple_create_free,
 		test_simple_header,
 		test_simple_paginate,
+		test_stream,
 	};
 
 	/* Without arguments, print the number of tests available */
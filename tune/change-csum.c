@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include "kernel-lib/sizes.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
@@ -30,10 +31,12 @@
 #include "kernel-shared/extent_io.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/tree-checker.h"
+#include "crypto/hash.h"
 #include "common/messages.h"
 #include "common/utils.h"
 #include "common/inject-error.h"
 #include "common/extent-tree-utils.h"
+#include "common/thread-pool.h"
 #include "tune/tune.h"
 
 static int check_csum_change_requreiment(struct btrfs_fs_info *fs_info, u16 new_csum_type)
@@ -177,21 +180,37 @@ static int read_verify_one_data_sector(struct btrfs_fs_info *fs_info,
 	return 0;
 }
 
-static int generate_new_csum_range(struct btrfs_trans_handle *trans,
+/* Sectors read and verified before calculating their new csums at once */
+#define CSUM_CHANGE_BATCH_SECTORS	(256)
+
+static int generate_new_csum_range(struct btrfs_bulk_loader *loader,
 				   u64 logical, u64 length, u16 new_csum_type,
 				   const void *old_csums)
 {
-	struct btrfs_fs_info *fs_info = trans->fs_info;
+	struct btrfs_fs_info *fs_info = loader->root->fs_info;
 	const u32 sectorsize = fs_info->sectorsize;
+	const u16 new_csum_size = btrfs_csum_type_size(new_csum_type);
+	const u32 max_csums = MAX_CSUM_ITEMS(loader->root, new_csum_size);
+	struct btrfs_key key;
+	u64 item_start = logical;
+	u32 nr_csums = 0;
+	u32 nr_batched = 0;
+	u8 *new_csums;
 	int ret = 0;
-	void *buf;
+	u8 *buf;
 
-	buf = malloc(fs_info->sectorsize);
-	if (!buf)
-		return -ENOMEM;
+	buf = malloc(CSUM_CHANGE_BATCH_SECTORS * sectorsize);
+	new_csums = malloc(max_csums * new_csum_size);
+	if (!buf || !new_csums) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
 	for (u64 cur = logical; cur < logical + length; cur += sectorsize) {
-		ret = read_verify_one_data_sector(fs_info, cur, buf, old_csums +
+		bool item_full;
+
+		ret = read_verify_one_data_sector(fs_info, cur,
+				buf + nr_batched * sectorsize, old_csums +
 				(cur - logical) / sectorsize * fs_info->csum_size,
 				fs_info->csum_type, true);
 
@@ -200,17 +219,36 @@ static int generate_new_csum_range(struct btrfs_trans_handle *trans,
 			      logical);
 			goto out;
 		}
-		/* Calculate new csum and insert it into the csum tree. */
-		ret = btrfs_csum_file_block(trans, cur,
-				BTRFS_CSUM_CHANGE_OBJECTID, new_csum_type, buf);
+		nr_batched++;
+		nr_csums++;
+		item_full = (nr_csums == max_csums || cur + sectorsize == logical + length);
+
+		/* Calculate new csums, insert a csum item once it's full. */
+		if (nr_batched == CSUM_CHANGE_BATCH_SECTORS || item_full) {
+			btrfs_csum_data_batch(new_csum_type, buf,
+				new_csums + (nr_csums - nr_batched) * new_csum_size,
+				sectorsize, nr_batched);
+			nr_batched = 0;
+		}
+		if (!item_full)
+			continue;
+
+		key.objectid = BTRFS_CSUM_CHANGE_OBJECTID;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = item_start;
+		ret = btrfs_bulk_loader_add(loader, &key, new_csums,
+					    nr_csums * new_csum_size);
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to insert new csum for data at logical %llu: %m",
-			      cur);
+			      item_start);
 			goto out;
 		}
+		item_start = cur + sectorsize;
+		nr_csums = 0;
 	}
 out:
+	free(new_csums);
 	free(buf);
 	return ret;
 }
@@ -233,14 +271,394 @@ static unsigned int calc_csum_change_nr_items(struct btrfs_fs_info *fs_info,
 	return round_up(csum_item_size, fs_info->nodesize) / fs_info->nodesize * 2;
 }
 
+/*
+ * Read the old csums of the first data csum item at or after @cur into @csums,
+ * which must be nodesize large.  Return 1 if there is no such item.
+ */
+static int read_next_old_csums(struct btrfs_fs_info *fs_info, u64 cur,
+			       u64 *csum_start, u64 *len, void *csums)
+{
+	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, 0);
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key;
+	u32 item_size;
+	int ret;
+
+	key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
+	key.type = BTRFS_EXTENT_CSUM_KEY;
+	key.offset = cur;
+
+	ret = btrfs_search_slot(NULL, csum_root, &key, &path, 0, 0);
+	if (ret < 0)
+		return ret;
+	if (ret > 0 && path.slots[0] >= btrfs_header_nritems(path.nodes[0])) {
+		ret = btrfs_next_leaf(csum_root, &path);
+		if (ret) {
+			btrfs_release_path(&path);
+			return ret;
+		}
+	}
+	btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+	UASSERT(key.offset >= cur);
+	item_size = btrfs_item_size(path.nodes[0], path.slots[0]);
+
+	*csum_start = key.offset;
+	*len = item_size / fs_info->csum_size * fs_info->sectorsize;
+	read_extent_buffer(path.nodes[0], csums,
+			   btrfs_item_ptr_offset(path.nodes[0], path.slots[0]),
+			   item_size);
+	btrfs_release_path(&path);
+	return 0;
+}
+
+/* Same as for the data checksums of btrfs check */
+static bool csum_type_thread_safe(u16 csum_type)
+{
+	return CRYPTO_HASH_THREAD_SAFE || csum_type == BTRFS_CSUM_TYPE_CRC32 ||
+	       csum_type == BTRFS_CSUM_TYPE_XXHASH;
+}
+
+/* Data read, verified and checksummed at once by a worker of --csum-threads */
+#define CSUM_CHANGE_JOB_BYTES		(SZ_4M)
+
+struct csum_change_job {
+	u64 logical;
+	u64 len;
+	/* The job ends an old csum item */
+	bool item_end;
+	int ret;
+	u8 *old_csums;
+	u8 *new_csums;
+};
+
+/*
+ * Workers reading the data of the old csum items and calculating the new
+ * csums, the jobs are queued and consumed in the logical order by the main
+ * thread, which inserts the new csum items exactly as without the workers.
+ */
+struct csum_change_pool {
+	struct btrfs_fs_info *fs_info;
+	u16 new_csum_type;
+
+	/*
+	 * Held for read by the workers mapping the data, for write by the
+	 * main thread modifying the trees, which can allocate new chunks.
+	 */
+	pthread_rwlock_t map_lock;
+
+	struct thread_pool pool;
+	/* Ring of the jobs, indexed by the sequence number of the pool */
+	struct csum_change_job *jobs;
+	unsigned int nr_jobs;
+
+	/* The old csum item being queued, only accessed by the main thread */
+	u64 cur;
+	u64 last_csum;
+	u8 *item_csums;
+	u64 item_start;
+	u64 item_len;
+	u64 item_offset;
+
+	/* The new csum item being filled, only accessed by the main thread */
+	u8 *new_item;
+	u64 new_item_start;
+	u32 new_item_nr;
+};
+
+/* Buffers of one worker */
+struct csum_change_buffers {
+	u8 *buf;
+	u8 *csums;
+};
+
+static int csum_change_process(struct csum_change_pool *pool,
+			       struct csum_change_job *job, u8 *buf, u8 *csums)
+{
+	struct btrfs_fs_info *fs_info = pool->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+	const u16 csum_size = fs_info->csum_size;
+	const u32 nr_sectors = job->len / sectorsize;
+	u64 read_len;
+	int ret = 0;
+
+	pthread_rwlock_rdlock(&pool->map_lock);
+	for (u64 offset = 0; offset < job->len; offset += read_len) {
+		read_len = job->len - offset;
+		ret = read_data_from_disk(fs_info, buf + offset,
+					  job->logical + offset, &read_len, 1);
+		if (ret < 0)
+			break;
+	}
+	pthread_rwlock_unlock(&pool->map_lock);
+	if (ret == 0)
+		btrfs_csum_data_batch(fs_info->csum_type, buf, csums, sectorsize,
+				      nr_sectors);
+
+	/* Mismatches and read errors are retried by sectors from all mirrors */
+	for (u32 i = 0; i < nr_sectors; i++) {
+		const u64 logical = job->logical + (u64)i * sectorsize;
+		int ret2;
+
+		if (ret == 0 && memcmp(csums + i * csum_size,
+				       job->old_csums + i * csum_size,
+				       csum_size) == 0)
+			continue;
+		pthread_rwlock_rdlock(&pool->map_lock);
+		ret2 = read_verify_one_data_sector(fs_info, logical,
+				buf + (u64)i * sectorsize,
+				job->old_csums + i * csum_size,
+				fs_info->csum_type, true);
+		pthread_rwlock_unlock(&pool->map_lock);
+		if (ret2 < 0) {
+			error("failed to recover a good copy for data at logical %llu",
+			      logical);
+			return ret2;
+		}
+	}
+	btrfs_csum_data_batch(pool->new_csum_type, buf, job->new_csums,
+			      sectorsize, nr_sectors);
+	return 0;
+}
+
+static void *csum_change_thread_init(void *arg)
+{
+	struct csum_change_pool *pool = arg;
+	struct btrfs_fs_info *fs_info = pool->fs_info;
+	struct csum_change_buffers *bufs;
+
+	bufs = calloc(1, sizeof(*bufs));
+	if (!bufs)
+		return NULL;
+	bufs->buf = malloc(CSUM_CHANGE_JOB_BYTES);
+	bufs->csums = malloc(CSUM_CHANGE_JOB_BYTES / fs_info->sectorsize *
+			     fs_info->csum_size);
+	return bufs;
+}
+
+static void csum_change_thread_exit(void *arg, void *thread_data)
+{
+	struct csum_change_buffers *bufs = thread_data;
+
+	if (!bufs)
+		return;
+	free(bufs->csums);
+	free(bufs->buf);
+	free(bufs);
+}
+
+static void csum_change_worker(void *arg, void *data, void *thread_data)
+{
+	struct csum_change_buffers *bufs = thread_data;
+	struct csum_change_job *job = data;
+
+	if (!bufs || !bufs->buf || !bufs->csums)
+		job->ret = -ENOMEM;
+	else
+		job->ret = csum_change_process(arg, job, bufs->buf, bufs->csums);
+}
+
+static const struct thread_pool_ops csum_change_pool_ops = {
+	.process = csum_change_worker,
+	.thread_init = csum_change_thread_init,
+	.thread_exit = csum_change_thread_exit,
+};
+
+static void csum_change_pool_free(struct csum_change_pool *pool)
+{
+	if (!pool)
+		return;
+	thread_pool_release(&pool->pool);
+	for (unsigned int i = 0; pool->jobs && i < pool->nr_jobs; i++) {
+		free(pool->jobs[i].old_csums);
+		free(pool->jobs[i].new_csums);
+	}
+	free(pool->jobs);
+	free(pool->item_csums);
+	free(pool->new_item);
+	pthread_rwlock_destroy(&pool->map_lock);
+	free(pool);
+}
+
+/*
+ * Start @nr_threads converting the csums of [@start, @last_csum), NULL if
+ * there are no threads or they can't be used, the csums are then converted
+ * by generate_new_csum_range().
+ */
+static struct csum_change_pool *csum_change_pool_start(
+		struct btrfs_fs_info *fs_info, u64 start, u64 last_csum,
+		u16 new_csum_type, unsigned int nr_threads)
+{
+	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, 0);
+	const u16 new_csum_size = btrfs_csum_type_size(new_csum_type);
+	const u32 job_sectors = CSUM_CHANGE_JOB_BYTES / fs_info->sectorsize;
+	struct csum_change_pool *pool;
+
+	if (!nr_threads)
+		return NULL;
+	if (!csum_type_thread_safe(fs_info->csum_type) ||
+	    !csum_type_thread_safe(new_csum_type))
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->fs_info = fs_info;
+	pool->new_csum_type = new_csum_type;
+	pool->cur = start;
+	pool->last_csum = last_csum;
+	pthread_rwlock_init(&pool->map_lock, NULL);
+
+	pool->item_csums = malloc(fs_info->nodesize);
+	pool->new_item = malloc(MAX_CSUM_ITEMS(csum_root, new_csum_size) *
+				new_csum_size);
+	pool->nr_jobs = nr_threads * 2;
+	pool->jobs = calloc(pool->nr_jobs, sizeof(*pool->jobs));
+	if (!pool->item_csums || !pool->new_item || !pool->jobs)
+		goto fail;
+	for (unsigned int i = 0; i < pool->nr_jobs; i++) {
+		pool->jobs[i].old_csums = malloc(job_sectors * fs_info->csum_size);
+		pool->jobs[i].new_csums = malloc(job_sectors * new_csum_size);
+		if (!pool->jobs[i].old_csums || !pool->jobs[i].new_csums)
+			goto fail;
+	}
+	if (thread_pool_init(&pool->pool, &csum_change_pool_ops, pool,
+			     nr_threads, pool->nr_jobs) < 0)
+		goto fail;
+	if (pool->pool.nr_threads)
+		return pool;
+fail:
+	csum_change_pool_free(pool);
+	return NULL;
+}
+
+/* Queue the old csums to the free jobs of the ring */
+static int csum_change_queue(struct csum_change_pool *pool)
+{
+	struct btrfs_fs_info *fs_info = pool->fs_info;
+	const u32 sectorsize = fs_info->sectorsize;
+
+	while (!thread_pool_full(&pool->pool)) {
+		struct csum_change_job *job;
+		int ret;
+
+		if (pool->item_offset == pool->item_len) {
+			if (pool->cur >= pool->last_csum)
+				return 0;
+			ret = read_next_old_csums(fs_info, pool->cur,
+						  &pool->item_start,
+						  &pool->item_len,
+						  pool->item_csums);
+			if (ret > 0) {
+				pool->cur = pool->last_csum;
+				return 0;
+			}
+			if (ret < 0)
+				return ret;
+			pool->item_offset = 0;
+			pool->cur = pool->item_start + pool->item_len;
+		}
+		job = &pool->jobs[pool->pool.head_seq % pool->nr_jobs];
+		job->logical = pool->item_start + pool->item_offset;
+		job->len = min_t(u64, pool->item_len - pool->item_offset,
+				 CSUM_CHANGE_JOB_BYTES);
+		job->item_end = (pool->item_offset + job->len == pool->item_len);
+		job->ret = 0;
+		memcpy(job->old_csums, pool->item_csums +
+		       pool->item_offset / sectorsize * fs_info->csum_size,
+		       job->len / sectorsize * fs_info->csum_size);
+		pool->item_offset += job->len;
+		thread_pool_push(&pool->pool, job);
+	}
+	return 0;
+}
+
+/*
+ * Add the new csums of @job to the new csum item, which is inserted once it's
+ * full or the old csum item ends, the same as generate_new_csum_range().
+ */
+static int csum_change_add_job(struct csum_change_pool *pool,
+			       struct btrfs_bulk_loader *loader,
+			       struct csum_change_job *job)
+{
+	const u32 sectorsize = pool->fs_info->sectorsize;
+	const u16 new_csum_size = btrfs_csum_type_size(pool->new_csum_type);
+	const u32 max_csums = MAX_CSUM_ITEMS(loader->root, new_csum_size);
+	const u32 nr_sectors = job->len / sectorsize;
+	u32 added = 0;
+
+	while (added < nr_sectors) {
+		const u32 nr = min(nr_sectors - added,
+				   max_csums - pool->new_item_nr);
+		struct btrfs_key key;
+		int ret;
+
+		if (pool->new_item_nr == 0)
+			pool->new_item_start = job->logical +
+					       (u64)added * sectorsize;
+		memcpy(pool->new_item + pool->new_item_nr * new_csum_size,
+		       job->new_csums + added * new_csum_size,
+		       nr * new_csum_size);
+		pool->new_item_nr += nr;
+		added += nr;
+		if (pool->new_item_nr < max_csums &&
+		    !(added == nr_sectors && job->item_end))
+			continue;
+
+		key.objectid = BTRFS_CSUM_CHANGE_OBJECTID;
+		key.type = BTRFS_EXTENT_CSUM_KEY;
+		key.offset = pool->new_item_start;
+		ret = btrfs_bulk_loader_add(loader, &key, pool->new_item,
+					    pool->new_item_nr * new_csum_size);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to insert new csum for data at logical %llu: %m",
+			      pool->new_item_start);
+			return ret;
+		}
+		pool->new_item_nr = 0;
+	}
+	return 0;
+}
+
+/*
+ * Insert the new csums of the next job in order, return 1 if all the jobs are
+ * done.  @len is the length of the job and @item_end is set if it ended an old
+ * csum item.
+ */
+static int csum_change_next_job(struct csum_change_pool *pool,
+				struct btrfs_bulk_loader *loader,
+				u64 *len, bool *item_end)
+{
+	struct csum_change_job *job;
+	int ret;
+
+	ret = csum_change_queue(pool);
+	if (ret < 0)
+		return ret;
+	job = thread_pool_pop(&pool->pool);
+	if (!job)
+		return 1;
+	if (job->ret < 0)
+		return job->ret;
+
+	pthread_rwlock_wrlock(&pool->map_lock);
+	ret = csum_change_add_job(pool, loader, job);
+	pthread_rwlock_unlock(&pool->map_lock);
+	if (ret < 0)
+		return ret;
+	*len = job->len;
+	*item_end = job->item_end;
+	return 0;
+}
+
 static int generate_new_data_csums_range(struct btrfs_fs_info *fs_info, u64 start,
-					 u16 new_csum_type)
+					 u16 new_csum_type, unsigned int nr_threads)
 {
 	const unsigned int nr_items = calc_csum_change_nr_items(fs_info, new_csum_type);
 	struct btrfs_root *csum_root = btrfs_csum_root(fs_info, 0);
 	struct btrfs_trans_handle *trans;
-	struct btrfs_path path = { 0 };
-	struct btrfs_key key;
+	struct btrfs_bulk_loader loader = { 0 };
+	struct csum_change_pool *pool;
 	void *csum_buffer;
 	u64 converted_bytes = 0;
 	u64 last_csum;
@@ -264,72 +682,76 @@ static int generate_new_data_csums_range(struct btrfs_fs_info *fs_info, u64 star
 		error("failed to start transaction: %m");
 		return ret;
 	}
+	/* New csums are generated in order, after all existing csum items */
+	btrfs_bulk_loader_init(&loader, trans, csum_root, 100);
+	pool = csum_change_pool_start(fs_info, start, last_csum, new_csum_type,
+				      nr_threads);
 
-	while (cur < last_csum) {
-		u64 csum_start;
+	while (true) {
+		bool item_end = true;
 		u64 len;
-		u32 item_size;
 
-		key.objectid = BTRFS_EXTENT_CSUM_OBJECTID;
-		key.type = BTRFS_EXTENT_CSUM_KEY;
-		key.offset = cur;
-
-		ret = btrfs_search_slot(NULL, csum_root, &key, &path, 0, 0);
-		if (ret < 0)
-			goto out;
-		if (ret > 0 && path.slots[0] >=
-			       btrfs_header_nritems(path.nodes[0])) {
-			ret = btrfs_next_leaf(csum_root, &path);
-			if (ret > 0) {
-				ret = 0;
-				btrfs_release_path(&path);
-				break;
-			}
-			if (ret < 0) {
-				btrfs_release_path(&path);
-				goto out;
+		if (pool) {
+			ret = csum_change_next_job(pool, &loader, &len, &item_end);
+		} else if (cur < last_csum) {
+			u64 csum_start;
+
+			ret = read_next_old_csums(fs_info, cur, &csum_start,
+						  &len, csum_buffer);
+			if (ret == 0) {
+				ret = generate_new_csum_range(&loader, csum_start,
+							      len, new_csum_type,
+							      csum_buffer);
+				cur = csum_start + len;
 			}
+		} else {
+			ret = 1;
+		}
+		if (ret > 0) {
+			ret = 0;
+			break;
 		}
-		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
-		UASSERT(key.offset >= cur);
-		item_size = btrfs_item_size(path.nodes[0], path.slots[0]);
-
-		csum_start = key.offset;
-		len = item_size / fs_info->csum_size * fs_info->sectorsize;
-		read_extent_buffer(path.nodes[0], csum_buffer,
-				btrfs_item_ptr_offset(path.nodes[0], path.slots[0]),
-				item_size);
-		btrfs_release_path(&path);
-
-		ret = generate_new_csum_range(trans, csum_start, len, new_csum_type,
-					      csum_buffer);
 		if (ret < 0)
 			goto out;
 		converted_bytes += len;
-		if (converted_bytes >= CSUM_CHANGE_BYTES_THRESHOLD) {
+		/* Only commit between the old csum items */
+		if (item_end && converted_bytes >= CSUM_CHANGE_BYTES_THRESHOLD) {
 			converted_bytes = 0;
+			if (pool)
+				pthread_rwlock_wrlock(&pool->map_lock);
+			btrfs_bulk_loader_release(&loader);
 			ret = btrfs_commit_transaction(trans, csum_root);
 			if (inject_error(0xfc35ae54))
-				return -EUCLEAN;
+				ret = -EUCLEAN;
+			if (ret == 0) {
+				trans = btrfs_start_transaction(csum_root, nr_items);
+				if (IS_ERR(trans))
+					ret = PTR_ERR(trans);
+				else
+					btrfs_bulk_loader_init(&loader, trans,
+							       csum_root, 100);
+			}
+			if (pool)
+				pthread_rwlock_unlock(&pool->map_lock);
 			if (ret < 0)
 				goto out;
-			trans = btrfs_start_transaction(csum_root, nr_items);
-			if (IS_ERR(trans)) {
-				ret = PTR_ERR(trans);
-				goto out;
-			}
 		}
-		cur = csum_start + len;
 	}
+	csum_change_pool_free(pool);
+	pool = NULL;
+	btrfs_bulk_loader_release(&loader);
 	ret = btrfs_commit_transaction(trans, csum_root);
 	if (inject_error(0x4de02239))
-		return -EUCLEAN;
+		ret = -EUCLEAN;
 out:
+	csum_change_pool_free(pool);
+	btrfs_bulk_loader_release(&loader);
 	free(csum_buffer);
 	return ret;
 }
 
-static int generate_new_data_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type)
+static int generate_new_data_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type,
+				   unsigned int nr_threads)
 {
 	struct btrfs_root *tree_root = fs_info->tree_root;
 	struct btrfs_trans_handle *trans;
@@ -366,7 +788,8 @@ static int generate_new_data_csums(struct btrfs_fs_info *fs_info, u16 new_csum_t
 		error("failed to commit the initial transaction: %m");
 		return ret;
 	}
-	return generate_new_data_csums_range(fs_info, 0, new_csum_type);
+	return generate_new_data_csums_range(fs_info, 0, new_csum_type,
+					     nr_threads);
 }
 
 /* After deleting/modifying this many leaves, commit a transaction. */
@@ -555,61 +978,40 @@ out:
 	return ret;
 }
 
+/*
+ * Replace the old csum of a tree block by the new one, return 0 if it already
+ * has the new csum, i.e. it was rewritten before an interruption.
+ */
 static int rewrite_tree_block_csum(struct btrfs_fs_info *fs_info, u64 logical,
-				   u16 new_csum_type)
+				   u8 *buf, void *data)
 {
-	struct extent_buffer *eb;
-	struct btrfs_tree_parent_check check = { 0 };
+	const u16 new_csum_type = *(u16 *)data;
 	u8 result_old[BTRFS_CSUM_SIZE];
 	u8 result_new[BTRFS_CSUM_SIZE];
-	int ret;
-
-	eb = alloc_dummy_extent_buffer(fs_info, logical, fs_info->nodesize);
-	if (!eb)
-		return -ENOMEM;
-
-	ret = btrfs_read_extent_buffer(eb, &check);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to read tree block at logical %llu: %m", logical);
-		goto out;
-	}
 
 	/* Verify the csum first. */
-	btrfs_csum_data(fs_info->csum_type, (u8 *)eb->data + BTRFS_CSUM_SIZE,
-			result_old, fs_info->nodesize - BTRFS_CSUM_SIZE);
-	btrfs_csum_data(new_csum_type, (u8 *)eb->data + BTRFS_CSUM_SIZE,
-			result_new, fs_info->nodesize - BTRFS_CSUM_SIZE);
+	btrfs_csum_data(fs_info->csum_type, buf + BTRFS_CSUM_SIZE, result_old,
+			fs_info->nodesize - BTRFS_CSUM_SIZE);
+	btrfs_csum_data(new_csum_type, buf + BTRFS_CSUM_SIZE, result_new,
+			fs_info->nodesize - BTRFS_CSUM_SIZE);
 
 	/* Matches old csum, rewrite. */
-	if (memcmp_extent_buffer(eb, result_old, 0, fs_info->csum_size) == 0) {
-		write_extent_buffer(eb, result_new, 0,
-				    btrfs_csum_type_size(new_csum_type));
-		ret = write_data_to_disk(fs_info, eb->data, eb->start,
-					 fs_info->nodesize);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to write tree block at logical %llu: %m",
-			      logical);
-		}
-		goto out;
+	if (memcmp(buf, result_old, fs_info->csum_size) == 0) {
+		memcpy(buf, result_new, btrfs_csum_type_size(new_csum_type));
+		return 1;
 	}
 
 	/* Already new csum. */
-	if (memcmp_extent_buffer(eb, result_new, 0, fs_info->csum_size) == 0)
-		goto out;
+	if (memcmp(buf, result_new, btrfs_csum_type_size(new_csum_type)) == 0)
+		return 0;
 
 	/* Csum doesn't match either old or new csum type, bad tree block. */
-	ret = -EIO;
-	error("tree block csum mismatch at logical %llu", logical);
-out:
-	free_extent_buffer(eb);
-	return ret;
+	return -EIO;
 }
 
-static int change_meta_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type)
+static int change_meta_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type,
+			     unsigned int nr_threads)
 {
-	struct btrfs_root *extent_root = btrfs_extent_root(fs_info, 0);
 	struct btrfs_path path = { 0 };
 	struct btrfs_key key;
 	u64 super_flags;
@@ -633,51 +1035,11 @@ static int change_meta_csums(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	 */
 	fs_info->skip_csum_check = true;
 
-	key.objectid = 0;
-	key.type = 0;
-	key.offset = 0;
-
-	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
-	if (ret < 0) {
-		errno = -ret;
-		error("failed to get the first tree block of extent tree: %m");
-		return ret;
-	}
-	UASSERT(ret > 0);
-	while (true) {
-		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
-		if (key.type != BTRFS_EXTENT_ITEM_KEY &&
-		    key.type != BTRFS_METADATA_ITEM_KEY)
-			goto next;
-
-		if (key.type == BTRFS_EXTENT_ITEM_KEY) {
-			struct btrfs_extent_item *ei;
-			ei = btrfs_item_ptr(path.nodes[0], path.slots[0],
-					    struct btrfs_extent_item);
-			if (btrfs_extent_flags(path.nodes[0], ei) &
-			    BTRFS_EXTENT_FLAG_DATA)
-				goto next;
-		}
-		ret = rewrite_tree_block_csum(fs_info, key.objectid, new_csum_type);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to rewrite csum for tree block %llu: %m",
-			      key.offset);
-			goto out;
-		}
-next:
-		ret = btrfs_next_extent_item(extent_root, &path, U64_MAX);
-		if (ret < 0) {
-			errno = -ret;
-			error("failed to get next extent item: %m");
-		}
-		if (ret > 0) {
-			ret = 0;
-			goto out;
-		}
-	}
-out:
-	btrfs_release_path(&path);
+	/* Both csums are calculated by the workers */
+	if (!csum_type_thread_safe(new_csum_type))
+		nr_threads = 0;
+	ret = btrfs_rewrite_tree_blocks(fs_info, rewrite_tree_block_csum,
+					&new_csum_type, nr_threads);
 
 	/*
 	 * Finish the change by clearing the csum change flag, update the superblock
@@ -879,7 +1241,8 @@ static int determine_csum_type(struct btrfs_fs_info *fs_info, u64 logical,
 	return ret;
 }
 
-static int resume_data_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_type)
+static int resume_data_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_type,
+				   unsigned int nr_threads)
 {
 	u64 old_csum_first;
 	u64 old_csum_last;
@@ -986,7 +1349,8 @@ static int resume_data_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_t
 	return -EUCLEAN;
 
 new_data_csums:
-	ret = generate_new_data_csums_range(fs_info, resume_start, new_csum_type);
+	ret = generate_new_data_csums_range(fs_info, resume_start, new_csum_type,
+					    nr_threads);
 	if (ret < 0) {
 		errno = -ret;
 		error("failed to generate new data csums: %m");
@@ -1001,11 +1365,12 @@ change:
 	if (ret < 0)
 		return ret;
 new_meta_csum:
-	ret = change_meta_csums(fs_info, new_csum_type);
+	ret = change_meta_csums(fs_info, new_csum_type, nr_threads);
 	return ret;
 }
 
-static int resume_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_type)
+static int resume_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_type,
+			      unsigned int nr_threads)
 {
 	const u64 super_flags = btrfs_super_flags(fs_info->super_copy);
 	struct btrfs_root *tree_root = fs_info->tree_root;
@@ -1055,7 +1420,7 @@ static int resume_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	}
 
 	if (super_flags & BTRFS_SUPER_FLAG_CHANGING_DATA_CSUM) {
-		ret = resume_data_csum_change(fs_info, new_csum_type);
+		ret = resume_data_csum_change(fs_info, new_csum_type, nr_threads);
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to resume data checksum change: %m");
@@ -1068,7 +1433,7 @@ static int resume_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	 * have no record on previous converted metadata, thus have to go
 	 * through all metadata anyway.
 	 */
-	ret = change_meta_csums(fs_info, new_csum_type);
+	ret = change_meta_csums(fs_info, new_csum_type, nr_threads);
 	if (ret < 0) {
 		errno = -ret;
 		error("failed to resume metadata csum change: %m");
@@ -1076,7 +1441,8 @@ static int resume_csum_change(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	return ret;
 }
 
-int btrfs_change_csum_type(struct btrfs_fs_info *fs_info, u16 new_csum_type)
+int btrfs_change_csum_type(struct btrfs_fs_info *fs_info, u16 new_csum_type,
+			   unsigned int nr_threads)
 {
 	u16 old_csum_type = fs_info->csum_type;
 	int ret;
@@ -1089,7 +1455,7 @@ int btrfs_change_csum_type(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	if (btrfs_super_flags(fs_info->super_copy) &
 	    (BTRFS_SUPER_FLAG_CHANGING_DATA_CSUM |
 	     BTRFS_SUPER_FLAG_CHANGING_META_CSUM)) {
-		ret = resume_csum_change(fs_info, new_csum_type);
+		ret = resume_csum_change(fs_info, new_csum_type, nr_threads);
 		if (ret < 0) {
 			errno = -ret;
 			error("failed to resume unfinished csum change: %m");
@@ -1107,7 +1473,7 @@ int btrfs_change_csum_type(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	 * will be a temporary item in root tree to indicate the new checksum
 	 * algo.
 	 */
-	ret = generate_new_data_csums(fs_info, new_csum_type);
+	ret = generate_new_data_csums(fs_info, new_csum_type, nr_threads);
 	if (ret < 0) {
 		errno = -ret;
 		error("failed to generate new data csums: %m");
@@ -1131,7 +1497,7 @@ int btrfs_change_csum_type(struct btrfs_fs_info *fs_info, u16 new_csum_type)
 	 * like relocation in progs.
 	 * Thus we have to support reading a tree block with either csum.
 	 */
-	ret = change_meta_csums(fs_info, new_csum_type);
+	ret = change_meta_csums(fs_info, new_csum_type, nr_threads);
 	if (ret == 0)
 		printf("converted csum type from %s (%u) to %s (%u)\n",
 		       btrfs_super_csum_name(old_csum_type), old_csum_type,
@@ -54,92 +54,34 @@ static int change_fsid_prepare(struct btrfs_fs_info *fs_info, uuid_t new_fsid)
 	return write_tree_block(NULL, fs_info, tree_root->node);
 }
 
-static int change_buffer_header_uuid(struct extent_buffer *eb, uuid_t new_fsid)
+/*
+ * Change the fsid and chunk tree uuid in the header of a tree block, return 0
+ * if it has them already, i.e. it was changed before an interruption.
+ */
+static int change_tree_block_uuid(struct btrfs_fs_info *fs_info, u64 logical,
+				  u8 *buf, void *data)
 {
-	struct btrfs_fs_info *fs_info = eb->fs_info;
-	int same_fsid = 1;
-	int same_chunk_tree_uuid = 1;
-	int ret;
-
-	same_fsid = !memcmp_extent_buffer(eb, new_fsid, btrfs_header_fsid(),
-					  BTRFS_FSID_SIZE);
-	same_chunk_tree_uuid =
-		!memcmp_extent_buffer(eb, fs_info->new_chunk_tree_uuid,
-				btrfs_header_chunk_tree_uuid(eb),
-				BTRFS_UUID_SIZE);
-	if (same_fsid && same_chunk_tree_uuid)
+	struct btrfs_header *header = (struct btrfs_header *)buf;
+	const u8 *new_fsid = data;
+	u8 result[BTRFS_CSUM_SIZE];
+
+	btrfs_csum_data(fs_info->csum_type, buf + BTRFS_CSUM_SIZE, result,
+			fs_info->nodesize - BTRFS_CSUM_SIZE);
+	if (memcmp(buf, result, fs_info->csum_size) ||
+	    btrfs_stack_header_bytenr(header) != logical)
+		return -EIO;
+
+	if (!memcmp(header->fsid, new_fsid, BTRFS_FSID_SIZE) &&
+	    !memcmp(header->chunk_tree_uuid, fs_info->new_chunk_tree_uuid,
+		    BTRFS_UUID_SIZE))
 		return 0;
-	if (!same_fsid)
-		write_extent_buffer(eb, new_fsid, btrfs_header_fsid(),
-				    BTRFS_FSID_SIZE);
-	if (!same_chunk_tree_uuid)
-		write_extent_buffer(eb, fs_info->new_chunk_tree_uuid,
-				    btrfs_header_chunk_tree_uuid(eb),
-				    BTRFS_UUID_SIZE);
-	ret = write_tree_block(NULL, fs_info, eb);
-
-	return ret;
-}
-
-static int change_extent_tree_uuid(struct btrfs_fs_info *fs_info, uuid_t new_fsid)
-{
-	struct btrfs_root *root = btrfs_extent_root(fs_info, 0);
-	struct btrfs_path path = { 0 };
-	struct btrfs_key key = {0, 0, 0};
-	int ret = 0;
-
-	/*
-	 * Here we don't use transaction as it will takes a lot of reserve
-	 * space, and that will make a near-full btrfs unable to change uuid
-	 */
-	ret = btrfs_search_slot(NULL, root, &key, &path, 0, 0);
-	if (ret < 0)
-		goto out;
-
-	while (1) {
-		struct btrfs_extent_item *ei;
-		struct extent_buffer *eb;
-		struct btrfs_tree_parent_check check = { 0 };
-		u64 flags;
-		u64 bytenr;
-
-		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
-		if (key.type != BTRFS_EXTENT_ITEM_KEY &&
-		    key.type != BTRFS_METADATA_ITEM_KEY)
-			goto next;
-		ei = btrfs_item_ptr(path.nodes[0], path.slots[0],
-				    struct btrfs_extent_item);
-		flags = btrfs_extent_flags(path.nodes[0], ei);
-		if (!(flags & BTRFS_EXTENT_FLAG_TREE_BLOCK))
-			goto next;
-
-		bytenr = key.objectid;
-		eb = read_tree_block(fs_info, bytenr, &check);
-		if (IS_ERR(eb)) {
-			error("failed to read tree block: %llu", bytenr);
-			ret = PTR_ERR(eb);
-			goto out;
-		}
-		ret = change_buffer_header_uuid(eb, new_fsid);
-		free_extent_buffer(eb);
-		if (ret < 0) {
-			error("failed to change uuid of tree block: %llu",
-				bytenr);
-			goto out;
-		}
-next:
-		ret = btrfs_next_item(root, &path);
-		if (ret < 0)
-			goto out;
-		if (ret > 0) {
-			ret = 0;
-			goto out;
-		}
-	}
-
-out:
-	btrfs_release_path(&path);
-	return ret;
+	memcpy(header->fsid, new_fsid, BTRFS_FSID_SIZE);
+	memcpy(header->chunk_tree_uuid, fs_info->new_chunk_tree_uuid,
+	       BTRFS_UUID_SIZE);
+	btrfs_csum_data(fs_info->csum_type, buf + BTRFS_CSUM_SIZE, result,
+			fs_info->nodesize - BTRFS_CSUM_SIZE);
+	memcpy(buf, result, fs_info->csum_size);
+	return 1;
 }
 
 static int change_device_uuid(struct extent_buffer *eb, int slot,
@@ -232,7 +174,8 @@ static int check_unfinished_fsid_change(struct btrfs_fs_info *fs_info,
  * If new_fsid_str is not given, use a random generated UUID.
  * Caller should check new_fsid_str is valid
  */
-int change_uuid(struct btrfs_fs_info *fs_info, const char *new_fsid_str)
+int change_uuid(struct btrfs_fs_info *fs_info, const char *new_fsid_str,
+		unsigned int nr_threads)
 {
 	uuid_t new_fsid;
 	uuid_t new_chunk_id;
@@ -276,7 +219,12 @@ int change_uuid(struct btrfs_fs_info *fs_info, const char *new_fsid_str)
 
 	/* Change extents first */
 	pr_verbose(LOG_DEFAULT, "Change fsid in extent tree\n");
-	ret = change_extent_tree_uuid(fs_info, new_fsid);
+	/*
+	 * No transaction as it would take a lot of reserved space and make a
+	 * near-full btrfs unable to change uuid
+	 */
+	ret = btrfs_rewrite_tree_blocks(fs_info, change_tree_block_uuid,
+					new_fsid, nr_threads);
 	if (ret < 0) {
 		error("failed to change UUID of metadata: %d", ret);
 		goto out;
@@ -27,15 +27,73 @@
 #include "common/extent-cache.h"
 #include "tune/tune.h"
 
-/* After this many block groups we need to commit transaction. */
-#define BLOCK_GROUP_BATCH	16
+/*
+ * After this many block groups we need to commit transaction.  The old items
+ * of a batch are deleted by runs and the new items inserted by leaves, the
+ * dirty tree blocks are at most about one per block group.
+ */
+#define BLOCK_GROUP_BATCH	256
+
+/*
+ * Convert the block groups from @ce down to the first one, by batches
+ * committed separately, the last batch is left to the caller's transaction.
+ *
+ * The first batch is converted in the transaction at @trans_ret.  Return the
+ * running transaction there, or NULL if it was aborted or failed to start.
+ */
+static int convert_bg_batches(struct btrfs_fs_info *fs_info,
+			      struct btrfs_trans_handle **trans_ret,
+			      struct cache_extent *ce)
+{
+	struct btrfs_trans_handle *trans = *trans_ret;
+	u64 bytenrs[BLOCK_GROUP_BATCH];
+	int ret = 0;
+
+	while (ce) {
+		int nr = 0;
+
+		/* Collect the batch backwards, it's converted in ascending order */
+		for (; ce && nr < BLOCK_GROUP_BATCH; ce = prev_cache_extent(ce))
+			bytenrs[BLOCK_GROUP_BATCH - ++nr] = ce->start;
+
+		if (!trans) {
+			/* One new item per block group, the deletes need none */
+			trans = btrfs_start_transaction(fs_info->tree_root, nr);
+			if (IS_ERR(trans)) {
+				ret = PTR_ERR(trans);
+				trans = NULL;
+				errno = -ret;
+				error_msg(ERROR_MSG_START_TRANS, "%m");
+				break;
+			}
+		}
+		ret = btrfs_convert_bgs(trans, bytenrs + BLOCK_GROUP_BATCH - nr,
+					nr);
+		if (ret < 0) {
+			btrfs_abort_transaction(trans, ret);
+			trans = NULL;
+			break;
+		}
+		if (!ce)
+			break;
+
+		ret = btrfs_commit_transaction(trans, fs_info->tree_root);
+		trans = NULL;
+		if (ret < 0) {
+			errno = -ret;
+			error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
+			break;
+		}
+	}
+	*trans_ret = trans;
+	return ret;
+}
 
 int convert_to_bg_tree(struct btrfs_fs_info *fs_info)
 {
 	struct btrfs_super_block *sb = fs_info->super_copy;
 	struct btrfs_trans_handle *trans;
 	struct cache_extent *ce;
-	int converted_bgs = 0;
 	int ret;
 
 	trans = btrfs_start_transaction(fs_info->tree_root, 2);
@@ -71,14 +129,8 @@ int convert_to_bg_tree(struct btrfs_fs_info *fs_info)
 		error_msg(ERROR_MSG_COMMIT_TRANS, "new bg root: %d", ret);
 		goto error;
 	}
-	trans = btrfs_start_transaction(fs_info->tree_root,
-					2 * BLOCK_GROUP_BATCH);
-	if (IS_ERR(trans)) {
-		ret = PTR_ERR(trans);
-		errno = -ret;
-		error_msg(ERROR_MSG_START_TRANS, "%m");
-		return ret;
-	}
+	/* Started for the first batch */
+	trans = NULL;
 
 iterate_bgs:
 	if (fs_info->last_converted_bg_bytenr == (u64)-1) {
@@ -101,34 +153,12 @@ iterate_bgs:
 		}
 	}
 
-	/* Now convert each block */
-	while (ce) {
-		struct cache_extent *prev = prev_cache_extent(ce);
-		u64 bytenr = ce->start;
-
-		ret = btrfs_convert_one_bg(trans, bytenr);
-		if (ret < 0)
-			goto error;
-		converted_bgs++;
-		ce = prev;
-
-		if (converted_bgs % BLOCK_GROUP_BATCH == 0) {
-			ret = btrfs_commit_transaction(trans,
-							fs_info->tree_root);
-			if (ret < 0) {
-				errno = -ret;
-				error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
-				return ret;
-			}
-			trans = btrfs_start_transaction(fs_info->tree_root,
-							2 * BLOCK_GROUP_BATCH);
-			if (IS_ERR(trans)) {
-				ret = PTR_ERR(trans);
-				errno = -ret;
-				error_msg(ERROR_MSG_START_TRANS, "%m");
-				return ret;
-			}
-		}
+	/* Now convert the block groups by batches */
+	ret = convert_bg_batches(fs_info, &trans, ce);
+	if (ret < 0) {
+		if (trans)
+			btrfs_abort_transaction(trans, ret);
+		return ret;
 	}
 	/*
 	 * All bgs converted, remove the CHANGING_BG flag and set the compat ro
@@ -150,7 +180,8 @@ iterate_bgs:
 	pr_verbose(LOG_DEFAULT, "Converted the filesystem to block group tree feature\n");
 	return 0;
 error:
-	btrfs_abort_transaction(trans, ret);
+	if (trans)
+		btrfs_abort_transaction(trans, ret);
 	return ret;
 }
 
@@ -159,7 +190,6 @@ int convert_to_extent_tree(struct btrfs_fs_info *fs_info)
 	struct btrfs_super_block *sb = fs_info->super_copy;
 	struct btrfs_trans_handle *trans;
 	struct cache_extent *ce;
-	u32 converted_bgs = 0;
 	int ret;
 
 	trans = btrfs_start_transaction(fs_info->tree_root, 2);
@@ -183,14 +213,8 @@ int convert_to_extent_tree(struct btrfs_fs_info *fs_info)
 		error_msg(ERROR_MSG_COMMIT_TRANS, "new extent tree root: %m");
 		goto error;
 	}
-	trans = btrfs_start_transaction(fs_info->tree_root,
-					2 * BLOCK_GROUP_BATCH);
-	if (IS_ERR(trans)) {
-		ret = PTR_ERR(trans);
-		errno = -ret;
-		error_msg(ERROR_MSG_START_TRANS, "%m");
-		return ret;
-	}
+	/* Started for the first batch */
+	trans = NULL;
 
 iterate_bgs:
 	if (fs_info->last_converted_bg_bytenr == (u64)-1) {
@@ -212,33 +236,12 @@ iterate_bgs:
 			goto error;
 		}
 	}
-	/* Now convert each block group. */
-	while (ce) {
-		struct cache_extent *prev = prev_cache_extent(ce);
-		u64 bytenr = ce->start;
-
-		ret = btrfs_convert_one_bg(trans, bytenr);
-		if (ret < 0)
-			goto error;
-		converted_bgs++;
-		ce = prev;
-
-		if (converted_bgs % BLOCK_GROUP_BATCH == 0) {
-			ret = btrfs_commit_transaction(trans, fs_info->tree_root);
-			if (ret < 0) {
-				errno = -ret;
-				error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
-				return ret;
-			}
-			trans = btrfs_start_transaction(fs_info->tree_root,
-							2 * BLOCK_GROUP_BATCH);
-			if (IS_ERR(trans)) {
-				ret = PTR_ERR(trans);
-				errno = -ret;
-				error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
-				return ret;
-			}
-		}
+	/* Now convert the block groups by batches */
+	ret = convert_bg_batches(fs_info, &trans, ce);
+	if (ret < 0) {
+		if (trans)
+			btrfs_abort_transaction(trans, ret);
+		return ret;
 	}
 	/*
 	 * Remove block group tree, at this stage, the block group tree root
@@ -274,6 +277,7 @@ iterate_bgs:
 	return 0;
 
 error:
-	btrfs_abort_transaction(trans, ret);
+	if (trans)
+		btrfs_abort_transaction(trans, ret);
 	return ret;
 }
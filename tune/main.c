@@ -23,6 +23,7 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <uuid/uuid.h>
+#include "kernel-lib/raid56.h"
 #include "kernel-shared/accessors.h"
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
@@ -41,6 +42,7 @@
 #include "common/help.h"
 #include "common/box.h"
 #include "common/clear-cache.h"
+#include "common/thread-pool.h"
 #include "cmds/commands.h"
 #include "tune/tune.h"
 
@@ -131,6 +133,9 @@ static const char * const tune_usage[] = {
 	"",
 	"EXPERIMENTAL FEATURES:",
 	OPTLINE("--csum CSUM", "switch checksum for data and metadata to CSUM"),
+	OPTLINE("--csum-threads N", "number of threads converting the data and metadata "
+		      "checksums (0 ~ 64), default online CPUs up to 16, 0 converts "
+		      "them synchronously"),
 #endif
 	NULL
 };
@@ -198,6 +203,7 @@ int BOX_MAIN(btrfstune)(int argc, char *argv[])
 	bool to_bg_tree = false;
 	bool to_fst = false;
 	int csum_type = -1;
+	unsigned int nr_threads = (unsigned int)-1;
 	char *new_fsid_str = NULL;
 	int ret;
 	u64 super_flags = 0;
@@ -208,10 +214,12 @@ int BOX_MAIN(btrfstune)(int argc, char *argv[])
 
 	cpu_detect_flags();
 	hash_init_accel();
+	raid6_init_accel();
 	btrfs_config_init();
 
 	while(1) {
 		enum { GETOPT_VAL_CSUM = GETOPT_VAL_FIRST,
+		       GETOPT_VAL_CSUM_THREADS,
 		       GETOPT_VAL_ENABLE_BLOCK_GROUP_TREE,
 		       GETOPT_VAL_DISABLE_BLOCK_GROUP_TREE,
 		       GETOPT_VAL_ENABLE_FREE_SPACE_TREE,
@@ -234,6 +242,8 @@ int BOX_MAIN(btrfstune)(int argc, char *argv[])
 				GETOPT_VAL_REMOVE_SIMPLE_QUOTA},
 #if EXPERIMENTAL
 			{ "csum", required_argument, NULL, GETOPT_VAL_CSUM },
+			{ "csum-threads", required_argument, NULL,
+				GETOPT_VAL_CSUM_THREADS },
 #endif
 			{ NULL, 0, NULL, 0 }
 		};
@@ -311,6 +321,19 @@ int BOX_MAIN(btrfstune)(int argc, char *argv[])
 			csum_type = parse_csum_type(optarg);
 			btrfstune_cmd_groups[CSUM_CHANGE] = true;
 			break;
+		case GETOPT_VAL_CSUM_THREADS:
+		{
+			u64 tmp = arg_strtou64(optarg);
+
+			if (tmp > CSUM_CHANGE_MAX_THREADS) {
+				error("number of threads out of range: %llu > %u",
+				      tmp, CSUM_CHANGE_MAX_THREADS);
+				ret = 1;
+				goto free_out;
+			}
+			nr_threads = tmp;
+			break;
+		}
 #endif
 		case GETOPT_VAL_VERSION:
 			help_builtin_features("btrfstune, part of ");
@@ -322,6 +345,13 @@ int BOX_MAIN(btrfstune)(int argc, char *argv[])
 		}
 	}
 
+	/*
+	 * Threads checksumming the data and tree blocks, the new csum items are
+	 * inserted and the tree blocks written by one thread, which limits more
+	 */
+	if (nr_threads == (unsigned int)-1)
+		nr_threads = thread_pool_default_threads(16);
+
 	set_argv0(argv);
 	device = argv[optind];
 	if (check_argc_exact(argc - optind, 1)) {
@@ -503,7 +533,7 @@ int BOX_MAIN(btrfstune)(int argc, char *argv[])
 
 	if (csum_type != -1) {
 		pr_verbose(LOG_DEFAULT, "Proceed to switch checksums\n");
-		ret = btrfs_change_csum_type(fs_info, csum_type);
+		ret = btrfs_change_csum_type(fs_info, csum_type, nr_threads);
 		goto out;
 	}
 
@@ -544,7 +574,7 @@ int BOX_MAIN(btrfstune)(int argc, char *argv[])
 				goto out;
 			}
 		}
-		ret = change_uuid(fs_info, new_fsid_str);
+		ret = change_uuid(fs_info, new_fsid_str, nr_threads);
 		goto out;
 	}
 
@@ -1,9 +1,11 @@
+#include <stdlib.h>
 #include <errno.h>
 #include "kernel-shared/ctree.h"
 #include "kernel-shared/disk-io.h"
 #include "kernel-shared/transaction.h"
 #include "kernel-shared/uapi/btrfs_tree.h"
 #include "common/messages.h"
+#include "common/tree-walk.h"
 #include "tune/tune.h"
 
 static int remove_quota_tree(struct btrfs_fs_info *fs_info)
@@ -73,86 +75,144 @@ static void shift_leaf_data(struct btrfs_trans_handle *trans,
 	btrfs_mark_buffer_dirty(leaf);
 }
 
+/*
+ * Return the offset of the owner ref of the extent item at @slot, or 0 if the
+ * item has none. The owner ref is always the first inline ref.
+ */
+static unsigned long owner_ref_ptr(struct extent_buffer *leaf, int slot)
+{
+	struct btrfs_key key;
+	struct btrfs_extent_item *ei;
+	struct btrfs_extent_inline_ref *iref;
+	unsigned long ptr;
+	unsigned long item_end;
+
+	btrfs_item_key_to_cpu(leaf, &key, slot);
+	if (key.type != BTRFS_EXTENT_ITEM_KEY)
+		return 0;
+	ei = btrfs_item_ptr(leaf, slot, struct btrfs_extent_item);
+	ptr = (unsigned long)(ei + 1);
+	item_end = (unsigned long)ei + btrfs_item_size(leaf, slot);
+	/* No inline extent references; accessing type is invalid. */
+	if (ptr > item_end)
+		return 0;
+	iref = (struct btrfs_extent_inline_ref *)ptr;
+	if (btrfs_extent_inline_ref_type(leaf, iref) != BTRFS_EXTENT_OWNER_REF_KEY)
+		return 0;
+	return ptr;
+}
+
+/* First keys of the extent tree leaves with owner refs */
+struct owner_ref_leaves {
+	struct btrfs_key *keys;
+	size_t nr;
+	size_t capacity;
+};
+
+static int collect_owner_ref_leaf(struct extent_buffer *eb, void *priv)
+{
+	struct owner_ref_leaves *leaves = priv;
+	const u32 nritems = btrfs_header_nritems(eb);
+
+	if (btrfs_header_level(eb) > 0)
+		return 0;
+
+	for (u32 slot = 0; slot < nritems; slot++) {
+		if (!owner_ref_ptr(eb, slot))
+			continue;
+		if (leaves->nr == leaves->capacity) {
+			size_t capacity = max_t(size_t, 64, leaves->capacity * 2);
+			struct btrfs_key *keys;
+
+			keys = realloc(leaves->keys, capacity * sizeof(*keys));
+			if (!keys)
+				return -ENOMEM;
+			leaves->keys = keys;
+			leaves->capacity = capacity;
+		}
+		btrfs_item_key_to_cpu(eb, &leaves->keys[leaves->nr++], 0);
+		break;
+	}
+	return 0;
+}
+
+static int cmp_leaf_key(const void *a, const void *b)
+{
+	return btrfs_comp_cpu_keys(a, b);
+}
+
 /*
  * Iterate over the extent tree and for each EXTENT_DATA item that has an inline
  * ref of type OWNER_REF, shift that leaf to eliminate the owner ref.
  *
+ * The tree is read first in physical order with the blocks read ahead by
+ * threads, only the leaves with owner refs are searched again to be CoW-ed.
+ * Leaves with only metadata or pre-squota extents are not rewritten.
+ *
  * Note: we use a search_slot per leaf rather than find_next_leaf to get the
- * needed CoW-ing and rebalancing for each leaf and its path up to the root.
+ * needed CoW-ing for each leaf and its path up to the root. Removing the refs
+ * only shrinks the items, the leaves are not split or merged so the collected
+ * keys still lead to the same leaves.
  */
 static int remove_owner_refs(struct btrfs_fs_info *fs_info)
 {
 	struct btrfs_trans_handle *trans;
 	struct btrfs_root *extent_root;
-	struct btrfs_key key;
-	struct extent_buffer *leaf;
+	struct owner_ref_leaves leaves = { 0 };
 	struct btrfs_path path = { 0 };
-	int slot;
 	int ret;
 
 	extent_root = btrfs_extent_root(fs_info, 0);
 
-	trans = btrfs_start_transaction(extent_root, 0);
-
-	key.objectid = 0;
-	key.type = BTRFS_EXTENT_ITEM_KEY;
-	key.offset = 0;
+	ret = btrfs_walk_tree_physical(extent_root->node, 0, 0,
+				       collect_owner_ref_leaf, &leaves);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to read the extent tree: %m");
+		goto out;
+	}
+	qsort(leaves.keys, leaves.nr, sizeof(*leaves.keys), cmp_leaf_key);
 
-search_slot:
-	ret = btrfs_search_slot(trans, extent_root, &key, &path, 1, 1);
-	if (ret < 0)
-		return ret;
-	leaf = path.nodes[0];
-	slot = path.slots[0];
+	trans = btrfs_start_transaction(extent_root, 0);
+	if (IS_ERR(trans)) {
+		ret = PTR_ERR(trans);
+		errno = -ret;
+		error_msg(ERROR_MSG_START_TRANS, "%m");
+		goto out;
+	}
 
-	while (1) {
-		struct btrfs_key found_key;
-		struct btrfs_extent_item *ei;
-		struct btrfs_extent_inline_ref *iref;
-		u8 type;
+	for (size_t i = 0; i < leaves.nr; i++) {
+		struct extent_buffer *leaf;
 		unsigned long ptr;
-		unsigned long item_end;
-
-		if (slot >= btrfs_header_nritems(leaf)) {
-			ret = btrfs_next_leaf(extent_root, &path);
-			if (ret < 0) {
-				break;
-			} else if (ret) {
-				ret = 0;
-				break;
-			}
-			leaf = path.nodes[0];
-			slot = path.slots[0];
-			btrfs_item_key_to_cpu(leaf, &key, slot);
-			btrfs_release_path(&path);
-			goto search_slot;
-		}
 
-		btrfs_item_key_to_cpu(leaf, &found_key, slot);
-		if (found_key.type != BTRFS_EXTENT_ITEM_KEY)
-			goto next;
-		ei = btrfs_item_ptr(leaf, slot, struct btrfs_extent_item);
-		ptr = (unsigned long)(ei + 1);
-		item_end = (unsigned long)ei + btrfs_item_size(leaf, slot);
-		/* No inline extent references; accessing type is invalid. */
-		if (ptr > item_end)
-			goto next;
-		iref = (struct btrfs_extent_inline_ref *)ptr;
-		type = btrfs_extent_inline_ref_type(leaf, iref);
-		if (type == BTRFS_EXTENT_OWNER_REF_KEY)
-			shift_leaf_data(trans, leaf, slot, ptr, sizeof(*iref));
-next:
-		slot++;
+		ret = btrfs_search_slot(trans, extent_root, &leaves.keys[i],
+					&path, 0, 1);
+		if (ret > 0)
+			ret = -EUCLEAN;
+		if (ret < 0) {
+			btrfs_abort_transaction(trans, ret);
+			goto out;
+		}
+		leaf = path.nodes[0];
+		for (int slot = path.slots[0];
+		     slot < btrfs_header_nritems(leaf); slot++) {
+			ptr = owner_ref_ptr(leaf, slot);
+			if (ptr)
+				shift_leaf_data(trans, leaf, slot, ptr,
+					sizeof(struct btrfs_extent_inline_ref));
+		}
+		btrfs_release_path(&path);
 	}
-	btrfs_release_path(&path);
 
 	ret = btrfs_commit_transaction(trans, extent_root);
 	if (ret < 0) {
 		errno = -ret;
 		error_msg(ERROR_MSG_COMMIT_TRANS, "%m");
-		return ret;
 	}
-	return 0;
+out:
+	btrfs_release_path(&path);
+	free(leaves.keys);
+	return ret;
 }
 
 int remove_squota(struct btrfs_fs_info *fs_info)
@@ -0,0 +1,388 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ */
+
+/*
+ * In-place rewrite of all tree blocks, without transactions.
+ *
+ * The tree blocks are collected from the extent tree and sorted by the
+ * physical address of their first copy.  Jobs of consecutive blocks are read
+ * in runs and passed to the rewrite callback by the workers, the main thread
+ * writes the changed blocks back to all copies in the same order.
+ *
+ * There's no progress recorded on disk, the callback must recognize the
+ * blocks it already rewrote, so an interrupted rewrite can be simply started
+ * again under the super block flag of the caller.
+ */
+
+#include "kerncompat.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "kernel-shared/accessors.h"
+#include "kernel-shared/uapi/btrfs_tree.h"
+#include "kernel-shared/ctree.h"
+#include "kernel-shared/disk-io.h"
+#include "kernel-shared/extent_io.h"
+#include "kernel-shared/volumes.h"
+#include "crypto/hash.h"
+#include "common/messages.h"
+#include "common/extent-tree-utils.h"
+#include "common/thread-pool.h"
+#include "tune/tune.h"
+
+/* Tree blocks read and rewritten by one job */
+#define REWRITE_JOB_BLOCKS		(64)
+
+struct rewrite_block {
+	u64 logical;
+	u64 devid;
+	u64 physical;
+};
+
+struct rewrite_job {
+	/* Blocks [first, first + nr) of the sorted array */
+	u64 first;
+	u32 nr;
+	int ret;
+	u8 *buf;
+	/* Result of the callback for each block, 1 if it has to be written */
+	int changed[REWRITE_JOB_BLOCKS];
+};
+
+struct rewrite_ctx {
+	struct btrfs_fs_info *fs_info;
+	tree_block_rewrite_t rewrite;
+	void *data;
+
+	struct rewrite_block *blocks;
+	u64 nr_blocks;
+
+	struct thread_pool pool;
+	/* Ring of the jobs, indexed by the sequence number of the pool */
+	struct rewrite_job *jobs;
+	unsigned int nr_jobs;
+};
+
+static int compare_rewrite_block(const void *a, const void *b)
+{
+	const struct rewrite_block *ba = a;
+	const struct rewrite_block *bb = b;
+
+	if (ba->devid != bb->devid)
+		return ba->devid < bb->devid ? -1 : 1;
+	if (ba->physical != bb->physical)
+		return ba->physical < bb->physical ? -1 : 1;
+	if (ba->logical != bb->logical)
+		return ba->logical < bb->logical ? -1 : 1;
+	return 0;
+}
+
+static int collect_tree_blocks(struct rewrite_ctx *ctx)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	struct btrfs_root *extent_root = btrfs_extent_root(fs_info, 0);
+	struct btrfs_path path = { 0 };
+	struct btrfs_key key = { 0 };
+	u64 allocated = 0;
+	int ret;
+
+	ret = btrfs_search_slot(NULL, extent_root, &key, &path, 0, 0);
+	if (ret < 0) {
+		errno = -ret;
+		error("failed to get the first tree block of extent tree: %m");
+		return ret;
+	}
+	while (true) {
+		struct btrfs_bio_stripe stripe;
+		struct rewrite_block *block;
+		u64 len = fs_info->nodesize;
+
+		btrfs_item_key_to_cpu(path.nodes[0], &key, path.slots[0]);
+		if (key.type != BTRFS_EXTENT_ITEM_KEY &&
+		    key.type != BTRFS_METADATA_ITEM_KEY)
+			goto next;
+		if (key.type == BTRFS_EXTENT_ITEM_KEY) {
+			struct btrfs_extent_item *ei;
+
+			ei = btrfs_item_ptr(path.nodes[0], path.slots[0],
+					    struct btrfs_extent_item);
+			if (!(btrfs_extent_flags(path.nodes[0], ei) &
+			      BTRFS_EXTENT_FLAG_TREE_BLOCK))
+				goto next;
+		}
+
+		if (ctx->nr_blocks == allocated) {
+			struct rewrite_block *tmp;
+
+			allocated = max_t(u64, allocated * 2, SZ_64K);
+			tmp = realloc(ctx->blocks, allocated * sizeof(*tmp));
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			ctx->blocks = tmp;
+		}
+		block = &ctx->blocks[ctx->nr_blocks++];
+		block->logical = key.objectid;
+		block->devid = 0;
+		block->physical = key.objectid;
+		if (btrfs_map_block_stripe(fs_info, key.objectid, &len, NULL, 1,
+					   &stripe) == 0) {
+			block->devid = stripe.dev->devid;
+			block->physical = stripe.physical;
+		}
+next:
+		ret = btrfs_next_extent_item(extent_root, &path, U64_MAX);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to get next extent item: %m");
+			break;
+		}
+		if (ret > 0) {
+			ret = 0;
+			break;
+		}
+	}
+	btrfs_release_path(&path);
+	if (ret < 0)
+		return ret;
+
+	qsort(ctx->blocks, ctx->nr_blocks, sizeof(*ctx->blocks),
+	      compare_rewrite_block);
+	return 0;
+}
+
+/* Read the tree blocks of @job in runs of consecutive logical addresses */
+static void rewrite_job_read(struct rewrite_ctx *ctx, struct rewrite_job *job)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	const u32 nodesize = fs_info->nodesize;
+	u32 i = 0;
+
+	while (i < job->nr) {
+		const struct rewrite_block *block = &ctx->blocks[job->first + i];
+		u64 len = nodesize;
+		u64 read_len;
+		u32 nr = 1;
+		int ret = 0;
+
+		while (i + nr < job->nr &&
+		       ctx->blocks[job->first + i + nr].logical ==
+		       block->logical + len) {
+			len += nodesize;
+			nr++;
+		}
+		for (u64 offset = 0; offset < len; offset += read_len) {
+			read_len = len - offset;
+			ret = read_data_from_disk(fs_info,
+					job->buf + (u64)i * nodesize + offset,
+					block->logical + offset, &read_len, 1);
+			if (ret < 0)
+				break;
+		}
+		/* Retried from all the copies by the callback */
+		if (ret < 0)
+			for (u32 k = 0; k < nr; k++)
+				job->changed[i + k] = ret;
+		i += nr;
+	}
+}
+
+static int rewrite_job_block(struct rewrite_ctx *ctx, struct rewrite_job *job,
+			     u32 i)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	const u64 logical = ctx->blocks[job->first + i].logical;
+	u8 *buf = job->buf + (u64)i * fs_info->nodesize;
+	int num_copies;
+	int ret = job->changed[i];
+
+	if (ret == 0)
+		ret = ctx->rewrite(fs_info, logical, buf, ctx->data);
+	if (ret >= 0)
+		return ret;
+
+	num_copies = btrfs_num_copies(fs_info, logical, fs_info->nodesize);
+	for (int mirror = 2; mirror <= num_copies; mirror++) {
+		u64 read_len = fs_info->nodesize;
+
+		ret = read_data_from_disk(fs_info, buf, logical, &read_len,
+					  mirror);
+		if (ret < 0)
+			continue;
+		ret = ctx->rewrite(fs_info, logical, buf, ctx->data);
+		if (ret >= 0)
+			return ret;
+	}
+	errno = -ret;
+	error("failed to rewrite tree block at logical %llu: %m", logical);
+	return ret;
+}
+
+static void rewrite_job_process(struct rewrite_ctx *ctx, struct rewrite_job *job)
+{
+	memset(job->changed, 0, sizeof(job->changed));
+	rewrite_job_read(ctx, job);
+	job->ret = 0;
+	for (u32 i = 0; i < job->nr; i++) {
+		int ret = rewrite_job_block(ctx, job, i);
+
+		if (ret < 0) {
+			job->ret = ret;
+			return;
+		}
+		job->changed[i] = ret;
+	}
+}
+
+static void rewrite_worker(void *arg, void *job, void *thread_data)
+{
+	rewrite_job_process(arg, job);
+}
+
+static const struct thread_pool_ops rewrite_pool_ops = {
+	.process = rewrite_worker,
+};
+
+/*
+ * Write the changed blocks of @job to all copies, in runs of consecutive
+ * logical addresses, and update the cached extent buffers.
+ */
+static int rewrite_job_write(struct rewrite_ctx *ctx, struct rewrite_job *job)
+{
+	struct btrfs_fs_info *fs_info = ctx->fs_info;
+	const u32 nodesize = fs_info->nodesize;
+	u32 i = 0;
+
+	while (i < job->nr) {
+		const u64 logical = ctx->blocks[job->first + i].logical;
+		u32 nr = 0;
+		int ret;
+
+		while (i + nr < job->nr && job->changed[i + nr] == 1 &&
+		       ctx->blocks[job->first + i + nr].logical ==
+		       logical + (u64)nr * nodesize)
+			nr++;
+		if (!nr) {
+			i++;
+			continue;
+		}
+		ret = write_data_to_disk(fs_info, job->buf + (u64)i * nodesize,
+					 logical, (u64)nr * nodesize);
+		if (ret < 0) {
+			errno = -ret;
+			error("failed to write tree block at logical %llu: %m",
+			      logical);
+			return ret;
+		}
+		for (u32 k = 0; k < nr; k++) {
+			struct extent_buffer *eb;
+
+			eb = find_extent_buffer(fs_info,
+						logical + (u64)k * nodesize);
+			if (!eb)
+				continue;
+			write_extent_buffer(eb, job->buf + (u64)(i + k) * nodesize,
+					    0, nodesize);
+			free_extent_buffer(eb);
+		}
+		i += nr;
+	}
+	return 0;
+}
+
+static int start_rewrite_workers(struct rewrite_ctx *ctx,
+				 unsigned int nr_threads)
+{
+	ctx->nr_jobs = max(nr_threads * 2, 1U);
+	ctx->jobs = calloc(ctx->nr_jobs, sizeof(*ctx->jobs));
+	if (!ctx->jobs)
+		return -ENOMEM;
+	for (unsigned int i = 0; i < ctx->nr_jobs; i++) {
+		ctx->jobs[i].buf = malloc(REWRITE_JOB_BLOCKS *
+					  ctx->fs_info->nodesize);
+		if (!ctx->jobs[i].buf)
+			return -ENOMEM;
+	}
+	return thread_pool_init(&ctx->pool, &rewrite_pool_ops, ctx, nr_threads,
+				ctx->nr_jobs);
+}
+
+/*
+ * Call @rewrite for all tree blocks and write back the blocks it changed,
+ * by @nr_threads workers or synchronously if it's 0.
+ *
+ * The callback gets the tree block read from the first copy, or the next ones
+ * if it fails, and may be called from several threads at once.  It must not
+ * touch the trees.
+ */
+int btrfs_rewrite_tree_blocks(struct btrfs_fs_info *fs_info,
+			      tree_block_rewrite_t rewrite, void *data,
+			      unsigned int nr_threads)
+{
+	struct rewrite_ctx ctx = {
+		.fs_info = fs_info,
+		.rewrite = rewrite,
+		.data = data,
+	};
+	u64 next_block = 0;
+	int ret;
+
+	/* Same as for the data checksums of btrfs check */
+	if (!CRYPTO_HASH_THREAD_SAFE &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_CRC32 &&
+	    fs_info->csum_type != BTRFS_CSUM_TYPE_XXHASH)
+		nr_threads = 0;
+
+	ret = collect_tree_blocks(&ctx);
+	if (ret < 0)
+		goto out;
+
+	ret = start_rewrite_workers(&ctx, nr_threads);
+	if (ret < 0)
+		goto out_workers;
+
+	while (next_block < ctx.nr_blocks || !thread_pool_empty(&ctx.pool)) {
+		struct rewrite_job *job;
+
+		/* Queue the next blocks to the free jobs */
+		while (next_block < ctx.nr_blocks && !thread_pool_full(&ctx.pool)) {
+			job = &ctx.jobs[ctx.pool.head_seq % ctx.nr_jobs];
+			job->first = next_block;
+			job->nr = min_t(u64, ctx.nr_blocks - next_block,
+					REWRITE_JOB_BLOCKS);
+			next_block += job->nr;
+			thread_pool_push(&ctx.pool, job);
+		}
+
+		job = thread_pool_pop(&ctx.pool);
+		ret = job->ret;
+		if (ret < 0)
+			break;
+		ret = rewrite_job_write(&ctx, job);
+		if (ret < 0)
+			break;
+	}
+
+out_workers:
+	thread_pool_release(&ctx.pool);
+	for (unsigned int i = 0; ctx.jobs && i < ctx.nr_jobs; i++)
+		free(ctx.jobs[i].buf);
+	free(ctx.jobs);
+out:
+	free(ctx.blocks);
+	return ret;
+}
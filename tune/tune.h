@@ -26,13 +26,29 @@ struct btrfs_fs_info;
 
 int update_seeding_flag(struct btrfs_root *root, const char *device, int set_flag, int force);
 
-int change_uuid(struct btrfs_fs_info *fs_info, const char *new_fsid_str);
+int change_uuid(struct btrfs_fs_info *fs_info, const char *new_fsid_str,
+		unsigned int nr_threads);
 int set_metadata_uuid(struct btrfs_root *root, const char *uuid_string);
 
 int convert_to_bg_tree(struct btrfs_fs_info *fs_info);
 int convert_to_extent_tree(struct btrfs_fs_info *fs_info);
 
-int btrfs_change_csum_type(struct btrfs_fs_info *fs_info, u16 new_csum_type);
+/*
+ * Rewrite the tree block at @logical in @buf, return 1 if it has to be
+ * written back, 0 if it's unchanged and <0 if it's not valid.
+ */
+typedef int (*tree_block_rewrite_t)(struct btrfs_fs_info *fs_info, u64 logical,
+				    u8 *buf, void *data);
+
+int btrfs_rewrite_tree_blocks(struct btrfs_fs_info *fs_info,
+			      tree_block_rewrite_t rewrite, void *data,
+			      unsigned int nr_threads);
+
+/* Threads converting the data checksums of --csum */
+#define CSUM_CHANGE_MAX_THREADS		(64)
+
+int btrfs_change_csum_type(struct btrfs_fs_info *fs_info, u16 new_csum_type,
+			   unsigned int nr_threads);
 
 int enable_quota(struct btrfs_fs_info *fs_info, bool simple);
 int remove_squota(struct btrfs_fs_info *fs_info);